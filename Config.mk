@@ -41,11 +41,11 @@
 # first, and make sure to make a copy of your working Weenix before you
 # go breaking it, which we promise you will happen.
 
-        MOUNTING=0 # be able to mount multiple file systems
+        MOUNTING=1 # be able to mount multiple file systems
           GETCWD=0 # getcwd(3) syscall-like functionality
         UPREEMPT=0 # userland preemption
              MTP=0 # multiple kernel threads per process
-           PIPES=0 # pipe(2) functionality
+           PIPES=1 # pipe(2) functionality
          SHADOWD=1 # shadow page cleanup
 
 # Boolean options specified in this specified in this file that should be
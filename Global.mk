@@ -1,4 +1,5 @@
 CC        := gcc
+HOSTCC    := cc
 LD        := ld
 AR        := ar
 PYTHON    := python
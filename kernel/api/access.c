@@ -8,6 +8,8 @@
 #include "mm/page.h"
 #include "mm/mm.h"
 #include "mm/kmalloc.h"
+#include "mm/pagetable.h"
+#include "mm/tlb.h"
 
 #include "proc/proc.h"
 
@@ -16,12 +18,76 @@
 #include "api/access.h"
 #include "api/syscall.h"
 
+/* user_copy copies nbytes from src to dst with the current page table,
+ * one side being a user address. It returns 0, or 1 if the copy page
+ * faulted, in which case the fault handler has resumed it at
+ * user_copy_fixup (see user_access_fixup) and it is partly done. */
+int user_copy(void *dst, const void *src, size_t nbytes);
+extern char user_copy_insn[], user_copy_fixup[];
+__asm__ (
+        ".global user_copy\n"
+        "user_copy:\n\t"
+        "pushl %esi\n\t"
+        "pushl %edi\n\t"
+        "movl 12(%esp), %edi\n\t"
+        "movl 16(%esp), %esi\n\t"
+        "movl 20(%esp), %ecx\n\t"
+        "xorl %eax, %eax\n\t"
+        "cld\n"
+        ".global user_copy_insn\n"
+        "user_copy_insn:\n\t"
+        "rep movsb\n"
+        "user_copy_done:\n\t"
+        "popl %edi\n\t"
+        "popl %esi\n\t"
+        "ret\n"
+        ".global user_copy_fixup\n"
+        "user_copy_fixup:\n\t"
+        "movl $1, %eax\n\t"
+        "jmp user_copy_done\n"
+);
+
+/* The kernel instructions which may fault on a user address, and where
+ * to resume each of them when they do. */
+static const struct {
+        char *ex_insn;
+        char *ex_fixup;
+} user_ex_table[] = {
+        { user_copy_insn, user_copy_fixup },
+};
+
+uintptr_t user_access_fixup(uintptr_t eip)
+{
+        uint32_t i;
+        for (i = 0; i < sizeof(user_ex_table) / sizeof(user_ex_table[0]); ++i) {
+                if ((uintptr_t)user_ex_table[i].ex_insn == eip) {
+                        return (uintptr_t)user_ex_table[i].ex_fixup;
+                }
+        }
+        return 0;
+}
+
+static int user_range(const void *uaddr, size_t nbytes)
+{
+        return (uintptr_t)uaddr >= USER_MEM_LOW
+               && nbytes <= USER_MEM_HIGH - (uintptr_t)uaddr;
+}
+
 /* copy_to_user and copy_from_user are used to copy to and from the
- * user space of the current process.  They first check that the range
- * of addresses has valid mappings, then call vmmap_read/write.
+ * user space of the current process.  They first copy directly through
+ * the page table, which is already loaded with the process's mappings.
+ * Should that fault on a page which is not mapped (or is mapped
+ * read-only, copy-on-write) they check that the range of addresses has
+ * valid mappings, then call vmmap_read/write.
  */
 int copy_from_user(void *kaddr, const void *uaddr, size_t nbytes)
 {
+        if (!user_range(uaddr, nbytes)) {
+                return -EFAULT;
+        }
+        if (0 == user_copy(kaddr, uaddr, nbytes)) {
+                return 0;
+        }
         if (!range_perm(curproc, uaddr, nbytes, PROT_READ)) {
                 return -EFAULT;
         }
@@ -30,10 +96,28 @@ int copy_from_user(void *kaddr, const void *uaddr, size_t nbytes)
 
 int copy_to_user(void *uaddr, const void *kaddr, size_t nbytes)
 {
+        if (!user_range(uaddr, nbytes)) {
+                return -EFAULT;
+        }
+        if (0 == user_copy(uaddr, kaddr, nbytes)) {
+                return 0;
+        }
         if (!range_perm(curproc, uaddr, nbytes, PROT_WRITE)) {
                 return -EFAULT;
         }
-        return vmmap_write(curproc->p_vmmap, uaddr, kaddr, nbytes);
+        int err = vmmap_write(curproc->p_vmmap, uaddr, kaddr, nbytes);
+        /* the pages written may have been copied for copy-on-write,
+         * leaving the old ones mapped; have the process fault the new
+         * ones in */
+        uintptr_t low = (uintptr_t)PAGE_ALIGN_DOWN(uaddr);
+        uintptr_t high = (uintptr_t)PAGE_ALIGN_UP((uintptr_t)uaddr + nbytes);
+        if (low < high) {
+                vmmap_sync(curproc->p_vmmap, ADDR_TO_PN(low),
+                           (high - low) >> PAGE_SHIFT, 0);
+                pt_unmap_range(curproc->p_pagedir, low, high);
+                tlb_flush_range(low, (high - low) >> PAGE_SHIFT);
+        }
+        return err;
 }
 
 /* Like strndup(), but gets the string from user space, ensuring
@@ -164,9 +248,15 @@ int range_perm(struct proc *p, const void *avaddr, size_t len, int perm)
     uint32_t pn_start = ADDR_TO_PN(avaddr);
     uint32_t pn_end = ADDR_TO_PN((uint32_t)avaddr + len - 1);
 
+    /* a buffer in the part of a stack the process has yet to touch; the
+     * stack grows down to it as it would on a fault */
+    if (NULL == vmmap_lookup(p->p_vmmap, pn_start)) {
+        vmmap_grow_down(p->p_vmmap, pn_start);
+    }
+
     uint32_t i;
     for (i = pn_start ; i <= pn_end ; i++) {
-        if (addr_perm(p, PN_TO_ADDR(pn_start), perm) == 0) {
+        if (addr_perm(p, PN_TO_ADDR(i), perm) == 0) {
             return 0;
         }
     }
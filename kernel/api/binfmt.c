@@ -41,7 +41,8 @@ int binfmt_add(const char *id, binfmt_load_func_t loadfunc)
 
         return 0;
 }
-int binfmt_load(const char *filename, char *const *argv, char *const *envp, uint32_t *eip, uint32_t *esp)
+int binfmt_load(const char *filename, const execvec_t *argv, const execvec_t *envp,
+                uint32_t *eip, uint32_t *esp)
 {
         int err, fd = -1;
         if (0 > (fd = do_open(filename, O_RDONLY))) {
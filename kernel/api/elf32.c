@@ -6,11 +6,15 @@
 #include "mm/tlb.h"
 #include "mm/pagetable.h"
 #include "mm/kmalloc.h"
+#include "mm/mmobj.h"
+#include "mm/pframe.h"
 
 #include "vm/vmmap.h"
+#include "vm/anon.h"
 
 #include "api/elf.h"
 #include "api/binfmt.h"
+#include "api/vdso.h"
 
 #include "util/init.h"
 #include "util/debug.h"
@@ -20,6 +24,30 @@
 #include "fs/fcntl.h"
 #include "fs/lseek.h"
 #include "fs/vfs_syscall.h"
+#include "fs/vnode.h"
+
+/*
+ * Everything exec needs from an ELF file's headers, read and checked once
+ * and then kept with the file's vnode until the file is next written, so
+ * that exec'ing the same program again only has to replay the mappings
+ * (see vnode_modified).
+ *
+ * The page where a segment's data ends and its bss begins cannot be mapped
+ * from the file, which has whatever follows the data there. The plan keeps
+ * that page, read and zeroed once, in an anonymous object of its own which
+ * every exec maps privately, so they share it until one writes to it.
+ */
+typedef struct elf32_plan {
+        vnode_exec_t    ep_vx;
+        int             ep_refcount;    /* the vnode's and each exec's */
+        Elf32_Ehdr      ep_header;
+        size_t          ep_phtsize;
+        char           *ep_pht;         /* follows the plan in its allocation */
+        char           *ep_interpname;  /* NUL-terminated, NULL if none */
+        void           *ep_low;         /* bounds of the PT_LOAD segments */
+        void           *ep_high;
+        mmobj_t       **ep_tails;       /* per phdr, the data-bss page or NULL */
+} elf32_plan_t;
 
 static int _elf32_platform_check(const Elf32_Ehdr *header)
 {
@@ -35,8 +63,10 @@ static int _elf32_platform_check(const Elf32_Ehdr *header)
  * Note that since any error returned by this function should
  * cause the ELF loader to give up, it is acceptable for the
  * address space to be modified after returning an error.
+ * tail is the segment's data-bss page from the plan, or NULL to read it here.
  * Note that memoff can be negative */
-static int _elf32_map_segment(vmmap_t *map, vnode_t *file, int32_t memoff, const Elf32_Phdr *segment)
+static int _elf32_map_segment(vmmap_t *map, vnode_t *file, int32_t memoff,
+                              const Elf32_Phdr *segment, mmobj_t *tail)
 {
         uintptr_t addr;
         if (memoff < 0) {
@@ -107,6 +137,16 @@ static int _elf32_map_segment(vmmap_t *map, vnode_t *file, int32_t memoff, const
                 if (npages > 1 && !vmmap_is_range_empty(map, lopage + 1, npages - 1)) {
                         dbg(DBG_ELF, "ERROR: ELF file contains overlapping segments\n");
                         return -ENOEXEC;
+                } else if (NULL != tail) {
+                        KASSERT(!PAGE_ALIGNED(addr + filesz) && filesz > 0);
+                        if (0 > (ret = vmmap_map_obj(map, tail, lopage, 1, perms,
+                                                     MAP_PRIVATE | MAP_FIXED, 0, 0, NULL))) {
+                                return ret;
+                        } else if (npages > 1 &&
+                                   0 > (ret = vmmap_map(map, NULL, lopage + 1, npages - 1, perms,
+                                                        MAP_PRIVATE | MAP_FIXED, 0, 0, NULL))) {
+                                return ret;
+                        }
                 } else if (0 > (ret = vmmap_map(map, NULL, lopage, npages, perms,
                                                 MAP_PRIVATE | MAP_FIXED, 0, 0, NULL))) {
                         return ret;
@@ -209,22 +249,24 @@ done:
 /* Maps the PT_LOAD segments for an ELF file into the given address space.
  * vnode should be the open vnode of the ELF file.
  * map is the address space to map the ELF file into.
- * header is the ELF file's header.
- * pht is the full program header table.
+ * plan is the ELF file's load plan.
  * memoff is the difference (in pages) between the desired base address and the
  * base address given in the ELF file (usually 0x8048094)
  *
  * Returns the number of segments loaded on success, -errno on failure. */
-static int _elf32_map_progsegs(vnode_t *vnode, vmmap_t *map, Elf32_Ehdr *header, char *pht, int32_t memoff)
+static int _elf32_map_progsegs(vnode_t *vnode, vmmap_t *map, elf32_plan_t *plan, int32_t memoff)
 {
         int err = 0;
+        Elf32_Ehdr *header = &plan->ep_header;
+        char *pht = plan->ep_pht;
 
         uint32_t i = 0;
         int loadcount = 0;
         for (i = 0; i < header->e_phnum; ++i) {
                 Elf32_Phdr *phtentry = (Elf32_Phdr *)(pht + (i * header->e_phentsize));
                 if (PT_LOAD == phtentry->p_type) {
-                        if (0 > (err = _elf32_map_segment(map, vnode, memoff, phtentry))) {
+                        if (0 > (err = _elf32_map_segment(map, vnode, memoff, phtentry,
+                                                          plan->ep_tails[i]))) {
                                 goto done;
                         } else {
                                 ++loadcount;
@@ -296,34 +338,186 @@ static void _elf32_calc_progbounds(Elf32_Ehdr *header, char *pht, void **low, vo
                 *high = (void *) curhigh;
 }
 
+static void _elf32_plan_put(elf32_plan_t *plan)
+{
+        uint32_t i;
+
+        KASSERT(0 < plan->ep_refcount);
+        if (0 == --plan->ep_refcount) {
+                for (i = 0; i < plan->ep_header.e_phnum; i++) {
+                        if (NULL != plan->ep_tails[i]) {
+                                plan->ep_tails[i]->mmo_ops->put(plan->ep_tails[i]);
+                        }
+                }
+                if (NULL != plan->ep_interpname) {
+                        kfree(plan->ep_interpname);
+                }
+                kfree(plan);
+        }
+}
+
+/* Reads the page of vn where segment's data gives way to its bss into a new
+ * anonymous object, zeroed past the data, and returns it through tailp with
+ * a reference for the plan. Returns 0 on success, -errno on failure. */
+static int _elf32_load_tail(vnode_t *vn, const Elf32_Phdr *segment, mmobj_t **tailp)
+{
+        int err;
+        pframe_t *pf;
+        mmobj_t *tail;
+        uint32_t end = segment->p_offset + segment->p_filesz;
+
+        if (NULL == (tail = anon_create())) {
+                return -ENOMEM;
+        }
+        tail->mmo_ops->ref(tail);
+
+        /* Filling an anonymous page zeroes and pins it, so it stays
+         * resident for as long as the plan has it */
+        if (0 > (err = pframe_get(tail, 0, &pf))) {
+                tail->mmo_ops->put(tail);
+                return err;
+        }
+        void *addr = pframe_kmap(pf);
+        err = vn->vn_ops->read(vn, (off_t)PAGE_ALIGN_DOWN(end), addr, PAGE_OFFSET(end));
+        pframe_kunmap(pf, addr);
+        if (0 > err) {
+                tail->mmo_ops->put(tail);
+                return err;
+        }
+        *tailp = tail;
+        return 0;
+}
+
+static void _elf32_plan_vx_put(vnode_exec_t *vx)
+{
+        _elf32_plan_put(CONTAINER_OF(vx, elf32_plan_t, ep_vx));
+}
+
+/* Returns through planp the load plan for the ELF file open on fd, whose
+ * vnode is vn, reading and checking its headers unless vn already has one.
+ * The plan is checked as though for an interpreter, so the caller must still
+ * check e_type for a program. Returns 0 on success, -errno on failure; the
+ * caller drops the plan with _elf32_plan_put(). */
+static int _elf32_get_plan(int fd, vnode_t *vn, elf32_plan_t **planp)
+{
+        int err;
+        Elf32_Ehdr header;
+        elf32_plan_t *plan = NULL;
+
+        if (NULL != vn->vn_exec) {
+                plan = CONTAINER_OF(vn->vn_exec, elf32_plan_t, ep_vx);
+                plan->ep_refcount++;
+                *planp = plan;
+                return 0;
+        }
+        /* Reading can block, and the file be written meanwhile */
+        uint32_t wgen = vn->vn_wgen;
+
+        if (0 > (err = _elf32_load_ehdr(fd, &header, 1))) {
+                goto fail;
+        } else if (sizeof(Elf32_Phdr) > header.e_phentsize) {
+                dbg(DBG_ELF, "ELF load failed: bad program header size\n");
+                err = -ENOEXEC;
+                goto fail;
+        }
+
+        size_t phtsize = header.e_phentsize * header.e_phnum;
+        size_t tailsize = header.e_phnum * sizeof(mmobj_t *);
+        if (NULL == (plan = kmalloc(sizeof(*plan) + tailsize + phtsize))) {
+                err = -ENOMEM;
+                goto fail;
+        }
+        plan->ep_refcount = 1;
+        plan->ep_vx.vx_put = _elf32_plan_vx_put;
+        plan->ep_header = header;
+        plan->ep_phtsize = phtsize;
+        plan->ep_tails = (mmobj_t **)(plan + 1);
+        memset(plan->ep_tails, 0, tailsize);
+        plan->ep_pht = (char *)plan->ep_tails + tailsize;
+        plan->ep_interpname = NULL;
+        if (0 > (err = _elf32_load_phtable(fd, &header, plan->ep_pht, phtsize))) {
+                goto fail;
+        }
+
+        Elf32_Phdr *phinterp;
+        if (0 > (err = _elf32_find_phinterp(&header, plan->ep_pht, &phinterp))) {
+                goto fail;
+        }
+        if (NULL != phinterp) {
+                /* read the file name of the interpreter from the binary */
+                if (0 > (err = do_lseek(fd, phinterp->p_offset, SEEK_SET))) {
+                        goto fail;
+                } else if (NULL == (plan->ep_interpname = kmalloc(phinterp->p_filesz + 1))) {
+                        err = -ENOMEM;
+                        goto fail;
+                } else if (0 > (err = do_read(fd, plan->ep_interpname, phinterp->p_filesz))) {
+                        goto fail;
+                }
+                if (err != (int)phinterp->p_filesz) {
+                        err = -ENOEXEC;
+                        goto fail;
+                }
+                plan->ep_interpname[phinterp->p_filesz] = '\0';
+        }
+
+        /* Calculate program bounds for future reference */
+        _elf32_calc_progbounds(&header, plan->ep_pht, &plan->ep_low, &plan->ep_high);
+
+        uint32_t i;
+        for (i = 0; i < header.e_phnum; ++i) {
+                Elf32_Phdr *phtentry = (Elf32_Phdr *)(plan->ep_pht + (i * header.e_phentsize));
+                if (PT_LOAD == phtentry->p_type && 0 < phtentry->p_filesz
+                    && phtentry->p_memsz > phtentry->p_filesz
+                    && !PAGE_ALIGNED(phtentry->p_offset + phtentry->p_filesz)
+                    && PAGE_OFFSET(phtentry->p_vaddr) == PAGE_OFFSET(phtentry->p_offset)) {
+                        if (0 > (err = _elf32_load_tail(vn, phtentry, &plan->ep_tails[i]))) {
+                                goto fail;
+                        }
+                }
+        }
+
+        /* Only keep it if it still describes the file */
+        if (wgen == vn->vn_wgen && NULL == vn->vn_exec
+            && !(vn->vn_flags & VN_WRITEMAPPED)) {
+                plan->ep_refcount++;
+                vn->vn_exec = &plan->ep_vx;
+        }
+        *planp = plan;
+        return 0;
+
+fail:
+        if (NULL != plan) {
+                _elf32_plan_put(plan);
+        }
+        return err;
+}
+
 /* Calculates the total size of all the arguments that need to be placed on the
  * user stack before execution can begin. See Intel i386 ELF supplement pp 54-59
  * Returns total size on success. Returns the number of non-NULL entries in
- * argv, envp, and auxv in argc, envc, and auxc arguments, respectively */
-static size_t _elf32_calc_argsize(char *const argv[], char *const envp[], Elf32_auxv_t *auxv,
-                                  size_t phtsize, int *argc, int *envc, int *auxc)
+ * auxv in auxc, and how much of the total the strings of argv and envp take
+ * in strsize */
+static size_t _elf32_calc_argsize(const execvec_t *argv, const execvec_t *envp,
+                                  Elf32_auxv_t *auxv, size_t phtsize, int *auxc,
+                                  size_t *strsize)
 {
         size_t size = 0;
+        size_t strs = 0;
+        size_t n;
         int i;
         /* All strings in argv */
-        for (i = 0; argv[i] != NULL; i++) {
-                size += strlen(argv[i]) + 1; /* null terminator */
-        }
-        if (argc != NULL) {
-                *argc = i;
+        for (n = 0; n < argv->ev_len; n++) {
+                strs += execvec_strlen(argv, n) + 1; /* null terminator */
         }
         /* argv itself (+ null terminator) */
-        size += (i + 1) * sizeof(char *);
+        size += (argv->ev_len + 1) * sizeof(char *);
 
         /* All strings in envp */
-        for (i = 0; envp[i] != NULL; i++) {
-                size += strlen(envp[i]) + 1; /* null terminator */
-        }
-        if (envc != NULL) {
-                *envc = i;
+        for (n = 0; n < envp->ev_len; n++) {
+                strs += execvec_strlen(envp, n) + 1; /* null terminator */
         }
         /* envp itself (+ null terminator) */
-        size += (i + 1) * sizeof(char *);
+        size += (envp->ev_len + 1) * sizeof(char *);
 
         /* The only extra-space-consuming entry in auxv is AT_PHDR, as if we find
          * that entry we'll need to put the program header table on the stack */
@@ -343,25 +537,34 @@ static size_t _elf32_calc_argsize(char *const argv[], char *const envp[], Elf32_
         /* argv, envp, and auxv pointers (as passed to main) */
         size += 3 * sizeof(void *);
 
-        return size;
+        *strsize = strs;
+        return size + strs;
 }
 
 /* Copies the arguments that must be on the stack prior to execution onto the
- * user stack. This should never fail.
+ * user stack.
  * arglow:   low address on the user stack where we should start the copying
  * argsize:  total size of everything to go on the stack
- * buf:      a kernel buffer at least as big as argsize (for convenience)
+ * strsize:  how much of that the strings of argv and envp take, at the top
+ * buf:      a kernel buffer at least as big as argsize - strsize, in which
+ *           everything but those strings is laid out
  * argv, envp, auxv: various vectors of stuff (to go on the stack)
- * argc, envc, auxc: number of non-NULL entries in argv, envp, auxv,
- *                   respectively (to avoid recomputing them)
+ * auxc:     number of non-NULL entries in auxv (to avoid recomputing it)
  * phtsize: the size of the program header table (to avoid recomputing)
+ * The strings are copied straight from wherever argv and envp have them, the
+ * old address space for exec(2), which is why this can fail: returns 0 or
+ * -errno.
  * c.f. Intel i386 ELF supplement pp 54-59
  */
-static void _elf32_load_args(vmmap_t *map, void *arglow, size_t argsize, char *buf,
-                             char *const argv[], char *const envp[], Elf32_auxv_t *auxv,
-                             int argc, int envc, int auxc, int phtsize)
+static int _elf32_load_args(vmmap_t *map, void *arglow, size_t argsize, size_t strsize,
+                            char *buf, const execvec_t *argv, const execvec_t *envp,
+                            Elf32_auxv_t *auxv, int auxc, int phtsize)
 {
+        int argc = argv->ev_len;
+        int envc = envp->ev_len;
+        size_t n;
         int i;
+        int err;
 
         /* Copy argc */
         *((int *) buf) = argc;
@@ -373,11 +576,14 @@ static void _elf32_load_args(vmmap_t *map, void *arglow, size_t argsize, char *b
 
         char *vvecstart = ((char *)arglow) + sizeof(int) + 3 * sizeof(void *); /* Beginning of argv (in user space) */
 
-        char *strstart = vecstart + veclen; /* Beginning of first string pointed to by argv
-                                                                                   (in kernel buffer) */
+        /* The program header table follows the vectors (in kernel buffer and
+         * in user space) */
+        char *tblstart = vecstart + veclen;
+        char *vtblstart = vvecstart + veclen;
 
         /* Beginning of first string pointed to by argv (in user space) */
-        char *vstrstart = vvecstart + veclen;
+        char *vstrstart = ((char *)arglow) + argsize - strsize;
+        char *vstr = vstrstart;
 
         /* Copy over pointer to argv */
         *(char **)(buf + 4) = vvecstart;
@@ -386,28 +592,20 @@ static void _elf32_load_args(vmmap_t *map, void *arglow, size_t argsize, char *b
         /* Copy over pointer to auxv */
         *(char **)(buf + 12) = vvecstart + (argc + 1 + envc + 1) * sizeof(char *);
 
-        /* Copy over argv along with every string in it */
-        for (i = 0; i < argc; i++) {
-                size_t len = strlen(argv[i]) + 1;
-                strcpy(strstart, argv[i]);
-                /* Remember that we need to use the virtual address of the string */
-                *(char **) vecstart = vstrstart;
-                strstart += len;
-                vstrstart += len;
+        /* Point argv at where its strings will be */
+        for (n = 0; n < argv->ev_len; n++) {
+                *(char **) vecstart = vstr;
+                vstr += execvec_strlen(argv, n) + 1;
                 vecstart += sizeof(char *);
         }
         /* null terminator of argv */
         *(char **) vecstart = NULL;
         vecstart += sizeof(char *);
 
-        /* Copy over envp along with every string in it */
-        for (i = 0; i < envc; i++) {
-                size_t len = strlen(envp[i]) + 1;
-                strcpy(strstart, envp[i]);
-                /* Remember that we need to use the virtual address of the string */
-                *(char **) vecstart = vstrstart;
-                strstart += len;
-                vstrstart += len;
+        /* And envp */
+        for (n = 0; n < envp->ev_len; n++) {
+                *(char **) vecstart = vstr;
+                vstr += execvec_strlen(envp, n) + 1;
                 vecstart += sizeof(char *);
         }
         /* null terminator of envp */
@@ -421,38 +619,52 @@ static void _elf32_load_args(vmmap_t *map, void *arglow, size_t argsize, char *b
                 /* Check if it points to the program header */
                 if (auxv[i].a_type == AT_PHDR) {
                         /* Copy over the program header table */
-                        memcpy(strstart, auxv[i].a_un.a_ptr, phtsize);
+                        memcpy(tblstart, auxv[i].a_un.a_ptr, phtsize);
                         /* And modify the address */
-                        ((Elf32_auxv_t *)vecstart)->a_un.a_ptr = vstrstart;
+                        ((Elf32_auxv_t *)vecstart)->a_un.a_ptr = vtblstart;
+                        tblstart += phtsize;
+                        vtblstart += phtsize;
                 }
                 vecstart += sizeof(Elf32_auxv_t);
         }
         /* null terminator of auxv */
         ((Elf32_auxv_t *)vecstart)->a_type = NULL;
+        KASSERT(vtblstart == vstrstart);
 
-        /* Finally, we're done copying into the kernel buffer. Now just copy the
-         * kernel buffer into user space */
-        int ret = vmmap_write(map, arglow, buf, argsize);
-        /* If this failed, we must have set up the address space wrong... */
-        KASSERT(0 == ret);
+        /* Copy the kernel buffer into user space, then each string straight
+         * into place after it */
+        if (0 > (err = vmmap_write(map, arglow, buf, argsize - strsize))) {
+                return err;
+        }
+        vstr = vstrstart;
+        for (n = 0; n < argv->ev_len; n++) {
+                if (0 > (err = execvec_copyout(argv, n, map, vstr))) {
+                        return err;
+                }
+                vstr += execvec_strlen(argv, n) + 1;
+        }
+        for (n = 0; n < envp->ev_len; n++) {
+                if (0 > (err = execvec_copyout(envp, n, map, vstr))) {
+                        return err;
+                }
+                vstr += execvec_strlen(envp, n) + 1;
+        }
+        return 0;
 }
 
 
-static int _elf32_load(const char *filename, int fd, char *const argv[],
-                       char *const envp[], uint32_t *eip, uint32_t *esp)
+static int _elf32_load(const char *filename, int fd, const execvec_t *argv,
+                       const execvec_t *envp, uint32_t *eip, uint32_t *esp)
 {
         int err = 0;
-        Elf32_Ehdr header;
-        Elf32_Ehdr interpheader;
 
         /* variables to clean up on failure */
         vmmap_t *map = NULL;
         file_t *file = NULL;
-        char *pht = NULL;
-        char *interpname = NULL;
+        elf32_plan_t *plan = NULL;
         int interpfd = -1;
         file_t *interpfile = NULL;
-        char *interppht = NULL;
+        elf32_plan_t *interpplan = NULL;
         Elf32_auxv_t *auxv = NULL;
         char *argbuf = NULL;
 
@@ -461,99 +673,64 @@ static int _elf32_load(const char *filename, int fd, char *const argv[],
         file = fget(fd);
         KASSERT(NULL != file);
 
-        /* Load and verify the ELF header */
-        if (0 > (err = _elf32_load_ehdr(fd, &header, 0))) {
+        /* Get the verified ELF header and program header table */
+        if (0 > (err = _elf32_get_plan(fd, file->f_vnode, &plan))) {
                 goto done;
-        }
-
-        if (NULL == (map = vmmap_create())) {
-                err = -ENOMEM;
+        } else if (ET_EXEC != plan->ep_header.e_type) {
+                dbg(DBG_ELF, "ELF load failed: not exectuable ELF\n");
+                err = -ENOEXEC;
                 goto done;
         }
+        Elf32_Ehdr *header = &plan->ep_header;
+        char *pht = plan->ep_pht;
+        size_t phtsize = plan->ep_phtsize;
 
-        size_t phtsize = header.e_phentsize * header.e_phnum;
-        if (NULL == (pht = kmalloc(phtsize))) {
+        if (NULL == (map = vmmap_create())) {
                 err = -ENOMEM;
                 goto done;
         }
-        /* Read in the program header table */
-        if (0 > (err = _elf32_load_phtable(fd, &header, pht, phtsize))) {
-                goto done;
-        }
-        /* Load the segments in the program header table */
-        if (0 > (err = _elf32_map_progsegs(file->f_vnode, map, &header, pht, 0))) {
+        /* The vdso pages go in first, so nothing placed at the top of
+         * user memory (the interpreter, say) lands on them */
+        if (0 > (err = vdso_map(map, curproc->p_pid))) {
                 goto done;
         }
 
-        Elf32_Phdr *phinterp = NULL;
-        /* Check if program requires an interpreter */
-        if (0 > (err = _elf32_find_phinterp(&header, pht, &phinterp))) {
+        /* Load the segments in the program header table */
+        if (0 > (err = _elf32_map_progsegs(file->f_vnode, map, plan, 0))) {
                 goto done;
         }
 
-        /* Calculate program bounds for future reference */
-        void *proglow;
-        void *proghigh;
-        _elf32_calc_progbounds(&header, pht, &proglow, &proghigh);
+        void *proglow = plan->ep_low;
+        void *proghigh = plan->ep_high;
 
-        entry = (uintptr_t) header.e_entry;
+        entry = (uintptr_t) header->e_entry;
 
         /* if an interpreter was requested load it */
-        if (NULL != phinterp) {
-                /* read the file name of the interpreter from the binary */
-                if (0 > (err = do_lseek(fd, phinterp->p_offset, SEEK_SET))) {
-                        goto done;
-                } else if (NULL == (interpname = kmalloc(phinterp->p_filesz))) {
-                        err = -ENOMEM;
-                        goto done;
-                } else if (0 > (err = do_read(fd, interpname, phinterp->p_filesz))) {
-                        goto done;
-                }
-                if (err != (int)phinterp->p_filesz) {
-                        err = -ENOEXEC;
-                        goto done;
-                }
-
+        if (NULL != plan->ep_interpname) {
                 /* open the interpreter */
-                dbgq(DBG_ELF, "ELF Interpreter: %*s\n", phinterp->p_filesz, interpname);
-                if (0 > (interpfd = do_open(interpname, O_RDONLY))) {
+                dbgq(DBG_ELF, "ELF Interpreter: %s\n", plan->ep_interpname);
+                if (0 > (interpfd = do_open(plan->ep_interpname, O_RDONLY))) {
                         err = interpfd;
                         goto done;
                 }
-                kfree(interpname);
-                interpname = NULL;
 
                 interpfile = fget(interpfd);
                 KASSERT(NULL != interpfile);
 
-                /* Load and verify the interpreter ELF header */
-                if (0 > (err = _elf32_load_ehdr(interpfd, &interpheader, 1))) {
-                        goto done;
-                }
-                size_t interpphtsize = interpheader.e_phentsize * interpheader.e_phnum;
-                if (NULL == (interppht = kmalloc(interpphtsize))) {
-                        err = -ENOMEM;
-                        goto done;
-                }
-                /* Read in the program header table */
-                if (0 > (err = _elf32_load_phtable(interpfd, &interpheader, interppht, interpphtsize))) {
+                /* Get the verified interpreter ELF header and program header table */
+                if (0 > (err = _elf32_get_plan(interpfd, interpfile->f_vnode, &interpplan))) {
                         goto done;
                 }
 
                 /* Interpreter shouldn't itself need an interpreter */
-                Elf32_Phdr *interpphinterp;
-                if (0 > (err = _elf32_find_phinterp(&interpheader, interppht, &interpphinterp))) {
-                        goto done;
-                }
-                if (NULL != interpphinterp) {
+                if (NULL != interpplan->ep_interpname) {
                         err = -EINVAL;
                         goto done;
                 }
 
                 /* Calculate the interpreter program size */
-                void *interplow;
-                void *interphigh;
-                _elf32_calc_progbounds(&interpheader, interppht, &interplow, &interphigh);
+                void *interplow = interpplan->ep_low;
+                void *interphigh = interpplan->ep_high;
                 uint32_t interpnpages = ADDR_TO_PN(PAGE_ALIGN_UP(interphigh)) - ADDR_TO_PN(interplow);
 
                 /* Find space for the interpreter */
@@ -570,10 +747,11 @@ static int _elf32_load(const char *filename, int fd, char *const argv[],
                 /* Offset from "expected base" in number of pages */
                 int32_t interpoff = (int32_t) interppagebase - (int32_t) ADDR_TO_PN(interplow);
 
-                entry = (uintptr_t) interpbase + ((uintptr_t) interpheader.e_entry - (uintptr_t) interplow);
+                entry = (uintptr_t) interpbase + ((uintptr_t) interpplan->ep_header.e_entry - (uintptr_t) interplow);
 
                 /* Load the interpreter program header and map in its segments */
-                if (0 > (err = _elf32_map_progsegs(interpfile->f_vnode, map, &interpheader, interppht, interpoff))) {
+                if (0 > (err = _elf32_map_progsegs(interpfile->f_vnode, map, interpplan,
+                                                   interpoff))) {
                         goto done;
                 }
 
@@ -592,15 +770,15 @@ static int _elf32_load(const char *filename, int fd, char *const argv[],
                 auxvent++;
 
                 auxvent->a_type = AT_PHENT;
-                auxvent->a_un.a_val = header.e_phentsize;
+                auxvent->a_un.a_val = header->e_phentsize;
                 auxvent++;
 
                 auxvent->a_type = AT_PHNUM;
-                auxvent->a_un.a_val = header.e_phnum;
+                auxvent->a_un.a_val = header->e_phnum;
                 auxvent++;
 
                 auxvent->a_type = AT_ENTRY;
-                auxvent->a_un.a_ptr = (void *) header.e_entry;
+                auxvent->a_un.a_ptr = (void *) header->e_entry;
                 auxvent++;
 
                 auxvent->a_type = AT_BASE;
@@ -622,27 +800,32 @@ static int _elf32_load(const char *filename, int fd, char *const argv[],
                 auxv->a_type = AT_NULL;
         }
 
-        /* Allocate a stack. We put the stack immediately below the program text.
-         * (in the Intel x86 ELF supplement pp 59 "example stack", that is where the
-         * stack is located). I suppose we can add this "extra page for magic data" too */
-        uint32_t stack_lopage = ADDR_TO_PN(proglow) - (DEFAULT_STACK_SIZE / PAGE_SIZE) - 1;
-        err = vmmap_map(map, NULL, stack_lopage, (DEFAULT_STACK_SIZE / PAGE_SIZE) + 1,
-                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, 0, 0, NULL);
-        KASSERT(0 == err);
-        dbg(DBG_ELF, "Mapped stack at low addr 0x%p, size %#x\n",
-            PN_TO_ADDR(stack_lopage), DEFAULT_STACK_SIZE + PAGE_SIZE);
-
-
         /* Copy out arguments onto the user stack */
-        int argc, envc, auxc;
-        size_t argsize = _elf32_calc_argsize(argv, envp, auxv, phtsize, &argc, &envc, &auxc);
+        int auxc;
+        size_t strsize;
+        size_t argsize = _elf32_calc_argsize(argv, envp, auxv, phtsize, &auxc, &strsize);
         /* Make sure it fits on the stack */
         if (argsize >= DEFAULT_STACK_SIZE) {
                 err = -E2BIG;
                 goto done;
         }
-        /* Copy arguments into kernel buffer */
-        if (NULL == (argbuf = (char *) kmalloc(argsize))) {
+
+        /* Allocate a stack. We put the stack immediately below the program text.
+         * (in the Intel x86 ELF supplement pp 59 "example stack", that is where the
+         * stack is located). Only the arguments and a few pages below them are
+         * mapped now; the stack grows down on faults, up to USER_STACK_MAX_SIZE,
+         * as far as the offset it is mapped at (see vmmap_grow_down) */
+        uint32_t stack_npages = ADDR_TO_PN(PAGE_ALIGN_UP(argsize)) + USER_STACK_INIT_PAGES;
+        uint32_t stack_lopage = ADDR_TO_PN(proglow) - stack_npages;
+        err = vmmap_map(map, NULL, stack_lopage, stack_npages,
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_GROWSDOWN,
+                        (off_t)(uintptr_t)PN_TO_ADDR(USER_STACK_MAX_SIZE / PAGE_SIZE - stack_npages),
+                        0, NULL);
+        KASSERT(0 == err);
+        dbg(DBG_ELF, "Mapped stack at low addr 0x%p, size %#x\n",
+            PN_TO_ADDR(stack_lopage), stack_npages * PAGE_SIZE);
+        /* Lay out all but the strings in a kernel buffer */
+        if (NULL == (argbuf = (char *) kmalloc(argsize - strsize))) {
                 err = -ENOMEM;
                 goto done;
         }
@@ -650,7 +833,19 @@ static int _elf32_load(const char *filename, int fd, char *const argv[],
         void *arglow = (void *)((uintptr_t)(((char *) proglow) - argsize) & ~PTR_MASK);
         /* Copy everything into the user address space, modifying addresses in
          * argv, envp, and auxv to be user addresses as we go. */
-        _elf32_load_args(map, arglow, argsize, argbuf, argv, envp, auxv, argc, envc, auxc, phtsize);
+        if (0 > (err = _elf32_load_args(map, arglow, argsize, strsize, argbuf,
+                                        argv, envp, auxv, auxc, phtsize))) {
+                goto done;
+        }
+
+        /* A vforked process gets page tables of its own here; the ones it
+         * is running on are its parent's */
+        pagedir_t *pagedir = NULL;
+        if (NULL != curproc->p_vfork_parent
+            && NULL == (pagedir = pt_create_pagedir())) {
+                err = -ENOMEM;
+                goto done;
+        }
 
         dbg(DBG_ELF, "Past the point of no return. Swapping to map at 0x%p, setting brk to 0x%p\n", map, proghigh);
         /* the final threshold / What warm unspoken secrets will we learn? / Beyond
@@ -661,12 +856,27 @@ static int _elf32_load(const char *filename, int fd, char *const argv[],
         curproc->p_vmmap = map;
         map = tempmap; /* So the old maps are cleaned up */
         curproc->p_vmmap->vmm_proc = curproc;
-        map->vmm_proc = NULL;
 
-        /* Flush the process pagetables and TLB */
-        pt_unmap_range(curproc->p_pagedir, USER_MEM_LOW, USER_MEM_HIGH);
+        if (NULL != pagedir) {
+                /* Hand the parent back its address space untouched */
+                map = NULL;
+                curproc->p_pagedir = pagedir;
+                curthr->kt_ctx.c_pdptr = pagedir;
+                pt_set(pagedir);
+                vfork_release();
+        } else {
+                /* Keep what was written through shared mappings, then
+                 * flush the process pagetables */
+                vmmap_sync(map, ADDR_TO_PN(USER_MEM_LOW),
+                           ADDR_TO_PN(USER_MEM_HIGH) - ADDR_TO_PN(USER_MEM_LOW), 0);
+                map->vmm_proc = NULL;
+                pt_unmap_range(curproc->p_pagedir, USER_MEM_LOW, USER_MEM_HIGH);
+        }
         tlb_flush_all();
 
+        /* The new program starts with fresh FPU state */
+        context_fpu_release(&curthr->kt_ctx);
+
         /* Set the process break and starting break (immediately after the mapped-in
          * text/data/bss from the executable) */
         curproc->p_brk = proghigh;
@@ -691,11 +901,8 @@ done:
         if (NULL != file) {
                 fput(file);
         }
-        if (NULL != pht) {
-                kfree(pht);
-        }
-        if (NULL != interpname) {
-                kfree(interpname);
+        if (NULL != plan) {
+                _elf32_plan_put(plan);
         }
         if (0 <= interpfd) {
                 do_close(interpfd);
@@ -703,8 +910,8 @@ done:
         if (NULL != interpfile) {
                 fput(interpfile);
         }
-        if (NULL != interppht) {
-                kfree(interppht);
+        if (NULL != interpplan) {
+                _elf32_plan_put(interpplan);
         }
         if (NULL != auxv) {
                 kfree(auxv);
@@ -1,8 +1,17 @@
+#include "globals.h"
+
 #include "util/debug.h"
+#include "util/string.h"
+
+#include "mm/pagetable.h"
+
+#include "vm/vmmap.h"
 
 #include "main/interrupt.h"
 #include "main/gdt.h"
 
+#include "proc/sched.h"
+
 #include "api/exec.h"
 #include "api/binfmt.h"
 #include "api/syscall.h"
@@ -15,6 +24,7 @@
  */
 void userland_entry(const regs_t *regs)
 {
+        sched_acct_untrap();
         intr_disable();
         intr_setipl(IPL_LOW);
         /* We "return from the interrupt" to get into userland */
@@ -35,7 +45,43 @@ void userland_entry(const regs_t *regs)
         );
 }
 
-int do_execve(const char *filename, char *const *argv, char *const *envp, struct regs *regs)
+void execvec_kernel(execvec_t *ev, char *const *vec)
+{
+        static char *const empty[] = { NULL };
+
+        ev->ev_kvec = (NULL != vec) ? vec : empty;
+        ev->ev_uvec = NULL;
+        for (ev->ev_len = 0; NULL != ev->ev_kvec[ev->ev_len]; ev->ev_len++)
+                ;
+}
+
+size_t execvec_strlen(const execvec_t *ev, size_t i)
+{
+        KASSERT(i < ev->ev_len);
+        if (NULL != ev->ev_uvec) {
+                return ev->ev_uvec[i].as_len;
+        }
+        return strlen(ev->ev_kvec[i]);
+}
+
+int execvec_copyout(const execvec_t *ev, size_t i, struct vmmap *map, void *vaddr)
+{
+        size_t len = execvec_strlen(ev, i);
+        int err;
+
+        if (NULL == ev->ev_uvec) {
+                return vmmap_write(map, vaddr, ev->ev_kvec[i], len + 1);
+        }
+        /* The terminator is written here rather than copied, so that the
+         * string is exactly as long as was allowed for */
+        if (0 > (err = vmmap_write_user(map, vaddr, ev->ev_uvec[i].as_str, len))) {
+                return err;
+        }
+        return vmmap_write(map, (char *)vaddr + len, "", 1);
+}
+
+int do_execve(const char *filename, const execvec_t *argv, const execvec_t *envp,
+              struct regs *regs)
 {
         uint32_t eip, esp;
         int ret = binfmt_load(filename, argv, envp, &eip, &esp);
@@ -51,7 +97,16 @@ int do_execve(const char *filename, char *const *argv, char *const *envp, struct
 void kernel_execve(const char *filename, char *const *argv, char *const *envp)
 {
         uint32_t eip, esp;
-        int ret = binfmt_load(filename, argv, envp, &eip, &esp);
+        execvec_t kargv, kenvp;
+
+        /* The thread stops being a kernel thread, which may have been
+         * running on another process's page directory */
+        curthr->kt_ctx.c_kernel = 0;
+        pt_set(curproc->p_pagedir);
+
+        execvec_kernel(&kargv, argv);
+        execvec_kernel(&kenvp, envp);
+        int ret = binfmt_load(filename, &kargv, &kenvp, &eip, &esp);
         KASSERT(0 == ret); /* Should never fail to load the first binary */
 
         dbg(DBG_EXEC, "Entering userland with eip %#08x, esp %#08x\n", eip, esp);
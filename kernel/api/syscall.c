@@ -2,16 +2,23 @@
 #include "globals.h"
 #include "errno.h"
 #include "types.h"
+#include "limits.h"
 
 #include "main/interrupt.h"
 
 #include "proc/proc.h"
 #include "proc/kthread.h"
+#include "proc/futex.h"
+#include "proc/resource.h"
 
 #include "util/init.h"
 #include "util/string.h"
 #include "util/debug.h"
 #include "util/list.h"
+#include "util/time.h"
+#include "util/counter.h"
+#include "util/trace.h"
+#include "util/tracepoint.h"
 
 #include "mm/mman.h"
 #include "mm/mm.h"
@@ -21,158 +28,416 @@
 
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
+#include "fs/uio.h"
+#include "fs/poll.h"
+#include "fs/epoll.h"
+#include "fs/uring.h"
+
+#include "net/socket.h"
 
 #include "test/kshell/kshell.h"
 
 #include "vm/brk.h"
 #include "vm/mmap.h"
+#include "vm/shm.h"
 #include "vm/vmmap.h"
 
 #include "api/syscall.h"
 #include "api/utsname.h"
+#include "api/time.h"
 #include "api/access.h"
 #include "api/exec.h"
+#include "api/vdso.h"
 
 static void syscall_handler(regs_t *regs);
 static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs);
 
+static void syscall_counters_init(void);
+static void syscall_stats_record(uint32_t sysnum, uint64_t ns);
+
 static __attribute__((unused)) void syscall_init(void)
 {
         intr_register(INTR_SYSCALL, syscall_handler);
+        syscall_counters_init();
 }
 init_func(syscall_init);
 
 /*
- * this is one of the few sys_* functions you have to write. be sure to
- * check out the sys_* functions we have provided before trying to write
- * this one.
- *  - copy_from_user() the read_args_t
- *  - page_alloc() a temporary buffer
- *  - call do_read(), and copy_to_user() the read bytes
- *  - page_free() your buffer
- *  - return the number of bytes actually read, or if anything goes wrong
- *    set curthr->kt_errno and return -1
+ * read_bounce and write_bounce move count bytes between the user buffer
+ * ubuf and a file which cannot copy to and from user memory itself
+ * (a pipe or a device, say), a page at a time through a kernel buffer.
+ * They use and advance the file position if pos is -1, and work at pos
+ * otherwise. They return the number of bytes moved or -errno.
  */
 static int
-sys_read(read_args_t *arg)
+read_bounce(int fd, char *ubuf, size_t count, off_t pos)
 {
-    read_args_t kern_args;
-    int err;
-
-    if ((err = copy_from_user(&kern_args, arg, sizeof(read_args_t))) < 0) {
-        curthr->kt_errno = -err;
-        return -1;
-    }
-
     void *kaddr = page_alloc();
-    size_t count = kern_args.nbytes;
-    char *buff = (char *)kern_args.buf;
+    if (kaddr == NULL) {
+        return -ENOMEM;
+    }
     int total_read = 0;
+    int err;
 
     while (count > 0) {
         size_t readlen = MIN(PAGE_SIZE, count);
 
-        int actual_read = do_read(kern_args.fd, kaddr, readlen);
+        int actual_read;
+        if (pos == -1) {
+            actual_read = do_read(fd, kaddr, readlen);
+        } else {
+            actual_read = do_pread(fd, kaddr, readlen, pos + total_read);
+        }
         if (actual_read < 0) {
             page_free(kaddr);
-            curthr->kt_errno = -actual_read;
-            return -1;
+            return actual_read;
         }
         KASSERT((unsigned)actual_read <= readlen);
 
-        err = copy_to_user(buff, kaddr, actual_read);
+        err = copy_to_user(ubuf, kaddr, actual_read);
         if (err < 0) {
             page_free(kaddr);
-            curthr->kt_errno = -err;
-            return -1;
+            return err;
         }
         KASSERT(err == 0);
 
         count -= actual_read;
-        buff += actual_read;
+        ubuf += actual_read;
         total_read += actual_read;
         if ((unsigned)actual_read != readlen) {
             break;
         }
     }
-/*
- *    err = do_read(kern_args.fd, kaddr, kern_args.nbytes);
- *    if (err < 0) {
- *        curthr->kt_errno = -err;
- *        return -1;
- *    }
- *
- *    copy_to_user(kern_args.buf, kaddr, err);
- */
     page_free(kaddr);
 
     return total_read;
-        /*NOT_YET_IMPLEMENTED("VM: sys_read");*/
-        /*return -1;*/
 }
 
-/*
- * This function is almost identical to sys_read.  See comments above.
- */
 static int
-sys_write(write_args_t *arg)
+write_bounce(int fd, const char *ubuf, size_t count, off_t pos)
 {
-    write_args_t kern_args;
-    int err;
-
-    if ((err = copy_from_user(&kern_args, arg, sizeof(write_args_t))) < 0) {
-        curthr->kt_errno = -err;
-        return -1;
-    }
-
     void *kaddr = page_alloc();
-    size_t count = kern_args.nbytes;
-    char *buff = (char *)kern_args.buf;
+    if (kaddr == NULL) {
+        return -ENOMEM;
+    }
     int total_write = 0;
+    int err;
 
     while (count > 0) {
         size_t writelen = MIN(PAGE_SIZE, count);
 
-        err = copy_from_user(kaddr, buff, writelen);
+        err = copy_from_user(kaddr, ubuf, writelen);
         if (err < 0) {
             page_free(kaddr);
-            curthr->kt_errno = -err;
-            return -1;
+            return err;
         }
         KASSERT(err == 0);
 
-        int actual_write = do_write(kern_args.fd, kaddr, writelen);
+        int actual_write;
+        if (pos == -1) {
+            actual_write = do_write(fd, kaddr, writelen);
+        } else {
+            actual_write = do_pwrite(fd, kaddr, writelen, pos + total_write);
+        }
         if (actual_write < 0) {
             page_free(kaddr);
-            curthr->kt_errno = -actual_write;
-            return -1;
+            return actual_write;
         }
         KASSERT((unsigned)actual_write <= writelen);
 
         count -= actual_write;
-        buff += actual_write;
+        ubuf += actual_write;
         total_write += actual_write;
         if ((unsigned)actual_write != writelen) {
             break;
         }
     }
-
-    /*
-     *copy_from_user(kaddr, kern_args.buf, kern_args.nbytes);
-     *err = do_write(kern_args.fd, kaddr, kern_args.nbytes);
-     *if (err < 0) {
-     *    curthr->kt_errno = -err;
-     *    return -1;
-     *}
-     */
-
     page_free(kaddr);
 
     return total_write;
+}
+
+/*
+ * this is one of the few sys_* functions you have to write. be sure to
+ * check out the sys_* functions we have provided before trying to write
+ * this one.
+ *  - copy_from_user() the read_args_t
+ *  - page_alloc() a temporary buffer
+ *  - call do_read(), and copy_to_user() the read bytes
+ *  - page_free() your buffer
+ *  - return the number of bytes actually read, or if anything goes wrong
+ *    set curthr->kt_errno and return -1
+ */
+static int
+sys_read(read_args_t *arg)
+{
+    read_args_t kern_args;
+    int err;
+
+    if ((err = copy_from_user(&kern_args, arg, sizeof(read_args_t))) < 0) {
+        curthr->kt_errno = -err;
+        return -1;
+    }
+
+    /*files which copy straight to user memory need no bounce page*/
+    err = do_read_user(kern_args.fd, kern_args.buf, kern_args.nbytes);
+    if (err == -ENOTSUP) {
+        err = read_bounce(kern_args.fd, kern_args.buf, kern_args.nbytes, -1);
+    }
+    if (err < 0) {
+        curthr->kt_errno = -err;
+        return -1;
+    }
+
+    return err;
+        /*NOT_YET_IMPLEMENTED("VM: sys_read");*/
+        /*return -1;*/
+}
+
+/*
+ * This function is almost identical to sys_read.  See comments above.
+ */
+static int
+sys_write(write_args_t *arg)
+{
+    write_args_t kern_args;
+    int err;
+
+    if ((err = copy_from_user(&kern_args, arg, sizeof(write_args_t))) < 0) {
+        curthr->kt_errno = -err;
+        return -1;
+    }
+
+    /*files which copy straight from user memory need no bounce page*/
+    err = do_write_user(kern_args.fd, kern_args.buf, kern_args.nbytes);
+    if (err == -ENOTSUP) {
+        err = write_bounce(kern_args.fd, kern_args.buf, kern_args.nbytes, -1);
+    }
+    if (err < 0) {
+        curthr->kt_errno = -err;
+        return -1;
+    }
+
+    return err;
         /*NOT_YET_IMPLEMENTED("VM: sys_write");*/
         /*return -1;*/
 }
 
+/*
+ * sys_read and sys_write, but at the given offset, leaving the file
+ * position alone.
+ */
+static int
+sys_pread(pread_args_t *arg)
+{
+        pread_args_t kern_args;
+        int err;
+
+        if ((err = copy_from_user(&kern_args, arg, sizeof(pread_args_t))) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+
+        err = do_pread_user(kern_args.fd, kern_args.buf, kern_args.nbytes,
+                            kern_args.offset);
+        if (err == -ENOTSUP) {
+                err = read_bounce(kern_args.fd, kern_args.buf, kern_args.nbytes,
+                                  kern_args.offset);
+        }
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return err;
+}
+
+static int
+sys_pwrite(pwrite_args_t *arg)
+{
+        pwrite_args_t kern_args;
+        int err;
+
+        if ((err = copy_from_user(&kern_args, arg, sizeof(pwrite_args_t))) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+
+        err = do_pwrite_user(kern_args.fd, kern_args.buf, kern_args.nbytes,
+                             kern_args.offset);
+        if (err == -ENOTSUP) {
+                err = write_bounce(kern_args.fd, kern_args.buf, kern_args.nbytes,
+                                   kern_args.offset);
+        }
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return err;
+}
+
+/*
+ * Copies from one file to another within the kernel. The offset, if
+ * not NULL, is read from and written back to user memory.
+ */
+static int
+sys_sendfile(sendfile_args_t *arg)
+{
+        sendfile_args_t kern_args;
+        off_t off;
+        int err;
+
+        if ((err = copy_from_user(&kern_args, arg, sizeof(sendfile_args_t))) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        if (kern_args.offset != NULL
+            && (err = copy_from_user(&off, kern_args.offset, sizeof(off_t))) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+
+        int ret = do_sendfile(kern_args.out_fd, kern_args.in_fd,
+                              (kern_args.offset == NULL) ? NULL : &off,
+                              kern_args.count);
+        if (ret >= 0 && kern_args.offset != NULL
+            && (err = copy_to_user(kern_args.offset, &off, sizeof(off_t))) < 0) {
+                ret = err;
+        }
+        if (ret < 0) {
+                curthr->kt_errno = -ret;
+                return -1;
+        }
+        return ret;
+}
+
+/*
+ * Makes one file share another's blocks, see do_clone_file.
+ */
+static int
+sys_clone_file(clone_file_args_t *arg)
+{
+        clone_file_args_t kern_args;
+        int err;
+
+        if ((err = copy_from_user(&kern_args, arg, sizeof(clone_file_args_t))) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        if ((err = do_clone_file(kern_args.src_fd, kern_args.dst_fd)) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+/* Copies in the arguments of readv or writev and their iovec, which
+ * must have at most IOV_MAX segments adding up to at most INT_MAX
+ * bytes. */
+static int
+copy_iov_from_user(rwv_args_t *arg, rwv_args_t *kern_args, struct iovec *iov)
+{
+        int err;
+        if ((err = copy_from_user(kern_args, arg, sizeof(rwv_args_t))) < 0) {
+                return err;
+        }
+        if (kern_args->iovcnt < 0 || kern_args->iovcnt > IOV_MAX) {
+                return -EINVAL;
+        }
+        if ((err = copy_from_user(iov, kern_args->iov,
+                                  kern_args->iovcnt * sizeof(struct iovec))) < 0) {
+                return err;
+        }
+
+        size_t total = 0;
+        int i;
+        for (i = 0; i < kern_args->iovcnt; ++i) {
+                if (iov[i].iov_len > INT_MAX - total) {
+                        return -EINVAL;
+                }
+                total += iov[i].iov_len;
+        }
+        return 0;
+}
+
+/*
+ * readv and writev read into or write from each segment of an iovec in
+ * turn, as one read or write would. Files which copy to and from user
+ * memory take the whole iovec at once, others go through
+ * read_bounce/write_bounce a segment at a time.
+ */
+static int
+sys_readv(rwv_args_t *arg)
+{
+        rwv_args_t kern_args;
+        struct iovec iov[IOV_MAX];
+        int err;
+
+        if ((err = copy_iov_from_user(arg, &kern_args, iov)) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+
+        err = do_readv_user(kern_args.fd, iov, kern_args.iovcnt);
+        if (err == -ENOTSUP) {
+                int total = 0;
+                int i;
+                for (i = 0; i < kern_args.iovcnt; ++i) {
+                        err = read_bounce(kern_args.fd, iov[i].iov_base,
+                                          iov[i].iov_len, -1);
+                        if (err < 0) {
+                                break;
+                        }
+                        total += err;
+                        if ((unsigned)err != iov[i].iov_len) {
+                                break;
+                        }
+                }
+                if (err >= 0 || total > 0) {
+                        err = total;
+                }
+        }
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return err;
+}
+
+static int
+sys_writev(rwv_args_t *arg)
+{
+        rwv_args_t kern_args;
+        struct iovec iov[IOV_MAX];
+        int err;
+
+        if ((err = copy_iov_from_user(arg, &kern_args, iov)) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+
+        err = do_writev_user(kern_args.fd, iov, kern_args.iovcnt);
+        if (err == -ENOTSUP) {
+                int total = 0;
+                int i;
+                for (i = 0; i < kern_args.iovcnt; ++i) {
+                        err = write_bounce(kern_args.fd, iov[i].iov_base,
+                                           iov[i].iov_len, -1);
+                        if (err < 0) {
+                                break;
+                        }
+                        total += err;
+                }
+                if (err >= 0) {
+                        err = total;
+                }
+        }
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return err;
+}
+
 /*
  * This is another tricly sys_* function that you will need to write.
  * It's pretty similar to sys_read(), but you don't need
@@ -193,34 +458,42 @@ sys_getdents(getdents_args_t *arg)
         return -1;
     }
 
-    dirent_t dirent;
+    /*entries are read a page's worth at a time, then copied out together*/
+    dirent_t *dirents = page_alloc();
+    if (dirents == NULL) {
+        curthr->kt_errno = ENOMEM;
+        return -1;
+    }
     size_t maxdir = kern_args.count / sizeof(dirent_t);
+    size_t batch = PAGE_SIZE / sizeof(dirent_t);
 
-    size_t i;
     int total_read = 0;
-    for (i = 0 ; i < maxdir ; i++) {
-        int actual_read = do_getdent(kern_args.fd, &dirent);
-        if (actual_read < 0) {
-            curthr->kt_errno = -actual_read;
+    while (maxdir > 0) {
+        int n = do_getdents(kern_args.fd, dirents, MIN(maxdir, batch));
+        if (n < 0) {
+            page_free(dirents);
+            curthr->kt_errno = -n;
             return -1;
         }
-        KASSERT(actual_read == 0 || actual_read == sizeof(dirent_t));
         /*no more dirents, just break out*/
-        if (actual_read == 0) {
+        if (n == 0) {
             break;
         }
 
-        char *uaddr = (char *)kern_args.dirp + i * sizeof(dirent_t);
-        err = copy_to_user(uaddr, &dirent, sizeof(dirent_t));
+        char *uaddr = (char *)kern_args.dirp + total_read;
+        err = copy_to_user(uaddr, dirents, n * sizeof(dirent_t));
         if (err < 0) {
+            page_free(dirents);
             curthr->kt_errno = -err;
             return -1;
         }
         KASSERT(err == 0);
 
         /*only increment total_read when copy_to_user succeed*/
-        total_read += actual_read;
+        total_read += n * sizeof(dirent_t);
+        maxdir -= n;
     }
+    page_free(dirents);
 
     return total_read;
         /*NOT_YET_IMPLEMENTED("VM: sys_getdents");*/
@@ -524,6 +797,24 @@ static int sys_lseek(lseek_args_t *args)
         } else return err;
 }
 
+static int sys_ioctl(ioctl_args_t *args)
+{
+        ioctl_args_t            kargs;
+        int                     err;
+
+        if ((err = copy_from_user(&kargs, args, sizeof(ioctl_args_t))) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+
+        err = do_ioctl(kargs.fd, kargs.request, kargs.arg);
+
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        } else return err;
+}
+
 static int sys_open(open_args_t *arg)
 {
         open_args_t             kern_args;
@@ -549,34 +840,160 @@ static int sys_open(open_args_t *arg)
         } else return err;
 }
 
-static int sys_munmap(munmap_args_t *args)
+/* The mode is for permissions, of which there are none */
+static int sys_shm_open(shm_open_args_t *arg)
 {
-        munmap_args_t           kargs;
+        shm_open_args_t         kern_args;
+        char                    *name;
         int                     err;
 
-        if (copy_from_user(&kargs, args, sizeof(munmap_args_t))) {
-                curthr->kt_errno = EFAULT;
+        if ((err = copy_from_user(&kern_args, arg, sizeof(shm_open_args_t))) < 0) {
+                curthr->kt_errno = -err;
                 return -1;
         }
 
-        err = do_munmap(kargs.addr, kargs.len);
+        name = user_strdup(&kern_args.name);
+        if (!name) {
+                curthr->kt_errno = EINVAL;
+                return -1;
+        }
+
+        err = do_shm_open(name, kern_args.oflag);
+        kfree(name);
         if (err < 0) {
                 curthr->kt_errno = -err;
                 return -1;
-        }
-        return 0;
+        } else return err;
 }
 
-static void *sys_mmap(mmap_args_t *arg)
+static int sys_shm_unlink(argstr_t *arg)
 {
-        mmap_args_t             kargs;
-        void                    *ret;
+        argstr_t                kern_args;
+        char                    *name;
         int                     err;
 
-        if (copy_from_user(&kargs, arg, sizeof(mmap_args_t)) < 0) {
-                curthr->kt_errno = EFAULT;
-                return MAP_FAILED;
-        }
+        if ((err = copy_from_user(&kern_args, arg, sizeof(argstr_t))) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+
+        name = user_strdup(&kern_args);
+        if (!name) {
+                curthr->kt_errno = EINVAL;
+                return -1;
+        }
+
+        err = do_shm_unlink(name);
+        kfree(name);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        } else return err;
+}
+
+static int sys_munmap(munmap_args_t *args)
+{
+        munmap_args_t           kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(munmap_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_munmap(kargs.addr, kargs.len);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+static int sys_msync(msync_args_t *args)
+{
+        msync_args_t            kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(msync_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_msync(kargs.addr, kargs.len, kargs.flags);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+static int sys_madvise(madvise_args_t *args)
+{
+        madvise_args_t          kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(madvise_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_madvise(kargs.addr, kargs.len, kargs.advice);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+/*
+ * mlock and munlock take the same arguments as munmap.
+ */
+static int sys_mlock(munmap_args_t *args)
+{
+        munmap_args_t           kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(munmap_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_mlock(kargs.addr, kargs.len);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+static int sys_munlock(munmap_args_t *args)
+{
+        munmap_args_t           kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(munmap_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_munlock(kargs.addr, kargs.len);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+static void *sys_mmap(mmap_args_t *arg)
+{
+        mmap_args_t             kargs;
+        void                    *ret;
+        int                     err;
+
+        if (copy_from_user(&kargs, arg, sizeof(mmap_args_t)) < 0) {
+                curthr->kt_errno = EFAULT;
+                return MAP_FAILED;
+        }
 
         err = do_mmap(kargs.mma_addr, kargs.mma_len, kargs.mma_prot,
                       kargs.mma_flags, kargs.mma_fd, kargs.mma_off, &ret);
@@ -584,139 +1001,975 @@ static void *sys_mmap(mmap_args_t *arg)
                 curthr->kt_errno = -err;
                 return MAP_FAILED;
         }
-        return ret;
+        return ret;
+}
+
+
+static pid_t sys_waitpid(waitpid_args_t *args)
+{
+        int s, p;
+        waitpid_args_t kargs;
+
+        if (0 > copy_from_user(&kargs, args, sizeof(kargs))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        if (0 > (p = do_waitpid(kargs.wpa_pid, kargs.wpa_options, &s))) {
+                curthr->kt_errno = -p;
+                return -1;
+        }
+
+        if (NULL != kargs.wpa_status && 0 > copy_to_user(kargs.wpa_status, &s, sizeof(int))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        return p;
+}
+
+static void *sys_brk(void *addr)
+{
+        void *ret;
+        int err;
+
+        if (0 == (err = do_brk(addr, &ret))) {
+                return ret;
+        } else {
+                curthr->kt_errno = -err;
+                return (void *) - 1;
+        }
+}
+
+static void sys_sync(void)
+{
+        pframe_clean_all();
+}
+
+static int sys_fsync(int fd)
+{
+        int err;
+
+        if ((err = do_fsync(fd, 0)) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        } else return err;
+}
+
+static int sys_fdatasync(int fd)
+{
+        int err;
+
+        if ((err = do_fsync(fd, 1)) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        } else return err;
+}
+
+static int sys_fadvise(fadvise_args_t *arg)
+{
+        fadvise_args_t kern_args;
+        int err;
+
+        if ((err = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+
+        if ((err = do_fadvise(kern_args.fd, kern_args.offset, kern_args.len,
+                              kern_args.advice)) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        } else return err;
+}
+
+static int sys_fallocate(fallocate_args_t *arg)
+{
+        fallocate_args_t kern_args;
+        int err;
+
+        if ((err = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+
+        if ((err = do_fallocate(kern_args.fd, kern_args.mode, kern_args.offset,
+                                kern_args.len)) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        } else return err;
+}
+
+/*
+ * As sys_getdents, for do_getdents_plus and dirent_plus_ts.
+ */
+static int
+sys_getdents_plus(getdents_plus_args_t *arg)
+{
+    getdents_plus_args_t kern_args;
+    int err;
+
+    if ((err = copy_from_user(&kern_args, arg, sizeof(getdents_plus_args_t))) < 0) {
+        curthr->kt_errno = -err;
+        return -1;
+    }
+
+    dirent_plus_t *dirents = page_alloc();
+    if (dirents == NULL) {
+        curthr->kt_errno = ENOMEM;
+        return -1;
+    }
+    size_t maxdir = kern_args.count / sizeof(dirent_plus_t);
+    size_t batch = PAGE_SIZE / sizeof(dirent_plus_t);
+
+    int total_read = 0;
+    while (maxdir > 0) {
+        int n = do_getdents_plus(kern_args.fd, dirents, MIN(maxdir, batch));
+        if (n < 0) {
+            page_free(dirents);
+            curthr->kt_errno = -n;
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        char *uaddr = (char *)kern_args.dirp + total_read;
+        err = copy_to_user(uaddr, dirents, n * sizeof(dirent_plus_t));
+        if (err < 0) {
+            page_free(dirents);
+            curthr->kt_errno = -err;
+            return -1;
+        }
+
+        total_read += n * sizeof(dirent_plus_t);
+        maxdir -= n;
+    }
+    page_free(dirents);
+
+    return total_read;
+}
+
+static void sys_halt(void)
+{
+        proc_kill_all();
+}
+
+static int sys_stat(stat_args_t *arg)
+{
+        stat_args_t kern_args;
+        struct stat buf;
+        char *path;
+        int ret;
+
+        if (copy_from_user(&kern_args, arg, sizeof(kern_args)) < 0) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        if ((path = user_strdup(&kern_args.path)) == NULL) {
+                curthr->kt_errno = EINVAL;
+                return -1;
+        }
+
+        ret = do_stat(path, &buf);
+
+        if (ret == 0) {
+                ret = copy_to_user(kern_args.buf, &buf, sizeof(struct stat));
+        }
+
+        if (ret != 0) {
+                kfree(path);
+                curthr->kt_errno = -ret;
+                return -1;
+        }
+
+        kfree(path);
+        return 0;
+}
+
+static int sys_fstatat(fstatat_args_t *arg)
+{
+        fstatat_args_t kern_args;
+        struct stat buf;
+        char *path;
+        int ret;
+
+        if (copy_from_user(&kern_args, arg, sizeof(kern_args)) < 0) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        if ((path = user_strdup(&kern_args.path)) == NULL) {
+                curthr->kt_errno = EINVAL;
+                return -1;
+        }
+
+        ret = do_fstatat(kern_args.dirfd, path, &buf);
+        kfree(path);
+
+        if (ret == 0) {
+                ret = copy_to_user(kern_args.buf, &buf, sizeof(struct stat));
+        }
+
+        if (ret != 0) {
+                curthr->kt_errno = -ret;
+                return -1;
+        }
+        return 0;
+}
+
+static int sys_pipe(int arg[2])
+{
+        int kern_args[2];
+        int ret;
+        
+        ret = do_pipe(kern_args);
+
+        if (ret == 0) {
+                ret = copy_to_user(arg, kern_args, sizeof(kern_args));
+        }
+
+        if (ret != 0) {
+                curthr->kt_errno = -ret;
+                return -1;
+        }
+        
+        return 0;
+}
+
+static int sys_socket(socket_args_t *arg)
+{
+        socket_args_t kern_args;
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        if ((ret = do_socket(kern_args.domain, kern_args.type, kern_args.protocol)) < 0) {
+                goto err;
+        }
+        return ret;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+/* Copies in the address of a socket call, which the family makes sense of */
+static int copy_sockaddr(struct sockaddr_storage *ss, const struct sockaddr *uaddr,
+                         uint32_t len)
+{
+        if (len > sizeof(*ss)) {
+                return -EINVAL;
+        }
+        return copy_from_user(ss, uaddr, len);
+}
+
+/* Copies out what fits in room bytes of an address a call returned, and
+ * its whole length, len, to *ulen */
+static int copy_sockaddr_out(struct sockaddr *uaddr, uint32_t *ulen,
+                             const struct sockaddr_storage *ss, uint32_t room,
+                             uint32_t len)
+{
+        int ret;
+
+        if ((ret = copy_to_user(uaddr, ss, MIN(room, len))) < 0) {
+                return ret;
+        }
+        return copy_to_user(ulen, &len, sizeof(len));
+}
+
+static int sys_socketpair(socketpair_args_t *arg)
+{
+        socketpair_args_t kern_args;
+        int sv[2];
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        if ((ret = do_socketpair(kern_args.domain, kern_args.type,
+                                 kern_args.protocol, sv)) < 0) {
+                goto err;
+        }
+        if ((ret = copy_to_user(kern_args.sv, sv, sizeof(sv))) < 0) {
+                /* the descriptors are already the process's */
+                goto err;
+        }
+        return 0;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+static int sys_bind(bind_args_t *arg)
+{
+        bind_args_t kern_args;
+        struct sockaddr_storage ss;
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        if ((ret = copy_sockaddr(&ss, kern_args.addr, kern_args.addrlen)) < 0) {
+                goto err;
+        }
+        if ((ret = do_bind(kern_args.fd, (struct sockaddr *)&ss, kern_args.addrlen)) < 0) {
+                goto err;
+        }
+        return 0;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+static int sys_listen(listen_args_t *arg)
+{
+        listen_args_t kern_args;
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        if ((ret = do_listen(kern_args.fd, kern_args.backlog)) < 0) {
+                goto err;
+        }
+        return 0;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+static int sys_accept(accept_args_t *arg)
+{
+        accept_args_t kern_args;
+        struct sockaddr_storage ss;
+        uint32_t room = 0, len = sizeof(ss);
+        int ret, fd;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        if (NULL != kern_args.addr
+            && (ret = copy_from_user(&room, kern_args.addrlen, sizeof(room))) < 0) {
+                goto err;
+        }
+        if ((fd = do_accept(kern_args.fd, (NULL != kern_args.addr)
+                            ? (struct sockaddr *)&ss : NULL, &len)) < 0) {
+                ret = fd;
+                goto err;
+        }
+        if (NULL != kern_args.addr
+            && (ret = copy_sockaddr_out(kern_args.addr, kern_args.addrlen,
+                                        &ss, room, len)) < 0) {
+                goto err;
+        }
+        return fd;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+static int sys_connect(connect_args_t *arg)
+{
+        connect_args_t kern_args;
+        struct sockaddr_storage ss;
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        if ((ret = copy_sockaddr(&ss, kern_args.addr, kern_args.addrlen)) < 0) {
+                goto err;
+        }
+        if ((ret = do_connect(kern_args.fd, (struct sockaddr *)&ss, kern_args.addrlen)) < 0) {
+                goto err;
+        }
+        return 0;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+/* No flags are supported; the data is copied straight from the user's
+ * buffer, into the page a datagram is sent in or whatever the family keeps
+ * a stream in, if the family does not take it from there itself */
+static int sys_sendto(sendto_args_t *arg)
+{
+        sendto_args_t kern_args;
+        struct sockaddr_storage ss;
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        if (0 != kern_args.flags) {
+                ret = -EINVAL;
+                goto err;
+        }
+        if (NULL != kern_args.to
+            && (ret = copy_sockaddr(&ss, kern_args.to, kern_args.tolen)) < 0) {
+                goto err;
+        }
+        if ((ret = do_sendto(kern_args.fd, kern_args.buf, kern_args.len,
+                             (NULL != kern_args.to) ? (struct sockaddr *)&ss : NULL,
+                             kern_args.tolen)) < 0) {
+                goto err;
+        }
+        return ret;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+/* and straight to the user's buffer */
+static int sys_recvfrom(recvfrom_args_t *arg)
+{
+        recvfrom_args_t kern_args;
+        struct sockaddr_storage ss;
+        uint32_t room = 0, len = sizeof(ss);
+        int ret, n;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        if (0 != kern_args.flags) {
+                ret = -EINVAL;
+                goto err;
+        }
+        if (NULL != kern_args.from
+            && (ret = copy_from_user(&room, kern_args.fromlen, sizeof(room))) < 0) {
+                goto err;
+        }
+        if ((n = do_recvfrom(kern_args.fd, kern_args.buf, kern_args.len,
+                             (NULL != kern_args.from) ? (struct sockaddr *)&ss : NULL,
+                             &len)) < 0) {
+                ret = n;
+                goto err;
+        }
+        if (NULL != kern_args.from
+            && (ret = copy_sockaddr_out(kern_args.from, kern_args.fromlen,
+                                        &ss, room, len)) < 0) {
+                goto err;
+        }
+        return n;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+static int sys_poll(poll_args_t *arg)
+{
+        poll_args_t kern_args;
+        struct pollfd *fds = NULL;
+        int nready;
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        if (kern_args.nfds > NFILES) {
+                ret = -EINVAL;
+                goto err;
+        }
+        if (0 < kern_args.nfds) {
+                if (NULL == (fds = kmalloc(kern_args.nfds * sizeof(*fds)))) {
+                        ret = -ENOMEM;
+                        goto err;
+                }
+                if ((ret = copy_from_user(fds, kern_args.fds,
+                                          kern_args.nfds * sizeof(*fds))) < 0) {
+                        goto err;
+                }
+        }
+
+        if ((nready = do_poll(fds, kern_args.nfds, kern_args.timeout)) < 0) {
+                ret = nready;
+                goto err;
+        }
+        if ((ret = copy_to_user(kern_args.fds, fds,
+                                kern_args.nfds * sizeof(*fds))) < 0) {
+                goto err;
+        }
+        if (NULL != fds) {
+                kfree(fds);
+        }
+        return nready;
+err:
+        if (NULL != fds) {
+                kfree(fds);
+        }
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+static int sys_epoll_create(int size)
+{
+        int ret = do_epoll_create(size);
+
+        if (ret < 0) {
+                curthr->kt_errno = -ret;
+                return -1;
+        }
+        return ret;
+}
+
+static int sys_epoll_ctl(epoll_ctl_args_t *arg)
+{
+        epoll_ctl_args_t kern_args;
+        struct epoll_event event;
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        /* the event is ignored for EPOLL_CTL_DEL, and may be NULL */
+        if (EPOLL_CTL_DEL != kern_args.op
+            && (ret = copy_from_user(&event, kern_args.event, sizeof(event))) < 0) {
+                goto err;
+        }
+
+        if ((ret = do_epoll_ctl(kern_args.epfd, kern_args.op, kern_args.fd, &event)) < 0) {
+                goto err;
+        }
+        return 0;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+static int sys_epoll_wait(epoll_wait_args_t *arg)
+{
+        epoll_wait_args_t kern_args;
+        struct epoll_event events[POLL_MAX_FDS];
+        int n;
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+
+        /* returning fewer than asked for is always allowed */
+        if ((n = do_epoll_wait(kern_args.epfd, events, MIN(kern_args.maxevents, POLL_MAX_FDS),
+                               kern_args.timeout)) < 0) {
+                ret = n;
+                goto err;
+        }
+        if ((ret = copy_to_user(kern_args.events, events, n * sizeof(*events))) < 0) {
+                goto err;
+        }
+        return n;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+static int sys_uring_setup(uring_setup_args_t *arg)
+{
+        uring_setup_args_t kern_args;
+        struct uring_params params;
+        int fd;
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        if ((fd = do_uring_setup(kern_args.entries, kern_args.buflen, &params)) < 0) {
+                ret = fd;
+                goto err;
+        }
+        if ((ret = copy_to_user(kern_args.params, &params, sizeof(params))) < 0) {
+                do_close(fd);
+                goto err;
+        }
+        return fd;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+static int sys_uring_enter(uring_enter_args_t *arg)
+{
+        uring_enter_args_t kern_args;
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        if ((ret = do_uring_enter(kern_args.fd, kern_args.to_submit,
+                                  kern_args.min_complete)) < 0) {
+                goto err;
+        }
+        return ret;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+/* libc reads the vdso page instead; this is for programs which trap */
+static int sys_uname(struct utsname *arg)
+{
+        int ret = copy_to_user(arg, vdso_uname(), sizeof(*arg));
+        if (ret != 0) {
+                curthr->kt_errno = -ret;
+                return -1;
+        }
+        return 0;
+}
+
+/*
+ * Sleeps for at least the requested time, rounded up to a whole
+ * millisecond. The only way to be interrupted is to be cancelled, and a
+ * cancelled thread never gets back to userland, so rem is never written.
+ */
+static int sys_nanosleep(nanosleep_args_t *arg)
+{
+        nanosleep_args_t kern_args;
+        struct timespec req;
+        uint32_t msecs;
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        if ((ret = copy_from_user(&req, kern_args.req, sizeof(req))) < 0) {
+                goto err;
+        }
+        if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+                ret = -EINVAL;
+                goto err;
+        }
+
+        /* Deadlines are compared as signed 32 bit msec differences */
+        if ((uint32_t)req.tv_sec >= INT_MAX / 1000) {
+                msecs = INT_MAX;
+        } else {
+                msecs = req.tv_sec * 1000 + (req.tv_nsec + 999999) / 1000000;
+        }
+
+        if ((ret = timer_sleep(msecs)) < 0) {
+                goto err;
+        }
+        return 0;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+/*
+ * There is no clock of the day, only the time since boot, which comes
+ * from time_now_ns and so has better than millisecond resolution.
+ */
+static int sys_clock_gettime(clock_gettime_args_t *arg)
+{
+        clock_gettime_args_t kern_args;
+        struct timespec ts;
+        uint64_t ns;
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        if (CLOCK_MONOTONIC != kern_args.clk) {
+                ret = -EINVAL;
+                goto err;
+        }
+
+        ns = time_now_ns();
+        ts.tv_sec = (time_t)(ns / 1000000000);
+        ts.tv_nsec = (long)(ns % 1000000000);
+        if ((ret = copy_to_user(kern_args.tp, &ts, sizeof(ts))) < 0) {
+                goto err;
+        }
+        return 0;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+/*
+ * Copies out the stats of the first count system calls, returning how
+ * many there were; buf is indexed by number, and the numbers with no
+ * system call are left zeroed.
+ */
+static int sys_syscall_stats(syscall_stats_args_t *arg)
+{
+        syscall_stats_args_t kern_args;
+        struct syscall_stat st;
+        int ret, i;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        for (i = 0; i < kern_args.count && 0 == syscall_stats_get(i, &st); i++) {
+                if ((ret = copy_to_user(&kern_args.buf[i], &st, sizeof(st))) < 0) {
+                        goto err;
+                }
+        }
+        return i;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
 }
 
-
-static pid_t sys_waitpid(waitpid_args_t *args)
+/*
+ * Everything is gathered before any of it is copied out, since copying
+ * may sleep, and processes may come and go meanwhile.
+ */
+static int sys_proc_stats(proc_stats_args_t *arg)
 {
-        int s, p;
-        waitpid_args_t kargs;
+        proc_stats_args_t kern_args;
+        struct proc_stat *st;
+        proc_t *p;
+        int ret, n = 0, i = 0;
 
-        if (0 > copy_from_user(&kargs, args, sizeof(kargs))) {
-                curthr->kt_errno = EFAULT;
-                return -1;
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
         }
-
-        if (0 > (p = do_waitpid(kargs.wpa_pid, kargs.wpa_options, &s))) {
-                curthr->kt_errno = -p;
-                return -1;
+        if (kern_args.count < 0) {
+                ret = -EINVAL;
+                goto err;
+        }
+        rcu_read_lock();
+        list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+                n++;
+        } list_iterate_end();
+        rcu_read_unlock();
+        n = MIN(n, kern_args.count);
+        if (0 == n) {
+                return 0;
+        }
+        if (NULL == (st = kmalloc(n * sizeof(*st)))) {
+                ret = -ENOMEM;
+                goto err;
         }
 
-        if (NULL != kargs.wpa_status && 0 > copy_to_user(kargs.wpa_status, &s, sizeof(int))) {
-                curthr->kt_errno = EFAULT;
-                return -1;
+        rcu_read_lock();
+        list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+                if (i < n) {
+                        proc_stat_get(p, &st[i++]);
+                }
+        } list_iterate_end();
+        rcu_read_unlock();
+        ret = copy_to_user(kern_args.buf, st, n * sizeof(*st));
+        kfree(st);
+        if (ret < 0) {
+                goto err;
         }
+        return n;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
 
-        return p;
+/* As for proc_stats, the census is taken before any of it is copied out */
+static int sys_kmem_census(kmem_census_args_t *arg)
+{
+        kmem_census_args_t kern_args;
+        char *buf;
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        kern_args.len = MIN(kern_args.len, KMEM_CENSUS_MAX);
+        if (0 == kern_args.len) {
+                return 0;
+        }
+        if (NULL == (buf = kmalloc(kern_args.len))) {
+                ret = -ENOMEM;
+                goto err;
+        }
+        kmem_census(NULL, buf, kern_args.len);
+        kern_args.len = strnlen(buf, kern_args.len);
+        ret = copy_to_user(kern_args.buf, buf, kern_args.len);
+        kfree(buf);
+        if (ret < 0) {
+                goto err;
+        }
+        return kern_args.len;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
 }
 
-static void *sys_brk(void *addr)
+static int sys_ioprio_set(ioprio_set_args_t *arg)
 {
-        void *ret;
+        ioprio_set_args_t kern_args;
         int err;
 
-        if (0 == (err = do_brk(addr, &ret))) {
-                return ret;
-        } else {
+        if ((err = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
                 curthr->kt_errno = -err;
-                return (void *) - 1;
+                return -1;
         }
-}
 
-static void sys_sync(void)
-{
-        pframe_clean_all();
+        if ((err = do_ioprio_set(kern_args.pid, kern_args.ioclass)) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        } else return err;
 }
 
-static void sys_halt(void)
+static int sys_ioprio_get(int pid)
 {
-        proc_kill_all();
+        int ret;
+
+        if ((ret = do_ioprio_get(pid)) < 0) {
+                curthr->kt_errno = -ret;
+                return -1;
+        } else return ret;
 }
 
-static int sys_stat(stat_args_t *arg)
+static int sys_sched_setaffinity(sched_setaffinity_args_t *arg)
 {
-        stat_args_t kern_args;
-        struct stat buf;
-        char *path;
-        int ret;
+        sched_setaffinity_args_t kern_args;
+        int err;
 
-        if (copy_from_user(&kern_args, arg, sizeof(kern_args)) < 0) {
-                curthr->kt_errno = EFAULT;
+        if ((err = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                curthr->kt_errno = -err;
                 return -1;
         }
 
-        if ((path = user_strdup(&kern_args.path)) == NULL) {
-                curthr->kt_errno = EINVAL;
+        if ((err = do_sched_setaffinity(kern_args.pid, kern_args.mask)) < 0) {
+                curthr->kt_errno = -err;
                 return -1;
-        }
+        } else return err;
+}
 
-        ret = do_stat(path, &buf);
+static int sys_sched_getaffinity(sched_getaffinity_args_t *arg)
+{
+        sched_getaffinity_args_t kern_args;
+        uint32_t mask;
+        int err;
 
-        if (ret == 0) {
-                ret = copy_to_user(kern_args.buf, &buf, sizeof(struct stat));
+        if ((err = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
         }
 
-        if (ret != 0) {
-                kfree(path);
-                curthr->kt_errno = -ret;
+        if ((err = do_sched_getaffinity(kern_args.pid, &mask)) < 0
+            || (err = copy_to_user(kern_args.mask, &mask, sizeof(mask))) < 0) {
+                curthr->kt_errno = -err;
                 return -1;
         }
-
-        kfree(path);
         return 0;
 }
 
-static int sys_pipe(int arg[2])
+static int sys_getrusage(getrusage_args_t *arg)
 {
-        int kern_args[2];
+        getrusage_args_t kern_args;
+        struct rusage ru;
         int ret;
-        
-        ret = do_pipe(kern_args);
-
-        if (ret == 0) {
-                ret = copy_to_user(arg, kern_args, sizeof(kern_args));
-        }
 
-        if (ret != 0) {
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0
+            || (ret = do_getrusage(kern_args.who, &ru)) < 0
+            || (ret = copy_to_user(kern_args.ru, &ru, sizeof(ru))) < 0) {
                 curthr->kt_errno = -ret;
                 return -1;
         }
-        
         return 0;
 }
 
-static int sys_uname(struct utsname *arg)
+#ifdef __MTP__
+static int sys_thr_create(thr_create_args_t *arg, regs_t *regs)
 {
-        static const char sysname[] = "Weenix";
-        static const char release[] = "1.2";
-        /* Version = last compilation time */
-        static const char version[] = "#1 " __DATE__ " " __TIME__;
-        static const char nodename[] = "";
-        static const char machine[] = "";
-        int ret = 0;
+        thr_create_args_t kern_args;
+        int ret;
 
-        ret = copy_to_user(arg->sysname, sysname, sizeof(sysname));
-        if (ret != 0) {
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
                 goto err;
         }
-        ret = copy_to_user(arg->release, release, sizeof(release));
-        if (ret != 0) {
+        if ((ret = do_thr_create(regs, (uintptr_t)kern_args.tca_eip,
+                                 (uintptr_t)kern_args.tca_esp)) < 0) {
                 goto err;
         }
-        ret = copy_to_user(arg->version, version, sizeof(version));
-        if (ret != 0) {
+        return ret;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+static int sys_thr_join(thr_join_args_t *arg)
+{
+        thr_join_args_t kern_args;
+        kthread_t *kthr;
+        void *retval;
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
                 goto err;
         }
-        ret = copy_to_user(arg->nodename, nodename, sizeof(nodename));
-        if (ret != 0) {
+        if (NULL == (kthr = kthread_lookup(kern_args.tja_tid))) {
+                ret = -ESRCH;
                 goto err;
         }
-        ret = copy_to_user(arg->machine, machine, sizeof(machine));
-        if (ret != 0) {
+        if ((ret = kthread_join(kthr, &retval)) < 0) {
                 goto err;
         }
+        if (NULL != kern_args.tja_retval) {
+                ret = copy_to_user(kern_args.tja_retval, &retval, sizeof(retval));
+                if (ret < 0) {
+                        goto err;
+                }
+        }
+        return 0;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
+static int sys_thr_detach(int tid)
+{
+        kthread_t *kthr;
+        int ret;
+
+        if (NULL == (kthr = kthread_lookup(tid))) {
+                ret = -ESRCH;
+        } else {
+                ret = kthread_detach(kthr);
+        }
+        if (ret < 0) {
+                curthr->kt_errno = -ret;
+                return -1;
+        }
+        return 0;
+}
+
+static int sys_thr_cancel(int tid)
+{
+        kthread_t *kthr;
+
+        if (NULL == (kthr = kthread_lookup(tid)) || KT_EXITED == kthr->kt_state) {
+                curthr->kt_errno = ESRCH;
+                return -1;
+        }
+        /* same value as PTHREAD_CANCELED */
+        kthread_cancel(kthr, (void *) -1);
         return 0;
+}
+#endif
+
+static int sys_futex(futex_args_t *arg)
+{
+        futex_args_t kern_args;
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        switch (kern_args.fa_op) {
+                case FUTEX_WAIT:
+                        ret = do_futex_wait(kern_args.fa_addr, kern_args.fa_val);
+                        break;
+                case FUTEX_WAKE:
+                        ret = do_futex_wake(kern_args.fa_addr, (int)kern_args.fa_val);
+                        break;
+                default:
+                        ret = -EINVAL;
+        }
+        if (ret < 0) {
+                goto err;
+        }
+        return ret;
 err:
         curthr->kt_errno = -ret;
         return -1;
@@ -732,20 +1985,53 @@ static int sys_fork(regs_t *regs)
         return ret;
 }
 
-static void free_vector(char **vect)
+static int sys_vfork(regs_t *regs)
+{
+        int ret = do_vfork(regs);
+        if (ret < 0) {
+                curthr->kt_errno = -ret;
+                return -1;
+        }
+        return ret;
+}
+
+/* Copies in the argstrs of uvec, but not the strings they point at, which
+ * exec copies straight into the new program's stack. */
+static int execvec_from_user(execvec_t *ev, const argvec_t *uvec)
 {
-        char **temp;
-        for (temp = vect; *temp; temp++)
-                kfree(*temp);
-        kfree(vect);
+        argstr_t *vec;
+        int err;
+
+        ev->ev_kvec = NULL;
+        ev->ev_uvec = NULL;
+        ev->ev_len = 0;
+        if (NULL == uvec->av_vec) {
+                return 0;
+        }
+        /* more than could fit on the new stack */
+        if (uvec->av_len > DEFAULT_STACK_SIZE / sizeof(char *)) {
+                return -E2BIG;
+        }
+
+        if (NULL == (vec = kmalloc((uvec->av_len + 1) * sizeof(argstr_t)))) {
+                return -ENOMEM;
+        }
+        if (0 > (err = copy_from_user(vec, uvec->av_vec,
+                                      uvec->av_len * sizeof(argstr_t)))) {
+                kfree(vec);
+                return err;
+        }
+        ev->ev_uvec = vec;
+        ev->ev_len = uvec->av_len;
+        return 0;
 }
 
 static int sys_execve(execve_args_t *args, regs_t *regs)
 {
         execve_args_t kern_args;
         char *kern_filename = NULL;
-        char **kern_argv = NULL;
-        char **kern_envp = NULL;
+        execvec_t kern_argv = { NULL, NULL, 0 };
+        execvec_t kern_envp = { NULL, NULL, 0 };
         int err;
 
         if ((err = copy_from_user(&kern_args, args, sizeof(kern_args))) < 0) {
@@ -757,29 +2043,24 @@ static int sys_execve(execve_args_t *args, regs_t *regs)
         if ((kern_filename = user_strdup(&kern_args.filename)) == NULL)
                 goto cleanup;
 
-        /* copy the argument list */
-        if (kern_args.argv.av_vec) {
-                if ((kern_argv = user_vecdup(&kern_args.argv)) == NULL)
-                        goto cleanup;
-        }
-
-        /* copy the environment list */
-        if (kern_args.envp.av_vec) {
-                if ((kern_envp = user_vecdup(&kern_args.envp)) == NULL)
-                        goto cleanup;
+        /* find the argument and environment lists */
+        if ((err = execvec_from_user(&kern_argv, &kern_args.argv)) < 0
+            || (err = execvec_from_user(&kern_envp, &kern_args.envp)) < 0) {
+                curthr->kt_errno = -err;
+                goto cleanup;
         }
 
-        err = do_execve(kern_filename, kern_argv, kern_envp, regs);
+        err = do_execve(kern_filename, &kern_argv, &kern_envp, regs);
 
         curthr->kt_errno = -err;
 
 cleanup:
         if (kern_filename)
                 kfree(kern_filename);
-        if (kern_argv)
-                free_vector(kern_argv);
-        if (kern_envp)
-                free_vector(kern_envp);
+        if (kern_argv.ev_uvec)
+                kfree((void *)kern_argv.ev_uvec);
+        if (kern_envp.ev_uvec)
+                kfree((void *)kern_envp.ev_uvec);
         if (curthr->kt_errno)
                 return -1;
         return 0;
@@ -833,145 +2114,330 @@ static void syscall_handler(regs_t *regs)
         uint32_t sysnum = (uint32_t) regs->r_eax;
         uint32_t args = (uint32_t) regs->r_edx;
 
-        dbg(DBG_SYSCALL, ">> pid %d, sysnum: %d (%x), arg: %d (%#08x)\n",
-            curproc->p_pid, sysnum, sysnum, args, args);
+        trace_emit(TRACE_SYSCALL_ENTER, sysnum, args, 0);
 
         if (curthr->kt_cancelled) {
-                dbg(DBG_SYSCALL, "trap: CANCELLING: thread %p of proc %d "
-                    "(0x%p)\n", curthr, curproc->p_pid, curproc);
+                tpdbg(DBG_SYSCALL, "trap: CANCELLING: thread %p of proc %d "
+                      "(0x%p)\n", curthr, curproc->p_pid, curproc);
 
                 kthread_exit(curthr->kt_retval);
         }
 
-        dbginfo(DBG_VMMAP, vmmap_mapping_info, curproc->p_vmmap);
+        tpdbginfo(DBG_VMMAP, vmmap_mapping_info, curproc->p_vmmap);
 
+        uint64_t start = time_now_ns();
         int ret = syscall_dispatch(sysnum, args, regs);
+        syscall_stats_record(sysnum, time_now_ns() - start);
 
         if (curthr->kt_cancelled) {
-                dbg(DBG_SYSCALL, "trap: CANCELLING: thread %p of proc %d "
-                    "(%p)\n", curthr, curproc->p_pid, curproc);
+                tpdbg(DBG_SYSCALL, "trap: CANCELLING: thread %p of proc %d "
+                      "(%p)\n", curthr, curproc->p_pid, curproc);
 
                 kthread_exit(curthr->kt_retval);
         }
 
-        dbg(DBG_SYSCALL, "<< pid %d, sysnum: %d (%x), returned: %d (%#x)\n",
-            curproc->p_pid, sysnum, sysnum, ret, ret);
+        trace_emit(TRACE_SYSCALL_EXIT, sysnum, ret, 0);
         regs->r_eax = ret; /* Return value goes in eax */
 }
 
-static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
-{
-        switch (sysnum) {
-                case SYS_waitpid:
-                        return sys_waitpid((waitpid_args_t *)args);
-
-                case SYS_exit:
-                        do_exit((int)args);
-                        panic("exit failed!\n");
-                        return 0;
-
-                case SYS_thr_exit:
-                        kthread_exit((void *)args);
-                        panic("thr_exit failed!\n");
-                        return 0;
-
-                case SYS_thr_yield:
-                        sched_make_runnable(curthr);
-                        sched_switch();
-                        return 0;
-
-                case SYS_fork:
-                        return sys_fork(regs);
-
-                case SYS_getpid:
-                        return curproc->p_pid;
-
-                case SYS_sync:
-                        sys_sync();
-                        return 0;
-
-#ifdef __MOUNTING__
-                case SYS_mount:
-                        return sys_mount((mount_args_t *) args);
-
-                case SYS_umount:
-                        return sys_umount((argstr_t *) args);
-#endif
-
-                case SYS_mmap:
-                        return (int) sys_mmap((mmap_args_t *) args);
-
-                case SYS_munmap:
-                        return sys_munmap((munmap_args_t *) args);
-
-                case SYS_open:
-                        return sys_open((open_args_t *) args);
-
-                case SYS_close:
-                        return sys_close((int)args);
-
-                case SYS_read:
-                        return sys_read((read_args_t *)args);
-
-                case SYS_write:
-                        return sys_write((write_args_t *)args);
-
-                case SYS_dup:
-                        return sys_dup((int)args);
-
-                case SYS_dup2:
-                        return sys_dup2((dup2_args_t *)args);
+/*
+ * The system call table. Each entry adapts one sys_* function to the
+ * common signature, taking the argument word from userland and the
+ * saved registers.
+ */
+typedef int (*syscall_func_t)(uint32_t args, regs_t *regs);
 
-                case SYS_mkdir:
-                        return sys_mkdir((mkdir_args_t *)args);
+#define SYSCALL(name, type)                                             \
+        static int sc_##name(uint32_t args, regs_t *regs)               \
+        {                                                               \
+                return (int)sys_##name((type)args);                     \
+        }
+#define SYSCALL_REGS(name, type)                                        \
+        static int sc_##name(uint32_t args, regs_t *regs)               \
+        {                                                               \
+                return sys_##name((type)args, regs);                    \
+        }
 
-                case SYS_rmdir:
-                        return sys_rmdir((argstr_t *)args);
+static int sc_exit(uint32_t args, regs_t *regs)
+{
+        do_exit((int)args);
+        panic("exit failed!\n");
+        return 0;
+}
 
-                case SYS_unlink:
-                        return sys_unlink((argstr_t *)args);
+static int sc_thr_exit(uint32_t args, regs_t *regs)
+{
+        kthread_exit((void *)args);
+        panic("thr_exit failed!\n");
+        return 0;
+}
 
-                case SYS_link:
-                        return sys_link((link_args_t *)args);
+static int sc_thr_yield(uint32_t args, regs_t *regs)
+{
+        sched_make_runnable(curthr);
+        sched_switch();
+        return 0;
+}
 
-                case SYS_rename:
-                        return sys_rename((rename_args_t *)args);
+static int sc_fork(uint32_t args, regs_t *regs)
+{
+        return sys_fork(regs);
+}
 
-                case SYS_chdir:
-                        return sys_chdir((argstr_t *)args);
+static int sc_vfork(uint32_t args, regs_t *regs)
+{
+        return sys_vfork(regs);
+}
 
-                case SYS_getdents:
-                        return sys_getdents((getdents_args_t *)args);
+static int sc_getpid(uint32_t args, regs_t *regs)
+{
+        return curproc->p_pid;
+}
 
-                case SYS_brk:
-                        return (int) sys_brk((void *)args);
+static int sc_sync(uint32_t args, regs_t *regs)
+{
+        sys_sync();
+        return 0;
+}
 
-                case SYS_lseek:
-                        return sys_lseek((lseek_args_t *)args);
+static int sc_halt(uint32_t args, regs_t *regs)
+{
+        sys_halt();
+        return -1;
+}
 
-                case SYS_halt:
-                        sys_halt();
-                        return -1;
+static int sc_set_errno(uint32_t args, regs_t *regs)
+{
+        curthr->kt_errno = (int)args;
+        return 0;
+}
 
-                case SYS_set_errno:
-                        curthr->kt_errno = (int)args;
-                        return 0;
+static int sc_errno(uint32_t args, regs_t *regs)
+{
+        return curthr->kt_errno;
+}
 
-                case SYS_errno:
-                        return curthr->kt_errno;
+SYSCALL(waitpid, waitpid_args_t *)
+SYSCALL(nanosleep, nanosleep_args_t *)
+SYSCALL(clock_gettime, clock_gettime_args_t *)
+SYSCALL(syscall_stats, syscall_stats_args_t *)
+SYSCALL(proc_stats, proc_stats_args_t *)
+SYSCALL(ioprio_set, ioprio_set_args_t *)
+SYSCALL(ioprio_get, int)
+SYSCALL(sched_setaffinity, sched_setaffinity_args_t *)
+SYSCALL(sched_getaffinity, sched_getaffinity_args_t *)
+SYSCALL(getrusage, getrusage_args_t *)
+SYSCALL(kmem_census, kmem_census_args_t *)
+#ifdef __MTP__
+SYSCALL_REGS(thr_create, thr_create_args_t *)
+SYSCALL(thr_join, thr_join_args_t *)
+SYSCALL(thr_detach, int)
+SYSCALL(thr_cancel, int)
+
+static int sc_gettid(uint32_t args, regs_t *regs)
+{
+        return curthr->kt_tid;
+}
+#endif
+SYSCALL(futex, futex_args_t *)
+#ifdef __MOUNTING__
+SYSCALL(mount, mount_args_t *)
+SYSCALL(umount, argstr_t *)
+#endif
+SYSCALL(mmap, mmap_args_t *)
+SYSCALL(munmap, munmap_args_t *)
+SYSCALL(msync, msync_args_t *)
+SYSCALL(madvise, madvise_args_t *)
+SYSCALL(mlock, munmap_args_t *)
+SYSCALL(munlock, munmap_args_t *)
+SYSCALL(shm_open, shm_open_args_t *)
+SYSCALL(shm_unlink, argstr_t *)
+SYSCALL(poll, poll_args_t *)
+SYSCALL(epoll_create, int)
+SYSCALL(epoll_ctl, epoll_ctl_args_t *)
+SYSCALL(epoll_wait, epoll_wait_args_t *)
+SYSCALL(uring_setup, uring_setup_args_t *)
+SYSCALL(uring_enter, uring_enter_args_t *)
+SYSCALL(open, open_args_t *)
+SYSCALL(close, int)
+SYSCALL(read, read_args_t *)
+SYSCALL(write, write_args_t *)
+SYSCALL(readv, rwv_args_t *)
+SYSCALL(writev, rwv_args_t *)
+SYSCALL(pread, pread_args_t *)
+SYSCALL(pwrite, pwrite_args_t *)
+SYSCALL(sendfile, sendfile_args_t *)
+SYSCALL(clone_file, clone_file_args_t *)
+SYSCALL(fsync, int)
+SYSCALL(fdatasync, int)
+SYSCALL(fadvise, fadvise_args_t *)
+SYSCALL(fallocate, fallocate_args_t *)
+SYSCALL(dup, int)
+SYSCALL(dup2, dup2_args_t *)
+SYSCALL(mkdir, mkdir_args_t *)
+SYSCALL(rmdir, argstr_t *)
+SYSCALL(unlink, argstr_t *)
+SYSCALL(link, link_args_t *)
+SYSCALL(rename, rename_args_t *)
+SYSCALL(chdir, argstr_t *)
+SYSCALL(getdents, getdents_args_t *)
+SYSCALL(getdents_plus, getdents_plus_args_t *)
+SYSCALL(brk, void *)
+SYSCALL(lseek, lseek_args_t *)
+SYSCALL(ioctl, ioctl_args_t *)
+SYSCALL_REGS(execve, execve_args_t *)
+SYSCALL(stat, stat_args_t *)
+SYSCALL(fstatat, fstatat_args_t *)
+SYSCALL(pipe, int *)
+SYSCALL(socket, socket_args_t *)
+SYSCALL(socketpair, socketpair_args_t *)
+SYSCALL(bind, bind_args_t *)
+SYSCALL(listen, listen_args_t *)
+SYSCALL(accept, accept_args_t *)
+SYSCALL(connect, connect_args_t *)
+SYSCALL(sendto, sendto_args_t *)
+SYSCALL(recvfrom, recvfrom_args_t *)
+SYSCALL(uname, struct utsname *)
+
+static const syscall_func_t syscall_table[] = {
+        [SYS_waitpid]    = sc_waitpid,
+        [SYS_exit]       = sc_exit,
+        [SYS_thr_exit]   = sc_thr_exit,
+        [SYS_thr_yield]  = sc_thr_yield,
+        [SYS_fork]       = sc_fork,
+        [SYS_vfork]      = sc_vfork,
+        [SYS_nanosleep]  = sc_nanosleep,
+        [SYS_clock_gettime] = sc_clock_gettime,
+        [SYS_syscall_stats] = sc_syscall_stats,
+        [SYS_proc_stats] = sc_proc_stats,
+        [SYS_ioprio_set] = sc_ioprio_set,
+        [SYS_ioprio_get] = sc_ioprio_get,
+        [SYS_sched_setaffinity] = sc_sched_setaffinity,
+        [SYS_sched_getaffinity] = sc_sched_getaffinity,
+        [SYS_getrusage]  = sc_getrusage,
+        [SYS_kmem_census] = sc_kmem_census,
+        [SYS_clone_file] = sc_clone_file,
+#ifdef __MTP__
+        [SYS_thr_create] = sc_thr_create,
+        [SYS_thr_join]   = sc_thr_join,
+        [SYS_thr_detach] = sc_thr_detach,
+        [SYS_thr_cancel] = sc_thr_cancel,
+        [SYS_gettid]     = sc_gettid,
+#endif
+        [SYS_futex]      = sc_futex,
+        [SYS_getpid]     = sc_getpid,
+        [SYS_sync]       = sc_sync,
+        [SYS_fsync]      = sc_fsync,
+        [SYS_fdatasync]  = sc_fdatasync,
+        [SYS_fadvise]    = sc_fadvise,
+        [SYS_fallocate]  = sc_fallocate,
+#ifdef __MOUNTING__
+        [SYS_mount]      = sc_mount,
+        [SYS_umount]     = sc_umount,
+#endif
+        [SYS_mmap]       = sc_mmap,
+        [SYS_munmap]     = sc_munmap,
+        [SYS_msync]      = sc_msync,
+        [SYS_madvise]    = sc_madvise,
+        [SYS_mlock]      = sc_mlock,
+        [SYS_munlock]    = sc_munlock,
+        [SYS_shm_open]   = sc_shm_open,
+        [SYS_shm_unlink] = sc_shm_unlink,
+        [SYS_poll]       = sc_poll,
+        [SYS_epoll_create] = sc_epoll_create,
+        [SYS_epoll_ctl]  = sc_epoll_ctl,
+        [SYS_epoll_wait] = sc_epoll_wait,
+        [SYS_uring_setup] = sc_uring_setup,
+        [SYS_uring_enter] = sc_uring_enter,
+        [SYS_open]       = sc_open,
+        [SYS_close]      = sc_close,
+        [SYS_read]       = sc_read,
+        [SYS_write]      = sc_write,
+        [SYS_readv]      = sc_readv,
+        [SYS_writev]     = sc_writev,
+        [SYS_pread]      = sc_pread,
+        [SYS_pwrite]     = sc_pwrite,
+        [SYS_sendfile]   = sc_sendfile,
+        [SYS_dup]        = sc_dup,
+        [SYS_dup2]       = sc_dup2,
+        [SYS_mkdir]      = sc_mkdir,
+        [SYS_rmdir]      = sc_rmdir,
+        [SYS_unlink]     = sc_unlink,
+        [SYS_link]       = sc_link,
+        [SYS_rename]     = sc_rename,
+        [SYS_chdir]      = sc_chdir,
+        [SYS_getdents]   = sc_getdents,
+        [SYS_getdents_plus] = sc_getdents_plus,
+        [SYS_brk]        = sc_brk,
+        [SYS_lseek]      = sc_lseek,
+        [SYS_ioctl]      = sc_ioctl,
+        [SYS_halt]       = sc_halt,
+        [SYS_set_errno]  = sc_set_errno,
+        [SYS_errno]      = sc_errno,
+        [SYS_execve]     = sc_execve,
+        [SYS_stat]       = sc_stat,
+        [SYS_fstatat]    = sc_fstatat,
+        [SYS_pipe]       = sc_pipe,
+        [SYS_socket]     = sc_socket,
+        [SYS_bind]       = sc_bind,
+        [SYS_listen]     = sc_listen,
+        [SYS_accept]     = sc_accept,
+        [SYS_connect]    = sc_connect,
+        [SYS_socketpair] = sc_socketpair,
+        [SYS_sendto]     = sc_sendto,
+        [SYS_recvfrom]   = sc_recvfrom,
+        [SYS_uname]      = sc_uname,
+};
+
+#define NSYSCALLS       (sizeof(syscall_table) / sizeof(syscall_table[0]))
+
+/* Calls made of each system call in the table, by number */
+static counter_t syscall_counters[NSYSCALLS];
+
+static void syscall_counters_init(void)
+{
+        counter_register_array(syscall_counters, NSYSCALLS, "syscall");
+}
 
-                case SYS_execve:
-                        return sys_execve((execve_args_t *)args, regs);
+/*
+ * Time spent in each of them, from syscall_handler. Only threads in
+ * system calls touch these, and nothing preempts the kernel, so they
+ * need no locking.
+ */
+static uint64_t syscall_ns[NSYSCALLS];
+static uint32_t syscall_hist[NSYSCALLS][SYSCALL_STAT_BUCKETS];
 
-                case SYS_stat:
-                        return sys_stat((stat_args_t *)args);
+static void syscall_stats_record(uint32_t sysnum, uint64_t ns)
+{
+        uint32_t b = 0;
+
+        if (sysnum >= NSYSCALLS)
+                return;
+        syscall_ns[sysnum] += ns;
+        while (b < SYSCALL_STAT_BUCKETS - 1 && (ns >> (b + 1)) != 0)
+                b++;
+        syscall_hist[sysnum][b]++;
+}
 
-                case SYS_pipe:
-                        return sys_pipe((int *)args);
+int syscall_stats_get(uint32_t sysnum, struct syscall_stat *st)
+{
+        if (sysnum >= NSYSCALLS)
+                return -EINVAL;
+        st->ss_calls = syscall_counters[sysnum].c_value;
+        st->ss_ns = syscall_ns[sysnum];
+        memcpy(st->ss_hist, syscall_hist[sysnum], sizeof(st->ss_hist));
+        return 0;
+}
 
-                case SYS_uname:
-                        return sys_uname((struct utsname *)args);
+static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
+{
+        if (sysnum < NSYSCALLS && NULL != syscall_table[sysnum]) {
+                counter_inc(&syscall_counters[sysnum]);
+                return syscall_table[sysnum](args, regs);
+        }
 
+        /* the debugging calls are numbered well away from the rest */
+        switch (sysnum) {
                 case SYS_debug:
                         return sys_debug((argstr_t *)args);
                 case SYS_kshell:
@@ -0,0 +1,165 @@
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/string.h"
+
+#include "mm/mm.h"
+#include "mm/mman.h"
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/pagetable.h"
+#include "mm/tlb.h"
+
+#include "vm/vmmap.h"
+
+#include "proc/proc.h"
+
+#include "api/vdso.h"
+
+/*
+ * The shared page is page 0 of vdso_obj, an object of one pinned page
+ * which is never freed; every address space maps it MAP_SHARED, so a
+ * store here is seen by all of them at once. The private page is plain
+ * anonymous memory mapped MAP_PRIVATE, so fork gives the child a copy of
+ * its own to put its pid in.
+ */
+static mmobj_t vdso_obj;
+static pframe_t *vdso_pf;
+
+#define vdso_data ((struct vdso_data *)vdso_pf->pf_addr)
+
+static void
+vdso_ref(mmobj_t *o)
+{
+        o->mmo_refcount++;
+}
+
+static void
+vdso_put(mmobj_t *o)
+{
+        /* vdso_init's reference is never dropped */
+        KASSERT(1 < o->mmo_refcount);
+        o->mmo_refcount--;
+}
+
+static int
+vdso_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
+{
+        if (0 != pagenum || forwrite) {
+                *pf = NULL;
+                return -EFAULT;
+        }
+        return pframe_get(o, pagenum, pf);
+}
+
+static int
+vdso_fillpage(mmobj_t *o, pframe_t *pf)
+{
+        page_zero(pf->pf_addr);
+        pframe_pin(pf);
+        return 0;
+}
+
+static int
+vdso_dirtypage(mmobj_t *o, pframe_t *pf)
+{
+        return 0;
+}
+
+static int
+vdso_cleanpage(mmobj_t *o, pframe_t *pf)
+{
+        return 0;
+}
+
+static mmobj_ops_t vdso_mmobj_ops = {
+        .ref = vdso_ref,
+        .put = vdso_put,
+        .lookuppage = vdso_lookuppage,
+        .fillpage  = vdso_fillpage,
+        .dirtypage = vdso_dirtypage,
+        .cleanpage = vdso_cleanpage
+};
+
+static __attribute__((unused)) void
+vdso_init(void)
+{
+        mmobj_init(&vdso_obj, &vdso_mmobj_ops);
+        vdso_obj.mmo_ops->ref(&vdso_obj);
+        int err = pframe_get(&vdso_obj, 0, &vdso_pf);
+        KASSERT(0 == err && "Ran out of memory while booting.");
+
+        struct utsname *uts = &vdso_data->vd_uts;
+        strncpy(uts->sysname, "Weenix", sizeof(uts->sysname));
+        strncpy(uts->release, "1.2", sizeof(uts->release));
+        /* Version = last compilation time */
+        strncpy(uts->version, "#1 " __DATE__ " " __TIME__, sizeof(uts->version));
+}
+init_func(vdso_init);
+
+int
+vdso_map(vmmap_t *map, pid_t pid)
+{
+        vmarea_t *vma;
+        int err;
+
+        /* An anonymous shared area whose object is then swapped for
+         * vdso_obj; it has no pages yet, so nothing is lost */
+        if (0 > (err = vmmap_map(map, NULL, ADDR_TO_PN(VDSO_DATA_ADDR), 1, PROT_READ,
+                                 MAP_SHARED | MAP_FIXED, 0, 0, &vma))) {
+                return err;
+        }
+        vmarea_obj_remove(vma);
+        vma->vma_obj->mmo_ops->put(vma->vma_obj);
+        vdso_obj.mmo_ops->ref(&vdso_obj);
+        vma->vma_obj = &vdso_obj;
+        vmarea_obj_insert(&vdso_obj, vma);
+
+        if (0 > (err = vmmap_map(map, NULL, ADDR_TO_PN(VDSO_PROC_ADDR), 1, PROT_READ,
+                                 MAP_PRIVATE | MAP_FIXED, 0, 0, NULL))) {
+                return err;
+        }
+        return vmmap_write(map, (void *)VDSO_PROC_ADDR, &pid, sizeof(pid));
+}
+
+int
+vdso_set_pid(vmmap_t *map, pid_t pid)
+{
+        /* Unless the process has unmapped it or mapped over it */
+        vmarea_t *vma = vmmap_lookup(map, ADDR_TO_PN(VDSO_PROC_ADDR));
+        if (NULL == vma || !(vma->vma_flags & MAP_PRIVATE)) {
+                return 0;
+        }
+
+        int err = vmmap_write(map, (void *)VDSO_PROC_ADDR, &pid, sizeof(pid));
+        if (0 > err) {
+                return err;
+        }
+
+        /* The write may have given map a copy of its own, which the page
+         * table has to find by faulting */
+        if (NULL != map->vmm_proc) {
+                pt_unmap_range(map->vmm_proc->p_pagedir, VDSO_PROC_ADDR,
+                               VDSO_PROC_ADDR + PAGE_SIZE);
+                tlb_flush_range(VDSO_PROC_ADDR, 1);
+        }
+        return 0;
+}
+
+void
+vdso_set_clock(uint32_t msecs)
+{
+        /* the timer may be running before vdso_init is */
+        if (NULL != vdso_pf) {
+                vdso_data->vd_msecs = msecs;
+        }
+}
+
+const struct utsname *
+vdso_uname(void)
+{
+        return &vdso_data->vd_uts;
+}
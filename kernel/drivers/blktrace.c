@@ -0,0 +1,72 @@
+#include "kernel.h"
+#include "types.h"
+#include "config.h"
+#include "errno.h"
+#include "globals.h"
+
+#include "util/string.h"
+#include "util/time.h"
+
+#include "drivers/blktrace.h"
+#include "drivers/blockdev.h"
+
+static blktrace_rec_t blktrace_buf[BLKTRACE_NRECS];
+static volatile uint32_t blktrace_next = 0;    /* records emitted so far */
+int blktrace_enabled = BLKTRACE_ENABLED;
+
+void
+blktrace_emit(devid_t dev, int action, pid_t pid, blocknum_t block,
+              uint32_t count, int write, int status, uint32_t depth)
+{
+        uint32_t i = 1;
+        blktrace_rec_t *r;
+
+        if (!blktrace_enabled)
+                return;
+
+        /* claimed as in trace_emit, so that interrupts get the next one */
+        __asm__ volatile("xaddl %0, %1"
+                         : "+r"(i), "+m"(blktrace_next)
+                         : : "memory", "cc");
+        r = &blktrace_buf[i & (BLKTRACE_NRECS - 1)];
+        r->bt_ns = time_now_ns();
+        r->bt_seq = i;
+        r->bt_block = block;
+        r->bt_count = (uint16_t)count;
+        r->bt_dev = (uint16_t)dev;
+        r->bt_pid = (int16_t)pid;
+        r->bt_action = (uint8_t)action;
+        r->bt_write = !!write;
+        r->bt_status = status;
+        r->bt_depth = depth;
+}
+
+void
+blktrace_issue(blockdev_t *dev, blocknum_t block, uint32_t count, int write)
+{
+        blktrace_emit(dev->bd_id, BLKTRACE_ISSUE, (NULL != curproc) ? curproc->p_pid : -1,
+                      block, count, write, 0, dev->bd_nqueued);
+}
+
+int
+blktrace_read(uint32_t offset, void *buf, uint32_t count)
+{
+        uint32_t seq = offset / sizeof(blktrace_rec_t);
+        uint32_t next = blktrace_next;
+        blktrace_rec_t *out = (blktrace_rec_t *)buf;
+        uint32_t n = 0;
+
+        if (0 != offset % sizeof(blktrace_rec_t) || count < sizeof(blktrace_rec_t))
+                return -EINVAL;
+
+        for (; seq < next && n < count / sizeof(blktrace_rec_t); seq++, n++) {
+                if (next - seq > BLKTRACE_NRECS) {
+                        memset(&out[n], 0, sizeof(out[n]));
+                        out[n].bt_seq = seq;
+                        out[n].bt_action = BLKTRACE_LOST;
+                } else {
+                        out[n] = blktrace_buf[seq & (BLKTRACE_NRECS - 1)];
+                }
+        }
+        return n * sizeof(blktrace_rec_t);
+}
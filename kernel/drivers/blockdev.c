@@ -1,13 +1,26 @@
 #include "kernel.h"
 #include "types.h"
+#include "globals.h"
 #include "util/debug.h"
 #include "util/list.h"
+#include "util/init.h"
 
+#include "main/interrupt.h"
+
+#include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+
+#include "drivers/blktrace.h"
 #include "drivers/blockdev.h"
+#include "drivers/disk/ahci.h"
 #include "drivers/disk/ata.h"
+#include "drivers/disk/raid.h"
+#include "drivers/disk/virtio_blk.h"
 
 #include "mm/pframe.h"
 #include "mm/mmobj.h"
+#include "mm/slab.h"
 
 static void blockdev_ref(mmobj_t *o);
 static void blockdev_put(mmobj_t *o);
@@ -16,30 +29,45 @@ static int blockdev_lookuppage(mmobj_t *o, uint32_t pagenum,
 static int blockdev_fillpage(mmobj_t *o, pframe_t *pf);
 static int blockdev_dirtypage(mmobj_t *o, pframe_t *pf);
 static int blockdev_cleanpage(mmobj_t *o, pframe_t *pf);
+static int blockdev_cleanpages(mmobj_t *o, pframe_t **pfs, int npages);
 
 static mmobj_ops_t blockdev_mmobj_ops = {
+        .type = MMOBJ_BLOCKDEV,
         .ref = blockdev_ref,
         .put = blockdev_put,
         .lookuppage = blockdev_lookuppage,
         .fillpage = blockdev_fillpage,
         .dirtypage = blockdev_dirtypage,
-        .cleanpage = blockdev_cleanpage
+        .cleanpage = blockdev_cleanpage,
+        .cleanpages = blockdev_cleanpages
 };
 
+/* Most dirty pages blockdev_cleanpages writes back at once */
+#define BLOCKDEV_FLUSH_BATCH BLOCKDEV_MAX_BATCH
+
 static list_t blockdevs;
 
+static slab_allocator_t *blockdev_req_allocator;
+
 void
 blockdev_init()
 {
         list_init(&blockdevs);
+        blockdev_req_allocator = slab_allocator_create("blockdev_req",
+                                                       sizeof(blockdev_req_t));
+        KASSERT(NULL != blockdev_req_allocator);
         /* Initialize all subsystems */
         ata_init();
+        virtio_blk_init();
+        ahci_init();
+        raid_init();
 }
 
 int
 blockdev_register(blockdev_t *dev)
 {
         blockdev_t *bd;
+        int i;
 
         /* Make sure dev, dev ops, and dev id not null */
         if (!dev
@@ -56,6 +84,25 @@ blockdev_register(blockdev_t *dev)
         /* Initialize its object here */
         mmobj_init(&dev->bd_mmobj, &blockdev_mmobj_ops);
 
+        /* And its request queue; the I/O thread is started later, once
+         * there are processes (see blockdev_iod_init) */
+        for (i = 0; i < IOPRIO_NCLASS; i++) {
+                list_init(&dev->bd_reqq[i]);
+                list_init(&dev->bd_fifo[i]);
+                dev->bd_served[i] = 0;
+        }
+        dev->bd_nqueued = 0;
+        dev->bd_ninflight = 0;
+        dev->bd_head = 0;
+        dev->bd_dispatches = 0;
+        list_init(&dev->bd_started);
+        dev->bd_nstarted = 0;
+        dev->bd_iodone = 0;
+        dev->bd_unflushed = 0;
+        sched_queue_init(&dev->bd_iowaitq);
+        sched_queue_class(&dev->bd_iowaitq, SCHED_WQ_DISK);
+        dev->bd_iothr = NULL;
+
         list_insert_tail(&blockdevs, &dev->bd_link);
         return 0;
 }
@@ -71,33 +118,475 @@ blockdev_lookup(devid_t id)
         return NULL;
 }
 
+/* ------------------------------------------------------------------ */
+/* ------------------------- REQUEST QUEUE -------------------------- */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Nothing here is touched from interrupt context but bd_iodone, and a
+ * request is taken off the queue before the driver (which may block) is
+ * called, so the queue needs no lock beyond the fact that kernel threads
+ * are not preempted. Transfers handed to a driver's start_blockv are
+ * completed by the I/O thread too, once the driver has said they are
+ * done.
+ */
+
+/* Whether dispatches start transfers rather than wait for them */
+#define blockdev_async(dev) \
+        (NULL != (dev)->bd_iothr && NULL != (dev)->bd_ops->start_blockv)
+
+void
+blockdev_req_init(blockdev_req_t *req, char *buf, blocknum_t loc,
+                  int write, blockdev_done_t callback, void *arg)
+{
+        KASSERT(PAGE_ALIGNED(buf));
+
+        req->br_blocknum = loc;
+        req->br_buf = buf;
+        req->br_write = write;
+        req->br_status = 0;
+        req->br_done = 0;
+        req->br_callback = callback;
+        req->br_arg = arg;
+        req->br_pid = -1;
+        req->br_class = 0;
+        req->br_age = 0;
+        req->br_nbatch = 0;
+        sched_queue_init(&req->br_waitq);
+        sched_queue_class(&req->br_waitq, SCHED_WQ_DISK);
+        list_link_init(&req->br_link);
+        list_link_init(&req->br_flink);
+}
+
+blockdev_req_t *
+blockdev_req_alloc(void)
+{
+        return (blockdev_req_t *)slab_obj_alloc(blockdev_req_allocator);
+}
+
+void
+blockdev_req_free(blockdev_req_t *req)
+{
+        KASSERT(!list_link_is_linked(&req->br_link));
+        slab_obj_free(blockdev_req_allocator, req);
+}
+
+/* Which of the bd_reqq queues requests of the current process go on */
+static int
+blockdev_cur_class(void)
+{
+        int ioclass = (NULL != curproc) ? curproc->p_ioprio : IOPRIO_CLASS_NONE;
+
+        if (IOPRIO_CLASS_NONE == ioclass)
+                ioclass = IOPRIO_CLASS_BE;
+        return ioclass - IOPRIO_CLASS_RT;
+}
+
+/*
+ * Choose the class to serve next, or -1 if none is to be served yet: a
+ * lower class which has gone too long without a turn, otherwise the
+ * highest with requests pending, except that idle requests wait while
+ * the I/O thread has others in flight.
+ */
+static int
+blockdev_elevator_class(blockdev_t *dev)
+{
+        static const uint32_t starve[IOPRIO_NCLASS] = {
+                0, BLOCKDEV_BE_STARVE, BLOCKDEV_IDLE_STARVE
+        };
+        int c;
+
+        for (c = IOPRIO_NCLASS - 1; c > 0; c--) {
+                if (!list_empty(&dev->bd_reqq[c])
+                    && dev->bd_dispatches - dev->bd_served[c] >= starve[c])
+                        return c;
+        }
+
+        for (c = 0; c < IOPRIO_NCLASS; c++) {
+                if (!list_empty(&dev->bd_reqq[c]))
+                        break;
+        }
+        if (IOPRIO_NCLASS == c)
+                return -1;
+        if (IOPRIO_CLASS_IDLE - IOPRIO_CLASS_RT == c
+            && NULL != dev->bd_iothr && 0 < dev->bd_ninflight)
+                return -1;
+        return c;
+}
+
+/*
+ * Choose the request of class c to serve next: the oldest one if it has
+ * missed its deadline, otherwise the first at or beyond the head in block
+ * order, wrapping around to the lowest block once there are none left
+ * ahead of the head (C-LOOK).
+ */
+static blockdev_req_t *
+blockdev_elevator_next(blockdev_t *dev, int c)
+{
+        blockdev_req_t *req;
+
+        KASSERT(!list_empty(&dev->bd_reqq[c]));
+
+        req = list_head(&dev->bd_fifo[c], blockdev_req_t, br_flink);
+        if (dev->bd_dispatches - req->br_age >= BLOCKDEV_DEADLINE)
+                return req;
+
+        list_iterate_begin(&dev->bd_reqq[c], req, blockdev_req_t, br_link) {
+                if (req->br_blocknum >= dev->bd_head)
+                        return req;
+        } list_iterate_end();
+
+        return list_head(&dev->bd_reqq[c], blockdev_req_t, br_link);
+}
+
+static void
+blockdev_req_complete(blockdev_t *dev, blockdev_req_t *req, int status)
+{
+        blktrace_emit(dev->bd_id, BLKTRACE_COMPLETE, req->br_pid, req->br_blocknum,
+                      1, req->br_write, status, dev->bd_nqueued);
+        req->br_status = status;
+        req->br_done = 1;
+        if (NULL != req->br_callback)
+                req->br_callback(req);
+        sched_broadcast_on(&req->br_waitq);
+}
+
+/*
+ * Complete the requests of a started transfer, which are on bd_started
+ * from req, its first, onwards.
+ */
+static void
+blockdev_started_complete(blockdev_t *dev, blockdev_req_t *req, int status)
+{
+        int i, n = req->br_nbatch;
+
+        if (req->br_write)
+                dev->bd_unflushed = 1;
+
+        for (i = 0; i < n; i++) {
+                list_link_t *next = req->br_link.l_next;
+                list_remove(&req->br_link);
+                blockdev_req_complete(dev, req, status);
+                if (i + 1 < n)
+                        req = list_item(next, blockdev_req_t, br_link);
+        }
+        dev->bd_ninflight -= n;
+        dev->bd_nstarted--;
+}
+
+/* Complete every transfer the driver has finished with */
+static void
+blockdev_reap(blockdev_t *dev)
+{
+        void *tag;
+        int status;
+
+        dev->bd_iodone = 0;
+        while (NULL != (tag = dev->bd_ops->reap_blockv(dev, &status)))
+                blockdev_started_complete(dev, (blockdev_req_t *)tag, status);
+}
+
+void
+blockdev_io_done(blockdev_t *dev)
+{
+        dev->bd_iodone = 1;
+        sched_wakeup_on(&dev->bd_iowaitq);
+}
+
+/* Whether there is a request to dispatch and the driver has room for it */
+static int
+blockdev_can_dispatch(blockdev_t *dev)
+{
+        return 0 <= blockdev_elevator_class(dev)
+               && (!blockdev_async(dev) || dev->bd_nstarted < dev->bd_qdepth);
+}
+
+/*
+ * Take the next request, together with any requests in the same direction
+ * for the blocks directly following it, off the queue and hand them to the
+ * driver as one call. If the driver can start transfers without waiting
+ * for them, the requests go on bd_started until it has completed them.
+ */
+static void
+blockdev_dispatch(blockdev_t *dev)
+{
+        blockdev_req_t *batch[BLOCKDEV_MAX_BATCH];
+        char *bufs[BLOCKDEV_MAX_BATCH];
+        blockdev_req_t *req;
+        int n = 0, i, ret, c;
+
+        c = blockdev_elevator_class(dev);
+        KASSERT(0 <= c);
+        req = blockdev_elevator_next(dev, c);
+        batch[n++] = req;
+        /* requests are sorted by block, so any mergeable ones follow */
+        while (n < BLOCKDEV_MAX_BATCH && req->br_link.l_next != &dev->bd_reqq[c]) {
+                blockdev_req_t *next = list_item(req->br_link.l_next,
+                                                 blockdev_req_t, br_link);
+                if (next->br_write != req->br_write
+                    || next->br_blocknum != req->br_blocknum + 1)
+                        break;
+                batch[n++] = req = next;
+        }
+
+        for (i = 0; i < n; i++) {
+                list_remove(&batch[i]->br_link);
+                list_remove(&batch[i]->br_flink);
+                bufs[i] = batch[i]->br_buf;
+        }
+        dev->bd_nqueued -= n;
+        dev->bd_ninflight += n;
+        dev->bd_head = batch[0]->br_blocknum + n;
+        dev->bd_dispatches++;
+        dev->bd_served[c] = dev->bd_dispatches;
+        blktrace_emit(dev->bd_id, BLKTRACE_DISPATCH, batch[0]->br_pid,
+                      batch[0]->br_blocknum, n, batch[0]->br_write, 0, dev->bd_nqueued);
+
+        if (blockdev_async(dev)) {
+                for (i = 0; i < n; i++)
+                        list_insert_tail(&dev->bd_started, &batch[i]->br_link);
+                batch[0]->br_nbatch = n;
+                dev->bd_nstarted++;
+                ret = dev->bd_ops->start_blockv(dev, bufs, batch[0]->br_blocknum, n,
+                                                batch[0]->br_write, batch[0]);
+                if (0 > ret)
+                        blockdev_started_complete(dev, batch[0], ret);
+                return;
+        }
+
+        if (1 == n) {
+                if (batch[0]->br_write)
+                        ret = dev->bd_ops->write_block(dev, bufs[0], batch[0]->br_blocknum, 1);
+                else
+                        ret = dev->bd_ops->read_block(dev, bufs[0], batch[0]->br_blocknum, 1);
+        } else if (batch[0]->br_write && NULL != dev->bd_ops->write_blockv) {
+                ret = dev->bd_ops->write_blockv(dev, bufs, batch[0]->br_blocknum, n);
+        } else if (!batch[0]->br_write && NULL != dev->bd_ops->read_blockv) {
+                ret = dev->bd_ops->read_blockv(dev, bufs, batch[0]->br_blocknum, n);
+        } else {
+                /* no scatter-gather support, the driver moves blocks one at
+                 * a time; each request gets its own status */
+                ret = 0;
+                for (i = 0; i < n; i++) {
+                        int err;
+                        if (batch[i]->br_write)
+                                err = dev->bd_ops->write_block(dev, bufs[i], batch[i]->br_blocknum, 1);
+                        else
+                                err = dev->bd_ops->read_block(dev, bufs[i], batch[i]->br_blocknum, 1);
+                        dev->bd_ninflight--;
+                        if (batch[i]->br_write)
+                                dev->bd_unflushed = 1;
+                        blockdev_req_complete(dev, batch[i], err);
+                }
+                return;
+        }
+
+        if (batch[0]->br_write)
+                dev->bd_unflushed = 1;
+        dev->bd_ninflight -= n;
+        for (i = 0; i < n; i++)
+                blockdev_req_complete(dev, batch[i], ret);
+}
+
+void
+blockdev_submit(blockdev_t *dev, blockdev_req_t *req)
+{
+        blockdev_req_t *r;
+        int c;
+
+        KASSERT(NULL != dev && NULL != req);
+        KASSERT(!req->br_done && !list_link_is_linked(&req->br_link));
+
+        /* writeback done by kernel threads is charged to their process */
+        if (NULL != curproc) {
+                req->br_pid = curproc->p_pid;
+                if (req->br_write) {
+                        curproc->p_io_wbytes += BLOCK_SIZE;
+                        curproc->p_io_wops++;
+                } else {
+                        curproc->p_io_rbytes += BLOCK_SIZE;
+                        curproc->p_io_rops++;
+                }
+        }
+        c = req->br_class = blockdev_cur_class();
+
+        /* a class's wait for a turn starts with its first request */
+        if (list_empty(&dev->bd_reqq[c]))
+                dev->bd_served[c] = dev->bd_dispatches;
+        req->br_age = dev->bd_dispatches;
+        list_insert_tail(&dev->bd_fifo[c], &req->br_flink);
+
+        /* keep bd_reqq sorted by block number, FIFO among equals */
+        list_iterate_reverse(&dev->bd_reqq[c], r, blockdev_req_t, br_link) {
+                if (r->br_blocknum <= req->br_blocknum) {
+                        list_insert_before(r->br_link.l_next, &req->br_link);
+                        goto inserted;
+                }
+        } list_iterate_end();
+        list_insert_head(&dev->bd_reqq[c], &req->br_link);
+inserted:
+        dev->bd_nqueued++;
+        blktrace_emit(dev->bd_id, BLKTRACE_QUEUE, req->br_pid, req->br_blocknum,
+                      1, req->br_write, 0, dev->bd_nqueued);
+
+        if (NULL != dev->bd_iothr) {
+                sched_wakeup_on(&dev->bd_iowaitq);
+        } else {
+                /* before the I/O thread is running (or after it has been
+                 * stopped) the submitter does the work itself */
+                while (0 < dev->bd_nqueued)
+                        blockdev_dispatch(dev);
+        }
+}
+
+int
+blockdev_wait(blockdev_req_t *req)
+{
+        while (!req->br_done)
+                sched_sleep_on(&req->br_waitq);
+        return req->br_status;
+}
+
+int
+blockdev_read(blockdev_t *dev, char *buf, blocknum_t loc)
+{
+        blockdev_req_t req;
+
+        blockdev_req_init(&req, buf, loc, 0, NULL, NULL);
+        blockdev_submit(dev, &req);
+        return blockdev_wait(&req);
+}
+
+int
+blockdev_write(blockdev_t *dev, const char *buf, blocknum_t loc)
+{
+        blockdev_req_t req;
+
+        blockdev_req_init(&req, (char *)buf, loc, 1, NULL, NULL);
+        blockdev_submit(dev, &req);
+        return blockdev_wait(&req);
+}
+
+int
+blockdev_flush(blockdev_t *dev)
+{
+        KASSERT(NULL != dev);
+
+        if (NULL == dev->bd_ops->flush || !dev->bd_unflushed)
+                return 0;
+        /* writes completing during the flush may not be covered by it */
+        dev->bd_unflushed = 0;
+        return dev->bd_ops->flush(dev);
+}
+
+void
+blockdev_sync(void)
+{
+        blockdev_t *bd;
+        int err;
+
+        /* an array is registered after the disks it is made of, so they
+         * have been flushed by the time it is, and it sends them nothing */
+        list_iterate_begin(&blockdevs, bd, blockdev_t, bd_link) {
+                if (0 > (err = blockdev_flush(bd)))
+                        dbg(DBG_DISK, "blockdev_sync: flushing device 0x%x failed (%d)\n",
+                            bd->bd_id, err);
+        } list_iterate_end();
+}
+
+/*
+ * Each block device gets a thread which drains its request queue, so
+ * that submitters can go on running while the disk works.
+ */
+static void *
+blockdev_iod_run(int arg1, void *arg2)
+{
+        blockdev_t *dev = (blockdev_t *)arg2;
+
+        while (1) {
+                uint8_t oldipl;
+
+                if (NULL != dev->bd_ops->reap_blockv)
+                        blockdev_reap(dev);
+                while (blockdev_can_dispatch(dev))
+                        blockdev_dispatch(dev);
+
+                /* a transfer completing between the checks and the sleep
+                 * would go unnoticed, so interrupts wait until it */
+                oldipl = intr_getipl();
+                intr_setipl(IPL_HIGH);
+                if (!dev->bd_iodone && !blockdev_can_dispatch(dev)
+                    && sched_cancellable_sleep_on(&dev->bd_iowaitq)) {
+                        intr_setipl(oldipl);
+                        kthread_exit((void *)0);
+                }
+                intr_setipl(oldipl);
+        }
+        return NULL;
+}
+
+static __attribute__((unused)) void
+blockdev_iod_init(void)
+{
+        blockdev_t *bd;
+
+        KASSERT(curproc && (PID_IDLE == curproc->p_pid)
+                && "should be calling this from idleproc");
+        list_iterate_begin(&blockdevs, bd, blockdev_t, bd_link) {
+                proc_t *p = proc_create("blockdevd");
+                KASSERT(NULL != p);
+                bd->bd_iothr = kthread_create(p, blockdev_iod_run, 0, bd);
+                KASSERT(NULL != bd->bd_iothr);
+                sched_make_runnable(bd->bd_iothr);
+        } list_iterate_end();
+}
+init_func(blockdev_iod_init);
+init_depends(sched_init);
+
+void
+blockdev_shutdown(void)
+{
+        blockdev_t *bd;
+
+        KASSERT(PID_IDLE == curproc->p_pid);
+        list_iterate_begin(&blockdevs, bd, blockdev_t, bd_link) {
+                kthread_t *thr = bd->bd_iothr;
+                pid_t pid, child;
+                if (NULL == thr)
+                        continue;
+                pid = thr->kt_proc->p_pid;
+                /* from here on submitters do their own I/O */
+                bd->bd_iothr = NULL;
+                KASSERT(0 == bd->bd_nqueued && 0 == bd->bd_ninflight);
+                kthread_cancel(thr, (void *)0);
+                child = do_waitpid(pid, 0, NULL);
+                KASSERT(pid == child);
+        } list_iterate_end();
+}
+
 /*
  * Clean and then free all resident pages belonging to this
- * particular block device.
- * As with pframe_clean_all, this is not guaranteed to terminate.
+ * particular block device. Only its dirty pages are visited, in block
+ * order, and adjacent ones are written back together so the driver can
+ * move them in one transfer.
  */
 void
 blockdev_flush_all(blockdev_t *dev)
 {
         pframe_t *pf;
+        uint32_t pn;
+        int err;
 
-        /* Clean all pages - see pframe_clean_all for
-         * explanation of this loop */
-clean:
-        list_iterate_begin(&dev->bd_mmobj.mmo_respages, pf,
-                           pframe_t, pf_olink) {
-                if (pframe_is_dirty(pf)) {
-                        pframe_clean(pf);
-                        goto clean;
-                }
-        } list_iterate_end();
+        /* Going in block order, the disk head sweeps across once */
+        if (0 > (err = pframe_clean_obj(&dev->bd_mmobj)))
+                dbg(DBG_DISK, "blockdev_flush_all: WARNING: failed to clean "
+                    "pages of device 0x%x: %d\n", dev->bd_id, err);
 
         /* Free all pages */
-        list_iterate_begin(&dev->bd_mmobj.mmo_respages, pf,
-                           pframe_t, pf_olink) {
+        for (pn = 0; NULL != (pf = pframe_next_resident(&dev->bd_mmobj, &pn)); pn++) {
                 KASSERT(!pframe_is_dirty(pf));
                 pframe_free(pf);
-        } list_iterate_end();
+        }
 }
 
 /* Implementation of mmobj entry points: */
@@ -122,7 +611,7 @@ blockdev_fillpage(mmobj_t *o, pframe_t *pf)
         /* Find the corresponding blockdev */
         blockdev_t *bd = CONTAINER_OF(pf->pf_obj, blockdev_t, bd_mmobj);
         /* And fill in the page by reading from it */
-        return bd->bd_ops->read_block(bd, pf->pf_addr, pf->pf_pagenum, 1);
+        return blockdev_read(bd, pf->pf_addr, pf->pf_pagenum);
 }
 
 /* block devices don't need to make use of this entry point: */
@@ -139,5 +628,28 @@ blockdev_cleanpage(mmobj_t *o, pframe_t *pf)
         /* Find the corresponding blockdev */
         blockdev_t *bd = CONTAINER_OF(pf->pf_obj, blockdev_t, bd_mmobj);
         /* Clean the corresponding page by writing it back */
-        return bd->bd_ops->write_block(bd, pf->pf_addr, pf->pf_pagenum, 1);
+        return blockdev_write(bd, pf->pf_addr, pf->pf_pagenum);
+}
+
+static int
+blockdev_cleanpages(mmobj_t *o, pframe_t **pfs, int npages)
+{
+        int i, ret, err = 0;
+        blockdev_req_t reqs[BLOCKDEV_FLUSH_BATCH];
+        blockdev_t *bd = CONTAINER_OF(o, blockdev_t, bd_mmobj);
+
+        KASSERT(0 < npages && npages <= BLOCKDEV_FLUSH_BATCH);
+
+        /* Queue all of the writes before waiting on any of them so the
+         * elevator can merge them into one transfer */
+        for (i = 0; i < npages; i++) {
+                blockdev_req_init(&reqs[i], pfs[i]->pf_addr, pfs[i]->pf_pagenum,
+                                  1, NULL, NULL);
+                blockdev_submit(bd, &reqs[i]);
+        }
+        for (i = 0; i < npages; i++) {
+                if ((ret = blockdev_wait(&reqs[i])) < 0)
+                        err = ret;
+        }
+        return err;
 }
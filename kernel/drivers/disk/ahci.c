@@ -0,0 +1,779 @@
+#include "kernel.h"
+#include "types.h"
+#include "errno.h"
+
+#include "main/interrupt.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/string.h"
+#include "util/counter.h"
+#include "util/trace.h"
+
+#include "drivers/blktrace.h"
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+#include "drivers/pci.h"
+#include "drivers/disk/ahci.h"
+
+#include "proc/sched.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+
+/* PCI class of an AHCI controller */
+#define AHCI_PCI_CLASS                  0x01
+#define AHCI_PCI_SUBCLASS               0x06
+#define AHCI_PCI_INTERFACE              0x01
+#define AHCI_PCI_ABAR                   5
+
+/* Generic host control registers, from the ABAR */
+#define HBA_CAP                         0x00
+#define HBA_GHC                         0x04
+#define HBA_IS                          0x08
+#define HBA_PI                          0x0c
+
+#define HBA_CAP_SNCQ                    BIT(30)
+#define HBA_CAP_NCS(cap)                ((((cap) >> 8) & 0x1f) + 1)
+#define HBA_GHC_AE                      0x80000000U
+#define HBA_GHC_IE                      BIT(1)
+
+/* Port registers, from the port's base */
+#define AHCI_PORT_BASE(port)            (0x100 + (port) * 0x80)
+#define AHCI_ABAR_SIZE                  AHCI_PORT_BASE(AHCI_MAX_PORTS)
+#define AHCI_MAX_PORTS                  32
+
+#define PX_CLB                          0x00
+#define PX_CLBU                         0x04
+#define PX_FB                           0x08
+#define PX_FBU                          0x0c
+#define PX_IS                           0x10
+#define PX_IE                           0x14
+#define PX_CMD                          0x18
+#define PX_TFD                          0x20
+#define PX_SIG                          0x24
+#define PX_SSTS                         0x28
+#define PX_SERR                         0x30
+#define PX_SACT                         0x34
+#define PX_CI                           0x38
+
+#define PX_CMD_ST                       BIT(0)
+#define PX_CMD_SUD                      BIT(1)
+#define PX_CMD_POD                      BIT(2)
+#define PX_CMD_FRE                      BIT(4)
+#define PX_CMD_FR                       BIT(14)
+#define PX_CMD_CR                       BIT(15)
+
+#define PX_IS_DHRS                      BIT(0)  /* D2H register FIS */
+#define PX_IS_SDBS                      BIT(3)  /* set device bits FIS (NCQ) */
+#define PX_IS_IFS                       BIT(27)
+#define PX_IS_HBDS                      BIT(28)
+#define PX_IS_HBFS                      BIT(29)
+#define PX_IS_TFES                      BIT(30)
+#define PX_IS_ERRORS    (PX_IS_IFS | PX_IS_HBDS | PX_IS_HBFS | PX_IS_TFES)
+
+#define PX_TFD_ERR                      BIT(0)
+#define PX_TFD_DRQ                      BIT(3)
+#define PX_TFD_BSY                      BIT(7)
+
+#define PX_SSTS_DET(ssts)               ((ssts) & 0x0f)
+#define PX_SSTS_DET_PRESENT             3
+#define PX_SIG_ATA                      0x00000101
+
+/* ATA commands */
+#define ATA_CMD_READ_DMA_EXT            0x25
+#define ATA_CMD_WRITE_DMA_EXT           0x35
+#define ATA_CMD_READ_FPDMA_QUEUED       0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED      0x61
+#define ATA_CMD_FLUSH_CACHE_EXT         0xea
+#define ATA_CMD_IDENTIFY                0xec
+
+#define ATA_DEV_LBA                     BIT(6)
+
+/* IDENTIFY DEVICE words */
+#define ATA_ID_QUEUE_DEPTH              75
+#define ATA_ID_SATA_CAP                 76
+#define ATA_ID_SATA_CAP_NCQ             BIT(8)
+#define ATA_ID_CMDSET2                  83
+#define ATA_ID_CMDSET2_LBA48            BIT(10)
+#define ATA_ID_LBA48_SECTORS            100
+
+#define AHCI_SECTOR_SIZE                512
+
+/* Polls of a register before a port is given up on */
+#define AHCI_SPIN                       1000000
+
+/* Command slots in a port, and scatter-gather entries in each command
+ * table, one per block */
+#define AHCI_MAX_SLOTS                  32
+#define AHCI_MAX_PRDS                   BLOCKDEV_MAX_BATCH
+
+#define FIS_TYPE_REG_H2D                0x27
+#define FIS_H2D_C                       0x80    /* a command, not control */
+
+typedef struct ahci_cmd_hdr {
+        uint16_t          ch_flags;
+        uint16_t          ch_prdtl;     /* scatter-gather entries */
+        volatile uint32_t ch_prdbc;     /* bytes moved */
+        uint32_t          ch_ctba;      /* command table, 128-byte aligned */
+        uint32_t          ch_ctbau;
+        uint32_t          ch_reserved[4];
+} ahci_cmd_hdr_t;
+
+#define AHCI_CH_CFL(dwords)             ((dwords) & 0x1f)
+#define AHCI_CH_W                       BIT(6)
+
+typedef struct ahci_prd {
+        uint32_t pr_dba;
+        uint32_t pr_dbau;
+        uint32_t pr_reserved;
+        uint32_t pr_dbc;                /* bytes - 1 */
+} ahci_prd_t;
+
+typedef struct ahci_cmd_tbl {
+        uint8_t    ct_cfis[64];
+        uint8_t    ct_acmd[16];
+        uint8_t    ct_reserved[48];
+        ahci_prd_t ct_prdt[AHCI_MAX_PRDS];
+} ahci_cmd_tbl_t;
+
+/* The command list is 1K-aligned and the received FIS area 256-byte
+ * aligned; both come first in a port's memory, then its command tables */
+#define AHCI_CMDLIST_SIZE               (AHCI_MAX_SLOTS * sizeof(ahci_cmd_hdr_t))
+#define AHCI_RFIS_SIZE                  256
+#define AHCI_TABLES_OFFSET              (AHCI_CMDLIST_SIZE + AHCI_RFIS_SIZE)
+#define AHCI_PORT_MEM_SIZE \
+        (AHCI_TABLES_OFFSET + AHCI_MAX_SLOTS * sizeof(ahci_cmd_tbl_t))
+
+/* A synchronous transfer, on the stack of the thread waiting for it */
+typedef struct ahci_wait {
+        volatile int aw_done;
+        int          aw_status;
+        ktqueue_t    aw_waitq;
+} ahci_wait_t;
+
+/* What occupies a command slot: a synchronous transfer with its waiter,
+ * or one started by start_blockv with its tag */
+typedef struct ahci_slot {
+        ahci_wait_t *as_wait;
+        void        *as_tag;
+} ahci_slot_t;
+
+/* A started transfer which has completed and not been reaped */
+typedef struct ahci_done {
+        void *ad_tag;
+        int   ad_status;
+} ahci_done_t;
+
+typedef struct ahci_port {
+        uintptr_t        ap_regs;
+        int              ap_num;
+        int              ap_ncq;
+        uint32_t         ap_nslots;     /* slots in use at most */
+        uint32_t         ap_nblocks;
+
+        ahci_cmd_hdr_t  *ap_cmdlist;
+        ahci_cmd_tbl_t  *ap_tables;
+
+        uint32_t         ap_busy;       /* slots issued, as a bit mask */
+        int              ap_nexclusive; /* unqueued commands waiting or out */
+        ahci_slot_t      ap_slots[AHCI_MAX_SLOTS];
+        ktqueue_t        ap_slotwaitq;  /* waiting for a free slot */
+
+        ahci_done_t      ap_done[AHCI_MAX_SLOTS];
+        uint32_t         ap_done_head;
+        uint32_t         ap_ndone;
+
+        list_link_t      ap_link;       /* on ahci_ports */
+        blockdev_t       ap_bdev;
+} ahci_port_t;
+
+#define bd_to_port(bd) (CONTAINER_OF((bd), ahci_port_t, ap_bdev))
+
+#define ahci_read(base, reg)            (*(volatile uint32_t *)((base) + (reg)))
+#define ahci_write(base, reg, val)      (*(volatile uint32_t *)((base) + (reg)) = (val))
+
+/* The command list and tables must be written before the slot is issued */
+#define ahci_barrier()  __asm__ volatile("" : : : "memory")
+
+#define NDISKS __NDISKS__
+
+static uintptr_t ahci_abar;
+static list_t ahci_ports;
+
+static counter_t ahci_nreads;
+static counter_t ahci_nwrites;
+static counter_t ahci_nblocks_read;
+static counter_t ahci_nblocks_written;
+static counter_t ahci_nerrors;
+static counter_t ahci_nflushes;
+
+static int ahci_read_block(blockdev_t *bdev, char *data, blocknum_t blocknum, size_t count);
+static int ahci_write_block(blockdev_t *bdev, const char *data, blocknum_t blocknum, size_t count);
+static int ahci_readv(blockdev_t *bdev, char **bufs, blocknum_t blocknum, size_t count);
+static int ahci_writev(blockdev_t *bdev, char **bufs, blocknum_t blocknum, size_t count);
+static int ahci_start_blockv(blockdev_t *bdev, char **bufs, blocknum_t blocknum,
+                             size_t count, int write, void *tag);
+static void *ahci_reap_blockv(blockdev_t *bdev, int *status);
+static int ahci_flush(blockdev_t *bdev);
+static void ahci_intr(regs_t *regs);
+
+static blockdev_ops_t ahci_ops = {
+        .read_block   = ahci_read_block,
+        .write_block  = ahci_write_block,
+        .read_blockv  = ahci_readv,
+        .write_blockv = ahci_writev,
+        .start_blockv = ahci_start_blockv,
+        .reap_blockv  = ahci_reap_blockv,
+        .flush        = ahci_flush
+};
+
+/* Spins until the port register has none of the bits set, returning 0, or
+ * -ETIME if it never gets there */
+static int
+ahci_port_wait_clear(ahci_port_t *ap, uint32_t reg, uint32_t bits)
+{
+        int i;
+        for (i = 0; i < AHCI_SPIN; i++) {
+                if (!(ahci_read(ap->ap_regs, reg) & bits))
+                        return 0;
+        }
+        return -ETIME;
+}
+
+static int
+ahci_port_stop(ahci_port_t *ap)
+{
+        uint32_t cmd = ahci_read(ap->ap_regs, PX_CMD);
+        ahci_write(ap->ap_regs, PX_CMD, cmd & ~PX_CMD_ST);
+        if (0 != ahci_port_wait_clear(ap, PX_CMD, PX_CMD_CR))
+                return -ETIME;
+        cmd = ahci_read(ap->ap_regs, PX_CMD);
+        ahci_write(ap->ap_regs, PX_CMD, cmd & ~PX_CMD_FRE);
+        return ahci_port_wait_clear(ap, PX_CMD, PX_CMD_FR);
+}
+
+static int
+ahci_port_start(ahci_port_t *ap)
+{
+        ahci_write(ap->ap_regs, PX_SERR, 0xffffffff);
+        ahci_write(ap->ap_regs, PX_IS, 0xffffffff);
+        ahci_write(ap->ap_regs, PX_CMD, ahci_read(ap->ap_regs, PX_CMD)
+                   | PX_CMD_FRE | PX_CMD_SUD | PX_CMD_POD);
+        if (0 != ahci_port_wait_clear(ap, PX_TFD, PX_TFD_BSY | PX_TFD_DRQ))
+                return -ETIME;
+        ahci_write(ap->ap_regs, PX_CMD, ahci_read(ap->ap_regs, PX_CMD) | PX_CMD_ST);
+        return 0;
+}
+
+static void
+ahci_fis_h2d(uint8_t *fis, uint8_t command, uint64_t lba, uint16_t count,
+             uint16_t features, uint8_t device)
+{
+        memset(fis, 0, 20);
+        fis[0] = FIS_TYPE_REG_H2D;
+        fis[1] = FIS_H2D_C;
+        fis[2] = command;
+        fis[3] = (uint8_t)features;
+        fis[4] = (uint8_t)lba;
+        fis[5] = (uint8_t)(lba >> 8);
+        fis[6] = (uint8_t)(lba >> 16);
+        fis[7] = device;
+        fis[8] = (uint8_t)(lba >> 24);
+        fis[9] = (uint8_t)(lba >> 32);
+        fis[10] = (uint8_t)(lba >> 40);
+        fis[11] = (uint8_t)(features >> 8);
+        fis[12] = (uint8_t)count;
+        fis[13] = (uint8_t)(count >> 8);
+}
+
+/* Returns a free slot, or -1 if there is none. A command which is not
+ * queued must be the only one outstanding, which without NCQ is every
+ * command; once one is waiting, queued commands wait behind it. */
+static int
+ahci_slot_get(ahci_port_t *ap, int exclusive)
+{
+        uint32_t slot;
+
+        if ((exclusive || !ap->ap_ncq) ? (0 != ap->ap_busy) : (0 < ap->ap_nexclusive))
+                return -1;
+        for (slot = 0; slot < ap->ap_nslots; slot++) {
+                if (!(ap->ap_busy & (1U << slot)))
+                        return slot;
+        }
+        return -1;
+}
+
+/*
+ * Issues a read or write of nblocks blocks, at most AHCI_MAX_PRDS of them,
+ * in a free command slot, waiting for one if need be; as NCQ commands if the
+ * disk takes them. The transfer is either synchronous, with w to be
+ * completed, or started, with its tag. Must be called with the disk's
+ * interrupt masked.
+ */
+static void
+ahci_issue(ahci_port_t *ap, char *buf, char **bufs, blocknum_t blocknum,
+           unsigned int nblocks, int write, ahci_wait_t *w, void *tag)
+{
+        ahci_cmd_hdr_t *hdr;
+        ahci_cmd_tbl_t *tbl;
+        uint64_t lba = (uint64_t)blocknum * (BLOCK_SIZE / AHCI_SECTOR_SIZE);
+        uint16_t nsectors = nblocks * (BLOCK_SIZE / AHCI_SECTOR_SIZE);
+        unsigned int i;
+        int slot;
+
+        KASSERT(0 < nblocks && nblocks <= AHCI_MAX_PRDS);
+        KASSERT((NULL == w) != (NULL == tag));
+
+        while (-1 == (slot = ahci_slot_get(ap, 0)))
+                sched_sleep_on(&ap->ap_slotwaitq);
+
+        hdr = &ap->ap_cmdlist[slot];
+        tbl = &ap->ap_tables[slot];
+        for (i = 0; i < nblocks; i++) {
+                char *addr = (NULL != bufs) ? bufs[i] : buf + i * BLOCK_SIZE;
+                tbl->ct_prdt[i].pr_dba = pt_virt_to_phys((uintptr_t)addr);
+                tbl->ct_prdt[i].pr_dbau = 0;
+                tbl->ct_prdt[i].pr_dbc = BLOCK_SIZE - 1;
+        }
+        if (ap->ap_ncq)
+                ahci_fis_h2d(tbl->ct_cfis, write ? ATA_CMD_WRITE_FPDMA_QUEUED
+                             : ATA_CMD_READ_FPDMA_QUEUED, lba, slot << 3,
+                             nsectors, ATA_DEV_LBA);
+        else
+                ahci_fis_h2d(tbl->ct_cfis, write ? ATA_CMD_WRITE_DMA_EXT
+                             : ATA_CMD_READ_DMA_EXT, lba, nsectors, 0, ATA_DEV_LBA);
+        hdr->ch_flags = AHCI_CH_CFL(5) | (write ? AHCI_CH_W : 0);
+        hdr->ch_prdtl = nblocks;
+        hdr->ch_prdbc = 0;
+
+        ap->ap_slots[slot].as_wait = w;
+        ap->ap_slots[slot].as_tag = tag;
+        ap->ap_busy |= 1U << slot;
+
+        trace_emit(TRACE_DISK, blocknum, nblocks, write);
+        blktrace_issue(&ap->ap_bdev, blocknum, nblocks, write);
+        if (write) {
+                counter_inc(&ahci_nwrites);
+                counter_add(&ahci_nblocks_written, nblocks);
+        } else {
+                counter_inc(&ahci_nreads);
+                counter_add(&ahci_nblocks_read, nblocks);
+        }
+
+        ahci_barrier();
+        if (ap->ap_ncq)
+                ahci_write(ap->ap_regs, PX_SACT, 1U << slot);
+        ahci_write(ap->ap_regs, PX_CI, 1U << slot);
+}
+
+/* Frees a slot whose command has finished, and completes its transfer;
+ * returns whether the transfer was a started one */
+static int
+ahci_slot_complete(ahci_port_t *ap, int slot, int status)
+{
+        ahci_slot_t *s = &ap->ap_slots[slot];
+        int started = 0;
+
+        KASSERT(ap->ap_busy & (1U << slot));
+        ap->ap_busy &= ~(1U << slot);
+
+        if (NULL != s->as_wait) {
+                s->as_wait->aw_status = status;
+                s->as_wait->aw_done = 1;
+                sched_wakeup_on(&s->as_wait->aw_waitq);
+        } else {
+                ahci_done_t *d;
+                KASSERT(ap->ap_ndone < AHCI_MAX_SLOTS);
+                d = &ap->ap_done[(ap->ap_done_head + ap->ap_ndone++) % AHCI_MAX_SLOTS];
+                d->ad_tag = s->as_tag;
+                d->ad_status = status;
+                started = 1;
+        }
+        s->as_wait = NULL;
+        s->as_tag = NULL;
+        return started;
+}
+
+/*
+ * The port has stopped on an error. Which of the outstanding NCQ
+ * commands failed could be read from the disk's error log; rather than
+ * that, all of them are failed, and the port is restarted for the next.
+ */
+static int
+ahci_port_error(ahci_port_t *ap, uint32_t is)
+{
+        uint32_t busy = ap->ap_busy;
+        int slot, started = 0;
+
+        dbg(DBG_DISK, "AHCI port %d error: IS 0x%x, TFD 0x%x, SERR 0x%x\n",
+            ap->ap_num, is, ahci_read(ap->ap_regs, PX_TFD),
+            ahci_read(ap->ap_regs, PX_SERR));
+        counter_inc(&ahci_nerrors);
+
+        for (slot = 0; slot < AHCI_MAX_SLOTS; slot++) {
+                if (busy & (1U << slot))
+                        started |= ahci_slot_complete(ap, slot, -EIO);
+        }
+
+        if (0 != ahci_port_stop(ap) || 0 != ahci_port_start(ap))
+                dbg(DBG_DISK, "AHCI port %d did not restart\n", ap->ap_num);
+        return started;
+}
+
+static void
+ahci_port_intr(ahci_port_t *ap)
+{
+        uint32_t is, active, done;
+        int slot, started = 0;
+
+        is = ahci_read(ap->ap_regs, PX_IS);
+        ahci_write(ap->ap_regs, PX_IS, is);
+
+        if (is & PX_IS_ERRORS) {
+                started = ahci_port_error(ap, is);
+        } else {
+                /* an NCQ command has finished once its SACT bit is clear,
+                 * any other once its CI bit is */
+                active = ahci_read(ap->ap_regs, PX_CI)
+                         | (ap->ap_ncq ? ahci_read(ap->ap_regs, PX_SACT) : 0);
+                done = ap->ap_busy & ~active;
+                for (slot = 0; 0 != done; slot++, done >>= 1) {
+                        if (done & 1)
+                                started |= ahci_slot_complete(ap, slot, 0);
+                }
+        }
+
+        sched_broadcast_on(&ap->ap_slotwaitq);
+        if (started)
+                blockdev_io_done(&ap->ap_bdev);
+}
+
+/* Every port interrupts through the controller's one interrupt; the
+ * controller's status is cleared after the ports', and while it shows more
+ * there is more to do, since the interrupt is only taken on its edge */
+static void
+ahci_intr(regs_t *regs)
+{
+        ahci_port_t *ap;
+        uint32_t is;
+
+        while (0 != (is = ahci_read(ahci_abar, HBA_IS))) {
+                list_iterate_begin(&ahci_ports, ap, ahci_port_t, ap_link) {
+                        if (is & (1U << ap->ap_num))
+                                ahci_port_intr(ap);
+                } list_iterate_end();
+                ahci_write(ahci_abar, HBA_IS, is);
+        }
+}
+
+static int
+ahci_rw(ahci_port_t *ap, char *buf, char **bufs, blocknum_t blocknum,
+        unsigned int count, int write)
+{
+        while (count > 0) {
+                ahci_wait_t w;
+                uint8_t oldipl;
+                unsigned int n = MIN(count, AHCI_MAX_PRDS);
+
+                w.aw_done = 0;
+                w.aw_status = 0;
+                sched_queue_init(&w.aw_waitq);
+                sched_queue_class(&w.aw_waitq, SCHED_WQ_DISK);
+
+                oldipl = intr_getipl();
+                intr_setipl(INTR_DISK_AHCI);
+                ahci_issue(ap, buf, bufs, blocknum, n, write, &w, NULL);
+                while (!w.aw_done)
+                        sched_sleep_on(&w.aw_waitq);
+                intr_setipl(oldipl);
+
+                if (0 != w.aw_status)
+                        return w.aw_status;
+                if (NULL != bufs)
+                        bufs += n;
+                else
+                        buf += n * BLOCK_SIZE;
+                blocknum += n;
+                count -= n;
+        }
+        return 0;
+}
+
+static int
+ahci_read_block(blockdev_t *bdev, char *data, blocknum_t blocknum, size_t count)
+{
+        KASSERT(NULL != bdev && NULL != data);
+        return ahci_rw(bd_to_port(bdev), data, NULL, blocknum, count, 0);
+}
+
+static int
+ahci_write_block(blockdev_t *bdev, const char *data, blocknum_t blocknum, size_t count)
+{
+        KASSERT(NULL != bdev && NULL != data);
+        return ahci_rw(bd_to_port(bdev), (char *)data, NULL, blocknum, count, 1);
+}
+
+static int
+ahci_readv(blockdev_t *bdev, char **bufs, blocknum_t blocknum, size_t count)
+{
+        KASSERT(NULL != bdev && NULL != bufs);
+        return ahci_rw(bd_to_port(bdev), NULL, bufs, blocknum, count, 0);
+}
+
+static int
+ahci_writev(blockdev_t *bdev, char **bufs, blocknum_t blocknum, size_t count)
+{
+        KASSERT(NULL != bdev && NULL != bufs);
+        return ahci_rw(bd_to_port(bdev), NULL, bufs, blocknum, count, 1);
+}
+
+static int
+ahci_start_blockv(blockdev_t *bdev, char **bufs, blocknum_t blocknum,
+                  size_t count, int write, void *tag)
+{
+        uint8_t oldipl;
+
+        KASSERT(NULL != bdev && NULL != bufs && NULL != tag);
+
+        oldipl = intr_getipl();
+        intr_setipl(INTR_DISK_AHCI);
+        ahci_issue(bd_to_port(bdev), NULL, bufs, blocknum, count, write, NULL, tag);
+        intr_setipl(oldipl);
+        return 0;
+}
+
+static void *
+ahci_reap_blockv(blockdev_t *bdev, int *status)
+{
+        ahci_port_t *ap = bd_to_port(bdev);
+        void *tag = NULL;
+        uint8_t oldipl;
+
+        oldipl = intr_getipl();
+        intr_setipl(INTR_DISK_AHCI);
+        if (0 < ap->ap_ndone) {
+                ahci_done_t *d = &ap->ap_done[ap->ap_done_head];
+                tag = d->ad_tag;
+                *status = d->ad_status;
+                ap->ap_done_head = (ap->ap_done_head + 1) % AHCI_MAX_SLOTS;
+                ap->ap_ndone--;
+        }
+        intr_setipl(oldipl);
+        return tag;
+}
+
+/* FLUSH CACHE EXT cannot be queued, so it waits for the commands before
+ * it to complete, and those after it wait for it */
+static int
+ahci_flush(blockdev_t *bdev)
+{
+        ahci_port_t *ap = bd_to_port(bdev);
+        ahci_cmd_tbl_t *tbl;
+        ahci_wait_t w;
+        uint8_t oldipl;
+        int slot;
+
+        w.aw_done = 0;
+        w.aw_status = 0;
+        sched_queue_init(&w.aw_waitq);
+        sched_queue_class(&w.aw_waitq, SCHED_WQ_DISK);
+
+        oldipl = intr_getipl();
+        intr_setipl(INTR_DISK_AHCI);
+
+        ap->ap_nexclusive++;
+        while (-1 == (slot = ahci_slot_get(ap, 1)))
+                sched_sleep_on(&ap->ap_slotwaitq);
+
+        tbl = &ap->ap_tables[slot];
+        ahci_fis_h2d(tbl->ct_cfis, ATA_CMD_FLUSH_CACHE_EXT, 0, 0, 0, ATA_DEV_LBA);
+        ap->ap_cmdlist[slot].ch_flags = AHCI_CH_CFL(5);
+        ap->ap_cmdlist[slot].ch_prdtl = 0;
+        ap->ap_cmdlist[slot].ch_prdbc = 0;
+        ap->ap_slots[slot].as_wait = &w;
+        ap->ap_slots[slot].as_tag = NULL;
+        ap->ap_busy |= 1U << slot;
+        counter_inc(&ahci_nflushes);
+
+        ahci_barrier();
+        ahci_write(ap->ap_regs, PX_CI, 1U << slot);
+
+        while (!w.aw_done)
+                sched_sleep_on(&w.aw_waitq);
+        /* queued commands held back for it may go now */
+        ap->ap_nexclusive--;
+        sched_broadcast_on(&ap->ap_slotwaitq);
+        intr_setipl(oldipl);
+
+        return w.aw_status;
+}
+
+/*
+ * Identifies the disk on a port, polling for the command to finish since
+ * the port's interrupts are not enabled yet. Fills in the disk's size and
+ * whether, and how deeply, it queues. Returns 0 or -errno.
+ */
+static int
+ahci_identify(ahci_port_t *ap, uint32_t nslots, int hba_ncq)
+{
+        uint16_t *id;
+        uint64_t nsectors;
+        uint32_t depth;
+        int ret = 0;
+
+        if (NULL == (id = (uint16_t *)page_alloc()))
+                return -ENOMEM;
+
+        ahci_fis_h2d(ap->ap_tables[0].ct_cfis, ATA_CMD_IDENTIFY, 0, 0, 0, 0);
+        ap->ap_tables[0].ct_prdt[0].pr_dba = pt_virt_to_phys((uintptr_t)id);
+        ap->ap_tables[0].ct_prdt[0].pr_dbau = 0;
+        ap->ap_tables[0].ct_prdt[0].pr_dbc = AHCI_SECTOR_SIZE - 1;
+        ap->ap_cmdlist[0].ch_flags = AHCI_CH_CFL(5);
+        ap->ap_cmdlist[0].ch_prdtl = 1;
+        ap->ap_cmdlist[0].ch_prdbc = 0;
+        ahci_barrier();
+        ahci_write(ap->ap_regs, PX_CI, 1);
+
+        if (0 != ahci_port_wait_clear(ap, PX_CI, 1)
+            || (ahci_read(ap->ap_regs, PX_TFD) & PX_TFD_ERR)) {
+                ret = -EIO;
+                goto out;
+        }
+        if (!(id[ATA_ID_CMDSET2] & ATA_ID_CMDSET2_LBA48)) {
+                ret = -ENOTSUP;
+                goto out;
+        }
+
+        nsectors = id[ATA_ID_LBA48_SECTORS] | ((uint32_t)id[ATA_ID_LBA48_SECTORS + 1] << 16)
+                   | ((uint64_t)id[ATA_ID_LBA48_SECTORS + 2] << 32);
+        ap->ap_nblocks = (uint32_t)(nsectors / (BLOCK_SIZE / AHCI_SECTOR_SIZE));
+
+        ap->ap_ncq = hba_ncq && (id[ATA_ID_SATA_CAP] & ATA_ID_SATA_CAP_NCQ);
+        depth = (id[ATA_ID_QUEUE_DEPTH] & 0x1f) + 1;
+        ap->ap_nslots = ap->ap_ncq ? MIN(nslots, depth) : 1;
+
+out:
+        ahci_write(ap->ap_regs, PX_IS, 0xffffffff);
+        page_free(id);
+        return ret;
+}
+
+/*
+ * Sets up the port's memory, starts it, identifies its disk and registers
+ * it as disk minor. Returns 0, or -errno if there is no usable disk on the
+ * port.
+ */
+static int
+ahci_port_attach(int port, int minor, uint32_t nslots, int hba_ncq)
+{
+        ahci_port_t *ap;
+        uintptr_t regs = ahci_abar + AHCI_PORT_BASE(port);
+        uint32_t npages, slot;
+        char *mem;
+        int ret;
+
+        if (PX_SSTS_DET_PRESENT != PX_SSTS_DET(ahci_read(regs, PX_SSTS))
+            || PX_SIG_ATA != ahci_read(regs, PX_SIG))
+                return -ENODEV;
+
+        npages = ADDR_TO_PN(PAGE_ALIGN_UP(AHCI_PORT_MEM_SIZE));
+        if (NULL == (ap = (ahci_port_t *)kmalloc(sizeof(ahci_port_t)))
+            || NULL == (mem = page_alloc_n(npages)))
+                panic("Not enough memory for AHCI disk!\n");
+        memset(ap, 0, sizeof(ahci_port_t));
+        memset(mem, 0, npages * PAGE_SIZE);
+
+        ap->ap_regs = regs;
+        ap->ap_num = port;
+        ap->ap_cmdlist = (ahci_cmd_hdr_t *)mem;
+        ap->ap_tables = (ahci_cmd_tbl_t *)(mem + AHCI_TABLES_OFFSET);
+        for (slot = 0; slot < AHCI_MAX_SLOTS; slot++)
+                ap->ap_cmdlist[slot].ch_ctba = pt_virt_to_phys((uintptr_t)&ap->ap_tables[slot]);
+        sched_queue_init(&ap->ap_slotwaitq);
+        sched_queue_class(&ap->ap_slotwaitq, SCHED_WQ_DISK);
+
+        if (0 != (ret = ahci_port_stop(ap)))
+                goto fail;
+        ahci_write(regs, PX_CLB, pt_virt_to_phys((uintptr_t)ap->ap_cmdlist));
+        ahci_write(regs, PX_CLBU, 0);
+        ahci_write(regs, PX_FB, pt_virt_to_phys((uintptr_t)(mem + AHCI_CMDLIST_SIZE)));
+        ahci_write(regs, PX_FBU, 0);
+        if (0 != (ret = ahci_port_start(ap))
+            || 0 != (ret = ahci_identify(ap, nslots, hba_ncq)))
+                goto fail;
+
+        list_insert_tail(&ahci_ports, &ap->ap_link);
+        ahci_write(regs, PX_IE, PX_IS_DHRS | PX_IS_SDBS | PX_IS_ERRORS);
+
+        dbg(DBG_DISK, "Initialized AHCI device %d, port %d, size %u blocks, %s%u slots\n",
+            minor, port, ap->ap_nblocks, ap->ap_ncq ? "NCQ, " : "", ap->ap_nslots);
+
+        ap->ap_bdev.bd_id = MKDEVID(DISK_MAJOR, minor);
+        ap->ap_bdev.bd_ops = &ahci_ops;
+        ap->ap_bdev.bd_qdepth = ap->ap_nslots;
+        blockdev_register(&ap->ap_bdev);
+        return 0;
+
+fail:
+        dbg(DBG_DISK, "AHCI port %d unusable: %d\n", port, ret);
+        ahci_port_stop(ap);
+        page_free_n(mem, npages);
+        kfree(ap);
+        return ret;
+}
+
+void
+ahci_init(void)
+{
+        pcidev_t *pdev;
+        uintptr_t base;
+        uint32_t cap, pi;
+        int port, minor;
+        uint8_t oldipl;
+
+        list_init(&ahci_ports);
+        if (NULL == (pdev = pci_lookup(AHCI_PCI_CLASS, AHCI_PCI_SUBCLASS, AHCI_PCI_INTERFACE)))
+                return;
+        if (PCI_MMIO != pdev->pci_bar[AHCI_PCI_ABAR].mem_type) {
+                dbg(DBG_DISK, "AHCI: no memory BAR, skipping\n");
+                return;
+        }
+
+        counter_register(&ahci_nreads, "ahci.reads");
+        counter_register(&ahci_nwrites, "ahci.writes");
+        counter_register(&ahci_nblocks_read, "ahci.blocks_read");
+        counter_register(&ahci_nblocks_written, "ahci.blocks_written");
+        counter_register(&ahci_nerrors, "ahci.errors");
+        counter_register(&ahci_nflushes, "ahci.flushes");
+
+        pci_write_config(pdev, PCI_COMMAND, pci_read_config(pdev, PCI_COMMAND, 2)
+                         | PCI_CMD_MMIO | PCI_CMD_BUSMASTER, 2);
+        base = pdev->pci_bar[AHCI_PCI_ABAR].base_addr;
+        ahci_abar = pt_phys_perm_map((uintptr_t)PAGE_ALIGN_DOWN(base),
+                                     ADDR_TO_PN(PAGE_ALIGN_UP(PAGE_OFFSET(base) + AHCI_ABAR_SIZE)))
+                    + PAGE_OFFSET(base);
+
+        ahci_write(ahci_abar, HBA_GHC, ahci_read(ahci_abar, HBA_GHC) | HBA_GHC_AE);
+        cap = ahci_read(ahci_abar, HBA_CAP);
+        pi = ahci_read(ahci_abar, HBA_PI);
+
+        for (minor = 0; NULL != blockdev_lookup(MKDEVID(DISK_MAJOR, minor)); minor++)
+                ;
+
+        oldipl = intr_getipl();
+        intr_setipl(INTR_DISK_AHCI);
+        intr_register(INTR_DISK_AHCI, ahci_intr);
+        for (port = 0; port < AHCI_MAX_PORTS && minor < NDISKS; port++) {
+                if ((pi & (1U << port))
+                    && 0 == ahci_port_attach(port, minor, HBA_CAP_NCS(cap),
+                                             !!(cap & HBA_CAP_SNCQ)))
+                        minor++;
+        }
+        ahci_write(ahci_abar, HBA_IS, 0xffffffff);
+        if (0 != pci_msi_enable(pdev, INTR_DISK_AHCI))
+                intr_map(pdev->pci_irq, INTR_DISK_AHCI);
+        ahci_write(ahci_abar, HBA_GHC, ahci_read(ahci_abar, HBA_GHC) | HBA_GHC_IE);
+        intr_setipl(oldipl);
+}
@@ -1,4 +1,5 @@
 #include "types.h"
+#include "errno.h"
 
 #include "main/interrupt.h"
 #include "main/io.h"
@@ -7,7 +8,10 @@
 #include "util/debug.h"
 #include "util/list.h"
 #include "util/delay.h"
+#include "util/counter.h"
+#include "util/trace.h"
 
+#include "drivers/blktrace.h"
 #include "drivers/blockdev.h"
 #include "drivers/dev.h"
 #include "drivers/pci.h"
@@ -74,22 +78,27 @@ static struct ata_channel {
 	
         /* address of busmaster register */
         uint16_t atac_busmaster;
+
+        /* The master and slave share the channel's registers and PRD
+         * table, so one command at a time goes to either of them; the
+         * two channels work independently */
+        kmutex_t atac_mutex;
+
+        /* The disk with a command in flight, for the interrupt */
+        struct ata_disk *atac_active;
+
+        /* The drive last selected, or -1 */
+        int atac_selected;
 } ATA_CHANNELS[2] = {
         {
-                ATA_PRIMARY_CMD_BASE,
-                ATA_PRIMARY_CTRL_BASE,
-                INTR_DISK_PRIMARY,
-                NULL,
-                NULL,
-		NULL
+                .atac_cmd  = ATA_PRIMARY_CMD_BASE,
+                .atac_ctrl = ATA_PRIMARY_CTRL_BASE,
+                .atac_intr = INTR_DISK_PRIMARY
         },
         {
-                ATA_SECONDARY_CMD_BASE,
-                ATA_SECONDARY_CTRL_BASE,
-                INTR_DISK_SECONDARY,
-                NULL,
-                NULL,
-		NULL
+                .atac_cmd  = ATA_SECONDARY_CMD_BASE,
+                .atac_ctrl = ATA_SECONDARY_CTRL_BASE,
+                .atac_intr = INTR_DISK_SECONDARY
         }
 };
 
@@ -97,6 +106,9 @@ static struct ata_channel {
 
 #define ATA_SECTOR_SIZE 512 /* Pretty much always true */
 
+/* Most sectors a single (non-lba48) READ/WRITE DMA command can move */
+#define ATA_MAX_SECTORS 256
+
 /* Drive/head values (for ATA_REG_DRIVEHEAD) */
 #define ATA_DRIVEHEAD_MASTER 0xA0
 #define ATA_DRIVEHEAD_SLAVE  0xB0
@@ -162,6 +174,10 @@ static struct ata_channel {
 #define ATA_CMD_PACKET          0xA0
 #define ATA_CMD_IDENTIFY_PACKET 0xA1
 #define ATA_CMD_IDENTIFY        0xEC
+#define ATA_CMD_SET_FEATURES    0xEF
+
+/* Subcommands (for ATA_REG_FEATURE with ATA_CMD_SET_FEATURES) */
+#define ATA_FEATURE_WCACHE_ON   0x02
 
 /* Drive/head values for CHS / LBA */
 #define ATA_DRIVEHEAD_CHS 0x00
@@ -169,6 +185,11 @@ static struct ata_channel {
 
 #define ATA_IDENT_MAX_LBA 30
 
+/* Words of the identification space, which ATA_IDENT_* above counts in
+ * double words */
+#define ATA_IDENT_CMDSET1       82
+#define ATA_IDENT_CMDSET1_WCACHE 0x20
+
 /* Reads from the command registers, NOT the control registers */
 #define ata_inb_reg(channel, reg) inb(ATA_CHANNELS[channel].atac_cmd + reg)
 #define ata_inw_reg(channel, reg) inw(ATA_CHANNELS[channel].atac_cmd + reg)
@@ -217,20 +238,34 @@ typedef struct ata_disk {
         /* Size of disk in number of sectors */
         uint32_t   ata_size;
 
+        /* Whether the drive's write cache is on, so that a write is only
+         * durable once ata_flush has been called after it */
+        int        ata_wcache;
+
         uint32_t   ata_sectors_per_block;
 
         /* Threads making blocking disk operations wait one this
          * queue, and disk interrupt wakes them up */
         ktqueue_t  ata_waitq;
 
-        /* Disk mutex since only one process can be using the disk at
-         * any time */
-        kmutex_t   ata_mutex;
+        /* The command in flight, if any, and how it ended: ata_intr
+         * reads the status (which acknowledges the interrupt) and the
+         * error, then sets ata_done */
+        int        ata_busy;
+        int        ata_done;
+        uint8_t    ata_status;
+        uint8_t    ata_error;
 
         /* Underlying block device */
         blockdev_t ata_bdev;
 } ata_disk_t;
 
+/* Largest run of blocks ata_do_operation can transfer in one command, limited
+ * by both the sector count register and the size of the PRD table */
+#define ata_max_blocks(adisk) \
+        MIN(ATA_MAX_SECTORS / (adisk)->ata_sectors_per_block, \
+            DMA_MAX_PRDS * PAGE_SIZE / BLOCK_SIZE)
+
 /* this prototype needs to be after the struct definition */
 uint16_t ata_setup_busmaster(ata_disk_t* adisk);
 
@@ -241,41 +276,90 @@ static int ata_read(blockdev_t *bdev, char *data,
                     blocknum_t blocknum, unsigned int count);
 static int ata_write(blockdev_t *bdev, const char *data,
                      blocknum_t blocknum, unsigned int count);
-static int ata_do_operation(ata_disk_t *adisk, char *data, \
-                            blocknum_t sectornum, int write);
+static int ata_readv(blockdev_t *bdev, char **bufs,
+                     blocknum_t blocknum, unsigned int count);
+static int ata_writev(blockdev_t *bdev, char **bufs,
+                      blocknum_t blocknum, unsigned int count);
+static int ata_flush(blockdev_t *bdev);
+/* Commands issued to all the disks, and the blocks they moved */
+static counter_t ata_nreads;
+static counter_t ata_nwrites;
+static counter_t ata_nblocks_read;
+static counter_t ata_nblocks_written;
+
+static int ata_do_operation(ata_disk_t *adisk, const dma_seg_t *segs, int nsegs, \
+                            blocknum_t blocknum, unsigned int nblocks, int write);
 static void ata_intr(regs_t *regs, void *arg);
 
 static blockdev_ops_t ata_disk_ops = {
-        .read_block  = ata_read,
-        .write_block = ata_write
+        .read_block   = ata_read,
+        .write_block  = ata_write,
+        .read_blockv  = ata_readv,
+        .write_blockv = ata_writev,
+        .flush        = ata_flush
 };
 
+/* Issues SET FEATURES to the selected drive and polls for it to finish,
+ * for use while the disks are being found */
+static int
+ata_set_feature_polled(uint8_t channel, uint8_t feature)
+{
+        uint8_t status;
+
+        ata_outb_reg(channel, ATA_REG_FEATURE, feature);
+        ata_outb_reg(channel, ATA_REG_COMMAND, ATA_CMD_SET_FEATURES);
+        ata_pause(channel);
+        while ((status = ata_inb_reg(channel, ATA_REG_STATUS)) & ATA_SR_BSY)
+                ata_pause(channel);
+        return (status & (ATA_SR_ERR | ATA_SR_DF)) ? -EIO : 0;
+}
+
 void
 ata_init()
 {
         int ii;
+        int ndisks = 0;
 
         intr_map(IRQ_DISK_PRIMARY, INTR_DISK_PRIMARY);
         intr_map(IRQ_DISK_SECONDARY, INTR_DISK_SECONDARY);
 
         dma_init(); /* IMPORTANT! */
 
+        counter_register(&ata_nreads, "disk.reads");
+        counter_register(&ata_nwrites, "disk.writes");
+        counter_register(&ata_nblocks_read, "disk.blocks_read");
+        counter_register(&ata_nblocks_written, "disk.blocks_written");
+
         uint8_t oldipl = intr_getipl();
         intr_setipl(INTR_DISK_PRIMARY);
 
-        for (ii = 0; ii < NDISKS; ii++) {
+        for (ii = 0; ii < ATA_NUM_CHANNELS; ii++) {
+                kmutex_init(&ATA_CHANNELS[ii].atac_mutex);
+                ATA_CHANNELS[ii].atac_active = NULL;
+                ATA_CHANNELS[ii].atac_selected = -1;
+                ATA_CHANNELS[ii].atac_intr_handler = ata_intr;
+                ATA_CHANNELS[ii].atac_intr_arg = &ATA_CHANNELS[ii];
+                intr_register(ATA_CHANNELS[ii].atac_intr, ata_intr_wrapper);
+        }
+
+        /* Disks are numbered in the order they are found: the primary
+         * master, the primary slave, the secondary master and the
+         * secondary slave, skipping what is not there or is not an ATA
+         * disk (the CD-ROM, say) */
+        for (ii = 0; ii < ATA_NUM_CHANNELS * 2 && ndisks < NDISKS; ii++) {
                 int i;
-                int err = 0;
                 uint32_t ident_buf[ATA_IDENT_BUFSIZE];
                 uint8_t status = 0;
-                int channel = ii; /* No slave drive support */
+                int channel = ii / 2;
+                int drive = ii % 2;
                 ata_disk_t *adisk;
 
-                if (ii >= ATA_NUM_CHANNELS)
-                        panic("ATA does not have as many drives"
-                              "as you want!\n");
-                /* Choose drive - In this case always Master */
-                ata_outb_reg(channel, ATA_REG_DRIVEHEAD, ATA_DRIVEHEAD_MASTER | ATA_DRIVEHEAD_LBA);
+                /* Choose drive */
+                ata_outb_reg(channel, ATA_REG_DRIVEHEAD,
+                             (drive ? ATA_DRIVEHEAD_SLAVE : ATA_DRIVEHEAD_MASTER)
+                             | ATA_DRIVEHEAD_LBA);
+                ATA_CHANNELS[channel].atac_selected = drive;
+                ata_pause(channel);
                 /* Set the Sector count register to be 0 */
                 ata_outb_reg(channel, ATA_REG_SECCOUNT0, 0);
                 /* Set the LBA0 LBA1 LBA2 registers to be 0 */
@@ -283,8 +367,8 @@ ata_init()
                 ata_outb_reg(channel, ATA_REG_LBA1, 0);
                 ata_outb_reg(channel, ATA_REG_LBA2, 0);
 
-                /* disable IRQs for the master (shamelessly stolen from OS Dev */
-                outb(ATA_PRIMARY_CTRL_BASE + ATA_REG_CONTROL, 0x02);
+                /* disable IRQs for the channel (shamelessly stolen from OS Dev */
+                outb(ATA_CHANNELS[channel].atac_ctrl + ATA_REG_CONTROL, 0x02);
 		
                 /* Tell drive to get ready to in identification space */
                 ata_outb_reg(channel, ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
@@ -292,9 +376,11 @@ ata_init()
                 /* wait some time for the drive to process */
                 ata_pause(channel);
 
-                /* If status register is 0xff, drive does not exist */
-                if (0x00 == ata_inb_reg(channel, ATA_REG_STATUS)) {
+                /* If status register is 0 (or floats high), drive does not exist */
+                status = ata_inb_reg(channel, ATA_REG_STATUS);
+                if (0x00 == status || 0xff == status) {
                   dbgq(DBG_DISK, "Drive does not exist\n");
+                  outb(ATA_CHANNELS[channel].atac_ctrl + ATA_REG_CONTROL, 0x00);
                   continue;
                 }
 
@@ -305,27 +391,32 @@ ata_init()
                   ata_pause(channel);	
                 }
 
-                /* Now the drive is no longer busy, poll until the error bit is set or drq is set */
+                /* Now the drive is no longer busy, poll until the error bit is set or drq is set;
+                 * a packet device (which leaves its signature in LBA1 and LBA2) aborts the command */
                 while (1) {
                   status = ata_inb_reg(channel, ATA_REG_STATUS);
-                  if (status & ATA_SR_ERR) { err = 1; break; }
-                  if (status & ATA_SR_DRQ) break;
+                  if (status & (ATA_SR_ERR | ATA_SR_DRQ)) break;
+                  if (ata_inb_reg(channel, ATA_REG_LBA1) || ata_inb_reg(channel, ATA_REG_LBA2)) {
+                    status = ATA_SR_ERR;
+                    break;
+                  }
                   ata_pause(channel);
                 }
 
-                if (err) {
-                  panic("Error setting up ATA drive\n");
-                }
-
                 /* Now clear the command register */
-                outb(ATA_PRIMARY_CTRL_BASE + ATA_REG_CONTROL, 0x00);
+                outb(ATA_CHANNELS[channel].atac_ctrl + ATA_REG_CONTROL, 0x00);
+
+                if (status & ATA_SR_ERR) {
+                  dbgq(DBG_DISK, "Not an ATA disk on channel %d drive %d\n", channel, drive);
+                  continue;
+                }
 
                 /* Otherwise, allocate new disk */
                 if (NULL ==
                     (adisk = (ata_disk_t *)kmalloc(sizeof(ata_disk_t))))
                         panic("Not enough memory for ata disk struct!\n");
                 adisk->ata_channel = channel;
-                adisk->ata_drive = 0;
+                adisk->ata_drive = drive;
 
                 for (i = 0; i < ATA_IDENT_BUFSIZE; i++) {
                         ident_buf[i] = ata_inl_reg(adisk->ata_channel, ATA_REG_DATA);
@@ -338,23 +429,28 @@ ata_init()
 
                 adisk->ata_sectors_per_block = BLOCK_SIZE / ATA_SECTOR_SIZE;
 
+                /* Writes complete once they reach the cache, and
+                 * blockdev_flush makes them durable */
+                adisk->ata_wcache = 0;
+                if ((((uint16_t *)ident_buf)[ATA_IDENT_CMDSET1] & ATA_IDENT_CMDSET1_WCACHE)
+                    && 0 == ata_set_feature_polled(channel, ATA_FEATURE_WCACHE_ON))
+                        adisk->ata_wcache = 1;
+
                 sched_queue_init(&adisk->ata_waitq);
-                kmutex_init(&adisk->ata_mutex);
+                sched_queue_class(&adisk->ata_waitq, SCHED_WQ_DISK);
+                adisk->ata_busy = 0;
+                adisk->ata_done = 0;
 
                 dbg(DBG_DISK, "Initialized ATA device %d, channel %s, drive %s, size %d\n",
-                    ii, (adisk->ata_channel ? "SECONDARY" : "PRIMARY"),
+                    ndisks, (adisk->ata_channel ? "SECONDARY" : "PRIMARY"),
                     (adisk->ata_drive ? "SLAVE" : "MASTER"), adisk->ata_size);
 
-                /* Set up corresponding handler */
-                intr_register(ATA_CHANNELS[adisk->ata_channel].atac_intr,
-                              ata_intr_wrapper);
-                ATA_CHANNELS[adisk->ata_channel].atac_intr_handler = ata_intr;
-                ATA_CHANNELS[adisk->ata_channel].atac_intr_arg = adisk;
                 ATA_CHANNELS[adisk->ata_channel].atac_busmaster = ata_setup_busmaster(adisk);
 
-                adisk->ata_bdev.bd_id = MKDEVID(DISK_MAJOR, ii);
+                adisk->ata_bdev.bd_id = MKDEVID(DISK_MAJOR, ndisks);
                 adisk->ata_bdev.bd_ops = &ata_disk_ops;
                 blockdev_register(&adisk->ata_bdev);
+                ndisks++;
         }
         intr_setipl(oldipl);
 }
@@ -370,10 +466,9 @@ ata_intr_wrapper(regs_t *regs)
                         if (NULL == ATA_CHANNELS[i].atac_intr_handler)
                                 panic("No handler registered "
                                       "for ATA channel %d!\n", i);
+                        /* The handler acknowledges the interrupt */
                         ATA_CHANNELS[i].atac_intr_handler(
                                 regs, ATA_CHANNELS[i].atac_intr_arg);
-                        /* Acknowledge interrupt */
-                        ata_inb_reg(i, ATA_REG_STATUS);
                         return;
                 }
         }
@@ -396,13 +491,20 @@ ata_read(blockdev_t *bdev, char *data, blocknum_t blocknum, unsigned int count)
     KASSERT(NULL != bdev);
     KASSERT(NULL != data);
 
-    unsigned int i = 0;
     ata_disk_t *adisk = bd_to_ata(bdev);
-    for (i = 0 ; i < count ; i++) {
+    /*issue one command per run of up to ata_max_blocks blocks*/
+    while (count > 0) {
         int ret;
-        if ((ret = ata_do_operation(adisk, &data[i * BLOCK_SIZE], blocknum + i, 0)) != 0) {
+        dma_seg_t seg;
+        unsigned int n = MIN(count, ata_max_blocks(adisk));
+        seg.ds_addr = data;
+        seg.ds_len = n * BLOCK_SIZE;
+        if ((ret = ata_do_operation(adisk, &seg, 1, blocknum, n, 0)) != 0) {
             return ret;
         }
+        data += n * BLOCK_SIZE;
+        blocknum += n;
+        count -= n;
     }
     return 0;
         /*NOT_YET_IMPLEMENTED("DRIVERS: ata_read");*/
@@ -425,13 +527,20 @@ ata_write(blockdev_t *bdev, const char *data, blocknum_t blocknum, unsigned int
     KASSERT(NULL != bdev);
     KASSERT(NULL != data);
 
-    unsigned int i = 0;
     ata_disk_t *adisk = bd_to_ata(bdev);
-    for (i = 0 ; i < count ; i++) {
+    /*issue one command per run of up to ata_max_blocks blocks*/
+    while (count > 0) {
         int ret;
-        if ((ret = ata_do_operation(adisk, (char *)&data[i * BLOCK_SIZE], blocknum + i, 1)) != 0) {
+        dma_seg_t seg;
+        unsigned int n = MIN(count, ata_max_blocks(adisk));
+        seg.ds_addr = (char *)data;
+        seg.ds_len = n * BLOCK_SIZE;
+        if ((ret = ata_do_operation(adisk, &seg, 1, blocknum, n, 1)) != 0) {
             return ret;
         }
+        data += n * BLOCK_SIZE;
+        blocknum += n;
+        count -= n;
     }
     return 0;
         /*NOT_YET_IMPLEMENTED("DRIVERS: ata_write");*/
@@ -439,11 +548,67 @@ ata_write(blockdev_t *bdev, const char *data, blocknum_t blocknum, unsigned int
 }
 
 /**
- * Read/write the given block.
+ * Reads or writes a run of contiguous blocks from or into a set of
+ * separate block-sized buffers, using one scatter-gather DMA command
+ * per ata_max_blocks() blocks.
+ *
+ * @param adisk the disk to perform the operation on
+ * @param bufs one page-aligned buffer per block
+ * @param blocknum the block number of bufs[0]
+ * @param count the number of blocks (and buffers)
+ * @param write true if writing, false if reading
+ * @return 0 on success and <0 on error
+ */
+static int
+ata_rwv(ata_disk_t *adisk, char **bufs, blocknum_t blocknum,
+        unsigned int count, int write)
+{
+    dma_seg_t segs[DMA_MAX_PRDS];
+
+    while (count > 0) {
+        int ret;
+        unsigned int i;
+        unsigned int n = MIN(count, ata_max_blocks(adisk));
+        for (i = 0; i < n; i++) {
+            segs[i].ds_addr = bufs[i];
+            segs[i].ds_len = BLOCK_SIZE;
+        }
+        if ((ret = ata_do_operation(adisk, segs, n, blocknum, n, write)) != 0) {
+            return ret;
+        }
+        bufs += n;
+        blocknum += n;
+        count -= n;
+    }
+    return 0;
+}
+
+static int
+ata_readv(blockdev_t *bdev, char **bufs, blocknum_t blocknum, unsigned int count)
+{
+    KASSERT(NULL != bdev);
+    KASSERT(NULL != bufs);
+
+    return ata_rwv(bd_to_ata(bdev), bufs, blocknum, count, 0);
+}
+
+static int
+ata_writev(blockdev_t *bdev, char **bufs, blocknum_t blocknum, unsigned int count)
+{
+    KASSERT(NULL != bdev);
+    KASSERT(NULL != bufs);
+
+    return ata_rwv(bd_to_ata(bdev), bufs, blocknum, count, 1);
+}
+
+/**
+ * Read/write a run of contiguous blocks with a single DMA command.
  *
  * @param adisk the disk to perform the operation on
- * @param data the buffer to write from or read into
- * @param blocknum which block on the disk to read or write
+ * @param segs the buffers to write from or read into, in disk order
+ * @param nsegs the number of segments in segs
+ * @param blocknum which block on the disk to start reading or writing at
+ * @param nblocks the number of blocks, at most ata_max_blocks(adisk)
  * @param write true if writing, false if reading
  * @return 0 on sucess or <0 on error
  */
@@ -483,8 +648,8 @@ ata_write(blockdev_t *bdev, const char *data, blocknum_t blocknum, unsigned int
  *     most-significant eight bits to ATA_REG_LBA2).
  *
  *     (* Note that the special value 0 when written to this
- *     register will in fact write 256 sectors, though you will
- *     not ever be writing this value)
+ *     register will in fact write 256 sectors, which is what a
+ *     full-sized ata_max_blocks() run uses)
  *
  *     o Write to the disk's registers to tell it the type of
  *     operation it will be performing.
@@ -492,10 +657,10 @@ ata_write(blockdev_t *bdev, const char *data, blocknum_t blocknum, unsigned int
  *     You should write either ATA_CMD_WRITE_DMA or
  *     ATA_CMD_READ_DMA to the ATA_REG_COMMAND register.
  *
- *     o Pause to make sure the disk is ready to go (see the
- *     ata_pause() function).
- *
  *     o Start the DMA operation (see the dma_start() function).
+ *     There is no need to pause first: the 400ns wait after a
+ *     command is for reading the status, which we leave to the
+ *     interrupt.
  *
  *     o Now that we have given the disk and the DMA
  *     controller the necessary information, all we have to do
@@ -506,49 +671,65 @@ ata_write(blockdev_t *bdev, const char *data, blocknum_t blocknum, unsigned int
  *
  *     Specifically, we want to sleep on the disk's wait queue
  *     so we can be woken up by the interrupt handler, which
- *     will be called when the DMA operation is completed.
- *
- *     o Once we have woken up from sleep, we need to read
- *     the status of the DMA operation from the disk's
- *     ATA_REG_STATUS register (see the ata_inb_reg()
- *     function).
- *
- *     o Next, we check the status to see if the error bit is
- *     set (for status flags, see ATA_SR_* values). If there
- *     is an error, read the error code from the disk's
- *     ATA_REG_ERROR register (propagate it up as -error).
+ *     will be called when the DMA operation is completed. The
+ *     sleep is not cancellable, since the buffers belong to the
+ *     disk until then.
  *
- *     o Alert the DMA controller that we have received the
- *     interrupt and, if necessary, clear the error bit (see
- *     dma_reset() function).
+ *     o The interrupt handler has read the status of the DMA
+ *     operation from the disk's ATA_REG_STATUS register and,
+ *     if the error bit is set (for status flags, see ATA_SR_*
+ *     values), the error code from the disk's ATA_REG_ERROR
+ *     register, which we propagate up as -error. It has also
+ *     alerted the DMA controller (see the dma_reset()
+ *     function), so that nothing is left to read here.
  *
  *     o Now we are finished. Restore the IPL, release any
  *     locks we have, and return the status of the DMA
  *     operation.
  */
 static int
-ata_do_operation(ata_disk_t *adisk, char *data, blocknum_t blocknum, int write)
+ata_do_operation(ata_disk_t *adisk, const dma_seg_t *segs, int nsegs,
+                 blocknum_t blocknum, unsigned int nblocks, int write)
 {
-    if (blocknum == 1988) {
-        dbg(DBG_TEST, "test");
-    }
     KASSERT(NULL != adisk);
-    KASSERT(NULL != data);
+    KASSERT(NULL != segs);
+    KASSERT(0 < nblocks && nblocks <= ata_max_blocks(adisk));
 
     /*store the old ipl*/
     uint8_t old_ipl = intr_getipl();
     /*set the IPL(not sure about the ipl level)*/
     intr_setipl(INTR_DISK_SECONDARY);
-    /*lock the mutex*/
-    kmutex_lock(&adisk->ata_mutex);
+    /*lock the channel, which the other drive on it shares*/
+    struct ata_channel *chan = &ATA_CHANNELS[adisk->ata_channel];
+    kmutex_lock(&chan->atac_mutex);
 
     /*Initialize DMA*/
-    dma_load(adisk->ata_channel, data, BLOCK_SIZE);
+    dma_load_sg(adisk->ata_channel, segs, nsegs);
+
+    trace_emit(TRACE_DISK, blocknum, nblocks, write);
+    blktrace_issue(&adisk->ata_bdev, blocknum, nblocks, write);
+    if (write) {
+        counter_inc(&ata_nwrites);
+        counter_add(&ata_nblocks_written, nblocks);
+    } else {
+        counter_inc(&ata_nreads);
+        counter_add(&ata_nblocks_read, nblocks);
+    }
 
-    /*number of sectors*/
-    ata_outb_reg(adisk->ata_channel, ATA_REG_SECCOUNT0, adisk->ata_sectors_per_block);
+    /*number of sectors (a count of 256 is written as 0)*/
+    uint32_t nsectors = nblocks * adisk->ata_sectors_per_block;
+    ata_outb_reg(adisk->ata_channel, ATA_REG_SECCOUNT0, (uint8_t)(nsectors & 0xff));
     /*starting sector*/
     uint32_t sectornum = blocknum * adisk->ata_sectors_per_block;
+    /*the drive, and the top four bits of the sector number; the drive
+     *needs a moment only when it has just been selected*/
+    ata_outb_reg(adisk->ata_channel, ATA_REG_DRIVEHEAD,
+                 (adisk->ata_drive ? ATA_DRIVEHEAD_SLAVE : ATA_DRIVEHEAD_MASTER)
+                 | ATA_DRIVEHEAD_LBA | ((sectornum >> 24) & 0x0f));
+    if (chan->atac_selected != adisk->ata_drive) {
+        chan->atac_selected = adisk->ata_drive;
+        ata_pause(adisk->ata_channel);
+    }
     uint8_t byte = (sectornum & 0xff);
     ata_outb_reg(adisk->ata_channel, ATA_REG_LBA0, byte);
     byte = (sectornum & 0xff00) >> 8;
@@ -563,40 +744,28 @@ ata_do_operation(ata_disk_t *adisk, char *data, blocknum_t blocknum, int write)
         ata_outb_reg(adisk->ata_channel, ATA_REG_COMMAND, ATA_CMD_READ_DMA);
     }
 
-    /*pause*/
-    ata_pause(adisk->ata_channel);
-
     /*start*/
+    adisk->ata_done = 0;
+    adisk->ata_busy = 1;
+    chan->atac_active = adisk;
     dma_start(adisk->ata_channel, ATA_CHANNELS[adisk->ata_channel].atac_busmaster, write);
 
-    /*sleep*/
+    /*sleep until ata_intr has completed the command*/
     dbg(DBG_TERM, "do_operation about to go to sleep\n");
-    /*sched_sleep_on(&adisk->ata_waitq);*/
-    sched_cancellable_sleep_on(&adisk->ata_waitq);
+    while (!adisk->ata_done) {
+        sched_sleep_on(&adisk->ata_waitq);
+    }
     dbg(DBG_TERM, "do_operation gets woken up\n");
 
-    /*
-     *wake up
-     */
-
-    /*read the status of the DMA operation*/
-    uint8_t status = ata_inb_reg(adisk->ata_channel, ATA_REG_STATUS);
-    uint8_t error = 0;
-
-    /*check if there is error*/
-    if (ATA_SR_ERR == status) {
-        /*read the error code and return*/
-        error = ata_inb_reg(adisk->ata_channel, ATA_REG_ERROR);
-
+    uint8_t error = adisk->ata_error;
+    if (adisk->ata_status & ATA_SR_ERR) {
         /*clear the error bit*/
         ata_outb_reg(adisk->ata_channel, ATA_REG_ERROR, 0x00);
     }
 
-    /*how to alert the DMA controller that we've received the interrupt*/
-    dma_reset(ATA_CHANNELS[adisk->ata_channel].atac_busmaster);
-
     /*unlock the mutex*/
-    kmutex_unlock(&adisk->ata_mutex);
+    chan->atac_active = NULL;
+    kmutex_unlock(&chan->atac_mutex);
     /*restore the IPL*/
     intr_setipl(old_ipl);
 
@@ -604,18 +773,87 @@ ata_do_operation(ata_disk_t *adisk, char *data, blocknum_t blocknum, int write)
         /*NOT_YET_IMPLEMENTED("DRIVERS: ata_do_operation");*/
 }
 
+/**
+ * Flushes the drive's write cache with FLUSH CACHE, which interrupts when
+ * it is done like a transfer does; nothing to do if the cache is off.
+ *
+ * @param bdev the block device to flush
+ * @return 0 on success and <0 on error
+ */
+static int
+ata_flush(blockdev_t *bdev)
+{
+    KASSERT(NULL != bdev);
+
+    ata_disk_t *adisk = bd_to_ata(bdev);
+    if (!adisk->ata_wcache) {
+        return 0;
+    }
+
+    uint8_t old_ipl = intr_getipl();
+    intr_setipl(INTR_DISK_SECONDARY);
+    struct ata_channel *chan = &ATA_CHANNELS[adisk->ata_channel];
+    kmutex_lock(&chan->atac_mutex);
+
+    ata_outb_reg(adisk->ata_channel, ATA_REG_DRIVEHEAD,
+                 (adisk->ata_drive ? ATA_DRIVEHEAD_SLAVE : ATA_DRIVEHEAD_MASTER)
+                 | ATA_DRIVEHEAD_LBA);
+    if (chan->atac_selected != adisk->ata_drive) {
+        chan->atac_selected = adisk->ata_drive;
+        ata_pause(adisk->ata_channel);
+    }
+    ata_outb_reg(adisk->ata_channel, ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH);
+
+    adisk->ata_done = 0;
+    adisk->ata_busy = 1;
+    chan->atac_active = adisk;
+    while (!adisk->ata_done) {
+        sched_sleep_on(&adisk->ata_waitq);
+    }
+
+    uint8_t error = adisk->ata_error;
+    int ret = (adisk->ata_status & ATA_SR_ERR) ? -(error ? error : EIO) : 0;
+    if (adisk->ata_status & ATA_SR_ERR) {
+        ata_outb_reg(adisk->ata_channel, ATA_REG_ERROR, 0x00);
+    }
+
+    chan->atac_active = NULL;
+    kmutex_unlock(&chan->atac_mutex);
+    intr_setipl(old_ipl);
+
+    return ret;
+}
+
 /**
  * Interrupt handler called by the disk when an operation has
- * completed.
+ * completed. Reading the status acknowledges the interrupt; what the
+ * command came to is left in the disk for ata_do_operation, which is
+ * woken to return it. An interrupt with no command in flight is only
+ * acknowledged.
  *
  * @param regs the register state
- * @param arg the disk the operation was performed on. This should be
- * a pointer to an ata_disk_t struct.
+ * @param arg the channel the operation was performed on. This should
+ * be a pointer to a struct ata_channel, whose atac_active is the disk.
  */
 static void
 ata_intr(regs_t *regs, void *arg)
 {
-    ata_disk_t *adisk = (ata_disk_t *)arg;
+    struct ata_channel *chan = (struct ata_channel *)arg;
+    uint8_t status = inb(chan->atac_cmd + ATA_REG_STATUS);
+    ata_disk_t *adisk = chan->atac_active;
+    if (NULL == adisk || !adisk->ata_busy) {
+        return;
+    }
+
+    adisk->ata_status = status;
+    adisk->ata_error = 0;
+    if (status & ATA_SR_ERR) {
+        adisk->ata_error = ata_inb_reg(adisk->ata_channel, ATA_REG_ERROR);
+    }
+    dma_reset(ATA_CHANNELS[adisk->ata_channel].atac_busmaster);
+
+    adisk->ata_busy = 0;
+    adisk->ata_done = 1;
     sched_wakeup_on(&adisk->ata_waitq);
         /*NOT_YET_IMPLEMENTED("DRIVERS: ata_intr");*/
 }
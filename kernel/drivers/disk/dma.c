@@ -15,7 +15,16 @@ typedef struct {
         uint16_t prd_last;
 } prd_t;
 
-static prd_t prd_table[2] __attribute__((aligned(32)));
+/* A single PRD may not cross a 64K physical boundary and may describe at
+ * most 64K (a count of 0 means 64K) */
+#define PRD_MAX_BYTES    0x10000
+#define PRD_BOUNDARY(x)  ((x) & ~(PRD_MAX_BYTES - 1))
+#define PRD_EOT          0x8000
+
+/* Each table is aligned to its own size so that it can never cross a 64K
+ * boundary, which the busmaster does not allow */
+static prd_t prd_table[2][DMA_MAX_PRDS]
+__attribute__((aligned(DMA_MAX_PRDS * sizeof(prd_t))));
 
 static prd_t *DMA_PRDS[2];
 
@@ -23,21 +32,67 @@ void
 dma_init()
 {
   /* Clear the table */
-  memset(prd_table, 0, sizeof(prd_t) * 2);
-  /* Set pointers to it; note each channel only needs one PRD entry */
-  DMA_PRDS[0] = prd_table;
-  DMA_PRDS[1] = prd_table + 1;
+  memset(prd_table, 0, sizeof(prd_table));
+  /* Set pointers to it; each channel gets its own table */
+  DMA_PRDS[0] = prd_table[0];
+  DMA_PRDS[1] = prd_table[1];
 }
 
-void dma_load(uint8_t channel, void *start, int count) {
-	KASSERT(PAGE_ALIGNED(start));
+/* Append the physical range [paddr, paddr + len) to the PRD table, extending
+ * the last entry when the range directly follows it and the result still
+ * satisfies the busmaster's size and boundary limits. Returns the new last
+ * entry. */
+static prd_t *
+dma_prd_append(prd_t *table, prd_t *prd, uint32_t paddr, uint32_t len)
+{
+	if (NULL != prd) {
+		uint32_t plen = prd->prd_count ? prd->prd_count : PRD_MAX_BYTES;
+		if (prd->prd_addr + plen == paddr
+		    && plen + len <= PRD_MAX_BYTES
+		    && PRD_BOUNDARY(prd->prd_addr) == PRD_BOUNDARY(paddr + len - 1)) {
+			prd->prd_count = (uint16_t)(plen + len);
+			return prd;
+		}
+		prd++;
+	} else {
+		prd = table;
+	}
+	KASSERT(prd < table + DMA_MAX_PRDS && "DMA transfer too scattered");
+	prd->prd_addr = paddr;
+	prd->prd_count = (uint16_t)len;
+	return prd;
+}
+
+void dma_load_sg(uint8_t channel, const dma_seg_t *segs, int nsegs) {
 	prd_t* table = DMA_PRDS[channel];
-	memset(table, 0, sizeof(prd_t));
-	/* set up the PRD for this operation */
-	table->prd_addr = pt_virt_to_phys((uintptr_t) start);
-	table->prd_count = count;
-	table->prd_last = 0x8000;
-	return;
+	prd_t* prd = NULL;
+	int i;
+	KASSERT(0 < nsegs);
+	memset(table, 0, sizeof(prd_t) * DMA_MAX_PRDS);
+	/* set up the PRDs for this operation; each segment is split at page
+	 * boundaries since it need only be virtually contiguous, and
+	 * physically adjacent pages (even across segments) share an entry */
+	for (i = 0; i < nsegs; i++) {
+		uintptr_t vaddr = (uintptr_t)segs[i].ds_addr;
+		uint32_t count = segs[i].ds_len;
+		KASSERT(PAGE_ALIGNED(vaddr));
+		KASSERT(0 < count);
+		while (count > 0) {
+			uint32_t len = MIN(count, PAGE_SIZE);
+			prd = dma_prd_append(table, prd, pt_virt_to_phys(vaddr), len);
+			vaddr += len;
+			count -= len;
+		}
+	}
+	prd->prd_last = PRD_EOT;
+}
+
+void dma_load(uint8_t channel, void *start, int count) {
+	dma_seg_t seg;
+	KASSERT(0 < count && count <= DMA_MAX_PRDS * (int)PAGE_SIZE);
+	seg.ds_addr = start;
+	seg.ds_len = count;
+	dma_load_sg(channel, &seg, 1);
 }
 
 void dma_start(uint8_t channel, uint16_t busmaster_addr, int write) {
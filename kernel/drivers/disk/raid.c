@@ -0,0 +1,267 @@
+#include "kernel.h"
+#include "types.h"
+#include "config.h"
+#include "errno.h"
+
+#include "util/debug.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+#include "drivers/disk/raid.h"
+
+#include "mm/kmalloc.h"
+
+/*
+ * The array does its I/O by queueing requests on the disks it is made of
+ * and then waiting for them all, so that each disk's I/O thread works on
+ * its share at the same time as the others, and each disk's elevator
+ * merges the blocks which land next to one another on it.
+ */
+
+/* Most blocks of a transfer which are queued on the disks at once */
+#define RAID_BATCH      BLOCKDEV_MAX_BATCH
+
+typedef struct raid {
+        blockdev_t      rd_bdev;
+        int             rd_level;
+        int             rd_ndisks;
+        blockdev_t     *rd_disks[RAID_MAX_DISKS];
+
+        /* The block after the last one read from each mirror, which is
+         * roughly where its head is */
+        blocknum_t      rd_next[RAID_MAX_DISKS];
+} raid_t;
+
+#define bdev_to_raid(bd) CONTAINER_OF(bd, raid_t, rd_bdev)
+
+static int raid_read(blockdev_t *bdev, char *buf, blocknum_t loc, size_t count);
+static int raid_write(blockdev_t *bdev, const char *buf, blocknum_t loc, size_t count);
+static int raid_readv(blockdev_t *bdev, char **bufs, blocknum_t loc, size_t count);
+static int raid_writev(blockdev_t *bdev, char **bufs, blocknum_t loc, size_t count);
+static int raid_flush(blockdev_t *bdev);
+
+static blockdev_ops_t raid_ops = {
+        .read_block   = raid_read,
+        .write_block  = raid_write,
+        .read_blockv  = raid_readv,
+        .write_blockv = raid_writev,
+        .flush        = raid_flush
+};
+
+/* The buffer for block i of a transfer, which is either one run of memory
+ * or a buffer per block */
+static char *
+raid_buf(char *buf, char **bufs, size_t i)
+{
+        return (NULL != bufs) ? bufs[i] : buf + i * BLOCK_SIZE;
+}
+
+/* Queues one block of I/O on a disk, remembering the disk for
+ * raid_wait; NULL if there is no memory for the request */
+static blockdev_req_t *
+raid_submit(blockdev_t *disk, char *buf, blocknum_t loc, int write)
+{
+        blockdev_req_t *req = blockdev_req_alloc();
+
+        if (NULL != req) {
+                blockdev_req_init(req, buf, loc, write, NULL, disk);
+                blockdev_submit(disk, req);
+        }
+        return req;
+}
+
+/*
+ * Waits for and frees n requests, returning the first error. With retry,
+ * a block which could not be read from one mirror is read from the
+ * others in turn.
+ */
+static int
+raid_wait(raid_t *rd, blockdev_req_t **reqs, int n, int retry)
+{
+        int i, j, ret = 0;
+
+        for (i = 0; i < n; i++) {
+                int err;
+
+                if (NULL == reqs[i]) {
+                        if (0 == ret)
+                                ret = -ENOMEM;
+                        continue;
+                }
+                err = blockdev_wait(reqs[i]);
+                for (j = 0; retry && 0 > err && j < rd->rd_ndisks; j++) {
+                        if (rd->rd_disks[j] == (blockdev_t *)reqs[i]->br_arg)
+                                continue;
+                        dbg(DBG_DISK, "raid: block %u failed (%d), trying mirror %d\n",
+                            reqs[i]->br_blocknum, err, j);
+                        err = blockdev_read(rd->rd_disks[j], reqs[i]->br_buf,
+                                            reqs[i]->br_blocknum);
+                }
+                if (0 > err && 0 == ret)
+                        ret = err;
+                blockdev_req_free(reqs[i]);
+        }
+        return ret;
+}
+
+/* Blocks go to the disks RAID_CHUNK_BLOCKS at a time, round and round */
+static int
+raid_stripe(raid_t *rd, char *buf, char **bufs, size_t first,
+            blocknum_t loc, size_t n, int write)
+{
+        blockdev_req_t *reqs[RAID_BATCH];
+        size_t i;
+
+        for (i = 0; i < n; i++) {
+                blocknum_t chunk = (loc + i) / RAID_CHUNK_BLOCKS;
+                int disk = chunk % rd->rd_ndisks;
+                blocknum_t dloc = (chunk / rd->rd_ndisks) * RAID_CHUNK_BLOCKS
+                                  + (loc + i) % RAID_CHUNK_BLOCKS;
+                reqs[i] = raid_submit(rd->rd_disks[disk], raid_buf(buf, bufs, first + i),
+                                      dloc, write);
+        }
+        return raid_wait(rd, reqs, n, 0);
+}
+
+static int
+raid_mirror_write(raid_t *rd, char *buf, char **bufs, size_t first,
+                  blocknum_t loc, size_t n)
+{
+        blockdev_req_t *reqs[RAID_BATCH * RAID_MAX_DISKS];
+        size_t i;
+        int j, nreqs = 0;
+
+        for (i = 0; i < n; i++) {
+                for (j = 0; j < rd->rd_ndisks; j++)
+                        reqs[nreqs++] = raid_submit(rd->rd_disks[j],
+                                                    raid_buf(buf, bufs, first + i),
+                                                    loc + i, 1);
+        }
+        return raid_wait(rd, reqs, nreqs, 0);
+}
+
+/*
+ * A read starts on the mirror whose head is nearest, so that a sequential
+ * reader stays on one disk while another reader elsewhere uses the other.
+ * A read of several blocks is split between the mirrors, a run to each.
+ */
+static int
+raid_mirror_read(raid_t *rd, char *buf, char **bufs, size_t first,
+                 blocknum_t loc, size_t n)
+{
+        blockdev_req_t *reqs[RAID_BATCH];
+        size_t i, per;
+        int j, start = 0;
+        uint32_t best = (uint32_t) -1;
+
+        for (j = 0; j < rd->rd_ndisks; j++) {
+                uint32_t dist = (rd->rd_next[j] > loc) ? rd->rd_next[j] - loc
+                                : loc - rd->rd_next[j];
+                if (dist < best) {
+                        best = dist;
+                        start = j;
+                }
+        }
+
+        per = (n + rd->rd_ndisks - 1) / rd->rd_ndisks;
+        for (i = 0; i < n; i++) {
+                int disk = (start + i / per) % rd->rd_ndisks;
+                reqs[i] = raid_submit(rd->rd_disks[disk], raid_buf(buf, bufs, first + i),
+                                      loc + i, 0);
+                rd->rd_next[disk] = loc + i + 1;
+        }
+        return raid_wait(rd, reqs, n, 1);
+}
+
+static int
+raid_rw(raid_t *rd, char *buf, char **bufs, blocknum_t loc, size_t count, int write)
+{
+        size_t done, n;
+        int err, ret = 0;
+
+        for (done = 0; done < count; done += n) {
+                n = MIN(count - done, RAID_BATCH);
+                if (0 == rd->rd_level)
+                        err = raid_stripe(rd, buf, bufs, done, loc + done, n, write);
+                else if (write)
+                        err = raid_mirror_write(rd, buf, bufs, done, loc + done, n);
+                else
+                        err = raid_mirror_read(rd, buf, bufs, done, loc + done, n);
+                if (0 > err && 0 == ret)
+                        ret = err;
+        }
+        return ret;
+}
+
+static int
+raid_read(blockdev_t *bdev, char *buf, blocknum_t loc, size_t count)
+{
+        return raid_rw(bdev_to_raid(bdev), buf, NULL, loc, count, 0);
+}
+
+static int
+raid_write(blockdev_t *bdev, const char *buf, blocknum_t loc, size_t count)
+{
+        return raid_rw(bdev_to_raid(bdev), (char *)buf, NULL, loc, count, 1);
+}
+
+static int
+raid_readv(blockdev_t *bdev, char **bufs, blocknum_t loc, size_t count)
+{
+        return raid_rw(bdev_to_raid(bdev), NULL, bufs, loc, count, 0);
+}
+
+static int
+raid_writev(blockdev_t *bdev, char **bufs, blocknum_t loc, size_t count)
+{
+        return raid_rw(bdev_to_raid(bdev), NULL, bufs, loc, count, 1);
+}
+
+static int
+raid_flush(blockdev_t *bdev)
+{
+        raid_t *rd = bdev_to_raid(bdev);
+        int i, ret, err = 0;
+
+        for (i = 0; i < rd->rd_ndisks; i++) {
+                if ((ret = blockdev_flush(rd->rd_disks[i])) < 0 && !err)
+                        err = ret;
+        }
+        return err;
+}
+
+void
+raid_init(void)
+{
+        raid_t *rd;
+        int i, minor;
+
+        if (0 > RAID_LEVEL)
+                return;
+        KASSERT((0 == RAID_LEVEL || 1 == RAID_LEVEL) && "unknown RAID_LEVEL");
+        KASSERT(0 < RAID_NDISKS && RAID_NDISKS <= RAID_MAX_DISKS);
+
+        if (NULL == (rd = (raid_t *)kmalloc(sizeof(raid_t))))
+                panic("Not enough memory for raid struct!\n");
+        rd->rd_level = RAID_LEVEL;
+        rd->rd_ndisks = RAID_NDISKS;
+        for (i = 0; i < RAID_NDISKS; i++) {
+                rd->rd_disks[i] = blockdev_lookup(MKDEVID(DISK_MAJOR, RAID_FIRST_DISK + i));
+                rd->rd_next[i] = 0;
+                if (NULL == rd->rd_disks[i]) {
+                        dbg(DBG_DISK, "raid: no disk%d, not building the array\n",
+                            RAID_FIRST_DISK + i);
+                        kfree(rd);
+                        return;
+                }
+        }
+
+        for (minor = 0; NULL != blockdev_lookup(MKDEVID(DISK_MAJOR, minor)); minor++)
+                ;
+        rd->rd_bdev.bd_id = MKDEVID(DISK_MAJOR, minor);
+        rd->rd_bdev.bd_ops = &raid_ops;
+        blockdev_register(&rd->rd_bdev);
+
+        dbg(DBG_DISK, "raid: disk%d is RAID-%d over disk%d to disk%d\n", minor,
+            RAID_LEVEL, RAID_FIRST_DISK, RAID_FIRST_DISK + RAID_NDISKS - 1);
+}
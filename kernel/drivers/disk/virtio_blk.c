@@ -0,0 +1,379 @@
+#include "kernel.h"
+#include "types.h"
+#include "errno.h"
+
+#include "main/interrupt.h"
+#include "main/io.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/string.h"
+#include "util/counter.h"
+#include "util/trace.h"
+
+#include "drivers/blktrace.h"
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+#include "drivers/pci.h"
+#include "drivers/virtio.h"
+#include "drivers/disk/virtio_blk.h"
+
+#include "proc/sched.h"
+
+#include "mm/kmalloc.h"
+
+/* A transitional virtio-blk device, which has the legacy interface */
+#define VIRTIO_PCI_DEVICE_BLK           0x1001
+
+/* virtio-blk configuration, from VIRTIO_REG_CONFIG */
+#define VIRTIO_BLK_CFG_CAPACITY         0x00    /* 64 bits, in sectors */
+#define VIRTIO_BLK_CFG_SEG_MAX          0x0c    /* 32 bits */
+
+/* Feature bits, those that the driver takes if offered */
+#define VIRTIO_BLK_F_SEG_MAX            BIT(2)
+#define VIRTIO_BLK_F_RO                 BIT(5)
+#define VIRTIO_BLK_F_FLUSH              BIT(9)  /* it has a write cache */
+#define VIRTIO_BLK_FEATURES \
+        (VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH \
+         | VIRTIO_RING_F_EVENT_IDX)
+
+/* Request types and statuses */
+#define VIRTIO_BLK_T_IN                 0
+#define VIRTIO_BLK_T_OUT                1
+#define VIRTIO_BLK_T_FLUSH              4
+#define VIRTIO_BLK_S_OK                 0
+
+#define VIRTIO_SECTOR_SIZE              512
+
+/* The header the device reads at the start of each request */
+typedef struct virtio_blk_hdr {
+        uint32_t vh_type;
+        uint32_t vh_reserved;
+        uint64_t vh_sector;
+} virtio_blk_hdr_t;
+
+/* A request in flight, on the stack of the thread waiting for it; the
+ * device reads vo_hdr and writes vo_status */
+typedef struct vblk_op {
+        virtio_blk_hdr_t  vo_hdr;
+        volatile uint8_t  vo_status;
+        volatile int      vo_done;
+        ktqueue_t         vo_waitq;
+} vblk_op_t;
+
+typedef struct virtio_blk {
+        uint16_t                 vb_iobase;
+        uint32_t                 vb_features;   /* as negotiated */
+        int                      vb_readonly;
+
+        /* The virtqueue, each request on it given as its vblk_op_t */
+        virtq_t                  vb_vq;
+        ktqueue_t                vb_descwaitq;  /* waiting for descriptors */
+
+        /* Most blocks in one request */
+        uint32_t                 vb_max_blocks;
+
+        list_link_t              vb_link;       /* on vblk_list */
+        blockdev_t               vb_bdev;
+} virtio_blk_t;
+
+#define bd_to_vblk(bd) (CONTAINER_OF((bd), virtio_blk_t, vb_bdev))
+
+#define NDISKS __NDISKS__
+
+static list_t vblk_list;
+
+/* Requests made of all the virtio disks, and the blocks they moved */
+static counter_t vblk_nreads;
+static counter_t vblk_nwrites;
+static counter_t vblk_nblocks_read;
+static counter_t vblk_nblocks_written;
+static counter_t vblk_nnotifies;
+static counter_t vblk_nflushes;
+
+static int vblk_read(blockdev_t *bdev, char *data, blocknum_t blocknum, size_t count);
+static int vblk_write(blockdev_t *bdev, const char *data, blocknum_t blocknum, size_t count);
+static int vblk_readv(blockdev_t *bdev, char **bufs, blocknum_t blocknum, size_t count);
+static int vblk_writev(blockdev_t *bdev, char **bufs, blocknum_t blocknum, size_t count);
+static int vblk_flush(blockdev_t *bdev);
+static void vblk_intr(regs_t *regs);
+
+static blockdev_ops_t vblk_ops = {
+        .read_block   = vblk_read,
+        .write_block  = vblk_write,
+        .read_blockv  = vblk_readv,
+        .write_blockv = vblk_writev,
+        .flush        = vblk_flush
+};
+
+/*
+ * Reads or writes a run of contiguous blocks, at most vb_max_blocks of
+ * them, as one request: a descriptor for the header, one for each block,
+ * and one for the status. A flush is the same without any blocks. Waits
+ * for free descriptors, then for the request to complete, with the disk's
+ * interrupt masked in between, as ata_do_operation does; the sleeps are
+ * not cancellable, since the buffers belong to the device until the
+ * request completes.
+ *
+ * @param buf the blocks in one buffer, or NULL if bufs is given
+ * @param bufs one page-aligned buffer per block
+ * @return 0 on success, -EROFS for a write to a read-only disk, or -EIO
+ */
+static int
+vblk_do_operation(virtio_blk_t *vb, char *buf, char **bufs, blocknum_t blocknum,
+                  unsigned int nblocks, uint32_t type)
+{
+        vblk_op_t op;
+        virtq_seg_t segs[BLOCKDEV_MAX_BATCH + 2];
+        unsigned int i;
+        int write = (VIRTIO_BLK_T_OUT == type);
+        uint8_t oldipl;
+
+        KASSERT((VIRTIO_BLK_T_FLUSH == type) == (0 == nblocks));
+        KASSERT(nblocks <= vb->vb_max_blocks);
+
+        if (write && vb->vb_readonly)
+                return -EROFS;
+
+        op.vo_hdr.vh_type = type;
+        op.vo_hdr.vh_reserved = 0;
+        op.vo_hdr.vh_sector = (uint64_t)blocknum * (BLOCK_SIZE / VIRTIO_SECTOR_SIZE);
+        op.vo_status = 0xff;
+        op.vo_done = 0;
+        sched_queue_init(&op.vo_waitq);
+        sched_queue_class(&op.vo_waitq, SCHED_WQ_DISK);
+
+        segs[0].vs_addr = &op.vo_hdr;
+        segs[0].vs_len = sizeof(op.vo_hdr);
+        segs[0].vs_devwrite = 0;
+        for (i = 0; i < nblocks; i++) {
+                segs[i + 1].vs_addr = (NULL != bufs) ? bufs[i] : buf + i * BLOCK_SIZE;
+                segs[i + 1].vs_len = BLOCK_SIZE;
+                segs[i + 1].vs_devwrite = !write;
+        }
+        segs[nblocks + 1].vs_addr = (const void *)&op.vo_status;
+        segs[nblocks + 1].vs_len = 1;
+        segs[nblocks + 1].vs_devwrite = 1;
+
+        oldipl = intr_getipl();
+        intr_setipl(INTR_DISK_VIRTIO);
+
+        while (0 != virtq_add(&vb->vb_vq, segs, nblocks + 2, &op))
+                sched_sleep_on(&vb->vb_descwaitq);
+
+        if (0 == nblocks) {
+                counter_inc(&vblk_nflushes);
+        } else if (write) {
+                trace_emit(TRACE_DISK, blocknum, nblocks, write);
+                blktrace_issue(&vb->vb_bdev, blocknum, nblocks, write);
+                counter_inc(&vblk_nwrites);
+                counter_add(&vblk_nblocks_written, nblocks);
+        } else {
+                trace_emit(TRACE_DISK, blocknum, nblocks, write);
+                blktrace_issue(&vb->vb_bdev, blocknum, nblocks, write);
+                counter_inc(&vblk_nreads);
+                counter_add(&vblk_nblocks_read, nblocks);
+        }
+
+        if (virtq_kick(&vb->vb_vq))
+                counter_inc(&vblk_nnotifies);
+
+        while (!op.vo_done)
+                sched_sleep_on(&op.vo_waitq);
+
+        intr_setipl(oldipl);
+
+        return (VIRTIO_BLK_S_OK == op.vo_status) ? 0 : -EIO;
+}
+
+static int
+vblk_rw(virtio_blk_t *vb, char *buf, char **bufs, blocknum_t blocknum,
+        unsigned int count, int write)
+{
+        while (count > 0) {
+                int ret;
+                unsigned int n = MIN(count, vb->vb_max_blocks);
+                if (0 != (ret = vblk_do_operation(vb, buf, bufs, blocknum, n,
+                                                  write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN)))
+                        return ret;
+                if (NULL != bufs)
+                        bufs += n;
+                else
+                        buf += n * BLOCK_SIZE;
+                blocknum += n;
+                count -= n;
+        }
+        return 0;
+}
+
+static int
+vblk_read(blockdev_t *bdev, char *data, blocknum_t blocknum, size_t count)
+{
+        KASSERT(NULL != bdev && NULL != data);
+        return vblk_rw(bd_to_vblk(bdev), data, NULL, blocknum, count, 0);
+}
+
+static int
+vblk_write(blockdev_t *bdev, const char *data, blocknum_t blocknum, size_t count)
+{
+        KASSERT(NULL != bdev && NULL != data);
+        return vblk_rw(bd_to_vblk(bdev), (char *)data, NULL, blocknum, count, 1);
+}
+
+static int
+vblk_readv(blockdev_t *bdev, char **bufs, blocknum_t blocknum, size_t count)
+{
+        KASSERT(NULL != bdev && NULL != bufs);
+        return vblk_rw(bd_to_vblk(bdev), NULL, bufs, blocknum, count, 0);
+}
+
+static int
+vblk_writev(blockdev_t *bdev, char **bufs, blocknum_t blocknum, size_t count)
+{
+        KASSERT(NULL != bdev && NULL != bufs);
+        return vblk_rw(bd_to_vblk(bdev), NULL, bufs, blocknum, count, 1);
+}
+
+/* Without VIRTIO_BLK_F_FLUSH the device has no cache to flush */
+static int
+vblk_flush(blockdev_t *bdev)
+{
+        virtio_blk_t *vb = bd_to_vblk(bdev);
+
+        if (!(vb->vb_features & VIRTIO_BLK_F_FLUSH))
+                return 0;
+        return vblk_do_operation(vb, NULL, NULL, 0, 0, VIRTIO_BLK_T_FLUSH);
+}
+
+/*
+ * Completes the requests the device has put on the used ring, giving their
+ * descriptors back and waking their threads. The device is asked not to
+ * interrupt for what it finishes meanwhile, and once it is asked to again
+ * the ring is looked at once more, for what it finished before it knew.
+ */
+static void
+vblk_reap(virtio_blk_t *vb)
+{
+        vblk_op_t *op;
+        int freed = 0;
+
+        do {
+                virtq_intr_disable(&vb->vb_vq);
+                while (NULL != (op = virtq_get(&vb->vb_vq, NULL))) {
+                        op->vo_done = 1;
+                        sched_wakeup_on(&op->vo_waitq);
+                        freed = 1;
+                }
+        } while (virtq_intr_enable(&vb->vb_vq));
+
+        if (freed)
+                sched_broadcast_on(&vb->vb_descwaitq);
+}
+
+/* Every virtio disk interrupts on the same vector, and reading the ISR
+ * status tells whether it was one and acknowledges it */
+static void
+vblk_intr(regs_t *regs)
+{
+        virtio_blk_t *vb;
+
+        list_iterate_begin(&vblk_list, vb, virtio_blk_t, vb_link) {
+                if (inb(vb->vb_iobase + VIRTIO_REG_ISR_STATUS) & VIRTIO_ISR_QUEUE)
+                        vblk_reap(vb);
+        } list_iterate_end();
+}
+
+/*
+ * Resets the device, agrees on features, sets up its virtqueue and
+ * registers it as disk minor. Returns 0, or -errno if the device cannot
+ * be used, in which case it is left marked as failed.
+ */
+static int
+vblk_attach(pcidev_t *pdev, int minor)
+{
+        virtio_blk_t *vb;
+        uint16_t iobase;
+        uint32_t features, seg_max;
+        uint64_t capacity;
+
+        if (PCI_IO != pdev->pci_bar[0].mem_type) {
+                dbg(DBG_DISK, "virtio-blk: no I/O port BAR, skipping\n");
+                return -ENODEV;
+        }
+        iobase = (uint16_t)pdev->pci_bar[0].base_addr;
+        pci_write_config(pdev, PCI_COMMAND, pci_read_config(pdev, PCI_COMMAND, 2)
+                         | PCI_CMD_IO | PCI_CMD_BUSMASTER, 2);
+
+        features = virtio_negotiate(iobase, VIRTIO_BLK_FEATURES);
+
+        if (NULL == (vb = (virtio_blk_t *)kmalloc(sizeof(virtio_blk_t))))
+                panic("Not enough memory for virtio-blk disk!\n");
+        if (0 != virtq_init(&vb->vb_vq, iobase, 0, !!(features & VIRTIO_RING_F_EVENT_IDX))
+            || 3 > vb->vb_vq.vq_size) {
+                virtio_fail(iobase);
+                kfree(vb);
+                return -ENODEV;
+        }
+
+        vb->vb_iobase = iobase;
+        vb->vb_features = features;
+        vb->vb_readonly = !!(features & VIRTIO_BLK_F_RO);
+        sched_queue_init(&vb->vb_descwaitq);
+        sched_queue_class(&vb->vb_descwaitq, SCHED_WQ_DISK);
+
+        /* the segments of a request are gathered on the stack, so there
+         * are no more of them than there are blocks in a batch */
+        seg_max = (features & VIRTIO_BLK_F_SEG_MAX)
+                  ? inl(iobase + VIRTIO_REG_CONFIG + VIRTIO_BLK_CFG_SEG_MAX) : 0;
+        vb->vb_max_blocks = MIN(vb->vb_vq.vq_size - 2, BLOCKDEV_MAX_BATCH);
+        if (0 < seg_max)
+                vb->vb_max_blocks = MIN(vb->vb_max_blocks, seg_max);
+        capacity = inl(iobase + VIRTIO_REG_CONFIG + VIRTIO_BLK_CFG_CAPACITY)
+                   | ((uint64_t)inl(iobase + VIRTIO_REG_CONFIG + VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+
+        list_insert_tail(&vblk_list, &vb->vb_link);
+        /* MSI-X would move the device configuration in the legacy
+         * layout, plain MSI does not */
+        if (0 != pci_msi_enable(pdev, INTR_DISK_VIRTIO))
+                intr_map(pdev->pci_irq, INTR_DISK_VIRTIO);
+        virtio_driver_ok(iobase);
+
+        dbg(DBG_DISK, "Initialized virtio-blk device %d, I/O ports 0x%x, IRQ %u, "
+            "%u sectors, queue of %u, features 0x%x\n", minor, iobase, pdev->pci_irq,
+            (uint32_t)capacity, vb->vb_vq.vq_size, features);
+
+        vb->vb_bdev.bd_id = MKDEVID(DISK_MAJOR, minor);
+        vb->vb_bdev.bd_ops = &vblk_ops;
+        blockdev_register(&vb->vb_bdev);
+        return 0;
+}
+
+void
+virtio_blk_init(void)
+{
+        pcidev_t *pdev = NULL;
+        int minor;
+        uint8_t oldipl;
+
+        list_init(&vblk_list);
+        intr_register(INTR_DISK_VIRTIO, vblk_intr);
+
+        counter_register(&vblk_nreads, "vblk.reads");
+        counter_register(&vblk_nwrites, "vblk.writes");
+        counter_register(&vblk_nblocks_read, "vblk.blocks_read");
+        counter_register(&vblk_nblocks_written, "vblk.blocks_written");
+        counter_register(&vblk_nnotifies, "vblk.notifies");
+        counter_register(&vblk_nflushes, "vblk.flushes");
+
+        for (minor = 0; NULL != blockdev_lookup(MKDEVID(DISK_MAJOR, minor)); minor++)
+                ;
+
+        oldipl = intr_getipl();
+        intr_setipl(INTR_DISK_VIRTIO);
+        while (minor < NDISKS
+               && NULL != (pdev = pci_lookup_id(VIRTIO_PCI_VENDOR, VIRTIO_PCI_DEVICE_BLK, pdev))) {
+                if (0 == vblk_attach(pdev, minor))
+                        minor++;
+        }
+        intr_setipl(oldipl);
+}
@@ -3,6 +3,7 @@
 
 #include "util/string.h"
 #include "util/debug.h"
+#include "util/counter.h"
 
 #include "mm/mm.h"
 #include "mm/page.h"
@@ -10,6 +11,7 @@
 #include "mm/kmalloc.h"
 #include "mm/pframe.h"
 
+#include "drivers/blktrace.h"
 #include "drivers/bytedev.h"
 
 #include "vm/anon.h"
@@ -22,12 +24,20 @@ static int null_write(bytedev_t *dev, int offset, const void *buf, int count);
 static int zero_read(bytedev_t *dev, int offset, void *buf, int count);
 static int zero_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret);
 
+static int counters_read(bytedev_t *dev, int offset, void *buf, int count);
+static int counters_write(bytedev_t *dev, int offset, const void *buf, int count);
+
+static int blktrace_dev_read(bytedev_t *dev, int offset, void *buf, int count);
+static int blktrace_dev_write(bytedev_t *dev, int offset, const void *buf, int count);
+
 bytedev_ops_t null_dev_ops = {
         null_read,
         null_write,
         NULL,
         NULL,
         NULL,
+        NULL,
+        NULL,
         NULL
 };
 
@@ -37,6 +47,30 @@ bytedev_ops_t zero_dev_ops = {
         zero_mmap,
         NULL,
         NULL,
+        NULL,
+        NULL,
+        NULL
+};
+
+bytedev_ops_t counters_dev_ops = {
+        counters_read,
+        counters_write,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL
+};
+
+bytedev_ops_t blktrace_dev_ops = {
+        blktrace_dev_read,
+        blktrace_dev_write,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
         NULL
 };
 
@@ -57,6 +91,16 @@ memdevs_init()
     zero_dev->cd_id = MEM_ZERO_DEVID;
     zero_dev->cd_ops = &zero_dev_ops;
     bytedev_register(zero_dev);
+
+    bytedev_t *counters_dev = (bytedev_t *)kmalloc(sizeof(bytedev_t));
+    counters_dev->cd_id = MEM_COUNTERS_DEVID;
+    counters_dev->cd_ops = &counters_dev_ops;
+    bytedev_register(counters_dev);
+
+    bytedev_t *blktrace_dev = (bytedev_t *)kmalloc(sizeof(bytedev_t));
+    blktrace_dev->cd_id = MEM_BLKTRACE_DEVID;
+    blktrace_dev->cd_ops = &blktrace_dev_ops;
+    bytedev_register(blktrace_dev);
         /*NOT_YET_IMPLEMENTED("DRIVERS: memdevs_init");*/
 }
 
@@ -148,3 +192,66 @@ zero_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret)
         /*NOT_YET_IMPLEMENTED("VM: zero_mmap");*/
         /*return -1;*/
 }
+
+/**
+ * Reads the kernel's event counters (see util/counter.h), as lines of
+ * text. Unlike the other memory devices the offset matters, so that the
+ * text can be read a piece at a time.
+ *
+ * @param dev the counters device
+ * @param offset the offset into the text to read from
+ * @param buf the buffer to read into
+ * @param count the maximum number of bytes to read
+ * @return the number of bytes read, 0 at the end of the text
+ */
+static int
+counters_read(bytedev_t *dev, int offset, void *buf, int count)
+{
+    return counter_format(offset, (char *)buf, count);
+}
+
+/* The counters are only read */
+static int
+counters_write(bytedev_t *dev, int offset, const void *buf, int count)
+{
+    return -EACCES;
+}
+
+/**
+ * Reads block I/O trace records (see drivers/blktrace.h), in binary. The
+ * offset picks the first record, so it must be a multiple of the size of
+ * one, and only whole records are read.
+ *
+ * @param dev the blktrace device
+ * @param offset the offset of the first record to read
+ * @param buf the buffer to read into
+ * @param count the maximum number of bytes to read
+ * @return the number of bytes read, 0 once there are no newer records
+ */
+static int
+blktrace_dev_read(bytedev_t *dev, int offset, void *buf, int count)
+{
+    if (offset < 0 || count < 0) {
+        return -EINVAL;
+    }
+    return blktrace_read(offset, buf, count);
+}
+
+/* '1' turns tracing on and '0' off */
+static int
+blktrace_dev_write(bytedev_t *dev, int offset, const void *buf, int count)
+{
+    const char *c = (const char *)buf;
+
+    if (0 == count) {
+        return 0;
+    }
+    if ('1' == c[0]) {
+        blktrace_enabled = 1;
+    } else if ('0' == c[0]) {
+        blktrace_enabled = 0;
+    } else {
+        return -EINVAL;
+    }
+    return count;
+}
@@ -0,0 +1,314 @@
+#include "kernel.h"
+#include "types.h"
+#include "errno.h"
+#include "config.h"
+
+#include "main/interrupt.h"
+#include "main/io.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/string.h"
+#include "util/counter.h"
+#include "util/init.h"
+
+#include "drivers/pci.h"
+#include "drivers/virtio.h"
+#include "drivers/net/virtio_net.h"
+
+#include "proc/sched.h"
+
+#include "mm/kmalloc.h"
+
+#include "net/net.h"
+
+/* A transitional virtio-net device, which has the legacy interface */
+#define VIRTIO_PCI_DEVICE_NET           0x1000
+
+/* virtio-net configuration, from VIRTIO_REG_CONFIG */
+#define VIRTIO_NET_CFG_MAC              0x00    /* 6 bytes */
+
+/* Feature bits, those that the driver takes if offered */
+#define VIRTIO_NET_F_MAC                BIT(5)
+#define VIRTIO_NET_FEATURES             (VIRTIO_NET_F_MAC | VIRTIO_RING_F_EVENT_IDX)
+
+#define VIRTIO_NET_RXQ                  0
+#define VIRTIO_NET_TXQ                  1
+
+/* The header in front of each frame, in a descriptor of its own, since a
+ * legacy device need not take it any other way; without any offloads
+ * agreed on it is all zeroes */
+typedef struct virtio_net_hdr {
+        uint8_t  vh_flags;
+        uint8_t  vh_gso_type;
+        uint16_t vh_hdr_len;
+        uint16_t vh_gso_size;
+        uint16_t vh_csum_start;
+        uint16_t vh_csum_offset;
+} virtio_net_hdr_t;
+
+typedef struct virtio_net {
+        uint16_t                 nv_iobase;
+        uint32_t                 nv_features;   /* as negotiated */
+
+        /* Received into netbufs, nv_rxposted of which are on nv_rxq, each
+         * with the header at NETBUF_START and the frame after it */
+        virtq_t                  nv_rxq;
+        int                      nv_rxposted;
+
+        /* Sent from netbufs, which are freed once the device is done
+         * with them; senders wait on nv_txwaitq for room */
+        virtq_t                  nv_txq;
+        ktqueue_t                nv_txwaitq;
+
+        list_link_t              nv_link;       /* on vnet_list */
+        netdev_t                 nv_ndev;
+} virtio_net_t;
+
+#define nd_to_vnet(nd) (CONTAINER_OF((nd), virtio_net_t, nv_ndev))
+
+static list_t vnet_list;
+
+/* Notifications of the devices, and the times a sender found the
+ * transmit queue full */
+static counter_t vnet_nnotifies;
+static counter_t vnet_ntxfull;
+
+static int vnet_xmit(netdev_t *nd, netbuf_t *nb);
+static void vnet_receive(netdev_t *nd, list_t *frames);
+static void vnet_intr(regs_t *regs);
+
+static netdev_ops_t vnet_ops = {
+        .xmit    = vnet_xmit,
+        .receive = vnet_receive
+};
+
+static const char *vnet_names[] = { "net0", "net1", "net2", "net3" };
+
+/*
+ * Gives the device netbufs to receive into until it has NET_RX_BUFS of
+ * them, or there is no memory for more, in which case it makes do with
+ * what it has until the next time.
+ */
+static void
+vnet_rx_fill(virtio_net_t *nv)
+{
+        virtq_seg_t segs[2];
+        netbuf_t *nb;
+        uint8_t oldipl;
+        int added = 0;
+
+        while (nv->nv_rxposted < NET_RX_BUFS) {
+                if (NULL == (nb = netbuf_alloc()))
+                        break;
+                segs[0].vs_addr = NETBUF_START(nb);
+                segs[0].vs_len = sizeof(virtio_net_hdr_t);
+                segs[0].vs_devwrite = 1;
+                segs[1].vs_addr = NETBUF_START(nb) + sizeof(virtio_net_hdr_t);
+                segs[1].vs_len = NETBUF_END(nb) - (NETBUF_START(nb) + sizeof(virtio_net_hdr_t));
+                segs[1].vs_devwrite = 1;
+
+                oldipl = intr_getipl();
+                intr_setipl(INTR_NET_VIRTIO);
+                if (0 != virtq_add(&nv->nv_rxq, segs, 2, nb)) {
+                        intr_setipl(oldipl);
+                        netbuf_free(nb);
+                        break;
+                }
+                intr_setipl(oldipl);
+                nv->nv_rxposted++;
+                added = 1;
+        }
+
+        if (added) {
+                oldipl = intr_getipl();
+                intr_setipl(INTR_NET_VIRTIO);
+                if (virtq_kick(&nv->nv_rxq))
+                        counter_inc(&vnet_nnotifies);
+                intr_setipl(oldipl);
+        }
+}
+
+/* Takes the frames the device has received, and posts new netbufs in
+ * their place, from netd */
+static void
+vnet_receive(netdev_t *nd, list_t *frames)
+{
+        virtio_net_t *nv = nd_to_vnet(nd);
+        netbuf_t *nb;
+        uint32_t len;
+        uint8_t oldipl;
+
+        oldipl = intr_getipl();
+        intr_setipl(INTR_NET_VIRTIO);
+        do {
+                virtq_intr_disable(&nv->nv_rxq);
+                while (NULL != (nb = virtq_get(&nv->nv_rxq, &len))) {
+                        nv->nv_rxposted--;
+                        if (len < sizeof(virtio_net_hdr_t) + ETH_HLEN) {
+                                netbuf_free(nb);
+                                continue;
+                        }
+                        nb->nb_data = NETBUF_START(nb) + sizeof(virtio_net_hdr_t);
+                        nb->nb_len = len - sizeof(virtio_net_hdr_t);
+                        list_insert_tail(frames, &nb->nb_link);
+                }
+        } while (virtq_intr_enable(&nv->nv_rxq));
+        intr_setipl(oldipl);
+
+        vnet_rx_fill(nv);
+}
+
+/* Frees the netbufs the device has sent. Called with the device's
+ * interrupt masked. */
+static void
+vnet_tx_reap(virtio_net_t *nv)
+{
+        netbuf_t *nb;
+
+        while (NULL != (nb = virtq_get(&nv->nv_txq, NULL)))
+                netbuf_free(nb);
+}
+
+/*
+ * The transmit queue does not interrupt as a rule, since whatever it has
+ * sent is freed by the next sender; only a sender which finds it full asks
+ * it to, and sleeps until it does. The sleep is not cancellable, since
+ * the stack has handed the netbuf over.
+ */
+static int
+vnet_xmit(netdev_t *nd, netbuf_t *nb)
+{
+        virtio_net_t *nv = nd_to_vnet(nd);
+        virtio_net_hdr_t *vh;
+        virtq_seg_t segs[2];
+        uint8_t oldipl;
+
+        vh = (virtio_net_hdr_t *)netbuf_push(nb, sizeof(*vh));
+        memset(vh, 0, sizeof(*vh));
+        segs[0].vs_addr = vh;
+        segs[0].vs_len = sizeof(*vh);
+        segs[0].vs_devwrite = 0;
+        segs[1].vs_addr = nb->nb_data + sizeof(*vh);
+        segs[1].vs_len = nb->nb_len - sizeof(*vh);
+        segs[1].vs_devwrite = 0;
+
+        oldipl = intr_getipl();
+        intr_setipl(INTR_NET_VIRTIO);
+        while (1) {
+                vnet_tx_reap(nv);
+                if (0 == virtq_add(&nv->nv_txq, segs, 2, nb))
+                        break;
+                counter_inc(&vnet_ntxfull);
+                if (!virtq_intr_enable(&nv->nv_txq))
+                        sched_sleep_on(&nv->nv_txwaitq);
+                virtq_intr_disable(&nv->nv_txq);
+        }
+        if (virtq_kick(&nv->nv_txq))
+                counter_inc(&vnet_nnotifies);
+        intr_setipl(oldipl);
+        return 0;
+}
+
+/* Every virtio network device interrupts on the same vector, and reading
+ * the ISR status tells whether it was one and acknowledges it. The frames
+ * are left on the receive queue for netd. */
+static void
+vnet_intr(regs_t *regs)
+{
+        virtio_net_t *nv;
+
+        list_iterate_begin(&vnet_list, nv, virtio_net_t, nv_link) {
+                if (inb(nv->nv_iobase + VIRTIO_REG_ISR_STATUS) & VIRTIO_ISR_QUEUE) {
+                        if (nv->nv_rxq.vq_last_used != nv->nv_rxq.vq_used->vu_idx)
+                                netdev_wakeup(&nv->nv_ndev);
+                        sched_broadcast_on(&nv->nv_txwaitq);
+                }
+        } list_iterate_end();
+}
+
+/*
+ * Resets the device, agrees on features, sets up its queues and registers
+ * it as network device unit. Returns 0, or -errno if the device cannot be
+ * used, in which case it is left marked as failed.
+ */
+static int
+vnet_attach(pcidev_t *pdev, int unit)
+{
+        virtio_net_t *nv;
+        uint16_t iobase;
+        uint32_t features;
+        int event_idx, i;
+
+        if (PCI_IO != pdev->pci_bar[0].mem_type) {
+                dbg(DBG_NET, "virtio-net: no I/O port BAR, skipping\n");
+                return -ENODEV;
+        }
+        iobase = (uint16_t)pdev->pci_bar[0].base_addr;
+        pci_write_config(pdev, PCI_COMMAND, pci_read_config(pdev, PCI_COMMAND, 2)
+                         | PCI_CMD_IO | PCI_CMD_BUSMASTER, 2);
+
+        features = virtio_negotiate(iobase, VIRTIO_NET_FEATURES);
+        if (!(features & VIRTIO_NET_F_MAC)) {
+                dbg(DBG_NET, "virtio-net: no MAC address, skipping\n");
+                virtio_fail(iobase);
+                return -ENODEV;
+        }
+        event_idx = !!(features & VIRTIO_RING_F_EVENT_IDX);
+
+        if (NULL == (nv = (virtio_net_t *)kmalloc(sizeof(virtio_net_t))))
+                panic("Not enough memory for virtio-net device!\n");
+        if (0 != virtq_init(&nv->nv_rxq, iobase, VIRTIO_NET_RXQ, event_idx)
+            || 0 != virtq_init(&nv->nv_txq, iobase, VIRTIO_NET_TXQ, event_idx)) {
+                /* what the receive queue was given is lost along with the
+                 * device, which is never touched again */
+                virtio_fail(iobase);
+                kfree(nv);
+                return -ENODEV;
+        }
+
+        nv->nv_iobase = iobase;
+        nv->nv_features = features;
+        nv->nv_rxposted = 0;
+        sched_queue_init(&nv->nv_txwaitq);
+        virtq_intr_disable(&nv->nv_txq);
+
+        for (i = 0; i < ETH_ALEN; i++)
+                nv->nv_ndev.nd_mac[i] = inb(iobase + VIRTIO_REG_CONFIG + VIRTIO_NET_CFG_MAC + i);
+        nv->nv_ndev.nd_name = vnet_names[unit];
+        nv->nv_ndev.nd_ops = &vnet_ops;
+
+        list_insert_tail(&vnet_list, &nv->nv_link);
+        if (0 != pci_msi_enable(pdev, INTR_NET_VIRTIO))
+                intr_map(pdev->pci_irq, INTR_NET_VIRTIO);
+        vnet_rx_fill(nv);
+        virtio_driver_ok(iobase);
+
+        dbg(DBG_NET, "Initialized virtio-net device %d, I/O ports 0x%x, IRQ %u, "
+            "queues of %u and %u, features 0x%x\n", unit, iobase, pdev->pci_irq,
+            nv->nv_rxq.vq_size, nv->nv_txq.vq_size, features);
+
+        netdev_register(&nv->nv_ndev);
+        return 0;
+}
+
+void
+virtio_net_init(void)
+{
+        pcidev_t *pdev = NULL;
+        int unit = 0;
+
+        list_init(&vnet_list);
+        intr_register(INTR_NET_VIRTIO, vnet_intr);
+
+        counter_register(&vnet_nnotifies, "vnet.notifies");
+        counter_register(&vnet_ntxfull, "vnet.tx_full");
+
+        while (unit < (int)(sizeof(vnet_names) / sizeof(vnet_names[0]))
+               && NULL != (pdev = pci_lookup_id(VIRTIO_PCI_VENDOR, VIRTIO_PCI_DEVICE_NET, pdev))) {
+                if (0 == vnet_attach(pdev, unit))
+                        unit++;
+        }
+}
+init_func(virtio_net_init);
+init_depends(sched_init);
@@ -1,5 +1,10 @@
+#include "errno.h"
+
 #include "drivers/pci.h"
 
+#include "main/apic.h"
+#include "main/interrupt.h"
+
 list_t pci_list;
 
 /*
@@ -169,6 +174,23 @@ pcidev_t* pci_lookup(uint8_t class, uint8_t subclass, uint8_t interface) {
 	return NULL;
 }
 
+/*
+ * Returns the device with the given vendor and device IDs that comes after
+ * prev in the list, or the first one if prev is NULL, or NULL if there are
+ * no more
+ */
+pcidev_t* pci_lookup_id(uint16_t vendor, uint16_t device, pcidev_t* prev) {
+	list_link_t* link = (NULL == prev) ? pci_list.l_next : prev->pci_link.l_next;
+	for (; link != &pci_list; link = link->l_next) {
+		pcidev_t* dev = list_item(link, pcidev_t, pci_link);
+		if (dev->pci_vendorid == vendor && dev->pci_deviceid == device) {
+			return dev;
+		}
+	}
+
+	return NULL;
+}
+
 /*
  * High level interface to reading from the PCI Tables
  */
@@ -198,3 +220,49 @@ void pci_write_config(pcidev_t* dev, uint8_t reg_off, uint32_t val, uint8_t leng
 			break;
 	}
 }
+
+uint8_t pci_find_cap(pcidev_t* dev, uint8_t id) {
+	uint8_t off;
+	int n;
+
+	if (!(pci_read_config(dev, PCI_STATUS, 2) & PCI_STATUS_CAPLIST)) {
+		return 0;
+	}
+	/* the list is bounded in case a device loops it */
+	off = pci_read_config(dev, PCI_CAPLIST, 1) & 0xFC;
+	for (n = 0; off != 0 && n < 48; n++) {
+		if (pci_read_config(dev, off, 1) == id) {
+			return off;
+		}
+		off = pci_read_config(dev, off + 1, 1) & 0xFC;
+	}
+
+	return 0;
+}
+
+int pci_msi_enable(pcidev_t* dev, uint8_t intr) {
+	uint8_t cap = pci_find_cap(dev, PCI_CAP_MSI);
+	uint32_t addr, data;
+	uint16_t ctrl;
+
+	if (0 == cap) {
+		return -ENOTSUP;
+	}
+
+	apic_msi_message(intr, &addr, &data);
+	ctrl = pci_read_config(dev, cap + PCI_MSI_CTRL, 2);
+	pci_write_config(dev, cap + PCI_MSI_ADDR, addr, 4);
+	if (ctrl & PCI_MSI_CTRL_64BIT) {
+		pci_write_config(dev, cap + PCI_MSI_ADDR_HI, 0, 4);
+		pci_write_config(dev, cap + PCI_MSI_DATA_64, data, 2);
+	} else {
+		pci_write_config(dev, cap + PCI_MSI_DATA_32, data, 2);
+	}
+	/* one message only */
+	ctrl = (ctrl & ~PCI_MSI_CTRL_MME) | PCI_MSI_CTRL_ENABLE;
+	pci_write_config(dev, cap + PCI_MSI_CTRL, ctrl, 2);
+
+	pci_write_config(dev, PCI_COMMAND, pci_read_config(dev, PCI_COMMAND, 2) | PCI_CMD_INTXDISABLE, 2);
+	intr_map_msi(intr);
+	return 0;
+}
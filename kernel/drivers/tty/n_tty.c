@@ -4,13 +4,22 @@
 
 #include "drivers/tty/driver.h"
 #include "drivers/tty/ldisc.h"
+#include "drivers/tty/termios.h"
 #include "drivers/tty/tty.h"
 
+#include "api/access.h"
+
+#include "fs/poll.h"
+
+#include "main/interrupt.h"
+
 #include "mm/kmalloc.h"
 
 #include "proc/kthread.h"
 
 #include "util/debug.h"
+#include "util/string.h"
+#include "util/time.h"
 
 /* helpful macros */
 #define EOFC            '\x4'
@@ -23,6 +32,10 @@ static void n_tty_detach(tty_ldisc_t *ldisc, tty_device_t *tty);
 static int n_tty_read(tty_ldisc_t *ldisc, void *buf, int len);
 static const char *n_tty_receive_char(tty_ldisc_t *ldisc, char c);
 static const char *n_tty_process_char(tty_ldisc_t *ldisc, char c);
+static int n_tty_process_buf(tty_ldisc_t *ldisc, const char *buf, int *len,
+                             char *out, int outlen);
+static int n_tty_poll(tty_ldisc_t *ldisc, int events, polltable_t *pt);
+static int n_tty_ioctl(tty_ldisc_t *ldisc, int request, void *arg);
 
 int is_newline(char c);
 int is_ctrl_d(char c);
@@ -32,12 +45,16 @@ static tty_ldisc_ops_t n_tty_ops = {
         .detach       = n_tty_detach,
         .read         = n_tty_read,
         .receive_char = n_tty_receive_char,
-        .process_char = n_tty_process_char
+        .process_char = n_tty_process_char,
+        .process_buf  = n_tty_process_buf,
+        .poll         = n_tty_poll,
+        .ioctl        = n_tty_ioctl
 };
 
 struct n_tty {
         kmutex_t            ntty_rlock;
         ktqueue_t           ntty_rwaitq;
+        pollhead_t          ntty_pollhead;
         char               *ntty_inbuf;
         int                 ntty_rhead;
         int                 ntty_rawtail;
@@ -46,6 +63,10 @@ struct n_tty {
         tty_ldisc_t         ntty_ldisc;
 
         int                 ntty_initial;
+
+        struct termios      ntty_termios;
+        int                 ntty_expired;   /* the VTIME timer has fired */
+        char                ntty_echo[2];
 };
 
 void
@@ -119,6 +140,8 @@ n_tty_attach(tty_ldisc_t *ldisc, tty_device_t *tty)
     /*initialize each field*/
     kmutex_init(&ntty->ntty_rlock);
     sched_queue_init(&ntty->ntty_rwaitq);
+    sched_queue_class(&ntty->ntty_rwaitq, SCHED_WQ_TTY);
+    pollhead_init(&ntty->ntty_pollhead);
 
     ntty->ntty_inbuf = (char *)kmalloc(sizeof(char) * (TTY_BUF_SIZE + 1));
     KASSERT(NULL != ntty->ntty_inbuf);
@@ -132,6 +155,14 @@ n_tty_attach(tty_ldisc_t *ldisc, tty_device_t *tty)
     ntty->ntty_rawtail = 0;
     ntty->ntty_ckdtail = 0;
     ntty->ntty_initial = 1;
+
+    memset(&ntty->ntty_termios, 0, sizeof(ntty->ntty_termios));
+    ntty->ntty_termios.c_lflag = ICANON | ECHO;
+    ntty->ntty_termios.c_cc[VEOF] = EOFC;
+    ntty->ntty_termios.c_cc[VERASE] = 0x7f;
+    ntty->ntty_termios.c_cc[VMIN] = 1;
+    ntty->ntty_termios.c_cc[VTIME] = 0;
+    ntty->ntty_expired = 0;
         /*NOT_YET_IMPLEMENTED("DRIVERS: n_tty_attach");*/
 }
 
@@ -226,6 +257,134 @@ convert(int n) {
  *Self-defined function to deal with index incrementing and decrementing
  */
 
+/* How many characters are cooked and waiting to be read */
+static int
+n_tty_cooked(n_tty_t *ntty)
+{
+    return convert(ntty->ntty_ckdtail - ntty->ntty_rhead);
+}
+
+/*
+ * Moves n cooked characters from the read head into out. The cooked
+ * region is at most two runs of the circular buffer, so this is at most
+ * two memcpys.
+ */
+static void
+n_tty_copyout(n_tty_t *ntty, char *out, int n)
+{
+    int first = MIN(n, TTY_BUF_SIZE - ntty->ntty_rhead);
+
+    memcpy(out, ntty->ntty_inbuf + ntty->ntty_rhead, first);
+    if (first < n) {
+        memcpy(out + first, ntty->ntty_inbuf, n - first);
+    }
+    ntty->ntty_rhead = convert(ntty->ntty_rhead + n);
+}
+
+static void
+n_tty_expired(ktimer_t *t)
+{
+    n_tty_t *ntty = (n_tty_t *)t->t_data;
+
+    ntty->ntty_expired = 1;
+    sched_broadcast_on(&ntty->ntty_rwaitq);
+}
+
+/*
+ * Sleeps until at least want characters are cooked, or the VTIME timer
+ * fires. As in poll, neither a wakeup nor the timer can come in between
+ * looking and sleeping.
+ */
+static int
+n_tty_wait(n_tty_t *ntty, int want)
+{
+    int err = 0;
+    uint8_t old_ipl = intr_getipl();
+
+    intr_setipl(IPL_HIGH);
+    while (0 == err && !ntty->ntty_expired && n_tty_cooked(ntty) < want) {
+        err = sched_cancellable_sleep_on(&ntty->ntty_rwaitq);
+    }
+    intr_setipl(old_ipl);
+    return err;
+}
+
+/*
+ * A line at a time: up to and including the newline or CTRL-D which
+ * ends the cooked region, the terminator read as '\n'. A CTRL-D at the
+ * start of a line is end of file, and reads as nothing.
+ */
+static int
+n_tty_read_canon(n_tty_t *ntty, char *outbuf, int len)
+{
+    char *inbuf = ntty->ntty_inbuf;
+    int avail = n_tty_cooked(ntty);
+    int n;
+
+    for (n = 0; n < avail && n < len; n++) {
+        char c = inbuf[convert(ntty->ntty_rhead + n)];
+        if (is_newline(c) || is_ctrl_d(c)) {
+            break;
+        }
+    }
+    if (n == avail || n == len) {
+        /* No terminator in what fits (or the line was cooked before
+         * ICANON was turned on) */
+        n_tty_copyout(ntty, outbuf, n);
+        return n;
+    }
+
+    if (0 == n && is_ctrl_d(inbuf[ntty->ntty_rhead])) {
+        dbg(DBG_TERM, "First character is CTRL-D\n");
+        increment(&ntty->ntty_rhead);
+        return 0;
+    }
+    n_tty_copyout(ntty, outbuf, n);
+    outbuf[n++] = '\n';
+    increment(&ntty->ntty_rhead);
+    return n;
+}
+
+/*
+ * Without ICANON, what to wait for is up to VMIN and VTIME, as in
+ * termios(3): VMIN characters with no timer, VMIN characters or VTIME
+ * tenths of a second since the last one arrived, any character within
+ * VTIME of the read, or whatever is there now.
+ */
+static int
+n_tty_read_raw(n_tty_t *ntty, char *outbuf, int len)
+{
+    int vmin = ntty->ntty_termios.c_cc[VMIN];
+    int vtime = ntty->ntty_termios.c_cc[VTIME];
+    int want = MIN(MIN(vmin, len), TTY_BUF_SIZE - 1);
+    int err = 0;
+    ktimer_t t;
+
+    timer_init(&t, n_tty_expired, ntty);
+    ntty->ntty_expired = 0;
+    if (0 < want && 0 == vtime) {
+        err = n_tty_wait(ntty, want);
+    } else if (0 < want) {
+        err = n_tty_wait(ntty, 1);
+        while (0 == err && !ntty->ntty_expired && n_tty_cooked(ntty) < want) {
+            timer_add(&t, vtime * 100);
+            err = n_tty_wait(ntty, n_tty_cooked(ntty) + 1);
+            timer_cancel(&t);
+        }
+    } else if (0 < vtime) {
+        timer_add(&t, vtime * 100);
+        err = n_tty_wait(ntty, 1);
+        timer_cancel(&t);
+    }
+    if (0 > err) {
+        return err;
+    }
+
+    int n = MIN(n_tty_cooked(ntty), len);
+    n_tty_copyout(ntty, outbuf, n);
+    return n;
+}
+
 /*
  * Read a maximum of len bytes from the line discipline into buf. If
  * the buffer is empty, sleep until some characters appear. This might
@@ -253,56 +412,25 @@ n_tty_read(tty_ldisc_t *ldisc, void *buf, int len)
     dbg(DBG_TERM, "Starting read\n");
     struct n_tty *ntty = ldisc_to_ntty(ldisc);
     KASSERT(NULL != ntty);
-    char *outbuf = (char *)buf;
 
-    if (ntty->ntty_rhead == ntty->ntty_ckdtail) {
-        dbg(DBG_TERM, "Nothing in the inbuf yet.\n");
-        if (EINTR == sched_cancellable_sleep_on(&ntty->ntty_rwaitq)) {
-            /*is cancelled, not handled yet*/
-            panic("n_tty_read get cancelled\n");
-            return 0;
-        }
-        dbg(DBG_TERM, "Something is cooked, been woken up.\n");
+    /* One reader at a time, so the timer and the head are its own */
+    if (0 != kmutex_lock_cancellable(&ntty->ntty_rlock)) {
+        return -EINTR;
     }
 
-    /*lock*/
-    kmutex_lock(&ntty->ntty_rlock);
-
-    char *inbuf = ntty->ntty_inbuf;
-    KASSERT(NULL != inbuf);
-    int rhead = ntty->ntty_rhead;
-
-    int i = 0;
-    for (i = 0 ; i < len ; i++) {
-        /*?ckdtail?*/
-        /*no: ckdtail is always at a newline or ctrl-d*/
-        if (is_newline(inbuf[convert(rhead+i)])) {
-            outbuf[i] = '\n';
-            i++;
-            break;
-        }
-        if (is_ctrl_d(inbuf[convert(rhead+i)])) {
-            if (0 == i) {
-                dbg(DBG_TERM, "First character is CTRL-D\n");
-                outbuf[i] = '\0';
-                ntty->ntty_rhead = convert(rhead+i);
-                return i;
-            }
-            outbuf[i] = '\n';
-            i++;
-            break;
+    int ret;
+    if (ntty->ntty_termios.c_lflag & ICANON) {
+        ntty->ntty_expired = 0;
+        ret = n_tty_wait(ntty, 1);
+        if (0 == ret) {
+            ret = n_tty_read_canon(ntty, (char *)buf, len);
         }
-        outbuf[i] = inbuf[convert(rhead+i)];
+    } else {
+        ret = n_tty_read_raw(ntty, (char *)buf, len);
     }
 
-    outbuf[i] = '\0';
-    ntty->ntty_rhead = convert(rhead + i);
-
-    /*unlock*/
     kmutex_unlock(&ntty->ntty_rlock);
-
-    n_tty_print_inbuf(ldisc);
-    return i;
+    return ret;
         /*NOT_YET_IMPLEMENTED("DRIVERS: n_tty_read");*/
 }
         /**
@@ -327,8 +455,8 @@ n_tty_read(tty_ldisc_t *ldisc, void *buf, int len)
  * need to be echoed to the screen. For a normal, printable character,
  * just the character to be echoed.
  */
-const char *
-n_tty_receive_char(tty_ldisc_t *ldisc, char c)
+static const char *
+n_tty_receive_canon(tty_ldisc_t *ldisc, char c)
 {
     KASSERT(NULL != ldisc);
     /*lock it?*/
@@ -369,6 +497,7 @@ n_tty_receive_char(tty_ldisc_t *ldisc, char c)
         s = "\n\r";
         n_tty_print_inbuf(ldisc);
         sched_wakeup_on(&ntty->ntty_rwaitq);
+        poll_wakeup(&ntty->ntty_pollhead);
         return s;
     }
     if (is_ctrl_d(c)) {
@@ -379,16 +508,64 @@ n_tty_receive_char(tty_ldisc_t *ldisc, char c)
         s = "\n\r";
         n_tty_print_inbuf(ldisc);
         sched_wakeup_on(&ntty->ntty_rwaitq);
+        poll_wakeup(&ntty->ntty_pollhead);
         return s;
     }
     ntty->ntty_inbuf[ntty->ntty_rawtail] = c;
     increment(&ntty->ntty_rawtail);
-    s = " ";
-    s[0] = c;
+    ntty->ntty_echo[0] = c;
+    ntty->ntty_echo[1] = '\0';
     n_tty_print_inbuf(ldisc);
-    return s;
+    return ntty->ntty_echo;
         /*NOT_YET_IMPLEMENTED("DRIVERS: n_tty_receive_char");*/
 }
+
+/*
+ * Without ICANON there is no editing: every character is cooked as soon
+ * as it arrives, for n_tty_read_raw to decide when the reader has enough.
+ */
+static const char *
+n_tty_receive_raw(n_tty_t *ntty, char c)
+{
+    if (convert(ntty->ntty_rawtail + 1) == ntty->ntty_rhead) {
+        return "";
+    }
+    ntty->ntty_initial = 0;
+
+    ntty->ntty_inbuf[ntty->ntty_rawtail] = c;
+    increment(&ntty->ntty_rawtail);
+    ntty->ntty_ckdtail = ntty->ntty_rawtail;
+    sched_wakeup_on(&ntty->ntty_rwaitq);
+    poll_wakeup(&ntty->ntty_pollhead);
+
+    if (is_newline(c)) {
+        return "\n\r";
+    }
+    ntty->ntty_echo[0] = c;
+    ntty->ntty_echo[1] = '\0';
+    return ntty->ntty_echo;
+}
+
+const char *
+n_tty_receive_char(tty_ldisc_t *ldisc, char c)
+{
+    KASSERT(NULL != ldisc);
+    struct n_tty *ntty = ldisc_to_ntty(ldisc);
+    struct termios *t = &ntty->ntty_termios;
+    const char *s;
+
+    if (t->c_lflag & ICANON) {
+        if (c == (char)t->c_cc[VEOF]) {
+            c = EOFC;
+        } else if (c == (char)t->c_cc[VERASE]) {
+            c = '\b';
+        }
+        s = n_tty_receive_canon(ldisc, c);
+    } else {
+        s = n_tty_receive_raw(ntty, c);
+    }
+    return (t->c_lflag & ECHO) ? s : "";
+}
         /**
          * Receive a character and return a string to be echoed to the
          * tty.
@@ -419,6 +596,27 @@ n_tty_process_char(tty_ldisc_t *ldisc, char c)
     }
         /*NOT_YET_IMPLEMENTED("DRIVERS: n_tty_process_char");*/
 }
+
+/*
+ * The same translation as n_tty_process_char, a run at a time: each
+ * character becomes at most two, so stop while there is room for that.
+ */
+int
+n_tty_process_buf(tty_ldisc_t *ldisc, const char *buf, int *len,
+                  char *out, int outlen)
+{
+    int i, o = 0;
+    for (i = 0; i < *len && o + 2 <= outlen; i++) {
+        if (is_newline(buf[i])) {
+            out[o++] = '\n';
+            out[o++] = '\r';
+        } else {
+            out[o++] = buf[i];
+        }
+    }
+    *len = i;
+    return o;
+}
         /**
          * Process a character and return a string to be echoed to the
          * tty.
@@ -427,3 +625,55 @@ n_tty_process_char(tty_ldisc_t *ldisc, char c)
          * @param c the character to process
          * @return a null terminated string to be echoed to the tty
          */
+
+/*
+ * A line is there to read once the cooked tail has moved past the read
+ * head, which is when n_tty_receive_char wakes the pollhead. Writing to
+ * the terminal never waits.
+ */
+int
+n_tty_poll(tty_ldisc_t *ldisc, int events, polltable_t *pt)
+{
+    KASSERT(NULL != ldisc);
+    struct n_tty *ntty = ldisc_to_ntty(ldisc);
+
+    poll_wait(&ntty->ntty_pollhead, pt);
+
+    int revents = POLLOUT;
+    if (ntty->ntty_rhead != ntty->ntty_ckdtail) {
+        revents |= POLLIN;
+    }
+    return revents;
+}
+
+/*
+ * TCGETS and TCSETS, the only terminal requests there are. Turning
+ * ICANON off cooks whatever has been typed of the current line, so that
+ * it is not lost to a reader which no longer waits for the end of it.
+ */
+int
+n_tty_ioctl(tty_ldisc_t *ldisc, int request, void *arg)
+{
+    KASSERT(NULL != ldisc);
+    struct n_tty *ntty = ldisc_to_ntty(ldisc);
+    struct termios t;
+    int err;
+
+    switch (request) {
+        case TCGETS:
+            return copy_to_user(arg, &ntty->ntty_termios, sizeof(t));
+        case TCSETS:
+            if (0 > (err = copy_from_user(&t, arg, sizeof(t)))) {
+                return err;
+            }
+            ntty->ntty_termios = t;
+            if (!(t.c_lflag & ICANON)) {
+                ntty->ntty_ckdtail = ntty->ntty_rawtail;
+            }
+            sched_broadcast_on(&ntty->ntty_rwaitq);
+            poll_wakeup(&ntty->ntty_pollhead);
+            return 0;
+        default:
+            return -ENOTTY;
+    }
+}
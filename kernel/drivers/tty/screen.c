@@ -5,6 +5,7 @@
 
 #include "main/io.h"
 
+#include "mm/page.h"
 #include "mm/pagetable.h"
 
 #include "util/debug.h"
@@ -15,6 +16,10 @@
 /* Note that this is a short * as video memory is addressed in 2-byte chunks -
  * 1st byte is attributes, 2nd byte is char */
 #define PHYS_VIDEORAM 0xb8000
+/* All of colour text memory, some eight screens' worth, is mapped so that
+ * the display can scroll through it */
+#define VIDEORAM_PAGES 8
+#define VIDEORAM_CELLS (VIDEORAM_PAGES * PAGE_SIZE / sizeof(uint16_t))
 /* Port addresses for the CRT controller */
 #define CRT_CONTROL_ADDR 0x3d4
 #define CRT_CONTROL_DATA 0x3d5
@@ -22,6 +27,9 @@
 /* Addresses we can pass to the CRT_CONTROLL_ADDR port */
 #define CURSOR_HIGH 0x0e
 #define CURSOR_LOW 0x0f
+/* Where in video memory the display starts */
+#define START_HIGH 0x0c
+#define START_LOW 0x0d
 /* Right now, we shouldn't need cursor high to change from zero */
 
 /* Default attribs */
@@ -33,11 +41,43 @@
 
 static uint16_t *videoram;
 
-/* Needs to get a virtual memory mapping for video memory */
+/* The cell of video memory at the top left of the display */
+static uint16_t origin;
+
+#define display (videoram + origin)
+
+/* Needs to get a virtual memory mapping for video memory, which is
+ * write-combining where it can be, as nothing here reads it back */
 void
 screen_init()
 {
-        videoram = (uint16_t *) pt_phys_perm_map(PHYS_VIDEORAM, 1);
+        videoram = (uint16_t *) pt_phys_perm_map_wc(PHYS_VIDEORAM, VIDEORAM_PAGES);
+        origin = 0;
+}
+
+/* Writes a line of cells at pos, built up here first so that video
+ * memory gets one burst of word stores (a run of 160 bytes fills whole
+ * write-combining buffers) instead of a store per cell. Whatever is
+ * left in the buffers reaches the screen by the next outb, as the one
+ * that moves the cursor, or interrupt. */
+static void
+screen_write_line(uint16_t *pos, const char *buf, uint16_t fill)
+{
+        uint16_t line[DISPLAY_WIDTH];
+        int i;
+
+        for (i = 0; i < DISPLAY_WIDTH; i++)
+                line[i] = (NULL != buf) ? (DEFAULT_ATTRIB << 8) | (uint8_t)buf[i] : fill;
+        memcpy(pos, line, sizeof(line));
+}
+
+static void
+screen_set_start(uint16_t start)
+{
+        outb(CRT_CONTROL_ADDR, START_HIGH);
+        outb(CRT_CONTROL_DATA, start >> 8);
+        outb(CRT_CONTROL_ADDR, START_LOW);
+        outb(CRT_CONTROL_DATA, start & 0xff);
 }
 
 /* Copied from OSDev */
@@ -46,7 +86,7 @@ screen_move_cursor(uint8_t x, uint8_t y)
 {
         /* Commented out until we have kasserts */
         /* KASSERT(cursor_col < DISPLAY_WIDTH && cursor_row < DISPLAY_HEIGHT); */
-        uint16_t pos = y * DISPLAY_WIDTH + x;
+        uint16_t pos = origin + y * DISPLAY_WIDTH + x;
 
         outb(CRT_CONTROL_ADDR, CURSOR_HIGH);
         outb(CRT_CONTROL_DATA, pos >> 8);
@@ -62,29 +102,50 @@ screen_putchar(char c, uint8_t x, uint8_t y)
 {
         /* Update the character at the current cursor position, using the default
          * attributes */
-        *(videoram + (y * DISPLAY_WIDTH + x)) = (DEFAULT_ATTRIB << 8) | c;
+        *(display + (y * DISPLAY_WIDTH + x)) = (DEFAULT_ATTRIB << 8) | c;
 }
 
 void
 screen_putchar_attrib(char c, uint8_t x, uint8_t y, uint8_t attrib)
 {
         /* Similarly, but with custom attributes */
-        *(videoram + (y * DISPLAY_WIDTH + x)) = (attrib << 8) | c;
+        *(display + (y * DISPLAY_WIDTH + x)) = (attrib << 8) | c;
 }
 
 void
 screen_putbuf(const char *buf)
 {
-        uint16_t *pos;
-        for (pos = videoram; pos - videoram < DISPLAY_WIDTH * DISPLAY_HEIGHT; buf++, pos++)
-                *pos = (DEFAULT_ATTRIB << 8) | *buf;
+        int y;
+        for (y = 0; y < DISPLAY_HEIGHT; y++)
+                screen_write_line(display + y * DISPLAY_WIDTH, buf + y * DISPLAY_WIDTH, 0);
+}
+
+void
+screen_putline(const char *buf, uint8_t y)
+{
+        screen_write_line(display + y * DISPLAY_WIDTH, buf, 0);
+}
+
+int
+screen_scroll(uint8_t lines)
+{
+        KASSERT(lines < DISPLAY_HEIGHT);
+
+        if ((uint32_t)(origin + (lines + DISPLAY_HEIGHT) * DISPLAY_WIDTH) > VIDEORAM_CELLS) {
+                origin = 0;
+                screen_set_start(origin);
+                return -1;
+        }
+        origin += lines * DISPLAY_WIDTH;
+        screen_set_start(origin);
+        return 0;
 }
 
-/* In theory, this one should be much faster, but it probably isn't */
+/* One burst for the whole screen */
 void
 screen_putbuf_attrib(const uint16_t *buf)
 {
-        memcpy(videoram, buf, DISPLAY_WIDTH * DISPLAY_HEIGHT * 2);
+        memcpy(display, buf, DISPLAY_WIDTH * DISPLAY_HEIGHT * 2);
 }
 
 void
@@ -95,7 +156,7 @@ screen_clear()
          * use a memcpy b/c attribute 0x00 is black on black (which messes up the
          * attribute settings . . . ) */
         uint16_t blank = (DEFAULT_ATTRIB << 8) | 0x20;
-        uint16_t *pos;
-        for (pos = videoram; pos - videoram < DISPLAY_WIDTH * DISPLAY_HEIGHT; pos++)
-                *pos = blank;
+        int y;
+        for (y = 0; y < DISPLAY_HEIGHT; y++)
+                screen_write_line(display + y * DISPLAY_WIDTH, NULL, blank);
 }
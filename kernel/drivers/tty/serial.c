@@ -0,0 +1,272 @@
+#include "drivers/tty/serial.h"
+
+#include "drivers/tty/driver.h"
+
+#include "main/io.h"
+#include "main/interrupt.h"
+
+#include "util/debug.h"
+
+/*
+ * A terminal on the 16550 UART at COM1. Output goes into a ring buffer
+ * which the transmit interrupt empties into the UART's FIFO a FIFO-full
+ * at a time, so a writer only waits on the line when the ring is full;
+ * input is read out of the receive FIFO a burst at a time, so nothing
+ * is dropped between interrupts.
+ *
+ * The debug output in util/debug.c may use the same port. It polls the
+ * UART for room and then writes, which at worst interleaves its output
+ * with the terminal's.
+ */
+
+#define COM1            0x3f8
+#define IRQ_COM1        4
+
+/* Register offsets from the base port */
+#define UART_DATA       0       /* receive and transmit holding */
+#define UART_IER        1       /* interrupt enable */
+#define UART_IIR        2       /* interrupt identification (read) */
+#define UART_FCR        2       /* FIFO control (write) */
+#define UART_LCR        3       /* line control */
+#define UART_MCR        4       /* modem control */
+#define UART_LSR        5       /* line status */
+#define UART_MSR        6       /* modem status */
+#define UART_SCRATCH    7
+
+#define IER_RX          0x01    /* data received */
+#define IER_TX          0x02    /* transmit holding register empty */
+
+#define IIR_NONE        0x01    /* no interrupt pending */
+#define IIR_ID          0x0e
+#define IIR_MODEM       0x00
+#define IIR_TX          0x02
+#define IIR_RX          0x04
+#define IIR_LINE        0x06
+#define IIR_TIMEOUT     0x0c    /* data received, but below the trigger */
+
+#define LSR_DR          0x01    /* there is data to read */
+#define LSR_THRE        0x20    /* the transmit FIFO is empty */
+
+/* The transmit FIFO of a 16550 */
+#define UART_FIFO_SIZE  16
+
+#define SERIAL_BUFSIZE  4096
+
+typedef struct serialterm {
+        uint16_t        st_port;
+
+        /* Output not yet given to the UART (circular buffer) */
+        char            st_buf[SERIAL_BUFSIZE];
+        int             st_head;        /* next to transmit */
+        int             st_count;
+
+        tty_driver_t    st_driver;
+} serialterm_t;
+
+#define driver_to_st(driver) \
+        CONTAINER_OF(driver, serialterm_t, st_driver)
+
+static void serial_provide_char(tty_driver_t *ttyd, char c);
+static void serial_provide_buf(tty_driver_t *ttyd, const char *buf, int len);
+static tty_driver_callback_t serial_register_callback_handler(
+        tty_driver_t *ttyd,
+        tty_driver_callback_t callback,
+        void *arg);
+static tty_driver_callback_t serial_unregister_callback_handler(
+        tty_driver_t *ttyd);
+static void *serial_block_io(tty_driver_t *ttyd);
+static void  serial_unblock_io(tty_driver_t *ttyd, void *data);
+
+static tty_driver_ops_t serial_driver_ops = {
+        .provide_char                = serial_provide_char,
+        .provide_buf                 = serial_provide_buf,
+        .register_callback_handler   = serial_register_callback_handler,
+        .unregister_callback_handler = serial_unregister_callback_handler,
+        .block_io                    = serial_block_io,
+        .unblock_io                  = serial_unblock_io
+};
+
+static serialterm_t serial_term;
+static int serial_nterms;
+
+/* Moves output from the ring into the UART, which must have an empty
+ * transmit FIFO. Called with the UART's interrupt blocked. */
+static void
+serial_start_tx(serialterm_t *st)
+{
+        int n = 0;
+        while (st->st_count > 0 && n < UART_FIFO_SIZE) {
+                outb(st->st_port + UART_DATA, st->st_buf[st->st_head]);
+                st->st_head = (st->st_head + 1) % SERIAL_BUFSIZE;
+                st->st_count--;
+                n++;
+        }
+}
+
+static void
+serial_intr_handler(regs_t *regs)
+{
+        serialterm_t *st = &serial_term;
+        uint8_t iir;
+
+        while (!((iir = inb(st->st_port + UART_IIR)) & IIR_NONE)) {
+                switch (iir & IIR_ID) {
+                        case IIR_TX:
+                                serial_start_tx(st);
+                                break;
+                        case IIR_RX:
+                        case IIR_TIMEOUT:
+                                while (inb(st->st_port + UART_LSR) & LSR_DR) {
+                                        char c = inb(st->st_port + UART_DATA);
+                                        /* Terminals send CR for enter and DEL
+                                         * for backspace */
+                                        if ('\r' == c)
+                                                c = '\n';
+                                        else if (0x7f == c)
+                                                c = '\b';
+                                        if (NULL != st->st_driver.ttd_callback)
+                                                st->st_driver.ttd_callback(
+                                                        st->st_driver.ttd_callback_arg, c);
+                                }
+                                break;
+                        case IIR_LINE:
+                                (void) inb(st->st_port + UART_LSR);
+                                break;
+                        case IIR_MODEM:
+                        default:
+                                (void) inb(st->st_port + UART_MSR);
+                                break;
+                }
+        }
+}
+
+void
+serial_init()
+{
+        serialterm_t *st = &serial_term;
+        st->st_port = COM1;
+
+        /* There is no UART if the scratch register does not keep what is
+         * written to it */
+        outb(st->st_port + UART_SCRATCH, 0xae);
+        if (0xae != inb(st->st_port + UART_SCRATCH)) {
+                serial_nterms = 0;
+                return;
+        }
+
+        st->st_head = 0;
+        st->st_count = 0;
+        st->st_driver.ttd_ops = &serial_driver_ops;
+        st->st_driver.ttd_callback = NULL;
+        st->st_driver.ttd_callback_arg = NULL;
+
+        outb(st->st_port + UART_IER, 0x00);
+        outb(st->st_port + UART_LCR, 0x80);     /* Enable DLAB (set baud rate divisor) */
+        outb(st->st_port + UART_DATA, 0x03);    /* Set divisor to 3 (lo byte) 38400 baud */
+        outb(st->st_port + UART_IER, 0x00);     /*                  (hi byte) */
+        outb(st->st_port + UART_LCR, 0x03);     /* 8 bits, no parity, one stop bit */
+        outb(st->st_port + UART_FCR, 0xc7);     /* Enable FIFO, clear them, with 14-byte threshold */
+        outb(st->st_port + UART_MCR, 0x0b);     /* DTR, RTS, and OUT2 to pass on interrupts */
+
+        intr_map(IRQ_COM1, INTR_SERIAL);
+        intr_register(INTR_SERIAL, serial_intr_handler);
+        outb(st->st_port + UART_IER, IER_RX | IER_TX);
+
+        serial_nterms = 1;
+}
+
+int
+serial_num_terminals()
+{
+        return serial_nterms;
+}
+
+tty_driver_t *
+serial_get_tty_driver(int id)
+{
+        if (id >= serial_nterms) {
+                return NULL;
+        } else {
+                return &serial_term.st_driver;
+        }
+}
+
+void
+serial_provide_char(tty_driver_t *ttyd, char c)
+{
+        serial_provide_buf(ttyd, &c, 1);
+}
+
+void
+serial_provide_buf(tty_driver_t *ttyd, const char *buf, int len)
+{
+        KASSERT(NULL != ttyd);
+
+        serialterm_t *st = driver_to_st(ttyd);
+        uint8_t oldipl = intr_getipl();
+        int i;
+
+        /* The transmit interrupt must not run while the ring changes */
+        intr_setipl(MAX(oldipl, INTR_SERIAL));
+        for (i = 0; i < len; i++) {
+                if (SERIAL_BUFSIZE == st->st_count) {
+                        /* The interrupt is blocked, so make the room
+                         * by waiting on the UART ourselves */
+                        while (!(inb(st->st_port + UART_LSR) & LSR_THRE))
+                                ;
+                        serial_start_tx(st);
+                }
+                st->st_buf[(st->st_head + st->st_count) % SERIAL_BUFSIZE] = buf[i];
+                st->st_count++;
+        }
+
+        /* If the UART is idle there is no interrupt coming to start it */
+        if (inb(st->st_port + UART_LSR) & LSR_THRE)
+                serial_start_tx(st);
+        intr_setipl(oldipl);
+}
+
+tty_driver_callback_t
+serial_register_callback_handler(tty_driver_t *ttyd, tty_driver_callback_t callback, void *arg)
+{
+        tty_driver_callback_t previous_callback;
+
+        KASSERT(NULL != ttyd);
+        previous_callback = ttyd->ttd_callback;
+        ttyd->ttd_callback = callback;
+        ttyd->ttd_callback_arg = arg;
+        return previous_callback;
+}
+
+tty_driver_callback_t
+serial_unregister_callback_handler(tty_driver_t *ttyd)
+{
+        tty_driver_callback_t previous_callback;
+
+        KASSERT(NULL != ttyd);
+        previous_callback = ttyd->ttd_callback;
+        ttyd->ttd_callback = NULL;
+        return previous_callback;
+}
+
+void *
+serial_block_io(tty_driver_t *ttyd)
+{
+        uint8_t oldipl;
+        KASSERT(NULL != ttyd);
+
+        oldipl = intr_getipl();
+        intr_setipl(INTR_SERIAL);
+        return (void *)(uintptr_t)oldipl;
+}
+
+void
+serial_unblock_io(tty_driver_t *ttyd, void *data)
+{
+        uint8_t oldipl = (uint8_t)(uintptr_t)data;
+        KASSERT(NULL != ttyd);
+
+        KASSERT(intr_getipl() == INTR_SERIAL &&
+                "Serial terminal I/O not blocked");
+        intr_setipl(oldipl);
+}
@@ -1,5 +1,7 @@
 #include "drivers/tty/tty.h"
 
+#include "errno.h"
+
 #include "drivers/bytedev.h"
 
 #include "drivers/tty/driver.h"
@@ -7,15 +9,29 @@
 #include "drivers/tty/ldisc.h"
 #include "drivers/tty/n_tty.h"
 #include "drivers/tty/screen.h"
+#include "drivers/tty/serial.h"
 #include "drivers/tty/virtterm.h"
 
+#include "main/softirq.h"
+
 #include "mm/kmalloc.h"
 
 #include "util/debug.h"
+#include "util/string.h"
+
+/* How much tty_write translates before handing it to the driver */
+#define TTY_WRITE_CHUNK 256
 
 #define bd_to_tty(bd) \
         CONTAINER_OF(bd, tty_device_t, tty_cdev)
 
+/* Keeps the compiler from moving memory accesses across it; the ring
+ * needs no more than that on x86 */
+#define compiler_barrier() __asm__ __volatile__("" ::: "memory")
+
+/* Every tty, for the softirq to drain */
+static list_t tty_list;
+
 /**
  * The callback function called by the virtual terminal subsystem when
  * a key is pressed.
@@ -58,63 +74,103 @@ static int tty_write(bytedev_t *dev, int offset, const void *buf, int count);
  */
 static void tty_echo(tty_driver_t *driver, const char *out);
 
+/**
+ * The tty softirq, which hands what every tty has received to its line
+ * discipline.
+ */
+static void tty_softirq(void);
+
+/**
+ * Reports which poll events are true of the tty's input and output.
+ *
+ * @param dev the tty's byte device
+ * @param events the events the poller is waiting for
+ * @param pt the poll table to register, or NULL
+ * @return the events which are true now
+ */
+static int tty_poll(bytedev_t *dev, int events, struct polltable *pt);
+
+/**
+ * Carries out a terminal control request on the tty's line discipline.
+ *
+ * @param dev the tty's byte device
+ * @param request the request
+ * @param arg the request's argument, a user address
+ * @return 0 or the request's result on success, -errno on error
+ */
+static int tty_ioctl(bytedev_t *dev, int request, void *arg);
+
 static bytedev_ops_t tty_bytedev_ops = {
         tty_read,
         tty_write,
         NULL,
         NULL,
         NULL,
-        NULL
+        NULL,
+        tty_poll,
+        tty_ioctl
 };
 
+/* Creates tty number i, with the default line discipline, on ttyd */
+static void
+tty_init_one(tty_driver_t *ttyd, int i)
+{
+        tty_device_t *tty;
+        tty_ldisc_t *ldisc;
+
+        KASSERT(NULL != ttyd);
+        KASSERT(NULL != ttyd->ttd_ops);
+        KASSERT(NULL != ttyd->ttd_ops->register_callback_handler);
+
+        tty = tty_create(ttyd, i);
+        if (NULL == tty) {
+                panic("Not enough memory to allocate tty\n");
+        }
+
+        if (NULL != ttyd->ttd_ops->register_callback_handler(
+                    ttyd, tty_global_driver_callback, (void *)tty)) {
+                panic("Callback already registered "
+                      "to terminal %d\n", i);
+        }
+
+        ldisc = n_tty_create();
+        if (NULL == ldisc) {
+                panic("Not enough memory to allocate "
+                      "line discipline\n");
+        }
+        KASSERT(NULL != ldisc);
+        KASSERT(NULL != ldisc->ld_ops);
+        KASSERT(NULL != ldisc->ld_ops->attach);
+        ldisc->ld_ops->attach(ldisc, tty);
+
+        if (bytedev_register(&tty->tty_cdev) != 0) {
+                panic("Error registering tty as byte device\n");
+        }
+        list_insert_tail(&tty_list, &tty->tty_link);
+}
+
 void
 tty_init()
 {
         screen_init();
         vt_init();
         keyboard_init();
+        serial_init();
 
         /*
-         * Create NTERMS tty's, all with the default line discipline
-         * and a virtual terminal driver.
+         * Create NTERMS tty's on the virtual terminals, and after
+         * them one on each serial terminal.
          */
         int nterms, i;
 
+        list_init(&tty_list);
+        softirq_register(SOFTIRQ_TTY, tty_softirq);
         nterms = vt_num_terminals();
         for (i = 0; i < nterms; ++i) {
-                tty_driver_t *ttyd;
-                tty_device_t *tty;
-                tty_ldisc_t *ldisc;
-
-                ttyd = vt_get_tty_driver(i);
-                KASSERT(NULL != ttyd);
-                KASSERT(NULL != ttyd->ttd_ops);
-                KASSERT(NULL != ttyd->ttd_ops->register_callback_handler);
-
-                tty = tty_create(ttyd, i);
-                if (NULL == tty) {
-                        panic("Not enough memory to allocate tty\n");
-                }
-
-                if (NULL != ttyd->ttd_ops->register_callback_handler(
-                            ttyd, tty_global_driver_callback, (void *)tty)) {
-                        panic("Callback already registered "
-                              "to terminal %d\n", i);
-                }
-
-                ldisc = n_tty_create();
-                if (NULL == ldisc) {
-                        panic("Not enough memory to allocate "
-                              "line discipline\n");
-                }
-                KASSERT(NULL != ldisc);
-                KASSERT(NULL != ldisc->ld_ops);
-                KASSERT(NULL != ldisc->ld_ops->attach);
-                ldisc->ld_ops->attach(ldisc, tty);
-
-                if (bytedev_register(&tty->tty_cdev) != 0) {
-                        panic("Error registering tty as byte device\n");
-                }
+                tty_init_one(vt_get_tty_driver(i), i);
+        }
+        for (i = 0; i < serial_num_terminals(); ++i) {
+                tty_init_one(serial_get_tty_driver(i), nterms + i);
         }
 }
 
@@ -141,21 +197,21 @@ tty_create(tty_driver_t *driver, int id)
     tty->tty_cdev.cd_id = MKDEVID(TTY_MAJOR, id);
     tty->tty_cdev.cd_ops = &tty_bytedev_ops;
 
+    tty->tty_inq_head = 0;
+    tty->tty_inq_tail = 0;
+    list_link_init(&tty->tty_link);
+
     return tty;
 }
 
 /*
  * This is the function called by the virtual terminal subsystem when
- * a key is pressed.
- *
- * The first thing you should do is to pass the character to the line
- * discipline. This way, the character will be buffered, so that when
- * the read system call is made, an entire line will be returned,
- * rather than just a single character.
+ * a key is pressed, in its interrupt handler.
  *
- * After passing the character off to the line discipline, the result
- * of receive_char() should be echoed to the screen using the
- * tty_echo() function.
+ * The line discipline could take a while over the character, and echo
+ * it too, so the handler only puts it on the tty's ring and raises the
+ * tty softirq to pass it on. When the ring is full the character is
+ * dropped, as the line discipline would when its own buffer is full.
  */
 void
 tty_global_driver_callback(void *arg, char c)
@@ -163,27 +219,62 @@ tty_global_driver_callback(void *arg, char c)
     KASSERT(NULL != arg);
     tty_device_t *tty = (tty_device_t *)arg;
 
+    unsigned tail = tty->tty_inq_tail;
+    if (TTY_INQ_SIZE == tail - tty->tty_inq_head) {
+        return;
+    }
+    tty->tty_inq[tail % TTY_INQ_SIZE] = c;
+    /* the character is there before the softirq can see it is */
+    compiler_barrier();
+    tty->tty_inq_tail = tail + 1;
+
+    softirq_raise(SOFTIRQ_TTY);
+}
+
+/*
+ * Passes whatever has been received on tty to the line discipline and
+ * echoes the result of receive_char() with tty_echo(). This runs in the
+ * softirq, with interrupts enabled, so the interrupt handler goes on
+ * filling the ring meanwhile. Softirqs only run at IPL_LOW, and so never
+ * while a thread has blocked the driver's I/O to use the line discipline.
+ */
+static void
+tty_inq_drain(tty_device_t *tty)
+{
     tty_ldisc_t *tty_ldisc = tty->tty_ldisc;
     KASSERT(NULL != tty_ldisc);
-    const char *s = tty_ldisc->ld_ops->receive_char(tty_ldisc, c);
-
     KASSERT(NULL != tty->tty_driver);
-    tty_echo(tty->tty_driver, s);
+
+    unsigned head = tty->tty_inq_head;
+    while (head != tty->tty_inq_tail) {
+        compiler_barrier();
+        char c = tty->tty_inq[head % TTY_INQ_SIZE];
+        compiler_barrier();
+        tty->tty_inq_head = ++head;
+
+        const char *s = tty_ldisc->ld_ops->receive_char(tty_ldisc, c);
+        tty_echo(tty->tty_driver, s);
+    }
+}
+
+static void
+tty_softirq(void)
+{
+    tty_device_t *tty;
+    list_iterate_begin(&tty_list, tty, tty_device_t, tty_link) {
+        tty_inq_drain(tty);
+    } list_iterate_end();
 }
 
 /*
- * You should use the driver's provide_char function to output
- * each character of the string 'out'.
+ * The driver's provide_buf outputs the string 'out' in one go.
  */
 void
 tty_echo(tty_driver_t *driver, const char *out)
 {
     KASSERT(NULL != driver);
 
-    int i = 0;
-    while ('\0' != out[i]) {
-        driver->ttd_ops->provide_char(driver, out[i++]);
-    }
+    driver->ttd_ops->provide_buf(driver, out, strlen(out));
 }
 
 /*
@@ -221,7 +312,9 @@ tty_read(bytedev_t *dev, int offset, void *buf, int count)
 /*
  * In this function, you should block I/O, process each
  * character with the line discipline and output the result to
- * the driver, and then unblock I/O.
+ * the driver, and then unblock I/O. The line discipline translates
+ * the buffer a chunk at a time, so that the driver updates the
+ * screen once a chunk rather than once a character.
  *
  * Important: You should return the number of bytes processed,
  * _NOT_ the number of bytes written out to the driver.
@@ -243,18 +336,67 @@ tty_write(bytedev_t *dev, int offset, const void *buf, int count)
     struct tty_ldisc *ldisc = tty->tty_ldisc;
     KASSERT(NULL != ldisc);
 
-    ((char *)buf)[count] = 0;
     const char *buff = (const char *)buf;
-    dbg(DBG_TERM, "tty_write: the string is: %s\n", buff);
+    char out[TTY_WRITE_CHUNK];
     int i = 0;
-    for (i = 0 ; i < count; i++) {
-        const char *s = ldisc->ld_ops->process_char(ldisc, buff[i]);
-        tty_echo(ttyd, s);
+    while (i < count) {
+        int n = count - i;
+        int len = ldisc->ld_ops->process_buf(ldisc, buff + i, &n, out, sizeof(out));
+        ttyd->ttd_ops->provide_buf(ttyd, out, len);
+        i += n;
     }
-    int write = i;
 
     /*unblock IO*/
     ttyd->ttd_ops->unblock_io(ttyd, ret);
 
     return i;
 }
+
+/*
+ * The line discipline knows whether there is input. As in tty_read, the
+ * driver's input is blocked while we look, so that a character arriving
+ * cannot wake the line discipline's pollhead while pt is going onto it.
+ */
+int
+tty_poll(bytedev_t *dev, int events, struct polltable *pt)
+{
+    KASSERT(NULL != dev);
+
+    tty_device_t *tty = bd_to_tty(dev);
+    tty_driver_t *ttyd = tty->tty_driver;
+    KASSERT(NULL != ttyd);
+
+    void *ret = ttyd->ttd_ops->block_io(ttyd);
+
+    struct tty_ldisc *ldisc = tty->tty_ldisc;
+    KASSERT(NULL != ldisc);
+    int revents = ldisc->ld_ops->poll(ldisc, events, pt);
+
+    ttyd->ttd_ops->unblock_io(ttyd, ret);
+    return revents;
+}
+
+/*
+ * The line discipline keeps the terminal's modes. Input is blocked while
+ * they change, so that no character is received half under each.
+ */
+int
+tty_ioctl(bytedev_t *dev, int request, void *arg)
+{
+    KASSERT(NULL != dev);
+
+    tty_device_t *tty = bd_to_tty(dev);
+    tty_driver_t *ttyd = tty->tty_driver;
+    KASSERT(NULL != ttyd);
+
+    struct tty_ldisc *ldisc = tty->tty_ldisc;
+    KASSERT(NULL != ldisc);
+    if (NULL == ldisc->ld_ops->ioctl) {
+        return -ENOTTY;
+    }
+
+    void *ret = ttyd->ttd_ops->block_io(ttyd);
+    int err = ldisc->ld_ops->ioctl(ldisc, request, arg);
+    ttyd->ttd_ops->unblock_io(ttyd, ret);
+    return err;
+}
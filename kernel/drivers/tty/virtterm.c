@@ -22,6 +22,7 @@
         CONTAINER_OF(driver, virtterm_t, vt_driver)
 
 static void vt_provide_char(tty_driver_t *ttyd, char c);
+static void vt_provide_buf(tty_driver_t *ttyd, const char *buf, int len);
 static tty_driver_callback_t vt_register_callback_handler(
         tty_driver_t *ttyd,
         tty_driver_callback_t callback,
@@ -33,6 +34,7 @@ static void  vt_unblock_io(tty_driver_t *ttyd, void *data);
 
 static tty_driver_ops_t vt_driver_ops = {
         .provide_char                = vt_provide_char,
+        .provide_buf                 = vt_provide_buf,
         .register_callback_handler   = vt_register_callback_handler,
         .unregister_callback_handler = vt_unregister_callback_handler,
         .block_io                    = vt_block_io,
@@ -68,6 +70,15 @@ typedef struct virtterm {
 static virtterm_t vt_terms[NTERMS];
 static virtterm_t *vt_curterm;
 
+/*
+ * What is on the screen, so that vt_redraw only writes the lines which
+ * differ: the terminal and top it was last drawn from (vt_shown_term is
+ * NULL when the screen is in no known state) and the characters there.
+ */
+static virtterm_t *vt_shown_term;
+static int vt_shown_top;
+static char vt_shown[DISPLAY_SIZE];
+
 /**
  * Called when a key is pressed. Sends the key press to the current
  * terminal if there is one.
@@ -234,42 +245,56 @@ vt_print_shutdown()
 
 void
 vt_provide_char(tty_driver_t *ttyd, char c)
+{
+        vt_provide_buf(ttyd, &c, 1);
+}
+
+void
+vt_provide_buf(tty_driver_t *ttyd, const char *buf, int len)
 {
         KASSERT(NULL != ttyd);
 
         virtterm_t *vt = driver_to_vt(ttyd);
+        int redraw = 0;
+        int i;
 
-        /* Store for optimizing */
-        int old_cursor = vt->vt_cursor;
-        int old_top = vt->vt_top;
-        int can_write_char;
+        for (i = 0; i < len; i++) {
+                /* Store for optimizing */
+                int old_cursor = vt->vt_cursor;
+                int old_top = vt->vt_top;
+                int can_write_char;
 
-        /* If cursor is not on the screen, we move top */
-        if (circ_dist(vt->vt_cursor, vt->vt_top) >= DISPLAY_SIZE) {
-                /* Cursor should be on the last row in this case */
+                /* If cursor is not on the screen, we move top */
+                if (circ_dist(vt->vt_cursor, vt->vt_top) >= DISPLAY_SIZE) {
+                        /* Cursor should be on the last row in this case */
 
-                vt->vt_top = next_row(vt->vt_cursor);
-                buf_add(vt->vt_top, -DISPLAY_SIZE);
-        }
+                        vt->vt_top = next_row(vt->vt_cursor);
+                        buf_add(vt->vt_top, -DISPLAY_SIZE);
+                }
 
-        can_write_char = vt_handle_char(vt, c);
+                can_write_char = vt_handle_char(vt, buf[i]);
 
-        /* Redraw if it's the current terminal */
-        if (vt_curterm == vt) {
                 /*
-                 * Check if we can optimize (just put 1 char instead
-                 * of redrawing screen)
+                 * Put just the char on the screen if it's the current
+                 * terminal and we can (the screen has not scrolled);
+                 * otherwise the whole screen is redrawn once at the end
                  */
-                if (old_top == vt->vt_top) {
-                        if (can_write_char) {
-                                int rel_cursor = circ_dist(old_cursor, vt->vt_top);
-                                screen_putchar(c, rel_cursor %
-                                               DISPLAY_WIDTH,
-                                               rel_cursor / DISPLAY_WIDTH);
-                        }
-                        vt_cursor_redraw();
-                } else {
+                if (old_top != vt->vt_top) {
+                        redraw = 1;
+                } else if (!redraw && can_write_char && vt_curterm == vt) {
+                        int rel_cursor = circ_dist(old_cursor, vt->vt_top);
+                        screen_putchar(buf[i], rel_cursor % DISPLAY_WIDTH,
+                                       rel_cursor / DISPLAY_WIDTH);
+                        if (vt_shown_term == vt)
+                                vt_shown[rel_cursor] = buf[i];
+                }
+        }
+
+        if (vt_curterm == vt) {
+                if (redraw) {
                         vt_redraw();
+                } else {
+                        vt_cursor_redraw();
                 }
         }
 }
@@ -338,7 +363,10 @@ vt_cursor_redraw()
 }
 
 
-/* Redraws the screen based on the current virtual terminal */
+/* Redraws the screen based on the current virtual terminal, writing
+ * only the lines which are not already on the screen. When the terminal
+ * has scrolled forward since it was drawn the display is scrolled in
+ * hardware first, so that only the lines scrolled in need writing. */
 void
 vt_redraw()
 {
@@ -386,7 +414,32 @@ vt_redraw()
                         }
                 }
         }
-        screen_putbuf(vt_curterm->vt_tempbuf);
+
+        /* Lines from here down must be written whatever vt_shown says */
+        int stale = 0;
+        if (vt_shown_term == vt_curterm) {
+                int lines = circ_dist(vt_curterm->vt_top, vt_shown_top) / DISPLAY_WIDTH;
+                if (0 == lines) {
+                        stale = DISPLAY_HEIGHT;
+                } else if (lines < DISPLAY_HEIGHT && 0 == screen_scroll(lines)) {
+                        /* memcpy copies forwards, so the overlap is safe */
+                        stale = DISPLAY_HEIGHT - lines;
+                        memcpy(vt_shown, vt_shown + lines * DISPLAY_WIDTH,
+                               stale * DISPLAY_WIDTH);
+                }
+        }
+
+        int y;
+        for (y = 0; y < DISPLAY_HEIGHT; y++) {
+                char *line = vt_curterm->vt_tempbuf + y * DISPLAY_WIDTH;
+                char *shown = vt_shown + y * DISPLAY_WIDTH;
+                if (y >= stale || 0 != memcmp(line, shown, DISPLAY_WIDTH)) {
+                        screen_putline(line, y);
+                        memcpy(shown, line, DISPLAY_WIDTH);
+                }
+        }
+        vt_shown_term = vt_curterm;
+        vt_shown_top = vt_curterm->vt_top;
 
         /* Also want to reposition the cursor */
         vt_cursor_redraw();
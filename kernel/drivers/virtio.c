@@ -0,0 +1,199 @@
+#include "kernel.h"
+#include "types.h"
+#include "errno.h"
+
+#include "main/io.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#include "drivers/virtio.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+
+#define vring_avail_size(qsize) (sizeof(vring_avail_t) + ((qsize) + 1) * sizeof(uint16_t))
+#define vring_used_size(qsize) \
+        (sizeof(vring_used_t) + (qsize) * sizeof(vring_used_elem_t) + sizeof(uint16_t))
+#define vring_used_offset(qsize) \
+        ((uintptr_t)PAGE_ALIGN_UP((qsize) * sizeof(vring_desc_t) + vring_avail_size(qsize)))
+
+/* Whether moving an index from old to new passes event, i.e. whether the
+ * other side asked to hear about it */
+#define vring_need_event(event, new, old) \
+        ((uint16_t)((new) - (event) - 1) < (uint16_t)((new) - (old)))
+
+uint32_t
+virtio_negotiate(uint16_t iobase, uint32_t wanted)
+{
+        uint32_t features;
+
+        outb(iobase + VIRTIO_REG_DEVICE_STATUS, 0);
+        outb(iobase + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+        outb(iobase + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+        features = inl(iobase + VIRTIO_REG_DEVICE_FEATURES) & wanted;
+        outl(iobase + VIRTIO_REG_GUEST_FEATURES, features);
+        return features;
+}
+
+void
+virtio_driver_ok(uint16_t iobase)
+{
+        outb(iobase + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE
+             | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+}
+
+void
+virtio_fail(uint16_t iobase)
+{
+        outb(iobase + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+}
+
+int
+virtq_init(virtq_t *vq, uint16_t iobase, uint16_t index, int event_idx)
+{
+        uint16_t qsize, i;
+        uint32_t npages;
+        char *ring;
+
+        outw(iobase + VIRTIO_REG_QUEUE_SELECT, index);
+        qsize = inw(iobase + VIRTIO_REG_QUEUE_SIZE);
+        npages = ADDR_TO_PN(PAGE_ALIGN_UP(vring_used_offset(qsize) + vring_used_size(qsize)));
+        if (2 > qsize || 0 != inl(iobase + VIRTIO_REG_QUEUE_PFN)
+            || npages > (1U << (PAGE_NSIZES - 1))) {
+                dbg(DBG_DISK, "virtio: unusable queue %u of size %u\n", index, qsize);
+                return -ENODEV;
+        }
+
+        if (NULL == (vq->vq_cookies = kmalloc(qsize * sizeof(void *)))
+            || NULL == (ring = page_alloc_n(npages)))
+                panic("Not enough memory for a virtqueue!\n");
+        memset(ring, 0, npages * PAGE_SIZE);
+        memset(vq->vq_cookies, 0, qsize * sizeof(void *));
+
+        vq->vq_iobase = iobase;
+        vq->vq_index = index;
+        vq->vq_event_idx = event_idx;
+        vq->vq_size = qsize;
+        vq->vq_desc = (vring_desc_t *)ring;
+        vq->vq_avail = (vring_avail_t *)(ring + qsize * sizeof(vring_desc_t));
+        vq->vq_avail_ring = (uint16_t *)(vq->vq_avail + 1);
+        vq->vq_used_event = &vq->vq_avail_ring[qsize];
+        vq->vq_used = (vring_used_t *)(ring + vring_used_offset(qsize));
+        vq->vq_used_ring = (vring_used_elem_t *)(vq->vq_used + 1);
+        vq->vq_avail_event = (uint16_t *)&vq->vq_used_ring[qsize];
+
+        for (i = 0; i < qsize; i++)
+                vq->vq_desc[i].vd_next = i + 1;
+        vq->vq_free_head = 0;
+        vq->vq_nfree = qsize;
+        vq->vq_kicked = 0;
+        vq->vq_last_used = 0;
+
+        outl(iobase + VIRTIO_REG_QUEUE_PFN, ADDR_TO_PN(pt_virt_to_phys((uintptr_t)ring)));
+        return 0;
+}
+
+int
+virtq_add(virtq_t *vq, const virtq_seg_t *segs, unsigned int nsegs, void *cookie)
+{
+        uint16_t head, d, idx;
+        unsigned int i;
+
+        KASSERT(0 < nsegs && NULL != cookie);
+        if (vq->vq_nfree < nsegs)
+                return -ENOSPC;
+
+        head = d = vq->vq_free_head;
+        for (i = 0; i < nsegs; i++) {
+                if (0 < i)
+                        d = vq->vq_desc[d].vd_next;
+                vq->vq_desc[d].vd_addr = pt_virt_to_phys((uintptr_t)segs[i].vs_addr);
+                vq->vq_desc[d].vd_len = segs[i].vs_len;
+                vq->vq_desc[d].vd_flags = ((i + 1 < nsegs) ? VRING_DESC_F_NEXT : 0)
+                                          | (segs[i].vs_devwrite ? VRING_DESC_F_WRITE : 0);
+        }
+        vq->vq_free_head = vq->vq_desc[d].vd_next;
+        vq->vq_nfree -= nsegs;
+        vq->vq_cookies[head] = cookie;
+
+        /* the descriptors, then the ring entry, then the index */
+        idx = vq->vq_avail->va_idx;
+        vq->vq_avail_ring[idx % vq->vq_size] = head;
+        virtio_barrier();
+        vq->vq_avail->va_idx = idx + 1;
+        return 0;
+}
+
+/*
+ * While it is working through the ring the device says it need not be
+ * told of more, either by its available event, or by a flag.
+ */
+int
+virtq_kick(virtq_t *vq)
+{
+        uint16_t old = vq->vq_kicked;
+        int kick;
+
+        vq->vq_kicked = vq->vq_avail->va_idx;
+        virtio_mb();
+        if (vq->vq_event_idx)
+                kick = vring_need_event(*vq->vq_avail_event, vq->vq_kicked, old);
+        else
+                kick = !(vq->vq_used->vu_flags & VRING_USED_F_NO_NOTIFY);
+        if (kick)
+                outw(vq->vq_iobase + VIRTIO_REG_QUEUE_NOTIFY, vq->vq_index);
+        return kick;
+}
+
+void *
+virtq_get(virtq_t *vq, uint32_t *len)
+{
+        volatile vring_used_elem_t *e;
+        uint16_t head, d, n = 1;
+        void *cookie;
+
+        if (vq->vq_last_used == vq->vq_used->vu_idx)
+                return NULL;
+
+        virtio_barrier();
+        e = &vq->vq_used_ring[vq->vq_last_used % vq->vq_size];
+        head = d = (uint16_t)e->ve_id;
+        KASSERT(head < vq->vq_size && NULL != vq->vq_cookies[head]);
+        if (NULL != len)
+                *len = e->ve_len;
+        while (vq->vq_desc[d].vd_flags & VRING_DESC_F_NEXT) {
+                d = vq->vq_desc[d].vd_next;
+                n++;
+        }
+        vq->vq_desc[d].vd_next = vq->vq_free_head;
+        vq->vq_free_head = head;
+        vq->vq_nfree += n;
+
+        cookie = vq->vq_cookies[head];
+        vq->vq_cookies[head] = NULL;
+        vq->vq_last_used++;
+        return cookie;
+}
+
+/* With VIRTIO_RING_F_EVENT_IDX the device interrupts only once it passes
+ * the used event, which is left where it is until the ring is empty */
+void
+virtq_intr_disable(virtq_t *vq)
+{
+        if (!vq->vq_event_idx)
+                vq->vq_avail->va_flags = VRING_AVAIL_F_NO_INTERRUPT;
+}
+
+int
+virtq_intr_enable(virtq_t *vq)
+{
+        if (vq->vq_event_idx)
+                *vq->vq_used_event = vq->vq_last_used;
+        else
+                vq->vq_avail->va_flags = 0;
+        virtio_mb();
+        return vq->vq_last_used != vq->vq_used->vu_idx;
+}
@@ -0,0 +1,225 @@
+#include "kernel.h"
+#include "config.h"
+#include "types.h"
+
+#include "util/debug.h"
+#include "util/hash.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/string.h"
+
+#include "fs/dcache.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+#include "proc/rcu.h"
+
+/*
+ * A fixed number of entries, hashed on (file system, directory inode,
+ * name). The least recently used entry is reused when a new one is
+ * needed. Entries name vnodes by file system and inode number rather than
+ * by pointer, so they hold no references; a hit calls vget, which does not
+ * touch the directory on disk. A name that crosses a mount point, either
+ * way, is cached as the vnode on the other side, so a hit goes straight
+ * there.
+ *
+ * Lookups search the hash in an RCU read-side section (proc/rcu.h) and
+ * write nothing but dc_referenced, so "least recently used" is a second
+ * chance on the way out rather than a move to the front on every hit. An
+ * entry taken off its bucket may still be looked at by a reader, so it is
+ * not reused until a grace period has passed since then (dc_retired).
+ */
+typedef struct dcache_ent {
+        fs_t            *dc_fs;         /* NULL if the entry is unused */
+        ino_t           dc_dir;         /* the directory */
+        fs_t            *dc_vfs;        /* what the name refers to */
+        ino_t           dc_vno;
+        int             dc_negative;    /* 1 if the name does not exist */
+        int             dc_referenced;  /* found since it last came round */
+        uint32_t        dc_retired;     /* rcu_state() when it was unhashed */
+        size_t          dc_namelen;
+        char            dc_name[NAME_LEN];
+        list_link_t     dc_hlink;       /* on a dcache_hash bucket */
+        list_link_t     dc_lru;         /* on dcache_lru */
+} dcache_ent_t;
+
+static dcache_ent_t dcache_ents[DCACHE_SIZE];
+static list_t dcache_hash[DCACHE_BUCKETS];
+static list_t dcache_lru;               /* most recently used first */
+
+/* How far up from the end of dcache_lru dcache_enter looks for an entry */
+#define DCACHE_SCAN     16
+
+static list_t *
+dcache_bucket(fs_t *fs, ino_t dir, const char *name, size_t len)
+{
+        uint32_t h = HASH_INIT ^ (uint32_t)fs ^ (dir * 2654435761u);
+        return &dcache_hash[hash_bytes(h, name, len) % DCACHE_BUCKETS];
+}
+
+static dcache_ent_t *
+dcache_find(vnode_t *dir, const char *name, size_t len)
+{
+        dcache_ent_t *dc;
+        list_iterate_begin(dcache_bucket(dir->vn_fs, dir->vn_vno, name, len),
+                           dc, dcache_ent_t, dc_hlink) {
+                if (dc->dc_fs == dir->vn_fs && dc->dc_dir == dir->vn_vno
+                    && dc->dc_namelen == len
+                    && !memcmp(dc->dc_name, name, len)) {
+                        return dc;
+                }
+        } list_iterate_end();
+        return NULL;
+}
+
+static void
+dcache_unhash(dcache_ent_t *dc)
+{
+        list_remove_rcu(&dc->dc_hlink);
+        dc->dc_fs = NULL;
+        dc->dc_vfs = NULL;
+        dc->dc_retired = rcu_state();
+}
+
+static void
+dcache_free(dcache_ent_t *dc)
+{
+        dcache_unhash(dc);
+        list_remove(&dc->dc_lru);
+        list_insert_tail(&dcache_lru, &dc->dc_lru);
+}
+
+/*
+ * An entry to reuse, from the end of dcache_lru, or NULL if none of the
+ * ones looked at can be reused yet. Entries found since they last came
+ * round go back to the front instead, and the others are unhashed on the
+ * way past, to be reused by a later call.
+ */
+static dcache_ent_t *
+dcache_victim(void)
+{
+        dcache_ent_t *dc;
+        int n = 0;
+
+        list_iterate_reverse(&dcache_lru, dc, dcache_ent_t, dc_lru) {
+                if (DCACHE_SCAN == n++)
+                        return NULL;
+                if (NULL != dc->dc_fs) {
+                        if (dc->dc_referenced) {
+                                dc->dc_referenced = 0;
+                                list_remove(&dc->dc_lru);
+                                list_insert_head(&dcache_lru, &dc->dc_lru);
+                                continue;
+                        }
+                        dcache_unhash(dc);
+                }
+                if (rcu_state_done(dc->dc_retired))
+                        return dc;
+        } list_iterate_end();
+        return NULL;
+}
+
+int
+dcache_lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result)
+{
+        dcache_ent_t *dc;
+        fs_t *vfs;
+        ino_t vno;
+        int negative;
+
+        rcu_read_lock();
+        if (NULL == (dc = dcache_find(dir, name, len))) {
+                rcu_read_unlock();
+                return 0;
+        }
+        dc->dc_referenced = 1;
+        negative = dc->dc_negative;
+        vfs = dc->dc_vfs;
+        vno = dc->dc_vno;
+        rcu_read_unlock();
+
+        *result = negative ? NULL : vget(vfs, vno);
+        return 1;
+}
+
+void
+dcache_enter(vnode_t *dir, const char *name, size_t len, vnode_t *child)
+{
+        dcache_ent_t *dc;
+
+        if (len > NAME_LEN)
+                return;
+
+        if (NULL == (dc = dcache_find(dir, name, len))) {
+                /* it is only a cache, so if nothing can be reused yet
+                 * the name just is not remembered */
+                if (NULL == (dc = dcache_victim()))
+                        return;
+                dc->dc_dir = dir->vn_vno;
+                dc->dc_namelen = len;
+                memcpy(dc->dc_name, name, len);
+                dc->dc_negative = (NULL == child);
+                dc->dc_vfs = (NULL == child) ? NULL : child->vn_fs;
+                dc->dc_vno = (NULL == child) ? 0 : child->vn_vno;
+                dc->dc_referenced = 0;
+                dc->dc_fs = dir->vn_fs;
+                list_insert_head_rcu(dcache_bucket(dir->vn_fs, dir->vn_vno, name, len),
+                                     &dc->dc_hlink);
+        } else {
+                dc->dc_negative = (NULL == child);
+                dc->dc_vfs = (NULL == child) ? NULL : child->vn_fs;
+                dc->dc_vno = (NULL == child) ? 0 : child->vn_vno;
+        }
+
+        list_remove(&dc->dc_lru);
+        list_insert_head(&dcache_lru, &dc->dc_lru);
+}
+
+void
+dcache_forget(vnode_t *dir, const char *name, size_t len)
+{
+        dcache_ent_t *dc = dcache_find(dir, name, len);
+        if (NULL != dc)
+                dcache_free(dc);
+}
+
+void
+dcache_forget_dir(fs_t *fs, ino_t vno)
+{
+        int i;
+        for (i = 0; i < DCACHE_SIZE; i++) {
+                if (dcache_ents[i].dc_fs == fs && dcache_ents[i].dc_dir == vno)
+                        dcache_free(&dcache_ents[i]);
+        }
+}
+
+void
+dcache_forget_fs(fs_t *fs)
+{
+        int i;
+        for (i = 0; i < DCACHE_SIZE; i++) {
+                if (dcache_ents[i].dc_fs == fs || dcache_ents[i].dc_vfs == fs)
+                        dcache_free(&dcache_ents[i]);
+        }
+}
+
+static __attribute__((unused)) void
+dcache_init(void)
+{
+        int i;
+
+        list_init(&dcache_lru);
+        for (i = 0; i < DCACHE_BUCKETS; i++) {
+                list_init(&dcache_hash[i]);
+        }
+        for (i = 0; i < DCACHE_SIZE; i++) {
+                dcache_ents[i].dc_fs = NULL;
+                dcache_ents[i].dc_vfs = NULL;
+                dcache_ents[i].dc_referenced = 0;
+                /* never hashed, so free to use at once */
+                dcache_ents[i].dc_retired = rcu_state() - 1;
+                list_link_init(&dcache_ents[i].dc_hlink);
+                list_insert_tail(&dcache_lru, &dcache_ents[i].dc_lru);
+        }
+}
+init_func(dcache_init);
@@ -0,0 +1,487 @@
+#include "kernel.h"
+#include "config.h"
+#include "errno.h"
+#include "globals.h"
+#include "types.h"
+
+#include "main/interrupt.h"
+
+#include "mm/slab.h"
+
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/string.h"
+#include "util/time.h"
+
+#include "fs/epoll.h"
+#include "fs/file.h"
+#include "fs/open.h"
+#include "fs/poll.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+/*
+ * An epoll instance is a file on a pseudo file system like pipefs. Each
+ * descriptor added to it gets an epitem, whose waiter stays on the
+ * pollhead of the descriptor's vnode until it is deleted. When the
+ * pollhead is woken the epitem goes on the instance's ready list, and
+ * epoll_wait looks only at what is on that list, so its cost is in the
+ * descriptors which have had something happen, not the ones watched.
+ *
+ * The ready list may be added to from interrupt context, by the waiter
+ * of a tty, so it is only touched at IPL_HIGH.
+ */
+typedef struct epoll {
+        list_t                  ep_items;       /* every epitem */
+        list_t                  ep_ready;       /* epitems woken since looked at */
+        int                     ep_nready;      /* length of ep_ready */
+        ktqueue_t               ep_waitq;       /* epoll_wait sleeps here */
+        pollhead_t              ep_pollhead;    /* for polling the epoll file */
+} epoll_t;
+
+typedef struct epitem {
+        epoll_t                *ei_ep;
+        /*
+         * The file watched and the descriptor it was added as. The file is
+         * not referenced, which would keep it from ever being closed;
+         * instead fput drops its epitems just before it frees it.
+         */
+        file_t                 *ei_file;
+        int                     ei_fd;
+        struct epoll_event      ei_event;
+        pollwaiter_t            ei_waiter;      /* on the file's pollhead */
+        list_link_t             ei_link;        /* on ep_items */
+        list_link_t             ei_flink;       /* on ei_file->f_epitems */
+        list_link_t             ei_rlink;       /* on ep_ready, if linked */
+} epitem_t;
+
+/* What the poll vnode operation hangs on a pollhead for EPOLL_CTL_ADD */
+typedef struct epitem_table {
+        polltable_t             et_table;
+        epitem_t               *et_item;
+} epitem_table_t;
+
+#define VNODE_TO_EPOLL(vn) ((epoll_t *)((vn)->vn_i))
+
+static void epoll_read_vnode(vnode_t *vnode);
+static void epoll_delete_vnode(vnode_t *vnode);
+static int  epoll_query_vnode(vnode_t *vnode);
+
+static fs_ops_t epoll_fsops = {
+        .read_vnode = epoll_read_vnode,
+        .delete_vnode = epoll_delete_vnode,
+        .query_vnode = epoll_query_vnode,
+        .umount = NULL
+};
+
+static fs_t epoll_fs = {
+        .fs_dev = "epoll",
+        .fs_type = "epoll",
+        .fs_op = &epoll_fsops,
+        .fs_root = NULL,
+        .fs_i = NULL
+};
+
+static int epoll_stat(vnode_t *vnode, struct stat *ss);
+static int epoll_poll(vnode_t *vnode, int events, polltable_t *pt);
+
+static vnode_ops_t epoll_vops = {
+        .stat = epoll_stat,
+        .poll = epoll_poll
+};
+
+static slab_allocator_t *epoll_allocator = NULL;
+static slab_allocator_t *epitem_allocator = NULL;
+static int next_epno = 0;
+
+static __attribute__((unused)) void
+epoll_init(void)
+{
+        epoll_allocator = slab_allocator_create("epoll", sizeof(epoll_t));
+        KASSERT(NULL != epoll_allocator);
+        epitem_allocator = slab_allocator_create("epitem", sizeof(epitem_t));
+        KASSERT(NULL != epitem_allocator);
+}
+init_func(epoll_init);
+init_depends(vfs_init);
+
+/* Puts ei on the ready list unless it is there already. Called at
+ * IPL_HIGH or from an interrupt. */
+static void
+epitem_ready(epitem_t *ei)
+{
+        epoll_t *ep = ei->ei_ep;
+
+        if (!list_link_is_linked(&ei->ei_rlink)) {
+                list_insert_tail(&ep->ep_ready, &ei->ei_rlink);
+                ep->ep_nready++;
+                sched_broadcast_on(&ep->ep_waitq);
+                poll_wakeup(&ep->ep_pollhead);
+        }
+}
+
+/* The file's pollhead was woken. Whether the events ei wants are among
+ * what happened is left for epoll_wait to find out. */
+static void
+epitem_wake(pollwaiter_t *pw)
+{
+        epitem_ready(CONTAINER_OF(pw, epitem_t, ei_waiter));
+}
+
+static pollwaiter_t *
+epitem_waiter(polltable_t *pt)
+{
+        epitem_t *ei = CONTAINER_OF(pt, epitem_table_t, et_table)->et_item;
+
+        /* the poll operations here use one pollhead each */
+        KASSERT(!list_link_is_linked(&ei->ei_waiter.pw_link));
+        return &ei->ei_waiter;
+}
+
+/* What of what ei wants is true of its file now. */
+static int
+epitem_poll(epitem_t *ei, polltable_t *pt)
+{
+        int events = ei->ei_event.events & ~EPOLLET;
+
+        return poll_vnode(ei->ei_file->f_vnode, events, pt)
+               & (events | EPOLLERR | EPOLLHUP);
+}
+
+static void
+epitem_free(epitem_t *ei)
+{
+        poll_unwait(&ei->ei_waiter);
+
+        uint8_t old_ipl = intr_getipl();
+        intr_setipl(IPL_HIGH);
+        if (list_link_is_linked(&ei->ei_rlink)) {
+                list_remove(&ei->ei_rlink);
+                ei->ei_ep->ep_nready--;
+        }
+        intr_setipl(old_ipl);
+
+        list_remove(&ei->ei_link);
+        list_remove(&ei->ei_flink);
+        slab_obj_free(epitem_allocator, ei);
+}
+
+void
+epoll_file_closed(file_t *f)
+{
+        epitem_t *ei;
+
+        list_iterate_begin(&f->f_epitems, ei, epitem_t, ei_flink) {
+                epitem_free(ei);
+        } list_iterate_end();
+}
+
+/* epollfs vnode operations */
+static void
+epoll_read_vnode(vnode_t *vnode)
+{
+        vnode->vn_ops = &epoll_vops;
+        vnode->vn_mode = 0;
+        vnode->vn_len = 0;
+        vnode->vn_i = NULL;
+}
+
+static void
+epoll_delete_vnode(vnode_t *vnode)
+{
+        epoll_t *ep = VNODE_TO_EPOLL(vnode);
+        epitem_t *ei;
+
+        if (NULL == ep) {
+                return;
+        }
+        list_iterate_begin(&ep->ep_items, ei, epitem_t, ei_link) {
+                epitem_free(ei);
+        } list_iterate_end();
+
+        KASSERT(0 == ep->ep_nready);
+        KASSERT(sched_queue_empty(&ep->ep_waitq));
+        slab_obj_free(epoll_allocator, ep);
+}
+
+static int
+epoll_query_vnode(vnode_t *vnode)
+{
+        /* as with pipes, nothing can open it again once it is closed */
+        return 0;
+}
+
+static int
+epoll_stat(vnode_t *vnode, struct stat *ss)
+{
+        memset(ss, 0, sizeof(*ss));
+        ss->st_mode = vnode->vn_mode;
+        ss->st_ino = (int) vnode->vn_vno;
+        return 0;
+}
+
+/* An epoll file is readable when epoll_wait might return something. */
+static int
+epoll_poll(vnode_t *vnode, int events, polltable_t *pt)
+{
+        epoll_t *ep = VNODE_TO_EPOLL(vnode);
+
+        poll_wait(&ep->ep_pollhead, pt);
+        return (0 < ep->ep_nready) ? POLLIN : 0;
+}
+
+int
+do_epoll_create(int size)
+{
+        if (0 >= size) {
+                return -EINVAL;
+        }
+
+        int fd = get_empty_fd(curproc);
+        if (0 > fd) {
+                return fd;
+        }
+
+        vnode_t *vn = vget(&epoll_fs, next_epno++);
+        if (NULL == vn) {
+                return -ENOMEM;
+        }
+        epoll_t *ep = slab_obj_alloc(epoll_allocator);
+        if (NULL == ep) {
+                vput(vn);
+                return -ENOMEM;
+        }
+        list_init(&ep->ep_items);
+        list_init(&ep->ep_ready);
+        ep->ep_nready = 0;
+        sched_queue_init(&ep->ep_waitq);
+        pollhead_init(&ep->ep_pollhead);
+        vn->vn_i = ep;
+
+        file_t *f = fget(-1);
+        if (NULL == f) {
+                vput(vn);
+                return -ENOMEM;
+        }
+        fdtable_install(&curproc->p_fdtable, fd, f);
+        f->f_mode = FMODE_READ;
+        f->f_pos = 0;
+        facq(f, vn);
+        return fd;
+}
+
+/* Returns epfd's epoll file, referenced, in *fp. */
+static int
+epoll_fget(int epfd, file_t **fp)
+{
+        file_t *f = fget(epfd);
+
+        if (NULL == f) {
+                return -EBADF;
+        }
+        if (&epoll_fs != f->f_vnode->vn_fs) {
+                fput(f);
+                return -EINVAL;
+        }
+        *fp = f;
+        return 0;
+}
+
+static epitem_t *
+epoll_find(epoll_t *ep, file_t *f, int fd)
+{
+        epitem_t *ei;
+
+        list_iterate_begin(&ep->ep_items, ei, epitem_t, ei_link) {
+                if (f == ei->ei_file && fd == ei->ei_fd) {
+                        return ei;
+                }
+        } list_iterate_end();
+        return NULL;
+}
+
+int
+do_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+        file_t *epf, *f;
+        epitem_t *ei;
+        int err;
+
+        if (0 > (err = epoll_fget(epfd, &epf))) {
+                return err;
+        }
+        epoll_t *ep = VNODE_TO_EPOLL(epf->f_vnode);
+
+        if (NULL == (f = fget(fd))) {
+                fput(epf);
+                return -EBADF;
+        }
+        /* Watching an epoll file could make loops of them */
+        if (&epoll_fs == f->f_vnode->vn_fs) {
+                err = -EINVAL;
+                goto out;
+        }
+
+        ei = epoll_find(ep, f, fd);
+        switch (op) {
+                case EPOLL_CTL_ADD:
+                        if (NULL != ei) {
+                                err = -EEXIST;
+                                break;
+                        }
+                        if (NULL == (ei = slab_obj_alloc(epitem_allocator))) {
+                                err = -ENOMEM;
+                                break;
+                        }
+                        ei->ei_ep = ep;
+                        ei->ei_file = f;
+                        ei->ei_fd = fd;
+                        ei->ei_event = *event;
+                        pollwaiter_init(&ei->ei_waiter, epitem_wake);
+                        list_link_init(&ei->ei_rlink);
+                        list_insert_tail(&ep->ep_items, &ei->ei_link);
+                        list_insert_tail(&f->f_epitems, &ei->ei_flink);
+
+                        epitem_table_t et;
+                        et.et_table.pt_waiter = epitem_waiter;
+                        et.et_item = ei;
+                        if (0 != epitem_poll(ei, &et.et_table)) {
+                                uint8_t old_ipl = intr_getipl();
+                                intr_setipl(IPL_HIGH);
+                                epitem_ready(ei);
+                                intr_setipl(old_ipl);
+                        }
+                        break;
+                case EPOLL_CTL_MOD:
+                        if (NULL == ei) {
+                                err = -ENOENT;
+                                break;
+                        }
+                        ei->ei_event = *event;
+                        /* it is on the pollhead already */
+                        if (0 != epitem_poll(ei, NULL)) {
+                                uint8_t old_ipl = intr_getipl();
+                                intr_setipl(IPL_HIGH);
+                                epitem_ready(ei);
+                                intr_setipl(old_ipl);
+                        }
+                        break;
+                case EPOLL_CTL_DEL:
+                        if (NULL == ei) {
+                                err = -ENOENT;
+                                break;
+                        }
+                        epitem_free(ei);
+                        break;
+                default:
+                        err = -EINVAL;
+                        break;
+        }
+
+out:
+        fput(f);
+        fput(epf);
+        return err;
+}
+
+/*
+ * Takes the epitems woken so far off the ready list, filling in events
+ * for those whose file has what they want. Level-triggered ones which
+ * are still ready go back on the end, after the ones looked at this
+ * time, so that each call sees each at most once.
+ */
+static int
+epoll_harvest(epoll_t *ep, struct epoll_event *events, int maxevents)
+{
+        int n = 0;
+
+        uint8_t old_ipl = intr_getipl();
+        intr_setipl(IPL_HIGH);
+        int todo = ep->ep_nready;
+        while (0 < todo-- && n < maxevents) {
+                epitem_t *ei = list_head(&ep->ep_ready, epitem_t, ei_rlink);
+                list_remove(&ei->ei_rlink);
+                ep->ep_nready--;
+                intr_setipl(old_ipl);
+
+                int revents = epitem_poll(ei, NULL);
+
+                intr_setipl(IPL_HIGH);
+                if (0 != revents) {
+                        events[n].events = revents;
+                        events[n].data = ei->ei_event.data;
+                        n++;
+                        if (!(ei->ei_event.events & EPOLLET)
+                            && !list_link_is_linked(&ei->ei_rlink)) {
+                                list_insert_tail(&ep->ep_ready, &ei->ei_rlink);
+                                ep->ep_nready++;
+                        }
+                }
+        }
+        intr_setipl(old_ipl);
+        return n;
+}
+
+typedef struct epoll_sleep {
+        epoll_t                *es_ep;
+        int                     es_expired;
+} epoll_sleep_t;
+
+static void
+epoll_expired(ktimer_t *t)
+{
+        epoll_sleep_t *es = (epoll_sleep_t *)t->t_data;
+
+        es->es_expired = 1;
+        sched_broadcast_on(&es->es_ep->ep_waitq);
+}
+
+int
+do_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+        file_t *epf;
+        epoll_sleep_t es;
+        ktimer_t t;
+        int n;
+        int err;
+
+        if (0 >= maxevents) {
+                return -EINVAL;
+        }
+        if (0 > (err = epoll_fget(epfd, &epf))) {
+                return err;
+        }
+
+        es.es_ep = VNODE_TO_EPOLL(epf->f_vnode);
+        es.es_expired = 0;
+        timer_init(&t, epoll_expired, &es);
+        if (0 < timeout) {
+                timer_add(&t, timeout);
+        }
+
+        for (;;) {
+                n = epoll_harvest(es.es_ep, events, maxevents);
+                if (0 != n || 0 == timeout || es.es_expired) {
+                        break;
+                }
+
+                uint8_t old_ipl = intr_getipl();
+                intr_setipl(IPL_HIGH);
+                if (0 == es.es_ep->ep_nready && !es.es_expired) {
+                        err = sched_cancellable_sleep_on(&es.es_ep->ep_waitq);
+                }
+                intr_setipl(old_ipl);
+                if (0 > err) {
+                        break;
+                }
+        }
+
+        timer_cancel(&t);
+        fput(epf);
+        return (0 > err) ? err : n;
+}
@@ -0,0 +1,186 @@
+#include "kernel.h"
+#include "config.h"
+#include "errno.h"
+#include "types.h"
+
+#include "mm/kmalloc.h"
+
+#include "fs/fdtable.h"
+#include "fs/file.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#define fdtable_word(fd)        ((fd) / FDTABLE_WORD_BITS)
+#define fdtable_bit(fd)         (1U << ((fd) % FDTABLE_WORD_BITS))
+
+/* Every word of the bitmap is a whole one, and doubling the table from
+ * NFILES_INITIAL stops at NFILES */
+#if NFILES_INITIAL % FDTABLE_WORD_BITS || NFILES % NFILES_INITIAL \
+    || (NFILES / NFILES_INITIAL) & (NFILES / NFILES_INITIAL - 1)
+#error "NFILES must be NFILES_INITIAL, a multiple of 32, times a power of two"
+#endif
+
+void
+fdtable_init(fdtable_t *fdt)
+{
+        memset(fdt->fdt_inline_files, 0, sizeof(fdt->fdt_inline_files));
+        memset(fdt->fdt_inline_open, 0, sizeof(fdt->fdt_inline_open));
+        fdt->fdt_files = fdt->fdt_inline_files;
+        fdt->fdt_open = fdt->fdt_inline_open;
+        fdt->fdt_size = NFILES_INITIAL;
+        fdt->fdt_first = 0;
+}
+
+/* Gives back the arrays of a table which has grown out of its own */
+static void
+fdtable_free_arrays(fdtable_t *fdt)
+{
+        if (fdt->fdt_files != fdt->fdt_inline_files) {
+                kfree(fdt->fdt_files);
+                kfree(fdt->fdt_open);
+        }
+}
+
+int
+fdtable_reserve(fdtable_t *fdt, int fd)
+{
+        struct file **files;
+        uint32_t *open;
+        int size;
+
+        KASSERT(0 <= fd && fd < NFILES);
+        if (fd < fdt->fdt_size)
+                return 0;
+
+        for (size = fdt->fdt_size; size <= fd; size *= 2)
+                ;
+        files = kmalloc(size * sizeof(*files));
+        open = kmalloc(FDTABLE_WORDS(size) * sizeof(*open));
+        if (NULL == files || NULL == open) {
+                if (NULL != files)
+                        kfree(files);
+                if (NULL != open)
+                        kfree(open);
+                return -ENOMEM;
+        }
+        /* another thread may have grown it while kmalloc slept */
+        if (fd < fdt->fdt_size) {
+                kfree(files);
+                kfree(open);
+                return 0;
+        }
+
+        memcpy(files, fdt->fdt_files, fdt->fdt_size * sizeof(*files));
+        memset(files + fdt->fdt_size, 0, (size - fdt->fdt_size) * sizeof(*files));
+        memcpy(open, fdt->fdt_open, FDTABLE_WORDS(fdt->fdt_size) * sizeof(*open));
+        memset(open + FDTABLE_WORDS(fdt->fdt_size), 0,
+               (FDTABLE_WORDS(size) - FDTABLE_WORDS(fdt->fdt_size)) * sizeof(*open));
+        fdtable_free_arrays(fdt);
+        fdt->fdt_files = files;
+        fdt->fdt_open = open;
+        fdt->fdt_size = size;
+        return 0;
+}
+
+int
+fdtable_first_free(fdtable_t *fdt)
+{
+        int w, fd, err;
+
+        for (w = fdtable_word(fdt->fdt_first); w < FDTABLE_WORDS(fdt->fdt_size); w++) {
+                if (~0U != fdt->fdt_open[w]) {
+                        fd = w * FDTABLE_WORD_BITS + __builtin_ctz(~fdt->fdt_open[w]);
+                        fdt->fdt_first = fd;
+                        return fd;
+                }
+        }
+
+        /* all of them are open, so it is the first past the end */
+        fd = fdt->fdt_size;
+        if (NFILES <= fd)
+                return -EMFILE;
+        if (0 > (err = fdtable_reserve(fdt, fd)))
+                return err;
+        fdt->fdt_first = fd;
+        return fd;
+}
+
+void
+fdtable_install(fdtable_t *fdt, int fd, struct file *f)
+{
+        KASSERT(0 <= fd && fd < fdt->fdt_size);
+        KASSERT(NULL != f);
+
+        fdt->fdt_files[fd] = f;
+        fdt->fdt_open[fdtable_word(fd)] |= fdtable_bit(fd);
+}
+
+struct file *
+fdtable_remove(fdtable_t *fdt, int fd)
+{
+        struct file *f;
+
+        KASSERT(0 <= fd && fd < fdt->fdt_size);
+
+        f = fdt->fdt_files[fd];
+        fdt->fdt_files[fd] = NULL;
+        fdt->fdt_open[fdtable_word(fd)] &= ~fdtable_bit(fd);
+        if (fd < fdt->fdt_first)
+                fdt->fdt_first = fd;
+        return f;
+}
+
+/* The highest descriptor open in fdt, or -1 if none is */
+static int
+fdtable_last_open(const fdtable_t *fdt)
+{
+        int w;
+
+        for (w = FDTABLE_WORDS(fdt->fdt_size) - 1; w >= 0; w--) {
+                if (0 != fdt->fdt_open[w])
+                        return w * FDTABLE_WORD_BITS + 31 - __builtin_clz(fdt->fdt_open[w]);
+        }
+        return -1;
+}
+
+int
+fdtable_copy(fdtable_t *dst, const fdtable_t *src)
+{
+        uint32_t w, bits;
+        int last, fd, err;
+
+        KASSERT(-1 == fdtable_last_open(dst));
+
+        if (0 > (last = fdtable_last_open(src)))
+                return 0;
+        /* grown first, so that there is nothing to undo if it fails */
+        if (0 > (err = fdtable_reserve(dst, last)))
+                return err;
+
+        for (w = 0; w <= fdtable_word((uint32_t)last); w++) {
+                for (bits = src->fdt_open[w]; 0 != bits; bits &= bits - 1) {
+                        fd = w * FDTABLE_WORD_BITS + __builtin_ctz(bits);
+                        fref(src->fdt_files[fd]);
+                        fdtable_install(dst, fd, src->fdt_files[fd]);
+                }
+        }
+        dst->fdt_first = src->fdt_first;
+        return 0;
+}
+
+void
+fdtable_destroy(fdtable_t *fdt)
+{
+        uint32_t bits;
+        int w, fd;
+
+        for (w = 0; w < FDTABLE_WORDS(fdt->fdt_size); w++) {
+                while (0 != (bits = fdt->fdt_open[w])) {
+                        fd = w * FDTABLE_WORD_BITS + __builtin_ctz(bits);
+                        fput(fdtable_remove(fdt, fd));
+                }
+        }
+        fdtable_free_arrays(fdt);
+        fdtable_init(fdt);
+}
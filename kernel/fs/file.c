@@ -13,6 +13,7 @@
 #include "globals.h"
 #include "util/list.h"
 #include "fs/file.h"
+#include "fs/epoll.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "proc/proc.h"
@@ -31,7 +32,7 @@ init_func(file_init);
 void
 fref(file_t *f)
 {
-        KASSERT(f->f_mode >= 0 && f->f_mode < 8);
+        KASSERT(f->f_mode >= 0 && f->f_mode < 16);
         KASSERT(f->f_pos >= -1);
         KASSERT(f->f_refcount >= 0);
         if (f->f_refcount != 0) KASSERT(f->f_vnode);
@@ -69,11 +70,14 @@ fget(int fd)
 
         if (fd == -1) {
                 f = slab_obj_alloc(file_allocator);
-                if (f) memset(f, 0, sizeof(file_t));
+                if (f) {
+                        memset(f, 0, sizeof(file_t));
+                        list_init(&f->f_epitems);
+                }
         } else {
-                if (fd < 0 || fd >= NFILES)
+                if (fd < 0 || fd >= curproc->p_fdtable.fdt_size)
                         return NULL;
-                f = curproc->p_files[fd];
+                f = curproc->p_fdtable.fdt_files[fd];
         }
         if (f) fref(f);
 
@@ -86,7 +90,7 @@ void
 fput(file_t *f)
 {
         KASSERT(f);
-        KASSERT(f->f_mode >= 0 && f->f_mode < 8);
+        KASSERT(f->f_mode >= 0 && f->f_mode < 16);
         KASSERT(f->f_pos >= -1);
         KASSERT(f->f_refcount > 0);
         if (f->f_refcount != 1) KASSERT(f->f_vnode);
@@ -103,6 +107,9 @@ fput(file_t *f)
 
         if (f->f_refcount == 0) {
                 vnode_t *vn = f->f_vnode;
+                if (!list_empty(&f->f_epitems)) {
+                        epoll_file_closed(f);
+                }
                 if (vn) {
                         if (vn->vn_ops->release) {
                                 vn->vn_ops->release(vn, f);
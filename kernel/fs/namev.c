@@ -7,6 +7,7 @@
 #include "util/printf.h"
 #include "util/debug.h"
 
+#include "fs/dcache.h"
 #include "fs/dirent.h"
 #include "fs/fcntl.h"
 #include "fs/stat.h"
@@ -40,6 +41,14 @@ lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result)
         return 0;
     }
 
+#ifdef __MOUNTING__
+    /*".." from the root of a mounted file system is ".." of where it is
+     * mounted; the way down is taken care of by vget*/
+    if (dir == dir->vn_fs->fs_root && name_match("..", name, len)) {
+        dir = dir->vn_fs->fs_mtpt;
+    }
+#endif
+
     KASSERT(dir->vn_ops);
     if (dir->vn_ops->lookup == NULL) {
         dbg(DBG_VFS, "lookup: vnode_t *dir is not a directory.\n");
@@ -57,14 +66,22 @@ lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result)
      *}
      */
 
+    if (dcache_lookup(dir, name, len, result)) {
+        return (*result == NULL) ? -ENOENT : 0;
+    }
+
     dbg(DBG_VFS, "lookup: gonna call vnode's lookup function.\n");
     int err = dir->vn_ops->lookup(dir, name, len, result);
     if (err < 0) {
         dbg(DBG_VFS, "dir_vnode's lookup did not find out the vnode\n");
         *result = NULL;
+        if (err == -ENOENT) {
+            dcache_enter(dir, name, len, NULL);
+        }
         return err;
     }
     KASSERT(err == 0);
+    dcache_enter(dir, name, len, *result);
     return err;
 
     /*don't know why I need to special case "." and ".."*/
@@ -247,6 +264,7 @@ open_namev(const char *pathname, int flag, vnode_t **res_vnode, vnode_t *base)
                 *res_vnode = NULL;
                 return err;
             }
+            dcache_forget(vn_dir, name, namelen);
             /*vput(vn_dir);*/
             /*no need, handled on line 250*/
         } else {
@@ -18,20 +18,19 @@
 #include "fs/stat.h"
 #include "util/debug.h"
 
-/* find empty index in p->p_files[] */
+/* find the lowest empty index in p's file descriptor table, which grows
+ * if needs be; that it has room for it stays true until p exits */
 int
 get_empty_fd(proc_t *p)
 {
         int fd;
 
-        for (fd = 0; fd < NFILES; fd++) {
-                if (!p->p_files[fd])
-                        return fd;
-        }
+        if (0 <= (fd = fdtable_first_free(&p->p_fdtable)))
+                return fd;
 
         dbg(DBG_ERROR | DBG_VFS, "ERROR: get_empty_fd: out of file descriptors "
             "for pid %d\n", curproc->p_pid);
-        return -EMFILE;
+        return fd;
 }
 
 /*
@@ -67,7 +66,10 @@ get_empty_fd(proc_t *p)
  *        writing (that is, O_WRONLY or O_RDWR is set).
  *      o ENXIO
  *        pathname refers to a device special file and no corresponding device
- *        exists.
+ *        exists, or to the name of a socket, which is connected to rather
+ *        than opened.
+ *      o EINVAL
+ *        O_DIRECT is set and the file has no direct_io op.
  */
 
 int
@@ -79,7 +81,7 @@ do_open(const char *filename, int oflags)
 
     /*validate oflags*/
     int lower_mask = 0x100 - 1;
-    int higher_mask = ~0x7FF;
+    int higher_mask = ~(0x7FF | O_DIRECT);
     if (oflags < 0 || (oflags & lower_mask) > 2 || (oflags & higher_mask)) {
         dbg(DBG_VFS, "oflags are invalid\n");
         return -EINVAL;
@@ -87,9 +89,9 @@ do_open(const char *filename, int oflags)
 
     /*get file descriptor*/
     int fd;
-    if ((fd = get_empty_fd(curproc)) == -EMFILE) {
+    if ((fd = get_empty_fd(curproc)) < 0) {
         dbg(DBG_VFS, "too many open files.\n");
-        return -EMFILE;
+        return fd;
     }
 
     /*get a fresh file_t*/
@@ -100,7 +102,7 @@ do_open(const char *filename, int oflags)
     }
 
     /*save file_t in file descriptor table*/
-    curproc->p_files[fd] = f;
+    fdtable_install(&curproc->p_fdtable, fd, f);
 
     /*set f_mode*/
     int rw = oflags & lower_mask;
@@ -116,13 +118,17 @@ do_open(const char *filename, int oflags)
         f->f_mode |= FMODE_APPEND;
     }
 
+    if (oflags & O_DIRECT) {
+        f->f_mode |= FMODE_DIRECT;
+    }
+
     /*get the vnode*/
     vnode_t *vn;
     dbg(DBG_VFS, "about to call open_namev\n");
     int err = open_namev(filename, oflags, &vn, NULL);
     if (err < 0) {
         /*clean up*/
-        curproc->p_files[fd] = NULL;
+        fdtable_remove(&curproc->p_fdtable, fd);
         fput(f);
         return err;
     }
@@ -131,11 +137,27 @@ do_open(const char *filename, int oflags)
     if (S_ISDIR(vn->vn_mode) && ((oflags & O_WRONLY) || (oflags & O_RDWR))) {
         vput(vn);
         fput(f);
-        curproc->p_files[fd] = NULL;
+        fdtable_remove(&curproc->p_fdtable, fd);
         dbg(DBG_VFS, "it's a directory and write flag set\n");
         return -EISDIR;
     }
 
+    if (S_ISSOCK(vn->vn_mode)) {
+        vput(vn);
+        fput(f);
+        fdtable_remove(&curproc->p_fdtable, fd);
+        dbg(DBG_VFS, "it's the name of a socket\n");
+        return -ENXIO;
+    }
+
+    if ((oflags & O_DIRECT) && vn->vn_ops->direct_io == NULL) {
+        vput(vn);
+        fput(f);
+        fdtable_remove(&curproc->p_fdtable, fd);
+        dbg(DBG_VFS, "it cannot be read or written directly\n");
+        return -EINVAL;
+    }
+
     /*initialize fields of file_t*/
 
     /*f_pos*/
@@ -7,15 +7,18 @@
 
 #include "errno.h"
 #include "globals.h"
+#include "config.h"
 
 #include "fs/file.h"
 #include "fs/open.h"
 #include "fs/pipe.h"
+#include "fs/poll.h"
 #include "fs/stat.h"
 #include "fs/vfs_syscall.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 
+#include "mm/page.h"
 #include "mm/slab.h"
 #include "mm/kmalloc.h"
 
@@ -24,7 +27,8 @@
 #include "util/debug.h"
 #include "util/string.h"
 
-#define PIPE_BUF_SIZE 4096
+#define PIPE_BUF_SIZE   (PIPE_BUF_PAGES * PAGE_SIZE)
+#define PIPE_WAKE_BYTES (PIPE_BUF_SIZE >> PIPE_WAKE_SHIFT)
 
 static void pipe_read_vnode(vnode_t *vnode);
 static void pipe_delete_vnode(vnode_t *vnode);
@@ -51,6 +55,7 @@ static int pipe_write(vnode_t *vnode, off_t offset, const void *buf, size_t len)
 static int pipe_stat(vnode_t *vnode, struct stat *ss);
 static int pipe_acquire(vnode_t *vnode, file_t *file);
 static int pipe_release(vnode_t *vnode, file_t *file);
+static int pipe_poll(vnode_t *vnode, int events, polltable_t *pt);
 
 static vnode_ops_t pipe_vops = {
         .read = pipe_read,
@@ -67,6 +72,7 @@ static vnode_ops_t pipe_vops = {
         .stat = pipe_stat,
         .acquire = pipe_acquire,
         .release = pipe_release,
+        .poll = pipe_poll,
         .fillpage = NULL,
         .dirtypage = NULL,
         .cleanpage = NULL
@@ -75,14 +81,18 @@ static vnode_ops_t pipe_vops = {
 /* struct pipe defines some data specific to pipes. One of these
    should be present in the vn_i field of each pipe vnode. */
 typedef struct pipe {
-        /* Buffer for data in the pipe, which has been written but not yet read. */
-        char      *pv_buf;
+        /*
+         * Buffer for data in the pipe, which has been written but not yet
+         * read: a ring of PIPE_BUF_PAGES pages, which need not be
+         * contiguous, addressed as one PIPE_BUF_SIZE buffer.
+         */
+        char      *pv_pages[PIPE_BUF_PAGES];
         /*
          * Position of the head and number of characters in the buffer. You can
          * write in characters at position head so long as size does not grow beyond
-         * the pipe buffer size.
+         * the pipe buffer size; the oldest character is size before head.
          */
-        off_t      pv_head;
+        size_t     pv_head;
         size_t     pv_size;
         /* Number of file descriptors using this pipe for read and write. */
         int        pv_readers;
@@ -97,12 +107,15 @@ typedef struct pipe {
         kmutex_t   pv_wrlock;
         /*
          * Waitqueues for threads attempting to read from an empty buffer, or
-         * write to a full buffer. When the pipe becomes non-empty (or non-full)
-         * then the corresponding waitq should be broadcasted on to make sure all
-         * of the threads get a chance to go.
+         * write to a full buffer. Readers are woken once per write which
+         * leaves something to read. Writers are woken only when reads free
+         * PIPE_WAKE_BYTES, so that a writer which fills the pipe goes back
+         * to sleep with a batch written rather than a few bytes a time.
          */
         ktqueue_t  pv_read_waitq;
         ktqueue_t  pv_write_waitq;
+        /* Woken along with either waitqueue, for poll. */
+        pollhead_t pv_pollhead;
 } pipe_t;
 
 #define VNODE_TO_PIPE(vn) ((pipe_t *)((vn)->vn_i))
@@ -119,6 +132,7 @@ pipe_init(void)
 init_func(pipe_init);
 init_depends(vfs_init);
 
+#ifdef __PIPES__
 /*
  * Create a pipe struct here. You are going to need to allocate all
  * of the necessary structs and buffers, and then initialize all of
@@ -128,9 +142,32 @@ init_depends(vfs_init);
 static pipe_t *
 pipe_create(void)
 {
-        NOT_YET_IMPLEMENTED("PIPES: pipe_create");
-        return NULL;
+        pipe_t *pipe = slab_obj_alloc(pipe_allocator);
+        int i;
+
+        if (NULL == pipe) {
+                return NULL;
+        }
+        memset(pipe, 0, sizeof(*pipe));
+
+        for (i = 0; i < PIPE_BUF_PAGES; i++) {
+                if (NULL == (pipe->pv_pages[i] = page_alloc())) {
+                        while (i-- > 0) {
+                                page_free(pipe->pv_pages[i]);
+                        }
+                        slab_obj_free(pipe_allocator, pipe);
+                        return NULL;
+                }
+        }
+
+        kmutex_init(&pipe->pv_rdlock);
+        kmutex_init(&pipe->pv_wrlock);
+        sched_queue_init(&pipe->pv_read_waitq);
+        sched_queue_init(&pipe->pv_write_waitq);
+        pollhead_init(&pipe->pv_pollhead);
+        return pipe;
 }
+#endif /* __PIPES__ */
 
 /*
  * Free all necessary memory.
@@ -138,7 +175,16 @@ pipe_create(void)
 static void
 pipe_destroy(pipe_t *pipe)
 {
-        NOT_YET_IMPLEMENTED("PIPES: pipe_destroy");
+        int i;
+
+        KASSERT(0 == pipe->pv_readers && 0 == pipe->pv_writers);
+        KASSERT(sched_queue_empty(&pipe->pv_read_waitq));
+        KASSERT(sched_queue_empty(&pipe->pv_write_waitq));
+
+        for (i = 0; i < PIPE_BUF_PAGES; i++) {
+                page_free(pipe->pv_pages[i]);
+        }
+        slab_obj_free(pipe_allocator, pipe);
 }
 
 /* pipefs vnode operations */
@@ -164,14 +210,14 @@ static int
 pipe_query_vnode(vnode_t *vnode)
 {
         /*
-         * Since we are not using the VM subsystem for
-         * this type of vnode, there is no reason for
-         * us to return 0 -- there will never be pages
-         * to clean up.
+         * Once its last file is closed nothing can open a pipe again, so
+         * there is no point in vput keeping the vnode, and with it the
+         * pipe's buffer, cached. It never has pages for vput to evict.
          */
-        return 1;
+        return 0;
 }
 
+#ifdef __PIPES__
 /*
  * Gets a new vnode representing a pipe. The reason
  * why we don't just do this setup in pipe_read_vnode
@@ -185,9 +231,19 @@ pipe_query_vnode(vnode_t *vnode)
 static vnode_t *
 pget(void)
 {
-        NOT_YET_IMPLEMENTED("PIPES: pget");
-        return NULL;
+        vnode_t *vn = vget(&pipe_fs, next_pno++);
+        if (NULL == vn) {
+                return NULL;
+        }
+        KASSERT(NULL == vn->vn_i);
+
+        if (NULL == (vn->vn_i = pipe_create())) {
+                vput(vn);
+                return NULL;
+        }
+        return vn;
 }
+#endif /* __PIPES__ */
 
 /*
  * An implementation of the pipe(2) system call. You really
@@ -203,28 +259,123 @@ pget(void)
 int
 do_pipe(int pipefd[2])
 {
+#ifdef __PIPES__
+        int modes[2] = { FMODE_READ, FMODE_WRITE };
+        int fd[2] = { -1, -1 };
+        int err = 0;
+        int i;
+
+        vnode_t *vn = pget();
+        if (NULL == vn) {
+                return -ENOMEM;
+        }
+
+        for (i = 0; i < 2; i++) {
+                if (0 > (fd[i] = get_empty_fd(curproc))) {
+                        err = fd[i];
+                        break;
+                }
+                file_t *f = fget(-1);
+                if (NULL == f) {
+                        err = -ENOMEM;
+                        break;
+                }
+                fdtable_install(&curproc->p_fdtable, fd[i], f);
+                f->f_mode = modes[i];
+                f->f_pos = 0;
+                /* each file holds a reference of its own */
+                vref(vn);
+                facq(f, vn);
+        }
+
+        if (0 > err) {
+                while (i-- > 0) {
+                        fput(fdtable_remove(&curproc->p_fdtable, fd[i]));
+                }
+        } else {
+                pipefd[0] = fd[0];
+                pipefd[1] = fd[1];
+        }
+        vput(vn);
+        return err;
+#else
         NOT_YET_IMPLEMENTED("PIPES: do_pipe");
         return -ENOTSUP;
+#endif /* __PIPES__ */
+}
+
+/*
+ * Copies len characters between buf and the ring, starting pos characters
+ * into it and wrapping at its end, a page at a time.
+ */
+static void
+pipe_copy(pipe_t *p, size_t pos, char *buf, size_t len, int toring)
+{
+        while (len > 0) {
+                pos %= PIPE_BUF_SIZE;
+                char *ring = p->pv_pages[pos / PAGE_SIZE] + pos % PAGE_SIZE;
+                size_t chunk = MIN(len, PAGE_SIZE - pos % PAGE_SIZE);
+
+                if (toring) {
+                        memcpy(ring, buf, chunk);
+                } else {
+                        memcpy(buf, ring, chunk);
+                }
+                pos += chunk;
+                buf += chunk;
+                len -= chunk;
+        }
 }
 
 /*
- * When reading from a pipe, you should make sure there are enough characters in
- * the buffer to read. If there are, grab them and move up the tail by subtracting
- * from size. offset is ignored. Also, remember to take the reader lock to prevent
- * other threads from reading while you are waiting for more characters.
+ * When reading from a pipe, you should make sure there are characters in the
+ * buffer to read. If there are, grab as many as fit and move up the tail by
+ * subtracting from size; like read(2) on any pipe, this returns what is there
+ * rather than waiting for len. offset is ignored. Also, remember to take the
+ * reader lock so that other readers wait while you are waiting for characters.
  *
- * This might block, e.g. if there are no or not enough characters to read.
- * It might be the case that there are no more writers and we aren't done reading.
- * However, in situations like this, there is no way to open the pipe for writing
- * again so no more writers will ever put characters in the pipe. The reader should
- * just take as much as it needs (or barring that, as much as it can get) and
- * return with a partial buffer.
+ * This might block if there are no characters to read. It might be the case
+ * that there are no more writers, though. In situations like this, there is
+ * no way to open the pipe for writing again so no more writers will ever put
+ * characters in the pipe, and the reader returns 0 for end of file.
  */
 static int
 pipe_read(vnode_t *vnode, off_t offset, void *buf, size_t len)
 {
-        NOT_YET_IMPLEMENTED("PIPES: pipe_read");
-        return -EINVAL;
+        pipe_t *p = VNODE_TO_PIPE(vnode);
+        int err;
+
+        if (0 == len) {
+                return 0;
+        }
+        if (0 > (err = kmutex_lock_cancellable(&p->pv_rdlock))) {
+                return err;
+        }
+
+        while (0 == p->pv_size && 0 < p->pv_writers) {
+                if (0 > (err = sched_cancellable_sleep_on(&p->pv_read_waitq))) {
+                        kmutex_unlock(&p->pv_rdlock);
+                        return err;
+                }
+        }
+
+        size_t n = MIN(len, p->pv_size);
+        size_t room = PIPE_BUF_SIZE - p->pv_size;
+        pipe_copy(p, p->pv_head + PIPE_BUF_SIZE - p->pv_size, buf, n, 0);
+        p->pv_size -= n;
+
+        /*
+         * Writers sleep only on a full pipe, so the room they have is below
+         * the watermark until reads take it past; waking them before then
+         * would have them write a few characters and sleep again.
+         */
+        if (room < PIPE_WAKE_BYTES && PIPE_WAKE_BYTES <= room + n) {
+                sched_broadcast_on(&p->pv_write_waitq);
+                poll_wakeup(&p->pv_pollhead);
+        }
+
+        kmutex_unlock(&p->pv_rdlock);
+        return (int)n;
 }
 
 /*
@@ -234,13 +385,51 @@ pipe_read(vnode_t *vnode, off_t offset, void *buf, size_t len)
  * sure your write is contiguous.
  *
  * If there are no more readers, we have a broken pipe, and should fail with
- * the EPIPE error number.
+ * the EPIPE error number, after whatever was already written.
  */
 static int
 pipe_write(vnode_t *vnode, off_t offset, const void *buf, size_t len)
 {
-        NOT_YET_IMPLEMENTED("PIPES: pipe_write");
-        return -EINVAL;
+        pipe_t *p = VNODE_TO_PIPE(vnode);
+        size_t done = 0;
+        int err;
+
+        if (0 > (err = kmutex_lock_cancellable(&p->pv_wrlock))) {
+                return err;
+        }
+
+        while (done < len) {
+                if (0 == p->pv_readers) {
+                        err = -EPIPE;
+                        break;
+                }
+
+                size_t n = MIN(len - done, PIPE_BUF_SIZE - p->pv_size);
+                if (0 == n) {
+                        /* the readers can have the full pipe while we wait */
+                        sched_broadcast_on(&p->pv_read_waitq);
+                        poll_wakeup(&p->pv_pollhead);
+                        if (0 > (err = sched_cancellable_sleep_on(&p->pv_write_waitq))) {
+                                break;
+                        }
+                        continue;
+                }
+
+                pipe_copy(p, p->pv_head, (char *)buf + done, n, 1);
+                p->pv_head = (p->pv_head + n) % PIPE_BUF_SIZE;
+                p->pv_size += n;
+                done += n;
+        }
+
+        /* Readers sleep only on an empty pipe, so one wakeup per write is
+         * all it takes for them to see everything it wrote. */
+        if (0 < done) {
+                sched_broadcast_on(&p->pv_read_waitq);
+                poll_wakeup(&p->pv_pollhead);
+        }
+
+        kmutex_unlock(&p->pv_wrlock);
+        return (0 < done) ? (int)done : err;
 }
 
 /*
@@ -251,8 +440,12 @@ pipe_write(vnode_t *vnode, off_t offset, const void *buf, size_t len)
 static int
 pipe_stat(vnode_t *vnode, struct stat *ss)
 {
-        NOT_YET_IMPLEMENTED("PIPES: pipe_stat");
-        return -EINVAL;
+        memset(ss, 0, sizeof(*ss));
+        ss->st_mode    = vnode->vn_mode;
+        ss->st_ino     = (int) vnode->vn_vno;
+        ss->st_size    = (int) VNODE_TO_PIPE(vnode)->pv_size;
+        ss->st_blksize = (int) PIPE_BUF_SIZE;
+        return 0;
 }
 
 /*
@@ -264,7 +457,14 @@ pipe_stat(vnode_t *vnode, struct stat *ss)
 static int
 pipe_acquire(vnode_t *vnode, file_t *file)
 {
-        NOT_YET_IMPLEMENTED("PIPES: pipe_acquire");
+        pipe_t *p = VNODE_TO_PIPE(vnode);
+
+        if (file->f_mode & FMODE_READ) {
+                p->pv_readers++;
+        }
+        if (file->f_mode & FMODE_WRITE) {
+                p->pv_writers++;
+        }
         return 0;
 }
 
@@ -277,6 +477,50 @@ pipe_acquire(vnode_t *vnode, file_t *file)
 static int
 pipe_release(vnode_t *vnode, file_t *file)
 {
-        NOT_YET_IMPLEMENTED("PIPES: pipe_release");
+        pipe_t *p = VNODE_TO_PIPE(vnode);
+
+        if (file->f_mode & FMODE_READ) {
+                KASSERT(0 < p->pv_readers);
+                if (0 == --p->pv_readers) {
+                        sched_broadcast_on(&p->pv_write_waitq);
+                        poll_wakeup(&p->pv_pollhead);
+                }
+        }
+        if (file->f_mode & FMODE_WRITE) {
+                KASSERT(0 < p->pv_writers);
+                if (0 == --p->pv_writers) {
+                        sched_broadcast_on(&p->pv_read_waitq);
+                        poll_wakeup(&p->pv_pollhead);
+                }
+        }
         return 0;
 }
+
+/*
+ * A pipe is readable when it has characters in it, and hung up once it
+ * has no writers. It is writable only once PIPE_WAKE_BYTES are free, the
+ * same point at which a blocked writer would be woken, since that is the
+ * only time reads wake the pollhead; and in error once it has no readers.
+ */
+static int
+pipe_poll(vnode_t *vnode, int events, polltable_t *pt)
+{
+        pipe_t *p = VNODE_TO_PIPE(vnode);
+        int revents = 0;
+
+        poll_wait(&p->pv_pollhead, pt);
+
+        if (0 < p->pv_size) {
+                revents |= POLLIN;
+        }
+        if (PIPE_WAKE_BYTES <= PIPE_BUF_SIZE - p->pv_size) {
+                revents |= POLLOUT;
+        }
+        if (0 == p->pv_writers) {
+                revents |= POLLHUP;
+        }
+        if (0 == p->pv_readers) {
+                revents |= POLLERR;
+        }
+        return revents;
+}
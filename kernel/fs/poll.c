@@ -0,0 +1,266 @@
+#include "kernel.h"
+#include "config.h"
+#include "errno.h"
+#include "globals.h"
+#include "types.h"
+
+#include "main/interrupt.h"
+
+#include "mm/kmalloc.h"
+
+#include "proc/sched.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/time.h"
+
+#include "fs/file.h"
+#include "fs/poll.h"
+#include "fs/vnode.h"
+
+/*
+ * A thread sleeps on one queue at a time, so poll does not sleep on the
+ * queues of the things it polls. Instead each of them keeps a pollhead,
+ * on which poll hangs a waiter per descriptor pointing back at its own
+ * pollsleep, and poll_wakeup wakes every pollsleep waiting there.
+ */
+
+/* What a vnode without a poll operation, a regular file say, reports:
+ * reading and writing it never waits on anyone else. */
+#define POLL_DEFAULT_EVENTS (POLLIN | POLLOUT)
+
+typedef struct pollsleep_waiter {
+        pollwaiter_t            psw_waiter;
+        struct pollsleep       *psw_sleep;
+} pollsleep_waiter_t;
+
+/*
+ * do_poll's record of what it is waiting on, at most one waiter per
+ * descriptor, in arrays with room for each of them. It holds the files
+ * polled until it is off their pollheads, so that none goes away with a
+ * waiter still on it.
+ */
+typedef struct pollsleep {
+        polltable_t             ps_table;
+        ktqueue_t               ps_queue;       /* the poller sleeps here */
+        int                     ps_woken;       /* poll_wakeup since the scan */
+        int                     ps_expired;     /* the timeout has passed */
+        nfds_t                  ps_nfds;        /* room in the arrays */
+        nfds_t                  ps_nwaiters;
+        pollsleep_waiter_t     *ps_waiters;
+        nfds_t                  ps_nfiles;
+        file_t                **ps_files;
+} pollsleep_t;
+
+void
+pollhead_init(pollhead_t *ph)
+{
+        list_init(&ph->ph_waiters);
+}
+
+void
+pollwaiter_init(pollwaiter_t *pw, void (*wake)(pollwaiter_t *pw))
+{
+        list_link_init(&pw->pw_link);
+        pw->pw_wake = wake;
+}
+
+void
+poll_wait(pollhead_t *ph, polltable_t *pt)
+{
+        pollwaiter_t *pw;
+
+        if (NULL == pt || NULL == (pw = pt->pt_waiter(pt))) {
+                return;
+        }
+        KASSERT(!list_link_is_linked(&pw->pw_link));
+
+        uint8_t old_ipl = intr_getipl();
+        intr_setipl(IPL_HIGH);
+        list_insert_tail(&ph->ph_waiters, &pw->pw_link);
+        intr_setipl(old_ipl);
+}
+
+void
+poll_wakeup(pollhead_t *ph)
+{
+        pollwaiter_t *pw;
+
+        list_iterate_begin(&ph->ph_waiters, pw, pollwaiter_t, pw_link) {
+                pw->pw_wake(pw);
+        } list_iterate_end();
+}
+
+/* The pollhead may be walked by an interrupt. */
+void
+poll_unwait(pollwaiter_t *pw)
+{
+        uint8_t old_ipl = intr_getipl();
+        intr_setipl(IPL_HIGH);
+        if (list_link_is_linked(&pw->pw_link)) {
+                list_remove(&pw->pw_link);
+        }
+        intr_setipl(old_ipl);
+}
+
+int
+poll_vnode(vnode_t *vn, int events, polltable_t *pt)
+{
+        if (NULL == vn->vn_ops->poll) {
+                return POLL_DEFAULT_EVENTS;
+        }
+        return vn->vn_ops->poll(vn, events, pt);
+}
+
+static void
+pollsleep_wake(pollwaiter_t *pw)
+{
+        pollsleep_t *ps = CONTAINER_OF(pw, pollsleep_waiter_t, psw_waiter)->psw_sleep;
+
+        ps->ps_woken = 1;
+        sched_broadcast_on(&ps->ps_queue);
+}
+
+static pollwaiter_t *
+pollsleep_waiter(polltable_t *pt)
+{
+        pollsleep_t *ps = CONTAINER_OF(pt, pollsleep_t, ps_table);
+        KASSERT(ps->ps_nfds > ps->ps_nwaiters);
+
+        pollsleep_waiter_t *psw = &ps->ps_waiters[ps->ps_nwaiters++];
+        pollwaiter_init(&psw->psw_waiter, pollsleep_wake);
+        psw->psw_sleep = ps;
+        return &psw->psw_waiter;
+}
+
+/* Takes ps's waiters off their pollheads and then lets go of the files
+ * they belong to. */
+static void
+pollsleep_unwait(pollsleep_t *ps)
+{
+        nfds_t i;
+
+        for (i = 0; i < ps->ps_nwaiters; i++) {
+                poll_unwait(&ps->ps_waiters[i].psw_waiter);
+        }
+        ps->ps_nwaiters = 0;
+
+        for (i = 0; i < ps->ps_nfiles; i++) {
+                fput(ps->ps_files[i]);
+        }
+        ps->ps_nfiles = 0;
+}
+
+static void
+poll_expired(ktimer_t *t)
+{
+        pollsleep_t *ps = (pollsleep_t *)t->t_data;
+
+        ps->ps_expired = 1;
+        sched_broadcast_on(&ps->ps_queue);
+}
+
+/*
+ * Fills in revents for each of fds, registering on ps (unless it is NULL)
+ * for wakeups from whatever is not ready yet. Returns how many are ready.
+ */
+static int
+poll_scan(struct pollfd *fds, nfds_t nfds, pollsleep_t *ps)
+{
+        int nready = 0;
+        nfds_t i;
+
+        for (i = 0; i < nfds; i++) {
+                fds[i].revents = 0;
+                if (0 > fds[i].fd) {
+                        continue;
+                }
+
+                file_t *f = fget(fds[i].fd);
+                if (NULL == f) {
+                        fds[i].revents = POLLNVAL;
+                        nready++;
+                        continue;
+                }
+
+                int revents = poll_vnode(f->f_vnode, fds[i].events,
+                                         (NULL != ps) ? &ps->ps_table : NULL);
+                if (NULL != ps) {
+                        ps->ps_files[ps->ps_nfiles++] = f;
+                } else {
+                        fput(f);
+                }
+
+                fds[i].revents = revents & (fds[i].events | POLLERR | POLLHUP);
+                if (0 != fds[i].revents) {
+                        nready++;
+                }
+        }
+        return nready;
+}
+
+int
+do_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+        pollsleep_t ps;
+        ktimer_t t;
+        int nready;
+        int err = 0;
+
+        ps.ps_nfds = 0;
+        ps.ps_waiters = NULL;
+        ps.ps_files = NULL;
+        /* only a poll which may sleep registers anything */
+        if (0 != timeout && 0 < nfds) {
+                ps.ps_waiters = kmalloc(nfds * sizeof(*ps.ps_waiters));
+                ps.ps_files = kmalloc(nfds * sizeof(*ps.ps_files));
+                if (NULL == ps.ps_waiters || NULL == ps.ps_files) {
+                        err = -ENOMEM;
+                        goto out;
+                }
+                ps.ps_nfds = nfds;
+        }
+
+        ps.ps_table.pt_waiter = pollsleep_waiter;
+        sched_queue_init(&ps.ps_queue);
+        ps.ps_expired = 0;
+        ps.ps_nwaiters = 0;
+        ps.ps_nfiles = 0;
+        timer_init(&t, poll_expired, &ps);
+        if (0 < timeout) {
+                timer_add(&t, timeout);
+        }
+
+        for (;;) {
+                ps.ps_woken = 0;
+                nready = poll_scan(fds, nfds, (0 == timeout) ? NULL : &ps);
+                if (0 != nready || 0 == timeout || ps.ps_expired) {
+                        break;
+                }
+
+                /* Neither a wakeup nor the timer can come in between
+                 * looking at the flags and sleeping */
+                uint8_t old_ipl = intr_getipl();
+                intr_setipl(IPL_HIGH);
+                if (!ps.ps_woken && !ps.ps_expired) {
+                        err = sched_cancellable_sleep_on(&ps.ps_queue);
+                }
+                intr_setipl(old_ipl);
+
+                pollsleep_unwait(&ps);
+                if (0 > err) {
+                        break;
+                }
+        }
+
+        pollsleep_unwait(&ps);
+        timer_cancel(&t);
+out:
+        if (NULL != ps.ps_waiters) {
+                kfree(ps.ps_waiters);
+        }
+        if (NULL != ps.ps_files) {
+                kfree(ps.ps_files);
+        }
+        return (0 > err) ? err : nready;
+}
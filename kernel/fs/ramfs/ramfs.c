@@ -61,6 +61,7 @@ static int ramfs_unlink(vnode_t *dir, const char *name, size_t name_len);
 static int ramfs_mkdir(vnode_t *dir, const char *name, size_t name_len);
 static int ramfs_rmdir(vnode_t *dir, const char *name, size_t name_len);
 static int ramfs_readdir(vnode_t *dir, off_t offset, struct dirent *d);
+static int ramfs_readdir_batch(vnode_t *dir, off_t *offset, struct dirent *d, int count);
 static int ramfs_stat(vnode_t *file, struct stat *buf);
 
 static vnode_ops_t ramfs_dir_vops = {
@@ -75,6 +76,7 @@ static vnode_ops_t ramfs_dir_vops = {
         .mkdir = ramfs_mkdir,
         .rmdir = ramfs_rmdir,
         .readdir = ramfs_readdir,
+        .readdir_batch = ramfs_readdir_batch,
         .stat = ramfs_stat,
         .acquire = NULL,
         .release = NULL,
@@ -117,6 +119,7 @@ typedef struct ramfs_inode {
 #define RAMFS_TYPE_DIR    1
 #define RAMFS_TYPE_CHR    2
 #define RAMFS_TYPE_BLK    3
+#define RAMFS_TYPE_SOCK   4
 
 #define VNODE_TO_RAMFSINODE(vn) \
         ((ramfs_inode_t *)(vn)->vn_i)
@@ -153,7 +156,8 @@ ramfs_alloc_inode(fs_t *fs, int type, devid_t devid)
         KASSERT((RAMFS_TYPE_DATA == type)
                 || (RAMFS_TYPE_DIR == type)
                 || (RAMFS_TYPE_CHR == type)
-                || (RAMFS_TYPE_BLK == type));
+                || (RAMFS_TYPE_BLK == type)
+                || (RAMFS_TYPE_SOCK == type));
         /* Find a free inode */
         int i;
         for (i = 0; i < RAMFS_MAX_FILES; i++) {
@@ -163,7 +167,8 @@ ramfs_alloc_inode(fs_t *fs, int type, devid_t devid)
                                 return -ENOSPC;
                         }
 
-                        if (RAMFS_TYPE_CHR == type || RAMFS_TYPE_BLK == type) {
+                        if (RAMFS_TYPE_CHR == type || RAMFS_TYPE_BLK == type
+                            || RAMFS_TYPE_SOCK == type) {
                                 /* Don't need any space in memory, so put devid in here */
                                 inode->rf_mem = (char *) devid;
                         } else {
@@ -264,6 +269,10 @@ ramfs_read_vnode(vnode_t *vn)
                         vn->vn_ops = NULL;
                         vn->vn_devid = (devid_t)(inode->rf_mem);
                         break;
+                case RAMFS_TYPE_SOCK:
+                        vn->vn_mode = S_IFSOCK;
+                        vn->vn_ops = NULL;
+                        break;
                 default:
                         panic("inode %d has unknown/invalid type %d!!\n",
                               (int)vn->vn_vno, (int)inode->rf_mode);
@@ -391,6 +400,10 @@ ramfs_mknod(struct vnode *dir, const char *name, size_t name_len, int mode, devi
                 if (0 > (ino = ramfs_alloc_inode(dir->vn_fs, RAMFS_TYPE_BLK, devid))) {
                         return ino;
                 }
+        } else if (S_ISSOCK(mode)) {
+                if (0 > (ino = ramfs_alloc_inode(dir->vn_fs, RAMFS_TYPE_SOCK, 0))) {
+                        return ino;
+                }
         } else {
                 panic("Invalid mode!\n");
         }
@@ -642,6 +655,19 @@ ramfs_readdir(vnode_t *dir, off_t offset, struct dirent *d)
         return ret;
 }
 
+static int
+ramfs_readdir_batch(vnode_t *dir, off_t *offset, struct dirent *d, int count)
+{
+        int n, ret;
+
+        for (n = 0; n < count; ++n) {
+                if (0 == (ret = ramfs_readdir(dir, *offset, &d[n])))
+                        break;
+                *offset += ret;
+        }
+        return n;
+}
+
 static int
 ramfs_stat(vnode_t *file, struct stat *buf)
 {
@@ -0,0 +1,590 @@
+/*
+ *   FILE: rofs.c
+ *  DESCR: a read-only file system of compressed files
+ *
+ * For what does not change at run time, such as the programs under /usr,
+ * in less space and with fewer blocks to read than s5fs needs; images
+ * are made by tools/fsmaker/mkrofs, and the layout is in rofs.h.
+ *
+ * Everything is read through the block device's pages. A file's pages
+ * are filled by decompressing its pieces, and from then on are cached
+ * with the vnode like those of any other file; nothing can be written,
+ * so nothing of rofs is ever dirty.
+ */
+
+#include "kernel.h"
+#include "config.h"
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/string.h"
+#include "util/printf.h"
+#include "util/debug.h"
+
+#include "fs/rofs/rofs.h"
+#include "fs/dirent.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+#include "fs/stat.h"
+
+#include "drivers/dev.h"
+#include "drivers/blockdev.h"
+
+#include "mm/kmalloc.h"
+#include "mm/pframe.h"
+#include "mm/mmobj.h"
+#include "mm/mm.h"
+
+#include "api/access.h"
+
+#define VNODE_TO_ROFS(vn)       ((rofs_t *)(vn)->vn_fs->fs_i)
+#define VNODE_TO_ROFSINODE(vn)  ((rofs_inode_t *)(vn)->vn_i)
+
+/* fs_t entry points: */
+static void rofs_read_vnode(vnode_t *vnode);
+static void rofs_delete_vnode(vnode_t *vnode);
+static int  rofs_query_vnode(vnode_t *vnode);
+static int  rofs_umount(fs_t *fs);
+
+/* vnode_t entry points: */
+static int  rofs_read(vnode_t *vnode, off_t offset, void *buf, size_t len);
+static int  rofs_write(vnode_t *vnode, off_t offset, const void *buf, size_t len);
+static int  rofs_read_user(vnode_t *vnode, off_t offset, void *buf, size_t len);
+static int  rofs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret);
+static int  rofs_create(vnode_t *dir, const char *name, size_t namelen, vnode_t **result);
+static int  rofs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode, devid_t devid);
+static int  rofs_lookup(vnode_t *dir, const char *name, size_t namelen, vnode_t **result);
+static int  rofs_link(vnode_t *src, vnode_t *dir, const char *name, size_t namelen);
+static int  rofs_unlink(vnode_t *dir, const char *name, size_t namelen);
+static int  rofs_mkdir(vnode_t *dir, const char *name, size_t namelen);
+static int  rofs_rmdir(vnode_t *dir, const char *name, size_t namelen);
+static int  rofs_readdir(vnode_t *dir, off_t offset, struct dirent *d);
+static int  rofs_stat(vnode_t *vnode, struct stat *ss);
+static int  rofs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf);
+static int  rofs_dirtypage(vnode_t *vnode, off_t offset);
+static int  rofs_cleanpage(vnode_t *vnode, off_t offset, void *pagebuf);
+
+static fs_ops_t rofs_fsops = {
+        .read_vnode   = rofs_read_vnode,
+        .delete_vnode = rofs_delete_vnode,
+        .query_vnode  = rofs_query_vnode,
+        .umount       = rofs_umount
+};
+
+static vnode_ops_t rofs_dir_vops = {
+        .read = NULL,
+        .write = NULL,
+        .mmap = NULL,
+        .create = rofs_create,
+        .mknod = rofs_mknod,
+        .lookup = rofs_lookup,
+        .link = rofs_link,
+        .unlink = rofs_unlink,
+        .mkdir = rofs_mkdir,
+        .rmdir = rofs_rmdir,
+        .readdir = rofs_readdir,
+        .stat = rofs_stat,
+        .acquire = NULL,
+        .release = NULL,
+        .fillpage = NULL,
+        .dirtypage = NULL,
+        .cleanpage = NULL
+};
+
+static vnode_ops_t rofs_file_vops = {
+        .read = rofs_read,
+        .write = rofs_write,
+        .read_user = rofs_read_user,
+        .write_user = NULL,
+        .mmap = rofs_mmap,
+        .create = NULL,
+        .mknod = NULL,
+        .lookup = NULL,
+        .link = NULL,
+        .unlink = NULL,
+        .mkdir = NULL,
+        .rmdir = NULL,
+        .readdir = NULL,
+        .stat = rofs_stat,
+        .acquire = NULL,
+        .release = NULL,
+        .fillpage = rofs_fillpage,
+        .dirtypage = rofs_dirtypage,
+        .cleanpage = rofs_cleanpage
+};
+
+/*
+ * Copies len bytes of the image, from offset on, into buf. Nothing
+ * blocks between getting a page and copying out of it, so the pages need
+ * no pins.
+ */
+static int
+rofs_read_image(rofs_t *rf, uint32_t offset, void *buf, size_t len)
+{
+        char *dest = buf;
+        pframe_t *pf;
+        int err;
+
+        if (offset + len < offset || offset + len > rf->rf_super.rs_size)
+                return -EIO;
+
+        while (len > 0) {
+                size_t n = MIN(len, ROFS_BLOCK_SIZE - offset % ROFS_BLOCK_SIZE);
+                if (0 > (err = pframe_get(&rf->rf_bdev->bd_mmobj, offset / ROFS_BLOCK_SIZE, &pf)))
+                        return err;
+                memcpy(dest, (char *)pf->pf_addr + offset % ROFS_BLOCK_SIZE, n);
+                dest += n;
+                offset += n;
+                len -= n;
+        }
+        return 0;
+}
+
+/*
+ * Decompresses one LZ4 block, src[0..srclen), into dest, which can hold
+ * destlen bytes. Returns the number of bytes it came to, or -EIO if the
+ * block is malformed or would not fit.
+ */
+static int
+rofs_decompress(const uint8_t *src, size_t srclen, uint8_t *dest, size_t destlen)
+{
+        const uint8_t *ip = src, *iend = src + srclen;
+        uint8_t *op = dest, *oend = dest + destlen;
+
+        while (ip < iend) {
+                uint32_t token = *ip++;
+                uint32_t len = token >> 4, offset;
+                const uint8_t *match;
+
+                /* literals */
+                if (15 == len) {
+                        uint8_t b;
+                        do {
+                                if (ip >= iend)
+                                        return -EIO;
+                                b = *ip++;
+                                len += b;
+                        } while (255 == b);
+                }
+                if ((size_t)(iend - ip) < len || (size_t)(oend - op) < len)
+                        return -EIO;
+                memcpy(op, ip, len);
+                ip += len;
+                op += len;
+
+                /* the last sequence is only literals */
+                if (ip == iend)
+                        break;
+
+                /* then a match, which may overlap what it makes */
+                if (iend - ip < 2)
+                        return -EIO;
+                offset = ip[0] | (ip[1] << 8);
+                ip += 2;
+                if (0 == offset || offset > (uint32_t)(op - dest))
+                        return -EIO;
+                len = token & 0xf;
+                if (15 == len) {
+                        uint8_t b;
+                        do {
+                                if (ip >= iend)
+                                        return -EIO;
+                                b = *ip++;
+                                len += b;
+                        } while (255 == b);
+                }
+                len += 4;
+                if ((size_t)(oend - op) < len)
+                        return -EIO;
+                for (match = op - offset; len > 0; len--)
+                        *op++ = *match++;
+        }
+        return op - dest;
+}
+
+int
+rofs_mount(struct fs *fs)
+{
+        rofs_super_t *s;
+        blockdev_t *dev;
+        rofs_t *rf;
+        int num, err;
+
+        KASSERT(fs);
+
+        if (sscanf(fs->fs_dev, "disk%d", &num) != 1)
+                return -EINVAL;
+        if (!(dev = blockdev_lookup(MKDEVID(1, num))))
+                return -EINVAL;
+
+        if (NULL == (rf = kmalloc(sizeof(*rf))))
+                return -ENOMEM;
+        rf->rf_bdev = dev;
+
+        /* enough to read the superblock itself */
+        s = &rf->rf_super;
+        s->rs_size = sizeof(*s);
+        if (0 > (err = rofs_read_image(rf, 0, s, sizeof(*s)))) {
+                kfree(rf);
+                return err;
+        }
+        if (ROFS_MAGIC != s->rs_magic || s->rs_root_inode >= s->rs_num_inodes
+            || s->rs_size < (ROFS_INODE_BLOCK(s->rs_num_inodes - 1) + 1) * ROFS_BLOCK_SIZE) {
+                kfree(rf);
+                return -EINVAL;
+        }
+        if (ROFS_CURRENT_VERSION != s->rs_version) {
+                dbg(DBG_PRINT, "Filesystem is rofs version %d; "
+                    "only version %d is supported.\n",
+                    s->rs_version, ROFS_CURRENT_VERSION);
+                kfree(rf);
+                return -EINVAL;
+        }
+
+        fs->fs_i = rf;
+        fs->fs_op = &rofs_fsops;
+        fs->fs_root = vget(fs, s->rs_root_inode);
+        return 0;
+}
+
+/* Implementation of fs_t entry points: */
+
+static void
+rofs_read_vnode(vnode_t *vnode)
+{
+        rofs_t *rf = VNODE_TO_ROFS(vnode);
+        rofs_inode_t *inode;
+        uint32_t ino = vnode->vn_vno;
+
+        if (ino >= rf->rf_super.rs_num_inodes)
+                panic("rofs: inode %d is past the last one\n", (int)ino);
+        if (NULL == (inode = kmalloc(sizeof(*inode))))
+                panic("rofs: out of memory reading inode %d\n", (int)ino);
+        if (0 > rofs_read_image(rf, ROFS_INODE_BLOCK(ino) * ROFS_BLOCK_SIZE
+                                + ROFS_INODE_OFFSET(ino) * sizeof(*inode),
+                                inode, sizeof(*inode)))
+                panic("rofs: failed to read inode %d\n", (int)ino);
+
+        switch (inode->ri_type) {
+                case ROFS_TYPE_DATA:
+                        vnode->vn_mode = S_IFREG;
+                        vnode->vn_ops = &rofs_file_vops;
+                        break;
+                case ROFS_TYPE_DIR:
+                        vnode->vn_mode = S_IFDIR;
+                        vnode->vn_ops = &rofs_dir_vops;
+                        break;
+                default:
+                        panic("rofs: inode %d has unknown/invalid type %d!!\n",
+                              (int)ino, (int)inode->ri_type);
+        }
+        vnode->vn_len = inode->ri_size;
+        vnode->vn_i = inode;
+}
+
+static void
+rofs_delete_vnode(vnode_t *vnode)
+{
+        kfree(vnode->vn_i);
+        vnode->vn_i = NULL;
+}
+
+/* Nothing is ever removed */
+static int
+rofs_query_vnode(vnode_t *vnode)
+{
+        return 1;
+}
+
+static int
+rofs_umount(fs_t *fs)
+{
+        vput(fs->fs_root);
+        kfree(fs->fs_i);
+        return 0;
+}
+
+/* Implementation of vnode_t entry points: */
+
+static int
+rofs_read_file(vnode_t *vnode, off_t seek, char *dest, size_t len, int user)
+{
+        pframe_t *pfs[PFRAME_RANGE_MAX];
+        uint32_t first, last, pn;
+        off_t end;
+        int err;
+
+        if (seek < 0)
+                return -EINVAL;
+        if (seek >= vnode->vn_len || 0 == len)
+                return 0;
+
+        end = MIN(vnode->vn_len, seek + (off_t)len);
+        len = end - seek;
+        first = ADDR_TO_PN(seek);
+        last = ADDR_TO_PN(end - 1);
+        vnode_readahead(vnode, first, last - first + 1);
+
+        /* a batch of pages at a time, brought in and pinned at once */
+        for (pn = first; pn <= last;) {
+                uint32_t n = MIN(last - pn + 1, PFRAME_RANGE_MAX), i;
+
+                if (0 > (err = pframe_get_range(&vnode->vn_mmobj, pn, n, pfs)))
+                        return err;
+                for (i = 0; i < n; i++, pn++) {
+                        off_t from = (pn == first) ? PAGE_OFFSET(seek) : 0;
+                        off_t to = (pn == last) ? PAGE_OFFSET(end - 1) + 1 : PAGE_SIZE;
+
+                        if (user) {
+                                err = copy_to_user(dest, (char *)pfs[i]->pf_addr + from, to - from);
+                                if (err < 0) {
+                                        pframe_unpin_range(pfs, n);
+                                        return err;
+                                }
+                        } else {
+                                memcpy(dest, (char *)pfs[i]->pf_addr + from, to - from);
+                        }
+                        dest += to - from;
+                }
+                pframe_unpin_range(pfs, n);
+        }
+        return len;
+}
+
+static int
+rofs_read(vnode_t *vnode, off_t offset, void *buf, size_t len)
+{
+        return rofs_read_file(vnode, offset, buf, len, 0);
+}
+
+static int
+rofs_read_user(vnode_t *vnode, off_t offset, void *buf, size_t len)
+{
+        return rofs_read_file(vnode, offset, buf, len, 1);
+}
+
+static int
+rofs_write(vnode_t *vnode, off_t offset, const void *buf, size_t len)
+{
+        return -EROFS;
+}
+
+static int
+rofs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret)
+{
+        *ret = &file->vn_mmobj;
+        return 0;
+}
+
+static int
+rofs_create(vnode_t *dir, const char *name, size_t namelen, vnode_t **result)
+{
+        *result = NULL;
+        return -EROFS;
+}
+
+static int
+rofs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode, devid_t devid)
+{
+        return -EROFS;
+}
+
+static int
+rofs_link(vnode_t *src, vnode_t *dir, const char *name, size_t namelen)
+{
+        return -EROFS;
+}
+
+static int
+rofs_unlink(vnode_t *dir, const char *name, size_t namelen)
+{
+        return -EROFS;
+}
+
+static int
+rofs_mkdir(vnode_t *dir, const char *name, size_t namelen)
+{
+        return -EROFS;
+}
+
+static int
+rofs_rmdir(vnode_t *dir, const char *name, size_t namelen)
+{
+        return -EROFS;
+}
+
+static int
+rofs_get_dirent(vnode_t *dir, uint32_t index, rofs_dirent_t *d)
+{
+        rofs_inode_t *inode = VNODE_TO_ROFSINODE(dir);
+        int err;
+
+        if (0 > (err = rofs_read_image(VNODE_TO_ROFS(dir), inode->ri_data + index * sizeof(*d),
+                                       d, sizeof(*d))))
+                return err;
+        d->rd_name[ROFS_NAME_LEN - 1] = '\0';
+        return 0;
+}
+
+/* Like strcmp(), for a name which is not null-terminated */
+static int
+rofs_namecmp(const char *name, size_t namelen, const char *entry)
+{
+        int cmp = strncmp(name, entry, namelen);
+        if (0 == cmp && '\0' != entry[namelen])
+                cmp = -1;
+        return cmp;
+}
+
+/*
+ * "." and ".." are the first two entries, and the rest are in order, so
+ * are looked for by binary search.
+ */
+static int
+rofs_lookup(vnode_t *dir, const char *name, size_t namelen, vnode_t **result)
+{
+        uint32_t nents = dir->vn_len / sizeof(rofs_dirent_t), lo, hi;
+        rofs_dirent_t d;
+        int err;
+
+        if (namelen >= ROFS_NAME_LEN)
+                return -ENOENT;
+
+        for (lo = 0; lo < MIN(nents, 2); lo++) {
+                if (0 > (err = rofs_get_dirent(dir, lo, &d)))
+                        return err;
+                if (0 == rofs_namecmp(name, namelen, d.rd_name))
+                        goto found;
+        }
+
+        hi = nents;
+        while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                int cmp;
+                if (0 > (err = rofs_get_dirent(dir, mid, &d)))
+                        return err;
+                if (0 == (cmp = rofs_namecmp(name, namelen, d.rd_name)))
+                        goto found;
+                if (cmp < 0)
+                        hi = mid;
+                else
+                        lo = mid + 1;
+        }
+        return -ENOENT;
+
+found:
+        if (d.rd_inode >= VNODE_TO_ROFS(dir)->rf_super.rs_num_inodes)
+                return -EIO;
+        *result = vget(dir->vn_fs, d.rd_inode);
+        return 0;
+}
+
+static int
+rofs_readdir(vnode_t *dir, off_t offset, struct dirent *d)
+{
+        rofs_dirent_t ent;
+        int err;
+
+        if (offset >= dir->vn_len)
+                return 0;
+        if (0 != offset % sizeof(ent))
+                return -EINVAL;
+        if (0 > (err = rofs_get_dirent(dir, offset / sizeof(ent), &ent)))
+                return err;
+
+        d->d_ino = ent.rd_inode;
+        d->d_off = 0; /* unused */
+        strncpy(d->d_name, ent.rd_name, ROFS_NAME_LEN);
+        return sizeof(ent);
+}
+
+static int
+rofs_stat(vnode_t *vnode, struct stat *ss)
+{
+        rofs_inode_t *inode = VNODE_TO_ROFSINODE(vnode);
+        uint32_t pieces = (inode->ri_size + ROFS_BLOCK_SIZE - 1) / ROFS_BLOCK_SIZE;
+        uint32_t bytes = inode->ri_size;
+
+        memset(ss, 0, sizeof(*ss));
+        ss->st_mode = vnode->vn_mode;
+        ss->st_ino = (int)vnode->vn_vno;
+        ss->st_nlink = inode->ri_linkcount;
+        ss->st_size = (int)vnode->vn_len;
+        ss->st_blksize = (int)PAGE_SIZE;
+
+        /* what it takes up in the image, compressed */
+        if (S_ISREG(vnode->vn_mode) && pieces > 0) {
+                uint32_t first, last;
+                int err;
+                if (0 > (err = rofs_read_image(VNODE_TO_ROFS(vnode), inode->ri_data,
+                                               &first, sizeof(first)))
+                    || 0 > (err = rofs_read_image(VNODE_TO_ROFS(vnode),
+                                                  inode->ri_data + pieces * sizeof(uint32_t),
+                                                  &last, sizeof(last))))
+                        return err;
+                bytes = last - first;
+        }
+        ss->st_blocks = (bytes + ROFS_BLOCK_SIZE - 1) / ROFS_BLOCK_SIZE;
+        return 0;
+}
+
+static int
+rofs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf)
+{
+        rofs_t *rf = VNODE_TO_ROFS(vnode);
+        rofs_inode_t *inode = VNODE_TO_ROFSINODE(vnode);
+        uint32_t piece = offset / ROFS_BLOCK_SIZE, bounds[2], len, clen;
+        uint8_t *buf;
+        int err;
+
+        KASSERT(PAGE_SIZE == ROFS_BLOCK_SIZE);
+
+        if ((uint32_t)offset >= inode->ri_size) {
+                memset(pagebuf, 0, PAGE_SIZE);
+                return 0;
+        }
+        len = MIN(ROFS_BLOCK_SIZE, inode->ri_size - piece * ROFS_BLOCK_SIZE);
+
+        if (0 > (err = rofs_read_image(rf, inode->ri_data + piece * sizeof(uint32_t),
+                                       bounds, sizeof(bounds))))
+                return err;
+        if (bounds[1] < bounds[0] || (clen = bounds[1] - bounds[0]) > len)
+                return -EIO;
+
+        if (clen == len) {
+                /* kept as it is */
+                if (0 > (err = rofs_read_image(rf, bounds[0], pagebuf, len)))
+                        return err;
+        } else {
+                if (NULL == (buf = kmalloc(clen)))
+                        return -ENOMEM;
+                if (0 <= (err = rofs_read_image(rf, bounds[0], buf, clen))) {
+                        err = rofs_decompress(buf, clen, pagebuf, len);
+                        if (0 <= err && (uint32_t)err != len)
+                                err = -EIO;
+                }
+                kfree(buf);
+                if (err < 0) {
+                        dbg(DBG_PRINT, "rofs: piece %u of inode %d is corrupt\n",
+                            piece, (int)vnode->vn_vno);
+                        return err;
+                }
+        }
+        memset((char *)pagebuf + len, 0, PAGE_SIZE - len);
+        return 0;
+}
+
+/* Reached through a shared, writable mapping, which then fails */
+static int
+rofs_dirtypage(vnode_t *vnode, off_t offset)
+{
+        return -EROFS;
+}
+
+static int
+rofs_cleanpage(vnode_t *vnode, off_t offset, void *pagebuf)
+{
+        panic("rofs: cleaning a page, but none can be dirty\n");
+        return -EROFS;
+}
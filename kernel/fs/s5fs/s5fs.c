@@ -5,6 +5,7 @@
  */
 
 #include "kernel.h"
+#include "config.h"
 #include "types.h"
 #include "globals.h"
 #include "errno.h"
@@ -14,23 +15,28 @@
 #include "util/debug.h"
 
 #include "proc/kmutex.h"
+#include "proc/sched.h"
 
 #include "fs/s5fs/s5fs_subr.h"
 #include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
 #include "fs/dirent.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "fs/file.h"
 #include "fs/stat.h"
+#include "fs/fcntl.h"
 
 #include "drivers/dev.h"
 #include "drivers/blockdev.h"
 
 #include "mm/kmalloc.h"
+#include "mm/page.h"
 #include "mm/pframe.h"
 #include "mm/mmobj.h"
 #include "mm/mm.h"
 #include "mm/mman.h"
+#include "mm/vmalloc.h"
 
 #include "vm/vmmap.h"
 #include "vm/shadow.h"
@@ -51,6 +57,8 @@ static int  s5fs_umount(fs_t *fs);
 /* vnode_t entry points: */
 static int  s5fs_read(vnode_t *vnode, off_t offset, void *buf, size_t len);
 static int  s5fs_write(vnode_t *vnode, off_t offset, const void *buf, size_t len);
+static int  s5fs_read_user(vnode_t *vnode, off_t offset, void *buf, size_t len);
+static int  s5fs_write_user(vnode_t *vnode, off_t offset, const void *buf, size_t len);
 static int  s5fs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret);
 static int  s5fs_create(vnode_t *vdir, const char *name, size_t namelen, vnode_t **result);
 static int  s5fs_mknod(struct vnode *dir, const char *name, size_t namelen, int mode, devid_t devid);
@@ -60,9 +68,17 @@ static int  s5fs_unlink(vnode_t *vdir, const char *name, size_t namelen);
 static int  s5fs_mkdir(vnode_t *vdir, const char *name, size_t namelen);
 static int  s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen);
 static int  s5fs_readdir(vnode_t *vnode, int offset, struct dirent *d);
+static int  s5fs_readdir_batch(vnode_t *vnode, off_t *offset, struct dirent *d, int count);
+static int  s5fs_readdir_plus(vnode_t *vnode, off_t *offset, struct dirent_plus *d, int count);
 static int  s5fs_stat(vnode_t *vnode, struct stat *ss);
+static int  s5fs_fsync(vnode_t *vnode, int datasync);
+static int  s5fs_direct_io(vnode_t *vnode, off_t offset, pframe_t **pfs, int npages, int write);
+static int  s5fs_clone(vnode_t *src, vnode_t *dst);
+static int  s5fs_fallocate(vnode_t *vnode, int mode, off_t offset, off_t len);
 static int  s5fs_release(vnode_t *vnode, file_t *file);
 static int  s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf);
+static int  s5fs_fillpage_async(vnode_t *vnode, off_t offset, pframe_t *pf);
+static int  s5fs_fillpages(vnode_t *vnode, off_t offset, void **pagebufs, int npages);
 static int  s5fs_dirtypage(vnode_t *vnode, off_t offset);
 static int  s5fs_cleanpage(vnode_t *vnode, off_t offset, void *pagebuf);
 
@@ -86,10 +102,14 @@ static vnode_ops_t s5fs_dir_vops = {
         .mkdir = s5fs_mkdir,
         .rmdir = s5fs_rmdir,
         .readdir = s5fs_readdir,
+        .readdir_batch = s5fs_readdir_batch,
+        .readdir_plus = s5fs_readdir_plus,
         .stat = s5fs_stat,
+        .fsync = s5fs_fsync,
         .acquire = NULL,
         .release = NULL,
         .fillpage = s5fs_fillpage,
+        .fillpages = s5fs_fillpages,
         .dirtypage = s5fs_dirtypage,
         .cleanpage = s5fs_cleanpage
 };
@@ -98,6 +118,8 @@ static vnode_ops_t s5fs_dir_vops = {
 static vnode_ops_t s5fs_file_vops = {
         .read = s5fs_read,
         .write = s5fs_write,
+        .read_user = s5fs_read_user,
+        .write_user = s5fs_write_user,
         .mmap = s5fs_mmap,
         .create = NULL,
         .mknod = NULL,
@@ -108,9 +130,15 @@ static vnode_ops_t s5fs_file_vops = {
         .rmdir = NULL,
         .readdir = NULL,
         .stat = s5fs_stat,
+        .fsync = s5fs_fsync,
+        .direct_io = s5fs_direct_io,
+        .clone = s5fs_clone,
+        .fallocate = s5fs_fallocate,
         .acquire = NULL,
         .release = NULL,
         .fillpage = s5fs_fillpage,
+        .fillpage_async = s5fs_fillpage_async,
+        .fillpages = s5fs_fillpages,
         .dirtypage = s5fs_dirtypage,
         .cleanpage = s5fs_cleanpage
 };
@@ -118,13 +146,47 @@ static vnode_ops_t s5fs_file_vops = {
 static void
 lock_vnode(vnode_t *vn)
 {
-    kmutex_lock(&vn->vn_mutex);
+    krwlock_wrlock(&vn->vn_rwlock);
 }
 
 static void
 unlock_vnode(vnode_t *vn)
 {
-    kmutex_unlock(&vn->vn_mutex);
+    krwlock_wrunlock(&vn->vn_rwlock);
+}
+
+/*
+ * Like lock_vnode() and unlock_vnode(), for operations which only look
+ * at the file, so that they can run together.
+ */
+static void
+lock_vnode_shared(vnode_t *vn)
+{
+    krwlock_rdlock(&vn->vn_rwlock);
+}
+
+static void
+unlock_vnode_shared(vnode_t *vn)
+{
+    krwlock_rdunlock(&vn->vn_rwlock);
+}
+
+/*
+ * Like lock_vnode() and unlock_vnode(), for operations which change
+ * metadata: these run as part of a journal transaction.
+ */
+static void
+lock_vnode_journal(vnode_t *vn)
+{
+    krwlock_wrlock(&vn->vn_rwlock);
+    s5_journal_begin(VNODE_TO_S5FS(vn));
+}
+
+static void
+unlock_vnode_journal(vnode_t *vn)
+{
+    s5_journal_end(VNODE_TO_S5FS(vn));
+    krwlock_wrunlock(&vn->vn_rwlock);
 }
 
 /*
@@ -178,12 +240,26 @@ s5fs_mount(struct fs *fs)
 
         pframe_pin(vp);
 
-        /*     init s5f_mutex: */
-        kmutex_init(&s5->s5f_mutex);
+        /*     init the allocation mutexes: */
+        kmutex_init(&s5->s5f_block_mutex);
+        kmutex_init(&s5->s5f_inode_mutex);
+        kmutex_init(&s5->s5f_alloc_mutex);
+        s5->s5f_reserved = 0;
 
         /*     init s5f_fs: */
         s5->s5f_fs = fs;
 
+        int i;
+        for (i = 0; i < S5_DIRINDEX_HASH; i++) {
+                list_init(&s5->s5f_dirindex[i]);
+        }
+
+        /* before anything but the superblock has been read */
+        if (0 > (i = s5_journal_mount(s5))) {
+                pframe_unpin(vp);
+                kfree(s5);
+                return i;
+        }
 
         /* Init the members of fs that we (the fs-implementation) are
          * responsible for initializing: */
@@ -262,6 +338,10 @@ s5fs_read_vnode(vnode_t *vnode)
             vnode->vn_ops = NULL;
             vnode->vn_devid = (devid_t)(inode->s5_indirect_block);
             break;
+        case S5_TYPE_SOCK:
+            vnode->vn_mode = S_IFSOCK;
+            vnode->vn_ops = NULL;
+            break;
         default:
             panic("inode %d has unknown/invalid type %d!!\n",
                   (int)vnode->vn_vno, (int)inode->s5_type);
@@ -291,9 +371,16 @@ s5fs_delete_vnode(vnode_t *vnode)
     s5_inode_t *ilist = (s5_inode_t *)pframe_inode_block->pf_addr;
     s5_inode_t *inode = ilist + S5_INODE_OFFSET(vnode->vn_vno);
 
+    if (S5_TYPE_DIR == inode->s5_type) {
+        s5_dirindex_drop(vnode);
+    }
+
+    s5_journal_begin(fs);
+
     inode->s5_linkcount--;
 
     pframe_dirty(pframe_inode_block);
+    s5_journal_dirty(fs, pframe_inode_block, pframe_inode_block->pf_pagenum);
     pframe_unpin(pframe_inode_block);
 
     if (inode->s5_linkcount == 0) {
@@ -301,6 +388,8 @@ s5fs_delete_vnode(vnode_t *vnode)
         s5_free_inode(vnode);
         pframe_unpin(pframe_inode_block);
     }
+
+    s5_journal_end(fs);
 }
 
 /*
@@ -328,6 +417,24 @@ s5fs_query_vnode(vnode_t *vnode)
         return 1;
     } else {
         KASSERT(inode->s5_linkcount == 1);
+        /*vput is about to free the cached pages of this removed file, so
+         *they can't stay pinned in the journal*/
+        s5_journal_forget(fs, &vnode->vn_mmobj);
+        /*nor will the blocks reserved for its unwritten pages be needed*/
+        if (S_ISREG(vnode->vn_mode)) {
+            pframe_t *pf;
+            uint32_t pn;
+            for (pn = 0; NULL != (pf = pframe_next_resident(&vnode->vn_mmobj, &pn)); pn++) {
+                while (pframe_is_busy(pf)) {
+                    sched_sleep_on(pframe_waitq(pf));
+                }
+                if (pframe_is_dirty(pf)
+                    && !(0 == pn && S5_INODE_INLINE(inode))
+                    && 0 == s5_seek_to_block(vnode, (off_t)pn * S5_BLOCK_SIZE, 0)) {
+                    s5_unreserve_block(vnode, (off_t)pn * S5_BLOCK_SIZE);
+                }
+            }
+        }
         return 0;
     }
 }
@@ -344,6 +451,8 @@ s5fs_umount(fs_t *fs)
         pframe_t *sbp;
         int ret;
 
+        s5_journal_umount(s5);
+
         if (s5fs_check_refcounts(fs)) {
                 dbg(DBG_PRINT, "s5fs_umount: WARNING: linkcount corruption "
                     "discovered in fs on block device with major %d "
@@ -356,6 +465,7 @@ s5fs_umount(fs_t *fs)
         }
 
         vnode_flush_all(fs);
+        KASSERT(0 == s5->s5f_reserved);
 
         vput(fs->fs_root);
 
@@ -410,18 +520,18 @@ s5fs_umount(fs_t *fs)
 static int
 s5fs_read(vnode_t *vnode, off_t offset, void *buf, size_t len)
 {
-    lock_vnode(vnode);
+    lock_vnode_shared(vnode);
 
     /*read exceeds the end of the file*/
     if (offset >= vnode->vn_len) {
-        unlock_vnode(vnode);
+        unlock_vnode_shared(vnode);
 
         return 0;
     }
 
     int err = s5_read_file(vnode, offset, buf, len);
 
-    unlock_vnode(vnode);
+    unlock_vnode_shared(vnode);
 
     return err;
 }
@@ -430,15 +540,451 @@ s5fs_read(vnode_t *vnode, off_t offset, void *buf, size_t len)
 static int
 s5fs_write(vnode_t *vnode, off_t offset, const void *buf, size_t len)
 {
-    lock_vnode(vnode);
+    lock_vnode_journal(vnode);
 
     int err = s5_write_file(vnode, offset, buf, len);
 
-    unlock_vnode(vnode);
+    unlock_vnode_journal(vnode);
+
+    return err;
+}
+
+/* As s5fs_read, but buf is a user address. */
+static int
+s5fs_read_user(vnode_t *vnode, off_t offset, void *buf, size_t len)
+{
+    lock_vnode_shared(vnode);
+
+    if (offset >= vnode->vn_len) {
+        unlock_vnode_shared(vnode);
+
+        return 0;
+    }
+
+    int err = s5_read_file_user(vnode, offset, buf, len);
+
+    unlock_vnode_shared(vnode);
+
+    return err;
+}
+
+/* As s5fs_write, but buf is a user address. */
+static int
+s5fs_write_user(vnode_t *vnode, off_t offset, const void *buf, size_t len)
+{
+    lock_vnode_journal(vnode);
+
+    int err = s5_write_file_user(vnode, offset, buf, len);
+
+    unlock_vnode_journal(vnode);
+
+    return err;
+}
+
+/*
+ * See the comment in vnode.h for what is expected of this function.
+ *
+ * Each block goes to or from the disk in a request of its own, all of
+ * them queued before any is waited for, so that the device merges the
+ * ones next to each other. A block with a page in the file's cache is
+ * copied to or from that page instead, so the cache never disagrees with
+ * the disk; so is all of an inline file, which is in the inode. Sparse
+ * blocks read as zeros and are given blocks when written. The pages are
+ * mapped in all together, for those in high memory.
+ */
+static int
+s5fs_direct_io(vnode_t *vnode, off_t offset, pframe_t **pfs, int npages, int write)
+{
+    blockdev_req_t reqs[PFRAME_RANGE_MAX];
+    uint8_t queued[PFRAME_RANGE_MAX];
+    void *addrs[PFRAME_RANGE_MAX];
+    s5fs_t *fs = VNODE_TO_S5FS(vnode);
+    s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+    uint32_t block = S5_DATA_BLOCK(offset);
+    int i, n, done, ret, err = 0;
+
+    KASSERT(0 < npages && npages <= PFRAME_RANGE_MAX);
+    KASSERT(0 == S5_DATA_OFFSET(offset));
+
+    if (write) {
+        lock_vnode_journal(vnode);
+        if (block >= S5_MAX_FILE_BLOCKS) {
+            unlock_vnode_journal(vnode);
+            return -EINVAL;
+        }
+        n = MIN((uint32_t)npages, S5_MAX_FILE_BLOCKS - block);
+    } else {
+        lock_vnode_shared(vnode);
+        if (offset >= vnode->vn_len) {
+            unlock_vnode_shared(vnode);
+            return 0;
+        }
+        n = MIN(npages, (vnode->vn_len - offset + S5_BLOCK_SIZE - 1) / S5_BLOCK_SIZE);
+    }
+    pframe_kmap_n(pfs, n, addrs);
+
+    for (i = 0; i < n; i++) {
+        off_t pos = offset + i * S5_BLOCK_SIZE;
+        char *buf = addrs[i];
+
+        queued[i] = 0;
+        if (S5_INODE_INLINE(inode)
+            || NULL != pframe_get_resident(&vnode->vn_mmobj, block + i)) {
+            if (write) {
+                ret = s5_write_file(vnode, pos, buf, S5_BLOCK_SIZE);
+            } else if ((ret = s5_read_file(vnode, pos, buf, S5_BLOCK_SIZE)) >= 0) {
+                memset(buf + ret, 0, S5_BLOCK_SIZE - ret);
+            }
+            if (ret < 0) {
+                err = ret;
+                break;
+            }
+            continue;
+        }
+
+        int blocknum = write ? s5_unshare_block(vnode, pos) : s5_seek_to_block(vnode, pos, 0);
+        if (blocknum == 0 && !write) {
+            memset(buf, 0, S5_BLOCK_SIZE);
+            continue;
+        }
+        if (blocknum == 0) {
+            kmutex_lock(&fs->s5f_alloc_mutex);
+            blocknum = s5_seek_to_block(vnode, pos, 1);
+            kmutex_unlock(&fs->s5f_alloc_mutex);
+        }
+        if (blocknum < 0) {
+            err = blocknum;
+            break;
+        }
+        blockdev_req_init(&reqs[i], buf, blocknum, write, NULL, NULL);
+        blockdev_submit(fs->s5f_bdev, &reqs[i]);
+        queued[i] = 1;
+    }
+
+    /*everything queued has to be waited for, even after an error, and
+     *what was moved is what came before the first block which was not*/
+    int last = i;
+    done = i;
+    for (i = 0; i < last; i++) {
+        if (queued[i] && (ret = blockdev_wait(&reqs[i])) < 0 && i < done) {
+            err = ret;
+            done = i;
+        }
+    }
+    int bytes = done * S5_BLOCK_SIZE;
+
+    if (write) {
+        if (offset + bytes > vnode->vn_len) {
+            vnode->vn_len = offset + bytes;
+            inode->s5_size = (unsigned)vnode->vn_len;
+        }
+        s5_dirty_inode(fs, inode);
+        unlock_vnode_journal(vnode);
+    } else {
+        /*the last block may run past the end of the file*/
+        if (offset + bytes > vnode->vn_len) {
+            bytes = vnode->vn_len - offset;
+            memset((char *)addrs[done - 1] + S5_DATA_OFFSET(bytes), 0,
+                   S5_BLOCK_SIZE - S5_DATA_OFFSET(bytes));
+        }
+        unlock_vnode_shared(vnode);
+    }
+    pframe_kunmap_n(pfs, n, addrs);
+
+    return (0 == bytes) ? err : bytes;
+}
+
+/*
+ * See the comment in vnode.h for what is expected of this function.
+ *
+ * The two files are locked in the order of their inode numbers, so that
+ * two clones going opposite ways cannot deadlock.
+ */
+static int
+s5fs_clone(vnode_t *src, vnode_t *dst)
+{
+    vnode_t *first = (src->vn_vno < dst->vn_vno) ? src : dst;
+    vnode_t *second = (first == src) ? dst : src;
+    s5fs_t *fs = VNODE_TO_S5FS(src);
+    pframe_t *pf;
+    int err;
+
+    lock_vnode(first);
+    lock_vnode(second);
+
+    /*dst's cached pages would hide what it is given*/
+    if (0 != dst->vn_len || !list_empty(&dst->vn_mmobj.mmo_respages)) {
+        err = -EINVAL;
+        goto out;
+    }
+
+    /*the shared blocks have to hold what src does, and writes through
+     *shared mappings may be only in the page tables*/
+    list_iterate_begin(&src->vn_mmobj.mmo_respages, pf, pframe_t, pf_olink) {
+        pframe_harvest_dirty(pf);
+    } list_iterate_end();
+    if ((err = pframe_clean_obj(&src->vn_mmobj)) < 0) {
+        goto out;
+    }
+
+    s5_journal_begin(fs);
+    if (0 == (err = s5_clone_file(src, dst))) {
+        dst->vn_len = src->vn_len;
+    }
+    s5_journal_end(fs);
+
+out:
+    unlock_vnode(second);
+    unlock_vnode(first);
+    return err;
+}
+
+/*
+ * Gives each sparse block of the file from offset up to end one of its
+ * own, after the block before it where that is free, and zeroes it on
+ * disk so that it still reads as a hole did. A page dirtied over a hole
+ * holds a reservation for its block already, and is left to get it
+ * when it is written back.
+ */
+static int
+s5fs_prealloc(vnode_t *vnode, off_t offset, off_t end)
+{
+    blockdev_req_t reqs[PFRAME_RANGE_MAX];
+    s5fs_t *fs = VNODE_TO_S5FS(vnode);
+    uint32_t block = S5_DATA_BLOCK(offset);
+    uint32_t last = S5_DATA_BLOCK(end - 1);
+    int i, n = 0, ret, err = 0;
+    void *zeros;
+
+    if (NULL == (zeros = page_alloc())) {
+        return -ENOMEM;
+    }
+    memset(zeros, 0, S5_BLOCK_SIZE);
+
+    for (; block <= last; block++) {
+        off_t pos = (off_t)block * S5_BLOCK_SIZE;
+        pframe_t *pf;
+        int blocknum;
+
+        kmutex_lock(&fs->s5f_alloc_mutex);
+        pf = pframe_get_resident(&vnode->vn_mmobj, block);
+        if (0 == (blocknum = s5_seek_to_block(vnode, pos, 0))
+            && (NULL == pf || !pframe_is_dirty(pf))) {
+            blocknum = s5_seek_to_block(vnode, pos, 1);
+        } else if (blocknum > 0) {
+            blocknum = 0;
+        }
+        kmutex_unlock(&fs->s5f_alloc_mutex);
+        if (blocknum < 0) {
+            err = blocknum;
+            break;
+        }
+        if (0 == blocknum) {
+            continue;
+        }
+
+        blockdev_req_init(&reqs[n], zeros, blocknum, 1, NULL, NULL);
+        blockdev_submit(fs->s5f_bdev, &reqs[n]);
+        if (++n == PFRAME_RANGE_MAX) {
+            for (i = 0; i < n; i++) {
+                if ((ret = blockdev_wait(&reqs[i])) < 0) {
+                    err = ret;
+                }
+            }
+            n = 0;
+            if (err < 0) {
+                break;
+            }
+        }
+    }
+
+    /*everything queued has to be waited for, even after an error*/
+    for (i = 0; i < n; i++) {
+        if ((ret = blockdev_wait(&reqs[i])) < 0) {
+            err = ret;
+        }
+    }
+    page_free(zeros);
 
     return err;
 }
 
+/*
+ * Zeroes the bytes of the file from from up to to, which lie in one
+ * page, through the page cache. A sparse block with nothing cached for
+ * it reads as zeros already, and is left as it is.
+ */
+static int
+s5fs_zero_range(vnode_t *vnode, off_t from, off_t to)
+{
+    uint32_t pn = S5_DATA_BLOCK(from);
+    pframe_t *pf;
+    int err;
+
+    KASSERT(from < to && (uint32_t)S5_DATA_BLOCK(to - 1) == pn);
+
+    if (!S5_INODE_INLINE(VNODE_TO_S5INODE(vnode))
+        && NULL == pframe_get_resident(&vnode->vn_mmobj, pn)) {
+        int blocknum = s5_seek_to_block(vnode, from, 0);
+        if (blocknum <= 0) {
+            return blocknum;
+        }
+    }
+
+    if ((err = pframe_get(&vnode->vn_mmobj, pn, &pf)) < 0) {
+        return err;
+    }
+    pframe_pin(pf);
+    memset((char *)pf->pf_addr + S5_DATA_OFFSET(from), 0, to - from);
+    err = pframe_dirty(pf);
+    pframe_unpin(pf);
+
+    return err;
+}
+
+/*
+ * Drops the file's pages from lopage up to hipage, whose blocks are
+ * about to be punched out. Whatever was written to them is thrown away,
+ * along with the block reserved for it if it had none. A page pinned
+ * by someone using it cannot go: it is written back, so that it holds
+ * no reservation, and emptied instead.
+ */
+static int
+s5fs_punch_pages(vnode_t *vnode, uint32_t lopage, uint32_t hipage)
+{
+    pframe_t *pf;
+    uint32_t pn;
+    int err;
+
+    for (pn = lopage; NULL != (pf = pframe_next_resident(&vnode->vn_mmobj, &pn))
+                      && pn < hipage; ) {
+        if (pframe_is_busy(pf)) {
+            sched_sleep_on(pframe_waitq(pf));
+            continue;
+        }
+        /*writes through shared mappings may be only in the page tables;
+         *finding them may block, after which the page is looked up again*/
+        pframe_harvest_dirty(pf);
+        pf = pframe_get_resident(&vnode->vn_mmobj, pn);
+        if (NULL == pf || pframe_is_busy(pf)) {
+            continue;
+        }
+
+        off_t pos = (off_t)pn * S5_BLOCK_SIZE;
+        if (pframe_is_pinned(pf)) {
+            if (pframe_is_dirty(pf) && (err = pframe_clean(pf)) < 0) {
+                return err;
+            }
+            memset(pf->pf_addr, 0, S5_BLOCK_SIZE);
+        } else {
+            if (pframe_is_dirty(pf) && 0 == s5_seek_to_block(vnode, pos, 0)) {
+                s5_unreserve_block(vnode, pos);
+            }
+            pframe_free(pf);
+        }
+        pn++;
+    }
+
+    return 0;
+}
+
+/*
+ * Makes the bytes of the file from offset up to end, which is no
+ * further than the end of the file, read as zeros. The blocks wholly
+ * inside are given up, and what is left of a block at either edge is
+ * zeroed in its page. The file keeps its size.
+ *
+ * The lock keeps reads and writes out meanwhile, but not faults on
+ * shared mappings of the file, which would find nothing left to read in
+ * what is punched.
+ */
+static int
+s5fs_punch(vnode_t *vnode, off_t offset, off_t end)
+{
+    uint32_t lo, hi, b;
+    int err;
+
+    if (offset >= end) {
+        return 0;
+    }
+    /*all of an inline file is in page 0, and goes back into the inode*/
+    if (S5_INODE_INLINE(VNODE_TO_S5INODE(vnode))) {
+        return s5fs_zero_range(vnode, offset, end);
+    }
+
+    lo = S5_DATA_BLOCK(offset + S5_BLOCK_SIZE - 1);
+    /*past the end of the file, the last block holds nothing to keep*/
+    hi = (end == vnode->vn_len) ? S5_DATA_BLOCK(end + S5_BLOCK_SIZE - 1)
+         : S5_DATA_BLOCK(end);
+
+    if (S5_DATA_OFFSET(offset)
+        && (err = s5fs_zero_range(vnode, offset, MIN(end, (off_t)lo * S5_BLOCK_SIZE))) < 0) {
+        return err;
+    }
+    if (S5_DATA_OFFSET(end) && end != vnode->vn_len && hi >= lo
+        && (err = s5fs_zero_range(vnode, (off_t)hi * S5_BLOCK_SIZE, end)) < 0) {
+        return err;
+    }
+
+    if (lo >= hi) {
+        return 0;
+    }
+    if ((err = s5fs_punch_pages(vnode, lo, hi)) < 0) {
+        return err;
+    }
+    for (b = lo; b < hi; b++) {
+        if ((err = s5_punch_block(vnode, (off_t)b * S5_BLOCK_SIZE)) < 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * See the comment in vnode.h for what is expected of this function.
+ *
+ * There are no extents to hand out, so the blocks are taken one at a
+ * time, each after the one before it, which lays them out together
+ * when the file system has the room.
+ */
+static int
+s5fs_fallocate(vnode_t *vnode, int mode, off_t offset, off_t len)
+{
+    s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+    int err = 0;
+
+    if (len > S5_MAX_FILE_SIZE - offset) {
+        return -EFBIG;
+    }
+    off_t end = offset + len;
+
+    lock_vnode_journal(vnode);
+
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        err = s5fs_punch(vnode, offset, MIN(end, vnode->vn_len));
+        unlock_vnode_journal(vnode);
+        return err;
+    }
+
+    int grow = !(mode & FALLOC_FL_KEEP_SIZE) && end > vnode->vn_len;
+    if (grow && S5_INODE_INLINE(inode) && (unsigned)end > S5_INLINE_SIZE) {
+        err = s5_uninline(vnode, (uint32_t)end);
+    }
+    /*an inline file has no blocks, and all it holds has room already*/
+    if (!err && !S5_INODE_INLINE(inode)) {
+        err = s5fs_prealloc(vnode, offset, end);
+    }
+    if (!err && grow) {
+        vnode->vn_len = end;
+        inode->s5_size = (unsigned)end;
+        s5_dirty_inode(VNODE_TO_S5FS(vnode), inode);
+    }
+
+    unlock_vnode_journal(vnode);
+    return err;
+}
+
 /* This function is deceptivly simple, just return the vnode's
  * mmobj_t through the ret variable. Remember to watch the
  * refcount.
@@ -464,13 +1010,13 @@ s5fs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret)
 static int
 s5fs_create(vnode_t *dir, const char *name, size_t namelen, vnode_t **result)
 {
-    lock_vnode(dir);
+    lock_vnode_journal(dir);
 
-    int inodeno = s5_alloc_inode(dir->vn_fs, S5_TYPE_DATA, 0);
+    int inodeno = s5_alloc_inode(dir->vn_fs, S5_TYPE_DATA, 0, dir->vn_vno);
     if (inodeno < 0) {
         *result = NULL;
 
-        unlock_vnode(dir);
+        unlock_vnode_journal(dir);
 
         return inodeno;
     }
@@ -487,12 +1033,12 @@ s5fs_create(vnode_t *dir, const char *name, size_t namelen, vnode_t **result)
         /*s5_free_inode(*result);*/
         dprintf("some error occured, the error number is %d.\n", err);
 
-        unlock_vnode(dir);
+        unlock_vnode_journal(dir);
 
         return err;
     }
 
-    unlock_vnode(dir);
+    unlock_vnode_journal(dir);
 
     return err;
 }
@@ -509,20 +1055,22 @@ s5fs_create(vnode_t *dir, const char *name, size_t namelen, vnode_t **result)
 static int
 s5fs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode, devid_t devid)
 {
-    lock_vnode(dir);
+    lock_vnode_journal(dir);
 
     int inodeno;
     if (S_ISCHR(mode)) {
-        inodeno = s5_alloc_inode(dir->vn_fs, S5_TYPE_CHR, devid);
+        inodeno = s5_alloc_inode(dir->vn_fs, S5_TYPE_CHR, devid, dir->vn_vno);
     } else if (S_ISBLK(mode)) {
-        inodeno = s5_alloc_inode(dir->vn_fs, S5_TYPE_BLK, devid);
+        inodeno = s5_alloc_inode(dir->vn_fs, S5_TYPE_BLK, devid, dir->vn_vno);
+    } else if (S_ISSOCK(mode)) {
+        inodeno = s5_alloc_inode(dir->vn_fs, S5_TYPE_SOCK, 0, dir->vn_vno);
     } else {
         panic("Invalid mode! \n");
     }
 
     if (inodeno < 0) {
 
-        unlock_vnode(dir);
+        unlock_vnode_journal(dir);
 
         return inodeno;
     }
@@ -535,14 +1083,14 @@ s5fs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode, devid_t dev
     vput(file);
     if (err < 0) {
 
-        unlock_vnode(dir);
+        unlock_vnode_journal(dir);
 
         return err;
     }
 
     KASSERT(err == 0);
 
-    unlock_vnode(dir);
+    unlock_vnode_journal(dir);
 
     return 0;
 }
@@ -555,6 +1103,7 @@ s5fs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode, devid_t dev
 int
 s5fs_lookup(vnode_t *base, const char *name, size_t namelen, vnode_t **result)
 {
+    /*not shared: the first lookup in a big directory builds its name hash*/
     lock_vnode(base);
 
     int inodeno = s5_find_dirent(base, name, namelen);
@@ -584,12 +1133,12 @@ static int
 s5fs_link(vnode_t *src, vnode_t *dir, const char *name, size_t namelen)
 {
     lock_vnode(src);
-    lock_vnode(dir);
+    lock_vnode_journal(dir);
 
     /*switch the order of parameters*/
     int err = s5_link(dir, src, name, namelen);
 
-    unlock_vnode(dir);
+    unlock_vnode_journal(dir);
     unlock_vnode(src);
     
     return err;
@@ -606,11 +1155,11 @@ s5fs_link(vnode_t *src, vnode_t *dir, const char *name, size_t namelen)
 static int
 s5fs_unlink(vnode_t *dir, const char *name, size_t namelen)
 {
-    lock_vnode(dir);
+    lock_vnode_journal(dir);
 
     int err = s5_remove_dirent(dir, name, namelen);
 
-    unlock_vnode(dir);
+    unlock_vnode_journal(dir);
 
     return err;
 }
@@ -636,21 +1185,21 @@ s5fs_unlink(vnode_t *dir, const char *name, size_t namelen)
 static int
 s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen)
 {
-    lock_vnode(dir);
+    lock_vnode_journal(dir);
 
     if ((unsigned)dir->vn_len >= S5_MAX_FILE_SIZE) {
         panic("It's hardly the case, gonna panic here during debugging.\n");
 
-        unlock_vnode(dir);
+        unlock_vnode_journal(dir);
 
         return -ENOSPC;
     }
 
     /*Allocate an inode*/
-    int inodeno = s5_alloc_inode(dir->vn_fs, S5_TYPE_DIR, 0);
+    int inodeno = s5_alloc_inode(dir->vn_fs, S5_TYPE_DIR, 0, dir->vn_vno);
     if (inodeno < 0) {
 
-        unlock_vnode(dir);
+        unlock_vnode_journal(dir);
 
         return inodeno;
     }
@@ -664,7 +1213,7 @@ s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen)
         /*s5_free_inode(vnode_child);*/
         vput(vnode_child);
 
-        unlock_vnode(dir);
+        unlock_vnode_journal(dir);
 
         return err;
     }
@@ -680,7 +1229,7 @@ s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen)
         /*s5_free_inode(vnode_child);*/
         vput(vnode_child);
 
-        unlock_vnode(dir);
+        unlock_vnode_journal(dir);
 
         return err;
     }
@@ -701,14 +1250,14 @@ s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen)
         }
         vput(vnode_child);
 
-        unlock_vnode(dir);
+        unlock_vnode_journal(dir);
 
         return err;
     }
 
     vput(vnode_child);
 
-    unlock_vnode(dir);
+    unlock_vnode_journal(dir);
 
     return 0;
 }
@@ -726,42 +1275,26 @@ s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen)
 static int
 s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
 {
-    lock_vnode(parent);
+    lock_vnode_journal(parent);
 
     /*get the vnode for the child*/
     int inodeno = s5_find_dirent(parent, name, namelen);
     if (inodeno < 0) {
 
-        unlock_vnode(parent);
+        unlock_vnode_journal(parent);
 
         return inodeno;
     }
     vnode_t *child = vget(parent->vn_fs, inodeno);
 
     /*determine if the child dir is empty or not*/
-    if (child->vn_len != 2 * sizeof(s5_dirent_t)) {
-        vput(child);
-
-        unlock_vnode(parent);
-
-        return -ENOTEMPTY;
-    }
-    int err = 0;
-    err = s5_find_dirent(parent, ".", 1);
-    if (err < 0) {
+    int err = s5_dir_empty(child);
+    if (err <= 0) {
         vput(child);
 
-        unlock_vnode(parent);
+        unlock_vnode_journal(parent);
 
-        return -ENOTEMPTY;
-    }
-    err = s5_find_dirent(parent, "..", 2);
-    if (err < 0) {
-        vput(child);
-
-        unlock_vnode(parent);
-
-        return -ENOTEMPTY;
+        return (err < 0) ? err : -ENOTEMPTY;
     }
 
     /*remove '..' directory from child*/
@@ -769,7 +1302,7 @@ s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
     if (err < 0) {
         vput(child);
 
-        unlock_vnode(parent);
+        unlock_vnode_journal(parent);
 
         return err;
     }
@@ -783,62 +1316,130 @@ s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
         }
         vput(child);
 
-        unlock_vnode(parent);
+        unlock_vnode_journal(parent);
 
         return err;
     }
 
     vput(child);
 
-    unlock_vnode(parent);
+    unlock_vnode_journal(parent);
 
     return err;
 }
 
 
+static void
+s5_dirent_to_dirent(const s5_dirent_t *ent, struct dirent *d)
+{
+    d->d_ino = ent->s5d_inode;
+    d->d_off = 0; /* unused*/
+    strncpy(d->d_name, ent->s5d_name, S5_NAME_LEN - 1);
+    d->d_name[S5_NAME_LEN - 1] = '\0';
+}
+
 /*
  * See the comment in vnode.h for what is expected of this function.
  *
- * Here you need to use s5_read_file() to read a s5_dirent_t from a directory
- * and copy that data into the given dirent. The value of d_off is dependent on
- * your implementation and may or may not be necessary.  Finally, return the
- * number of bytes read.
+ * The entry is copied straight out of the directory's page with
+ * s5_dirent_iter. An offset inside an entry skips to the next one, and
+ * the bytes skipped are counted in what is returned.
  */
 static int
 s5fs_readdir(vnode_t *vnode, off_t offset, struct dirent *d)
 {
-    lock_vnode(vnode);
+    lock_vnode_shared(vnode);
+
+    s5_dirent_iter_t it;
+    s5_dirent_iter_init(&it, vnode, offset);
+    int err = s5_dirent_iter_next(&it);
+    if (err > 0) {
+        s5_dirent_to_dirent(it.it_ent, d);
+        err = it.it_next - offset;
+    }
+    s5_dirent_iter_done(&it);
 
-    if (offset > vnode->vn_len) {
+    unlock_vnode_shared(vnode);
 
-        unlock_vnode(vnode);
+    return err;
+}
 
-        return 0;
+/*
+ * Reads entries straight out of the directory's pages with
+ * s5_dirent_iter, each page pinned once for all the entries on it.
+ */
+static int
+s5fs_readdir_batch(vnode_t *vnode, off_t *offset, struct dirent *d, int count)
+{
+    lock_vnode_shared(vnode);
+
+    s5_dirent_iter_t it;
+    s5_dirent_iter_init(&it, vnode, *offset);
+    int n = 0, err = 0;
+    while (n < count && 0 < (err = s5_dirent_iter_next(&it))) {
+        s5_dirent_to_dirent(it.it_ent, &d[n++]);
+        *offset = it.it_next;
     }
+    s5_dirent_iter_done(&it);
 
-    s5_dirent_t s5_dirent;
-    int err = s5_read_file(vnode, offset, (char *)(&s5_dirent), sizeof(s5_dirent_t));
-    if (err < 0) {
+    unlock_vnode_shared(vnode);
 
-        unlock_vnode(vnode);
+    return (n > 0 || err >= 0) ? n : err;
+}
 
-        return err;
-    }
-    if (err == 0) {
+/*
+ * Reads entries as s5fs_readdir_batch does, and takes the type and size
+ * of each straight from its inode, whose block is most likely resident
+ * along with those of its neighbours. No vnode is made for any of them.
+ */
+static int
+s5fs_readdir_plus(vnode_t *vnode, off_t *offset, struct dirent_plus *d, int count)
+{
+    s5fs_t *fs = VNODE_TO_S5FS(vnode);
 
-        unlock_vnode(vnode);
+    lock_vnode_shared(vnode);
+
+    s5_dirent_iter_t it;
+    s5_dirent_iter_init(&it, vnode, *offset);
+    int n = 0, err = 0;
+    for (; n < count && 0 < (err = s5_dirent_iter_next(&it)); n++) {
+        s5_dirent_to_dirent(it.it_ent, &d[n].dp_dirent);
+        *offset = it.it_next;
+
+        pframe_t *pf;
+        uint32_t ino = d[n].dp_dirent.d_ino;
+        d[n].dp_mode = 0;
+        d[n].dp_size = 0;
+        if (pframe_get(S5FS_TO_VMOBJ(fs), S5_INODE_BLOCK(ino), &pf) < 0) {
+            continue;
+        }
 
-        return 0;
+        s5_inode_t *inode = (s5_inode_t *)pf->pf_addr + S5_INODE_OFFSET(ino);
+        d[n].dp_size = inode->s5_size;
+        switch (inode->s5_type) {
+            case S5_TYPE_DATA:
+                d[n].dp_mode = S_IFREG;
+                break;
+            case S5_TYPE_DIR:
+                d[n].dp_mode = S_IFDIR;
+                break;
+            case S5_TYPE_CHR:
+                d[n].dp_mode = S_IFCHR;
+                break;
+            case S5_TYPE_BLK:
+                d[n].dp_mode = S_IFBLK;
+                break;
+            case S5_TYPE_SOCK:
+                d[n].dp_mode = S_IFSOCK;
+                break;
+        }
     }
 
-    d->d_ino = s5_dirent.s5d_inode;
-    d->d_off = 0; /* unused*/
-    strncpy(d->d_name, s5_dirent.s5d_name, S5_NAME_LEN - 1);
-    d->d_name[S5_NAME_LEN - 1] = '\0';
+    s5_dirent_iter_done(&it);
 
-    unlock_vnode(vnode);
+    unlock_vnode_shared(vnode);
 
-    return sizeof(s5_dirent_t);
+    return (n > 0 || err >= 0) ? n : err;
 }
 
 
@@ -857,7 +1458,7 @@ s5fs_stat(vnode_t *vnode, struct stat *ss)
     s5_inode_t *i = VNODE_TO_S5INODE(vnode);
     KASSERT(i);
 
-    lock_vnode(vnode);
+    lock_vnode_shared(vnode);
 
     memset(ss, 0, sizeof(struct stat));
     ss->st_mode = vnode->vn_mode;
@@ -869,11 +1470,131 @@ s5fs_stat(vnode_t *vnode, struct stat *ss)
     ss->st_blksize = (int) PAGE_SIZE;
     ss->st_blocks = s5_inode_blocks(vnode);
 
-    unlock_vnode(vnode);
+    unlock_vnode_shared(vnode);
 
     return 0;
 }
 
+/*
+ * Writes back the block device page of blockno, if it is resident and
+ * dirty. A pinned one (an inode block, while its vnodes are around) is
+ * written straight from the page, which stays dirty, as the journal
+ * writes blocks home.
+ */
+static int
+s5_sync_block(s5fs_t *fs, uint32_t blockno)
+{
+    pframe_t *pf;
+
+    while (NULL != (pf = pframe_get_resident(S5FS_TO_VMOBJ(fs), blockno))
+           && pframe_is_dirty(pf)) {
+        if (pframe_is_busy(pf)) {
+            sched_sleep_on(pframe_waitq(pf));
+        } else if (pframe_is_pinned(pf)) {
+            return blockdev_write(fs->s5f_bdev, pf->pf_addr, blockno);
+        } else {
+            return pframe_clean(pf);
+        }
+    }
+    return 0;
+}
+
+/* Writes back the inode of vnode and the index blocks of its file */
+static int
+s5_sync_inode(vnode_t *vnode)
+{
+    s5fs_t *fs = VNODE_TO_S5FS(vnode);
+    s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+    int ret, err = 0;
+
+    if (inode->s5_indirect_block
+        && 0 > (ret = s5_sync_block(fs, inode->s5_indirect_block))) {
+        err = ret;
+    }
+
+    if (inode->s5_dindirect_block) {
+        pframe_t *dpf;
+        uint32_t i;
+
+        if (0 > (ret = pframe_get(S5FS_TO_VMOBJ(fs), inode->s5_dindirect_block, &dpf))) {
+            return ret;
+        }
+        /*keep it resident while its entries are looked at*/
+        pframe_pin(dpf);
+        for (i = 0; i < S5_NIDIRECT_BLOCKS; i++) {
+            uint32_t b = ((uint32_t *)dpf->pf_addr)[i];
+            if (b && 0 > (ret = s5_sync_block(fs, b)) && !err) {
+                err = ret;
+            }
+        }
+        pframe_unpin(dpf);
+        if (0 > (ret = s5_sync_block(fs, inode->s5_dindirect_block)) && !err) {
+            err = ret;
+        }
+    }
+
+    if (0 > (ret = s5_sync_block(fs, S5_INODE_BLOCK(vnode->vn_vno))) && !err) {
+        err = ret;
+    }
+    return err;
+}
+
+/*
+ * Writes back the file's dirty pages, and then the metadata they are
+ * found through, since writing a page back may allocate its block. With
+ * a journal that means committing the running transaction, which writes
+ * all of it home; writing journaled blocks home ourselves before then
+ * would defeat the journal. Without one the inode and index blocks of
+ * the file are written, and nothing else.
+ *
+ * An s5 inode has no times, so all of it is needed to read the data
+ * back and fdatasync does everything fsync does.
+ */
+static int
+s5fs_fsync(vnode_t *vnode, int datasync)
+{
+    s5fs_t *fs = VNODE_TO_S5FS(vnode);
+    pframe_t *pf;
+    int ret, err;
+
+    /*writes through shared mappings may be only in the page tables*/
+    list_iterate_begin(&vnode->vn_mmobj.mmo_respages, pf, pframe_t, pf_olink) {
+        pframe_harvest_dirty(pf);
+    } list_iterate_end();
+    err = pframe_clean_obj(&vnode->vn_mmobj);
+
+    if (NULL != fs->s5f_journal) {
+        s5_journal_sync(fs);
+    } else {
+        /*keep truncation from freeing the index blocks meanwhile*/
+        lock_vnode_shared(vnode);
+        if (0 > (ret = s5_sync_inode(vnode)) && !err) {
+            err = ret;
+        }
+        unlock_vnode_shared(vnode);
+    }
+
+    /*what was written may still be in the disk's cache*/
+    if (0 > (ret = blockdev_flush(fs->s5f_bdev)) && !err) {
+        err = ret;
+    }
+    return err;
+}
+
+/*
+ * Fills a page which has no block: with zeros, but for the start of an
+ * inline file, which is in the inode.
+ */
+static void
+s5fs_fill_hole(vnode_t *vnode, off_t offset, void *pagebuf)
+{
+    s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+
+    memset(pagebuf, 0, PAGE_SIZE);
+    if (S5_INODE_INLINE(inode) && 0 == S5_DATA_BLOCK(offset)) {
+        memcpy(pagebuf, inode->s5_direct_blocks, inode->s5_size);
+    }
+}
 
 /*
  * See the comment in vnode.h for what is expected of this function.
@@ -890,13 +1611,92 @@ s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf)
     }
 
     if (blocknum == 0) {
-        memset(pagebuf, 0, PAGE_SIZE);
+        s5fs_fill_hole(vnode, offset, pagebuf);
         return 0;
     }
 
     s5fs_t *fs = VNODE_TO_S5FS(vnode);
 
-    int err = fs->s5f_bdev->bd_ops->read_block(fs->s5f_bdev, pagebuf, blocknum, 1);
+    int err = blockdev_read(fs->s5f_bdev, pagebuf, blocknum);
+
+    return err;
+}
+
+static void
+s5fs_fillpage_done(blockdev_req_t *req)
+{
+    pframe_fill_done((pframe_t *)req->br_arg, req->br_status);
+    blockdev_req_free(req);
+}
+
+/*
+ * Like fillpage, but only queues the read; see fillpage_async in vnode.h.
+ */
+static int
+s5fs_fillpage_async(vnode_t *vnode, off_t offset, pframe_t *pf)
+{
+    int blocknum = s5_seek_to_block(vnode, offset, 0);
+    if (blocknum < 0) {
+        return blocknum;
+    }
+
+    if (blocknum == 0) {
+        s5fs_fill_hole(vnode, offset, pf->pf_addr);
+        pframe_fill_done(pf, 0);
+        return 0;
+    }
+
+    blockdev_req_t *req = blockdev_req_alloc();
+    if (NULL == req) {
+        return -ENOMEM;
+    }
+
+    s5fs_t *fs = VNODE_TO_S5FS(vnode);
+    blockdev_req_init(req, pf->pf_addr, blocknum, 0, s5fs_fillpage_done, pf);
+    blockdev_submit(fs->s5f_bdev, req);
+
+    return 0;
+}
+
+/*
+ * Like fillpage, but for npages consecutive pages of the file. All of the
+ * reads are queued before waiting on any of them, so blocks which are
+ * adjacent on disk are read in one transfer.
+ */
+static int
+s5fs_fillpages(vnode_t *vnode, off_t offset, void **pagebufs, int npages)
+{
+    blockdev_req_t reqs[PFRAME_RANGE_MAX];
+    uint8_t queued[PFRAME_RANGE_MAX];
+    s5fs_t *fs = VNODE_TO_S5FS(vnode);
+    int i, ret, err = 0;
+
+    KASSERT(0 < npages && npages <= PFRAME_RANGE_MAX);
+
+    for (i = 0; i < npages; i++) {
+        queued[i] = 0;
+        if (err < 0) {
+            continue;
+        }
+
+        int blocknum = s5_seek_to_block(vnode, offset + i * S5_BLOCK_SIZE, 0);
+        if (blocknum < 0) {
+            err = blocknum;
+        } else if (blocknum == 0) {
+            s5fs_fill_hole(vnode, offset + i * S5_BLOCK_SIZE, pagebufs[i]);
+        } else {
+            blockdev_req_init(&reqs[i], pagebufs[i], blocknum, 0, NULL, NULL);
+            blockdev_submit(fs->s5f_bdev, &reqs[i]);
+            queued[i] = 1;
+        }
+    }
+
+    /*everything queued has to be waited for, even after an error*/
+    for (i = 0; i < npages; i++) {
+        if (queued[i] && (ret = blockdev_wait(&reqs[i])) < 0) {
+            err = ret;
+        }
+    }
 
     return err;
 }
@@ -906,6 +1706,10 @@ s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf)
  * if this offset is NOT within a sparse region of the file
  *     return 0;
  *
+ * a regular file only has blocks reserved for it here, they are
+ * allocated when the page is cleaned so that whatever is written
+ * back together lands together;
+ *
  * attempt to make the region containing this offset no longer
  * sparse
  *     - attempt to allocate a free block
@@ -919,23 +1723,54 @@ s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf)
 static int
 s5fs_dirtypage(vnode_t *vnode, off_t offset)
 {
-    int blocknum = s5_seek_to_block(vnode, offset, 0);
+    s5fs_t *fs = VNODE_TO_S5FS(vnode);
+
+    /*written back into the inode, which needs no block*/
+    if (S5_INODE_INLINE(VNODE_TO_S5INODE(vnode)) && 0 == S5_DATA_BLOCK(offset)) {
+        return 0;
+    }
+
+    /*a block shared with a clone is replaced now, while the page holds
+     *what was in it*/
+    int blocknum = s5_unshare_block(vnode, offset);
     if (blocknum < 0) {
         return blocknum;
     }
 
+    if (blocknum == 0 && S_ISREG(vnode->vn_mode)) {
+        /*a page dirty already still holds its reservation*/
+        pframe_t *pf = pframe_get_resident(&vnode->vn_mmobj, S5_DATA_BLOCK(offset));
+        if (pframe_is_dirty(pf) || 0 == s5_reserve_block(vnode, offset)) {
+            return 0;
+        }
+        /*too few free blocks left to promise any, allocate now*/
+        if (S5_INODE_INLINE(VNODE_TO_S5INODE(vnode))) {
+            return -ENOSPC;
+        }
+    }
+
     if (blocknum == 0) {
+        /*this may come from a fault on a shared mapping, outside of any
+         *operation*/
+        kmutex_lock(&fs->s5f_alloc_mutex);
+        s5_journal_begin(fs);
         blocknum = s5_seek_to_block(vnode, offset, 1);
+        s5_journal_end(fs);
+        kmutex_unlock(&fs->s5f_alloc_mutex);
         if (blocknum < 0) {
             return blocknum;
         }
         
         /*seems no need here to associate this block with the inode because it's already done during s5_seek_to_block*/
+    }
 
-        return 0;
-    } else {
-        return 0;
+    /*directory contents are metadata too*/
+    if (S_ISDIR(vnode->vn_mode)) {
+        s5_journal_dirty(fs, pframe_get_resident(&vnode->vn_mmobj, S5_DATA_BLOCK(offset)),
+                         (uint32_t)blocknum);
     }
+
+    return 0;
 }
 
 /*
@@ -944,14 +1779,43 @@ s5fs_dirtypage(vnode_t *vnode, off_t offset)
 static int
 s5fs_cleanpage(vnode_t *vnode, off_t offset, void *pagebuf)
 {
-    int blocknum = s5_seek_to_block(vnode, offset, 0);
+    /*the block may have been shared since the page was dirtied*/
+    int blocknum = s5_unshare_block(vnode, offset);
     if (blocknum < 0) {
         return blocknum;
     }
 
     s5fs_t *fs = VNODE_TO_S5FS(vnode);
 
-    int err = fs->s5f_bdev->bd_ops->write_block(fs->s5f_bdev, pagebuf, blocknum, 1);
+    if (S5_INODE_INLINE(VNODE_TO_S5INODE(vnode))) {
+        if (0 == S5_DATA_BLOCK(offset)) {
+            s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+            s5_journal_begin(fs);
+            memcpy(inode->s5_direct_blocks, pagebuf, S5_INLINE_SIZE);
+            s5_dirty_inode(fs, inode);
+            s5_journal_end(fs);
+        } else {
+            /*past the end of the file, there is nothing to keep*/
+            s5_unreserve_block(vnode, offset);
+        }
+        return 0;
+    }
+
+    if (blocknum == 0) {
+        /*delayed by dirtypage, which reserved the blocks*/
+        KASSERT(S_ISREG(vnode->vn_mode));
+        kmutex_lock(&fs->s5f_alloc_mutex);
+        s5_journal_begin(fs);
+        blocknum = s5_seek_to_block(vnode, offset, S5_ALLOC_RESERVED);
+        s5_journal_end(fs);
+        kmutex_unlock(&fs->s5f_alloc_mutex);
+        if (blocknum < 0) {
+            return blocknum;
+        }
+        s5_unreserve_block(vnode, offset);
+    }
+
+    int err = blockdev_write(fs->s5f_bdev, pagebuf, blocknum);
 
     return err;
 }
@@ -966,8 +1830,7 @@ static int
 s5_check_super(s5_super_t *super)
 {
         if (!(super->s5s_magic == S5_MAGIC
-              && (super->s5s_free_inode < super->s5s_num_inodes
-                  || super->s5s_free_inode == (uint32_t) - 1)
+              && super->s5s_free_inodes < super->s5s_num_inodes
               && super->s5s_root_inode < super->s5s_num_inodes))
                 return -1;
         if (super->s5s_version != S5_CURRENT_VERSION) {
@@ -976,6 +1839,14 @@ s5_check_super(s5_super_t *super)
                     super->s5s_version, S5_CURRENT_VERSION);
                 return -1;
         }
+        /* the inode bitmap is right after the inode blocks, and the
+         * block reference counts after that */
+        if (super->s5s_imap_start != S5_INODE_BLOCK(super->s5s_num_inodes - 1) + 1
+            || super->s5s_refs_start != super->s5s_imap_start
+               + S5_IMAP_BLOCKS(super->s5s_num_inodes)
+            || super->s5s_num_blocks <= super->s5s_refs_start
+               + S5_REFS_BLOCKS(super->s5s_num_blocks))
+                return -1;
         return 0;
 }
 
@@ -1032,7 +1903,7 @@ s5fs_check_refcounts(fs_t *fs)
         int ret = 0;
         uint32_t i;
 
-        refcounts = kmalloc(s5fs->s5f_super->s5s_num_inodes * sizeof(int));
+        refcounts = vmalloc(s5fs->s5f_super->s5s_num_inodes * sizeof(int));
         KASSERT(refcounts);
         memset(refcounts, 0, s5fs->s5f_super->s5s_num_inodes * sizeof(int));
 
@@ -1067,6 +1938,24 @@ s5fs_check_refcounts(fs_t *fs)
             MAJOR(s5fs->s5f_bdev->bd_id), MINOR(s5fs->s5f_bdev->bd_id),
             (ret ? "UNSUCCESSFULLY" : "successfully"));
 
-        kfree(refcounts);
+        vfree(refcounts);
         return ret;
 }
+
+size_t
+s5fs_lock_info(const void *vnode, char *buf, size_t osize)
+{
+        const vnode_t *vn = vnode;
+        s5fs_t *s5 = VNODE_TO_S5FS(vn);
+        size_t size = osize;
+
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "lock           waits\n");
+        iprintf(&buf, &size, "inode %-8lu %6u\n",
+                (unsigned long)vn->vn_vno, vn->vn_rwlock.kr_contended);
+        iprintf(&buf, &size, "free blocks    %6u\n", s5->s5f_block_mutex.km_contended);
+        iprintf(&buf, &size, "free inodes    %6u\n", s5->s5f_inode_mutex.km_contended);
+        iprintf(&buf, &size, "block mapping  %6u\n", s5->s5f_alloc_mutex.km_contended);
+        return osize - size;
+}
@@ -0,0 +1,443 @@
+/*
+ *   FILE: s5fs_journal.c
+ *  DESCR: write-ahead log for s5fs metadata
+ */
+
+#include "kernel.h"
+#include "config.h"
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+
+#include "drivers/blockdev.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
+
+/*
+ * Every s5fs operation which changes metadata runs between
+ * s5_journal_begin() and s5_journal_end(). The metadata pages it dirties
+ * meanwhile (pages of the block device, and directory pages) join the
+ * running transaction and stay pinned, so nothing writes them back in
+ * place before the transaction is committed.
+ *
+ * Transactions are committed in groups: the running one takes in every
+ * operation until s5journald commits it S5_JOURNAL_COMMIT_MSECS after it
+ * got its first block, or until it is too full to take another. A commit
+ * waits for the operations in it to end and keeps new ones out until it
+ * is done. It writes the descriptor and block images to the log as one
+ * sequential run, then the commit block, and then writes the blocks
+ * home and marks the log empty. The log thus never holds more than one
+ * transaction, and replaying it at mount is just writing it home again.
+ *
+ * Operations nest (vput in s5fs_unlink may get to s5fs_delete_vnode), so
+ * s5_journal_begin() only ever waits while no operation is running. A
+ * transaction which keeps growing after that leaves the pages which do
+ * not fit to be written back unjournaled, as they were before.
+ */
+
+typedef struct s5_jblock {
+        pframe_t        *jb_pf;         /* the page, pinned by us */
+        uint32_t        jb_blockno;     /* where it goes on disk */
+} s5_jblock_t;
+
+typedef struct s5_journal {
+        s5fs_t          *j_fs;
+        uint32_t        j_start;        /* the descriptor's block */
+        uint32_t        j_max;          /* most blocks one transaction logs */
+        uint32_t        j_seq;          /* the running transaction's number */
+        int             j_handles;      /* operations running in it */
+        int             j_committing;   /* 1 while it is being written */
+        int             j_want_commit;  /* commit once j_handles is 0 */
+        uint32_t        j_nblocks;      /* entries used in j_blocks */
+        s5_jblock_t     *j_blocks;      /* j_max entries */
+        blockdev_req_t  *j_reqs;        /* j_max + 1 entries */
+        s5_jdesc_t      *j_desc;        /* page for the descriptor */
+        s5_jcommit_t    *j_commit;      /* page for the commit block */
+        ktqueue_t       j_waitq;        /* waiting for a commit to finish */
+        ktqueue_t       j_thrq;         /* s5journald sleeps here */
+        kthread_t       *j_thr;         /* s5journald */
+} s5_journal_t;
+
+/* Waits on the first n of j_reqs, returning the first error if any */
+static int
+s5_journal_wait(s5_journal_t *j, uint32_t n)
+{
+        uint32_t i;
+        int ret, err = 0;
+
+        for (i = 0; i < n; i++) {
+                if ((ret = blockdev_wait(&j->j_reqs[i])) < 0 && !err)
+                        err = ret;
+        }
+        return err;
+}
+
+static void
+s5_journal_commit(s5_journal_t *j)
+{
+        blockdev_t *bd = j->j_fs->s5f_bdev;
+        uint32_t i, n = j->j_nblocks;
+        int err;
+
+        KASSERT(0 == j->j_handles && !j->j_committing);
+        j->j_committing = 1;
+        j->j_want_commit = 0;
+
+        if (0 == n)
+                goto done;
+
+        /* The descriptor and the images go to consecutive blocks, so the
+         * elevator merges them into one write. Nothing can dirty the
+         * pages (as part of an operation) until we are done. */
+        j->j_desc->s5jd_magic = S5_JDESC_MAGIC;
+        j->j_desc->s5jd_seq = j->j_seq;
+        j->j_desc->s5jd_nblocks = n;
+        for (i = 0; i < n; i++)
+                j->j_desc->s5jd_blocks[i] = j->j_blocks[i].jb_blockno;
+
+        blockdev_req_init(&j->j_reqs[0], (char *)j->j_desc, j->j_start,
+                          1, NULL, NULL);
+        blockdev_submit(bd, &j->j_reqs[0]);
+        for (i = 0; i < n; i++) {
+                blockdev_req_init(&j->j_reqs[i + 1], j->j_blocks[i].jb_pf->pf_addr,
+                                  j->j_start + 1 + i, 1, NULL, NULL);
+                blockdev_submit(bd, &j->j_reqs[i + 1]);
+        }
+
+        /* The commit block goes out only once all of that is on disk, not
+         * just in its cache, and the blocks go home only once the commit
+         * block is */
+        if (0 == (err = s5_journal_wait(j, n + 1))
+            && 0 == (err = blockdev_flush(bd))) {
+                j->j_commit->s5jc_magic = S5_JCOMMIT_MAGIC;
+                j->j_commit->s5jc_seq = j->j_seq;
+                if (0 == (err = blockdev_write(bd, (char *)j->j_commit, j->j_start + n + 1)))
+                        err = blockdev_flush(bd);
+        }
+        if (err < 0) {
+                dbg(DBG_S5FS, "s5_journal_commit: failed to log transaction "
+                    "%u (error %d), writing it back unjournaled\n", j->j_seq, err);
+        }
+
+        /* Now the blocks can go home. The pages stay dirty: they may have
+         * been changed outside of any operation meanwhile. */
+        for (i = 0; i < n; i++) {
+                blockdev_req_init(&j->j_reqs[i], j->j_blocks[i].jb_pf->pf_addr,
+                                  j->j_blocks[i].jb_blockno, 1, NULL, NULL);
+                blockdev_submit(bd, &j->j_reqs[i]);
+        }
+        if ((err = s5_journal_wait(j, n)) < 0 || (err = blockdev_flush(bd)) < 0) {
+                dbg(DBG_S5FS, "s5_journal_commit: failed to write back "
+                    "transaction %u (error %d)\n", j->j_seq, err);
+        }
+
+        /* Replaying it again after this could undo later changes made
+         * outside of the journal */
+        j->j_desc->s5jd_nblocks = 0;
+        if ((err = blockdev_write(bd, (char *)j->j_desc, j->j_start)) < 0) {
+                dbg(DBG_S5FS, "s5_journal_commit: failed to empty the log "
+                    "(error %d)\n", err);
+        }
+
+        for (i = 0; i < n; i++)
+                pframe_unpin(j->j_blocks[i].jb_pf);
+        j->j_nblocks = 0;
+        j->j_seq++;
+
+done:
+        j->j_committing = 0;
+        sched_broadcast_on(&j->j_waitq);
+}
+
+/*
+ * s5journald sleeps until the running transaction gets its first block,
+ * then gives it S5_JOURNAL_COMMIT_MSECS to collect more before it
+ * commits it, or has the last operation in it do so if it is busy.
+ */
+static void *
+s5_journal_run(int arg1, void *arg2)
+{
+        s5_journal_t *j = (s5_journal_t *)arg2;
+        int ret;
+
+        /* Cancelling only interrupts a cancellable sleep, so this is
+         * checked before each one */
+        while (!curthr->kt_cancelled) {
+                if (0 == j->j_nblocks) {
+                        sched_cancellable_sleep_on(&j->j_thrq);
+                        continue;
+                }
+                ret = sched_sleep_on_timeout(&j->j_thrq, S5_JOURNAL_COMMIT_MSECS);
+                if (-ETIME != ret || j->j_committing || 0 == j->j_nblocks)
+                        continue;
+
+                if (0 < j->j_handles)
+                        j->j_want_commit = 1;
+                else
+                        s5_journal_commit(j);
+
+                /* don't start timing a transaction someone else is about
+                 * to commit */
+                while (j->j_want_commit || j->j_committing)
+                        sched_sleep_on(&j->j_waitq);
+        }
+        kthread_exit((void *)0);
+        return NULL;
+}
+
+/*
+ * If the log holds a committed transaction, writes its blocks home
+ * (and into their pages, for those already resident), then empties
+ * the log.
+ */
+static int
+s5_journal_replay(s5_journal_t *j)
+{
+        blockdev_t *bd = j->j_fs->s5f_bdev;
+        s5_jdesc_t *d = j->j_desc;
+        char *buf = (char *)j->j_commit;
+        uint32_t i, n;
+        int err;
+
+        if ((err = blockdev_read(bd, (char *)d, j->j_start)) < 0)
+                return err;
+        if (S5_JDESC_MAGIC != d->s5jd_magic) {
+                /* never used */
+                j->j_seq = 1;
+                return 0;
+        }
+        j->j_seq = d->s5jd_seq + 1;
+        if (0 == (n = d->s5jd_nblocks))
+                return 0;
+        if (n > j->j_max)
+                return -EINVAL;
+
+        if ((err = blockdev_read(bd, buf, j->j_start + n + 1)) < 0)
+                return err;
+        if (S5_JCOMMIT_MAGIC != j->j_commit->s5jc_magic
+            || d->s5jd_seq != j->j_commit->s5jc_seq) {
+                dbg(DBG_S5FS, "s5_journal_replay: transaction %u was not "
+                    "committed, discarding it\n", d->s5jd_seq);
+                goto empty;
+        }
+
+        for (i = 0; i < n; i++) {
+                pframe_t *pf;
+                if ((err = blockdev_read(bd, buf, j->j_start + 1 + i)) < 0
+                    || (err = blockdev_write(bd, buf, d->s5jd_blocks[i])) < 0)
+                        return err;
+                if (NULL != (pf = pframe_get_resident(&bd->bd_mmobj, d->s5jd_blocks[i])))
+                        memcpy(pf->pf_addr, buf, S5_BLOCK_SIZE);
+        }
+        dbg(DBG_S5FS, "s5_journal_replay: replayed transaction %u (%u blocks)\n",
+            d->s5jd_seq, n);
+
+empty:
+        d->s5jd_nblocks = 0;
+        return blockdev_write(bd, (char *)d, j->j_start);
+}
+
+int
+s5_journal_mount(s5fs_t *fs)
+{
+        s5_super_t *s = fs->s5f_super;
+        s5_journal_t *j;
+        proc_t *p;
+        int err;
+
+        fs->s5f_journal = NULL;
+        if (0 == s->s5s_journal_blocks)
+                return 0;
+        if (3 > s->s5s_journal_blocks)
+                return -EINVAL;
+
+        if (NULL == (j = (s5_journal_t *)kmalloc(sizeof(s5_journal_t))))
+                return -ENOMEM;
+        memset(j, 0, sizeof(s5_journal_t));
+        j->j_fs = fs;
+        j->j_start = s->s5s_journal_start;
+        j->j_max = MIN(s->s5s_journal_blocks - 2, S5_JOURNAL_MAX_BLOCKS);
+        sched_queue_init(&j->j_waitq);
+        sched_queue_init(&j->j_thrq);
+
+        err = -ENOMEM;
+        if (NULL == (j->j_blocks = (s5_jblock_t *)kmalloc(j->j_max * sizeof(s5_jblock_t)))
+            || NULL == (j->j_reqs = (blockdev_req_t *)kmalloc((j->j_max + 1) * sizeof(blockdev_req_t)))
+            || NULL == (j->j_desc = (s5_jdesc_t *)page_alloc())
+            || NULL == (j->j_commit = (s5_jcommit_t *)page_alloc()))
+                goto fail;
+
+        if (0 > (err = s5_journal_replay(j)))
+                goto fail;
+        memset(j->j_commit, 0, S5_BLOCK_SIZE);
+
+        p = proc_create("s5journald");
+        KASSERT(NULL != p);
+        j->j_thr = kthread_create(p, s5_journal_run, 0, j);
+        KASSERT(NULL != j->j_thr);
+        sched_make_runnable(j->j_thr);
+
+        fs->s5f_journal = j;
+        return 0;
+
+fail:
+        if (NULL != j->j_commit)
+                page_free(j->j_commit);
+        if (NULL != j->j_desc)
+                page_free(j->j_desc);
+        if (NULL != j->j_reqs)
+                kfree(j->j_reqs);
+        if (NULL != j->j_blocks)
+                kfree(j->j_blocks);
+        kfree(j);
+        return err;
+}
+
+void
+s5_journal_umount(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        pid_t pid, child;
+
+        if (NULL == j)
+                return;
+
+        /* s5journald is a child of whoever mounted the file system */
+        pid = j->j_thr->kt_proc->p_pid;
+        kthread_cancel(j->j_thr, (void *)0);
+        child = do_waitpid(pid, 0, NULL);
+        KASSERT(pid == child);
+
+        KASSERT(0 == j->j_handles && !j->j_committing);
+        s5_journal_commit(j);
+        fs->s5f_journal = NULL;
+
+        page_free(j->j_commit);
+        page_free(j->j_desc);
+        kfree(j->j_reqs);
+        kfree(j->j_blocks);
+        kfree(j);
+}
+
+void
+s5_journal_sync(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        uint32_t seq;
+
+        if (NULL == j)
+                return;
+
+        /* Nothing joins a transaction while it is being committed, so
+         * whatever we are after is in this one or an earlier one */
+        seq = j->j_seq;
+        while (seq == j->j_seq) {
+                if (j->j_committing) {
+                        sched_sleep_on(&j->j_waitq);
+                } else if (0 == j->j_nblocks) {
+                        break;
+                } else if (0 < j->j_handles) {
+                        /* the last operation in it commits it */
+                        j->j_want_commit = 1;
+                        sched_sleep_on(&j->j_waitq);
+                } else {
+                        s5_journal_commit(j);
+                }
+        }
+}
+
+void
+s5_journal_begin(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+
+        if (NULL == j)
+                return;
+
+        /* Joining operations which are still running never waits, the
+         * caller may be one of them */
+        while (0 == j->j_handles) {
+                if (j->j_committing)
+                        sched_sleep_on(&j->j_waitq);
+                else if (j->j_want_commit
+                         || j->j_nblocks + S5_JOURNAL_RESERVE > j->j_max)
+                        s5_journal_commit(j);
+                else
+                        break;
+        }
+        j->j_handles++;
+}
+
+void
+s5_journal_end(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+
+        if (NULL == j)
+                return;
+
+        KASSERT(0 < j->j_handles);
+        if (0 == --j->j_handles && j->j_want_commit)
+                s5_journal_commit(j);
+}
+
+void
+s5_journal_dirty(s5fs_t *fs, pframe_t *pf, uint32_t blockno)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        uint32_t i;
+
+        if (NULL == j || 0 == j->j_handles)
+                return;
+        KASSERT(!j->j_committing);
+
+        for (i = 0; i < j->j_nblocks; i++) {
+                if (j->j_blocks[i].jb_pf == pf)
+                        return;
+        }
+        if (j->j_nblocks == j->j_max) {
+                dbg(DBG_S5FS, "s5_journal_dirty: transaction %u is full, "
+                    "block %u goes unjournaled\n", j->j_seq, blockno);
+                return;
+        }
+
+        pframe_pin(pf);
+        j->j_blocks[j->j_nblocks].jb_pf = pf;
+        j->j_blocks[j->j_nblocks].jb_blockno = blockno;
+        if (1 == ++j->j_nblocks)
+                sched_wakeup_on(&j->j_thrq);
+}
+
+void
+s5_journal_forget(s5fs_t *fs, mmobj_t *obj)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        uint32_t i;
+
+        if (NULL == j)
+                return;
+
+        while (j->j_committing)
+                sched_sleep_on(&j->j_waitq);
+
+        for (i = 0; i < j->j_nblocks;) {
+                if (j->j_blocks[i].jb_pf->pf_obj == obj) {
+                        pframe_unpin(j->j_blocks[i].jb_pf);
+                        j->j_blocks[i] = j->j_blocks[--j->j_nblocks];
+                } else {
+                        i++;
+                }
+        }
+}
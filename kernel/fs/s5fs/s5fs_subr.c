@@ -6,6 +6,7 @@
  */
 
 #include "kernel.h"
+#include "config.h"
 #include "util/debug.h"
 #include "mm/kmalloc.h"
 #include "globals.h"
@@ -23,8 +24,10 @@
 #include "fs/vnode.h"
 #include "fs/s5fs/s5fs_subr.h"
 #include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
 #include "mm/mm.h"
 #include "mm/page.h"
+#include "api/access.h"
 
 #define dprintf(...) dbg(DBG_S5FS, __VA_ARGS__)
 #define S5_MAX_FILE_SIZE        S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE
@@ -39,13 +42,104 @@
                 KASSERT(!err                                         \
                         && "shouldn\'t fail for a page belonging "   \
                         "to a block device");                        \
+                s5_journal_dirty((fs), p, p->pf_pagenum);            \
         } while (0)
 
 
 static void s5_free_block(s5fs_t *fs, int block);
-static int s5_alloc_block(s5fs_t *);
+static int s5_alloc_block(s5fs_t *, uint32_t, int);
+static uint8_t s5_block_refs(s5fs_t *fs, uint32_t blockno);
 
 
+/*
+ * Returns the block number held in *slot. If it is 0 (sparse) and alloc
+ * is set, a block is allocated near goal and stored there first, and
+ * owner, or the inode if owner is NULL, is dirtied. A newly allocated
+ * index block is zeroed.
+ *
+ * With S5_ALLOC_UNSHARE, a data block shared with another file is
+ * replaced the same way, and the shared block loses a reference. Nothing
+ * is copied: the caller's page holds what the shared block does, and is
+ * about to be written to the new one.
+ *
+ * Returns the block number, 0 for a sparse slot when alloc is not set,
+ * or -errno.
+ */
+static int
+s5_slot_get(s5fs_t *fs, uint32_t *slot, pframe_t *owner, s5_inode_t *inode,
+            int alloc, uint32_t goal, int index)
+{
+    uint32_t shared = 0;
+
+    if (*slot && S5_ALLOC_UNSHARE == alloc && !index && s5_block_refs(fs, *slot)) {
+        shared = *slot;
+    } else if (*slot || !alloc) {
+        return (int)*slot;
+    }
+
+    int blocknum = s5_alloc_block(fs, goal, S5_ALLOC_RESERVED == alloc);
+    if (blocknum < 0) {
+        return blocknum;
+    }
+
+    if (index) {
+        pframe_t *pf;
+        /*give it a page in the block device cache, where index blocks live*/
+        int err = pframe_get(S5FS_TO_VMOBJ(fs), (uint32_t)blocknum, &pf);
+        if (err >= 0) {
+            memset(pf->pf_addr, 0, S5_BLOCK_SIZE);
+            if ((err = pframe_dirty(pf)) >= 0) {
+                s5_journal_dirty(fs, pf, (uint32_t)blocknum);
+            }
+        }
+        if (err < 0) {
+            s5_free_block(fs, blocknum);
+            return err;
+        }
+    }
+
+    *slot = (uint32_t)blocknum;
+    if (owner) {
+        int err = pframe_dirty(owner);
+        if (err < 0) {
+            *slot = shared;
+            s5_free_block(fs, blocknum);
+            return err;
+        }
+        s5_journal_dirty(fs, owner, owner->pf_pagenum);
+    } else {
+        s5_dirty_inode(fs, inode);
+    }
+    if (shared) {
+        s5_free_block(fs, (int)shared);
+    }
+    return blocknum;
+}
+
+/*
+ * Like s5_slot_get, for entry idx of the index block iblock. New blocks
+ * are placed after the previous entry's block, or after the index block
+ * itself.
+ */
+static int
+s5_index_entry(s5fs_t *fs, uint32_t iblock, uint32_t idx, int alloc, int index)
+{
+    pframe_t *ibp;
+    int err = pframe_get(S5FS_TO_VMOBJ(fs), iblock, &ibp);
+    if (err < 0) {
+        return err;
+    }
+
+    uint32_t *b = (uint32_t *)ibp->pf_addr;
+    uint32_t goal = (idx > 0 && b[idx - 1]) ? b[idx - 1] + 1 : iblock + 1;
+
+    /*allocating may block, keep the index block resident meanwhile*/
+    pframe_pin(ibp);
+    int ret = s5_slot_get(fs, &b[idx], ibp, NULL, alloc, goal, index);
+    pframe_unpin(ibp);
+    return ret;
+}
+
 /*
  * Return the disk-block number for the given seek pointer (aka file
  * position).
@@ -57,6 +151,11 @@ static int s5_alloc_block(s5fs_t *);
  *
  * Be sure to handle indirect blocks!
  *
+ * alloc may also be S5_ALLOC_RESERVED, when the caller holds blocks set
+ * aside by s5_reserve_block(); those are then used. With
+ * S5_ALLOC_UNSHARE, see s5_slot_get(), a block the file shares with
+ * another is replaced with one of its own.
+ *
  * If there is an error, return -errno.
  *
  * You probably want to use pframe_get, pframe_pin, pframe_unpin, pframe_dirty.
@@ -78,193 +177,220 @@ s5_seek_to_block(vnode_t *vnode, off_t seekptr, int alloc)
         return -EINVAL;
     }
 
-    int blocknum = 0;
     /*get the file's corresponding inode*/
     s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
 
     /*get the file system*/
     s5fs_t *fs = VNODE_TO_S5FS(vnode);
 
+    /*a small file's data is in the inode, there are no blocks to find*/
+    if (S5_INODE_INLINE(inode)) {
+        KASSERT(!alloc);
+        return 0;
+    }
+
     if (blocknum_file < S5_NDIRECT_BLOCKS) {
-        /*direct block*/
+        /*direct block: place it right after the file's previous block if we can*/
+        uint32_t goal = (blocknum_file > 0) ? inode->s5_direct_blocks[blocknum_file - 1] : 0;
+        return s5_slot_get(fs, &inode->s5_direct_blocks[blocknum_file], NULL, inode,
+                           alloc, goal ? goal + 1 : 0, 0);
+    }
 
-        /*get the actually block number on disk*/
-        blocknum = inode->s5_direct_blocks[blocknum_file];
-        if (blocknum == 0) {
-            /*sparse block*/
+    if (!((S5_TYPE_DATA == inode->s5_type)
+          || (S5_TYPE_DIR == inode->s5_type))) {
+        panic("file is corrupted: not a dir or file but have idirect blocks?\n");
+        return -EINVAL;
+    }
 
-            if (alloc == 0) {
+    /*the index past the direct blocks*/
+    uint32_t idx = blocknum_file - S5_NDIRECT_BLOCKS;
+    uint32_t goal = inode->s5_direct_blocks[S5_NDIRECT_BLOCKS - 1];
 
-                return 0;
-            } else {
+    if (idx < S5_NIDIRECT_BLOCKS) {
+        int ib = s5_slot_get(fs, &inode->s5_indirect_block, NULL, inode,
+                             alloc, goal ? goal + 1 : 0, 1);
+        if (ib <= 0) {
+            return ib;
+        }
+        return s5_index_entry(fs, (uint32_t)ib, idx, alloc, 0);
+    }
 
-                blocknum = s5_alloc_block(fs);
-                if (blocknum < 0) {
-                    return blocknum;
-                }
+    /*double indirect: an index block of indirect blocks*/
+    idx -= S5_NIDIRECT_BLOCKS;
+    int dib = s5_slot_get(fs, &inode->s5_dindirect_block, NULL, inode,
+                          alloc, 0, 1);
+    if (dib <= 0) {
+        return dib;
+    }
+    int ib = s5_index_entry(fs, (uint32_t)dib, idx / S5_NIDIRECT_BLOCKS, alloc, 1);
+    if (ib <= 0) {
+        return ib;
+    }
+    return s5_index_entry(fs, (uint32_t)ib, idx % S5_NIDIRECT_BLOCKS, alloc, 0);
+}
 
-                inode->s5_direct_blocks[blocknum_file] = blocknum;
-                s5_dirty_inode(fs, inode);
-                return blocknum;
-            }
-        } else {
-            /*not a sparse block*/
+/*
+ * Takes the block for seekptr out of the file, which reads as zeros
+ * there afterwards, and frees it, or drops the file's reference to it
+ * if it is shared with a clone. Index blocks are kept, even once they
+ * are empty. The caller has already seen to the file's page for the
+ * block, and holds a journal operation.
+ *
+ * Returns 0, also when the block is sparse already, or -errno.
+ */
+int
+s5_punch_block(vnode_t *vnode, off_t seekptr)
+{
+    s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+    s5fs_t *fs = VNODE_TO_S5FS(vnode);
+    uint32_t blocknum_file = S5_DATA_BLOCK(seekptr);
+    uint32_t blocknum = 0;
+    int err = 0;
+
+    KASSERT(!S5_INODE_INLINE(inode));
+    if (seekptr < 0 || blocknum_file >= S5_MAX_FILE_BLOCKS) {
+        return -EINVAL;
+    }
 
-            return blocknum;
+    /*the mapping changes, as it does when a block is given*/
+    kmutex_lock(&fs->s5f_alloc_mutex);
+
+    if (blocknum_file < S5_NDIRECT_BLOCKS) {
+        blocknum = inode->s5_direct_blocks[blocknum_file];
+        if (blocknum) {
+            inode->s5_direct_blocks[blocknum_file] = 0;
+            s5_dirty_inode(fs, inode);
         }
+        goto out;
+    }
+
+    uint32_t idx = blocknum_file - S5_NDIRECT_BLOCKS;
+    int ib;
+    if (idx < S5_NIDIRECT_BLOCKS) {
+        ib = (int)inode->s5_indirect_block;
     } else {
-        /*indirect block*/
-
-        /*not sure about check here*/
-        if (((S5_TYPE_DATA == inode->s5_type)
-             || (S5_TYPE_DIR == inode->s5_type))) {
-            /*the index in indirect blocks*/
-            uint32_t blocknum_indirect = blocknum_file - S5_NDIRECT_BLOCKS;
-
-            if (inode->s5_indirect_block) {
-                /*indirect block points to a block*/
-                pframe_t *ibp;
-                uint32_t *b;
-
-                /*get the page frame*/
-                pframe_get(S5FS_TO_VMOBJ(fs),
-                           (inode->s5_indirect_block),
-                           &ibp);
-
-                b = (uint32_t *)(ibp->pf_addr);
-                /*the block number on device*/
-                blocknum = b[blocknum_indirect];
-
-                if (blocknum == 0) {
-                    /*sparse block*/
-                    if (alloc == 0) {
-                        return 0;
-                    } else {
-                        pframe_pin(ibp);
-                        blocknum = s5_alloc_block(fs);
-                        pframe_unpin(ibp);
-
-                        if (blocknum < 0) {
-                            return blocknum;
-                        } else {
-                            /*store it back in the indirect blocks array*/
-                            b[blocknum_indirect] = blocknum;
-
-                            pframe_pin(ibp);
-                            /*since indirect block is modified, dirty it*/
-                            int err = pframe_dirty(ibp);
-                            pframe_unpin(ibp);
-                            if (err < 0) {
-                                return err;
-                            }
-
-                            return blocknum;
-                        }
-                    }
-                } else {
-                    return blocknum;
-                }
-            } else {
-                if (alloc == 0) {
-                    dprintf("no need to allocate, just return 0\n");
-                    return 0;
-                } else {
-                    /*allocate the block for indirect block first*/
-                    int indirect_block = s5_alloc_block(fs);
-                    if (indirect_block < 0) {
-                        dprintf("some error occured during s5_alloc_block, error number is %d\n", indirect_block);
-                        return indirect_block;
-                    }
-
-                    mmobj_t *o = S5FS_TO_VMOBJ(fs);
-                    
-                    pframe_t *ibp = NULL;
-                    /*load the page frame for indirect block*/
-                    int err = pframe_get(o, (uint32_t)indirect_block, &ibp);
-                    if (err < 0) {
-                        s5_free_block(fs, (uint32_t)indirect_block);
-                        panic("it should never fail for block_device vm_obj\n");
-                        return err;
-                    }
-
-                    /*get the pointer to indirect blocks array*/
-                    uint32_t *b = (uint32_t*)(ibp->pf_addr);
-                    memset(b, 0, S5_BLOCK_SIZE);
-
-                    pframe_pin(ibp);
-                    /*allocate the block for the real data*/
-                    blocknum = s5_alloc_block(fs);
-                    /*also dirty the ibp because memsetting it*/
-                    err = pframe_dirty(ibp);
-                    pframe_unpin(ibp);
-
-                    if (blocknum < 0) {
-                        /*not sure about free the pframe*/
-                        /*pframe_free(ibp);*/
-                        s5_free_block(fs, (uint32_t)indirect_block);
-                        return blocknum;
-                    }
-
-                    if (err < 0) {
-                        /*
-                         *I free the pframe here because I've already dirty it
-                         */
-                        /*not sure about free the pframe*/
-                        /*pframe_free(ibp);*/
-                        s5_free_block(fs, (uint32_t)indirect_block);
-                        s5_free_block(fs, (uint32_t)blocknum);
-                        return err;
-                    }
-
-                    /*update the indirect block number*/
-                    inode->s5_indirect_block = (uint32_t)indirect_block;
-                    /*update the block number in indirect block*/
-                    b[blocknum_indirect] = blocknum;
-
-                    pframe_pin(ibp);
-                    /*dirty the page for indirect block*/
-                    err = pframe_dirty(ibp);
-                    /*dirty the inode*/
-                    s5_dirty_inode(fs, inode);
-                    pframe_unpin(ibp);
-                    if (err < 0) {
-                        inode->s5_indirect_block = 0;
-                        s5_dirty_inode(fs, inode);
-                        /*pframe_free(ibp);*/
-                        s5_free_block(fs, (uint32_t)indirect_block);
-                        s5_free_block(fs, (uint32_t)blocknum);
-                        return err;
-                    }
+        idx -= S5_NIDIRECT_BLOCKS;
+        ib = 0;
+        if (inode->s5_dindirect_block) {
+            ib = s5_index_entry(fs, inode->s5_dindirect_block,
+                                idx / S5_NIDIRECT_BLOCKS, 0, 1);
+        }
+        idx %= S5_NIDIRECT_BLOCKS;
+    }
+    if (ib <= 0) {
+        err = ib;
+        goto out;
+    }
 
-                    return blocknum;
-                }
-            }
-        } else {
-            panic("file is corrupted: not a dir or file but have idirect blocks?\n");
-            return -EINVAL;
+    pframe_t *ibp;
+    if ((err = pframe_get(S5FS_TO_VMOBJ(fs), (uint32_t)ib, &ibp)) < 0) {
+        goto out;
+    }
+    uint32_t *b = (uint32_t *)ibp->pf_addr;
+    if (0 != (blocknum = b[idx])) {
+        b[idx] = 0;
+        if ((err = pframe_dirty(ibp)) < 0) {
+            b[idx] = blocknum;
+            blocknum = 0;
+            goto out;
         }
+        s5_journal_dirty(fs, ibp, (uint32_t)ib);
     }
+
+out:
+    if (blocknum) {
+        s5_free_block(fs, (int)blocknum);
+    }
+    kmutex_unlock(&fs->s5f_alloc_mutex);
+    return err;
 }
 
 
 /*
- * Locks the mutex for the whole file system
+ * Locks the mutex for the file system's free blocks: the free list, the
+ * free count and what is reserved of them
  */
 static void
-lock_s5(s5fs_t *fs)
+lock_s5_blocks(s5fs_t *fs)
 {
-        kmutex_lock(&fs->s5f_mutex);
+        kmutex_lock(&fs->s5f_block_mutex);
 }
 
 /*
- * Unlocks the mutex for the whole file system
+ * Unlocks the mutex for the file system's free blocks
  */
 static void
-unlock_s5(s5fs_t *fs)
+unlock_s5_blocks(s5fs_t *fs)
 {
-        kmutex_unlock(&fs->s5f_mutex);
+        kmutex_unlock(&fs->s5f_block_mutex);
 }
 
+/*
+ * Locks the mutex for the file system's free inode list, which is kept
+ * apart from the blocks' so that neither has to wait for the other
+ */
+static void
+lock_s5_inodes(s5fs_t *fs)
+{
+        kmutex_lock(&fs->s5f_inode_mutex);
+}
+
+/*
+ * Unlocks the mutex for the file system's free inode list
+ */
+static void
+unlock_s5_inodes(s5fs_t *fs)
+{
+        kmutex_unlock(&fs->s5f_inode_mutex);
+}
+
+
+/*
+ * Moves the data of an inline file, which is to grow to size bytes, out
+ * of the inode and into page 0 of the file. The page is dirtied, and so
+ * gets a block like any other when it is written back.
+ */
+int
+s5_uninline(vnode_t *vnode, uint32_t size)
+{
+    s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+    s5fs_t *fs = VNODE_TO_S5FS(vnode);
+    uint32_t oldsize = inode->s5_size;
+    pframe_t *pf = NULL;
+    int err;
+
+    KASSERT(S5_INODE_INLINE(inode) && size > S5_INLINE_SIZE);
+
+    if (oldsize > 0) {
+        /*filled from the inode; anything written since goes back first*/
+        if ((err = pframe_get(&vnode->vn_mmobj, 0, &pf)) < 0) {
+            return err;
+        }
+        if (pframe_is_dirty(pf) && (err = pframe_clean(pf)) < 0) {
+            return err;
+        }
+        pframe_pin(pf);
+    }
+
+    memset(inode->s5_direct_blocks, 0, S5_INLINE_SIZE);
+    inode->s5_size = size;
+    vnode->vn_len = size;
+    s5_dirty_inode(fs, inode);
+
+    if (pf) {
+        if ((err = pframe_dirty(pf)) < 0) {
+            memcpy(inode->s5_direct_blocks, pf->pf_addr, S5_INLINE_SIZE);
+            inode->s5_size = oldsize;
+            vnode->vn_len = oldsize;
+        }
+        pframe_unpin(pf);
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
 
 /*
  * Write len bytes to the given inode, starting at seek bytes from the
@@ -285,9 +411,12 @@ unlock_s5(s5fs_t *fs)
  * call to s5_seek_to_block().
  *
  * You will need pframe_dirty(), pframe_get(), memcpy().
+ *
+ * If user is set, bytes is in the current process's user space and is
+ * copied straight into the file's pages with copy_from_user().
  */
-int
-s5_write_file(vnode_t *vnode, off_t seek, const char *bytes, size_t len)
+static int
+s5_write(vnode_t *vnode, off_t seek, const char *bytes, size_t len, int user)
 {
     s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
 
@@ -310,71 +439,45 @@ s5_write_file(vnode_t *vnode, off_t seek, const char *bytes, size_t len)
     /*get the offset inside block*/
     off_t offset_start = S5_DATA_OFFSET(seek);
     off_t offset_end = S5_DATA_OFFSET(end);
-    
-    /*write to only one block*/
-    if (block_start == block_end) {
-        pframe_t *block_pframe = NULL;
-        int err = pframe_get(&vnode->vn_mmobj, block_start, &block_pframe);
-        if (err < 0) {
-            return err;
-        }
 
-        char *pf_off = (char *)block_pframe->pf_addr + offset_start;
-        memcpy(pf_off, bytes, len);
-
-        err = pframe_dirty(block_pframe);
+    if (S5_INODE_INLINE(inode) && (unsigned)end >= S5_INLINE_SIZE) {
+        int err = s5_uninline(vnode, (uint32_t)end + 1);
         if (err < 0) {
             return err;
         }
-
-        off_t file_length = end + 1;
-        if (file_length > vnode->vn_len) {
-            /*update len in vnode*/
-            vnode->vn_len = file_length;
-            /*update size in s5_inode*/
-            inode->s5_size = (uint32_t)file_length;
-        }
-        /*dirty the inode*/
-        s5_dirty_inode(VNODE_TO_S5FS(vnode), inode);
-
-        return len;
-    }
-
-    /*write to the start block*/
-    pframe_t *block_pframe = NULL;
-    int err = pframe_get(&vnode->vn_mmobj, block_start, &block_pframe);
-    if (err < 0) {
-        return err;
     }
 
-    char *pf_off = (char *)block_pframe->pf_addr + offset_start;
-    memcpy(pf_off, bytes, (S5_BLOCK_SIZE - offset_start));
-    err = pframe_dirty(block_pframe);
-    if (err < 0) {
-        return err;
-    }
-    bytes += S5_BLOCK_SIZE - offset_start;
-
-    /*write to blocks till end between*/
-    uint32_t i;
-    for (i = block_start + 1 ; i <= block_end ; i++) {
-        pframe_t *cur_pframe = NULL;
-        err = pframe_get(&vnode->vn_mmobj, i, &cur_pframe);
+    /*write the blocks in batches, each one brought in and pinned at once*/
+    pframe_t *pfs[PFRAME_RANGE_MAX];
+    uint32_t block = block_start;
+    while (block <= block_end) {
+        uint32_t n = MIN(block_end - block + 1, PFRAME_RANGE_MAX);
+        int err = pframe_get_range(&vnode->vn_mmobj, block, n, pfs);
         if (err < 0) {
-            KASSERT(cur_pframe == NULL);
             return err;
         }
 
-        if (i != block_end) {
-            memcpy(cur_pframe->pf_addr, bytes, S5_BLOCK_SIZE);
-            bytes += S5_BLOCK_SIZE;
-        } else {
-            memcpy(cur_pframe->pf_addr, bytes, offset_end + 1);
-        }
-        err = pframe_dirty(cur_pframe);
-        if (err < 0) {
-            return err;
+        uint32_t i;
+        for (i = 0; i < n; i++, block++) {
+            off_t from = (block == block_start) ? offset_start : 0;
+            off_t to = (block == block_end) ? offset_end + 1 : S5_BLOCK_SIZE;
+
+            if (user) {
+                err = copy_from_user((char *)pfs[i]->pf_addr + from, bytes, to - from);
+                if (err < 0) {
+                    pframe_unpin_range(pfs, n);
+                    return err;
+                }
+            } else {
+                memcpy((char *)pfs[i]->pf_addr + from, bytes, to - from);
+            }
+            bytes += to - from;
+            if ((err = pframe_dirty(pfs[i])) < 0) {
+                pframe_unpin_range(pfs, n);
+                return err;
+            }
         }
+        pframe_unpin_range(pfs, n);
     }
 
     off_t file_length = end + 1;
@@ -390,6 +493,18 @@ s5_write_file(vnode_t *vnode, off_t seek, const char *bytes, size_t len)
     return len;
 }
 
+int
+s5_write_file(vnode_t *vnode, off_t seek, const char *bytes, size_t len)
+{
+    return s5_write(vnode, seek, bytes, len, 0);
+}
+
+int
+s5_write_file_user(vnode_t *vnode, off_t seek, const char *ubytes, size_t len)
+{
+    return s5_write(vnode, seek, ubytes, len, 1);
+}
+
 /*
  * Read up to len bytes from the given inode, starting at seek bytes
  * from the beginning of the inode. On success, return the number of
@@ -409,9 +524,12 @@ s5_write_file(vnode_t *vnode, off_t seek, const char *bytes, size_t len)
  * data will be read than was requested.
  *
  * You probably want to use pframe_get(), memcpy().
+ *
+ * If user is set, dest is in the current process's user space and the
+ * file's pages are copied straight into it with copy_to_user().
  */
-int
-s5_read_file(struct vnode *vnode, off_t seek, char *dest, size_t len)
+static int
+s5_read(struct vnode *vnode, off_t seek, char *dest, size_t len, int user)
 {
     s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
 
@@ -437,51 +555,53 @@ s5_read_file(struct vnode *vnode, off_t seek, char *dest, size_t len)
     off_t offset_start = S5_DATA_OFFSET(seek);
     off_t offset_end = S5_DATA_OFFSET(end);
     
-    if (block_start == block_end) {
-        pframe_t *block_pframe = NULL;
-        int err = pframe_get(&vnode->vn_mmobj, block_start, &block_pframe);
-        if (err < 0) {
-            KASSERT(block_pframe == NULL);
-            return err;
-        }
-
-        char *pf_off = (char *)block_pframe->pf_addr + offset_start;
-        memcpy(dest, pf_off, len);
-
-        return len;
-    }
-
-    /*read the start block*/
-    pframe_t *block_pframe = NULL;
-    int err = pframe_get(&vnode->vn_mmobj, block_start, &block_pframe);
-    if (err < 0) {
-        return err;
-    }
-
-    char *pf_off = (char *)block_pframe + offset_start;
-    memcpy(dest, pf_off, (S5_BLOCK_SIZE - offset_start));
-    dest += S5_BLOCK_SIZE - offset_start;
-
-    /*read blocks till end*/
-    uint32_t i;
-    for (i = block_start + 1 ; i <= block_end ; i++) {
-        pframe_t *cur_pframe = NULL;
-        err = pframe_get(&vnode->vn_mmobj, i, &cur_pframe);
+    /*start fetching this and the following blocks if we are scanning*/
+    vnode_readahead(vnode, block_start, block_end - block_start + 1);
+
+    /*read the blocks in batches, each one brought in and pinned at once*/
+    pframe_t *pfs[PFRAME_RANGE_MAX];
+    uint32_t block = block_start;
+    while (block <= block_end) {
+        uint32_t n = MIN(block_end - block + 1, PFRAME_RANGE_MAX);
+        int err = pframe_get_range(&vnode->vn_mmobj, block, n, pfs);
         if (err < 0) {
             return err;
         }
 
-        if (i != block_end) {
-            memcpy(dest, cur_pframe->pf_addr, S5_BLOCK_SIZE);
-            dest += S5_BLOCK_SIZE;
-        } else {
-            memcpy(dest, cur_pframe->pf_addr, offset_end + 1);
+        uint32_t i;
+        for (i = 0; i < n; i++, block++) {
+            off_t from = (block == block_start) ? offset_start : 0;
+            off_t to = (block == block_end) ? offset_end + 1 : S5_BLOCK_SIZE;
+
+            if (user) {
+                err = copy_to_user(dest, (char *)pfs[i]->pf_addr + from, to - from);
+                if (err < 0) {
+                    pframe_unpin_range(pfs, n);
+                    return err;
+                }
+            } else {
+                memcpy(dest, (char *)pfs[i]->pf_addr + from, to - from);
+            }
+            dest += to - from;
         }
+        pframe_unpin_range(pfs, n);
     }
 
     return len;
 }
 
+int
+s5_read_file(struct vnode *vnode, off_t seek, char *dest, size_t len)
+{
+    return s5_read(vnode, seek, dest, len, 0);
+}
+
+int
+s5_read_file_user(struct vnode *vnode, off_t seek, char *udest, size_t len)
+{
+    return s5_read(vnode, seek, udest, len, 1);
+}
+
 /*
  * Allocate a new disk-block off the block free list and return it. If
  * there are no free blocks, return -ENOSPC.
@@ -496,18 +616,31 @@ s5_read_file(struct vnode *vnode, off_t seek, char *dest, size_t len)
  *
  * Don't forget to dirty the appropriate blocks!
  *
- * You'll probably want to use lock_s5(), unlock_s5(), pframe_get(),
+ * You'll probably want to use lock_s5_blocks(), unlock_s5_blocks(), pframe_get(),
  * and s5_dirty_super()
+ *
+ * goal is the block the caller would like, normally the one after the
+ * file's previous block, or 0 for no preference. It is taken if it is
+ * among the free blocks held in the superblock; otherwise the lowest of
+ * those is, since a fresh free list holds ascending runs and the lowest
+ * block has the most free blocks after it.
+ *
+ * The blocks s5_reserve_block() has set aside are only handed out if
+ * reserved is set.
  */
 static int
-s5_alloc_block(s5fs_t *fs)
+s5_alloc_block(s5fs_t *fs, uint32_t goal, int reserved)
 {
     s5_super_t *s = fs->s5f_super;
 
-    lock_s5(fs);
+    lock_s5_blocks(fs);
 
     if (s->s5s_nfree == 0 && s->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1] == (uint32_t) -1) {
-        unlock_s5(fs);
+        unlock_s5_blocks(fs);
+        return -ENOSPC;
+    }
+    if (!reserved && s->s5s_free_count <= fs->s5f_reserved) {
+        unlock_s5_blocks(fs);
         return -ENOSPC;
     }
 
@@ -528,12 +661,25 @@ s5_alloc_block(s5fs_t *fs)
 
         s->s5s_nfree = S5_NBLKS_PER_FNODE - 1;
     } else {
-        blocknum = s->s5s_free_blocks[--(s->s5s_nfree)];
+        uint32_t i, pick = s->s5s_nfree - 1;
+        for (i = 0; i < s->s5s_nfree; i++) {
+            if (s->s5s_free_blocks[i] == goal) {
+                pick = i;
+                break;
+            }
+            if (s->s5s_free_blocks[i] < s->s5s_free_blocks[pick]) {
+                pick = i;
+            }
+        }
+        /*move it to the top of the stack and pop it*/
+        blocknum = s->s5s_free_blocks[pick];
+        s->s5s_free_blocks[pick] = s->s5s_free_blocks[--(s->s5s_nfree)];
     }
+    s->s5s_free_count--;
 
     s5_dirty_super(fs);
 
-    unlock_s5(fs);
+    unlock_s5_blocks(fs);
 
     return blocknum;
         /*NOT_YET_IMPLEMENTED("S5FS: s5_alloc_block");*/
@@ -541,6 +687,64 @@ s5_alloc_block(s5fs_t *fs)
 }
 
 
+/*
+ * The block reference counts: s5_block_ref() finds blockno's, in the
+ * page it returns through pfp. They are changed with the free block
+ * lock held, and the page dirtied with s5_dirty_refs().
+ */
+static uint8_t *
+s5_block_ref(s5fs_t *fs, uint32_t blockno, pframe_t **pfp)
+{
+        KASSERT(blockno < fs->s5f_super->s5s_num_blocks);
+        pframe_get(S5FS_TO_VMOBJ(fs),
+                   fs->s5f_super->s5s_refs_start + blockno / S5_BLOCK_SIZE, pfp);
+        KASSERT(*pfp
+                && "because never fails for block_device "
+                "vm_objects");
+        return (uint8_t *)(*pfp)->pf_addr + blockno % S5_BLOCK_SIZE;
+}
+
+static void
+s5_dirty_refs(s5fs_t *fs, pframe_t *pf)
+{
+        int err = pframe_dirty(pf);
+        KASSERT(!err
+                && "shouldn\'t fail for a page belonging "
+                "to a block device");
+        s5_journal_dirty(fs, pf, pf->pf_pagenum);
+}
+
+/* How many files share blockno beyond the first */
+static uint8_t
+s5_block_refs(s5fs_t *fs, uint32_t blockno)
+{
+        pframe_t *pf;
+        return *s5_block_ref(fs, blockno, &pf);
+}
+
+/*
+ * Gives the caller another reference to blockno, or returns -EMLINK if
+ * it has as many as it can hold.
+ */
+static int
+s5_share_block(s5fs_t *fs, uint32_t blockno)
+{
+        pframe_t *pf;
+        uint8_t *ref;
+        int ret = 0;
+
+        lock_s5_blocks(fs);
+        ref = s5_block_ref(fs, blockno, &pf);
+        if (S5_REFS_MAX == *ref) {
+                ret = -EMLINK;
+        } else {
+                (*ref)++;
+                s5_dirty_refs(fs, pf);
+        }
+        unlock_s5_blocks(fs);
+        return ret;
+}
+
 /*
  * Given a filesystem and a block number, frees the given block in the
  * filesystem.
@@ -549,14 +753,27 @@ s5_alloc_block(s5fs_t *fs)
  *
  * The caller is responsible for ensuring that the block being placed on
  * the free list is actually free and is not resident.
+ *
+ * A block shared with other files only loses a reference, which the
+ * caller had.
  */
 static void
 s5_free_block(s5fs_t *fs, int blockno)
 {
         s5_super_t *s = fs->s5f_super;
+        pframe_t *refp;
+        uint8_t *ref;
+
 
+        lock_s5_blocks(fs);
 
-        lock_s5(fs);
+        ref = s5_block_ref(fs, (uint32_t)blockno, &refp);
+        if (*ref) {
+                (*ref)--;
+                s5_dirty_refs(fs, refp);
+                unlock_s5_blocks(fs);
+                return;
+        }
 
         KASSERT(S5_NBLKS_PER_FNODE > s->s5s_nfree);
 
@@ -571,6 +788,7 @@ s5_free_block(s5fs_t *fs, int blockno)
                 memcpy(prev_free_blocks->pf_addr, (void *)(s->s5s_free_blocks),
                        S5_NBLKS_PER_FNODE * sizeof(int));
                 pframe_dirty(prev_free_blocks);
+                s5_journal_dirty(fs, prev_free_blocks, blockno);
 
                 /* reset s->s5s_nfree and s->s5s_free_blocks */
                 s->s5s_nfree = 0;
@@ -578,54 +796,257 @@ s5_free_block(s5fs_t *fs, int blockno)
         } else {
                 s->s5s_free_blocks[s->s5s_nfree++] = blockno;
         }
+        s->s5s_free_count++;
 
         s5_dirty_super(fs);
 
-        unlock_s5(fs);
+        unlock_s5_blocks(fs);
 }
 
 /*
- * Creates a new inode from the free list and initializes its fields.
- * Uses S5_INODE_BLOCK to get the page from which to create the inode
+ * The most blocks giving the page at seekptr a block can take: its own,
+ * plus the index blocks above it if none of them exist yet.
+ */
+static uint32_t
+s5_reserve_cost(off_t seekptr)
+{
+    uint32_t blocknum_file = S5_DATA_BLOCK(seekptr);
+
+    if (blocknum_file < S5_NDIRECT_BLOCKS) {
+        return 1;
+    } else if (blocknum_file < S5_NDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS) {
+        return 2;
+    }
+    return 3;
+}
+
+/*
+ * Sets aside enough free blocks to give the page at seekptr a block
+ * later, at writeback, with s5_seek_to_block(..., S5_ALLOC_RESERVED).
+ *
+ * Returns 0 on success, -ENOSPC if there are not enough free blocks left.
+ */
+int
+s5_reserve_block(vnode_t *vnode, off_t seekptr)
+{
+    s5fs_t *fs = VNODE_TO_S5FS(vnode);
+    uint32_t cost = s5_reserve_cost(seekptr);
+    int ret = -ENOSPC;
+
+    lock_s5_blocks(fs);
+    if (fs->s5f_super->s5s_free_count >= fs->s5f_reserved + cost) {
+        fs->s5f_reserved += cost;
+        ret = 0;
+    }
+    unlock_s5_blocks(fs);
+
+    return ret;
+}
+
+/*
+ * Gives back what s5_reserve_block() set aside for seekptr, once the
+ * page has its block or is thrown away.
+ */
+void
+s5_unreserve_block(vnode_t *vnode, off_t seekptr)
+{
+    s5fs_t *fs = VNODE_TO_S5FS(vnode);
+    uint32_t cost = s5_reserve_cost(seekptr);
+
+    lock_s5_blocks(fs);
+    KASSERT(fs->s5f_reserved >= cost);
+    fs->s5f_reserved -= cost;
+    unlock_s5_blocks(fs);
+}
+
+/*
+ * Returns the block of the file at seekptr like s5_seek_to_block(),
+ * but first gives the file a block of its own there if it shares that
+ * one with another file, for a page about to be written back to it.
+ *
+ * Returns the block number, 0 for a hole, or -errno.
+ */
+int
+s5_unshare_block(vnode_t *vnode, off_t seekptr)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        int blocknum = s5_seek_to_block(vnode, seekptr, 0);
+
+        if (blocknum <= 0 || !s5_block_refs(fs, (uint32_t)blocknum))
+                return blocknum;
+
+        /* this may come from a fault on a shared mapping, outside of any
+         * operation */
+        kmutex_lock(&fs->s5f_alloc_mutex);
+        s5_journal_begin(fs);
+        blocknum = s5_seek_to_block(vnode, seekptr, S5_ALLOC_UNSHARE);
+        s5_journal_end(fs);
+        kmutex_unlock(&fs->s5f_alloc_mutex);
+        return blocknum;
+}
+
+/*
+ * The inode bitmap: s5_imap_byte() finds the byte holding inode ino's
+ * bit, in the page it returns through pfp.
+ */
+static uint8_t *
+s5_imap_byte(s5fs_t *fs, uint32_t ino, pframe_t **pfp)
+{
+        pframe_get(S5FS_TO_VMOBJ(fs),
+                   fs->s5f_super->s5s_imap_start + ino / S5_IMAP_BITS, pfp);
+        KASSERT(*pfp
+                && "because never fails for block_device "
+                "vm_objects");
+        return (uint8_t *)(*pfp)->pf_addr + (ino % S5_IMAP_BITS) / 8;
+}
+
+static void
+s5_imap_set(s5fs_t *fs, uint32_t ino, int used)
+{
+        pframe_t *pf;
+        uint8_t *b = s5_imap_byte(fs, ino, &pf);
+        uint8_t bit = 1 << (ino % 8);
+        int err;
+
+        KASSERT(!(*b & bit) == !!used);
+        if (used)
+                *b |= bit;
+        else
+                *b &= ~bit;
+        err = pframe_dirty(pf);
+        KASSERT(!err
+                && "shouldn\'t fail for a page belonging "
+                "to a block device");
+        s5_journal_dirty(fs, pf, pf->pf_pagenum);
+}
+
+/*
+ * Returns the first free inode in [from, to), a byte of the bitmap at a
+ * time, or -1 if there is none there.
+ */
+static int
+s5_imap_find(s5fs_t *fs, uint32_t from, uint32_t to)
+{
+        pframe_t *pf = NULL;
+        uint8_t *b = NULL;
+        uint32_t ino = from;
+
+        while (ino < to) {
+                if (NULL == pf || 0 == ino % S5_IMAP_BITS)
+                        b = s5_imap_byte(fs, ino, &pf);
+                else if (0 == ino % 8)
+                        b++;
+                if (0 == ino % 8 && 0xff == *b) {
+                        ino += 8;
+                        continue;
+                }
+                if (!(*b & (1 << (ino % 8))))
+                        return ino;
+                ino++;
+        }
+        return -1;
+}
+
+/* Counts the free inodes in [from, to) */
+static uint32_t
+s5_imap_count(s5fs_t *fs, uint32_t from, uint32_t to)
+{
+        pframe_t *pf = NULL;
+        uint8_t *b = NULL;
+        uint32_t ino, count = 0;
+
+        for (ino = from; ino < to; ino++) {
+                if (NULL == pf || 0 == ino % S5_IMAP_BITS)
+                        b = s5_imap_byte(fs, ino, &pf);
+                else if (0 == ino % 8)
+                        b++;
+                if (!(*b & (1 << (ino % 8))))
+                        count++;
+        }
+        return count;
+}
+
+/*
+ * Picks where a new inode goes. A file or device goes as near its
+ * directory as it can, from the start of the directory's inode block
+ * on, so that listing the directory and stat-ing what is in it reads
+ * few inode blocks. A directory goes at the start of whichever group
+ * has the most free inodes, looking at the parent's group first, so
+ * that directories spread out and each has room for its files nearby.
+ */
+static uint32_t
+s5_inode_goal(s5fs_t *fs, uint16_t type, ino_t parent)
+{
+        uint32_t ninodes = fs->s5f_super->s5s_num_inodes;
+        uint32_t ngroups = (ninodes - 1) / S5_IGROUP_INODES + 1;
+        uint32_t g, first, best = 0, best_free = 0;
+
+        if (parent >= ninodes)
+                parent = 0;
+        if (S5_TYPE_DIR != type)
+                return parent - parent % S5_INODES_PER_BLOCK;
+
+        first = parent / S5_IGROUP_INODES;
+        for (g = 0; g < ngroups; g++) {
+                uint32_t grp = (first + g) % ngroups;
+                uint32_t start = grp * S5_IGROUP_INODES;
+                uint32_t end = MIN(start + S5_IGROUP_INODES, ninodes);
+                uint32_t nfree = s5_imap_count(fs, start, end);
+                if (nfree > best_free) {
+                        best = start;
+                        best_free = nfree;
+                }
+        }
+        return best;
+}
+
+/*
+ * Creates a new inode and initializes its fields. The first free inode
+ * in the bitmap at or after the goal s5_inode_goal() picks for a child
+ * of parent is taken, wrapping around to the start if need be, and only
+ * the block that inode is in is read.
  *
  * This function may block.
  */
 int
-s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid)
+s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid, ino_t parent)
 {
         s5fs_t *s5fs = FS_TO_S5FS(fs);
         pframe_t *inodep;
         s5_inode_t *inode;
+        uint32_t goal;
         int ret = -1;
 
         KASSERT((S5_TYPE_DATA == type)
                 || (S5_TYPE_DIR == type)
                 || (S5_TYPE_CHR == type)
-                || (S5_TYPE_BLK == type));
+                || (S5_TYPE_BLK == type)
+                || (S5_TYPE_SOCK == type));
 
 
-        lock_s5(s5fs);
+        lock_s5_inodes(s5fs);
 
-        if (s5fs->s5f_super->s5s_free_inode == (uint32_t) -1) {
-                unlock_s5(s5fs);
+        if (0 == s5fs->s5f_super->s5s_free_inodes) {
+                unlock_s5_inodes(s5fs);
                 return -ENOSPC;
         }
 
-        pframe_get(&s5fs->s5f_bdev->bd_mmobj,
-                   S5_INODE_BLOCK(s5fs->s5f_super->s5s_free_inode),
-                   &inodep);
-        KASSERT(inodep);
+        goal = s5_inode_goal(s5fs, type, parent);
+        if (0 > (ret = s5_imap_find(s5fs, goal, s5fs->s5f_super->s5s_num_inodes)))
+                ret = s5_imap_find(s5fs, 0, goal);
+        KASSERT(0 <= ret && "s5s_free_inodes disagrees with the bitmap");
 
-        inode = (s5_inode_t *)(inodep->pf_addr)
-                + S5_INODE_OFFSET(s5fs->s5f_super->s5s_free_inode);
+        pframe_get(&s5fs->s5f_bdev->bd_mmobj, S5_INODE_BLOCK(ret), &inodep);
+        KASSERT(inodep);
 
-        KASSERT(inode->s5_number == s5fs->s5f_super->s5s_free_inode);
+        inode = (s5_inode_t *)(inodep->pf_addr) + S5_INODE_OFFSET(ret);
 
-        ret = inode->s5_number;
+        KASSERT(inode->s5_number == (uint32_t)ret);
+        KASSERT(S5_TYPE_FREE == inode->s5_type);
 
-        /* reset s5s_free_inode; remove the inode from the inode free list: */
-        s5fs->s5f_super->s5s_free_inode = inode->s5_next_free;
         pframe_pin(inodep);
+        s5_imap_set(s5fs, ret, 1);
+        s5fs->s5f_super->s5s_free_inodes--;
         s5_dirty_super(s5fs);
         pframe_unpin(inodep);
 
@@ -640,18 +1061,116 @@ s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid)
                 inode->s5_indirect_block = devid;
         else
                 inode->s5_indirect_block = 0;
+        inode->s5_dindirect_block = 0;
 
         s5_dirty_inode(s5fs, inode);
 
-        unlock_s5(s5fs);
+        unlock_s5_inodes(s5fs);
 
         return ret;
 }
 
 
 /*
- * Free an inode by freeing its disk blocks and putting it back on the
- * inode free list.
+ * Frees an index block and every block it points to. depth is 1 for an
+ * indirect block, 2 for a double-indirect block.
+ */
+static void
+s5_free_index(s5fs_t *fs, uint32_t iblock, int depth)
+{
+        pframe_t *ibp;
+        uint32_t *b;
+        uint32_t i;
+
+        pframe_get(S5FS_TO_VMOBJ(fs), iblock, &ibp);
+        KASSERT(ibp
+                && "because never fails for block_device "
+                "vm_objects");
+        pframe_pin(ibp);
+
+        b = (uint32_t *)(ibp->pf_addr);
+        for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
+                KASSERT(b[i] != iblock);
+                if (!b[i])
+                        continue;
+                if (depth > 1)
+                        s5_free_index(fs, b[i], depth - 1);
+                else
+                        s5_free_block(fs, b[i]);
+        }
+
+        pframe_unpin(ibp);
+
+        s5_free_block(fs, iblock);
+}
+
+/*
+ * Counts an index block and the blocks it points to, see s5_free_index.
+ */
+static int
+s5_count_index(s5fs_t *fs, uint32_t iblock, int depth)
+{
+        pframe_t *ibp;
+        uint32_t *b;
+        uint32_t i;
+        int count = 1;
+
+        pframe_get(S5FS_TO_VMOBJ(fs), iblock, &ibp);
+        KASSERT(ibp
+                && "because never fails for block_device "
+                "vm_objects");
+        pframe_pin(ibp);
+
+        b = (uint32_t *)(ibp->pf_addr);
+        for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
+                if (!b[i])
+                        continue;
+                count += (depth > 1) ? s5_count_index(fs, b[i], depth - 1) : 1;
+        }
+
+        pframe_unpin(ibp);
+        return count;
+}
+
+/* Frees every block of inode, or its inline data, see s5_free_inode() */
+static void
+s5_free_inode_blocks(s5fs_t *fs, s5_inode_t *inode)
+{
+        uint32_t i;
+
+        /* if they are blocks at all */
+        if (S5_INODE_INLINE(inode)) {
+                memset(inode->s5_direct_blocks, 0, S5_INLINE_SIZE);
+                s5_dirty_inode(fs, inode);
+        }
+
+        /* free any direct blocks */
+        for (i = 0; i < S5_NDIRECT_BLOCKS; ++i) {
+                if (inode->s5_direct_blocks[i]) {
+                        dprintf("freeing block %d\n", inode->s5_direct_blocks[i]);
+                        s5_free_block(fs, inode->s5_direct_blocks[i]);
+
+                        s5_dirty_inode(fs, inode);
+                        inode->s5_direct_blocks[i] = 0;
+                }
+        }
+
+        if ((S5_TYPE_DATA == inode->s5_type)
+            || (S5_TYPE_DIR == inode->s5_type)) {
+                if (inode->s5_indirect_block)
+                        s5_free_index(fs, inode->s5_indirect_block, 1);
+                if (inode->s5_dindirect_block)
+                        s5_free_index(fs, inode->s5_dindirect_block, 2);
+        }
+
+        inode->s5_indirect_block = 0;
+        inode->s5_dindirect_block = 0;
+        s5_dirty_inode(fs, inode);
+}
+
+/*
+ * Free an inode by freeing its disk blocks and clearing its bit in the
+ * inode bitmap.
  *
  * You should also reset the inode to an unused state (eg. zero-ing its
  * list of blocks and setting its type to S5_FREE_TYPE).
@@ -663,63 +1182,356 @@ s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid)
 void
 s5_free_inode(vnode_t *vnode)
 {
-        uint32_t i;
         s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
         s5fs_t *fs = VNODE_TO_S5FS(vnode);
 
         KASSERT((S5_TYPE_DATA == inode->s5_type)
                 || (S5_TYPE_DIR == inode->s5_type)
                 || (S5_TYPE_CHR == inode->s5_type)
-                || (S5_TYPE_BLK == inode->s5_type));
+                || (S5_TYPE_BLK == inode->s5_type)
+                || (S5_TYPE_SOCK == inode->s5_type));
 
-        /* free any direct blocks */
-        for (i = 0; i < S5_NDIRECT_BLOCKS; ++i) {
-                if (inode->s5_direct_blocks[i]) {
-                        dprintf("freeing block %d\n", inode->s5_direct_blocks[i]);
-                        s5_free_block(fs, inode->s5_direct_blocks[i]);
+        s5_free_inode_blocks(fs, inode);
+        inode->s5_type = S5_TYPE_FREE;
+        s5_dirty_inode(fs, inode);
 
-                        s5_dirty_inode(fs, inode);
-                        inode->s5_direct_blocks[i] = 0;
-                }
+        lock_s5_inodes(fs);
+        s5_imap_set(fs, inode->s5_number, 0);
+        fs->s5f_super->s5s_free_inodes++;
+        s5_dirty_super(fs);
+        unlock_s5_inodes(fs);
+}
+
+/*
+ * Gives dst's index block at *slot, below owner (or the inode, if owner
+ * is NULL), the entries of src's index block from, taking a reference on
+ * each data block. depth is as for s5_free_index.
+ */
+static int
+s5_clone_index(s5fs_t *fs, s5_inode_t *inode, uint32_t from, uint32_t *slot,
+               pframe_t *owner, int depth)
+{
+        pframe_t *fpf, *tpf;
+        uint32_t *fb, *tb, i;
+        int to, err = 0;
+
+        if (0 > (to = s5_slot_get(fs, slot, owner, inode, 1, 0, 1)))
+                return to;
+
+        pframe_get(S5FS_TO_VMOBJ(fs), from, &fpf);
+        KASSERT(fpf);
+        pframe_pin(fpf);
+        pframe_get(S5FS_TO_VMOBJ(fs), (uint32_t)to, &tpf);
+        KASSERT(tpf);
+        pframe_pin(tpf);
+
+        fb = (uint32_t *)fpf->pf_addr;
+        tb = (uint32_t *)tpf->pf_addr;
+        for (i = 0; i < S5_NIDIRECT_BLOCKS && !err; ++i) {
+                if (!fb[i])
+                        continue;
+                if (depth > 1)
+                        err = s5_clone_index(fs, inode, fb[i], &tb[i], tpf, depth - 1);
+                else if (0 == (err = s5_share_block(fs, fb[i])))
+                        tb[i] = fb[i];
         }
+        if (!err && 0 == (err = pframe_dirty(tpf)))
+                s5_journal_dirty(fs, tpf, (uint32_t)to);
 
-        if (((S5_TYPE_DATA == inode->s5_type)
-             || (S5_TYPE_DIR == inode->s5_type))
-            && inode->s5_indirect_block) {
-                pframe_t *ibp;
-                uint32_t *b;
-
-                pframe_get(S5FS_TO_VMOBJ(fs),
-                           inode->s5_indirect_block,
-                           &ibp);
-                KASSERT(ibp
-                        && "because never fails for block_device "
-                        "vm_objects");
-                pframe_pin(ibp);
-
-                b = (uint32_t *)(ibp->pf_addr);
-                for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
-                        KASSERT(b[i] != inode->s5_indirect_block);
-                        if (b[i])
-                                s5_free_block(fs, b[i]);
-                }
+        pframe_unpin(tpf);
+        pframe_unpin(fpf);
+        return err;
+}
+
+/*
+ * Makes the empty regular file dst hold what src holds by sharing src's
+ * data blocks, each of which gets another reference, instead of copying
+ * them; dst gets index blocks of its own. Whichever file writes to a
+ * shared block first gets a block of its own for it then, through
+ * s5_unshare_block(). An inline file is simply copied.
+ *
+ * The caller holds both vnodes' locks in a journal operation, and has
+ * written back src's dirty pages so that its blocks hold what it does.
+ *
+ * Returns 0, or -errno with dst left empty.
+ */
+int
+s5_clone_file(vnode_t *src, vnode_t *dst)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(src);
+        s5_inode_t *si = VNODE_TO_S5INODE(src);
+        s5_inode_t *di = VNODE_TO_S5INODE(dst);
+        uint32_t i;
+        int err = 0;
 
-                pframe_unpin(ibp);
+        KASSERT(S5_TYPE_DATA == si->s5_type && S5_TYPE_DATA == di->s5_type);
+        KASSERT(0 == di->s5_size);
 
-                s5_free_block(fs, inode->s5_indirect_block);
+        /* dst stops being inline with its size, before it is given blocks */
+        di->s5_size = si->s5_size;
+        if (S5_INODE_INLINE(si)) {
+                memcpy(di->s5_direct_blocks, si->s5_direct_blocks, S5_INLINE_SIZE);
+                s5_dirty_inode(fs, di);
+                return 0;
         }
 
-        inode->s5_indirect_block = 0;
-        inode->s5_type = S5_TYPE_FREE;
-        s5_dirty_inode(fs, inode);
+        for (i = 0; i < S5_NDIRECT_BLOCKS && !err; ++i) {
+                if (si->s5_direct_blocks[i]
+                    && 0 == (err = s5_share_block(fs, si->s5_direct_blocks[i])))
+                        di->s5_direct_blocks[i] = si->s5_direct_blocks[i];
+        }
+        if (!err && si->s5_indirect_block)
+                err = s5_clone_index(fs, di, si->s5_indirect_block,
+                                     &di->s5_indirect_block, NULL, 1);
+        if (!err && si->s5_dindirect_block)
+                err = s5_clone_index(fs, di, si->s5_dindirect_block,
+                                     &di->s5_dindirect_block, NULL, 2);
 
-        lock_s5(fs);
-        inode->s5_next_free = fs->s5f_super->s5s_free_inode;
-        fs->s5f_super->s5s_free_inode = inode->s5_number;
-        unlock_s5(fs);
+        if (err < 0) {
+                s5_free_inode_blocks(fs, di);
+                di->s5_size = 0;
+        }
+        s5_dirty_inode(fs, di);
+        return err;
+}
 
-        s5_dirty_inode(fs, inode);
-        s5_dirty_super(fs);
+void
+s5_dirent_iter_init(s5_dirent_iter_t *it, vnode_t *dir, off_t offset)
+{
+        const off_t size = sizeof(s5_dirent_t);
+
+        KASSERT(0 <= offset);
+        it->it_dir = dir;
+        it->it_pf = NULL;
+        it->it_ent = NULL;
+        it->it_offset = -1;
+        /* an offset inside an entry means the next whole one */
+        it->it_next = (offset + size - 1) / size * size;
+
+        /* start fetching the rest of the directory if it is being scanned */
+        if (it->it_next < dir->vn_len)
+                vnode_readahead(dir, S5_DATA_BLOCK(it->it_next),
+                                S5_DATA_BLOCK(dir->vn_len - 1)
+                                - S5_DATA_BLOCK(it->it_next) + 1);
+}
+
+int
+s5_dirent_iter_next(s5_dirent_iter_t *it)
+{
+        vnode_t *dir = it->it_dir;
+        uint32_t block;
+        pframe_t *pf;
+        int err;
+
+        if (it->it_next >= dir->vn_len)
+                return 0;
+
+        /* entries never straddle a block, so only a new block needs a page */
+        block = S5_DATA_BLOCK(it->it_next);
+        if (NULL == it->it_pf || it->it_pf->pf_pagenum != block) {
+                s5_dirent_iter_done(it);
+                if ((err = pframe_get(&dir->vn_mmobj, block, &pf)) < 0)
+                        return err;
+                pframe_pin(pf);
+                it->it_pf = pf;
+        }
+
+        it->it_ent = (s5_dirent_t *)((char *)it->it_pf->pf_addr
+                                     + S5_DATA_OFFSET(it->it_next));
+        it->it_offset = it->it_next;
+        it->it_next += sizeof(s5_dirent_t);
+        return 1;
+}
+
+int
+s5_dirent_iter_dirty(s5_dirent_iter_t *it)
+{
+        KASSERT(NULL != it->it_pf);
+        return pframe_dirty(it->it_pf);
+}
+
+void
+s5_dirent_iter_done(s5_dirent_iter_t *it)
+{
+        if (NULL != it->it_pf) {
+                pframe_unpin(it->it_pf);
+                it->it_pf = NULL;
+        }
+        it->it_ent = NULL;
+}
+
+int
+s5_dir_empty(vnode_t *dir)
+{
+        s5_dirent_iter_t it;
+        int empty = 1, err = 0;
+
+        if (dir->vn_len != 2 * sizeof(s5_dirent_t))
+                return 0;
+
+        s5_dirent_iter_init(&it, dir, 0);
+        while (empty && 0 < (err = s5_dirent_iter_next(&it))) {
+                if (!name_match(".", it.it_ent->s5d_name, 1)
+                    && !name_match("..", it.it_ent->s5d_name, 2))
+                        empty = 0;
+        }
+        s5_dirent_iter_done(&it);
+        return (err < 0) ? err : empty;
+}
+
+/*
+ * Directories of at least S5_DIRINDEX_MIN_DIRENTS entries get an
+ * in-memory hash from name to dirent, so lookups do not have to read the
+ * whole directory. It is built on the first lookup, kept up to date by
+ * s5_link and s5_remove_dirent, and dropped with the vnode. Smaller
+ * directories are just scanned.
+ */
+typedef struct s5_dirindex_ent {
+        list_link_t     de_link;        /* on a di_buckets list */
+        off_t           de_offset;      /* of the dirent in the directory */
+        uint32_t        de_ino;
+        char            de_name[S5_NAME_LEN];
+} s5_dirindex_ent_t;
+
+typedef struct s5_dirindex {
+        ino_t           di_vno;         /* the directory */
+        list_link_t     di_link;        /* on s5f_dirindex */
+        list_t          di_buckets[S5_DIRINDEX_BUCKETS];
+} s5_dirindex_t;
+
+static uint32_t
+s5_name_hash(const char *name, size_t namelen)
+{
+        uint32_t h = 2166136261u;
+        size_t i;
+        for (i = 0; i < namelen; i++) {
+                h = (h ^ (unsigned char)name[i]) * 16777619u;
+        }
+        return h;
+}
+
+static s5_dirindex_t *
+s5_dirindex_find(s5fs_t *fs, ino_t vno)
+{
+        s5_dirindex_t *di;
+        list_iterate_begin(&fs->s5f_dirindex[vno % S5_DIRINDEX_HASH], di,
+                           s5_dirindex_t, di_link) {
+                if (di->di_vno == vno)
+                        return di;
+        } list_iterate_end();
+        return NULL;
+}
+
+static s5_dirindex_ent_t *
+s5_dirindex_lookup(s5_dirindex_t *di, const char *name, size_t namelen)
+{
+        s5_dirindex_ent_t *de;
+        list_t *bucket = &di->di_buckets[s5_name_hash(name, namelen)
+                                          % S5_DIRINDEX_BUCKETS];
+        list_iterate_begin(bucket, de, s5_dirindex_ent_t, de_link) {
+                if (name_match(de->de_name, name, namelen))
+                        return de;
+        } list_iterate_end();
+        return NULL;
+}
+
+static int
+s5_dirindex_add(s5_dirindex_t *di, const char *name, size_t namelen,
+                uint32_t ino, off_t offset)
+{
+        s5_dirindex_ent_t *de;
+
+        KASSERT(namelen < S5_NAME_LEN);
+        if (NULL == (de = kmalloc(sizeof(*de))))
+                return -ENOMEM;
+        memcpy(de->de_name, name, namelen);
+        de->de_name[namelen] = '\0';
+        de->de_ino = ino;
+        de->de_offset = offset;
+        list_insert_head(&di->di_buckets[s5_name_hash(name, namelen)
+                                         % S5_DIRINDEX_BUCKETS],
+                         &de->de_link);
+        return 0;
+}
+
+static void
+s5_dirindex_free(s5_dirindex_t *di)
+{
+        int i;
+        s5_dirindex_ent_t *de;
+
+        for (i = 0; i < S5_DIRINDEX_BUCKETS; i++) {
+                list_iterate_begin(&di->di_buckets[i], de,
+                                   s5_dirindex_ent_t, de_link) {
+                        list_remove(&de->de_link);
+                        kfree(de);
+                } list_iterate_end();
+        }
+        kfree(di);
+}
+
+/*
+ * Returns the directory's index, building it first if the directory is
+ * big enough to deserve one. Returns NULL if the directory should be
+ * scanned instead, including when there is no memory for an index.
+ */
+static s5_dirindex_t *
+s5_dirindex_get(vnode_t *dir)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(dir);
+        s5_dirindex_t *di;
+        s5_dirent_iter_t it;
+        off_t len = dir->vn_len;
+        int i, err;
+
+        if (NULL != (di = s5_dirindex_find(fs, dir->vn_vno)))
+                return di;
+        if (len < (off_t)(S5_DIRINDEX_MIN_DIRENTS * sizeof(s5_dirent_t)))
+                return NULL;
+
+        if (NULL == (di = kmalloc(sizeof(*di))))
+                return NULL;
+        di->di_vno = dir->vn_vno;
+        for (i = 0; i < S5_DIRINDEX_BUCKETS; i++) {
+                list_init(&di->di_buckets[i]);
+        }
+
+        s5_dirent_iter_init(&it, dir, 0);
+        while (0 < (err = s5_dirent_iter_next(&it))) {
+                if ((err = s5_dirindex_add(di, it.it_ent->s5d_name,
+                                           strlen(it.it_ent->s5d_name),
+                                           it.it_ent->s5d_inode, it.it_offset)) < 0)
+                        break;
+        }
+        s5_dirent_iter_done(&it);
+        if (err < 0)
+                goto fail;
+
+        /* reading may have blocked; give up if the directory changed, or
+         * if someone else indexed it meanwhile */
+        if (dir->vn_len != len || NULL != s5_dirindex_find(fs, dir->vn_vno))
+                goto fail;
+        list_insert_head(&fs->s5f_dirindex[dir->vn_vno % S5_DIRINDEX_HASH],
+                         &di->di_link);
+        return di;
+
+fail:
+        s5_dirindex_free(di);
+        return NULL;
+}
+
+/*
+ * Frees the directory's name hash, if it has one. Called when its vnode
+ * goes away.
+ */
+void
+s5_dirindex_drop(vnode_t *dir)
+{
+        s5_dirindex_t *di = s5_dirindex_find(VNODE_TO_S5FS(dir), dir->vn_vno);
+        if (NULL != di) {
+                list_remove(&di->di_link);
+                s5_dirindex_free(di);
+        }
 }
 
 /*
@@ -727,10 +1539,8 @@ s5_free_inode(vnode_t *vnode)
  * and return its inode number. If there is no entry with the given
  * name, return -ENOENT.
  *
- * You'll probably want to use s5_read_file and name_match
- *
- * You can either read one dirent at a time or optimize and read more.
- * Either is fine.
+ * The entries are scanned in place with s5_dirent_iter, unless the
+ * directory has a name hash.
  */
 int
 s5_find_dirent(vnode_t *vnode, const char *name, size_t namelen)
@@ -739,32 +1549,35 @@ s5_find_dirent(vnode_t *vnode, const char *name, size_t namelen)
     
     ((char *)name)[namelen] = 0;
     
+    s5_dirindex_t *di = s5_dirindex_get(vnode);
+    if (di) {
+        s5_dirindex_ent_t *de = s5_dirindex_lookup(di, name, namelen);
+        return de ? (int)de->de_ino : -ENOENT;
+    }
+
     int err = 0;
-    off_t offset = 0;
-    off_t filesize = vnode->vn_len;
-    s5_dirent_t dirent;
+    s5_dirent_iter_t it;
 
     /*scan thru every dirent*/
-    while (offset < filesize) {
-        err = s5_read_file(vnode, offset, (char *)(&dirent), sizeof(s5_dirent_t));
-        if (err < 0) {
-            dprintf("some error occurs, error number is %d\n", err);
-            return err;
-        }
-
-        if (dirent.s5d_name[0] == '\0') {
+    s5_dirent_iter_init(&it, vnode, 0);
+    while (0 < (err = s5_dirent_iter_next(&it))) {
+        if (it.it_ent->s5d_name[0] == '\0') {
             panic("Weird, there's some inconsistency between dirents and file size\n");
         }
 
-        if name_match(dirent.s5d_name, name, namelen) {
+        if name_match(it.it_ent->s5d_name, name, namelen) {
             /*there exists inode number 0- the inode for the root*/
-            /*KASSERT(dirent.s5d_inode);*/
-            return dirent.s5d_inode;
+            err = it.it_ent->s5d_inode;
+            s5_dirent_iter_done(&it);
+            return err;
         }
-
-        offset += sizeof(s5_dirent_t);
     }
+    s5_dirent_iter_done(&it);
 
+    if (err < 0) {
+        dprintf("some error occurs, error number is %d\n", err);
+        return err;
+    }
     return -ENOENT;
 }
 
@@ -785,8 +1598,8 @@ s5_find_dirent(vnode_t *vnode, const char *name, size_t namelen)
  *
  * Don't forget to dirty appropriate blocks!
  *
- * You probably want to use vget(), vput(), s5_read_file(),
- * s5_write_file(), and s5_dirty_inode().
+ * Both entries are found, and the last one copied over the other, in
+ * place with s5_dirent_iter; then vget(), vput() and s5_dirty_inode().
  */
 int
 s5_remove_dirent(vnode_t *vnode, const char *name, size_t namelen)
@@ -798,43 +1611,68 @@ s5_remove_dirent(vnode_t *vnode, const char *name, size_t namelen)
     int err = 0;
     int inodeno = 0;
     off_t offset = 0;
-    off_t filesize = vnode->vn_len;
-    s5_dirent_t dirent_target;
-
-    /*search for the to-be-deleted dirent*/
-    while (offset < filesize) {
-        err = s5_read_file(vnode, offset, (char *)(&dirent_target), sizeof(s5_dirent_t));
-        if (err < 0) {
-            return err;
+    off_t lastoff = vnode->vn_len - sizeof(s5_dirent_t);
+    s5_dirent_iter_t it, last;
+
+    s5_dirindex_t *di = s5_dirindex_get(vnode);
+    s5_dirindex_ent_t *de = NULL;
+    if (di) {
+        if (!(de = s5_dirindex_lookup(di, name, namelen))) {
+            return -ENOENT;
         }
+        offset = de->de_offset;
+    }
 
-        if (dirent_target.s5d_name[0] == '\0') {
+    /*search for the to-be-deleted dirent, or go straight to it*/
+    s5_dirent_iter_init(&it, vnode, offset);
+    while (0 < (err = s5_dirent_iter_next(&it))) {
+        if (it.it_ent->s5d_name[0] == '\0') {
             panic("Weird, there's some inconsistency between dirents and file size\n");
         }
 
-        if name_match(dirent_target.s5d_name, name, namelen) {
-            inodeno = dirent_target.s5d_inode;
-            /*inodeno can be 0: inode for root*/
-            /*KASSERT(inodeno);*/
+        if name_match(it.it_ent->s5d_name, name, namelen) {
             break;
         }
-
-        KASSERT(err == sizeof(s5_dirent_t));
-        offset += sizeof(s5_dirent_t);
+        KASSERT(!di && "the name hash is out of step with the directory");
     }
+    if (err <= 0) {
+        s5_dirent_iter_done(&it);
+        return (err < 0) ? err : -ENOENT;
+    }
+    /*inodeno can be 0: inode for root*/
+    inodeno = it.it_ent->s5d_inode;
+    offset = it.it_offset;
 
-    /*get the last dirent*/
+    /*copy the last dirent into the deleted dirent position*/
     s5_dirent_t dirent_last;
-    err = s5_read_file(vnode, filesize - sizeof(s5_dirent_t), (char *)(&dirent_last), sizeof(s5_dirent_t));
-    if (err < 0) {
-        return err;
+    if (offset != lastoff) {
+        s5_dirent_iter_init(&last, vnode, lastoff);
+        err = s5_dirent_iter_next(&last);
+        KASSERT(err != 0);
+        if (err > 0) {
+            dirent_last = *last.it_ent;
+        }
+        s5_dirent_iter_done(&last);
+        /*dirtied first, so that a failure leaves the entry as it was*/
+        if (err > 0 && (err = s5_dirent_iter_dirty(&it)) >= 0) {
+            *it.it_ent = dirent_last;
+        }
     }
-    
-    /*write the last dirent into the deleted dirent position*/
-    err = s5_write_file(vnode, offset, (const char *)(&dirent_last), sizeof(s5_dirent_t));
+    s5_dirent_iter_done(&it);
     if (err < 0) {
         return err;
     }
+
+    if (di) {
+        if (offset != lastoff) {
+            s5_dirindex_ent_t *moved = s5_dirindex_lookup(di, dirent_last.s5d_name,
+                                                          strlen(dirent_last.s5d_name));
+            KASSERT(moved);
+            moved->de_offset = offset;
+        }
+        list_remove(&de->de_link);
+        kfree(de);
+    }
     
     s5fs_t *fs = VNODE_TO_S5FS(vnode);
     vnode_t *vnode_deleted = vget(fs->s5f_fs, inodeno);
@@ -896,10 +1734,17 @@ s5_link(vnode_t *parent, vnode_t *child, const char *name, size_t namelen)
     dirent.s5d_inode = inode_child->s5_number;
     
     /*write it to the end of the file*/
-    err = s5_write_file(parent, parent->vn_len, (const char *)(&dirent), sizeof(s5_dirent_t));
+    off_t offset = parent->vn_len;
+    err = s5_write_file(parent, offset, (const char *)(&dirent), sizeof(s5_dirent_t));
     if (err < 0) {
         return err;
     }
+
+    /*keep the name hash, if there is one, in step; drop it if we can't*/
+    s5_dirindex_t *di = s5_dirindex_find(VNODE_TO_S5FS(parent), parent->vn_vno);
+    if (di && s5_dirindex_add(di, name, namelen, dirent.s5d_inode, offset) < 0) {
+        s5_dirindex_drop(parent);
+    }
     
     /*special case '.'*/
     if (!name_match(".", name, namelen)) {
@@ -913,7 +1758,7 @@ s5_link(vnode_t *parent, vnode_t *child, const char *name, size_t namelen)
 
 /*
  * Return the number of blocks that this inode has allocated on disk.
- * This should include the indirect block, but not include sparse
+ * This should include the indirect blocks, but not include sparse
  * blocks.
  *
  * This is only used by s5fs_stat().
@@ -925,6 +1770,10 @@ s5_inode_blocks(vnode_t *vnode)
 {
     s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
 
+    if (S5_INODE_INLINE(inode)) {
+        return 0;
+    }
+
     int result = 0;
     uint32_t i;
     for (i = 0 ; i < S5_NDIRECT_BLOCKS ; i++) {
@@ -933,32 +1782,16 @@ s5_inode_blocks(vnode_t *vnode)
         }
     }
 
-    if (inode->s5_indirect_block == 0) {
-        return result;
-    } else {
-        if (((S5_TYPE_DATA == inode->s5_type)
-             || (S5_TYPE_DIR == inode->s5_type))
-            && inode->s5_indirect_block) {
-            pframe_t *ibp;
-            uint32_t *b;
-
-            s5fs_t *fs = VNODE_TO_S5FS(vnode);
-            KASSERT(fs);
-
-            /*get the page frame*/
-            pframe_get(S5FS_TO_VMOBJ(fs),
-                       (inode->s5_indirect_block),
-                       &ibp);
-            KASSERT(ibp
-                    && "because never fails for block_device "
-                    "vm_objects");
-
-            b = (uint32_t *)(ibp->pf_addr);
-            for (i = 0 ; i < S5_NIDIRECT_BLOCKS ; i++) {
-                if (b[i]) {
-                    result++;
-                }
-            }
+    if ((S5_TYPE_DATA == inode->s5_type)
+        || (S5_TYPE_DIR == inode->s5_type)) {
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        KASSERT(fs);
+
+        if (inode->s5_indirect_block) {
+            result += s5_count_index(fs, inode->s5_indirect_block, 1);
+        }
+        if (inode->s5_dindirect_block) {
+            result += s5_count_index(fs, inode->s5_dindirect_block, 2);
         }
     }
 
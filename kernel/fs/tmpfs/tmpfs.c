@@ -0,0 +1,781 @@
+/*
+ * An in-memory file system, for /tmp, without ramfs's limits. There is no
+ * limit on the number of files, and files can be any length.
+ *
+ * Each regular file's contents are an anonymous object. Its pages are
+ * allocated as they are first written, and are paged out to swap by
+ * pageoutd like any other anonymous memory (they stay pinned if there is
+ * no swap). mmap() maps that object directly, so a shared mapping and
+ * read()/write() see the same pages. Holes read as zeros without taking
+ * up any memory.
+ *
+ * A directory is a list of its entries, in the order they were made,
+ * together with a hash from name to entry. readdir() offsets are cookies,
+ * numbered in that same order, so removing entries does not move the
+ * others.
+ *
+ * Reads and lookups take a vnode's lock shared; writes and changes to a
+ * directory take it exclusively. The inode table and link counts are
+ * under the file system's mutex.
+ */
+
+#include "kernel.h"
+#include "globals.h"
+#include "types.h"
+#include "errno.h"
+
+#include "util/string.h"
+#include "util/debug.h"
+#include "util/hash.h"
+
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+#include "fs/stat.h"
+#include "fs/dirent.h"
+
+#include "mm/mm.h"
+#include "mm/kmalloc.h"
+#include "mm/mmobj.h"
+#include "mm/pframe.h"
+#include "mm/radix.h"
+
+#include "proc/kmutex.h"
+
+#include "vm/anon.h"
+
+#include "api/access.h"
+
+#include "fs/tmpfs/tmpfs.h"
+
+/*
+ * Filesystem operations
+ */
+static void tmpfs_read_vnode(vnode_t *vn);
+static void tmpfs_delete_vnode(vnode_t *vn);
+static int tmpfs_query_vnode(vnode_t *vn);
+static int tmpfs_umount(fs_t *fs);
+
+static fs_ops_t tmpfs_ops = {
+        .read_vnode   = tmpfs_read_vnode,
+        .delete_vnode = tmpfs_delete_vnode,
+        .query_vnode  = tmpfs_query_vnode,
+        .umount       = tmpfs_umount
+};
+
+/*
+ * vnode operations
+ */
+static int tmpfs_read(vnode_t *file, off_t offset, void *buf, size_t count);
+static int tmpfs_write(vnode_t *file, off_t offset, const void *buf, size_t count);
+static int tmpfs_read_user(vnode_t *file, off_t offset, void *buf, size_t count);
+static int tmpfs_write_user(vnode_t *file, off_t offset, const void *buf, size_t count);
+static int tmpfs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret);
+static int tmpfs_create(vnode_t *dir, const char *name, size_t name_len,
+                        vnode_t **result);
+static int tmpfs_mknod(struct vnode *dir, const char *name, size_t name_len,
+                       int mode, devid_t devid);
+static int tmpfs_lookup(vnode_t *dir, const char *name, size_t name_len,
+                        vnode_t **result);
+static int tmpfs_link(vnode_t *oldvnode, vnode_t *dir,
+                      const char *name, size_t name_len);
+static int tmpfs_unlink(vnode_t *dir, const char *name, size_t name_len);
+static int tmpfs_mkdir(vnode_t *dir, const char *name, size_t name_len);
+static int tmpfs_rmdir(vnode_t *dir, const char *name, size_t name_len);
+static int tmpfs_readdir(vnode_t *dir, off_t offset, struct dirent *d);
+static int tmpfs_readdir_batch(vnode_t *dir, off_t *offset, struct dirent *d, int count);
+static int tmpfs_stat(vnode_t *file, struct stat *buf);
+
+static vnode_ops_t tmpfs_dir_vops = {
+        .read = NULL,
+        .write = NULL,
+        .mmap = NULL,
+        .create = tmpfs_create,
+        .mknod = tmpfs_mknod,
+        .lookup = tmpfs_lookup,
+        .link = tmpfs_link,
+        .unlink = tmpfs_unlink,
+        .mkdir = tmpfs_mkdir,
+        .rmdir = tmpfs_rmdir,
+        .readdir = tmpfs_readdir,
+        .readdir_batch = tmpfs_readdir_batch,
+        .stat = tmpfs_stat,
+        .acquire = NULL,
+        .release = NULL,
+        .fillpage = NULL,
+        .dirtypage = NULL,
+        .cleanpage = NULL
+};
+
+/* The vnode's own mmobj is never used: the pages are in ti_obj */
+static vnode_ops_t tmpfs_file_vops = {
+        .read = tmpfs_read,
+        .write = tmpfs_write,
+        .read_user = tmpfs_read_user,
+        .write_user = tmpfs_write_user,
+        .mmap = tmpfs_mmap,
+        .create = NULL,
+        .mknod = NULL,
+        .lookup = NULL,
+        .link = NULL,
+        .unlink = NULL,
+        .mkdir = NULL,
+        .rmdir = NULL,
+        .stat = tmpfs_stat,
+        .acquire = NULL,
+        .release = NULL,
+        .fillpage = NULL,
+        .dirtypage = NULL,
+        .cleanpage = NULL
+};
+
+#define TMPFS_MAX_FILE_SIZE     ((off_t)0x7fffffff)
+
+typedef struct tmpfs_dirent {
+        list_link_t     td_link;        /* on ti_entries, in cookie order */
+        htable_link_t   td_hlink;       /* in ti_names */
+        off_t           td_cookie;      /* its readdir() offset */
+        ino_t           td_ino;
+        char            td_name[NAME_LEN];
+} tmpfs_dirent_t;
+
+/*
+ * The tmpfs 'inode' structure. As in ramfs, the link count has one more
+ * in it while the inode has a vnode.
+ */
+typedef struct tmpfs_inode {
+        ino_t           ti_ino;
+        int             ti_mode;        /* S_IFREG, S_IFDIR, ... */
+        int             ti_linkcount;
+        off_t           ti_size;        /* for a regular file */
+        mmobj_t        *ti_obj;         /* for a regular file */
+        devid_t         ti_devid;       /* for a device file */
+
+        /* For a directory: */
+        list_t          ti_entries;
+        htable_t        ti_names;       /* the entries, by name */
+        int             ti_nentries;
+        off_t           ti_next_cookie;
+} tmpfs_inode_t;
+
+typedef struct tmpfs {
+        kmutex_t        tf_mutex;       /* for what is below, and link counts */
+        radix_tree_t    tf_inodes;      /* by number */
+        ino_t           tf_next_ino;
+} tmpfs_t;
+
+#define VNODE_TO_TMPFSINODE(vn) \
+        ((tmpfs_inode_t *)(vn)->vn_i)
+#define VNODE_TO_TMPFS(vn) \
+        ((tmpfs_t *)(vn)->vn_fs->fs_i)
+
+/* Helper functions */
+
+#define tmpfs_name_hash(name, namelen) hash_bytes(HASH_INIT, (name), (namelen))
+
+/* Makes an inode, with a link count of 1, and puts it in the table */
+static int
+tmpfs_alloc_inode(tmpfs_t *tfs, int mode, devid_t devid, tmpfs_inode_t **result)
+{
+        tmpfs_inode_t *inode;
+        int err;
+
+        if (NULL == (inode = kmalloc(sizeof(tmpfs_inode_t))))
+                return -ENOSPC;
+        memset(inode, 0, sizeof(*inode));
+        inode->ti_mode = mode;
+        inode->ti_linkcount = 1;
+        inode->ti_devid = devid;
+        list_init(&inode->ti_entries);
+        htable_init(&inode->ti_names);
+
+        if (S_ISREG(mode)) {
+                if (NULL == (inode->ti_obj = anon_create())) {
+                        kfree(inode);
+                        return -ENOSPC;
+                }
+                inode->ti_obj->mmo_ops->ref(inode->ti_obj);
+        }
+
+        kmutex_lock(&tfs->tf_mutex);
+        inode->ti_ino = tfs->tf_next_ino;
+        if (0 == (err = radix_insert(&tfs->tf_inodes, inode->ti_ino, inode)))
+                tfs->tf_next_ino++;
+        kmutex_unlock(&tfs->tf_mutex);
+
+        if (err < 0) {
+                if (NULL != inode->ti_obj)
+                        inode->ti_obj->mmo_ops->put(inode->ti_obj);
+                kfree(inode);
+                return -ENOSPC;
+        }
+        *result = inode;
+        return 0;
+}
+
+/* Frees an inode which is no longer in the table */
+static void
+tmpfs_free_inode(tmpfs_inode_t *inode)
+{
+        tmpfs_dirent_t *entry;
+
+        if (NULL != inode->ti_obj) {
+                /* mappings of the file keep its pages */
+                inode->ti_obj->mmo_ops->put(inode->ti_obj);
+        }
+        list_iterate_begin(&inode->ti_entries, entry, tmpfs_dirent_t, td_link) {
+                list_remove(&entry->td_link);
+                htable_remove(&inode->ti_names, &entry->td_hlink);
+                kfree(entry);
+        } list_iterate_end();
+        htable_destroy(&inode->ti_names);
+        kfree(inode);
+}
+
+static void
+tmpfs_drop_link(vnode_t *vn)
+{
+        tmpfs_t *tfs = VNODE_TO_TMPFS(vn);
+
+        kmutex_lock(&tfs->tf_mutex);
+        VNODE_TO_TMPFSINODE(vn)->ti_linkcount--;
+        kmutex_unlock(&tfs->tf_mutex);
+}
+
+static tmpfs_dirent_t *
+tmpfs_dir_find(tmpfs_inode_t *dir, const char *name, size_t namelen)
+{
+        tmpfs_dirent_t *entry;
+
+        htable_iterate_begin(&dir->ti_names, tmpfs_name_hash(name, namelen),
+                             entry, tmpfs_dirent_t, td_hlink) {
+                if (name_match(entry->td_name, name, namelen))
+                        return entry;
+        } htable_iterate_end();
+        return NULL;
+}
+
+/* Adds an entry to the directory, which is locked */
+static int
+tmpfs_dir_add(vnode_t *dir, const char *name, size_t namelen, ino_t ino)
+{
+        tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(dir);
+        tmpfs_dirent_t *entry;
+
+        KASSERT(namelen < NAME_LEN);
+        KASSERT(NULL == tmpfs_dir_find(inode, name, namelen));
+
+        if (NULL == (entry = kmalloc(sizeof(tmpfs_dirent_t))))
+                return -ENOSPC;
+        memcpy(entry->td_name, name, namelen);
+        entry->td_name[namelen] = '\0';
+        entry->td_ino = ino;
+        entry->td_cookie = inode->ti_next_cookie++;
+        list_insert_tail(&inode->ti_entries, &entry->td_link);
+        htable_insert(&inode->ti_names, &entry->td_hlink,
+                      tmpfs_name_hash(name, namelen));
+
+        inode->ti_nentries++;
+        dir->vn_len = inode->ti_nentries * sizeof(tmpfs_dirent_t);
+        return 0;
+}
+
+static void
+tmpfs_dir_remove(vnode_t *dir, tmpfs_dirent_t *entry)
+{
+        tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(dir);
+
+        list_remove(&entry->td_link);
+        htable_remove(&inode->ti_names, &entry->td_hlink);
+        kfree(entry);
+
+        inode->ti_nentries--;
+        dir->vn_len = inode->ti_nentries * sizeof(tmpfs_dirent_t);
+}
+
+/* The first entry at or after offset, or NULL if there is none */
+static tmpfs_dirent_t *
+tmpfs_dir_seek(tmpfs_inode_t *dir, off_t offset)
+{
+        tmpfs_dirent_t *entry;
+
+        list_iterate_begin(&dir->ti_entries, entry, tmpfs_dirent_t, td_link) {
+                if (entry->td_cookie >= offset)
+                        return entry;
+        } list_iterate_end();
+        return NULL;
+}
+
+/* Fills in "." and ".." in a new directory */
+static int
+tmpfs_dir_init(tmpfs_inode_t *inode, ino_t parent)
+{
+        const char *names[] = { ".", ".." };
+        ino_t inos[2];
+        int i;
+
+        inos[0] = inode->ti_ino;
+        inos[1] = parent;
+        for (i = 0; i < 2; i++) {
+                tmpfs_dirent_t *entry = kmalloc(sizeof(tmpfs_dirent_t));
+                if (NULL == entry)
+                        return -ENOSPC;
+                strcpy(entry->td_name, names[i]);
+                entry->td_ino = inos[i];
+                entry->td_cookie = inode->ti_next_cookie++;
+                list_insert_tail(&inode->ti_entries, &entry->td_link);
+                htable_insert(&inode->ti_names, &entry->td_hlink,
+                              tmpfs_name_hash(names[i], strlen(names[i])));
+                inode->ti_nentries++;
+        }
+        return 0;
+}
+
+/* Takes an inode made for an entry which could not then be added, back out */
+static void
+tmpfs_discard_inode(tmpfs_t *tfs, tmpfs_inode_t *inode)
+{
+        kmutex_lock(&tfs->tf_mutex);
+        radix_remove(&tfs->tf_inodes, inode->ti_ino);
+        kmutex_unlock(&tfs->tf_mutex);
+        tmpfs_free_inode(inode);
+}
+
+/*
+ * Function implementations
+ */
+
+int
+tmpfs_mount(struct fs *fs)
+{
+        tmpfs_t *tfs;
+        tmpfs_inode_t *root;
+        int err;
+
+        if (NULL == (tfs = kmalloc(sizeof(tmpfs_t))))
+                return -ENOMEM;
+        kmutex_init(&tfs->tf_mutex);
+        radix_tree_init(&tfs->tf_inodes);
+        tfs->tf_next_ino = 0;
+
+        fs->fs_i = tfs;
+        fs->fs_op = &tmpfs_ops;
+
+        /* Set up the root, which is its own parent */
+        if (0 > (err = tmpfs_alloc_inode(tfs, S_IFDIR, 0, &root))) {
+                kfree(tfs);
+                return err;
+        }
+        KASSERT(0 == root->ti_ino);
+        if (0 > (err = tmpfs_dir_init(root, root->ti_ino))) {
+                tmpfs_discard_inode(tfs, root);
+                kfree(tfs);
+                return err;
+        }
+
+        fs->fs_root = vget(fs, root->ti_ino);
+        return 0;
+}
+
+static void
+tmpfs_read_vnode(vnode_t *vn)
+{
+        tmpfs_t *tfs = VNODE_TO_TMPFS(vn);
+        tmpfs_inode_t *inode;
+
+        kmutex_lock(&tfs->tf_mutex);
+        inode = radix_lookup(&tfs->tf_inodes, vn->vn_vno);
+        KASSERT(inode && inode->ti_ino == vn->vn_vno);
+        inode->ti_linkcount++;
+        kmutex_unlock(&tfs->tf_mutex);
+
+        vn->vn_i = inode;
+        vn->vn_mode = inode->ti_mode;
+
+        if (S_ISREG(inode->ti_mode)) {
+                vn->vn_ops = &tmpfs_file_vops;
+                vn->vn_len = inode->ti_size;
+        } else if (S_ISDIR(inode->ti_mode)) {
+                vn->vn_ops = &tmpfs_dir_vops;
+                vn->vn_len = inode->ti_nentries * sizeof(tmpfs_dirent_t);
+        } else if (S_ISCHR(inode->ti_mode) || S_ISBLK(inode->ti_mode)) {
+                vn->vn_ops = NULL;
+                vn->vn_devid = inode->ti_devid;
+                vn->vn_len = 0;
+        } else {
+                panic("inode %d has unknown/invalid mode %d!!\n",
+                      (int)vn->vn_vno, inode->ti_mode);
+        }
+}
+
+static void
+tmpfs_delete_vnode(vnode_t *vn)
+{
+        tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(vn);
+        tmpfs_t *tfs = VNODE_TO_TMPFS(vn);
+        int gone;
+
+        kmutex_lock(&tfs->tf_mutex);
+        if (0 != (gone = (0 == --inode->ti_linkcount)))
+                radix_remove(&tfs->tf_inodes, inode->ti_ino);
+        kmutex_unlock(&tfs->tf_mutex);
+
+        if (gone)
+                tmpfs_free_inode(inode);
+}
+
+static int
+tmpfs_query_vnode(vnode_t *vn)
+{
+        return VNODE_TO_TMPFSINODE(vn)->ti_linkcount > 1;
+}
+
+static int
+tmpfs_umount(fs_t *fs)
+{
+        tmpfs_t *tfs = (tmpfs_t *)fs->fs_i;
+        tmpfs_inode_t *inode;
+        uint32_t ino = 0;
+
+        vput(fs->fs_root);
+
+        while (NULL != (inode = radix_next(&tfs->tf_inodes, &ino))) {
+                radix_remove(&tfs->tf_inodes, ino);
+                tmpfs_free_inode(inode);
+        }
+        kfree(tfs);
+        return 0;
+}
+
+static int
+tmpfs_create(vnode_t *dir, const char *name, size_t name_len, vnode_t **result)
+{
+        tmpfs_inode_t *inode;
+        vnode_t *vn;
+        int err;
+
+        krwlock_wrlock(&dir->vn_rwlock);
+        KASSERT(NULL == tmpfs_dir_find(VNODE_TO_TMPFSINODE(dir), name, name_len));
+
+        if (0 > (err = tmpfs_alloc_inode(VNODE_TO_TMPFS(dir), S_IFREG, 0, &inode))) {
+                krwlock_wrunlock(&dir->vn_rwlock);
+                return err;
+        }
+        vn = vget(dir->vn_fs, inode->ti_ino);
+
+        if (0 > (err = tmpfs_dir_add(dir, name, name_len, inode->ti_ino))) {
+                /* the vnode's is then the only reference, and it goes */
+                tmpfs_drop_link(vn);
+                vput(vn);
+                krwlock_wrunlock(&dir->vn_rwlock);
+                return err;
+        }
+        krwlock_wrunlock(&dir->vn_rwlock);
+
+        *result = vn;
+        return 0;
+}
+
+static int
+tmpfs_mknod(struct vnode *dir, const char *name, size_t name_len, int mode, devid_t devid)
+{
+        tmpfs_t *tfs = VNODE_TO_TMPFS(dir);
+        tmpfs_inode_t *inode;
+        int err;
+
+        KASSERT(S_ISCHR(mode) || S_ISBLK(mode));
+
+        krwlock_wrlock(&dir->vn_rwlock);
+        KASSERT(NULL == tmpfs_dir_find(VNODE_TO_TMPFSINODE(dir), name, name_len));
+
+        if (0 <= (err = tmpfs_alloc_inode(tfs, S_ISCHR(mode) ? S_IFCHR : S_IFBLK,
+                                          devid, &inode))
+            && 0 > (err = tmpfs_dir_add(dir, name, name_len, inode->ti_ino)))
+                tmpfs_discard_inode(tfs, inode);
+        krwlock_wrunlock(&dir->vn_rwlock);
+        return err;
+}
+
+static int
+tmpfs_lookup(vnode_t *dir, const char *name, size_t namelen, vnode_t **result)
+{
+        tmpfs_dirent_t *entry;
+        int err = -ENOENT;
+
+        krwlock_rdlock(&dir->vn_rwlock);
+        if (NULL != (entry = tmpfs_dir_find(VNODE_TO_TMPFSINODE(dir), name, namelen))) {
+                *result = vget(dir->vn_fs, entry->td_ino);
+                err = 0;
+        }
+        krwlock_rdunlock(&dir->vn_rwlock);
+        return err;
+}
+
+static int
+tmpfs_link(vnode_t *oldvnode, vnode_t *dir, const char *name, size_t name_len)
+{
+        tmpfs_t *tfs = VNODE_TO_TMPFS(dir);
+        int err;
+
+        KASSERT(oldvnode->vn_fs == dir->vn_fs);
+
+        krwlock_wrlock(&dir->vn_rwlock);
+        if (0 == (err = tmpfs_dir_add(dir, name, name_len, oldvnode->vn_vno))) {
+                kmutex_lock(&tfs->tf_mutex);
+                VNODE_TO_TMPFSINODE(oldvnode)->ti_linkcount++;
+                kmutex_unlock(&tfs->tf_mutex);
+        }
+        krwlock_wrunlock(&dir->vn_rwlock);
+        return err;
+}
+
+static int
+tmpfs_unlink(vnode_t *dir, const char *name, size_t namelen)
+{
+        tmpfs_dirent_t *entry;
+        vnode_t *vn;
+
+        krwlock_wrlock(&dir->vn_rwlock);
+        entry = tmpfs_dir_find(VNODE_TO_TMPFSINODE(dir), name, namelen);
+        KASSERT(NULL != entry);
+        vn = vget(dir->vn_fs, entry->td_ino);
+        KASSERT(!S_ISDIR(vn->vn_mode));
+
+        tmpfs_dir_remove(dir, entry);
+        krwlock_wrunlock(&dir->vn_rwlock);
+
+        tmpfs_drop_link(vn);
+        vput(vn);
+        return 0;
+}
+
+static int
+tmpfs_mkdir(vnode_t *dir, const char *name, size_t name_len)
+{
+        tmpfs_t *tfs = VNODE_TO_TMPFS(dir);
+        tmpfs_inode_t *inode;
+        int err;
+
+        krwlock_wrlock(&dir->vn_rwlock);
+        KASSERT(NULL == tmpfs_dir_find(VNODE_TO_TMPFSINODE(dir), name, name_len));
+
+        if (0 <= (err = tmpfs_alloc_inode(tfs, S_IFDIR, 0, &inode))
+            && (0 > (err = tmpfs_dir_init(inode, dir->vn_vno))
+                || 0 > (err = tmpfs_dir_add(dir, name, name_len, inode->ti_ino))))
+                tmpfs_discard_inode(tfs, inode);
+        krwlock_wrunlock(&dir->vn_rwlock);
+        return err;
+}
+
+static int
+tmpfs_rmdir(vnode_t *dir, const char *name, size_t name_len)
+{
+        tmpfs_dirent_t *entry;
+        vnode_t *vn;
+        int err = 0;
+
+        KASSERT(!name_match(".", name, name_len) &&
+                !name_match("..", name, name_len));
+
+        krwlock_wrlock(&dir->vn_rwlock);
+        if (NULL == (entry = tmpfs_dir_find(VNODE_TO_TMPFSINODE(dir), name, name_len))) {
+                krwlock_wrunlock(&dir->vn_rwlock);
+                return -ENOENT;
+        }
+        vn = vget(dir->vn_fs, entry->td_ino);
+
+        if (!S_ISDIR(vn->vn_mode)) {
+                err = -ENOTDIR;
+        } else {
+                /* nothing can be made in it while it is going */
+                krwlock_wrlock(&vn->vn_rwlock);
+                if (VNODE_TO_TMPFSINODE(vn)->ti_nentries > 2)
+                        err = -ENOTEMPTY;
+                else
+                        tmpfs_dir_remove(dir, entry);
+                krwlock_wrunlock(&vn->vn_rwlock);
+        }
+        krwlock_wrunlock(&dir->vn_rwlock);
+
+        if (0 == err)
+                tmpfs_drop_link(vn);
+        vput(vn);
+        return err;
+}
+
+static int
+tmpfs_rw(vnode_t *file, off_t offset, char *buf, size_t count, int write, int user)
+{
+        mmobj_t *obj = VNODE_TO_TMPFSINODE(file)->ti_obj;
+        pframe_t *pfs[PFRAME_RANGE_MAX];
+        size_t done = 0;
+        off_t end;
+        int err = 0;
+
+        KASSERT(S_ISREG(file->vn_mode));
+        if (offset < 0)
+                return -EINVAL;
+        if (0 == count)
+                return 0;
+
+        if (write) {
+                if (offset >= TMPFS_MAX_FILE_SIZE)
+                        return -EFBIG;
+                krwlock_wrlock(&file->vn_rwlock);
+                end = offset + (off_t)MIN(count, (size_t)(TMPFS_MAX_FILE_SIZE - offset));
+        } else {
+                krwlock_rdlock(&file->vn_rwlock);
+                end = offset + (off_t)MIN(count, (size_t)MAX(0, file->vn_len - offset));
+        }
+
+        while (offset < end && 0 == err) {
+                uint32_t pn = ADDR_TO_PN(offset), n, i;
+
+                /*
+                 * Writes bring in a batch of pages at once. Reads go a
+                 * page at a time so that holes read as the zero page
+                 * instead of being filled in.
+                 */
+                if (write) {
+                        n = MIN(ADDR_TO_PN(end - 1) - pn + 1, PFRAME_RANGE_MAX);
+                        if (0 > (err = pframe_get_range(obj, pn, n, pfs)))
+                                break;
+                } else {
+                        n = 1;
+                        if (0 > (err = pframe_lookup(obj, pn, 0, &pfs[0])))
+                                break;
+                        /* nothing has blocked since it was looked up */
+                        pframe_pin(pfs[0]);
+                }
+
+                for (i = 0; i < n && 0 == err; i++) {
+                        size_t len = MIN((size_t)(end - offset), PAGE_SIZE - PAGE_OFFSET(offset));
+                        char *addr = pframe_kmap(pfs[i]);
+                        char *page = addr + PAGE_OFFSET(offset);
+
+                        if (write && user)
+                                err = copy_from_user(page, buf + done, len);
+                        else if (write)
+                                memcpy(page, buf + done, len);
+                        else if (user)
+                                err = copy_to_user(buf + done, page, len);
+                        else
+                                memcpy(buf + done, page, len);
+                        pframe_kunmap(pfs[i], addr);
+                        if (0 == err && write)
+                                err = pframe_dirty(pfs[i]);
+                        if (0 == err) {
+                                done += len;
+                                offset += len;
+                        }
+                }
+                pframe_unpin_range(pfs, n);
+        }
+
+        if (write && offset > file->vn_len)
+                file->vn_len = VNODE_TO_TMPFSINODE(file)->ti_size = offset;
+        if (write)
+                krwlock_wrunlock(&file->vn_rwlock);
+        else
+                krwlock_rdunlock(&file->vn_rwlock);
+
+        return (0 == done && err < 0) ? err : (int)done;
+}
+
+static int
+tmpfs_read(vnode_t *file, off_t offset, void *buf, size_t count)
+{
+        return tmpfs_rw(file, offset, buf, count, 0, 0);
+}
+
+static int
+tmpfs_write(vnode_t *file, off_t offset, const void *buf, size_t count)
+{
+        return tmpfs_rw(file, offset, (char *)buf, count, 1, 0);
+}
+
+static int
+tmpfs_read_user(vnode_t *file, off_t offset, void *buf, size_t count)
+{
+        return tmpfs_rw(file, offset, buf, count, 0, 1);
+}
+
+static int
+tmpfs_write_user(vnode_t *file, off_t offset, const void *buf, size_t count)
+{
+        return tmpfs_rw(file, offset, (char *)buf, count, 1, 1);
+}
+
+static int
+tmpfs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret)
+{
+        *ret = VNODE_TO_TMPFSINODE(file)->ti_obj;
+        return 0;
+}
+
+static void
+tmpfs_fill_dirent(tmpfs_dirent_t *entry, struct dirent *d)
+{
+        d->d_ino = entry->td_ino;
+        d->d_off = 0; /* unused */
+        strcpy(d->d_name, entry->td_name);
+}
+
+static int
+tmpfs_readdir(vnode_t *dir, off_t offset, struct dirent *d)
+{
+        tmpfs_dirent_t *entry;
+        int ret = 0;
+
+        KASSERT(S_ISDIR(dir->vn_mode));
+
+        krwlock_rdlock(&dir->vn_rwlock);
+        if (NULL != (entry = tmpfs_dir_seek(VNODE_TO_TMPFSINODE(dir), offset))) {
+                tmpfs_fill_dirent(entry, d);
+                ret = entry->td_cookie + 1 - offset;
+        }
+        krwlock_rdunlock(&dir->vn_rwlock);
+        return ret;
+}
+
+static int
+tmpfs_readdir_batch(vnode_t *dir, off_t *offset, struct dirent *d, int count)
+{
+        tmpfs_inode_t *inode = VNODE_TO_TMPFSINODE(dir);
+        tmpfs_dirent_t *entry;
+        int n = 0;
+
+        KASSERT(S_ISDIR(dir->vn_mode));
+
+        krwlock_rdlock(&dir->vn_rwlock);
+        entry = tmpfs_dir_seek(inode, *offset);
+        while (NULL != entry && n < count) {
+                tmpfs_fill_dirent(entry, &d[n++]);
+                *offset = entry->td_cookie + 1;
+                if (entry->td_link.l_next == &inode->ti_entries)
+                        break;
+                entry = list_item(entry->td_link.l_next, tmpfs_dirent_t, td_link);
+        }
+        krwlock_rdunlock(&dir->vn_rwlock);
+        return n;
+}
+
+static int
+tmpfs_stat(vnode_t *file, struct stat *buf)
+{
+        tmpfs_inode_t *i = VNODE_TO_TMPFSINODE(file);
+
+        memset(buf, 0, sizeof(struct stat));
+        buf->st_mode    = file->vn_mode;
+        buf->st_ino     = (int) file->vn_vno;
+        buf->st_dev     = 0;
+        if (S_ISCHR(file->vn_mode) || S_ISBLK(file->vn_mode)) {
+                buf->st_rdev  = (int) i->ti_devid;
+        }
+        buf->st_nlink   = i->ti_linkcount - 1;
+        buf->st_size    = (int) file->vn_len;
+        buf->st_blksize = (int) PAGE_SIZE;
+        /* the pages it has in memory, not counting those in swap */
+        buf->st_blocks  = (NULL != i->ti_obj) ? i->ti_obj->mmo_nrespages : 0;
+
+        return 0;
+}
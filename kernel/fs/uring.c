@@ -0,0 +1,645 @@
+#include "kernel.h"
+#include "config.h"
+#include "errno.h"
+#include "globals.h"
+#include "types.h"
+
+#include "mm/kmalloc.h"
+#include "mm/mman.h"
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/workq.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/string.h"
+
+#include "fs/fcntl.h"
+#include "fs/file.h"
+#include "fs/open.h"
+#include "fs/poll.h"
+#include "fs/stat.h"
+#include "fs/uring.h"
+#include "fs/vfs.h"
+#include "fs/vfs_syscall.h"
+#include "fs/vnode.h"
+
+/*
+ * A ring is a file on a pseudo file system like epollfs, whose vnode has
+ * the ring in vn_i. The mapping is an object of the ring's own, all of
+ * whose pages are allocated when it is made and stay pinned, so the
+ * kernel reaches them through their pframes from any thread, without
+ * the address space of the process which mapped them.
+ *
+ * uring_enter takes requests off the submission queue in order. Reads,
+ * writes and fsyncs go to the shared workqueue, whose workers do them
+ * into and out of the buffer area, so several can be waiting on the disk
+ * at once; opens and stats use the caller's descriptors and working
+ * directory, so they are done there and then. Reads and writes are only
+ * of regular files: one of a pipe or socket could keep a worker asleep
+ * for as long as it liked, and the workers are everyone's.
+ *
+ * The kernel keeps its own copies of sq_head and cq_tail, and only ever
+ * stores the ones in the header, so nothing the process writes there can
+ * make it lose its place. Each request in flight holds a reference on
+ * the ring's object, which may outlive the file and the mapping.
+ */
+typedef struct uring {
+        mmobj_t                 ur_mmobj;
+        struct uring_params     ur_params;
+        uint32_t                ur_npages;
+        pframe_t              **ur_pages;       /* all of them, pinned */
+        uint32_t                ur_sqhead;
+        uint32_t                ur_cqtail;
+        uint32_t                ur_inflight;    /* queued to the workers */
+        ktqueue_t               ur_waitq;       /* uring_enter sleeps here */
+        pollhead_t              ur_pollhead;    /* for polling the ring file */
+} uring_t;
+
+typedef struct uring_req {
+        work_t                  rq_work;
+        uring_t                *rq_ur;
+        file_t                 *rq_file;        /* referenced */
+        struct uring_sqe        rq_sqe;
+} uring_req_t;
+
+#define VNODE_TO_URING(vn) ((uring_t *)((vn)->vn_i))
+#define MMOBJ_TO_URING(o) CONTAINER_OF(o, uring_t, ur_mmobj)
+
+/* The byte at off from the start of the mapping */
+#define URING_ADDR(ur, off) \
+        ((char *)(ur)->ur_pages[(off) / PAGE_SIZE]->pf_addr + (off) % PAGE_SIZE)
+#define URING_HDR(ur) ((struct uring_hdr *)URING_ADDR(ur, 0))
+
+static void uring_read_vnode(vnode_t *vnode);
+static void uring_delete_vnode(vnode_t *vnode);
+static int  uring_query_vnode(vnode_t *vnode);
+
+static fs_ops_t uring_fsops = {
+        .read_vnode = uring_read_vnode,
+        .delete_vnode = uring_delete_vnode,
+        .query_vnode = uring_query_vnode,
+        .umount = NULL
+};
+
+static fs_t uring_fs = {
+        .fs_dev = "uring",
+        .fs_type = "uring",
+        .fs_op = &uring_fsops,
+        .fs_root = NULL,
+        .fs_i = NULL
+};
+
+static int uring_mmap(vnode_t *vnode, vmarea_t *vma, mmobj_t **ret);
+static int uring_stat(vnode_t *vnode, struct stat *ss);
+static int uring_poll(vnode_t *vnode, int events, polltable_t *pt);
+
+static vnode_ops_t uring_vops = {
+        .mmap = uring_mmap,
+        .stat = uring_stat,
+        .poll = uring_poll
+};
+
+static void uring_ref(mmobj_t *o);
+static void uring_put(mmobj_t *o);
+static int  uring_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf);
+static int  uring_fillpage(mmobj_t *o, pframe_t *pf);
+static int  uring_dirtypage(mmobj_t *o, pframe_t *pf);
+static int  uring_cleanpage(mmobj_t *o, pframe_t *pf);
+
+static mmobj_ops_t uring_mmobj_ops = {
+        .ref = uring_ref,
+        .put = uring_put,
+        .lookuppage = uring_lookuppage,
+        .fillpage  = uring_fillpage,
+        .dirtypage = uring_dirtypage,
+        .cleanpage = uring_cleanpage
+};
+
+static slab_allocator_t *uring_allocator = NULL;
+static slab_allocator_t *uring_req_allocator = NULL;
+static int next_urno = 0;
+
+static __attribute__((unused)) void
+uring_init(void)
+{
+        uring_allocator = slab_allocator_create("uring", sizeof(uring_t));
+        KASSERT(NULL != uring_allocator);
+        uring_req_allocator = slab_allocator_create("uring_req", sizeof(uring_req_t));
+        KASSERT(NULL != uring_req_allocator);
+}
+init_func(uring_init);
+init_depends(vfs_init);
+
+/* The ring's object */
+static void
+uring_ref(mmobj_t *o)
+{
+        o->mmo_refcount++;
+}
+
+static void
+uring_put(mmobj_t *o)
+{
+        uring_t *ur = MMOBJ_TO_URING(o);
+        uint32_t i;
+
+        if ((o->mmo_refcount - 1) == o->mmo_nrespages) {
+                /* only the pages are left holding it */
+                for (i = 0; i < ur->ur_npages; i++) {
+                        pframe_t *pf = ur->ur_pages[i];
+                        if (NULL != pf) {
+                                ur->ur_pages[i] = NULL;
+                                pframe_unpin(pf);
+                                pframe_free(pf);
+                        }
+                }
+        }
+
+        if (0 < --o->mmo_refcount) {
+                return;
+        }
+
+        KASSERT(0 == ur->ur_inflight);
+        KASSERT(sched_queue_empty(&ur->ur_waitq));
+        if (NULL != ur->ur_pages) {
+                kfree(ur->ur_pages);
+        }
+        slab_obj_free(uring_allocator, ur);
+}
+
+static int
+uring_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
+{
+        uring_t *ur = MMOBJ_TO_URING(o);
+
+        if (pagenum >= ur->ur_npages) {
+                *pf = NULL;
+                return -EFAULT;
+        }
+        return pframe_get(o, pagenum, pf);
+}
+
+static int
+uring_fillpage(mmobj_t *o, pframe_t *pf)
+{
+        page_zero(pf->pf_addr);
+        pframe_pin(pf);
+        return 0;
+}
+
+static int
+uring_dirtypage(mmobj_t *o, pframe_t *pf)
+{
+        return 0;
+}
+
+static int
+uring_cleanpage(mmobj_t *o, pframe_t *pf)
+{
+        return 0;
+}
+
+/* uringfs vnode operations */
+static void
+uring_read_vnode(vnode_t *vnode)
+{
+        vnode->vn_ops = &uring_vops;
+        vnode->vn_mode = 0;
+        vnode->vn_len = 0;
+        vnode->vn_i = NULL;
+}
+
+static void
+uring_delete_vnode(vnode_t *vnode)
+{
+        uring_t *ur = VNODE_TO_URING(vnode);
+
+        if (NULL != ur) {
+                ur->ur_mmobj.mmo_ops->put(&ur->ur_mmobj);
+        }
+}
+
+static int
+uring_query_vnode(vnode_t *vnode)
+{
+        /* as with pipes, nothing can open it again once it is closed */
+        return 0;
+}
+
+static int
+uring_mmap(vnode_t *vnode, vmarea_t *vma, mmobj_t **ret)
+{
+        /* a private copy would be a ring nobody else sees */
+        if (!(vma->vma_flags & MAP_SHARED)) {
+                *ret = NULL;
+                return -EINVAL;
+        }
+        *ret = &VNODE_TO_URING(vnode)->ur_mmobj;
+        return 0;
+}
+
+static int
+uring_stat(vnode_t *vnode, struct stat *ss)
+{
+        memset(ss, 0, sizeof(*ss));
+        ss->st_mode = vnode->vn_mode;
+        ss->st_ino = (int) vnode->vn_vno;
+        ss->st_size = (int) VNODE_TO_URING(vnode)->ur_params.size;
+        ss->st_blksize = (int) PAGE_SIZE;
+        return 0;
+}
+
+/* Completions the process has yet to take off the queue. What it has
+ * put in cq_head is not to be trusted, so this is at most a full queue. */
+static uint32_t
+uring_cq_ready(uring_t *ur)
+{
+        return MIN(ur->ur_cqtail - URING_HDR(ur)->cq_head, ur->ur_params.cq_entries);
+}
+
+/* A ring is readable when there are completions on it. */
+static int
+uring_poll(vnode_t *vnode, int events, polltable_t *pt)
+{
+        uring_t *ur = VNODE_TO_URING(vnode);
+
+        poll_wait(&ur->ur_pollhead, pt);
+        return (0 < uring_cq_ready(ur)) ? POLLIN : 0;
+}
+
+/* Posts the completion of the request with user_data */
+static void
+uring_complete(uring_t *ur, uint64_t user_data, int res)
+{
+        struct uring_hdr *hdr = URING_HDR(ur);
+        struct uring_cqe *cqe;
+        uint32_t off;
+
+        /* uring_enter never has more in flight than there is room for,
+         * but the process may not have kept its cq_head in order */
+        if (uring_cq_ready(ur) >= ur->ur_params.cq_entries) {
+                hdr->cq_overflow++;
+        } else {
+                off = ur->ur_params.cq_off
+                      + (ur->ur_cqtail & (ur->ur_params.cq_entries - 1)) * sizeof(*cqe);
+                cqe = (struct uring_cqe *)URING_ADDR(ur, off);
+                cqe->user_data = user_data;
+                cqe->res = res;
+                cqe->pad = 0;
+                hdr->cq_tail = ++ur->ur_cqtail;
+        }
+        sched_broadcast_on(&ur->ur_waitq);
+        poll_wakeup(&ur->ur_pollhead);
+}
+
+/* Copies len bytes between buf and the buffer area at off, which the
+ * caller has checked are in it */
+static void
+uring_buf_copy(uring_t *ur, uint32_t off, void *buf, size_t len, int tobuf)
+{
+        char *p = buf;
+
+        off += ur->ur_params.buf_off;
+        while (len > 0) {
+                size_t n = MIN(len, PAGE_SIZE - off % PAGE_SIZE);
+
+                if (tobuf) {
+                        memcpy(p, URING_ADDR(ur, off), n);
+                } else {
+                        memcpy(URING_ADDR(ur, off), p, n);
+                }
+                off += n;
+                p += n;
+                len -= n;
+        }
+}
+
+static int
+uring_buf_ok(uring_t *ur, uint32_t off, uint32_t len)
+{
+        return off <= ur->ur_params.buf_len && len <= ur->ur_params.buf_len - off;
+}
+
+/* A read or write of len bytes of the buffer area at addr, a page at a
+ * time since its pages are not next to each other in the kernel, with
+ * the result of read_file or write_file */
+static int
+uring_rw(uring_t *ur, file_t *f, struct uring_sqe *sqe)
+{
+        vnode_t *vn = f->f_vnode;
+        int write = (URING_OP_WRITE == sqe->opcode);
+        uint32_t addr = ur->ur_params.buf_off + sqe->addr;
+        uint32_t left = sqe->len;
+        off_t pos;
+        int total = 0;
+        int err = 0;
+
+        if (-1 != sqe->off) {
+                pos = sqe->off;
+        } else if (write && (f->f_mode & FMODE_APPEND)) {
+                pos = vn->vn_len;
+        } else {
+                pos = f->f_pos;
+        }
+
+        if (write) {
+                vnode_modified(vn);
+        }
+        while (left > 0) {
+                size_t n = MIN(left, PAGE_SIZE - addr % PAGE_SIZE);
+                int done;
+
+                if (write) {
+                        done = vn->vn_ops->write(vn, pos, URING_ADDR(ur, addr), n);
+                } else {
+                        done = vn->vn_ops->read(vn, pos, URING_ADDR(ur, addr), n);
+                }
+                if (0 > done) {
+                        err = done;
+                        break;
+                }
+                pos += done;
+                total += done;
+                addr += done;
+                left -= done;
+                if ((size_t)done != n) {
+                        /* the end of the file, or of the disk */
+                        if (write) {
+                                err = -ENOSPC;
+                        }
+                        break;
+                }
+        }
+
+        if (-1 == sqe->off) {
+                f->f_pos = pos;
+        }
+        return (0 == total) ? err : total;
+}
+
+/* What a worker does with each request queued to it */
+static void
+uring_work(work_t *w)
+{
+        uring_req_t *rq = w->w_data;
+        uring_t *ur = rq->rq_ur;
+        vnode_t *vn = rq->rq_file->f_vnode;
+        int res;
+
+        if (URING_OP_FSYNC == rq->rq_sqe.opcode) {
+                res = vn->vn_ops->fsync(vn, rq->rq_sqe.op_flags & URING_FSYNC_DATASYNC);
+        } else {
+                res = uring_rw(ur, rq->rq_file, &rq->rq_sqe);
+        }
+        fput(rq->rq_file);
+
+        ur->ur_inflight--;
+        uring_complete(ur, rq->rq_sqe.user_data, res);
+        slab_obj_free(uring_req_allocator, rq);
+        ur->ur_mmobj.mmo_ops->put(&ur->ur_mmobj);
+}
+
+/* Hands a read, write or fsync to the workers, or returns -errno for the
+ * completion if it cannot be done at all */
+static int
+uring_queue(uring_t *ur, struct uring_sqe *sqe)
+{
+        uring_req_t *rq;
+        file_t *f;
+        int err;
+
+        if (sqe->fd < 0 || sqe->fd >= NFILES || NULL == (f = fget(sqe->fd))) {
+                return -EBADF;
+        }
+
+        if (URING_OP_FSYNC == sqe->opcode) {
+                err = (NULL == f->f_vnode->vn_ops->fsync) ? -EINVAL : 0;
+        } else if (!(f->f_mode & ((URING_OP_READ == sqe->opcode) ? FMODE_READ : FMODE_WRITE))) {
+                err = -EBADF;
+        } else if (S_ISDIR(f->f_vnode->vn_mode)) {
+                err = -EISDIR;
+        } else if (!S_ISREG(f->f_vnode->vn_mode) || sqe->off < -1
+                   || !uring_buf_ok(ur, sqe->addr, sqe->len)) {
+                err = -EINVAL;
+        } else {
+                err = 0;
+        }
+        if (0 > err) {
+                fput(f);
+                return err;
+        }
+
+        if (NULL == (rq = slab_obj_alloc(uring_req_allocator))) {
+                fput(f);
+                return -ENOMEM;
+        }
+        rq->rq_ur = ur;
+        rq->rq_file = f;
+        rq->rq_sqe = *sqe;
+        work_init(&rq->rq_work, uring_work, rq);
+
+        ur->ur_mmobj.mmo_ops->ref(&ur->ur_mmobj);
+        ur->ur_inflight++;
+        work_queue(&rq->rq_work);
+        return 0;
+}
+
+/* An open or stat, of the path of sqe->len bytes at sqe->addr */
+static int
+uring_path_op(uring_t *ur, struct uring_sqe *sqe)
+{
+        struct stat ss;
+        char *path;
+        int err;
+
+        if (0 == sqe->len || sqe->len > MAXPATHLEN || !uring_buf_ok(ur, sqe->addr, sqe->len)) {
+                return -EINVAL;
+        }
+        if (URING_OP_STAT == sqe->opcode
+            && (sqe->off < 0 || !uring_buf_ok(ur, sqe->off, sizeof(ss)))) {
+                return -EINVAL;
+        }
+
+        if (NULL == (path = kmalloc(sqe->len + 1))) {
+                return -ENOMEM;
+        }
+        uring_buf_copy(ur, sqe->addr, path, sqe->len, 1);
+        path[sqe->len] = '\0';
+
+        if (URING_OP_OPEN == sqe->opcode) {
+                err = do_open(path, sqe->op_flags);
+        } else if (0 == (err = do_stat(path, &ss))) {
+                uring_buf_copy(ur, sqe->off, &ss, sizeof(ss), 0);
+        }
+        kfree(path);
+        return err;
+}
+
+/* Puts the ring's pages in place and works out where everything is */
+static int
+uring_alloc(uint32_t entries, uint32_t buflen, uring_t **urp)
+{
+        struct uring_params *p;
+        uring_t *ur;
+        uint32_t i, ringlen;
+        int err;
+
+        if (NULL == (ur = slab_obj_alloc(uring_allocator))) {
+                return -ENOMEM;
+        }
+        mmobj_init(&ur->ur_mmobj, &uring_mmobj_ops);
+        ur->ur_mmobj.mmo_ops->ref(&ur->ur_mmobj);
+        ur->ur_sqhead = 0;
+        ur->ur_cqtail = 0;
+        ur->ur_inflight = 0;
+        sched_queue_init(&ur->ur_waitq);
+        pollhead_init(&ur->ur_pollhead);
+
+        p = &ur->ur_params;
+        for (p->sq_entries = 1; p->sq_entries < entries; p->sq_entries <<= 1)
+                ;
+        p->cq_entries = 2 * p->sq_entries;
+        p->sq_off = 64;
+        p->cq_off = p->sq_off + p->sq_entries * sizeof(struct uring_sqe);
+        ringlen = (uint32_t)PAGE_ALIGN_UP(p->cq_off + p->cq_entries * sizeof(struct uring_cqe));
+        p->buf_off = ringlen;
+        p->buf_len = (uint32_t)PAGE_ALIGN_UP(buflen);
+        p->size = ringlen + p->buf_len;
+
+        ur->ur_npages = p->size / PAGE_SIZE;
+        if (NULL == (ur->ur_pages = kmalloc(ur->ur_npages * sizeof(pframe_t *)))) {
+                ur->ur_npages = 0;
+                ur->ur_mmobj.mmo_ops->put(&ur->ur_mmobj);
+                return -ENOMEM;
+        }
+        memset(ur->ur_pages, 0, ur->ur_npages * sizeof(pframe_t *));
+        for (i = 0; i < ur->ur_npages; i++) {
+                if (0 > (err = pframe_get(&ur->ur_mmobj, i, &ur->ur_pages[i]))) {
+                        ur->ur_pages[i] = NULL;
+                        ur->ur_mmobj.mmo_ops->put(&ur->ur_mmobj);
+                        return err;
+                }
+        }
+
+        *urp = ur;
+        return 0;
+}
+
+int
+do_uring_setup(uint32_t entries, uint32_t buflen, struct uring_params *params)
+{
+        uring_t *ur;
+        vnode_t *vn;
+        file_t *f;
+        int fd, err;
+
+        if (0 == entries || entries > URING_MAX_ENTRIES
+            || buflen > URING_MAX_BUF_PAGES * PAGE_SIZE) {
+                return -EINVAL;
+        }
+
+        if (0 > (fd = get_empty_fd(curproc))) {
+                return fd;
+        }
+        if (0 > (err = uring_alloc(entries, buflen, &ur))) {
+                return err;
+        }
+        if (NULL == (vn = vget(&uring_fs, next_urno++))) {
+                ur->ur_mmobj.mmo_ops->put(&ur->ur_mmobj);
+                return -ENOMEM;
+        }
+        vn->vn_i = ur;
+
+        if (NULL == (f = fget(-1))) {
+                vput(vn);
+                return -ENOMEM;
+        }
+        fdtable_install(&curproc->p_fdtable, fd, f);
+        f->f_mode = FMODE_READ | FMODE_WRITE;
+        f->f_pos = 0;
+        facq(f, vn);
+
+        *params = ur->ur_params;
+        return fd;
+}
+
+int
+do_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete)
+{
+        struct uring_sqe sqe;
+        struct uring_hdr *hdr;
+        uring_t *ur;
+        file_t *f;
+        uint32_t n, off;
+        int res, err = 0;
+
+        if (fd < 0 || fd >= NFILES || NULL == (f = fget(fd))) {
+                return -EBADF;
+        }
+        if (&uring_fs != f->f_vnode->vn_fs) {
+                fput(f);
+                return -EINVAL;
+        }
+        ur = VNODE_TO_URING(f->f_vnode);
+        hdr = URING_HDR(ur);
+
+        if (hdr->sq_tail - ur->ur_sqhead > ur->ur_params.sq_entries) {
+                fput(f);
+                return -EINVAL;
+        }
+        to_submit = MIN(to_submit, hdr->sq_tail - ur->ur_sqhead);
+
+        for (n = 0; n < to_submit; n++) {
+                /* every request must have room for its completion */
+                if (ur->ur_inflight + uring_cq_ready(ur) >= ur->ur_params.cq_entries) {
+                        if (0 == n) {
+                                err = -EBUSY;
+                        }
+                        break;
+                }
+
+                off = ur->ur_params.sq_off
+                      + (ur->ur_sqhead & (ur->ur_params.sq_entries - 1)) * sizeof(sqe);
+                memcpy(&sqe, URING_ADDR(ur, off), sizeof(sqe));
+                hdr->sq_head = ++ur->ur_sqhead;
+
+                if (0 != sqe.flags) {
+                        res = -EINVAL;
+                } else {
+                        switch (sqe.opcode) {
+                                case URING_OP_NOP:
+                                        res = 0;
+                                        break;
+                                case URING_OP_READ:
+                                case URING_OP_WRITE:
+                                case URING_OP_FSYNC:
+                                        if (0 == (res = uring_queue(ur, &sqe))) {
+                                                continue;
+                                        }
+                                        break;
+                                case URING_OP_OPEN:
+                                case URING_OP_STAT:
+                                        res = uring_path_op(ur, &sqe);
+                                        break;
+                                default:
+                                        res = -EINVAL;
+                                        break;
+                        }
+                }
+                uring_complete(ur, sqe.user_data, res);
+        }
+
+        min_complete = MIN(min_complete, ur->ur_params.cq_entries);
+        while (0 == err && uring_cq_ready(ur) < min_complete && 0 < ur->ur_inflight) {
+                err = sched_cancellable_sleep_on(&ur->ur_waitq);
+        }
+
+        fput(f);
+        return (0 < n) ? (int)n : err;
+}
@@ -14,12 +14,15 @@
 
 #ifdef __S5FS__
 #include "fs/s5fs/s5fs.h"
+#include "fs/rofs/rofs.h"
 #endif
+#include "fs/dcache.h"
 #include "fs/vfs.h"
 #include "fs/file.h"
 #include "fs/vnode.h"
 #include "fs/vfs_syscall.h"
 #include "fs/ramfs/ramfs.h"
+#include "fs/tmpfs/tmpfs.h"
 
 #include "fs/stat.h"
 #include "fs/fcntl.h"
@@ -34,50 +37,84 @@ vnode_t *vfs_root_vn;
 list_t mounted_fs_list;
 
 /*
- * Implementing this function is not required and strongly discouraged unless
- * you are absolutley sure your Weenix is perfect.
+ * Sets up the pointers between the file system struct and the vnode of the
+ * mount point. The caller's reference on mtpt becomes fs->fs_mtpt's. There
+ * is no reference on the file system's root for mtpt->vn_mount: the file
+ * system already keeps one, which goes only when it is unmounted, and a
+ * second would look like a user to vfs_is_in_use().
  *
- * The purpose of this function is to set up the pointers between the file
- * system struct and the vnode of the mount point. Remember to watch your
- * reference counts. (The exception here is when the vnode's vn_mount field
- * points to the mounted file system's root we do not increment the reference
- * count on the file system's root vnode. The file system is already keeping
- * a reference to the vnode which will not go away until the file system is
- * unmounted. If we kept a second such reference it would conflict with the
- * behavior of vfs_is_in_use(), make sure you understand why.)
+ * From then on vget() of mtpt gives the root instead, and lookup() goes
+ * back across for "..". Names in the name cache which led to mtpt still
+ * do, through vget().
  *
- * Once everything is set up add the file system to the list of mounted file
- * systems.
- *
- * Remember proper error handling.
- *
- * This function is not meant to mount the root file system.
+ * This is not meant to mount the root file system.
  */
 int
 vfs_mount(struct vnode *mtpt, fs_t *fs)
 {
-        NOT_YET_IMPLEMENTED("MOUNTING: vfs_mount");
-        return -EINVAL;
+        KASSERT(mtpt && fs && fs->fs_root);
+
+        if (!S_ISDIR(mtpt->vn_mode))
+                return -ENOTDIR;
+        /* a vnode hidden by a mount is never handed out, so this is also
+         * the test for something being mounted here already */
+        if (mtpt == mtpt->vn_fs->fs_root)
+                return -EBUSY;
+        KASSERT(mtpt->vn_mount == mtpt);
+
+        fs->fs_mtpt = mtpt;
+        mtpt->vn_mount = fs->fs_root;
+        list_insert_tail(&mounted_fs_list, &fs->fs_link);
+
+        dbg(DBG_VFS, "mounted %s on %s at vnode %d of fs %p\n",
+            fs->fs_type, fs->fs_dev, (int)mtpt->vn_vno, mtpt->vn_fs);
+        return 0;
 }
 
 /*
- * Implementing this function is not required and strongly discouraged unless
- * you are absolutley sure your Weenix is perfect.
+ * Undoes vfs_mount(), calls the file system's umount(), and frees the fs
+ * struct. Fails with EBUSY, leaving it mounted, if anything is still using
+ * it: an open file, a process's cwd, a mapping, or another file system
+ * mounted on it.
  *
- * The purpose of this function is to undo the setup done in vfs_mount(). Also
- * you should call the underlying file system's umount() function. Make sure
- * to keep track of reference counts. You should also kfree the fs struct at
- * the end of this method.
- *
- * Remember proper error handling. You might want to make sure that you do not
- * try to call this function on the root file system (this function is not meant
- * to unmount the root file system).
+ * This is not meant to unmount the root file system.
  */
 int
 vfs_umount(fs_t *fs)
 {
-        NOT_YET_IMPLEMENTED("MOUNTING: vfs_umount");
-        return -EINVAL;
+        vnode_t *mtpt = fs->fs_mtpt;
+        fs_t *other;
+        int ret;
+
+        KASSERT(fs != vfs_root_vn->vn_fs);
+        KASSERT(mtpt->vn_mount == fs->fs_root);
+
+        list_iterate_begin(&mounted_fs_list, other, fs_t, fs_link) {
+                if (other->fs_mtpt->vn_fs == fs)
+                        return -EBUSY;
+        } list_iterate_end();
+
+        /* what is left in the vnode cache holds no references, but
+         * would outlive the fs */
+        vnode_drop_cached(fs);
+        if (0 > vfs_is_in_use(fs))
+                return -EBUSY;
+
+        list_remove(&fs->fs_link);
+        mtpt->vn_mount = mtpt;
+        dcache_forget_fs(fs);
+
+        if (fs->fs_op->umount) {
+                ret = fs->fs_op->umount(fs);
+        } else {
+                vput(fs->fs_root);
+                ret = 0;
+        }
+        KASSERT(!vnode_inuse(fs));
+
+        vput(mtpt);
+        kfree(fs);
+        return ret;
 }
 #endif /* __MOUNTING__ */
 
@@ -132,6 +169,7 @@ vfs_init(void)
 init_func(vfs_init);
 init_depends(vnode_init);
 init_depends(file_init);
+init_depends(dcache_init);
 
 int
 vfs_shutdown()
@@ -146,11 +184,12 @@ vfs_shutdown()
         KASSERT(vfs_root_vn);
 
 #ifdef __MOUNTING__
-        fs_t *mtfs;
-        list_iterate_begin(&mounted_fs_list, mtfs, fs_t, fs_link) {
-                int ret = vfs_umount(mtfs);
+        /* the last mounted first, so that nothing is mounted on each one
+         * by the time it goes */
+        while (!list_empty(&mounted_fs_list)) {
+                int ret = vfs_umount(list_tail(&mounted_fs_list, fs_t, fs_link));
                 KASSERT(0 <= ret);
-        } list_iterate_end();
+        }
 #endif
 
 
@@ -166,6 +205,8 @@ vfs_shutdown()
                       "filesystem!!! This shouldn't happen!!\n");
         }
 
+        vnode_drop_cached(fs);
+
         if (vn->vn_fs->fs_op->umount) {
                 ret = vn->vn_fs->fs_op->umount(fs);
         } else {
@@ -178,6 +219,7 @@ vfs_shutdown()
 
         vfs_root_vn = NULL; /* not /really/ necessary... */
 
+        dcache_forget_fs(fs);
         kfree(fs);
 
         return ret;
@@ -196,8 +238,10 @@ mountfunc(fs_t *fs)
         } types[] = {
 #ifdef __S5FS__
                 { "s5fs", s5fs_mount },
+                { "rofs", rofs_mount },
 #endif
                 { "ramfs", ramfs_mount },
+                { "tmpfs", tmpfs_mount },
         };
         unsigned i;
 
@@ -8,7 +8,9 @@
 
 #include "kernel.h"
 #include "errno.h"
+#include "limits.h"
 #include "globals.h"
+#include "fs/dcache.h"
 #include "fs/vfs.h"
 #include "fs/file.h"
 #include "fs/vnode.h"
@@ -17,11 +19,78 @@
 #include "fs/fcntl.h"
 #include "fs/lseek.h"
 #include "mm/kmalloc.h"
+#include "mm/pframe.h"
+#include "mm/page.h"
 #include "util/string.h"
 #include "util/printf.h"
 #include "fs/stat.h"
+#include "fs/uio.h"
 #include "util/debug.h"
 #include "drivers/dev.h"
+#include "api/access.h"
+#include "mm/mman.h"
+#include "mm/pagetable.h"
+#include "mm/tlb.h"
+#include "vm/vmmap.h"
+
+/*
+ * Reads or writes len bytes of vn at off for a file opened with O_DIRECT:
+ * the pages of the user buffer are pinned, PFRAME_RANGE_MAX at a time,
+ * and the direct_io op moves the file's blocks straight between them and
+ * the disk. The buffer, len and off all have to be page-aligned. Returns
+ * the number of bytes moved, or -errno if that was none.
+ */
+static int
+direct_file(vnode_t *vn, off_t off, void *ubuf, size_t len, int write)
+{
+    pframe_t *pfs[PFRAME_RANGE_MAX];
+    size_t done = 0;
+    int err = 0;
+
+    if (PAGE_OFFSET(ubuf) || PAGE_OFFSET(off) || PAGE_OFFSET(len)) {
+        return -EINVAL;
+    }
+    /*reading the file writes the buffer*/
+    if (!range_perm(curproc, ubuf, len, write ? PROT_READ : PROT_WRITE)) {
+        return -EFAULT;
+    }
+
+    while (done < len) {
+        uintptr_t vaddr = (uintptr_t)ubuf + done;
+        uint32_t npages = MIN((len - done) / PAGE_SIZE, PFRAME_RANGE_MAX);
+        err = vmmap_pin_pages(curproc->p_vmmap, ADDR_TO_PN(vaddr), npages, pfs, !write);
+        if (err < 0) {
+            break;
+        }
+
+        int n = vn->vn_ops->direct_io(vn, off + done, pfs, npages, write);
+        if (!write && n > 0) {
+            /*the pages are what a write fault would have found, which
+             *may be copies the page table does not map yet*/
+            uint32_t i;
+            for (i = 0; i * PAGE_SIZE < (uint32_t)n; i++) {
+                if ((err = pframe_dirty(pfs[i])) < 0) {
+                    n = (0 == i) ? err : (int)(i * PAGE_SIZE);
+                    break;
+                }
+            }
+            pt_unmap_range(curproc->p_pagedir, vaddr, vaddr + npages * PAGE_SIZE);
+            tlb_flush_range(vaddr, npages);
+        }
+        vmmap_unpin_pages(pfs, npages);
+
+        if (n < 0) {
+            err = n;
+            break;
+        }
+        done += n;
+        if ((uint32_t)n != npages * PAGE_SIZE) {
+            break;
+        }
+    }
+
+    return (0 == done) ? err : (int)done;
+}
 
 /* To read a file:
  *      o fget(fd)
@@ -38,12 +107,20 @@
  *
  * In all cases, be sure you do not leak file refcounts by returning before
  * you fput() a file that you fget()'ed.
+ *
+ * read_file reads into each of the iovcnt segments of iov in turn,
+ * stopping early at the end of the file. If pos is -1 it reads from and
+ * advances f_pos, otherwise it reads from pos and leaves f_pos alone
+ * (files which cannot seek return -ESPIPE). If user is set, the segments
+ * are user addresses and the file's read_user op is used; -ENOTSUP is
+ * returned for files without one. A file opened with O_DIRECT reads user
+ * segments with direct_file() instead.
  */
-int
-do_read(int fd, void *buf, size_t nbytes)
+static int
+read_file(int fd, const struct iovec *iov, int iovcnt, off_t pos, int user)
 {
     dbg(DBG_VFS, "syscall hook\n");
-    KASSERT(buf);
+    KASSERT(user || iov[0].iov_base);
 
     if (fd <= -1 || fd >= NFILES) {
         return -EBADF;
@@ -70,22 +147,102 @@ do_read(int fd, void *buf, size_t nbytes)
         return -EISDIR;
     }
 
-    /*call virtual read op*/
-    int readlen = f->f_vnode->vn_ops->read(f->f_vnode, f->f_pos, buf, nbytes);
-    if (readlen < 0) {
+    if (pos != -1 && !S_ISREG(f->f_vnode->vn_mode)) {
         fput(f);
-        return readlen;
+        return -ESPIPE;
+    }
+
+    if (user && f->f_vnode->vn_ops->read_user == NULL) {
+        fput(f);
+        return -ENOTSUP;
+    }
+
+    /*call virtual read op on each segment*/
+    off_t off = (pos == -1) ? f->f_pos : pos;
+    int total = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        int readlen;
+        if (user && (f->f_mode & FMODE_DIRECT)) {
+            readlen = direct_file(f->f_vnode, off, iov[i].iov_base, iov[i].iov_len, 0);
+        } else if (user) {
+            readlen = f->f_vnode->vn_ops->read_user(f->f_vnode, off,
+                        iov[i].iov_base, iov[i].iov_len);
+        } else {
+            readlen = f->f_vnode->vn_ops->read(f->f_vnode, off,
+                        iov[i].iov_base, iov[i].iov_len);
+        }
+        if (readlen < 0) {
+            /*report what was read before the error, if anything*/
+            if (total == 0) {
+                total = readlen;
+            }
+            break;
+        }
+        off += readlen;
+        total += readlen;
+        if ((unsigned)readlen != iov[i].iov_len) {
+            break;
+        }
+    }
+    if (pos == -1) {
+        f->f_pos = off;
     }
-    f->f_pos += readlen;
 
     /*fput it*/
     fput(f);
 
-    return readlen;
+    return total;
         /*NOT_YET_IMPLEMENTED("VFS: do_read");*/
         /*return -1;*/
 }
 
+int
+do_read(int fd, void *buf, size_t nbytes)
+{
+    struct iovec iov = { buf, nbytes };
+    return read_file(fd, &iov, 1, -1, 0);
+}
+
+int
+do_read_user(int fd, void *ubuf, size_t nbytes)
+{
+    struct iovec iov = { ubuf, nbytes };
+    return read_file(fd, &iov, 1, -1, 1);
+}
+
+int
+do_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    return read_file(fd, iov, iovcnt, -1, 0);
+}
+
+int
+do_readv_user(int fd, const struct iovec *uiov, int iovcnt)
+{
+    return read_file(fd, uiov, iovcnt, -1, 1);
+}
+
+int
+do_pread(int fd, void *buf, size_t nbytes, off_t pos)
+{
+    if (pos < 0) {
+        return -EINVAL;
+    }
+    struct iovec iov = { buf, nbytes };
+    return read_file(fd, &iov, 1, pos, 0);
+}
+
+int
+do_pread_user(int fd, void *ubuf, size_t nbytes, off_t pos)
+{
+    if (pos < 0) {
+        return -EINVAL;
+    }
+    struct iovec iov = { ubuf, nbytes };
+    return read_file(fd, &iov, 1, pos, 1);
+}
+
 /* Very similar to do_read.  Check f_mode to be sure the file is writable.  If
  * f_mode & FMODE_APPEND, do_lseek() to the end of the file, call the write
  * f_op, and fput the file.  As always, be mindful of refcount leaks.
@@ -93,12 +250,15 @@ do_read(int fd, void *buf, size_t nbytes)
  * Error cases you must handle for this function at the VFS level:
  *      o EBADF
  *        fd is not a valid file descriptor or is not open for writing.
+ *
+ * iov, pos and user are as for read_file(), with the write_user op and
+ * direct_file(); a write at pos ignores FMODE_APPEND.
  */
-int
-do_write(int fd, const void *buf, size_t nbytes)
+static int
+write_file(int fd, const struct iovec *iov, int iovcnt, off_t pos, int user)
 {
     dbg(DBG_VFS, "syscall hook\n");
-    KASSERT(buf);
+    KASSERT(user || iov[0].iov_base);
 
     if (fd < 0 || fd >= NFILES) {
         return -EBADF;
@@ -116,29 +276,296 @@ do_write(int fd, const void *buf, size_t nbytes)
         return -EBADF;
     }
 
-    if (f->f_mode & FMODE_APPEND) {
-        do_lseek(fd, 0, SEEK_END);
+    if (pos != -1 && !S_ISREG(f->f_vnode->vn_mode)) {
+        fput(f);
+        return -ESPIPE;
     }
 
-    int writelen = f->f_vnode->vn_ops->write(f->f_vnode, f->f_pos, buf, nbytes);
-    if (writelen < 0) {
+    if (user && f->f_vnode->vn_ops->write_user == NULL) {
         fput(f);
-        return writelen;
+        return -ENOTSUP;
     }
-    f->f_pos += writelen;
 
-    fput(f);
+    if (pos == -1 && (f->f_mode & FMODE_APPEND)) {
+        do_lseek(fd, 0, SEEK_END);
+    }
 
-    if ((unsigned)writelen != nbytes) {
-        return -ENOSPC;
+    off_t off = (pos == -1) ? f->f_pos : pos;
+    int total = 0;
+    int i;
+    vnode_modified(f->f_vnode);
+    for (i = 0; i < iovcnt; i++) {
+        int writelen;
+        if (user && (f->f_mode & FMODE_DIRECT)) {
+            writelen = direct_file(f->f_vnode, off, iov[i].iov_base, iov[i].iov_len, 1);
+        } else if (user) {
+            writelen = f->f_vnode->vn_ops->write_user(f->f_vnode, off,
+                        iov[i].iov_base, iov[i].iov_len);
+        } else {
+            writelen = f->f_vnode->vn_ops->write(f->f_vnode, off,
+                        iov[i].iov_base, iov[i].iov_len);
+        }
+        if (writelen < 0) {
+            /*report what was written before the error, if anything*/
+            if (total == 0) {
+                total = writelen;
+            }
+            break;
+        }
+        off += writelen;
+        total += writelen;
+        if ((unsigned)writelen != iov[i].iov_len) {
+            /*out of room: the rest of the segments would not fit either*/
+            if (total == 0) {
+                total = -ENOSPC;
+            }
+            break;
+        }
+    }
+    if (pos == -1) {
+        f->f_pos = off;
     }
-    return writelen;
+
+    fput(f);
+
+    /*no locks held anymore, wait here if too much is left to write back*/
+    pframe_balance_dirty();
+
+    return total;
         /*NOT_YET_IMPLEMENTED("VFS: do_write");*/
         /*return -1;*/
 }
 
+int
+do_write(int fd, const void *buf, size_t nbytes)
+{
+    struct iovec iov = { (void *)buf, nbytes };
+    return write_file(fd, &iov, 1, -1, 0);
+}
+
+int
+do_write_user(int fd, const void *ubuf, size_t nbytes)
+{
+    struct iovec iov = { (void *)ubuf, nbytes };
+    return write_file(fd, &iov, 1, -1, 1);
+}
+
+int
+do_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    return write_file(fd, iov, iovcnt, -1, 0);
+}
+
+int
+do_writev_user(int fd, const struct iovec *uiov, int iovcnt)
+{
+    return write_file(fd, uiov, iovcnt, -1, 1);
+}
+
+int
+do_pwrite(int fd, const void *buf, size_t nbytes, off_t pos)
+{
+    if (pos < 0) {
+        return -EINVAL;
+    }
+    struct iovec iov = { (void *)buf, nbytes };
+    return write_file(fd, &iov, 1, pos, 0);
+}
+
+int
+do_pwrite_user(int fd, const void *ubuf, size_t nbytes, off_t pos)
+{
+    if (pos < 0) {
+        return -EINVAL;
+    }
+    struct iovec iov = { (void *)ubuf, nbytes };
+    return write_file(fd, &iov, 1, pos, 1);
+}
+
 /*
- * Zero curproc->p_files[fd], and fput() the file. Return 0 on success
+ * Copies count bytes from in_fd to out_fd without them passing through
+ * user space. If offp is NULL the data comes from in_fd's position,
+ * which is advanced; otherwise it comes from *offp, which is advanced
+ * instead. out_fd is written as by do_write. Returns the number of bytes
+ * copied, which is short at the end of in_fd, or -errno if nothing was.
+ *
+ * A regular file whose pages are cached in vn_mmobj is written to
+ * out_fd straight from its pframes, PFRAME_RANGE_MAX pages at a time.
+ * Anything else is read into a kernel page first.
+ */
+int
+do_sendfile(int out_fd, int in_fd, off_t *offp, size_t count)
+{
+    if (in_fd < 0 || in_fd >= NFILES || out_fd < 0 || out_fd >= NFILES) {
+        return -EBADF;
+    }
+
+    file_t *in = fget(in_fd);
+    if (in == NULL) {
+        return -EBADF;
+    }
+    if ((in->f_mode & FMODE_READ) == 0) {
+        fput(in);
+        return -EBADF;
+    }
+    if (S_ISDIR(in->f_vnode->vn_mode)) {
+        fput(in);
+        return -EISDIR;
+    }
+
+    vnode_t *vn = in->f_vnode;
+    int cached = S_ISREG(vn->vn_mode) && vn->vn_ops->fillpage != NULL;
+    if (offp != NULL && !S_ISREG(vn->vn_mode)) {
+        fput(in);
+        return -ESPIPE;
+    }
+    off_t pos = (offp == NULL) ? in->f_pos : *offp;
+    if (pos < 0) {
+        fput(in);
+        return -EINVAL;
+    }
+
+    /*writing a file into itself could chase its own tail*/
+    file_t *out = fget(out_fd);
+    if (out == NULL) {
+        fput(in);
+        return -EBADF;
+    }
+    int same = (out->f_vnode == vn);
+    fput(out);
+    if (same) {
+        fput(in);
+        return -EINVAL;
+    }
+
+    void *kbuf = NULL;
+    if (!cached && count > 0 && (kbuf = page_alloc()) == NULL) {
+        fput(in);
+        return -ENOMEM;
+    }
+
+    int total = 0;
+    int err = 0;
+    count = MIN(count, (size_t)INT_MAX);
+    while (count > 0 && err == 0) {
+        if (!cached) {
+            int n = vn->vn_ops->read(vn, pos, kbuf, MIN(count, PAGE_SIZE));
+            if (n <= 0) {
+                err = n;
+                break;
+            }
+            int w = do_write(out_fd, kbuf, n);
+            if (w < 0) {
+                err = w;
+                break;
+            }
+            pos += w;
+            total += w;
+            count -= w;
+            continue;
+        }
+
+        if (pos >= vn->vn_len) {
+            break;
+        }
+        size_t len = MIN(count, (size_t)(vn->vn_len - pos));
+        uint32_t first = ADDR_TO_PN(pos);
+        uint32_t npages = MIN(ADDR_TO_PN(pos + len - 1) - first + 1,
+                              PFRAME_RANGE_MAX);
+        pframe_t *pfs[PFRAME_RANGE_MAX];
+
+        vnode_readahead(vn, first, npages);
+        if ((err = pframe_get_range(&vn->vn_mmobj, first, npages, pfs)) < 0) {
+            break;
+        }
+        uint32_t i;
+        for (i = 0; i < npages && count > 0; i++) {
+            size_t from = PAGE_OFFSET(pos);
+            size_t n = MIN(PAGE_SIZE - from, count);
+            int w = do_write(out_fd, (char *)pfs[i]->pf_addr + from, n);
+            if (w < 0) {
+                err = w;
+                break;
+            }
+            pos += w;
+            total += w;
+            count -= w;
+        }
+        pframe_unpin_range(pfs, npages);
+    }
+
+    if (kbuf != NULL) {
+        page_free(kbuf);
+    }
+    if (offp == NULL) {
+        in->f_pos = pos;
+    } else {
+        *offp = pos;
+    }
+    fput(in);
+
+    if (err < 0 && total == 0) {
+        return err;
+    }
+    return total;
+}
+
+/*
+ * Makes the empty regular file open for writing as dst_fd hold what the
+ * regular file open for reading as src_fd does, with the file system's
+ * clone operation, which shares the two files' blocks instead of copying
+ * them. Neither file's position changes.
+ *
+ * Error cases:
+ *      o EBADF: either fd is not open, src_fd not for reading or dst_fd
+ *        not for writing.
+ *      o EISDIR: either is a directory.
+ *      o EINVAL: either is not a regular file, they are the same file,
+ *        or dst_fd's file is not empty.
+ *      o EXDEV: they are on different file systems.
+ *      o EOPNOTSUPP: the file system cannot clone files.
+ */
+int
+do_clone_file(int src_fd, int dst_fd)
+{
+    if (src_fd < 0 || src_fd >= NFILES || dst_fd < 0 || dst_fd >= NFILES) {
+        return -EBADF;
+    }
+
+    file_t *src = fget(src_fd);
+    if (src == NULL) {
+        return -EBADF;
+    }
+    file_t *dst = fget(dst_fd);
+    if (dst == NULL) {
+        fput(src);
+        return -EBADF;
+    }
+
+    vnode_t *svn = src->f_vnode;
+    vnode_t *dvn = dst->f_vnode;
+    int err;
+    if ((src->f_mode & FMODE_READ) == 0 || (dst->f_mode & FMODE_WRITE) == 0) {
+        err = -EBADF;
+    } else if (S_ISDIR(svn->vn_mode) || S_ISDIR(dvn->vn_mode)) {
+        err = -EISDIR;
+    } else if (!S_ISREG(svn->vn_mode) || !S_ISREG(dvn->vn_mode) || svn == dvn) {
+        err = -EINVAL;
+    } else if (svn->vn_fs != dvn->vn_fs) {
+        err = -EXDEV;
+    } else if (svn->vn_ops->clone == NULL) {
+        err = -EOPNOTSUPP;
+    } else {
+        err = svn->vn_ops->clone(svn, dvn);
+    }
+
+    fput(dst);
+    fput(src);
+    return err;
+}
+
+/*
+ * Remove fd from curproc->p_fdtable, and fput() the file. Return 0 on success
  *
  * Error cases you must handle for this function at the VFS level:
  *      o EBADF
@@ -152,12 +579,15 @@ do_close(int fd)
         return -EBADF;
     }
 
-    file_t *f = curproc->p_files[fd];
+    if (fd >= curproc->p_fdtable.fdt_size) {
+        return -EBADF;
+    }
+
+    file_t *f = fdtable_remove(&curproc->p_fdtable, fd);
     if (f == NULL) {
         return -EBADF;
     }
 
-    curproc->p_files[fd] = NULL;
     fput(f);
 
     return 0;
@@ -197,10 +627,10 @@ do_dup(int fd)
     int newfd = get_empty_fd(curproc);
     if (newfd < 0) {
         fput(f);
-        return -EMFILE;
+        return newfd;
     }
 
-    curproc->p_files[newfd] = f;
+    fdtable_install(&curproc->p_fdtable, newfd, f);
 
     return newfd;
         /*NOT_YET_IMPLEMENTED("VFS: do_dup");*/
@@ -239,17 +669,24 @@ do_dup2(int ofd, int nfd)
         return nfd;
     }
 
+    /*the table may have to grow to reach nfd*/
+    int err = fdtable_reserve(&curproc->p_fdtable, nfd);
+    if (err < 0) {
+        fput(f);
+        return err;
+    }
+
     /*look it up in the table or fget?*/
-    file_t *nf = curproc->p_files[nfd];
+    file_t *nf = curproc->p_fdtable.fdt_files[nfd];
     if (nf) {
-        int err = do_close(nfd);
+        err = do_close(nfd);
         if (err < 0) {
             fput(f);
             return err;
         }
     }
 
-    curproc->p_files[nfd] = f;
+    fdtable_install(&curproc->p_fdtable, nfd, f);
 
     return nfd;
         /*NOT_YET_IMPLEMENTED("VFS: do_dup2");*/
@@ -271,7 +708,7 @@ do_dup2(int ofd, int nfd)
  * Error cases you must handle for this function at the VFS level:
  *      o EINVAL
  *        mode requested creation of something other than a device special
- *        file.
+ *        file or the name of a socket.
  *      o EEXIST
  *        path already exists.
  *      o ENOENT
@@ -287,7 +724,7 @@ do_mknod(const char *path, int mode, unsigned devid)
     KASSERT(path);
     dbg(DBG_VFS, "called with path %s, mode 0x%12x\n", path, mode);
 
-    if (!S_ISCHR(mode) && !S_ISBLK(mode)) {
+    if (!S_ISCHR(mode) && !S_ISBLK(mode) && !S_ISSOCK(mode)) {
         dbg(DBG_VFS, "invalid mode argument\n");
         return -EINVAL;
     }
@@ -337,6 +774,7 @@ do_mknod(const char *path, int mode, unsigned devid)
         dbg(DBG_VFS, "vnode->mknod failed, errno is %d\n", err);
         return err;
     }
+    dcache_forget(dir_vnode, name, namelen);
 
     kfree((void *)name);
     vput(dir_vnode);
@@ -412,6 +850,7 @@ do_mkdir(const char *path)
         dbg(DBG_VFS, "call vnode->mkdir failed, errno is %d\n", err);
         return err;
     }
+    dcache_forget(dir_vnode, name, namelen);
 
     kfree((void *)name);
     vput(dir_vnode);
@@ -486,8 +925,21 @@ do_rmdir(const char *path)
         return -ENOTDIR;
     }
 
+    /*something is mounted on it*/
+    if (child_vnode->vn_fs != dir_vnode->vn_fs) {
+        vput(dir_vnode);
+        vput(child_vnode);
+        kfree((void *)name);
+        return -EBUSY;
+    }
+
+    ino_t child_vno = child_vnode->vn_vno;
     vput(child_vnode);
     err = dir_vnode->vn_ops->rmdir(dir_vnode, name, namelen);
+    if (err == 0) {
+        dcache_forget(dir_vnode, name, namelen);
+        dcache_forget_dir(dir_vnode->vn_fs, child_vno);
+    }
     kfree((void *)name);
     vput(dir_vnode);
     return err;
@@ -543,6 +995,9 @@ do_unlink(const char *path)
 
     vput(file_vnode);
     err = dir_vnode->vn_ops->unlink(dir_vnode, name, namelen);
+    if (err == 0) {
+        dcache_forget(dir_vnode, name, namelen);
+    }
     kfree((void *)name);
     vput(dir_vnode);
     return err;
@@ -568,6 +1023,8 @@ do_unlink(const char *path)
  *        directory.
  *      o ENAMETOOLONG
  *        A component of from or to was too long.
+ *      o EXDEV
+ *        from and to are on different file systems.
  */
 int
 do_link(const char *from, const char *to)
@@ -620,7 +1077,17 @@ do_link(const char *from, const char *to)
     }
     KASSERT(to_vnode == NULL);
 
+    if (from_vnode->vn_fs != todir_vnode->vn_fs) {
+        vput(from_vnode);
+        vput(todir_vnode);
+        kfree((void *)name);
+        return -EXDEV;
+    }
+
     err = todir_vnode->vn_ops->link(from_vnode, todir_vnode, name, namelen);
+    if (err == 0) {
+        dcache_forget(todir_vnode, name, namelen);
+    }
 
     vput(from_vnode);
     vput(todir_vnode);
@@ -761,6 +1228,109 @@ do_getdent(int fd, struct dirent *dirp)
         /*return -1;*/
 }
 
+/*
+ * Like do_getdent, but reads up to count entries into dirp[0..count)
+ * with one fget, using the readdir_batch op if the directory has one.
+ * Returns the number of entries read, or -errno if none were.
+ */
+int
+do_getdents(int fd, struct dirent *dirp, int count)
+{
+    KASSERT(dirp);
+    if (fd <= -1 || fd >= NFILES) {
+        return -EBADF;
+    }
+
+    file_t *f = fget(fd);
+    if (f == NULL) {
+        return -EBADF;
+    }
+
+    vnode_t *dir_vn = f->f_vnode;
+    if (!S_ISDIR(dir_vn->vn_mode) || dir_vn->vn_ops->readdir == NULL) {
+        fput(f);
+        return -ENOTDIR;
+    }
+
+    int n = 0;
+    if (dir_vn->vn_ops->readdir_batch != NULL) {
+        off_t pos = f->f_pos;
+        n = dir_vn->vn_ops->readdir_batch(dir_vn, &pos, dirp, count);
+        f->f_pos = pos;
+    } else {
+        for (; n < count; n++) {
+            int ret = dir_vn->vn_ops->readdir(dir_vn, f->f_pos, &dirp[n]);
+            if (ret <= 0) {
+                if (n == 0) {
+                    n = ret;
+                }
+                break;
+            }
+            f->f_pos += ret;
+        }
+    }
+
+    fput(f);
+    return n;
+}
+
+/*
+ * Like do_getdents, but each entry comes with the type and size of the
+ * file it names, so that a listing need not stat every entry by path.
+ * Directories without a readdir_plus op have each entry looked up in
+ * them instead, which is one component, usually out of the name cache.
+ */
+int
+do_getdents_plus(int fd, struct dirent_plus *dirp, int count)
+{
+    KASSERT(dirp);
+    if (fd <= -1 || fd >= NFILES) {
+        return -EBADF;
+    }
+
+    file_t *f = fget(fd);
+    if (f == NULL) {
+        return -EBADF;
+    }
+
+    vnode_t *dir_vn = f->f_vnode;
+    if (!S_ISDIR(dir_vn->vn_mode) || dir_vn->vn_ops->readdir == NULL) {
+        fput(f);
+        return -ENOTDIR;
+    }
+
+    int n = 0;
+    if (dir_vn->vn_ops->readdir_plus != NULL) {
+        off_t pos = f->f_pos;
+        n = dir_vn->vn_ops->readdir_plus(dir_vn, &pos, dirp, count);
+        f->f_pos = pos;
+    } else {
+        for (; n < count; n++) {
+            struct dirent *d = &dirp[n].dp_dirent;
+            int ret = dir_vn->vn_ops->readdir(dir_vn, f->f_pos, d);
+            if (ret <= 0) {
+                if (n == 0) {
+                    n = ret;
+                }
+                break;
+            }
+            f->f_pos += ret;
+
+            vnode_t *vn;
+            dirp[n].dp_mode = 0;
+            dirp[n].dp_size = 0;
+            if (lookup(dir_vn, d->d_name, strlen(d->d_name), &vn) == 0) {
+                dirp[n].dp_mode = vn->vn_mode;
+                dirp[n].dp_size = vn->vn_len;
+                vput(vn);
+            }
+        }
+    }
+
+    fput(f);
+    return n;
+}
+
 /*
  * Modify f_pos according to offset and whence.
  *
@@ -853,43 +1423,367 @@ do_stat(const char *path, struct stat *buf)
         /*return -1;*/
 }
 
+/*
+ * Like do_stat, but a relative path is resolved from the directory open
+ * on dirfd, or the current one if dirfd is AT_FDCWD, so that stating
+ * each entry of a directory does not walk the path to it every time.
+ *
+ * Error cases, besides those of do_stat:
+ *      o EBADF
+ *        dirfd is neither AT_FDCWD nor an open file descriptor.
+ *      o ENOTDIR
+ *        path is relative and dirfd does not refer to a directory.
+ */
+int
+do_fstatat(int dirfd, const char *path, struct stat *buf)
+{
+    KASSERT(path);
+    KASSERT(buf);
+
+    if (dirfd == AT_FDCWD || path[0] == '/') {
+        return do_stat(path, buf);
+    }
+    if (dirfd < 0 || dirfd >= NFILES) {
+        return -EBADF;
+    }
+
+    file_t *f = fget(dirfd);
+    if (f == NULL) {
+        return -EBADF;
+    }
+    if (!S_ISDIR(f->f_vnode->vn_mode)) {
+        fput(f);
+        return -ENOTDIR;
+    }
+
+    vnode_t *vnode;
+    int err = open_namev(path, O_RDONLY, &vnode, f->f_vnode);
+    fput(f);
+    if (err < 0) {
+        return err;
+    }
+
+    err = vnode->vn_ops->stat(vnode, buf);
+    vput(vnode);
+    return err;
+}
+
+/*
+ * Hand a device-specific request on an open file to its vnode. arg is
+ * a user address, which the vnode operation copies in and out itself.
+ *
+ * Error cases:
+ *      o EBADF
+ *        fd is not a valid file descriptor.
+ *      o ENOTTY
+ *        The file does not take ioctl requests.
+ */
+int
+do_ioctl(int fd, int request, void *arg)
+{
+    dbg(DBG_VFS, "syscall hook\n");
+
+    if (fd <= -1 || fd >= NFILES) {
+        return -EBADF;
+    }
+
+    file_t *f = fget(fd);
+    if (f == NULL) {
+        return -EBADF;
+    }
+
+    int err = -ENOTTY;
+    if (f->f_vnode->vn_ops->ioctl != NULL) {
+        err = f->f_vnode->vn_ops->ioctl(f->f_vnode, request, arg);
+    }
+    fput(f);
+    return err;
+}
+
+/*
+ * Make what was written to an open file durable, as fsync(2) does (or
+ * fdatasync(2), if datasync is set), without writing back the rest of
+ * the system's dirty pages as sync(2) does.
+ *
+ * Error cases:
+ *      o EBADF
+ *        fd is not a valid file descriptor.
+ *      o EINVAL
+ *        The file does not support synchronization.
+ *      o EIO
+ *        The file could not be written back.
+ */
+int
+do_fsync(int fd, int datasync)
+{
+    if (fd <= -1 || fd >= NFILES) {
+        return -EBADF;
+    }
+
+    file_t *f = fget(fd);
+    if (f == NULL) {
+        return -EBADF;
+    }
+
+    int err = -EINVAL;
+    if (f->f_vnode->vn_ops->fsync != NULL) {
+        err = f->f_vnode->vn_ops->fsync(f->f_vnode, datasync);
+    }
+    fput(f);
+    return err;
+}
+
+/*
+ * Advice on how fd's file is going to be read, for the page cache to go
+ * by. POSIX_FADV_NORMAL, POSIX_FADV_RANDOM and POSIX_FADV_SEQUENTIAL are
+ * kept by the vnode for vnode_readahead(), for all of the file whatever
+ * the range, as its readahead state is. POSIX_FADV_WILLNEED and
+ * POSIX_FADV_DONTNEED act on the pages of [offset, offset + len) right
+ * away; a len of 0 runs to the end of the file.
+ *
+ * Error cases:
+ *      o EBADF
+ *        fd is not a valid file descriptor.
+ *      o EINVAL
+ *        offset or len is negative, or advice is not one of POSIX_FADV_*.
+ *      o ESPIPE
+ *        fd is not a regular file.
+ */
+int
+do_fadvise(int fd, off_t offset, off_t len, int advice)
+{
+    if (fd <= -1 || fd >= NFILES) {
+        return -EBADF;
+    }
+    if (offset < 0 || len < 0 || advice < POSIX_FADV_NORMAL || advice > POSIX_FADV_NOREUSE) {
+        return -EINVAL;
+    }
+
+    file_t *f = fget(fd);
+    if (f == NULL) {
+        return -EBADF;
+    }
+    vnode_t *vn = f->f_vnode;
+    if (!S_ISREG(vn->vn_mode)) {
+        fput(f);
+        return -ESPIPE;
+    }
+
+    uint32_t lopage = ADDR_TO_PN(offset);
+    uint32_t npages = (len == 0) ? (uint32_t)-1 - lopage
+                      : ((uint32_t)offset + (uint32_t)len - 1) / PAGE_SIZE + 1 - lopage;
+    switch (advice) {
+        case POSIX_FADV_WILLNEED:
+            vnode_willneed(vn, lopage, npages);
+            break;
+        case POSIX_FADV_DONTNEED:
+            vnode_dontneed(vn, lopage, npages);
+            break;
+        case POSIX_FADV_NOREUSE:
+            break;
+        default:
+            /*start over with what vnode_readahead has seen*/
+            vn->vn_ra_advice = advice;
+            vn->vn_ra_window = 0;
+            vn->vn_ra_end = 0;
+            break;
+    }
+
+    fput(f);
+    return 0;
+}
+
+/*
+ * Sets aside blocks for [offset, offset + len) of fd's file, so that
+ * writing there later cannot run out of space, with the file system's
+ * fallocate operation. The file grows to cover the range unless mode has
+ * FALLOC_FL_KEEP_SIZE. With FALLOC_FL_PUNCH_HOLE, which needs
+ * FALLOC_FL_KEEP_SIZE too, the range is made a hole instead, and the
+ * blocks and cached pages which it covers are let go of.
+ *
+ * Error cases:
+ *      o EBADF
+ *        fd is not a valid file descriptor, or is not open for writing.
+ *      o EINVAL
+ *        offset is negative, or len is not positive.
+ *      o EFBIG
+ *        the range runs past the largest file there can be.
+ *      o ENODEV
+ *        fd is not a regular file or a directory.
+ *      o EISDIR
+ *        fd is a directory.
+ *      o EOPNOTSUPP
+ *        mode is not one of the above, or the file system has no
+ *        fallocate operation.
+ */
+int
+do_fallocate(int fd, int mode, off_t offset, off_t len)
+{
+    if (fd <= -1 || fd >= NFILES) {
+        return -EBADF;
+    }
+    if (offset < 0 || len <= 0) {
+        return -EINVAL;
+    }
+    if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+        || ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))) {
+        return -EOPNOTSUPP;
+    }
+
+    file_t *f = fget(fd);
+    if (f == NULL) {
+        return -EBADF;
+    }
+    vnode_t *vn = f->f_vnode;
+    int err;
+    if ((f->f_mode & FMODE_WRITE) == 0) {
+        err = -EBADF;
+    } else if (S_ISDIR(vn->vn_mode)) {
+        err = -EISDIR;
+    } else if (!S_ISREG(vn->vn_mode)) {
+        err = -ENODEV;
+    } else if (vn->vn_ops->fallocate == NULL) {
+        err = -EOPNOTSUPP;
+    } else {
+        err = vn->vn_ops->fallocate(vn, mode, offset, len);
+    }
+
+    fput(f);
+    return err;
+}
+
 #ifdef __MOUNTING__
 /*
- * Implementing this function is not required and strongly discouraged unless
- * you are absolutely sure your Weenix is perfect.
- *
- * This is the syscall entry point into vfs for mounting. You will need to
- * create the fs_t struct and populate its fs_dev and fs_type fields before
- * calling vfs's mountfunc(). mountfunc() will use the fields you populated
- * in order to determine which underlying filesystem's mount function should
- * be run, then it will finish setting up the fs_t struct. At this point you
- * have a fully functioning file system, however it is not mounted on the
- * virtual file system, you will need to call vfs_mount to do this.
- *
- * There are lots of things which can go wrong here. Make sure you have good
- * error handling. Remember the fs_dev and fs_type buffers have limited size
- * so you should not write arbitrary length strings to them.
+ * Mounts a new file system of the given type, on the device named by
+ * source (e.g. "disk1", or NULL for a file system which needs none), over
+ * the directory target. The type may be followed by options, separated by
+ * commas:
+ *
+ *      flush=<n>       flushd writes back the file system's pages once
+ *                      they have been dirty for n of its looks, rather
+ *                      than FLUSHD_EXPIRE_INTERVALS
+ *
+ * Error cases:
+ *      o EINVAL
+ *        The type or source is too long, an option is not known, or there
+ *        is no such type of file system. The file system's own mount
+ *        function may fail with other errors, such as for a bad image.
+ *      o ENOTDIR
+ *        target is not a directory.
+ *      o EBUSY
+ *        target already has something mounted on it, or is the root; or
+ *        source is already mounted.
+ *      o ENOENT, ENAMETOOLONG
+ *        As for open_namev(target).
  */
 int
 do_mount(const char *source, const char *target, const char *type)
 {
-        NOT_YET_IMPLEMENTED("MOUNTING: do_mount");
-        return -EINVAL;
+        const char *opt;
+        size_t typelen;
+        vnode_t *mtpt;
+        fs_t *fs;
+        int err;
+
+        KASSERT(target && type);
+
+        opt = strchr(type, ',');
+        typelen = (NULL == opt) ? strlen(type) : (size_t)(opt - type);
+        if (0 == typelen || typelen >= STR_MAX
+            || (NULL != source && strlen(source) >= STR_MAX))
+                return -EINVAL;
+
+        if (NULL == (fs = kmalloc(sizeof(fs_t))))
+                return -ENOMEM;
+        memset(fs, 0, sizeof(fs_t));
+        memcpy(fs->fs_type, type, typelen);
+        if (NULL != source)
+                strcpy(fs->fs_dev, source);
+
+        for (; NULL != opt; opt = strchr(opt, ',')) {
+                int n;
+                opt++;
+                if (1 != sscanf(opt, "flush=%d", &n) || n <= 0) {
+                        kfree(fs);
+                        return -EINVAL;
+                }
+                fs->fs_flush_expire = n;
+        }
+
+        if (NULL != source) {
+                fs_t *other;
+                int busy = !strcmp(source, vfs_root_vn->vn_fs->fs_dev);
+                list_iterate_begin(&mounted_fs_list, other, fs_t, fs_link) {
+                        busy = busy || !strcmp(source, other->fs_dev);
+                } list_iterate_end();
+                if (busy) {
+                        kfree(fs);
+                        return -EBUSY;
+                }
+        }
+
+        if (0 > (err = open_namev(target, O_RDONLY, &mtpt, NULL))) {
+                kfree(fs);
+                return err;
+        }
+        if (!S_ISDIR(mtpt->vn_mode)) {
+                vput(mtpt);
+                kfree(fs);
+                return -ENOTDIR;
+        }
+
+        if (0 > (err = mountfunc(fs))) {
+                vput(mtpt);
+                kfree(fs);
+                return err;
+        }
+
+        if (0 > (err = vfs_mount(mtpt, fs))) {
+                if (fs->fs_op->umount)
+                        fs->fs_op->umount(fs);
+                else
+                        vput(fs->fs_root);
+                dcache_forget_fs(fs);
+                vput(mtpt);
+                kfree(fs);
+                return err;
+        }
+        return 0;
 }
 
 /*
- * Implementing this function is not required and strongly discouraged unless
- * you are absolutley sure your Weenix is perfect.
+ * Unmounts the file system mounted on target, which has to name the root
+ * of a mounted file system. vfs_umount() does the rest, and frees the fs
+ * struct.
  *
- * This function delegates all of the real work to vfs_umount. You should not worry
- * about freeing the fs_t struct here, that is done in vfs_umount. All this function
- * does is figure out which file system to pass to vfs_umount and do good error
- * checking.
+ * Error cases:
+ *      o EINVAL
+ *        target is not where a file system is mounted.
+ *      o EBUSY
+ *        target is the root, or the file system is in use.
+ *      o ENOENT, ENOTDIR, ENAMETOOLONG
+ *        As for open_namev(target).
  */
 int
 do_umount(const char *target)
 {
-        NOT_YET_IMPLEMENTED("MOUNTING: do_umount");
-        return -EINVAL;
+        vnode_t *root;
+        fs_t *fs;
+        int err;
+
+        KASSERT(target);
+
+        if (0 > (err = open_namev(target, O_RDONLY, &root, NULL)))
+                return err;
+        fs = root->vn_fs;
+        if (root != fs->fs_root) {
+                vput(root);
+                return -EINVAL;
+        }
+        vput(root);
+
+        if (fs == vfs_root_vn->vn_fs)
+                return -EBUSY;
+        return vfs_umount(fs);
 }
 #endif
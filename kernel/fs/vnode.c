@@ -6,24 +6,40 @@
  */
 
 #include "kernel.h"
+#include "config.h"
 #include "util/init.h"
 #include "util/string.h"
 #include "util/printf.h"
 #include "errno.h"
+#include "fs/fcntl.h"
+#include "fs/poll.h"
 #include "fs/stat.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "mm/slab.h"
+#include "mm/shrink.h"
+#include "proc/rcu.h"
 #include "proc/sched.h"
 #include "util/debug.h"
 #include "vm/vmmap.h"
+#include "vm/oom.h"
 #include "globals.h"
 
 static slab_allocator_t *vnode_allocator;
 
+/* vnode_inuse_list and the hash are searched in RCU read-side sections
+ * (proc/rcu.h), so a vnode is freed a grace period after it leaves them */
 static list_t vnode_inuse_list;
+static list_t vnode_hash[VNODE_HASH_BUCKETS];
+static list_t vnode_lru;                /* cached vnodes with no references,
+                                         * least recently used first */
+static int vnode_lru_count = 0;
+
+#define vnode_bucket(fs, vno) \
+        (&vnode_hash[((uint32_t)(fs) / sizeof(fs_t) + (vno)) % VNODE_HASH_BUCKETS])
 
 /* Related to vnodes representing special files: */
+static void vnode_free(vnode_t *vn);
 static void init_special_vnode(vnode_t *vn);
 static int special_file_read(vnode_t *file, off_t offset, void *buf, size_t count);
 static int special_file_write(vnode_t *file, off_t offset, const void *buf, size_t count);
@@ -32,22 +48,29 @@ static int special_file_stat(vnode_t *vnode, struct stat *ss);
 static int special_file_fillpage(vnode_t *file, off_t offset, void *pagebuf);
 static int special_file_dirtypage(vnode_t *file, off_t offset);
 static int special_file_cleanpage(vnode_t *file, off_t offset, void *pagebuf);
+static int special_file_poll(vnode_t *file, int events, polltable_t *pt);
+static int special_file_ioctl(vnode_t *file, int request, void *arg);
 /* mmobj_t entry points: */
 static void vo_vref(mmobj_t *o);
 static void vo_vput(mmobj_t *o);
 
 static int  vlookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf);
 static int  vreadpage(mmobj_t *o, pframe_t *pf);
+static int  vreadpage_async(mmobj_t *o, pframe_t *pf);
+static int  vreadpages(mmobj_t *o, pframe_t **pfs, int npages);
 static int  vdirtypage(mmobj_t *o, pframe_t *pf);
 static int  vcleanpage(mmobj_t *o, pframe_t *pf);
 
 static mmobj_ops_t vnode_mmobj_ops = {
+        .type = MMOBJ_VNODE,
         .ref = vo_vref,
         .put = vo_vput,
         .lookuppage = vlookuppage,
         .fillpage = vreadpage,
         .dirtypage = vdirtypage,
-        .cleanpage = vcleanpage
+        .cleanpage = vcleanpage,
+        .fillpage_async = vreadpage_async,
+        .fillpages = vreadpages
 };
 
 /* vnode operations tables for special files: */
@@ -64,6 +87,8 @@ static vnode_ops_t bytedev_spec_vops = {
         .rmdir = NULL,
         .readdir = NULL,
         .stat = special_file_stat,
+        .poll = special_file_poll,
+        .ioctl = special_file_ioctl,
         .fillpage = special_file_fillpage,
         .dirtypage = special_file_dirtypage,
         .cleanpage = special_file_cleanpage
@@ -87,6 +112,55 @@ static vnode_ops_t blockdev_spec_vops = {
         .cleanpage = NULL
 };
 
+/* The name a local socket is bound to (see net/unix.c), which can be
+ * looked up, stat'ed and unlinked, but not opened */
+static vnode_ops_t sockname_spec_vops = {
+        .read = NULL,
+        .write = NULL,
+        .mmap = NULL,
+        .create = NULL,
+        .mknod = NULL,
+        .lookup = NULL,
+        .link = NULL,
+        .unlink = NULL,
+        .mkdir = NULL,
+        .rmdir = NULL,
+        .readdir = NULL,
+        .stat = special_file_stat,
+        .fillpage = NULL,
+        .dirtypage = NULL,
+        .cleanpage = NULL
+};
+
+/*
+ * The shrinker for the cached vnodes, which frees the least recently used.
+ */
+static uint32_t
+vnode_shrink_count(void)
+{
+        return vnode_lru_count;
+}
+
+static uint32_t
+vnode_shrink_scan(uint32_t n)
+{
+        uint32_t freed;
+
+        for (freed = 0; freed < n && !list_empty(&vnode_lru); freed++) {
+                vnode_t *old = list_head(&vnode_lru, vnode_t, vn_lru_link);
+                list_remove(&old->vn_lru_link);
+                vnode_lru_count--;
+                vnode_free(old);
+        }
+        return freed;
+}
+
+static shrinker_t vnode_shrinker = {
+        .sh_name = "vnode",
+        .sh_count = vnode_shrink_count,
+        .sh_scan = vnode_shrink_scan
+};
+
 /*
  * Initialization:
  */
@@ -94,7 +168,14 @@ static __attribute__((unused)) void
 vnode_init(void)
 {
         list_init(&vnode_inuse_list);
-        vnode_allocator = slab_allocator_create("vnode", sizeof(vnode_t));
+        int i;
+        for (i = 0; i < VNODE_HASH_BUCKETS; i++) {
+                list_init(&vnode_hash[i]);
+        }
+        list_init(&vnode_lru);
+        vnode_allocator = slab_allocator_create_flags("vnode", sizeof(vnode_t),
+                                                      SLAB_ALIGN_CACHE);
+        shrinker_register(&vnode_shrinker);
 }
 init_func(vnode_init);
 
@@ -120,7 +201,8 @@ vget(struct fs *fs, ino_t vno)
 
         /* look for inuse vnode */
 find:
-        list_iterate_begin(&vnode_inuse_list, vn, vnode_t, vn_link) {
+        rcu_read_lock();
+        list_iterate_begin(vnode_bucket(fs, vno), vn, vnode_t, vn_hlink) {
                 if ((vn->vn_fs == fs) && (vn->vn_vno == vno)) {
                         /* found it... */
                         if (VN_BUSY & vn->vn_flags) {
@@ -131,10 +213,21 @@ find:
                                 dbg(DBG_VNREF, "vget: wow, found vnode busy (0x%p, 0x%p ino %ld refcount %d)\n",
                                     vn, vn->vn_fs, (long)vn->vn_vno, vn->vn_refcount);
 
-                                sched_sleep_on(&vn->vn_waitq);
+                                rcu_read_unlock();
+                                sched_sleep_on(sched_waitq(vn));
                                 goto find;
                         }
 
+                        rcu_read_unlock();
+                        if (list_link_is_linked(&vn->vn_lru_link)) {
+                                /* cached after its last vput */
+                                KASSERT(0 == vn->vn_refcount);
+                                list_remove(&vn->vn_lru_link);
+                                vnode_lru_count--;
+                                vn->vn_refcount = 1;
+                                return vn;
+                        }
+
 #ifndef __MOUNTING__
                         /* If we are implementing mountpoint support
                            then we should get the mounted vnode,
@@ -149,6 +242,7 @@ find:
 #endif
                 }
         } list_iterate_end();
+        rcu_read_unlock();
 
         /* if we got here, we didn't find the vnode. */
         /*   alloc a new vnode: */
@@ -156,8 +250,11 @@ find:
         if (!vn) {
                 dbg(DBG_VNREF, "vget: kmem has been exhausted. "
                     "will then re-attempt to vget vnode later %d of fs %p\n", vno, fs);
-                sched_make_runnable(curthr);
-                sched_switch();
+                /* nothing gives kernel memory back by itself once all of
+                 * it is taken; the caller may hold locks, so it cannot
+                 * exit here if it is the one to go */
+                oom_kill(0);
+                oom_wait();
                 goto find;
         }
         memset(vn, 0, sizeof(vnode_t));
@@ -165,9 +262,8 @@ find:
         /*     members that can be initialized here: */
         vn->vn_fs = fs;
         vn->vn_vno = vno;
-        kmutex_init(&vn->vn_mutex);
+        krwlock_init(&vn->vn_rwlock);
         mmobj_init(&vn->vn_mmobj, &vnode_mmobj_ops);
-        sched_queue_init(&vn->vn_waitq);
 
 #ifdef __MOUNTING__
         vn->vn_mount = vn;
@@ -184,7 +280,8 @@ find:
          *       done bringing the vnode in)
          */
         vn->vn_flags |= VN_BUSY;
-        list_insert_head(&vnode_inuse_list, &vn->vn_link);
+        list_insert_head_rcu(&vnode_inuse_list, &vn->vn_link);
+        list_insert_head_rcu(vnode_bucket(fs, vno), &vn->vn_hlink);
 
         KASSERT(vn->vn_fs->fs_op && vn->vn_fs->fs_op->read_vnode);
         /*       this is where we might block (depending on the underlying
@@ -192,9 +289,11 @@ find:
         vn->vn_fs->fs_op->read_vnode(vn);
 
         vn->vn_flags &= ~VN_BUSY;
+        /* anyone who found it while it was being read in goes again */
+        sched_broadcast_on(sched_waitq(vn));
 
         /*     for special files: */
-        if (S_ISCHR(vn->vn_mode) || S_ISBLK(vn->vn_mode))
+        if (S_ISCHR(vn->vn_mode) || S_ISBLK(vn->vn_mode) || S_ISSOCK(vn->vn_mode))
                 init_special_vnode(vn);
 
         vn->vn_refcount = 1;
@@ -257,7 +356,7 @@ vput(struct vnode *vn)
                          * definately free the page, if they have it busy.
                          */
                         while (pframe_is_busy(vp))
-                                sched_sleep_on(&(vp->pf_waitq));
+                                sched_sleep_on(pframe_waitq(vp));
                         pframe_free(vp);
                 } list_iterate_end();
 
@@ -276,30 +375,85 @@ vput(struct vnode *vn)
         KASSERT(vn->vn_mount == vn);
 #endif
 
-        /* no res pages and no more active references; free the vnode */
+        /* no res pages and no more active references */
         KASSERT(0 == vn->vn_refcount);
         KASSERT(0 == vn->vn_nrespages);
 
+        /* Keep it around for the next vget if it still exists in the fs.
+         * The root goes away only with the fs, see vnode_drop_cached. */
+        if (0 < VNODE_CACHE_SIZE && vn != vn->vn_fs->fs_root
+            && vn->vn_fs->fs_op->query_vnode(vn)) {
+                list_insert_tail(&vnode_lru, &vn->vn_lru_link);
+                if (VNODE_CACHE_SIZE < ++vnode_lru_count) {
+                        vnode_t *old = list_head(&vnode_lru, vnode_t, vn_lru_link);
+                        list_remove(&old->vn_lru_link);
+                        vnode_lru_count--;
+                        vnode_free(old);
+                }
+                return;
+        }
+
+        vnode_free(vn);
+}
+
+void
+vnode_modified(vnode_t *vn)
+{
+        vn->vn_wgen++;
+        if (NULL != vn->vn_exec) {
+                vnode_exec_t *vx = vn->vn_exec;
+                vn->vn_exec = NULL;
+                vx->vx_put(vx);
+        }
+}
+
+static void
+vnode_free_rcu(rcu_head_t *rh)
+{
+        slab_obj_free(vnode_allocator, list_item(rh, vnode_t, vn_rcu));
+}
+
+/*
+ * Deletes a vnode which has no references left.
+ */
+static void
+vnode_free(vnode_t *vn)
+{
+        KASSERT(0 == vn->vn_refcount);
+        KASSERT(!list_link_is_linked(&vn->vn_lru_link));
+
+        vnode_modified(vn);
+
         vn->vn_flags |= VN_BUSY;
         if (vn->vn_fs->fs_op->delete_vnode) {
                 vn->vn_fs->fs_op->delete_vnode(vn);
         }
         /* (really no need to clear VN_BUSY): */
 
-#ifndef NDEBUG
-        if (!sched_queue_empty(&vn->vn_waitq)) {
-                dbg(DBG_VNREF, "vput: wow, found thread(s) trying to vget "
-                    "(%p, %p ino %ld) after returning from delete_vnode.\n",
-                    vn, vn->vn_fs, (long)vn->vn_vno);
-        }
-#endif
-
         /* wake up anyone who might have attempted to vget this vnode while
          * we were taking it away: */
-        sched_broadcast_on(&vn->vn_waitq);
+        sched_broadcast_on(sched_waitq(vn));
 
-        list_remove(&vn->vn_link); /* remove from vn_inuse_list */
-        slab_obj_free(vnode_allocator, vn);
+        list_remove_rcu(&vn->vn_link); /* remove from vn_inuse_list */
+        list_remove_rcu(&vn->vn_hlink);
+        call_rcu(&vn->vn_rcu, vnode_free_rcu);
+}
+
+void
+vnode_drop_cached(fs_t *fs)
+{
+        vnode_t *vn;
+
+        /* delete_vnode may block, so start over after each one */
+again:
+        list_iterate_begin(&vnode_lru, vn, vnode_t, vn_lru_link) {
+                if (vn->vn_fs == fs) {
+                        list_remove(&vn->vn_lru_link);
+                        vnode_lru_count--;
+                        vnode_free(vn);
+                        goto again;
+                }
+        } list_iterate_end();
 }
 
 int
@@ -322,6 +476,7 @@ vfs_is_in_use(fs_t *fs)
         list_t *list = &vnode_inuse_list;
         list_link_t *link;
         int ret = 0;
+        rcu_read_lock();
         for (link = list->l_next; link != list; link = link->l_next) {
                 vnode_t *vn = list_item(link, vnode_t, vn_link);
                 int refs;
@@ -352,48 +507,141 @@ vfs_is_in_use(fs_t *fs)
                         ret = -EBUSY;
                 }
         }
+        rcu_read_unlock();
 
         return ret;
 }
 
 
+static int
+vnode_is_mmobj(mmobj_t *o, void *arg)
+{
+        return &vnode_mmobj_ops == o->mmo_ops;
+}
+
 void
 vnode_flush_all(struct fs *fs)
 {
         vnode_t *v;
         pframe_t *p;
+        uint32_t pn;
         int err;
 
-clean:
-        list_iterate_begin(&vnode_inuse_list, v, vnode_t, vn_link) {
-                list_iterate_begin(&v->vn_mmobj.mmo_respages,
-                                   p, pframe_t, pf_olink) {
-                        if (pframe_is_dirty(p)) {
-                                if (0 > (err = pframe_clean(p))) {
-                                        dbg(DBG_VFS, "vnode_flush_all: WARNING: failed to clean page %d of "
-                                            "vnode %ld of fs %p of type %s\n", p->pf_pagenum,
-                                            (long)v->vn_vno, v->vn_fs, v->vn_fs->fs_type);
-                                }
-                                KASSERT((!err)
-                                        && "as things presently stand, "
-                                        "this shouldn't happen");
-                                /* This may have blocked. */
-                                goto clean;
-                        }
-                } list_iterate_end();
-        } list_iterate_end();
+        vnode_drop_cached(fs);
+
+        /* only the vnodes with dirty pages are visited, and their pages
+         * are written back in page number order so that the file's blocks
+         * are written out roughly in order too */
+        if (0 > (err = pframe_clean_objs(vnode_is_mmobj, NULL))) {
+                dbg(DBG_VFS, "vnode_flush_all: WARNING: failed to clean pages "
+                    "of fs %p of type %s: %d\n", fs, fs->fs_type, err);
+        }
+        KASSERT((!err)
+                && "as things presently stand, "
+                "this shouldn't happen");
 
         /* all pages of all vnodes belonging to this fs have been cleaned.
          * Now, uncache all of them: */
+uncache:
         list_iterate_begin(&vnode_inuse_list, v, vnode_t, vn_link) {
-                list_iterate_begin(&v->vn_mmobj.mmo_respages,
-                                   p, pframe_t, pf_olink) {
+                for (pn = 0; NULL != (p = pframe_next_resident(&v->vn_mmobj, &pn)); pn++) {
+                        if (pframe_is_busy(p)) {
+                                /* a readahead may still be filling it */
+                                sched_sleep_on(pframe_waitq(p));
+                                goto uncache;
+                        }
                         KASSERT(!pframe_is_dirty(p));
                         pframe_free(p);
-                } list_iterate_end();
+                }
         } list_iterate_end();
 }
 
+void
+vnode_readahead(vnode_t *vn, uint32_t pagenum, uint32_t npages)
+{
+        uint32_t end = pagenum + npages;
+        uint32_t filepages = ADDR_TO_PN(PAGE_ALIGN_UP(vn->vn_len));
+        uint32_t target, p, behind;
+        pframe_t *pf;
+
+        KASSERT(0 < npages);
+
+        if (POSIX_FADV_RANDOM == vn->vn_ra_advice)
+                return;
+
+        if (pagenum == vn->vn_ra_next) {
+                /* moved on to the next page of a sequential scan */
+                vn->vn_ra_window = vn->vn_ra_window
+                                   ? MIN(2 * vn->vn_ra_window, READAHEAD_MAX_PAGES)
+                                   : READAHEAD_MIN_PAGES;
+        } else if (!(vn->vn_ra_window && pagenum + 1 == vn->vn_ra_next)) {
+                /* anything other than another read of the last page read
+                 * is a random access */
+                vn->vn_ra_window = 0;
+                vn->vn_ra_end = 0;
+        }
+        vn->vn_ra_next = end;
+        /* a scan was promised, so even a seek is part of it */
+        if (POSIX_FADV_SEQUENTIAL == vn->vn_ra_advice)
+                vn->vn_ra_window = READAHEAD_SEQ_PAGES;
+
+        if (0 == vn->vn_ra_window)
+                return;
+
+        /* Prefetch the pages about to be read as well, so the elevator sees
+         * them together with the ones beyond */
+        target = MIN(end + vn->vn_ra_window, filepages);
+        for (p = MAX(pagenum, vn->vn_ra_end); p < target; p++) {
+                if (pframe_prefetch(&vn->vn_mmobj, p) < 0)
+                        break;
+        }
+        vn->vn_ra_end = MAX(vn->vn_ra_end, p);
+
+        /* As fault_sequential does for mappings: what the scan is a
+         * window past goes first when pageoutd looks for pages, rather
+         * than everybody else's */
+        if (POSIX_FADV_SEQUENTIAL != vn->vn_ra_advice || pagenum <= vn->vn_ra_window)
+                return;
+        behind = pagenum - vn->vn_ra_window;
+        for (p = behind - MIN(behind, MAX(npages, vn->vn_ra_window)); p < behind; p++) {
+                if (NULL != (pf = pframe_get_resident(&vn->vn_mmobj, p)))
+                        pframe_deactivate(pf);
+        }
+}
+
+void
+vnode_willneed(vnode_t *vn, uint32_t lopage, uint32_t npages)
+{
+        uint32_t filepages = ADDR_TO_PN(PAGE_ALIGN_UP(vn->vn_len));
+        uint32_t p;
+
+        for (p = lopage; p < filepages && p - lopage < npages; p++) {
+                if (pframe_prefetch(&vn->vn_mmobj, p) < 0)
+                        break;
+        }
+}
+
+void
+vnode_dontneed(vnode_t *vn, uint32_t lopage, uint32_t npages)
+{
+        pframe_t *pf;
+        uint32_t pn;
+
+        for (pn = lopage; NULL != (pf = pframe_next_resident(&vn->vn_mmobj, &pn))
+                          && pn - lopage < npages; pn++) {
+                if (pframe_is_busy(pf) || pframe_is_pinned(pf))
+                        continue;
+                /* writes through shared mappings may be only in the page
+                 * tables; finding them may block, after which the page
+                 * has to be looked up again */
+                pframe_harvest_dirty(pf);
+                pf = pframe_get_resident(&vn->vn_mmobj, pn);
+                if (NULL != pf && !pframe_is_busy(pf) && !pframe_is_pinned(pf)
+                    && !pframe_is_dirty(pf))
+                        pframe_free(pf);
+        }
+}
+
 
 /*
  * Return the number of vnodes from the given filesystem which are in use.
@@ -404,10 +652,12 @@ vnode_inuse(struct fs *fs)
         vnode_t *vn;
         int n = 0;
 
+        rcu_read_lock();
         list_iterate_begin(&vnode_inuse_list, vn, vnode_t, vn_link) {
                 if (vn->vn_fs == fs)
                         n++;
         } list_iterate_end();
+        rcu_read_unlock();
         return n;
 }
 
@@ -417,6 +667,8 @@ init_special_vnode(vnode_t *vn)
         if (S_ISCHR(vn->vn_mode)) {
                 vn->vn_ops = &bytedev_spec_vops;
                 vn->vn_cdev = bytedev_lookup(vn->vn_devid);
+        } else if (S_ISSOCK(vn->vn_mode)) {
+                vn->vn_ops = &sockname_spec_vops;
         } else {
                 KASSERT(S_ISBLK(vn->vn_mode));
                 vn->vn_ops = &blockdev_spec_vops;
@@ -558,6 +810,34 @@ special_file_cleanpage(vnode_t *file, off_t offset, void *pagebuf)
         /*return 0;*/
 }
 
+/* Pass poll through to the device too; a device which can always be
+ * read and written, like /dev/null, need not have a poll function. */
+static int
+special_file_poll(vnode_t *file, int events, polltable_t *pt)
+{
+        bytedev_t *bytedev = file->vn_cdev;
+        KASSERT(bytedev);
+        KASSERT(bytedev->cd_ops);
+
+        if (NULL == bytedev->cd_ops->poll) {
+                return POLLIN | POLLOUT;
+        }
+        return bytedev->cd_ops->poll(bytedev, events, pt);
+}
+
+static int
+special_file_ioctl(vnode_t *file, int request, void *arg)
+{
+        bytedev_t *bytedev = file->vn_cdev;
+        KASSERT(bytedev);
+        KASSERT(bytedev->cd_ops);
+
+        if (NULL == bytedev->cd_ops->ioctl) {
+                return -ENOTTY;
+        }
+        return bytedev->cd_ops->ioctl(bytedev, request, arg);
+}
+
 /*
  * Related to implementation of vnode vm_object entry points:
  */
@@ -602,6 +882,41 @@ vreadpage(mmobj_t *o, pframe_t *pf)
         return v->vn_ops->fillpage(v, (int)PN_TO_ADDR(pf->pf_pagenum), pf->pf_addr);
 }
 
+static int
+vreadpage_async(mmobj_t *o, pframe_t *pf)
+{
+        KASSERT(NULL != pf);
+        KASSERT(NULL != o);
+
+        vnode_t *v = mmobj_to_vnode(o);
+        if (NULL == v->vn_ops->fillpage_async)
+                return -ENOTSUP;
+        return v->vn_ops->fillpage_async(v, (int)PN_TO_ADDR(pf->pf_pagenum), pf);
+}
+
+static int
+vreadpages(mmobj_t *o, pframe_t **pfs, int npages)
+{
+        void *bufs[PFRAME_RANGE_MAX];
+        int i;
+
+        KASSERT(NULL != o);
+        KASSERT(0 < npages && npages <= PFRAME_RANGE_MAX);
+
+        vnode_t *v = mmobj_to_vnode(o);
+        if (NULL == v->vn_ops->fillpages) {
+                for (i = 0; i < npages; i++) {
+                        int ret = vreadpage(o, pfs[i]);
+                        if (0 > ret)
+                                return ret;
+                }
+                return 0;
+        }
+        for (i = 0; i < npages; i++)
+                bufs[i] = pfs[i]->pf_addr;
+        return v->vn_ops->fillpages(v, (int)PN_TO_ADDR(pfs[0]->pf_pagenum), bufs, npages);
+}
+
 static int
 vdirtypage(mmobj_t *o, pframe_t *pf)
 {
@@ -9,6 +9,10 @@ struct argvec;
 int copy_from_user(void *kaddr, const void *uaddr, size_t nbytes);
 int copy_to_user(void *uaddr, const void *kaddr, size_t nbytes);
 
+/* Returns where to resume a kernel instruction at eip which faulted on a
+ * user address, or 0 if it is not one which may. */
+uintptr_t user_access_fixup(uintptr_t eip);
+
 char *user_strdup(struct argstr *ustr);
 char **user_vecdup(struct argvec *uvec);
 
@@ -2,9 +2,13 @@
 
 #include "fs/vnode.h"
 
+#include "api/exec.h"
+
 typedef int(*binfmt_load_func_t)(const char *filename, int fd,
-                                 char *const *argv, char *const *envp, uint32_t *eip, uint32_t *esp);
+                                 const execvec_t *argv, const execvec_t *envp,
+                                 uint32_t *eip, uint32_t *esp);
 
 int  binfmt_add(const char *id, binfmt_load_func_t loadfunc);
 
-int binfmt_load(const char *filename, char *const *argv, char *const *envp, uint32_t *eip, uint32_t *esp);
+int binfmt_load(const char *filename, const execvec_t *argv, const execvec_t *envp,
+                uint32_t *eip, uint32_t *esp);
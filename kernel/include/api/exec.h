@@ -2,9 +2,37 @@
 
 #include "types.h"
 
+#include "api/syscall.h"
+
 struct regs;
+struct vmmap;
+
+/*
+ * The arguments or environment given to a new program. Those of the exec
+ * system call are left in the caller's address space (ev_uvec is a kernel
+ * copy of just the argstrs), so that exec copies each string once, from
+ * there straight onto the new program's stack. Those of kernel_execve are
+ * kernel strings.
+ */
+typedef struct execvec {
+        char *const            *ev_kvec;       /* or NULL */
+        const argstr_t         *ev_uvec;       /* or NULL */
+        size_t                  ev_len;
+} execvec_t;
+
+/* Sets up ev for the NULL-terminated kernel vector vec, which may be NULL
+ * for none. */
+void execvec_kernel(execvec_t *ev, char *const *vec);
+
+/* The length of the i'th string of ev, not counting its NUL */
+size_t execvec_strlen(const execvec_t *ev, size_t i);
+
+/* Writes the i'th string of ev, NUL-terminated, to vaddr in map. Returns 0
+ * or -errno. */
+int execvec_copyout(const execvec_t *ev, size_t i, struct vmmap *map, void *vaddr);
 
-int do_execve(const char *filename, char *const *argv, char *const *envp, struct regs *regs);
+int do_execve(const char *filename, const execvec_t *argv, const execvec_t *envp,
+              struct regs *regs);
 
 void kernel_execve(const char *filename, char *const *argv, char *const *envp);
 
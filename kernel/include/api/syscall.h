@@ -2,11 +2,13 @@
 
 /* Kernel and user header (via symlink) */
 
+#ifndef __ASSEMBLY__
 #ifdef __KERNEL__
 #include "types.h"
 #else
 #include "sys/types.h"
 #endif
+#endif
 
 /* Trap number for syscalls */
 #define INTR_SYSCALL 0x2e
@@ -31,7 +33,7 @@
 #define SYS_nuke                16 /* NYI */
 #define SYS_dup                 17
 #define SYS_pipe                18
-#define SYS_ioctl               19 /* NYI */
+#define SYS_ioctl               19
 #define SYS_rmdir               21
 #define SYS_mkdir               22
 #define SYS_getdents            23
@@ -40,12 +42,12 @@
 #define SYS_munmap              26
 #define SYS_rename              27 /* NYI */
 #define SYS_uname               28
-#define SYS_thr_create          29 /* NYI */
-#define SYS_thr_cancel          30
+#define SYS_thr_create          29 /* MTP only */
+#define SYS_thr_cancel          30 /* MTP only */
 #define SYS_thr_exit            31
 #define SYS_thr_yield           32
-#define SYS_thr_join            33 /* NYI */
-#define SYS_gettid              34 /* NYI */
+#define SYS_thr_join            33 /* MTP only */
+#define SYS_gettid              34 /* MTP only */
 #define SYS_getpid              35
 #define SYS_errno               39
 #define SYS_halt                40
@@ -56,6 +58,55 @@
 #define SYS_mount               45
 #define SYS_umount              46
 #define SYS_stat                47
+#define SYS_vfork               48
+#define SYS_nanosleep           49
+#define SYS_thr_detach          50 /* MTP only */
+#define SYS_futex               51
+#define SYS_readv               52
+#define SYS_writev              53
+#define SYS_pread               54
+#define SYS_pwrite              55
+#define SYS_sendfile            56
+#define SYS_msync               57
+#define SYS_madvise             58
+#define SYS_poll                59
+#define SYS_epoll_create        60
+#define SYS_epoll_ctl           61
+#define SYS_epoll_wait          62
+#define SYS_clock_gettime       63
+#define SYS_syscall_stats       64
+#define SYS_proc_stats          65
+#define SYS_socket              66
+#define SYS_bind                67
+#define SYS_sendto              68
+#define SYS_recvfrom            69
+#define SYS_listen              70
+#define SYS_accept              71
+#define SYS_connect             72
+#define SYS_socketpair          73
+#define SYS_shm_open            74
+#define SYS_shm_unlink          75
+#define SYS_fsync               76
+#define SYS_fdatasync           77
+#define SYS_uring_setup         78
+#define SYS_uring_enter         79
+#define SYS_fadvise             80
+#define SYS_ioprio_set          81
+#define SYS_ioprio_get          82
+#define SYS_getdents_plus       83
+#define SYS_fstatat             84
+#define SYS_getrusage           85
+#define SYS_kmem_census         86
+#define SYS_clone_file          87
+#define SYS_fallocate           88
+#define SYS_mlock               89
+#define SYS_munlock             90
+#define SYS_sched_setaffinity   91
+#define SYS_sched_getaffinity   92
+
+/* futex operations */
+#define FUTEX_WAIT              0  /* sleep while *addr == val */
+#define FUTEX_WAKE              1  /* wake up to val sleepers on addr */
 
 /*
  * ... what does the scouter say about his syscall?
@@ -65,8 +116,14 @@
 #define SYS_debug               9001
 #define SYS_kshell              9002
 
+#ifndef __ASSEMBLY__
+
 struct regs;
 struct stat;
+struct timespec;
+struct iovec;
+struct sockaddr;
+struct uring_params;
 
 typedef struct argstr {
         const char *as_str;
@@ -98,12 +155,148 @@ typedef struct munmap_args {
         size_t  len;
 } munmap_args_t;
 
+typedef struct msync_args {
+        void   *addr;
+        size_t  len;
+        int     flags;
+} msync_args_t;
+
+typedef struct ioctl_args {
+        int     fd;
+        int     request;
+        void   *arg;
+} ioctl_args_t;
+
+typedef struct madvise_args {
+        void   *addr;
+        size_t  len;
+        int     advice;
+} madvise_args_t;
+
+typedef struct poll_args {
+        struct pollfd *fds;
+        unsigned int   nfds;
+        int            timeout;
+} poll_args_t;
+
+typedef struct epoll_ctl_args {
+        int                 epfd;
+        int                 op;
+        int                 fd;
+        struct epoll_event *event;
+} epoll_ctl_args_t;
+
+typedef struct epoll_wait_args {
+        int                 epfd;
+        struct epoll_event *events;
+        int                 maxevents;
+        int                 timeout;
+} epoll_wait_args_t;
+
+typedef struct uring_setup_args {
+        uint32_t             entries;
+        uint32_t             buflen;
+        struct uring_params *params;
+} uring_setup_args_t;
+
+typedef struct uring_enter_args {
+        int                 fd;
+        uint32_t            to_submit;
+        uint32_t            min_complete;
+} uring_enter_args_t;
+
+typedef struct nanosleep_args {
+        const struct timespec *req;
+        struct timespec       *rem;
+} nanosleep_args_t;
+
+typedef struct clock_gettime_args {
+        int              clk;
+        struct timespec *tp;
+} clock_gettime_args_t;
+
+typedef struct thr_create_args {
+        void   *tca_eip;        /* where the thread starts */
+        void   *tca_esp;        /* its initial stack pointer */
+} thr_create_args_t;
+
+typedef struct thr_join_args {
+        int     tja_tid;
+        void  **tja_retval;
+} thr_join_args_t;
+
+typedef struct futex_args {
+        uint32_t *fa_addr;
+        int       fa_op;
+        uint32_t  fa_val;
+} futex_args_t;
+
+typedef struct socket_args {
+        int     domain;
+        int     type;
+        int     protocol;
+} socket_args_t;
+
+typedef struct bind_args {
+        int                    fd;
+        const struct sockaddr *addr;
+        uint32_t               addrlen;
+} bind_args_t;
+
+typedef struct listen_args {
+        int     fd;
+        int     backlog;
+} listen_args_t;
+
+typedef struct accept_args {
+        int                    fd;
+        struct sockaddr       *addr;
+        uint32_t              *addrlen;
+} accept_args_t;
+
+typedef struct connect_args {
+        int                    fd;
+        const struct sockaddr *addr;
+        uint32_t               addrlen;
+} connect_args_t;
+
+typedef struct socketpair_args {
+        int     domain;
+        int     type;
+        int     protocol;
+        int    *sv;
+} socketpair_args_t;
+
+typedef struct sendto_args {
+        int                    fd;
+        const void            *buf;
+        size_t                 len;
+        int                    flags;
+        const struct sockaddr *to;
+        uint32_t               tolen;
+} sendto_args_t;
+
+typedef struct recvfrom_args {
+        int                    fd;
+        void                  *buf;
+        size_t                 len;
+        int                    flags;
+        struct sockaddr       *from;
+        uint32_t              *fromlen;
+} recvfrom_args_t;
+
 typedef struct open_args {
         argstr_t filename;
         int      flags;
         int      mode;
 } open_args_t;
 
+typedef struct shm_open_args {
+        argstr_t name;
+        int      oflag;
+        int      mode;
+} shm_open_args_t;
+
 typedef struct read_args {
         int     fd;
         void   *buf;
@@ -116,6 +309,52 @@ typedef struct write_args {
         size_t  nbytes;
 } write_args_t;
 
+typedef struct rwv_args {
+        int                 fd;
+        const struct iovec *iov;
+        int                 iovcnt;
+} rwv_args_t;
+
+typedef struct pread_args {
+        int     fd;
+        void   *buf;
+        size_t  nbytes;
+        off_t   offset;
+} pread_args_t;
+
+typedef struct pwrite_args {
+        int     fd;
+        void   *buf;
+        size_t  nbytes;
+        off_t   offset;
+} pwrite_args_t;
+
+typedef struct sendfile_args {
+        int     out_fd;
+        int     in_fd;
+        off_t  *offset;
+        size_t  count;
+} sendfile_args_t;
+
+typedef struct clone_file_args {
+        int     src_fd;
+        int     dst_fd;
+} clone_file_args_t;
+
+typedef struct fadvise_args {
+        int     fd;
+        off_t   offset;
+        off_t   len;
+        int     advice;
+} fadvise_args_t;
+
+typedef struct fallocate_args {
+        int     fd;
+        int     mode;
+        off_t   offset;
+        off_t   len;
+} fallocate_args_t;
+
 typedef struct mkdir_args {
         argstr_t path;
         int      mode;
@@ -143,6 +382,12 @@ typedef struct getdents_args {
         size_t         count;
 } getdents_args_t;
 
+typedef struct getdents_plus_args {
+        int                 fd;
+        struct dirent_plus *dirp;
+        size_t              count;
+} getdents_plus_args_t;
+
 typedef struct lseek_args {
         int fd;
         int offset;
@@ -167,4 +412,88 @@ typedef struct stat_args {
         struct stat *buf;
 } stat_args_t;
 
+typedef struct fstatat_args {
+        int          dirfd;
+        argstr_t     path;
+        struct stat *buf;
+} fstatat_args_t;
+
 struct utsname;
+
+/* What is known about the calls made of one system call. ss_hist[i]
+ * counts those which took from 2^i to 2^(i+1) nanoseconds, the last
+ * bucket taking everything longer. */
+#define SYSCALL_STAT_BUCKETS    32
+
+struct syscall_stat {
+        uint64_t ss_calls;
+        uint64_t ss_ns;                 /* spent in all of them */
+        uint32_t ss_hist[SYSCALL_STAT_BUCKETS];
+};
+
+typedef struct syscall_stats_args {
+        struct syscall_stat *buf;       /* indexed by syscall number */
+        int                  count;
+} syscall_stats_args_t;
+
+/* The memory a process uses, in pages. ps_rss counts the user pages it
+ * has mapped, of which ps_private are in no other address space (the
+ * rest are shared with other processes or the page cache); ps_ptpages
+ * counts the page tables mapping them. A vforked child reports its
+ * parent's address space. */
+#define PROC_STAT_NAME_LEN      32
+
+struct proc_stat {
+        pid_t    ps_pid;
+        pid_t    ps_ppid;               /* -1 if there is no parent */
+        int      ps_state;              /* 1 running, 2 exited */
+        uint32_t ps_rss;
+        uint32_t ps_private;
+        uint32_t ps_ptpages;
+        char     ps_comm[PROC_STAT_NAME_LEN];
+        uint64_t ps_cpu_ns;             /* run for, by all its threads */
+};
+
+typedef struct proc_stats_args {
+        struct proc_stat *buf;
+        int               count;
+} proc_stats_args_t;
+
+/* The text of kmem_census (see mm/kmalloc.h), truncated to len bytes,
+ * which are at most KMEM_CENSUS_MAX */
+#define KMEM_CENSUS_MAX         16384
+
+typedef struct kmem_census_args {
+        char    *buf;
+        size_t   len;
+} kmem_census_args_t;
+
+typedef struct ioprio_set_args {
+        pid_t   pid;
+        int     ioclass;
+} ioprio_set_args_t;
+
+typedef struct sched_setaffinity_args {
+        pid_t     pid;
+        uint32_t  mask;
+} sched_setaffinity_args_t;
+
+typedef struct sched_getaffinity_args {
+        pid_t     pid;
+        uint32_t *mask;
+} sched_getaffinity_args_t;
+
+struct rusage;
+
+typedef struct getrusage_args {
+        int            who;
+        struct rusage *ru;
+} getrusage_args_t;
+
+#ifdef __KERNEL__
+/* Fills in st for the system call numbered sysnum. Returns 0, or -EINVAL
+ * if there is no such number in the table. */
+int syscall_stats_get(uint32_t sysnum, struct syscall_stat *st);
+#endif
+
+#endif /* __ASSEMBLY__ */
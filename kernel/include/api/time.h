@@ -0,0 +1,15 @@
+#pragma once
+
+typedef long time_t;
+typedef int clockid_t;
+
+#define CLOCK_REALTIME          0       /* NYI, there is no clock of the day */
+#define CLOCK_MONOTONIC         1       /* time since boot */
+
+struct timespec {
+        time_t tv_sec;          /* seconds */
+        long   tv_nsec;         /* nanoseconds, 0 to 999999999 */
+};
+
+int clock_gettime(clockid_t clk, struct timespec *tp);
+int nanosleep(const struct timespec *req, struct timespec *rem);
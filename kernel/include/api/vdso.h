@@ -0,0 +1,50 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#include "api/utsname.h"
+#else
+#include "sys/types.h"
+#include "sys/utsname.h"
+#endif
+
+/*
+ * Every address space gets two read-only pages at the top of user memory
+ * at exec, which libc reads instead of trapping. The first is the same
+ * page in every process and holds what is the same for all of them; the
+ * second is private and holds what is not.
+ */
+#define VDSO_DATA_ADDR  0xbfffe000
+#define VDSO_PROC_ADDR  0xbffff000
+
+struct vdso_data {
+        volatile uint32_t vd_msecs;     /* msecs since boot, as of the last
+                                         * timer interrupt */
+        struct utsname    vd_uts;       /* what uname() returns */
+};
+
+struct vdso_proc {
+        pid_t             vp_pid;       /* what getpid() returns */
+};
+
+#define VDSO_DATA ((const struct vdso_data *)VDSO_DATA_ADDR)
+#define VDSO_PROC ((const struct vdso_proc *)VDSO_PROC_ADDR)
+
+#ifdef __KERNEL__
+struct vmmap;
+
+/* Maps both pages into map, which must have nothing mapped there, with
+ * pid filled in. Returns 0 or -errno. */
+int vdso_map(struct vmmap *map, pid_t pid);
+
+/* Changes the pid map's private page reports. Returns 0, or -ENOMEM if
+ * the page is shared copy-on-write and there is no memory for a copy. */
+int vdso_set_pid(struct vmmap *map, pid_t pid);
+
+/* Publishes the time, called from the timer interrupt. */
+void vdso_set_clock(uint32_t msecs);
+
+const struct utsname *vdso_uname(void);
+#endif
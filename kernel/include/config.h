@@ -11,8 +11,24 @@
 /*
  * kernel configuration parameters
  */
-#define DEFAULT_STACK_SIZE      (56*1024) /* size of stacks */
+#define DEFAULT_STACK_SIZE      (56*1024) /* most exec's arguments take up
+                                           * on a user stack */
+#define KSTACK_SIZE             (32*1024) /* size of kernel thread stacks */
+#define INTR_STACK_SIZE         (16*1024) /* size of the stack interrupts
+                                           * taken in the kernel run on */
+#define USER_STACK_MAX_SIZE     (1024*1024) /* most a user stack grows to */
+#define USER_STACK_INIT_PAGES   2  /* of user stack mapped below the
+                                    * arguments by exec */
+#define STACK_GUARD_PAGES       16 /* left unmapped below a stack, which it
+                                    * may not grow into */
 #define TICK_MSECS              10        /* msecs between clock interrupts */
+#define SCHED_QUANTUM_TICKS     5         /* timer ticks a user thread runs
+                                           * before it is preempted */
+#define SCHED_NPRIO             4         /* run queue priority levels */
+#define SCHED_HOUSEKEEPING_CPUS 0x1       /* CPU mask kernel daemons are
+                                           * confined to, see affinity.h */
+#define TIMER_SLACK_MSECS       1         /* timers this close to the one
+                                           * firing run with it */
 
 /*
  * Memory-management-related:
@@ -24,11 +40,50 @@
  */
 #define KMEM_FRAC(x)               (((x)>>2)+((x)>>3)) /* 37.5%-ish */
 
+/*     pages above which a ranged TLB flush reloads cr3 instead */
+#define TLB_FLUSH_ALL_THRESHOLD       32
+/*     destroyed page directories kept for the next process */
+#define PAGEDIR_POOL_SIZE              8
+/*     kmap_atomic() mappings one processor may hold at once, and
+ *     pages kmap() may have mapped */
+#define KMAP_ATOMIC_SLOTS              8
+#define KMAP_POOL_SIZE                64
+/*     kernel address space vmalloc() maps scattered pages into, taken
+ *     from the top of the direct map (a multiple of 4mb) */
+#define VMALLOC_SIZE                  (128 * 1024 * 1024)
+/*     freed kernel stacks kept for new threads (two per thread) */
+#define KSTACK_POOL_SIZE               8
+
 /*     pframe/mmobj-system-related: */
-#define PF_HASH_SIZE                  17 /* Number of buckets in pn/mmobj->pframe hash */
 /*         Pageout-related: */
 #define PAGEOUTD_FREE_TARGET_SHIFT     5 /* 3.125% */
 #define PAGEOUTD_FREE_MIN_SHIFT        4 /* 6.25% */
+#define PAGEOUTD_CLEAN_BATCH          16 /* dirty pages pageoutd cleans per pass */
+/*         Writeback-related: */
+#define FLUSHD_INTERVAL_MSECS       1000 /* between flushd's looks at dirty pages */
+#define FLUSHD_EXPIRE_INTERVALS        5 /* looks a page stays dirty before flushd
+                                          * writes it back */
+#define DIRTY_BACKGROUND_SHIFT         3 /* 12.5%: flushd writes back above this */
+#define DIRTY_THROTTLE_SHIFT           2 /* 25%: writers wait above this */
+#define PFRAME_FLUSH_BATCH            32 /* dirty pages of one object a sync writes
+                                          * back at a time, at most BLOCKDEV_MAX_BATCH */
+#define PFRAME_RANGE_MAX              16 /* most pages one pframe_get_range returns */
+#define FAULT_AROUND_PAGES            16 /* aligned window of resident pages a read fault maps */
+#define VMMAP_CACHE_SIZE               4 /* recent vmmap_lookup results kept per address space */
+#define PROC_RSS_LIMIT_SHIFT           1 /* 50%: a process faulting in more user
+                                          * pages than this of memory is killed */
+#define PROC_MLOCK_LIMIT_SHIFT         3 /* 12.5%: most of memory one process
+                                          * may hold locked with mlock */
+#define OOM_RESERVE_PAGES             16 /* kept back for the exits of processes
+                                          * the OOM killer kills */
+#define OOM_WAIT_MSECS               100 /* between looks for whether the OOM
+                                          * killer's victim has exited */
+/*         Same-page merging, see vm/ksm.c: */
+#define KSM_SCAN_PAGES                64 /* pages ksmd hashes each time it wakes;
+                                          * 0 turns it off */
+#define KSM_SCAN_MSECS               200 /* between ksmd's wakeups */
+#define KSM_CANDIDATES              1024 /* unmerged pages a pass remembers for
+                                          * later ones to match */
 
 
 /*
@@ -39,14 +94,79 @@
 #define MAX_FILES               1024    /* max number of files */
 #define MAX_VFS                 8       /* max # of vfses */
 #define MAX_VNODES              1024    /* max number of in-core vnodes */
+#define VNODE_HASH_BUCKETS      256     /* buckets vget looks vnodes up in */
+#define VNODE_CACHE_SIZE        128     /* unreferenced vnodes kept for vget */
 #define NAME_LEN                28      /* maximum directory entry length */
-#define NFILES                  32      /* maximum number of open files */
+#define NFILES                  1024    /* maximum number of open files */
+#define NFILES_INITIAL          32      /* that a file table starts with room for */
+#define POLL_MAX_FDS            32      /* most events epoll_wait(2) reports
+                                         * at once */
+#define READAHEAD_MIN_PAGES     2       /* initial sequential readahead window */
+#define READAHEAD_MAX_PAGES     32      /* largest the window grows to */
+#define READAHEAD_SEQ_PAGES     64      /* the window of a file advised
+                                         * POSIX_FADV_SEQUENTIAL */
+#define S5_DIRINDEX_MIN_DIRENTS 64      /* s5fs directories this big get an
+                                         * in-memory name hash */
+#define S5_DIRINDEX_BUCKETS     256     /* buckets in each such hash */
+#define S5_JOURNAL_COMMIT_MSECS 5000    /* longest an s5fs transaction
+                                         * collects operations */
+#define S5_JOURNAL_RESERVE      16      /* log blocks kept free for each
+                                         * new s5fs operation */
+#define DCACHE_SIZE             256     /* names remembered by lookup() */
+#define DCACHE_BUCKETS          64      /* hash buckets for those */
+#define PIPE_BUF_PAGES          16      /* pages in each pipe's buffer */
+#define PIPE_WAKE_SHIFT         2       /* 25%: reads wake blocked writers
+                                         * once this much is free */
+#define UNIX_BUF_PAGES          4       /* pages each end of a local socket
+                                         * buffers small writes in */
+#define UNIX_LOAN_PAGES         16      /* most pages of a large write lent
+                                         * to the reader at a time */
+#define UNIX_BACKLOG_MAX        16      /* connections a local socket
+                                         * holds for accept */
+#define URING_MAX_ENTRIES       256     /* largest submission queue of a
+                                         * ring (see fs/uring.h) */
+#define URING_MAX_BUF_PAGES     64      /* largest buffer area of one */
+#define TRACE_ENABLED           1       /* whether util/trace.h records
+                                         * from boot on */
+#define BLKTRACE_ENABLED        0       /* whether drivers/blktrace.h
+                                         * records from boot on */
+#define KMUTEX_STATS            0       /* 1 to keep contention statistics
+                                         * by kmutex call site */
+
+/* A block device made of other disks (see drivers/disk/raid.h) */
+#define RAID_LEVEL              -1      /* 0 to stripe, 1 to mirror, or -1
+                                         * for no array */
+#define RAID_FIRST_DISK         1       /* disks it is made of, by number */
+#define RAID_NDISKS             2
+#define RAID_CHUNK_BLOCKS       8       /* blocks to a disk per stripe */
+
+/* Where anonymous memory is paged out to (see vm/swap.h) */
+#define SWAP_DISK               -1      /* number of the disk, or -1 for
+                                         * no swap */
+#define SWAP_FIRST_BLOCK        0       /* where on it swap starts */
+#define SWAP_BLOCKS             8192    /* pages it holds */
+#define ZRAM_PAGES              2048    /* without the disk, the most memory
+                                         * swap may take up compressed (see
+                                         * vm/zram.h), or 0 for no swap */
+
+/* The network (see net/net.h), as QEMU's user networking hands it out */
+#define NET_ADDR                NET_IPADDR(10, 0, 2, 15)
+#define NET_NETMASK             NET_IPADDR(255, 255, 255, 0)
+#define NET_GATEWAY             NET_IPADDR(10, 0, 2, 2)
+#define NET_RX_BUFS             64      /* pages each network device is
+                                         * given to receive into */
+#define SOCK_RCVQ_MAX           32      /* datagrams a socket holds before
+                                         * it drops more */
+#define ARP_CACHE_SIZE          16      /* neighbours' ethernet addresses
+                                         * remembered */
+#define ARP_RESOLVE_MSECS       500     /* wait for each ARP reply */
+#define ARP_RESOLVE_TRIES       3
 
 /* Note: if rootfs is ramfs, this is completely ignored */
 #define VFS_ROOTFS_DEV  "disk0" /* device containing root filesystem */
 
 #ifdef __S5FS__
-/* root filesystem type - either "ramfs" or "s5fs" */
+/* root filesystem type - "ramfs", "tmpfs" or "s5fs" */
 #    define VFS_ROOTFS_TYPE "s5fs"
 #else
 #    define VFS_ROOTFS_TYPE "ramfs"
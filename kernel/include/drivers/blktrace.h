@@ -0,0 +1,86 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Block I/O tracing: a record for each step a block request takes, from
+ * being queued in blockdev_submit, through the elevator's dispatch (of
+ * the request and any merged with it) and the driver issuing it to the
+ * disk, to its completion. The newest BLKTRACE_NRECS records are kept in
+ * a ring, which userland reads in binary from /dev/blktrace, and
+ * tools/blkparse.py decodes.
+ *
+ * The device's file offset is the number of the record to read times
+ * the size of a record, counting from the first emitted since boot, so a
+ * reader picks up where it left off; a record which has been overwritten
+ * since reads as BLKTRACE_LOST. Writing '1' to the device turns tracing
+ * on, and '0' off.
+ */
+
+#define BLKTRACE_NRECS          4096    /* a power of two */
+
+/* What happened; keep tools/blkparse.py in step */
+#define BLKTRACE_LOST           0       /* overwritten before it was read */
+#define BLKTRACE_QUEUE          1       /* a request went on the queue */
+#define BLKTRACE_DISPATCH       2       /* the elevator took bt_count
+                                         * requests off it as one */
+#define BLKTRACE_ISSUE          3       /* a driver sent bt_count blocks
+                                         * to the disk */
+#define BLKTRACE_COMPLETE       4       /* a request completed with
+                                         * bt_status */
+
+typedef struct blktrace_rec {
+        uint64_t        bt_ns;          /* time_now_ns() */
+        uint32_t        bt_seq;         /* which record this is */
+        uint32_t        bt_block;
+        uint16_t        bt_count;       /* blocks */
+        uint16_t        bt_dev;         /* the device's devid_t */
+        int16_t         bt_pid;         /* of the process the I/O is for */
+        uint8_t         bt_action;      /* BLKTRACE_ */
+        uint8_t         bt_write;
+        int32_t         bt_status;      /* 0 or -errno, for completions */
+        uint32_t        bt_depth;       /* requests then queued on the device */
+} blktrace_rec_t;
+
+struct blockdev;
+
+extern int blktrace_enabled;
+
+/**
+ * Adds a record to the ring, if tracing is on. May be called from any
+ * context.
+ *
+ * @param dev the device's id
+ * @param action a BLKTRACE_ event
+ * @param pid the process the I/O is for, or -1
+ * @param block the first block
+ * @param count how many blocks (or requests, for a dispatch)
+ * @param write whether the I/O is a write
+ * @param status the result of a completion, otherwise 0
+ * @param depth how many requests are queued on the device
+ */
+void blktrace_emit(devid_t dev, int action, pid_t pid, blocknum_t block,
+                   uint32_t count, int write, int status, uint32_t depth);
+
+/**
+ * Emits the BLKTRACE_ISSUE record for a driver sending blocks to its
+ * disk, on behalf of the current process.
+ *
+ * @param dev the driver's block device
+ * @param block the first block
+ * @param count how many blocks
+ * @param write whether it is a write
+ */
+void blktrace_issue(struct blockdev *dev, blocknum_t block, uint32_t count,
+                    int write);
+
+/**
+ * Copies out whole records, see /dev/blktrace above.
+ *
+ * @param offset the byte offset of the first record to read
+ * @param buf where to put them
+ * @param count the size of buf
+ * @return the number of bytes read, 0 if there are no newer records, or
+ * -EINVAL if offset is not that of a record or buf does not fit one
+ */
+int blktrace_read(uint32_t offset, void *buf, uint32_t count);
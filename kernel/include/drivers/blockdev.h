@@ -13,9 +13,27 @@
 #include "mm/page.h"
 #include "mm/mmobj.h"
 
+#include "proc/sched.h"
+#include "proc/ioprio.h"
+
 #define BLOCK_SIZE PAGE_SIZE
 
+/* Most requests the elevator merges into a single driver call */
+#define BLOCKDEV_MAX_BATCH 32
+
+/* A queued request that has been passed over by this many dispatches is
+ * served next regardless of where it lies relative to the disk head */
+#define BLOCKDEV_DEADLINE  16
+
+/* A lower priority class with requests queued which has gone this many
+ * dispatches without being served is served next, ahead of the classes
+ * above it; idle requests otherwise wait until nothing is in flight */
+#define BLOCKDEV_BE_STARVE   64
+#define BLOCKDEV_IDLE_STARVE 256
+
 struct blockdev_ops;
+struct blockdev_req;
+struct kthread;
 
 /*
  * Represents a Weenix block device.
@@ -26,13 +44,66 @@ typedef struct blockdev {
 
         struct blockdev_ops  *bd_ops;
 
+        /* Most transfers the driver can have outstanding at once, if it
+         * has start_blockv */
+        int bd_qdepth;
+
         /* Fields that should be ignored by drivers: */
         struct mmobj bd_mmobj;
 
         /* Link on the list of block-oriented devices */
         list_link_t bd_link;
+
+        /* Request queue, see blockdev_submit(), one per priority class
+         * from realtime down to idle: */
+        list_t          bd_reqq[IOPRIO_NCLASS];   /* pending requests by
+                                                   * block number */
+        list_t          bd_fifo[IOPRIO_NCLASS];   /* pending requests by
+                                                   * arrival */
+        uint32_t        bd_served[IOPRIO_NCLASS]; /* bd_dispatches when the
+                                                   * class last had a turn */
+        int             bd_nqueued;     /* number of pending requests */
+        int             bd_ninflight;   /* requests handed to the driver */
+        blocknum_t      bd_head;        /* block after the last one moved */
+        uint32_t        bd_dispatches;  /* driver calls made so far */
+        list_t          bd_started;     /* requests of started transfers */
+        int             bd_nstarted;    /* transfers started, not reaped */
+        volatile int    bd_iodone;      /* set by blockdev_io_done() */
+        int             bd_unflushed;   /* written since the last flush */
+        ktqueue_t       bd_iowaitq;     /* the I/O thread sleeps here */
+        struct kthread *bd_iothr;       /* services the queue, or NULL */
 } blockdev_t;
 
+typedef void (*blockdev_done_t)(struct blockdev_req *req);
+
+/*
+ * A request to read or write one block. The caller owns the memory and
+ * fills it in with blockdev_req_init(); it must stay valid until the
+ * request completes.
+ */
+typedef struct blockdev_req {
+        blocknum_t       br_blocknum;
+        char            *br_buf;        /* page-aligned, BLOCK_SIZE bytes */
+        int              br_write;
+        int              br_status;     /* 0 or -errno once complete */
+        int              br_done;       /* 1 once complete */
+
+        /* Called once the transfer is complete, from the context that
+         * dispatched it (usually the device's I/O thread). This must not
+         * block. May be NULL. */
+        blockdev_done_t  br_callback;
+        void            *br_arg;
+
+        /* Private: */
+        pid_t            br_pid;        /* of the submitting process */
+        int              br_class;      /* its I/O priority, 0 is realtime */
+        uint32_t         br_age;        /* bd_dispatches at submission */
+        int              br_nbatch;     /* requests in its started transfer */
+        ktqueue_t        br_waitq;      /* blockdev_wait() sleeps here */
+        list_link_t      br_link;       /* link on bd_reqq or bd_started */
+        list_link_t      br_flink;      /* link on bd_fifo */
+} blockdev_req_t;
+
 typedef struct blockdev_ops {
         /**
          * Reads a block from the block device. This call will block.
@@ -59,6 +130,78 @@ typedef struct blockdev_ops {
          */
         int (*write_block)(blockdev_t *bdev, const char *buf,
                            blocknum_t loc, size_t count);
+
+        /**
+         * Reads a run of contiguous blocks into separate buffers, one
+         * per block, as a single scatter-gather transfer. This call
+         * will block. Drivers which cannot do scatter-gather I/O may
+         * leave this NULL.
+         *
+         * @param bdev the block device
+         * @param bufs count page-aligned, block-sized buffers
+         * @param loc the number of the block to start reading from
+         * @param count the number of blocks to read
+         * @return 0 on success, -errno on failure
+         */
+        int (*read_blockv)(blockdev_t *bdev, char **bufs,
+                           blocknum_t loc, size_t count);
+
+        /**
+         * Writes a run of contiguous blocks from separate buffers, one
+         * per block, as a single scatter-gather transfer. This call
+         * will block. May be NULL, as with read_blockv.
+         *
+         * @param bdev the block device
+         * @param bufs count page-aligned, block-sized buffers
+         * @param loc the number of the block to start writing at
+         * @param count the number of blocks to write
+         * @return 0 on success, -errno on failure
+         */
+        int (*write_blockv)(blockdev_t *bdev, char **bufs,
+                            blocknum_t loc, size_t count);
+
+        /**
+         * Starts reading or writing a run of contiguous blocks, one
+         * buffer per block, and returns without waiting for the transfer
+         * to complete. The driver calls blockdev_io_done() when it has,
+         * and hands it back from reap_blockv(). This lets the I/O thread
+         * keep up to bd_qdepth transfers outstanding on a device which
+         * queues commands itself. This call may block, to wait for room
+         * in the driver. Drivers which cannot queue may leave this and
+         * reap_blockv NULL; the synchronous operations are still used
+         * while there is no I/O thread.
+         *
+         * @param bdev the block device
+         * @param bufs count page-aligned, block-sized buffers
+         * @param loc the number of the first block
+         * @param count the number of blocks, at most BLOCKDEV_MAX_BATCH
+         * @param write true to write, false to read
+         * @param tag handed back by reap_blockv, never NULL
+         * @return 0 if the transfer was started, -errno if it could not be
+         */
+        int (*start_blockv)(blockdev_t *bdev, char **bufs, blocknum_t loc,
+                            size_t count, int write, void *tag);
+
+        /**
+         * Takes a completed transfer started with start_blockv. This call
+         * does not block.
+         *
+         * @param bdev the block device
+         * @param status set to the status of the transfer, 0 or -errno
+         * @return the tag of the transfer, or NULL if none has completed
+         */
+        void *(*reap_blockv)(blockdev_t *bdev, int *status);
+
+        /**
+         * Makes every write which has completed on the device durable,
+         * by flushing its volatile write cache. This call will block.
+         * Drivers whose devices complete writes only once they are
+         * durable may leave this NULL.
+         *
+         * @param bdev the block device
+         * @return 0 on success, -errno on failure
+         */
+        int (*flush)(blockdev_t *bdev);
 } blockdev_ops_t;
 
 /**
@@ -82,6 +225,100 @@ int blockdev_register(blockdev_t *dev);
  */
 blockdev_t *blockdev_lookup(devid_t id);
 
+/**
+ * Initializes a block I/O request.
+ *
+ * @param req the request
+ * @param buf the page-aligned buffer to read into or write from
+ * @param loc the block to read or write
+ * @param write true to write, false to read
+ * @param callback called when the request completes, or NULL
+ * @param arg stashed in req->br_arg for the callback
+ */
+void blockdev_req_init(blockdev_req_t *req, char *buf, blocknum_t loc,
+                       int write, blockdev_done_t callback, void *arg);
+
+/**
+ * Allocates and frees requests for callers which cannot keep them on their
+ * stack, i.e. those which do not wait for the request to complete.
+ * blockdev_req_free does not block, so it may be called from a request's
+ * callback.
+ */
+blockdev_req_t *blockdev_req_alloc(void);
+void blockdev_req_free(blockdev_req_t *req);
+
+/**
+ * Queues a request on a block device and returns without waiting for it.
+ * The request is charged to the current process and queued in its I/O
+ * priority class. The highest class with requests pending is served, in
+ * C-LOOK order except that one which has waited BLOCKDEV_DEADLINE
+ * dispatches goes first, and runs of requests for adjacent blocks are
+ * merged into one driver call.
+ *
+ * @param dev the block device
+ * @param req an initialized request
+ */
+void blockdev_submit(blockdev_t *dev, blockdev_req_t *req);
+
+/**
+ * Waits for a submitted request to complete.
+ *
+ * @param req the request
+ * @return the status of the request, 0 or -errno
+ */
+int blockdev_wait(blockdev_req_t *req);
+
+/**
+ * Reads a block through the request queue. This call will block.
+ *
+ * @param dev the block device
+ * @param buf page-aligned buffer for the block
+ * @param loc the block to read
+ * @return 0 on success, -errno on failure
+ */
+int blockdev_read(blockdev_t *dev, char *buf, blocknum_t loc);
+
+/**
+ * Writes a block through the request queue. This call will block.
+ *
+ * @param dev the block device
+ * @param buf page-aligned buffer holding the block
+ * @param loc the block to write
+ * @return 0 on success, -errno on failure
+ */
+int blockdev_write(blockdev_t *dev, const char *buf, blocknum_t loc);
+
+/**
+ * Makes the writes completed on a block device so far durable. Callers
+ * which need a write on stable storage before going on (a journal commit,
+ * say) wait for it and then call this. Nothing is sent to the device if
+ * nothing has been written to it since the last flush.
+ *
+ * @param dev the block device
+ * @return 0 on success, -errno on failure
+ */
+int blockdev_flush(blockdev_t *dev);
+
+/**
+ * Flushes every block device, as sync(2) does once it has written all
+ * dirty pages back.
+ */
+void blockdev_sync(void);
+
+/**
+ * Tells the block device's I/O thread that a transfer started with
+ * start_blockv has completed. May be called from interrupt context.
+ *
+ * @param dev the block device
+ */
+void blockdev_io_done(blockdev_t *dev);
+
+/**
+ * Stops the I/O threads of all block devices. Requests submitted
+ * afterwards are performed synchronously by the submitter.
+ */
+void blockdev_shutdown(void);
+
 /**
  * Cleans and frees all resident pages belonging to a given block
  * device.
@@ -9,6 +9,7 @@ struct pframe;
 struct bytedev_ops;
 struct vmarea;
 struct mmobj;
+struct polltable;
 
 typedef struct bytedev {
         devid_t             cd_id;
@@ -23,6 +24,10 @@ typedef struct bytedev_ops {
         int (*fillpage)(struct vnode *file, off_t offset, void *pagebuf);
         int (*dirtypage)(struct vnode *file, off_t offset);
         int (*cleanpage)(struct vnode *file, off_t offset, void *pagebuf);
+        /* Optional; the poll vnode operation of files for this device */
+        int (*poll)(bytedev_t *dev, int events, struct polltable *pt);
+        /* Optional; the ioctl vnode operation, arg being a user address */
+        int (*ioctl)(bytedev_t *dev, int request, void *arg);
 } bytedev_ops_t;
 
 /**
@@ -0,0 +1,16 @@
+#pragma once
+
+/*
+ * Disks on an AHCI SATA controller. Where the disk supports Native Command
+ * Queuing up to 32 reads and writes are outstanding on it at once, each in
+ * its own command slot with its own scatter-gather table, and the disk
+ * chooses the order in which to serve them. The I/O thread fills the
+ * slots from the request queue through start_blockv. The disks are
+ * numbered after the ATA and virtio ones.
+ */
+
+/**
+ * Finds the AHCI controller, if any, and registers a block device for each
+ * disk attached to it.
+ */
+void ahci_init(void);
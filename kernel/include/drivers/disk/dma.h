@@ -1,10 +1,27 @@
 #pragma once
 
+#include "types.h"
+
 /* Linux kernel: drivers/ata/libata-sff.c */
 #define DMA_COMMAND 0x00
 #define DMA_STATUS  0x02
 #define DMA_PRD     0x04 /* dword register */
 
+/* Number of PRD entries in each channel's table. A physically scattered
+ * buffer needs one entry per page, so this also bounds the size of a single
+ * transfer to DMA_MAX_PRDS pages. */
+#define DMA_MAX_PRDS 32
+
+/*
+ * One piece of a scatter-gather transfer: a page-aligned kernel buffer
+ * (typically a pframe's pf_addr, or where pframe_kmap put it) and its
+ * length in bytes.
+ */
+typedef struct dma_seg {
+        void     *ds_addr;
+        uint32_t  ds_len;
+} dma_seg_t;
+
 /**
  * Initializes the DMA subsystem.
  */
@@ -29,12 +46,24 @@ void dma_reset(uint16_t busmaster_addr);
  * Initialize DMA for an operation
  *
  * @param channel the channel on which to perform the operation
- * @param start the beginning of the buffer in memory
- * @param count the number of bytes to read/write
- * @param write true if writing, false if reading
+ * @param start the beginning of the buffer in memory (must be page-aligned,
+ *      and need only be virtually contiguous)
+ * @param count the number of bytes to read/write, at most
+ *      DMA_MAX_PRDS * PAGE_SIZE
  */
 void dma_load(uint8_t channel, void* start, int count);
 
+/**
+ * Initialize DMA for a scatter-gather operation which moves the given
+ * segments, in order, as one transfer. Together the segments may span at
+ * most DMA_MAX_PRDS pages.
+ *
+ * @param channel the channel on which to perform the operation
+ * @param segs the segments making up the transfer
+ * @param nsegs the number of segments
+ */
+void dma_load_sg(uint8_t channel, const dma_seg_t *segs, int nsegs);
+
 /* 1/24/13 Commented this out for now, it isn't used anyway */
 /**
  * Cancel the current DMA operation.
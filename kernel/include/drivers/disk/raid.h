@@ -0,0 +1,18 @@
+#pragma once
+
+/*
+ * A block device made of several disks, set up at boot from RAID_LEVEL,
+ * RAID_FIRST_DISK and RAID_NDISKS in config.h. RAID-0 stripes blocks
+ * across the disks RAID_CHUNK_BLOCKS at a time; RAID-1 writes every
+ * block to all of them and spreads reads between them. The array is
+ * registered as the disk after the last real one, so it can be mounted
+ * like any other ("disk2" with two disks, say).
+ */
+
+#define RAID_MAX_DISKS          4
+
+/**
+ * Builds the configured array, if there is one, out of the disks which
+ * have been registered by now.
+ */
+void raid_init(void);
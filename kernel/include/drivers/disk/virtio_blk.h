@@ -0,0 +1,17 @@
+#pragma once
+
+/*
+ * Disks on virtio-blk PCI devices (the "legacy" interface, I/O port
+ * registers), which QEMU provides with -drive if=virtio. A request is
+ * one chain of descriptors on the device's single virtqueue, so there
+ * is no register access per sector as with ATA, just one port write to
+ * notify the device, which it tells the driver it can do without while it
+ * is busy. Several requests may be outstanding at once, each thread
+ * sleeping on its own until the interrupt reaps it. The disks are
+ * numbered after the ATA ones.
+ */
+
+/**
+ * Finds the virtio-blk devices and registers a block device for each.
+ */
+void virtio_blk_init(void);
@@ -0,0 +1,14 @@
+#pragma once
+
+/*
+ * Network interfaces on virtio-net PCI devices (the legacy interface),
+ * which QEMU provides with -device virtio-net-pci. Each frame is received
+ * straight into a netbuf the driver keeps posted on the receive queue,
+ * and sent straight from the netbuf the stack built it in, so the driver
+ * copies nothing.
+ */
+
+/**
+ * Finds the virtio-net devices and registers a network device for each.
+ */
+void virtio_net_init(void);
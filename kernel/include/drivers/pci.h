@@ -33,6 +33,22 @@
 #define PCI_CMD_IO		BIT(0)
 #define PCI_CMD_MMIO		BIT(1)
 #define PCI_CMD_BUSMASTER	BIT(2)
+#define PCI_CMD_INTXDISABLE	BIT(10)
+
+#define PCI_STATUS_CAPLIST	BIT(4)
+
+/* Capability IDs, and the layout of the MSI capability */
+#define PCI_CAP_MSI		0x05
+#define PCI_CAP_MSIX		0x11
+
+#define PCI_MSI_CTRL		0x02
+#define PCI_MSI_ADDR		0x04
+#define PCI_MSI_ADDR_HI		0x08
+#define PCI_MSI_DATA_32		0x08
+#define PCI_MSI_DATA_64		0x0C
+#define PCI_MSI_CTRL_ENABLE	BIT(0)
+#define PCI_MSI_CTRL_MME	(BIT(4) | BIT(5) | BIT(6))
+#define PCI_MSI_CTRL_64BIT	BIT(7)
 
 enum {
 	PCI_MMIO, PCI_IO, PCI_INVALIDBAR
@@ -67,6 +83,18 @@ void pci_init(void);
 
 pcidev_t* pci_lookup(uint8_t class, uint8_t subclass, uint8_t interface);
 
+pcidev_t* pci_lookup_id(uint16_t vendor, uint16_t device, pcidev_t* prev);
+
 uint32_t pci_read_config(pcidev_t* dev, uint8_t reg_off, uint8_t length);
 
 void pci_write_config(pcidev_t* dev, uint8_t reg_off, uint32_t val, uint8_t length);
+
+/* Returns the offset in the device's configuration space of its capability
+ * with the given ID, or 0 if it does not have it */
+uint8_t pci_find_cap(pcidev_t* dev, uint8_t id);
+
+/* Has the device raise the given interrupt with a single message-signalled
+ * interrupt instead of its legacy IRQ line, which it stops asserting.
+ * Returns 0, or -ENOTSUP if the device has no MSI capability, in which
+ * case its IRQ line is left as it was. */
+int pci_msi_enable(pcidev_t* dev, uint8_t intr);
@@ -2,6 +2,7 @@
 
 struct tty_ldisc;
 struct tty_device;
+struct polltable;
 
 typedef struct tty_ldisc_ops {
         /**
@@ -51,6 +52,43 @@ typedef struct tty_ldisc_ops {
          * @return a null terminated string to be echoed to the tty
          */
         const char *(*process_char)(struct tty_ldisc *ldisc, char c);
+
+        /**
+         * Process as many of the characters in buf as fit, translated,
+         * into out, as though with process_char.
+         *
+         * @param ldisc the line discipline
+         * @param buf the characters to process
+         * @param len the number of characters in buf; set to how many
+         * were processed, which is at least one if outlen is at least 2
+         * @param out where to put what is to be echoed to the tty
+         * @param outlen the size of out
+         * @return the number of characters put in out
+         */
+        int (*process_buf)(struct tty_ldisc *ldisc, const char *buf, int *len,
+                           char *out, int outlen);
+
+        /**
+         * Reports which POLL* events are true of the line discipline's
+         * input, registering pt to be woken when that changes.
+         *
+         * @param ldisc the line discipline
+         * @param events the events the poller is waiting for
+         * @param pt the poll table to register, or NULL
+         * @return the events which are true now
+         */
+        int (*poll)(struct tty_ldisc *ldisc, int events, struct polltable *pt);
+
+        /**
+         * Carries out a terminal control request, such as TCGETS or
+         * TCSETS.
+         *
+         * @param ldisc the line discipline
+         * @param request the request
+         * @param arg the request's argument, a user address
+         * @return 0 or the request's result on success, -errno on error
+         */
+        int (*ioctl)(struct tty_ldisc *ldisc, int request, void *arg);
 } tty_ldisc_ops_t;
 
 typedef struct tty_ldisc {
@@ -50,6 +50,28 @@ void screen_putbuf(const char *buf);
  */
 void screen_putbuf_attrib(const uint16_t *buf);
 
+/**
+ * Write a row of _EXACTLY_ DISPLAY_WIDTH characters to the given line
+ * of the screen.
+ *
+ * @param buf the characters to write
+ * @param y the line to write them to
+ */
+void screen_putline(const char *buf, uint8_t y);
+
+/**
+ * Scroll the screen up by the given number of lines (less than
+ * DISPLAY_HEIGHT) by moving where the display starts in video memory,
+ * without copying anything. The lines which come into view at the
+ * bottom hold garbage until they are written.
+ *
+ * @param lines the number of lines to scroll
+ * @return 0 if the screen scrolled, or -1 if the display had to be
+ * moved back to the start of video memory instead, in which case every
+ * line holds garbage
+ */
+int screen_scroll(uint8_t lines);
+
 /**
  * Clear the screen.
  */
@@ -0,0 +1,26 @@
+#pragma once
+
+struct tty_driver;
+
+/**
+ * Initializes the serial terminal subsystem, finding and setting up
+ * the UART on COM1 if there is one.
+ */
+void serial_init(void);
+
+/**
+ * Returns the number of serial terminals available to the system.
+ *
+ * @return the number of serial terminals
+ */
+int serial_num_terminals(void);
+
+/**
+ * Returns a pointer to the tty_driver_t for the serial terminal with a
+ * given id. The terminals are numbered 0 through serial_num_terminals()
+ * - 1.
+ *
+ * @param id the id of the serial terminal to get the driver for
+ * @return a pointer to the driver for the specified serial terminal
+ */
+struct tty_driver *serial_get_tty_driver(int id);
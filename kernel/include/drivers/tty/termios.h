@@ -0,0 +1,45 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+/*
+ * The part of termios(3) a tty here implements: whether input is read a
+ * line at a time and echoed, and when a read which is not gets to return.
+ */
+
+typedef unsigned int    tcflag_t;
+typedef unsigned char   cc_t;
+
+/* c_lflag */
+#define ICANON          0x0002  /* line at a time, with erase and EOF */
+#define ECHO            0x0008  /* echo what is typed */
+
+/* c_cc indices; VMIN and VTIME only apply without ICANON */
+#define VEOF            0
+#define VERASE          1
+#define VMIN            2       /* a read waits for this many characters */
+#define VTIME           3       /* or this many tenths of a second */
+#define NCCS            4
+
+struct termios {
+        tcflag_t        c_iflag;        /* unused */
+        tcflag_t        c_oflag;        /* unused */
+        tcflag_t        c_cflag;        /* unused */
+        tcflag_t        c_lflag;
+        cc_t            c_cc[NCCS];
+};
+
+/* ioctl requests, whose argument is a struct termios * */
+#define TCGETS          0x5401
+#define TCSETS          0x5402
+
+/* tcsetattr actions; all take effect at once */
+#define TCSANOW         0
+#define TCSADRAIN       1
+#define TCSAFLUSH       2
+
+#ifndef __KERNEL__
+int     tcgetattr(int fd, struct termios *t);
+int     tcsetattr(int fd, int action, const struct termios *t);
+void    cfmakeraw(struct termios *t);
+#endif
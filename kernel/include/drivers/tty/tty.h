@@ -2,8 +2,14 @@
 
 #include "drivers/bytedev.h"
 
+#include "util/list.h"
+
 #define TTY_MAJOR 2
 
+/* Characters received and not yet seen by the line discipline; a power
+ * of two, so that the free-running ring indices wrap cleanly */
+#define TTY_INQ_SIZE 256
+
 struct tty_driver;
 struct tty_ldisc;
 
@@ -12,6 +18,16 @@ typedef struct tty_device {
         struct tty_ldisc  *tty_ldisc;
         int                tty_id;
         bytedev_t          tty_cdev;
+
+        /*
+         * The driver's interrupt handler puts what it receives here and
+         * the tty softirq takes it out for the line discipline.
+         * Each index is written by only one of them, so neither locks.
+         */
+        char               tty_inq[TTY_INQ_SIZE];
+        volatile unsigned  tty_inq_head;        /* next to take */
+        volatile unsigned  tty_inq_tail;        /* next to fill */
+        list_link_t        tty_link;            /* on the list of ttys */
 } tty_device_t;
 
 /**
@@ -0,0 +1,157 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/bits.h"
+
+/*
+ * What the virtio drivers share: the legacy ("transitional") PCI
+ * interface, whose registers are I/O ports in BAR0, and the virtqueues
+ * through which the driver hands the device chains of buffers.
+ */
+
+#define VIRTIO_PCI_VENDOR               0x1af4
+
+/* Legacy register offsets from the I/O port base in BAR0 */
+#define VIRTIO_REG_DEVICE_FEATURES      0x00    /* 32 bits */
+#define VIRTIO_REG_GUEST_FEATURES       0x04    /* 32 bits */
+#define VIRTIO_REG_QUEUE_PFN            0x08    /* 32 bits */
+#define VIRTIO_REG_QUEUE_SIZE           0x0c    /* 16 bits */
+#define VIRTIO_REG_QUEUE_SELECT         0x0e    /* 16 bits */
+#define VIRTIO_REG_QUEUE_NOTIFY         0x10    /* 16 bits */
+#define VIRTIO_REG_DEVICE_STATUS        0x12    /* 8 bits */
+#define VIRTIO_REG_ISR_STATUS           0x13    /* 8 bits, reading clears */
+#define VIRTIO_REG_CONFIG               0x14    /* without MSI-X */
+
+/* Device status bits */
+#define VIRTIO_STATUS_ACKNOWLEDGE       0x01
+#define VIRTIO_STATUS_DRIVER            0x02
+#define VIRTIO_STATUS_DRIVER_OK         0x04
+#define VIRTIO_STATUS_FAILED            0x80
+
+/* ISR status bits */
+#define VIRTIO_ISR_QUEUE                0x01
+
+/* Feature bits common to all devices */
+#define VIRTIO_RING_F_EVENT_IDX         BIT(29)
+
+/*
+ * The virtqueue, laid out as the legacy interface has it in one physically
+ * contiguous, page-aligned piece: the descriptors, the available ring
+ * (with the used event after it) and, from the next page boundary, the
+ * used ring (with the available event after it).
+ */
+#define VRING_DESC_F_NEXT               0x01
+#define VRING_DESC_F_WRITE              0x02    /* the device writes it */
+#define VRING_AVAIL_F_NO_INTERRUPT      0x01
+#define VRING_USED_F_NO_NOTIFY          0x01
+
+typedef struct vring_desc {
+        uint64_t vd_addr;
+        uint32_t vd_len;
+        uint16_t vd_flags;
+        uint16_t vd_next;
+} vring_desc_t;
+
+typedef struct vring_avail {
+        uint16_t va_flags;
+        uint16_t va_idx;
+        /* followed by uint16_t va_ring[qsize] and the used event */
+} vring_avail_t;
+
+typedef struct vring_used_elem {
+        uint32_t ve_id;
+        uint32_t ve_len;
+} vring_used_elem_t;
+
+typedef struct vring_used {
+        uint16_t vu_flags;
+        uint16_t vu_idx;
+        /* followed by vring_used_elem_t vu_ring[qsize] and the avail event */
+} vring_used_t;
+
+/* One buffer of a chain handed to virtq_add */
+typedef struct virtq_seg {
+        const void *vs_addr;            /* kernel virtual address */
+        uint32_t    vs_len;
+        int         vs_devwrite;        /* the device writes it */
+} virtq_seg_t;
+
+typedef struct virtq {
+        uint16_t                 vq_iobase;
+        uint16_t                 vq_index;
+        int                      vq_event_idx;  /* VIRTIO_RING_F_EVENT_IDX */
+
+        uint16_t                 vq_size;
+        vring_desc_t            *vq_desc;
+        volatile vring_avail_t  *vq_avail;
+        volatile uint16_t       *vq_avail_ring;
+        volatile uint16_t       *vq_used_event;
+        volatile vring_used_t   *vq_used;
+        volatile vring_used_elem_t *vq_used_ring;
+        volatile uint16_t       *vq_avail_event;
+
+        /* Free descriptors, chained through vd_next */
+        uint16_t                 vq_free_head;
+        uint16_t                 vq_nfree;
+
+        /* The available index when the device was last told of it */
+        uint16_t                 vq_kicked;
+
+        /* The first used ring entry not taken yet */
+        uint16_t                 vq_last_used;
+
+        /* What the chain starting at each descriptor was added with */
+        void                   **vq_cookies;
+} virtq_t;
+
+/* The device sees memory writes in program order on x86 as long as the
+ * compiler keeps them there, except that a later read may go ahead of an
+ * earlier write, which the locked instruction prevents */
+#define virtio_barrier()        __asm__ volatile("" : : : "memory")
+#define virtio_mb()             __asm__ volatile("lock; addl $0, 0(%%esp)" : : : "memory", "cc")
+
+/*
+ * Resets the device at iobase and agrees on the features it offers out
+ * of wanted, which it returns. The device is then to have its queues set
+ * up and virtio_driver_ok called, or virtio_fail.
+ */
+uint32_t virtio_negotiate(uint16_t iobase, uint32_t wanted);
+void virtio_driver_ok(uint16_t iobase);
+void virtio_fail(uint16_t iobase);
+
+/*
+ * Sets up queue index of the device at iobase, using the notification
+ * suppression of VIRTIO_RING_F_EVENT_IDX if event_idx is set. Returns 0,
+ * or -ENODEV if the device has no such queue, or one too small or too
+ * big. Panics if there is not the memory for it.
+ */
+int virtq_init(virtq_t *vq, uint16_t iobase, uint16_t index, int event_idx);
+
+/*
+ * Makes the chain of nsegs buffers available to the device, to be handed
+ * back by virtq_get with cookie, which must not be NULL. Returns 0, or
+ * -ENOSPC without adding anything if there are not nsegs descriptors
+ * free. Must be called with the device's interrupt masked.
+ */
+int virtq_add(virtq_t *vq, const virtq_seg_t *segs, unsigned int nsegs, void *cookie);
+
+/* Tells the device about what virtq_add added, unless it has said it
+ * does not need telling. Returns whether it was told. */
+int virtq_kick(virtq_t *vq);
+
+/*
+ * Takes the next chain the device is done with, giving its descriptors
+ * back, and returns its cookie, with the length the device wrote in len
+ * if len is not NULL. Returns NULL if there are none.
+ */
+void *virtq_get(virtq_t *vq, uint32_t *len);
+
+/*
+ * Ask the device not to interrupt, while its used ring is being emptied,
+ * and to again once it has been. virtq_intr_enable returns whether the
+ * device finished more before it knew, in which case the ring has to be
+ * emptied once more.
+ */
+void virtq_intr_disable(virtq_t *vq);
+int virtq_intr_enable(virtq_t *vq);
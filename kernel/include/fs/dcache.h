@@ -0,0 +1,52 @@
+#pragma once
+
+#include "types.h"
+
+struct fs;
+struct vnode;
+
+/*
+ * The name cache remembers what lookup() found for (directory, name)
+ * pairs, including names which do not exist. Anything that adds or
+ * removes a directory entry has to tell it, see vfs_syscall.c.
+ */
+
+/**
+ * Looks a name up in the cache.
+ *
+ * @param dir the directory
+ * @param name the name, len bytes long
+ * @param len the length of name
+ * @param result set to the vnode the name refers to, with a reference
+ * held, or to NULL if the name is known not to exist
+ * @return 1 if the name was in the cache, 0 if it was not
+ */
+int dcache_lookup(struct vnode *dir, const char *name, size_t len,
+                  struct vnode **result);
+
+/**
+ * Remembers the result of a lookup.
+ *
+ * @param child the vnode name refers to, or NULL if it does not exist
+ */
+void dcache_enter(struct vnode *dir, const char *name, size_t len,
+                  struct vnode *child);
+
+/**
+ * Forgets what the cache knows about one name in a directory.
+ */
+void dcache_forget(struct vnode *dir, const char *name, size_t len);
+
+/**
+ * Forgets every name in a directory that is being removed.
+ *
+ * @param fs the directory's file system
+ * @param vno the directory's inode number
+ */
+void dcache_forget_dir(struct fs *fs, ino_t vno);
+
+/**
+ * Forgets every name on a file system that is going away, and every name
+ * elsewhere that leads into it.
+ */
+void dcache_forget_fs(struct fs *fs);
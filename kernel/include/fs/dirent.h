@@ -18,3 +18,11 @@ typedef struct dirent {
 } dirent_t;
 
 #define d_fileno d_ino
+
+/* A directory entry along with what ls(1) wants to know of the file it
+ * names, as read by getdents_plus() */
+typedef struct dirent_plus {
+        struct dirent   dp_dirent;
+        int             dp_mode;                /* S_IF* type, 0 if unknown */
+        int             dp_size;                /* length in bytes */
+} dirent_plus_t;
@@ -0,0 +1,51 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#else
+#include "sys/types.h"
+#endif
+
+/* epoll events, the same as the POLL* ones of poll.h */
+#define EPOLLIN         0x01
+#define EPOLLPRI        0x02
+#define EPOLLOUT        0x04
+#define EPOLLERR        0x08    /* always reported */
+#define EPOLLHUP        0x10    /* always reported */
+/* Report an event once when it happens, rather than each epoll_wait
+ * until it stops being true */
+#define EPOLLET         0x80000000
+
+/* epoll_ctl() operations */
+#define EPOLL_CTL_ADD   1
+#define EPOLL_CTL_DEL   2
+#define EPOLL_CTL_MOD   3
+
+typedef union epoll_data {
+        void           *ptr;
+        int             fd;
+        uint32_t        u32;
+} epoll_data_t;
+
+struct epoll_event {
+        uint32_t        events;
+        epoll_data_t    data;           /* handed back by epoll_wait */
+};
+
+#ifdef __KERNEL__
+struct file;
+
+/* Each returns -errno on failure. event and events are kernel copies. */
+int do_epoll_create(int size);
+int do_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int do_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
+/* Called by fput before a file goes away, to drop its registrations. */
+void epoll_file_closed(struct file *f);
+#else
+int epoll_create(int size);
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+#endif
@@ -6,6 +6,9 @@
 
 /* Kernel and user header (via symlink) */
 
+/* For fstatat(), the directory to resolve a relative path against. */
+#define AT_FDCWD        -100    /* The current working directory. */
+
 /* File access modes for open(). */
 #define O_RDONLY        0
 #define O_WRONLY        1
@@ -15,3 +18,20 @@
 #define O_CREAT         0x100   /* Create file if non-existent. */
 #define O_TRUNC         0x200   /* Truncate to zero length. */
 #define O_APPEND        0x400   /* Append to file. */
+#define O_EXCL          0x800   /* With O_CREAT, fail if it exists (shm_open only). */
+#define O_DIRECT        0x1000  /* Read and write page-aligned buffers straight
+                                 * to and from the disk, past the page cache. */
+
+/* fadvise() advice. */
+#define POSIX_FADV_NORMAL       0       /* No advice, read ahead when sequential. */
+#define POSIX_FADV_RANDOM       1       /* Do not read ahead. */
+#define POSIX_FADV_SEQUENTIAL   2       /* Read ahead further, and let go of
+                                         * pages behind. */
+#define POSIX_FADV_WILLNEED     3       /* Start reading the range in now. */
+#define POSIX_FADV_DONTNEED     4       /* Drop the cached pages of the range. */
+#define POSIX_FADV_NOREUSE      5       /* Accepted; does nothing. */
+
+/* fallocate() mode. */
+#define FALLOC_FL_KEEP_SIZE     0x01    /* Do not grow the file. */
+#define FALLOC_FL_PUNCH_HOLE    0x02    /* Free the range instead; needs
+                                         * FALLOC_FL_KEEP_SIZE. */
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "types.h"
+#include "config.h"
+
+struct file;
+
+/*
+ * A process's file descriptor table. It starts out with room for
+ * NFILES_INITIAL descriptors in the table itself, and whenever one past
+ * the end is wanted its arrays are moved into ones twice the size, up to
+ * NFILES. Beside the files is a bitmap of the descriptors in use, from
+ * which the lowest free one is found a word at a time, and across which
+ * fork and exit step from one open descriptor to the next without
+ * looking at the closed ones.
+ *
+ * fget() looks descriptors up with a bounds check and one load from
+ * fdt_files, which is all there is to reading the table.
+ */
+
+#define FDTABLE_WORD_BITS       32
+#define FDTABLE_WORDS(n)        (((n) + FDTABLE_WORD_BITS - 1) / FDTABLE_WORD_BITS)
+
+typedef struct fdtable {
+        struct file   **fdt_files;      /* fdt_size of them, NULL if closed */
+        uint32_t       *fdt_open;       /* bit fd is set if fdt_files[fd] is */
+        int             fdt_size;
+        int             fdt_first;      /* every descriptor below is open */
+        struct file    *fdt_inline_files[NFILES_INITIAL];
+        uint32_t        fdt_inline_open[FDTABLE_WORDS(NFILES_INITIAL)];
+} fdtable_t;
+
+/**
+ * Sets up an empty table, which has room for NFILES_INITIAL descriptors.
+ *
+ * @param fdt the table
+ */
+void fdtable_init(fdtable_t *fdt);
+
+/**
+ * Finds the lowest descriptor which is not open, growing the table to
+ * make room for it if every one in it is.
+ *
+ * @param fdt the table
+ * @return the descriptor, -EMFILE if NFILES are open already, or -ENOMEM
+ * if the table had to grow and could not
+ */
+int fdtable_first_free(fdtable_t *fdt);
+
+/**
+ * Grows the table until it has room for descriptor fd, for dup2(2).
+ *
+ * @param fdt the table
+ * @param fd the descriptor, which is less than NFILES
+ * @return 0, or -ENOMEM
+ */
+int fdtable_reserve(fdtable_t *fdt, int fd);
+
+/**
+ * Makes fd, for which the table has room, refer to f. The reference to
+ * f passes to the table.
+ *
+ * @param fdt the table
+ * @param fd the descriptor
+ * @param f the file
+ */
+void fdtable_install(fdtable_t *fdt, int fd, struct file *f);
+
+/**
+ * Closes fd in the table, without putting the file it referred to.
+ *
+ * @param fdt the table
+ * @param fd the descriptor, for which the table has room
+ * @return the file, which the caller now has the table's reference to,
+ * or NULL if fd was not open
+ */
+struct file *fdtable_remove(fdtable_t *fdt, int fd);
+
+/**
+ * Gives dst, an empty table, each of the files open in src at the same
+ * descriptors, for fork(2).
+ *
+ * @param dst the new table
+ * @param src the table to copy
+ * @return 0, or -ENOMEM, in which case dst is left empty
+ */
+int fdtable_copy(fdtable_t *dst, const fdtable_t *src);
+
+/**
+ * Puts every file open in the table and leaves it empty, for exit(2).
+ *
+ * @param fdt the table
+ */
+void fdtable_destroy(fdtable_t *fdt);
@@ -1,10 +1,12 @@
 #pragma once
 
 #include "types.h"
+#include "util/list.h"
 
 #define FMODE_READ    1
 #define FMODE_WRITE   2
 #define FMODE_APPEND  4
+#define FMODE_DIRECT  8
 
 struct vnode;
 
@@ -18,9 +20,9 @@ typedef struct file {
 
         /*
          * The mode in which this file was opened. This is a mask of the flags
-         * FMODE_READ, FMODE_WRITE, and FMODE_APPEND. It is set when the file
-         * is first opened, and use to restrict the operations that can be
-         * performed on the underlying vnode.
+         * FMODE_READ, FMODE_WRITE, FMODE_APPEND and FMODE_DIRECT. It is set
+         * when the file is first opened, and use to restrict the operations
+         * that can be performed on the underlying vnode.
          */
         int                     f_mode;
 
@@ -34,6 +36,12 @@ typedef struct file {
          * The vnode which corresponds to this file.
          */
         struct vnode            *f_vnode;
+
+        /*
+         * The epoll registrations of this file, which fput drops when it
+         * frees the file (see fs/epoll.c).
+         */
+        list_t                  f_epitems;
 } file_t;
 
 /*
@@ -0,0 +1,77 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#include "proc/sched.h"
+#include "util/list.h"
+#else
+#include "sys/types.h"
+#endif
+
+/* poll() events */
+#define POLLIN          0x01    /* there is something to read */
+#define POLLPRI         0x02    /* there is urgent data to read */
+#define POLLOUT         0x04    /* writing now would not block */
+#define POLLERR         0x08    /* error, always reported */
+#define POLLHUP         0x10    /* hung up, always reported */
+#define POLLNVAL        0x20    /* fd is not open, always reported */
+
+typedef unsigned int nfds_t;
+
+struct pollfd {
+        int     fd;             /* file descriptor, ignored if negative */
+        short   events;         /* what the caller waits for */
+        short   revents;        /* what happened, filled in by poll() */
+};
+
+#ifdef __KERNEL__
+struct polltable;
+struct pollwaiter;
+
+/*
+ * Something which can be polled keeps a pollhead, and calls poll_wakeup
+ * on it whenever one of the events its poll vnode operation reports may
+ * have become true. poll_wakeup may be called from interrupt context.
+ */
+typedef struct pollhead {
+        list_t                  ph_waiters;
+} pollhead_t;
+
+/* One registration on a pollhead; pw_wake is called by poll_wakeup, at
+ * interrupt time if that is where poll_wakeup is called. */
+typedef struct pollwaiter {
+        list_link_t             pw_link;        /* on the pollhead */
+        void                  (*pw_wake)(struct pollwaiter *pw);
+} pollwaiter_t;
+
+/* What the poll vnode operation is handed: pt_waiter gives the waiter to
+ * hang on a pollhead, or NULL for none. */
+typedef struct polltable {
+        pollwaiter_t         *(*pt_waiter)(struct polltable *pt);
+} polltable_t;
+
+void pollhead_init(pollhead_t *ph);
+
+/* Called by a poll vnode operation, before it tests for its events, to
+ * have pt woken by poll_wakeup(ph). pt is NULL when nobody will wait. */
+void poll_wait(pollhead_t *ph, polltable_t *pt);
+
+void poll_wakeup(pollhead_t *ph);
+
+void pollwaiter_init(pollwaiter_t *pw, void (*wake)(pollwaiter_t *pw));
+
+/* Takes pw off whatever pollhead it is on, if any. */
+void poll_unwait(pollwaiter_t *pw);
+
+/* Calls vn's poll operation, or reports what a vnode without one is. */
+struct vnode;
+int poll_vnode(struct vnode *vn, int events, polltable_t *pt);
+
+/* fds is a kernel copy of nfds entries; fills in revents and returns how
+ * many are non-zero, or -errno. timeout is in msecs, negative for none. */
+int do_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+#else
+int poll(struct pollfd *fds, nfds_t nfds, int timeout);
+#endif
@@ -0,0 +1,77 @@
+/*
+ *   FILE: rofs.h
+ *  DESCR: a read-only file system of compressed files, see rofs.c
+ */
+
+#pragma once
+
+#ifdef __FSMAKER__
+#include <stdint.h>
+#else
+#include "config.h"
+
+#include "fs/vfs.h"
+#include "drivers/blockdev.h"
+#endif
+
+/*
+ * The image is a superblock, a table of inodes starting in the next
+ * block, and then bytes, packed without regard to block boundaries but
+ * for what is noted below. mkrofs puts each directory's entries there
+ * followed by the files in it.
+ *
+ * A regular file is cut into ROFS_BLOCK_SIZE pieces, each compressed on
+ * its own (LZ4's block format), and its ri_data is the byte offset of
+ * an array of one more offsets than it has pieces: piece i is the bytes
+ * from the i-th offset up to the next. A piece which is as long after
+ * compression as before is kept as it is.
+ *
+ * A directory's ri_data is the byte offset of its entries, ".", "..",
+ * and then the rest sorted by name with strcmp() for binary search.
+ */
+#define ROFS_MAGIC              0x53464f52      /* "ROFS" */
+#define ROFS_CURRENT_VERSION    1
+#define ROFS_BLOCK_SIZE         4096
+#define ROFS_SUPER_BLOCK        0
+#define ROFS_NAME_LEN           28
+
+#define ROFS_TYPE_DATA          0x1
+#define ROFS_TYPE_DIR           0x2
+
+typedef struct rofs_super {
+        uint32_t rs_magic;
+        uint32_t rs_version;
+        uint32_t rs_num_inodes;
+        uint32_t rs_root_inode;
+        uint32_t rs_size;               /* bytes in the image */
+} rofs_super_t;
+
+typedef struct rofs_inode {
+        uint32_t ri_type;               /* ROFS_TYPE_{DATA,DIR} */
+        uint32_t ri_size;               /* uncompressed; entries times
+                                         * sizeof(rofs_dirent_t) for a
+                                         * directory */
+        uint32_t ri_linkcount;
+        uint32_t ri_data;               /* 4-aligned for a file, and
+                                         * sizeof(rofs_dirent_t)-aligned
+                                         * for a directory, so that no
+                                         * offset or entry spans blocks */
+} rofs_inode_t;
+
+typedef struct rofs_dirent {
+        uint32_t rd_inode;
+        char     rd_name[ROFS_NAME_LEN];
+} rofs_dirent_t;
+
+#define ROFS_INODES_PER_BLOCK   (ROFS_BLOCK_SIZE / sizeof(rofs_inode_t))
+#define ROFS_INODE_BLOCK(inum)  ((inum) / ROFS_INODES_PER_BLOCK + 1)
+#define ROFS_INODE_OFFSET(inum) ((inum) % ROFS_INODES_PER_BLOCK)
+
+#ifndef __FSMAKER__
+typedef struct rofs {
+        blockdev_t              *rf_bdev;
+        rofs_super_t             rf_super;
+} rofs_t;
+
+int rofs_mount(struct fs *fs);
+#endif
@@ -21,22 +21,27 @@
 #define S5_IS_SUPER(blkno)      ( (blkno) == S5_SUPER_BLOCK )
 #define S5_NBLKS_PER_FNODE      30
 #define S5_BLOCK_SIZE           4096
-#define S5_NDIRECT_BLOCKS       28
+#define S5_NDIRECT_BLOCKS       27
 #define S5_INODES_PER_BLOCK     (S5_BLOCK_SIZE /  sizeof(s5_inode_t))
 #define S5_DIRENTS_PER_BLOCK    (S5_BLOCK_SIZE / sizeof(s5_dirent_t))
-#define S5_MAX_FILE_BLOCKS      (S5_NDIRECT_BLOCKS + (S5_BLOCK_SIZE / sizeof(uint32_t)))
+/* The direct, indirect and double-indirect blocks could address more
+ * than this, but file offsets (off_t) are 32-bit signed. */
+#define S5_MAX_FILE_BLOCKS      (0x7fffffff / S5_BLOCK_SIZE)
 #define S5_NAME_LEN             28
+#define S5_DIRINDEX_HASH        16      /* buckets of s5f_dirindex */
 
 #define S5_TYPE_FREE            0x0
 #define S5_TYPE_DATA            0x1
 #define S5_TYPE_DIR             0x2
 #define S5_TYPE_CHR             0x4
 #define S5_TYPE_BLK             0x8
+#define S5_TYPE_SOCK            0x10    /* the name of a local socket */
 
 #define S5_MAGIC                071177
-#define S5_CURRENT_VERSION      3
+#define S5_CURRENT_VERSION      9
 
-/* Number of blocks stored in the indirect block */
+/* Number of blocks stored in the indirect block, and in each block the
+ * double-indirect block points to */
 #define S5_NIDIRECT_BLOCKS      (S5_BLOCK_SIZE / sizeof(uint32_t))
 
 /* Given a file offset, returns the block number that it is in */
@@ -45,6 +50,14 @@
 /* Given a file offset, returns the offset into the pointer's block */
 #define S5_DATA_OFFSET(seekptr) ((seekptr) % S5_BLOCK_SIZE)
 
+/*
+ * A regular file no bigger than its direct block numbers is stored in
+ * them instead, see s5_write_file() and s5fs_cleanpage().
+ */
+#define S5_INLINE_SIZE          (S5_NDIRECT_BLOCKS * sizeof(uint32_t))
+#define S5_INODE_INLINE(inode)  (S5_TYPE_DATA == (inode)->s5_type         \
+                                 && (inode)->s5_size <= S5_INLINE_SIZE)
+
 /* Given an inode number, tells the block that inode is stored in. */
 #define S5_INODE_BLOCK(inum)    ((inum) / S5_INODES_PER_BLOCK + 1)
 
@@ -54,6 +67,24 @@
  */
 #define S5_INODE_OFFSET(inum)  ((inum) % S5_INODES_PER_BLOCK)
 
+/*
+ * The inode bitmap follows the inode blocks, and has a bit set for each
+ * inode in use. Inodes are handed out by allocation group, a run of
+ * S5_IGROUP_BLOCKS inode blocks, see s5_alloc_inode().
+ */
+#define S5_IMAP_BITS            (S5_BLOCK_SIZE * 8)
+#define S5_IMAP_BLOCKS(ninodes) (((ninodes) + S5_IMAP_BITS - 1) / S5_IMAP_BITS)
+#define S5_IGROUP_BLOCKS        4
+#define S5_IGROUP_INODES        (S5_IGROUP_BLOCKS * S5_INODES_PER_BLOCK)
+
+/*
+ * The block reference counts follow the inode bitmap: a byte for each
+ * block of the disk, counting the files which share it beyond the
+ * first, so 0 for a block which is not shared. See s5_clone_file().
+ */
+#define S5_REFS_MAX             0xff
+#define S5_REFS_BLOCKS(nblocks) (((nblocks) + S5_BLOCK_SIZE - 1) / S5_BLOCK_SIZE)
+
 /* Given an FS struct, get the S5FS (private data) struct. */
 #define FS_TO_S5FS(fs)  ( (s5fs_t *)((fs)->fs_i))
 
@@ -71,7 +102,7 @@ typedef struct s5_fbl_node {
 /* The contents of the superblock, as stored on disk. */
 typedef struct s5_super {
         uint32_t s5s_magic;              /* the magic number */
-        uint32_t s5s_free_inode;         /* the free inode pointer */
+        uint32_t s5s_free_inodes;        /* number of free inodes */
         uint32_t s5s_nfree;              /* number of blocks currently in
                                           * s5s_free_blocks */
         /** First "node" of free block list */
@@ -80,21 +111,27 @@ typedef struct s5_super {
         uint32_t s5s_root_inode;         /* root inode */
         uint32_t s5s_num_inodes;         /* number of inodes */
         uint32_t s5s_version;            /* version of this disk format */
+
+        uint32_t s5s_journal_start;      /* first block of the journal */
+        uint32_t s5s_journal_blocks;     /* its length, 0 if there is none */
+        uint32_t s5s_free_count;         /* number of free blocks */
+        uint32_t s5s_imap_start;         /* first block of the inode
+                                          * bitmap */
+        uint32_t s5s_num_blocks;         /* blocks on the disk */
+        uint32_t s5s_refs_start;         /* first block of the block
+                                          * reference counts */
 } s5_super_t;
 
 /* The contents of an inode, as stored on disk. */
 typedef struct s5_inode {
-        union {
-                uint32_t s5_next_free; /* inode free list ptr */
-                uint32_t s5_size;      /* file size */
-        } s5_un;
-#define        s5_next_free s5_un.s5_next_free
-#define        s5_size      s5_un.s5_size
+        uint32_t   s5_size;                /* file size */
         uint32_t   s5_number;              /* this inode's number */
         uint16_t   s5_type;         /* one of S5_TYPE_{FREE,DATA,DIR} */
         int16_t    s5_linkcount;    /* link count of this inode */
-        uint32_t   s5_direct_blocks[S5_NDIRECT_BLOCKS];
+        uint32_t   s5_direct_blocks[S5_NDIRECT_BLOCKS]; /* or the data
+                                     * itself, see S5_INODE_INLINE */
         uint32_t   s5_indirect_block;
+        uint32_t   s5_dindirect_block; /* block of indirect blocks */
 } s5_inode_t;
 
 /* The contents of a directory entry, as stored on disk. */
@@ -103,14 +140,60 @@ typedef struct s5_dirent {
         char       s5d_name[S5_NAME_LEN];
 } s5_dirent_t;
 
+/*
+ * The journal is a run of blocks which holds at most one transaction: a
+ * descriptor in its first block, the images of the blocks the descriptor
+ * lists, in that order, and then a commit block. The transaction only
+ * counts if its commit block is there with the same sequence number.
+ * s5jd_nblocks is 0 once the blocks have been written home.
+ */
+#define S5_JDESC_MAGIC          0x4a4e5235
+#define S5_JCOMMIT_MAGIC        0x434d5435
+#define S5_JOURNAL_MAX_BLOCKS   (S5_BLOCK_SIZE / sizeof(uint32_t) - 3)
+
+typedef struct s5_jdesc {
+        uint32_t s5jd_magic;
+        uint32_t s5jd_seq;               /* the transaction's number */
+        uint32_t s5jd_nblocks;           /* number of blocks it logs */
+        uint32_t s5jd_blocks[S5_JOURNAL_MAX_BLOCKS]; /* where they go */
+} s5_jdesc_t;
+
+typedef struct s5_jcommit {
+        uint32_t s5jc_magic;
+        uint32_t s5jc_seq;               /* matches s5jd_seq */
+} s5_jcommit_t;
+
 #ifndef __FSMAKER__
+struct s5_journal;
+
 /* Our in-memory representation of a s5fs filesytem (fs_i points to this) */
 typedef struct s5fs {
         blockdev_t              *s5f_bdev;
         s5_super_t              *s5f_super;
-        kmutex_t                s5f_mutex;
+        kmutex_t                s5f_block_mutex; /* free blocks */
+        kmutex_t                s5f_inode_mutex; /* free inodes */
+        kmutex_t                s5f_alloc_mutex; /* held while giving a
+                                        * file blocks, see s5fs_dirtypage */
+        uint32_t                s5f_reserved; /* free blocks set aside for
+                                        * dirty pages which have none yet */
         fs_t                    *s5f_fs;
+        list_t                  s5f_dirindex[S5_DIRINDEX_HASH]; /* name
+                                        * hashes of big directories, by
+                                        * inode number, see s5fs_subr.c */
+        struct s5_journal       *s5f_journal; /* NULL if the disk has
+                                        * none, see s5fs_journal.c */
 } s5fs_t;
 
 int s5fs_mount(struct fs *fs);
+
+/**
+ * Writes how many times threads have had to wait for the lock of the
+ * given vnode, and for each allocation lock of its file system.
+ *
+ * @param vnode an s5fs vnode
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the number of bytes written
+ */
+size_t s5fs_lock_info(const void *vnode, char *buf, size_t osize);
 #endif
@@ -0,0 +1,61 @@
+/*
+ *   FILE: s5fs_journal.h
+ *  DESCR: write-ahead log for s5fs metadata
+ */
+
+#pragma once
+
+#include "types.h"
+
+struct s5fs;
+struct pframe;
+struct mmobj;
+
+/**
+ * Replays the journal left on disk, if it holds a committed
+ * transaction, and sets up fs->s5f_journal. Must be called once the
+ * superblock has been read, but before any other metadata is.
+ *
+ * @return 0 on success, -errno on failure
+ */
+int s5_journal_mount(struct s5fs *fs);
+
+/**
+ * Commits whatever is outstanding and stops journaling. Metadata
+ * dirtied afterwards is written back in place.
+ */
+void s5_journal_umount(struct s5fs *fs);
+
+/**
+ * Commits the running transaction, if it has any blocks, and waits
+ * until it is on disk and written home. Must not be called from within
+ * an operation.
+ */
+void s5_journal_sync(struct s5fs *fs);
+
+/**
+ * Starts an operation which changes metadata. Metadata pages dirtied
+ * until the matching s5_journal_end() are committed together, or not
+ * at all. Operations may nest.
+ */
+void s5_journal_begin(struct s5fs *fs);
+
+/**
+ * Ends an operation started by s5_journal_begin().
+ */
+void s5_journal_end(struct s5fs *fs);
+
+/**
+ * Called after dirtying a metadata page. If an operation is running the
+ * page joins its transaction and stays pinned until it is committed.
+ *
+ * @param pf the page, either of the block device or of a directory
+ * @param blockno the disk block the page is stored in
+ */
+void s5_journal_dirty(struct s5fs *fs, struct pframe *pf, uint32_t blockno);
+
+/**
+ * Drops the pages of obj from the running transaction, for a directory
+ * which is about to go away along with its cached pages.
+ */
+void s5_journal_forget(struct s5fs *fs, struct mmobj *obj);
@@ -10,14 +10,19 @@
 
 struct fs;
 struct vnode;
+struct pframe;
+struct s5_dirent;
 
-int s5_alloc_inode(struct fs *fs, uint16_t type, devid_t devid);
+int s5_alloc_inode(struct fs *fs, uint16_t type, devid_t devid, ino_t parent);
 void s5_free_inode(struct vnode *vnode);
 
 
 int s5_read_file(struct vnode *vn, off_t seek, char *dest, size_t len);
 int s5_write_file(struct vnode *vn, off_t seek, const char *bytes,
                   size_t len);
+int s5_read_file_user(struct vnode *vn, off_t seek, char *udest, size_t len);
+int s5_write_file_user(struct vnode *vn, off_t seek, const char *ubytes,
+                       size_t len);
 
 /* TA BLANK {{{ */
 /* TODO: perhaps change the order of the arguments 'parent' and 'child' to
@@ -28,7 +33,48 @@ int s5_link(struct vnode *parent, struct vnode *child,
 int s5_find_dirent(struct vnode *vnode, const char *name, size_t namelen);
 int s5_remove_dirent(struct vnode *vnode, const char *name, size_t namelen);
 int s5_seek_to_block(struct vnode *vnode, off_t seekptr, int alloc);
+int s5_reserve_block(struct vnode *vnode, off_t seekptr);
+void s5_unreserve_block(struct vnode *vnode, off_t seekptr);
+int s5_unshare_block(struct vnode *vnode, off_t seekptr);
+int s5_punch_block(struct vnode *vnode, off_t seekptr);
+int s5_uninline(struct vnode *vnode, uint32_t size);
+int s5_clone_file(struct vnode *src, struct vnode *dst);
 int s5_inode_blocks(struct vnode *vnode);
+void s5_dirindex_drop(struct vnode *dir);
+
+/*
+ * Walks the entries of a directory where they lie in its pages: each
+ * page is brought in and pinned once for all the S5_DIRENTS_PER_BLOCK
+ * entries it holds, rather than each entry being copied out with
+ * s5_read_file. s5_dirent_iter_next moves to the first entry at or after
+ * the offset given to s5_dirent_iter_init, then to each one after that,
+ * and returns 1 with it_ent and it_offset set, 0 after the last one, or
+ * -errno. An entry changed through it_ent must be followed by
+ * s5_dirent_iter_dirty. The caller holds the directory's lock throughout,
+ * and s5_dirent_iter_done lets go of the page.
+ */
+typedef struct s5_dirent_iter {
+        struct vnode            *it_dir;
+        struct pframe           *it_pf;         /* pinned, holds it_ent */
+        struct s5_dirent        *it_ent;        /* the current entry */
+        off_t                    it_offset;     /* of it_ent */
+        off_t                    it_next;       /* of the entry after it */
+} s5_dirent_iter_t;
+
+void s5_dirent_iter_init(s5_dirent_iter_t *it, struct vnode *dir, off_t offset);
+int s5_dirent_iter_next(s5_dirent_iter_t *it);
+int s5_dirent_iter_dirty(s5_dirent_iter_t *it);
+void s5_dirent_iter_done(s5_dirent_iter_t *it);
+
+/* 1 if dir holds only "." and "..", 0 if it holds more, or -errno */
+int s5_dir_empty(struct vnode *dir);
+
+/* alloc for s5_seek_to_block() when the caller holds what
+ * s5_reserve_block() set aside for seekptr */
+#define S5_ALLOC_RESERVED       2
+/* alloc for s5_seek_to_block() which also replaces a block shared with
+ * another file, see s5_unshare_block() */
+#define S5_ALLOC_UNSHARE        3
 
 #define VNODE_TO_S5FS(vn)       ( (s5fs_t *)((vn)->vn_fs->fs_i))
 #define VNODE_TO_S5INODE(vn)    ( (s5_inode_t *)(vn)->vn_i )
@@ -49,6 +95,7 @@ int s5_inode_blocks(struct vnode *vnode);
                 KASSERT(!err                                            \
                         && "shouldn\'t fail for a page belonging "      \
                         "to a block device");                           \
+                s5_journal_dirty((fs), p, p->pf_pagenum);               \
         } while (0)
 
 /*
@@ -33,6 +33,7 @@ struct stat {
 #define S_IFREG         0x0800 /* regular */
 #define S_IFLNK         0x1000 /* symlink */
 #define S_IFIFO         0x2000 /* fifo/pipe */
+#define S_IFSOCK        0x4000 /* socket */
 
 #define _S_TYPE(m)      ((m) & 0xFF00)
 #define S_ISCHR(m)      (_S_TYPE(m) == S_IFCHR)
@@ -41,3 +42,4 @@ struct stat {
 #define S_ISREG(m)      (_S_TYPE(m) == S_IFREG)
 #define S_ISLNK(m)      (_S_TYPE(m) == S_IFLNK)
 #define S_ISFIFO(m)     (_S_TYPE(m) == S_IFIFO)
+#define S_ISSOCK(m)     (_S_TYPE(m) == S_IFSOCK)
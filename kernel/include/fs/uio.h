@@ -0,0 +1,15 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#include "types.h"
+
+#define IOV_MAX 16              /* most segments one readv/writev takes */
+
+struct iovec {
+        void   *iov_base;       /* start of the segment */
+        size_t  iov_len;        /* and its length in bytes */
+};
+
+int readv(int fd, const struct iovec *iov, int iovcnt);
+int writev(int fd, const struct iovec *iov, int iovcnt);
@@ -0,0 +1,82 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#else
+#include "sys/types.h"
+#endif
+
+/*
+ * A submission/completion ring: memory shared between a process and the
+ * kernel, which the process maps with mmap(2) on the descriptor
+ * uring_setup() returns. The process puts requests in the submission
+ * queue and advances sq_tail; uring_enter() hands them to the kernel,
+ * which posts a completion for each in the completion queue, advancing
+ * cq_tail, and the process reads completions off it, advancing cq_head.
+ * One uring_enter() can submit many requests, and wait for some of them.
+ *
+ * Reads and writes go to and from the ring's buffer area, which follows
+ * the queues in the mapping; addr and STAT's off are offsets into it.
+ */
+
+#define URING_OP_NOP            0
+#define URING_OP_READ           1       /* len bytes from fd at off to addr */
+#define URING_OP_WRITE          2       /* len bytes at addr to fd at off */
+#define URING_OP_FSYNC          3       /* fsync(2) fd, or fdatasync(2) */
+#define URING_OP_OPEN           4       /* open(2) the len bytes of path at
+                                         * addr with op_flags */
+#define URING_OP_STAT           5       /* stat(2) the path at addr, len,
+                                         * into a struct stat at off */
+
+/* op_flags of URING_OP_FSYNC */
+#define URING_FSYNC_DATASYNC    0x1
+
+struct uring_sqe {
+        uint8_t         opcode;         /* URING_OP_* */
+        uint8_t         flags;          /* none yet, must be 0 */
+        uint16_t        pad;
+        int32_t         fd;
+        int32_t         off;            /* in the file, or -1 for its position */
+        uint32_t        addr;           /* in the buffer area */
+        uint32_t        len;
+        uint32_t        op_flags;
+        uint64_t        user_data;      /* handed back in the completion */
+};
+
+struct uring_cqe {
+        uint64_t        user_data;
+        int32_t         res;            /* what the call would return, or -errno */
+        uint32_t        pad;
+};
+
+/* At the start of the mapping. Entry i of a queue is at index
+ * i & (entries - 1). */
+struct uring_hdr {
+        uint32_t        sq_head;        /* advanced by the kernel */
+        uint32_t        sq_tail;        /* advanced by the process */
+        uint32_t        cq_head;        /* advanced by the process */
+        uint32_t        cq_tail;        /* advanced by the kernel */
+        uint32_t        cq_overflow;    /* completions lost to a full queue */
+};
+
+/* Filled in by uring_setup(); offsets are from the start of the mapping */
+struct uring_params {
+        uint32_t        sq_entries;
+        uint32_t        cq_entries;
+        uint32_t        sq_off;
+        uint32_t        cq_off;
+        uint32_t        buf_off;
+        uint32_t        buf_len;
+        uint32_t        size;           /* of the whole mapping */
+};
+
+#ifdef __KERNEL__
+/* Each returns -errno on failure; params is a kernel copy. */
+int do_uring_setup(uint32_t entries, uint32_t buflen, struct uring_params *params);
+int do_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete);
+#else
+int uring_setup(uint32_t entries, uint32_t buflen, struct uring_params *params);
+int uring_enter(int fd, uint32_t to_submit, uint32_t min_complete);
+#endif
@@ -95,6 +95,13 @@ typedef struct fs {
         list_link_t     fs_link;
 #endif
 
+        /*
+         * How many of flushd's looks the file system's pages may stay
+         * dirty before they are written back, or 0 for
+         * FLUSHD_EXPIRE_INTERVALS. Set by mount options, see do_mount().
+         */
+        int             fs_flush_expire;
+
         /*
          * The following members are initialized by the filesystem
          * implementation's mount routine:
@@ -158,6 +165,9 @@ int lookup_dirpath(struct vnode *dir, char *buf, size_t size);
 int mountfunc(fs_t *fs);
 
 #ifdef __MOUNTING__
+/* every mounted file system but the root, in the order they were mounted */
+extern list_t mounted_fs_list;
+
 int vfs_mount(struct vnode *mtpt, fs_t *fs);
 int vfs_umount(fs_t *fs);
 #endif
@@ -7,10 +7,23 @@
 #include "fs/open.h"
 #include "fs/pipe.h"
 #include "fs/stat.h"
+#include "fs/uio.h"
 
 int do_close(int fd);
 int do_read(int fd, void *buf, size_t nbytes);
 int do_write(int fd, const void *buf, size_t nbytes);
+int do_read_user(int fd, void *ubuf, size_t nbytes);
+int do_write_user(int fd, const void *ubuf, size_t nbytes);
+int do_readv(int fd, const struct iovec *iov, int iovcnt);
+int do_writev(int fd, const struct iovec *iov, int iovcnt);
+int do_readv_user(int fd, const struct iovec *uiov, int iovcnt);
+int do_writev_user(int fd, const struct iovec *uiov, int iovcnt);
+int do_pread(int fd, void *buf, size_t nbytes, off_t pos);
+int do_pwrite(int fd, const void *buf, size_t nbytes, off_t pos);
+int do_pread_user(int fd, void *ubuf, size_t nbytes, off_t pos);
+int do_pwrite_user(int fd, const void *ubuf, size_t nbytes, off_t pos);
+int do_sendfile(int out_fd, int in_fd, off_t *offp, size_t count);
+int do_clone_file(int src_fd, int dst_fd);
 int do_dup(int fd);
 int do_dup2(int ofd, int nfd);
 int do_mknod(const char *path, int mode, unsigned devid);
@@ -21,8 +34,15 @@ int do_link(const char *from, const char *to);
 int do_rename(const char *oldname, const char *newname);
 int do_chdir(const char *path);
 int do_getdent(int fd, struct dirent *dirp);
+int do_getdents(int fd, struct dirent *dirp, int count);
+int do_getdents_plus(int fd, struct dirent_plus *dirp, int count);
 int do_lseek(int fd, int offset, int whence);
 int do_stat(const char *path, struct stat *uf);
+int do_fstatat(int dirfd, const char *path, struct stat *buf);
+int do_ioctl(int fd, int request, void *arg);
+int do_fsync(int fd, int datasync);
+int do_fadvise(int fd, off_t offset, off_t len, int advice);
+int do_fallocate(int fd, int mode, off_t offset, off_t len);
 
 #ifdef __MOUNTING__
 /* for mounting implementations only, not required */
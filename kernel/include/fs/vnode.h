@@ -13,15 +13,19 @@
 #include "drivers/bytedev.h"
 #include "util/list.h"
 #include "proc/kmutex.h"
+#include "proc/krwlock.h"
+#include "proc/rcu.h"
 #include "mm/mmobj.h"
 #include "mm/pframe.h"
 
 struct fs;
 struct dirent;
+struct dirent_plus;
 struct stat;
 struct file;
 struct vnode;
 struct vmarea;
+struct polltable;
 
 typedef struct vnode_ops {
         /* The following functions map directly to their corresponding
@@ -46,6 +50,14 @@ typedef struct vnode_ops {
          * transferred.
          */
         int (*write)(struct vnode *file, off_t offset, const void *buf, size_t count);
+        /*
+         * Optional; may be NULL. Like read and write, but buf is an
+         * address in the current process's user space, which is copied
+         * to or from directly with copy_to_user()/copy_from_user().
+         * Returns -EFAULT if buf is not accessible.
+         */
+        int (*read_user)(struct vnode *file, off_t offset, void *buf, size_t count);
+        int (*write_user)(struct vnode *file, off_t offset, const void *buf, size_t count);
         /*
          * Everything within 'vma' other than vma->vm_obj (and
          * vm_link--meaning that 'vma' has not yet been entered into
@@ -109,6 +121,19 @@ typedef struct vnode_ops {
          * read and 0 will be returned.
          */
         int (*readdir)(struct vnode *dir, off_t offset, struct dirent *d);
+        /*
+         * Optional; may be NULL. Like readdir, but reads up to count
+         * entries into d[0..count) starting at *offset, and advances
+         * *offset past them. Returns the number of entries read, 0 at
+         * the end of the directory.
+         */
+        int (*readdir_batch)(struct vnode *dir, off_t *offset, struct dirent *d, int count);
+        /*
+         * Optional; may be NULL. Like readdir_batch, but also fills in
+         * the type and size of the file each entry names, from wherever
+         * the filesystem keeps them, without a vnode for each.
+         */
+        int (*readdir_plus)(struct vnode *dir, off_t *offset, struct dirent_plus *d, int count);
 
         /* Operations that can be performed on any type of file: */
         /*
@@ -128,6 +153,57 @@ typedef struct vnode_ops {
          * same file that was passed to acquire.
          */
         int (*release)(struct vnode *vnode, struct file *file);
+        /*
+         * Optional; may be NULL, in which case poll reports the file as
+         * always readable and writable. Returns which of the POLL*
+         * events (see fs/poll.h) are true of vnode now, having first
+         * called poll_wait with pt and the pollhead which will be woken
+         * when that changes.
+         */
+        int (*poll)(struct vnode *vnode, int events, struct polltable *pt);
+        /*
+         * Optional; may be NULL, in which case ioctl fails with ENOTTY.
+         * Carries out the device-specific request on vnode; arg is a
+         * user address, for the operation to copy in and out itself.
+         */
+        int (*ioctl)(struct vnode *vnode, int request, void *arg);
+        /*
+         * Optional; may be NULL, in which case fsync fails with EINVAL.
+         * Writes back the dirty pages of vnode and the metadata needed
+         * to read them back, and waits until all of it is on stable
+         * storage. If datasync is set, metadata which is not needed for
+         * that (such as times) may be left behind.
+         */
+        int (*fsync)(struct vnode *vnode, int datasync);
+        /*
+         * Optional; may be NULL, in which case the file cannot be opened
+         * with O_DIRECT. Reads (or, if write is set, writes) the npages
+         * pages of the file from offset, which is page-aligned, straight
+         * between the disk and the pinned pages pfs, keeping whatever of
+         * the file is in its pframes the same as what is on disk. Returns
+         * the number of bytes moved, which is short at the end of the
+         * file, or -errno if that was none.
+         */
+        int (*direct_io)(struct vnode *file, off_t offset, struct pframe **pfs,
+                         int npages, int write);
+        /*
+         * Optional; may be NULL, in which case clone_file fails with
+         * EOPNOTSUPP. Makes the regular file dst, which is empty and on
+         * the same file system, hold what the regular file src holds,
+         * sharing src's blocks rather than copying them. Returns 0 or
+         * -errno, EINVAL if dst is not empty.
+         */
+        int (*clone)(struct vnode *src, struct vnode *dst);
+        /*
+         * Optional; may be NULL, in which case fallocate fails with
+         * EOPNOTSUPP. For the regular file, gives the len bytes from
+         * offset blocks of their own, which read as zeros where there
+         * was a hole, and grows the file over them unless mode has
+         * FALLOC_FL_KEEP_SIZE; or, with FALLOC_FL_PUNCH_HOLE, makes
+         * them a hole, giving up the blocks and pages wholly inside
+         * and zeroing the rest. Returns 0 or -errno.
+         */
+        int (*fallocate)(struct vnode *file, int mode, off_t offset, off_t len);
 
         /*
          * Used by vnode vm_object entry points (and by no one else):
@@ -138,6 +214,19 @@ typedef struct vnode_ops {
          * 'pagebuf'.
          */
         int (*fillpage)(struct vnode *vnode, off_t offset, void *pagebuf);
+        /*
+         * Optional; may be NULL. Start reading the page of 'vnode'
+         * containing 'offset' into pf->pf_addr and return without
+         * waiting for it, calling pframe_fill_done(pf, status) once the
+         * read is complete (see the fillpage_async mmobj entry point).
+         */
+        int (*fillpage_async)(struct vnode *vnode, off_t offset, struct pframe *pf);
+        /*
+         * Optional; may be NULL. Like fillpage, but reads the npages
+         * pages of 'vnode' starting with the one containing 'offset'
+         * into pagebufs[0..npages).
+         */
+        int (*fillpages)(struct vnode *vnode, off_t offset, void **pagebufs, int npages);
         /*
          * A hook; an attempt is being made to dirty the page
          * belonging to 'vnode' that contains 'offset'. (If the
@@ -159,6 +248,17 @@ typedef struct vnode_ops {
 
 
 #define VN_BUSY        0x1
+#define VN_WRITEMAPPED 0x2      /* has been mapped shared and writable, so
+                                 * its contents change without write() */
+
+/*
+ * Something worked out from a file's contents and kept with its vnode,
+ * by the ELF loader so far; vnode_modified drops the vnode's reference
+ * to it with vx_put.
+ */
+typedef struct vnode_exec {
+        void             (*vx_put)(struct vnode_exec *vx);
+} vnode_exec_t;
 
 typedef struct vnode {
         /*
@@ -228,10 +328,11 @@ typedef struct vnode {
         off_t              vn_len;
 
         /*
-         * A mutex used to synchronize reads and writes. This is only used by
-         * the underlying filesystem implementation.
+         * A lock used to synchronize reads and writes, which readers can
+         * hold together. This is only used by the underlying filesystem
+         * implementation.
          */
-        kmutex_t           vn_mutex;
+        krwlock_t          vn_rwlock;
 
         /*
          * A generic pointer which the file system can use to store any extra
@@ -260,11 +361,27 @@ typedef struct vnode {
          */
         blockdev_t        *vn_bdev;
 
+        /* Sequential readahead state, see vnode_readahead(): */
+        uint32_t           vn_ra_next;     /* page a sequential read starts at */
+        uint32_t           vn_ra_end;      /* one past the last page prefetched */
+        uint32_t           vn_ra_window;   /* pages to stay ahead by, 0 if random */
+        int                vn_ra_advice;   /* POSIX_FADV_* last given by fadvise */
+
+        /* What the ELF loader parsed when the file was last exec'd, see
+         * vnode_modified(). vn_wgen counts modifications, so a parse
+         * which blocked can tell whether it is already out of date. */
+        vnode_exec_t      *vn_exec;
+        uint32_t           vn_wgen;
+
         /* Used (only) by the v{get,ref,put} facilities (vfs/vnode.c): */
         list_link_t        vn_link;        /* link on system vnode list */
-        int                vn_flags;       /* VN_BUSY */
-        ktqueue_t          vn_waitq;       /* queue of threads waiting for vnode
-                                              to become not busy */
+        list_link_t        vn_hlink;       /* link on vget's hash bucket */
+        rcu_head_t         vn_rcu;         /* frees it once vget cannot see it */
+        list_link_t        vn_lru_link;    /* link on the list of cached
+                                              unreferenced vnodes */
+        int                vn_flags;       /* VN_BUSY, VN_WRITEMAPPED (threads waiting
+                                              for it not to be busy sleep on
+                                              sched_waitq(vnode)) */
 } vnode_t;
 
 /* Core vnode management routines: */
@@ -337,6 +454,12 @@ void vref(vnode_t *vn);
  */
 void vput(vnode_t *vn);
 
+/*
+ * Called whenever the contents of vn may have changed: by writes, and
+ * when vn is mapped shared and writable. Drops vn->vn_exec.
+ */
+void vnode_modified(vnode_t *vn);
+
 
 /* Auxilliary: */
 
@@ -357,10 +480,41 @@ int vfs_is_in_use(struct fs *fs);
 
 /*
  *         Clean and uncache all resident pages of all vnodes belonging to
- *         the specified fs.
+ *         the specified fs, and drop its cached unreferenced vnodes (see
+ *         vnode_drop_cached).
  */
 void vnode_flush_all(struct fs *fs);
 
+/*
+ *         vput keeps up to VNODE_CACHE_SIZE vnodes whose last reference
+ *         went away, so that a vget soon after does not have to read the
+ *         inode again. This deletes the ones belonging to the specified
+ *         fs, which must be done before it is unmounted.
+ */
+void vnode_drop_cached(struct fs *fs);
+
+/*
+ *         Called by a filesystem before it reads pages [pagenum, pagenum +
+ *         npages) of vn through vn_mmobj. If vn is being read sequentially,
+ *         asynchronously prefetch those pages and a window of pages beyond
+ *         them; the window doubles with each sequential read up to
+ *         READAHEAD_MAX_PAGES and collapses on a random access. A file
+ *         advised POSIX_FADV_RANDOM is never read ahead; one advised
+ *         POSIX_FADV_SEQUENTIAL always is, by READAHEAD_SEQ_PAGES, and
+ *         the pages as far behind the read are deactivated.
+ */
+void vnode_readahead(vnode_t *vn, uint32_t pagenum, uint32_t npages);
+
+/*
+ *         For POSIX_FADV_WILLNEED and POSIX_FADV_DONTNEED on pages
+ *         [lopage, lopage + npages) of vn: the first starts reading them
+ *         in without waiting, stopping early when memory is short; the
+ *         second frees the ones which are clean, and which nobody has
+ *         pinned or is filling. Dirty pages are left for the flusher.
+ */
+void vnode_willneed(vnode_t *vn, uint32_t lopage, uint32_t npages);
+void vnode_dontneed(vnode_t *vn, uint32_t lopage, uint32_t npages);
+
 /*
  *         Returns the number of vnodes from this filesystem that are in
  *         use.
@@ -19,6 +19,8 @@ extern void *kernel_end_data;
 extern void *kernel_end_bss;
 extern void *kernel_start_init;
 extern void *kernel_end_init;
+extern void *kernel_start_tracepoints;
+extern void *kernel_end_tracepoints;
 
 #define inline __attribute__ ((always_inline,used))
 #define unlikely(x) __builtin_expect((x), 0)
@@ -7,15 +7,39 @@
  * function. */
 void apic_init();
 
+/* Returns the number of enabled processors described by the
+ * ACPI tables. Only the bootstrap processor is ever started. */
+int apic_cpu_count();
+
 /* Maps the given IRQ to the given interrupt number. */
 void apic_setredir(uint32_t irq, uint8_t intr);
 
+/* Composes the address and data a PCI device should write for a
+ * message-signalled interrupt to raise the given interrupt. It is
+ * delivered straight to the bootstrap processor's local APIC, the one
+ * the IO APIC redirections go to as well; the destination in the address
+ * is what would steer it to another processor. */
+void apic_msi_message(uint8_t intr, uint32_t *addr, uint32_t *data);
+
 /* Starts the APIC timer */
 void apic_enable_periodic_timer(uint32_t freq);
 
 /* Stops the APIC timer */
 void apic_disable_periodic_timer();
 
+/* Makes the APIC timer raise interrupt 32 once, after the given number of
+ * milliseconds (clamped to what the counter can hold). 0 stops it. */
+void apic_start_oneshot_timer(uint32_t msecs);
+
+/* Returns the milliseconds (rounded up) left before the one-shot timer
+ * fires, or 0 if it is not running. */
+uint32_t apic_oneshot_remaining();
+
+/* Returns how many times the time stamp counter ticks in a millisecond,
+ * measured against the PIT along with the APIC timer the first time
+ * either is needed. */
+uint32_t apic_tsc_per_ms();
+
 /* Sets the interrupt to raise when a spurious
  * interrupt occurs. */
 void apic_setspur(uint8_t intr);
@@ -100,6 +100,14 @@ static inline void cpuid_set_msr(uint32_t msr, uint32_t lo, uint32_t hi)
 	__asm__ volatile("wrmsr"::"a"(lo),"d"(hi),"c"(msr));
 }
 
+/* Reads the time stamp counter */
+static inline uint64_t cpuid_rdtsc(void)
+{
+        uint32_t lo, hi;
+        __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+        return ((uint64_t)hi << 32) | lo;
+}
+
 static inline void io_wait(void)
 {
 	__asm__ volatile("jmp 1f\n\t"
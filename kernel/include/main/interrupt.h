@@ -7,14 +7,19 @@
 
 #define INTR_DIVIDE_BY_ZERO 0x00
 #define INTR_INVALID_OPCODE 0x06
+#define INTR_DEVICE_NOT_AVAILABLE 0x07
 #define INTR_GPF 0x0d
 #define INTR_PAGE_FAULT 0x0e
 
 #define INTR_PIT 0xf1
 #define INTR_APICTIMER 0xf0
 #define INTR_KEYBOARD 0xe0
+#define INTR_SERIAL 0xe1
 #define INTR_DISK_PRIMARY 0xd0
 #define INTR_DISK_SECONDARY 0xd1
+#define INTR_DISK_VIRTIO 0xd2
+#define INTR_DISK_AHCI 0xd3
+#define INTR_NET_VIRTIO 0xc0
 
 /* NOTE: INTR_SYSCALL is not defined here, but is in syscall.h (it must be
  * in a userland-accessible header) */
@@ -46,6 +51,19 @@ typedef void (*intr_handler_t)(regs_t *regs);
 intr_handler_t intr_register(uint8_t intr, intr_handler_t handler);
 int32_t intr_map(uint16_t irq, uint8_t intr);
 
+/* Notes that the given interrupt is raised by a device's message-signalled
+ * interrupts, which come straight to the local APIC rather than through
+ * the IO APIC, so they need no redirection, but are acknowledged the same
+ * way. Returns the IRQ the interrupt was mapped to before, as intr_map. */
+int32_t intr_map_msi(uint8_t intr);
+
+/* What intr_mappings holds for an interrupt taken by message */
+#define IRQ_MSI 0xffff
+
+/* Whether addr is on the stack device and timer interrupts taken in the
+ * kernel run on (see __intr_stack) */
+int intr_on_stack(uintptr_t addr);
+
 static inline void intr_enable()
 {
         __asm__ volatile("sti");
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Softirqs are the bottom halves of interrupt handlers. A handler which
+ * has more to do than it should with interrupts masked raises one, and
+ * the softirq's function runs on the way out of the interrupt, with
+ * interrupts enabled, once nothing below is running at a raised IPL.
+ * They run to completion in the order of their numbers and must not
+ * sleep; anything which might belongs on a workqueue (proc/workq.h).
+ */
+
+#define SOFTIRQ_TTY     0       /* input for the line disciplines */
+#define NSOFTIRQS       1
+
+typedef void (*softirq_func_t)(void);
+
+/**
+ * Sets the function softirq nr runs, before it is first raised.
+ *
+ * @param nr the softirq
+ * @param func the function to run when it has been raised
+ */
+void softirq_register(int nr, softirq_func_t func);
+
+/**
+ * Arranges for softirq nr to run on the way out of the current, or
+ * otherwise the next, interrupt. Raising it again before it has run
+ * makes no difference. May be called from any context.
+ *
+ * @param nr the softirq
+ */
+void softirq_raise(int nr);
+
+/**
+ * Runs the softirqs which are raised, if the interrupted code was at
+ * IPL_LOW and was not itself a softirq. Called by the interrupt handler
+ * before it returns.
+ */
+void softirq_run(void);
@@ -4,3 +4,17 @@
 
 void *kmalloc(size_t size);
 void  kfree(void *addr);
+
+/* The most that can be asked of kmalloc and be served from the class'th
+ * size class, smallest first, or 0 if there are not that many (for
+ * measuring each class on its own) */
+size_t kmalloc_class_max(unsigned int class);
+
+/* Debugging routine: per size class usage and fragmentation (for dbg_print
+ * or the kmalloc_stats kshell command). arg must be NULL. */
+size_t kmalloc_info(const void *arg, char *buf, size_t osize);
+
+/* Debugging routine: live objects by slab allocator and, with
+ * SLAB_TRACK_CALLERS, the call sites holding the most memory (for the
+ * kmem_census kshell command and system call). arg must be NULL. */
+size_t kmem_census(const void *arg, char *buf, size_t osize);
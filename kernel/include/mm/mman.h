@@ -23,3 +23,20 @@
 */
 #define MAP_FIXED       4
 #define MAP_ANON        8
+#define MAP_POPULATE    16    /* Fault the whole mapping in right away. */
+#define MAP_GROWSDOWN   32    /* A stack: with MAP_ANON and MAP_PRIVATE,
+                               * extended downwards by faults below it. */
+
+/* msync() flags.
+*/
+#define MS_ASYNC        1     /* Harvest dirty pages for the flusher. */
+#define MS_INVALIDATE   2     /* Accepted; mappings are always coherent. */
+#define MS_SYNC         4     /* Write dirty pages back before returning. */
+
+/* madvise() advice.
+*/
+#define MADV_NORMAL     0     /* No advice, fault around resident pages. */
+#define MADV_RANDOM     1     /* Fault in only the page touched. */
+#define MADV_SEQUENTIAL 2     /* Read ahead, and let go of pages behind. */
+#define MADV_WILLNEED   3     /* Start reading the pages in now. */
+#define MADV_DONTNEED   4     /* Throw the pages away now. */
@@ -2,9 +2,20 @@
 
 #include "util/list.h"
 
+#include "mm/radix.h"
+
 struct pframe;
+struct vmarea;
 typedef struct mmobj_ops mmobj_ops_t;
 
+/* Kinds of object, which the pframe statistics are kept by */
+#define MMOBJ_OTHER     0
+#define MMOBJ_ANON      1
+#define MMOBJ_SHADOW    2
+#define MMOBJ_VNODE     3
+#define MMOBJ_BLOCKDEV  4
+#define NMMOBJ_TYPES    5
+
 typedef struct mmobj {
         mmobj_ops_t        *mmo_ops;
         int                 mmo_refcount;   /* mmo_refcount >= mmo_nrespages >= 0 */
@@ -15,14 +26,19 @@ typedef struct mmobj {
          */
         int                 mmo_nrespages;
         list_t              mmo_respages;
+        radix_tree_t        mmo_pages;      /* resident pages by page number */
+        list_t              mmo_dirtypages; /* dirty, unpinned ones, see pframe.c */
+        list_link_t         mmo_dlink;      /* on the list of objects with some */
+        uint32_t            mmo_flushgen;   /* last pframe_clean_objs to visit it */
         /*
          * For shadow objects, the mmo_bottom_obj member of the union should point
          * to the bottommost object in the shadow chain. For non-shadow objects, the
-         * mmo_vmas member of the union, should be a list of all vm_areas that
-         * have this object at the bottom of their tree of mmobjs.
+         * mmo_vmas member of the union is the root of the tree of all vm_areas
+         * that have this object at the bottom of their tree of mmobjs, see
+         * vmarea_obj_walk().
          */
         union {
-                list_t            mmo_vmas;
+                struct vmarea    *mmo_vmas;
                 struct mmobj     *mmo_bottom_obj;
         }                   mmo_un;
 
@@ -37,6 +53,9 @@ typedef struct mmobj {
 
 struct mmobj_ops {
 
+        /* One of the MMOBJ_* kinds above; left out, MMOBJ_OTHER. */
+        int type;
+
         /* Add a reference to 'o'.
          * This may not block. */
         void (*ref)(mmobj_t *o);
@@ -86,6 +105,36 @@ struct mmobj_ops {
          * Return 0 on success and -errno otherwise.
          */
         int (*cleanpage)(mmobj_t *o, struct pframe *pf);
+
+        /*
+         * Optional; may be NULL. Like cleanpage, but writes back npages
+         * pages with consecutive page numbers (pfs[i]->pf_pagenum ==
+         * pfs[0]->pf_pagenum + i) in one operation.
+         * This may block.
+         * Return 0 on success and -errno otherwise (in which case none of
+         * the pages are considered clean).
+         */
+        int (*cleanpages)(mmobj_t *o, struct pframe **pfs, int npages);
+
+        /*
+         * Optional; may be NULL. Like fillpage, but only starts the fill
+         * and returns without waiting for it. The page is busy and pinned
+         * until the object calls pframe_fill_done(), which it must do
+         * exactly once if (and only if) this returns 0.
+         * This may block, but not for the transfer itself.
+         * Return 0 on success and -errno otherwise.
+         */
+        int (*fillpage_async)(mmobj_t *o, struct pframe *pf);
+
+        /*
+         * Optional; may be NULL. Like fillpage, but fills npages pages
+         * with consecutive page numbers (pfs[i]->pf_pagenum ==
+         * pfs[0]->pf_pagenum + i) in one operation.
+         * This may block.
+         * Return 0 on success and -errno otherwise (in which case none of
+         * the pages are considered filled).
+         */
+        int (*fillpages)(mmobj_t *o, struct pframe **pfs, int npages);
 };
 
 
@@ -99,7 +148,11 @@ static inline void mmobj_init(mmobj_t *o, mmobj_ops_t *ops)
         (o)->mmo_refcount = 0;
         (o)->mmo_nrespages = 0;
         list_init(&(o)->mmo_respages);
-        list_init(&(o)->mmo_un.mmo_vmas);
+        radix_tree_init(&(o)->mmo_pages);
+        list_init(&(o)->mmo_dirtypages);
+        list_link_init(&(o)->mmo_dlink);
+        (o)->mmo_flushgen = 0;
+        (o)->mmo_un.mmo_vmas = NULL;
         (o)->mmo_shadowed = NULL;
 }
 
@@ -107,6 +160,3 @@ static inline void mmobj_init(mmobj_t *o, mmobj_ops_t *ops)
         ((mmobj_t*) (NULL == (o)->mmo_shadowed)? \
          (o):((o)->mmo_un.mmo_bottom_obj))
 
-#define mmobj_bottom_vmas(o) \
-        ((list_t *)(&(mmobj_bottom_obj(o))->mmo_un.mmo_vmas))
-
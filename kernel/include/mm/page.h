@@ -22,6 +22,12 @@
 
 #define PAGE_NSIZES  8
 
+/* The kinds of page, which are kept apart so that multi-page blocks can
+ * be made by moving movable pages out of the way, see mm/page.c */
+#define PAGE_UNMOVABLE  0
+#define PAGE_MOVABLE    1
+#define PAGE_NTYPES     2
+
 #define PAGE_SAME(addr1, addr2) (PAGE_ALIGN_DOWN(addr1) == PAGE_ALIGN_DOWN(addr2))
 
 /* Adds the virtual pages [start,end) to those that
@@ -29,6 +35,22 @@
  * only be called once for any given page (no overlaps). */
 void page_add_range(uintptr_t start, uintptr_t end);
 
+/* Sets [*start,*end) to the smallest range of addresses which covers
+ * every page the page allocator hands out. */
+void page_range(uintptr_t *start, uintptr_t *end);
+
+/* High memory is physical memory past the end of what the kernel maps
+ * directly, so its pages have no kernel address and are only reached
+ * through kmap (see mm/pagetable.h). page_add_highmem adds the physical
+ * pages [pstart,pend) once at boot; page_alloc_highmem hands out one of
+ * them by physical address, or returns 0 if there are none left, and
+ * page_free_highmem gives it back. None of these block. Only page
+ * frames of user memory are kept in high memory, see pframe_alloc. */
+void      page_add_highmem(uintptr_t pstart, uintptr_t pend);
+uintptr_t page_alloc_highmem(void);
+void      page_free_highmem(uintptr_t paddr);
+uint32_t  page_highmem_free_count(void);
+
 /* These functions allocate and free one page-aligned,
  * page-sized block of memory. Values passed to
  * page_free MUST have been returned by page_alloc
@@ -39,6 +61,26 @@ void page_add_range(uintptr_t start, uintptr_t end);
 void *page_alloc(void);
 void  page_free(void *addr);
 
+/* Like page_alloc, but for a page frame's page, which the page frame
+ * code may move to another page while it is not in use (see
+ * pframe_relocate). Such pages are kept apart from the rest, which never
+ * move, so that moving them can make room for page_alloc_n. Freed with
+ * page_free. */
+void *page_alloc_movable(void);
+
+/* Like page_alloc and page_alloc_movable, but the page is full of
+ * zeroes. Pages zeroed beforehand by page_zero_idle are used first for
+ * page_alloc_movable_zeroed, so that it usually costs no more than
+ * page_alloc_movable. */
+void *page_alloc_zeroed(void);
+void *page_alloc_movable_zeroed(void);
+
+/* Zeroes one more free page for page_alloc_movable_zeroed, unless enough are
+ * zeroed already or there is no free page to spare. Called while there
+ * is nothing to run, with interrupts masked; returns 1 if it zeroed a
+ * page, 0 otherwise. */
+int   page_zero_idle(void);
+
 /* These functions allocate and free a page-aligned
  * block of memory which are npages pages in length.
  * A call to page_alloc_n will allocate a block, to free
@@ -48,6 +90,13 @@ void  page_free(void *addr);
 void *page_alloc_n(uint32_t npages);
 void  page_free_n(void *start, uint32_t npages);
 
+/* Copy one whole page to another, or zero one; both must be page
+ * aligned. Where the processor has SSE2 these go around the cache with
+ * non-temporal stores, which is picked once the kernel is up; before
+ * that, and otherwise, they copy dwords. */
+void  page_copy(void *dst, const void *src);
+void  page_zero(void *dst);
+
 /* Returns the number of free pages remaining in the
  * system. Note that calls to page_alloc_n(npages) may
  * fail even if page_free_count() >= npages. */
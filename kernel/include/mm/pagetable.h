@@ -16,17 +16,35 @@
 #define PT_DIRTY          0x040
 #define PT_SIZE           0x080
 #define PT_GLOBAL         0x100
+#define PT_PAT            0x080             /* where a PDE has PT_SIZE */
 
 typedef uint32_t pte_t;
 typedef uint32_t pde_t;
 
 typedef struct pagedir pagedir_t;
 
-/* Temporarily maps one page at the given physical address in at a
- * virtual address and returns that virtual address. Note that repeated
- * calls to this function will return the same virtual address, thereby
- * invalidating the previous mapping. */
-uintptr_t pt_phys_tmp_map(uintptr_t paddr);
+/* Maps the physical page at paddr in at a virtual address, which it
+ * returns, until the matching kunmap_atomic. Does not block, and may be
+ * used from interrupt handlers, but the caller must not block either
+ * while it holds the mapping, and mappings must be given back in the
+ * reverse of the order they were taken in. At most KMAP_ATOMIC_SLOTS may
+ * be held at once. */
+uintptr_t kmap_atomic(uintptr_t paddr);
+void kunmap_atomic(uintptr_t vaddr);
+
+/* Maps the physical page at paddr in at a virtual address, which it
+ * returns, until the matching kunmap; the same page mapped twice is
+ * mapped at the same address. The mapping may be held across blocking.
+ * Sleeps if all KMAP_POOL_SIZE addresses are in use, so it must not be
+ * called from interrupt context. */
+uintptr_t kmap(uintptr_t paddr);
+void kunmap(uintptr_t vaddr);
+
+/* As kmap for each of the count pages at paddrs, putting the addresses
+ * in vaddrs, but waits until there is room for all of them before
+ * taking any, so that it is safe for callers which hold several at once
+ * (each is given back with kunmap). count is at most KMAP_POOL_SIZE. */
+void kmap_n(const uintptr_t *paddrs, uint32_t count, uintptr_t *vaddrs);
 
 /* Permenantly maps the given number of physical pages, starting at the
  * given physical address to a virtual address and returns that virtual
@@ -36,6 +54,24 @@ uintptr_t pt_phys_tmp_map(uintptr_t paddr);
  * will cause the kernel to panic. */
 uintptr_t pt_phys_perm_map(uintptr_t paddr, uint32_t count);
 
+/* As pt_phys_perm_map, but the pages are write-combining (see pt_init)
+ * if the processor has a page attribute table, and are otherwise mapped
+ * as pt_phys_perm_map maps them. For device memory, such as a display's,
+ * which is written far more than it is read and which does not mind
+ * writes reaching it late and merged. */
+uintptr_t pt_phys_perm_map_wc(uintptr_t paddr, uint32_t count);
+
+/* Maps the physical page at paddr in at vaddr, a page of the vmalloc
+ * area (see mm/vmalloc.h), whose page tables every page directory
+ * shares, so the mapping is seen in all of them at once. The mapping is
+ * not global, so tlb_flush_range may flush it with a reload of cr3. The
+ * TLB is not flushed. */
+void pt_kernel_map(uintptr_t vaddr, uintptr_t paddr);
+
+/* Unmaps the page at vaddr in the vmalloc area, returning the physical
+ * address it was mapped to. The TLB is not flushed. */
+uintptr_t pt_kernel_unmap(uintptr_t vaddr);
+
 /* Looks up the given virtual address (vaddr) in the current page
  * directory, in order to find the matching physical memory address it
  * points to. vaddr MUST have a mapping in the current page directory,
@@ -54,10 +90,46 @@ int pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, ui
  * be page aligned. Note that the TLB is not flushed by this function. */
 void pt_unmap(pagedir_t *pd, uintptr_t vaddr);
 
+/* Returns 1 if the given virtual page is mapped in the given page
+ * directory, 0 otherwise. vaddr must be page aligned in the user
+ * address space. */
+int pt_is_mapped(pagedir_t *pd, uintptr_t vaddr);
+
+/* Returns 1 if the given virtual page is mapped in the given page
+ * directory and has been accessed since the last call, clearing the
+ * accessed bit (and the TLB entry, if pd is the current page directory)
+ * so that the next access sets it again. Returns 0 otherwise. vaddr must
+ * be page aligned in the user address space. */
+int pt_test_and_clear_accessed(pagedir_t *pd, uintptr_t vaddr);
+
+/* Clears the dirty bit of the given virtual page in the given page
+ * directory (and the TLB entry, if pd is the current page directory and
+ * the bit was set), so that the next write through it sets the bit
+ * again without faulting. Returns the PT_* flags the entry had, or 0 if
+ * the page is not mapped. vaddr must be page aligned in the user
+ * address space. */
+uint32_t pt_clear_dirty(pagedir_t *pd, uintptr_t vaddr);
+
 /* Unmaps the given range of addresses [low, high). As with pt_unmap,
  * the addresses must be page aligned in the user address space */
 void pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh);
 
+/* Returns the number of user pages mapped in the given page directory,
+ * kept up to date by the functions above. */
+uint32_t pt_resident(pagedir_t *pd);
+
+/* Returns the number of page tables the given page directory has for
+ * user memory. */
+uint32_t pt_table_count(pagedir_t *pd);
+
+/* Copies the mappings present in [vlow, vhigh) of src into dst, without
+ * write permission. If cow is true write permission is also removed in
+ * src, so the next write through either directory faults. The TLB is
+ * not flushed. Returns 0, or -ENOMEM if a page table for dst could not
+ * be allocated, in which case only some mappings were copied (src is
+ * still fully write-protected if cow); both directories stay valid. */
+int pt_copy_range(pagedir_t *dst, pagedir_t *src, uintptr_t vlow, uintptr_t vhigh, int cow);
+
 /* Creates a new page directory which is initialized to contain
  * mappings for all kernel memory. If there is not enough memory
  * to allocate the directory NULL is returned. Note that destroying
@@ -11,6 +11,9 @@ struct mmobj;
 
 #define PF_BUSY                 0x01
 #define PF_DIRTY                0x02
+#define PF_INVALID              0x04    /* fill failed, contents are garbage */
+#define PF_REFERENCED           0x08    /* requested since pageoutd last looked */
+#define PF_ZEROED               0x10    /* allocated full of zeroes, not filled yet */
 
 #define pframe_is_busy(pf)          ((pf)->pf_flags & PF_BUSY)
 #define pframe_set_busy(pf)         do { (pf)->pf_flags |= PF_BUSY; } while (0)
@@ -20,9 +23,20 @@ struct mmobj;
 #define pframe_set_dirty(pf)        do { (pf)->pf_flags |= PF_DIRTY; } while (0)
 #define pframe_clear_dirty(pf)      do { (pf)->pf_flags &= ~PF_DIRTY; } while (0)
 
+#define pframe_is_invalid(pf)       ((pf)->pf_flags & PF_INVALID)
+
+#define pframe_is_zeroed(pf)        ((pf)->pf_flags & PF_ZEROED)
+
+#define pframe_is_referenced(pf)    ((pf)->pf_flags & PF_REFERENCED)
+#define pframe_set_referenced(pf)   do { (pf)->pf_flags |= PF_REFERENCED; } while (0)
+#define pframe_clear_referenced(pf) do { (pf)->pf_flags &= ~PF_REFERENCED; } while (0)
+
 #define pframe_is_pinned(pf)        ((pf)->pf_pincount)
 #define pframe_is_free(pf)          (!(pf)->pf_obj)
 
+/* A page in high memory (see page_alloc_highmem) has no kernel address */
+#define pframe_is_highmem(pf)       (NULL == (pf)->pf_addr)
+
 /* A pframe structure represents a page frame in physical memory available to the
  * kernel. pframes are managed by mmobjs */
 typedef struct pframe {
@@ -34,37 +48,110 @@ typedef struct pframe {
 
         /*   The address of the page frame. Note that this is NOT a
          *   physical address, but is a virtual address in the kernel's memory
-         *   map (i.e., it will be higher than 0xc0000000) */
+         *   map (i.e., it will be higher than 0xc0000000). It is NULL for a
+         *   page of user memory in high memory, whose contents are only
+         *   reached through pframe_kmap and the like. */
         void               *pf_addr;
+        uintptr_t           pf_paddr;    /* the physical address */
 
         /* Private: */
-        uint8_t             pf_flags;    /* PF_DIRTY, PF_BUSY */
-        ktqueue_t           pf_waitq;    /* wait on this if page is busy */
+        uint8_t             pf_flags;    /* PF_DIRTY, PF_BUSY, PF_INVALID, PF_REFERENCED, PF_ZEROED */
         int                 pf_pincount;
         list_link_t         pf_link;     /* link on {free,allocated,pinned}_list */
-        list_link_t         pf_hlink;    /* link on hash chain of resident page hash */
         list_link_t         pf_olink;    /* link on object's list of resident pages */
+        list_link_t         pf_dlink;    /* link on dirty_list, see pframe.c */
+        list_link_t         pf_odlink;   /* link on object's list of dirty pages */
+        list_link_t         pf_mlink;    /* link on mapped_list, see pframe.c */
+        uint32_t            pf_dirtied;  /* flushd's count of looks when it got dirty */
+        uint32_t            pf_ksmhash;  /* ksmd's hash of it when it last looked, see vm/ksm.c */
 } pframe_t;
 
+/* wait on this if page is busy, see sched_waitq() */
+#define pframe_waitq(pf)        (sched_waitq(pf))
+
 void pframe_init(void);
 void pframe_add_range(uint32_t startpfn, uint32_t endpfn);
 void pframe_pageoutd_init(void);
 
 void pframe_shutdown(void);
 
+/*
+ * Return the page frame of the page at the given kernel (or physical, such
+ * as one in a page table entry) address, or NULL if that page is not a
+ * page frame's. O(1).
+ */
+pframe_t *pframe_from_addr(const void *addr);
+pframe_t *pframe_from_paddr(uintptr_t paddr);
+
+/*
+ * Page compaction, see mm/page.c. pframe_movable returns whether the page
+ * at addr is a page frame's which pframe_relocate can move elsewhere: one
+ * that is neither pinned nor busy, so that nothing expects it to stay put
+ * any more than it expects pageoutd to leave it alone. pframe_relocate
+ * unmaps the frame, copies it to a new page and moves its descriptor
+ * along, leaving the old page allocated for the caller to free. It
+ * returns 0, or -ENOMEM if there was no page to move to. Neither blocks.
+ */
+int pframe_movable(const void *addr);
+int pframe_relocate(void *addr);
+
+/*
+ * Kernel addresses for the contents of a page frame, which for a page in
+ * high memory is mapped in until the matching unmap, with kmap, kmap_n or
+ * kmap_atomic (see mm/pagetable.h for what each allows); for the rest
+ * they return pf_addr and cost nothing. pframe_kmap_n maps n of them, at
+ * most PFRAME_RANGE_MAX, into addrs.
+ */
+void *pframe_kmap(pframe_t *pf);
+void  pframe_kunmap(pframe_t *pf, void *addr);
+void  pframe_kmap_n(pframe_t **pfs, int n, void **addrs);
+void  pframe_kunmap_n(pframe_t **pfs, int n, void **addrs);
+void *pframe_kmap_atomic(pframe_t *pf);
+void  pframe_kunmap_atomic(pframe_t *pf, void *addr);
+
 pframe_t *pframe_get_resident(struct mmobj *o, uint32_t pagenum);
+pframe_t *pframe_next_resident(struct mmobj *o, uint32_t *pagenum);
 
 int pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result);
+int pframe_get_range(struct mmobj *o, uint32_t first, uint32_t npages, pframe_t **result);
+void pframe_unpin_range(pframe_t **pfs, uint32_t npages);
 int pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result);
-void pframe_migrate(pframe_t *pf, mmobj_t *dest);
+int pframe_prefetch(struct mmobj *o, uint32_t pagenum);
+void pframe_fill_done(pframe_t *pf, int status);
+int pframe_migrate(pframe_t *pf, mmobj_t *dest);
 
 void pframe_pin(pframe_t *pf);
 void pframe_unpin(pframe_t *pf);
 
 int  pframe_dirty(pframe_t *pf);
 int  pframe_clean(pframe_t *pf);
+int  pframe_clean_n(pframe_t **pfs, int npages);
 void pframe_free(pframe_t *pf);
 
+int  pframe_clean_obj(struct mmobj *o);
+int  pframe_clean_objs(int (*match)(struct mmobj *o, void *arg), void *arg);
 void pframe_clean_all(void);
+void pframe_balance_dirty(void);
+
+/*
+ * Formats the page cache statistics: hits and misses in pframe_get,
+ * pages filled and cleaned by kind of object, what pageoutd has done, and
+ * how long threads have waited for it.
+ *
+ * @param arg unused
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the number of bytes written
+ */
+size_t pframe_info(const void *arg, char *buf, size_t osize);
+
+/*
+ * Gets the free page counts below which pageoutd is woken up, and up to
+ * which it then frees pages.
+ */
+void pframe_freepages_limits(uint32_t *min, uint32_t *target);
 
 void pframe_remove_from_pts(pframe_t *pf);
+void pframe_harvest_dirty(pframe_t *pf);
+void pframe_deactivate(pframe_t *pf);
+void pframe_discard(pframe_t *pf);
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * A radix tree mapping 32 bit keys to (non-NULL) pointers. Each level of the
+ * tree consumes RADIX_SHIFT bits of the key, and the tree is only as tall as
+ * its largest key requires, so small, dense key spaces (like the page numbers
+ * of most objects) take one or two levels. Interior nodes are allocated as
+ * needed and freed as soon as they become empty.
+ *
+ * None of these functions block.
+ */
+
+#define RADIX_SHIFT             6
+#define RADIX_SLOTS             (1 << RADIX_SHIFT)
+#define RADIX_MAX_HEIGHT        ((32 + RADIX_SHIFT - 1) / RADIX_SHIFT)
+
+typedef struct radix_node {
+        void               *rn_slots[RADIX_SLOTS];
+        int                 rn_count;    /* number of non-NULL slots */
+} radix_node_t;
+
+typedef struct radix_tree {
+        radix_node_t       *rt_root;     /* NULL if and only if tree is empty */
+        int                 rt_height;   /* 0 if tree is empty */
+} radix_tree_t;
+
+#define radix_tree_init(t) \
+        do { (t)->rt_root = NULL; (t)->rt_height = 0; } while (0)
+#define radix_tree_empty(t)     (NULL == (t)->rt_root)
+
+/* Called by slab_init */
+void radix_init(void);
+
+/* Returns the item stored under key, or NULL */
+void *radix_lookup(radix_tree_t *t, uint32_t key);
+
+/* Stores item under key, which must not already be in use. Returns 0 on
+ * success or -ENOMEM if a node could not be allocated, in which case the
+ * tree is unchanged. */
+int radix_insert(radix_tree_t *t, uint32_t key, void *item);
+
+/* Stores item under key in place of what is there, returning that, or
+ * does nothing and returns NULL if there is nothing stored under key */
+void *radix_replace(radix_tree_t *t, uint32_t key, void *item);
+
+/* Removes and returns the item stored under key, or NULL if there is none */
+void *radix_remove(radix_tree_t *t, uint32_t key);
+
+/* Returns the item with the smallest key >= *key and stores that key in
+ * *key, or returns NULL if there is no such item. */
+void *radix_next(radix_tree_t *t, uint32_t *key);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Shrinkers let caches of kernel objects give memory back when pageoutd
+ * runs, alongside the page frames it reclaims. Each cache registers a
+ * shrinker_t once; pageoutd then asks every shrinker, after each
+ * revolution of its hand, to free the same share of its objects as the
+ * share of page frames the hand went past, so that caches are trimmed in
+ * step with the page cache rather than left alone while useful pages go.
+ */
+typedef struct shrinker {
+        const char         *sh_name;
+
+        /* Returns how many objects could be freed right now */
+        uint32_t          (*sh_count)(void);
+
+        /* Frees up to n objects, oldest first, returning how many it
+         * freed. Called from pageoutd, and may block. */
+        uint32_t          (*sh_scan)(uint32_t n);
+
+        struct shrinker    *sh_next;
+} shrinker_t;
+
+/* Adds a shrinker, which must stay around for good. Shrinkers run in the
+ * reverse of the order they were registered in, so the slab allocator's,
+ * which is registered first, gets the slabs emptied by the others. */
+void shrinker_register(shrinker_t *sh);
+
+/*
+ * Runs every shrinker, asking each to free the fraction scanned / total
+ * of its objects, rounded up. Returns how many objects were freed in all.
+ */
+uint32_t shrinkers_run(uint32_t scanned, uint32_t total);
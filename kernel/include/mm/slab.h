@@ -9,6 +9,15 @@
  * are no double frees. */
 #define SLAB_CHECK_FREE
 
+/* Define SLAB_TRACK_CALLERS to record in every object where it was
+ * allocated from, so that kmem_census() can say what is using the heap. */
+#define SLAB_TRACK_CALLERS
+
+/* Define SLAB_TRACK_CHAINS, as well, to record the whole call chain (see
+ * util/callchain.h) which allocated each object, and not only its caller,
+ * so that kmem_census() can tell apart the paths into a shared helper. */
+#define SLAB_TRACK_CHAINS
+
 /*
  * The slab allocator. A "cache" is a store of objects; you create one by
  * specifying a constructor, destructor, and the size of an object. The
@@ -19,7 +28,16 @@
  */
 typedef struct slab_allocator slab_allocator_t;
 
+/* Assumed size of a cache line, which slabs are coloured in steps of */
+#define SLAB_CACHE_LINE         64
+
+/* Flags for slab_allocator_create_flags() */
+#define SLAB_ALIGN_CACHE        0x1     /* start every object on a cache
+                                         * line, so that none straddles two */
+
 slab_allocator_t *slab_allocator_create(const char *name, size_t size);
+slab_allocator_t *slab_allocator_create_flags(const char *name, size_t size,
+                                              int flags);
 int slab_allocators_reclaim(int target);
 
 void *slab_obj_alloc(slab_allocator_t *allocator);
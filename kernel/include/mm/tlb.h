@@ -2,6 +2,8 @@
 
 #include "kernel.h"
 #include "types.h"
+#include "config.h"
+#include "limits.h"
 
 #include "mm/page.h"
 
@@ -12,22 +14,61 @@ static inline void tlb_flush(uintptr_t vaddr)
         __asm__ volatile("invlpg (%0)" :: "r"(vaddr));
 }
 
+/* Invalidates the entire TLB. Global (kernel) entries survive. */
+static inline void tlb_flush_all()
+{
+        uintptr_t pdir;
+        __asm__ volatile("movl %%cr3, %0" : "=r"(pdir));
+        __asm__ volatile("movl %0, %%cr3" :: "r"(pdir) : "memory");
+}
+
 /* Invalidates any entries for the count virtual addresses
- * starting at vaddr from the TLB. If this range is very
- * large it may be more efficient to call tlb_flush_all
- * to invalidate the entire TLB. */
+ * starting at vaddr from the TLB. Above TLB_FLUSH_ALL_THRESHOLD
+ * pages one cr3 reload is cheaper than the invlpgs, so this
+ * flushes everything instead; the range must therefore not hold
+ * global mappings that need flushing. */
 static inline void tlb_flush_range(uintptr_t vaddr, uint32_t count)
 {
         uint32_t i;
+        if (count > TLB_FLUSH_ALL_THRESHOLD) {
+                tlb_flush_all();
+                return;
+        }
         for (i = 0; i < count; ++i, vaddr += PAGE_SIZE) {
                 tlb_flush(vaddr);
         }
 }
 
-/* Invalidates the entire TLB. */
-static inline void tlb_flush_all()
+/* Collects the user pages unmapped over one operation that unmaps
+ * them piecemeal (such as evicting a page from every area mapping
+ * it) so that the TLB is
+ * flushed once at the end, with whichever of tlb_flush_range and
+ * tlb_flush_all covers them more cheaply. This is also where a
+ * shootdown would be sent to other processors, once per gather. */
+typedef struct tlb_gather {
+        uintptr_t tg_start;   /* lowest and just past the highest */
+        uintptr_t tg_end;     /* address added */
+} tlb_gather_t;
+
+static inline void tlb_gather_init(tlb_gather_t *tg)
 {
-        uintptr_t pdir;
-        __asm__ volatile("movl %%cr3, %0" : "=r"(pdir));
-        __asm__ volatile("movl %0, %%cr3" :: "r"(pdir) : "memory");
+        tg->tg_start = UPTR_MAX;
+        tg->tg_end = 0;
+}
+
+/* Adds the count pages starting at the page aligned vaddr */
+static inline void tlb_gather_add(tlb_gather_t *tg, uintptr_t vaddr, uint32_t count)
+{
+        if (vaddr < tg->tg_start)
+                tg->tg_start = vaddr;
+        if (vaddr + count * PAGE_SIZE > tg->tg_end)
+                tg->tg_end = vaddr + count * PAGE_SIZE;
+}
+
+static inline void tlb_gather_flush(tlb_gather_t *tg)
+{
+        if (tg->tg_start < tg->tg_end) {
+                tlb_flush_range(tg->tg_start, (tg->tg_end - tg->tg_start) >> PAGE_SHIFT);
+        }
+        tlb_gather_init(tg);
 }
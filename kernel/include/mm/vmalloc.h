@@ -0,0 +1,25 @@
+#pragma once
+
+#include "types.h"
+#include "config.h"
+
+/* The kernel addresses vmalloc hands out, just below the last page
+ * table's (see mm/pagetable.c) and above the direct map */
+#define VMALLOC_END             0xffc00000
+#define VMALLOC_START           (VMALLOC_END - VMALLOC_SIZE)
+
+/* Allocates size bytes, rounded up to whole pages, which are contiguous
+ * in kernel virtual memory but made of single pages from anywhere in
+ * the direct map, so that they can be had however fragmented free
+ * memory is. An unmapped page follows each allocation, which an overrun
+ * faults on. Returns NULL if there is not the memory or the address
+ * space. May block. Nothing which needs the bytes physically contiguous
+ * (a device) may be given them. */
+void *vmalloc(size_t size);
+
+/* Frees what vmalloc returned; addr may be NULL */
+void vfree(void *addr);
+
+/* Whether addr is in the vmalloc area */
+#define vmalloc_addr(addr) \
+        (VMALLOC_START <= (uintptr_t)(addr) && VMALLOC_END > (uintptr_t)(addr))
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "types.h"
+
+#include "mm/page.h"
+
+#include "proc/sched.h"
+
+#include "util/list.h"
+
+/*
+ * A small IPv4 stack: ethernet and ARP, IP without fragments, ICMP echo
+ * and UDP, behind the datagram sockets of net/socket.h.
+ *
+ * A packet lives in a page of its own, a netbuf, from the network device
+ * to the socket and back. What comes in is written there by the device,
+ * taken apart where it lies, queued on its socket as it is, and copied
+ * once, straight to the buffer recvfrom was given; what goes out is
+ * copied once from the buffer sendto was given into a netbuf, with the
+ * headers put in front of it there.
+ */
+
+/* An IPv4 address in host byte order, as one is kept in the kernel */
+#define NET_IPADDR(a, b, c, d) \
+        (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+/*
+ * The page of a packet: this header, then the packet, nb_len bytes of
+ * it from nb_data, which moves forward as each layer takes its header
+ * off on the way in, and back as each puts its header on on the way out.
+ */
+typedef struct netbuf {
+        list_link_t      nb_link;       /* on a socket's receive queue */
+        char            *nb_data;
+        size_t           nb_len;
+        uint32_t         nb_faddr;      /* who sent it, for recvfrom */
+        uint16_t         nb_fport;
+} netbuf_t;
+
+#define NETBUF_START(nb)        ((char *)((nb) + 1))
+#define NETBUF_END(nb)          ((char *)(nb) + PAGE_SIZE)
+/* Left in front of what is sent, for the headers of every layer */
+#define NETBUF_HEADROOM         64
+
+/* Returns an empty netbuf, with NETBUF_HEADROOM in front of nb_data, or
+ * NULL if there is no memory. Called only from thread context. */
+netbuf_t *netbuf_alloc(void);
+void netbuf_free(netbuf_t *nb);
+
+/* Puts len bytes in front of the packet and returns where they start */
+void *netbuf_push(netbuf_t *nb, size_t len);
+/* Takes len bytes off the front of the packet and returns where they
+ * started, or NULL if the packet is not that long */
+void *netbuf_pull(netbuf_t *nb, size_t len);
+
+#define ETH_ALEN                6
+#define ETH_HLEN                14
+#define ETH_MTU                 1500
+#define ETH_P_IP                0x0800
+#define ETH_P_ARP               0x0806
+
+struct netdev;
+
+typedef struct netdev_ops {
+        /*
+         * Sends nb, a whole ethernet frame, which the driver frees once it
+         * is done with it, whether or not it could be sent. May sleep
+         * for room on the device. Returns 0 or -errno.
+         */
+        int  (*xmit)(struct netdev *nd, netbuf_t *nb);
+        /*
+         * Moves the frames which have come in onto frames, with nb_data
+         * at their ethernet headers, and gives the device new buffers in
+         * their place. Called only by the device's netd.
+         */
+        void (*receive)(struct netdev *nd, list_t *frames);
+} netdev_ops_t;
+
+typedef struct netdev {
+        const char      *nd_name;
+        uint8_t          nd_mac[ETH_ALEN];
+        netdev_ops_t    *nd_ops;
+
+        /* Its configuration, from config.h */
+        uint32_t         nd_addr;
+        uint32_t         nd_netmask;
+        uint32_t         nd_gateway;
+
+        /* netd, which takes in what the device receives, sleeps on
+         * nd_waitq until netdev_wakeup sets nd_rxready */
+        struct kthread  *nd_thr;
+        ktqueue_t        nd_waitq;
+        volatile int     nd_rxready;
+
+        list_link_t      nd_link;       /* on netdevs */
+} netdev_t;
+
+/* Called by a driver for each device it finds, before init_func time */
+void netdev_register(netdev_t *nd);
+
+/* Stops the netd threads, from the idle process at shutdown */
+void netdev_shutdown(void);
+
+/* Tells nd's netd there are frames to take in. May be called from the
+ * device's interrupt. */
+void netdev_wakeup(netdev_t *nd);
+
+/* Returns the device through which to send to addr, and the address of
+ * the next hop there, or NULL if there is none. */
+netdev_t *netdev_route(uint32_t addr, uint32_t *nexthop);
+
+/* Puts an ethernet header on nb and sends it to dst through nd. Frees nb
+ * if it cannot be sent. Returns 0 or -errno. */
+int eth_output(netdev_t *nd, netbuf_t *nb, const uint8_t *dst, uint16_t type);
+
+/* The layers above, each handed a packet with nb_data at its header,
+ * which they queue or free */
+void arp_input(netdev_t *nd, netbuf_t *nb);
+void ip_input(netdev_t *nd, netbuf_t *nb);
+void udp_input(netbuf_t *nb, uint32_t src, uint32_t dst);
+
+/* Finds addr's ethernet address, asking for it if it is not known.
+ * Returns 0 or -EHOSTUNREACH. */
+int arp_resolve(netdev_t *nd, uint32_t addr, uint8_t *mac);
+
+/*
+ * Puts an IP header on nb, of protocol proto from src to dst, and sends
+ * it through the device netdev_route gives for dst. Frees nb if it
+ * cannot be sent. Returns 0 or -errno.
+ */
+int ip_output(netbuf_t *nb, uint8_t proto, uint32_t src, uint32_t dst);
+
+/* Adds the 16-bit words of len bytes at data to the one's complement
+ * sum, which ip_checksum folds into the internet checksum */
+uint32_t ip_sum(const void *data, size_t len, uint32_t sum);
+uint16_t ip_checksum(uint32_t sum);
+
+#define IPPROTO_ICMP            1
+#define IP_HLEN                 20
+#define UDP_HLEN                8
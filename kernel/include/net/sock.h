@@ -0,0 +1,50 @@
+#pragma once
+
+#include "types.h"
+
+#include "net/socket.h"
+
+struct fs;
+struct vnode;
+
+/*
+ * A family of sockets, behind the system calls of net/socket.c. Each
+ * socket is a vnode of the family's so_fs, which is never mounted, read,
+ * written, polled and closed through its vnode operations like any other
+ * file; these are the calls which have nothing to do with files.
+ *
+ * Each returns 0 or -errno, and any of them but create may be NULL, for
+ * -EOPNOTSUPP. vn is a socket of the family; addresses are as the do_
+ * calls of net/socket.h get them.
+ */
+typedef struct sockops {
+        int               so_domain;
+        struct fs        *so_fs;
+
+        /* Makes a new socket, a vnode with a reference for the caller */
+        int (*create)(int type, int protocol, struct vnode **vnp);
+        /* Makes two sockets connected to each other */
+        int (*pair)(int type, int protocol, struct vnode *vns[2]);
+
+        int (*bind)(struct vnode *vn, const struct sockaddr *addr, socklen_t len);
+        int (*listen)(struct vnode *vn, int backlog);
+        /* Waits for a connection to vn, then makes it a socket, as create
+         * does, with the peer's address in addr */
+        int (*accept)(struct vnode *vn, struct vnode **vnp,
+                      struct sockaddr *addr, socklen_t *len);
+        int (*connect)(struct vnode *vn, const struct sockaddr *addr, socklen_t len);
+
+        /* These return the number of bytes moved */
+        int (*sendto)(struct vnode *vn, const void *ubuf, size_t len,
+                      const struct sockaddr *to, socklen_t tolen);
+        int (*recvfrom)(struct vnode *vn, void *ubuf, size_t len,
+                        struct sockaddr *from, socklen_t *fromlen);
+} sockops_t;
+
+extern sockops_t unix_sockops;
+extern sockops_t udp_sockops;
+
+/* Copies what fits of addr, len bytes, to dst, which has room for *dstlen,
+ * and sets *dstlen to len, for the calls which return addresses */
+void sockaddr_out(struct sockaddr *dst, socklen_t *dstlen,
+                  const void *addr, socklen_t len);
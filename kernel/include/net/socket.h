@@ -0,0 +1,91 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "types.h"
+#else
+#include "sys/types.h"
+#endif
+
+/* Local stream sockets, named in the filesystem, and UDP over IPv4 */
+#define AF_UNIX         1
+#define AF_LOCAL        AF_UNIX
+#define AF_INET         2
+#define SOCK_STREAM     1
+#define SOCK_DGRAM      2
+#define IPPROTO_UDP     17
+
+#define UNIX_PATH_MAX   108
+
+#define INADDR_ANY          ((in_addr_t)0x00000000)
+#define INADDR_BROADCAST    ((in_addr_t)0xffffffff)
+
+typedef uint32_t        socklen_t;
+typedef uint32_t        in_addr_t;
+typedef uint16_t        in_port_t;
+
+struct in_addr {
+        in_addr_t       s_addr;         /* in network byte order */
+};
+
+struct sockaddr {
+        uint16_t        sa_family;
+        char            sa_data[14];
+};
+
+struct sockaddr_in {
+        uint16_t        sin_family;     /* AF_INET */
+        in_port_t       sin_port;       /* in network byte order */
+        struct in_addr  sin_addr;
+        char            sin_zero[8];
+};
+
+struct sockaddr_un {
+        uint16_t        sun_family;     /* AF_UNIX */
+        char            sun_path[UNIX_PATH_MAX];
+};
+
+/* Room for the address of any family */
+struct sockaddr_storage {
+        uint16_t        ss_family;
+        char            ss_data[126];
+};
+
+/* Between the byte order of the network (big-endian) and ours */
+#define htons(x)        ((uint16_t)((((uint16_t)(x) & 0xff) << 8) | ((uint16_t)(x) >> 8)))
+#define ntohs(x)        htons(x)
+#define htonl(x)        ((((uint32_t)(x) & 0xff) << 24) | (((uint32_t)(x) & 0xff00) << 8) \
+                         | (((uint32_t)(x) >> 8) & 0xff00) | ((uint32_t)(x) >> 24))
+#define ntohl(x)        htonl(x)
+
+#ifdef __KERNEL__
+/*
+ * Each returns -errno on failure. Addresses are kernel copies, of the
+ * length given; one that is returned is truncated to the length given,
+ * which is then set to its full length, and may be NULL. The buffers of
+ * do_sendto and do_recvfrom are in user space, and are copied straight
+ * to and from where the data is sent or received.
+ */
+int do_socket(int domain, int type, int protocol);
+int do_socketpair(int domain, int type, int protocol, int sv[2]);
+int do_bind(int fd, const struct sockaddr *addr, socklen_t addrlen);
+int do_listen(int fd, int backlog);
+int do_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+int do_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+int do_sendto(int fd, const void *ubuf, size_t len,
+              const struct sockaddr *to, socklen_t tolen);
+int do_recvfrom(int fd, void *ubuf, size_t len,
+                struct sockaddr *from, socklen_t *fromlen);
+#else
+int socket(int domain, int type, int protocol);
+int socketpair(int domain, int type, int protocol, int sv[2]);
+int bind(int fd, const struct sockaddr *addr, socklen_t addrlen);
+int listen(int fd, int backlog);
+int accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+int connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+ssize_t sendto(int fd, const void *buf, size_t len, int flags,
+               const struct sockaddr *to, socklen_t tolen);
+ssize_t recvfrom(int fd, void *buf, size_t len, int flags,
+                 struct sockaddr *from, socklen_t *fromlen);
+#endif
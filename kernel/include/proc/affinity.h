@@ -0,0 +1,20 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+/*
+ * CPU affinity: the CPUs a thread may run on, as a mask with bit n set
+ * for CPU n. Every thread has one, which threads made by fork(2) and
+ * thr_create(2) inherit; sched_setaffinity(2) sets it for each thread of
+ * a process at once, and sched_getaffinity(2) reads it. A mask is cut
+ * down to the CPUs there are, and may not be left with none.
+ */
+#define CPU_SETSIZE             32      /* CPUs a mask can name */
+#define CPU_MASK(cpu)           (1U << (cpu))
+#define CPU_MASK_ALL            (~0U)
+
+#ifndef __KERNEL__
+/* pid 0 is the calling process */
+int sched_setaffinity(int pid, unsigned int mask);
+int sched_getaffinity(int pid, unsigned int *mask);
+#endif
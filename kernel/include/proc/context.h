@@ -19,8 +19,21 @@ typedef struct context {
 
         uintptr_t  c_kstack;
         size_t     c_kstacksz;
+
+        int        c_kernel; /* never runs in userland, and so runs on
+                              * whichever page directory is loaded */
+
+        void      *c_fpu;   /* where the FPU and SSE registers are kept
+                             * while another context has them, allocated
+                             * when this context first uses them */
 } context_t;
 
+#define CR0_MP          0x00000002
+#define CR0_EM          0x00000004
+#define CR0_TS          0x00000008
+#define CR4_OSFXSR      0x00000200
+#define CR4_OSXMMEXCPT  0x00000400
+
 /**
  * Initialize the given context such that when it begins execution it
  * will execute func(arg1,arg2). When the thread returns from func it
@@ -55,3 +68,52 @@ void context_make_active(context_t *c);
  * @param newc the context to switch to
  */
 void context_switch(context_t *oldc, context_t *newc);
+
+/**
+ * Gives dst a copy of the FPU state of src, which must be the current
+ * context, as fork does.
+ *
+ * @param dst a context which has no FPU state yet
+ * @param src the current context
+ * @return 0 on success, -ENOMEM if there was no memory for it
+ */
+int context_fpu_copy(context_t *dst, context_t *src);
+
+/**
+ * Frees the FPU state of a context, so that it starts afresh should it
+ * use the FPU again (as after exec), or before the context goes away.
+ *
+ * @param c the context
+ */
+void context_fpu_release(context_t *c);
+
+/*
+ * The FPU registers are switched lazily: CR0.TS is set whenever the
+ * running context is not the one whose state is in them, and the first
+ * FPU instruction then traps to switch them over. Kernel code which
+ * uses xmm registers saves and restores the ones it touches itself, so
+ * rather than take that trap it clears CR0.TS around them with these:
+ *
+ *      uint32_t ts = context_fpu_kernel_begin();
+ *      ...
+ *      context_fpu_kernel_end(ts);
+ */
+static inline uint32_t
+context_fpu_kernel_begin(void)
+{
+        uint32_t cr0;
+        __asm__ volatile("movl %%cr0, %0" : "=r"(cr0));
+        if (cr0 & CR0_TS)
+                __asm__ volatile("clts" ::: "memory");
+        return cr0 & CR0_TS;
+}
+
+static inline void
+context_fpu_kernel_end(uint32_t ts)
+{
+        uint32_t cr0;
+        if (ts) {
+                __asm__ volatile("movl %%cr0, %0" : "=r"(cr0));
+                __asm__ volatile("movl %0, %%cr0" :: "r"(cr0 | CR0_TS) : "memory");
+        }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "types.h"
+
+/**
+ * Sleeps the current thread on the userland word at uaddr, as long as
+ * it still holds val. Used by userland locks to wait without spinning.
+ * Threads sharing an address space, or processes sharing a MAP_SHARED
+ * mapping, wait on the same word.
+ *
+ * @param uaddr a 4 byte aligned userland address
+ * @param val the value the caller last saw at uaddr
+ * @return 0 once woken by do_futex_wake, -EAGAIN if uaddr no longer
+ * holds val, -EINTR if the thread was cancelled, or another -errno if
+ * uaddr cannot be read
+ */
+int do_futex_wait(uint32_t *uaddr, uint32_t val);
+
+/**
+ * Wakes up to nwake threads sleeping on the word at uaddr.
+ *
+ * @param uaddr the userland address of the word
+ * @param nwake the most threads to wake
+ * @return the number of threads woken, or -errno if uaddr is not mapped
+ * or not aligned
+ */
+int do_futex_wake(uint32_t *uaddr, int nwake);
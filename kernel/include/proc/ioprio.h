@@ -0,0 +1,24 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+/*
+ * I/O priority classes, which the block request queue serves in order:
+ * realtime requests go before best-effort ones, and idle requests only
+ * once the disk has nothing else to do. A lower class which has waited
+ * long enough still gets a turn (see BLOCKDEV_BE_STARVE), so it is
+ * slowed down, never stopped. A process's class is inherited across
+ * fork(2).
+ */
+#define IOPRIO_CLASS_NONE       0       /* not set, served as best-effort */
+#define IOPRIO_CLASS_RT         1
+#define IOPRIO_CLASS_BE         2
+#define IOPRIO_CLASS_IDLE       3
+
+#define IOPRIO_NCLASS           3       /* not counting NONE */
+
+#ifndef __KERNEL__
+/* pid 0 is the calling process */
+int ioprio_set(int pid, int ioclass);
+int ioprio_get(int pid);
+#endif
@@ -1,10 +1,17 @@
 #pragma once
 
+#include "config.h"
+
 #include "proc/sched.h"
 
 typedef struct kmutex {
         ktqueue_t       km_waitq;       /* wait queue */
         struct kthread *km_holder;      /* current holder */
+        uint32_t        km_contended;   /* times a thread had to wait */
+#if KMUTEX_STATS
+        void           *km_site;        /* where the holder locked it */
+        uint64_t        km_locked_ns;   /* and when */
+#endif
 } kmutex_t;
 
 /**
@@ -45,3 +52,17 @@ int  kmutex_lock_cancellable(kmutex_t *mtx);
  * @mtx the mutex to unlock
  */
 void kmutex_unlock(kmutex_t *mtx);
+
+/**
+ * Formats the kmutex statistics kept with KMUTEX_STATS: for the call
+ * sites of kmutex_lock and kmutex_lock_cancellable which have waited
+ * longest in all, how often they took the lock, how often they had to
+ * wait for it, for how long in all, and the longest they held it. Sites
+ * are return addresses, to be looked up in weenix.dbg.
+ *
+ * @param data unused
+ * @param buf where to put the table
+ * @param size the size of buf
+ * @return the number of bytes written
+ */
+size_t kmutex_info(const void *data, char *buf, size_t size);
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "types.h"
+#include "proc/sched.h"
+
+/*
+ * A lock which is held either by any number of readers or by one
+ * writer. Writers which are waiting keep new readers out, so they are
+ * not starved; when a writer lets go, the readers which queued up behind
+ * it all get in before the next writer.
+ */
+typedef struct krwlock {
+        ktqueue_t       kr_rwaitq;      /* readers waiting */
+        ktqueue_t       kr_wwaitq;      /* writers waiting */
+        int             kr_readers;     /* readers holding it */
+        struct kthread *kr_writer;      /* writer holding it */
+        uint32_t        kr_contended;   /* times a thread had to wait */
+} krwlock_t;
+
+/**
+ * Initializes the fields of the specified krwlock_t.
+ *
+ * @param rw the lock to initialize
+ */
+void krwlock_init(krwlock_t *rw);
+
+/**
+ * Takes the lock shared, alongside any other readers.
+ *
+ * Note: This function may block.
+ *
+ * Note: These locks are not re-entrant
+ *
+ * @param rw the lock to take
+ */
+void krwlock_rdlock(krwlock_t *rw);
+
+/**
+ * Takes the lock exclusively.
+ *
+ * Note: This function may block.
+ *
+ * Note: These locks are not re-entrant
+ *
+ * @param rw the lock to take
+ */
+void krwlock_wrlock(krwlock_t *rw);
+
+/**
+ * Lets go of a lock taken with krwlock_rdlock().
+ *
+ * @param rw the lock to let go of
+ */
+void krwlock_rdunlock(krwlock_t *rw);
+
+/**
+ * Lets go of a lock taken with krwlock_wrlock().
+ *
+ * @param rw the lock to let go of
+ */
+void krwlock_wrunlock(krwlock_t *rw);
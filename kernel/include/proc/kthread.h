@@ -22,10 +22,22 @@ typedef struct kthread {
 
         int             kt_cancelled;   /* 1 if this thread has been cancelled */
         ktqueue_t      *kt_wchan;       /* The queue that this thread is blocked on */
+        int             kt_exclusive;   /* 1 if it waits there exclusively */
         int             kt_state;       /* this thread's state */
+        int             kt_prio;        /* run queue level, 0 runs first */
+        uint32_t        kt_cpumask;     /* CPUs it may run on, see
+                                         * proc/affinity.h */
+        int             kt_rcu_nesting; /* depth of RCU read-side sections */
+        uint64_t        kt_utime;       /* ns run in userland */
+        uint64_t        kt_stime;       /* ns run in the kernel */
+        uint64_t        kt_runq_at;     /* when it was last made runnable */
+        int             kt_wclass;      /* SCHED_WQ_ of what it last slept on */
+        uint32_t        kt_nreadins;    /* pages it read in from files or
+                                         * swap, see handle_pagefault */
         list_link_t     kt_qlink;       /* link on ktqueue */
         list_link_t     kt_plink;       /* link on proc thread list */
 #ifdef __MTP__
+        int             kt_tid;         /* thread id, see kthread_lookup */
         int             kt_detached;    /* if the thread has been detached */
         ktqueue_t       kt_joinq;       /* thread waiting to join with this thread */
 #endif
@@ -83,11 +95,26 @@ void kthread_exit(void *retval);
 kthread_t *kthread_clone(kthread_t *thr);
 
 #ifdef __MTP__
+/**
+ * Finds a thread of the current process.
+ *
+ * @param tid the thread's kt_tid
+ * @return the thread, or NULL if the current process has no such thread
+ */
+kthread_t *kthread_lookup(int tid);
+
 /**
  * Shuts down the reaper daemon.
  */
 void kthread_reapd_shutdown(void);
 
+/**
+ * Hands an exited, detached thread to the reaper daemon to clean up.
+ *
+ * @param kthr the thread
+ */
+void kthread_reapd_add(kthread_t *kthr);
+
 /**
  * Put a thread in the detached state.
  *
@@ -3,17 +3,21 @@
 #include "types.h"
 
 #include "proc/kthread.h"
+#include "proc/rcu.h"
 
 #include "mm/pagetable.h"
 
 #include "vm/vmmap.h"
 
+#include "fs/fdtable.h"
+
 #include "config.h"
 
 #define PROC_MAX_COUNT  65536
 #define PROC_NAME_LEN   256
 
 struct regs;
+struct proc_stat;
 
 typedef struct proc {
         pid_t           p_pid;                 /* our pid */
@@ -30,10 +34,14 @@ typedef struct proc {
         pagedir_t      *p_pagedir;
 
         list_link_t     p_list_link;     /* link on the list of all processes */
+        list_link_t     p_hash_link;     /* link on its bucket of the PID
+                                          * hash, see proc_lookup() */
         list_link_t     p_child_link;    /* link on proc list of children */
+        uint32_t        p_seq;           /* creation order, see proc_list_next() */
+        rcu_head_t      p_rcu;           /* to free it once nobody can see it */
 
         /* VFS-related: */
-        struct file    *p_files[NFILES]; /* open files */
+        fdtable_t       p_fdtable;       /* open files */
         struct vnode   *p_cwd;           /* current working dir */
 
         /* VM */
@@ -42,12 +50,44 @@ typedef struct proc {
         struct vmmap   *p_vmmap;         /* list of areas mapped into
                                           * process' user address
                                           * space */
+        struct proc    *p_vfork_parent;  /* if set, p_vmmap and p_pagedir
+                                          * are borrowed from this process
+                                          * until we exec or exit */
+        ktqueue_t       p_vfork_wait;    /* where that process sleeps */
+        int             p_reap;          /* PROC_REAP_*, see proc_cleanup() */
+        list_link_t     p_reap_link;     /* on the list for the reaper */
+
+        /* Block I/O, see blockdev_submit(): */
+        int             p_ioprio;        /* IOPRIO_CLASS_*, inherited */
+        uint64_t        p_io_rbytes;     /* read from disk */
+        uint64_t        p_io_wbytes;     /* written to disk */
+        uint32_t        p_io_rops;       /* block requests of each */
+        uint32_t        p_io_wops;
+
+        /* CPU time, in nanoseconds, see sched_acct_trap(): */
+        uint64_t        p_utime;         /* its threads ran in userland */
+        uint64_t        p_stime;         /* ...and in the kernel for it */
+        uint64_t        p_cutime;        /* of its children, and theirs, */
+        uint64_t        p_cstime;        /* once they were waited for */
+        /* its threads' waits from runnable to running, see sched_lat_info */
+        uint32_t        p_sched_lat[SCHED_LAT_BUCKETS];
+#ifdef __MTP__
+        int             p_exiting;       /* set once do_exit has started */
+        ktqueue_t       p_thread_exitq;  /* do_exit waits here for the
+                                          * other threads to exit */
+#endif
 } proc_t;
 
 /* Process states. */
 #define PROC_RUNNING    1       /* has running threads */
 #define PROC_DEAD       2       /* has already exited, hasn't been wait'ed */
 
+/* How far the teardown of an exited process's address space has got */
+#define PROC_REAP_NONE          0       /* not queued, or done */
+#define PROC_REAP_QUEUED        1       /* waiting for the reaper */
+#define PROC_REAP_WAITED        2       /* ...which is to free the proc_t,
+                                         * as do_waitpid() is done with it */
+
 
 /* Special PIDs for Kernel Deamons */
 #define PID_IDLE     0
@@ -63,6 +103,16 @@ void proc_init(void);
  */
 proc_t *proc_create(char *name);
 
+/**
+ * Undoes proc_create() for a process which never got to run, as when
+ * fork(2) runs out of memory part of the way through. The caller has
+ * already disposed of its vmmap and page directory, or given back the
+ * ones it borrowed.
+ *
+ * @param p the process, which has no threads
+ */
+void proc_discard(proc_t *p);
+
 /**
  * Finds the process with the specified PID.
  *
@@ -73,12 +123,24 @@ proc_t *proc_create(char *name);
 proc_t *proc_lookup(int pid);
 
 /**
- * Returns the list of running processes.
+ * Returns the list of running processes. It can be walked without a lock
+ * in an RCU read-side section, and what is found there stays safe to look
+ * at until the section ends, even if it is reaped meanwhile.
  *
  * @return the list of running processes
  */
 list_t *proc_list(void);
 
+/**
+ * For walks of the process list which sleep along the way, and so cannot
+ * stay in one read-side section: finds the first process created after
+ * the one seq names. Must be called in a read-side section.
+ *
+ * @param seq 0 to start the walk, advanced to the process returned
+ * @return the next process, or NULL at the end of the list
+ */
+proc_t *proc_list_next(uint32_t *seq);
+
 /**
  * Stops another process from running again by cancelling all its
  * threads.
@@ -127,6 +189,74 @@ pid_t do_waitpid(pid_t pid, int options, int *status);
  */
 int do_fork(struct regs *regs);
 
+/**
+ * This function implements the vfork(2) system call. The child runs in
+ * the parent's address space, and the parent sleeps until the child
+ * calls vfork_release() by exec'ing or exiting.
+ *
+ * @param regs the register state at the time of the system call
+ */
+int do_vfork(struct regs *regs);
+
+/**
+ * Called by a vforked child once it no longer uses its parent's address
+ * space; wakes the parent.
+ */
+void vfork_release(void);
+
+#ifdef __MTP__
+/**
+ * Adds a thread to the current process which shares its address space.
+ *
+ * @param regs the register state at the time of the system call, which
+ * the new thread starts with apart from eip and esp
+ * @param eip where the new thread starts running in userland
+ * @param esp the new thread's userland stack pointer
+ * @return the new thread's id, or -EFAULT if eip or esp is not a
+ * userland address
+ */
+int do_thr_create(struct regs *regs, uintptr_t eip, uintptr_t esp);
+#endif
+
+/**
+ * Fills in what the proc_stats(2) system call reports about a process.
+ * Does not block.
+ *
+ * @param p the process
+ * @param st where to put it
+ */
+void proc_stat_get(proc_t *p, struct proc_stat *st);
+
+/*
+ * The implementations of ioprio_set(2) and ioprio_get(2): set or get the
+ * I/O priority class of process pid, or of the current one if pid is 0.
+ * Both return -ESRCH if there is no such process, and do_ioprio_set
+ * -EINVAL for an unknown class; otherwise do_ioprio_set returns 0 and
+ * do_ioprio_get the class.
+ */
+int do_ioprio_set(pid_t pid, int ioclass);
+int do_ioprio_get(pid_t pid);
+
+/*
+ * The implementations of sched_setaffinity(2) and sched_getaffinity(2):
+ * confine every thread of process pid (or of the current one, if pid is
+ * 0) to the CPUs of mask that are online, or get the CPUs its threads
+ * may run on. Both return 0, or -ESRCH if there is no such process, and
+ * do_sched_setaffinity -EINVAL if none of mask is online.
+ */
+int do_sched_setaffinity(pid_t pid, uint32_t mask);
+int do_sched_getaffinity(pid_t pid, uint32_t *mask);
+
+struct rusage;
+
+/*
+ * The implementation of getrusage(2): the CPU time of the current
+ * process, its waited-for children or the current thread, as who is
+ * RUSAGE_SELF, RUSAGE_CHILDREN or RUSAGE_THREAD. Returns 0, or -EINVAL
+ * for any other who.
+ */
+int do_getrusage(int who, struct rusage *ru);
+
 /**
  * Provides detailed debug information about a given process.
  *
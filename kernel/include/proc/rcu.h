@@ -0,0 +1,51 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/list.h"
+
+/*
+ * Read-copy-update, for read-mostly structures which are searched far
+ * more often than they change: the process list, the vnode hash and the
+ * name cache. Readers bracket a lookup with rcu_read_lock and
+ * rcu_read_unlock, which take no lock and write nothing shared, and must
+ * not sleep in between. Updaters still exclude each other as they
+ * did before, link and unlink elements with the _rcu list operations in
+ * util/list.h, and free an unlinked element only once a grace period has
+ * passed, by which time no reader can still be looking at it.
+ */
+
+typedef struct rcu_head {
+        void          (*rh_func)(struct rcu_head *rh);
+        list_link_t     rh_link;        /* on the pending or ready list */
+} rcu_head_t;
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+
+/**
+ * Arranges for func to be called with rh, in thread context, once every
+ * read-side section that has started has finished. May be called from
+ * any context; rh is usually embedded in what func is to free.
+ *
+ * @param rh somewhere for the callback to wait
+ * @param func what to call, which must not sleep
+ */
+void call_rcu(rcu_head_t *rh, void (*func)(rcu_head_t *rh));
+
+/**
+ * Sleeps until a grace period has passed. Must not be called in a
+ * read-side section.
+ */
+void synchronize_rcu(void);
+
+/**
+ * For updaters which cannot wait and have nowhere to put an rcu_head:
+ * rcu_state_done(rcu_state()) becomes true once a grace period has
+ * passed after the call to rcu_state().
+ */
+uint32_t rcu_state(void);
+int rcu_state_done(uint32_t state);
+
+/* Called by sched_switch, which is where grace periods end */
+void rcu_quiescent(void);
@@ -0,0 +1,28 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#ifdef __KERNEL__
+#include "api/time.h"
+#else
+#include "time.h"
+#endif
+
+/*
+ * CPU time used, as getrusage(2) reports it. User time is what was spent
+ * running in userland, system time what the kernel spent on its behalf,
+ * system calls and faults and interrupts taken while it ran.
+ */
+#define RUSAGE_SELF             0       /* the calling process */
+#define RUSAGE_CHILDREN         (-1)    /* its children which have been
+                                         * waited for, and theirs */
+#define RUSAGE_THREAD           1       /* the calling thread */
+
+struct rusage {
+        struct timespec ru_utime;       /* user time */
+        struct timespec ru_stime;       /* system time */
+};
+
+#ifndef __KERNEL__
+int getrusage(int who, struct rusage *ru);
+#endif
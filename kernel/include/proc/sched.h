@@ -1,11 +1,46 @@
 #pragma once
 
+#include "config.h"
+
 #include "util/list.h"
 
+/* Run queue levels (0 through SCHED_NPRIO - 1, lower runs first). Threads
+ * start at SCHED_PRIO_DEFAULT, move up a level each time they are woken
+ * (but no higher than SCHED_PRIO_WAKEUP) and, with UPREEMPT, down a level
+ * each time they use up a quantum. SCHED_PRIO_URGENT is only entered
+ * through sched_broadcast_urgent and sched_set_prio. */
+#define SCHED_PRIO_URGENT       0
+#define SCHED_PRIO_WAKEUP       1
+#define SCHED_PRIO_DEFAULT      2
+
+/* The CPUs threads are run on, which is the boot CPU alone however many
+ * the APIC finds, as a mask (see proc/affinity.h) */
+#define SCHED_NCPUS             1
+#define SCHED_CPUS_ONLINE       ((uint32_t)((1ULL << SCHED_NCPUS) - 1))
+
+/* What a queue is waited on for, which sched_lat_info breaks wakeup
+ * latency down by. Queues are SCHED_WQ_OTHER unless sched_queue_class
+ * says otherwise; a thread made runnable without having slept (because
+ * it yielded or was preempted) counts as SCHED_WQ_PREEMPT. */
+#define SCHED_WQ_OTHER          0
+#define SCHED_WQ_DISK           1
+#define SCHED_WQ_TTY            2
+#define SCHED_WQ_PFRAME         3       /* a busy page or vnode, see sched_waitq */
+#define SCHED_WQ_ALLOC          4       /* free memory */
+#define SCHED_WQ_PREEMPT        5
+#define SCHED_WQ_NCLASSES       6
+
+/* Histogram buckets: bucket i of a latency histogram counts waits from
+ * 2^i to 2^(i+1) nanoseconds, and of a depth histogram run queues of
+ * 2^i to 2^(i+1) threads; the last bucket takes everything larger */
+#define SCHED_LAT_BUCKETS       32
+#define SCHED_DEPTH_BUCKETS     8
+
 struct kthread;
 typedef struct ktqueue {
         list_t          tq_list;
         int             tq_size;
+        int             tq_class;       /* SCHED_WQ_ */
 } ktqueue_t;
 
 /**
@@ -35,6 +70,27 @@ void sched_queue_init(ktqueue_t *q);
  */
 int sched_queue_empty(ktqueue_t *q);
 
+/**
+ * Returns the queue to wait on for something to happen to the given
+ * object, so that objects which are only rarely waited for (such as busy
+ * pages and vnodes) need no queue of their own. The queue is shared with
+ * other objects, so waiters must check again that what they are waiting
+ * for has happened when they wake, and wakers must wake them all with
+ * sched_broadcast_on.
+ *
+ * @param obj the object
+ * @return the queue for obj
+ */
+ktqueue_t *sched_waitq(const void *obj);
+
+/**
+ * Says what a queue is waited on for, see SCHED_WQ_OTHER.
+ *
+ * @param q the queue, already initialized
+ * @param class one of the SCHED_WQ_ classes
+ */
+void sched_queue_class(ktqueue_t *q, int class);
+
 /**
  * Causes the current thread to enter into an uncancellable sleep on
  * the given queue.
@@ -43,6 +99,16 @@ int sched_queue_empty(ktqueue_t *q);
  */
 void sched_sleep_on(ktqueue_t *q);
 
+/**
+ * Like sched_sleep_on, but as an exclusive waiter: sched_wakeup_n wakes
+ * only as many of those as it is told to, for waiters which are after
+ * something that not all of them can have. Whoever is woken either takes
+ * it, or should pass the wakeup on.
+ *
+ * @param q the queue to sleep on
+ */
+void sched_sleep_on_exclusive(ktqueue_t *q);
+
 /**
  * Causes the current thread to enter into a cancellable sleep on the
  * given queue.
@@ -52,6 +118,17 @@ void sched_sleep_on(ktqueue_t *q);
  */
 int sched_cancellable_sleep_on(ktqueue_t *q);
 
+/**
+ * Like sched_cancellable_sleep_on, but gives up waiting after the given
+ * number of milliseconds.
+ *
+ * @param q the queue to sleep on
+ * @param msecs how long to wait at most
+ * @return -EINTR if the thread was cancelled, -ETIME if it was not woken
+ * in time and 0 otherwise
+ */
+int sched_sleep_on_timeout(ktqueue_t *q, uint32_t msecs);
+
 /**
  * Wakes a single thread from sleep if there are any waiting on the
  * queue.
@@ -61,6 +138,16 @@ int sched_cancellable_sleep_on(ktqueue_t *q);
  */
 struct kthread *sched_wakeup_on(ktqueue_t *q);
 
+/**
+ * Wakes every thread on the queue which is not an exclusive waiter, and
+ * the n exclusive waiters which have waited longest.
+ *
+ * @param q the queue to wake up threads from
+ * @param n how many exclusive waiters to wake at most
+ * @return the number of threads woken
+ */
+int sched_wakeup_n(ktqueue_t *q, int n);
+
 /**
  * Wake up all threads running on the queue.
  *
@@ -68,9 +155,98 @@ struct kthread *sched_wakeup_on(ktqueue_t *q);
  */
 void sched_broadcast_on(ktqueue_t *q);
 
+/**
+ * Wakes up all threads on the queue at SCHED_PRIO_URGENT, so that they run
+ * before anything else. For daemons woken because memory is short; they
+ * should drop back with sched_set_prio once they are done.
+ *
+ * @param q the queue to wake up threads from
+ */
+void sched_broadcast_urgent(ktqueue_t *q);
+
+/**
+ * Moves a thread to the given run queue level, see SCHED_PRIO_DEFAULT.
+ *
+ * @param thr the thread
+ * @param prio the new level
+ */
+void sched_set_prio(struct kthread *thr, int prio);
+
+/**
+ * Confines a thread to the CPUs of mask which are online, see
+ * proc/affinity.h.
+ *
+ * @param thr the thread
+ * @param mask the CPUs it may run on
+ * @return 0, or -EINVAL, with the thread's mask unchanged, if none of
+ * mask is online
+ */
+int sched_set_affinity(struct kthread *thr, uint32_t mask);
+
 /**
  * Cancel the given thread from the queue it sleeps on.
  *
  * @param the thread to cancel sleep from
  */
 void sched_cancel(struct kthread *kthr);
+
+/**
+ * A voluntary preemption point, for kernel loops which can run for long
+ * enough to hold up interactive threads. Yields the processor if a thread
+ * of a better run queue level than the running one is runnable, or, with
+ * UPREEMPT, if its quantum is up. Must not be called where sleeping is
+ * not allowed. Anything the caller was in the middle of walking may have
+ * changed by the time it returns 1.
+ *
+ * @return 1 if another thread ran meanwhile, 0 otherwise
+ */
+int cond_resched(void);
+
+#ifdef __UPREEMPT__
+/**
+ * Yields the processor if the running thread has used up its quantum.
+ * Called on the way back to userland from an interrupt, never while the
+ * thread is running kernel code.
+ */
+void sched_preempt(void);
+#endif
+
+/*
+ * CPU time accounting. sched_acct_trap is called on entering the kernel
+ * from userland, and charges the time since the thread last left the
+ * kernel to its user time; sched_acct_untrap is called just before
+ * going back, and charges the time in between to its system time. Time
+ * with nothing to run is charged to no one.
+ */
+void sched_acct_trap(void);
+void sched_acct_untrap(void);
+
+/**
+ * @return the number of threads waiting on the run queues, not counting
+ * the running one
+ */
+int sched_runnable(void);
+
+/**
+ * Prints the scheduler's load counters: the number of runnable threads
+ * and how many context switches, wakeups and idle waits there have been.
+ *
+ * @param arg unused
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the number of bytes written
+ */
+size_t sched_info(const void *arg, char *buf, size_t osize);
+
+/**
+ * Prints how long threads waited between being made runnable and being
+ * switched to, as log2 histograms by what they had slept on, and how
+ * many threads were runnable whenever one was made so. The histograms by
+ * process are each process's p_sched_lat.
+ *
+ * @param arg unused
+ * @param buf buffer to write to
+ * @param osize size of the buffer
+ * @return the number of bytes written
+ */
+size_t sched_lat_info(const void *arg, char *buf, size_t osize);
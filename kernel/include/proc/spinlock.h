@@ -0,0 +1,40 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Busy-waiting locks, for data touched from interrupt context or held
+ * too briefly to be worth sleeping for. A spinlock taken both by threads
+ * and by an interrupt handler must be taken with the irqsave variants,
+ * otherwise the handler can spin forever on a lock the thread it
+ * interrupted holds. Never sleep while holding one.
+ */
+typedef struct spinlock {
+        volatile uint32_t sl_locked;    /* 1 while held */
+} spinlock_t;
+
+/* Read-mostly data: any number of readers, or one writer */
+typedef struct rwlock {
+        spinlock_t      rw_lock;        /* protects the fields below */
+        int             rw_readers;     /* number of readers inside */
+        int             rw_writer;      /* 1 if a writer is inside */
+} rwlock_t;
+
+void spinlock_init(spinlock_t *lock);
+void spinlock_lock(spinlock_t *lock);
+void spinlock_unlock(spinlock_t *lock);
+
+/**
+ * Masks interrupts and then takes the lock.
+ *
+ * @param lock the lock to take
+ * @return the previous IPL, to give to spinlock_unlock_irqrestore
+ */
+uint8_t spinlock_lock_irqsave(spinlock_t *lock);
+void spinlock_unlock_irqrestore(spinlock_t *lock, uint8_t ipl);
+
+void rwlock_init(rwlock_t *rw);
+void rwlock_read_lock(rwlock_t *rw);
+void rwlock_read_unlock(rwlock_t *rw);
+void rwlock_write_lock(rwlock_t *rw);
+void rwlock_write_unlock(rwlock_t *rw);
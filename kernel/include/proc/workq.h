@@ -0,0 +1,59 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/list.h"
+
+/*
+ * Work deferred to a small pool of kernel threads shared by the whole
+ * kernel, for anything which has to happen later in thread context
+ * rather than in an interrupt handler or softirq, perhaps sleeping, but
+ * does not deserve a daemon of its own. Items run in the order they
+ * were queued, though with several workers one may start before the
+ * one ahead of it has finished.
+ */
+
+typedef struct work {
+        void          (*w_func)(struct work *w);
+        void           *w_data;         /* for w_func */
+        list_link_t     w_link;         /* on the queue while pending */
+} work_t;
+
+/**
+ * Sets up a work item which is not pending.
+ *
+ * @param w the work item
+ * @param func what to run, which is passed w and may free it
+ * @param data what w_data is to be
+ */
+void work_init(work_t *w, void (*func)(work_t *), void *data);
+
+/**
+ * Queues w for a worker to run, unless it is already queued. May be
+ * called from any context, including interrupt handlers and softirqs.
+ * Once w has been taken off the queue to run, it can be queued again.
+ *
+ * @param w the work item
+ * @return 1 if w was queued, 0 if it was already pending
+ */
+int work_queue(work_t *w);
+
+/**
+ * Takes w off the queue if no worker has started on it yet.
+ *
+ * @param w the work item
+ * @return 1 if w was pending, 0 otherwise
+ */
+int work_cancel(work_t *w);
+
+/**
+ * Sleeps until no work is queued or running, so that everything queued
+ * before the call has run. Must not be called by a work item.
+ */
+void workq_flush(void);
+
+/**
+ * Runs whatever is left and stops the workers. Must be called from the
+ * idle process; work queued afterwards is never run.
+ */
+void workq_shutdown(void);
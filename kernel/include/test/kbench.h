@@ -0,0 +1,67 @@
+#pragma once
+
+#include "types.h"
+
+#include "test/kshell/kshell.h"
+
+#include "util/list.h"
+
+/*
+ * Microbenchmarks of the kernel's own code, run from the kshell "kbench"
+ * command, for judging a change to an allocator or cache on its own
+ * rather than through what userland sees of it. Each benchmark does some
+ * number of the operation it measures, timing only those with
+ * kbench_start and kbench_stop around them, so that setting up and
+ * cleaning up (freeing what a run allocated, say) are left out. The
+ * harness runs it a few times and prints the cycles per operation, read
+ * from the time stamp counter, of the fastest and the median run.
+ */
+
+typedef struct kbench kbench_t;
+
+/* Does n operations, returning 0, or -errno if it could not */
+typedef int (*kbench_func_t)(kbench_t *kb, uint32_t n);
+
+struct kbench {
+        const char      *kb_name;
+        const char      *kb_desc;
+        kbench_func_t    kb_func;
+        uint32_t         kb_arg;        /* for the function, as it likes */
+        uint64_t         kb_cycles;     /* timed so far in this run */
+        uint64_t         kb_started;    /* the TSC at kbench_start */
+        list_link_t      kb_link;       /* on the list of benchmarks */
+};
+
+/**
+ * Adds a benchmark for the kbench command to run.
+ *
+ * @param name how the kbench command names it
+ * @param func the benchmark
+ * @param arg for the function to tell what to do, when one function
+ * serves several benchmarks
+ * @param desc what it measures, for "kbench list"
+ */
+void kbench_add(const char *name, kbench_func_t func, uint32_t arg,
+                const char *desc);
+
+/* Starts and stops the clock on the operations being measured */
+void kbench_start(kbench_t *kb);
+void kbench_stop(kbench_t *kb);
+
+/**
+ * Runs benchmarks and prints what they found.
+ *
+ * @param ksh the shell to print to
+ * @param name the benchmark to run, or the start of the names of several
+ * (so "kmalloc" runs every size class), or NULL for all of them
+ * @param n how many operations each run does
+ * @return 0, or -ENOENT if no benchmark is called name
+ */
+int kbench_run(kshell_t *ksh, const char *name, uint32_t n);
+
+/**
+ * Prints the benchmarks there are.
+ *
+ * @param ksh the shell to print to
+ */
+void kbench_list(kshell_t *ksh);
@@ -39,6 +39,13 @@ ksyscall(lseek, (int fd, int offset, int whence), (fd, offset, whence))
 ksyscall(getdent, (int fd, struct dirent *dirp), (fd, dirp))
 ksyscall(stat, (const char *path, struct stat *uf), (path, uf))
 ksyscall(open, (const char *filename, int flags), (filename, flags))
+ksyscall(readv, (int fd, const struct iovec *iov, int iovcnt), (fd, iov, iovcnt))
+ksyscall(writev, (int fd, const struct iovec *iov, int iovcnt), (fd, iov, iovcnt))
+ksyscall(pread, (int fd, void *buf, size_t nbytes, off_t pos), (fd, buf, nbytes, pos))
+ksyscall(pwrite, (int fd, const void *buf, size_t nbytes, off_t pos), (fd, buf, nbytes, pos))
+ksyscall(pipe, (int pipefd[2]), (pipefd))
+ksyscall(clone_file, (int src_fd, int dst_fd), (src_fd, dst_fd))
+ksyscall(fallocate, (int fd, int mode, off_t offset, off_t len), (fd, mode, offset, len))
 #define ksys_exit do_exit
 
 /* Kill me now */
@@ -85,6 +92,13 @@ int ksys_getdents(int fd, struct dirent *dirp, unsigned int count)
 #define unlink          ksys_unlink
 #define read            ksys_read
 #define write           ksys_write
+#define readv           ksys_readv
+#define writev          ksys_writev
+#define pread           ksys_pread
+#define pwrite          ksys_pwrite
+#define pipe            ksys_pipe
+#define clone_file      ksys_clone_file
+#define fallocate       ksys_fallocate
 #define lseek           ksys_lseek
 #define dup             ksys_dup
 #define dup2            ksys_dup2
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Kernel call chains, found by walking the frame pointers the kernel is
+ * built to keep (-fno-omit-frame-pointer, see the Makefile): each frame
+ * starts with the caller's %ebp, then the address the call returns to.
+ * The walk stays on the current thread's kernel stack, or the interrupt
+ * stack and then the stack the interrupt came in on, and stops at the
+ * first frame which is out of place, so a wild %ebp gives a short chain
+ * rather than a fault. Chains are return addresses, innermost first, to
+ * be named with "info symbol" in gdb or addr2line on kernel/weenix.dbg.
+ *
+ * Records kept by the thousand store a handle to the chain instead of
+ * the chain: callchain_save keeps one copy of each distinct chain in a
+ * fixed table, which fills up and stays full, never being emptied.
+ */
+
+#define CALLCHAIN_DEPTH         8       /* the most frames kept */
+#define CALLCHAIN_NSAVED        1024    /* distinct chains callchain_save
+                                         * keeps, a power of two */
+
+/**
+ * Walks the frames starting at fp. May be called from any context.
+ *
+ * @param fp the %ebp of the innermost frame
+ * @param pcs where to put the return addresses
+ * @param max the most to put there
+ * @return how many were found, 0 before there are threads
+ */
+int callchain_walk(uintptr_t fp, uintptr_t *pcs, int max);
+
+/**
+ * Walks the frames of the function which calls this, so that pcs[0] is
+ * where that function returns to.
+ *
+ * @param pcs where to put the return addresses
+ * @param max the most to put there
+ * @param skip how many of the innermost to leave out, for a function
+ * which captures on behalf of its caller
+ * @return how many were put in pcs
+ */
+int callchain_capture(uintptr_t *pcs, int max, int skip);
+
+/**
+ * Keeps a copy of a chain. May be called from any context.
+ *
+ * @param pcs the return addresses, innermost first
+ * @param n how many, at most CALLCHAIN_DEPTH
+ * @return a handle for callchain_fetch, which is the same for the same
+ * chain, or 0 if n is 0 or the table is full
+ */
+uint32_t callchain_save(const uintptr_t *pcs, int n);
+
+/**
+ * @param handle what callchain_save returned
+ * @param pcs set to the chain, or NULL for a handle of 0
+ * @return how many return addresses are in it
+ */
+int callchain_fetch(uint32_t handle, const uintptr_t **pcs);
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/list.h"
+
+/*
+ * Event counters, for seeing what the kernel is up to without a
+ * debugger. A subsystem defines a counter_t (or an array of them, one for
+ * each of a range of numbers), bumps it with counter_inc(), and registers
+ * it under a name once at init time, after which it is listed by
+ * /dev/counters. There is one processor, so a counter is one value. It is
+ * bumped with plain arithmetic, so any one counter should be bumped only
+ * from threads or only from a single interrupt handler.
+ */
+
+typedef struct counter {
+        uint64_t        c_value;
+        const char     *c_name;
+        int             c_index;        /* place in its array, or -1 */
+        list_link_t     c_link;         /* on the list of counters */
+} counter_t;
+
+#define counter_inc(c)          ((c)->c_value++)
+#define counter_add(c, n)       ((c)->c_value += (n))
+
+/**
+ * Lists a counter. Counting starts when the counter is defined, not when
+ * it is registered.
+ *
+ * @param c the counter
+ * @param name its name, e.g. "vm.pagefaults", which must not go away
+ */
+void counter_register(counter_t *c, const char *name);
+
+/**
+ * Lists an array of counters as name.0, name.1, and so on. Members of
+ * the array which are still 0 are left out.
+ *
+ * @param cs the counters
+ * @param n how many there are
+ * @param name the name they share
+ */
+void counter_register_array(counter_t *cs, int n, const char *name);
+
+/**
+ * Looks up a counter by the name it was registered under, as it is
+ * listed: "name" or, for a member of an array, "name.i".
+ *
+ * @param name the name
+ * @param value where to put its value
+ * @return 0, or -ENOENT if there is no such counter
+ */
+int counter_get(const char *name, uint64_t *value);
+
+/**
+ * Formats the counters as text, a "name value" line for each in the order
+ * they were registered, and copies out what is at offset in it.
+ *
+ * @param offset where in the text to start
+ * @param buf where to copy it
+ * @param count the most to copy
+ * @return the number of bytes copied, 0 past the end
+ */
+int counter_format(int offset, char *buf, int count);
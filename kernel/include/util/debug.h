@@ -60,6 +60,7 @@
 #define DBG_THR         DBG_MODE(23)    /* thread stuff                 */
 #define DBG_PRINT       DBG_MODE(24)    /* printdbg.c                   */
 #define DBG_OSYSCALL    DBG_MODE(25)    /* other system calls           */
+#define DBG_NET         DBG_MODE(26)    /* network stack and devices    */
 #define DBG_VM          DBG_MODE(28)    /* VM                           */
 #define DBG_TEST        DBG_MODE(30)    /* for testing code             */
 #define DBG_TESTPASS    DBG_MODE(31)    /* for testing code             */
@@ -97,6 +98,7 @@
         {"term", DBG_TERM, _BMAGENTA_ },        \
         {"disk", DBG_DISK, _YELLOW_ },          \
         {"memdev", DBG_MEMDEV, _BBLUE_ },       \
+        {"net", DBG_NET, _BCYAN_ },             \
         /* VFS */                               \
         {"vfs", DBG_VFS, _WHITE_ },             \
         {"fref", DBG_FREF, _MAGENTA_ },         \
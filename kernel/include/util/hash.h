@@ -0,0 +1,99 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/list.h"
+
+/*
+ * Chained hash tables which grow with what is put in them.
+ *
+ * htable_link_t is included in structures which want to be in an
+ * htable_t; the link carries the item's hash, so that the table can
+ * move items between buckets as it grows without calling back into its
+ * user, and so that lookups skip other items in a bucket without
+ * comparing keys.
+ *
+ * htable_init(ht) makes an empty table with a single bucket, which
+ * needs no memory beyond the htable_t. htable_insert(ht, link, hash)
+ * doubles the buckets once there are more than HTABLE_LOAD items to a
+ * bucket; should there be no memory for that, the table carries on with
+ * the buckets it has, so insertion never fails. htable_remove(ht, link)
+ * takes an item out, and htable_destroy(ht) gives back the buckets of
+ * a table which must by then be empty.
+ *
+ * To look an item up,
+ *    type *iterator;
+ *    htable_iterate_begin(ht, hash, iterator, type, member) {
+ *        if (... iterator matches the key ...)
+ *            return iterator;
+ *    } htable_iterate_end();
+ * which walks only the items whose hash is the one given, and works even
+ * if htable_remove() is called on the current one.
+ *
+ * Growing moves items between buckets, so these are not for tables
+ * walked without a lock (see proc/rcu.h), which keep fixed buckets.
+ */
+
+/* Items to a bucket before the table grows */
+#define HTABLE_LOAD             2
+/* Most buckets a table grows to, as a power of two */
+#define HTABLE_MAX_SHIFT        16
+
+typedef struct htable_link {
+        list_link_t      hl_link;       /* on a bucket */
+        uint32_t         hl_hash;
+} htable_link_t;
+
+typedef struct htable {
+        list_t          *ht_buckets;    /* ht_mask + 1 of them */
+        uint32_t         ht_mask;
+        uint32_t         ht_count;      /* items in the table */
+        list_t           ht_bucket0;    /* the buckets until the first grow */
+} htable_t;
+
+void htable_init(htable_t *ht);
+void htable_destroy(htable_t *ht);
+void htable_insert(htable_t *ht, htable_link_t *link, uint32_t hash);
+void htable_remove(htable_t *ht, htable_link_t *link);
+
+#define htable_bucket(ht, hash)                                         \
+        (&(ht)->ht_buckets[(hash) & (ht)->ht_mask])
+
+#define htable_iterate_begin(ht, hash, var, type, member)               \
+        do {                                                            \
+                uint32_t __hash = (hash);                               \
+                list_iterate_begin(htable_bucket(ht, __hash), var,      \
+                                   type, member.hl_link) {              \
+                        if ((var)->member.hl_hash != __hash)            \
+                                continue;                               \
+                        do
+
+#define htable_iterate_end()                                            \
+                        while (0);                                      \
+                } list_iterate_end();                                   \
+        } while (0)
+
+/* Hashes for keys, to be combined as a table's user sees fit */
+
+/* FNV-1a over len bytes, starting from h (HASH_INIT for a fresh hash) */
+#define HASH_INIT               2166136261u
+
+static inline uint32_t
+hash_bytes(uint32_t h, const void *buf, size_t len)
+{
+        const unsigned char *p = buf;
+        size_t i;
+        for (i = 0; i < len; i++)
+                h = (h ^ p[i]) * 16777619u;
+        return h;
+}
+
+/* Knuth's multiplicative hash, which spreads small integers (inode and
+ * process numbers, page numbers) into the high bits; a table's buckets
+ * are chosen by the low bits, so those are mixed down again */
+static inline uint32_t
+hash_u32(uint32_t x)
+{
+        x *= 2654435761u;
+        return x ^ (x >> 16);
+}
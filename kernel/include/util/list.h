@@ -28,6 +28,14 @@
  *   list_remove_head(list) removes the first element.
  *   list_remove_tail(list) removes the last element.
  *
+ * Variants for lists which readers walk without a lock (see proc/rcu.h),
+ * with the usual iteration macros:
+ *   list_insert_head_rcu(list, link), list_insert_tail_rcu(list, link)
+ *     fill link in before making it reachable.
+ *   list_remove_rcu(link) unlinks link, but leaves it pointing on to the
+ *     rest of the list for any reader standing on it; it may be reused
+ *     or freed only after a grace period.
+ *
  * Item accessors.
  *   list_item(link, type, member)
  * Given a list_link_t* and the name of the type of structure which contains
@@ -95,6 +103,36 @@ typedef struct list {
                 ll->l_next = ll->l_prev = NULL;                         \
         } while(0)
 
+#define list_barrier()                                                  \
+        __asm__ volatile("" : : : "memory")
+
+#define list_insert_before_rcu(old, new)                                \
+        do {                                                            \
+                list_link_t *prev = (new);                              \
+                list_link_t *next = (old);                              \
+                prev->l_next = next;                                    \
+                prev->l_prev = next->l_prev;                            \
+                list_barrier();                                         \
+                next->l_prev->l_next = prev;                            \
+                next->l_prev = prev;                                    \
+        } while(0)
+
+#define list_insert_head_rcu(list, link)                                \
+        list_insert_before_rcu((list)->l_next, link)
+
+#define list_insert_tail_rcu(list, link)                                \
+        list_insert_before_rcu(list, link)
+
+#define list_remove_rcu(link)                                           \
+        do {                                                            \
+                list_link_t *ll = (link);                               \
+                list_link_t *prev = ll->l_prev;                         \
+                list_link_t *next = ll->l_next;                         \
+                prev->l_next = next;                                    \
+                next->l_prev = prev;                                    \
+                ll->l_prev = NULL;                                      \
+        } while(0)
+
 #define list_remove_head(list)                                          \
         list_remove((list)->l_next)
 
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Compression in the LZ4 block format: a run of sequences, each some
+ * literal bytes and then a copy of earlier output, which is fast enough
+ * to do on every page that is paged out. The compressor is the simple
+ * greedy one, which finds matches through a hash of the next four bytes.
+ * Inputs are limited to 64KiB, so that every match is within reach.
+ */
+
+/**
+ * Compresses len bytes at src into dst, which has room for cap bytes.
+ * This does not block.
+ *
+ * @return the length of the compressed data, or 0 if it does not fit
+ */
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/**
+ * Decompresses len bytes of what lz4_compress made at src into dst,
+ * which has room for cap bytes.
+ *
+ * @return the length of the decompressed data, or -EINVAL if src is not
+ * well formed or does not fit
+ */
+int lz4_decompress(const void *src, size_t len, void *dst, size_t cap);
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/callchain.h"
+
+/*
+ * A sampling profiler. While it runs, every timer interrupt, which comes
+ * at least every PROF_INTERVAL_MSECS, counts the instruction it
+ * interrupted, and the pid of the process it was in, so the counts form a
+ * histogram of where the time goes in the kernel and in userland alike.
+ * The kshell "prof" command starts and stops it and dumps the counts,
+ * which are raw addresses to be looked up in kernel/weenix.dbg, or the
+ * program's own binary for user addresses; the "kernel prof" gdb command
+ * (util/prof.py) does the kernel's and adds them up by function.
+ *
+ * Samples of the kernel are told apart by the call chain leading to the
+ * instruction as well, so the counts can be drawn as a flame graph
+ * ("kernel prof --folded" prints them in the form flamegraph.pl takes).
+ */
+
+#define PROF_INTERVAL_MSECS     1
+#define PROF_NSLOTS             4096    /* a power of two */
+
+typedef struct prof_slot {
+        uint32_t        ps_eip;
+        pid_t           ps_pid;         /* curproc's, or -1 */
+        uint32_t        ps_count;       /* 0 if the slot is free */
+        uintptr_t       ps_chain[CALLCHAIN_DEPTH];      /* the callers of
+                                         * ps_eip, innermost first, padded
+                                         * with 0; none for userland */
+} prof_slot_t;
+
+extern prof_slot_t prof_table[PROF_NSLOTS];
+extern uint32_t prof_samples;           /* taken since prof_start */
+extern uint32_t prof_dropped;           /* of those, with no slot left */
+
+/**
+ * Throws away the counts so far and starts sampling.
+ */
+void prof_start(void);
+
+/**
+ * Stops sampling, keeping the counts.
+ */
+void prof_stop(void);
+
+/**
+ * Stops sampling and sorts the counts, most first, to the start of
+ * prof_table, after which they are only fit for reading until the next
+ * prof_start.
+ *
+ * @return how many slots are in use
+ */
+uint32_t prof_sort(void);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/list.h"
+
+/* A one-shot timer: t_func is called from the timer interrupt, with
+ * interrupts masked, once the given number of milliseconds have passed.
+ * Timers due within TIMER_SLACK_MSECS of each other fire together. */
+typedef struct ktimer {
+        uint32_t        t_expires;      /* when it fires, see util/time.c */
+        void          (*t_func)(struct ktimer *t);
+        void           *t_data;         /* for t_func */
+        list_link_t     t_link;         /* link on the pending timer list */
+} ktimer_t;
+
+/* Sets up a timer which is not pending. */
+void timer_init(ktimer_t *t, void (*func)(ktimer_t *), void *data);
+
+/* Makes t fire after msecs milliseconds. t must not already be pending. */
+void timer_add(ktimer_t *t, uint32_t msecs);
+
+/* Stops t from firing. Returns 1 if it was pending, 0 if it had already
+ * fired (or was never added). */
+int timer_cancel(ktimer_t *t);
+
+/* Returns 1 if t has been added and has not fired or been cancelled. */
+int timer_pending(ktimer_t *t);
+
+/* Cancellably sleeps the current thread for msecs milliseconds. Returns
+ * -EINTR if the thread was cancelled and 0 otherwise. */
+int timer_sleep(uint32_t msecs);
+
+struct regs;
+
+/* Has func called from every timer interrupt, with the registers it
+ * interrupted, and keeps the APIC timer armed for at most msecs at a time
+ * so that this happens at least that often. func must not touch timers.
+ * A NULL func stops it. */
+void timer_set_sampler(void (*func)(struct regs *), uint32_t msecs);
+
+/* Nanoseconds since boot, from the time stamp counter. Unlike the timer
+ * clock it moves whether or not any timer is pending, and may be called
+ * from any context. */
+uint64_t time_now_ns(void);
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * A ring of fixed-size binary trace records, for watching hot paths that
+ * are too busy for dbg(): emitting a record costs a few stores instead of
+ * a trip through printf and the debug port. The newest TRACE_NRECS
+ * records are kept. They are decoded afterwards, by the kshell "trace"
+ * command or the "kernel trace" gdb command (util/trace.py).
+ */
+
+#define TRACE_NRECS     2048            /* a power of two */
+#define TRACE_NARGS     3
+
+/* Events, and what their arguments are; keep trace_event_names in
+ * util/trace.c in step */
+#define TRACE_SWITCH            1       /* from pid, to pid */
+#define TRACE_PAGEFAULT         2       /* vaddr, cause */
+#define TRACE_PFRAME_HIT        3       /* object, page number */
+#define TRACE_PFRAME_MISS       4       /* object, page number */
+#define TRACE_DISK              5       /* block, blocks, write */
+#define TRACE_SYSCALL_ENTER     6       /* number, argument pointer */
+#define TRACE_SYSCALL_EXIT      7       /* number, return value */
+#define TRACE_NEVENTS           8
+
+typedef struct trace_rec {
+        uint64_t        tr_tsc;         /* time stamp counter */
+        uint16_t        tr_event;
+        int16_t         tr_pid;         /* curproc's, or -1 */
+        uint32_t        tr_args[TRACE_NARGS];
+} trace_rec_t;
+
+extern trace_rec_t trace_buf[TRACE_NRECS];
+extern volatile uint32_t trace_next;    /* records emitted so far */
+extern int trace_enabled;
+extern const char *trace_event_names[TRACE_NEVENTS];
+
+/**
+ * Adds a record to the ring, if tracing is on. May be called from any
+ * context, including interrupt handlers; a record is claimed with one
+ * instruction, so nothing it interrupts can write the same one.
+ *
+ * @param event a TRACE_* event
+ */
+void trace_emit(uint16_t event, uint32_t a0, uint32_t a1, uint32_t a2);
+
+/**
+ * Formats the record that is n records older than the newest.
+ *
+ * @param n which record
+ * @param buf where to put the line
+ * @param size the size of buf
+ * @return 0, or -1 if the ring has no such record
+ */
+int trace_format(uint32_t n, char *buf, size_t size);
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "types.h"
+
+#include "util/debug.h"
+
+/*
+ * Debug statements for hot paths, which cost a five-byte nop while their
+ * modes are off rather than the load and test of dbg_modes that dbg()
+ * makes. Each site is a nop, recorded (with the code to run and the
+ * modes it is for) in the kernel's .tracepoints section; whenever the
+ * debug modes change, tracepoint_sync rewrites the nop of every site
+ * whose modes are now on into a jump to its code, and back again when
+ * they go off. The kernel's text is mapped writable, and there is one
+ * CPU, so patching it is a matter of a few stores with interrupts off.
+ *
+ * tpdbg, tpdbgq and tpdbginfo take the same arguments as dbg, dbgq and
+ * dbginfo, and print the same way.
+ */
+
+typedef struct tracepoint {
+        uintptr_t       tp_site;        /* the nop */
+        uintptr_t       tp_target;      /* where the site jumps to when on */
+        uint32_t        tp_mode_lo;     /* the DBG_ modes it is for */
+        uint32_t        tp_mode_hi;
+} tracepoint_t;
+
+#ifndef NDEBUG
+/* Whether any of mode is on, evaluated by the patching of a nop */
+#define tracepoint_active(mode) ({                                      \
+        __label__ _tp_on;                                               \
+        int _tp = 0;                                                    \
+        __asm__ goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"        \
+                     ".pushsection .tracepoints, \"aw\"\n\t"            \
+                     ".balign 4\n\t"                                    \
+                     ".long 1b, %l2, %c0, %c1\n\t"                      \
+                     ".popsection"                                      \
+                     : : "i"((uint32_t)(mode)),                         \
+                         "i"((uint32_t)((uint64_t)(mode) >> 32))        \
+                     : : _tp_on);                                       \
+        if (0) {                                                        \
+_tp_on:         _tp = 1;                                                \
+        }                                                               \
+        _tp; })
+
+#define tpdbg(mode, ...)                                                \
+        do {                                                            \
+                if (tracepoint_active(mode)) {                          \
+                        dbg_print("%s", dbg_color(mode));               \
+                        dbg_print("%s:%d %s(): ",__FILE__, __LINE__, __func__); \
+                        dbg_print(__VA_ARGS__);                         \
+                        dbg_print("%s", _NORMAL_);                      \
+                }                                                       \
+        } while(0)
+
+#define tpdbgq(mode, ...)                                               \
+        do {                                                            \
+                if (tracepoint_active(mode)) {                          \
+                        dbg_print("%s", dbg_color(mode));               \
+                        dbg_print(__VA_ARGS__);                         \
+                        dbg_print("%s", _NORMAL_);                      \
+                }                                                       \
+        } while(0)
+
+#define tpdbginfo(mode, func, data)                                     \
+        do {                                                            \
+                if (tracepoint_active(mode)) {                          \
+                        dbg_print("%s", dbg_color(mode));               \
+                        dbg_printinfo(func, data);                      \
+                        dbg_print("%s", _NORMAL_);                      \
+                }                                                       \
+        } while(0)
+
+/**
+ * Turns every site on or off to match dbg_modes. dbg_init and
+ * dbg_add_mode call this.
+ */
+void tracepoint_sync(void);
+#else
+#define tracepoint_active(mode) 0
+#define tpdbg(mode, ...)
+#define tpdbgq(mode, ...)
+#define tpdbginfo(mode, func, data)
+#define tracepoint_sync()
+#endif
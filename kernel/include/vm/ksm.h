@@ -0,0 +1,36 @@
+#pragma once
+
+#include "types.h"
+
+struct mmobj;
+struct pframe;
+
+/*
+ * Same-page merging: ksmd finds pages of shadow objects (what private
+ * mappings have written) with the same contents, and keeps one copy of
+ * them, which the objects then only have a read-only reference to. A
+ * write to one of them goes through the usual copy-on-write, with
+ * shadow_fillpage copying the merged page and dropping the reference.
+ * None of these block.
+ */
+
+/* The page that page pagenum of o was merged into, or NULL if it was
+ * not (and always for objects that are not shadow objects) */
+struct pframe *ksm_lookup(struct mmobj *o, uint32_t pagenum);
+
+/* Drops the merged pages of o in [lopage, hipage) */
+void ksm_unmerge(struct mmobj *o, uint32_t lopage, uint32_t hipage);
+
+/* Drops all the merged pages of o, which is going away */
+void ksm_forget(struct mmobj *o);
+
+/*
+ * Before the pages of the shadow object from move up into to, which it
+ * is shadowed by and is to be taken out from under: frees the pages of
+ * from which to has a merged page in place of, and moves the merged
+ * pages of from which to has nothing in place of up into it. Returns 0,
+ * or -ENOMEM part way, in which case what moved is found first.
+ */
+int ksm_migrate(struct mmobj *from, struct mmobj *to);
+
+void ksmd_shutdown(void);
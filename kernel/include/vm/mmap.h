@@ -4,4 +4,8 @@ struct proc;
 struct vmarea;
 
 int do_munmap(void *addr, size_t len);
+int do_msync(void *addr, size_t len, int flags);
+int do_madvise(void *addr, size_t len, int advice);
+int do_mlock(void *addr, size_t len);
+int do_munlock(void *addr, size_t len);
 int do_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off, void **ret);
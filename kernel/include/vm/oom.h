@@ -0,0 +1,25 @@
+#pragma once
+
+/*
+ * The out-of-memory killer, for when memory cannot be had and waiting
+ * for it would wait forever: see vm/oom.c.
+ */
+
+/**
+ * Kills the process whose memory is most worth having back, unless one
+ * killed earlier is still on its way out.
+ *
+ * @param mayexit whether the caller holds nothing, so that if the
+ * current process is chosen it can exit here and now; otherwise it is
+ * only cancelled, and goes when it next leaves the kernel
+ * @return 0 if memory should be on its way back, or -ENOMEM if there was
+ * nobody to kill
+ */
+int oom_kill(int mayexit);
+
+/**
+ * Waits a while for the process oom_kill killed to exit, and then
+ * takes back what the kill let go of for it. Returns early if the
+ * caller is cancelled.
+ */
+void oom_wait(void);
@@ -8,4 +8,21 @@
 #define FAULT_RESERVED 0x08
 #define FAULT_EXEC     0x10
 
+/* What handle_pagefault had to do for a fault: fill a page with zeros
+ * (or map the zero page), map a page already in memory (a minor fault),
+ * read one in from a file or swap (a major fault), or copy one for a
+ * write to a private mapping. Counted by vmarea and by the counters
+ * vm.faults.zero and so on. */
+#define FAULT_ZERO     0
+#define FAULT_MINOR    1
+#define FAULT_MAJOR    2
+#define FAULT_COW      3
+#define FAULT_NKINDS   4
+
+/* Faults are also counted by how far down the area's shadow chain the
+ * page was found (or, for a page found nowhere, by the chain's length),
+ * the last bucket taking deeper ones too */
+#define FAULT_NDEPTHS  4
+
 void handle_pagefault(uintptr_t vaddr, uint32_t cause);
+int pagefault_populate(uint32_t lopage, uint32_t npages);
@@ -1,9 +1,18 @@
 #pragma once
 
+#include "mm/radix.h"
+
 struct mmobj;
 
 void shadow_init();
 struct mmobj *shadow_create(void);
 
-extern int shadow_count;
+/* The pages of the shadow object o which ksmd has merged, by page
+ * number; only vm/ksm.c looks in here. */
+radix_tree_t *shadow_merged(struct mmobj *o);
 
+/* The shadow object after o on the list of them all, the first if o is
+ * NULL, or NULL after the last. o must be reffed. Does not block. */
+struct mmobj *shadow_next(struct mmobj *o);
+
+extern int shadow_count;
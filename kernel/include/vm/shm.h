@@ -0,0 +1,14 @@
+#pragma once
+
+/*
+ * Opens the shared memory object with the given name, "/" and then no more
+ * than NAME_LEN characters without a slash, making it first if O_CREAT is
+ * given (and failing with -EEXIST if it is there already and O_EXCL is as
+ * well). oflags is O_RDONLY or O_RDWR, and O_TRUNC is accepted but does
+ * nothing, since objects have no length. Returns the new file descriptor,
+ * or -errno.
+ */
+int do_shm_open(const char *path, int oflags);
+
+/* Removes the name; the object goes once nothing has it open or mapped */
+int do_shm_unlink(const char *path);
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * The swap area, where anonymous pages go when pageoutd needs their page
+ * frames. It is SWAP_BLOCKS blocks of the disk numbered SWAP_DISK,
+ * starting at SWAP_FIRST_BLOCK (see config.h), so it can be a whole disk
+ * or a stretch of one kept out of the file system. Each block holds a
+ * page, and is called a slot.
+ *
+ * Without the disk, swap is kept compressed in memory instead (see
+ * vm/zram.h), as long as ZRAM_PAGES is not 0. It still has SWAP_BLOCKS
+ * slots, but none of them take up room until pages are written to them.
+ */
+
+/**
+ * Finds the swap area, if one is configured. Called once the disks have
+ * been registered.
+ */
+void swap_init(void);
+
+/**
+ * @return true if there is a swap area
+ */
+int swap_enabled(void);
+
+/**
+ * Reserves a slot. This does not block.
+ *
+ * @param slot where to store the slot
+ * @return 0 on success, or -ENOSPC if swap is full (or there is none)
+ */
+int swap_alloc(uint32_t *slot);
+
+/**
+ * Gives back a slot from swap_alloc. This does not block.
+ *
+ * @param slot the slot
+ */
+void swap_free(uint32_t slot);
+
+/**
+ * Says that what was written to a slot is out of date, since the page is
+ * about to change, so that compressed swap can give back the room it took
+ * up. This does not block.
+ *
+ * @param slot the slot
+ */
+void swap_discard(uint32_t slot);
+
+/**
+ * Reads a page out of a slot, or writes one into it. These block, unless
+ * swap is compressed.
+ *
+ * @param slot the slot
+ * @param page the page-aligned page
+ * @return 0 on success, -errno on failure; writing to compressed swap
+ * fails with -ENOSPC if the page is to be kept in memory instead
+ */
+int swap_read(uint32_t slot, void *page);
+int swap_write(uint32_t slot, const void *page);
@@ -1,19 +1,39 @@
 #pragma once
 
+#include "config.h"
 #include "types.h"
 
 #include "util/list.h"
 
+#include "mm/radix.h"
+
+#include "vm/pagefault.h"
+
 #define VMMAP_DIR_LOHI 1
 #define VMMAP_DIR_HILO 2
 
 struct mmobj;
+struct pframe;
+struct pagedir;
 struct proc;
 struct vnode;
 
+struct vmarea;
+
+/* The areas of a map are kept both on vmm_list, sorted by address, and in
+ * an AVL tree rooted at vmm_root, keyed by address and augmented with the
+ * largest free gap in each subtree, for lookups and range searches.
+ * vmm_cache holds the areas most recently returned by vmmap_lookup, most
+ * recent first; it is cleared whenever an area is added or removed.
+ * vmm_locked holds the pframe pinned for each page locked by mlock(2),
+ * by address, until munlock or munmap lets go of it. */
 typedef struct vmmap {
-        list_t       vmm_list;
-        struct proc *vmm_proc;
+        list_t         vmm_list;
+        struct vmarea *vmm_root;
+        struct vmarea *vmm_cache[VMMAP_CACHE_SIZE];
+        struct proc   *vmm_proc;
+        radix_tree_t   vmm_locked;   /* vfn -> pinned pframe */
+        uint32_t       vmm_nlocked;  /* pages in vmm_locked */
 } vmmap_t;
 
 /* make sure you understand why mapping boundaries are in terms of frame
@@ -25,13 +45,38 @@ typedef struct vmarea {
 
         int            vma_prot;     /* permissions on mapping */
         int            vma_flags;    /* either MAP_SHARED or MAP_PRIVATE */
+        int            vma_advice;   /* MADV_NORMAL, MADV_RANDOM or
+                                      * MADV_SEQUENTIAL, see madvise(2) */
 
         struct vmmap  *vma_vmmap;    /* address space that this area belongs to */
         struct mmobj  *vma_obj;      /* the vm object to read pages from */
         list_link_t    vma_plink;    /* link on process vmmap maps list */
-        list_link_t    vma_olink;    /* link on the list of all vm_areas
-                                      * having the same vm_object at the
-                                      * bottom of their chain */
+
+        /* Maintained by vmmap.c: */
+        uint32_t       vma_faults[FAULT_NKINDS];       /* by FAULT_ kind */
+        uint32_t       vma_fault_depths[FAULT_NDEPTHS];
+
+        struct vmarea *vma_left;     /* children and parent in vmm_root */
+        struct vmarea *vma_right;
+        struct vmarea *vma_parent;
+        int            vma_height;   /* height of this subtree */
+        uint32_t       vma_gap;      /* free pages between the area before
+                                      * this one (or USER_MEM_LOW) and this one */
+        uint32_t       vma_maxgap;   /* largest vma_gap in this subtree */
+
+        /* The areas having the same vm_object at the bottom of their
+         * chain are in an AVL tree rooted in that object, keyed by
+         * vma_off and augmented with the end of the furthest reaching
+         * area in each subtree, so that the areas which can map a page
+         * are found without looking at the others. Maintained by
+         * vmmap.c: */
+        struct mmobj  *vma_otree;    /* that object, or NULL if in no tree */
+        struct vmarea *vma_oleft;
+        struct vmarea *vma_oright;
+        struct vmarea *vma_oparent;
+        int            vma_oheight;
+        uint32_t       vma_omaxend;  /* largest vma_off + length of an area
+                                      * in this subtree */
 } vmarea_t;
 
 void vmmap_init(void);
@@ -41,13 +86,42 @@ void vmmap_destroy(vmmap_t *map);
 
 vmarea_t *vmmap_lookup(vmmap_t *map, uint32_t vfn);
 int vmmap_map(vmmap_t *map, struct vnode *file, uint32_t lopage, uint32_t npages, int prot, int flags, off_t off, int dir, vmarea_t **new);
+int vmmap_map_obj(vmmap_t *map, struct mmobj *obj, uint32_t lopage, uint32_t npages, int prot, int flags, off_t off, int dir, vmarea_t **new);
 int vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages);
+void vmmap_resize(vmmap_t *map, vmarea_t *vma, uint32_t end);
+vmarea_t *vmmap_grow_down(vmmap_t *map, uint32_t vfn);
+int vmmap_sync(vmmap_t *map, uint32_t lopage, uint32_t npages, int sync);
+int vmmap_advise(vmmap_t *map, uint32_t lopage, uint32_t npages, int advice);
+void vmmap_prefetch(vmmap_t *map, uint32_t lopage, uint32_t npages);
+void vmmap_dontneed(vmmap_t *map, uint32_t lopage, uint32_t npages);
+uint32_t vmmap_private_pages(vmmap_t *map, struct pagedir *pd);
 int vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages);
 int vmmap_find_range(vmmap_t *map, uint32_t npages, int dir);
 
 int vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count);
 int vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count);
+/* Like vmmap_write, but buf is a user address of the current process, which
+ * need not be the process whose map it is (exec copies this way from the
+ * old address space into the new one). */
+int vmmap_write_user(vmmap_t *map, void *vaddr, const void *ubuf, size_t count);
+/* For lending the pages of an address space without copying them */
+int vmmap_pin_pages(vmmap_t *map, uint32_t lopage, uint32_t npages, struct pframe **pfs,
+                    int forwrite);
+void vmmap_unpin_pages(struct pframe **pfs, uint32_t npages);
+/* For mlock(2) and munlock(2), see vmmap.c */
+int vmmap_lock(vmmap_t *map, uint32_t lopage, uint32_t npages);
+void vmmap_unlock(vmmap_t *map, uint32_t lopage, uint32_t npages);
+uint32_t vmmap_locked_pages(vmmap_t *map, uint32_t lopage, uint32_t npages);
 
 vmmap_t *vmmap_clone(vmmap_t *map);
 
+void vmarea_obj_insert(struct mmobj *bottom, vmarea_t *vma);
+void vmarea_obj_remove(vmarea_t *vma);
+/* Calls func on each area that maps page pagenum of o or of the objects
+ * shadowing it, with the address it would be mapped at in the area.
+ * func must not add or remove areas. */
+void vmarea_obj_walk(struct mmobj *o, uint32_t pagenum,
+                     void (*func)(vmarea_t *vma, uintptr_t vaddr, void *arg),
+                     void *arg);
+
 size_t vmmap_mapping_info(const void *map, char *buf, size_t size);
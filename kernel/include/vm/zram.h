@@ -0,0 +1,40 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * A swap area in memory, for when there is no swap disk: each page put
+ * in a slot is compressed (see util/lz4.h) and packed in with others into
+ * pages of its own, so that cold anonymous memory takes up less room
+ * without any I/O. It never takes more than ZRAM_PAGES pages (see
+ * config.h). Slots are the swap layer's (see vm/swap.h), which hands these
+ * out. None of these block.
+ */
+
+/**
+ * Sets up the store for nslots slots.
+ *
+ * @return 0, or -ENOMEM
+ */
+int zram_init(uint32_t nslots);
+
+/**
+ * Compresses a page into a slot, in place of whatever was there.
+ *
+ * @return 0, or -ENOSPC if the page does not compress well enough to be
+ * worth keeping this way, or there is no room for it, in which case the
+ * slot is left empty
+ */
+int zram_write(uint32_t slot, const void *page);
+
+/**
+ * Decompresses what was last written to a slot into a page.
+ *
+ * @return 0, or -EIO if the slot is empty
+ */
+int zram_read(uint32_t slot, void *page);
+
+/**
+ * Empties a slot, giving back the room what was in it took up.
+ */
+void zram_discard(uint32_t slot);
@@ -84,14 +84,15 @@ static struct rsd_table *rsd_table;
  * that memory, returning the new virtual address for that table */
 static void *_acpi_load_table(uintptr_t paddr)
 {
-        struct acpi_header *tmp =
-                (struct acpi_header *)(pt_phys_tmp_map((uintptr_t)PAGE_ALIGN_DOWN(paddr)) + (PAGE_OFFSET(paddr)));
+        uintptr_t page = kmap((uintptr_t)PAGE_ALIGN_DOWN(paddr));
+        struct acpi_header *tmp = (struct acpi_header *)(page + PAGE_OFFSET(paddr));
 
         /* this function is not designed to handle tables which
          * cross page boundaries */
         KASSERT(PAGE_OFFSET(paddr) + tmp->ah_size < PAGE_SIZE);
         struct acpi_header *table = kmalloc(tmp->ah_size);
         memcpy(table, tmp, tmp->ah_size);
+        kunmap(page);
         return (void *)table;
 }
 
@@ -103,7 +104,7 @@ void acpi_init()
         KASSERT(NULL != rsd_ptr && "Could not find the ACPI Root Descriptor Table.");
 
         /* use the RSDP to find the RSDT, which will probably be in unmapped physical
-         * memory, therefore we must use the phys_tmp_map functionallity of page tables */
+         * memory, therefore we must use the kmap functionallity of page tables */
         rsd_table = _acpi_load_table(rsd_ptr->rp_addr);
         KASSERT(RSDT_SIGNATURE == rsd_table->rt_header.ah_sign);
 	/* Only support ACPI version 1.0 */
@@ -14,6 +14,14 @@
 #define TYPE_LAPIC 0
 #define TYPE_IOAPIC 1
 
+/* Most processors we keep track of from the ACPI tables */
+#define APIC_MAX_CPUS 32
+
+/* Message-signalled interrupts are writes to this window, which the local
+ * APIC named in the address takes as an interrupt */
+#define MSI_ADDRESS_BASE 0xfee00000
+#define MSI_ADDRESS_DEST_SHIFT 12
+
 /* For disabling interrupts on the 8259 PIC, it needs to be
  * disabled to use the APIC
  */
@@ -130,9 +138,13 @@ struct ioapic_table {
 };
 
 static struct apic_table *apic = NULL;
-static struct lapic_table *lapic = NULL;
+static struct lapic_table *lapic = NULL; /* the bootstrap processor's */
 static struct ioapic_table *ioapic = NULL;
 
+/* every enabled processor in the ACPI tables */
+static struct lapic_table *lapics[APIC_MAX_CPUS];
+static int apic_ncpus = 0;
+
 
 static uint32_t __lapic_getid(void)
 {
@@ -285,6 +297,70 @@ void apic_enable_periodic_timer(uint32_t freq) {
 	*(uint32_t*)(apic->at_addr + LOCAL_APIC_TMRDIV) = 0x03;
 }
 
+/* APIC timer counts per millisecond with a divider of 16, measured against
+ * the PIT by apic_calibrate_timer */
+static uint32_t apic_tmr_per_ms = 0;
+/* and how many times the time stamp counter ticks, over the same 10ms */
+static uint32_t apic_tsc_ms = 0;
+
+static void apic_calibrate_timer() {
+	uint32_t tmp;
+	uint64_t tsc;
+
+	*(uint32_t*)(apic->at_addr + LOCAL_APIC_TMRDIV) = 0x03;
+	/* count down from -1, masked, while PIT channel 2 counts
+	 * 0x2e9b ticks of 1.193182MHz in one-shot mode, 10ms */
+	*(uint32_t*)(apic->at_addr + LOCAL_APIC_LVT_TMR) = LOCAL_APIC_DISABLE;
+	outb(0x61, (inb(0x61) & 0xfd) | 1);
+	outb(0x43, 0xb2);
+	outb(0x42, 0x9b);
+	inb(0x60);
+	outb(0x42, 0x2e);
+
+	tmp = (uint32_t)(inb(0x61) & 0xfe);
+	outb(0x61, (uint8_t)tmp);
+	outb(0x61, (uint8_t)tmp | 1);
+	*(uint32_t*)(apic->at_addr + LOCAL_APIC_TMRINITCNT) = 0xffffffff;
+	tsc = cpuid_rdtsc();
+	while(!(inb(0x61) & 0x20));
+	tmp = 0xffffffff - *(volatile uint32_t*)(apic->at_addr + LOCAL_APIC_TMRCURRCNT);
+	tsc = cpuid_rdtsc() - tsc;
+	*(uint32_t*)(apic->at_addr + LOCAL_APIC_TMRINITCNT) = 0;
+
+	apic_tmr_per_ms = (tmp / 10) ? (tmp / 10) : 1;
+	apic_tsc_ms = (uint32_t)(tsc / 10) ? (uint32_t)(tsc / 10) : 1;
+	dbgq(DBG_CORE, "APIC Timer counts per ms: %u\n", apic_tmr_per_ms);
+	dbgq(DBG_CORE, "TSC counts per ms: %u\n", apic_tsc_ms);
+}
+
+uint32_t apic_tsc_per_ms() {
+	if (0 == apic_tmr_per_ms) {
+		apic_calibrate_timer();
+	}
+	return apic_tsc_ms;
+}
+
+void apic_start_oneshot_timer(uint32_t msecs) {
+	if (0 == apic_tmr_per_ms) {
+		apic_calibrate_timer();
+	}
+	if (msecs > 0xffffffff / apic_tmr_per_ms) {
+		msecs = 0xffffffff / apic_tmr_per_ms;
+	}
+	/* one-shot is the LVT timer mode with the periodic bit clear */
+	*(uint32_t*)(apic->at_addr + LOCAL_APIC_LVT_TMR) = 32;
+	*(uint32_t*)(apic->at_addr + LOCAL_APIC_TMRDIV) = 0x03;
+	*(uint32_t*)(apic->at_addr + LOCAL_APIC_TMRINITCNT) = msecs * apic_tmr_per_ms;
+}
+
+uint32_t apic_oneshot_remaining() {
+	if (0 == apic_tmr_per_ms) {
+		return 0;
+	}
+	uint32_t count = *(volatile uint32_t*)(apic->at_addr + LOCAL_APIC_TMRCURRCNT);
+	return count / apic_tmr_per_ms + (count % apic_tmr_per_ms ? 1 : 0);
+}
+
 static void apic_disable_8259() {
 	dbgq(DBG_CORE, "--- DISABLE 8259 PIC ---\n");
   /* disable 8259 PICs by initializing them and masking all interrupts */
@@ -325,24 +401,29 @@ void apic_init()
         KASSERT(PAGE_ALIGNED(apic->at_addr));
         apic->at_addr = pt_phys_perm_map(apic->at_addr, 1);
 
-        /* Get the tables for the local APIC and IO APICS,
-         * Weenix currently only supports one of each, in order
-         * to enforce this a KASSERT will fail this if more than one
-         * of each type is found */
-        uint8_t off = sizeof(*apic);
+        /* Get the tables for the local APICs and IO APICS. There is
+         * one local APIC per processor; Weenix runs on the bootstrap
+         * processor only, leaving the others unstarted, and supports
+         * a single IO APIC, in order to enforce this a KASSERT will
+         * fail this if more than one IO APIC is found */
+        uint32_t off = sizeof(*apic);
         while (off < apic->at_header.ah_size) {
                 uint8_t type = *(ptr + off);
                 uint8_t size = *(ptr + off + 1);
                 if (TYPE_LAPIC == type) {
+                        struct lapic_table *cpu = (struct lapic_table *)(ptr + off);
                         KASSERT(apic_exists() && "Local APIC does not exist");
                         KASSERT(sizeof(struct lapic_table) == size);
-                        KASSERT(NULL == lapic && "Weenix only supports a single local APIC");
-                        lapic = (struct lapic_table *)(ptr + off);
                         dbgq(DBG_CORE, "LAPIC:\n");
-                        dbgq(DBG_CORE, "   id:         0x%.2x\n", (uint32_t)lapic->at_apicid);
-                        dbgq(DBG_CORE, "   processor:  0x%.3x\n", (uint32_t)lapic->at_procid);
-                        dbgq(DBG_CORE, "   enabled:    %i\n", lapic->at_flags & 0x1);
-                        KASSERT(lapic->at_flags & 0x1 && "The local APIC is disabled");
+                        dbgq(DBG_CORE, "   id:         0x%.2x\n", (uint32_t)cpu->at_apicid);
+                        dbgq(DBG_CORE, "   processor:  0x%.3x\n", (uint32_t)cpu->at_procid);
+                        dbgq(DBG_CORE, "   enabled:    %i\n", cpu->at_flags & 0x1);
+                        if ((cpu->at_flags & 0x1) && APIC_MAX_CPUS > apic_ncpus) {
+                                lapics[apic_ncpus++] = cpu;
+                                if (cpu->at_apicid == __lapic_getid()) {
+                                        lapic = cpu;
+                                }
+                        }
                 } else if (TYPE_IOAPIC == type) {
                         KASSERT(apic_exists() && "IO APIC does not exist");
                         KASSERT(sizeof(struct ioapic_table) == size);
@@ -359,8 +440,10 @@ void apic_init()
                 }
                 off += size;
         }
-        KASSERT(NULL != lapic && "Could not find a local APIC device");
+        KASSERT(NULL != lapic && "Could not find the bootstrap processor's local APIC");
         KASSERT(NULL != ioapic && "Could not find an IO APIC");
+        dbgq(DBG_CORE, "%d processor(s), running on local APIC 0x%.2x only\n",
+             apic_ncpus, (uint32_t)lapic->at_apicid);
 
 	dbgq(DBG_CORE, "--- Enabling APIC ---\n");
 	apic_enable();
@@ -375,6 +458,19 @@ void apic_init()
 
 }
 
+int apic_cpu_count()
+{
+        return apic_ncpus;
+}
+
+void apic_msi_message(uint8_t intr, uint32_t *addr, uint32_t *data)
+{
+        KASSERT(NULL != lapic);
+        /* fixed delivery, physical destination, edge triggered */
+        *addr = MSI_ADDRESS_BASE | ((uint32_t)lapic->at_apicid << MSI_ADDRESS_DEST_SHIFT);
+        *data = intr;
+}
+
 uint8_t apic_getipl()
 {
         return LAPICTPR & 0xff;
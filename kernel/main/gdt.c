@@ -1,4 +1,7 @@
+#include "kernel.h"
+
 #include "main/gdt.h"
+#include "main/cpuid.h"
 
 #include "util/printf.h"
 #include "util/debug.h"
@@ -47,6 +50,12 @@ struct gdt_location {
         uint32_t gl_offset;
 } __attribute__((packed));
 
+#define MSR_SYSENTER_CS  0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+extern char __intr_sysenter[];
+
 static struct gdt_entry gdt[GDT_COUNT];
 static struct tss_entry tss;
 static struct gdt_location gdtl = {
@@ -78,6 +87,19 @@ void gdt_init(void)
 
         int segment = GDT_TSS;
         __asm__ volatile("ltr %0" :: "m"(segment));
+
+        /* sysenter needs the kernel code segment to be followed by the
+         * kernel data, user code and user data segments, as they are.
+         * It starts __intr_sysenter on a "stack" at ts_esp0, from which
+         * the real kernel stack pointer is loaded, so that nothing needs
+         * updating on a context switch beyond what interrupts need. */
+        uint32_t eax, edx;
+        cpuid(CPUID_GETFEATURES, &eax, &edx);
+        if (edx & CPUID_FEAT_EDX_SEP) {
+                cpuid_set_msr(MSR_SYSENTER_CS, GDT_KERNEL_TEXT, 0);
+                cpuid_set_msr(MSR_SYSENTER_ESP, (uint32_t)&tss.ts_esp0, 0);
+                cpuid_set_msr(MSR_SYSENTER_EIP, (uint32_t)__intr_sysenter, 0);
+        }
 }
 
 void gdt_set_kernel_stack(void *addr)
@@ -1,3 +1,4 @@
+#include "config.h"
 #include "types.h"
 
 #include "util/debug.h"
@@ -7,6 +8,13 @@
 #include "main/apic.h"
 #include "main/interrupt.h"
 #include "main/gdt.h"
+#include "main/softirq.h"
+
+#include "mm/page.h"
+
+#include "proc/sched.h"
+
+#include "api/syscall.h"
 
 #define MAX_INTERRUPTS          256
 
@@ -36,7 +44,7 @@
                 "movl %ss, %edx\n\t"                    \
                 "movl %edx, %ds\n\t"                    \
                 "movl %edx, %es\n\t"                    \
-                "call __intr_handler\n\t"               \
+                "call __intr_entry\n\t"                 \
                 "pop %es\n\t"                           \
                 "pop %ds\n\t"                           \
                 "popa\n\t"                              \
@@ -57,7 +65,7 @@
                 "movl %ss, %edx\n\t"                    \
                 "movl %edx, %ds\n\t"                    \
                 "movl %edx, %es\n\t"                    \
-                "call __intr_handler\n\t"               \
+                "call __intr_entry\n\t"                 \
                 "pop %es\n\t"                           \
                 "pop %ds\n\t"                           \
                 "popa\n\t"                              \
@@ -322,6 +330,78 @@ INTR_NOERRCODE(253)
 INTR_NOERRCODE(254)
 INTR_NOERRCODE(255)
 
+/* The sysenter entry point for system calls (see gdt_init). The processor
+ * arrives here with interrupts disabled and nothing pushed, on a stack
+ * whose top word is the TSS's kernel stack pointer. The userland stub
+ * (see user/include/weenix/trap.h) passes the syscall number and argument
+ * in %eax and %edx as for int $INTR_SYSCALL, its stack pointer in %ecx and
+ * where to return to in %esi. This builds the regs_t the syscall
+ * interrupt would have, so that __intr_handler and everything after it
+ * (fork, execve, returning through iret) cannot tell the difference, and
+ * leaves with sysexit, which takes the return address in %edx and the
+ * stack pointer in %ecx. */
+__asm__ (
+        ".global __intr_sysenter\n"
+        "__intr_sysenter:\n\t"
+        "movl (%esp), %esp\n\t"
+        "pushl $(" QUOTE(GDT_USER_DATA) " | 3)\n\t"
+        "pushl %ecx\n\t"
+        "pushfl\n\t"
+        "orl $0x200, (%esp)\n\t"      /* interrupts were on in userland */
+        "pushl $(" QUOTE(GDT_USER_TEXT) " | 3)\n\t"
+        "pushl %esi\n\t"
+        "push $0\n\t"
+        "push $" QUOTE(INTR_SYSCALL) "\n\t"
+        "pusha\n\t"
+        "push %ds\n\t"
+        "push %es\n\t"
+        "movl %ss, %edx\n\t"
+        "movl %edx, %ds\n\t"
+        "movl %edx, %es\n\t"
+        "sti\n\t"
+        "call __intr_entry\n\t"
+        "cli\n\t"
+        "pop %es\n\t"
+        "pop %ds\n\t"
+        "popa\n\t"
+        "add $8, %esp\n\t"
+        "popl %edx\n\t"               /* eip */
+        "add $4, %esp\n\t"            /* cs */
+        "andl $~0x200, (%esp)\n\t"
+        "popfl\n\t"
+        "popl %ecx\n\t"               /* esp */
+        "add $4, %esp\n\t"            /* ss */
+        "sti\n\t"                     /* takes effect after sysexit */
+        "sysexit\n"
+);
+
+/* Every stub above comes here with the regs_t it built just above the
+ * return address. An interrupt taken in the kernel would otherwise run
+ * its handler, and the softirqs after it, on top of whatever the thread
+ * it interrupted had on its stack, so that every thread stack had to
+ * leave room for them; here it moves to intr_stack instead (see
+ * __intr_stack), and back once __intr_handler returns. */
+__asm__ (
+        ".global __intr_entry\n"
+        "__intr_entry:\n\t"
+        "pushl %ebx\n\t"
+        "pushl %esi\n\t"
+        "leal 12(%esp), %ebx\n\t"   /* the regs_t */
+        "movl %esp, %esi\n\t"
+        "pushl %ebx\n\t"
+        "call __intr_stack\n\t"
+        "testl %eax, %eax\n\t"
+        "jz 1f\n\t"
+        "movl %eax, %esp\n"
+        "1:\n\t"
+        "pushl %ebx\n\t"
+        "call __intr_handler\n\t"
+        "movl %esi, %esp\n\t"
+        "popl %esi\n\t"
+        "popl %ebx\n\t"
+        "ret\n"
+);
+
 typedef struct intr_desc {
         uint16_t baselo;
         uint16_t selector;
@@ -369,21 +449,83 @@ int32_t intr_map(uint16_t irq, uint8_t intr)
         return oldirq;
 }
 
-static __attribute__((used)) void __intr_handler(regs_t regs)
+int32_t intr_map_msi(uint8_t intr)
+{
+        KASSERT(INTR_SPURIOUS != intr);
+
+        int32_t oldirq = intr_mappings[intr];
+        intr_mappings[intr] = IRQ_MSI;
+        return oldirq;
+}
+
+/* The stack hardware interrupts taken in the kernel run on. There is
+ * one CPU, and so one of these. */
+static char intr_stack[INTR_STACK_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+int intr_on_stack(uintptr_t addr)
+{
+        return addr >= (uintptr_t)intr_stack
+               && addr < (uintptr_t)intr_stack + INTR_STACK_SIZE;
+}
+
+/* Returns the top of intr_stack if the handler for regs should move
+ * there, or 0 if it should stay on the stack it came in on. Traps from
+ * userland come in at the top of the thread's own stack already, and may
+ * sleep or switch threads (syscalls, page faults, preemption), as may
+ * the exceptions below 32, so all of those stay. What is left are device
+ * and timer interrupts, which never sleep, and so are done with
+ * intr_stack by the time the thread they interrupted runs again; those
+ * interrupting one of them are already on it. */
+static __attribute__((used)) uintptr_t __intr_stack(regs_t *regs)
+{
+        uintptr_t sp = (uintptr_t)regs;
+
+        if ((regs->r_cs & 0x3) == 0x3 || regs->r_intr < 32
+            || INTR_SYSCALL == regs->r_intr) {
+                return 0;
+        }
+        if (intr_on_stack(sp)) {
+                return 0;
+        }
+        return (uintptr_t)intr_stack + INTR_STACK_SIZE;
+}
+
+static __attribute__((used)) void __intr_handler(regs_t *regs)
 {
-        intr_handler_t handler = intr_handlers[regs.r_intr];
-        _intr_regs = &regs;
+        intr_handler_t handler = intr_handlers[regs->r_intr];
+
+        if ((regs->r_cs & 0x3) == 0x3) {
+                sched_acct_trap();
+        }
+        _intr_regs = regs;
         if (NULL != handler) {
-                handler(&regs);
+                handler(regs);
         } else {
-                panic("Unhandled interrupt 0x%x\n", regs.r_intr);
+                panic("Unhandled interrupt 0x%x\n", regs->r_intr);
         }
 
-        if (0 <= intr_mappings[regs.r_intr]) {
+        if (0 <= intr_mappings[regs->r_intr]) {
                 apic_eoi();
         }
 
         _intr_regs = NULL;
+
+        /* Bottom halves run as though they were interrupting what this
+         * interrupt did, and so not if it had interrupts disabled */
+        if (regs->r_eflags & 0x200) {
+                softirq_run();
+        }
+
+#ifdef __UPREEMPT__
+        /* kernel code is never preempted, only threads about to return
+         * to userland which have run out of time */
+        if ((regs->r_cs & 0x3) == 0x3) {
+                sched_preempt();
+        }
+#endif
+        if ((regs->r_cs & 0x3) == 0x3) {
+                sched_acct_untrap();
+        }
 }
 
 static void __intr_divide_by_zero_handler(regs_t *regs)
@@ -17,6 +17,8 @@
 #include "vm/shadowd.h"
 #include "vm/shadow.h"
 #include "vm/anon.h"
+#include "vm/ksm.h"
+#include "vm/swap.h"
 
 #include "main/acpi.h"
 #include "main/apic.h"
@@ -26,13 +28,17 @@
 #include "proc/sched.h"
 #include "proc/proc.h"
 #include "proc/kthread.h"
+#include "proc/workq.h"
 
 #include "drivers/dev.h"
 #include "drivers/blockdev.h"
 #include "drivers/disk/ata.h"
 #include "drivers/tty/virtterm.h"
+#include "drivers/tty/serial.h"
 #include "drivers/pci.h"
 
+#include "net/net.h"
+
 #include "api/exec.h"
 #include "api/syscall.h"
 
@@ -99,6 +105,9 @@ kmain()
 #ifdef __DRIVERS__
         bytedev_init();
         blockdev_init();
+#ifdef __VM__
+        swap_init();
+#endif
 #endif
 
         void *bstack = page_alloc();
@@ -190,6 +199,8 @@ idleproc_run(int arg1, void *arg2)
         /*still need to figure out how to set the vnode for special device*/
         do_mknod("/dev/null", S_IFCHR, MEM_NULL_DEVID);
         do_mknod("/dev/zero", S_IFCHR, MEM_ZERO_DEVID);
+        do_mknod("/dev/counters", S_IFCHR, MEM_COUNTERS_DEVID);
+        do_mknod("/dev/blktrace", S_IFCHR, MEM_BLKTRACE_DEVID);
         int nterms = vt_num_terminals();
         int i = 0;
         char *path = "/dev/tty0";
@@ -197,6 +208,12 @@ idleproc_run(int arg1, void *arg2)
             path[8] = '0' + i;
             do_mknod((const char *)path, S_IFCHR, MKDEVID(2, i));
         }
+        /*the serial terminals come after the virtual ones*/
+        char spath[] = "/dev/ttyS0";
+        for (i = 0 ; i < serial_num_terminals() ; i++) {
+            spath[9] = '0' + i;
+            do_mknod(spath, S_IFCHR, MKDEVID(2, nterms + i));
+        }
 #endif
 
         /* Finally, enable interrupts (we want to make sure interrupts
@@ -216,6 +233,19 @@ idleproc_run(int arg1, void *arg2)
         kthread_reapd_shutdown();
 #endif
 
+        /* Stop the workers once whatever is queued has run */
+        workq_shutdown();
+
+#ifdef __DRIVERS__
+        /* Nothing is left to take in what the network devices receive */
+        netdev_shutdown();
+#endif
+
+
+#ifdef __VM__
+        /* ksmd lets go of the objects it was scanning */
+        ksmd_shutdown();
+#endif
 
 #ifdef __SHADOWD__
         /* wait for shadowd to shutdown */
@@ -236,6 +266,12 @@ idleproc_run(int arg1, void *arg2)
         pframe_shutdown();
 #endif
 
+#ifdef __DRIVERS__
+        /* Stop the block device I/O threads now that nothing is left to
+         * write back */
+        blockdev_shutdown();
+#endif
+
         dbg_print("\nweenix: halted cleanly!\n");
         GDB_CALL_HOOK(shutdown);
         hard_shutdown();
@@ -0,0 +1,85 @@
+#include "kernel.h"
+#include "types.h"
+
+#include "main/interrupt.h"
+#include "main/softirq.h"
+
+#include "util/debug.h"
+
+/*
+ * How many times softirq_run goes back for softirqs raised while it ran
+ * before leaving them for the next interrupt, so that a softirq which
+ * keeps being raised cannot keep the interrupted thread from running.
+ */
+#define SOFTIRQ_ROUNDS  4
+
+static softirq_func_t softirq_funcs[NSOFTIRQS];
+static volatile uint32_t softirq_pending;
+static int softirq_active;
+
+/* Saves whether interrupts were enabled and disables them */
+static inline uint32_t
+softirq_save(void)
+{
+        uint32_t flags;
+        __asm__ volatile("pushfl\n\t"
+                         "popl %0\n\t"
+                         "cli"
+                         : "=r"(flags) : : "memory");
+        return flags;
+}
+
+static inline void
+softirq_restore(uint32_t flags)
+{
+        __asm__ volatile("pushl %0\n\t"
+                         "popfl"
+                         : : "r"(flags) : "memory", "cc");
+}
+
+void
+softirq_register(int nr, softirq_func_t func)
+{
+        KASSERT(0 <= nr && nr < NSOFTIRQS);
+        KASSERT(NULL == softirq_funcs[nr]);
+        softirq_funcs[nr] = func;
+}
+
+void
+softirq_raise(int nr)
+{
+        KASSERT(0 <= nr && nr < NSOFTIRQS);
+        /* one instruction, so no interrupt can come in the middle */
+        __asm__ volatile("orl %1, %0"
+                         : "+m"(softirq_pending)
+                         : "r"(1U << nr)
+                         : "memory", "cc");
+}
+
+void
+softirq_run(void)
+{
+        uint32_t flags = softirq_save();
+        int rounds;
+
+        if (softirq_active || 0 == softirq_pending || IPL_LOW != intr_getipl()) {
+                softirq_restore(flags);
+                return;
+        }
+
+        softirq_active = 1;
+        for (rounds = 0; rounds < SOFTIRQ_ROUNDS && 0 != softirq_pending; rounds++) {
+                uint32_t pending = softirq_pending;
+                int nr;
+
+                softirq_pending = 0;
+                intr_enable();
+                for (nr = 0; nr < NSOFTIRQS; nr++) {
+                        if ((pending & (1U << nr)) && NULL != softirq_funcs[nr])
+                                softirq_funcs[nr]();
+                }
+                intr_disable();
+        }
+        softirq_active = 0;
+        softirq_restore(flags);
+}
@@ -1,18 +1,25 @@
 #include "types.h"
 #include "kernel.h"
+#include "limits.h"
 
 #include "mm/mm.h"
 #include "mm/page.h"
+#include "mm/pagetable.h"
 #include "mm/slab.h"
+#include "mm/pframe.h"
+
+#include "main/cpuid.h"
 
 #include "util/gdb.h"
 #include "util/bits.h"
 #include "util/list.h"
 #include "util/debug.h"
 #include "util/string.h"
+#include "util/init.h"
 
 #include "vm/shadowd.h"
 
+#include "proc/context.h"
 #include "proc/sched.h"
 
 GDB_DEFINE_HOOK(page_alloc, void *addr, int npages)
@@ -21,9 +28,28 @@ GDB_DEFINE_HOOK(page_free, void *addr, int npages)
 static list_t pagegroup_list;
 static uintptr_t page_freecount;
 
+/*
+ * To keep multi-page allocations possible once memory has been in use for
+ * a while, memory is divided into blocks of the largest order, each of
+ * them meant for either unmovable pages (kernel memory, which stays where
+ * it is until it is freed) or movable ones (page frames, which
+ * _page_compact can move elsewhere), and each group keeps free lists for
+ * the two kinds apart. An allocation takes from blocks of its own kind
+ * first and only falls back on the other kind when there is nothing else,
+ * taking the biggest free block there is so as to mix them as little as
+ * possible, and a whole block which is taken over changes kind. The
+ * unmovable pages thus stay together, and the movable ones around them
+ * can be moved out of the way of a multi-page allocation.
+ */
+#define PAGE_BLOCK_ORDER        (PAGE_NSIZES - 1)
+#define PAGE_OTHER_TYPE(type)   (PAGE_NTYPES - 1 - (type))
+
 struct pagegroup {
-        list_t       pg_freelist[PAGE_NSIZES];
+        list_t       pg_freelist[PAGE_NTYPES][PAGE_NSIZES];
         void        *pg_map[PAGE_NSIZES];
+        uint8_t     *pg_type;       /* the kind of each block */
+        uint8_t     *pg_order;      /* 1 + the order of the free block
+                                     * starting at each page, or 0 */
         uintptr_t    pg_baseaddr;
         uintptr_t    pg_endaddr;
         list_link_t  pg_link;
@@ -33,6 +59,73 @@ struct freepage {
         list_link_t fp_link;
 };
 
+/* The index of the page at addr within its group */
+#define _pagegroup_pn(group, addr) \
+        (((uintptr_t)(addr) - (group)->pg_baseaddr) >> PAGE_SHIFT)
+
+/* The kind of the largest block the page at addr is in */
+#define _pagegroup_type(group, addr) \
+        ((group)->pg_type[_pagegroup_pn(group, addr) >> PAGE_BLOCK_ORDER])
+
+static inline void
+_pagegroup_free_insert(struct pagegroup *group, int type, uint32_t order, uintptr_t addr)
+{
+        list_insert_head(&group->pg_freelist[type][order], &((struct freepage *)addr)->fp_link);
+        group->pg_order[_pagegroup_pn(group, addr)] = order + 1;
+}
+
+static inline void
+_pagegroup_free_remove(struct pagegroup *group, uintptr_t addr)
+{
+        list_remove(&((struct freepage *)addr)->fp_link);
+        group->pg_order[_pagegroup_pn(group, addr)] = 0;
+}
+
+/*
+ * Single pages are allocated and freed far more often than anything else,
+ * so they go through a cache of free pages in front of the buddy lists.
+ * Freed pages go on the head of the cache and are handed out from there
+ * first, since they are the most likely to still be in the CPU cache; when
+ * the cache grows past PAGE_CACHE_HIGH pages, PAGE_CACHE_BATCH of the
+ * coldest pages (from the tail) go back to the buddy lists together, and
+ * an empty cache is refilled with a batch from the buddy lists. There is a
+ * cache for each kind of page, and only one of each since there is a
+ * single CPU. Cached pages are counted in page_freecount.
+ */
+#define PAGE_CACHE_HIGH         64
+#define PAGE_CACHE_BATCH        16
+
+static list_t page_cache[PAGE_NTYPES];
+static uint32_t page_cache_count[PAGE_NTYPES];
+
+/*
+ * Pages which the scheduler zeroed while there was nothing to run, for
+ * page_alloc_movable_zeroed to hand out without zeroing them then. They
+ * are free movable pages, counted in page_freecount, and
+ * page_alloc_movable takes them too once there are no others to be had.
+ */
+#define PAGE_ZEROED_MAX         64
+
+static list_t page_zeroed;
+static uint32_t page_zeroed_count;
+
+/*
+ * High memory, past the end of what the kernel maps directly, is handed
+ * out a page at a time by physical address. Freed pages go on a stack
+ * threaded through the pages themselves, each holding the address of the
+ * next (written and read through kmap_atomic); the pages above
+ * highmem_next have never been handed out, so nothing needs doing for
+ * them at boot.
+ */
+static uintptr_t highmem_start;
+static uintptr_t highmem_end;
+static uintptr_t highmem_next;
+static uintptr_t highmem_stack;         /* the last page freed, or 0 */
+static uint32_t highmem_freecount;
+
+static void *_page_alloc_order(uint32_t order, int type);
+static void _page_free_order(void *addr, int order);
+
 static struct pagegroup *
 _pagegroup_create(uintptr_t start, uintptr_t end)
 {
@@ -52,7 +145,7 @@ _pagegroup_create(uintptr_t start, uintptr_t end)
          * we allocate enough bits to track all pages even
          * though some pages will be unavailable since they
          * are being used as bitmaps */
-        int order;
+        int order, type;
         for (order = 1; order < PAGE_NSIZES; ++order) {
                 uintptr_t count = npages >> order;
                 count = ((count - 1) & ~((uintptr_t)0x7)) + 8;
@@ -62,28 +155,39 @@ _pagegroup_create(uintptr_t start, uintptr_t end)
                 memset(group->pg_map[order], 0, count);
         }
 
+        /* and for the orders of the free blocks and the kinds of the
+         * largest blocks, all of which start out movable */
+        end -= npages;
+        group->pg_order = (uint8_t *)end;
+        memset(group->pg_order, 0, npages);
+        end -= (npages >> PAGE_BLOCK_ORDER) + 1;
+        group->pg_type = (uint8_t *)end;
+        memset(group->pg_type, PAGE_MOVABLE, (npages >> PAGE_BLOCK_ORDER) + 1);
+
         /* discard the remainder of the page being used for
          * mappings and read just npages */
         end = (uintptr_t)PAGE_ALIGN_DOWN(end);
         npages = (end - start) >> PAGE_SHIFT;
         group->pg_endaddr = end;
 
+        for (type = 0; type < PAGE_NTYPES; ++type)
+                for (order = 0; order < PAGE_NSIZES; ++order)
+                        list_init(&group->pg_freelist[type][order]);
+
         /* put pages which do not fit nicely into the largest
          * order and add them to smaller buckets */
         for (order = 0; order < PAGE_NSIZES - 1; ++order) {
-                list_init(&group->pg_freelist[order]);
                 if (npages & (1 << order)) {
                         end -= (1 << order) << PAGE_SHIFT;
-                        list_insert_head(&group->pg_freelist[order], &((struct freepage *)end)->fp_link);
+                        _pagegroup_free_insert(group, PAGE_MOVABLE, order, end);
                 }
         }
 
         /* put the remaining pages into the largest bucket */
         KASSERT(0 == (end - start) % (1 << order));
-        list_init(&group->pg_freelist[order]);
         uintptr_t current = start;
         while (current < end) {
-                list_insert_head(&group->pg_freelist[order], &((struct freepage *)current)->fp_link);
+                _pagegroup_free_insert(group, PAGE_MOVABLE, order, current);
                 current += (1 << order) << PAGE_SHIFT;
         }
 
@@ -106,6 +210,12 @@ page_init()
 {
         list_init(&pagegroup_list);
         page_freecount = 0;
+        list_init(&page_cache[PAGE_UNMOVABLE]);
+        list_init(&page_cache[PAGE_MOVABLE]);
+        list_init(&page_zeroed);
+        page_cache_count[PAGE_UNMOVABLE] = 0;
+        page_cache_count[PAGE_MOVABLE] = 0;
+        page_zeroed_count = 0;
 }
 
 void
@@ -124,6 +234,75 @@ page_add_range(uintptr_t start, uintptr_t end)
         }
 }
 
+void
+page_add_highmem(uintptr_t pstart, uintptr_t pend)
+{
+        KASSERT(0 == highmem_end && "only one high memory range");
+
+        pstart = (uintptr_t)PAGE_ALIGN_UP(pstart);
+        pend = (uintptr_t)PAGE_ALIGN_DOWN(pend);
+        if (pstart >= pend)
+                return;
+        dbgq(DBG_MM, "Page System adding high memory: 0x%08x to 0x%08x\n", pstart, pend);
+
+        highmem_start = highmem_next = pstart;
+        highmem_end = pend;
+        highmem_freecount = ADDR_TO_PN(pend - pstart);
+}
+
+uintptr_t
+page_alloc_highmem(void)
+{
+        uintptr_t paddr, vaddr;
+
+        if (0 != (paddr = highmem_stack)) {
+                vaddr = kmap_atomic(paddr);
+                highmem_stack = *(uintptr_t *)vaddr;
+                kunmap_atomic(vaddr);
+        } else if (highmem_next < highmem_end) {
+                paddr = highmem_next;
+                highmem_next += PAGE_SIZE;
+        } else {
+                return 0;
+        }
+        highmem_freecount--;
+        return paddr;
+}
+
+void
+page_free_highmem(uintptr_t paddr)
+{
+        uintptr_t vaddr;
+
+        KASSERT(PAGE_ALIGNED(paddr));
+        KASSERT(highmem_start <= paddr && paddr < highmem_next);
+
+        vaddr = kmap_atomic(paddr);
+        *(uintptr_t *)vaddr = highmem_stack;
+        kunmap_atomic(vaddr);
+        highmem_stack = paddr;
+        highmem_freecount++;
+}
+
+uint32_t
+page_highmem_free_count(void)
+{
+        return highmem_freecount;
+}
+
+void
+page_range(uintptr_t *start, uintptr_t *end)
+{
+        struct pagegroup *group;
+
+        *start = UPTR_MAX;
+        *end = 0;
+        list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
+                *start = MIN(*start, group->pg_baseaddr);
+                *end = MAX(*end, group->pg_endaddr);
+        } list_iterate_end();
+}
+
 /**
  * Calculates the address's index in to the buddy bitmap for the
  * specified order. The address must be within the range of addresses
@@ -150,15 +329,15 @@ _pagegroup_calculate_index(struct pagegroup *group, uint32_t order, uintptr_t ad
 }
 
 static void
-__page_split(struct pagegroup *group, uint32_t order)
+__page_split(struct pagegroup *group, int type, uint32_t order)
 {
         KASSERT(0 < order);
         KASSERT(PAGE_NSIZES > order);
-        KASSERT(!list_empty(&group->pg_freelist[order]));
+        KASSERT(!list_empty(&group->pg_freelist[type][order]));
         KASSERT(PAGE_SIZE >= sizeof(uintptr_t));
 
-        uintptr_t target = (uintptr_t)list_head(&group->pg_freelist[order], struct freepage, fp_link);
-        list_remove_head(&group->pg_freelist[order]);
+        uintptr_t target = (uintptr_t)list_head(&group->pg_freelist[type][order], struct freepage, fp_link);
+        _pagegroup_free_remove(group, target);
 
         /* splitting the page requires marking it as allocated */
         if (likely(order < PAGE_NSIZES - 1)) {
@@ -169,50 +348,273 @@ __page_split(struct pagegroup *group, uint32_t order)
         KASSERT(!bit_check(group->pg_map[order], _pagegroup_calculate_index(group, order, target)));
 
         uintptr_t buddy = (target + ((1 << (order - 1)) << PAGE_SHIFT));
-        list_insert_head(&group->pg_freelist[order - 1], &((struct freepage *)target)->fp_link);
-        list_insert_head(&group->pg_freelist[order - 1], &((struct freepage *)buddy)->fp_link);
+        _pagegroup_free_insert(group, type, order - 1, target);
+        _pagegroup_free_insert(group, type, order - 1, buddy);
         dbg(DBG_PAGEALLOC, "split 0x%.8x (%u) into 0x%.8x and 0x%.8x\n", target, order, target, buddy);
 }
 
 /**
- * Finds a block of pages strictly bigger than a block of the given order and
- * splits it into blocks of the given order. Used, for example, when the user
- * requests a 4k block and there are no free 4k blocks, but there is an 8k or
- * 16k block.
+ * Returns the n coldest pages of the cache for the given kind of page to
+ * the buddy lists.
+ */
+static void
+_page_cache_drain(int type, uint32_t n)
+{
+        KASSERT(n <= page_cache_count[type]);
+        while (n-- > 0) {
+                struct freepage *fp = list_tail(&page_cache[type], struct freepage, fp_link);
+                list_remove(&fp->fp_link);
+                page_cache_count[type]--;
+                page_freecount--;
+                _page_free_order(fp, 0);
+        }
+}
+
+/**
+ * Returns the zeroed pages to the buddy lists.
+ */
+static void
+_page_zeroed_drain(void)
+{
+        while (!list_empty(&page_zeroed)) {
+                struct freepage *fp = list_head(&page_zeroed, struct freepage, fp_link);
+                list_remove(&fp->fp_link);
+                page_zeroed_count--;
+                page_freecount--;
+                _page_free_order(fp, 0);
+        }
+}
+
+/**
+ * Returns whether there is a free block of at least the given order in the
+ * buddy lists, of either kind, i.e. whether _page_alloc_order(order, type)
+ * would succeed without having to reclaim memory.
+ */
+static int
+_page_available(uint32_t order)
+{
+        struct pagegroup *group;
+        list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
+                uint32_t norder;
+                int type;
+                for (type = 0; type < PAGE_NTYPES; type++) {
+                        for (norder = order; norder < PAGE_NSIZES; norder++) {
+                                if (!list_empty(&group->pg_freelist[type][norder]))
+                                        return 1;
+                        }
+                }
+        } list_iterate_end();
+        return 0;
+}
+
+/**
+ * Moves up to PAGE_CACHE_BATCH pages of the given kind from the buddy
+ * lists into the cache, without reclaiming memory to do so.
+ */
+static void
+_page_cache_refill(int type)
+{
+        int n;
+        for (n = 0; n < PAGE_CACHE_BATCH && _page_available(0); n++) {
+                struct freepage *fp = _page_alloc_order(0, type);
+                KASSERT(NULL != fp);
+                list_insert_tail(&page_cache[type], &fp->fp_link);
+                page_cache_count[type]++;
+                page_freecount++;
+        }
+}
+
+/**
+ * Takes a free block of at least the given order away from the other kind
+ * of page, the biggest there is, and splits it into blocks of the given
+ * order on the free lists for the given kind. A whole largest-order block
+ * changes kind; a smaller one does not, and goes back to the other kind
+ * once the pages taken from it are freed.
+ *
+ * @return the group the block was in on success, NULL otherwise
+ */
+static struct pagegroup *
+_page_steal(uint32_t order, int type)
+{
+        int norder;
+
+        for (norder = PAGE_NSIZES - 1; norder >= (int)order; norder--) {
+                struct pagegroup *group;
+                list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
+                        list_t *list = &group->pg_freelist[PAGE_OTHER_TYPE(type)][norder];
+                        if (!list_empty(list)) {
+                                uintptr_t addr = (uintptr_t)list_head(list, struct freepage, fp_link);
+                                dbg(DBG_PAGEALLOC, "%s taking 0x%.8x (%u) from %s\n",
+                                    type == PAGE_MOVABLE ? "movable" : "unmovable", addr, norder,
+                                    type == PAGE_MOVABLE ? "unmovable" : "movable");
+                                _pagegroup_free_remove(group, addr);
+                                if (PAGE_BLOCK_ORDER == norder)
+                                        _pagegroup_type(group, addr) = type;
+                                _pagegroup_free_insert(group, type, norder, addr);
+                                while (norder > (int)order) {
+                                        __page_split(group, type, norder);
+                                        --norder;
+                                }
+                                return group;
+                        }
+                } list_iterate_end();
+        }
+        return NULL;
+}
+
+#ifdef __SHADOWD__
+/**
+ * Returns how many pages of the block of 2^order pages at addr would have
+ * to be moved for the whole block to be free, or UINT_MAX if some of them
+ * cannot be.
+ */
+static uint32_t
+_page_compact_cost(struct pagegroup *group, uintptr_t addr, uint32_t order)
+{
+        uint32_t i, cost = 0;
+
+        for (i = 0; i < (1U << order);) {
+                uint8_t forder = group->pg_order[_pagegroup_pn(group, addr) + i];
+                if (0 != forder) {
+                        i += 1 << (forder - 1);
+                } else if (pframe_movable((void *)(addr + (i << PAGE_SHIFT)))) {
+                        cost++;
+                        i++;
+                } else {
+                        return UINT_MAX;
+                }
+        }
+        return cost;
+}
+
+/**
+ * Makes a free block of the given order out of one whose pages are all
+ * either free or page frames that may be moved, those which need the
+ * fewest moved, by moving the page frames to other pages. The free pages
+ * of that block are taken off the free lists first, as if they were
+ * allocated, so that none of those other pages is in it, and are freed
+ * again along with the pages the frames moved out of.
+ *
+ * @return 1 if there is now a free block of the given order, 0 otherwise
+ */
+static int
+_page_compact(uint32_t order)
+{
+        struct pagegroup *group, *best = NULL;
+        uintptr_t addr, bestaddr = 0;
+        uint32_t cost, bestcost = UINT_MAX, size = 1U << order, i, nfree;
+        uintptr_t freeaddr[1 << (PAGE_NSIZES - 1)];
+        uint8_t freeorder[1 << (PAGE_NSIZES - 1)];
+        int ret = 1;
+
+        KASSERT(0 < order && PAGE_NSIZES > order);
+
+        /* the cached pages need to be in the buddy lists to be seen */
+        _page_cache_drain(PAGE_UNMOVABLE, page_cache_count[PAGE_UNMOVABLE]);
+        _page_cache_drain(PAGE_MOVABLE, page_cache_count[PAGE_MOVABLE]);
+        _page_zeroed_drain();
+
+        list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
+                for (addr = group->pg_baseaddr; addr + (size << PAGE_SHIFT) <= group->pg_endaddr;
+                     addr += size << PAGE_SHIFT) {
+                        if ((cost = _page_compact_cost(group, addr, order)) < bestcost) {
+                                best = group;
+                                bestaddr = addr;
+                                bestcost = cost;
+                        }
+                }
+        } list_iterate_end();
+
+        /* the pages moved to have to come from outside the block, with a
+         * few to spare for whatever moving them allocates */
+        if (NULL == best || bestcost + PAGE_CACHE_BATCH > page_freecount - (size - bestcost))
+                return 0;
+        dbg(DBG_PAGEALLOC, "compacting 0x%.8x (%u), moving %u pages\n", bestaddr, order, bestcost);
+
+        for (i = 0, nfree = 0; i < size;) {
+                uint8_t forder = best->pg_order[_pagegroup_pn(best, bestaddr) + i];
+                if (0 != forder) {
+                        addr = bestaddr + (i << PAGE_SHIFT);
+                        _pagegroup_free_remove(best, addr);
+                        if (PAGE_NSIZES - 1 > forder - 1)
+                                bit_flip(best->pg_map[forder], _pagegroup_calculate_index(best, forder, addr));
+                        page_freecount -= 1 << (forder - 1);
+                        freeaddr[nfree] = addr;
+                        freeorder[nfree++] = forder - 1;
+                        i += 1 << (forder - 1);
+                } else {
+                        i++;
+                }
+        }
+
+        for (i = 0; i < size; i++) {
+                addr = bestaddr + (i << PAGE_SHIFT);
+                if (NULL == pframe_from_addr((void *)addr))
+                        continue;
+                if (0 == pframe_relocate((void *)addr))
+                        _page_free_order((void *)addr, 0);
+                else
+                        ret = 0;
+        }
+        for (i = 0; i < nfree; i++)
+                _page_free_order((void *)freeaddr[i], freeorder[i]);
+
+        return ret;
+}
+#endif /* __SHADOWD__ */
+
+/**
+ * Finds a block of pages bigger than a block of the given order for the
+ * given kind of page and splits it into blocks of the given order. Used,
+ * for example, when the user requests a 4k block and there are no free 4k
+ * blocks, but there is an 8k or 16k block. Failing that it takes a block
+ * from the other kind of page, then compacts memory to make one, and only
+ * then reclaims memory.
  *
  * @param order the order of the block to split into.
+ * @param type the kind of page the block is for
  * @return the group where the split took place on success, NULL otherwise
  */
 static struct pagegroup *
-_page_split(int order)
+_page_split(uint32_t order, int type)
 {
 #ifdef __SHADOWD__
         uint32_t num_retrys = 2;
 #else
         uint32_t num_retrys = 0;
 #endif
+        struct pagegroup *group;
         int norder;
 
         do {
-                /* Find the first free block of greater size than requested. */
-                for (norder = order + 1; norder < PAGE_NSIZES; norder++) {
-                        struct pagegroup *group;
+                /* Find the first free block at least as big as requested. */
+                for (norder = order; norder < PAGE_NSIZES; norder++) {
                         list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
-                                if (!list_empty(&group->pg_freelist[norder])) {
-                                        while (norder > order) {
-                                                __page_split(group, norder);
+                                if (!list_empty(&group->pg_freelist[type][norder])) {
+                                        while (norder > (int)order) {
+                                                __page_split(group, type, norder);
                                                 --norder;
                                         }
-                                        KASSERT(!list_empty(&group->pg_freelist[order]));
+                                        KASSERT(!list_empty(&group->pg_freelist[type][order]));
                                         return group;
                                 }
                         } list_iterate_end();
                 }
 
+                if (NULL != (group = _page_steal(order, type)))
+                        return group;
+
                 dbg(DBG_PAGEALLOC, "WARNING, cannot allocate order=%u\n", order);
                 /* We have run out of kernel memory. Lets try and collapse some
                    shadow trees, and then retry */
 #ifdef __SHADOWD__
+                /* Compacting moves page frames that nothing has pinned,
+                 * which the caller cannot count on staying put across a
+                 * sleep either, so it is only done instead of one. */
+                if (0 < order && _page_compact(order)) {
+                        num_retrys++;
+                        continue;
+                }
                 dbg(DBG_PAGEALLOC, "waking up shadowd\n");
                 shadowd_wakeup();
                 shadowd_alloc_sleep();
@@ -226,32 +628,45 @@ _page_split(int order)
 }
 
 /**
- * Allocate a block of at least 2^order pages. Fills the block with the
- * MM_POISON_ALLOC pattern.
+ * Allocate a block of at least 2^order pages of the given kind. Fills the
+ * block with the MM_POISON_ALLOC pattern.
  *
  * @param order the order of the block size desired
+ * @param type PAGE_MOVABLE or PAGE_UNMOVABLE
  * @return the address of the free memory or null if no memory could be allocated
  */
 static void *
-_page_alloc_order(uint32_t order)
+_page_alloc_order(uint32_t order, int type)
 {
         uintptr_t addr;
         struct pagegroup *group;
 
+again:
         list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
-                if (!list_empty(&group->pg_freelist[order]))
+                if (!list_empty(&group->pg_freelist[type][order]))
                         goto found;
         } list_iterate_end();
 
-        if (NULL != (group = _page_split(order))) {
-                KASSERT(!list_empty(&group->pg_freelist[order]));
+        if (0 < page_cache_count[PAGE_UNMOVABLE] + page_cache_count[PAGE_MOVABLE]) {
+                /* Pages sitting in the caches may be all that is keeping
+                 * their buddies from joining into the block we need */
+                _page_cache_drain(PAGE_UNMOVABLE, page_cache_count[PAGE_UNMOVABLE]);
+                _page_cache_drain(PAGE_MOVABLE, page_cache_count[PAGE_MOVABLE]);
+                goto again;
+        }
+        if (0 < page_zeroed_count) {
+                _page_zeroed_drain();
+                goto again;
+        }
+        if (NULL != (group = _page_split(order, type))) {
+                KASSERT(!list_empty(&group->pg_freelist[type][order]));
                 goto found;
         }
         return NULL;
 
 found:
-        addr = (uintptr_t)list_head(&group->pg_freelist[order], struct freepage, fp_link);
-        list_remove_head(&group->pg_freelist[order]);
+        addr = (uintptr_t)list_head(&group->pg_freelist[type][order], struct freepage, fp_link);
+        _pagegroup_free_remove(group, addr);
         if (PAGE_NSIZES - 1 > order)
                 bit_flip(group->pg_map[order + 1], _pagegroup_calculate_index(group, order + 1, addr));
 
@@ -282,11 +697,11 @@ __page_join(struct pagegroup *group, int order, uintptr_t addr)
 
                 dbg(DBG_PAGEALLOC, "joining 0x%.8x and 0x%.8x (%u) into 0x%.8x\n", addr, buddy, order, MIN(offset, buddy));
 
-                list_remove(&((struct freepage *)addr)->fp_link);
-                list_remove(&((struct freepage *)buddy)->fp_link);
+                _pagegroup_free_remove(group, addr);
+                _pagegroup_free_remove(group, buddy);
                 addr = MIN(addr, buddy);
                 ++order;
-                list_insert_head(&group->pg_freelist[order], &((struct freepage *)addr)->fp_link);
+                _pagegroup_free_insert(group, _pagegroup_type(group, addr), order, addr);
 
                 if (PAGE_NSIZES - 1 > order)
                         bit_flip(group->pg_map[order + 1], _pagegroup_calculate_index(group, order + 1, (uintptr_t)addr));
@@ -315,7 +730,7 @@ _page_free_order(void *addr, int order)
         if (NULL == group)
                 return;
 
-        list_insert_head(&group->pg_freelist[order], &((struct freepage *)addr)->fp_link);
+        _pagegroup_free_insert(group, _pagegroup_type(group, addr), order, (uintptr_t)addr);
         page_freecount += (1 << order);
 
         if (PAGE_NSIZES - 1 > order) {
@@ -328,6 +743,40 @@ _page_free_order(void *addr, int order)
             (1 << order), addr, page_freecount);
 }
 
+static void *
+_page_alloc_type(int type)
+{
+        void *addr;
+
+        if (list_empty(&page_cache[type]))
+                _page_cache_refill(type);
+
+        if (!list_empty(&page_cache[type])) {
+                addr = list_head(&page_cache[type], struct freepage, fp_link);
+                list_remove_head(&page_cache[type]);
+                page_cache_count[type]--;
+                page_freecount--;
+#ifdef MM_POISON
+                memset(addr, MM_POISON_ALLOC, PAGE_SIZE);
+#endif /* MM_POISON */
+        } else if (PAGE_MOVABLE == type && !list_empty(&page_zeroed)) {
+                /* rather than reclaiming anything */
+                addr = list_head(&page_zeroed, struct freepage, fp_link);
+                list_remove_head(&page_zeroed);
+                page_zeroed_count--;
+                page_freecount--;
+#ifdef MM_POISON
+                memset(addr, MM_POISON_ALLOC, PAGE_SIZE);
+#endif /* MM_POISON */
+        } else {
+                /* the buddy lists are empty too; this reclaims memory */
+                addr = _page_alloc_order(0, type);
+        }
+
+        GDB_CALL_HOOK(page_alloc, addr, 1);
+        return addr;
+}
+
 /*
  * Allocate one page of memory (which is, of course page-aligned).
  * @return the address of the page
@@ -335,20 +784,112 @@ _page_free_order(void *addr, int order)
 void *
 page_alloc(void)
 {
-        void *addr =  _page_alloc_order(0);
+        return _page_alloc_type(PAGE_UNMOVABLE);
+}
+
+/*
+ * Allocate one page of memory which the page frame code can move
+ * elsewhere while it is not in use, see pframe_relocate.
+ * @return the address of the page
+ */
+void *
+page_alloc_movable(void)
+{
+        return _page_alloc_type(PAGE_MOVABLE);
+}
+
+/*
+ * Allocate one page of memory filled with zeroes.
+ * @return the address of the page
+ */
+void *
+page_alloc_zeroed(void)
+{
+        void *addr;
+
+        if (NULL != (addr = page_alloc()))
+                page_zero(addr);
+        return addr;
+}
+
+/*
+ * Allocate one movable page of memory filled with zeroes, zeroed ahead
+ * of time if there is such a page.
+ * @return the address of the page
+ */
+void *
+page_alloc_movable_zeroed(void)
+{
+        void *addr;
+
+        if (list_empty(&page_zeroed)) {
+                if (NULL != (addr = page_alloc_movable()))
+                        page_zero(addr);
+                return addr;
+        }
+
+        addr = list_head(&page_zeroed, struct freepage, fp_link);
+        list_remove_head(&page_zeroed);
+        page_zeroed_count--;
+        page_freecount--;
+        /* the list link was written into it */
+        memset(addr, 0, sizeof(struct freepage));
+
         GDB_CALL_HOOK(page_alloc, addr, 1);
         return addr;
 }
 
+int
+page_zero_idle(void)
+{
+        struct freepage *fp;
+
+        if (PAGE_ZEROED_MAX <= page_zeroed_count)
+                return 0;
+        if (!list_empty(&page_cache[PAGE_MOVABLE])) {
+                /* the coldest, which is handed out last */
+                fp = list_tail(&page_cache[PAGE_MOVABLE], struct freepage, fp_link);
+                list_remove(&fp->fp_link);
+                page_cache_count[PAGE_MOVABLE]--;
+        } else if (_page_available(0)) {
+                fp = _page_alloc_order(0, PAGE_MOVABLE);
+                page_freecount++;
+        } else {
+                return 0;
+        }
+
+        page_zero(fp);
+        list_insert_tail(&page_zeroed, &fp->fp_link);
+        page_zeroed_count++;
+        return 1;
+}
+
 /*
- * Free one page of memory (which was allocated with page_alloc())
+ * Free one page of memory (which was allocated with page_alloc() or
+ * page_alloc_movable())
  * @param addr the address of the page to be freed
  */
 void
 page_free(void *addr)
 {
+        struct pagegroup *group;
+        int type;
+
         GDB_CALL_HOOK(page_free, addr, 1);
-        _page_free_order(addr, 0);
+        KASSERT(PAGE_ALIGNED(addr));
+
+        group = _pagegroup_from_address((uintptr_t)addr);
+        type = (NULL == group) ? PAGE_UNMOVABLE : _pagegroup_type(group, addr);
+
+#ifdef MM_POISON
+        memset(addr, MM_POISON_FREE, PAGE_SIZE);
+#endif /* MM_POISON */
+        list_insert_head(&page_cache[type], &((struct freepage *)addr)->fp_link);
+        page_cache_count[type]++;
+        page_freecount++;
+
+        if (page_cache_count[type] > PAGE_CACHE_HIGH)
+                _page_cache_drain(type, PAGE_CACHE_BATCH);
 }
 
 /*
@@ -367,7 +908,7 @@ page_alloc_n(uint32_t npages)
         if (order == PAGE_NSIZES)
                 panic("Implementation does not permit allocating %u pages!\n", npages);
 
-        void *addr = _page_alloc_order(order);
+        void *addr = _page_alloc_order(order, PAGE_UNMOVABLE);
         GDB_CALL_HOOK(page_alloc, addr, npages);
         return addr;
 }
@@ -399,3 +940,137 @@ page_free_count()
 {
         return page_freecount;
 }
+
+/*
+ * Whole-page copying and zeroing. The SSE2 versions save and restore the
+ * few xmm registers they use, which nothing else in the kernel touches,
+ * rather than the whole FPU state: the kernel is not preempted, so only
+ * an interrupt at that moment can come in between, and it puts back any
+ * registers it uses in turn. For the same reason they need not take the
+ * lazy FPU switch over from whichever thread's state is in the registers,
+ * see proc/context.h.
+ */
+
+static void
+_page_copy_dwords(void *dst, const void *src)
+{
+        int d0, d1, d2;
+        __asm__ volatile("cld\n\t"
+                         "rep\n\t"
+                         "movsl"
+                         : "=&c"(d0), "=&D"(d1), "=&S"(d2)
+                         : "0"(PAGE_SIZE / 4), "1"(dst), "2"(src)
+                         : "memory", "cc");
+}
+
+static void
+_page_zero_dwords(void *dst)
+{
+        int d0, d1;
+        __asm__ volatile("cld\n\t"
+                         "rep\n\t"
+                         "stosl"
+                         : "=&c"(d0), "=&D"(d1)
+                         : "a"(0), "0"(PAGE_SIZE / 4), "1"(dst)
+                         : "memory", "cc");
+}
+
+static inline void
+_page_xmm_save(char *save)
+{
+        __asm__ volatile("movdqu %%xmm0, 0(%0)\n\t"
+                         "movdqu %%xmm1, 16(%0)\n\t"
+                         "movdqu %%xmm2, 32(%0)\n\t"
+                         "movdqu %%xmm3, 48(%0)"
+                         : : "r"(save) : "memory");
+}
+
+/* Also waits for the non-temporal stores to be done */
+static inline void
+_page_xmm_restore(const char *save)
+{
+        __asm__ volatile("sfence\n\t"
+                         "movdqu 0(%0), %%xmm0\n\t"
+                         "movdqu 16(%0), %%xmm1\n\t"
+                         "movdqu 32(%0), %%xmm2\n\t"
+                         "movdqu 48(%0), %%xmm3"
+                         : : "r"(save) : "memory");
+}
+
+static void
+_page_copy_sse2(void *dst, const void *src)
+{
+        char save[64];
+        uint32_t off;
+        uint32_t ts = context_fpu_kernel_begin();
+
+        _page_xmm_save(save);
+        for (off = 0; off < PAGE_SIZE; off += 64) {
+                __asm__ volatile("movdqa 0(%0), %%xmm0\n\t"
+                                 "movdqa 16(%0), %%xmm1\n\t"
+                                 "movdqa 32(%0), %%xmm2\n\t"
+                                 "movdqa 48(%0), %%xmm3\n\t"
+                                 "movntdq %%xmm0, 0(%1)\n\t"
+                                 "movntdq %%xmm1, 16(%1)\n\t"
+                                 "movntdq %%xmm2, 32(%1)\n\t"
+                                 "movntdq %%xmm3, 48(%1)"
+                                 : : "r"((const char *)src + off), "r"((char *)dst + off)
+                                 : "memory");
+        }
+        _page_xmm_restore(save);
+        context_fpu_kernel_end(ts);
+}
+
+static void
+_page_zero_sse2(void *dst)
+{
+        char save[64];
+        uint32_t off;
+        uint32_t ts = context_fpu_kernel_begin();
+
+        _page_xmm_save(save);
+        __asm__ volatile("pxor %%xmm0, %%xmm0" : : : "memory");
+        for (off = 0; off < PAGE_SIZE; off += 64) {
+                __asm__ volatile("movntdq %%xmm0, 0(%0)\n\t"
+                                 "movntdq %%xmm0, 16(%0)\n\t"
+                                 "movntdq %%xmm0, 32(%0)\n\t"
+                                 "movntdq %%xmm0, 48(%0)"
+                                 : : "r"((char *)dst + off) : "memory");
+        }
+        _page_xmm_restore(save);
+        context_fpu_kernel_end(ts);
+}
+
+static void (*page_copy_func)(void *dst, const void *src) = _page_copy_dwords;
+static void (*page_zero_func)(void *dst) = _page_zero_dwords;
+
+void
+page_copy(void *dst, const void *src)
+{
+        KASSERT(PAGE_ALIGNED(dst) && PAGE_ALIGNED(src));
+        page_copy_func(dst, src);
+}
+
+void
+page_zero(void *dst)
+{
+        KASSERT(PAGE_ALIGNED(dst));
+        page_zero_func(dst);
+}
+
+static __attribute__((unused)) void
+page_copy_init(void)
+{
+        uint32_t eax, edx;
+
+        /* context_fpu_init has told the CPU that SSE may be used */
+        cpuid(CPUID_GETFEATURES, &eax, &edx);
+        if (!(edx & CPUID_FEAT_EDX_SSE2) || !(edx & CPUID_FEAT_EDX_FXSR))
+                return;
+
+        page_copy_func = _page_copy_sse2;
+        page_zero_func = _page_zero_sse2;
+        dbgq(DBG_MM, "page_copy: using SSE2 non-temporal stores\n");
+}
+init_func(page_copy_init);
+init_depends(context_fpu_init);
@@ -6,6 +6,7 @@
 #include "globals.h"
 
 #include "main/interrupt.h"
+#include "main/cpuid.h"
 
 #include "mm/mm.h"
 #include "mm/page.h"
@@ -13,6 +14,9 @@
 #include "mm/phys.h"
 #include "mm/tlb.h"
 #include "mm/pframe.h"
+#include "mm/vmalloc.h"
+
+#include "proc/sched.h"
 
 #include "util/debug.h"
 #include "util/string.h"
@@ -20,8 +24,13 @@
 
 #include "vm/pagefault.h"
 
+#include "api/access.h"
+
 #include "boot/config.h"
 
+#define CR0_WP            0x00010000
+#define CR4_PGE           0x080
+
 #define PT_ENTRY_COUNT    (PAGE_SIZE / sizeof (uint32_t))
 #define PT_VADDR_SIZE     (PAGE_SIZE * PT_ENTRY_COUNT)
 
@@ -41,26 +50,191 @@ struct pagedir {
 #define vaddr_to_offset(vaddr) \
         (((uint32_t)(vaddr)) & (~PAGE_MASK))
 
+/* User page directories map nothing below USER_MEM_LOW, so the
+ * pd_virtual slot of the first table holds the number of user pages
+ * mapped instead; its pd_physical entry stays clear (see
+ * pt_template_init). */
+#define pd_resident(pd) \
+        (*(uint32_t *)&(pd)->pd_virtual[0])
+
 /* the virtual address of the page directory in cr3 */
 static pagedir_t *current_pagedir = NULL;
 static pagedir_t *template_pagedir = NULL;
 
-static uint32_t phys_map_count = 1;
+/* destroyed page directories, user half cleared, kept for reuse */
+static pagedir_t *pagedir_pool[PAGEDIR_POOL_SIZE];
+static int pagedir_pool_count = 0;
+
+/* The last page table, final_page, maps physical pages in for the
+ * kernel wherever they are: from the top down, the kmap_atomic slots,
+ * the kmap pool, and then the pages of pt_phys_perm_map. */
+#define final_vaddr(index) \
+        ((uintptr_t)PT_VADDR_SIZE * (PT_ENTRY_COUNT - 1) + (index) * PAGE_SIZE)
+
+#define KMAP_ATOMIC_BASE  (PT_ENTRY_COUNT - KMAP_ATOMIC_SLOTS)
+#define KMAP_POOL_BASE    (KMAP_ATOMIC_BASE - KMAP_POOL_SIZE)
+
+static uint32_t phys_map_count = KMAP_ATOMIC_SLOTS + KMAP_POOL_SIZE;
 static pte_t *final_page;
 
+/* The page tables of the vmalloc area, which sits just below final_page's
+ * and which they map page by page, one after another. They are made in
+ * pt_init and so are in the template, and in every page directory. */
+static pte_t *vmalloc_ptes;
+#define VMALLOC_PTABLES (VMALLOC_SIZE / PT_VADDR_SIZE)
+
+/* The kmap_atomic slots of the processor (there is only the one) in use.
+ * They are taken and given back in stack order, so an interrupt handler
+ * using them nests inside whatever it interrupted. */
+static int kmap_atomic_depth = 0;
+
+/* kmap_count[i] is 0 if pool slot i is free and in no TLB, 1 if it has
+ * been given back but its mapping may still be cached, and 1 plus its
+ * users otherwise. Slots given back are only unmapped, all at once with
+ * one flush, when the search for a free slot wraps around. */
+static int kmap_count[KMAP_POOL_SIZE];
+static uintptr_t kmap_paddr[KMAP_POOL_SIZE];
+static int kmap_last = 0;
+static ktqueue_t kmap_waitq;
+
+/* The page attribute table, whose entries are picked by the PT_PAT,
+ * PT_CACHE_DISABLED and PT_WRITE_THROUGH bits of a page table entry, in
+ * that order. The processor starts with write-back, write-through, UC-
+ * and uncached in entries 0 to 3, and again in 4 to 7; pt_init makes
+ * entry 4, which PT_PAT alone picks, write-combining, and leaves the
+ * others be, so that no mapping made without PT_PAT changes. A
+ * write-combining entry wins over the uncached memory type the MTRRs
+ * give device memory. */
+#define MSR_PAT                 0x277
+#define PAT_UC                  0x00
+#define PAT_WC                  0x01
+#define PAT_WT                  0x04
+#define PAT_WB                  0x06
+#define PAT_UC_MINUS            0x07
+#define PAT_ENTRIES(a, b, c, d) ((a) | (b) << 8 | (c) << 16 | (d) << 24)
+
+/* What pt_phys_perm_map_wc adds to its entries, PT_PAT if there is a
+ * page attribute table */
+static uint32_t pt_wc_flags = 0;
+
 uintptr_t
-pt_phys_tmp_map(uintptr_t paddr)
+kmap_atomic(uintptr_t paddr)
 {
         KASSERT(PAGE_ALIGNED(paddr));
-        final_page[PT_ENTRY_COUNT - 1] = paddr | PT_PRESENT | PT_WRITE;
+        KASSERT(KMAP_ATOMIC_SLOTS > kmap_atomic_depth && "kmap_atomic nested too deep");
+
+        uint32_t index = KMAP_ATOMIC_BASE + kmap_atomic_depth++;
+        final_page[index] = paddr | PT_PRESENT | PT_WRITE;
 
-        uintptr_t vaddr = UPTR_MAX - PAGE_SIZE + 1;
+        uintptr_t vaddr = final_vaddr(index);
         tlb_flush(vaddr);
         return vaddr;
 }
 
+void
+kunmap_atomic(uintptr_t vaddr)
+{
+        KASSERT(0 < kmap_atomic_depth);
+        KASSERT((uintptr_t)PAGE_ALIGN_DOWN(vaddr)
+                == final_vaddr(KMAP_ATOMIC_BASE + kmap_atomic_depth - 1)
+                && "kunmap_atomic of a slot other than the last taken");
+        /* the slot is flushed when it is next taken */
+        kmap_atomic_depth--;
+}
+
+static void
+kmap_flush_unused(void)
+{
+        int i;
+        for (i = 0; i < KMAP_POOL_SIZE; ++i) {
+                if (1 == kmap_count[i]) {
+                        final_page[KMAP_POOL_BASE + i] = 0;
+                        kmap_count[i] = 0;
+                }
+        }
+        tlb_flush_range(final_vaddr(KMAP_POOL_BASE), KMAP_POOL_SIZE);
+}
+
 uintptr_t
-pt_phys_perm_map(uintptr_t paddr, uint32_t count)
+kmap(uintptr_t paddr)
+{
+        int i, n;
+
+        KASSERT(PAGE_ALIGNED(paddr));
+
+        while (1) {
+                /* a page given back but not yet unmapped can be had again
+                 * without touching the TLB */
+                for (i = 0; i < KMAP_POOL_SIZE; ++i) {
+                        if (0 != kmap_count[i] && paddr == kmap_paddr[i]) {
+                                kmap_count[i]++;
+                                return final_vaddr(KMAP_POOL_BASE + i);
+                        }
+                }
+
+                /* the search wraps around, and so unmaps the slots given
+                 * back, at most once before it has looked at every slot
+                 * since */
+                for (n = 0; n < 2 * KMAP_POOL_SIZE; ++n) {
+                        kmap_last = (kmap_last + 1) % KMAP_POOL_SIZE;
+                        if (0 == kmap_last) {
+                                kmap_flush_unused();
+                        }
+                        if (0 == kmap_count[kmap_last]) {
+                                kmap_count[kmap_last] = 2;
+                                kmap_paddr[kmap_last] = paddr;
+                                final_page[KMAP_POOL_BASE + kmap_last] =
+                                        paddr | PT_PRESENT | PT_WRITE;
+                                return final_vaddr(KMAP_POOL_BASE + kmap_last);
+                        }
+                }
+
+                sched_sleep_on(&kmap_waitq);
+        }
+}
+
+void
+kunmap(uintptr_t vaddr)
+{
+        int i = (int)vaddr_to_ptindex(vaddr) - KMAP_POOL_BASE;
+
+        KASSERT(PT_ENTRY_COUNT - 1 == vaddr_to_pdindex(vaddr));
+        KASSERT(0 <= i && KMAP_POOL_SIZE > i && 1 < kmap_count[i]);
+
+        if (1 == --kmap_count[i]) {
+                sched_broadcast_on(&kmap_waitq);
+        }
+}
+
+void
+kmap_n(const uintptr_t *paddrs, uint32_t count, uintptr_t *vaddrs)
+{
+        uint32_t i;
+        int avail;
+
+        KASSERT(KMAP_POOL_SIZE >= count);
+
+        /* taking the slots one by one, two callers each holding some
+         * could wait for each other forever */
+        while (1) {
+                avail = 0;
+                for (i = 0; i < KMAP_POOL_SIZE; ++i) {
+                        if (1 >= kmap_count[i]) {
+                                avail++;
+                        }
+                }
+                if (avail >= (int)count) {
+                        break;
+                }
+                sched_sleep_on(&kmap_waitq);
+        }
+        for (i = 0; i < count; ++i) {
+                vaddrs[i] = kmap(paddrs[i]);
+        }
+}
+
+static uintptr_t
+_pt_phys_perm_map(uintptr_t paddr, uint32_t count, uint32_t flags)
 {
         KASSERT(PAGE_ALIGNED(paddr));
 
@@ -70,14 +244,50 @@ pt_phys_perm_map(uintptr_t paddr, uint32_t count)
         uint32_t i;
         for (i = 0; i < count; ++i) {
                 final_page[PT_ENTRY_COUNT - phys_map_count + i] =
-                        (paddr + PAGE_SIZE * i) | PT_PRESENT | PT_WRITE;
+                        (paddr + PAGE_SIZE * i) | PT_PRESENT | PT_WRITE | flags;
         }
 
-        uintptr_t vaddr = UPTR_MAX - (PAGE_SIZE * phys_map_count) + 1;
+        uintptr_t vaddr = final_vaddr(PT_ENTRY_COUNT - phys_map_count);
         tlb_flush(vaddr);
         return vaddr;
 }
 
+uintptr_t
+pt_phys_perm_map(uintptr_t paddr, uint32_t count)
+{
+        return _pt_phys_perm_map(paddr, count, 0);
+}
+
+uintptr_t
+pt_phys_perm_map_wc(uintptr_t paddr, uint32_t count)
+{
+        return _pt_phys_perm_map(paddr, count, pt_wc_flags);
+}
+
+void
+pt_kernel_map(uintptr_t vaddr, uintptr_t paddr)
+{
+        KASSERT(PAGE_ALIGNED(vaddr) && PAGE_ALIGNED(paddr));
+        KASSERT(VMALLOC_START <= vaddr && VMALLOC_END > vaddr);
+
+        pte_t *pte = &vmalloc_ptes[(vaddr - VMALLOC_START) >> PAGE_SHIFT];
+        KASSERT(!(PT_PRESENT & *pte));
+        *pte = paddr | PT_PRESENT | PT_WRITE;
+}
+
+uintptr_t
+pt_kernel_unmap(uintptr_t vaddr)
+{
+        KASSERT(PAGE_ALIGNED(vaddr));
+        KASSERT(VMALLOC_START <= vaddr && VMALLOC_END > vaddr);
+
+        pte_t *pte = &vmalloc_ptes[(vaddr - VMALLOC_START) >> PAGE_SHIFT];
+        uintptr_t paddr = *pte & PAGE_MASK;
+        KASSERT(PT_PRESENT & *pte);
+        *pte = 0;
+        return paddr;
+}
+
 uintptr_t
 pt_virt_to_phys(uintptr_t vaddr)
 {
@@ -85,8 +295,9 @@ pt_virt_to_phys(uintptr_t vaddr)
         uint32_t entry = vaddr_to_ptindex(vaddr);
         uint32_t offset = vaddr_to_offset(vaddr);
 
-        pte_t *pagetable = (pte_t *)pt_phys_tmp_map(current_pagedir->pd_physical[table] & PAGE_MASK);
-        uintptr_t page = pagetable[entry] & PAGE_MASK;
+        uintptr_t pt = kmap_atomic(current_pagedir->pd_physical[table] & PAGE_MASK);
+        uintptr_t page = ((pte_t *)pt)[entry] & PAGE_MASK;
+        kunmap_atomic(pt);
         return page + offset;
 }
 
@@ -114,11 +325,10 @@ pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32
 
         pte_t *pt;
         if (!(PT_PRESENT & pd->pd_physical[index])) {
-                if (NULL == (pt = page_alloc())) {
+                if (NULL == (pt = page_alloc_zeroed())) {
                         return -ENOMEM;
                 } else {
                         KASSERT((pdflags & ~PAGE_MASK) == pdflags);
-                        memset(pt, 0, PAGE_SIZE);
                         pd->pd_physical[index] = pt_virt_to_phys((uintptr_t)pt) | pdflags;
                         pd->pd_virtual[index] = pt;
                 }
@@ -131,6 +341,10 @@ pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32
         index = vaddr_to_ptindex(vaddr);
 
         KASSERT((ptflags & ~PAGE_MASK) == ptflags);
+        if (!(PT_PRESENT & pt[index]) && (PT_PRESENT & ptflags))
+                pd_resident(pd)++;
+        else if ((PT_PRESENT & pt[index]) && !(PT_PRESENT & ptflags))
+                pd_resident(pd)--;
         pt[index] = paddr | ptflags;
 
         return 0;
@@ -148,52 +362,204 @@ pt_unmap(pagedir_t *pd, uintptr_t vaddr)
                 pte_t *pt = (pte_t *)pd->pd_virtual[index];
 
                 index = vaddr_to_ptindex(vaddr);
+                if (PT_PRESENT & pt[index])
+                        pd_resident(pd)--;
                 pt[index] = 0;
         }
 }
 
+int
+pt_is_mapped(pagedir_t *pd, uintptr_t vaddr)
+{
+        KASSERT(PAGE_ALIGNED(vaddr));
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
+
+        int index = vaddr_to_pdindex(vaddr);
+
+        if (PT_PRESENT & pd->pd_physical[index]) {
+                pte_t *pt = (pte_t *)pd->pd_virtual[index];
+                return !!(PT_PRESENT & pt[vaddr_to_ptindex(vaddr)]);
+        }
+        return 0;
+}
+
+int
+pt_test_and_clear_accessed(pagedir_t *pd, uintptr_t vaddr)
+{
+        KASSERT(PAGE_ALIGNED(vaddr));
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
+
+        int index = vaddr_to_pdindex(vaddr);
+
+        if (PT_PRESENT & pd->pd_physical[index]) {
+                pte_t *pt = (pte_t *)pd->pd_virtual[index];
+
+                index = vaddr_to_ptindex(vaddr);
+                if ((PT_PRESENT & pt[index]) && (PT_ACCESSED & pt[index])) {
+                        pt[index] &= ~PT_ACCESSED;
+                        if (pd == current_pagedir)
+                                tlb_flush(vaddr);
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+uint32_t
+pt_clear_dirty(pagedir_t *pd, uintptr_t vaddr)
+{
+        KASSERT(PAGE_ALIGNED(vaddr));
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
+
+        int index = vaddr_to_pdindex(vaddr);
+
+        if (PT_PRESENT & pd->pd_physical[index]) {
+                pte_t *pt = (pte_t *)pd->pd_virtual[index];
+                pte_t pte;
+
+                index = vaddr_to_ptindex(vaddr);
+                pte = pt[index];
+                if (!(PT_PRESENT & pte))
+                        return 0;
+                if (PT_DIRTY & pte) {
+                        pt[index] &= ~PT_DIRTY;
+                        if (pd == current_pagedir)
+                                tlb_flush(vaddr);
+                }
+                return PAGE_OFFSET(pte);
+        }
+        return 0;
+}
+
+static uint32_t
+_pt_count_present(const pte_t *pt, uint32_t count)
+{
+        uint32_t i, n = 0;
+        for (i = 0; i < count; ++i) {
+                if (PT_PRESENT & pt[i])
+                        ++n;
+        }
+        return n;
+}
+
+/* Frees the user page table at index of the page directory */
+static void
+_pt_free_table(pagedir_t *pd, uint32_t index)
+{
+        pd_resident(pd) -= _pt_count_present((pte_t *)pd->pd_virtual[index],
+                                             PT_ENTRY_COUNT);
+        page_free(pd->pd_virtual[index]);
+        pd->pd_virtual[index] = NULL;
+        pd->pd_physical[index] = 0;
+}
+
+static int
+_pt_table_empty(const pte_t *pt)
+{
+        uint32_t i;
+        for (i = 0; i < PT_ENTRY_COUNT; ++i) {
+                if (PT_PRESENT & pt[i])
+                        return 0;
+        }
+        return 1;
+}
+
 void
 pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh)
 {
-        uint32_t index;
-
         KASSERT(vlow < vhigh);
         KASSERT(PAGE_ALIGNED(vlow) && PAGE_ALIGNED(vhigh));
         KASSERT(USER_MEM_LOW <= vlow && USER_MEM_HIGH >= vhigh);
 
-        index = vaddr_to_ptindex(vlow);
-        if (PT_PRESENT & pd->pd_physical[vaddr_to_pdindex(vlow)] && index != 0) {
-                pte_t *pt = (pte_t *)pd->pd_virtual[vaddr_to_pdindex(vlow)];
-                size_t size = (PT_ENTRY_COUNT - index) * sizeof(*pt);
-                memset(&pt[index], 0, size);
+        while (vlow < vhigh) {
+                uint32_t index = vaddr_to_pdindex(vlow);
+                uintptr_t tstart = index * PT_VADDR_SIZE;
+                uintptr_t end = MIN(tstart + PT_VADDR_SIZE, vhigh);
+
+                if (PT_PRESENT & pd->pd_physical[index]) {
+                        pte_t *pt = (pte_t *)pd->pd_virtual[index];
+                        if (vlow == tstart && end == tstart + PT_VADDR_SIZE) {
+                                _pt_free_table(pd, index);
+                        } else {
+                                pd_resident(pd) -= _pt_count_present(&pt[vaddr_to_ptindex(vlow)],
+                                                                     (end - vlow) >> PAGE_SHIFT);
+                                memset(&pt[vaddr_to_ptindex(vlow)], 0,
+                                       ((end - vlow) >> PAGE_SHIFT) * sizeof(*pt));
+                                /* don't keep a table around for nothing */
+                                if (_pt_table_empty(pt))
+                                        _pt_free_table(pd, index);
+                        }
+                }
+                vlow = end;
         }
-        vlow += PAGE_SIZE * ((PT_ENTRY_COUNT - index) % PT_ENTRY_COUNT);
+}
+
+uint32_t
+pt_resident(pagedir_t *pd)
+{
+        return pd_resident(pd);
+}
 
-        index = vaddr_to_ptindex(vhigh);
-        if (PT_PRESENT & pd->pd_physical[vaddr_to_pdindex(vhigh)] && index != 0) {
-                pte_t *pt = (pte_t *)pd->pd_virtual[vaddr_to_pdindex(vhigh)];
-                size_t size = index * sizeof(*pt);
-                memset(&pt[0], 0, size);
+uint32_t
+pt_table_count(pagedir_t *pd)
+{
+        uint32_t begin = USER_MEM_LOW / PT_VADDR_SIZE;
+        uint32_t end = (USER_MEM_HIGH - 1) / PT_VADDR_SIZE;
+        uint32_t i, n = 0;
+
+        for (i = begin; i <= end; ++i) {
+                if (PT_PRESENT & pd->pd_physical[i])
+                        ++n;
         }
-        vhigh -= PAGE_SIZE * index;
+        return n;
+}
 
-        uint32_t i;
-        for (i = vaddr_to_pdindex(vlow); i < vaddr_to_pdindex(vhigh); ++i) {
-                if (PT_PRESENT & pd->pd_physical[i]) {
-                        page_free(pd->pd_virtual[i]);
-                        pd->pd_virtual[i] = NULL;
-                        pd->pd_physical[i] = 0;
+int
+pt_copy_range(pagedir_t *dst, pagedir_t *src, uintptr_t vlow, uintptr_t vhigh, int cow)
+{
+        KASSERT(vlow < vhigh);
+        KASSERT(PAGE_ALIGNED(vlow) && PAGE_ALIGNED(vhigh));
+        KASSERT(USER_MEM_LOW <= vlow && USER_MEM_HIGH >= vhigh);
+
+        int err = 0;
+        uintptr_t vaddr = vlow;
+        while (vaddr < vhigh) {
+                int index = vaddr_to_pdindex(vaddr);
+                if (!(PT_PRESENT & src->pd_physical[index])) {
+                        /* skip the rest of this page table */
+                        vaddr = (index + 1) * PT_VADDR_SIZE;
+                        continue;
+                }
+
+                pte_t *pt = (pte_t *)src->pd_virtual[index];
+                pte_t pte = pt[vaddr_to_ptindex(vaddr)];
+                if (PT_PRESENT & pte) {
+                        if (cow) {
+                                pt[vaddr_to_ptindex(vaddr)] = pte & ~PT_WRITE;
+                        }
+                        /* after a failure keep write-protecting src */
+                        if (0 == err) {
+                                err = pt_map(dst, vaddr, pte & PAGE_MASK,
+                                             src->pd_physical[index] & ~PAGE_MASK & ~PD_ACCESSED,
+                                             pte & ~PAGE_MASK & ~(PT_WRITE | PT_ACCESSED | PT_DIRTY));
+                        }
                 }
+                vaddr += PAGE_SIZE;
         }
+        return err;
 }
 
-
 pagedir_t *
 pt_create_pagedir()
 {
         KASSERT(sizeof(pagedir_t) == PAGE_SIZE * 2);
 
         pagedir_t *pdir;
+        if (0 < pagedir_pool_count) {
+                /* no user mappings, and the kernel half never changes
+                 * once the template is made, so it is ready as is */
+                return pagedir_pool[--pagedir_pool_count];
+        }
         if (NULL == (pdir = page_alloc_n(2))) {
                 return NULL;
         }
@@ -214,10 +580,22 @@ pt_destroy_pagedir(pagedir_t *pdir)
         uint32_t i;
         for (i = begin; i <= end; ++i) {
                 if (PT_PRESENT & pdir->pd_physical[i]) {
-                        page_free(pdir->pd_virtual[i]);
+                        _pt_free_table(pdir, i);
                 }
         }
-        page_free_n(pdir, 2);
+        KASSERT(0 == pd_resident(pdir));
+
+        /* a kernel thread may still be running on it, see
+         * context_switch */
+        if (pdir == current_pagedir) {
+                pt_set(template_pagedir);
+        }
+
+        if (PAGEDIR_POOL_SIZE > pagedir_pool_count) {
+                pagedir_pool[pagedir_pool_count++] = pdir;
+        } else {
+                page_free_n(pdir, 2);
+        }
 }
 
 static void
@@ -228,9 +606,14 @@ _pt_fault_handler(regs_t *regs)
         __asm__ volatile("movl %%cr2, %0" : "=r"(vaddr));
         uint32_t cause = regs->r_err;
 
-        /* Check if pagefault was in user space (otherwise, BAD!) */
+        /* Check if pagefault was in user space (otherwise, BAD! unless
+         * it was copy_to/from_user touching a user address) */
+        uintptr_t fixup;
         if (cause & FAULT_USER) {
                 handle_pagefault(vaddr, cause);
+        } else if (USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr
+                   && 0 != (fixup = user_access_fixup(regs->r_eip))) {
+                regs->r_eip = fixup;
         } else {
                 panic("\nPage faulted while accessing 0x%08x\n", vaddr);
         }
@@ -256,8 +639,9 @@ _pt_fill_page(pagedir_t *pd, pte_t *pt, pde_t pdflags, pte_t ptflags,
 
         pde_t *temppdir;
         __asm__ volatile("movl %%cr3, %0" : "=r"(temppdir));
-        pte_t *pagetable = (pte_t *)pt_phys_tmp_map(temppdir[table] & PAGE_MASK);
-        uintptr_t page = pagetable[entry] & PAGE_MASK;
+        uintptr_t tmppt = kmap_atomic(temppdir[table] & PAGE_MASK);
+        uintptr_t page = ((pte_t *)tmppt)[entry] & PAGE_MASK;
+        kunmap_atomic(tmppt);
 
         pd->pd_physical[base] = page | (pdflags & ~(PAGE_MASK));
         pd->pd_virtual[base] = pt;
@@ -284,11 +668,26 @@ pt_init(void)
         final_page = (pde_t *)((char *)pagedir + sizeof(*pagedir));
         KASSERT(PAGE_ALIGNED(final_page));
         memset(final_page, 0, PAGE_SIZE);
+        sched_queue_init(&kmap_waitq);
         temppdir[PT_ENTRY_COUNT - 1] = ((uintptr_t)final_page
                                         - (uintptr_t)&kernel_start + KERNEL_PHYS_BASE) | PT_PRESENT | PT_WRITE;
         pagedir->pd_physical[PT_ENTRY_COUNT - 1] = temppdir[PT_ENTRY_COUNT - 1];
         pagedir->pd_virtual[PT_ENTRY_COUNT - 1] = final_page;
 
+        /* The kernel's mappings are the same in every page directory, so
+         * where the processor allows it mark them global, and they are not
+         * flushed from the TLB on every context switch. (4mb pages would
+         * shrink the map further, but with the kernel loaded at
+         * KERNEL_PHYS_BASE virtual and physical addresses are never both
+         * 4mb aligned.) The identity map below goes away in
+         * pt_template_init, so it is not global. */
+        uint32_t kptflags = PT_PRESENT | PT_WRITE;
+        uint32_t eax, edx;
+        cpuid(CPUID_GETFEATURES, &eax, &edx);
+        if (edx & CPUID_FEAT_EDX_PGE) {
+                kptflags |= PT_GLOBAL;
+        }
+
         /* identity map the first 4mb (one page table) of physical memory */
         pte_t *pagetable = final_page + PT_ENTRY_COUNT;
         _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE, 0, 0);
@@ -297,7 +696,7 @@ pt_init(void)
          * this will make our new page table identical to the temporary
          * page table the boot loader created. */
         pagetable += PT_ENTRY_COUNT;
-        _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE,
+        _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, kptflags,
                       (uintptr_t)&kernel_start, KERNEL_PHYS_BASE);
 
         current_pagedir = pagedir;
@@ -305,20 +704,63 @@ pt_init(void)
          * permanant page table */
         pt_set(pagedir);
 
+        if (kptflags & PT_GLOBAL) {
+                uint32_t cr4;
+                __asm__ volatile("movl %%cr4, %0" : "=r"(cr4));
+                __asm__ volatile("movl %0, %%cr4" :: "r"(cr4 | CR4_PGE) : "memory");
+        }
+
+        /* nothing is mapped with PT_PAT yet, so entry 4 can change
+         * without flushing anything */
+        if (edx & CPUID_FEAT_EDX_PAT) {
+                cpuid_set_msr(MSR_PAT, PAT_ENTRIES(PAT_WB, PAT_WT, PAT_UC_MINUS, PAT_UC),
+                              PAT_ENTRIES(PAT_WC, PAT_WT, PAT_UC_MINUS, PAT_UC));
+                pt_wc_flags = PT_PAT;
+        }
+
+        /* have kernel writes fault on read-only user mappings as user
+         * writes do, so that copy_to_user cannot write to a page shared
+         * copy-on-write */
+        uint32_t cr0;
+        __asm__ volatile("movl %%cr0, %0" : "=r"(cr0));
+        __asm__ volatile("movl %0, %%cr0" :: "r"(cr0 | CR0_WP) : "memory");
+
         uintptr_t physmax = phys_detect_highmem();
         dbgq(DBG_MM, "Highest usable physical memory: 0x%08x\n", physmax);
         dbgq(DBG_MM, "Available memory: 0x%08x\n", physmax - KERNEL_PHYS_BASE);
 
+        /* the direct map stops where the vmalloc area, and then
+         * final_page's table, begin, and the rest of memory is high
+         * memory */
+        KASSERT(VMALLOC_END == final_vaddr(0));
+        KASSERT(0 == VMALLOC_START % PT_VADDR_SIZE);
+        uintptr_t lowmax = physmax;
+        if (physmax - KERNEL_PHYS_BASE > VMALLOC_START - (uintptr_t)&kernel_start) {
+                lowmax = VMALLOC_START - (uintptr_t)&kernel_start + KERNEL_PHYS_BASE;
+                dbgq(DBG_MM, "High memory: 0x%08x\n", physmax - lowmax);
+        }
+
         uintptr_t vaddr = ((uintptr_t)&kernel_start);
         uintptr_t paddr = KERNEL_PHYS_BASE;
         do {
                 pagetable += PT_ENTRY_COUNT;
                 vaddr += PT_VADDR_SIZE;
                 paddr += PT_VADDR_SIZE;
-                _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE, vaddr, paddr);
-        } while (paddr < physmax);
+                _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, kptflags, vaddr, paddr);
+        } while (paddr + PT_VADDR_SIZE < lowmax);
 
-        page_add_range((uintptr_t) pagetable + PT_ENTRY_COUNT, physmax + ((uintptr_t)&kernel_start) - KERNEL_PHYS_BASE);
+        uint32_t i;
+        vmalloc_ptes = pagetable + PT_ENTRY_COUNT;
+        for (i = 0; i < VMALLOC_PTABLES; ++i) {
+                pagetable += PT_ENTRY_COUNT;
+                memset(pagetable, 0, PAGE_SIZE);
+                pagedir->pd_physical[vaddr_to_pdindex(VMALLOC_START) + i] =
+                        pt_virt_to_phys((uintptr_t)pagetable) | PD_PRESENT | PD_WRITE;
+                pagedir->pd_virtual[vaddr_to_pdindex(VMALLOC_START) + i] = (uintptr_t *)pagetable;
+        }
+
+        page_add_range((uintptr_t) pagetable + PT_ENTRY_COUNT, lowmax + ((uintptr_t)&kernel_start) - KERNEL_PHYS_BASE);
+        page_add_highmem(lowmax, physmax);
 }
 
 void
@@ -335,6 +777,12 @@ pt_template_init()
         KASSERT(NULL != template_pagedir);
         memcpy(template_pagedir, current_pagedir, sizeof(*template_pagedir));
 
+        /* the emptied table is not needed in user page directories,
+         * whose first slot keeps the resident count instead */
+        KASSERT(0 == vaddr_to_pdindex(USER_MEM_LOW - 1));
+        template_pagedir->pd_physical[0] = 0;
+        template_pagedir->pd_virtual[0] = NULL;
+
         intr_register(INTR_PAGE_FAULT, _pt_fault_handler);
 }
 
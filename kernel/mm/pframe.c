@@ -1,15 +1,24 @@
 #include "globals.h"
 #include "config.h"
 #include "errno.h"
+#include "kernel.h"
+
+#include "boot/config.h"
 
 #include "proc/proc.h"
 
 #include "util/debug.h"
 #include "util/string.h"
+#include "util/counter.h"
+#include "util/printf.h"
+#include "util/time.h"
+#include "util/trace.h"
+#include "util/tracepoint.h"
 
 #include "mm/mmobj.h"
 #include "mm/page.h"
 #include "mm/slab.h"
+#include "mm/shrink.h"
 #include "mm/kmalloc.h"
 #include "mm/pframe.h"
 #include "mm/tlb.h"
@@ -17,6 +26,11 @@
 
 #include "vm/vmmap.h"
 
+#include "drivers/blockdev.h"
+
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
 /*
  * In this file, physical pages (as represented by pframes) will be
  * referred to as "pages"
@@ -52,14 +66,11 @@
  * When a page is allocated or pinned:
  *     - pf_link links the page into allocated_list or pinned_list,
  *       respectively
- *     - pf_hlink links the page into the appropriate hash chain of the
- *       resident page hashtable
  *     - pf_olink links the page into the appropriate mmobj's list of
- *       resident pages
+ *       resident pages, and the page is in that mmobj's mmo_pages tree
  *
  * When a page is free:
  *     - pf_link links the page into free_list
- *     - pf_hlink does not link the page into any list
  *     - pf_olink does not link the page into any list
  */
 
@@ -76,20 +87,100 @@ static list_t pinned_list;
 
 /*     The ALLOCATED list: */
 /*       Pages on this list contain useful/actual/real data. This list is
- *       maintained in least-recently-requested (via pframe_get or
- *       pframe_get_resident) (and thus, *roughly/approximately* LRU) order.
+ *       the face of pageoutd's CLOCK: the head is where the hand points,
+ *       and pages the hand passes over go to the tail. Rather than moving
+ *       pages to the tail every time they are requested (via pframe_get or
+ *       pframe_get_resident), requests set PF_REFERENCED, and the hand
+ *       gives referenced pages a second trip around before reclaiming
+ *       them. For pages mapped into user address spaces the hand also
+ *       samples the accessed bits in the page tables.
  */
 static int nallocated;
 static list_t alloc_list;
 
-static slab_allocator_t *pframe_allocator;
+/*     The DIRTY list: */
+/*       Dirty pages which are not pinned (so the ones which can be cleaned)
+ *       are also on this list, roughly in the order they got dirty. flushd
+ *       writes back the ones which have stayed dirty too long, and the
+ *       oldest ones when too many pages are dirty.
+ *
+ *       The same pages are also on their object's mmo_dirtypages, and
+ *       objects with any are on dirty_objs, so that sync(2) and unmounts
+ *       go straight to what needs writing rather than over every resident
+ *       page again each time they block.
+ */
+static int ndirty;
+static list_t dirty_list;
+static list_t dirty_objs;
+static uint32_t flush_gen;
+
+/*     The MAPPED list: */
+/*       Cleaning a page leaves its user mappings writable, so a write
+ *       through one of them after that sets only the dirty bit in the page
+ *       table. Clean pages which some mapping can still write to are kept
+ *       on this list, and flushd harvests their dirty bits every time it
+ *       looks. Pages drop off once no mapping can write to them.
+ */
+static list_t mapped_list;
+
+/*     The descriptors: */
+/*       Every page the page allocator manages has a pframe_t, found from
+ *       its address in O(1) by pframe_from_addr. Rather than one array,
+ *       which the page allocator could not hand out in one piece, they
+ *       are kept in chunks of PFRAME_MAP_PAGES pages each, and
+ *       pframe_map points to the chunks in order. Descriptors of free
+ *       pages have no pf_obj.
+ */
+#define PFRAME_MAP_PAGES        8
+#define PFRAME_MAP_CHUNK        ((PFRAME_MAP_PAGES * PAGE_SIZE) / sizeof(pframe_t))
+
+static pframe_t **pframe_map;
+static uintptr_t pframe_map_start;
+static uint32_t pframe_map_npages;
 
-/* Used to quickly look up pframes. ALL pages "owned by" some
- * mmobj should be in this hash
- * (object, pagenum) --> list of pframes */
-#define hash_page(obj, pagenum)  ((((uint32_t)(obj)) + (pagenum)) \
-                                  % PF_HASH_SIZE)
-static list_t pframe_hash[PF_HASH_SIZE];
+/*       Pages in high memory have no place in pframe_map, nor need one, as
+ *       nothing looks them up by address: their descriptors are allocated
+ *       along with them, from this.
+ */
+static slab_allocator_t *pframe_high_allocator;
+
+/* pframe_get calls which found the page resident, and which did not */
+static counter_t pframe_nhits;
+static counter_t pframe_nmisses;
+
+/* Pages filled and cleaned, by the kind of object (MMOBJ_*), and how many
+ * of the fills were prefetches */
+static counter_t pframe_nfills[NMMOBJ_TYPES];
+static counter_t pframe_ncleans[NMMOBJ_TYPES];
+static counter_t pframe_nprefetches;
+static const char *pframe_type_names[NMMOBJ_TYPES] = {
+        [MMOBJ_OTHER]    = "other",
+        [MMOBJ_ANON]     = "anon",
+        [MMOBJ_SHADOW]   = "shadow",
+        [MMOBJ_VNODE]    = "vnode",
+        [MMOBJ_BLOCKDEV] = "blockdev"
+};
+static const char *pframe_fill_names[NMMOBJ_TYPES] = {
+        "pframe.fills.other", "pframe.fills.anon", "pframe.fills.shadow",
+        "pframe.fills.vnode", "pframe.fills.blockdev"
+};
+static const char *pframe_clean_names[NMMOBJ_TYPES] = {
+        "pframe.cleans.other", "pframe.cleans.anon", "pframe.cleans.shadow",
+        "pframe.cleans.vnode", "pframe.cleans.blockdev"
+};
+
+/* Threads which waited on alloc_waitq, and for how long in all */
+static counter_t pframe_nallocwaits;
+static counter_t pframe_allocwait_ns;
+
+/* Times pageoutd went around its loop, pages its hand passed over, and
+ * of those, how many it reclaimed and how many it cleaned, and the
+ * objects the shrinkers freed */
+static counter_t pageoutd_nruns;
+static counter_t pageoutd_nscanned;
+static counter_t pageoutd_nreclaimed;
+static counter_t pageoutd_ncleaned;
+static counter_t pageoutd_nshrunk;
 
 /* Related to the Pageout daemon: */
 
@@ -104,10 +195,28 @@ static ktqueue_t pageoutd_waitq;
 /* threads waiting for pageoutd to run sleep on this queue */
 static ktqueue_t alloc_waitq;
 
+/* Related to the flusher: */
+
+/*   flushd sleeps on this queue, counting the times it has woken up to
+ *   look at the dirty pages */
+static proc_t *flushd = NULL;
+static kthread_t *flushd_thr = NULL;
+static ktqueue_t flushd_waitq;
+static uint32_t flushd_looks = 0;
+
+/* writers waiting for flushd to catch up sleep on this queue */
+static ktqueue_t dirty_waitq;
+
+static void *flushd_run(int arg1, void *arg2);
+static void pframe_clean_pts(pframe_t *pf);
+#define flushd_wakeup()          (sched_broadcast_on(&flushd_waitq))
+#define dirty_above(shift)       \
+	(ndirty > (int)((nallocated + page_free_count()) >> (shift)))
+
 /* Pageout daemon functions */
 static void *pageoutd_run(int arg1, void *arg2);
 static void pageoutd_exit(void);
-#define pageoutd_wakeup()        (sched_broadcast_on(&pageoutd_waitq))
+#define pageoutd_wakeup()        (sched_broadcast_urgent(&pageoutd_waitq))
 #define pageoutd_needed()        \
 	((page_free_count() <= nfreepages_min) && (!list_empty(&alloc_list)))
 #define pageoutd_target_met()    (page_free_count() >= nfreepages_target)
@@ -115,26 +224,42 @@ static void pageoutd_exit(void);
 
 /*
  * Initialize the pinned and allocated counts and lists. Then, make a pframe
- * slab allocator. You should also list_init all the lists that make
- * up the pframe_hash. Finally, you need to set things up for pageoutd to
+ * slab allocator. Finally, you need to set things up for pageoutd to
  * run by setting nfreepages_min and nfreepages_target.
  */
 void
 pframe_init(void)
 {
+        int i;
+
         /* initialize page lists: */
         npinned = 0;
         list_init(&pinned_list);
         nallocated = 0;
         list_init(&alloc_list);
+        ndirty = 0;
+        list_init(&dirty_list);
+        list_init(&dirty_objs);
+        list_init(&mapped_list);
+
+        uintptr_t start, end;
+        uint32_t nchunks;
+        page_range(&start, &end);
+        KASSERT(start < end);
+        pframe_map_start = start;
+        pframe_map_npages = ADDR_TO_PN(end - start);
+        nchunks = (pframe_map_npages + PFRAME_MAP_CHUNK - 1) / PFRAME_MAP_CHUNK;
+        pframe_map = kmalloc(nchunks * sizeof(*pframe_map));
+        KASSERT(NULL != pframe_map);
+        for (i = 0; i < (int)nchunks; i++) {
+                pframe_map[i] = page_alloc_n(PFRAME_MAP_PAGES);
+                KASSERT(NULL != pframe_map[i] && "not enough memory for page descriptors");
+                memset(pframe_map[i], 0, PFRAME_MAP_PAGES * PAGE_SIZE);
+        }
+        pframe_high_allocator = slab_allocator_create_flags("pframe_high", sizeof(pframe_t),
+                                                            SLAB_ALIGN_CACHE);
+        KASSERT(NULL != pframe_high_allocator);
 
-        pframe_allocator = slab_allocator_create("pframe", sizeof(pframe_t));
-        KASSERT(NULL != pframe_allocator);
-
-        /* initialize pframe_hash: */
-        int i;
-        for (i = 0; i < PF_HASH_SIZE; ++i)
-                list_init(&pframe_hash[i]);
 
         /* initialize pageout parameters: */
         nfreepages_target = page_free_count() >> 1;
@@ -142,6 +267,52 @@ pframe_init(void)
 
 		/* initialize alloc_waitq */
 		sched_queue_init(&alloc_waitq);
+		sched_queue_class(&alloc_waitq, SCHED_WQ_ALLOC);
+
+        sched_queue_init(&flushd_waitq);
+        sched_queue_init(&dirty_waitq);
+
+        counter_register(&pframe_nhits, "pframe.hits");
+        counter_register(&pframe_nmisses, "pframe.misses");
+        for (i = 0; i < NMMOBJ_TYPES; i++) {
+                counter_register(&pframe_nfills[i], pframe_fill_names[i]);
+                counter_register(&pframe_ncleans[i], pframe_clean_names[i]);
+        }
+        counter_register(&pframe_nprefetches, "pframe.prefetches");
+        counter_register(&pframe_nallocwaits, "pframe.alloc_waits");
+        counter_register(&pframe_allocwait_ns, "pframe.alloc_wait_ns");
+        counter_register(&pageoutd_nruns, "pageoutd.runs");
+        counter_register(&pageoutd_nscanned, "pageoutd.scanned");
+        counter_register(&pageoutd_nreclaimed, "pageoutd.reclaimed");
+        counter_register(&pageoutd_ncleaned, "pageoutd.cleaned");
+        counter_register(&pageoutd_nshrunk, "pageoutd.shrunk");
+}
+
+/*
+ * Wakes pageoutd up and waits for it to have freed enough pages, for a
+ * thread which has just taken a page while memory is short.
+ *
+ * Rather than have every waiter wake at once and race for the pages,
+ * pageoutd wakes only the first, and each in turn wakes the next when it
+ * runs, as long as memory is not short again; if it is, the next is left
+ * for pageoutd to wake after another run.
+ */
+static void
+pframe_wait_for_pageoutd(void)
+{
+        uint64_t start = time_now_ns();
+
+        pageoutd_wakeup();
+        sched_sleep_on_exclusive(&alloc_waitq);
+        counter_inc(&pframe_nallocwaits);
+        counter_add(&pframe_allocwait_ns, time_now_ns() - start);
+
+        if (!sched_queue_empty(&alloc_waitq)) {
+                if (pageoutd_needed())
+                        pageoutd_wakeup();
+                else
+                        sched_wakeup_n(&alloc_waitq, 1);
+        }
 }
 
 void
@@ -149,12 +320,18 @@ pframe_shutdown()
 {
         KASSERT(PID_IDLE == curproc->p_pid); /* Should call from idleproc */
 
-        /* Stop pageoutd and wait for it */
+        /* Stop pageoutd and flushd and wait for them */
         pageoutd_exit();
 
         int pid = pageoutd->p_pid;
-        int child = do_waitpid(-1, 0, NULL);
+        int child = do_waitpid(pid, 0, NULL);
         KASSERT(pid == child && "waited on process other than pageoutd");
+
+        kthread_cancel(flushd_thr, (void *) 0);
+        flushd_thr = NULL;
+        pid = flushd->p_pid;
+        child = do_waitpid(pid, 0, NULL);
+        KASSERT(pid == child && "waited on process other than flushd");
         KASSERT(0 == npinned && "WARNING: FOUND PINNED "
                 "PAGES!!!!!!!!!! SOMETHING IS BROKEN!!\n");
 
@@ -171,6 +348,67 @@ pframe_shutdown()
         } list_iterate_end();
 }
 
+/* Dirty and clean pages, keeping dirty_list and the object's dirty pages
+ * up to date. A page newly dirtied is stamped with how many times flushd
+ * has looked so far. */
+static void
+pframe_obj_dirty_add(pframe_t *pf)
+{
+        mmobj_t *o = pf->pf_obj;
+
+        list_insert_tail(&o->mmo_dirtypages, &pf->pf_odlink);
+        if (!list_link_is_linked(&o->mmo_dlink))
+                list_insert_tail(&dirty_objs, &o->mmo_dlink);
+}
+
+static void
+pframe_obj_dirty_remove(pframe_t *pf)
+{
+        mmobj_t *o = pf->pf_obj;
+
+        list_remove(&pf->pf_odlink);
+        if (list_empty(&o->mmo_dirtypages) && list_link_is_linked(&o->mmo_dlink))
+                list_remove(&o->mmo_dlink);
+}
+
+static void
+pframe_dirty_list_add(pframe_t *pf)
+{
+        list_insert_tail(&dirty_list, &pf->pf_dlink);
+        pframe_obj_dirty_add(pf);
+        if (0 == ndirty++)
+                flushd_wakeup();
+}
+
+static void
+pframe_dirty_list_remove(pframe_t *pf)
+{
+        list_remove(&pf->pf_dlink);
+        pframe_obj_dirty_remove(pf);
+        ndirty--;
+}
+
+static void
+pframe_mark_dirty(pframe_t *pf)
+{
+        if (pframe_is_dirty(pf))
+                return;
+        pframe_set_dirty(pf);
+        pf->pf_dirtied = flushd_looks;
+        if (!pframe_is_pinned(pf))
+                pframe_dirty_list_add(pf);
+}
+
+static void
+pframe_mark_clean(pframe_t *pf)
+{
+        if (!pframe_is_dirty(pf))
+                return;
+        pframe_clear_dirty(pf);
+        if (!pframe_is_pinned(pf))
+                pframe_dirty_list_remove(pf);
+}
+
 /*
  * Obtain the (unique) page identified by 'o' and 'pagenum' only if this page is
  * already resident; if this page is not already resident, NULL is
@@ -186,28 +424,122 @@ pframe_shutdown()
  *
  * @return the page requested, or NULL if it is not resident.
  */
+static inline pframe_t *
+pframe_desc(uintptr_t addr)
+{
+        uint32_t pn = ADDR_TO_PN(addr - pframe_map_start);
+        return pframe_map[pn / PFRAME_MAP_CHUNK] + pn % PFRAME_MAP_CHUNK;
+}
+
+pframe_t *
+pframe_from_addr(const void *addr)
+{
+        pframe_t *pf;
+
+        if ((uintptr_t)addr < pframe_map_start
+            || ADDR_TO_PN((uintptr_t)addr - pframe_map_start) >= pframe_map_npages)
+                return NULL;
+        pf = pframe_desc((uintptr_t)addr);
+        return pframe_is_free(pf) ? NULL : pf;
+}
+
+pframe_t *
+pframe_from_paddr(uintptr_t paddr)
+{
+        /* all of physical memory is mapped in where the kernel is */
+        return pframe_from_addr((char *)&kernel_start + (paddr - KERNEL_PHYS_BASE));
+}
+
+void *
+pframe_kmap(pframe_t *pf)
+{
+        if (!pframe_is_highmem(pf))
+                return pf->pf_addr;
+        return (void *)kmap(pf->pf_paddr);
+}
+
+void
+pframe_kunmap(pframe_t *pf, void *addr)
+{
+        if (pframe_is_highmem(pf))
+                kunmap((uintptr_t)addr);
+}
+
+void
+pframe_kmap_n(pframe_t **pfs, int n, void **addrs)
+{
+        uintptr_t paddrs[PFRAME_RANGE_MAX], vaddrs[PFRAME_RANGE_MAX];
+        int i, nhigh = 0;
+
+        KASSERT(0 <= n && n <= PFRAME_RANGE_MAX);
+        for (i = 0; i < n; i++) {
+                if (pframe_is_highmem(pfs[i]))
+                        paddrs[nhigh++] = pfs[i]->pf_paddr;
+        }
+        kmap_n(paddrs, nhigh, vaddrs);
+        for (i = 0, nhigh = 0; i < n; i++) {
+                addrs[i] = pframe_is_highmem(pfs[i]) ? (void *)vaddrs[nhigh++]
+                                                     : pfs[i]->pf_addr;
+        }
+}
+
+void
+pframe_kunmap_n(pframe_t **pfs, int n, void **addrs)
+{
+        int i;
+        for (i = 0; i < n; i++)
+                pframe_kunmap(pfs[i], addrs[i]);
+}
+
+void *
+pframe_kmap_atomic(pframe_t *pf)
+{
+        if (!pframe_is_highmem(pf))
+                return pf->pf_addr;
+        return (void *)kmap_atomic(pf->pf_paddr);
+}
+
+void
+pframe_kunmap_atomic(pframe_t *pf, void *addr)
+{
+        if (pframe_is_highmem(pf))
+                kunmap_atomic((uintptr_t)addr);
+}
+
 pframe_t *
 pframe_get_resident(struct mmobj *o, uint32_t pagenum)
 {
-        list_t *hashchain;
         pframe_t *pf;
 
-        hashchain = &pframe_hash[hash_page(o, pagenum)];
-        list_iterate_begin(hashchain, pf, pframe_t, pf_hlink) {
-                if ((o == pf->pf_obj) && (pagenum == pf->pf_pagenum)) {
-                        /* found a page with the specified identity. It is
-                         * up to the caller to recognize/care if the page
-                         * is busy. */
-                        if (!pframe_is_pinned(pf)) {
-                                /* send to back of alloc_list */
-                                list_remove(&pf->pf_link);
-                                list_insert_tail(&alloc_list, &pf->pf_link);
-                        }
-                        return pf;
-                }
-        } list_iterate_end();
+        if (NULL != (pf = radix_lookup(&o->mmo_pages, pagenum))) {
+                /* found a page with the specified identity. It is up to the
+                 * caller to recognize/care if the page is busy. */
+                KASSERT(o == pf->pf_obj && pagenum == pf->pf_pagenum);
+                pframe_set_referenced(pf);
+        }
+        return pf;
+}
 
-        return NULL;
+/*
+ * Obtain the resident page of 'o' with the smallest page number that is at
+ * least *pagenum, storing its page number in *pagenum. Like
+ * pframe_get_resident, this does not block and may return a busy page.
+ * Callers use this to visit an object's pages in page number order:
+ *
+ *     for (pn = 0; NULL != (pf = pframe_next_resident(o, &pn)); pn++)
+ *
+ * which stays correct even if the loop body frees pf or blocks.
+ *
+ * @param o the mmobj whose pages to look at
+ * @param pagenum the first page number to consider, and the page number of
+ * the page returned
+ *
+ * @return the page found, or NULL if there are no more resident pages.
+ */
+pframe_t *
+pframe_next_resident(struct mmobj *o, uint32_t *pagenum)
+{
+        return radix_next(&o->mmo_pages, pagenum);
 }
 
 /*
@@ -226,27 +558,55 @@ pframe_get_resident(struct mmobj *o, uint32_t pagenum)
 static pframe_t *
 pframe_alloc(mmobj_t *o, uint32_t pagenum)
 {
-        pframe_t *pf;
-        if (NULL == (pf = slab_obj_alloc(pframe_allocator))) {
-                dbg(DBG_PFRAME, "WARNING: not enough kernel memory\n");
-                return NULL;
+        pframe_t *pf = NULL;
+        void *addr = NULL;
+        uintptr_t paddr;
+        int type = o->mmo_ops->type;
+        /* anonymous pages start out zeroed, which is cheaper done ahead */
+        int zeroed = (MMOBJ_ANON == type);
+
+        /* user memory goes in high memory while there is any, leaving the
+         * rest for what the kernel needs an address for */
+        if ((MMOBJ_ANON == type || MMOBJ_SHADOW == type)
+            && 0 != (paddr = page_alloc_highmem())) {
+                if (NULL == (pf = slab_obj_alloc(pframe_high_allocator))) {
+                        page_free_highmem(paddr);
+                } else {
+                        memset(pf, 0, sizeof(*pf));
+                        zeroed = 0;
+                }
+        }
+        if (NULL == pf) {
+                if (NULL == (addr = zeroed ? page_alloc_movable_zeroed() : page_alloc_movable())) {
+                        dbg(DBG_PFRAME, "WARNING: not enough kernel memory\n");
+                        return NULL;
+                }
+                pf = pframe_desc((uintptr_t)addr);
+                KASSERT(pframe_is_free(pf));
+                paddr = (uintptr_t)addr - (uintptr_t)&kernel_start + KERNEL_PHYS_BASE;
         }
-        if (NULL == (pf->pf_addr = page_alloc())) {
+        if (0 > radix_insert(&o->mmo_pages, pagenum, pf)) {
                 dbg(DBG_PFRAME, "WARNING: not enough kernel memory\n");
-                slab_obj_free(pframe_allocator, pf);
+                if (NULL == addr) {
+                        page_free_highmem(paddr);
+                        slab_obj_free(pframe_high_allocator, pf);
+                } else {
+                        page_free(addr);
+                }
                 return NULL;
         }
+        pf->pf_addr = addr;
+        pf->pf_paddr = paddr;
 
         nallocated++;
         list_insert_tail(&alloc_list, &pf->pf_link);
 
         pf->pf_obj = o;
         pf->pf_pagenum = pagenum;
-        pf->pf_flags = 0; /*PF_DIRTY, PF_BUSY*/
-        sched_queue_init(&pf->pf_waitq);
+        pf->pf_flags = zeroed ? PF_ZEROED : 0; /*PF_DIRTY, PF_BUSY*/
         pf->pf_pincount = 0;
-
-        list_insert_head(&pframe_hash[hash_page(o, pagenum)], &pf->pf_hlink);
+        pf->pf_ksmhash = 0;
+        list_link_init(&pf->pf_mlink);
 
         o->mmo_ops->ref(o);
         o->mmo_nrespages++;
@@ -255,6 +615,18 @@ pframe_alloc(mmobj_t *o, uint32_t pagenum)
         return pf;
 }
 
+/* Charges the current thread with n pages of o read in, if o is a file
+ * or device; anonymous pages are charged in swap_read, if they came from
+ * swap at all */
+static void
+pframe_count_readins(mmobj_t *o, uint32_t n)
+{
+        int type = o->mmo_ops->type;
+
+        if ((MMOBJ_VNODE == type || MMOBJ_BLOCKDEV == type) && NULL != curthr)
+                curthr->kt_nreadins += n;
+}
+
 /*
  * Fills the contents of the page (using the mmobj's fillpage op).
  * Make sure to mark the page busy while it's being filled.
@@ -266,10 +638,12 @@ pframe_fill(pframe_t *pf)
         int ret;
 
         pframe_set_busy(pf);
+        counter_inc(&pframe_nfills[pf->pf_obj->mmo_ops->type]);
+        pframe_count_readins(pf->pf_obj, 1);
         ret = pf->pf_obj->mmo_ops->fillpage(pf->pf_obj, pf);
         pframe_clear_busy(pf);
 
-        sched_broadcast_on(&pf->pf_waitq);
+        sched_broadcast_on(pframe_waitq(pf));
 
         return ret;
 }
@@ -298,32 +672,40 @@ int
 pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result)
 {
     KASSERT(o);
-    dbg(DBG_PFRAME, "called with mmobj %p, pagenum %u\n", o, pagenum);
 
 get_resident:
     *result = pframe_get_resident(o, pagenum);
     if (*result) {
         if pframe_is_busy(*result) {
-            dbg(DBG_PFRAME, "the pframe is resident and BUSY, gonna sleep on it.\n");
-            sched_sleep_on(&((*result)->pf_waitq));
+            tpdbg(DBG_PFRAME, "the pframe is resident and BUSY, gonna sleep on it.\n");
+            sched_sleep_on(pframe_waitq(*result));
             /*KASSERT(*result);*/
             /*return 0;*/
             goto get_resident;
+        } else if (pframe_is_invalid(*result)) {
+            /*an earlier (possibly asynchronous) fill failed, start over*/
+            tpdbg(DBG_PFRAME, "the pframe is resident but INVALID, refilling it.\n");
+            pframe_free(*result);
+            goto get_resident;
         } else {
-            dbg(DBG_PFRAME, "the pframe is resident and not busy, just return it.\n");
+            tpdbg(DBG_PFRAME, "the pframe is resident and not busy, just return it.\n");
             KASSERT(o == (*result)->pf_obj);
+            counter_inc(&pframe_nhits);
+            trace_emit(TRACE_PFRAME_HIT, (uint32_t)o, pagenum, 0);
             return 0;
         }
     } else {
         KASSERT(*result == NULL);
     }
     /* *result == NULL means this page is not resident*/
+    counter_inc(&pframe_nmisses);
+    trace_emit(TRACE_PFRAME_MISS, (uint32_t)o, pagenum, 0);
 
     *result = pframe_alloc(o, pagenum);
     if (*result == NULL) {
         return -ENOMEM;
     } else {
-        dbg(DBG_PFRAME, "got a pframe, now gonna fill it.\n");
+        tpdbg(DBG_PFRAME, "got a pframe, now gonna fill it.\n");
         pframe_pin(*result);
         /*this may block*/
         int err = pframe_fill(*result);
@@ -331,28 +713,151 @@ get_resident:
 
         if (err < 0) {
             /*it's allocated but some error occured during fill the page*/
-            /*so reclaim all the memory this page took*/
+            /*so mark it for the next pframe_get (or pageoutd) to reclaim*/
             /*pframe_free(*result);*/
+            (*result)->pf_flags |= PF_INVALID;
             /*set the result to NULL*/
             *result = NULL;
-            dbg(DBG_PFRAME, "some error when trying to fill the page, error number is %d\n", err);
+            tpdbg(DBG_PFRAME, "some error when trying to fill the page, error number is %d\n", err);
             return err;
         }
 
         /*check to see if we need to call pageoutd*/
         if pageoutd_needed() {
-            /*wake up pageoutd*/
-            sched_wakeup_on(&pageoutd_waitq);
-            /*wait for pageoutd to finish*/
-            sched_sleep_on(&alloc_waitq);
+            /*wake up pageoutd and wait for it to finish*/
+            pframe_wait_for_pageoutd();
 
-            dbg(DBG_PFRAME, "after pageout deamon reclaimed pframes.\n");
+            tpdbg(DBG_PFRAME, "after pageout deamon reclaimed pframes.\n");
         }
         
         return err;
     }
 }
 
+/*
+ * Fill the pages pfs[0..n), which have consecutive page numbers, have just
+ * been allocated, and are busy and pinned, with the object's fillpages op,
+ * or one at a time if it does not have one.
+ */
+static int
+pframe_fill_n(pframe_t **pfs, uint32_t n)
+{
+        mmobj_t *o = pfs[0]->pf_obj;
+        uint32_t i;
+        int ret;
+
+        counter_add(&pframe_nfills[o->mmo_ops->type], n);
+        pframe_count_readins(o, n);
+        if (1 < n && NULL != o->mmo_ops->fillpages)
+                return o->mmo_ops->fillpages(o, pfs, n);
+        for (i = 0; i < n; i++) {
+                if (0 > (ret = o->mmo_ops->fillpage(o, pfs[i])))
+                        return ret;
+        }
+        return 0;
+}
+
+/*
+ * Like pframe_get, but for the npages consecutive pages starting at page
+ * number first, which are returned in result[0..npages). All the pages which
+ * are not yet resident are allocated together and filled in as few
+ * operations as the object allows. Unlike pframe_get, the pages are returned
+ * pinned, so they stay resident even if the caller blocks; release them with
+ * pframe_unpin_range.
+ *
+ * @param o the parent object of the pages
+ * @param first the page number of the first page
+ * @param npages the number of pages, at most PFRAME_RANGE_MAX
+ * @param result used to return the pframes
+ * @return 0 on success, < 0 on failure (in which case nothing is pinned)
+ */
+int
+pframe_get_range(struct mmobj *o, uint32_t first, uint32_t npages, pframe_t **result)
+{
+        uint32_t i, j;
+        uint8_t missing[PFRAME_RANGE_MAX];
+        int ret = 0;
+
+        KASSERT(NULL != o && NULL != result);
+        KASSERT(0 < npages && npages <= PFRAME_RANGE_MAX);
+        dbg(DBG_PFRAME, "called with mmobj %p, pages %u-%u\n", o, first, first + npages - 1);
+
+again:
+        /* Nothing may block between this scan and pinning the pages */
+        for (i = 0; i < npages; i++) {
+                pframe_t *pf = pframe_get_resident(o, first + i);
+                if (NULL != pf && pframe_is_busy(pf)) {
+                        sched_sleep_on(pframe_waitq(pf));
+                        goto again;
+                }
+                if (NULL != pf && pframe_is_invalid(pf)) {
+                        /* this may block */
+                        pframe_free(pf);
+                        goto again;
+                }
+                result[i] = pf;
+        }
+
+        for (i = 0; i < npages; i++) {
+                if (0 != (missing[i] = (NULL == result[i]))) {
+                        if (NULL == (result[i] = pframe_alloc(o, first + i))) {
+                                ret = -ENOMEM;
+                                break;
+                        }
+                        pframe_set_busy(result[i]);
+                }
+                pframe_pin(result[i]);
+        }
+        if (0 > ret) {
+                for (j = 0; j < i; j++) {
+                        pframe_unpin(result[j]);
+                        if (missing[j]) {
+                                pframe_clear_busy(result[j]);
+                                pframe_free(result[j]);
+                        }
+                }
+                return ret;
+        }
+
+        /* Fill each run of missing pages */
+        for (i = 0; i < npages; i = j) {
+                for (j = i + 1; j < npages && missing[i] == missing[j]; j++)
+                        ;
+                if (missing[i] && 0 == ret)
+                        ret = pframe_fill_n(&result[i], j - i);
+                if (missing[i]) {
+                        for (; i < j; i++) {
+                                if (0 > ret)
+                                        result[i]->pf_flags |= PF_INVALID;
+                                pframe_clear_busy(result[i]);
+                                sched_broadcast_on(pframe_waitq(result[i]));
+                        }
+                }
+        }
+        if (0 > ret) {
+                dbg(DBG_PFRAME, "error filling pages: %d\n", ret);
+                pframe_unpin_range(result, npages);
+                return ret;
+        }
+
+        if (pageoutd_needed()) {
+                /* the pages are pinned, so this is safe */
+                pframe_wait_for_pageoutd();
+        }
+        return 0;
+}
+
+/*
+ * Unpin the pages returned by pframe_get_range.
+ */
+void
+pframe_unpin_range(pframe_t **pfs, uint32_t npages)
+{
+        uint32_t i;
+        for (i = 0; i < npages; i++)
+                pframe_unpin(pfs[i]);
+}
+
 int
 pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result)
 {
@@ -362,6 +867,72 @@ pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result
         return o->mmo_ops->lookuppage(o, pagenum, forwrite, result);
 }
 
+/*
+ * Start bringing the page identified by the object and page number into
+ * memory without waiting for it, if the object supports asynchronous fills
+ * and there is memory to spare. If the page is already resident this does
+ * nothing. A later pframe_get of the page will wait for the fill to finish.
+ *
+ * @param o the parent object of the page
+ * @param pagenum the page number of this page in the object
+ * @return 0 if the page is resident or on its way, < 0 on failure.
+ */
+int
+pframe_prefetch(struct mmobj *o, uint32_t pagenum)
+{
+        pframe_t *pf;
+        int ret;
+
+        KASSERT(NULL != o);
+
+        if (NULL == o->mmo_ops->fillpage_async)
+                return -ENOTSUP;
+        if (NULL != pframe_get_resident(o, pagenum))
+                return 0;
+        /* Prefetching is speculative, it should never cause reclaim */
+        if (pageoutd_needed())
+                return -ENOMEM;
+        if (NULL == (pf = pframe_alloc(o, pagenum)))
+                return -ENOMEM;
+
+        /* Keep the page from being reclaimed while it fills; see
+         * pframe_fill_done */
+        pframe_pin(pf);
+        pframe_set_busy(pf);
+        counter_inc(&pframe_nfills[o->mmo_ops->type]);
+        counter_inc(&pframe_nprefetches);
+        if ((ret = o->mmo_ops->fillpage_async(o, pf)) < 0) {
+                pframe_unpin(pf);
+                pframe_clear_busy(pf);
+                sched_broadcast_on(pframe_waitq(pf));
+                pframe_free(pf);
+        }
+        return ret;
+}
+
+/*
+ * Called by an mmobj when an asynchronous fill started by its
+ * fillpage_async entry point completes. This does not block, so it may be
+ * called from an I/O completion callback.
+ *
+ * @param pf the page that was being filled
+ * @param status 0 or the -errno the fill failed with
+ */
+void
+pframe_fill_done(pframe_t *pf, int status)
+{
+        KASSERT(pframe_is_busy(pf) && pframe_is_pinned(pf));
+
+        if (status < 0) {
+                dbg(DBG_PFRAME, "asynchronous fill of page %d of obj %p failed: %d\n",
+                    pf->pf_pagenum, pf->pf_obj, status);
+                pf->pf_flags |= PF_INVALID;
+        }
+        pframe_unpin(pf);
+        pframe_clear_busy(pf);
+        sched_broadcast_on(pframe_waitq(pf));
+}
+
 /*
  * Migrate a page frame up the tree. The destination must be on the same
  * branch as the pframe's current object. pf must not be busy. If dest
@@ -369,28 +940,37 @@ pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result
  *
  * @param pf page to be migrated
  * @param dest destination vm object
+ * @return 0 on success, or -ENOMEM if there was no memory to add the page
+ * to dest, in which case it stays where it was.
  */
-void
+int
 pframe_migrate(pframe_t *pf, mmobj_t *dest)
 {
         KASSERT(!pframe_is_busy(pf));
-        if (NULL != pframe_get_resident(dest, pf->pf_pagenum)) {
+        if (NULL != radix_lookup(&dest->mmo_pages, pf->pf_pagenum)) {
                 /* dest already has a newer version of the page, clean this page */
                 pframe_unpin(pf);
                 pframe_clean(pf);
                 pframe_free(pf);
         } else {
                 mmobj_t *src = pf->pf_obj;
+                int ondirty = pframe_is_dirty(pf) && !pframe_is_pinned(pf);
+                if (0 > radix_insert(&dest->mmo_pages, pf->pf_pagenum, pf))
+                        return -ENOMEM;
+                radix_remove(&src->mmo_pages, pf->pf_pagenum);
+                if (ondirty)
+                        pframe_obj_dirty_remove(pf);
                 pf->pf_obj = dest;
-                list_remove(&pf->pf_hlink);
+                if (ondirty)
+                        pframe_obj_dirty_add(pf);
                 list_remove(&pf->pf_olink);
                 src->mmo_nrespages--;
                 src->mmo_ops->put(src);
-                list_insert_head(&pframe_hash[hash_page(dest, pf->pf_pagenum)], &pf->pf_hlink);
                 list_insert_head(&dest->mmo_respages, &pf->pf_olink);
                 dest->mmo_nrespages++;
                 dest->mmo_ops->ref(dest);
         }
+        return 0;
 }
 
 /*
@@ -420,6 +1000,11 @@ pframe_pin(pframe_t *pf)
         /*add it to pinned list*/
         list_insert_head(&pinned_list, &pf->pf_link);
         npinned++;
+
+        /*it can't be cleaned while pinned*/
+        if (pframe_is_dirty(pf)) {
+            pframe_dirty_list_remove(pf);
+        }
     }
 }
 
@@ -446,9 +1031,49 @@ pframe_unpin(pframe_t *pf)
         list_insert_tail(&alloc_list, &pf->pf_link);
         /*a little bit shaky about insert tail(LRU)*/
         nallocated++;
+
+        if (pframe_is_dirty(pf)) {
+            pframe_dirty_list_add(pf);
+        }
     }
 }
 
+/*
+ * Called on a page a sequential scan has gone past: it goes where
+ * pageoutd's hand points, without a second chance, so that it is the
+ * first page reclaimed rather than somebody else's. A mapping which
+ * touches it again in the meantime still saves it.
+ *
+ * @param pf the page, which may be busy
+ */
+void
+pframe_deactivate(pframe_t *pf)
+{
+        if (pframe_is_pinned(pf))
+                return;
+        pframe_clear_referenced(pf);
+        list_remove(&pf->pf_link);
+        list_insert_head(&alloc_list, &pf->pf_link);
+}
+
+/*
+ * Throws away a page of anonymous memory which nothing is going to read
+ * again, for MADV_DONTNEED. Such pages are pinned once by their object
+ * (anon and shadow objects keep all their pages pinned); a busy page, or
+ * one somebody else has pinned as well, is left alone.
+ *
+ * This routine may block in the mmobj put operation.
+ * @param pf the page to throw away
+ */
+void
+pframe_discard(pframe_t *pf)
+{
+        if (pframe_is_busy(pf) || 1 != pf->pf_pincount)
+                return;
+        pframe_unpin(pf);
+        pframe_free(pf);
+}
+
 /*
  * Indicates that a page is about to be modified. This should be called on a
  * page before any attempt to modify its contents. This marks the page dirty
@@ -471,10 +1096,10 @@ pframe_dirty(pframe_t *pf)
         pframe_set_busy(pf);
 
         if (!(ret = pf->pf_obj->mmo_ops->dirtypage(pf->pf_obj, pf))) {
-                pframe_set_dirty(pf);
+                pframe_mark_dirty(pf);
         }
         pframe_clear_busy(pf);
-        sched_broadcast_on(&pf->pf_waitq);
+        sched_broadcast_on(pframe_waitq(pf));
 
         return ret;
 }
@@ -504,18 +1129,73 @@ pframe_clean(pframe_t *pf)
          * that if the page is dirtied again while we're writing it out,
          * we won't (incorrectly) think the page has been fully cleaned.
          */
-        pframe_clear_dirty(pf);
-
-        /* Make sure a future write to the page will fault (and hence dirty it) */
-        tlb_flush((uintptr_t) pf->pf_addr);
-        pframe_remove_from_pts(pf);
+        pframe_clean_pts(pf);
 
         pframe_set_busy(pf);
+        counter_inc(&pframe_ncleans[pf->pf_obj->mmo_ops->type]);
         if ((ret = pf->pf_obj->mmo_ops->cleanpage(pf->pf_obj, pf)) < 0) {
-                pframe_set_dirty(pf);
+                pframe_mark_dirty(pf);
         }
         pframe_clear_busy(pf);
-        sched_broadcast_on(&pf->pf_waitq);
+        sched_broadcast_on(pframe_waitq(pf));
+
+        return ret;
+}
+
+/*
+ * Clean npages dirty, unpinned pages of the same object with consecutive
+ * page numbers (pfs[i]->pf_pagenum == pfs[0]->pf_pagenum + i). If the object
+ * provides a cleanpages entry point, the pages are written back together in
+ * a single operation; otherwise this is just pframe_clean on each page.
+ *
+ * This routine can block at the mmobj operation level.
+ * @param pfs the pages to clean
+ * @param npages the number of pages in pfs
+ * @return 0 on success, -errno on failure
+ */
+int
+pframe_clean_n(pframe_t **pfs, int npages)
+{
+        int i, ret;
+        mmobj_t *o;
+
+        KASSERT(0 < npages);
+        o = pfs[0]->pf_obj;
+
+        if (1 == npages || NULL == o->mmo_ops->cleanpages) {
+                int err = 0;
+                for (i = 0; i < npages; i++) {
+                        if ((ret = pframe_clean(pfs[i])) < 0)
+                                err = ret;
+                }
+                return err;
+        }
+
+        /* See pframe_clean for why the order here matters */
+        for (i = 0; i < npages; i++) {
+                pframe_t *pf = pfs[i];
+                KASSERT(o == pf->pf_obj);
+                KASSERT(pfs[0]->pf_pagenum + i == pf->pf_pagenum);
+                KASSERT(pframe_is_dirty(pf) && "Cleaning page that isn't dirty!");
+                KASSERT(pf->pf_pincount == 0 && "Cleaning a pinned page!");
+                KASSERT(!pframe_is_busy(pf));
+
+                pframe_clean_pts(pf);
+                pframe_set_busy(pf);
+        }
+
+        dbg(DBG_PFRAME, "cleaning pages %d-%d of obj %p\n", pfs[0]->pf_pagenum,
+            pfs[0]->pf_pagenum + npages - 1, o);
+
+        counter_add(&pframe_ncleans[o->mmo_ops->type], npages);
+        ret = o->mmo_ops->cleanpages(o, pfs, npages);
+
+        for (i = 0; i < npages; i++) {
+                if (ret < 0)
+                        pframe_mark_dirty(pfs[i]);
+                pframe_clear_busy(pfs[i]);
+                sched_broadcast_on(pframe_waitq(pfs[i]));
+        }
 
         return ret;
 }
@@ -538,24 +1218,35 @@ pframe_free(pframe_t *pf)
         dbg(DBG_PFRAME, "uncaching page %d of obj %p\n", pf->pf_pagenum, pf->pf_obj);
 
         mmobj_t *o = pf->pf_obj;
+        int high = pframe_is_highmem(pf);
+
+        /* whatever was not written back is thrown away */
+        pframe_mark_clean(pf);
+        if (list_link_is_linked(&pf->pf_mlink))
+                list_remove(&pf->pf_mlink);
 
 
         /* Flush the TLB */
-        tlb_flush((uintptr_t) pf->pf_addr);
+        if (!high)
+                tlb_flush((uintptr_t) pf->pf_addr);
         /* Remove from all pagetables that map it */
         pframe_remove_from_pts(pf);
 
-        list_remove(&pf->pf_hlink);
+        radix_remove(&o->mmo_pages, pf->pf_pagenum);
 
         pf->pf_obj = NULL;
         nallocated--;
         list_remove(&pf->pf_link);
 
-        page_free(pf->pf_addr);
-        slab_obj_free(pframe_allocator, pf);
+        if (high)
+                page_free_highmem(pf->pf_paddr);
+        else
+                page_free(pf->pf_addr);
 
         o->mmo_nrespages--;
         list_remove(&pf->pf_olink);
+        if (high)
+                slab_obj_free(pframe_high_allocator, pf);
 
         /* Now that pf has effectively been freed, dereference the corresponding
          * object. We don't do this earlier as we are modifying the object's counts
@@ -563,6 +1254,89 @@ pframe_free(pframe_t *pf)
         o->mmo_ops->put(o);
 }
 
+static int pageoutd_clean_batch(pframe_t **batch, int n);
+
+/*
+ * Write back the dirty pages of o, in page number order and up to
+ * PFRAME_FLUSH_BATCH at a time, so that neighbouring ones go together.
+ * Each page which was dirty to begin with is visited once: ones dirtied
+ * again, or which fail, go to the back of the object's list and are left
+ * for next time, so this ends however busy the object is. Returns 0, or
+ * the first error.
+ */
+int
+pframe_clean_obj(mmobj_t *o)
+{
+        pframe_t *batch[PFRAME_FLUSH_BATCH];
+        pframe_t *pf, *busy;
+        list_link_t *l;
+        int budget = 0, nbatch, ret, err = 0;
+
+        list_iterate_begin(&o->mmo_dirtypages, pf, pframe_t, pf_odlink) {
+                budget++;
+        } list_iterate_end();
+
+        while (0 < budget && !list_empty(&o->mmo_dirtypages)) {
+                /* the busy ones are being cleaned or freed already */
+                nbatch = 0;
+                busy = NULL;
+                for (l = o->mmo_dirtypages.l_next;
+                     l != &o->mmo_dirtypages && nbatch < MIN(budget, PFRAME_FLUSH_BATCH);
+                     l = l->l_next) {
+                        pf = list_item(l, pframe_t, pf_odlink);
+                        KASSERT(pframe_is_dirty(pf) && !pframe_is_pinned(pf));
+                        if (pframe_is_busy(pf)) {
+                                if (NULL == busy)
+                                        busy = pf;
+                                continue;
+                        }
+                        pframe_set_busy(pf);
+                        batch[nbatch++] = pf;
+                }
+
+                if (0 == nbatch) {
+                        KASSERT(NULL != busy);
+                        sched_sleep_on(pframe_waitq(busy));
+                        continue;
+                }
+                budget -= nbatch;
+                if (0 > (ret = pageoutd_clean_batch(batch, nbatch)) && 0 == err)
+                        err = ret;
+                /* each batch starts from the list head anyway */
+                cond_resched();
+        }
+        return err;
+}
+
+/*
+ * Write back the dirty pages of every object match says yes to (or of
+ * every object, if match is NULL), visiting each object once. Returns 0,
+ * or the first error.
+ */
+int
+pframe_clean_objs(int (*match)(mmobj_t *o, void *arg), void *arg)
+{
+        mmobj_t *o;
+        uint32_t gen = ++flush_gen;
+        int ret, err = 0;
+
+        /* cleaning blocks, and the list may change under us meanwhile, so
+         * start over after each object, skipping the ones this call did */
+again:
+        list_iterate_begin(&dirty_objs, o, mmobj_t, mmo_dlink) {
+                if (gen != o->mmo_flushgen && (NULL == match || match(o, arg))) {
+                        o->mmo_flushgen = gen;
+                        o->mmo_ops->ref(o);
+                        if (0 > (ret = pframe_clean_obj(o)) && 0 == err)
+                                err = ret;
+                        o->mmo_ops->put(o);
+                        cond_resched();
+                        goto again;
+                }
+        } list_iterate_end();
+        return err;
+}
+
 /*
  * Clean all allocated pages (that is, all pages that are not pinned and
  * not free). This is called by sync(2).
@@ -570,56 +1344,167 @@ pframe_free(pframe_t *pf)
 void
 pframe_clean_all()
 {
-        pframe_t *pf;
+        int err;
         dbg(DBG_PFRAME, "pframe_clean_all: starting (this may take a while)\n");
 
-        /*
-         * Iterate from head of alloc_list to tail; This is a rough attempt to
-         * sync from least active to most active. Note that every time we block we
-         * need to start the loop over as the "current element" pf may have been
-         * moved or removed in the meantime (our list has no multithreaded
-         * integrity)
-         */
-list_start:
-        list_iterate_begin(&alloc_list, pf, pframe_t, pf_link) {
-                KASSERT(!pframe_is_pinned(pf));
-                KASSERT(!pframe_is_free(pf));
-                if (pframe_is_busy(pf)) {
-                        sched_sleep_on(&pf->pf_waitq);
-                        goto list_start;
-                }
-                if (pframe_is_dirty(pf)) {
-                        pframe_clean(pf);
-                        goto list_start;
-                }
-        } list_iterate_end();
+        if (0 > (err = pframe_clean_objs(NULL, NULL)))
+                dbg(DBG_PFRAME, "pframe_clean_all: WARNING: failed to clean "
+                    "some pages: %d\n", err);
 
-        /* In theory, this function might never terminate (if new pages are
-         * constantly being added at the same time). That's why the user shouldn't
-         * call sync(2) very much... */
+        /* What was written is in the disks' caches; one flush each puts
+         * all of it on stable storage */
+        blockdev_sync();
         dbg(DBG_PFRAME, "pframe_clean_all: completed!\n");
 }
 
+struct pframe_harvest {
+        pframe_t           *ph_pf;
+        int                 ph_writable;
+};
+
+static void
+pframe_harvest_one(vmarea_t *vma, uintptr_t vaddr, void *arg)
+{
+        struct pframe_harvest *ph = (struct pframe_harvest *)arg;
+
+        if (NULL != vma->vma_vmmap->vmm_proc) {
+                uint32_t flags = pt_clear_dirty(vma->vma_vmmap->vmm_proc->p_pagedir, vaddr);
+                if (PT_DIRTY & flags)
+                        pframe_mark_dirty(ph->ph_pf);
+                if (PT_WRITE & flags)
+                        ph->ph_writable = 1;
+        }
+}
+
+/*
+ * Moves the dirty bits of the user mappings of pf into the page, clearing
+ * them. Returns 1 if one of the mappings can write to the page without
+ * faulting. Like pframe_remove_from_pts, this looks at every area which
+ * maps the page's offset in the object the page is at the bottom of.
+ */
+static int
+pframe_harvest_pts(pframe_t *pf)
+{
+        struct pframe_harvest ph;
+
+        ph.ph_pf = pf;
+        ph.ph_writable = 0;
+        vmarea_obj_walk(pf->pf_obj, pf->pf_pagenum, pframe_harvest_one, &ph);
+        return ph.ph_writable;
+}
+
+/*
+ * Marks the dirty page pf clean, just before it is written back. Writes
+ * through its user mappings from now on are caught by its dirty bits in
+ * the page tables, which are cleared here, rather than by faults: if a
+ * mapping can still write to it the page goes on the mapped list.
+ */
+static void
+pframe_clean_pts(pframe_t *pf)
+{
+        if (pframe_harvest_pts(pf) && !list_link_is_linked(&pf->pf_mlink)) {
+                if (list_empty(&mapped_list))
+                        flushd_wakeup();
+                list_insert_tail(&mapped_list, &pf->pf_mlink);
+        }
+        pframe_mark_clean(pf);
+}
+
+/*
+ * Moves the dirty bits of the user mappings of pf into the page, for when
+ * the page table entries are about to go away, or for msync(2). Only
+ * pages on the mapped list can be dirty there without being dirty
+ * already.
+ */
+void
+pframe_harvest_dirty(pframe_t *pf)
+{
+        if (list_link_is_linked(&pf->pf_mlink) && !pframe_harvest_pts(pf))
+                list_remove(&pf->pf_mlink);
+}
+
+static void
+pframe_unmap_one(vmarea_t *vma, uintptr_t vaddr, void *arg)
+{
+        tlb_gather_t *tg = (tlb_gather_t *)arg;
+
+        if (NULL != vma->vma_vmmap->vmm_proc) {
+                pagedir_t *pd = vma->vma_vmmap->vmm_proc->p_pagedir;
+                pt_unmap(pd, vaddr);
+                /* other page directories get flushed when they are loaded */
+                if (pd == pt_get())
+                        tlb_gather_add(tg, vaddr, 1);
+        }
+}
+
+int
+pframe_movable(const void *addr)
+{
+        pframe_t *pf = pframe_from_addr(addr);
+        return NULL != pf && !pframe_is_pinned(pf) && !pframe_is_busy(pf);
+}
+
+int
+pframe_relocate(void *addr)
+{
+        pframe_t *pf, *npf;
+        void *naddr;
+
+        KASSERT(pframe_movable(addr));
+        pf = pframe_desc((uintptr_t)addr);
+
+        if (NULL == (naddr = page_alloc_movable()))
+                return -ENOMEM;
+        npf = pframe_desc((uintptr_t)naddr);
+        KASSERT(pframe_is_free(npf));
+
+        dbg(DBG_PFRAME, "moving page %d of obj %p from 0x%p to 0x%p\n",
+            pf->pf_pagenum, pf->pf_obj, addr, naddr);
+
+        /* the user mappings go, keeping what they wrote in pf_flags */
+        pframe_harvest_pts(pf);
+        if (list_link_is_linked(&pf->pf_mlink))
+                list_remove(&pf->pf_mlink);
+        pframe_remove_from_pts(pf);
+
+        page_copy(naddr, addr);
+
+        *npf = *pf;
+        npf->pf_addr = naddr;
+        npf->pf_paddr = (uintptr_t)naddr - (uintptr_t)&kernel_start + KERNEL_PHYS_BASE;
+        list_link_init(&npf->pf_mlink);
+        list_insert_before(&pf->pf_link, &npf->pf_link);
+        list_remove(&pf->pf_link);
+        list_insert_before(&pf->pf_olink, &npf->pf_olink);
+        list_remove(&pf->pf_olink);
+        if (pframe_is_dirty(pf)) {
+                list_insert_before(&pf->pf_dlink, &npf->pf_dlink);
+                list_remove(&pf->pf_dlink);
+                list_insert_before(&pf->pf_odlink, &npf->pf_odlink);
+                list_remove(&pf->pf_odlink);
+        }
+        radix_replace(&pf->pf_obj->mmo_pages, pf->pf_pagenum, npf);
+
+        pf->pf_obj = NULL;
+        pf->pf_flags = 0;
+        return 0;
+}
+
 /* Remove a page frame from the page tables of all processes that map it
- * To do that, traverse all processes that map the given page frame into
- * their address space, and zero the corresponding address entry.
+ * To do that, visit the areas which map the page's offset in the bottom
+ * object of its chain (whatever page they map there, so that areas
+ * which were reading another object's copy of it look again), and zero
+ * the corresponding address entry. Areas which do not cover the page
+ * are not looked at, see vmarea_obj_walk().
  */
 void
 pframe_remove_from_pts(pframe_t *pf)
 {
-        vmarea_t *vma;
-        list_iterate_begin(mmobj_bottom_vmas(pf->pf_obj), vma, vmarea_t, vma_olink) {
-                /* Get the virtual address in the area corresponding to this pf */
-                if ((pf->pf_pagenum >= vma->vma_off)
-                    && (pf->pf_pagenum < vma->vma_off + (vma->vma_end - vma->vma_start))) {
-                        uintptr_t vaddr = (uintptr_t) PN_TO_ADDR(vma->vma_start + pf->pf_pagenum - vma->vma_off);
-                        /* And unmap it from that area's proc */
-                        if (NULL != vma->vma_vmmap->vmm_proc) {
-                                pt_unmap(vma->vma_vmmap->vmm_proc->p_pagedir, vaddr);
-                        }
-                }
+        tlb_gather_t tg;
 
-        } list_iterate_end();
+        tlb_gather_init(&tg);
+        vmarea_obj_walk(pf->pf_obj, pf->pf_pagenum, pframe_unmap_one, &tg);
+        tlb_gather_flush(&tg);
 }
 
 /* ------------------------------------------------------------------ */
@@ -644,12 +1529,29 @@ pageoutd_init(void)
         KASSERT(NULL != pageoutd);
         pageoutd_thr = kthread_create(pageoutd, pageoutd_run, 0, NULL);
         KASSERT(NULL != pageoutd_thr);
+        sched_set_affinity(pageoutd_thr, SCHED_HOUSEKEEPING_CPUS);
 
         sched_make_runnable(pageoutd_thr);
 }
 init_func(pageoutd_init);
 init_depends(sched_init);
 
+static __attribute__((unused)) void
+flushd_init(void)
+{
+        KASSERT(curproc && (PID_IDLE == curproc->p_pid)
+                && "should be calling this from idleproc");
+        flushd = proc_create("flushd");
+        KASSERT(NULL != flushd);
+        flushd_thr = kthread_create(flushd, flushd_run, 0, NULL);
+        KASSERT(NULL != flushd_thr);
+        sched_set_affinity(flushd_thr, SCHED_HOUSEKEEPING_CPUS);
+
+        sched_make_runnable(flushd_thr);
+}
+init_func(flushd_init);
+init_depends(sched_init);
+
 /*
  * Just cancel pageoutd
  */
@@ -661,38 +1563,159 @@ pageoutd_exit()
         pageoutd_thr = NULL;
 }
 
+static void
+pframe_sample_one(vmarea_t *vma, uintptr_t vaddr, void *arg)
+{
+        if (NULL != vma->vma_vmmap->vmm_proc)
+                *(int *)arg |= pt_test_and_clear_accessed(vma->vma_vmmap->vmm_proc->p_pagedir, vaddr);
+}
+
+/*
+ * Returns true if any user mapping of pf has been accessed since the last
+ * time the page was sampled, clearing the accessed bits as it goes. The
+ * walk over the mappings is the same as in pframe_remove_from_pts. The
+ * dirty bits are harvested too, so that pageoutd does not take a page
+ * written through a mapping for a clean one.
+ */
+static int
+pframe_sample_pts(pframe_t *pf)
+{
+        int accessed = 0;
+
+        vmarea_obj_walk(pf->pf_obj, pf->pf_pagenum, pframe_sample_one, &accessed);
+        pframe_harvest_dirty(pf);
+        return accessed;
+}
+
+/* Orders pages by object, then page number, so runs of consecutive pages
+ * of one object end up next to each other */
+static void
+pageoutd_sort_batch(pframe_t **batch, int n)
+{
+        int i, j;
+        for (i = 1; i < n; i++) {
+                pframe_t *pf = batch[i];
+                for (j = i; j > 0; j--) {
+                        pframe_t *prev = batch[j - 1];
+                        if ((uintptr_t)prev->pf_obj < (uintptr_t)pf->pf_obj
+                            || (prev->pf_obj == pf->pf_obj
+                                && prev->pf_pagenum < pf->pf_pagenum))
+                                break;
+                        batch[j] = prev;
+                }
+                batch[j] = pf;
+        }
+}
+
 /*
- * The pageout daemon, when run, gets the least-recently-requested page from the
- * list of pages which are available to be paged out. Make sure to check if the
- * page is busy before yanking it. If the page you select is dirty, make sure
- * to clean it before yanking it. Finally, go back to sleep after having paged
- * out the appropriate page.
+ * Write back a batch of dirty pages which pageoutd collected and marked
+ * busy (so nobody else could free or modify them in the meantime). Runs of
+ * consecutive pages of the same object are cleaned together. Returns 0, or
+ * the first error.
+ */
+static int
+pageoutd_clean_batch(pframe_t **batch, int n)
+{
+        int i, j, run, ret, err = 0;
+
+        pageoutd_sort_batch(batch, n);
+        for (i = 0; i < n; i += run) {
+                for (run = 1; i + run < n
+                     && batch[i + run]->pf_obj == batch[i]->pf_obj
+                     && batch[i + run]->pf_pagenum == batch[i]->pf_pagenum + run;
+                     run++)
+                        ;
+                /* hand the pages back over to pframe_clean_n without
+                 * blocking in between, then wake anyone who waited on them
+                 * while they sat in the batch */
+                for (j = i; j < i + run; j++)
+                        pframe_clear_busy(batch[j]);
+                if (0 > (ret = pframe_clean_n(&batch[i], run)) && 0 == err)
+                        err = ret;
+                for (j = i; j < i + run; j++)
+                        sched_broadcast_on(pframe_waitq(batch[j]));
+        }
+        return err;
+}
+
+/*
+ * The pageout daemon, when run, sweeps the CLOCK hand over the list of
+ * pages which are available to be paged out until enough pages are free.
+ * Busy pages are skipped rather than waited for, referenced pages are
+ * given a second chance, clean pages are reclaimed, and dirty pages are
+ * collected and cleaned in batches (after which the next revolution of the
+ * hand reclaims them). Only if a whole revolution makes no progress because
+ * every candidate is busy does pageoutd wait, for one of the busy pages.
+ * Finally, go back to sleep after having freed enough pages.
  * Both arguments unused.
  */
 static void *
 pageoutd_run(int arg1, void *arg2)
 {
+        pframe_t *batch[PAGEOUTD_CLEAN_BATCH];
+
         while (1) {
                 KASSERT(nallocated >= 0);
+                counter_inc(&pageoutd_nruns);
                 while ((!pageoutd_target_met()) && (!list_empty(&alloc_list))) {
-                        pframe_t *pf;
+                        pframe_t *pf, *busy = NULL;
+                        int nbatch = 0, progress = 0;
+                        int scan = nallocated, total = nallocated, nscanned = 0;
+                        uint32_t nshrunk;
+
+                        /* one revolution of the hand: */
+                        while (scan-- > 0 && !list_empty(&alloc_list)
+                               && nbatch < PAGEOUTD_CLEAN_BATCH
+                               && !pageoutd_target_met()) {
+                                pf = list_head(&alloc_list, pframe_t, pf_link);
+                                KASSERT(!pframe_is_pinned(pf));
+
+                                /* whatever happens, the hand moves past it */
+                                list_remove(&pf->pf_link);
+                                list_insert_tail(&alloc_list, &pf->pf_link);
+                                counter_inc(&pageoutd_nscanned);
+                                nscanned++;
+
+                                if (pframe_is_busy(pf)) {
+                                        busy = pf;
+                                } else if (pframe_is_referenced(pf) | pframe_sample_pts(pf)) {
+                                        pframe_clear_referenced(pf);
+                                        progress = 1;
+                                } else if (pframe_is_dirty(pf)) {
+                                        pframe_set_busy(pf);
+                                        batch[nbatch++] = pf;
+                                } else {
+                                        /* it's not busy, it's clean, and
+                                         * it hasn't been used for a whole
+                                         * revolution; reclaim it: */
+                                        pframe_free(pf);
+                                        counter_inc(&pageoutd_nreclaimed);
+                                        progress = 1;
+                                }
+                        }
 
-                        /* obtain least-recently-requested page: */
-                        pf = list_head(&alloc_list, pframe_t, pf_link);
+                        /* the caches of kernel objects shrink in step
+                         * with the pages the hand went past */
+                        if (0 < (nshrunk = shrinkers_run(nscanned, total))) {
+                                counter_add(&pageoutd_nshrunk, nshrunk);
+                                progress = 1;
+                        }
 
-                        if (pframe_is_busy(pf)) {
-                                sched_sleep_on(&pf->pf_waitq);
-                        } else if (pframe_is_dirty(pf)) {
-                                pframe_clean(pf);
-                        } else {
-                                /* it's not busy, it's clean, and it's
-                                 * least-recently-requested; reclaim it: */
-                                pframe_free(pf);
+                        if (nbatch > 0) {
+                                counter_add(&pageoutd_ncleaned, nbatch);
+                                pageoutd_clean_batch(batch, nbatch);
+                        } else if (!progress && NULL != busy) {
+                                sched_sleep_on(pframe_waitq(busy));
                         }
                 }
 
-                /*   release the thundering herd... */
-                sched_broadcast_on(&alloc_waitq);
+                /* the first waiter wakes the others one after the
+                 * other, see pframe_wait_for_pageoutd */
+                sched_wakeup_n(&alloc_waitq, 1);
+
+                /* memory is no longer short, stop running ahead of
+                 * everyone else */
+                sched_set_prio(curthr, SCHED_PRIO_DEFAULT);
 
                 dbg(DBG_PFRAME, "PAGEOUT DEMAON: Falling asleep\n");
                 dbg(DBG_PFRAME, "PAGEOUT DEMAON: "
@@ -709,3 +1732,152 @@ pageoutd_run(int arg1, void *arg2)
         }
         return NULL;
 }
+
+/*
+ * Harvests the dirty bits of the pages on the mapped list, so that pages
+ * written through a mapping after they were last cleaned are written
+ * back like any other. Busy pages are left for the next look.
+ */
+static void
+flushd_harvest(void)
+{
+        pframe_t *pf;
+        list_iterate_begin(&mapped_list, pf, pframe_t, pf_mlink) {
+                if (!pframe_is_busy(pf))
+                        pframe_harvest_dirty(pf);
+        } list_iterate_end();
+}
+
+/* How many looks the page may stay dirty, which its file system can set */
+static uint32_t
+flushd_expire(pframe_t *pf)
+{
+        if (MMOBJ_VNODE == pf->pf_obj->mmo_ops->type) {
+                vnode_t *vn = CONTAINER_OF(pf->pf_obj, vnode_t, vn_mmobj);
+                if (0 < vn->vn_fs->fs_flush_expire)
+                        return vn->vn_fs->fs_flush_expire;
+        }
+        return FLUSHD_EXPIRE_INTERVALS;
+}
+
+/*
+ * Collects a batch of dirty pages for flushd to write back, oldest first,
+ * marking them busy: the ones which have been dirty for flushd_expire()
+ * looks, and then as many as it takes to bring
+ * the dirty pages back under the background limit. At most *budget pages
+ * are taken, so that pages which fail to be cleaned and come back dirty
+ * are not tried again and again.
+ */
+static int
+flushd_collect(pframe_t **batch, int *budget)
+{
+        pframe_t *pf;
+        int nbatch = 0;
+
+        list_iterate_begin(&dirty_list, pf, pframe_t, pf_dlink) {
+                if (nbatch == PAGEOUTD_CLEAN_BATCH || 0 == *budget)
+                        break;
+                KASSERT(pframe_is_dirty(pf) && !pframe_is_pinned(pf));
+                if (pframe_is_busy(pf))
+                        continue;
+                if (flushd_looks - pf->pf_dirtied >= flushd_expire(pf)
+                    || ndirty - nbatch > (int)((nallocated + page_free_count())
+                                               >> DIRTY_BACKGROUND_SHIFT)) {
+                        pframe_set_busy(pf);
+                        batch[nbatch++] = pf;
+                        (*budget)--;
+                }
+        } list_iterate_end();
+
+        return nbatch;
+}
+
+/*
+ * The flusher writes dirty pages back before pageoutd needs their page
+ * frames: every FLUSHD_INTERVAL_MSECS while there are dirty pages (or
+ * pages on the mapped list, whose dirty bits it harvests first) it looks
+ * for ones which have stayed dirty too long, and whenever it is woken it
+ * brings the number of dirty pages down to the background limit. Batches
+ * are cleaned like pageoutd's, in object and page order, so neighbouring
+ * blocks go to the disk together. Writers throttled by
+ * pframe_balance_dirty() are woken after each pass.
+ * Both arguments unused.
+ */
+static void *
+flushd_run(int arg1, void *arg2)
+{
+        pframe_t *batch[PAGEOUTD_CLEAN_BATCH];
+
+        while (1) {
+                int ret, nbatch, budget;
+
+                flushd_harvest();
+                budget = ndirty;
+                while (0 < (nbatch = flushd_collect(batch, &budget)))
+                        pageoutd_clean_batch(batch, nbatch);
+                sched_broadcast_on(&dirty_waitq);
+
+                /* a cancellable sleep does not look before sleeping */
+                if (curthr->kt_cancelled)
+                        kthread_exit((void *)0);
+                if (0 == ndirty && list_empty(&mapped_list))
+                        ret = sched_cancellable_sleep_on(&flushd_waitq);
+                else
+                        ret = sched_sleep_on_timeout(&flushd_waitq, FLUSHD_INTERVAL_MSECS);
+                if (-EINTR == ret)
+                        kthread_exit((void *)0);
+                if (-ETIME == ret)
+                        flushd_looks++;
+        }
+        return NULL;
+}
+
+/*
+ * Called by writers once they have dirtied pages and hold no locks. If
+ * more than the throttle limit of the pages are dirty, waits for flushd
+ * to write some of them back.
+ */
+void
+pframe_balance_dirty(void)
+{
+        if (curthr == flushd_thr || curthr == pageoutd_thr)
+                return;
+        if (dirty_above(DIRTY_THROTTLE_SHIFT)) {
+                flushd_wakeup();
+                sched_cancellable_sleep_on(&dirty_waitq);
+        }
+}
+
+void
+pframe_freepages_limits(uint32_t *min, uint32_t *target)
+{
+        *min = nfreepages_min;
+        *target = nfreepages_target;
+}
+
+size_t
+pframe_info(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+        uint64_t hits = pframe_nhits.c_value, misses = pframe_nmisses.c_value;
+        int i;
+
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "pages: %d allocated, %d pinned, %d dirty, %u free, %u free high\n",
+                nallocated, npinned, ndirty, page_free_count(), page_highmem_free_count());
+        iprintf(&buf, &size, "lookups: %llu hits, %llu misses, %llu%% hit\n",
+                hits, misses, (0 == hits + misses) ? 0 : hits * 100 / (hits + misses));
+        iprintf(&buf, &size, "type          fills     cleans\n");
+        for (i = 0; i < NMMOBJ_TYPES; i++) {
+                iprintf(&buf, &size, "%-8s %10llu %10llu\n", pframe_type_names[i],
+                        pframe_nfills[i].c_value, pframe_ncleans[i].c_value);
+        }
+        iprintf(&buf, &size, "prefetches: %llu\n", pframe_nprefetches.c_value);
+        iprintf(&buf, &size, "pageoutd: %llu runs, %llu scanned, %llu reclaimed, %llu cleaned\n",
+                pageoutd_nruns.c_value, pageoutd_nscanned.c_value,
+                pageoutd_nreclaimed.c_value, pageoutd_ncleaned.c_value);
+        iprintf(&buf, &size, "waits for pageoutd: %llu, %llu ns in all\n",
+                pframe_nallocwaits.c_value, pframe_allocwait_ns.c_value);
+        return osize - size;
+}
@@ -0,0 +1,216 @@
+#include "types.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#include "mm/slab.h"
+#include "mm/radix.h"
+
+/*
+ * A node at level l (the leaves being at level 1 and the root at level
+ * rt_height) is indexed by bits [(l - 1) * RADIX_SHIFT, l * RADIX_SHIFT) of
+ * the key. Slots of level 1 nodes hold items, all other slots hold nodes.
+ */
+#define RADIX_MASK              (RADIX_SLOTS - 1)
+#define radix_index(key, level) (((key) >> (((level) - 1) * RADIX_SHIFT)) & RADIX_MASK)
+
+/* Whether a tree of the given height has room for key */
+#define radix_covers(height, key) \
+        ((height) >= RADIX_MAX_HEIGHT || (key) < (1U << ((height) * RADIX_SHIFT)))
+
+static slab_allocator_t *radix_node_allocator = NULL;
+
+void
+radix_init(void)
+{
+        radix_node_allocator = slab_allocator_create("radix_node", sizeof(radix_node_t));
+        KASSERT(NULL != radix_node_allocator);
+}
+
+static radix_node_t *
+radix_node_alloc(void)
+{
+        radix_node_t *n;
+        if (NULL != (n = slab_obj_alloc(radix_node_allocator)))
+                memset(n, 0, sizeof(*n));
+        return n;
+}
+
+/*
+ * Free the empty nodes on the path to key, from the bottom up, then lower
+ * the tree for as long as the root only has something in slot 0.
+ */
+static void
+radix_prune(radix_tree_t *t, uint32_t key)
+{
+        radix_node_t *path[RADIX_MAX_HEIGHT + 1];
+        radix_node_t *n = t->rt_root;
+        int level, bottom;
+
+        for (level = t->rt_height; level > 0 && NULL != n; level--) {
+                path[level] = n;
+                n = (level > 1) ? n->rn_slots[radix_index(key, level)] : NULL;
+        }
+        bottom = level + 1;
+
+        for (level = bottom; level <= t->rt_height; level++) {
+                if (0 != path[level]->rn_count)
+                        break;
+                slab_obj_free(radix_node_allocator, path[level]);
+                if (level == t->rt_height) {
+                        radix_tree_init(t);
+                        return;
+                }
+                path[level + 1]->rn_slots[radix_index(key, level + 1)] = NULL;
+                path[level + 1]->rn_count--;
+        }
+
+        while (t->rt_height > 1 && 1 == t->rt_root->rn_count
+               && NULL != t->rt_root->rn_slots[0]) {
+                n = t->rt_root;
+                t->rt_root = n->rn_slots[0];
+                t->rt_height--;
+                slab_obj_free(radix_node_allocator, n);
+        }
+}
+
+void *
+radix_lookup(radix_tree_t *t, uint32_t key)
+{
+        radix_node_t *n = t->rt_root;
+        int level;
+
+        if (NULL == n || !radix_covers(t->rt_height, key))
+                return NULL;
+        for (level = t->rt_height; level > 1; level--) {
+                if (NULL == (n = n->rn_slots[radix_index(key, level)]))
+                        return NULL;
+        }
+        return n->rn_slots[radix_index(key, 1)];
+}
+
+void *
+radix_replace(radix_tree_t *t, uint32_t key, void *item)
+{
+        radix_node_t *n = t->rt_root;
+        void *old;
+        int level;
+
+        KASSERT(NULL != item);
+
+        if (NULL == n || !radix_covers(t->rt_height, key))
+                return NULL;
+        for (level = t->rt_height; level > 1; level--) {
+                if (NULL == (n = n->rn_slots[radix_index(key, level)]))
+                        return NULL;
+        }
+        if (NULL != (old = n->rn_slots[radix_index(key, 1)]))
+                n->rn_slots[radix_index(key, 1)] = item;
+        return old;
+}
+
+int
+radix_insert(radix_tree_t *t, uint32_t key, void *item)
+{
+        radix_node_t *n, *child;
+        int level;
+
+        KASSERT(NULL != item);
+
+        if (NULL == t->rt_root) {
+                if (NULL == (t->rt_root = radix_node_alloc()))
+                        return -ENOMEM;
+                t->rt_height = 1;
+                while (!radix_covers(t->rt_height, key))
+                        t->rt_height++;
+        }
+
+        /* Grow the tree upwards until key fits; the old tree becomes the
+         * first subtree of the new root */
+        while (!radix_covers(t->rt_height, key)) {
+                if (NULL == (n = radix_node_alloc())) {
+                        radix_prune(t, key);
+                        return -ENOMEM;
+                }
+                n->rn_slots[0] = t->rt_root;
+                n->rn_count = 1;
+                t->rt_root = n;
+                t->rt_height++;
+        }
+
+        n = t->rt_root;
+        for (level = t->rt_height; level > 1; level--) {
+                if (NULL == (child = n->rn_slots[radix_index(key, level)])) {
+                        if (NULL == (child = radix_node_alloc())) {
+                                radix_prune(t, key);
+                                return -ENOMEM;
+                        }
+                        n->rn_slots[radix_index(key, level)] = child;
+                        n->rn_count++;
+                }
+                n = child;
+        }
+
+        KASSERT(NULL == n->rn_slots[radix_index(key, 1)] && "key already in tree");
+        n->rn_slots[radix_index(key, 1)] = item;
+        n->rn_count++;
+        return 0;
+}
+
+void *
+radix_remove(radix_tree_t *t, uint32_t key)
+{
+        radix_node_t *n = t->rt_root;
+        void *item;
+        int level;
+
+        if (NULL == n || !radix_covers(t->rt_height, key))
+                return NULL;
+        for (level = t->rt_height; level > 1; level--) {
+                if (NULL == (n = n->rn_slots[radix_index(key, level)]))
+                        return NULL;
+        }
+        if (NULL == (item = n->rn_slots[radix_index(key, 1)]))
+                return NULL;
+
+        n->rn_slots[radix_index(key, 1)] = NULL;
+        n->rn_count--;
+        radix_prune(t, key);
+        return item;
+}
+
+/* radix_next within the subtree rooted at n, which is at the given level
+ * and which *key falls in */
+static void *
+radix_next_in(radix_node_t *n, int level, uint32_t *key)
+{
+        uint32_t k = *key;
+        int shift = (level - 1) * RADIX_SHIFT;
+        int i;
+
+        for (i = radix_index(k, level); i < RADIX_SLOTS; i++) {
+                void *slot = n->rn_slots[i];
+                if (NULL != slot) {
+                        if (1 == level) {
+                                *key = k;
+                                return slot;
+                        }
+                        if (NULL != (slot = radix_next_in(slot, level - 1, &k))) {
+                                *key = k;
+                                return slot;
+                        }
+                }
+                /* continue from the first key of the next slot */
+                k = ((k >> shift) + 1) << shift;
+        }
+        return NULL;
+}
+
+void *
+radix_next(radix_tree_t *t, uint32_t *key)
+{
+        if (NULL == t->rt_root || !radix_covers(t->rt_height, *key))
+                return NULL;
+        return radix_next_in(t->rt_root, t->rt_height, key);
+}
@@ -0,0 +1,37 @@
+#include "types.h"
+#include "kernel.h"
+
+#include "util/debug.h"
+
+#include "mm/shrink.h"
+
+static shrinker_t *shrinkers = NULL;
+
+void
+shrinker_register(shrinker_t *sh)
+{
+        KASSERT(NULL != sh->sh_count && NULL != sh->sh_scan);
+        sh->sh_next = shrinkers;
+        shrinkers = sh;
+}
+
+uint32_t
+shrinkers_run(uint32_t scanned, uint32_t total)
+{
+        shrinker_t *sh;
+        uint32_t count, n, freed = 0;
+
+        if (0 == scanned)
+                return 0;
+        scanned = MIN(scanned, total);
+
+        for (sh = shrinkers; NULL != sh; sh = sh->sh_next) {
+                if (0 == (count = sh->sh_count()))
+                        continue;
+                n = (count * scanned + total - 1) / total;
+                n = sh->sh_scan(n);
+                dbg(DBG_MM, "shrinker %s: freed %u of %u\n", sh->sh_name, n, count);
+                freed += n;
+        }
+        return freed;
+}
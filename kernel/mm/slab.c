@@ -9,17 +9,51 @@
  * Note that there is no need for locking in allocation and deallocation because
  * it never blocks nor is used by an interrupt handler. Hurray for non preemptible
  * kernels!
+ *
+ * Each allocator keeps its slabs on three lists, by how many of their
+ * objects are in use, so finding a slab with a free object and finding
+ * empty slabs to reclaim never requires a search. In front of the slabs
+ * sits a magazine (as in Bonwick and Adams' "Magazines and Vmem"): a small
+ * stack of recently freed objects which allocations are satisfied from
+ * first without touching any slab. Since there is only one CPU, each
+ * allocator has a single magazine.
+ *
+ * Objects of less than SLAB_OFFSLAB_MIN bytes are each followed by their
+ * bufctl, with the slab structure after the last of them. Larger objects
+ * would fit a whole number to a page but for those few bytes, so their
+ * slab structure and bufctls are kmalloc'ed apart from the slab's pages,
+ * which are found from an object's address through slab_pages.
+ *
+ * Whatever the slab's pages hold beyond a whole number of objects is
+ * used to "colour" slabs (Bonwick, "The Slab Allocator"): each new slab
+ * starts its objects a cache line further into its first page than the
+ * one before, wrapping around, so that the same object in different
+ * slabs falls in different cache sets.
+ *
+ * With SLAB_TRACK_CALLERS, each bufctl also holds the return address of
+ * the call to slab_obj_alloc (or kmalloc) which handed its object out, and
+ * 0 while the object is free, so kmem_census can count what is live by
+ * call site with one pass over the slabs. SLAB_TRACK_CHAINS adds a handle
+ * to the call chain, kept by callchain_save, which the census counts by
+ * too.
  */
 
 #include "types.h"
 
 #include "mm/mm.h"
+#include "mm/kmalloc.h"
 #include "mm/slab.h"
 #include "mm/page.h"
+#include "mm/radix.h"
+#include "mm/shrink.h"
 
+#include "util/callchain.h"
 #include "util/gdb.h"
+#include "util/list.h"
+#include "util/printf.h"
 #include "util/string.h"
 #include "util/debug.h"
+#include "util/counter.h"
 
 #ifdef SLAB_REDZONE
 #define front_rz(obj)           (*(uintptr_t*)(obj))
@@ -37,20 +71,40 @@
         } while (0);
 #endif
 
+/* Number of objects a magazine holds */
+#define SLAB_MAGAZINE_SIZE      16
+
+/* Objects at least this big keep their bufctls off the slab */
+#define SLAB_OFFSLAB_MIN        (PAGE_SIZE / 8)
+
 struct slab {
-        struct slab             *s_next;       /* link on list of slabs */
+        list_link_t              s_link;       /* link on one of the allocator's slab lists */
         int                      s_inuse;      /* number of allocated objs */
         void                    *s_free;       /* head of obj free list */
         void                    *s_addr;       /* start address */
+        void                    *s_objs;       /* first object, past the colour */
+        struct slab_bufctl      *s_bufctl;     /* off-slab bufctls, or NULL */
 };
 
 struct slab_allocator {
         struct slab_allocator   *sa_next;       /* link on list of slab allocators */
         const char              *sa_name;       /* user-provided name */
         size_t                   sa_objsize;    /* object size */
-        struct slab             *sa_slabs;      /* head of slab list */
+        size_t                   sa_bufsize;    /* distance between objects */
+        size_t                   sa_align_off;  /* first object's offset, which
+                                                 * lines objects up past the
+                                                 * red-zone */
+        int                      sa_flags;      /* SLAB_* creation flags */
+        int                      sa_offslab;    /* bufctls kept apart */
+        int                      sa_ncolours;   /* offsets slabs start at */
+        int                      sa_colour;     /* the next slab's offset */
+        list_t                   sa_full;       /* slabs with no free objects */
+        list_t                   sa_partial;    /* slabs with some free objects */
+        list_t                   sa_empty;      /* slabs with no objects in use */
         int                      sa_order;      /* npages = (1 << order) */
         int                      sa_slab_nobjs; /* number of objs per slab */
+        int                      sa_mag_rounds; /* number of objects in sa_mag */
+        void                    *sa_mag[SLAB_MAGAZINE_SIZE]; /* magazine */
 };
 
 struct slab_bufctl {
@@ -61,17 +115,18 @@ struct slab_bufctl {
 #ifdef SLAB_CHECK_FREE
         uint8_t                  sb_free;       /* true if is object is free */
 #endif
+#ifdef SLAB_TRACK_CALLERS
+        uintptr_t                sb_caller;     /* who allocated it, 0 if free */
+#endif
+#ifdef SLAB_TRACK_CHAINS
+        uint32_t                 sb_chain;      /* and from where, a handle */
+#endif
 };
 #define sb_next                 u.sb_next
 #define sb_slab                 u.sb_slab
 
-#define obj_bufctl(allocator, obj) \
-        ( (struct slab_bufctl*)(((uintptr_t)(obj)) + (allocator)->sa_objsize) )
-#define bufctl_obj(allocator, buf) \
-        ( (void*)(((uintptr_t)(buf)) - (allocator)->sa_objsize) )
 #define next_obj(allocator, obj) \
-        ( (void*) (((uintptr_t)(obj)) + (allocator)->sa_objsize \
-                   + sizeof(struct slab_bufctl)) )
+        ( (void*) (((uintptr_t)(obj)) + (allocator)->sa_bufsize) )
 
 GDB_DEFINE_HOOK(slab_obj_alloc, void *addr, struct slab_allocator *allocator)
 GDB_DEFINE_HOOK(slab_obj_free, void *addr, struct slab_allocator *allocator)
@@ -82,6 +137,15 @@ static struct slab_allocator *slab_allocators = NULL;
 /* Special case - allocator for allocation of slab_allocator objects. */
 static struct slab_allocator slab_allocator_allocator;
 
+/* The slab of each page of an off-slab allocator's slabs. Its nodes
+ * come from an allocator whose objects are smaller than
+ * SLAB_OFFSLAB_MIN, so growing one never needs the tree. */
+static radix_tree_t slab_pages;
+
+/* Objects handed out and given back, by all allocators */
+static counter_t slab_nallocs;
+static counter_t slab_nfrees;
+
 /*
  * This constant defines how many orders of magnitude (in page block
  * sizes) we'll search for an optimal slab size (past the smallest
@@ -89,29 +153,56 @@ static struct slab_allocator slab_allocator_allocator;
  */
 #define SLAB_MAX_ORDER                  5
 
+/*
+ * The bufctl of an object, given the slab which holds the object. The
+ * index'th object of a slab is at s_objs + index * sa_bufsize.
+ */
+static inline struct slab_bufctl *
+slab_bufctl(struct slab_allocator *allocator, struct slab *slab, void *obj)
+{
+        if (NULL == slab->s_bufctl)
+                return (struct slab_bufctl *)((uintptr_t)obj + allocator->sa_objsize);
+        return &slab->s_bufctl[((uintptr_t)obj - (uintptr_t)slab->s_objs)
+                               / allocator->sa_bufsize];
+}
+
+static inline struct slab_bufctl *
+obj_bufctl(struct slab_allocator *allocator, void *obj)
+{
+        struct slab *slab;
+
+        if (!allocator->sa_offslab)
+                return (struct slab_bufctl *)((uintptr_t)obj + allocator->sa_objsize);
+        slab = radix_lookup(&slab_pages, ADDR_TO_PN(obj));
+        KASSERT(NULL != slab);
+        return slab_bufctl(allocator, slab, obj);
+}
+
+/* The room in the slab's pages taken by nobjs objects and what goes with
+ * them, before any colour */
 static size_t
-_slab_size(size_t objsize, size_t nobjs)
+_slab_size(struct slab_allocator *allocator, size_t nobjs)
 {
-        return (nobjs * (objsize + sizeof(struct slab_bufctl))
-                + sizeof(struct slab));
+        return (allocator->sa_align_off + nobjs * allocator->sa_bufsize
+                + (allocator->sa_offslab ? 0 : sizeof(struct slab)));
 }
 
 static int
-_slab_nobjs(size_t objsize, size_t order)
+_slab_nobjs(struct slab_allocator *allocator, size_t order)
 {
-        return (((PAGE_SIZE << order) - sizeof(struct slab))
-                / (objsize + sizeof(struct slab_bufctl)));
+        return (((PAGE_SIZE << order) - _slab_size(allocator, 0))
+                / allocator->sa_bufsize);
 }
 
 static int
-_slab_waste(size_t objsize, int order)
+_slab_waste(struct slab_allocator *allocator, int order)
 {
         /* Waste is defined as the amount of unused space in the page
          * block, that is the number of bytes in the page block minus
          * the optimal slab size for that particular block size.
          */
         return ((PAGE_SIZE << order)
-                - _slab_size(objsize, _slab_nobjs(objsize, order)));
+                - _slab_size(allocator, _slab_nobjs(allocator, order)));
 }
 
 static void
@@ -125,7 +216,7 @@ _calc_slab_size(struct slab_allocator *allocator)
         int waste;
 
         /* Find the minimum page block size that this slab requires. */
-        minsize = _slab_size(allocator->sa_objsize, 1);
+        minsize = _slab_size(allocator, 1);
         for (minorder = 0; minorder < PAGE_NSIZES; minorder++)
                 if ((int)(PAGE_SIZE << minorder) >= minsize)
                         break;
@@ -134,7 +225,7 @@ _calc_slab_size(struct slab_allocator *allocator)
 
         /* Start the search with the minimum block size for this slab. */
         best_order = minorder;
-        best_waste = _slab_waste(allocator->sa_objsize, minorder);
+        best_waste = _slab_waste(allocator, minorder);
 
         dbg(DBG_MM, "calc_slab_size: minorder %d, waste %d\n", minorder, best_waste);
 
@@ -143,7 +234,7 @@ _calc_slab_size(struct slab_allocator *allocator)
          * of pages per slab.
          */
         for (order = minorder + 1; order < SLAB_MAX_ORDER; order++) {
-                if ((waste = _slab_waste(allocator->sa_objsize, order)) < best_waste) {
+                if ((waste = _slab_waste(allocator, order)) < best_waste) {
                         best_waste = waste;
                         best_order = order;
                         dbg(DBG_MM, "calc_slab_size: replacing with order %d, waste %d\n",
@@ -154,11 +245,14 @@ _calc_slab_size(struct slab_allocator *allocator)
         /* Finally, the best page block size wins.
         */
         allocator->sa_order = best_order;
-        allocator->sa_slab_nobjs = _slab_nobjs(allocator->sa_objsize, best_order);
+        allocator->sa_slab_nobjs = _slab_nobjs(allocator, best_order);
+        allocator->sa_ncolours = best_waste / SLAB_CACHE_LINE + 1;
+        allocator->sa_colour = 0;
 }
 
 static void
-_allocator_init(struct slab_allocator *allocator, const char *name, size_t size)
+_allocator_init(struct slab_allocator *allocator, const char *name, size_t size,
+                int flags)
 {
 #ifdef SLAB_REDZONE
         /*
@@ -172,7 +266,23 @@ _allocator_init(struct slab_allocator *allocator, const char *name, size_t size)
 
         allocator->sa_name = name;
         allocator->sa_objsize = size;
-        allocator->sa_slabs = NULL;
+        allocator->sa_flags = flags;
+        allocator->sa_offslab = (size >= SLAB_OFFSLAB_MIN);
+        allocator->sa_bufsize = size;
+        if (!allocator->sa_offslab)
+                allocator->sa_bufsize += sizeof(struct slab_bufctl);
+        allocator->sa_align_off = 0;
+        if (flags & SLAB_ALIGN_CACHE) {
+                allocator->sa_bufsize = (allocator->sa_bufsize + SLAB_CACHE_LINE - 1)
+                                        & ~(SLAB_CACHE_LINE - 1);
+#ifdef SLAB_REDZONE
+                allocator->sa_align_off = SLAB_CACHE_LINE - sizeof(SLAB_REDZONE);
+#endif
+        }
+        list_init(&allocator->sa_full);
+        list_init(&allocator->sa_partial);
+        list_init(&allocator->sa_empty);
+        allocator->sa_mag_rounds = 0;
         _calc_slab_size(allocator);
 
         /* Add cache to global cache list. */
@@ -184,68 +294,123 @@ _allocator_init(struct slab_allocator *allocator, const char *name, size_t size)
         dbgq(DBG_MM, "  Object Size:   %d\n", allocator->sa_objsize);
         dbgq(DBG_MM, "  Order:         %d\n", allocator->sa_order);
         dbgq(DBG_MM, "  Slab Capacity: %d\n", allocator->sa_slab_nobjs);
+        dbgq(DBG_MM, "  Colours:       %d\n", allocator->sa_ncolours);
+        dbgq(DBG_MM, "  Off-slab:      %d\n", allocator->sa_offslab);
 }
 
 struct slab_allocator *
-slab_allocator_create(const char *name, size_t size) {
+slab_allocator_create_flags(const char *name, size_t size, int flags) {
         struct slab_allocator *allocator;
 
         allocator = (struct slab_allocator *) slab_obj_alloc(&slab_allocator_allocator);
         if (!allocator)
                 return NULL;
 
-        _allocator_init(allocator, name, size);
+        _allocator_init(allocator, name, size, flags);
         return allocator;
 }
 
+struct slab_allocator *
+slab_allocator_create(const char *name, size_t size) {
+        return slab_allocator_create_flags(name, size, 0);
+}
+
+/* Takes a slab's pages out of slab_pages, from its first page up to
+ * (but not including) its npages'th */
+static void
+_slab_pages_remove(struct slab *slab, int npages)
+{
+        int ii;
+
+        for (ii = 0; ii < npages; ii++)
+                radix_remove(&slab_pages, ADDR_TO_PN(slab->s_addr) + ii);
+}
+
+/* Gives a slab with no objects in use back to the page allocator */
+static void
+_slab_destroy(struct slab_allocator *allocator, struct slab *slab)
+{
+        int npages = 1 << allocator->sa_order;
+
+        KASSERT(0 == slab->s_inuse);
+        list_remove(&slab->s_link);
+        page_free_n(slab->s_addr, npages);
+        if (allocator->sa_offslab) {
+                _slab_pages_remove(slab, npages);
+                kfree(slab);
+        }
+}
+
 
 static int
 _slab_allocator_grow(struct slab_allocator *allocator)
 {
         void *addr;
+        void *objs;
         void *obj;
-        int ii, npages;
+        int ii, npages, nobjs;
         struct slab *slab;
+        struct slab_bufctl *buf;
 
         npages = 1 << allocator->sa_order;
+        nobjs = allocator->sa_slab_nobjs;
         addr = page_alloc_n(npages);
         if (!addr)
                 return 0;
 
-        /* Initialize each bufctl to be free and point to the next object. */
-        obj = addr;
-        for (ii = 0; ii < (allocator->sa_slab_nobjs - 1); ii++) {
-#ifdef SLAB_CHECK_FREE
-                obj_bufctl(allocator, obj)->sb_free = 1;
-#endif
-                obj = obj_bufctl(allocator, obj)->sb_next = next_obj(allocator, obj);
+        objs = (void *)((uintptr_t)addr + allocator->sa_colour * SLAB_CACHE_LINE
+                        + allocator->sa_align_off);
+        if (allocator->sa_offslab) {
+                slab = kmalloc(sizeof(*slab) + nobjs * sizeof(struct slab_bufctl));
+                if (!slab) {
+                        page_free_n(addr, npages);
+                        return 0;
+                }
+                slab->s_addr = addr;
+                slab->s_bufctl = (struct slab_bufctl *)(slab + 1);
+                for (ii = 0; ii < npages; ii++) {
+                        if (0 > radix_insert(&slab_pages, ADDR_TO_PN(addr) + ii, slab)) {
+                                _slab_pages_remove(slab, ii);
+                                kfree(slab);
+                                page_free_n(addr, npages);
+                                return 0;
+                        }
+                }
+        } else {
+                /* After the last object comes the slab structure itself. */
+                slab = (struct slab *)((uintptr_t)objs + nobjs * allocator->sa_bufsize);
+                slab->s_addr = addr;
+                slab->s_bufctl = NULL;
         }
-
-        /* The last bufctl is the tail of the list. */
-#ifdef SLAB_CHECK_FREE
-        obj_bufctl(allocator, obj)->sb_free = 1;
-#endif
-        obj_bufctl(allocator, obj)->sb_next = NULL;
-
-        /* After the last object comes the slab structure itself. */
-        slab = (struct slab *) next_obj(allocator, obj);
+        allocator->sa_colour = (allocator->sa_colour + 1) % allocator->sa_ncolours;
 
         /*
          * The first object in the slab will be the head of the free
-         * list and the start address of the slab.
+         * list.
          */
-        slab->s_free = addr;
-        slab->s_addr = addr;
+        slab->s_objs = objs;
+        slab->s_free = objs;
         slab->s_inuse = 0;
 
-        /* Initialize objects. */
-        obj = addr;
-        for (ii = 0; ii < allocator->sa_slab_nobjs; ii++) {
+        /* Initialize each bufctl to be free and point to the next object,
+         * the last one being the tail of the list. */
+        obj = objs;
+        for (ii = 0; ii < nobjs; ii++) {
+                buf = slab_bufctl(allocator, slab, obj);
+#ifdef SLAB_CHECK_FREE
+                buf->sb_free = 1;
+#endif
+#ifdef SLAB_TRACK_CALLERS
+                buf->sb_caller = 0;
+#endif
+#ifdef SLAB_TRACK_CHAINS
+                buf->sb_chain = 0;
+#endif
 #ifdef SLAB_REDZONE
                 front_rz(obj) = SLAB_REDZONE;
                 rear_rz(allocator, obj) = SLAB_REDZONE;
 #endif
-                obj = next_obj(allocator, obj);
+                obj = buf->sb_next = (ii + 1 < nobjs) ? next_obj(allocator, obj) : NULL;
         }
 
         dbg(DBG_MM, "Growing cache \"%s\" (0x%p), new slab 0x%p "
@@ -253,28 +418,50 @@ _slab_allocator_grow(struct slab_allocator *allocator)
             1 << allocator->sa_order);
 
         /* Place this slab into the cache. */
-        slab->s_next = allocator->sa_slabs;
-        allocator->sa_slabs = slab;
+        list_insert_head(&allocator->sa_empty, &slab->s_link);
 
         return 1;
 }
 
-void *
-slab_obj_alloc(struct slab_allocator *allocator)
+/*
+ * Move a slab to the list matching its number of objects in use.
+ */
+static void
+_slab_relist(struct slab_allocator *allocator, struct slab *slab)
+{
+        list_t *list;
+
+        if (0 == slab->s_inuse)
+                list = &allocator->sa_empty;
+        else if (allocator->sa_slab_nobjs == slab->s_inuse)
+                list = &allocator->sa_full;
+        else
+                list = &allocator->sa_partial;
+
+        list_remove(&slab->s_link);
+        list_insert_head(list, &slab->s_link);
+}
+
+/*
+ * Take a free object out of one of the allocator's slabs, growing the cache
+ * if none have any. The returned object is the start of the buffer, before
+ * any red-zone.
+ */
+static void *
+_slab_take(struct slab_allocator *allocator)
 {
         struct slab *slab;
+        struct slab_bufctl *buf;
         void *obj;
 
-        /* Find a slab with a free object. */
-        for (;;) {
-                slab = allocator->sa_slabs;
-                while (slab && (slab->s_inuse == allocator->sa_slab_nobjs))
-                        slab = slab->s_next;
-                if (slab && (slab->s_inuse < allocator->sa_slab_nobjs))
-                        break;
-                if (!_slab_allocator_grow(allocator))
+        if (!list_empty(&allocator->sa_partial)) {
+                slab = list_head(&allocator->sa_partial, struct slab, s_link);
+        } else {
+                if (list_empty(&allocator->sa_empty) && !_slab_allocator_grow(allocator))
                         return NULL;
+                slab = list_head(&allocator->sa_empty, struct slab, s_link);
         }
+        KASSERT(slab->s_inuse < allocator->sa_slab_nobjs);
 
         /*
          * Remove an object from the slab's free list.  We'll use the
@@ -282,17 +469,84 @@ slab_obj_alloc(struct slab_allocator *allocator)
          * slab.
          */
         obj = slab->s_free;
-        slab->s_free = obj_bufctl(allocator, obj)->sb_next;
-        obj_bufctl(allocator, obj)->sb_slab = slab;
-#ifdef SLAB_CHECK_FREE
-        obj_bufctl(allocator, obj)->sb_free = 0;
-#endif
+        buf = slab_bufctl(allocator, slab, obj);
+        slab->s_free = buf->sb_next;
+        buf->sb_slab = slab;
 
-        slab->s_inuse++;
+        if (1 == ++slab->s_inuse || allocator->sa_slab_nobjs == slab->s_inuse)
+                _slab_relist(allocator, slab);
 
         dbg(DBG_MM, "Allocated object 0x%p from \"%s\" (0x%p), "
             "slab 0x%p, inuse %d\n", obj, allocator->sa_name,
-            allocator, allocator, slab->s_inuse);
+            allocator, slab, slab->s_inuse);
+        return obj;
+}
+
+/*
+ * Put an object (the start of its buffer, before any red-zone) back on its
+ * slab's free list.
+ */
+static void
+_slab_put(struct slab_allocator *allocator, void *obj)
+{
+        struct slab_bufctl *buf = obj_bufctl(allocator, obj);
+        struct slab *slab = buf->sb_slab;
+
+        /* Place this object back on the slab's free list. */
+        buf->sb_next = slab->s_free;
+        slab->s_free = obj;
+
+        if (allocator->sa_slab_nobjs == slab->s_inuse-- || 0 == slab->s_inuse)
+                _slab_relist(allocator, slab);
+
+        dbg(DBG_MM, "Freed object 0x%p from \"%s\" (0x%p), slab 0x%p, inuse %d\n",
+            obj, allocator->sa_name, allocator, slab, slab->s_inuse);
+}
+
+/*
+ * Return the n oldest objects in the allocator's magazine to their slabs.
+ */
+static void
+_slab_magazine_drain(struct slab_allocator *allocator, int n)
+{
+        int i;
+
+        KASSERT(n <= allocator->sa_mag_rounds);
+        for (i = 0; i < n; i++)
+                _slab_put(allocator, allocator->sa_mag[i]);
+        allocator->sa_mag_rounds -= n;
+        for (i = 0; i < allocator->sa_mag_rounds; i++)
+                allocator->sa_mag[i] = allocator->sa_mag[i + n];
+}
+
+static void *
+_slab_obj_alloc(struct slab_allocator *allocator, uintptr_t caller)
+{
+        void *obj;
+#ifdef SLAB_TRACK_CHAINS
+        uintptr_t chain[CALLCHAIN_DEPTH];
+        int n;
+#endif
+
+        if (0 < allocator->sa_mag_rounds)
+                obj = allocator->sa_mag[--allocator->sa_mag_rounds];
+        else if (NULL == (obj = _slab_take(allocator)))
+                return NULL;
+
+#if defined(SLAB_CHECK_FREE) || defined(SLAB_TRACK_CALLERS)
+        struct slab_bufctl *buf = obj_bufctl(allocator, obj);
+#endif
+#ifdef SLAB_CHECK_FREE
+        buf->sb_free = 0;
+#endif
+#ifdef SLAB_TRACK_CALLERS
+        buf->sb_caller = caller;
+#endif
+#ifdef SLAB_TRACK_CHAINS
+        /* from caller, past slab_obj_alloc or kmalloc */
+        n = callchain_capture(chain, CALLCHAIN_DEPTH, 1);
+        buf->sb_chain = callchain_save(chain, n);
+#endif
 
 #ifdef SLAB_REDZONE
         VERIFY_REDZONES(allocator, obj);
@@ -303,15 +557,22 @@ slab_obj_alloc(struct slab_allocator *allocator)
         obj = (void *)((uintptr_t)obj + sizeof(SLAB_REDZONE));
 #endif
 
+        counter_inc(&slab_nallocs);
         GDB_CALL_HOOK(slab_obj_alloc, obj, allocator);
         return obj;
 }
 
+void *
+slab_obj_alloc(struct slab_allocator *allocator)
+{
+        return _slab_obj_alloc(allocator, (uintptr_t)__builtin_return_address(0));
+}
+
 void
 slab_obj_free(struct slab_allocator *allocator, void *obj)
 {
-        struct slab *slab;
         GDB_CALL_HOOK(slab_obj_free, obj, allocator);
+        counter_inc(&slab_nfrees);
 
 #ifdef SLAB_REDZONE
         /* Move pointer back.  See the end of kmem_cache_alloc. */
@@ -320,21 +581,25 @@ slab_obj_free(struct slab_allocator *allocator, void *obj)
         VERIFY_REDZONES(allocator, obj);
 #endif
 
+#if defined(SLAB_CHECK_FREE) || defined(SLAB_TRACK_CALLERS)
+        struct slab_bufctl *buf = obj_bufctl(allocator, obj);
+#endif
 #ifdef SLAB_CHECK_FREE
-        KASSERT(!obj_bufctl(allocator, obj)->sb_free && "INVALID FREE!");
-        obj_bufctl(allocator, obj)->sb_free = 1;
+        KASSERT(!buf->sb_free && "INVALID FREE!");
+        buf->sb_free = 1;
+#endif
+#ifdef SLAB_TRACK_CALLERS
+        buf->sb_caller = 0;
+#endif
+#ifdef SLAB_TRACK_CHAINS
+        buf->sb_chain = 0;
 #endif
 
-        slab = obj_bufctl(allocator, obj)->sb_slab;
-
-        /* Place this object back on the slab's free list. */
-        obj_bufctl(allocator, obj)->sb_next = slab->s_free;
-        slab->s_free = obj;
-
-        slab->s_inuse--;
-
-        dbg(DBG_MM, "Freed object 0x%p from \"%s\" (0x%p), slab 0x%p, inuse %d\n",
-            obj, allocator->sa_name, allocator, slab, slab->s_inuse);
+        /* Objects in the magazine stay allocated as far as their slabs are
+         * concerned; when it is full, the older half goes back first. */
+        if (SLAB_MAGAZINE_SIZE == allocator->sa_mag_rounds)
+                _slab_magazine_drain(allocator, SLAB_MAGAZINE_SIZE / 2);
+        allocator->sa_mag[allocator->sa_mag_rounds++] = obj;
 }
 
 /*
@@ -350,89 +615,166 @@ slab_allocators_reclaim(int target)
         int npages_freed = 0, npages;
 
         struct slab_allocator *a;
-        struct slab *s, **prev;
 
         /* Go through all caches */
         for (a = slab_allocators; NULL != a; a = a->sa_next) {
-                prev = &(a->sa_slabs);
-                s = a->sa_slabs;
-                while (NULL != s) {
-                        struct slab *next = s->s_next;
-                        if (0 == s->s_inuse) {
-                                /* Free Slab */
-                                (*prev) = next;
-                                npages = 1 << a->sa_order;
-
-                                page_free_n(s->s_addr, npages);
-                                npages_freed += npages;
-                        } else {
-                                prev = &(s->s_next);
-                        }
+                /* Objects sitting in the magazine keep their slabs from
+                 * being empty */
+                _slab_magazine_drain(a, a->sa_mag_rounds);
+
+                npages = 1 << a->sa_order;
+                while (!list_empty(&a->sa_empty)) {
+                        /* Free Slab */
+                        _slab_destroy(a, list_head(&a->sa_empty, struct slab, s_link));
+                        npages_freed += npages;
+
                         /* Check if target was met */
                         if ((target > 0) && (npages_freed >= target)) {
                                 return npages_freed;
                         }
-                        s = next;
                 }
         }
         return npages_freed;
 }
 
-#define KMALLOC_SIZE_MIN_ORDER  (6)
-#define KMALLOC_SIZE_MAX_ORDER  (18)
+/* The slab allocator's shrinker counts and frees pages of empty slabs */
+static uint32_t
+slab_shrink_count(void)
+{
+        struct slab_allocator *a;
+        list_link_t *link;
+        uint32_t npages = 0;
+
+        for (a = slab_allocators; NULL != a; a = a->sa_next) {
+                for (link = a->sa_empty.l_next; link != &a->sa_empty; link = link->l_next)
+                        npages += 1 << a->sa_order;
+        }
+        return npages;
+}
+
+static uint32_t
+slab_shrink_scan(uint32_t n)
+{
+        return slab_allocators_reclaim(n);
+}
 
-static struct slab_allocator *kmalloc_allocators[KMALLOC_SIZE_MAX_ORDER - KMALLOC_SIZE_MIN_ORDER + 1];
+static shrinker_t slab_shrinker = {
+        .sh_name = "slab",
+        .sh_count = slab_shrink_count,
+        .sh_scan = slab_shrink_scan
+};
 
-/* Note that kmem_cache_names should be modified to remain consistent
- * with KMALLOC_SIZE_MIN_ORDER ... KMALLOC_SIZE_MAX_ORDER.
+/*
+ * kmalloc size classes. Each object starts with a struct kmalloc_hdr, so a
+ * class of size n serves requests of up to n - sizeof(struct kmalloc_hdr)
+ * bytes. The classes go up in steps of a power of two and a half of one,
+ * which bounds the space wasted to rounding at a third of an object.
+ * Requests too big for the largest class get whole pages straight from the
+ * page allocator instead; since those are page aligned and small objects
+ * never are (because of the header), kfree can tell the two apart.
  */
-static const char *kmalloc_allocator_names[] = {
-        "size-64",
-        "size-128",
-        "size-256",
-        "size-512",
-        "size-1024",
-        "size-2048",
-        "size-4096",
-        "size-8192",
-        "size-16384",
-        "size-32768",
-        "size-65536",
-        "size-131072",
-        "size-262144"
+static const size_t kmalloc_class_sizes[] = {
+        16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072
+};
+static const char *kmalloc_class_names[] = {
+        "size-16", "size-24", "size-32", "size-48", "size-64", "size-96",
+        "size-128", "size-192", "size-256", "size-384", "size-512", "size-768",
+        "size-1024", "size-1536", "size-2048", "size-3072"
 };
+#define KMALLOC_NCLASSES (sizeof(kmalloc_class_sizes) / sizeof(kmalloc_class_sizes[0]))
 
-void *
-kmalloc(size_t size)
+struct kmalloc_hdr {
+        uint16_t                 kh_class;      /* index into kmalloc_allocators */
+        uint16_t                 kh_size;       /* size requested */
+};
+
+/* Usage counts, for kmalloc_info */
+struct kmalloc_stats {
+        uint32_t                 ks_nallocs;    /* calls to kmalloc, ever */
+        uint32_t                 ks_live;       /* allocations not yet freed */
+        uint32_t                 ks_requested;  /* bytes requested by them */
+        uint32_t                 ks_pages;      /* pages used by them (large only) */
+};
+
+static struct slab_allocator *kmalloc_allocators[KMALLOC_NCLASSES];
+static struct kmalloc_stats kmalloc_class_stats[KMALLOC_NCLASSES];
+static struct kmalloc_stats kmalloc_large_stats;
+
+/* The requested sizes of large allocations, by page number. The tree
+ * stores size << 1 | 1 so entries are never NULL. */
+static radix_tree_t kmalloc_large;
+
+static void *
+_kmalloc_large(size_t size)
 {
-        int order;
-        struct slab_allocator **cs;
+        uint32_t npages = ADDR_TO_PN(PAGE_ALIGN_UP(size));
         void *addr;
 
-        size += sizeof(struct slab_allocator *);
+        if (NULL == (addr = page_alloc_n(npages)))
+                return NULL;
+        if (0 > radix_insert(&kmalloc_large, ADDR_TO_PN(addr),
+                             (void *)(uintptr_t)((size << 1) | 1))) {
+                page_free_n(addr, npages);
+                return NULL;
+        }
+
+        kmalloc_large_stats.ks_nallocs++;
+        kmalloc_large_stats.ks_live++;
+        kmalloc_large_stats.ks_requested += size;
+        kmalloc_large_stats.ks_pages += npages;
+#ifdef MM_POISON
+        memset(addr, MM_POISON_ALLOC, size);
+#endif /* MM_POISON */
+        return addr;
+}
 
-        /*
-         * Find the first power of two bucket bigger than the
-         * requested size, and allocate from it.
-         */
-        cs = kmalloc_allocators;
-        for (order = KMALLOC_SIZE_MIN_ORDER; order <= KMALLOC_SIZE_MAX_ORDER; order++, cs++) {
-                if ((size_t)(1 << order) >= size) {
-                        addr = slab_obj_alloc(*cs);
-                        if (!addr) {
-                                dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
-                                return NULL;
-                        }
+static void
+_kfree_large(void *addr)
+{
+        uintptr_t entry = (uintptr_t)radix_remove(&kmalloc_large, ADDR_TO_PN(addr));
+        size_t size = entry >> 1;
+        uint32_t npages = ADDR_TO_PN(PAGE_ALIGN_UP(size));
+
+        KASSERT(0 != entry && "kfree of something kmalloc did not return");
+
+        kmalloc_large_stats.ks_live--;
+        kmalloc_large_stats.ks_requested -= size;
+        kmalloc_large_stats.ks_pages -= npages;
 #ifdef MM_POISON
-                        memset(addr, MM_POISON_ALLOC, size);
+        memset(addr, MM_POISON_FREE, size);
 #endif /* MM_POISON */
-                        *((struct slab_allocator **)addr) = *cs;
-                        return (void *)(((struct slab_allocator **)addr) + 1);
-                }
+        page_free_n(addr, npages);
+}
+
+void *
+kmalloc(size_t size)
+{
+        unsigned int class;
+        struct kmalloc_hdr *hdr;
+
+        for (class = 0; class < KMALLOC_NCLASSES; class++) {
+                if (kmalloc_class_sizes[class] >= size + sizeof(*hdr))
+                        break;
         }
+        if (KMALLOC_NCLASSES == class)
+                return _kmalloc_large(size);
 
-        panic("size bigger than maxorder %ld\n", (unsigned long) size);
-        return NULL;
+        /* charged to our caller, not to kmalloc */
+        if (NULL == (hdr = _slab_obj_alloc(kmalloc_allocators[class],
+                                           (uintptr_t)__builtin_return_address(0)))) {
+                dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
+                return NULL;
+        }
+#ifdef MM_POISON
+        memset(hdr, MM_POISON_ALLOC, size + sizeof(*hdr));
+#endif /* MM_POISON */
+        hdr->kh_class = class;
+        hdr->kh_size = size;
+
+        kmalloc_class_stats[class].ks_nallocs++;
+        kmalloc_class_stats[class].ks_live++;
+        kmalloc_class_stats[class].ks_requested += size;
+        return hdr + 1;
 }
 
 __attribute__((used)) static void *
@@ -447,22 +789,33 @@ malloc(size_t size)
 void
 kfree(void *addr)
 {
-        addr = (void *)(((struct slab_allocator **)addr) - 1);
-        struct slab_allocator *sa = *(struct slab_allocator **)addr;
+        if (PAGE_ALIGNED(addr)) {
+                _kfree_large(addr);
+                return;
+        }
+
+        struct kmalloc_hdr *hdr = ((struct kmalloc_hdr *)addr) - 1;
+        unsigned int class = hdr->kh_class;
+        KASSERT(class < KMALLOC_NCLASSES && "kfree of something kmalloc did not return");
+
+        kmalloc_class_stats[class].ks_live--;
+        kmalloc_class_stats[class].ks_requested -= hdr->kh_size;
 
 #ifdef MM_POISON
         /* If poisoning is enabled, wipe the memory given in
-         * this object, as specified by the cache object size
-         * (minus red-zone overhead, if any).
-         */
-        int objsize = sa->sa_objsize;
-#ifdef SLAB_REDZONE
-        objsize -= sizeof(SLAB_REDZONE) * 2;
-#endif /* SLAB_REDZONE */
-        memset(addr, MM_POISON_FREE, objsize);
+         * this object, as specified by the class size. */
+        memset(hdr, MM_POISON_FREE, kmalloc_class_sizes[class]);
 #endif /* MM_POISON */
 
-        slab_obj_free(sa, addr);
+        slab_obj_free(kmalloc_allocators[class], hdr);
+}
+
+size_t
+kmalloc_class_max(unsigned int class)
+{
+        if (class >= KMALLOC_NCLASSES)
+                return 0;
+        return kmalloc_class_sizes[class] - sizeof(struct kmalloc_hdr);
 }
 
 __attribute__((used)) static void
@@ -476,20 +829,216 @@ free(void *addr)
 void
 slab_init()
 {
-        int order;
-        struct slab_allocator **cs;
+        unsigned int class;
 
         /* Special case initialization of the kmem_cache_t cache. */
-        _allocator_init(&slab_allocator_allocator, "slab_allocators", sizeof(struct slab_allocator));
+        _allocator_init(&slab_allocator_allocator, "slab_allocators", sizeof(struct slab_allocator), 0);
 
         /*
-         * Allocate the power of two buckets for generic
-         * kmalloc/kfree.
+         * Allocate the buckets for generic kmalloc/kfree.
          */
-        cs = kmalloc_allocators;
-        for (order = KMALLOC_SIZE_MIN_ORDER; order <= KMALLOC_SIZE_MAX_ORDER; order++, cs++) {
-                if (NULL == (*cs = slab_allocator_create(kmalloc_allocator_names[order - KMALLOC_SIZE_MIN_ORDER], (1 << order)))) {
+        for (class = 0; class < KMALLOC_NCLASSES; class++) {
+                if (NULL == (kmalloc_allocators[class] = slab_allocator_create(kmalloc_class_names[class],
+                                                                               kmalloc_class_sizes[class]))) {
                         panic("Couldn't create kmalloc allocators!\n");
                 }
         }
+
+        /* Large kmallocs and the pframe system both keep radix trees */
+        radix_init();
+        radix_tree_init(&kmalloc_large);
+        radix_tree_init(&slab_pages);
+
+        /* first, so that it runs last, see mm/shrink.h */
+        shrinker_register(&slab_shrinker);
+
+        counter_register(&slab_nallocs, "slab.allocs");
+        counter_register(&slab_nfrees, "slab.frees");
+}
+
+/*
+ * Prints, for every kmalloc size class, how many allocations are live and
+ * how much of the space they take (class size times count, less the
+ * header) was not asked for, i.e. internal fragmentation.
+ */
+size_t
+kmalloc_info(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+        unsigned int class;
+        uint32_t used, requested;
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "%-11s %8s %8s %10s %10s %5s\n",
+                "CLASS", "ALLOCS", "LIVE", "REQUESTED", "USED", "WASTE");
+        for (class = 0; class < KMALLOC_NCLASSES; class++) {
+                struct kmalloc_stats *ks = &kmalloc_class_stats[class];
+                used = ks->ks_live * kmalloc_class_sizes[class];
+                requested = ks->ks_requested;
+                iprintf(&buf, &size, "%-11s %8u %8u %10u %10u %4u%%\n",
+                        kmalloc_class_names[class], ks->ks_nallocs, ks->ks_live,
+                        requested, used, used ? 100 - (requested * 100) / used : 0);
+        }
+        used = kmalloc_large_stats.ks_pages * PAGE_SIZE;
+        requested = kmalloc_large_stats.ks_requested;
+        iprintf(&buf, &size, "%-11s %8u %8u %10u %10u %4u%%\n",
+                "pages", kmalloc_large_stats.ks_nallocs, kmalloc_large_stats.ks_live,
+                requested, used, used ? 100 - (requested * 100) / used : 0);
+        return size;
+}
+
+#ifdef SLAB_TRACK_CALLERS
+/* How many call sites kmem_census can tell apart, and how many it prints */
+#define KMEM_CENSUS_SITES       256
+#define KMEM_CENSUS_TOP         32
+
+struct kmem_site {
+        uintptr_t                ks_caller;
+        uint32_t                 ks_chain;      /* 0 without SLAB_TRACK_CHAINS */
+        struct slab_allocator   *ks_allocator;
+        uint32_t                 ks_live;       /* objects it holds */
+};
+
+/* Filled in afresh by each census, which neither blocks nor runs in
+ * interrupt context, so a single table will do */
+static struct kmem_site kmem_sites[KMEM_CENSUS_SITES];
+
+static void
+_kmem_census_site(struct slab_allocator *a, uintptr_t caller, uint32_t chain,
+                  uint32_t *dropped)
+{
+        uint32_t h = ((caller >> 2) ^ ((uintptr_t)a >> 4) ^ (chain * 2654435761U))
+                     % KMEM_CENSUS_SITES;
+        uint32_t i;
+
+        for (i = 0; i < KMEM_CENSUS_SITES; i++, h = (h + 1) % KMEM_CENSUS_SITES) {
+                struct kmem_site *s = &kmem_sites[h];
+
+                if (0 == s->ks_caller) {
+                        s->ks_caller = caller;
+                        s->ks_chain = chain;
+                        s->ks_allocator = a;
+                }
+                if (caller == s->ks_caller && chain == s->ks_chain
+                    && a == s->ks_allocator) {
+                        s->ks_live++;
+                        return;
+                }
+        }
+        (*dropped)++;
+}
+
+/* Objects in the magazine, and on the free list, have no caller */
+static void
+_kmem_census_slab(struct slab_allocator *a, struct slab *slab, uint32_t *dropped)
+{
+        void *obj = slab->s_objs;
+        struct slab_bufctl *buf;
+        uint32_t chain = 0;
+        int i;
+
+        for (i = 0; i < a->sa_slab_nobjs; i++, obj = next_obj(a, obj)) {
+                buf = slab_bufctl(a, slab, obj);
+                if (0 == buf->sb_caller)
+                        continue;
+#ifdef SLAB_TRACK_CHAINS
+                chain = buf->sb_chain;
+#endif
+                _kmem_census_site(a, buf->sb_caller, chain, dropped);
+        }
+}
+#endif /* SLAB_TRACK_CALLERS */
+
+/*
+ * Prints, for every slab allocator with any slabs, how many of its objects
+ * are live (handed out and not in the magazine) and the memory they take,
+ * then the call sites holding the most of it. Call sites are return
+ * addresses; "info symbol" in gdb, or addr2line on the kernel, names them.
+ */
+size_t
+kmem_census(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+        struct slab_allocator *a;
+        struct slab *slab;
+        uint32_t nslabs, live;
+#ifdef SLAB_TRACK_CALLERS
+        struct kmem_site *s, *best;
+        const uintptr_t *pcs;
+        uint32_t dropped = 0;
+        int i, n, depth;
+
+        memset(kmem_sites, 0, sizeof(kmem_sites));
+#endif
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "%-20s %7s %6s %8s %4s %9s\n",
+                "ALLOCATOR", "OBJSIZE", "SLABS", "LIVE", "MAG", "BYTES");
+        for (a = slab_allocators; NULL != a; a = a->sa_next) {
+                nslabs = live = 0;
+                list_iterate_begin(&a->sa_full, slab, struct slab, s_link) {
+                        nslabs++;
+                        live += slab->s_inuse;
+#ifdef SLAB_TRACK_CALLERS
+                        _kmem_census_slab(a, slab, &dropped);
+#endif
+                } list_iterate_end();
+                list_iterate_begin(&a->sa_partial, slab, struct slab, s_link) {
+                        nslabs++;
+                        live += slab->s_inuse;
+#ifdef SLAB_TRACK_CALLERS
+                        _kmem_census_slab(a, slab, &dropped);
+#endif
+                } list_iterate_end();
+                list_iterate_begin(&a->sa_empty, slab, struct slab, s_link) {
+                        nslabs++;
+                } list_iterate_end();
+                if (0 == nslabs)
+                        continue;
+
+                /* the slabs count the magazine's objects as in use */
+                live -= a->sa_mag_rounds;
+                iprintf(&buf, &size, "%-20s %7u %6u %8u %4d %9u\n", a->sa_name,
+                        a->sa_objsize, nslabs, live, a->sa_mag_rounds,
+                        live * a->sa_objsize);
+        }
+        iprintf(&buf, &size, "%-20s %7s %6s %8u %4s %9u\n", "kmalloc pages",
+                "-", "-", kmalloc_large_stats.ks_live, "-",
+                kmalloc_large_stats.ks_pages * PAGE_SIZE);
+
+#ifdef SLAB_TRACK_CALLERS
+        iprintf(&buf, &size, "\n%-10s %-20s %8s %9s\n",
+                "CALLER", "ALLOCATOR", "LIVE", "BYTES");
+        for (n = 0; n < KMEM_CENSUS_TOP; n++) {
+                best = NULL;
+                for (i = 0; i < KMEM_CENSUS_SITES; i++) {
+                        s = &kmem_sites[i];
+                        if (0 != s->ks_live && (NULL == best
+                            || s->ks_live * s->ks_allocator->sa_objsize
+                            > best->ks_live * best->ks_allocator->sa_objsize))
+                                best = s;
+                }
+                if (NULL == best)
+                        break;
+                iprintf(&buf, &size, "0x%08x %-20s %8u %9u\n", best->ks_caller,
+                        best->ks_allocator->sa_name, best->ks_live,
+                        best->ks_live * best->ks_allocator->sa_objsize);
+                /* the chain's first return address is the caller's */
+                if (1 < (depth = callchain_fetch(best->ks_chain, &pcs))) {
+                        iprintf(&buf, &size, "  from");
+                        for (i = 1; i < depth; i++)
+                                iprintf(&buf, &size, " 0x%08x", pcs[i]);
+                        iprintf(&buf, &size, "\n");
+                }
+                best->ks_live = 0;
+        }
+        if (0 != dropped)
+                iprintf(&buf, &size, "%u objects from more than %d call sites not counted\n",
+                        dropped, KMEM_CENSUS_SITES);
+#endif
+        return size;
 }
@@ -0,0 +1,156 @@
+/*
+ * vmalloc: large kernel allocations made of single pages, mapped one
+ * after another into the vmalloc area. The area's page tables are made
+ * once, at boot, and shared by every page directory (see pt_init), so
+ * mapping and unmapping its pages never has to reach each directory.
+ *
+ * The addresses are handed out first fit from vmalloc_map, a bit per
+ * page of the area, starting where the last search left off; each
+ * allocation takes a page more than it needs, left unmapped as a guard.
+ * Allocations are found again from their first page through
+ * vmalloc_areas, which holds npages << 1 | 1 so entries are never NULL.
+ */
+
+#include "types.h"
+#include "kernel.h"
+#include "config.h"
+
+#include "mm/mm.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+#include "mm/radix.h"
+#include "mm/tlb.h"
+#include "mm/vmalloc.h"
+
+#include "util/bits.h"
+#include "util/debug.h"
+#include "util/string.h"
+
+#include "boot/config.h"
+
+#define VMALLOC_NPAGES          (VMALLOC_SIZE / PAGE_SIZE)
+
+/* Pages unmapped together before one ranged flush, and then freed */
+#define VMALLOC_FREE_BATCH      TLB_FLUSH_ALL_THRESHOLD
+
+static uint32_t vmalloc_map[VMALLOC_NPAGES / 32];
+static uint32_t vmalloc_next;
+static radix_tree_t vmalloc_areas;
+
+/* The first of npages free pages in a row, or -1 if there is no room */
+static int
+vmalloc_find(uint32_t npages)
+{
+        uint32_t start = vmalloc_next;
+        uint32_t pn, run = 0;
+        uint32_t i;
+
+        for (i = 0; i < VMALLOC_NPAGES + npages; i++) {
+                pn = (start + i) % VMALLOC_NPAGES;
+                if (0 == pn) {
+                        /* a run does not wrap around the end */
+                        run = 0;
+                }
+                if (bit_check(vmalloc_map, pn)) {
+                        run = 0;
+                } else if (++run == npages) {
+                        return pn + 1 - npages;
+                }
+        }
+        return -1;
+}
+
+static void
+vmalloc_mark(uint32_t pn, uint32_t npages)
+{
+        uint32_t i;
+        for (i = 0; i < npages; i++) {
+                bit_flip(vmalloc_map, pn + i);
+        }
+}
+
+/* Unmaps the first npages pages of an allocation at vaddr and frees them,
+ * flushing each batch from the TLB before its pages go back */
+static void
+vmalloc_unmap(uintptr_t vaddr, uint32_t npages)
+{
+        uintptr_t paddrs[VMALLOC_FREE_BATCH];
+        uint32_t done, n, i;
+
+        for (done = 0; done < npages; done += n) {
+                n = MIN(npages - done, VMALLOC_FREE_BATCH);
+                for (i = 0; i < n; i++) {
+                        paddrs[i] = pt_kernel_unmap(vaddr + (done + i) * PAGE_SIZE);
+                }
+                tlb_flush_range(vaddr + done * PAGE_SIZE, n);
+                for (i = 0; i < n; i++) {
+                        page_free((char *)&kernel_start + (paddrs[i] - KERNEL_PHYS_BASE));
+                }
+        }
+}
+
+void *
+vmalloc(size_t size)
+{
+        uint32_t npages = ADDR_TO_PN(PAGE_ALIGN_UP(size));
+        uintptr_t vaddr;
+        uint32_t i;
+        int pn;
+
+        if (0 == npages || VMALLOC_NPAGES <= npages) {
+                return NULL;
+        }
+        /* the guard page is taken too, free of any mapping */
+        if (0 > (pn = vmalloc_find(npages + 1))) {
+                dbg(DBG_MM, "vmalloc: no room for %u pages\n", npages);
+                return NULL;
+        }
+        /* marked first, as the radix tree may block for memory */
+        vmalloc_mark(pn, npages + 1);
+        vmalloc_next = (pn + npages + 1) % VMALLOC_NPAGES;
+        if (0 > radix_insert(&vmalloc_areas, pn, (void *)(uintptr_t)((npages << 1) | 1))) {
+                vmalloc_mark(pn, npages + 1);
+                return NULL;
+        }
+
+        vaddr = VMALLOC_START + (uintptr_t)PN_TO_ADDR(pn);
+        for (i = 0; i < npages; i++) {
+                void *page;
+                if (NULL == (page = page_alloc())) {
+                        vmalloc_unmap(vaddr, i);
+                        radix_remove(&vmalloc_areas, pn);
+                        vmalloc_mark(pn, npages + 1);
+                        return NULL;
+                }
+                pt_kernel_map(vaddr + i * PAGE_SIZE,
+                              (uintptr_t)page - (uintptr_t)&kernel_start + KERNEL_PHYS_BASE);
+        }
+
+#ifdef MM_POISON
+        memset((void *)vaddr, MM_POISON_ALLOC, size);
+#endif /* MM_POISON */
+        return (void *)vaddr;
+}
+
+void
+vfree(void *addr)
+{
+        uint32_t pn, npages;
+        uintptr_t entry;
+
+        if (NULL == addr) {
+                return;
+        }
+        KASSERT(vmalloc_addr(addr) && PAGE_ALIGNED(addr));
+
+        pn = ADDR_TO_PN((uintptr_t)addr - VMALLOC_START);
+        entry = (uintptr_t)radix_remove(&vmalloc_areas, pn);
+        KASSERT(0 != entry && "vfree of something vmalloc did not return");
+        npages = entry >> 1;
+
+#ifdef MM_POISON
+        memset(addr, MM_POISON_FREE, npages * PAGE_SIZE);
+#endif /* MM_POISON */
+        vmalloc_unmap((uintptr_t)addr, npages);
+        vmalloc_mark(pn, npages + 1);
+}
@@ -0,0 +1,172 @@
+#include "kernel.h"
+#include "types.h"
+#include "errno.h"
+#include "config.h"
+#include "globals.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+#include "util/time.h"
+#include "util/init.h"
+
+#include "proc/sched.h"
+
+#include "net/net.h"
+#include "net/socket.h"
+
+#define ARP_HTYPE_ETHER         1
+#define ARP_OP_REQUEST          1
+#define ARP_OP_REPLY            2
+
+/* An ARP packet for IPv4 over ethernet; the addresses are not aligned */
+typedef struct arp_pkt {
+        uint16_t ap_htype;
+        uint16_t ap_ptype;
+        uint8_t  ap_hlen;
+        uint8_t  ap_plen;
+        uint16_t ap_op;
+        uint8_t  ap_sha[ETH_ALEN];
+        uint32_t ap_spa;
+        uint8_t  ap_tha[ETH_ALEN];
+        uint32_t ap_tpa;
+} __attribute__((packed)) arp_pkt_t;
+
+typedef struct arp_entry {
+        uint32_t ae_addr;               /* 0 if the entry is free */
+        uint8_t  ae_mac[ETH_ALEN];
+        uint64_t ae_used;               /* time_now_ns() it was last used */
+} arp_entry_t;
+
+/*
+ * What is known of the neighbours. Only threads look at and change it,
+ * and nothing preempts the kernel, so it needs no locking. An entry is
+ * never expired, only replaced by the least recently used once the cache
+ * is full; QEMU's gateway, which is most of what there is to talk to,
+ * never moves.
+ */
+static arp_entry_t arp_cache[ARP_CACHE_SIZE];
+
+/* Threads in arp_resolve, woken by every reply */
+static ktqueue_t arp_waitq;
+
+static const uint8_t eth_broadcast[ETH_ALEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+static const uint8_t eth_unknown[ETH_ALEN] = { 0, 0, 0, 0, 0, 0 };
+
+static __attribute__((unused)) void
+arp_init(void)
+{
+        sched_queue_init(&arp_waitq);
+}
+init_func(arp_init);
+
+static arp_entry_t *
+arp_lookup(uint32_t addr)
+{
+        int i;
+
+        for (i = 0; i < ARP_CACHE_SIZE; i++) {
+                if (arp_cache[i].ae_addr == addr)
+                        return &arp_cache[i];
+        }
+        return NULL;
+}
+
+/* Notes that addr is at mac, if addr is known already or if add is set */
+static void
+arp_update(uint32_t addr, const uint8_t *mac, int add)
+{
+        arp_entry_t *ae = arp_lookup(addr);
+        int i;
+
+        if (NULL == ae) {
+                if (!add)
+                        return;
+                ae = &arp_cache[0];
+                for (i = 1; i < ARP_CACHE_SIZE && 0 != ae->ae_addr; i++) {
+                        if (0 == arp_cache[i].ae_addr || arp_cache[i].ae_used < ae->ae_used)
+                                ae = &arp_cache[i];
+                }
+                ae->ae_addr = addr;
+        }
+        memcpy(ae->ae_mac, mac, ETH_ALEN);
+        ae->ae_used = time_now_ns();
+        sched_broadcast_on(&arp_waitq);
+}
+
+static int
+arp_send(netdev_t *nd, uint16_t op, const uint8_t *tha, uint32_t tpa)
+{
+        netbuf_t *nb;
+        arp_pkt_t *ap;
+
+        if (NULL == (nb = netbuf_alloc()))
+                return -ENOMEM;
+        ap = (arp_pkt_t *)netbuf_push(nb, sizeof(*ap));
+        ap->ap_htype = htons(ARP_HTYPE_ETHER);
+        ap->ap_ptype = htons(ETH_P_IP);
+        ap->ap_hlen = ETH_ALEN;
+        ap->ap_plen = sizeof(uint32_t);
+        ap->ap_op = htons(op);
+        memcpy(ap->ap_sha, nd->nd_mac, ETH_ALEN);
+        ap->ap_spa = htonl(nd->nd_addr);
+        memcpy(ap->ap_tha, (ARP_OP_REQUEST == op) ? eth_unknown : tha, ETH_ALEN);
+        ap->ap_tpa = htonl(tpa);
+        return eth_output(nd, nb, (ARP_OP_REQUEST == op) ? eth_broadcast : tha, ETH_P_ARP);
+}
+
+void
+arp_input(netdev_t *nd, netbuf_t *nb)
+{
+        arp_pkt_t *ap = (arp_pkt_t *)netbuf_pull(nb, sizeof(*ap));
+        uint32_t spa, tpa;
+        uint8_t sha[ETH_ALEN];
+        uint16_t op;
+
+        if (NULL == ap || ARP_HTYPE_ETHER != ntohs(ap->ap_htype)
+            || ETH_P_IP != ntohs(ap->ap_ptype) || ETH_ALEN != ap->ap_hlen
+            || sizeof(uint32_t) != ap->ap_plen) {
+                netbuf_free(nb);
+                return;
+        }
+        spa = ntohl(ap->ap_spa);
+        tpa = ntohl(ap->ap_tpa);
+        op = ntohs(ap->ap_op);
+        memcpy(sha, ap->ap_sha, ETH_ALEN);
+        netbuf_free(nb);
+
+        /* whoever asks for us is about to talk to us, so is worth
+         * remembering; anyone else only if they are already known */
+        arp_update(spa, sha, tpa == nd->nd_addr);
+        if (ARP_OP_REQUEST == op && tpa == nd->nd_addr)
+                arp_send(nd, ARP_OP_REPLY, sha, spa);
+}
+
+int
+arp_resolve(netdev_t *nd, uint32_t addr, uint8_t *mac)
+{
+        arp_entry_t *ae;
+        int tries;
+
+        if (INADDR_BROADCAST == addr) {
+                memcpy(mac, eth_broadcast, ETH_ALEN);
+                return 0;
+        }
+        for (tries = 0; NULL == (ae = arp_lookup(addr)); tries++) {
+                if (ARP_RESOLVE_TRIES == tries) {
+                        dbg(DBG_NET, "no ARP reply from %u.%u.%u.%u\n", addr >> 24,
+                            (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+                        return -EHOSTUNREACH;
+                }
+                arp_send(nd, ARP_OP_REQUEST, NULL, addr);
+                /* netd cannot wait for a reply it would take in itself;
+                 * what it sends is only ever a reply, which can be lost */
+                if (curthr == nd->nd_thr)
+                        return -EHOSTUNREACH;
+                /* woken by any reply, which may not be the one wanted */
+                if (-EINTR == sched_sleep_on_timeout(&arp_waitq, ARP_RESOLVE_MSECS))
+                        return -EINTR;
+        }
+        memcpy(mac, ae->ae_mac, ETH_ALEN);
+        ae->ae_used = time_now_ns();
+        return 0;
+}
@@ -0,0 +1,181 @@
+#include "kernel.h"
+#include "types.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+#include "util/counter.h"
+#include "util/init.h"
+
+#include "net/net.h"
+#include "net/socket.h"
+
+#define IP_VERSION              4
+#define IP_TTL                  64
+#define IP_FLAG_MF              0x2000  /* more fragments */
+#define IP_FRAG_OFFSET          0x1fff
+
+typedef struct ip_hdr {
+        uint8_t  ih_vhl;                /* version, then header words */
+        uint8_t  ih_tos;
+        uint16_t ih_len;                /* all of it, header and data */
+        uint16_t ih_id;
+        uint16_t ih_frag;
+        uint8_t  ih_ttl;
+        uint8_t  ih_proto;
+        uint16_t ih_sum;
+        uint32_t ih_src;
+        uint32_t ih_dst;
+} ip_hdr_t;
+
+#define ICMP_ECHO_REPLY         0
+#define ICMP_ECHO_REQUEST       8
+
+typedef struct icmp_hdr {
+        uint8_t  ic_type;
+        uint8_t  ic_code;
+        uint16_t ic_sum;
+        /* followed by what is particular to the type */
+} icmp_hdr_t;
+
+static uint16_t ip_next_id;
+
+/* Packets in and out, and those dropped as malformed or not for us */
+static counter_t ip_nrx;
+static counter_t ip_ntx;
+static counter_t ip_ndropped;
+
+static __attribute__((unused)) void
+ip_counters_init(void)
+{
+        counter_register(&ip_nrx, "ip.rx");
+        counter_register(&ip_ntx, "ip.tx");
+        counter_register(&ip_ndropped, "ip.dropped");
+}
+init_func(ip_counters_init);
+
+uint32_t
+ip_sum(const void *data, size_t len, uint32_t sum)
+{
+        const uint8_t *p = (const uint8_t *)data;
+
+        while (len > 1) {
+                sum += ((uint32_t)p[0] << 8) | p[1];
+                p += 2;
+                len -= 2;
+        }
+        if (len > 0)
+                sum += (uint32_t)p[0] << 8;
+        return sum;
+}
+
+/* The sum is of the words as they are on the wire, so the checksum comes
+ * out in network byte order once it is stored with htons. Over anything
+ * which already has its checksum in it, it comes out 0. */
+uint16_t
+ip_checksum(uint32_t sum)
+{
+        while (sum >> 16)
+                sum = (sum & 0xffff) + (sum >> 16);
+        return htons((uint16_t)~sum);
+}
+
+int
+ip_output(netbuf_t *nb, uint8_t proto, uint32_t src, uint32_t dst)
+{
+        uint8_t mac[ETH_ALEN];
+        uint32_t nexthop;
+        netdev_t *nd;
+        ip_hdr_t *ih;
+        int err;
+
+        if (NULL == (nd = netdev_route(dst, &nexthop))) {
+                netbuf_free(nb);
+                return -EHOSTUNREACH;
+        }
+        if (INADDR_BROADCAST == dst)
+                nexthop = dst;
+        if (0 > (err = arp_resolve(nd, nexthop, mac))) {
+                netbuf_free(nb);
+                return err;
+        }
+
+        ih = (ip_hdr_t *)netbuf_push(nb, IP_HLEN);
+        ih->ih_vhl = (IP_VERSION << 4) | (IP_HLEN / 4);
+        ih->ih_tos = 0;
+        ih->ih_len = htons(nb->nb_len);
+        ih->ih_id = htons(ip_next_id);
+        ip_next_id++;
+        ih->ih_frag = 0;
+        ih->ih_ttl = IP_TTL;
+        ih->ih_proto = proto;
+        ih->ih_sum = 0;
+        ih->ih_src = htonl(src);
+        ih->ih_dst = htonl(dst);
+        ih->ih_sum = ip_checksum(ip_sum(ih, IP_HLEN, 0));
+
+        counter_inc(&ip_ntx);
+        return eth_output(nd, nb, mac, ETH_P_IP);
+}
+
+/* Answers a ping by turning the request around in the page it came in */
+static void
+icmp_input(netbuf_t *nb, uint32_t src, uint32_t dst)
+{
+        icmp_hdr_t *ic = (icmp_hdr_t *)nb->nb_data;
+
+        if (nb->nb_len < sizeof(*ic) || 0 != ip_checksum(ip_sum(ic, nb->nb_len, 0))
+            || ICMP_ECHO_REQUEST != ic->ic_type) {
+                netbuf_free(nb);
+                return;
+        }
+        ic->ic_type = ICMP_ECHO_REPLY;
+        ic->ic_sum = 0;
+        ic->ic_sum = ip_checksum(ip_sum(ic, nb->nb_len, 0));
+        ip_output(nb, IPPROTO_ICMP, dst, src);
+}
+
+void
+ip_input(netdev_t *nd, netbuf_t *nb)
+{
+        ip_hdr_t *ih = (ip_hdr_t *)nb->nb_data;
+        uint32_t src, dst;
+        size_t hlen, len;
+
+        counter_inc(&ip_nrx);
+        if (nb->nb_len < IP_HLEN || IP_VERSION != (ih->ih_vhl >> 4))
+                goto drop;
+        hlen = (ih->ih_vhl & 0xf) * 4;
+        len = ntohs(ih->ih_len);
+        if (hlen < IP_HLEN || len < hlen || nb->nb_len < len
+            || 0 != ip_checksum(ip_sum(ih, hlen, 0)))
+                goto drop;
+        /* fragments are not put back together, so what is sent in pieces,
+         * more than a frame's worth, is lost */
+        if (ntohs(ih->ih_frag) & (IP_FLAG_MF | IP_FRAG_OFFSET))
+                goto drop;
+
+        src = ntohl(ih->ih_src);
+        dst = ntohl(ih->ih_dst);
+        if (dst != nd->nd_addr && INADDR_BROADCAST != dst
+            && dst != (nd->nd_addr | ~nd->nd_netmask))
+                goto drop;
+
+        /* ethernet pads short frames, which the IP length leaves out */
+        nb->nb_len = len;
+        netbuf_pull(nb, hlen);
+        switch (ih->ih_proto) {
+                case IPPROTO_ICMP:
+                        /* pings to a broadcast address go unanswered */
+                        if (dst != nd->nd_addr)
+                                break;
+                        icmp_input(nb, src, dst);
+                        return;
+                case IPPROTO_UDP:
+                        udp_input(nb, src, dst);
+                        return;
+        }
+drop:
+        counter_inc(&ip_ndropped);
+        netbuf_free(nb);
+}
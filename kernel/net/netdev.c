@@ -0,0 +1,236 @@
+#include "kernel.h"
+#include "types.h"
+#include "errno.h"
+#include "globals.h"
+#include "config.h"
+
+#include "main/interrupt.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/string.h"
+#include "util/counter.h"
+#include "util/init.h"
+
+#include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+
+#include "mm/page.h"
+
+#include "net/net.h"
+#include "net/socket.h"
+
+typedef struct eth_hdr {
+        uint8_t  eh_dst[ETH_ALEN];
+        uint8_t  eh_src[ETH_ALEN];
+        uint16_t eh_type;               /* in network byte order */
+} __attribute__((packed)) eth_hdr_t;
+
+static list_t netdevs = { &netdevs, &netdevs };
+
+/* Frames in and out of all the devices, and those that came in for a
+ * protocol nothing here speaks */
+static counter_t net_nrx;
+static counter_t net_ntx;
+static counter_t net_nunknown;
+
+static __attribute__((unused)) void
+net_counters_init(void)
+{
+        counter_register(&net_nrx, "net.rx_frames");
+        counter_register(&net_ntx, "net.tx_frames");
+        counter_register(&net_nunknown, "net.rx_unknown");
+}
+init_func(net_counters_init);
+
+netbuf_t *
+netbuf_alloc(void)
+{
+        netbuf_t *nb = (netbuf_t *)page_alloc();
+
+        if (NULL == nb)
+                return NULL;
+        list_link_init(&nb->nb_link);
+        nb->nb_data = NETBUF_START(nb) + NETBUF_HEADROOM;
+        nb->nb_len = 0;
+        nb->nb_faddr = 0;
+        nb->nb_fport = 0;
+        return nb;
+}
+
+void
+netbuf_free(netbuf_t *nb)
+{
+        KASSERT(!list_link_is_linked(&nb->nb_link));
+        page_free(nb);
+}
+
+void *
+netbuf_push(netbuf_t *nb, size_t len)
+{
+        KASSERT(nb->nb_data - len >= NETBUF_START(nb) && "no headroom left");
+        nb->nb_data -= len;
+        nb->nb_len += len;
+        return nb->nb_data;
+}
+
+void *
+netbuf_pull(netbuf_t *nb, size_t len)
+{
+        char *hdr = nb->nb_data;
+
+        if (nb->nb_len < len)
+                return NULL;
+        nb->nb_data += len;
+        nb->nb_len -= len;
+        return hdr;
+}
+
+int
+eth_output(netdev_t *nd, netbuf_t *nb, const uint8_t *dst, uint16_t type)
+{
+        eth_hdr_t *eh = (eth_hdr_t *)netbuf_push(nb, ETH_HLEN);
+
+        memcpy(eh->eh_dst, dst, ETH_ALEN);
+        memcpy(eh->eh_src, nd->nd_mac, ETH_ALEN);
+        eh->eh_type = htons(type);
+        counter_inc(&net_ntx);
+        return nd->nd_ops->xmit(nd, nb);
+}
+
+static void
+eth_input(netdev_t *nd, netbuf_t *nb)
+{
+        eth_hdr_t *eh = (eth_hdr_t *)netbuf_pull(nb, ETH_HLEN);
+
+        counter_inc(&net_nrx);
+        if (NULL == eh) {
+                netbuf_free(nb);
+                return;
+        }
+        switch (ntohs(eh->eh_type)) {
+                case ETH_P_IP:
+                        ip_input(nd, nb);
+                        break;
+                case ETH_P_ARP:
+                        arp_input(nd, nb);
+                        break;
+                default:
+                        counter_inc(&net_nunknown);
+                        netbuf_free(nb);
+                        break;
+        }
+}
+
+/*
+ * Each network device gets a thread which takes in what it receives,
+ * so that the protocols run in thread context, where they can allocate
+ * pages and send replies, rather than in the device's interrupt.
+ */
+static void *
+netd_run(int arg1, void *arg2)
+{
+        netdev_t *nd = (netdev_t *)arg2;
+        list_t frames;
+        netbuf_t *nb;
+
+        list_init(&frames);
+        while (1) {
+                uint8_t oldipl;
+
+                /* a frame arriving between the check and the sleep would
+                 * go unnoticed, so interrupts wait until it */
+                oldipl = intr_getipl();
+                intr_setipl(IPL_HIGH);
+                while (!nd->nd_rxready) {
+                        if (sched_cancellable_sleep_on(&nd->nd_waitq)) {
+                                intr_setipl(oldipl);
+                                kthread_exit((void *)0);
+                        }
+                }
+                nd->nd_rxready = 0;
+                intr_setipl(oldipl);
+
+                nd->nd_ops->receive(nd, &frames);
+                list_iterate_begin(&frames, nb, netbuf_t, nb_link) {
+                        list_remove(&nb->nb_link);
+                        eth_input(nd, nb);
+                } list_iterate_end();
+        }
+        return NULL;
+}
+
+void
+netdev_register(netdev_t *nd)
+{
+        proc_t *p;
+
+        KASSERT(NULL != nd && NULL != nd->nd_ops);
+        KASSERT(curproc && (PID_IDLE == curproc->p_pid)
+                && "should be calling this from idleproc");
+
+        nd->nd_addr = NET_ADDR;
+        nd->nd_netmask = NET_NETMASK;
+        nd->nd_gateway = NET_GATEWAY;
+        sched_queue_init(&nd->nd_waitq);
+        nd->nd_rxready = 1;     /* for whatever came in before netd ran */
+        list_insert_tail(&netdevs, &nd->nd_link);
+
+        p = proc_create("netd");
+        KASSERT(NULL != p);
+        nd->nd_thr = kthread_create(p, netd_run, 0, nd);
+        KASSERT(NULL != nd->nd_thr);
+        sched_make_runnable(nd->nd_thr);
+
+        dbg(DBG_NET, "%s: %02x:%02x:%02x:%02x:%02x:%02x, address %u.%u.%u.%u\n",
+            nd->nd_name, nd->nd_mac[0], nd->nd_mac[1], nd->nd_mac[2],
+            nd->nd_mac[3], nd->nd_mac[4], nd->nd_mac[5], nd->nd_addr >> 24,
+            (nd->nd_addr >> 16) & 0xff, (nd->nd_addr >> 8) & 0xff, nd->nd_addr & 0xff);
+}
+
+void
+netdev_wakeup(netdev_t *nd)
+{
+        nd->nd_rxready = 1;
+        sched_wakeup_on(&nd->nd_waitq);
+}
+
+/* Any address not on a device's own network is sent to its gateway;
+ * with only one device there is nothing more to choose */
+netdev_t *
+netdev_route(uint32_t addr, uint32_t *nexthop)
+{
+        netdev_t *nd;
+
+        list_iterate_begin(&netdevs, nd, netdev_t, nd_link) {
+                if ((addr & nd->nd_netmask) == (nd->nd_addr & nd->nd_netmask)) {
+                        *nexthop = addr;
+                        return nd;
+                }
+        } list_iterate_end();
+        if (list_empty(&netdevs))
+                return NULL;
+        nd = list_head(&netdevs, netdev_t, nd_link);
+        *nexthop = nd->nd_gateway;
+        return nd;
+}
+
+void
+netdev_shutdown(void)
+{
+        netdev_t *nd;
+
+        KASSERT(PID_IDLE == curproc->p_pid);
+        list_iterate_begin(&netdevs, nd, netdev_t, nd_link) {
+                kthread_t *thr = nd->nd_thr;
+                pid_t pid, child;
+                if (NULL == thr)
+                        continue;
+                pid = thr->kt_proc->p_pid;
+                nd->nd_thr = NULL;
+                kthread_cancel(thr, (void *)0);
+                child = do_waitpid(pid, 0, NULL);
+                KASSERT(pid == child);
+        } list_iterate_end();
+}
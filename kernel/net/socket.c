@@ -0,0 +1,222 @@
+/*
+ * The system calls on sockets, whatever their family. A socket is a file
+ * whose vnode is on the fs of one of the families below, which does the
+ * rest.
+ */
+
+#include "kernel.h"
+#include "types.h"
+#include "errno.h"
+#include "globals.h"
+
+#include "fs/file.h"
+#include "fs/open.h"
+#include "fs/vfs.h"
+#include "fs/vfs_syscall.h"
+#include "fs/vnode.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#include "net/sock.h"
+#include "net/socket.h"
+
+static sockops_t *sock_families[] = { &unix_sockops, &udp_sockops };
+
+#define NFAMILIES       ((int)(sizeof(sock_families) / sizeof(sock_families[0])))
+
+static sockops_t *
+sock_family(int domain)
+{
+        int i;
+
+        for (i = 0; i < NFAMILIES; i++) {
+                if (sock_families[i]->so_domain == domain)
+                        return sock_families[i];
+        }
+        return NULL;
+}
+
+/* Returns the family of the socket open as fd, with a reference to its
+ * file in *fp, or NULL with -EBADF or -ENOTSOCK in *err */
+static sockops_t *
+sock_get(int fd, file_t **fp, int *err)
+{
+        file_t *f;
+        int i;
+
+        if (fd < 0 || fd >= NFILES || NULL == (f = fget(fd))) {
+                *err = -EBADF;
+                return NULL;
+        }
+        for (i = 0; i < NFAMILIES; i++) {
+                if (f->f_vnode->vn_fs == sock_families[i]->so_fs) {
+                        *fp = f;
+                        return sock_families[i];
+                }
+        }
+        fput(f);
+        *err = -ENOTSOCK;
+        return NULL;
+}
+
+/* Opens vn as a new file descriptor, which takes over the caller's
+ * reference to it; it is put if that fails */
+static int
+sock_install(vnode_t *vn)
+{
+        file_t *f;
+        int fd;
+
+        if (0 > (fd = get_empty_fd(curproc))) {
+                vput(vn);
+                return fd;
+        }
+        if (NULL == (f = fget(-1))) {
+                vput(vn);
+                return -ENOMEM;
+        }
+        fdtable_install(&curproc->p_fdtable, fd, f);
+        f->f_mode = FMODE_READ | FMODE_WRITE;
+        f->f_pos = 0;
+        facq(f, vn);
+        return fd;
+}
+
+void
+sockaddr_out(struct sockaddr *dst, socklen_t *dstlen, const void *addr, socklen_t len)
+{
+        if (NULL == dst)
+                return;
+        memcpy(dst, addr, MIN(*dstlen, len));
+        *dstlen = len;
+}
+
+int
+do_socket(int domain, int type, int protocol)
+{
+        sockops_t *ops;
+        vnode_t *vn;
+        int err;
+
+        if (NULL == (ops = sock_family(domain)))
+                return -EAFNOSUPPORT;
+        if (0 > (err = ops->create(type, protocol, &vn)))
+                return err;
+        return sock_install(vn);
+}
+
+int
+do_socketpair(int domain, int type, int protocol, int sv[2])
+{
+        vnode_t *vns[2];
+        sockops_t *ops;
+        int fd, err;
+
+        if (NULL == (ops = sock_family(domain)))
+                return -EAFNOSUPPORT;
+        if (NULL == ops->pair)
+                return -EOPNOTSUPP;
+        if (0 > (err = ops->pair(type, protocol, vns)))
+                return err;
+
+        if (0 > (fd = sock_install(vns[0]))) {
+                vput(vns[1]);
+                return fd;
+        }
+        if (0 > (sv[1] = sock_install(vns[1]))) {
+                do_close(fd);
+                return sv[1];
+        }
+        sv[0] = fd;
+        return 0;
+}
+
+int
+do_bind(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+        sockops_t *ops;
+        file_t *f;
+        int err;
+
+        if (NULL == (ops = sock_get(fd, &f, &err)))
+                return err;
+        err = (NULL != ops->bind) ? ops->bind(f->f_vnode, addr, addrlen) : -EOPNOTSUPP;
+        fput(f);
+        return err;
+}
+
+int
+do_listen(int fd, int backlog)
+{
+        sockops_t *ops;
+        file_t *f;
+        int err;
+
+        if (NULL == (ops = sock_get(fd, &f, &err)))
+                return err;
+        err = (NULL != ops->listen) ? ops->listen(f->f_vnode, backlog) : -EOPNOTSUPP;
+        fput(f);
+        return err;
+}
+
+int
+do_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+        sockops_t *ops;
+        vnode_t *vn;
+        file_t *f;
+        int err;
+
+        if (NULL == (ops = sock_get(fd, &f, &err)))
+                return err;
+        if (NULL == ops->accept)
+                err = -EOPNOTSUPP;
+        else if (0 == (err = ops->accept(f->f_vnode, &vn, addr, addrlen)))
+                err = sock_install(vn);
+        fput(f);
+        return err;
+}
+
+int
+do_connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+        sockops_t *ops;
+        file_t *f;
+        int err;
+
+        if (NULL == (ops = sock_get(fd, &f, &err)))
+                return err;
+        err = (NULL != ops->connect) ? ops->connect(f->f_vnode, addr, addrlen) : -EOPNOTSUPP;
+        fput(f);
+        return err;
+}
+
+int
+do_sendto(int fd, const void *ubuf, size_t len, const struct sockaddr *to, socklen_t tolen)
+{
+        sockops_t *ops;
+        file_t *f;
+        int err;
+
+        if (NULL == (ops = sock_get(fd, &f, &err)))
+                return err;
+        err = (NULL != ops->sendto) ? ops->sendto(f->f_vnode, ubuf, len, to, tolen) : -EOPNOTSUPP;
+        fput(f);
+        return err;
+}
+
+int
+do_recvfrom(int fd, void *ubuf, size_t len, struct sockaddr *from, socklen_t *fromlen)
+{
+        sockops_t *ops;
+        file_t *f;
+        int err;
+
+        if (NULL == (ops = sock_get(fd, &f, &err)))
+                return err;
+        err = (NULL != ops->recvfrom)
+              ? ops->recvfrom(f->f_vnode, ubuf, len, from, fromlen) : -EOPNOTSUPP;
+        fput(f);
+        return err;
+}
@@ -0,0 +1,489 @@
+/*
+ * UDP, and the datagram sockets through which it is used, the AF_INET
+ * family of net/sock.h. A socket is a vnode of udpfs, which like pipefs
+ * is never mounted, so that it is read, written, polled and closed
+ * through a file descriptor like anything else.
+ */
+
+#include "kernel.h"
+#include "types.h"
+#include "errno.h"
+#include "globals.h"
+#include "config.h"
+
+#include "api/access.h"
+
+#include "fs/poll.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+#include "mm/slab.h"
+
+#include "proc/sched.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/string.h"
+#include "util/counter.h"
+#include "util/init.h"
+
+#include "net/net.h"
+#include "net/sock.h"
+#include "net/socket.h"
+
+/* Where the ports of sockets which do not choose one start */
+#define UDP_PORT_EPHEMERAL      49152
+/* The most a datagram carries, so that it fits in one frame */
+#define UDP_MAX_PAYLOAD         (ETH_MTU - IP_HLEN - UDP_HLEN)
+
+typedef struct udp_hdr {
+        uint16_t uh_sport;
+        uint16_t uh_dport;
+        uint16_t uh_len;                /* header and data */
+        uint16_t uh_sum;                /* 0 for none */
+} udp_hdr_t;
+
+/* struct udpsock is what is in the vn_i field of each socket vnode */
+typedef struct udpsock {
+        /* What it is bound to, in host byte order: a port of 0 is not
+         * bound, an address of 0 is any of ours */
+        uint32_t        so_laddr;
+        uint16_t        so_lport;
+        list_link_t     so_link;        /* on udp_sockets, once bound */
+
+        /* Datagrams which have come in, each in the netbuf it came in,
+         * with nb_data at what it carries */
+        list_t          so_rcvq;
+        int             so_rcvlen;
+        ktqueue_t       so_waitq;       /* readers waiting for one */
+        pollhead_t      so_pollhead;
+} udpsock_t;
+
+#define VNODE_TO_UDPSOCK(vn) ((udpsock_t *)((vn)->vn_i))
+
+static void udp_read_vnode(vnode_t *vnode);
+static void udp_delete_vnode(vnode_t *vnode);
+static int  udp_query_vnode(vnode_t *vnode);
+
+static fs_ops_t udp_fsops = {
+        .read_vnode = udp_read_vnode,
+        .delete_vnode = udp_delete_vnode,
+        .query_vnode = udp_query_vnode,
+        .umount = NULL
+};
+
+static fs_t udp_fs = {
+        .fs_dev = "udp",
+        .fs_type = "udp",
+        .fs_op = &udp_fsops,
+        .fs_root = NULL,
+        .fs_i = NULL
+};
+
+static int udp_read(vnode_t *vnode, off_t offset, void *buf, size_t len);
+static int udp_read_user(vnode_t *vnode, off_t offset, void *buf, size_t len);
+static int udp_write(vnode_t *vnode, off_t offset, const void *buf, size_t len);
+static int udp_stat(vnode_t *vnode, struct stat *ss);
+static int udp_poll(vnode_t *vnode, int events, polltable_t *pt);
+
+static vnode_ops_t udp_vops = {
+        .read = udp_read,
+        .write = udp_write,
+        .read_user = udp_read_user,
+        .write_user = NULL,
+        .mmap = NULL,
+        .create = NULL,
+        .mknod = NULL,
+        .lookup = NULL,
+        .link = NULL,
+        .unlink = NULL,
+        .mkdir = NULL,
+        .rmdir = NULL,
+        .readdir = NULL,
+        .stat = udp_stat,
+        .acquire = NULL,
+        .release = NULL,
+        .poll = udp_poll,
+        .fillpage = NULL,
+        .dirtypage = NULL,
+        .cleanpage = NULL
+};
+
+/* The bound sockets, which udp_input looks through for each datagram */
+static list_t udp_sockets = { &udp_sockets, &udp_sockets };
+
+static slab_allocator_t *udpsock_allocator = NULL;
+static int next_sno = 0;
+
+/* Datagrams in and out, and those which came in for a port nothing is
+ * bound to or for a socket which had too many already */
+static counter_t udp_nrx;
+static counter_t udp_ntx;
+static counter_t udp_nnoport;
+static counter_t udp_noverflow;
+
+static __attribute__((unused)) void
+udp_init(void)
+{
+        udpsock_allocator = slab_allocator_create("socket", sizeof(udpsock_t));
+        KASSERT(udpsock_allocator != NULL);
+
+        counter_register(&udp_nrx, "udp.rx");
+        counter_register(&udp_ntx, "udp.tx");
+        counter_register(&udp_nnoport, "udp.noport");
+        counter_register(&udp_noverflow, "udp.overflow");
+}
+init_func(udp_init);
+init_depends(vfs_init);
+
+/* The checksum, or the sum to check it with, over the pseudo-header of
+ * the addresses, then the UDP header and data, len bytes together */
+static uint16_t
+udp_checksum(uint32_t src, uint32_t dst, const void *uh, size_t len)
+{
+        uint32_t sum = (src >> 16) + (src & 0xffff) + (dst >> 16) + (dst & 0xffff)
+                       + IPPROTO_UDP + len;
+        return ip_checksum(ip_sum(uh, len, sum));
+}
+
+void
+udp_input(netbuf_t *nb, uint32_t src, uint32_t dst)
+{
+        udp_hdr_t *uh = (udp_hdr_t *)nb->nb_data;
+        udpsock_t *so;
+        size_t len;
+
+        counter_inc(&udp_nrx);
+        if (nb->nb_len < UDP_HLEN || (len = ntohs(uh->uh_len)) < UDP_HLEN
+            || nb->nb_len < len
+            || (0 != uh->uh_sum && 0 != udp_checksum(src, dst, uh, len))) {
+                netbuf_free(nb);
+                return;
+        }
+        nb->nb_len = len;
+        netbuf_pull(nb, UDP_HLEN);
+
+        list_iterate_begin(&udp_sockets, so, udpsock_t, so_link) {
+                if (so->so_lport == ntohs(uh->uh_dport)
+                    && (0 == so->so_laddr || so->so_laddr == dst)) {
+                        if (SOCK_RCVQ_MAX <= so->so_rcvlen) {
+                                counter_inc(&udp_noverflow);
+                                netbuf_free(nb);
+                                return;
+                        }
+                        nb->nb_faddr = src;
+                        nb->nb_fport = ntohs(uh->uh_sport);
+                        list_insert_tail(&so->so_rcvq, &nb->nb_link);
+                        so->so_rcvlen++;
+                        sched_wakeup_on(&so->so_waitq);
+                        poll_wakeup(&so->so_pollhead);
+                        return;
+                }
+        } list_iterate_end();
+
+        counter_inc(&udp_nnoport);
+        netbuf_free(nb);
+}
+
+/* Whether a socket other than so is bound to port and an address that
+ * overlaps addr */
+static int
+udp_port_taken(udpsock_t *so, uint32_t addr, uint16_t port)
+{
+        udpsock_t *other;
+
+        list_iterate_begin(&udp_sockets, other, udpsock_t, so_link) {
+                if (other != so && other->so_lport == port
+                    && (0 == other->so_laddr || 0 == addr || other->so_laddr == addr))
+                        return 1;
+        } list_iterate_end();
+        return 0;
+}
+
+/* Binds so to addr and port, or to the first free ephemeral port if port
+ * is 0. Returns 0 or -errno. */
+static int
+udp_bind(udpsock_t *so, uint32_t addr, uint16_t port)
+{
+        uint32_t nexthop;
+        netdev_t *nd;
+
+        if (0 != so->so_lport)
+                return -EINVAL;
+        if (0 != addr && (NULL == (nd = netdev_route(addr, &nexthop))
+                          || nd->nd_addr != addr))
+                return -EADDRNOTAVAIL;
+
+        if (0 == port) {
+                for (port = UDP_PORT_EPHEMERAL; 0 != port; port++) {
+                        if (!udp_port_taken(so, addr, port))
+                                break;
+                }
+                if (0 == port)
+                        return -EADDRINUSE;
+        } else if (udp_port_taken(so, addr, port)) {
+                return -EADDRINUSE;
+        }
+
+        so->so_laddr = addr;
+        so->so_lport = port;
+        list_insert_tail(&udp_sockets, &so->so_link);
+        return 0;
+}
+
+static udpsock_t *
+udpsock_create(void)
+{
+        udpsock_t *so = slab_obj_alloc(udpsock_allocator);
+
+        if (NULL == so)
+                return NULL;
+        so->so_laddr = 0;
+        so->so_lport = 0;
+        list_link_init(&so->so_link);
+        list_init(&so->so_rcvq);
+        so->so_rcvlen = 0;
+        sched_queue_init(&so->so_waitq);
+        pollhead_init(&so->so_pollhead);
+        return so;
+}
+
+static void
+udpsock_destroy(udpsock_t *so)
+{
+        netbuf_t *nb;
+
+        KASSERT(sched_queue_empty(&so->so_waitq));
+        if (list_link_is_linked(&so->so_link))
+                list_remove(&so->so_link);
+        list_iterate_begin(&so->so_rcvq, nb, netbuf_t, nb_link) {
+                list_remove(&nb->nb_link);
+                netbuf_free(nb);
+        } list_iterate_end();
+        slab_obj_free(udpsock_allocator, so);
+}
+
+/* sockfs vnode operations */
+static void
+udp_read_vnode(vnode_t *vnode)
+{
+        vnode->vn_ops = &udp_vops;
+        vnode->vn_mode = S_IFSOCK;
+        vnode->vn_len = 0;
+        vnode->vn_i = NULL;
+}
+
+static void
+udp_delete_vnode(vnode_t *vnode)
+{
+        udpsock_t *so = VNODE_TO_UDPSOCK(vnode);
+        if (so) {
+                udpsock_destroy(so);
+        }
+}
+
+/* As with a pipe, nothing can open a socket again once it is closed */
+static int
+udp_query_vnode(vnode_t *vnode)
+{
+        return 0;
+}
+
+/*
+ * Takes the next datagram off so's queue, waiting for one if there is
+ * none, and moves what of it fits in len bytes to buf, a user address if
+ * user is set. The rest of it is dropped, as read(2) on a UDP socket
+ * does. Returns the number of bytes moved, or -errno.
+ */
+static int
+udp_recv(udpsock_t *so, void *buf, size_t len, int user, struct sockaddr_in *from)
+{
+        netbuf_t *nb;
+        size_t n;
+        int err = 0;
+
+        while (list_empty(&so->so_rcvq)) {
+                if (0 > (err = sched_cancellable_sleep_on(&so->so_waitq)))
+                        return err;
+        }
+        nb = list_head(&so->so_rcvq, netbuf_t, nb_link);
+        list_remove(&nb->nb_link);
+        so->so_rcvlen--;
+
+        n = MIN(len, nb->nb_len);
+        if (user)
+                err = copy_to_user(buf, nb->nb_data, n);
+        else
+                memcpy(buf, nb->nb_data, n);
+        if (NULL != from) {
+                memset(from, 0, sizeof(*from));
+                from->sin_family = AF_INET;
+                from->sin_port = htons(nb->nb_fport);
+                from->sin_addr.s_addr = htonl(nb->nb_faddr);
+        }
+        netbuf_free(nb);
+        return (0 > err) ? err : (int)n;
+}
+
+static int
+udp_read(vnode_t *vnode, off_t offset, void *buf, size_t len)
+{
+        return udp_recv(VNODE_TO_UDPSOCK(vnode), buf, len, 0, NULL);
+}
+
+static int
+udp_read_user(vnode_t *vnode, off_t offset, void *buf, size_t len)
+{
+        return udp_recv(VNODE_TO_UDPSOCK(vnode), buf, len, 1, NULL);
+}
+
+/* A socket is never connected, so there is nowhere for write to send to */
+static int
+udp_write(vnode_t *vnode, off_t offset, const void *buf, size_t len)
+{
+        return -EDESTADDRREQ;
+}
+
+static int
+udp_stat(vnode_t *vnode, struct stat *ss)
+{
+        memset(ss, 0, sizeof(*ss));
+        ss->st_mode    = vnode->vn_mode;
+        ss->st_ino     = (int) vnode->vn_vno;
+        ss->st_blksize = (int) UDP_MAX_PAYLOAD;
+        return 0;
+}
+
+/* A datagram can always be sent, though it may be dropped on the way */
+static int
+udp_poll(vnode_t *vnode, int events, polltable_t *pt)
+{
+        udpsock_t *so = VNODE_TO_UDPSOCK(vnode);
+        int revents = POLLOUT;
+
+        poll_wait(&so->so_pollhead, pt);
+
+        if (!list_empty(&so->so_rcvq)) {
+                revents |= POLLIN;
+        }
+        return revents;
+}
+
+static int
+udp_create(int type, int protocol, vnode_t **vnp)
+{
+        vnode_t *vn;
+
+        if (SOCK_DGRAM != type || (0 != protocol && IPPROTO_UDP != protocol))
+                return -EPROTONOSUPPORT;
+
+        if (NULL == (vn = vget(&udp_fs, next_sno++)))
+                return -ENOMEM;
+        KASSERT(NULL == vn->vn_i);
+        if (NULL == (vn->vn_i = udpsock_create())) {
+                vput(vn);
+                return -ENOMEM;
+        }
+        *vnp = vn;
+        return 0;
+}
+
+/* The AF_INET address of a call, or NULL if it is not one */
+static const struct sockaddr_in *
+udp_sockaddr(const struct sockaddr *addr, socklen_t len)
+{
+        if (len < sizeof(struct sockaddr_in) || AF_INET != addr->sa_family)
+                return NULL;
+        return (const struct sockaddr_in *)addr;
+}
+
+static int
+udp_sock_bind(vnode_t *vn, const struct sockaddr *addr, socklen_t len)
+{
+        const struct sockaddr_in *sin;
+
+        if (NULL == (sin = udp_sockaddr(addr, len)))
+                return -EAFNOSUPPORT;
+        return udp_bind(VNODE_TO_UDPSOCK(vn), ntohl(sin->sin_addr.s_addr),
+                        ntohs(sin->sin_port));
+}
+
+/*
+ * Copies the datagram straight from ubuf into the netbuf it is sent in,
+ * behind room for the headers, binding the socket to an ephemeral port
+ * first if it is not bound.
+ */
+static int
+udp_sendto(vnode_t *vn, const void *ubuf, size_t len,
+           const struct sockaddr *addr, socklen_t addrlen)
+{
+        udpsock_t *so = VNODE_TO_UDPSOCK(vn);
+        const struct sockaddr_in *to;
+        uint32_t dst, src, nexthop;
+        udp_hdr_t *uh;
+        netdev_t *nd;
+        netbuf_t *nb;
+        int err;
+
+        if (NULL == addr)
+                return -EDESTADDRREQ;
+        if (NULL == (to = udp_sockaddr(addr, addrlen)))
+                return -EAFNOSUPPORT;
+        if (UDP_MAX_PAYLOAD < len)
+                return -EMSGSIZE;
+        dst = ntohl(to->sin_addr.s_addr);
+        if (NULL == (nd = netdev_route(dst, &nexthop)))
+                return -EHOSTUNREACH;
+        src = (0 != so->so_laddr) ? so->so_laddr : nd->nd_addr;
+        if (0 == so->so_lport && 0 > (err = udp_bind(so, 0, 0)))
+                return err;
+
+        if (NULL == (nb = netbuf_alloc()))
+                return -ENOMEM;
+        if (0 > (err = copy_from_user(nb->nb_data, ubuf, len))) {
+                netbuf_free(nb);
+                return err;
+        }
+        nb->nb_len = len;
+
+        uh = (udp_hdr_t *)netbuf_push(nb, UDP_HLEN);
+        uh->uh_sport = htons(so->so_lport);
+        uh->uh_dport = to->sin_port;
+        uh->uh_len = htons(nb->nb_len);
+        uh->uh_sum = 0;
+        uh->uh_sum = udp_checksum(src, dst, uh, nb->nb_len);
+        /* a sum of 0 means there is none, and its complement is the same */
+        if (0 == uh->uh_sum)
+                uh->uh_sum = 0xffff;
+
+        counter_inc(&udp_ntx);
+        if (0 > (err = ip_output(nb, IPPROTO_UDP, src, dst)))
+                return err;
+        return (int)len;
+}
+
+static int
+udp_recvfrom(vnode_t *vn, void *ubuf, size_t len,
+             struct sockaddr *from, socklen_t *fromlen)
+{
+        struct sockaddr_in sin;
+        int n;
+
+        if (0 <= (n = udp_recv(VNODE_TO_UDPSOCK(vn), ubuf, len, 1, &sin)))
+                sockaddr_out(from, fromlen, &sin, sizeof(sin));
+        return n;
+}
+
+sockops_t udp_sockops = {
+        .so_domain = AF_INET,
+        .so_fs     = &udp_fs,
+        .create    = udp_create,
+        .pair      = NULL,
+        .bind      = udp_sock_bind,
+        .listen    = NULL,
+        .accept    = NULL,
+        .connect   = NULL,
+        .sendto    = udp_sendto,
+        .recvfrom  = udp_recvfrom
+};
@@ -0,0 +1,869 @@
+/*
+ * Local stream sockets, the AF_UNIX family of net/sock.h: byte streams
+ * both ways between two processes on this machine, which are connected
+ * through a name in the filesystem that one of them listens on, or are
+ * made as a pair. Like UDP's, each socket is a vnode of a filesystem of
+ * its own which is never mounted, unixfs.
+ *
+ * Each end keeps what its peer wrote to it and it has not read yet in a
+ * ring of UNIX_BUF_PAGES pages, which is where small writes go. A write
+ * of a page or more that finds the ring empty lends the reader the
+ * writer's own pages instead: they are pinned where they are, in the
+ * writer's address space, and the reader copies straight out of them into
+ * its buffer, so that the data is copied once rather than into the ring
+ * and out again. The writer waits in write until the reader has taken all
+ * that it lent, as it would for room in a full ring, which is what keeps
+ * it from changing the pages under the reader.
+ */
+
+#include "kernel.h"
+#include "types.h"
+#include "errno.h"
+#include "globals.h"
+#include "config.h"
+
+#include "api/access.h"
+
+#include "fs/file.h"
+#include "fs/poll.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vfs_syscall.h"
+#include "fs/vnode.h"
+
+#include "mm/mman.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+
+#include "vm/vmmap.h"
+
+#include "proc/kmutex.h"
+#include "proc/sched.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/string.h"
+#include "util/init.h"
+
+#include "net/sock.h"
+#include "net/socket.h"
+
+#define UNIX_BUF_SIZE   (UNIX_BUF_PAGES * PAGE_SIZE)
+/* The shortest write which is lent rather than copied into the ring */
+#define UNIX_LOAN_MIN   PAGE_SIZE
+
+#define UNIX_UNCONNECTED        0
+#define UNIX_LISTENING          1
+#define UNIX_CONNECTED          2       /* even once the peer has closed */
+
+/* The pages of a large write, lent by the writer, on whose stack this is,
+ * to its peer */
+typedef struct unixloan {
+        pframe_t       *ul_pages[UNIX_LOAN_PAGES];
+        uint32_t        ul_npages;
+        /* what is left of it, as offsets from the start of ul_pages[0] */
+        size_t          ul_pos;
+        size_t          ul_end;
+        int             ul_busy;        /* a reader is copying out of it */
+} unixloan_t;
+
+/* struct unixsock is what is in the vn_i field of each socket vnode */
+typedef struct unixsock {
+        int              us_state;
+        vnode_t         *us_vnode;
+
+        /* The name it is bound to, an S_IFSOCK node which it holds so that
+         * connect knows it when it looks the name up; NULL if it is not */
+        vnode_t         *us_name;
+        list_link_t      us_blink;      /* on unix_bound while it is */
+
+        /* Listening: the connections waiting for accept, each the socket
+         * accept returns, no more than us_backlog of them, and with the
+         * reference to it that accept hands over */
+        list_t           us_pending;
+        int              us_npending;
+        int              us_backlog;
+        list_link_t      us_plink;      /* on its listener's us_pending */
+
+        /* Connected: the other end, NULL once it has closed, and what it
+         * wrote to this one, first in the ring between us_head - us_size
+         * and us_head, then in what it lent */
+        struct unixsock *us_peer;
+        char            *us_pages[UNIX_BUF_PAGES];
+        size_t           us_head;
+        size_t           us_size;
+        unixloan_t      *us_loan;
+
+        /* Keep reads and writes whole against others on the same end */
+        kmutex_t         us_rdlock;
+        kmutex_t         us_wrlock;
+        /*
+         * Readers of this end and accept wait on us_rwaitq. Writers on
+         * this end wait on us_wwaitq for room in the peer's ring, or for
+         * the peer to take what they lent; connect waits on a listener's
+         * for room in its backlog.
+         */
+        ktqueue_t        us_rwaitq;
+        ktqueue_t        us_wwaitq;
+        pollhead_t       us_pollhead;
+} unixsock_t;
+
+#define VNODE_TO_UNIX(vn) ((unixsock_t *)((vn)->vn_i))
+
+static void unix_read_vnode(vnode_t *vnode);
+static void unix_delete_vnode(vnode_t *vnode);
+static int  unix_query_vnode(vnode_t *vnode);
+
+static fs_ops_t unix_fsops = {
+        .read_vnode = unix_read_vnode,
+        .delete_vnode = unix_delete_vnode,
+        .query_vnode = unix_query_vnode,
+        .umount = NULL
+};
+
+static fs_t unix_fs = {
+        .fs_dev = "unix",
+        .fs_type = "unix",
+        .fs_op = &unix_fsops,
+        .fs_root = NULL,
+        .fs_i = NULL
+};
+
+static int unix_read(vnode_t *vnode, off_t offset, void *buf, size_t len);
+static int unix_write(vnode_t *vnode, off_t offset, const void *buf, size_t len);
+static int unix_read_user(vnode_t *vnode, off_t offset, void *buf, size_t len);
+static int unix_write_user(vnode_t *vnode, off_t offset, const void *buf, size_t len);
+static int unix_stat(vnode_t *vnode, struct stat *ss);
+static int unix_release(vnode_t *vnode, file_t *file);
+static int unix_poll(vnode_t *vnode, int events, polltable_t *pt);
+
+static vnode_ops_t unix_vops = {
+        .read = unix_read,
+        .write = unix_write,
+        .read_user = unix_read_user,
+        .write_user = unix_write_user,
+        .mmap = NULL,
+        .create = NULL,
+        .mknod = NULL,
+        .lookup = NULL,
+        .link = NULL,
+        .unlink = NULL,
+        .mkdir = NULL,
+        .rmdir = NULL,
+        .readdir = NULL,
+        .stat = unix_stat,
+        .acquire = NULL,
+        .release = unix_release,
+        .poll = unix_poll,
+        .fillpage = NULL,
+        .dirtypage = NULL,
+        .cleanpage = NULL
+};
+
+/* The bound sockets, which connect looks through for the name it is given */
+static list_t unix_bound = { &unix_bound, &unix_bound };
+
+static slab_allocator_t *unixsock_allocator = NULL;
+static int next_uno = 0;
+
+static __attribute__((unused)) void
+unix_init(void)
+{
+        unixsock_allocator = slab_allocator_create("unixsock", sizeof(unixsock_t));
+        KASSERT(unixsock_allocator != NULL);
+}
+init_func(unix_init);
+init_depends(vfs_init);
+
+static unixsock_t *
+unixsock_create(vnode_t *vn)
+{
+        unixsock_t *us = slab_obj_alloc(unixsock_allocator);
+
+        if (NULL == us)
+                return NULL;
+        memset(us, 0, sizeof(*us));
+        us->us_state = UNIX_UNCONNECTED;
+        us->us_vnode = vn;
+        list_link_init(&us->us_blink);
+        list_init(&us->us_pending);
+        list_link_init(&us->us_plink);
+        kmutex_init(&us->us_rdlock);
+        kmutex_init(&us->us_wrlock);
+        sched_queue_init(&us->us_rwaitq);
+        sched_queue_init(&us->us_wwaitq);
+        pollhead_init(&us->us_pollhead);
+        return us;
+}
+
+static void
+unixsock_destroy(unixsock_t *us)
+{
+        int i;
+
+        KASSERT(NULL == us->us_peer && NULL == us->us_name);
+        KASSERT(list_empty(&us->us_pending));
+        KASSERT(sched_queue_empty(&us->us_rwaitq));
+        KASSERT(sched_queue_empty(&us->us_wwaitq));
+
+        for (i = 0; i < UNIX_BUF_PAGES; i++) {
+                if (NULL != us->us_pages[i])
+                        page_free(us->us_pages[i]);
+        }
+        slab_obj_free(unixsock_allocator, us);
+}
+
+/* Gives us the ring it needs once it is connected, if it has none yet */
+static int
+unix_buffers(unixsock_t *us)
+{
+        int i;
+
+        if (NULL != us->us_pages[0])
+                return 0;
+        for (i = 0; i < UNIX_BUF_PAGES; i++) {
+                if (NULL == (us->us_pages[i] = page_alloc())) {
+                        while (i-- > 0) {
+                                page_free(us->us_pages[i]);
+                                us->us_pages[i] = NULL;
+                        }
+                        return -ENOMEM;
+                }
+        }
+        return 0;
+}
+
+/* Connects a and b, which both have their rings */
+static void
+unix_join(unixsock_t *a, unixsock_t *b)
+{
+        KASSERT(NULL != a->us_pages[0] && NULL != b->us_pages[0]);
+        a->us_peer = b;
+        b->us_peer = a;
+        a->us_state = UNIX_CONNECTED;
+        b->us_state = UNIX_CONNECTED;
+}
+
+static void
+unix_wakeup(unixsock_t *us)
+{
+        sched_broadcast_on(&us->us_rwaitq);
+        sched_broadcast_on(&us->us_wwaitq);
+        poll_wakeup(&us->us_pollhead);
+}
+
+/*
+ * Cuts us off from its peer, which reads what is left in its ring and then
+ * the end of the file, and gets EPIPE for what it writes. Whatever the
+ * peer had lent us is left for it to take back, and whoever waits on
+ * either end is woken to notice.
+ */
+static void
+unix_disconnect(unixsock_t *us)
+{
+        unixsock_t *peer = us->us_peer;
+
+        us->us_loan = NULL;
+        if (NULL != peer) {
+                peer->us_peer = NULL;
+                us->us_peer = NULL;
+                unix_wakeup(peer);
+        }
+        unix_wakeup(us);
+}
+
+/* Closes us: drops the connections waiting to be accepted if it listens,
+ * its peer if it is connected, and the name it is bound to */
+static void
+unix_shutdown(unixsock_t *us)
+{
+        unixsock_t *pending;
+
+        list_iterate_begin(&us->us_pending, pending, unixsock_t, us_plink) {
+                list_remove(&pending->us_plink);
+                us->us_npending--;
+                unix_disconnect(pending);
+                vput(pending->us_vnode);
+        } list_iterate_end();
+        if (UNIX_LISTENING == us->us_state)
+                us->us_state = UNIX_UNCONNECTED;
+
+        unix_disconnect(us);
+
+        if (NULL != us->us_name) {
+                list_remove(&us->us_blink);
+                vput(us->us_name);
+                us->us_name = NULL;
+        }
+}
+
+/* unixfs vnode operations */
+static void
+unix_read_vnode(vnode_t *vnode)
+{
+        vnode->vn_ops = &unix_vops;
+        vnode->vn_mode = S_IFSOCK;
+        vnode->vn_len = 0;
+        vnode->vn_i = NULL;
+}
+
+/* A socket is usually shut down when its file is released, but one which
+ * was never opened, such as a connection nobody accepted, is only put */
+static void
+unix_delete_vnode(vnode_t *vnode)
+{
+        unixsock_t *us = VNODE_TO_UNIX(vnode);
+        if (us) {
+                unix_shutdown(us);
+                unixsock_destroy(us);
+        }
+}
+
+static int
+unix_query_vnode(vnode_t *vnode)
+{
+        return 0;
+}
+
+/* Makes a new, unconnected socket, with a reference for the caller */
+static int
+unix_vget(vnode_t **vnp)
+{
+        vnode_t *vn;
+
+        if (NULL == (vn = vget(&unix_fs, next_uno++)))
+                return -ENOMEM;
+        KASSERT(NULL == vn->vn_i);
+        if (NULL == (vn->vn_i = unixsock_create(vn))) {
+                vput(vn);
+                return -ENOMEM;
+        }
+        *vnp = vn;
+        return 0;
+}
+
+/*
+ * Copies len bytes between buf and the ring of us, starting pos bytes into
+ * it and wrapping at its end, a page at a time. buf is a user address if
+ * user is set, in which case this may block, and fail with -EFAULT.
+ */
+static int
+unix_ring_copy(unixsock_t *us, size_t pos, char *buf, size_t len, int toring, int user)
+{
+        int err = 0;
+
+        while (len > 0 && 0 == err) {
+                pos %= UNIX_BUF_SIZE;
+                char *ring = us->us_pages[pos / PAGE_SIZE] + pos % PAGE_SIZE;
+                size_t chunk = MIN(len, PAGE_SIZE - pos % PAGE_SIZE);
+
+                if (!user)
+                        memcpy(toring ? ring : buf, toring ? buf : ring, chunk);
+                else if (toring)
+                        err = copy_from_user(ring, buf, chunk);
+                else
+                        err = copy_to_user(buf, ring, chunk);
+                pos += chunk;
+                buf += chunk;
+                len -= chunk;
+        }
+        return err;
+}
+
+/* Copies the next len bytes of what ul lends to buf, a user address if
+ * user is set, straight out of the writer's pages */
+static int
+unix_loan_copy(unixloan_t *ul, char *buf, size_t len, int user)
+{
+        size_t pos = ul->ul_pos;
+        int err = 0;
+
+        while (len > 0 && 0 == err) {
+                pframe_t *pf = ul->ul_pages[pos / PAGE_SIZE];
+                char *page = pframe_kmap(pf);
+                size_t chunk = MIN(len, PAGE_SIZE - pos % PAGE_SIZE);
+
+                if (user)
+                        err = copy_to_user(buf, page + pos % PAGE_SIZE, chunk);
+                else
+                        memcpy(buf, page + pos % PAGE_SIZE, chunk);
+                pframe_kunmap(pf, page);
+                pos += chunk;
+                buf += chunk;
+                len -= chunk;
+        }
+        return err;
+}
+
+/*
+ * Reads what the peer wrote, waiting until there is something, or until
+ * the peer has closed, for the end of the file. Like read(2) on a pipe,
+ * this returns what is there, from the ring or else from what the peer
+ * lent, rather than waiting for len.
+ */
+static int
+unix_recv(unixsock_t *us, char *buf, size_t len, int user)
+{
+        unixsock_t *peer;
+        unixloan_t *ul;
+        size_t n;
+        int err;
+
+        if (UNIX_CONNECTED != us->us_state)
+                return -ENOTCONN;
+        if (0 == len)
+                return 0;
+        if (0 > (err = kmutex_lock_cancellable(&us->us_rdlock)))
+                return err;
+
+        while (0 == us->us_size && NULL == us->us_loan) {
+                if (NULL == us->us_peer) {
+                        kmutex_unlock(&us->us_rdlock);
+                        return 0;
+                }
+                if (0 > (err = sched_cancellable_sleep_on(&us->us_rwaitq))) {
+                        kmutex_unlock(&us->us_rdlock);
+                        return err;
+                }
+        }
+
+        if (0 < us->us_size) {
+                n = MIN(len, us->us_size);
+                err = unix_ring_copy(us, us->us_head + UNIX_BUF_SIZE - us->us_size,
+                                     buf, n, 0, user);
+                if (0 == err)
+                        us->us_size -= n;
+        } else {
+                /* the writer waits for its pages while this copies out of
+                 * them, even if its wait is cancelled */
+                ul = us->us_loan;
+                n = MIN(len, ul->ul_end - ul->ul_pos);
+                ul->ul_busy = 1;
+                err = unix_loan_copy(ul, buf, n, user);
+                ul->ul_busy = 0;
+                if (0 == err)
+                        ul->ul_pos += n;
+                if (ul->ul_pos == ul->ul_end)
+                        us->us_loan = NULL;
+        }
+
+        /* the peer's writers wait for room, or for what they lent */
+        if (NULL != (peer = us->us_peer)) {
+                sched_broadcast_on(&peer->us_wwaitq);
+                poll_wakeup(&peer->us_pollhead);
+        }
+        kmutex_unlock(&us->us_rdlock);
+        return (0 > err) ? err : (int)n;
+}
+
+/*
+ * Lends peer, whose ring is empty, the pages of what of the len bytes at
+ * buf fit in UNIX_LOAN_PAGES, and waits until its readers have copied
+ * them out. Returns how much they took, which is less than was lent only
+ * if the peer closed or the wait was cancelled, or -errno if that was
+ * nothing.
+ */
+static int
+unix_lend(unixsock_t *us, unixsock_t *peer, const char *buf, size_t len)
+{
+        size_t off = PAGE_OFFSET(buf);
+        unixloan_t loan;
+        int err;
+
+        len = MIN(len, UNIX_LOAN_PAGES * PAGE_SIZE - off);
+        if (!range_perm(curproc, buf, len, PROT_READ))
+                return -EFAULT;
+        loan.ul_npages = (off + len + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (0 > (err = vmmap_pin_pages(curproc->p_vmmap, ADDR_TO_PN(buf),
+                                       loan.ul_npages, loan.ul_pages, 0)))
+                return err;
+        loan.ul_pos = off;
+        loan.ul_end = off + len;
+        loan.ul_busy = 0;
+
+        peer->us_loan = &loan;
+        sched_broadcast_on(&peer->us_rwaitq);
+        poll_wakeup(&peer->us_pollhead);
+
+        while (peer == us->us_peer && loan.ul_pos < loan.ul_end) {
+                if (loan.ul_busy)
+                        sched_sleep_on(&us->us_wwaitq);
+                else if (0 > (err = sched_cancellable_sleep_on(&us->us_wwaitq)))
+                        break;
+        }
+        /* a reader can only be copying out of the pages while the peer
+         * has its file, so it is not once the peer is gone */
+        KASSERT(!loan.ul_busy);
+        if (peer == us->us_peer && &loan == peer->us_loan)
+                peer->us_loan = NULL;
+        vmmap_unpin_pages(loan.ul_pages, loan.ul_npages);
+
+        if (off < loan.ul_pos)
+                return (int)(loan.ul_pos - off);
+        return (0 > err) ? err : -EPIPE;
+}
+
+/*
+ * Writes all of buf to the peer, as room in its ring is made, or as it
+ * takes what was lent to it, and returns len; if the peer closes or the
+ * wait is cancelled first, returns what was written, or -EPIPE or -EINTR
+ * if that was nothing. Only a user buffer can be lent.
+ */
+static int
+unix_send(unixsock_t *us, const char *buf, size_t len, int user)
+{
+        unixsock_t *peer;
+        size_t done = 0, n;
+        int err;
+
+        if (UNIX_CONNECTED != us->us_state)
+                return -ENOTCONN;
+        if (0 > (err = kmutex_lock_cancellable(&us->us_wrlock)))
+                return err;
+
+        while (done < len) {
+                if (NULL == (peer = us->us_peer)) {
+                        err = -EPIPE;
+                        break;
+                }
+
+                if (user && UNIX_LOAN_MIN <= len - done
+                    && 0 == peer->us_size && NULL == peer->us_loan) {
+                        if (0 > (err = unix_lend(us, peer, buf + done, len - done)))
+                                break;
+                        done += err;
+                        err = 0;
+                        continue;
+                }
+
+                n = MIN(len - done, UNIX_BUF_SIZE - peer->us_size);
+                if (0 == n) {
+                        if (0 > (err = sched_cancellable_sleep_on(&us->us_wwaitq)))
+                                break;
+                        continue;
+                }
+
+                /* copying from user space can block, while the peer closes
+                 * and would otherwise free the ring under the copy */
+                vref(peer->us_vnode);
+                err = unix_ring_copy(peer, peer->us_head, (char *)buf + done, n, 1, user);
+                if (0 == err) {
+                        peer->us_head = (peer->us_head + n) % UNIX_BUF_SIZE;
+                        peer->us_size += n;
+                        done += n;
+                        sched_broadcast_on(&peer->us_rwaitq);
+                        poll_wakeup(&peer->us_pollhead);
+                }
+                vput(peer->us_vnode);
+                if (0 > err)
+                        break;
+        }
+
+        kmutex_unlock(&us->us_wrlock);
+        return (0 < done) ? (int)done : err;
+}
+
+static int
+unix_read(vnode_t *vnode, off_t offset, void *buf, size_t len)
+{
+        return unix_recv(VNODE_TO_UNIX(vnode), buf, len, 0);
+}
+
+static int
+unix_write(vnode_t *vnode, off_t offset, const void *buf, size_t len)
+{
+        return unix_send(VNODE_TO_UNIX(vnode), buf, len, 0);
+}
+
+static int
+unix_read_user(vnode_t *vnode, off_t offset, void *buf, size_t len)
+{
+        return unix_recv(VNODE_TO_UNIX(vnode), buf, len, 1);
+}
+
+static int
+unix_write_user(vnode_t *vnode, off_t offset, const void *buf, size_t len)
+{
+        return unix_send(VNODE_TO_UNIX(vnode), buf, len, 1);
+}
+
+static int
+unix_stat(vnode_t *vnode, struct stat *ss)
+{
+        memset(ss, 0, sizeof(*ss));
+        ss->st_mode    = vnode->vn_mode;
+        ss->st_ino     = (int) vnode->vn_vno;
+        ss->st_size    = (int) VNODE_TO_UNIX(vnode)->us_size;
+        ss->st_blksize = (int) UNIX_BUF_SIZE;
+        return 0;
+}
+
+static int
+unix_release(vnode_t *vnode, file_t *file)
+{
+        unix_shutdown(VNODE_TO_UNIX(vnode));
+        return 0;
+}
+
+/*
+ * A listening socket is readable when there is a connection to accept. A
+ * connected one is readable when there is something to read, writable
+ * when the peer's ring has room, and hung up once the peer has closed.
+ */
+static int
+unix_poll(vnode_t *vnode, int events, polltable_t *pt)
+{
+        unixsock_t *us = VNODE_TO_UNIX(vnode);
+        int revents = 0;
+
+        poll_wait(&us->us_pollhead, pt);
+
+        switch (us->us_state) {
+                case UNIX_LISTENING:
+                        if (0 < us->us_npending)
+                                revents |= POLLIN;
+                        break;
+                case UNIX_CONNECTED:
+                        if (0 < us->us_size || NULL != us->us_loan)
+                                revents |= POLLIN;
+                        if (NULL == us->us_peer)
+                                revents |= POLLHUP;
+                        else if (us->us_peer->us_size < UNIX_BUF_SIZE)
+                                revents |= POLLOUT;
+                        break;
+        }
+        return revents;
+}
+
+/* The bound socket whose name is vn, or NULL */
+static unixsock_t *
+unix_lookup(vnode_t *vn)
+{
+        unixsock_t *us;
+
+        list_iterate_begin(&unix_bound, us, unixsock_t, us_blink) {
+                if (us->us_name == vn)
+                        return us;
+        } list_iterate_end();
+        return NULL;
+}
+
+/* Gets the path of an AF_UNIX address, which need not end in a NUL
+ * within len, into path, which has room for UNIX_PATH_MAX + 1 */
+static int
+unix_path(const struct sockaddr *addr, socklen_t len, char *path)
+{
+        const struct sockaddr_un *sun = (const struct sockaddr_un *)addr;
+        size_t n;
+
+        if (len < sizeof(sun->sun_family) || AF_UNIX != sun->sun_family)
+                return -EAFNOSUPPORT;
+        n = MIN(len - sizeof(sun->sun_family), UNIX_PATH_MAX);
+        memcpy(path, sun->sun_path, n);
+        path[n] = '\0';
+        /* there is no namespace but the filesystem's */
+        if ('\0' == path[0])
+                return -EINVAL;
+        return 0;
+}
+
+static int
+unix_create(int type, int protocol, vnode_t **vnp)
+{
+        if (SOCK_STREAM != type || 0 != protocol)
+                return -EPROTONOSUPPORT;
+        return unix_vget(vnp);
+}
+
+static int
+unix_pair(int type, int protocol, vnode_t *vns[2])
+{
+        int err;
+
+        if (0 > (err = unix_create(type, protocol, &vns[0])))
+                return err;
+        if (0 > (err = unix_vget(&vns[1]))) {
+                vput(vns[0]);
+                return err;
+        }
+        if (0 > (err = unix_buffers(VNODE_TO_UNIX(vns[0])))
+            || 0 > (err = unix_buffers(VNODE_TO_UNIX(vns[1])))) {
+                vput(vns[0]);
+                vput(vns[1]);
+                return err;
+        }
+        unix_join(VNODE_TO_UNIX(vns[0]), VNODE_TO_UNIX(vns[1]));
+        return 0;
+}
+
+/* Makes the name in the filesystem, which must not be there already, and
+ * binds the socket to it. The name stays once the socket is closed, until
+ * it is unlinked, though nothing can connect to it then. */
+static int
+unix_bind(vnode_t *vn, const struct sockaddr *addr, socklen_t len)
+{
+        unixsock_t *us = VNODE_TO_UNIX(vn);
+        char path[UNIX_PATH_MAX + 1];
+        vnode_t *name;
+        int err;
+
+        if (0 > (err = unix_path(addr, len, path)))
+                return err;
+        if (NULL != us->us_name)
+                return -EINVAL;
+        if (0 > (err = do_mknod(path, S_IFSOCK, 0)))
+                return (-EEXIST == err) ? -EADDRINUSE : err;
+        if (0 > (err = open_namev(path, 0, &name, NULL)))
+                return err;
+        /* another thread may have bound it while this one blocked */
+        if (NULL != us->us_name) {
+                vput(name);
+                return -EINVAL;
+        }
+
+        us->us_name = name;
+        list_insert_tail(&unix_bound, &us->us_blink);
+        return 0;
+}
+
+static int
+unix_listen(vnode_t *vn, int backlog)
+{
+        unixsock_t *us = VNODE_TO_UNIX(vn);
+
+        if (UNIX_CONNECTED == us->us_state || NULL == us->us_name)
+                return -EINVAL;
+        us->us_state = UNIX_LISTENING;
+        us->us_backlog = MAX(1, MIN(backlog, UNIX_BACKLOG_MAX));
+        /* connect may have room now */
+        sched_broadcast_on(&us->us_wwaitq);
+        return 0;
+}
+
+/* The peer is never known by name, even if it has bound one */
+static int
+unix_accept(vnode_t *vn, vnode_t **vnp, struct sockaddr *addr, socklen_t *len)
+{
+        unixsock_t *us = VNODE_TO_UNIX(vn), *conn;
+        struct sockaddr_un sun;
+        int err;
+
+        if (UNIX_LISTENING != us->us_state)
+                return -EINVAL;
+        while (list_empty(&us->us_pending)) {
+                if (0 > (err = sched_cancellable_sleep_on(&us->us_rwaitq)))
+                        return err;
+        }
+        conn = list_head(&us->us_pending, unixsock_t, us_plink);
+        list_remove(&conn->us_plink);
+        us->us_npending--;
+        sched_broadcast_on(&us->us_wwaitq);
+
+        sun.sun_family = AF_UNIX;
+        sockaddr_out(addr, len, &sun, sizeof(sun.sun_family));
+        *vnp = conn->us_vnode;
+        return 0;
+}
+
+/*
+ * Connects to the socket listening on the name in addr, as soon as there
+ * is room in its backlog, with the socket which accept will return for
+ * the other end. Unlike on a network this never waits for accept itself,
+ * and the connection can be written to at once.
+ */
+static int
+unix_connect(vnode_t *vn, const struct sockaddr *addr, socklen_t len)
+{
+        unixsock_t *us = VNODE_TO_UNIX(vn), *listener, *conn;
+        char path[UNIX_PATH_MAX + 1];
+        vnode_t *name, *cvn;
+        int err;
+
+        if (0 > (err = unix_path(addr, len, path)))
+                return err;
+        if (UNIX_CONNECTED == us->us_state)
+                return -EISCONN;
+        if (UNIX_LISTENING == us->us_state)
+                return -EINVAL;
+        if (0 > (err = open_namev(path, 0, &name, NULL)))
+                return err;
+        listener = unix_lookup(name);
+        vput(name);
+        if (NULL == listener || UNIX_LISTENING != listener->us_state)
+                return -ECONNREFUSED;
+
+        /* the listener can close while this blocks, so hold on to it */
+        vref(listener->us_vnode);
+        if (0 > (err = unix_vget(&cvn)))
+                goto out;
+        conn = VNODE_TO_UNIX(cvn);
+        if (0 > (err = unix_buffers(us)) || 0 > (err = unix_buffers(conn)))
+                goto out_conn;
+
+        while (UNIX_LISTENING == listener->us_state
+               && listener->us_npending >= listener->us_backlog) {
+                if (0 > (err = sched_cancellable_sleep_on(&listener->us_wwaitq)))
+                        goto out_conn;
+        }
+        if (UNIX_LISTENING != listener->us_state) {
+                err = -ECONNREFUSED;
+                goto out_conn;
+        }
+        /* another thread may have connected it while this one blocked */
+        if (UNIX_UNCONNECTED != us->us_state) {
+                err = -EISCONN;
+                goto out_conn;
+        }
+
+        unix_join(us, conn);
+        list_insert_tail(&listener->us_pending, &conn->us_plink);
+        listener->us_npending++;
+        sched_wakeup_on(&listener->us_rwaitq);
+        poll_wakeup(&listener->us_pollhead);
+        vput(listener->us_vnode);
+        return 0;
+
+out_conn:
+        vput(cvn);
+out:
+        vput(listener->us_vnode);
+        return err;
+}
+
+/* Only connected sockets send, so there is no address to send to */
+static int
+unix_sendto(vnode_t *vn, const void *ubuf, size_t len,
+            const struct sockaddr *to, socklen_t tolen)
+{
+        if (NULL != to)
+                return -EISCONN;
+        return unix_send(VNODE_TO_UNIX(vn), ubuf, len, 1);
+}
+
+static int
+unix_recvfrom(vnode_t *vn, void *ubuf, size_t len,
+              struct sockaddr *from, socklen_t *fromlen)
+{
+        struct sockaddr_un sun;
+        int n;
+
+        if (0 <= (n = unix_recv(VNODE_TO_UNIX(vn), ubuf, len, 1))) {
+                sun.sun_family = AF_UNIX;
+                sockaddr_out(from, fromlen, &sun, sizeof(sun.sun_family));
+        }
+        return n;
+}
+
+sockops_t unix_sockops = {
+        .so_domain = AF_UNIX,
+        .so_fs     = &unix_fs,
+        .create    = unix_create,
+        .pair      = unix_pair,
+        .bind      = unix_bind,
+        .listen    = unix_listen,
+        .accept    = unix_accept,
+        .connect   = unix_connect,
+        .sendto    = unix_sendto,
+        .recvfrom  = unix_recvfrom
+};
@@ -1,16 +1,174 @@
 #include "config.h"
+#include "globals.h"
+#include "errno.h"
 
 #include "proc/context.h"
 #include "proc/kthread.h"
+#include "proc/proc.h"
 
 #include "main/apic.h"
+#include "main/cpuid.h"
 #include "main/interrupt.h"
 #include "main/gdt.h"
 
 #include "mm/page.h"
 #include "mm/pagetable.h"
+#include "mm/slab.h"
 
 #include "util/debug.h"
+#include "util/init.h"
+#include "util/string.h"
+
+/*
+ * The FPU and SSE registers are only saved and loaded when they are
+ * needed, since most threads never touch them. fpu_owner is the context
+ * whose state is in the registers, if any; every other context runs
+ * with CR0.TS set, and when it first uses the FPU the resulting #NM
+ * trap saves fpu_owner's state into its c_fpu and loads its own. A
+ * context which has never used the FPU has no c_fpu, and gets one set
+ * to fpu_initial at that first trap.
+ *
+ * fxsave needs its area aligned to 16 bytes, which slab objects are not
+ * always, so the areas are allocated that much larger and aligned where
+ * they are used. Without FXSR there is no SSE either, and the smaller
+ * fnsave area is used instead.
+ */
+#define FPU_FXSAVE_SIZE         512
+#define FPU_FNSAVE_SIZE         108
+#define FPU_ALIGN               16
+
+static slab_allocator_t *fpu_allocator;
+static context_t *fpu_owner;
+static int fpu_fxsr;
+static size_t fpu_size;
+static char fpu_initial[FPU_FXSAVE_SIZE + FPU_ALIGN];
+
+#define fpu_area(raw) \
+        ((char *)(((uintptr_t)(raw) + FPU_ALIGN - 1) & ~(uintptr_t)(FPU_ALIGN - 1)))
+
+static inline void
+fpu_set_ts(int ts)
+{
+        uint32_t cr0;
+        __asm__ volatile("movl %%cr0, %0" : "=r"(cr0));
+        if (!ts != !(cr0 & CR0_TS))
+                __asm__ volatile("movl %0, %%cr0" :: "r"(cr0 ^ CR0_TS) : "memory");
+}
+
+static void
+fpu_save(void *raw)
+{
+        if (fpu_fxsr)
+                __asm__ volatile("fxsave (%0)" :: "r"(fpu_area(raw)) : "memory");
+        else
+                __asm__ volatile("fnsave (%0)" :: "r"(fpu_area(raw)) : "memory");
+}
+
+static void
+fpu_restore(const void *raw)
+{
+        if (fpu_fxsr)
+                __asm__ volatile("fxrstor (%0)" :: "r"(fpu_area(raw)) : "memory");
+        else
+                __asm__ volatile("frstor (%0)" :: "r"(fpu_area(raw)) : "memory");
+}
+
+static void
+fpu_trap(regs_t *regs)
+{
+        context_t *c = &curthr->kt_ctx;
+
+        __asm__ volatile("clts" ::: "memory");
+        if (fpu_owner == c)
+                return;
+        if (NULL != fpu_owner)
+                fpu_save(fpu_owner->c_fpu);
+        fpu_owner = NULL;
+
+        if (NULL == c->c_fpu) {
+                if (NULL == (c->c_fpu = slab_obj_alloc(fpu_allocator))) {
+                        if ((regs->r_cs & 0x3) != 0x3)
+                                panic("no memory for FPU state of kernel thread\n");
+                        /* the next context switch sets CR0.TS again */
+                        do_exit(ENOMEM);
+                }
+                memcpy(fpu_area(c->c_fpu), fpu_area(fpu_initial), fpu_size);
+        }
+        fpu_restore(c->c_fpu);
+        fpu_owner = c;
+}
+
+int
+context_fpu_copy(context_t *dst, context_t *src)
+{
+        KASSERT(NULL == dst->c_fpu);
+        if (NULL == src->c_fpu)
+                return 0;
+        if (NULL == (dst->c_fpu = slab_obj_alloc(fpu_allocator)))
+                return -ENOMEM;
+
+        if (fpu_owner == src) {
+                uint32_t ts = context_fpu_kernel_begin();
+                fpu_save(src->c_fpu);
+                /* fnsave also resets the FPU */
+                if (!fpu_fxsr)
+                        fpu_restore(src->c_fpu);
+                context_fpu_kernel_end(ts);
+        }
+        memcpy(fpu_area(dst->c_fpu), fpu_area(src->c_fpu), fpu_size);
+        return 0;
+}
+
+void
+context_fpu_release(context_t *c)
+{
+        if (fpu_owner == c) {
+                fpu_owner = NULL;
+                fpu_set_ts(1);
+        }
+        if (NULL != c->c_fpu) {
+                slab_obj_free(fpu_allocator, c->c_fpu);
+                c->c_fpu = NULL;
+        }
+}
+
+static __attribute__((unused)) void
+context_fpu_init(void)
+{
+        uint32_t eax, edx, cr0, cr4, mxcsr = 0x1f80;
+
+        cpuid(CPUID_GETFEATURES, &eax, &edx);
+        fpu_fxsr = !!(edx & CPUID_FEAT_EDX_FXSR);
+        fpu_size = fpu_fxsr ? FPU_FXSAVE_SIZE : FPU_FNSAVE_SIZE;
+
+        /* FPU instructions trap to us when CR0.TS is set, rather than
+         * being emulated; SSE instructions fault until the OS says it
+         * knows how to save their registers */
+        __asm__ volatile("movl %%cr0, %0" : "=r"(cr0));
+        __asm__ volatile("movl %0, %%cr0" :: "r"((cr0 & ~(CR0_EM | CR0_TS)) | CR0_MP) : "memory");
+        if (fpu_fxsr) {
+                __asm__ volatile("movl %%cr4, %0" : "=r"(cr4));
+                __asm__ volatile("movl %0, %%cr4" :: "r"(cr4 | CR4_OSFXSR | CR4_OSXMMEXCPT) : "memory");
+        }
+
+        /* the state every context starts out with: that of fninit, the
+         * default MXCSR, and zeroed xmm registers */
+        __asm__ volatile("fninit" ::: "memory");
+        if (fpu_fxsr) {
+                __asm__ volatile("ldmxcsr %0" :: "m"(mxcsr));
+                fpu_save(fpu_initial);
+                memset(fpu_area(fpu_initial) + 160, 0, 128);
+        } else {
+                fpu_save(fpu_initial);
+        }
+
+        fpu_allocator = slab_allocator_create("fpu", fpu_size + FPU_ALIGN);
+        KASSERT(NULL != fpu_allocator);
+
+        intr_register(INTR_DEVICE_NOT_AVAILABLE, fpu_trap);
+        fpu_set_ts(1);
+}
+init_func(context_fpu_init);
 
 static void
 __context_initial_func(context_func_t func, int arg1, void *arg2)
@@ -34,6 +192,8 @@ context_setup(context_t *c, context_func_t func, int arg1, void *arg2,
         c->c_kstack = (uintptr_t)kstack;
         c->c_kstacksz = kstacksz;
         c->c_pdptr = pdptr;
+        c->c_kernel = 1;
+        c->c_fpu = NULL;
 
         /* put the arguments for __contect_initial_func onto the
          * stack, leave room at the bottom of the stack for a phony
@@ -57,6 +217,7 @@ context_make_active(context_t *c)
 {
         gdt_set_kernel_stack((void *)((uintptr_t)c->c_kstack + c->c_kstacksz));
         pt_set(c->c_pdptr);
+        fpu_set_ts(c != fpu_owner);
 
         /* Switch stacks and run the thread */
         __asm__ volatile(
@@ -72,7 +233,13 @@ void
 context_switch(context_t *oldc, context_t *newc)
 {
         gdt_set_kernel_stack((void *)((uintptr_t)newc->c_kstack + newc->c_kstacksz));
-        pt_set(newc->c_pdptr);
+        /* Loading CR3 flushes the TLB of everything but the (global)
+         * kernel mappings, so leave it be when the new thread is of the
+         * same process, or a kernel thread which only uses the kernel
+         * half that every page directory shares */
+        if (!newc->c_kernel && newc->c_pdptr != pt_get())
+                pt_set(newc->c_pdptr);
+        fpu_set_ts(newc != fpu_owner);
 
         /*
          * Save the current value of the stack pointer and the frame pointer into
@@ -19,10 +19,12 @@
 #include "fs/file.h"
 #include "fs/vnode.h"
 
+#include "vm/oom.h"
 #include "vm/shadow.h"
 #include "vm/vmmap.h"
 
 #include "api/exec.h"
+#include "api/vdso.h"
 
 #include "main/interrupt.h"
 
@@ -36,7 +38,7 @@ fork_setup_stack(const regs_t *regs, void *kstack)
 {
         /* Pointer argument and dummy return address, and userland dummy return
          * address */
-        uint32_t esp = ((uint32_t) kstack) + DEFAULT_STACK_SIZE - (sizeof(regs_t) + 12);
+        uint32_t esp = ((uint32_t) kstack) + KSTACK_SIZE - (sizeof(regs_t) + 12);
         *(void **)(esp + 4) = (void *)(esp + 8); /* Set the argument to point to location of struct on stack */
         memcpy((void *)(esp + 8), regs, sizeof(regs_t)); /* Copy over struct */
         return esp;
@@ -120,8 +122,8 @@ vmmap_shadow(vmmap_t *newmap, vmmap_t *oldmap)
         oldshadow->mmo_un.mmo_bottom_obj = bottom;
         bottom->mmo_ops->ref(bottom);
 
-        list_insert_head(&bottom->mmo_un.mmo_vmas, &newarea->vma_olink);
-        /*list_insert_head(&bottom->mmo_un.mmo_vmas, &oldarea->vma_olink);*/
+        vmarea_obj_insert(bottom, newarea);
+        /*oldarea is in the tree already*/
 
         /*update vma_obj field*/
         newarea->vma_obj = newshadow;
@@ -131,6 +133,65 @@ vmmap_shadow(vmmap_t *newmap, vmmap_t *oldmap)
     } list_iterate_end();
 }
 
+/*
+ * Gives newproc copies of curproc's open files, break and thread, with
+ * the thread set up to return 0 to userland from the fork. Sets *thrp to
+ * the new thread, which the caller makes runnable once the address space
+ * is ready. Returns 0, or -ENOMEM with newproc given no thread, for the
+ * caller to proc_discard().
+ */
+static int
+fork_copy_proc(proc_t *newproc, struct regs *regs, kthread_t **thrp)
+{
+    /*bulletin 6*/
+    /*only the open ones are looked at*/
+    int err = fdtable_copy(&newproc->p_fdtable, &curproc->p_fdtable);
+    if (0 > err) {
+        return err;
+    }
+
+    /*bulletin 8*/
+    KASSERT(!(list_empty(&curproc->p_threads)));
+#ifndef __MTP__
+    /*only one thread for each process*/
+    KASSERT(curproc->p_threads.l_next == curproc->p_threads.l_prev);
+#endif
+    /*only the thread calling fork is copied*/
+    kthread_t *newthr = kthread_clone(curthr);
+    /**4** kt_proc, kt_plink*/
+    KASSERT(newthr);
+
+    /**2** DONE*/
+    /**4** DONE*/
+    newthr->kt_proc = newproc;
+    list_insert_head(&newproc->p_threads, &newthr->kt_plink);
+
+    /*the return value*/
+    regs->r_eax = 0;
+
+    /*bulletin 5*/
+    newthr->kt_ctx.c_pdptr = newproc->p_pagedir;
+    newthr->kt_ctx.c_eip = (uintptr_t)userland_entry;
+    newthr->kt_ctx.c_esp = fork_setup_stack(regs, newthr->kt_kstack);
+    newthr->kt_ctx.c_ebp = curthr->kt_ctx.c_ebp;
+    err = context_fpu_copy(&newthr->kt_ctx, &curthr->kt_ctx);
+    if (0 > err) {
+        /*the files copied above go with newproc*/
+        list_remove(&newthr->kt_plink);
+        kthread_destroy(newthr);
+        return err;
+    }
+    /*newthr->kt_ctx.c_kstack = (uintptr_t)newthr->kt_kstack;*/
+    /*c_kstack and c_kstacksz is set during kthread_clone*/
+
+    /*bulletin 9: need to copy brk and start_brk over*/
+    newproc->p_brk = curproc->p_brk;
+    newproc->p_start_brk = curproc->p_start_brk;
+
+    *thrp = newthr;
+    return 0;
+}
+
 /*
  * The implementation of fork(2). Once this works,
  * you're practically home free. This is what the
@@ -166,57 +227,151 @@ do_fork(struct regs *regs)
     newmap->vmm_proc = newproc;
     newproc->p_vmmap = newmap;
 
-    /*bulletin 6*/
-    int i = 0;
-    for (i = 0 ; i < NFILES ; i++) {
-        if (curproc->p_files[i]) {
-            newproc->p_files[i] = curproc->p_files[i];
-            fref(newproc->p_files[i]);
-        } else {
-            KASSERT(newproc->p_files[i] == NULL);
-        }
+    kthread_t *newthr;
+    int err = fork_copy_proc(newproc, regs, &newthr);
+    if (0 > err) {
+        goto fail;
     }
 
-    /*bulletin 8*/
-    KASSERT(!(list_empty(&curproc->p_threads)));
-    /*only one thread for each process*/
-    KASSERT(curproc->p_threads.l_next == curproc->p_threads.l_prev);
-    kthread_t *oldthr = list_item(curproc->p_threads.l_next, kthread_t, kt_plink);
-    KASSERT(oldthr);
-    kthread_t *newthr = kthread_clone(oldthr);
-    /**4** kt_proc, kt_plink*/
-    KASSERT(newthr);
-
-    /**2** DONE*/
-    /**4** DONE*/
-    newthr->kt_proc = newproc;
-    list_insert_head(&newproc->p_threads, &newthr->kt_plink);
-
-    /*the return value*/
-    regs->r_eax = 0;
-
-    /*bulletin 5*/
-    newthr->kt_ctx.c_pdptr = newproc->p_pagedir;
-    newthr->kt_ctx.c_eip = (uintptr_t)userland_entry;
-    newthr->kt_ctx.c_esp = fork_setup_stack(regs, newthr->kt_kstack);
-    newthr->kt_ctx.c_ebp = curthr->kt_ctx.c_ebp;
-    /*newthr->kt_ctx.c_kstack = (uintptr_t)newthr->kt_kstack;*/
-    /*c_kstack and c_kstacksz is set during kthread_clone*/
-
-    /*bulletin 9: need to copy brk and start_brk over*/
-    newproc->p_brk = curproc->p_brk;
-    newproc->p_start_brk = curproc->p_start_brk;
-
     /*bulletin 4*/
-    /*not sure which pagetable to flush*/
-    pagedir_t *pagedir = pt_get();
-    pt_unmap_range(pagedir, USER_MEM_LOW, USER_MEM_HIGH);
+    /*
+     * rather than unmapping everything and refaulting the whole working
+     * set, hand the child the parent's mappings read-only and
+     * write-protect the private ones in the parent, so only the first
+     * write to a page traps for copy-on-write. A copy cut short by
+     * ENOMEM is fine, the child faults the rest in.
+     */
+    vmarea_t *vma;
+    list_iterate_begin(&curproc->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
+        pt_copy_range(newproc->p_pagedir, curproc->p_pagedir,
+                      (uintptr_t)PN_TO_ADDR(vma->vma_start),
+                      (uintptr_t)PN_TO_ADDR(vma->vma_end),
+                      vma->vma_flags & MAP_PRIVATE);
+    } list_iterate_end();
+    /*after the copy, which gave the child the parent's pid page*/
+    err = vdso_set_pid(newmap, newproc->p_pid);
+    /*the parent's private pages are write-protected either way*/
     tlb_flush_all();
+    if (0 > err) {
+        list_remove(&newthr->kt_plink);
+        kthread_destroy(newthr);
+        goto fail;
+    }
 
     /*bulletin 10*/
     sched_make_runnable(newthr);
 
     return newproc->p_pid;
+
+fail:
+    vmmap_destroy(newmap);
+    newproc->p_vmmap = NULL;
+    pt_destroy_pagedir(newproc->p_pagedir);
+    newproc->p_pagedir = NULL;
+    proc_discard(newproc);
+    return err;
         /*NOT_YET_IMPLEMENTED("VM: do_fork");*/
         /*return 0;*/
 }
+
+/*
+ * vfork(2): like fork, but the child runs in the parent's vmmap and page
+ * tables instead of copies of them, which is all a child that is about
+ * to exec needs. The parent sleeps until the child execs or exits, so
+ * the two never run in the address space at the same time.
+ */
+int
+do_vfork(struct regs *regs)
+{
+    proc_t *newproc = proc_create(curproc->p_comm);
+    KASSERT(newproc != NULL);
+
+    /*borrow the parent's address space*/
+    vmmap_destroy(newproc->p_vmmap);
+    newproc->p_vmmap = curproc->p_vmmap;
+    pt_destroy_pagedir(newproc->p_pagedir);
+    newproc->p_pagedir = curproc->p_pagedir;
+    newproc->p_vfork_parent = curproc;
+
+    kthread_t *newthr;
+    int err = fork_copy_proc(newproc, regs, &newthr);
+    if (0 > err) {
+        goto fail;
+    }
+    /*the child reads its pid from the parent's page until it execs*/
+    err = vdso_set_pid(curproc->p_vmmap, newproc->p_pid);
+    if (0 > err) {
+        list_remove(&newthr->kt_plink);
+        kthread_destroy(newthr);
+        goto fail;
+    }
+    sched_make_runnable(newthr);
+
+    while (newproc->p_vfork_parent != NULL) {
+        sched_sleep_on(&newproc->p_vfork_wait);
+    }
+    /*a fork by the child may have shared the page again, in which case
+     *getting it back is like faulting on it*/
+    while (0 > (err = vdso_set_pid(curproc->p_vmmap, curproc->p_pid))) {
+        if (oom_kill(1) != 0) {
+            do_exit(ENOMEM);
+        }
+        oom_wait();
+        if (curthr->kt_cancelled) {
+            break;
+        }
+    }
+    return newproc->p_pid;
+
+fail:
+    /*nothing of the address space is the child's own*/
+    newproc->p_vmmap = NULL;
+    newproc->p_pagedir = NULL;
+    newproc->p_vfork_parent = NULL;
+    proc_discard(newproc);
+    return err;
+}
+
+void
+vfork_release(void)
+{
+    KASSERT(curproc->p_vfork_parent != NULL);
+    curproc->p_vfork_parent = NULL;
+    sched_broadcast_on(&curproc->p_vfork_wait);
+}
+
+#ifdef __MTP__
+/*
+ * Adds a thread to curproc, sharing its address space, which starts in
+ * userland at eip with its stack pointer at esp. Returns the new thread's
+ * id.
+ */
+int
+do_thr_create(struct regs *regs, uintptr_t eip, uintptr_t esp)
+{
+    if (eip < USER_MEM_LOW || eip >= USER_MEM_HIGH
+        || esp <= USER_MEM_LOW || esp > USER_MEM_HIGH) {
+        return -EFAULT;
+    }
+
+    kthread_t *newthr = kthread_clone(curthr);
+    KASSERT(newthr);
+    newthr->kt_proc = curproc;
+    newthr->kt_cancelled = 0;
+    list_insert_tail(&curproc->p_threads, &newthr->kt_plink);
+
+    /*same segments and flags as the creator, but its own code and stack*/
+    regs_t newregs = *regs;
+    newregs.r_eip = eip;
+    newregs.r_useresp = esp;
+    newregs.r_eax = 0;
+
+    newthr->kt_ctx.c_pdptr = curproc->p_pagedir;
+    newthr->kt_ctx.c_eip = (uintptr_t)userland_entry;
+    newthr->kt_ctx.c_esp = fork_setup_stack(&newregs, newthr->kt_kstack);
+    newthr->kt_ctx.c_ebp = 0;
+
+    sched_make_runnable(newthr);
+    return newthr->kt_tid;
+}
+#endif
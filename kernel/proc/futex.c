@@ -0,0 +1,138 @@
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/kthread.h"
+#include "proc/futex.h"
+
+#include "mm/mm.h"
+#include "mm/mman.h"
+#include "mm/page.h"
+
+#include "vm/vmmap.h"
+
+#include "api/access.h"
+
+#define FUTEX_HASH_SIZE 32
+
+/*
+ * What a futex word is identified by. For a MAP_SHARED area this is the
+ * mapped object and the word's place in it, so that processes mapping the
+ * same object at different addresses find each other; for a private one
+ * it is the address space and the word's address.
+ */
+typedef struct futex_key {
+        void           *fk_obj;         /* mmobj_t or vmmap_t */
+        uint32_t        fk_page;        /* object or virtual page number */
+        uint32_t        fk_off;         /* byte offset in the page */
+} futex_key_t;
+
+/*
+ * One per sleeping thread, on its kernel stack. Each waiter has its own
+ * queue so that a wake only disturbs threads waiting on that word, while
+ * the hash buckets are shared by every futex.
+ */
+typedef struct futex_waiter {
+        futex_key_t     fw_key;
+        ktqueue_t       fw_queue;
+        list_link_t     fw_link;        /* link on its futex_table bucket */
+} futex_waiter_t;
+
+static list_t futex_table[FUTEX_HASH_SIZE];
+
+#define futex_key_eq(a, b)                                              \
+        ((a)->fk_obj == (b)->fk_obj && (a)->fk_page == (b)->fk_page     \
+         && (a)->fk_off == (b)->fk_off)
+#define futex_bucket(k)                                                 \
+        (&futex_table[((uintptr_t)(k)->fk_obj ^ (k)->fk_page            \
+                       ^ ((k)->fk_off >> 2)) % FUTEX_HASH_SIZE])
+
+static __attribute__((unused)) void
+futex_init(void)
+{
+        int i;
+        for (i = 0; i < FUTEX_HASH_SIZE; i++) {
+                list_init(&futex_table[i]);
+        }
+}
+init_func(futex_init);
+
+static int
+futex_get_key(uint32_t *uaddr, futex_key_t *key)
+{
+        uint32_t vfn = ADDR_TO_PN(uaddr);
+        vmarea_t *vma;
+
+        if ((uintptr_t)uaddr & 0x3) {
+                return -EINVAL;
+        }
+        if (NULL == (vma = vmmap_lookup(curproc->p_vmmap, vfn))) {
+                return -EFAULT;
+        }
+        if (vma->vma_flags & MAP_SHARED) {
+                key->fk_obj = vma->vma_obj;
+                key->fk_page = vfn - vma->vma_start + vma->vma_off;
+        } else {
+                key->fk_obj = curproc->p_vmmap;
+                key->fk_page = vfn;
+        }
+        key->fk_off = PAGE_OFFSET(uaddr);
+        return 0;
+}
+
+int
+do_futex_wait(uint32_t *uaddr, uint32_t val)
+{
+        futex_waiter_t w;
+        uint32_t cur;
+        int err;
+
+        if ((err = futex_get_key(uaddr, &w.fw_key)) < 0) {
+                return err;
+        }
+        if ((err = copy_from_user(&cur, uaddr, sizeof(cur))) < 0) {
+                return err;
+        }
+        /* nothing else runs between the check and going to sleep, so the
+         * wake for a later change of the word cannot be missed */
+        if (cur != val) {
+                return -EAGAIN;
+        }
+
+        sched_queue_init(&w.fw_queue);
+        list_insert_tail(futex_bucket(&w.fw_key), &w.fw_link);
+
+        err = sched_cancellable_sleep_on(&w.fw_queue);
+
+        /* still there if we were cancelled rather than woken */
+        if (list_link_is_linked(&w.fw_link)) {
+                list_remove(&w.fw_link);
+        }
+        return err;
+}
+
+int
+do_futex_wake(uint32_t *uaddr, int nwake)
+{
+        futex_waiter_t *w;
+        futex_key_t key;
+        int woken = 0, err;
+
+        if ((err = futex_get_key(uaddr, &key)) < 0) {
+                return err;
+        }
+        list_iterate_begin(futex_bucket(&key), w, futex_waiter_t, fw_link) {
+                if (woken < nwake && futex_key_eq(&w->fw_key, &key)) {
+                        list_remove(&w->fw_link);
+                        sched_wakeup_on(&w->fw_queue);
+                        woken++;
+                }
+        } list_iterate_end();
+        return woken;
+}
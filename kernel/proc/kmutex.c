@@ -1,7 +1,11 @@
 #include "globals.h"
 #include "errno.h"
 
+#include "util/callchain.h"
 #include "util/debug.h"
+#include "util/printf.h"
+#include "util/string.h"
+#include "util/time.h"
 
 #include "proc/kthread.h"
 #include "proc/kmutex.h"
@@ -12,11 +16,146 @@
  * thread context.
  */
 
+#if KMUTEX_STATS
+/*
+ * Statistics are kept by where the lock was taken rather than by mutex,
+ * since mutexes are freed along with what they are in without being
+ * told, and the call site says which mutex it was anyway. Only threads
+ * touch them, and the kernel is not preempted, so they need no lock.
+ * The call chain of the longest wait at each site is kept as well, for
+ * sites in helpers which many paths share.
+ */
+#define KMUTEX_NSITES   256
+
+typedef struct kmutex_site {
+    void       *ks_site;
+    uint32_t    ks_acquired;
+    uint32_t    ks_contended;
+    uint64_t    ks_wait_ns;         /* spent waiting, in all */
+    uint64_t    ks_max_hold_ns;
+    uint64_t    ks_max_wait_ns;
+    uintptr_t   ks_chain[CALLCHAIN_DEPTH];  /* of the longest wait, from
+                                             * the site out */
+} kmutex_site_t;
+
+static kmutex_site_t kmutex_sites[KMUTEX_NSITES];
+static uint32_t kmutex_sites_dropped;   /* acquisitions with no slot left */
+
+static kmutex_site_t *
+kmutex_site(void *site)
+{
+    uint32_t h = (uint32_t)site * 2654435761U;
+    int i;
+
+    for (i = 0; i < KMUTEX_NSITES; i++) {
+        kmutex_site_t *s = &kmutex_sites[(h + i) % KMUTEX_NSITES];
+        if (NULL == s->ks_site) {
+            s->ks_site = site;
+        }
+        if (site == s->ks_site) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static void
+kmutex_stat_locked(kmutex_t *mtx, void *site, uint64_t start, int contended)
+{
+    kmutex_site_t *s = kmutex_site(site);
+
+    mtx->km_site = site;
+    mtx->km_locked_ns = time_now_ns();
+    if (NULL == s) {
+        kmutex_sites_dropped++;
+        return;
+    }
+    s->ks_acquired++;
+    if (contended) {
+        uint64_t wait = mtx->km_locked_ns - start;
+        s->ks_contended++;
+        s->ks_wait_ns += wait;
+        if (wait > s->ks_max_wait_ns) {
+            /* skipping the kmutex_ function, so starting at site */
+            s->ks_max_wait_ns = wait;
+            memset(s->ks_chain, 0, sizeof(s->ks_chain));
+            callchain_capture(s->ks_chain, CALLCHAIN_DEPTH, 1);
+        }
+    }
+}
+
+static void
+kmutex_stat_unlocked(kmutex_t *mtx)
+{
+    kmutex_site_t *s = kmutex_site(mtx->km_site);
+    uint64_t held = time_now_ns() - mtx->km_locked_ns;
+
+    if (NULL != s && held > s->ks_max_hold_ns) {
+        s->ks_max_hold_ns = held;
+    }
+    mtx->km_site = NULL;
+}
+
+size_t
+kmutex_info(const void *data, char *buf, size_t osize)
+{
+    size_t size = osize;
+    uint8_t shown[KMUTEX_NSITES] = { 0 };
+    int n, i, j;
+
+    iprintf(&buf, &size, "site       acquired contended    wait_ns max_wait_ns max_hold_ns\n");
+    /* The longest waits first, as many as fit */
+    for (n = 0; n < KMUTEX_NSITES; n++) {
+        kmutex_site_t *s = NULL;
+        int best = -1;
+        for (i = 0; i < KMUTEX_NSITES; i++) {
+            if (NULL != kmutex_sites[i].ks_site && !shown[i]
+                && (best < 0 || kmutex_sites[i].ks_wait_ns > kmutex_sites[best].ks_wait_ns)) {
+                best = i;
+            }
+        }
+        if (best < 0 || size < 200) {
+            break;
+        }
+        shown[best] = 1;
+        s = &kmutex_sites[best];
+        iprintf(&buf, &size, "%p %8u %9u %10llu %11llu %11llu\n", s->ks_site,
+                s->ks_acquired, s->ks_contended, s->ks_wait_ns, s->ks_max_wait_ns,
+                s->ks_max_hold_ns);
+        if (0 != s->ks_chain[0]) {
+            iprintf(&buf, &size, "    longest wait from");
+            for (j = 0; j < CALLCHAIN_DEPTH && 0 != s->ks_chain[j]; j++) {
+                iprintf(&buf, &size, " %p", (void *)s->ks_chain[j]);
+            }
+            iprintf(&buf, &size, "\n");
+        }
+    }
+    if (0 != kmutex_sites_dropped) {
+        iprintf(&buf, &size, "%u acquisitions at sites with no slot\n", kmutex_sites_dropped);
+    }
+    return osize - size;
+}
+#else
+size_t
+kmutex_info(const void *data, char *buf, size_t osize)
+{
+    size_t size = osize;
+
+    iprintf(&buf, &size, "kmutex statistics are off, see KMUTEX_STATS in config.h\n");
+    return osize - size;
+}
+#endif
+
 void
 kmutex_init(kmutex_t *mtx)
 {
     sched_queue_init(&mtx->km_waitq);
     mtx->km_holder = NULL;
+    mtx->km_contended = 0;
+#if KMUTEX_STATS
+    mtx->km_site = NULL;
+    mtx->km_locked_ns = 0;
+#endif
 
         /*NOT_YET_IMPLEMENTED("PROCS: kmutex_init");*/
 }
@@ -30,12 +169,20 @@ kmutex_init(kmutex_t *mtx)
 void
 kmutex_lock(kmutex_t *mtx)
 {
+#if KMUTEX_STATS
+    uint64_t start = time_now_ns();
+    int contended = (NULL != mtx->km_holder);
+#endif
     if (NULL == mtx->km_holder) {
         mtx->km_holder = curthr;
     } else {
+        mtx->km_contended++;
         sched_sleep_on(&mtx->km_waitq);
     }
     KASSERT(mtx->km_holder = curthr);
+#if KMUTEX_STATS
+    kmutex_stat_locked(mtx, __builtin_return_address(0), start, contended);
+#endif
 
         /*NOT_YET_IMPLEMENTED("PROCS: kmutex_lock");*/
 }
@@ -47,11 +194,21 @@ kmutex_lock(kmutex_t *mtx)
 int
 kmutex_lock_cancellable(kmutex_t *mtx)
 {
+#if KMUTEX_STATS
+    uint64_t start = time_now_ns();
+#endif
     if (NULL == mtx->km_holder) {
         mtx->km_holder = curthr;
+#if KMUTEX_STATS
+        kmutex_stat_locked(mtx, __builtin_return_address(0), start, 0);
+#endif
         return 0;
     } else {
+        mtx->km_contended++;
         if (0 == sched_cancellable_sleep_on(&mtx->km_waitq)) {
+#if KMUTEX_STATS
+            kmutex_stat_locked(mtx, __builtin_return_address(0), start, 1);
+#endif
             return 0;
         } else {
             return EINTR;
@@ -78,6 +235,9 @@ kmutex_lock_cancellable(kmutex_t *mtx)
 void
 kmutex_unlock(kmutex_t *mtx)
 {
+#if KMUTEX_STATS
+    kmutex_stat_unlocked(mtx);
+#endif
     mtx->km_holder = sched_wakeup_on(&mtx->km_waitq);
 
         /*NOT_YET_IMPLEMENTED("PROCS: kmutex_unlock");*/
@@ -0,0 +1,74 @@
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+
+#include "proc/kthread.h"
+#include "proc/krwlock.h"
+
+/*
+ * Like mutexes, these locks are only ever taken or let go of from a
+ * thread context. Whoever lets go of the lock hands it straight to the
+ * threads it wakes up, so a woken thread never has to check again.
+ */
+
+void
+krwlock_init(krwlock_t *rw)
+{
+        sched_queue_init(&rw->kr_rwaitq);
+        sched_queue_init(&rw->kr_wwaitq);
+        rw->kr_readers = 0;
+        rw->kr_writer = NULL;
+        rw->kr_contended = 0;
+}
+
+void
+krwlock_rdlock(krwlock_t *rw)
+{
+        KASSERT(rw->kr_writer != curthr);
+
+        if (NULL == rw->kr_writer && 0 == rw->kr_wwaitq.tq_size) {
+                rw->kr_readers++;
+                return;
+        }
+        rw->kr_contended++;
+        sched_sleep_on(&rw->kr_rwaitq);
+        KASSERT(NULL == rw->kr_writer && 0 < rw->kr_readers);
+}
+
+void
+krwlock_wrlock(krwlock_t *rw)
+{
+        KASSERT(rw->kr_writer != curthr);
+
+        if (NULL == rw->kr_writer && 0 == rw->kr_readers) {
+                rw->kr_writer = curthr;
+                return;
+        }
+        rw->kr_contended++;
+        sched_sleep_on(&rw->kr_wwaitq);
+        KASSERT(rw->kr_writer == curthr);
+}
+
+void
+krwlock_rdunlock(krwlock_t *rw)
+{
+        KASSERT(NULL == rw->kr_writer && 0 < rw->kr_readers);
+
+        if (0 == --rw->kr_readers && 0 < rw->kr_wwaitq.tq_size)
+                rw->kr_writer = sched_wakeup_on(&rw->kr_wwaitq);
+}
+
+void
+krwlock_wrunlock(krwlock_t *rw)
+{
+        KASSERT(rw->kr_writer == curthr && 0 == rw->kr_readers);
+
+        rw->kr_writer = NULL;
+        if (0 < rw->kr_rwaitq.tq_size) {
+                rw->kr_readers = rw->kr_rwaitq.tq_size;
+                sched_broadcast_on(&rw->kr_rwaitq);
+        } else if (0 < rw->kr_wwaitq.tq_size) {
+                rw->kr_writer = sched_wakeup_on(&rw->kr_wwaitq);
+        }
+}
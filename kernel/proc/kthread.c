@@ -26,6 +26,8 @@ static ktqueue_t reapd_waitq;
 static list_t kthread_reapd_deadlist; /* Threads to be cleaned */
 
 static void *kthread_reapd_run(int arg1, void *arg2);
+
+static int next_tid = 0;
 #endif
 
 void
@@ -35,6 +37,18 @@ kthread_init()
         KASSERT(NULL != kthread_allocator);
 }
 
+/*
+ * Freed stacks are kept for the next threads rather than going back to
+ * the page allocator, up to KSTACK_POOL_SIZE of them. The lowest word of
+ * each stack holds KSTACK_MAGIC, which is written once when the stack is
+ * first allocated; a thread that ran off the end of its stack will have
+ * overwritten it by the time the stack is freed.
+ */
+#define KSTACK_MAGIC 0x5ac4b0a7
+
+static char *kstack_pool[KSTACK_POOL_SIZE];
+static int kstack_pool_count = 0;
+
 /**
  * Allocates a new kernel stack.
  *
@@ -46,9 +60,14 @@ alloc_stack(void)
 {
         /* extra page for "magic" data */
         char *kstack;
-        int npages = 1 + (DEFAULT_STACK_SIZE >> PAGE_SHIFT);
-        kstack = (char *)page_alloc_n(npages);
-
+        int npages = 1 + (KSTACK_SIZE >> PAGE_SHIFT);
+
+        if (0 < kstack_pool_count) {
+                return kstack_pool[--kstack_pool_count];
+        }
+        if (NULL != (kstack = (char *)page_alloc_n(npages))) {
+                *(uint32_t *)kstack = KSTACK_MAGIC;
+        }
         return kstack;
 }
 
@@ -60,12 +79,18 @@ alloc_stack(void)
 static void
 free_stack(char *stack)
 {
-        page_free_n(stack, 1 + (DEFAULT_STACK_SIZE >> PAGE_SHIFT));
+        KASSERT(KSTACK_MAGIC == *(uint32_t *)stack && "kernel stack overflow");
+
+        if (KSTACK_POOL_SIZE > kstack_pool_count) {
+                kstack_pool[kstack_pool_count++] = stack;
+        } else {
+                page_free_n(stack, 1 + (KSTACK_SIZE >> PAGE_SHIFT));
+        }
 }
 
 /*
  * Allocate a new stack with the alloc_stack function. The size of the
- * stack is DEFAULT_STACK_SIZE.
+ * stack is KSTACK_SIZE.
  *
  * Don't forget to initialize the thread context with the
  * context_setup function. The context should have the same pagetable
@@ -93,7 +118,7 @@ kthread_create(struct proc *p, kthread_func_t func, long arg1, void *arg2)
     /*void *ctx_stack = kthread_struct->kt_kstack;*/
     KASSERT(NULL != ctx_stack);
 
-    context_setup(&kthread_struct->kt_ctx, func, arg1, arg2, ctx_stack, DEFAULT_STACK_SIZE, p->p_pagedir);
+    context_setup(&kthread_struct->kt_ctx, func, arg1, arg2, ctx_stack, KSTACK_SIZE, p->p_pagedir);
     /*The context should have the same pagetable as the process.*/
 
     kthread_struct->kt_cancelled = 0;
@@ -103,6 +128,22 @@ kthread_create(struct proc *p, kthread_func_t func, long arg1, void *arg2)
     /*not sure about the thread state init value*/
 
     kthread_struct->kt_wchan = NULL;
+    kthread_struct->kt_exclusive = 0;
+
+    kthread_struct->kt_prio = SCHED_PRIO_DEFAULT;
+    kthread_struct->kt_cpumask = SCHED_CPUS_ONLINE;
+    kthread_struct->kt_rcu_nesting = 0;
+    kthread_struct->kt_utime = 0;
+    kthread_struct->kt_stime = 0;
+    kthread_struct->kt_runq_at = 0;
+    kthread_struct->kt_wclass = SCHED_WQ_OTHER;
+    kthread_struct->kt_nreadins = 0;
+
+#ifdef __MTP__
+    kthread_struct->kt_tid = next_tid++;
+    kthread_struct->kt_detached = 0;
+    sched_queue_init(&kthread_struct->kt_joinq);
+#endif
     
     list_link_init(&kthread_struct->kt_qlink);
     list_link_init(&kthread_struct->kt_plink);
@@ -120,9 +161,17 @@ void
 kthread_destroy(kthread_t *t)
 {
         KASSERT(t && t->kt_kstack);
+        context_fpu_release(&t->kt_ctx);
         free_stack(t->kt_kstack);
+        /* the stack interrupts run on, see kthread_create */
+        free_stack((char *)t->kt_ctx.c_kstack);
         if (list_link_is_linked(&t->kt_plink))
                 list_remove(&t->kt_plink);
+#ifdef __MTP__
+        /* an exited detached thread may still be waiting for the reaper */
+        if (list_link_is_linked(&t->kt_qlink))
+                list_remove(&t->kt_qlink);
+#endif
 
         slab_obj_free(kthread_allocator, t);
 }
@@ -203,7 +252,10 @@ kthread_clone(kthread_t *thr)
     KASSERT(NULL != ctx_stack);
 
     newthr->kt_ctx.c_kstack = (uintptr_t)ctx_stack;
-    newthr->kt_ctx.c_kstacksz = DEFAULT_STACK_SIZE;
+    newthr->kt_ctx.c_kstacksz = KSTACK_SIZE;
+    /*a new thread starts with fresh FPU state, fork copies the old one*/
+    newthr->kt_ctx.c_fpu = NULL;
+    newthr->kt_ctx.c_kernel = 0;
     /*the rest should be initialized by do_fork*/
 
     newthr->kt_cancelled = thr->kt_cancelled;
@@ -212,6 +264,22 @@ kthread_clone(kthread_t *thr)
     /*it's gonna be made runnable soon*/
 
     newthr->kt_wchan = thr->kt_wchan;
+    newthr->kt_exclusive = 0;
+
+    newthr->kt_prio = SCHED_PRIO_DEFAULT;
+    newthr->kt_cpumask = thr->kt_cpumask;
+    newthr->kt_rcu_nesting = 0;
+    newthr->kt_utime = 0;
+    newthr->kt_stime = 0;
+    newthr->kt_runq_at = 0;
+    newthr->kt_wclass = SCHED_WQ_OTHER;
+    newthr->kt_nreadins = 0;
+
+#ifdef __MTP__
+    newthr->kt_tid = next_tid++;
+    newthr->kt_detached = 0;
+    sched_queue_init(&newthr->kt_joinq);
+#endif
     /*assert for now, just my assumption*/
     KASSERT(newthr->kt_wchan == NULL);
 
@@ -229,17 +297,62 @@ kthread_clone(kthread_t *thr)
  * unless your weenix is perfect.
  */
 #ifdef __MTP__
+kthread_t *
+kthread_lookup(int tid)
+{
+        kthread_t *kthr;
+        list_iterate_begin(&curproc->p_threads, kthr, kthread_t, kt_plink) {
+                if (kthr->kt_tid == tid) {
+                        return kthr;
+                }
+        } list_iterate_end();
+        return NULL;
+}
+
+/*
+ * A detached thread is cleaned up by the reaper as soon as it exits (see
+ * proc_thread_exited), or right away here if it already has.
+ */
 int
 kthread_detach(kthread_t *kthr)
 {
-        NOT_YET_IMPLEMENTED("MTP: kthread_detach");
+        KASSERT(NULL != kthr);
+
+        if (kthr->kt_detached || !sched_queue_empty(&kthr->kt_joinq)) {
+                return -EINVAL;
+        }
+        if (KT_EXITED == kthr->kt_state) {
+                kthread_destroy(kthr);
+        } else {
+                kthr->kt_detached = 1;
+        }
         return 0;
 }
 
+/*
+ * Only one thread may join with a given thread; it cleans the thread up
+ * once it has exited.
+ */
 int
 kthread_join(kthread_t *kthr, void **retval)
 {
-        NOT_YET_IMPLEMENTED("MTP: kthread_join");
+        KASSERT(NULL != kthr);
+
+        if (kthr == curthr) {
+                return -EDEADLK;
+        }
+        if (kthr->kt_detached || !sched_queue_empty(&kthr->kt_joinq)) {
+                return -EINVAL;
+        }
+        while (KT_EXITED != kthr->kt_state) {
+                if (sched_cancellable_sleep_on(&kthr->kt_joinq) < 0) {
+                        return -EINTR;
+                }
+        }
+        if (NULL != retval) {
+                *retval = kthr->kt_retval;
+        }
+        kthread_destroy(kthr);
         return 0;
 }
 
@@ -249,7 +362,16 @@ kthread_join(kthread_t *kthr, void **retval)
 static __attribute__((unused)) void
 kthread_reapd_init()
 {
-        NOT_YET_IMPLEMENTED("MTP: kthread_reapd_init");
+        sched_queue_init(&reapd_waitq);
+        list_init(&kthread_reapd_deadlist);
+
+        KASSERT(NULL != curproc && (PID_IDLE == curproc->p_pid));
+        reapd = proc_create("reapd");
+        KASSERT(NULL != reapd);
+        reapd_thr = kthread_create(reapd, kthread_reapd_run, 0, NULL);
+        KASSERT(NULL != reapd_thr);
+
+        sched_make_runnable(reapd_thr);
 }
 init_func(kthread_reapd_init);
 init_depends(sched_init);
@@ -257,13 +379,37 @@ init_depends(sched_init);
 void
 kthread_reapd_shutdown()
 {
-        NOT_YET_IMPLEMENTED("MTP: kthread_reapd_shutdown");
+        KASSERT(NULL != reapd_thr);
+        KASSERT(PID_IDLE == curproc->p_pid);
+        kthread_cancel(reapd_thr, (void *)0);
+        reapd_thr = NULL;
+        int reapd_pid = reapd->p_pid;
+        int child = do_waitpid(reapd_pid, 0, NULL);
+        KASSERT(child == reapd_pid && "waited on process other than reapd");
+}
+
+void
+kthread_reapd_add(kthread_t *kthr)
+{
+        KASSERT(KT_EXITED == kthr->kt_state && kthr->kt_detached);
+        list_insert_tail(&kthread_reapd_deadlist, &kthr->kt_qlink);
+        sched_wakeup_on(&reapd_waitq);
 }
 
 static void *
 kthread_reapd_run(int arg1, void *arg2)
 {
-        NOT_YET_IMPLEMENTED("MTP: kthread_reapd_run");
-        return (void *) 0;
+        while (1) {
+                /* a thread only goes on the list after its last switch
+                 * away, so none of these is still on its stack */
+                while (!list_empty(&kthread_reapd_deadlist)) {
+                        kthread_t *kthr = list_head(&kthread_reapd_deadlist,
+                                                    kthread_t, kt_qlink);
+                        kthread_destroy(kthr);
+                }
+                if (sched_cancellable_sleep_on(&reapd_waitq) < 0) {
+                        return (void *) 0;
+                }
+        }
 }
 #endif
@@ -12,6 +12,10 @@
 #include "proc/proc.h"
 #include "proc/sched.h"
 #include "proc/proc.h"
+#include "proc/ioprio.h"
+#include "proc/resource.h"
+#include "proc/rcu.h"
+#include "proc/workq.h"
 
 #include "mm/slab.h"
 #include "mm/page.h"
@@ -21,6 +25,8 @@
 
 #include "vm/vmmap.h"
 
+#include "api/syscall.h"
+
 #include "fs/vfs.h"
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
@@ -30,14 +36,55 @@ proc_t *curproc = NULL; /* global */
 static slab_allocator_t *proc_allocator = NULL;
 
 static list_t _proc_list;
+static uint32_t _proc_seq;      /* p_seq of the last process created */
 static proc_t *proc_initproc = NULL; /* Pointer to the init process (PID 1) */
 
+/*
+ * PIDs in use are set bits in _proc_pid_map, and processes are found by
+ * PID in _proc_hash. A PID stays in use until its process is reaped by
+ * do_waitpid(), the same time it leaves _proc_list.
+ *
+ * Both _proc_list and _proc_hash are walked in RCU read-side sections
+ * (proc/rcu.h), so processes are linked and unlinked with the _rcu list
+ * operations, and their proc_t is freed a grace period after reaping.
+ */
+#define PROC_WORD_BITS          32
+#define PROC_HASH_BUCKETS       256
+
+static uint32_t _proc_pid_map[PROC_MAX_COUNT / PROC_WORD_BITS];
+static uint32_t _proc_pid_nfree = PROC_MAX_COUNT;
+static list_t _proc_hash[PROC_HASH_BUCKETS];
+
+#define proc_bucket(pid) (&_proc_hash[(uint32_t)(pid) % PROC_HASH_BUCKETS])
+
+/*
+ * The address spaces of exited processes, which a work item tears down
+ * after the fact so that exit(2) and the parent's wait(2) need not wait
+ * for it: proc_cleanup() queues the process, and the reaper destroys its
+ * vmmap and page directory. Nothing can have the page directory loaded
+ * by then, so none of the unmapping has to flush the TLB, and a fork
+ * storm's worth of exits queued before the reaper gets to run are torn
+ * down by one run of it.
+ */
+static list_t _proc_reap_list;
+static work_t _proc_reap_work;
+
+static void proc_reap_queue(void);
+static void proc_reap(work_t *w);
+
 void
 proc_init()
 {
+        int i;
+
         list_init(&_proc_list);
+        for (i = 0; i < PROC_HASH_BUCKETS; i++) {
+                list_init(&_proc_hash[i]);
+        }
         proc_allocator = slab_allocator_create("proc", sizeof(proc_t));
         KASSERT(proc_allocator != NULL);
+        list_init(&_proc_reap_list);
+        work_init(&_proc_reap_work, proc_reap, NULL);
 }
 
 static pid_t next_pid = 0;
@@ -45,30 +92,45 @@ static pid_t next_pid = 0;
 /**
  * Returns the next available PID.
  *
- * Note: Where n is the number of running processes, this algorithm is
- * worst case O(n^2). As long as PIDs never wrap around it is O(n).
+ * The search starts at the PID after the last one handed out and skips
+ * 32 PIDs at a time where they are all in use, so it only looks at more
+ * than a word or two of the map once PIDs have wrapped around and most
+ * are taken.
  *
- * @return the next available PID
+ * @return the next available PID, or -1 if there is none
  */
 static int
 _proc_getid()
 {
-        proc_t *p;
-        pid_t pid = next_pid;
+        uint32_t pid = next_pid;
+        uint32_t word;
+
+        if (0 == _proc_pid_nfree) {
+                return -1;
+        }
         while (1) {
-failed:
-                list_iterate_begin(&_proc_list, p, proc_t, p_list_link) {
-                        if (p->p_pid == pid) {
-                                if ((pid = (pid + 1) % PROC_MAX_COUNT) == next_pid) {
-                                        return -1;
-                                } else {
-                                        goto failed;
-                                }
-                        }
-                } list_iterate_end();
-                next_pid = (pid + 1) % PROC_MAX_COUNT;
-                return pid;
+                word = _proc_pid_map[pid / PROC_WORD_BITS];
+                if (word == 0xffffffff) {
+                        pid = (pid / PROC_WORD_BITS + 1) * PROC_WORD_BITS;
+                } else if (word & (1U << (pid % PROC_WORD_BITS))) {
+                        pid++;
+                } else {
+                        break;
+                }
+                pid %= PROC_MAX_COUNT;
         }
+        _proc_pid_map[pid / PROC_WORD_BITS] |= 1U << (pid % PROC_WORD_BITS);
+        _proc_pid_nfree--;
+        next_pid = (pid + 1) % PROC_MAX_COUNT;
+        return pid;
+}
+
+static void
+_proc_putid(pid_t pid)
+{
+        KASSERT(_proc_pid_map[pid / PROC_WORD_BITS] & (1U << (pid % PROC_WORD_BITS)));
+        _proc_pid_map[pid / PROC_WORD_BITS] &= ~(1U << (pid % PROC_WORD_BITS));
+        _proc_pid_nfree++;
 }
 
 /*
@@ -111,9 +173,13 @@ proc_create(char *name)
     proc_struct->p_pagedir = pt_create_pagedir();
     KASSERT(proc_struct->p_pagedir);
 
+    /*the list stays in creation order, for proc_list_next*/
+    proc_struct->p_seq = ++_proc_seq;
     list_link_init(&proc_struct->p_list_link);
-    list_insert_tail(&_proc_list, &proc_struct->p_list_link);
+    list_insert_tail_rcu(&_proc_list, &proc_struct->p_list_link);
     /*add itself to _proc_list*/
+    list_link_init(&proc_struct->p_hash_link);
+    list_insert_head_rcu(proc_bucket(proc_struct->p_pid), &proc_struct->p_hash_link);
 
     list_link_init(&proc_struct->p_child_link);
 
@@ -129,11 +195,8 @@ proc_create(char *name)
     }
 
     /* VFS-related: */
-    /*p_files*/
-    int i = 0;
-    for (i = 0 ; i < NFILES ; i++) {
-        proc_struct->p_files[i] = NULL;
-    }
+    /*p_fdtable*/
+    fdtable_init(&proc_struct->p_fdtable);
     /*p_cwd*/
     if (proc_struct->p_pid != PID_IDLE && proc_struct->p_pid != PID_INIT) {
         proc_struct->p_cwd = curproc->p_cwd;
@@ -148,6 +211,27 @@ proc_create(char *name)
     proc_struct->p_vmmap = vmmap_create();
     KASSERT(proc_struct->p_vmmap);
     proc_struct->p_vmmap->vmm_proc = proc_struct;
+    proc_struct->p_vfork_parent = NULL;
+    sched_queue_init(&proc_struct->p_vfork_wait);
+    proc_struct->p_reap = PROC_REAP_NONE;
+    list_link_init(&proc_struct->p_reap_link);
+
+    /* I/O */
+    proc_struct->p_ioprio = (NULL != curproc) ? curproc->p_ioprio : IOPRIO_CLASS_NONE;
+    proc_struct->p_io_rbytes = 0;
+    proc_struct->p_io_wbytes = 0;
+    proc_struct->p_io_rops = 0;
+    proc_struct->p_io_wops = 0;
+    proc_struct->p_utime = 0;
+    proc_struct->p_stime = 0;
+    proc_struct->p_cutime = 0;
+    proc_struct->p_cstime = 0;
+    memset(proc_struct->p_sched_lat, 0, sizeof(proc_struct->p_sched_lat));
+
+#ifdef __MTP__
+    proc_struct->p_exiting = 0;
+    sched_queue_init(&proc_struct->p_thread_exitq);
+#endif
 
     dbg(DBG_PROC, "Created process with name: %s\n", name);
     dbginfo(DBG_PROC, proc_info, proc_struct);
@@ -211,19 +295,22 @@ proc_cleanup(int status)
 
     /*clean up file descriptors*/
     /*VFS*/
-    int i = 0;
-    for (i = 0 ; i < NFILES ; i++) {
-        if (curproc->p_files[i]) {
-            fput(curproc->p_files[i]);
-        }
-    }
+    fdtable_destroy(&curproc->p_fdtable);
 
     if (curproc->p_cwd) {
         vput(curproc->p_cwd);
     }
 
     /*VM*/
-    vmmap_destroy(curproc->p_vmmap);
+    if (curproc->p_vfork_parent != NULL) {
+        /*the address space is our parent's, just give it back*/
+        curproc->p_vmmap = NULL;
+        curproc->p_pagedir = NULL;
+        vfork_release();
+    } else {
+        /*the reaper tears it down once we are off it*/
+        proc_reap_queue();
+    }
         /*NOT_YET_IMPLEMENTED("PROCS: proc_cleanup");*/
 }
 
@@ -290,7 +377,11 @@ proc_t *
 proc_lookup(int pid)
 {
         proc_t *p;
-        list_iterate_begin(&_proc_list, p, proc_t, p_list_link) {
+
+        if (pid < 0 || pid >= PROC_MAX_COUNT) {
+                return NULL;
+        }
+        list_iterate_begin(proc_bucket(pid), p, proc_t, p_hash_link) {
                 if (p->p_pid == pid) {
                         return p;
                 }
@@ -304,6 +395,85 @@ proc_list()
         return &_proc_list;
 }
 
+proc_t *
+proc_list_next(uint32_t *seq)
+{
+        proc_t *p;
+
+        KASSERT(0 < curthr->kt_rcu_nesting);
+        list_iterate_begin(&_proc_list, p, proc_t, p_list_link) {
+                if (p->p_seq > *seq) {
+                        *seq = p->p_seq;
+                        return p;
+                }
+        } list_iterate_end();
+        return NULL;
+}
+
+static void
+proc_free_rcu(rcu_head_t *rh)
+{
+        slab_obj_free(proc_allocator, list_item(rh, proc_t, p_rcu));
+}
+
+void
+proc_discard(proc_t *p)
+{
+        KASSERT(list_empty(&p->p_threads));
+        KASSERT(list_empty(&p->p_children));
+        KASSERT(PROC_REAP_NONE == p->p_reap);
+
+        fdtable_destroy(&p->p_fdtable);
+        if (NULL != p->p_cwd)
+                vput(p->p_cwd);
+
+        list_remove_rcu(&p->p_list_link);
+        list_remove_rcu(&p->p_hash_link);
+        list_remove(&p->p_child_link);
+        _proc_putid(p->p_pid);
+        /* proc_lookup() may already have found it */
+        call_rcu(&p->p_rcu, proc_free_rcu);
+}
+
+/*
+ * Queues the current process's address space for the reaper. Its last
+ * thread is about to switch away for good, and the reaper cannot run
+ * before it has, so the page directory is not in use by the time it
+ * goes. Until then the vmmap stays where the reverse mappings of its
+ * pages can find it, with vmm_proc and p_pagedir as they were.
+ */
+static void
+proc_reap_queue(void)
+{
+        KASSERT(PROC_REAP_NONE == curproc->p_reap);
+        curproc->p_reap = PROC_REAP_QUEUED;
+        list_insert_tail(&_proc_reap_list, &curproc->p_reap_link);
+        work_queue(&_proc_reap_work);
+}
+
+static void
+proc_reap(work_t *w)
+{
+        proc_t *p;
+
+        /* vmmap_destroy stops to let others run, and more exits may
+         * queue up meanwhile, so each process is taken off first */
+        while (!list_empty(&_proc_reap_list)) {
+                p = list_head(&_proc_reap_list, proc_t, p_reap_link);
+                list_remove(&p->p_reap_link);
+
+                vmmap_destroy(p->p_vmmap);
+                p->p_vmmap = NULL;
+                pt_destroy_pagedir(p->p_pagedir);
+                p->p_pagedir = NULL;
+
+                if (PROC_REAP_WAITED == p->p_reap)
+                        call_rcu(&p->p_rcu, proc_free_rcu);
+                else
+                        p->p_reap = PROC_REAP_NONE;
+        }
+}
+
 /*
  * This function is only called from kthread_exit.
  *
@@ -312,12 +482,55 @@ proc_list()
  * run. If you are implementing MTP, a single thread exiting does not
  * necessarily mean that the process should be exited.
  */
+#ifdef __MTP__
+/*
+ * The number of threads of p, other than the current one, which have not
+ * exited yet.
+ */
+static int
+proc_live_threads(proc_t *p)
+{
+    int count = 0;
+    kthread_t *kthr;
+    list_iterate_begin(&p->p_threads, kthr, kthread_t, kt_plink) {
+        if (kthr != curthr && KT_EXITED != kthr->kt_state) {
+            count++;
+        }
+    } list_iterate_end();
+    return count;
+}
+#endif
+
 void
 proc_thread_exited(void *retval)
 {
     /*it should not be in any wait queue*/
     KASSERT(NULL == curthr->kt_wchan);
 
+#ifdef __MTP__
+    if (proc_live_threads(curproc) > 0) {
+        /*only this thread is done, leave it for a joiner or the reaper*/
+        curthr->kt_state = KT_EXITED;
+        if (curthr->kt_detached && !curproc->p_exiting) {
+            kthread_reapd_add(curthr);
+        } else {
+            sched_broadcast_on(&curthr->kt_joinq);
+        }
+        sched_broadcast_on(&curproc->p_thread_exitq);
+        sched_switch();
+        panic("exited thread %p was scheduled again\n", curthr);
+    }
+
+    /*the last thread out cleans up the ones that were never joined*/
+    kthread_t *kthr;
+    list_iterate_begin(&curproc->p_threads, kthr, kthread_t, kt_plink) {
+        if (kthr != curthr) {
+            KASSERT(KT_EXITED == kthr->kt_state);
+            kthread_destroy(kthr);
+        }
+    } list_iterate_end();
+#endif
+
     /*deal with NULL pointer*/
     /*
      *if (retval == NULL) {
@@ -442,8 +655,6 @@ CheckAgain:
     /*cleanup the thread*/
     kthread_t *kthr;
     list_iterate_begin(&child_proc->p_threads, kthr, kthread_t, kt_plink) {
-        /*work around for now*/
-        page_free_n((void *)kthr->kt_ctx.c_kstack, 1 + (DEFAULT_STACK_SIZE >> PAGE_SHIFT));
         kthread_destroy(kthr);
     } list_iterate_end();
     KASSERT(list_empty(&child_proc->p_threads));
@@ -454,15 +665,27 @@ CheckAgain:
         *status = child_proc->p_status;
     }
 
+    /*its CPU time, and that of what it waited for, is now ours*/
+    curproc->p_cutime += child_proc->p_utime + child_proc->p_cutime;
+    curproc->p_cstime += child_proc->p_stime + child_proc->p_cstime;
+
     /*debug infomation*/
     dbg(DBG_PROC, "About to clean the process: %s\n", child_proc->p_comm);
 
-    list_remove(&child_proc->p_list_link);
+    list_remove_rcu(&child_proc->p_list_link);
+    list_remove_rcu(&child_proc->p_hash_link);
     list_remove(&child_proc->p_child_link);
+    _proc_putid(child_proc->p_pid);
 
-    /*destroy page table and the struct*/
-    pt_destroy_pagedir(child_proc->p_pagedir);
-    slab_obj_free(proc_allocator, child_proc);
+    /*the reaper frees the struct if it has not got to the address
+     *space yet; a vforked child that exited never had one of its own*/
+    if (PROC_REAP_QUEUED == child_proc->p_reap) {
+        child_proc->p_reap = PROC_REAP_WAITED;
+    } else {
+        KASSERT(NULL == child_proc->p_pagedir);
+        /*someone may still be looking at it on the way past*/
+        call_rcu(&child_proc->p_rcu, proc_free_rcu);
+    }
 
     return child_pid;
 
@@ -478,12 +701,141 @@ CheckAgain:
 void
 do_exit(int status)
 {
-    /*implementation for now, only one thread*/
+#ifdef __MTP__
+    /*another thread is already taking the process down*/
+    if (curproc->p_exiting) {
+        kthread_exit((void *)status);
+    }
+    curproc->p_exiting = 1;
+
+    kthread_t *kthr;
+    list_iterate_begin(&curproc->p_threads, kthr, kthread_t, kt_plink) {
+        if (kthr != curthr && KT_EXITED != kthr->kt_state) {
+            kthread_cancel(kthr, (void *)status);
+        }
+    } list_iterate_end();
+    /*threads in uncancellable sleeps notice once they wake up*/
+    while (proc_live_threads(curproc) > 0) {
+        sched_sleep_on(&curproc->p_thread_exitq);
+    }
+#endif
     kthread_exit((void *)status);
 
         /*NOT_YET_IMPLEMENTED("PROCS: do_exit");*/
 }
 
+void
+proc_stat_get(proc_t *p, struct proc_stat *st)
+{
+        memset(st, 0, sizeof(*st));
+        st->ps_pid = p->p_pid;
+        st->ps_ppid = (NULL != p->p_pproc) ? p->p_pproc->p_pid : -1;
+        st->ps_state = p->p_state;
+        strncpy(st->ps_comm, p->p_comm, sizeof(st->ps_comm) - 1);
+        st->ps_cpu_ns = p->p_utime + p->p_stime;
+
+        /* an exited process's vmmap is the reaper's, if it is left */
+        if (NULL != p->p_pagedir) {
+                st->ps_rss = pt_resident(p->p_pagedir);
+                st->ps_ptpages = pt_table_count(p->p_pagedir);
+                if (PROC_DEAD != p->p_state && NULL != p->p_vmmap)
+                        st->ps_private = vmmap_private_pages(p->p_vmmap, p->p_pagedir);
+        }
+}
+
+static void
+ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+        ts->tv_sec = ns / 1000000000;
+        ts->tv_nsec = ns % 1000000000;
+}
+
+int
+do_getrusage(int who, struct rusage *ru)
+{
+        uint64_t utime, stime;
+
+        /* bring the running thread's times up to now */
+        sched_acct_untrap();
+        switch (who) {
+                case RUSAGE_SELF:
+                        utime = curproc->p_utime;
+                        stime = curproc->p_stime;
+                        break;
+                case RUSAGE_CHILDREN:
+                        utime = curproc->p_cutime;
+                        stime = curproc->p_cstime;
+                        break;
+                case RUSAGE_THREAD:
+                        utime = curthr->kt_utime;
+                        stime = curthr->kt_stime;
+                        break;
+                default:
+                        return -EINVAL;
+        }
+        ns_to_timespec(utime, &ru->ru_utime);
+        ns_to_timespec(stime, &ru->ru_stime);
+        return 0;
+}
+
+int
+do_ioprio_set(pid_t pid, int ioclass)
+{
+        proc_t *p = (0 == pid) ? curproc : proc_lookup(pid);
+
+        if (NULL == p)
+                return -ESRCH;
+        if (IOPRIO_CLASS_NONE > ioclass || IOPRIO_CLASS_IDLE < ioclass)
+                return -EINVAL;
+        /* requests already queued keep the class they were queued in */
+        p->p_ioprio = ioclass;
+        return 0;
+}
+
+int
+do_ioprio_get(pid_t pid)
+{
+        proc_t *p = (0 == pid) ? curproc : proc_lookup(pid);
+
+        if (NULL == p)
+                return -ESRCH;
+        return p->p_ioprio;
+}
+
+int
+do_sched_setaffinity(pid_t pid, uint32_t mask)
+{
+        proc_t *p = (0 == pid) ? curproc : proc_lookup(pid);
+        kthread_t *thr;
+        int err;
+
+        if (NULL == p)
+                return -ESRCH;
+        if (0 == (mask & SCHED_CPUS_ONLINE))
+                return -EINVAL;
+        list_iterate_begin(&p->p_threads, thr, kthread_t, kt_plink) {
+                err = sched_set_affinity(thr, mask);
+                KASSERT(0 == err);
+        } list_iterate_end();
+        return 0;
+}
+
+int
+do_sched_getaffinity(pid_t pid, uint32_t *mask)
+{
+        proc_t *p = (0 == pid) ? curproc : proc_lookup(pid);
+        kthread_t *thr;
+
+        if (NULL == p)
+                return -ESRCH;
+        /* the threads share a mask unless one was set for a thread alone */
+        *mask = 0;
+        list_iterate_begin(&p->p_threads, thr, kthread_t, kt_plink) {
+                *mask |= thr->kt_cpumask;
+        } list_iterate_end();
+        return 0;
+}
+
 size_t
 proc_info(const void *arg, char *buf, size_t osize)
 {
@@ -510,6 +862,10 @@ proc_info(const void *arg, char *buf, size_t osize)
                 ++count;
         } list_iterate_end();
         iprintf(&buf, &size, "thread count: %i\n", count);
+        list_iterate_begin(&p->p_threads, kthr, kthread_t, kt_plink) {
+                iprintf(&buf, &size, "  thread %i:  %llu us user, %llu us system\n",
+                        kthr->kt_tid, kthr->kt_utime / 1000, kthr->kt_stime / 1000);
+        } list_iterate_end();
 #endif
 
         if (list_empty(&p->p_children)) {
@@ -523,6 +879,15 @@ proc_info(const void *arg, char *buf, size_t osize)
 
         iprintf(&buf, &size, "status:       %i\n", p->p_status);
         iprintf(&buf, &size, "state:        %i\n", p->p_state);
+        iprintf(&buf, &size, "cpu user:     %llu us (children %llu us)\n",
+                p->p_utime / 1000, p->p_cutime / 1000);
+        iprintf(&buf, &size, "cpu system:   %llu us (children %llu us)\n",
+                p->p_stime / 1000, p->p_cstime / 1000);
+        iprintf(&buf, &size, "io class:     %i\n", p->p_ioprio);
+        iprintf(&buf, &size, "io read:      %u KB in %u ops\n",
+                (uint32_t)(p->p_io_rbytes >> 10), p->p_io_rops);
+        iprintf(&buf, &size, "io written:   %u KB in %u ops\n",
+                (uint32_t)(p->p_io_wbytes >> 10), p->p_io_wops);
 
 #ifdef __VFS__
 #ifdef __GETCWD__
@@ -539,6 +904,12 @@ proc_info(const void *arg, char *buf, size_t osize)
 #ifdef __VM__
         iprintf(&buf, &size, "start brk:    0x%p\n", p->p_start_brk);
         iprintf(&buf, &size, "brk:          0x%p\n", p->p_brk);
+
+        struct proc_stat st;
+        proc_stat_get((proc_t *)p, &st);
+        iprintf(&buf, &size, "rss:          %u pages (%u private, %u shared)\n",
+                st.ps_rss, st.ps_private, st.ps_rss - st.ps_private);
+        iprintf(&buf, &size, "page tables:  %u\n", st.ps_ptpages);
 #endif
 
         return size;
@@ -559,29 +930,51 @@ proc_list_info(const void *arg, char *buf, size_t osize)
         iprintf(&buf, &size, "%5s %-13s %-s\n", "PID", "NAME", "PARENT");
 #endif
 
-        list_iterate_begin(&_proc_list, p, proc_t, p_list_link) {
-                char parent[64];
+        /* lookup_dirpath may sleep, so each process is copied out in a
+         * read-side section of its own */
+        uint32_t seq = 0;
+        while (1) {
+                char parent[64], comm[PROC_NAME_LEN];
+                pid_t pid;
+#if defined(__VFS__) && defined(__GETCWD__)
+                vnode_t *cwd;
+#endif
+
+                rcu_read_lock();
+                if (NULL == (p = proc_list_next(&seq))) {
+                        rcu_read_unlock();
+                        break;
+                }
                 if (NULL != p->p_pproc) {
                         snprintf(parent, sizeof(parent),
                                  "%3i (%s)", p->p_pproc->p_pid, p->p_pproc->p_comm);
                 } else {
                         snprintf(parent, sizeof(parent), "  -");
                 }
+                pid = p->p_pid;
+                strncpy(comm, p->p_comm, sizeof(comm));
+                comm[sizeof(comm) - 1] = '\0';
+#if defined(__VFS__) && defined(__GETCWD__)
+                if (NULL != (cwd = p->p_cwd))
+                        vref(cwd);
+#endif
+                rcu_read_unlock();
 
 #if defined(__VFS__) && defined(__GETCWD__)
-                if (NULL != p->p_cwd) {
-                        char cwd[256];
-                        lookup_dirpath(p->p_cwd, cwd, sizeof(cwd));
+                if (NULL != cwd) {
+                        char path[256];
+                        lookup_dirpath(cwd, path, sizeof(path));
+                        vput(cwd);
                         iprintf(&buf, &size, " %3i  %-13s %-18s %-s\n",
-                                p->p_pid, p->p_comm, parent, cwd);
+                                pid, comm, parent, path);
                 } else {
                         iprintf(&buf, &size, " %3i  %-13s %-18s -\n",
-                                p->p_pid, p->p_comm, parent);
+                                pid, comm, parent);
                 }
 #else
                 iprintf(&buf, &size, " %3i  %-13s %-s\n",
-                        p->p_pid, p->p_comm, parent);
+                        pid, comm, parent);
 #endif
-        } list_iterate_end();
+        }
         return size;
 }
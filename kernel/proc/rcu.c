@@ -0,0 +1,127 @@
+#include "kernel.h"
+#include "types.h"
+#include "globals.h"
+
+#include "main/interrupt.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+
+#include "proc/kthread.h"
+#include "proc/rcu.h"
+#include "proc/sched.h"
+#include "proc/workq.h"
+
+/*
+ * There is one processor and kernel threads are not preempted, so a
+ * thread is never switched out in the middle of a read-side section:
+ * by the next context switch, every reader which could have seen
+ * something unlinked before it has finished. Each sched_switch ends a
+ * grace period, and the callbacks queued before it are handed to a
+ * worker to run. A read-side section in an interrupt handler counts
+ * towards the interrupted thread's, and ends before the handler returns.
+ *
+ * The lists are only touched with interrupts masked, since call_rcu may
+ * come from an interrupt handler and sched_switch runs with them masked
+ * anyway. They are set up statically as sched_switch looks at them from
+ * the first context switch, before rcu_init has run.
+ */
+static uint32_t rcu_gp;                 /* grace periods which have ended */
+static list_t rcu_pending = { &rcu_pending, &rcu_pending };
+static list_t rcu_ready = { &rcu_ready, &rcu_ready };
+static work_t rcu_work;
+static int rcu_running;                 /* once there are workers */
+
+void
+rcu_read_lock(void)
+{
+        if (NULL != curthr)
+                curthr->kt_rcu_nesting++;
+}
+
+void
+rcu_read_unlock(void)
+{
+        if (NULL != curthr) {
+                KASSERT(0 < curthr->kt_rcu_nesting);
+                curthr->kt_rcu_nesting--;
+        }
+}
+
+void
+call_rcu(rcu_head_t *rh, void (*func)(rcu_head_t *rh))
+{
+        uint8_t oldipl = intr_getipl();
+
+        rh->rh_func = func;
+        intr_setipl(IPL_HIGH);
+        list_insert_tail(&rcu_pending, &rh->rh_link);
+        intr_setipl(oldipl);
+}
+
+void
+synchronize_rcu(void)
+{
+        KASSERT(0 == curthr->kt_rcu_nesting);
+
+        /* a context switch of our own is a grace period */
+        sched_make_runnable(curthr);
+        sched_switch();
+}
+
+uint32_t
+rcu_state(void)
+{
+        return rcu_gp;
+}
+
+int
+rcu_state_done(uint32_t state)
+{
+        return rcu_gp != state;
+}
+
+void
+rcu_quiescent(void)
+{
+        KASSERT(0 == curthr->kt_rcu_nesting && "slept in an RCU read-side section");
+        KASSERT(IPL_HIGH == intr_getipl());
+
+        rcu_gp++;
+        if (list_empty(&rcu_pending))
+                return;
+        while (!list_empty(&rcu_pending)) {
+                list_link_t *link = rcu_pending.l_next;
+                list_remove(link);
+                list_insert_tail(&rcu_ready, link);
+        }
+        if (rcu_running)
+                work_queue(&rcu_work);
+}
+
+static void
+rcu_run(work_t *w)
+{
+        uint8_t oldipl = intr_getipl();
+        rcu_head_t *rh;
+
+        intr_setipl(IPL_HIGH);
+        while (!list_empty(&rcu_ready)) {
+                rh = list_head(&rcu_ready, rcu_head_t, rh_link);
+                list_remove(&rh->rh_link);
+                intr_setipl(oldipl);
+                rh->rh_func(rh);
+                intr_setipl(IPL_HIGH);
+        }
+        intr_setipl(oldipl);
+}
+
+static __attribute__((unused)) void
+rcu_init(void)
+{
+        work_init(&rcu_work, rcu_run, NULL);
+        rcu_running = 1;
+}
+init_func(rcu_init);
+init_depends(workq_init);
@@ -1,22 +1,100 @@
 #include "globals.h"
 #include "errno.h"
+#include "config.h"
 
 #include "main/interrupt.h"
 
 #include "proc/sched.h"
 #include "proc/kthread.h"
+#include "proc/rcu.h"
+
+#include "mm/page.h"
 
 #include "util/init.h"
 #include "util/debug.h"
+#include "util/printf.h"
+#include "util/time.h"
+#include "util/counter.h"
+#include "util/trace.h"
+#include "util/tracepoint.h"
+
+/* One run queue per priority level; bit i of kt_runq_map is set exactly
+ * when kt_runq[i] is not empty, so the level to run next is its lowest
+ * set bit */
+static ktqueue_t kt_runq[SCHED_NPRIO];
+static uint32_t kt_runq_map = 0;
+
+/* The queues handed out by sched_waitq */
+#define SCHED_WAITQ_SHIFT       7
+static ktqueue_t sched_waitqs[1 << SCHED_WAITQ_SHIFT];
+
+/* Load counters for the (only) processor, see sched_info */
+static counter_t sched_nswitches;     /* context switches */
+static counter_t sched_nwakeups;      /* threads made runnable */
+static counter_t sched_nidle;         /* waits for an interrupt with
+                                       * nothing to run */
+static counter_t sched_nvoluntary;    /* yields in cond_resched */
+static counter_t sched_idle_ns;       /* spent with nothing to run */
+
+/* Waits from being made runnable to running, by what was slept on, and
+ * the run queue depths they started from, see sched_lat_info. Only
+ * touched at IPL_HIGH. */
+static uint32_t sched_lat_hist[SCHED_WQ_NCLASSES][SCHED_LAT_BUCKETS];
+static uint64_t sched_lat_ns[SCHED_WQ_NCLASSES];
+static uint32_t sched_depth_hist[SCHED_DEPTH_BUCKETS];
+static int sched_depth_max;
+
+static const char *sched_wq_names[SCHED_WQ_NCLASSES] = {
+        "other", "disk", "tty", "pframe", "alloc", "preempt"
+};
+
+/* When time was last charged to the running thread, see sched_charge */
+static uint64_t sched_charged_at;
+static void sched_charge(int user);
+
+#ifdef __UPREEMPT__
+/* Fires when the running thread's quantum is up; only armed while some
+ * other thread is runnable, see sched_arm_quantum */
+static ktimer_t sched_quantum;
+static int sched_need_resched = 0;
 
-static ktqueue_t kt_runq;
+static void
+sched_quantum_expired(ktimer_t *t)
+{
+    sched_need_resched = 1;
+}
+
+static void
+sched_arm_quantum(void)
+{
+    if (!timer_pending(&sched_quantum) && !sched_need_resched) {
+        timer_add(&sched_quantum, SCHED_QUANTUM_TICKS * TICK_MSECS);
+    }
+}
+#endif
 
 static __attribute__((unused)) void
 sched_init(void)
 {
-        sched_queue_init(&kt_runq);
+        int i;
+        for (i = 0; i < SCHED_NPRIO; i++) {
+                sched_queue_init(&kt_runq[i]);
+        }
+        for (i = 0; i < (1 << SCHED_WAITQ_SHIFT); i++) {
+                sched_queue_init(&sched_waitqs[i]);
+                sched_queue_class(&sched_waitqs[i], SCHED_WQ_PFRAME);
+        }
+        counter_register(&sched_nswitches, "sched.switches");
+        counter_register(&sched_nwakeups, "sched.wakeups");
+        counter_register(&sched_nidle, "sched.idle");
+        counter_register(&sched_nvoluntary, "sched.voluntary");
+        counter_register(&sched_idle_ns, "sched.idle_ns");
+#ifdef __UPREEMPT__
+        timer_init(&sched_quantum, sched_quantum_expired, NULL);
+#endif
 }
 init_func(sched_init);
+init_depends(time_init);
 
 
 
@@ -55,6 +133,7 @@ ktqueue_dequeue(ktqueue_t *q)
         thr = list_item(link, kthread_t, kt_qlink);
         list_remove(link);
         thr->kt_wchan = NULL;
+        thr->kt_exclusive = 0;
 
         q->tq_size--;
 
@@ -73,15 +152,65 @@ ktqueue_remove(ktqueue_t *q, kthread_t *thr)
         KASSERT(thr->kt_qlink.l_next && thr->kt_qlink.l_prev);
         list_remove(&thr->kt_qlink);
         thr->kt_wchan = NULL;
+        thr->kt_exclusive = 0;
         q->tq_size--;
 }
 
+/**
+ * Puts a thread on the run queue of its level. Must be called at
+ * IPL_HIGH.
+ *
+ * @param thr the thread
+ */
+static void
+runq_enqueue(kthread_t *thr)
+{
+        KASSERT(0 <= thr->kt_prio && thr->kt_prio < SCHED_NPRIO);
+        KASSERT(thr->kt_cpumask & SCHED_CPUS_ONLINE);
+        ktqueue_enqueue(&kt_runq[thr->kt_prio], thr);
+        kt_runq_map |= 1 << thr->kt_prio;
+}
+
+/* The histogram bucket of x, see SCHED_LAT_BUCKETS */
+static int
+sched_bucket(uint64_t x, int nbuckets)
+{
+        int b = 0;
+
+        while (b < nbuckets - 1 && (x >> (b + 1)) != 0)
+                b++;
+        return b;
+}
+
+/**
+ * Makes a thread which was just taken off the queue it slept on runnable.
+ *
+ * @param thr the thread
+ */
+static void
+sched_wake(kthread_t *thr)
+{
+        /* it was waiting rather than computing, so let it in sooner */
+        if (thr->kt_prio > SCHED_PRIO_WAKEUP)
+                thr->kt_prio--;
+        thr->kt_state = KT_RUN;
+        sched_make_runnable(thr);
+}
+
 /*** PUBLIC KTQUEUE MANIPULATION FUNCTIONS ***/
 void
 sched_queue_init(ktqueue_t *q)
 {
         list_init(&q->tq_list);
         q->tq_size = 0;
+        q->tq_class = SCHED_WQ_OTHER;
+}
+
+void
+sched_queue_class(ktqueue_t *q, int class)
+{
+        KASSERT(0 <= class && class < SCHED_WQ_NCLASSES);
+        q->tq_class = class;
 }
 
 int
@@ -90,6 +219,14 @@ sched_queue_empty(ktqueue_t *q)
         return list_empty(&q->tq_list);
 }
 
+ktqueue_t *
+sched_waitq(const void *obj)
+{
+        /* multiplicative hashing, since the low bits of the addresses of
+         * slab objects hardly vary */
+        return &sched_waitqs[((uintptr_t)obj * 0x9e3779b9) >> (32 - SCHED_WAITQ_SHIFT)];
+}
+
 /*
  * Updates the thread's state and enqueues it on the given
  * queue. Returns when the thread has been woken up with wakeup_on or
@@ -105,9 +242,10 @@ sched_sleep_on(ktqueue_t *q)
 
     KASSERT(curproc->p_pid == PID_IDLE || curthr->kt_state == KT_RUN);
     curthr->kt_state = KT_SLEEP;
+    curthr->kt_wclass = q->tq_class;
 
     ktqueue_enqueue(q, curthr);
-    dbg(DBG_PROC, "%s begins to (normal) sleep on some queue %p.\n", curproc->p_comm, q);
+    tpdbg(DBG_PROC, "%s begins to (normal) sleep on some queue %p.\n", curproc->p_comm, q);
 
     sched_switch();
 
@@ -123,6 +261,35 @@ sched_sleep_on(ktqueue_t *q)
 }
 
 
+/*
+ * Like sched_sleep_on, but sched_wakeup_n only wakes as many exclusive
+ * waiters as it is asked to. A waiter which was woken but is going to exit
+ * because it was cancelled passes the wakeup on to the next.
+ */
+void
+sched_sleep_on_exclusive(ktqueue_t *q)
+{
+    KASSERT(NULL != curthr);
+    KASSERT(NULL != q);
+
+    KASSERT(curproc->p_pid == PID_IDLE || curthr->kt_state == KT_RUN);
+    curthr->kt_state = KT_SLEEP;
+    curthr->kt_wclass = q->tq_class;
+
+    ktqueue_enqueue(q, curthr);
+    curthr->kt_exclusive = 1;
+    tpdbg(DBG_PROC, "%s begins to (exclusive) sleep on some queue %p.\n", curproc->p_comm, q);
+
+    sched_switch();
+
+    KASSERT(curthr->kt_state == KT_RUN);
+
+    if (curthr->kt_cancelled == 1) {
+        sched_wakeup_n(q, 1);
+        kthread_exit((void *)curproc->p_status);
+    }
+}
+
 /*
  * Similar to sleep on, but the sleep can be cancelled.
  *
@@ -138,9 +305,10 @@ sched_cancellable_sleep_on(ktqueue_t *q)
 
     KASSERT(curproc->p_pid == PID_IDLE || curthr->kt_state == KT_RUN);
     curthr->kt_state = KT_SLEEP_CANCELLABLE;
+    curthr->kt_wclass = q->tq_class;
 
     ktqueue_enqueue(q, curthr);
-    dbg(DBG_PROC, "%s begins to (cancellable) sleep on some queue %p.\n", curproc->p_comm, q);
+    tpdbg(DBG_PROC, "%s begins to (cancellable) sleep on some queue %p.\n", curproc->p_comm, q);
     sched_switch();
 
     /*it should already be set to KT_RUN when it's added to runq*/
@@ -156,6 +324,58 @@ sched_cancellable_sleep_on(ktqueue_t *q)
         /*NOT_YET_IMPLEMENTED("PROCS: sched_cancellable_sleep_on");*/
 }
 
+/*
+ * What sched_sleep_on_timeout's timer needs to pull the thread back off
+ * the queue
+ */
+typedef struct sleep_timeout {
+    kthread_t *st_thr;
+    ktqueue_t *st_q;
+    int st_expired;
+} sleep_timeout_t;
+
+static void
+sched_sleep_expired(ktimer_t *t)
+{
+    sleep_timeout_t *st = (sleep_timeout_t *)t->t_data;
+
+    /*it may have been woken (or cancelled) just before the timer fired*/
+    if (st->st_thr->kt_wchan == st->st_q) {
+        ktqueue_remove(st->st_q, st->st_thr);
+        st->st_expired = 1;
+        sched_make_runnable(st->st_thr);
+    }
+}
+
+int
+sched_sleep_on_timeout(ktqueue_t *q, uint32_t msecs)
+{
+    KASSERT(NULL != curthr);
+    KASSERT(NULL != q);
+
+    sleep_timeout_t st;
+    ktimer_t t;
+    int ret;
+
+    st.st_thr = curthr;
+    st.st_q = q;
+    st.st_expired = 0;
+    timer_init(&t, sched_sleep_expired, &st);
+
+    /*the timer must not fire before we are on the queue*/
+    uint8_t old_ipl = intr_getipl();
+    intr_setipl(IPL_HIGH);
+    timer_add(&t, msecs);
+    ret = sched_cancellable_sleep_on(q);
+    timer_cancel(&t);
+    intr_setipl(old_ipl);
+
+    if (ret < 0) {
+        return ret;
+    }
+    return st.st_expired ? -ETIME : 0;
+}
+
 kthread_t *
 sched_wakeup_on(ktqueue_t *q)
 {
@@ -164,13 +384,42 @@ sched_wakeup_on(ktqueue_t *q)
 
     kthread_t *kthr_tmp = ktqueue_dequeue(q);
     if (NULL != kthr_tmp) {
-        kthr_tmp->kt_state = KT_RUN;
-        sched_make_runnable(kthr_tmp);
+        sched_wake(kthr_tmp);
     }
     return kthr_tmp;
         /*NOT_YET_IMPLEMENTED("PROCS: sched_wakeup_on");*/
 }
 
+int
+sched_wakeup_n(ktqueue_t *q, int n)
+{
+    KASSERT(NULL != q);
+    KASSERT(NULL != curthr);
+    KASSERT(0 <= n);
+
+    kthread_t *thr;
+    int nwoken = 0;
+
+    uint8_t old_ipl = intr_getipl();
+    intr_setipl(IPL_HIGH);
+
+    /*oldest first, threads are queued at the head*/
+    list_iterate_reverse(&q->tq_list, thr, kthread_t, kt_qlink) {
+        if (thr->kt_exclusive) {
+            if (0 == n) {
+                continue;
+            }
+            n--;
+        }
+        ktqueue_remove(q, thr);
+        sched_wake(thr);
+        nwoken++;
+    } list_iterate_end();
+
+    intr_setipl(old_ipl);
+    return nwoken;
+}
+
 void
 sched_broadcast_on(ktqueue_t *q)
 {
@@ -183,6 +432,56 @@ sched_broadcast_on(ktqueue_t *q)
         /*NOT_YET_IMPLEMENTED("PROCS: sched_broadcast_on");*/
 }
 
+void
+sched_broadcast_urgent(ktqueue_t *q)
+{
+    KASSERT(NULL != q);
+    KASSERT(NULL != curthr);
+
+    kthread_t *thr;
+    while (NULL != (thr = ktqueue_dequeue(q))) {
+        thr->kt_prio = SCHED_PRIO_URGENT;
+        sched_make_runnable(thr);
+    }
+}
+
+void
+sched_set_prio(kthread_t *thr, int prio)
+{
+    KASSERT(0 <= prio && prio < SCHED_NPRIO);
+
+    uint8_t old_ipl = intr_getipl();
+    intr_setipl(IPL_HIGH);
+
+    /*a runnable thread has to move to its new level's queue*/
+    if (thr != curthr && KT_RUN == thr->kt_state) {
+        KASSERT(thr->kt_wchan == &kt_runq[thr->kt_prio]);
+        ktqueue_remove(thr->kt_wchan, thr);
+        if (sched_queue_empty(&kt_runq[thr->kt_prio])) {
+            kt_runq_map &= ~(1 << thr->kt_prio);
+        }
+        thr->kt_prio = prio;
+        /*still the same wait, so neither timed nor counted again*/
+        runq_enqueue(thr);
+    } else {
+        thr->kt_prio = prio;
+    }
+
+    intr_setipl(old_ipl);
+}
+
+int
+sched_set_affinity(kthread_t *thr, uint32_t mask)
+{
+    /*the one run queue is the boot CPU's, which every mask must allow
+     *for the thread to be runnable, so there is nowhere to move it*/
+    if (0 == (mask & SCHED_CPUS_ONLINE)) {
+        return -EINVAL;
+    }
+    thr->kt_cpumask = mask & SCHED_CPUS_ONLINE;
+    return 0;
+}
+
 /*
  * If the thread's sleep is cancellable, we set the kt_cancelled
  * flag and remove it from the queue. Otherwise, we just set the
@@ -259,20 +558,58 @@ sched_switch(void)
     uint8_t old_ipl = intr_getipl();
     intr_setipl(IPL_HIGH);
 
+    /*every RCU reader has finished, see proc/rcu.c*/
+    rcu_quiescent();
+
+    /*the time waiting for something to run is nobody's*/
+    sched_charge(0);
+
     /*no threads on the run queue*/
-    while (sched_queue_empty(&kt_runq)) {
+    while (0 == kt_runq_map) {
+        /*a page at a time, so that a wakeup does not wait long*/
+        if (page_zero_idle()) {
+            /*let in whatever interrupt came meanwhile*/
+            intr_setipl(IPL_LOW);
+            intr_setipl(IPL_HIGH);
+            continue;
+        }
+        counter_inc(&sched_nidle);
         intr_disable();
         intr_setipl(IPL_LOW);
         intr_wait();
         intr_setipl(IPL_HIGH);
     }
+    uint64_t now = time_now_ns();
+    counter_add(&sched_idle_ns, now - sched_charged_at);
+    sched_charged_at = now;
 
     /*extract a thread from runq*/
     kthread_t *old_kthr = curthr;
-    curthr = ktqueue_dequeue(&kt_runq);
+    int prio = __builtin_ctz(kt_runq_map);
+    curthr = ktqueue_dequeue(&kt_runq[prio]);
+    if (sched_queue_empty(&kt_runq[prio])) {
+        kt_runq_map &= ~(1 << prio);
+    }
     curproc = curthr->kt_proc;
+    counter_inc(&sched_nswitches);
+
+    /*how long it waited to be picked*/
+    uint64_t lat = now - curthr->kt_runq_at;
+    int b = sched_bucket(lat, SCHED_LAT_BUCKETS);
+    sched_lat_hist[curthr->kt_wclass][b]++;
+    sched_lat_ns[curthr->kt_wclass] += lat;
+    curproc->p_sched_lat[b]++;
+    curthr->kt_wclass = SCHED_WQ_OTHER;
+#ifdef __UPREEMPT__
+    /*a fresh quantum, but no timer at all if nothing else wants to run*/
+    timer_cancel(&sched_quantum);
+    sched_need_resched = 0;
+    if (0 != kt_runq_map) {
+        sched_arm_quantum();
+    }
+#endif
 
-    dbg(DBG_SCHED, "Switching: %s -> %s\n", old_kthr->kt_proc->p_comm, curproc->p_comm);
+    trace_emit(TRACE_SWITCH, old_kthr->kt_proc->p_pid, curproc->p_pid, 0);
 
     /*do the switching*/
     context_switch(&old_kthr->kt_ctx, &curthr->kt_ctx);
@@ -280,7 +617,7 @@ sched_switch(void)
     /*unblock interrupts*/
     intr_setipl(old_ipl);
 
-    dbg(DBG_SCHED, "Going back to proc: %s\n", curproc->p_comm);
+    tpdbg(DBG_SCHED, "Going back to proc: %s\n", curproc->p_comm);
 
     /*
      *if (curthr->kt_cancelled == 1 && curproc->p_pid != PID_INIT) {
@@ -313,10 +650,176 @@ sched_make_runnable(kthread_t *thr)
 
     /*set it to KT_RUN state*/
     thr->kt_state = KT_RUN;
+    /*timed from here until sched_switch picks it*/
+    thr->kt_runq_at = time_now_ns();
+    if (thr == curthr) {
+        thr->kt_wclass = SCHED_WQ_PREEMPT;
+    }
     /*Add it to the runq*/
-    ktqueue_enqueue(&kt_runq, thr);
+    runq_enqueue(thr);
+    int depth = sched_runnable();
+    sched_depth_hist[sched_bucket(depth, SCHED_DEPTH_BUCKETS)]++;
+    if (depth > sched_depth_max) {
+        sched_depth_max = depth;
+    }
+#ifdef __UPREEMPT__
+    /*the running thread now has someone to share with*/
+    if (thr != curthr) {
+        sched_arm_quantum();
+    }
+#endif
+    counter_inc(&sched_nwakeups);
 
     intr_setipl(old_ipl);
     return;
         /*NOT_YET_IMPLEMENTED("PROCS: sched_make_runnable");*/
 }
+
+int
+cond_resched(void)
+{
+    /*a thread at a better level was woken, or (UPREEMPT) the time is up*/
+    int want = (0 != kt_runq_map && __builtin_ctz(kt_runq_map) < curthr->kt_prio);
+#ifdef __UPREEMPT__
+    want = want || (sched_need_resched && 0 != kt_runq_map);
+#endif
+    if (!want) {
+        return 0;
+    }
+    counter_inc(&sched_nvoluntary);
+    sched_make_runnable(curthr);
+    sched_switch();
+    return 1;
+}
+
+#ifdef __UPREEMPT__
+/*
+ * The interrupted thread was in userland, so it holds nothing in the kernel
+ * and can be put at the back of the run queue like any other. It used its
+ * whole quantum, so it goes down a level first; if nothing at that level or
+ * above is runnable it just gets a fresh quantum.
+ */
+void
+sched_preempt(void)
+{
+    if (!sched_need_resched) {
+        return;
+    }
+    if (curthr->kt_prio < SCHED_NPRIO - 1) {
+        curthr->kt_prio++;
+    }
+    if (0 == kt_runq_map || __builtin_ctz(kt_runq_map) > curthr->kt_prio) {
+        sched_need_resched = 0;
+        if (0 != kt_runq_map) {
+            sched_arm_quantum();
+        }
+        return;
+    }
+    sched_make_runnable(curthr);
+    sched_switch();
+
+    /*it is about to go back to userland, where it would never notice*/
+    if (curthr->kt_cancelled) {
+        kthread_exit(curthr->kt_retval);
+    }
+}
+#endif
+
+/*
+ * The running thread is charged for the time since the last charge at
+ * every boundary between its running in userland and in the kernel, and
+ * when it is switched away from, which is always in the kernel. An
+ * interrupt taken in the kernel is charged to whatever it interrupted.
+ */
+static void
+sched_charge(int user)
+{
+        uint64_t now = time_now_ns(), ns = now - sched_charged_at;
+
+        sched_charged_at = now;
+        if (user) {
+                curthr->kt_utime += ns;
+                curproc->p_utime += ns;
+        } else {
+                curthr->kt_stime += ns;
+                curproc->p_stime += ns;
+        }
+}
+
+void
+sched_acct_trap(void)
+{
+        sched_charge(1);
+}
+
+void
+sched_acct_untrap(void)
+{
+        sched_charge(0);
+}
+
+int
+sched_runnable(void)
+{
+        int i, nrun = 0;
+
+        for (i = 0; i < SCHED_NPRIO; i++) {
+                nrun += kt_runq[i].tq_size;
+        }
+        return nrun;
+}
+
+size_t
+sched_info(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+        int i, nrun = sched_runnable();
+
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "cpu  runnable   switches    wakeups  idle waits\n");
+        iprintf(&buf, &size, "%3d %9d %10llu %10llu %11llu\n", 0, nrun,
+                sched_nswitches.c_value, sched_nwakeups.c_value, sched_nidle.c_value);
+        iprintf(&buf, &size, "runnable by level:");
+        for (i = 0; i < SCHED_NPRIO; i++) {
+                iprintf(&buf, &size, " %d", kt_runq[i].tq_size);
+        }
+        iprintf(&buf, &size, "\n");
+        return osize - size;
+}
+
+size_t
+sched_lat_info(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+        uint32_t n;
+        int c, b;
+
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "wakeup to run, by what was slept on:\n");
+        iprintf(&buf, &size, "class      wakeups  mean_ns log2(ns):wakeups...\n");
+        for (c = 0; c < SCHED_WQ_NCLASSES; c++) {
+                for (n = 0, b = 0; b < SCHED_LAT_BUCKETS; b++) {
+                        n += sched_lat_hist[c][b];
+                }
+                if (0 == n)
+                        continue;
+                iprintf(&buf, &size, "%-8s %9u %8llu", sched_wq_names[c], n,
+                        sched_lat_ns[c] / n);
+                for (b = 0; b < SCHED_LAT_BUCKETS; b++) {
+                        if (0 != sched_lat_hist[c][b])
+                                iprintf(&buf, &size, " %d:%u", b, sched_lat_hist[c][b]);
+                }
+                iprintf(&buf, &size, "\n");
+        }
+
+        iprintf(&buf, &size, "runnable when one was made so (at most %d), "
+                "log2(threads):times...\n", sched_depth_max);
+        for (b = 0; b < SCHED_DEPTH_BUCKETS; b++) {
+                if (0 != sched_depth_hist[b])
+                        iprintf(&buf, &size, " %d:%u", b, sched_depth_hist[b]);
+        }
+        iprintf(&buf, &size, "\n");
+        return osize - size;
+}
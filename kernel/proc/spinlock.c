@@ -0,0 +1,127 @@
+#include "types.h"
+#include "globals.h"
+
+#include "util/debug.h"
+
+#include "main/apic.h"
+#include "main/interrupt.h"
+
+#include "proc/spinlock.h"
+
+static uint32_t
+spin_xchg(volatile uint32_t *p, uint32_t val)
+{
+        __asm__ volatile("xchgl %0, %1"
+                         : "+r"(val), "+m"(*p)
+                         :
+                         : "memory");
+        return val;
+}
+
+static void
+spin_relax(void)
+{
+        __asm__ volatile("pause" : : : "memory");
+}
+
+void
+spinlock_init(spinlock_t *lock)
+{
+        lock->sl_locked = 0;
+}
+
+/*
+ * Only the bootstrap processor runs (see apic_cpu_count), so for now a
+ * lock found held here can never be released: whoever holds it is either
+ * this thread or a thread this interrupt handler stopped.
+ */
+void
+spinlock_lock(spinlock_t *lock)
+{
+        while (spin_xchg(&lock->sl_locked, 1)) {
+                KASSERT(apic_cpu_count() > 1 && "spinlock deadlock");
+                while (lock->sl_locked)
+                        spin_relax();
+        }
+}
+
+void
+spinlock_unlock(spinlock_t *lock)
+{
+        KASSERT(lock->sl_locked);
+        spin_xchg(&lock->sl_locked, 0);
+}
+
+uint8_t
+spinlock_lock_irqsave(spinlock_t *lock)
+{
+        uint8_t ipl = intr_getipl();
+        intr_setipl(IPL_HIGH);
+        spinlock_lock(lock);
+        return ipl;
+}
+
+void
+spinlock_unlock_irqrestore(spinlock_t *lock, uint8_t ipl)
+{
+        spinlock_unlock(lock);
+        intr_setipl(ipl);
+}
+
+void
+rwlock_init(rwlock_t *rw)
+{
+        spinlock_init(&rw->rw_lock);
+        rw->rw_readers = 0;
+        rw->rw_writer = 0;
+}
+
+void
+rwlock_read_lock(rwlock_t *rw)
+{
+        while (1) {
+                spinlock_lock(&rw->rw_lock);
+                if (!rw->rw_writer) {
+                        rw->rw_readers++;
+                        spinlock_unlock(&rw->rw_lock);
+                        return;
+                }
+                spinlock_unlock(&rw->rw_lock);
+                KASSERT(apic_cpu_count() > 1 && "rwlock deadlock");
+                spin_relax();
+        }
+}
+
+void
+rwlock_read_unlock(rwlock_t *rw)
+{
+        spinlock_lock(&rw->rw_lock);
+        KASSERT(rw->rw_readers > 0);
+        rw->rw_readers--;
+        spinlock_unlock(&rw->rw_lock);
+}
+
+void
+rwlock_write_lock(rwlock_t *rw)
+{
+        while (1) {
+                spinlock_lock(&rw->rw_lock);
+                if (!rw->rw_writer && 0 == rw->rw_readers) {
+                        rw->rw_writer = 1;
+                        spinlock_unlock(&rw->rw_lock);
+                        return;
+                }
+                spinlock_unlock(&rw->rw_lock);
+                KASSERT(apic_cpu_count() > 1 && "rwlock deadlock");
+                spin_relax();
+        }
+}
+
+void
+rwlock_write_unlock(rwlock_t *rw)
+{
+        spinlock_lock(&rw->rw_lock);
+        KASSERT(rw->rw_writer);
+        rw->rw_writer = 0;
+        spinlock_unlock(&rw->rw_lock);
+}
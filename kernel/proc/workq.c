@@ -0,0 +1,173 @@
+#include "kernel.h"
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "main/interrupt.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/kthread.h"
+#include "proc/workq.h"
+
+/*
+ * There is one processor, so one queue, shared by the workers. There are
+ * a few of them so that an item which sleeps does not hold up the rest.
+ * The queue is looked at with interrupts masked, since interrupt
+ * handlers and softirqs queue work too.
+ */
+#define WORKQ_NWORKERS  3
+
+static list_t workq_pending;
+static int workq_running;       /* items which workers are running */
+static ktqueue_t workq_waitq;   /* idle workers */
+static ktqueue_t workq_flushq;  /* threads in workq_flush */
+static kthread_t *workq_workers[WORKQ_NWORKERS];
+
+void
+work_init(work_t *w, void (*func)(work_t *), void *data)
+{
+        w->w_func = func;
+        w->w_data = data;
+        list_link_init(&w->w_link);
+}
+
+int
+work_queue(work_t *w)
+{
+        uint8_t oldipl = intr_getipl();
+        int queued = 0;
+
+        intr_setipl(IPL_HIGH);
+        if (!list_link_is_linked(&w->w_link)) {
+                list_insert_tail(&workq_pending, &w->w_link);
+                sched_wakeup_on(&workq_waitq);
+                queued = 1;
+        }
+        intr_setipl(oldipl);
+        return queued;
+}
+
+int
+work_cancel(work_t *w)
+{
+        uint8_t oldipl = intr_getipl();
+        int pending = 0;
+
+        intr_setipl(IPL_HIGH);
+        if (list_link_is_linked(&w->w_link)) {
+                list_remove(&w->w_link);
+                pending = 1;
+                if (list_empty(&workq_pending) && 0 == workq_running)
+                        sched_broadcast_on(&workq_flushq);
+        }
+        intr_setipl(oldipl);
+        return pending;
+}
+
+static int
+workq_isworker(kthread_t *thr)
+{
+        int i;
+        for (i = 0; i < WORKQ_NWORKERS; i++) {
+                if (thr == workq_workers[i])
+                        return 1;
+        }
+        return 0;
+}
+
+void
+workq_flush(void)
+{
+        uint8_t oldipl = intr_getipl();
+
+        KASSERT(!workq_isworker(curthr) && "a work item would wait on itself");
+        intr_setipl(IPL_HIGH);
+        while (!list_empty(&workq_pending) || 0 != workq_running)
+                sched_sleep_on(&workq_flushq);
+        intr_setipl(oldipl);
+}
+
+static void *
+workq_worker_run(int arg1, void *arg2)
+{
+        uint8_t oldipl = intr_getipl();
+
+        while (1) {
+                work_t *w;
+                int err = 0;
+
+                /* Nothing can be queued in between looking and sleeping;
+                 * a cancellable sleep does not look before sleeping */
+                intr_setipl(IPL_HIGH);
+                while (0 == err && !curthr->kt_cancelled && list_empty(&workq_pending))
+                        err = sched_cancellable_sleep_on(&workq_waitq);
+                if (list_empty(&workq_pending)) {
+                        intr_setipl(oldipl);
+                        kthread_exit((void *)0);
+                }
+
+                w = list_head(&workq_pending, work_t, w_link);
+                list_remove(&w->w_link);
+                workq_running++;
+                intr_setipl(oldipl);
+
+                /* w may be freed, or queued again, from here */
+                w->w_func(w);
+
+                intr_setipl(IPL_HIGH);
+                workq_running--;
+                if (list_empty(&workq_pending) && 0 == workq_running)
+                        sched_broadcast_on(&workq_flushq);
+                intr_setipl(oldipl);
+        }
+        return NULL;
+}
+
+static __attribute__((unused)) void
+workq_init(void)
+{
+        int i;
+
+        list_init(&workq_pending);
+        workq_running = 0;
+        sched_queue_init(&workq_waitq);
+        sched_queue_init(&workq_flushq);
+
+        KASSERT(curproc && (PID_IDLE == curproc->p_pid)
+                && "should be calling this from idleproc");
+        for (i = 0; i < WORKQ_NWORKERS; i++) {
+                proc_t *p = proc_create("kworker");
+                KASSERT(NULL != p);
+                workq_workers[i] = kthread_create(p, workq_worker_run, i, NULL);
+                KASSERT(NULL != workq_workers[i]);
+                sched_set_affinity(workq_workers[i], SCHED_HOUSEKEEPING_CPUS);
+                sched_make_runnable(workq_workers[i]);
+        }
+}
+init_func(workq_init);
+init_depends(sched_init);
+
+void
+workq_shutdown(void)
+{
+        int i;
+
+        KASSERT(PID_IDLE == curproc->p_pid);
+        workq_flush();
+        for (i = 0; i < WORKQ_NWORKERS; i++) {
+                kthread_t *thr = workq_workers[i];
+                pid_t pid, child;
+                if (NULL == thr)
+                        continue;
+                pid = thr->kt_proc->p_pid;
+                workq_workers[i] = NULL;
+                kthread_cancel(thr, (void *)0);
+                child = do_waitpid(pid, 0, NULL);
+                KASSERT(pid == child);
+        }
+}
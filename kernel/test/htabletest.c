@@ -0,0 +1,191 @@
+#include "kernel.h"
+#include "types.h"
+
+#include "test/usertest.h"
+
+#include "util/debug.h"
+#include "util/hash.h"
+#include "util/list.h"
+
+/*
+ * Tests of the growable hash tables of util/hash.h, run from the kshell
+ * "htabletest" command. Like vfstest, they report to the debug log.
+ */
+
+/* Enough items for the table to grow several times */
+#define HTABLETEST_NITEMS       200
+/* Items which share each hash in the colliding tests */
+#define HTABLETEST_COLLIDE      4
+
+typedef struct htabletest_item {
+        int             hti_key;
+        htable_link_t   hti_link;
+} htabletest_item_t;
+
+static htabletest_item_t htabletest_items[HTABLETEST_NITEMS];
+
+/* The hash of key, which all HTABLETEST_COLLIDE keys in a row share if
+ * collide is set */
+static uint32_t
+htabletest_hash(int key, int collide)
+{
+        return hash_u32(collide ? key / HTABLETEST_COLLIDE : key);
+}
+
+static htabletest_item_t *
+htabletest_lookup(htable_t *ht, int key, int collide)
+{
+        htabletest_item_t *item;
+
+        htable_iterate_begin(ht, htabletest_hash(key, collide), item,
+                             htabletest_item_t, hti_link) {
+                if (item->hti_key == key)
+                        return item;
+        } htable_iterate_end();
+        return NULL;
+}
+
+/* Inserts the first n items and checks that every one is then found */
+static void
+htabletest_fill(htable_t *ht, int n, int collide)
+{
+        int i;
+
+        for (i = 0; i < n; i++) {
+                htabletest_items[i].hti_key = i;
+                list_link_init(&htabletest_items[i].hti_link.hl_link);
+                htable_insert(ht, &htabletest_items[i].hti_link, htabletest_hash(i, collide));
+        }
+        test_assert((uint32_t)n == ht->ht_count, NULL);
+
+        for (i = 0; i < n; i++) {
+                test_assert(&htabletest_items[i] == htabletest_lookup(ht, i, collide),
+                            "key %d", i);
+        }
+        test_assert(NULL == htabletest_lookup(ht, n, collide), NULL);
+}
+
+/* Checks that each item is in the bucket its hash picks */
+static void
+htabletest_check_buckets(htable_t *ht)
+{
+        htable_link_t *link;
+        uint32_t i, count = 0;
+
+        for (i = 0; i <= ht->ht_mask; i++) {
+                list_iterate_begin(&ht->ht_buckets[i], link, htable_link_t, hl_link) {
+                        test_assert(i == (link->hl_hash & ht->ht_mask),
+                                    "hash 0x%x in bucket %u", link->hl_hash, i);
+                        count++;
+                } list_iterate_end();
+        }
+        test_assert(ht->ht_count == count, NULL);
+}
+
+static void
+htabletest_empty(htable_t *ht, int n)
+{
+        int i;
+
+        for (i = 0; i < n; i++) {
+                if (list_link_is_linked(&htabletest_items[i].hti_link.hl_link))
+                        htable_remove(ht, &htabletest_items[i].hti_link);
+        }
+        test_assert(0 == ht->ht_count, NULL);
+}
+
+static void
+htabletest_grow(void)
+{
+        htable_t ht;
+
+        htable_init(&ht);
+        test_assert(&ht.ht_bucket0 == ht.ht_buckets, NULL);
+        test_assert(0 == ht.ht_mask, NULL);
+
+        /* one bucket holds HTABLE_LOAD items before the table grows */
+        htabletest_fill(&ht, HTABLE_LOAD, 0);
+        test_assert(&ht.ht_bucket0 == ht.ht_buckets, NULL);
+        htabletest_items[HTABLE_LOAD].hti_key = HTABLE_LOAD;
+        list_link_init(&htabletest_items[HTABLE_LOAD].hti_link.hl_link);
+        htable_insert(&ht, &htabletest_items[HTABLE_LOAD].hti_link,
+                      htabletest_hash(HTABLE_LOAD, 0));
+        test_assert(&ht.ht_bucket0 != ht.ht_buckets, "grew out of ht_bucket0");
+        test_assert(1 == ht.ht_mask, NULL);
+        htabletest_empty(&ht, HTABLE_LOAD + 1);
+
+        htabletest_fill(&ht, HTABLETEST_NITEMS, 0);
+        test_assert(ht.ht_count <= HTABLE_LOAD * (ht.ht_mask + 1), NULL);
+        test_assert(0 == ((ht.ht_mask + 1) & ht.ht_mask), "a power of two of buckets");
+        htabletest_check_buckets(&ht);
+
+        htabletest_empty(&ht, HTABLETEST_NITEMS);
+        htable_destroy(&ht);
+        test_assert(&ht.ht_bucket0 == ht.ht_buckets, NULL);
+        test_assert(0 == ht.ht_mask, NULL);
+        test_assert(0 == ht.ht_count, NULL);
+}
+
+static void
+htabletest_collide(void)
+{
+        htabletest_item_t *item;
+        htable_t ht;
+        int i, key, found;
+
+        htable_init(&ht);
+        htabletest_fill(&ht, HTABLETEST_NITEMS, 1);
+        htabletest_check_buckets(&ht);
+
+        /* a walk by hash sees just the items with that hash */
+        for (key = 0; key < HTABLETEST_NITEMS; key += HTABLETEST_COLLIDE) {
+                found = 0;
+                htable_iterate_begin(&ht, htabletest_hash(key, 1), item,
+                                     htabletest_item_t, hti_link) {
+                        test_assert(key / HTABLETEST_COLLIDE
+                                    == item->hti_key / HTABLETEST_COLLIDE,
+                                    "key %d for %d", item->hti_key, key);
+                        found++;
+                } htable_iterate_end();
+                test_assert(HTABLETEST_COLLIDE == found, "%d for key %d", found, key);
+        }
+
+        /* taking out the odd keys on the way past leaves the even ones */
+        for (key = 0; key < HTABLETEST_NITEMS; key += HTABLETEST_COLLIDE) {
+                htable_iterate_begin(&ht, htabletest_hash(key, 1), item,
+                                     htabletest_item_t, hti_link) {
+                        if (item->hti_key & 1)
+                                htable_remove(&ht, &item->hti_link);
+                } htable_iterate_end();
+        }
+        test_assert(HTABLETEST_NITEMS / 2 == ht.ht_count, NULL);
+        for (i = 0; i < HTABLETEST_NITEMS; i++) {
+                item = htabletest_lookup(&ht, i, 1);
+                test_assert((i & 1) ? NULL == item : &htabletest_items[i] == item,
+                            "key %d", i);
+        }
+        htabletest_check_buckets(&ht);
+
+        /* and taking out every one in a walk empties its hash */
+        for (key = 0; key < HTABLETEST_NITEMS; key += HTABLETEST_COLLIDE) {
+                htable_iterate_begin(&ht, htabletest_hash(key, 1), item,
+                                     htabletest_item_t, hti_link) {
+                        htable_remove(&ht, &item->hti_link);
+                } htable_iterate_end();
+                test_assert(NULL == htabletest_lookup(&ht, key, 1), "key %d", key);
+        }
+        test_assert(0 == ht.ht_count, NULL);
+
+        htable_destroy(&ht);
+        test_assert(&ht.ht_bucket0 == ht.ht_buckets, NULL);
+}
+
+int
+htabletest_main(void)
+{
+        test_init();
+        htabletest_grow();
+        htabletest_collide();
+        test_fini();
+        return 0;
+}
@@ -0,0 +1,353 @@
+#include "kernel.h"
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "mm/kmalloc.h"
+#include "mm/mm.h"
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/pagetable.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+#include "mm/tlb.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#ifdef __VFS__
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+#endif
+#ifdef __VM__
+#include "vm/anon.h"
+#endif
+
+#include "test/kbench.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+/*
+ * The benchmarks kbench comes with. Those of an allocator take and give
+ * back KBENCH_BATCH objects at a time, timing one half or the other, so
+ * that every run leaves the allocator as it found it.
+ */
+
+#define KBENCH_BATCH            64
+
+/* kb_arg of the allocator benchmarks, for which half is timed */
+#define KBENCH_TIME_ALLOC       0
+#define KBENCH_TIME_FREE        1
+
+/* kb_arg of the pframe_get benchmarks */
+#define KBENCH_PFRAME_HIT       0
+#define KBENCH_PFRAME_MISS      1
+
+/* Where pt_map maps, which must be free in the kshell's process */
+#define KBENCH_PT_VADDR         USER_MEM_LOW
+
+static slab_allocator_t *kbench_allocator;
+static ktqueue_t kbench_ping, kbench_pong;
+
+/* A name for each kmalloc size class's benchmark */
+#define KBENCH_NAME_LEN         16
+#define KBENCH_KMALLOC_CLASSES  32
+static char kbench_kmalloc_names[KBENCH_KMALLOC_CLASSES][KBENCH_NAME_LEN];
+
+typedef void *(*kbench_alloc_t)(uint32_t arg);
+typedef void (*kbench_free_t)(void *obj);
+
+/* Allocates and frees n objects in batches, timing one or the other */
+static int
+kbench_alloc_free(kbench_t *kb, uint32_t n, kbench_alloc_t alloc,
+                  kbench_free_t release, uint32_t arg, int which)
+{
+        void *objs[KBENCH_BATCH];
+        uint32_t done, m, i, j;
+
+        for (done = 0; done < n; done += m) {
+                m = MIN(n - done, KBENCH_BATCH);
+                if (KBENCH_TIME_ALLOC == which)
+                        kbench_start(kb);
+                for (i = 0; i < m && NULL != (objs[i] = alloc(arg)); i++)
+                        ;
+                if (KBENCH_TIME_ALLOC == which)
+                        kbench_stop(kb);
+
+                if (KBENCH_TIME_FREE == which)
+                        kbench_start(kb);
+                for (j = 0; j < i; j++)
+                        release(objs[j]);
+                if (KBENCH_TIME_FREE == which)
+                        kbench_stop(kb);
+
+                if (i < m)
+                        return -ENOMEM;
+        }
+        return 0;
+}
+
+static void *
+kbench_page_alloc(uint32_t arg)
+{
+        return page_alloc();
+}
+
+static void
+kbench_page_free(void *page)
+{
+        page_free(page);
+}
+
+static int
+kbench_pages(kbench_t *kb, uint32_t n)
+{
+        return kbench_alloc_free(kb, n, kbench_page_alloc, kbench_page_free, 0,
+                                 kb->kb_arg);
+}
+
+static void *
+kbench_slab_alloc(uint32_t arg)
+{
+        return slab_obj_alloc(kbench_allocator);
+}
+
+static void
+kbench_slab_free(void *obj)
+{
+        slab_obj_free(kbench_allocator, obj);
+}
+
+static int
+kbench_slab(kbench_t *kb, uint32_t n)
+{
+        return kbench_alloc_free(kb, n, kbench_slab_alloc, kbench_slab_free, 0,
+                                 kb->kb_arg);
+}
+
+static void *
+kbench_kmalloc_alloc(uint32_t size)
+{
+        return kmalloc(size);
+}
+
+/* kb_arg is the size to ask for */
+static int
+kbench_kmalloc(kbench_t *kb, uint32_t n)
+{
+        return kbench_alloc_free(kb, n, kbench_kmalloc_alloc, kfree, kb->kb_arg,
+                                 KBENCH_TIME_ALLOC);
+}
+
+#ifdef __VM__
+/* Gets the same page of an anonymous object again and again, or each of
+ * n pages of it once, each of which has to be filled */
+static int
+kbench_pframe_get(kbench_t *kb, uint32_t n)
+{
+        mmobj_t *o;
+        pframe_t *pf;
+        uint32_t i;
+        int ret = 0;
+
+        if (NULL == (o = anon_create()))
+                return -ENOMEM;
+        o->mmo_ops->ref(o);
+
+        if (KBENCH_PFRAME_HIT == kb->kb_arg) {
+                ret = pframe_get(o, 0, &pf);
+                kbench_start(kb);
+                for (i = 0; i < n && 0 == ret; i++)
+                        ret = pframe_get(o, 0, &pf);
+                kbench_stop(kb);
+        } else {
+                kbench_start(kb);
+                for (i = 0; i < n && 0 == ret; i++)
+                        ret = pframe_get(o, i, &pf);
+                kbench_stop(kb);
+        }
+
+        o->mmo_ops->put(o);
+        return ret;
+}
+#endif /* __VM__ */
+
+#ifdef __VFS__
+/* Looks up the root directory's vnode, which is always cached */
+static int
+kbench_vget(kbench_t *kb, uint32_t n)
+{
+        vnode_t *vn;
+        uint32_t i;
+
+        kbench_start(kb);
+        for (i = 0; i < n; i++) {
+                vn = vget(vfs_root_vn->vn_fs, vfs_root_vn->vn_vno);
+                vput(vn);
+        }
+        kbench_stop(kb);
+        return 0;
+}
+#endif /* __VFS__ */
+
+static void *
+kbench_pong_thread(int n, void *arg)
+{
+        int i;
+
+        for (i = 0; i < n; i++) {
+                sched_wakeup_on(&kbench_ping);
+                sched_sleep_on(&kbench_pong);
+        }
+        return NULL;
+}
+
+/*
+ * Each round trip between this thread and one in a process of its own,
+ * which wake each other and sleep, is two switches. Neither can run
+ * until the other sleeps, so no wakeup is ever lost.
+ */
+static int
+kbench_context_switch(kbench_t *kb, uint32_t n)
+{
+        proc_t *p;
+        kthread_t *thr;
+        uint32_t i;
+        int status;
+
+        p = proc_create("kbench");
+        KASSERT(NULL != p);
+        thr = kthread_create(p, kbench_pong_thread, n, NULL);
+        KASSERT(NULL != thr);
+        sched_make_runnable(thr);
+
+        kbench_start(kb);
+        for (i = 0; i < n; i++) {
+                sched_sleep_on(&kbench_ping);
+                sched_wakeup_on(&kbench_pong);
+        }
+        kbench_stop(kb);
+        kb->kb_cycles /= 2;
+
+        do_waitpid(p->p_pid, 0, &status);
+        return 0;
+}
+
+/* Maps one page at KBENCH_BATCH addresses at a time and unmaps them
+ * again, timing one or the other */
+static int
+kbench_pt(kbench_t *kb, uint32_t n)
+{
+        pagedir_t *pd = curproc->p_pagedir;
+        uintptr_t paddr;
+        void *page;
+        uint32_t done, m, i, j;
+        int ret = 0;
+
+        for (i = 0; i < KBENCH_BATCH; i++) {
+                if (pt_is_mapped(pd, KBENCH_PT_VADDR + i * PAGE_SIZE))
+                        return -EBUSY;
+        }
+        if (NULL == (page = page_alloc()))
+                return -ENOMEM;
+        paddr = pt_virt_to_phys((uintptr_t)page);
+
+        for (done = 0; done < n && 0 == ret; done += m) {
+                m = MIN(n - done, KBENCH_BATCH);
+                if (KBENCH_TIME_ALLOC == kb->kb_arg)
+                        kbench_start(kb);
+                for (i = 0; i < m && 0 == ret; i++) {
+                        ret = pt_map(pd, KBENCH_PT_VADDR + i * PAGE_SIZE, paddr,
+                                     PD_PRESENT | PD_WRITE | PD_USER,
+                                     PT_PRESENT | PT_WRITE | PT_USER);
+                }
+                if (KBENCH_TIME_ALLOC == kb->kb_arg)
+                        kbench_stop(kb);
+                if (0 != ret)
+                        i--;
+
+                if (KBENCH_TIME_FREE == kb->kb_arg)
+                        kbench_start(kb);
+                for (j = 0; j < i; j++)
+                        pt_unmap(pd, KBENCH_PT_VADDR + j * PAGE_SIZE);
+                if (KBENCH_TIME_FREE == kb->kb_arg)
+                        kbench_stop(kb);
+                tlb_flush_range(KBENCH_PT_VADDR, i);
+        }
+
+        page_free(page);
+        return ret;
+}
+
+/* kb_arg is the size to copy, at most a page */
+static int
+kbench_memcpy(kbench_t *kb, uint32_t n)
+{
+        void *src, *dst;
+        uint32_t i;
+
+        if (NULL == (src = page_alloc()))
+                return -ENOMEM;
+        if (NULL == (dst = page_alloc())) {
+                page_free(src);
+                return -ENOMEM;
+        }
+        memset(src, 0xa5, PAGE_SIZE);
+
+        kbench_start(kb);
+        for (i = 0; i < n; i++)
+                memcpy(dst, src, kb->kb_arg);
+        kbench_stop(kb);
+
+        page_free(dst);
+        page_free(src);
+        return 0;
+}
+
+static __attribute__((unused)) void
+kbench_benches_init(void)
+{
+        unsigned int class;
+        size_t size;
+
+        kbench_allocator = slab_allocator_create("kbench", 64);
+        KASSERT(NULL != kbench_allocator);
+        sched_queue_init(&kbench_ping);
+        sched_queue_init(&kbench_pong);
+
+        kbench_add("page_alloc", kbench_pages, KBENCH_TIME_ALLOC, "page_alloc of one page");
+        kbench_add("page_free", kbench_pages, KBENCH_TIME_FREE, "page_free of one page");
+        kbench_add("slab_obj_alloc", kbench_slab, KBENCH_TIME_ALLOC,
+                   "slab_obj_alloc of a 64-byte object");
+        kbench_add("slab_obj_free", kbench_slab, KBENCH_TIME_FREE,
+                   "slab_obj_free of a 64-byte object");
+        for (class = 0; class < KBENCH_KMALLOC_CLASSES
+             && 0 != (size = kmalloc_class_max(class)); class++) {
+                snprintf(kbench_kmalloc_names[class], KBENCH_NAME_LEN, "kmalloc-%u", size);
+                kbench_add(kbench_kmalloc_names[class], kbench_kmalloc, size,
+                           "kmalloc of the most a size class holds");
+        }
+#ifdef __VM__
+        kbench_add("pframe_get-hit", kbench_pframe_get, KBENCH_PFRAME_HIT,
+                   "pframe_get of a resident page");
+        kbench_add("pframe_get-miss", kbench_pframe_get, KBENCH_PFRAME_MISS,
+                   "pframe_get of a new anonymous page, zero filled");
+#endif
+#ifdef __VFS__
+        kbench_add("vget", kbench_vget, 0, "vget and vput of a cached vnode");
+#endif
+        kbench_add("context_switch", kbench_context_switch, 0,
+                   "sched_sleep_on to a thread woken before it");
+        kbench_add("pt_map", kbench_pt, KBENCH_TIME_ALLOC, "pt_map of a user page");
+        kbench_add("pt_unmap", kbench_pt, KBENCH_TIME_FREE, "pt_unmap of a user page");
+        kbench_add("memcpy-64", kbench_memcpy, 64, "memcpy of 64 bytes");
+        kbench_add("memcpy-512", kbench_memcpy, 512, "memcpy of 512 bytes");
+        kbench_add("memcpy-4096", kbench_memcpy, PAGE_SIZE, "memcpy of a page");
+}
+init_func(kbench_benches_init);
+init_depends(kbench_init);
+init_depends(sched_init);
@@ -0,0 +1,122 @@
+#include "kernel.h"
+#include "types.h"
+#include "errno.h"
+
+#include "main/cpuid.h"
+
+#include "mm/kmalloc.h"
+
+#include "test/kbench.h"
+#include "test/kshell/io.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/string.h"
+
+/* Timed runs of each benchmark, after one to warm up */
+#define KBENCH_RUNS     5
+
+static list_t kbench_benches;
+
+static __attribute__((unused)) void
+kbench_init(void)
+{
+        list_init(&kbench_benches);
+}
+init_func(kbench_init);
+
+void
+kbench_add(const char *name, kbench_func_t func, uint32_t arg, const char *desc)
+{
+        kbench_t *kb;
+
+        kb = kmalloc(sizeof(*kb));
+        KASSERT(NULL != kb);
+        kb->kb_name = name;
+        kb->kb_desc = desc;
+        kb->kb_func = func;
+        kb->kb_arg = arg;
+        kb->kb_cycles = 0;
+        kb->kb_started = 0;
+        list_link_init(&kb->kb_link);
+        list_insert_tail(&kbench_benches, &kb->kb_link);
+}
+
+void
+kbench_start(kbench_t *kb)
+{
+        kb->kb_started = cpuid_rdtsc();
+}
+
+void
+kbench_stop(kbench_t *kb)
+{
+        kb->kb_cycles += cpuid_rdtsc() - kb->kb_started;
+}
+
+/* Prints cycles per operation to a tenth */
+static void
+kbench_print_per_op(kshell_t *ksh, uint64_t cycles, uint32_t n)
+{
+        uint64_t tenths = cycles * 10 / n;
+
+        kprintf(ksh, " %10llu.%llu", tenths / 10, tenths % 10);
+}
+
+static int
+kbench_one(kshell_t *ksh, kbench_t *kb, uint32_t n)
+{
+        uint64_t runs[KBENCH_RUNS];
+        int i, j, ret;
+
+        for (i = -1; i < KBENCH_RUNS; i++) {
+                kb->kb_cycles = 0;
+                if (0 > (ret = kb->kb_func(kb, n))) {
+                        kprintf(ksh, "%-20s failed: %s\n", kb->kb_name, strerror(-ret));
+                        return ret;
+                }
+                if (0 > i)
+                        continue;
+                /* kept sorted, fastest first */
+                for (j = i; j > 0 && runs[j - 1] > kb->kb_cycles; j--)
+                        runs[j] = runs[j - 1];
+                runs[j] = kb->kb_cycles;
+        }
+
+        kprintf(ksh, "%-20s %8u", kb->kb_name, n);
+        kbench_print_per_op(ksh, runs[0], n);
+        kbench_print_per_op(ksh, runs[KBENCH_RUNS / 2], n);
+        kprintf(ksh, "\n");
+        return 0;
+}
+
+int
+kbench_run(kshell_t *ksh, const char *name, uint32_t n)
+{
+        kbench_t *kb;
+        int found = 0;
+
+        KASSERT(0 < n);
+
+        list_iterate_begin(&kbench_benches, kb, kbench_t, kb_link) {
+                if (NULL != name && 0 != strncmp(kb->kb_name, name, strlen(name)))
+                        continue;
+                if (0 == found++)
+                        kprintf(ksh, "%-20s %8s %12s %12s\n", "BENCHMARK", "OPS",
+                                "MIN CYC/OP", "MEDIAN");
+                kbench_one(ksh, kb, n);
+        } list_iterate_end();
+
+        return found ? 0 : -ENOENT;
+}
+
+void
+kbench_list(kshell_t *ksh)
+{
+        kbench_t *kb;
+
+        list_iterate_begin(&kbench_benches, kb, kbench_t, kb_link) {
+                kprintf(ksh, "%-20s %s\n", kb->kb_name, kb->kb_desc);
+        } list_iterate_end();
+}
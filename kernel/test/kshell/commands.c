@@ -10,11 +10,29 @@
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
 #endif
+#ifdef __S5FS__
+#include "fs/s5fs/s5fs.h"
+#endif
 
+#include "test/kbench.h"
 #include "test/kshell/io.h"
 
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "proc/kmutex.h"
+#include "proc/proc.h"
+#include "proc/rcu.h"
+#include "proc/sched.h"
+
+#include "api/syscall.h"
+
+#include "util/counter.h"
 #include "util/debug.h"
 #include "util/string.h"
+#include "util/prof.h"
+#include "util/time.h"
+#include "util/trace.h"
 
 int kshell_help(kshell_t *ksh, int argc, char **argv)
 {
@@ -60,6 +78,404 @@ int kshell_echo(kshell_t *ksh, int argc, char **argv)
         return 0;
 }
 
+int kshell_kmalloc_stats(kshell_t *ksh, int argc, char **argv)
+{
+        char buf[2048];
+
+        /* Too long for kprintf */
+        kmalloc_info(NULL, buf, sizeof(buf));
+        kshell_write(ksh, buf, strnlen(buf, sizeof(buf)));
+
+        return 0;
+}
+
+int kshell_kmem_census(kshell_t *ksh, int argc, char **argv)
+{
+        char *buf;
+
+        if (NULL == (buf = kmalloc(KMEM_CENSUS_MAX))) {
+                kprintf(ksh, "kmem_census: out of memory\n");
+                return 1;
+        }
+        kmem_census(NULL, buf, KMEM_CENSUS_MAX);
+        kshell_write(ksh, buf, strnlen(buf, KMEM_CENSUS_MAX));
+        kfree(buf);
+
+        return 0;
+}
+
+int kshell_sched_stats(kshell_t *ksh, int argc, char **argv)
+{
+        char buf[256];
+
+        sched_info(NULL, buf, sizeof(buf));
+        kshell_write(ksh, buf, strnlen(buf, sizeof(buf)));
+
+        return 0;
+}
+
+/* The most processes sched_lat shows histograms of */
+#define SCHED_LAT_NPROCS        64
+
+typedef struct sched_lat_proc {
+        pid_t           slp_pid;
+        char            slp_comm[PROC_STAT_NAME_LEN];
+        uint32_t        slp_lat[SCHED_LAT_BUCKETS];
+} sched_lat_proc_t;
+
+/*
+ * Shows wakeup-to-run latency by what was slept on and by process, and
+ * how deep the run queue was, see sched_lat_info. The processes' are
+ * copied out first, since nothing may sleep while walking them.
+ */
+int kshell_sched_lat(kshell_t *ksh, int argc, char **argv)
+{
+        char buf[2048];
+        sched_lat_proc_t *procs;
+        proc_t *p;
+        int nprocs = 0, i, b;
+
+        sched_lat_info(NULL, buf, sizeof(buf));
+        kshell_write(ksh, buf, strnlen(buf, sizeof(buf)));
+
+        if (NULL == (procs = kmalloc(SCHED_LAT_NPROCS * sizeof(*procs))))
+                return -ENOMEM;
+        rcu_read_lock();
+        list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+                if (nprocs < SCHED_LAT_NPROCS) {
+                        procs[nprocs].slp_pid = p->p_pid;
+                        strncpy(procs[nprocs].slp_comm, p->p_comm,
+                                PROC_STAT_NAME_LEN - 1);
+                        procs[nprocs].slp_comm[PROC_STAT_NAME_LEN - 1] = '\0';
+                        memcpy(procs[nprocs].slp_lat, p->p_sched_lat,
+                               sizeof(p->p_sched_lat));
+                        nprocs++;
+                }
+        } list_iterate_end();
+        rcu_read_unlock();
+
+        kprintf(ksh, "by process, log2(ns):wakeups...\n");
+        for (i = 0; i < nprocs; i++) {
+                kprintf(ksh, "%5d %-16s", procs[i].slp_pid, procs[i].slp_comm);
+                for (b = 0; b < SCHED_LAT_BUCKETS; b++) {
+                        if (0 != procs[i].slp_lat[b])
+                                kprintf(ksh, " %d:%u", b, procs[i].slp_lat[b]);
+                }
+                kprintf(ksh, "\n");
+        }
+        kfree(procs);
+
+        return 0;
+}
+
+int kshell_pframe_stats(kshell_t *ksh, int argc, char **argv)
+{
+        char buf[1024];
+
+        pframe_info(NULL, buf, sizeof(buf));
+        kshell_write(ksh, buf, strnlen(buf, sizeof(buf)));
+
+        return 0;
+}
+
+int kshell_kmutex_stats(kshell_t *ksh, int argc, char **argv)
+{
+        char buf[2048];
+
+        kmutex_info(NULL, buf, sizeof(buf));
+        kshell_write(ksh, buf, strnlen(buf, sizeof(buf)));
+
+        return 0;
+}
+
+int kshell_trace(kshell_t *ksh, int argc, char **argv)
+{
+        char buf[128];
+        uint32_t n;
+        int enabled = trace_enabled;
+
+        if (2 == argc && 0 == strcmp(argv[1], "on")) {
+                trace_enabled = 1;
+                return 0;
+        } else if (2 == argc && 0 == strcmp(argv[1], "off")) {
+                trace_enabled = 0;
+                return 0;
+        } else if (2 == argc && 0 == strcmp(argv[1], "clear")) {
+                trace_next = 0;
+                return 0;
+        } else if (1 != argc) {
+                kprintf(ksh, "Usage: trace [on|off|clear]\n");
+                return 0;
+        }
+
+        /* Oldest first, and without tracing the dump itself */
+        trace_enabled = 0;
+        kprintf(ksh, "tsc pid event args\n");
+        for (n = MIN(trace_next, TRACE_NRECS); n > 0; n--) {
+                if (0 == trace_format(n - 1, buf, sizeof(buf)))
+                        kshell_write(ksh, buf, strnlen(buf, sizeof(buf)));
+        }
+        trace_enabled = enabled;
+
+        return 0;
+}
+
+int kshell_prof(kshell_t *ksh, int argc, char **argv)
+{
+        uint32_t n, i, j;
+
+        if (2 == argc && 0 == strcmp(argv[1], "start")) {
+                prof_start();
+                return 0;
+        } else if (2 == argc && 0 == strcmp(argv[1], "stop")) {
+                prof_stop();
+                return 0;
+        } else if (2 != argc || 0 != strcmp(argv[1], "dump")) {
+                kprintf(ksh, "Usage: prof start|stop|dump\n");
+                return 0;
+        }
+
+        /* Most samples first; the addresses are for addr2line or gdb */
+        n = prof_sort();
+        kprintf(ksh, "%u samples, %u dropped\n", prof_samples, prof_dropped);
+        kprintf(ksh, "count pid eip callers...\n");
+        for (i = 0; i < n; i++) {
+                kprintf(ksh, "%u %d 0x%08x", prof_table[i].ps_count,
+                        prof_table[i].ps_pid, prof_table[i].ps_eip);
+                for (j = 0; j < CALLCHAIN_DEPTH && 0 != prof_table[i].ps_chain[j]; j++)
+                        kprintf(ksh, " 0x%08x", prof_table[i].ps_chain[j]);
+                kprintf(ksh, "\n");
+        }
+
+        return 0;
+}
+
+int kshell_syscall_stats(kshell_t *ksh, int argc, char **argv)
+{
+        struct syscall_stat st;
+        uint32_t nr;
+        int b;
+
+        /* Buckets are log2 of nanoseconds, only those with calls shown */
+        kprintf(ksh, "nr calls mean_ns log2(ns):calls...\n");
+        for (nr = 0; 0 == syscall_stats_get(nr, &st); nr++) {
+                if (0 == st.ss_calls)
+                        continue;
+                kprintf(ksh, "%u %llu %llu", nr, st.ss_calls,
+                        st.ss_ns / st.ss_calls);
+                for (b = 0; b < SYSCALL_STAT_BUCKETS; b++) {
+                        if (0 != st.ss_hist[b])
+                                kprintf(ksh, " %d:%u", b, st.ss_hist[b]);
+                }
+                kprintf(ksh, "\n");
+        }
+
+        return 0;
+}
+
+/* What top compares from one second to the next */
+#define TOP_NPROCS      64
+
+typedef struct top_sample {
+        uint64_t        ts_ns;
+        uint64_t        ts_idle_ns;
+        uint64_t        ts_switches;
+        uint64_t        ts_faults;
+        uint64_t        ts_diskops;
+        uint64_t        ts_scanned;
+        uint64_t        ts_reclaimed;
+        int             ts_nprocs;
+        struct proc_stat ts_procs[TOP_NPROCS];
+} top_sample_t;
+
+/* Requests to whichever disk drivers there are */
+static const char *top_disk_counters[] = {
+        "disk.reads", "disk.writes", "vblk.reads", "vblk.writes",
+        "ahci.reads", "ahci.writes", NULL
+};
+
+static uint64_t top_counter(const char *name)
+{
+        uint64_t value = 0;
+
+        counter_get(name, &value);
+        return value;
+}
+
+static void top_take(top_sample_t *ts)
+{
+        proc_t *p;
+        int i;
+
+        ts->ts_ns = time_now_ns();
+        ts->ts_idle_ns = top_counter("sched.idle_ns");
+        ts->ts_switches = top_counter("sched.switches");
+        ts->ts_faults = top_counter("vm.pagefaults");
+        ts->ts_scanned = top_counter("pageoutd.scanned");
+        ts->ts_reclaimed = top_counter("pageoutd.reclaimed");
+        ts->ts_diskops = 0;
+        for (i = 0; NULL != top_disk_counters[i]; i++) {
+                ts->ts_diskops += top_counter(top_disk_counters[i]);
+        }
+
+        ts->ts_nprocs = 0;
+        rcu_read_lock();
+        list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+                if (ts->ts_nprocs < TOP_NPROCS) {
+                        proc_stat_get(p, &ts->ts_procs[ts->ts_nprocs++]);
+                }
+        } list_iterate_end();
+        rcu_read_unlock();
+}
+
+/* The rate of something counted in both samples, per second */
+#define top_rate(old, new, field, ns) \
+        (((new)->field - (old)->field) * 1000000000ULL / (ns))
+
+static void top_show(kshell_t *ksh, top_sample_t *old, top_sample_t *new)
+{
+        uint64_t ns = new->ts_ns - old->ts_ns, cpu;
+        uint32_t min, target;
+        int i, j;
+
+        if (0 == ns) {
+                ns = 1;
+        }
+        pframe_freepages_limits(&min, &target);
+        kprintf(ksh, "runnable %d, free pages %u (pageoutd below %u, up to %u), %u high\n",
+                sched_runnable(), page_free_count(), min, target,
+                page_highmem_free_count());
+        kprintf(ksh, "per second: %llu switches, %llu faults, %llu disk ops, "
+                "pageoutd %llu scanned %llu reclaimed, %llu%% idle\n",
+                top_rate(old, new, ts_switches, ns),
+                top_rate(old, new, ts_faults, ns),
+                top_rate(old, new, ts_diskops, ns),
+                top_rate(old, new, ts_scanned, ns),
+                top_rate(old, new, ts_reclaimed, ns),
+                (new->ts_idle_ns - old->ts_idle_ns) * 100 / ns);
+        kprintf(ksh, "  PID  PPID  CPU%%    RSS  NAME\n");
+        for (i = 0; i < new->ts_nprocs; i++) {
+                struct proc_stat *st = &new->ts_procs[i];
+
+                /* a process new since the last sample has run only since */
+                cpu = st->ps_cpu_ns;
+                for (j = 0; j < old->ts_nprocs; j++) {
+                        if (old->ts_procs[j].ps_pid == st->ps_pid) {
+                                cpu -= old->ts_procs[j].ps_cpu_ns;
+                                break;
+                        }
+                }
+                kprintf(ksh, "%5d %5d %4llu%% %6u  %s%s\n", st->ps_pid, st->ps_ppid,
+                        MIN(cpu * 100 / ns, 100ULL), st->ps_rss, st->ps_comm,
+                        (PROC_DEAD == st->ps_state) ? " (exited)" : "");
+        }
+}
+
+/*
+ * Like top: samples what the processes and the kernel have been doing,
+ * once a second for as many seconds as asked, and shows each second's
+ * worth: CPU time and RSS by process, the run queue, free pages against
+ * pageoutd's limits, and rates of paging and disk activity.
+ */
+int kshell_top(kshell_t *ksh, int argc, char **argv)
+{
+        top_sample_t *samples, *old, *new, *t;
+        int n = 1;
+        char *c;
+
+        if (2 == argc) {
+                for (n = 0, c = argv[1]; '0' <= *c && *c <= '9' && n < 100000; c++) {
+                        n = 10 * n + (*c - '0');
+                }
+                if ('\0' != *c) {
+                        n = 0;
+                }
+        }
+        if (argc > 2 || 0 >= n) {
+                kprintf(ksh, "Usage: top [SECONDS]\n");
+                return 1;
+        }
+        if (NULL == (samples = kmalloc(2 * sizeof(*samples)))) {
+                kprintf(ksh, "top: out of memory\n");
+                return 1;
+        }
+        old = &samples[0];
+        new = &samples[1];
+
+        top_take(old);
+        while (n-- > 0) {
+                if (0 > timer_sleep(1000)) {
+                        break;
+                }
+                top_take(new);
+                top_show(ksh, old, new);
+                if (n > 0) {
+                        kprintf(ksh, "\n");
+                }
+                t = old;
+                old = new;
+                new = t;
+        }
+
+        kfree(samples);
+        return 0;
+}
+
+/* Operations each kbench run does, unless told otherwise */
+#define KBENCH_DEFAULT_OPS      1000
+
+/*
+ * Runs the kernel's microbenchmarks (see test/kbench.h), all of them or
+ * those whose names start with NAME, or lists them.
+ */
+int kshell_kbench(kshell_t *ksh, int argc, char **argv)
+{
+        uint32_t n = KBENCH_DEFAULT_OPS;
+        const char *name = NULL;
+        char *c;
+        int i;
+
+        if (2 == argc && 0 == strcmp(argv[1], "list")) {
+                kbench_list(ksh);
+                return 0;
+        }
+        for (i = 1; i < argc; i++) {
+                if (0 == strcmp(argv[i], "-n") && i + 1 < argc) {
+                        for (n = 0, c = argv[++i]; '0' <= *c && *c <= '9' && n < 10000000; c++) {
+                                n = 10 * n + (*c - '0');
+                        }
+                        if ('\0' != *c) {
+                                n = 0;
+                        }
+                } else if (NULL == name) {
+                        name = argv[i];
+                } else {
+                        n = 0;
+                }
+        }
+        if (0 == n) {
+                kprintf(ksh, "Usage: kbench list | kbench [-n OPS] [NAME]\n");
+                return 1;
+        }
+        if (0 > kbench_run(ksh, name, n)) {
+                kprintf(ksh, "kbench: no benchmark %s, see kbench list\n", name);
+                return 1;
+        }
+        return 0;
+}
+
+int htabletest_main(void);
+
+/* Runs the tests of util/hash.h, which report to the debug log. */
+int kshell_htabletest(kshell_t *ksh, int argc, char **argv)
+{
+        if (1 != argc) {
+                kprintf(ksh, "Usage: htabletest\n");
+                return 1;
+        }
+        return htabletest_main();
+}
+
 #ifdef __VFS__
 int kshell_cat(kshell_t *ksh, int argc, char **argv)
 {
@@ -320,4 +736,107 @@ int kshell_stat(kshell_t *ksh, int argc, char **argv)
 
         return exit_val;
 }
+
+/*
+ * Like fincore: how much of the file is in the page cache, and which
+ * runs of its pages those are.
+ */
+int kshell_resident(kshell_t *ksh, int argc, char **argv)
+{
+        int fd;
+        file_t *f;
+        mmobj_t *o;
+        pframe_t *pf;
+        uint32_t pagenum = 0, start = 0, npages, runlen = 0;
+        int inrun = 0;
+
+        if (argc != 2) {
+                kprintf(ksh, "Usage: resident FILE\n");
+                return 1;
+        }
+        if ((fd = do_open(argv[1], O_RDONLY)) < 0) {
+                kprintf(ksh, "Error opening file: %s\n", argv[1]);
+                return 1;
+        }
+        f = fget(fd);
+        KASSERT(NULL != f);
+        o = &f->f_vnode->vn_mmobj;
+        npages = ((uint32_t)f->f_vnode->vn_len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+        kprintf(ksh, "%d of %u pages resident:", o->mmo_nrespages, npages);
+        while (NULL != (pf = pframe_next_resident(o, &pagenum))) {
+                if (!inrun || pagenum != start + runlen) {
+                        if (inrun)
+                                kprintf(ksh, " %u-%u", start, start + runlen - 1);
+                        start = pagenum;
+                        runlen = 0;
+                        inrun = 1;
+                }
+                runlen++;
+                pagenum++;
+        }
+        if (inrun)
+                kprintf(ksh, " %u-%u", start, start + runlen - 1);
+        kprintf(ksh, "\n");
+
+        fput(f);
+        do_close(fd);
+        return 0;
+}
+
+int vfstest_main(int argc, char **argv);
+
+/*
+ * Runs the VFS tests, or with --bench their benchmark mode. The tests
+ * report to the debug log, the benchmark to file descriptor 1, which is
+ * pointed at the shell's output for the duration unless the shell is
+ * using it for something else.
+ */
+int kshell_vfstest(kshell_t *ksh, int argc, char **argv)
+{
+        int ret, moved = 0;
+
+        if (1 != ksh->ksh_out_fd && 1 != ksh->ksh_fd && 1 != ksh->ksh_in_fd) {
+                if ((ret = do_dup2(ksh->ksh_out_fd, 1)) < 0) {
+                        kprintf(ksh, "vfstest: dup2: %s\n", strerror(-ret));
+                        return 1;
+                }
+                moved = 1;
+        }
+        ret = vfstest_main(argc, argv);
+        if (moved)
+                do_close(1);
+        return ret;
+}
+#endif
+
+#ifdef __S5FS__
+int kshell_lock_stats(kshell_t *ksh, int argc, char **argv)
+{
+        char buf[256];
+        int fd;
+        file_t *f;
+
+        if (argc != 2) {
+                kprintf(ksh, "Usage: lock_stats FILE\n");
+                return 1;
+        }
+
+        if ((fd = do_open(argv[1], O_RDONLY)) < 0) {
+                kprintf(ksh, "Error opening file: %s\n", argv[1]);
+                return 1;
+        }
+        f = fget(fd);
+        KASSERT(NULL != f);
+        if (0 == strcmp(f->f_vnode->vn_fs->fs_type, "s5fs")) {
+                s5fs_lock_info(f->f_vnode, buf, sizeof(buf));
+                kshell_write(ksh, buf, strnlen(buf, sizeof(buf)));
+        } else {
+                kprintf(ksh, "%s is not on an s5fs file system\n", argv[1]);
+        }
+        fput(f);
+        do_close(fd);
+
+        return 0;
+}
 #endif
@@ -8,6 +8,18 @@
 KSHELL_CMD(help);
 KSHELL_CMD(exit);
 KSHELL_CMD(echo);
+KSHELL_CMD(kmalloc_stats);
+KSHELL_CMD(kmem_census);
+KSHELL_CMD(sched_stats);
+KSHELL_CMD(sched_lat);
+KSHELL_CMD(trace);
+KSHELL_CMD(prof);
+KSHELL_CMD(syscall_stats);
+KSHELL_CMD(kmutex_stats);
+KSHELL_CMD(pframe_stats);
+KSHELL_CMD(top);
+KSHELL_CMD(kbench);
+KSHELL_CMD(htabletest);
 #ifdef __VFS__
 KSHELL_CMD(cat);
 KSHELL_CMD(ls);
@@ -17,4 +29,9 @@ KSHELL_CMD(link);
 KSHELL_CMD(rmdir);
 KSHELL_CMD(mkdir);
 KSHELL_CMD(stat);
+KSHELL_CMD(resident);
+KSHELL_CMD(vfstest);
+#endif
+#ifdef __S5FS__
+KSHELL_CMD(lock_stats);
 #endif
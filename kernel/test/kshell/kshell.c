@@ -34,6 +34,30 @@ static __attribute__((unused)) void kshell_init()
         kshell_add_command("help", kshell_help,
                            "prints a list of available commands");
         kshell_add_command("echo", kshell_echo, "display a line of text");
+        kshell_add_command("kmalloc_stats", kshell_kmalloc_stats,
+                           "show kmalloc size class usage and fragmentation");
+        kshell_add_command("kmem_census", kshell_kmem_census,
+                           "show live objects by slab allocator and call site");
+        kshell_add_command("sched_stats", kshell_sched_stats,
+                           "show run queue length and scheduler activity");
+        kshell_add_command("sched_lat", kshell_sched_lat,
+                           "show wakeup-to-run latency and run queue depth histograms");
+        kshell_add_command("trace", kshell_trace,
+                           "dump the trace ring, or turn tracing on, off or clear it");
+        kshell_add_command("prof", kshell_prof,
+                           "start or stop the sampling profiler, or dump its counts");
+        kshell_add_command("syscall_stats", kshell_syscall_stats,
+                           "show calls and latency histograms by syscall number");
+        kshell_add_command("kmutex_stats", kshell_kmutex_stats,
+                           "show kmutex contention by call site (KMUTEX_STATS)");
+        kshell_add_command("pframe_stats", kshell_pframe_stats,
+                           "show page cache hits, fills, cleans and pageout activity");
+        kshell_add_command("top", kshell_top,
+                           "show processes, run queue and paging once a second");
+        kshell_add_command("kbench", kshell_kbench,
+                           "run kernel microbenchmarks, printing cycles per operation");
+        kshell_add_command("htabletest", kshell_htabletest,
+                           "run the hash table tests");
 #ifdef __VFS__
         kshell_add_command("cat", kshell_cat,
                            "concatenate files and print on the standard output");
@@ -46,6 +70,14 @@ static __attribute__((unused)) void kshell_init()
                            "remove empty directories");
         kshell_add_command("mkdir", kshell_mkdir, "make directories");
         kshell_add_command("stat", kshell_stat, "display file status");
+        kshell_add_command("resident", kshell_resident,
+                           "show which pages of a file are in memory");
+        kshell_add_command("vfstest", kshell_vfstest,
+                           "run the VFS tests, or time VFS calls with --bench");
+#endif
+#ifdef __S5FS__
+        kshell_add_command("lock_stats", kshell_lock_stats,
+                           "show how often a file's locks had to be waited for");
 #endif
 
         kshell_add_command("exit", kshell_exit, "exits the shell");
@@ -0,0 +1,132 @@
+#include "kernel.h"
+#include "types.h"
+#include "globals.h"
+
+#include "main/interrupt.h"
+
+#include "proc/kthread.h"
+
+#include "util/callchain.h"
+#include "util/debug.h"
+#include "util/string.h"
+
+/* The most frames callchain_capture leaves out */
+#define CALLCHAIN_MAX_SKIP      4
+
+/* How far callchain_save looks past a chain's slot before giving up */
+#define CALLCHAIN_PROBES        32
+
+typedef struct callchain {
+        uint32_t        cc_hash;
+        uint32_t        cc_n;           /* 0 if the slot is free */
+        uintptr_t       cc_pcs[CALLCHAIN_DEPTH];
+} callchain_t;
+
+static callchain_t callchain_saved[CALLCHAIN_NSAVED];
+
+/* Whether there is a whole frame at fp, on the interrupt stack if intr
+ * and otherwise on the current thread's */
+static int
+callchain_frame(uintptr_t fp, int intr)
+{
+        uintptr_t lo = curthr->kt_ctx.c_kstack;
+        uintptr_t hi = lo + curthr->kt_ctx.c_kstacksz;
+
+        if (0 != (fp & 3))
+                return 0;
+        if (intr)
+                return intr_on_stack(fp) && intr_on_stack(fp + 2 * sizeof(uintptr_t) - 1);
+        return fp >= lo && fp + 2 * sizeof(uintptr_t) <= hi;
+}
+
+int
+callchain_walk(uintptr_t fp, uintptr_t *pcs, int max)
+{
+        int intr = intr_on_stack(fp);
+        uintptr_t next, pc;
+        int n = 0;
+
+        if (NULL == curthr)
+                return 0;
+
+        while (n < max && callchain_frame(fp, intr)) {
+                next = ((uintptr_t *)fp)[0];
+                pc = ((uintptr_t *)fp)[1];
+                if (pc < (uintptr_t)&kernel_start_text || pc >= (uintptr_t)&kernel_end_text)
+                        break;
+                pcs[n++] = pc;
+
+                /* Frames get older going up the stack; the only other way
+                 * is off the interrupt stack to what the interrupt came
+                 * in on, which can only happen once. */
+                if (intr && !intr_on_stack(next))
+                        intr = 0;
+                else if (next <= fp)
+                        break;
+                fp = next;
+        }
+        return n;
+}
+
+int
+callchain_capture(uintptr_t *pcs, int max, int skip)
+{
+        uintptr_t all[CALLCHAIN_DEPTH + CALLCHAIN_MAX_SKIP];
+        int n;
+
+        KASSERT(0 <= skip && skip <= CALLCHAIN_MAX_SKIP);
+        KASSERT(max <= CALLCHAIN_DEPTH);
+
+        /* from the caller's frame, past the return into it */
+        n = callchain_walk(((uintptr_t *)__builtin_frame_address(0))[0], all, max + skip);
+        if (n <= skip)
+                return 0;
+        memcpy(pcs, all + skip, (n - skip) * sizeof(uintptr_t));
+        return n - skip;
+}
+
+uint32_t
+callchain_save(const uintptr_t *pcs, int n)
+{
+        uint32_t h = 2166136261U;
+        uint8_t ipl;
+        uint32_t i, handle = 0;
+        callchain_t *c;
+
+        KASSERT(n <= CALLCHAIN_DEPTH);
+        if (0 >= n)
+                return 0;
+        for (i = 0; i < (uint32_t)n; i++)
+                h = (h ^ pcs[i]) * 16777619U;
+
+        /* interrupts save chains too, so the claiming of a slot is masked */
+        ipl = intr_getipl();
+        intr_setipl(IPL_HIGH);
+        for (i = 0; i < CALLCHAIN_PROBES; i++) {
+                c = &callchain_saved[(h + i) & (CALLCHAIN_NSAVED - 1)];
+                if (0 == c->cc_n) {
+                        c->cc_hash = h;
+                        c->cc_n = n;
+                        memcpy(c->cc_pcs, pcs, n * sizeof(uintptr_t));
+                }
+                if (h == c->cc_hash && (uint32_t)n == c->cc_n
+                    && 0 == memcmp(c->cc_pcs, pcs, n * sizeof(uintptr_t))) {
+                        handle = (c - callchain_saved) + 1;
+                        break;
+                }
+        }
+        intr_setipl(ipl);
+        return handle;
+}
+
+int
+callchain_fetch(uint32_t handle, const uintptr_t **pcs)
+{
+        if (0 == handle) {
+                *pcs = NULL;
+                return 0;
+        }
+        KASSERT(handle <= CALLCHAIN_NSAVED);
+        *pcs = callchain_saved[handle - 1].cc_pcs;
+        return callchain_saved[handle - 1].cc_n;
+}
@@ -0,0 +1,91 @@
+#include "kernel.h"
+#include "types.h"
+#include "errno.h"
+
+#include "util/counter.h"
+#include "util/debug.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+/* Long enough for any name and a 20 digit value */
+#define COUNTER_LINE_LEN        64
+
+/* Counters are registered from all over, before and after init_call_all,
+ * so the list has to be ready from the start */
+static list_t counter_list = { &counter_list, &counter_list };
+
+void
+counter_register(counter_t *c, const char *name)
+{
+        KASSERT(NULL != name);
+        KASSERT(!list_link_is_linked(&c->c_link) && "counter registered twice");
+
+        c->c_name = name;
+        c->c_index = -1;
+        list_insert_tail(&counter_list, &c->c_link);
+}
+
+void
+counter_register_array(counter_t *cs, int n, const char *name)
+{
+        int i;
+
+        for (i = 0; i < n; i++) {
+                counter_register(&cs[i], name);
+                cs[i].c_index = i;
+        }
+}
+
+int
+counter_get(const char *name, uint64_t *value)
+{
+        counter_t *c;
+        char full[COUNTER_LINE_LEN];
+
+        list_iterate_begin(&counter_list, c, counter_t, c_link) {
+                if (0 > c->c_index) {
+                        if (0 != strcmp(c->c_name, name))
+                                continue;
+                } else {
+                        snprintf(full, sizeof(full), "%s.%d", c->c_name, c->c_index);
+                        if (0 != strcmp(full, name))
+                                continue;
+                }
+                *value = c->c_value;
+                return 0;
+        } list_iterate_end();
+
+        return -ENOENT;
+}
+
+int
+counter_format(int offset, char *buf, int count)
+{
+        counter_t *c;
+        int pos = 0, copied = 0;
+
+        list_iterate_begin(&counter_list, c, counter_t, c_link) {
+                char line[COUNTER_LINE_LEN];
+                int len, skip, n;
+
+                if ((0 <= c->c_index && 0 == c->c_value) || copied == count)
+                        continue;
+                if (0 > c->c_index)
+                        len = snprintf(line, sizeof(line), "%s %llu\n",
+                                       c->c_name, c->c_value);
+                else
+                        len = snprintf(line, sizeof(line), "%s.%d %llu\n",
+                                       c->c_name, c->c_index, c->c_value);
+                len = MIN(len, (int)sizeof(line) - 1);
+
+                if (pos + len > offset) {
+                        skip = MAX(offset - pos, 0);
+                        n = MIN(len - skip, count - copied);
+                        memcpy(buf + copied, line + skip, n);
+                        copied += n;
+                }
+                pos += len;
+        } list_iterate_end();
+
+        return copied;
+}
@@ -1,4 +1,5 @@
 #include "util/debug.h"
+#include "util/tracepoint.h"
 #include "util/string.h"
 #include "util/printf.h"
 
@@ -47,6 +48,7 @@ void dbg_init()
 
         dbg_modes = DBG_DEFAULT;
         dbg_add_modes(QUOTE(__DBG__));
+        tracepoint_sync();
 }
 
 static dbg_mode_t dbg_tab[] = {
@@ -136,7 +138,7 @@ void dbg_add_mode(const char *name)
         } else {
                 dbg_modes |= mode->d_mode;
         }
-
+        tracepoint_sync();
 }
 
 /**
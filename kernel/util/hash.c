@@ -0,0 +1,76 @@
+#include "kernel.h"
+
+#include "mm/kmalloc.h"
+
+#include "util/debug.h"
+#include "util/hash.h"
+
+void
+htable_init(htable_t *ht)
+{
+        list_init(&ht->ht_bucket0);
+        ht->ht_buckets = &ht->ht_bucket0;
+        ht->ht_mask = 0;
+        ht->ht_count = 0;
+}
+
+void
+htable_destroy(htable_t *ht)
+{
+        KASSERT(0 == ht->ht_count);
+
+        if (&ht->ht_bucket0 != ht->ht_buckets)
+                kfree(ht->ht_buckets);
+        htable_init(ht);
+}
+
+/* Doubles the buckets, if there is the memory to */
+static void
+htable_grow(htable_t *ht)
+{
+        uint32_t nbuckets = 2 * (ht->ht_mask + 1);
+        list_t *buckets;
+        htable_link_t *link;
+        uint32_t i;
+
+        if (NULL == (buckets = kmalloc(nbuckets * sizeof(list_t))))
+                return;
+        for (i = 0; i < nbuckets; i++)
+                list_init(&buckets[i]);
+
+        for (i = 0; i <= ht->ht_mask; i++) {
+                list_iterate_begin(&ht->ht_buckets[i], link, htable_link_t, hl_link) {
+                        list_remove(&link->hl_link);
+                        list_insert_tail(&buckets[link->hl_hash & (nbuckets - 1)],
+                                         &link->hl_link);
+                } list_iterate_end();
+        }
+
+        if (&ht->ht_bucket0 != ht->ht_buckets)
+                kfree(ht->ht_buckets);
+        ht->ht_buckets = buckets;
+        ht->ht_mask = nbuckets - 1;
+}
+
+void
+htable_insert(htable_t *ht, htable_link_t *link, uint32_t hash)
+{
+        if (ht->ht_count >= HTABLE_LOAD * (ht->ht_mask + 1)
+            && ht->ht_mask + 1 < (1U << HTABLE_MAX_SHIFT)) {
+                htable_grow(ht);
+        }
+
+        link->hl_hash = hash;
+        list_insert_head(htable_bucket(ht, hash), &link->hl_link);
+        ht->ht_count++;
+}
+
+void
+htable_remove(htable_t *ht, htable_link_t *link)
+{
+        KASSERT(0 < ht->ht_count);
+        KASSERT(list_link_is_linked(&link->hl_link));
+
+        list_remove(&link->hl_link);
+        ht->ht_count--;
+}
@@ -2,129 +2,153 @@
 
 #include "mm/kmalloc.h"
 
-#include "util/list.h"
 #include "util/string.h"
 #include "util/debug.h"
 #include "util/init.h"
 
-static int _init_search_count = 0;
-
+/*
+ * The .init section is a run of records, each a function pointer followed
+ * by its name, where a null pointer instead makes the name one the
+ * record before depends on. It is read once into an array, every
+ * dependency is looked up by binary search in a copy sorted by name, and
+ * the functions are then called in the order of a depth-first walk, each
+ * after what it depends on and otherwise in link order.
+ */
 struct init_function {
         init_func_t  if_func;
         const char  *if_name;
-        list_link_t  if_link;
 
-        int          if_search;
-        int          if_called;
-        list_t       if_deps;
+        uint32_t     if_ndeps;
+        uint32_t     if_deps;           /* first of ours in init_deps */
+        int          if_state;
 };
 
-struct init_depends {
-        const char  *id_name;
-        list_link_t  id_link;
-};
+#define INIT_UNVISITED  0
+#define INIT_VISITING   1               /* its dependencies are being called */
+#define INIT_CALLED     2
+
+static struct init_function *init_funcs;
+static uint32_t init_nfuncs;
+
+/* the dependency names until they are resolved, then indexes into init_funcs */
+static const char **init_dep_names;
+static uint32_t *init_deps;
 
-static void _init_call(list_t *funcs, struct init_function *func)
+static uint32_t
+_init_lookup(struct init_function **sorted, const char *name, const char *who)
 {
-        struct init_depends *dep;
-        list_iterate_begin(&func->if_deps, dep, struct init_depends, id_link) {
-                int found = 0;
-                struct init_function *f;
-                list_iterate_begin(funcs, f, struct init_function, if_link) {
-                        if (0 == strcmp(dep->id_name, f->if_name)) {
-                                found = 1;
-                                goto done;
-                        }
-                } list_iterate_end();
-done:
-
-                if (!found) {
-                        panic("'%s' dependency for '%s' does not exist",
-                              dep->id_name, func->if_name);
-                }
+        uint32_t lo = 0, hi = init_nfuncs;
+        while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                int cmp = strcmp(name, sorted[mid]->if_name);
+                if (0 == cmp)
+                        return sorted[mid] - init_funcs;
+                if (cmp < 0)
+                        hi = mid;
+                else
+                        lo = mid + 1;
+        }
+        panic("'%s' dependency for '%s' does not exist", name, who);
+        return 0;
+}
+
+static void
+_init_call(struct init_function *func)
+{
+        uint32_t i;
+
+        func->if_state = INIT_VISITING;
+        for (i = 0; i < func->if_ndeps; i++) {
+                struct init_function *f = &init_funcs[init_deps[func->if_deps + i]];
 
-                if (func->if_search == f->if_search) {
+                if (INIT_VISITING == f->if_state) {
                         panic("circular dependency between '%s' and '%s'",
                               func->if_name, f->if_name);
                 }
-
                 dbg(DBG_INIT, "'%s' depends on '%s': ", func->if_name, f->if_name);
-                if (!f->if_called) {
+                if (INIT_UNVISITED == f->if_state) {
                         dbgq(DBG_INIT, "calling\n");
-                        f->if_search = func->if_search;
-                        _init_call(funcs, f);
+                        _init_call(f);
                 } else {
                         dbgq(DBG_INIT, "already called\n");
                 }
-        } list_iterate_end();
-
-        KASSERT(!func->if_called);
+        }
 
         dbg(DBG_INIT, "Calling %s (0x%p)\n", func->if_name, func->if_func);
         func->if_func();
-        func->if_called = 1;
+        func->if_state = INIT_CALLED;
 }
 
 void init_call_all()
 {
-        list_t funcs;
-        char *buf, *end;
-
-        list_init(&funcs);
-        buf = (char *) &kernel_start_init;
-        end = (char *) &kernel_end_init;
-
-        while (buf < end) {
-                struct init_function *curr = kmalloc(sizeof(*curr));
-                KASSERT(NULL != curr);
-
-                list_insert_tail(&funcs, &curr->if_link);
-                list_init(&curr->if_deps);
-
-                KASSERT(NULL != *(uintptr_t *)buf);
-                curr->if_func = (init_func_t) * (uintptr_t *)buf;
-                curr->if_name = buf + sizeof(curr->if_func);
-                curr->if_search = 0;
-                curr->if_called = 0;
-
-                buf += sizeof(curr->if_func) + strlen(curr->if_name) + 1;
-
-                while ((NULL == *(uintptr_t *)buf) && (buf < end)) {
-                        struct init_depends *dep = kmalloc(sizeof(*dep));
-                        KASSERT(NULL != dep);
-
-                        list_insert_tail(&curr->if_deps, &dep->id_link);
-
-                        dep->id_name = buf + sizeof(curr->if_func);
-                        buf += sizeof(curr->if_func) + strlen(dep->id_name) + 1;
+        char *start = (char *) &kernel_start_init;
+        char *end = (char *) &kernel_end_init;
+        struct init_function **sorted;
+        uint32_t ndeps = 0, i, j;
+        char *buf;
+
+        /* count, then fill in */
+        init_nfuncs = 0;
+        for (buf = start; buf < end; buf += sizeof(init_func_t) + strlen(buf + sizeof(init_func_t)) + 1) {
+                if (NULL == *(uintptr_t *)buf)
+                        ndeps++;
+                else
+                        init_nfuncs++;
+        }
+        KASSERT(buf == end);
+        KASSERT(start == end || NULL != *(uintptr_t *)start);
+
+        init_funcs = kmalloc(MAX(init_nfuncs, 1) * sizeof(*init_funcs));
+        sorted = kmalloc(MAX(init_nfuncs, 1) * sizeof(*sorted));
+        init_dep_names = kmalloc(MAX(ndeps, 1) * sizeof(*init_dep_names));
+        init_deps = kmalloc(MAX(ndeps, 1) * sizeof(*init_deps));
+        KASSERT(NULL != init_funcs && NULL != sorted);
+        KASSERT(NULL != init_dep_names && NULL != init_deps);
+
+        struct init_function *curr = NULL;
+        ndeps = 0;
+        for (buf = start; buf < end; buf += sizeof(init_func_t) + strlen(buf + sizeof(init_func_t)) + 1) {
+                const char *name = buf + sizeof(init_func_t);
+                if (NULL == *(uintptr_t *)buf) {
+                        curr->if_ndeps++;
+                        init_dep_names[ndeps++] = name;
+                        continue;
                 }
+                curr = (NULL == curr) ? init_funcs : curr + 1;
+                curr->if_func = (init_func_t) * (uintptr_t *)buf;
+                curr->if_name = name;
+                curr->if_ndeps = 0;
+                curr->if_deps = ndeps;
+                curr->if_state = INIT_UNVISITED;
         }
 
-        KASSERT(buf == end);
+        /* insertion sort, there are only a few dozen */
+        for (i = 0; i < init_nfuncs; i++) {
+                struct init_function *f = &init_funcs[i];
+                for (j = i; j > 0 && strcmp(f->if_name, sorted[j - 1]->if_name) < 0; j--)
+                        sorted[j] = sorted[j - 1];
+                sorted[j] = f;
+        }
 
-        struct init_function *func;
         dbg(DBG_INIT, "Initialization functions and dependencies:\n");
-        list_iterate_begin(&funcs, func, struct init_function, if_link) {
-                dbgq(DBG_INIT, "%s (0x%p): ", func->if_name, func->if_func);
-                struct init_depends *dep;
-                list_iterate_begin(&func->if_deps, dep, struct init_depends, id_link) {
-                        dbgq(DBG_INIT, "%s ", dep->id_name);
-                } list_iterate_end();
+        for (i = 0; i < init_nfuncs; i++) {
+                struct init_function *f = &init_funcs[i];
+                dbgq(DBG_INIT, "%s (0x%p): ", f->if_name, f->if_func);
+                for (j = f->if_deps; j < f->if_deps + f->if_ndeps; j++) {
+                        dbgq(DBG_INIT, "%s ", init_dep_names[j]);
+                        init_deps[j] = _init_lookup(sorted, init_dep_names[j], f->if_name);
+                }
                 dbgq(DBG_INIT, "\n");
-        } list_iterate_end();
+        }
 
-        list_iterate_begin(&funcs, func, struct init_function, if_link) {
-                if (!func->if_called) {
-                        func->if_search = ++_init_search_count;
-                        _init_call(&funcs, func);
-                }
-        } list_iterate_end();
-
-        list_iterate_begin(&funcs, func, struct init_function, if_link) {
-                struct init_depends *dep;
-                list_iterate_begin(&func->if_deps, dep, struct init_depends, id_link) {
-                        kfree(dep);
-                } list_iterate_end();
-                kfree(func);
-        } list_iterate_end();
+        for (i = 0; i < init_nfuncs; i++) {
+                if (INIT_UNVISITED == init_funcs[i].if_state)
+                        _init_call(&init_funcs[i]);
+        }
+
+        kfree(init_deps);
+        kfree(init_dep_names);
+        kfree(sorted);
+        kfree(init_funcs);
+        init_funcs = NULL;
 }
@@ -0,0 +1,201 @@
+#include "types.h"
+#include "errno.h"
+#include "kernel.h"
+
+#include "util/debug.h"
+#include "util/lz4.h"
+#include "util/string.h"
+
+/*
+ * Each sequence is a token, whose high nibble is the number of literals
+ * and whose low nibble the length of the match less LZ4_MINMATCH, either
+ * of them continued in bytes after it if it is 15; then the literals; then
+ * the distance back to the match as two bytes, little-endian. The last
+ * sequence has only literals, and the format wants at least LZ4_LASTLITERALS
+ * of them, with no match starting in the last LZ4_MFLIMIT bytes.
+ */
+#define LZ4_MINMATCH            4
+#define LZ4_LASTLITERALS        5
+#define LZ4_MFLIMIT             12
+#define LZ4_MAX_DISTANCE        0xffff
+#define LZ4_RUN_MASK            15
+
+#define LZ4_HASH_BITS           12
+
+/* Where in the input each hash of four bytes was last seen. Compression
+ * never blocks, so one table does for everyone. */
+static uint16_t lz4_table[1 << LZ4_HASH_BITS];
+
+static uint32_t
+lz4_read32(const uint8_t *p)
+{
+        /* unaligned loads are fine on x86 */
+        return *(const uint32_t *)p;
+}
+
+static uint32_t
+lz4_hash(uint32_t v)
+{
+        return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* Writes the rest of a length which did not fit in its nibble */
+static uint8_t *
+lz4_put_length(uint8_t *op, size_t len)
+{
+        for (; len >= 255; len -= 255)
+                *op++ = 255;
+        *op++ = (uint8_t)len;
+        return op;
+}
+
+/* Writes a sequence of the literals from anchor and then, unless mlen is
+ * 0, a match of mlen bytes off bytes back, or returns NULL if that does
+ * not fit before oend */
+static uint8_t *
+lz4_put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *anchor,
+                 size_t litlen, size_t off, size_t mlen)
+{
+        uint8_t *token;
+        size_t need = 1 + litlen + litlen / 255 + 1;
+
+        if (0 != mlen)
+                need += 2 + (mlen - LZ4_MINMATCH) / 255 + 1;
+        if ((size_t)(oend - op) < need)
+                return NULL;
+        token = op++;
+
+        if (litlen >= LZ4_RUN_MASK) {
+                *token = LZ4_RUN_MASK << 4;
+                op = lz4_put_length(op, litlen - LZ4_RUN_MASK);
+        } else {
+                *token = (uint8_t)(litlen << 4);
+        }
+        memcpy(op, anchor, litlen);
+        op += litlen;
+        if (0 == mlen)
+                return op;
+
+        *op++ = (uint8_t)off;
+        *op++ = (uint8_t)(off >> 8);
+        mlen -= LZ4_MINMATCH;
+        if (mlen >= LZ4_RUN_MASK) {
+                *token |= LZ4_RUN_MASK;
+                op = lz4_put_length(op, mlen - LZ4_RUN_MASK);
+        } else {
+                *token |= (uint8_t)mlen;
+        }
+        return op;
+}
+
+size_t
+lz4_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+        const uint8_t *base = (const uint8_t *)src, *end = base + len;
+        const uint8_t *ip = base, *anchor = base, *ref;
+        uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+        size_t mlen;
+        uint32_t h;
+
+        KASSERT(len <= LZ4_MAX_DISTANCE + 1);
+
+        if (len > LZ4_MFLIMIT) {
+                const uint8_t *mflimit = end - LZ4_MFLIMIT;
+                const uint8_t *matchlimit = end - LZ4_LASTLITERALS;
+
+                memset(lz4_table, 0, sizeof(lz4_table));
+                lz4_table[lz4_hash(lz4_read32(ip))] = 0;
+                ip++;
+
+                while (ip < mflimit) {
+                        h = lz4_hash(lz4_read32(ip));
+                        ref = base + lz4_table[h];
+                        lz4_table[h] = (uint16_t)(ip - base);
+                        if (ref >= ip || lz4_read32(ref) != lz4_read32(ip)) {
+                                ip++;
+                                continue;
+                        }
+
+                        /* the match may begin before where it was found */
+                        while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                                ip--;
+                                ref--;
+                        }
+                        for (mlen = LZ4_MINMATCH;
+                             ip + mlen < matchlimit && ip[mlen] == ref[mlen]; mlen++)
+                                ;
+
+                        if (NULL == (op = lz4_put_sequence(op, oend, anchor, ip - anchor,
+                                                           ip - ref, mlen)))
+                                return 0;
+                        ip += mlen;
+                        anchor = ip;
+                }
+        }
+
+        if (NULL == (op = lz4_put_sequence(op, oend, anchor, end - anchor, 0, 0)))
+                return 0;
+        return op - (uint8_t *)dst;
+}
+
+/* Reads the rest of a length whose nibble was 15, or returns -1 if the
+ * input ends first */
+static int
+lz4_get_length(const uint8_t **ipp, const uint8_t *iend, size_t *len)
+{
+        const uint8_t *ip = *ipp;
+        uint8_t b;
+
+        do {
+                if (ip >= iend)
+                        return -1;
+                b = *ip++;
+                *len += b;
+        } while (255 == b);
+        *ipp = ip;
+        return 0;
+}
+
+int
+lz4_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+        const uint8_t *ip = (const uint8_t *)src, *iend = ip + len;
+        uint8_t *base = (uint8_t *)dst, *op = base, *oend = base + cap;
+        const uint8_t *match;
+        size_t n, off;
+        uint8_t token;
+
+        while (ip < iend) {
+                token = *ip++;
+
+                n = token >> 4;
+                if (LZ4_RUN_MASK == n && 0 > lz4_get_length(&ip, iend, &n))
+                        return -EINVAL;
+                if (n > (size_t)(iend - ip) || n > (size_t)(oend - op))
+                        return -EINVAL;
+                memcpy(op, ip, n);
+                op += n;
+                ip += n;
+                if (ip == iend)
+                        break;
+
+                if (iend - ip < 2)
+                        return -EINVAL;
+                off = ip[0] | (ip[1] << 8);
+                ip += 2;
+                if (0 == off || off > (size_t)(op - base))
+                        return -EINVAL;
+
+                n = token & LZ4_RUN_MASK;
+                if (LZ4_RUN_MASK == n && 0 > lz4_get_length(&ip, iend, &n))
+                        return -EINVAL;
+                n += LZ4_MINMATCH;
+                if (n > (size_t)(oend - op))
+                        return -EINVAL;
+
+                /* a match may overlap what it makes, for runs */
+                for (match = op - off; n > 0; n--)
+                        *op++ = *match++;
+        }
+        return op - base;
+}
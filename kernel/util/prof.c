@@ -0,0 +1,93 @@
+#include "kernel.h"
+#include "types.h"
+#include "globals.h"
+
+#include "main/interrupt.h"
+
+#include "proc/proc.h"
+
+#include "util/prof.h"
+#include "util/string.h"
+#include "util/time.h"
+
+/*
+ * The table is a hash of (eip, pid, chain), so that a sample is a walk of
+ * a few frames, a few loads and an increment, taken with interrupts
+ * masked; a sample which finds nowhere to go within PROF_PROBES slots is
+ * only counted as dropped.
+ */
+#define PROF_PROBES     16
+
+prof_slot_t prof_table[PROF_NSLOTS];
+uint32_t prof_samples = 0;
+uint32_t prof_dropped = 0;
+
+static void
+prof_sample(regs_t *regs)
+{
+        pid_t pid = (NULL != curproc) ? curproc->p_pid : -1;
+        uintptr_t chain[CALLCHAIN_DEPTH] = { 0 };
+        uint32_t h = (regs->r_eip * 2654435761U) ^ (uint32_t)pid;
+        int i, n = 0;
+
+        /* the interrupted function's own frame is where regs->r_ebp
+         * points, unless it was interrupted setting it up */
+        if (0 == (regs->r_cs & 0x3))
+                n = callchain_walk(regs->r_ebp, chain, CALLCHAIN_DEPTH);
+        for (i = 0; i < n; i++)
+                h = (h ^ chain[i]) * 16777619U;
+
+        prof_samples++;
+        for (i = 0; i < PROF_PROBES; i++) {
+                prof_slot_t *s = &prof_table[(h + i) & (PROF_NSLOTS - 1)];
+                if (0 == s->ps_count) {
+                        s->ps_eip = regs->r_eip;
+                        s->ps_pid = pid;
+                        memcpy(s->ps_chain, chain, sizeof(chain));
+                }
+                if (s->ps_eip == regs->r_eip && s->ps_pid == pid
+                    && 0 == memcmp(s->ps_chain, chain, sizeof(chain))) {
+                        s->ps_count++;
+                        return;
+                }
+        }
+        prof_dropped++;
+}
+
+void
+prof_start(void)
+{
+        timer_set_sampler(NULL, 0);
+        memset(prof_table, 0, sizeof(prof_table));
+        prof_samples = 0;
+        prof_dropped = 0;
+        timer_set_sampler(prof_sample, PROF_INTERVAL_MSECS);
+}
+
+void
+prof_stop(void)
+{
+        timer_set_sampler(NULL, 0);
+}
+
+uint32_t
+prof_sort(void)
+{
+        uint32_t n = 0, i, j;
+
+        prof_stop();
+        for (i = 0; i < PROF_NSLOTS; i++) {
+                if (0 != prof_table[i].ps_count)
+                        prof_table[n++] = prof_table[i];
+        }
+        memset(&prof_table[n], 0, (PROF_NSLOTS - n) * sizeof(prof_slot_t));
+
+        /* an insertion sort, there being no hurry */
+        for (i = 1; i < n; i++) {
+                prof_slot_t s = prof_table[i];
+                for (j = i; j > 0 && prof_table[j - 1].ps_count < s.ps_count; j--)
+                        prof_table[j] = prof_table[j - 1];
+                prof_table[j] = s;
+        }
+        return n;
+}
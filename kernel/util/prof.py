@@ -0,0 +1,77 @@
+import gdb
+
+import weenix
+
+class ProfCommand(weenix.Command):
+    """usage: prof [<count>]
+       prof --folded
+    <count>  how many functions to print, all if unspecified
+    Adds up the sampling profiler's counts (see util/prof.h) by the kernel
+    function they fall in, most samples first. User addresses are counted
+    together by pid, since gdb has only the kernel's symbols.
+    With --folded, prints each call chain instead, outermost function
+    first and separated by ';', then its count, which is what
+    flamegraph.pl takes to draw a flame graph."""
+
+    def __init__(self):
+        weenix.Command.__init__(self, "prof", gdb.COMMAND_DATA)
+
+    def _where(self, eip, pid):
+        if (eip < 0xc0000000):
+            return "<user pid {0}>".format(pid)
+        try:
+            block = gdb.block_for_pc(eip)
+        except RuntimeError:
+            block = None
+        while (block != None and block.function == None):
+            block = block.superblock
+        if (block == None):
+            return "{0:#x}".format(eip)
+        return block.function.name
+
+    def _slots(self):
+        nslots = int(gdb.parse_and_eval("sizeof(prof_table) / sizeof(prof_table[0])"))
+        depth = int(gdb.parse_and_eval("sizeof(prof_table[0].ps_chain) / sizeof(prof_table[0].ps_chain[0])"))
+        for i in xrange(nslots):
+            slot = gdb.parse_and_eval("prof_table[{0}]".format(i))
+            count = int(slot["ps_count"])
+            if (count == 0):
+                continue
+            pid = int(slot["ps_pid"])
+            chain = [ int(slot["ps_chain"][j]) & 0xffffffff for j in xrange(depth) ]
+            yield (int(slot["ps_eip"]) & 0xffffffff, pid, [ pc for pc in chain if pc != 0 ], count)
+
+    def _folded(self):
+        stacks = dict()
+        for eip, pid, chain, count in self._slots():
+            # a return address is just past its call, which is named
+            frames = [ self._where(pc - 1, pid) for pc in reversed(chain) ]
+            frames.append(self._where(eip, pid))
+            stack = ";".join(frames)
+            stacks[stack] = stacks.get(stack, 0) + count
+        for stack in sorted(stacks):
+            gdb.write("{0} {1}\n".format(stack, stacks[stack]))
+
+    def invoke(self, arg, tty):
+        args = gdb.string_to_argv(arg)
+        if (args == [ "--folded" ]):
+            self._folded()
+            return
+        if (len(args) > 1):
+            gdb.write("{0}\n".format(self.__doc__))
+            raise gdb.GdbError("invalid arguments")
+
+        counts = dict()
+        for eip, pid, chain, count in self._slots():
+            where = self._where(eip, pid)
+            counts[where] = counts.get(where, 0) + count
+
+        total = int(gdb.parse_and_eval("prof_samples"))
+        hist = sorted(counts.items(), key=lambda c: c[1], reverse=True)
+        if (len(args) == 1):
+            hist = hist[:int(args[0])]
+        gdb.write("{0} samples, {1} dropped\n".format(total, int(gdb.parse_and_eval("prof_dropped"))))
+        for where, count in hist:
+            gdb.write("{0:>8} {1:>5.1f}% {2}\n".format(count, 100.0 * count / max(total, 1), where))
+
+ProfCommand()
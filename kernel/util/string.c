@@ -3,50 +3,67 @@
 
 int memcmp(const void *cs, const void *ct, size_t count)
 {
-        int ret;
-        /* Compare bytes at %esi and %edi up to %ecx bytes OR until
-         * the bytes are not equal */
-        /* If not equal, set zf = 0 and stop */
-        /* Find out zf and sf and use them to return 0,1, or -1 */
+        const unsigned char *a = cs, *b = ct;
+        size_t words = count >> 2, left, i;
+
+        /* Skip the dwords which are the same; if one differs, back up to
+         * its start so the bytes below find which of its bytes it is.
+         * Setting zf first covers there being no dwords at all. */
         __asm__ volatile(
-                "xor %%eax, %%eax\n\t"  /* Zero output */
-                "cld\n\t"               /* Make sure direction is forwards */
+                "cld\n\t"
+                "xorl %%eax, %%eax\n\t"
                 "repe\n\t"
-                "cmpsb\n\t"
-                "setnz %%al\n\t"        /* If it is not zero, put 1 in low part */
-                "sets %%ah"             /* If sign set (means 2nd arg larger),
-                                         * put 1 in high part */
-                : "=a"(ret)
-                : "S"(cs), "D"(ct), "c"(count)
-                : "cc"                  /* Overwrite flags */
+                "cmpsl\n\t"
+                "je 1f\n\t"
+                "subl $4, %%esi\n\t"
+                "subl $4, %%edi\n\t"
+                "incl %%ecx\n"
+                "1:"
+                : "+S"(a), "+D"(b), "+c"(words)
+                :
+                : "eax", "cc", "memory"
         );
-        return ((ret & 1) ? ((ret >> 8) ? -1 : 1) : 0);
+        left = (words << 2) + (count & 3);
+        for (i = 0; i < left; i++) {
+                if (a[i] != b[i])
+                        return (int)a[i] - (int)b[i];
+        }
+        return 0;
 }
 
 void *memcpy(void *dest, const void *src, size_t count)
 {
-        /* Move %ecx bytes from %esi to %edi */
+        int d0, d1, d2;
+        /* Move %ecx / 4 dwords from %esi to %edi, then the odd bytes */
         __asm__ volatile(
                 "cld\n\t" /* Make sure direction is forwards */
                 "rep\n\t"
+                "movsl\n\t"
+                "movl %4, %%ecx\n\t"
+                "rep\n\t"
                 "movsb"
-                : /* No output */
-                : "S"(src), "D"(dest), "c"(count)
-                : "cc" /* We overwrite condition codes - i.e., flags */
+                : "=&c"(d0), "=&D"(d1), "=&S"(d2)
+                : "0"(count >> 2), "g"(count & 3), "1"(dest), "2"(src)
+                : "memory", "cc" /* We overwrite condition codes - i.e., flags */
         );
         return dest;
 }
 
 void *memset(void *s, int c, size_t count)
 {
-        /* Fill %ecx bytes at %edi with %eax (actually %al) */
+        int d0, d1;
+        /* Fill %ecx / 4 dwords at %edi with the byte repeated in %eax,
+         * then the odd bytes */
         __asm__ volatile(
                 "cld\n\t" /* Make sure direction is forwards */
                 "rep\n\t"
+                "stosl\n\t"
+                "movl %3, %%ecx\n\t"
+                "rep\n\t"
                 "stosb"
-                : /* No output */
-                : "a"(c), "D"(s), "c"(count)
-                : "cc" /* Overwrite flags */
+                : "=&c"(d0), "=&D"(d1)
+                : "a"((c & 0xff) * 0x01010101), "g"(count & 3), "0"(count >> 2), "1"(s)
+                : "memory", "cc" /* Overwrite flags */
         );
         return s;
 }
@@ -1,36 +1,232 @@
 #include "globals.h"
+#include "kernel.h"
+#include "config.h"
+#include "errno.h"
 
 #include "main/interrupt.h"
 #include "main/apic.h"
-#include "main/pit.h"
+#include "main/cpuid.h"
 
 #include "util/debug.h"
 #include "util/init.h"
+#include "util/time.h"
 
 #include "proc/sched.h"
 #include "proc/kthread.h"
+#include "proc/spinlock.h"
+
+#include "api/vdso.h"
 
 #define APIC_TIMER_IRQ 32 /* Map interrupt 32 */
 
-#ifdef __UPREEMPT__
-static unsigned int ms = 0;
+/*
+ * There is no periodic tick. The APIC timer is programmed in one-shot mode
+ * for the soonest pending timer and left off when there are none, so an
+ * idle system is not woken at all.
+ *
+ * timer_clock counts the milliseconds the APIC timer has been programmed
+ * for, and so only moves while some timer is pending; deadlines are only
+ * ever compared against it, never against the time of day.
+ *
+ * timer_lock protects all of the state below. It is taken with interrupts
+ * masked, since the handler takes it too.
+ */
+static spinlock_t timer_lock;
+static list_t timer_list;               /* pending timers, soonest first */
+static uint32_t timer_clock = 0;        /* msecs, as of the last reprogram */
+static uint32_t timer_armed = 0;        /* msecs the APIC timer was last
+                                         * programmed for, 0 if it is off */
+static void (*timer_sampler)(regs_t *) = NULL;
+static uint32_t timer_sample_msecs = 0; /* longest the timer may be armed
+                                         * for while there is a sampler */
+
+/*
+ * time_now_ns is kept apart from all of that. It scales the time stamp
+ * counter, which ticks at a fixed rate whether or not anything is
+ * pending, by its rate as measured against the PIT at boot:
+ * ns = ticks * time_tsc_mult >> time_tsc_shift, with the shift as large
+ * as it can be for the multiplier to fit in 32 bits.
+ */
+static uint64_t time_tsc_base;          /* the counter at time_init */
+static uint32_t time_tsc_mult;
+static uint32_t time_tsc_shift;
 
-static void pit_handler(regs_t *regs)
+#define timer_before(a, b) ((int32_t)((a) - (b)) < 0)
+
+/* The current time, counting what has already elapsed of the armed
+ * interval. */
+static uint32_t
+timer_now(void)
 {
-  dbg(DBG_CORE, "PIT HANDLER FIRED\n");
+        if (0 == timer_armed)
+                return timer_clock;
+        return timer_clock + timer_armed - MIN(timer_armed, apic_oneshot_remaining());
 }
 
-/* Uncomment this to enable the apic timer to 
- * call the pit_handler for userland preemption
- */
+/* Arm the APIC timer for the soonest pending timer, or turn it off. Must
+ * be called with timer_lock held. */
+static void
+timer_program(void)
+{
+        timer_clock = timer_now();
 
-static __attribute__((unused)) void time_init(void)
+        if (list_empty(&timer_list)) {
+                timer_armed = 0;
+        } else {
+                ktimer_t *t = list_head(&timer_list, ktimer_t, t_link);
+                timer_armed = timer_before(timer_clock, t->t_expires)
+                              ? t->t_expires - timer_clock : 1;
+        }
+        if (NULL != timer_sampler
+            && (0 == timer_armed || timer_armed > timer_sample_msecs))
+                timer_armed = timer_sample_msecs;
+        apic_start_oneshot_timer(timer_armed);
+}
+
+static void
+timer_handler(regs_t *regs)
 {
-  intr_map(APIC_TIMER_IRQ, APIC_TIMER_IRQ);
-  intr_register(APIC_TIMER_IRQ, pit_handler);
-  /* TODO: figure out how this argument converts to hertz */
-  apic_enable_periodic_timer(8);
+        spinlock_lock(&timer_lock);
+        timer_clock += timer_armed;
+        timer_armed = 0;
+        if (NULL != timer_sampler)
+                timer_sampler(regs);
+
+        /* Run everything due now or within TIMER_SLACK_MSECS together,
+         * rather than taking another interrupt right after this one */
+        while (!list_empty(&timer_list)) {
+                ktimer_t *t = list_head(&timer_list, ktimer_t, t_link);
+                if (timer_before(timer_clock + TIMER_SLACK_MSECS, t->t_expires))
+                        break;
+                list_remove(&t->t_link);
+                /* the callback may well add the timer back */
+                spinlock_unlock(&timer_lock);
+                t->t_func(t);
+                spinlock_lock(&timer_lock);
+        }
+        timer_program();
+        vdso_set_clock(timer_clock);
+        spinlock_unlock(&timer_lock);
 }
-init_func(time_init);
 
-#endif
+void
+timer_init(ktimer_t *t, void (*func)(ktimer_t *), void *data)
+{
+        t->t_expires = 0;
+        t->t_func = func;
+        t->t_data = data;
+        list_link_init(&t->t_link);
+}
+
+int
+timer_pending(ktimer_t *t)
+{
+        return list_link_is_linked(&t->t_link);
+}
+
+void
+timer_add(ktimer_t *t, uint32_t msecs)
+{
+        KASSERT(!timer_pending(t));
+
+        uint8_t oldipl = spinlock_lock_irqsave(&timer_lock);
+
+        t->t_expires = timer_now() + msecs;
+
+        ktimer_t *pos;
+        list_iterate_begin(&timer_list, pos, ktimer_t, t_link) {
+                if (timer_before(t->t_expires, pos->t_expires)) {
+                        list_insert_before(&pos->t_link, &t->t_link);
+                        goto inserted;
+                }
+        } list_iterate_end();
+        list_insert_tail(&timer_list, &t->t_link);
+inserted:
+        /* only a new soonest timer changes when the APIC has to fire */
+        if (timer_list.l_next == &t->t_link)
+                timer_program();
+
+        spinlock_unlock_irqrestore(&timer_lock, oldipl);
+}
+
+int
+timer_cancel(ktimer_t *t)
+{
+        int wasfirst, pending;
+
+        uint8_t oldipl = spinlock_lock_irqsave(&timer_lock);
+
+        if ((pending = timer_pending(t))) {
+                wasfirst = (timer_list.l_next == &t->t_link);
+                list_remove(&t->t_link);
+                if (wasfirst)
+                        timer_program();
+        }
+
+        spinlock_unlock_irqrestore(&timer_lock, oldipl);
+        return pending;
+}
+
+void
+timer_set_sampler(void (*func)(regs_t *), uint32_t msecs)
+{
+        uint8_t oldipl = spinlock_lock_irqsave(&timer_lock);
+
+        KASSERT(NULL == func || 0 < msecs);
+        timer_sampler = func;
+        timer_sample_msecs = msecs;
+        timer_program();
+
+        spinlock_unlock_irqrestore(&timer_lock, oldipl);
+}
+
+int
+timer_sleep(uint32_t msecs)
+{
+        ktqueue_t q;
+        int ret;
+
+        /* nobody else knows about q, so only the timeout can wake us */
+        sched_queue_init(&q);
+        ret = sched_sleep_on_timeout(&q, msecs);
+        return (-ETIME == ret) ? 0 : ret;
+}
+
+uint64_t
+time_now_ns(void)
+{
+        uint64_t ticks = cpuid_rdtsc() - time_tsc_base;
+
+        /* in two halves, so that neither product overflows */
+        return (((ticks >> 32) * time_tsc_mult) << (32 - time_tsc_shift))
+               + (((ticks & 0xffffffff) * time_tsc_mult) >> time_tsc_shift);
+}
+
+static void
+time_calibrate(void)
+{
+        uint32_t per_ms = apic_tsc_per_ms();
+        uint64_t mult;
+
+        time_tsc_shift = 32;
+        mult = ((uint64_t)1000000 << time_tsc_shift) / per_ms;
+        while (mult > 0xffffffff) {
+                time_tsc_shift--;
+                mult = ((uint64_t)1000000 << time_tsc_shift) / per_ms;
+        }
+        time_tsc_mult = (uint32_t)mult;
+        time_tsc_base = cpuid_rdtsc();
+        dbg(DBG_CORE, "TSC: %u per ms, ns = ticks * %u >> %u\n",
+            per_ms, time_tsc_mult, time_tsc_shift);
+}
+
+static __attribute__((unused)) void
+time_init(void)
+{
+        time_calibrate();
+        spinlock_init(&timer_lock);
+        list_init(&timer_list);
+        intr_map(APIC_TIMER_IRQ, APIC_TIMER_IRQ);
+        intr_register(APIC_TIMER_IRQ, timer_handler);
+}
+init_func(time_init);
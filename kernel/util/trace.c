@@ -0,0 +1,64 @@
+#include "kernel.h"
+#include "types.h"
+#include "config.h"
+#include "globals.h"
+
+#include "main/cpuid.h"
+
+#include "proc/proc.h"
+
+#include "util/printf.h"
+#include "util/trace.h"
+
+trace_rec_t trace_buf[TRACE_NRECS];
+volatile uint32_t trace_next = 0;
+int trace_enabled = TRACE_ENABLED;
+
+const char *trace_event_names[TRACE_NEVENTS] = {
+        [0]                     = "none",
+        [TRACE_SWITCH]          = "switch",
+        [TRACE_PAGEFAULT]       = "pagefault",
+        [TRACE_PFRAME_HIT]      = "pframe_hit",
+        [TRACE_PFRAME_MISS]     = "pframe_miss",
+        [TRACE_DISK]            = "disk",
+        [TRACE_SYSCALL_ENTER]   = "syscall",
+        [TRACE_SYSCALL_EXIT]    = "sysret"
+};
+
+void
+trace_emit(uint16_t event, uint32_t a0, uint32_t a1, uint32_t a2)
+{
+        uint32_t i = 1;
+        trace_rec_t *r;
+
+        if (!trace_enabled)
+                return;
+
+        /* an interrupt coming in after this gets the next record */
+        __asm__ volatile("xaddl %0, %1"
+                         : "+r"(i), "+m"(trace_next)
+                         : : "memory", "cc");
+        r = &trace_buf[i & (TRACE_NRECS - 1)];
+        r->tr_tsc = cpuid_rdtsc();
+        r->tr_event = event;
+        r->tr_pid = (NULL != curproc) ? (int16_t)curproc->p_pid : -1;
+        r->tr_args[0] = a0;
+        r->tr_args[1] = a1;
+        r->tr_args[2] = a2;
+}
+
+int
+trace_format(uint32_t n, char *buf, size_t size)
+{
+        uint32_t next = trace_next;
+        trace_rec_t *r;
+
+        if (n >= next || n >= TRACE_NRECS)
+                return -1;
+
+        r = &trace_buf[(next - 1 - n) & (TRACE_NRECS - 1)];
+        snprintf(buf, size, "%llu %d %s %#x %#x %#x\n", r->tr_tsc, r->tr_pid,
+                 (r->tr_event < TRACE_NEVENTS) ? trace_event_names[r->tr_event] : "?",
+                 r->tr_args[0], r->tr_args[1], r->tr_args[2]);
+        return 0;
+}
@@ -0,0 +1,46 @@
+import gdb
+
+import weenix
+
+class TraceCommand(weenix.Command):
+    """usage: trace [<count>]
+    <count>  how many of the newest records to print, all if unspecified
+    Decodes the kernel's trace ring (see util/trace.h), oldest record
+    first. Times are in time stamp counter ticks since the first record
+    printed."""
+
+    def __init__(self):
+        weenix.Command.__init__(self, "trace", gdb.COMMAND_DATA)
+
+    def _names(self):
+        names = list()
+        for i in xrange(int(gdb.parse_and_eval("sizeof(trace_event_names) / sizeof(trace_event_names[0])"))):
+            names.append(gdb.parse_and_eval("trace_event_names[{0}]".format(i)).string())
+        return names
+
+    def invoke(self, arg, tty):
+        args = gdb.string_to_argv(arg)
+        if (len(args) > 1):
+            gdb.write("{0}\n".format(self.__doc__))
+            raise gdb.GdbError("invalid arguments")
+
+        nrecs = int(gdb.parse_and_eval("sizeof(trace_buf) / sizeof(trace_buf[0])"))
+        nargs = int(gdb.parse_and_eval("sizeof(trace_buf[0].tr_args) / sizeof(trace_buf[0].tr_args[0])"))
+        next = int(gdb.parse_and_eval("trace_next"))
+        count = min(next, nrecs)
+        if (len(args) == 1):
+            count = min(count, int(args[0]))
+        names = self._names()
+
+        start = None
+        for i in xrange(next - count, next):
+            rec = gdb.parse_and_eval("trace_buf[{0}]".format(i % nrecs))
+            tsc = int(rec["tr_tsc"])
+            if (start == None):
+                start = tsc
+            event = int(rec["tr_event"])
+            name = names[event] if (event < len(names)) else str(event)
+            recargs = " ".join(map(lambda j: "{0:#x}".format(int(rec["tr_args"][j]) & 0xffffffff), xrange(nargs)))
+            gdb.write("{0:>12} {1:>4} {2:<12} {3}\n".format(tsc - start, int(rec["tr_pid"]), name, recargs))
+
+TraceCommand()
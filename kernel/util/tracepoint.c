@@ -0,0 +1,44 @@
+#include "kernel.h"
+#include "types.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+#include "util/tracepoint.h"
+
+#ifndef NDEBUG
+#define TRACEPOINT_SIZE         5       /* bytes of a site */
+#define TRACEPOINT_JMP          0xe9    /* jmp rel32 */
+
+static const uint8_t tracepoint_nop[TRACEPOINT_SIZE] = { 0x0f, 0x1f, 0x44, 0x00, 0x00 };
+
+void
+tracepoint_sync(void)
+{
+        tracepoint_t *tp;
+        uint8_t *site;
+        uint64_t mode;
+        uint32_t flags;
+
+        /* Nothing may run a site half rewritten. This is called from
+         * dbg_init, before the APIC is mapped, so interrupts are masked
+         * with cli rather than intr_setipl. */
+        __asm__ volatile("pushfl\n\t"
+                         "popl %0\n\t"
+                         "cli"
+                         : "=r"(flags) : : "memory");
+        for (tp = (tracepoint_t *)&kernel_start_tracepoints;
+             tp < (tracepoint_t *)&kernel_end_tracepoints; tp++) {
+                site = (uint8_t *)tp->tp_site;
+                mode = ((uint64_t)tp->tp_mode_hi << 32) | tp->tp_mode_lo;
+                if (dbg_modes & mode) {
+                        site[0] = TRACEPOINT_JMP;
+                        *(int32_t *)(site + 1) = tp->tp_target - (tp->tp_site + TRACEPOINT_SIZE);
+                } else {
+                        memcpy(site, tracepoint_nop, TRACEPOINT_SIZE);
+                }
+        }
+        __asm__ volatile("pushl %0\n\t"
+                         "popfl"
+                         : : "r"(flags) : "memory", "cc");
+}
+#endif /* NDEBUG */
@@ -11,10 +11,39 @@
 #include "mm/slab.h"
 #include "mm/tlb.h"
 
+#include "vm/anon.h"
+#include "vm/swap.h"
+
 int anon_count = 0; /* for debugging/verification purposes */
 
 static slab_allocator_t *anon_allocator;
 
+/*
+ * An anonymous object, and the swap slot of each of its pages which has
+ * one. A page gets its slot when it is first dirtied, so that pageoutd
+ * never has to allocate anything to write it out, and keeps it until the
+ * object goes away. Without a slot (because there is no swap, or it is
+ * full) a page is pinned, as there is nowhere else for it to be.
+ */
+typedef struct anon {
+        mmobj_t         an_mmobj;
+        radix_tree_t    an_slots;       /* slot + 1 of each such page */
+} anon_t;
+
+#define mmobj_to_anon(o) CONTAINER_OF(o, anon_t, an_mmobj)
+
+/* The page's slot + 1, or 0 if it has none */
+static uint32_t
+anon_slot(mmobj_t *o, uint32_t pagenum)
+{
+        return (uint32_t)(uintptr_t)radix_lookup(&mmobj_to_anon(o)->an_slots, pagenum);
+}
+
+/* A pinned page of zeros, page 0 of an anonymous object of its own, that
+ * read faults on untouched anonymous memory map instead of getting a page
+ * of their own. It is never looked up for writing, so it stays zero. */
+static pframe_t *anon_zeropage;
+
 static void anon_ref(mmobj_t *o);
 static void anon_put(mmobj_t *o);
 static int  anon_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf);
@@ -23,6 +52,7 @@ static int  anon_dirtypage(mmobj_t *o, pframe_t *pf);
 static int  anon_cleanpage(mmobj_t *o, pframe_t *pf);
 
 static mmobj_ops_t anon_mmobj_ops = {
+        .type = MMOBJ_ANON,
         .ref = anon_ref,
         .put = anon_put,
         .lookuppage = anon_lookuppage,
@@ -39,7 +69,13 @@ static mmobj_ops_t anon_mmobj_ops = {
 void
 anon_init()
 {
-    anon_allocator = slab_allocator_create("anonymous object", sizeof(mmobj_t));
+    anon_allocator = slab_allocator_create("anonymous object", sizeof(anon_t));
+
+    mmobj_t *zero = anon_create();
+    KASSERT(NULL != zero && "Ran out of memory while booting.");
+    zero->mmo_ops->ref(zero);
+    int err = pframe_get(zero, 0, &anon_zeropage);
+    KASSERT(0 == err && "Ran out of memory while booting.");
 }
 
 /*
@@ -51,11 +87,13 @@ anon_init()
 mmobj_t *
 anon_create()
 {
-    mmobj_t *mmo = slab_obj_alloc(anon_allocator);
-    if (mmo) {
-        mmobj_init(mmo, &anon_mmobj_ops);
+    anon_t *an = slab_obj_alloc(anon_allocator);
+    if (NULL == an) {
+        return NULL;
     }
-    return mmo;
+    mmobj_init(&an->an_mmobj, &anon_mmobj_ops);
+    radix_tree_init(&an->an_slots);
+    return &an->an_mmobj;
 }
 
 /* Implementation of mmobj entry points: */
@@ -75,44 +113,56 @@ anon_ref(mmobj_t *o)
  * pages of the object, we can conclude that the object is no
  * longer in use and, since it is an anonymous object, it will
  * never be used again. You should unpin and uncache all of the
- * object's pages and then free the object itself.
+ * object's pages and then free the object itself, and its swap slots.
  */
 static void
 anon_put(mmobj_t *o)
 {
     if ((o->mmo_refcount - 1) == o->mmo_nrespages) {
-        pframe_t *pframe_cur;
-        list_iterate_begin(&o->mmo_respages, pframe_cur, pframe_t, pf_olink) {
+        /*nothing needs what is in the pages any more, not even dirty ones*/
+        while (!list_empty(&o->mmo_respages)) {
+            pframe_t *pframe_cur = list_head(&o->mmo_respages, pframe_t, pf_olink);
             KASSERT(pframe_cur->pf_obj == o);
-            pframe_unpin(pframe_cur);
-            /*uncache the page frame*/
-            /*maybe no need to free it here*/
-            /*pframe_clean(pframe_cur);*/
-            
-            if (pframe_is_dirty(pframe_cur)) {
-                pframe_clean(pframe_cur);
+            if (pframe_is_busy(pframe_cur)) {
+                /*pageoutd is writing it out*/
+                sched_sleep_on(pframe_waitq(pframe_cur));
+                continue;
+            }
+            if (pframe_is_pinned(pframe_cur)) {
+                pframe_unpin(pframe_cur);
             }
-             
-            /*o->mmo_ops->cleanpage(o, pframe_cur);*/
-
             pframe_free(pframe_cur);
-        } list_iterate_end();
+        }
     }
 
     if (0 < --o->mmo_refcount) {
         return;
     }
 
+    anon_t *an = mmobj_to_anon(o);
+    uint32_t pagenum = 0;
+    void *slot;
+    while (NULL != (slot = radix_next(&an->an_slots, &pagenum))) {
+        radix_remove(&an->an_slots, pagenum);
+        swap_free((uint32_t)(uintptr_t)slot - 1);
+    }
 
-    slab_obj_free(anon_allocator, o);
+    slab_obj_free(anon_allocator, an);
         /*NOT_YET_IMPLEMENTED("VM: anon_put");*/
 }
 
-/* Get the corresponding page from the mmobj. No special handling is
- * required. */
+/* Get the corresponding page from the mmobj. A page that has never been
+ * written (and so is neither resident nor in swap) reads as
+ * anon_zeropage; only a write allocates it. */
 static int
 anon_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
 {
+    if (!forwrite && NULL == pframe_get_resident(o, pagenum)
+        && 0 == anon_slot(o, pagenum)) {
+        *pf = anon_zeropage;
+        return 0;
+    }
+
     int err = pframe_get(o, pagenum, pf);
     if (err < 0) {
         KASSERT(*pf == NULL);
@@ -133,20 +183,86 @@ anon_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
 static int
 anon_fillpage(mmobj_t *o, pframe_t *pf)
 {
-    memset(pf->pf_addr, 0, PAGE_SIZE);
-    pframe_pin(pf);
+    uint32_t slot = anon_slot(o, pf->pf_pagenum);
+    if (0 != slot) {
+        void *addr = pframe_kmap(pf);
+        int err = swap_read(slot - 1, addr);
+        pframe_kunmap(pf, addr);
+        if (err < 0) {
+            return err;
+        }
+    } else if (!pframe_is_zeroed(pf)) {
+        void *addr = pframe_kmap_atomic(pf);
+        page_zero(addr);
+        pframe_kunmap_atomic(pf, addr);
+    }
+    pf->pf_flags &= ~PF_ZEROED;
+
+    /*without swap there is nowhere for the page to go*/
+    if (!swap_enabled()) {
+        pframe_pin(pf);
+    }
+
+    /*shared mappings may have been reading anon_zeropage here*/
+    pframe_remove_from_pts(pf);
 
     return 0;
 }
 
+/*
+ * Reserves the page's slot, before anything is written to it; if swap
+ * is full the page is kept in memory instead.
+ */
 static int
 anon_dirtypage(mmobj_t *o, pframe_t *pf)
 {
+    anon_t *an = mmobj_to_anon(o);
+    uint32_t slot;
+    int err;
+
+    if (!swap_enabled()) {
+        return 0;
+    }
+    if (0 != (slot = anon_slot(o, pf->pf_pagenum))) {
+        /*what is in the slot is about to be out of date*/
+        swap_discard(slot - 1);
+        return 0;
+    }
+
+    if (0 == (err = swap_alloc(&slot))) {
+        err = radix_insert(&an->an_slots, pf->pf_pagenum, (void *)(uintptr_t)(slot + 1));
+        if (err < 0) {
+            swap_free(slot);
+        }
+    }
+    if (err < 0) {
+        dbg(DBG_ANON, "no swap for page %d of %p (%d), pinning it\n",
+            pf->pf_pagenum, o, err);
+        pframe_pin(pf);
+    }
     return 0;
 }
 
+/*
+ * Pages without a slot are pinned, and never written out. So is a page
+ * compressed swap has no room for, which keeps its slot, empty, until
+ * the object goes away.
+ */
 static int
 anon_cleanpage(mmobj_t *o, pframe_t *pf)
 {
-    return 0;
+    uint32_t slot = anon_slot(o, pf->pf_pagenum);
+    if (0 == slot) {
+        return 0;
+    }
+    void *addr = pframe_kmap(pf);
+    int err = swap_write(slot - 1, addr);
+    pframe_kunmap(pf, addr);
+    if (-ENOSPC == err) {
+        dbg(DBG_ANON, "no room in swap for page %d of %p, pinning it\n",
+            pf->pf_pagenum, o);
+        pframe_pin(pf);
+        return 0;
+    }
+    return err;
 }
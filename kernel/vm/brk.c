@@ -61,10 +61,10 @@ do_brk(void *addr, void **ret)
         return 0;
     }
 
+    vmmap_t *map = curproc->p_vmmap;
     uintptr_t start_brk = (uintptr_t)curproc->p_start_brk;
     uintptr_t brk = (uintptr_t)curproc->p_brk;
     uintptr_t vaddr = (uintptr_t)addr;
-    uint32_t lopage = ADDR_TO_PN(PAGE_ALIGN_DOWN(start_brk));
 
     if (vaddr < start_brk) {
         return -ENOMEM;
@@ -74,42 +74,48 @@ do_brk(void *addr, void **ret)
         return -ENOMEM;
     }
 
-    if (vaddr == brk) {
-        *ret = addr;
-        KASSERT(curproc->p_brk == addr);
-        curproc->p_brk = addr;
-        return 0;
-    }
-
     KASSERT(start_brk <= brk);
 
-    vmarea_t *area = vmmap_lookup(curproc->p_vmmap, lopage);
+    /*
+     * the heap is the pages from the one start_brk is in up to the break,
+     * and is part of the data/bss area unless start_brk is page aligned
+     */
+    uint32_t lopage = ADDR_TO_PN(PAGE_ALIGN_DOWN(start_brk));
+    uint32_t oldend = ADDR_TO_PN(PAGE_ALIGN_UP(brk));
+    uint32_t newend = ADDR_TO_PN(PAGE_ALIGN_UP(vaddr));
 
-    if (area == NULL) {
-        panic("panic for now\n");
-        return -1;
-    } else {
-        KASSERT(area);
+    if (newend > oldend) {
+        if (!vmmap_is_range_empty(map, oldend, newend - oldend)) {
+            return -ENOMEM;
+        }
 
-        uint32_t hiaddr = (uint32_t)(vaddr - 1);
-        uint32_t hipage = ADDR_TO_PN(hiaddr);
-        if (hipage < area->vma_end) {
-            area->vma_end = hipage + 1;
-            *ret = addr;
-            curproc->p_brk = addr;
-            return 0;
+        vmarea_t *area = (oldend > lopage) ? vmmap_lookup(map, oldend - 1) : NULL;
+        if (area != NULL) {
+            KASSERT(area->vma_end == oldend);
+            vmmap_resize(map, area, newend);
         } else {
-            if (vmmap_is_range_empty(curproc->p_vmmap, area->vma_end,
-                                        hipage - area->vma_end + 1)) {
-                area->vma_end = hipage + 1;
-                *ret = addr;
-                curproc->p_brk = addr;
-                return 0;
-            } else {
-                return -ENOMEM;
+            /*nothing to grow yet*/
+            int err = vmmap_map(map, NULL, oldend, newend - oldend,
+                                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                                0, VMMAP_DIR_HILO, NULL);
+            if (err < 0) {
+                return err;
             }
         }
+    } else if (newend < oldend) {
+        /*
+         * give the pages back now rather than when the process exits:
+         * the page table entries and the area's own copies go first, so
+         * that growing the heap again finds zeros
+         */
+        vmmap_dontneed(map, newend, oldend - newend);
+        int err = vmmap_remove(map, newend, oldend - newend);
+        if (err < 0) {
+            return err;
+        }
     }
-        /*NOT_YET_IMPLEMENTED("VM: do_brk");*/
-        /*return 0;*/
+
+    *ret = addr;
+    curproc->p_brk = addr;
+    return 0;
 }
@@ -0,0 +1,569 @@
+/*
+ * Same-page merging. Private mappings of the same file, or of zeros, in
+ * many processes tend to end up with many pages written the same way
+ * (tables built at startup, buffers cleared and never used); ksmd looks
+ * through the pages of the shadow objects, which are where all of them
+ * are, and keeps just one copy of each set of same pages, a ksm page.
+ *
+ * ksmd wakes every KSM_SCAN_MSECS and hashes the next KSM_SCAN_PAGES
+ * pages, going through the objects in the order shadow_next() has them.
+ * A page whose hash differs from what it was the last time round is
+ * being written, and is left until it settles. Otherwise it is looked
+ * for among the ksm pages (the stable table), and then among the pages
+ * this pass has seen so far which matched nothing (the unstable table),
+ * which two pages found the same become a new ksm page from. The
+ * unstable table is thrown away at the end of each pass, since its
+ * pages may have changed since.
+ *
+ * A page that is merged is taken out of the page tables, compared again
+ * (nothing can write it now), and freed, and its object keeps the ksm
+ * page in its sh_merged in its place. Lookups through the object find
+ * the ksm page there, for reading only: a write is a fill of a new page
+ * of the object, which copies the ksm page and drops it from sh_merged
+ * (see shadow_fillpage()). A ksm page goes once nothing has it merged.
+ *
+ * The ksm pages are pinned pages of ksm_obj, which nothing maps from.
+ * Nothing here blocks but getting a new ksm page and putting the objects
+ * ksmd holds references to.
+ */
+
+#include "kernel.h"
+#include "globals.h"
+#include "types.h"
+#include "errno.h"
+#include "config.h"
+
+#include "util/counter.h"
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/string.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/radix.h"
+#include "mm/slab.h"
+
+#include "vm/ksm.h"
+#include "vm/shadow.h"
+
+#define KSM_BUCKETS     64
+
+/* A page which objects have merged their own copies of it into */
+typedef struct ksm_page {
+        pframe_t       *kp_pf;          /* of ksm_obj, pinned */
+        uint32_t        kp_hash;
+        int             kp_nshared;     /* objects with it in sh_merged */
+        list_link_t     kp_link;        /* on its bucket of ksm_stable */
+} ksm_page_t;
+
+/* A page this pass saw, which matched nothing */
+typedef struct ksm_cand {
+        mmobj_t        *kc_obj;         /* reffed */
+        uint32_t        kc_pagenum;
+        uint32_t        kc_hash;
+        list_link_t     kc_link;        /* on its bucket of ksm_unstable */
+} ksm_cand_t;
+
+static void ksm_ref(mmobj_t *o);
+static void ksm_put(mmobj_t *o);
+static int  ksm_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf);
+static int  ksm_fillpage(mmobj_t *o, pframe_t *pf);
+static int  ksm_dirtypage(mmobj_t *o, pframe_t *pf);
+static int  ksm_cleanpage(mmobj_t *o, pframe_t *pf);
+
+static mmobj_ops_t ksm_mmobj_ops = {
+        .type = MMOBJ_OTHER,
+        .ref = ksm_ref,
+        .put = ksm_put,
+        .lookuppage = ksm_lookuppage,
+        .fillpage = ksm_fillpage,
+        .dirtypage = ksm_dirtypage,
+        .cleanpage = ksm_cleanpage
+};
+
+static mmobj_t ksm_obj;
+static uint32_t ksm_nextpage;   /* of ksm_obj, for the next ksm page */
+
+static slab_allocator_t *ksm_page_allocator;
+static slab_allocator_t *ksm_cand_allocator;
+
+static list_t ksm_stable[KSM_BUCKETS];
+static list_t ksm_unstable[KSM_BUCKETS];
+static int ksm_ncands;
+
+/* The object ksmd is going through, reffed, and the next page of it to
+ * look at; NULL between passes */
+static mmobj_t *ksm_cursor;
+static uint32_t ksm_cursor_pn;
+
+static counter_t ksm_nscanned;
+static counter_t ksm_nmerged;   /* pages freed for ksm pages */
+static counter_t ksm_nunmerged; /* merged pages dropped again */
+static counter_t ksm_npages;    /* ksm pages made */
+
+static proc_t *ksmd_proc;
+static kthread_t *ksmd_thr;
+static ktqueue_t ksmd_waitq;
+
+/* ksm_obj never goes away, so its reference count is just kept */
+static void
+ksm_ref(mmobj_t *o)
+{
+        o->mmo_refcount++;
+}
+
+static void
+ksm_put(mmobj_t *o)
+{
+        o->mmo_refcount--;
+        KASSERT(0 < o->mmo_refcount);
+}
+
+static int
+ksm_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
+{
+        return pframe_get(o, pagenum, pf);
+}
+
+/* ksm_page_fill() copies the contents in */
+static int
+ksm_fillpage(mmobj_t *o, pframe_t *pf)
+{
+        return 0;
+}
+
+static int
+ksm_dirtypage(mmobj_t *o, pframe_t *pf)
+{
+        return 0;
+}
+
+/* Once nothing has a ksm page merged, nothing reads it again */
+static int
+ksm_cleanpage(mmobj_t *o, pframe_t *pf)
+{
+        return 0;
+}
+
+static uint32_t
+ksm_hash(const void *page)
+{
+        const uint32_t *w = (const uint32_t *)page;
+        uint32_t h = 2166136261u;
+        uint32_t i;
+
+        for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++)
+                h = (h ^ w[i]) * 16777619u;
+        return h;
+}
+
+/* The pages of shadow objects may be in high memory, those of ksm_obj
+ * are not */
+static uint32_t
+ksm_pf_hash(pframe_t *pf)
+{
+        void *addr = pframe_kmap_atomic(pf);
+        uint32_t h = ksm_hash(addr);
+        pframe_kunmap_atomic(pf, addr);
+        return h;
+}
+
+/* Whether the contents of a and b are the same */
+static int
+ksm_same(pframe_t *a, pframe_t *b)
+{
+        void *pa = pframe_kmap_atomic(a);
+        void *pb = pframe_kmap_atomic(b);
+        int same = (0 == memcmp(pa, pb, PAGE_SIZE));
+        pframe_kunmap_atomic(b, pb);
+        pframe_kunmap_atomic(a, pa);
+        return same;
+}
+
+/* Makes a ksm page, with nothing in it yet and not in the stable table,
+ * or returns NULL. This may block, waiting for pageoutd. */
+static ksm_page_t *
+ksm_page_alloc(void)
+{
+        ksm_page_t *kp;
+        pframe_t *pf;
+
+        if (NULL == (kp = (ksm_page_t *)slab_obj_alloc(ksm_page_allocator)))
+                return NULL;
+        if (0 > pframe_get(&ksm_obj, ksm_nextpage++, &pf)) {
+                slab_obj_free(ksm_page_allocator, kp);
+                return NULL;
+        }
+        pframe_pin(pf);
+
+        kp->kp_pf = pf;
+        kp->kp_hash = 0;
+        kp->kp_nshared = 0;
+        list_link_init(&kp->kp_link);
+        counter_inc(&ksm_npages);
+        return kp;
+}
+
+/* Fills kp with the contents of src and puts it in the stable table */
+static void
+ksm_page_fill(ksm_page_t *kp, pframe_t *src)
+{
+        void *from = pframe_kmap_atomic(src);
+        page_copy(kp->kp_pf->pf_addr, from);
+        pframe_kunmap_atomic(src, from);
+        kp->kp_hash = ksm_hash(kp->kp_pf->pf_addr);
+        list_insert_head(&ksm_stable[kp->kp_hash % KSM_BUCKETS], &kp->kp_link);
+}
+
+static void
+ksm_page_free(ksm_page_t *kp)
+{
+        pframe_t *pf = kp->kp_pf;
+
+        KASSERT(0 == kp->kp_nshared);
+        if (list_link_is_linked(&kp->kp_link))
+                list_remove(&kp->kp_link);
+        slab_obj_free(ksm_page_allocator, kp);
+
+        pframe_unpin(pf);
+        /* unless it is lent out (see vmmap_pin_pages()), in which case
+         * pageoutd has it once it is back */
+        if (!pframe_is_pinned(pf))
+                pframe_free(pf);
+}
+
+static void
+ksm_page_put(ksm_page_t *kp)
+{
+        counter_inc(&ksm_nunmerged);
+        if (0 == --kp->kp_nshared)
+                ksm_page_free(kp);
+}
+
+/* Whether pf is a page of a shadow object which ksmd may merge: one not
+ * being filled, and not lent out, so pinned by shadow_fillpage alone */
+static int
+ksm_mergeable(pframe_t *pf)
+{
+        return !pframe_is_busy(pf) && 1 == pf->pf_pincount;
+}
+
+/*
+ * Replaces pf, a page of o, with kp, if they are still the same. Taking
+ * pf out of the page tables first means nothing writes it after the
+ * comparison. Returns 0, -EAGAIN if they are not the same, or -ENOMEM.
+ */
+static int
+ksm_merge(mmobj_t *o, pframe_t *pf, ksm_page_t *kp)
+{
+        KASSERT(o == pf->pf_obj && ksm_mergeable(pf));
+
+        pframe_remove_from_pts(pf);
+        if (!ksm_same(pf, kp->kp_pf))
+                return -EAGAIN;
+        if (0 > radix_insert(shadow_merged(o), pf->pf_pagenum, kp))
+                return -ENOMEM;
+        kp->kp_nshared++;
+
+        pframe_unpin(pf);
+        pframe_free(pf);
+        counter_inc(&ksm_nmerged);
+        return 0;
+}
+
+static ksm_page_t *
+ksm_stable_find(pframe_t *pf, uint32_t hash)
+{
+        ksm_page_t *kp;
+
+        list_iterate_begin(&ksm_stable[hash % KSM_BUCKETS], kp, ksm_page_t, kp_link) {
+                if (kp->kp_hash == hash
+                    && ksm_same(kp->kp_pf, pf))
+                        return kp;
+        } list_iterate_end();
+        return NULL;
+}
+
+/* Finds a page of the unstable table which is the same as pf, and which
+ * can still be merged, and puts it in *qp */
+static ksm_cand_t *
+ksm_unstable_find(pframe_t *pf, uint32_t hash, pframe_t **qp)
+{
+        ksm_cand_t *kc;
+        pframe_t *q;
+
+        list_iterate_begin(&ksm_unstable[hash % KSM_BUCKETS], kc, ksm_cand_t, kc_link) {
+                if (kc->kc_hash != hash)
+                        continue;
+                q = pframe_get_resident(kc->kc_obj, kc->kc_pagenum);
+                if (NULL != q && q != pf && ksm_mergeable(q)
+                    && ksm_same(q, pf)) {
+                        *qp = q;
+                        return kc;
+                }
+        } list_iterate_end();
+        return NULL;
+}
+
+static void
+ksm_cand_add(mmobj_t *o, uint32_t pagenum, uint32_t hash)
+{
+        ksm_cand_t *kc;
+
+        if (ksm_ncands >= KSM_CANDIDATES)
+                return;
+        if (NULL == (kc = (ksm_cand_t *)slab_obj_alloc(ksm_cand_allocator)))
+                return;
+        o->mmo_ops->ref(o);
+        kc->kc_obj = o;
+        kc->kc_pagenum = pagenum;
+        kc->kc_hash = hash;
+        list_link_init(&kc->kc_link);
+        list_insert_head(&ksm_unstable[hash % KSM_BUCKETS], &kc->kc_link);
+        ksm_ncands++;
+}
+
+/* Takes kc out of the unstable table, which may block */
+static void
+ksm_cand_free(ksm_cand_t *kc)
+{
+        mmobj_t *o = kc->kc_obj;
+
+        list_remove(&kc->kc_link);
+        ksm_ncands--;
+        slab_obj_free(ksm_cand_allocator, kc);
+        o->mmo_ops->put(o);
+}
+
+static void
+ksm_scan_page(mmobj_t *o, pframe_t *pf)
+{
+        ksm_page_t *kp;
+        ksm_cand_t *kc;
+        pframe_t *q;
+        uint32_t hash, pagenum;
+
+        counter_inc(&ksm_nscanned);
+        if (!ksm_mergeable(pf))
+                return;
+        hash = ksm_pf_hash(pf);
+        if (hash != pf->pf_ksmhash) {
+                pf->pf_ksmhash = hash;
+                return;
+        }
+
+        if (NULL != (kp = ksm_stable_find(pf, hash))) {
+                ksm_merge(o, pf, kp);
+                return;
+        }
+        if (NULL == (kc = ksm_unstable_find(pf, hash, &q))) {
+                ksm_cand_add(o, pf->pf_pagenum, hash);
+                return;
+        }
+
+        /* the two become the first to share a new ksm page; getting it may
+         * block, so both are looked for again after */
+        pagenum = pf->pf_pagenum;
+        if (NULL != (kp = ksm_page_alloc())) {
+                pf = pframe_get_resident(o, pagenum);
+                q = pframe_get_resident(kc->kc_obj, kc->kc_pagenum);
+                if (NULL != pf && NULL != q && pf != q && ksm_mergeable(pf) && ksm_mergeable(q)) {
+                        ksm_page_fill(kp, pf);
+                        ksm_merge(kc->kc_obj, q, kp);
+                        ksm_merge(o, pf, kp);
+                }
+                if (0 == kp->kp_nshared)
+                        ksm_page_free(kp);
+        }
+        ksm_cand_free(kc);
+}
+
+/* Empties the unstable table, which may block */
+static void
+ksm_pass_end(void)
+{
+        int i;
+
+        for (i = 0; i < KSM_BUCKETS; i++) {
+                while (!list_empty(&ksm_unstable[i]))
+                        ksm_cand_free(list_head(&ksm_unstable[i], ksm_cand_t, kc_link));
+        }
+        KASSERT(0 == ksm_ncands);
+}
+
+/* Looks at the next budget pages, stopping early at the end of a pass */
+static void
+ksm_scan(int budget)
+{
+        mmobj_t *o, *next;
+        pframe_t *pf;
+
+        while (budget > 0) {
+                o = ksm_cursor;
+                if (NULL != o && NULL != (pf = pframe_next_resident(o, &ksm_cursor_pn))) {
+                        ksm_cursor_pn++;
+                        budget--;
+                        ksm_scan_page(o, pf);
+                        continue;
+                }
+
+                if (NULL != (next = shadow_next(o)))
+                        next->mmo_ops->ref(next);
+                ksm_cursor = next;
+                ksm_cursor_pn = 0;
+                if (NULL != o)
+                        o->mmo_ops->put(o);
+                if (NULL == next) {
+                        ksm_pass_end();
+                        return;
+                }
+        }
+}
+
+/*
+ * The same-page merging daemon, which looks at KSM_SCAN_PAGES pages
+ * every KSM_SCAN_MSECS until it is cancelled.
+ * Both arguments unused.
+ */
+static void *
+ksmd_run(int arg1, void *arg2)
+{
+        /* a cancellable sleep does not look before sleeping */
+        while (!curthr->kt_cancelled) {
+                ksm_scan(KSM_SCAN_PAGES);
+                if (-EINTR == sched_sleep_on_timeout(&ksmd_waitq, KSM_SCAN_MSECS))
+                        break;
+        }
+
+        if (NULL != ksm_cursor) {
+                ksm_cursor->mmo_ops->put(ksm_cursor);
+                ksm_cursor = NULL;
+        }
+        ksm_pass_end();
+        return NULL;
+}
+
+pframe_t *
+ksm_lookup(mmobj_t *o, uint32_t pagenum)
+{
+        ksm_page_t *kp;
+
+        if (NULL == o->mmo_shadowed)
+                return NULL;
+        kp = (ksm_page_t *)radix_lookup(shadow_merged(o), pagenum);
+        return (NULL != kp) ? kp->kp_pf : NULL;
+}
+
+void
+ksm_unmerge(mmobj_t *o, uint32_t lopage, uint32_t hipage)
+{
+        radix_tree_t *merged = shadow_merged(o);
+        uint32_t pn = lopage;
+        ksm_page_t *kp;
+
+        while (NULL != (kp = (ksm_page_t *)radix_next(merged, &pn)) && pn < hipage) {
+                radix_remove(merged, pn);
+                ksm_page_put(kp);
+        }
+}
+
+void
+ksm_forget(mmobj_t *o)
+{
+        radix_tree_t *merged = shadow_merged(o);
+        uint32_t pn = 0;
+        ksm_page_t *kp;
+
+        while (NULL != (kp = (ksm_page_t *)radix_next(merged, &pn))) {
+                radix_remove(merged, pn);
+                ksm_page_put(kp);
+        }
+}
+
+int
+ksm_migrate(mmobj_t *from, mmobj_t *to)
+{
+        radix_tree_t *src = shadow_merged(from), *dst = shadow_merged(to);
+        uint32_t pn = 0;
+        ksm_page_t *kp;
+        pframe_t *pf;
+
+        /* what to merged is newer than what from has */
+        if (!radix_tree_empty(dst)) {
+                list_iterate_begin(&from->mmo_respages, pf, pframe_t, pf_olink) {
+                        if (NULL != radix_lookup(dst, pf->pf_pagenum)) {
+                                KASSERT(!pframe_is_busy(pf));
+                                pframe_unpin(pf);
+                                pframe_free(pf);
+                        }
+                } list_iterate_end();
+        }
+
+        while (NULL != (kp = (ksm_page_t *)radix_next(src, &pn))) {
+                if (NULL != radix_lookup(dst, pn) || NULL != pframe_get_resident(to, pn)) {
+                        radix_remove(src, pn);
+                        ksm_page_put(kp);
+                } else if (0 > radix_insert(dst, pn, kp)) {
+                        return -ENOMEM;
+                } else {
+                        radix_remove(src, pn);
+                }
+        }
+        return 0;
+}
+
+static __attribute__((unused)) void
+ksmd_init(void)
+{
+        int i;
+
+        mmobj_init(&ksm_obj, &ksm_mmobj_ops);
+        ksm_obj.mmo_ops->ref(&ksm_obj);
+        for (i = 0; i < KSM_BUCKETS; i++) {
+                list_init(&ksm_stable[i]);
+                list_init(&ksm_unstable[i]);
+        }
+        ksm_page_allocator = slab_allocator_create("ksm page", sizeof(ksm_page_t));
+        KASSERT(NULL != ksm_page_allocator);
+        ksm_cand_allocator = slab_allocator_create("ksm candidate", sizeof(ksm_cand_t));
+        KASSERT(NULL != ksm_cand_allocator);
+
+        counter_register(&ksm_nscanned, "ksm.scanned");
+        counter_register(&ksm_nmerged, "ksm.merged");
+        counter_register(&ksm_nunmerged, "ksm.unmerged");
+        counter_register(&ksm_npages, "ksm.pages");
+
+        if (0 == KSM_SCAN_PAGES)
+                return;
+        sched_queue_init(&ksmd_waitq);
+        KASSERT(NULL != curproc && PID_IDLE == curproc->p_pid);
+        ksmd_proc = proc_create("ksmd");
+        KASSERT(NULL != ksmd_proc);
+        ksmd_thr = kthread_create(ksmd_proc, ksmd_run, 0, NULL);
+        KASSERT(NULL != ksmd_thr);
+        sched_set_affinity(ksmd_thr, SCHED_HOUSEKEEPING_CPUS);
+        sched_make_runnable(ksmd_thr);
+}
+init_func(ksmd_init);
+init_depends(sched_init);
+
+void
+ksmd_shutdown(void)
+{
+        pid_t pid;
+
+        if (NULL == ksmd_thr)
+                return;
+        KASSERT(PID_IDLE == curproc->p_pid);
+        pid = ksmd_proc->p_pid;
+        kthread_cancel(ksmd_thr, (void *)0);
+        ksmd_thr = NULL;
+        if (pid != do_waitpid(pid, 0, NULL))
+                panic("ksmd: waited on a process other than ksmd\n");
+}
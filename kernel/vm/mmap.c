@@ -18,6 +18,7 @@
 
 #include "vm/vmmap.h"
 #include "vm/mmap.h"
+#include "vm/pagefault.h"
 
 #define LEN_TO_PAGES(len) len / PAGE_SIZE + ((len % PAGE_SIZE == 0) ? 0 : 1)
 
@@ -30,10 +31,31 @@ int valid_addr(void *addr, size_t len)
     return start && end;
 }
 
+/*
+ * Returns 1 if every page of [lopage, lopage + npages) is mapped in the
+ * current process, 0 otherwise.
+ */
+static int
+range_mapped(uint32_t lopage, uint32_t npages)
+{
+    uint32_t vfn = lopage;
+    while (vfn < lopage + npages) {
+        vmarea_t *vma = vmmap_lookup(curproc->p_vmmap, vfn);
+        if (vma == NULL) {
+            return 0;
+        }
+        vfn = vma->vma_end;
+    }
+    return 1;
+}
+
 /*
  * This function implements the mmap(2) syscall, but only
- * supports the MAP_SHARED, MAP_PRIVATE, MAP_FIXED, and
- * MAP_ANON flags.
+ * supports the MAP_SHARED, MAP_PRIVATE, MAP_FIXED, MAP_ANON,
+ * MAP_POPULATE and MAP_GROWSDOWN flags. With MAP_POPULATE the new mapping
+ * is faulted in before this returns, as far as memory allows; the mapping
+ * is made either way. A MAP_GROWSDOWN mapping grows down on faults below
+ * it until it is USER_STACK_MAX_SIZE long; off is ignored for it.
  *
  * Add a mapping to the current process's address space.
  * You need to do some error checking; see the ERRORS section
@@ -67,6 +89,17 @@ do_mmap(void *addr, size_t len, int prot, int flags,
         return -EINVAL;
     }
 
+    /*a stack is numbered from as far down as it may grow, see
+     *vmmap_grow_down*/
+    if (flags & MAP_GROWSDOWN) {
+        if (!(flags & MAP_ANON) || map_type != MAP_PRIVATE) {
+            return -EINVAL;
+        }
+        uint32_t maxpages = USER_STACK_MAX_SIZE / PAGE_SIZE;
+        uint32_t npages = LEN_TO_PAGES(len);
+        off = (npages < maxpages) ? (off_t)(maxpages - npages) * PAGE_SIZE : 0;
+    }
+
     file_t *file = NULL;
     vnode_t *vnode = NULL;
     int err = 0;
@@ -102,6 +135,11 @@ do_mmap(void *addr, size_t len, int prot, int flags,
         fput(file);
         return -EACCES;
     }
+    if (map_type == MAP_SHARED && (prot & PROT_WRITE)) {
+        /*stores through the mapping change the file behind our back*/
+        vnode->vn_flags |= VN_WRITEMAPPED;
+        vnode_modified(vnode);
+    }
 
 CheckDone:
     err = 0;
@@ -121,18 +159,22 @@ CheckDone:
         if (ret) {
             *ret = (void *)newaddr;
         }
-        tlb_flush_range(newaddr, pages);
         pagedir_t *pd = pt_get();
         pt_unmap_range(pd, newaddr,
                         newaddr + (uintptr_t)PN_TO_ADDR(pages));
+        tlb_flush_range(newaddr, pages);
     } else {
         if (ret) {
             *ret = addr;
         }
-        tlb_flush_range((uintptr_t)addr, pages);
         pagedir_t *pd = pt_get();
         pt_unmap_range(pd, (uintptr_t)addr,
                         (uintptr_t)addr + (uintptr_t)PN_TO_ADDR(pages));
+        tlb_flush_range((uintptr_t)addr, pages);
+    }
+
+    if (flags & MAP_POPULATE) {
+        pagefault_populate(area->vma_start, pages);
     }
     return 0;
         /*NOT_YET_IMPLEMENTED("VM: do_mmap");*/
@@ -168,11 +210,164 @@ do_munmap(void *addr, size_t len)
         return 0;
     }
     int ret = vmmap_remove(curproc->p_vmmap, lopage, npages);
-    tlb_flush_range(vaddr, npages);
     pagedir_t *pd = pt_get();
     pt_unmap_range(pd, vaddr, (uintptr_t)PN_TO_ADDR(lopage + npages));
+    tlb_flush_range(vaddr, npages);
     return ret;
         /*NOT_YET_IMPLEMENTED("VM: do_munmap");*/
         /*return -1;*/
 }
 
+/*
+ * This function implements the msync(2) syscall.
+ *
+ * Writes through shared mappings only set the dirty bits in the page
+ * tables, so these are harvested into the pages for flushd to write back
+ * (MS_ASYNC), or the pages are written back right away (MS_SYNC). Every
+ * page of the range has to be mapped.
+ */
+int
+do_msync(void *addr, size_t len, int flags)
+{
+    uintptr_t vaddr = (uintptr_t)addr;
+    if (!PAGE_ALIGNED(vaddr)) {
+        return -EINVAL;
+    }
+    if ((flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE))
+        || ((flags & MS_ASYNC) && (flags & MS_SYNC))) {
+        return -EINVAL;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (!valid_addr(addr, len)) {
+        return -ENOMEM;
+    }
+
+    uint32_t lopage = ADDR_TO_PN(vaddr);
+    uint32_t npages = LEN_TO_PAGES(len);
+    if (!range_mapped(lopage, npages)) {
+        return -ENOMEM;
+    }
+
+    int err = vmmap_sync(curproc->p_vmmap, lopage, npages, flags & MS_SYNC);
+    return (err < 0) ? -EIO : 0;
+}
+
+
+/*
+ * This function implements the madvise(2) syscall.
+ *
+ * MADV_NORMAL, MADV_RANDOM and MADV_SEQUENTIAL are recorded in the areas
+ * of the range, for handle_pagefault to go by. MADV_WILLNEED starts
+ * reading the file pages of the range in, and MADV_DONTNEED throws away
+ * the pages of the range right away. Every page of the range has to be
+ * mapped.
+ */
+int
+do_madvise(void *addr, size_t len, int advice)
+{
+    uintptr_t vaddr = (uintptr_t)addr;
+    if (!PAGE_ALIGNED(vaddr)) {
+        return -EINVAL;
+    }
+    if (advice < MADV_NORMAL || advice > MADV_DONTNEED) {
+        return -EINVAL;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (!valid_addr(addr, len)) {
+        return -ENOMEM;
+    }
+
+    uint32_t lopage = ADDR_TO_PN(vaddr);
+    uint32_t npages = LEN_TO_PAGES(len);
+    if (!range_mapped(lopage, npages)) {
+        return -ENOMEM;
+    }
+
+    switch (advice) {
+        case MADV_WILLNEED:
+            vmmap_prefetch(curproc->p_vmmap, lopage, npages);
+            return 0;
+        case MADV_DONTNEED:
+            /*locked pages stay where they are*/
+            if (vmmap_locked_pages(curproc->p_vmmap, lopage, npages)) {
+                return -EINVAL;
+            }
+            vmmap_dontneed(curproc->p_vmmap, lopage, npages);
+            return 0;
+        default:
+            return vmmap_advise(curproc->p_vmmap, lopage, npages, advice);
+    }
+}
+
+
+/*
+ * This function implements the mlock(2) syscall.
+ *
+ * The pages of the range are faulted in and pinned, so that touching
+ * them takes no fault and pageoutd never reclaims them, until munlock,
+ * munmap or exit. Every page of the range has to be mapped, and a
+ * process may lock no more than a share of memory, see
+ * PROC_MLOCK_LIMIT_SHIFT.
+ */
+int
+do_mlock(void *addr, size_t len)
+{
+    uintptr_t vaddr = (uintptr_t)addr;
+    if (!PAGE_ALIGNED(vaddr)) {
+        return -EINVAL;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (!valid_addr(addr, len)) {
+        return -ENOMEM;
+    }
+
+    uint32_t lopage = ADDR_TO_PN(vaddr);
+    uint32_t npages = LEN_TO_PAGES(len);
+    if (!range_mapped(lopage, npages)) {
+        return -ENOMEM;
+    }
+
+    int err = vmmap_lock(curproc->p_vmmap, lopage, npages);
+    if (err < 0) {
+        return err;
+    }
+    /*the pages are resident now, this only maps them*/
+    pagefault_populate(lopage, npages);
+    return 0;
+}
+
+/*
+ * This function implements the munlock(2) syscall.
+ *
+ * The locked pages of the range may be reclaimed again. Every page of
+ * the range has to be mapped.
+ */
+int
+do_munlock(void *addr, size_t len)
+{
+    uintptr_t vaddr = (uintptr_t)addr;
+    if (!PAGE_ALIGNED(vaddr)) {
+        return -EINVAL;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (!valid_addr(addr, len)) {
+        return -ENOMEM;
+    }
+
+    uint32_t lopage = ADDR_TO_PN(vaddr);
+    uint32_t npages = LEN_TO_PAGES(len);
+    if (!range_mapped(lopage, npages)) {
+        return -ENOMEM;
+    }
+
+    vmmap_unlock(curproc->p_vmmap, lopage, npages);
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * The out-of-memory killer. Once every page is taken by something that
+ * cannot give it back (anonymous memory with nowhere left to swap it,
+ * kernel objects), whoever waits for memory waits forever, and whoever
+ * retries spins; instead, a process is killed, and its memory comes
+ * back as it exits.
+ *
+ * The victim is the process whose going gives back the most: its
+ * private pages count double, since they certainly go with it, and its
+ * shared ones and page tables once. The daemons, init, and vforked
+ * children (which have no memory of their own) are never chosen. Only
+ * one victim is killed at a time; until it has exited, everybody waits
+ * for it.
+ *
+ * Exiting takes some memory of its own, so OOM_RESERVE_PAGES pages are
+ * kept back from boot and let go of with each kill, to be taken back
+ * once memory is plentiful again.
+ */
+
+#include "kernel.h"
+#include "globals.h"
+#include "types.h"
+#include "errno.h"
+#include "config.h"
+
+#include "util/counter.h"
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+
+#include "proc/kthread.h"
+#include "proc/proc.h"
+#include "proc/sched.h"
+
+#include "mm/page.h"
+
+#include "api/syscall.h"
+
+#include "vm/oom.h"
+
+static pid_t oom_victim = -1;   /* killed, and not yet exited */
+static ktqueue_t oom_waitq;
+
+static void *oom_reserve[OOM_RESERVE_PAGES];
+static int oom_nreserve;
+
+static counter_t oom_nkills;
+static counter_t oom_nnovictim; /* out of memory, with nobody to kill */
+
+static void
+oom_refill(void)
+{
+        void *page;
+
+        while (oom_nreserve < OOM_RESERVE_PAGES
+               && page_free_count() > 2 * OOM_RESERVE_PAGES) {
+                if (NULL == (page = page_alloc()))
+                        break;
+                oom_reserve[oom_nreserve++] = page;
+        }
+}
+
+static __attribute__((unused)) void
+oom_init(void)
+{
+        sched_queue_init(&oom_waitq);
+        sched_queue_class(&oom_waitq, SCHED_WQ_ALLOC);
+        oom_refill();
+        counter_register(&oom_nkills, "oom.kills");
+        counter_register(&oom_nnovictim, "oom.no_victim");
+}
+init_func(oom_init);
+
+static uint32_t
+oom_badness(proc_t *p)
+{
+        struct proc_stat st;
+
+        if (PID_IDLE == p->p_pid || PID_INIT == p->p_pid
+            || NULL == p->p_pproc || PID_IDLE == p->p_pproc->p_pid)
+                return 0;
+        if (PROC_RUNNING != p->p_state || NULL != p->p_vfork_parent)
+                return 0;
+        proc_stat_get(p, &st);
+        return 2 * st.ps_private + (st.ps_rss - st.ps_private) + st.ps_ptpages;
+}
+
+static int
+oom_victim_alive(void)
+{
+        proc_t *p;
+
+        if (-1 == oom_victim)
+                return 0;
+        if (NULL != (p = proc_lookup(oom_victim)) && PROC_RUNNING == p->p_state)
+                return 1;
+        oom_victim = -1;
+        return 0;
+}
+
+/* Kills p like proc_kill, except that if p is the current process and
+ * the caller cannot exit where it stands, the current thread is only
+ * cancelled along with the others */
+static void
+oom_kill_proc(proc_t *p, int mayexit)
+{
+        kthread_t *kthr;
+
+        if (curproc != p || mayexit) {
+                proc_kill(p, ENOMEM);
+                return;
+        }
+        list_iterate_begin(&p->p_threads, kthr, kthread_t, kt_plink) {
+                sched_cancel(kthr);
+                kthr->kt_retval = (void *)ENOMEM;
+        } list_iterate_end();
+        p->p_status = ENOMEM;
+}
+
+int
+oom_kill(int mayexit)
+{
+        proc_t *p, *victim = NULL;
+        uint32_t score, worst = 0;
+
+        if (oom_victim_alive())
+                return 0;
+
+        rcu_read_lock();
+        list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+                if ((score = oom_badness(p)) > worst) {
+                        worst = score;
+                        victim = p;
+                }
+        } list_iterate_end();
+        rcu_read_unlock();
+        if (NULL == victim) {
+                counter_inc(&oom_nnovictim);
+                return -ENOMEM;
+        }
+
+        dbg(DBG_VM, "out of memory: killing %d (%s), badness %u\n",
+            victim->p_pid, victim->p_comm, worst);
+        counter_inc(&oom_nkills);
+        oom_victim = victim->p_pid;
+        while (oom_nreserve > 0)
+                page_free(oom_reserve[--oom_nreserve]);
+        oom_kill_proc(victim, mayexit);
+        return 0;
+}
+
+void
+oom_wait(void)
+{
+        /* nothing wakes the queue: the victim is looked for again after
+         * each wait */
+        sched_sleep_on_timeout(&oom_waitq, OOM_WAIT_MSECS);
+        if (!oom_victim_alive())
+                oom_refill();
+}
@@ -1,9 +1,13 @@
 #include "types.h"
 #include "globals.h"
 #include "kernel.h"
+#include "config.h"
 #include "errno.h"
 
 #include "util/debug.h"
+#include "util/counter.h"
+#include "util/init.h"
+#include "util/trace.h"
 
 #include "proc/proc.h"
 
@@ -13,10 +17,234 @@
 #include "mm/mmobj.h"
 #include "mm/pframe.h"
 #include "mm/pagetable.h"
+#include "mm/tlb.h"
 
+#include "vm/ksm.h"
+#include "vm/oom.h"
 #include "vm/pagefault.h"
 #include "vm/vmmap.h"
 
+static counter_t pagefault_count;
+static counter_t pagefault_rss_kills;
+static counter_t pagefault_kinds[FAULT_NKINDS];
+static counter_t pagefault_depths[FAULT_NDEPTHS];
+
+static const char *pagefault_kind_names[FAULT_NKINDS] = {
+        "vm.faults.zero", "vm.faults.minor", "vm.faults.major", "vm.faults.cow"
+};
+
+/* most user pages one address space may have mapped */
+static uint32_t pagefault_rss_limit;
+
+static __attribute__((unused)) void
+pagefault_init(void)
+{
+        int i;
+
+        counter_register(&pagefault_count, "vm.pagefaults");
+        counter_register(&pagefault_rss_kills, "vm.rss_kills");
+        for (i = 0; i < FAULT_NKINDS; i++)
+                counter_register(&pagefault_kinds[i], pagefault_kind_names[i]);
+        counter_register_array(pagefault_depths, FAULT_NDEPTHS, "vm.fault_depth");
+        pagefault_rss_limit = page_free_count() >> PROC_RSS_LIMIT_SHIFT;
+}
+init_func(pagefault_init);
+
+/*
+ * How far down the area's shadow chain objpage is first resident (as
+ * itself or merged, see vm/ksm.h), with *resident set; or, if it is
+ * resident nowhere, the depth of the bottom object with *resident clear.
+ * Only for classifying the fault, which the lookup may yet change.
+ */
+static int
+fault_depth(vmarea_t *area, uint32_t objpage, int *resident)
+{
+    int depth = 0;
+    mmobj_t *o;
+
+    for (o = area->vma_obj; o != NULL; o = o->mmo_shadowed, depth++) {
+        if (pframe_get_resident(o, objpage) != NULL || ksm_lookup(o, objpage) != NULL) {
+            *resident = 1;
+            return depth;
+        }
+    }
+    *resident = 0;
+    return depth - 1;
+}
+
+/*
+ * Counts a fault of the given FAULT_ kind, and of the depth fault_depth
+ * found, against its area and in the counters.
+ */
+static void
+fault_account(vmarea_t *area, int kind, int depth)
+{
+    depth = MIN(depth, FAULT_NDEPTHS - 1);
+    area->vma_faults[kind]++;
+    area->vma_fault_depths[depth]++;
+    counter_inc(&pagefault_kinds[kind]);
+    counter_inc(&pagefault_depths[depth]);
+}
+
+/*
+ * Map, read-only, the pages of the FAULT_AROUND_PAGES aligned window around
+ * pagenum which are already resident, so that touching them later does not
+ * fault. This must not block, so only pages that can be found without
+ * filling anything are mapped: for each page, the first resident copy found
+ * going down the shadow chain, or merged page (see vm/ksm.h), which is
+ * what shadow_lookuppage would return for a read. Pages that are already
+ * mapped are left alone, and a later write to any of these pages still
+ * faults as usual.
+ */
+static void
+fault_around(vmarea_t *area, uint32_t pagenum, uint32_t pdflags)
+{
+    pagedir_t *pagedir = curproc->p_pagedir;
+    uint32_t first = MAX(area->vma_start, pagenum & ~(FAULT_AROUND_PAGES - 1));
+    uint32_t end = MIN(area->vma_end, (pagenum & ~(FAULT_AROUND_PAGES - 1)) + FAULT_AROUND_PAGES);
+    uint32_t vfn;
+
+    for (vfn = first; vfn < end; vfn++) {
+        uintptr_t vaddr = (uintptr_t)PN_TO_ADDR(vfn);
+        uint32_t objpage = vfn - area->vma_start + area->vma_off;
+        pframe_t *pf = NULL;
+        mmobj_t *o;
+
+        if (vfn == pagenum || pt_is_mapped(pagedir, vaddr)) {
+            continue;
+        }
+        if (pt_resident(pagedir) >= pagefault_rss_limit) {
+            return;
+        }
+        for (o = area->vma_obj; o != NULL && pf == NULL; o = o->mmo_shadowed) {
+            pf = pframe_get_resident(o, objpage);
+            if (pf == NULL) {
+                pf = ksm_lookup(o, objpage);
+            }
+        }
+        /*a busy page may still be being filled*/
+        if (pf == NULL || pframe_is_busy(pf) || pframe_is_invalid(pf)) {
+            continue;
+        }
+        if (pt_map(pagedir, vaddr, pf->pf_paddr,
+                   pdflags, PT_PRESENT | PT_USER) < 0) {
+            return;
+        }
+    }
+}
+
+/*
+ * For an area advised MADV_SEQUENTIAL: start reading the next
+ * READAHEAD_MAX_PAGES pages of the file in, and let go of the window of
+ * pages as far behind, which the scan is done with, so that a big scan
+ * has its own pages reclaimed rather than everybody else's. The window
+ * is wider than the fault-around window, so that no page is skipped
+ * between faults.
+ */
+static void
+fault_sequential(vmarea_t *area, uint32_t pagenum)
+{
+    pagedir_t *pagedir = curproc->p_pagedir;
+    mmobj_t *bottom = mmobj_bottom_obj(area->vma_obj);
+    uint32_t vfn, first, end;
+
+    /*anonymous memory is neither read ahead nor reclaimed*/
+    if (bottom->mmo_ops->fillpage_async == NULL) {
+        return;
+    }
+
+    vmmap_prefetch(curproc->p_vmmap, pagenum + 1,
+                   MIN(area->vma_end - pagenum - 1, READAHEAD_MAX_PAGES));
+
+    if (pagenum - area->vma_start <= READAHEAD_MAX_PAGES) {
+        return;
+    }
+    end = pagenum - READAHEAD_MAX_PAGES;
+    first = MAX(area->vma_start, end - READAHEAD_MAX_PAGES);
+    for (vfn = first; vfn < end; vfn++) {
+        uintptr_t vaddr = (uintptr_t)PN_TO_ADDR(vfn);
+        pframe_t *pf = pframe_get_resident(bottom, vfn - area->vma_start + area->vma_off);
+        if (pf == NULL || vmmap_locked_pages(curproc->p_vmmap, vfn, 1)) {
+            continue;
+        }
+        /*without our accessed bit, nothing gives it a second chance*/
+        if (pt_is_mapped(pagedir, vaddr)) {
+            pframe_harvest_dirty(pf);
+            pt_unmap(pagedir, vaddr);
+            tlb_flush(vaddr);
+        }
+        pframe_deactivate(pf);
+    }
+}
+
+/*
+ * Faults in [lopage, lopage + npages) of the current process, which must
+ * be mapped, in one pass rather than a fault per page at first touch, for
+ * MAP_POPULATE and mlock(2). The reads of the file pages are all started
+ * at once, then each page is looked up and mapped as a fault on it would
+ * map it: writable, with its copy made, in a writable private area, and
+ * read-only otherwise, so that the first store to a shared page still
+ * faults to dirty it. An area the process may not read or write is left
+ * unmapped. Returns 0, -ENOMEM once as many pages are mapped as a
+ * process may have, or -errno; what was mapped by then stays mapped.
+ */
+int
+pagefault_populate(uint32_t lopage, uint32_t npages)
+{
+    pagedir_t *pagedir = curproc->p_pagedir;
+    uint32_t vfn;
+    int err;
+
+    vmmap_prefetch(curproc->p_vmmap, lopage, npages);
+
+    for (vfn = lopage; vfn < lopage + npages; vfn++) {
+        vmarea_t *area = vmmap_lookup(curproc->p_vmmap, vfn);
+        uintptr_t vaddr = (uintptr_t)PN_TO_ADDR(vfn);
+        int mapped = pt_is_mapped(pagedir, vaddr);
+        pframe_t *pf;
+
+        if (area == NULL) {
+            /*unmapped by another thread since it was checked*/
+            return -ENOMEM;
+        }
+        if (!(area->vma_prot & (PROT_READ | PROT_WRITE))) {
+            continue;
+        }
+        int forwrite = (area->vma_prot & PROT_WRITE) && (area->vma_flags & MAP_PRIVATE);
+        if (mapped && !forwrite) {
+            continue;
+        }
+        if (!mapped && pt_resident(pagedir) >= pagefault_rss_limit) {
+            return -ENOMEM;
+        }
+
+        if ((err = pframe_lookup(area->vma_obj,
+                    vfn - area->vma_start + area->vma_off, forwrite, &pf)) < 0) {
+            return err;
+        }
+
+        uint32_t pdflags = PD_PRESENT | PD_USER;
+        uint32_t ptflags = PT_PRESENT | PT_USER;
+        if (forwrite) {
+            KASSERT(area->vma_obj == pf->pf_obj);
+            if ((err = pframe_dirty(pf)) < 0) {
+                return err;
+            }
+            pdflags |= PD_WRITE;
+            ptflags |= PT_WRITE;
+        }
+        if ((err = pt_map(pagedir, vaddr, pf->pf_paddr, pdflags, ptflags)) < 0) {
+            return err;
+        }
+        /*in place of a read-only mapping of what it was copied from*/
+        if (mapped) {
+            tlb_flush(vaddr);
+        }
+    }
+
+    return 0;
+}
+
 /*
  * This gets called by _pt_fault_handler in mm/pagetable.c The
  * calling function has already done a lot of error checking for
@@ -51,12 +279,20 @@
 void
 handle_pagefault(uintptr_t vaddr, uint32_t cause)
 {
-    dbg(DBG_MM, "vaddr is %#.8x, cause is %u\n", vaddr, cause);
+    counter_inc(&pagefault_count);
+    trace_emit(TRACE_PAGEFAULT, vaddr, cause, 0);
+
+    /*a thread which was killed while it only faulted goes now*/
+    if (curthr->kt_cancelled) {
+        kthread_exit(curthr->kt_retval);
+    }
 
     /*get the virtual page number*/
     int pagenum = ADDR_TO_PN(vaddr);
     vmarea_t *area = vmmap_lookup(curproc->p_vmmap, pagenum);
-    if (area == NULL) {
+    /*just below a stack, which grows to take it in*/
+    if (area == NULL
+        && (area = vmmap_grow_down(curproc->p_vmmap, pagenum)) == NULL) {
         do_exit(EFAULT);
     }
     /*check cause & FAULT_*/
@@ -85,20 +321,56 @@ handle_pagefault(uintptr_t vaddr, uint32_t cause)
         }
     }
 
+    /*a runaway process goes before it pushes everybody else's pages out*/
+    if (pt_resident(curproc->p_pagedir) >= pagefault_rss_limit
+        && !pt_is_mapped(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(pagenum))) {
+        counter_inc(&pagefault_rss_kills);
+        dbg(DBG_VM, "killing %d (%s): %u pages mapped\n", curproc->p_pid,
+            curproc->p_comm, pt_resident(curproc->p_pagedir));
+        do_exit(ENOMEM);
+    }
+
+    /*where the page is now, and whether the lookup reads it in, say
+     *what kind of fault this is*/
+    int resident;
+    int depth = fault_depth(area, pagenum - area->vma_start + area->vma_off, &resident);
+    uint32_t nreadins = curthr->kt_nreadins;
+
     /*get the actual page frame*/
     KASSERT(area->vma_obj);
     pframe_t *pf = NULL;
     int err = pframe_lookup(area->vma_obj, 
                 pagenum - area->vma_start + area->vma_off, forwrite, &pf);
 
-    /*TODO: redo it when shadow object is done*/
+    /*nothing holds memory we could wait for; somebody goes, maybe us*/
+    while (err == -ENOMEM && oom_kill(1) == 0) {
+        oom_wait();
+        if (curthr->kt_cancelled) {
+            kthread_exit(curthr->kt_retval);
+        }
+        if ((area = vmmap_lookup(curproc->p_vmmap, pagenum)) == NULL) {
+            do_exit(EFAULT);
+        }
+        err = pframe_lookup(area->vma_obj,
+                pagenum - area->vma_start + area->vma_off, forwrite, &pf);
+    }
 
     if (err < 0) {
-        do_exit(EFAULT);
+        do_exit(err == -ENOMEM ? ENOMEM : EFAULT);
     }
     KASSERT(err == 0);
     KASSERT(pf);
-    KASSERT(pf->pf_addr);
+    KASSERT(pf->pf_paddr);
+
+    if (curthr->kt_nreadins != nreadins) {
+        fault_account(area, FAULT_MAJOR, depth);
+    } else if (!resident) {
+        fault_account(area, FAULT_ZERO, depth);
+    } else if (forwrite && depth > 0) {
+        fault_account(area, FAULT_COW, depth);
+    } else {
+        fault_account(area, FAULT_MINOR, depth);
+    }
 
     if (forwrite) {
         KASSERT(area->vma_obj == pf->pf_obj);
@@ -110,8 +382,16 @@ handle_pagefault(uintptr_t vaddr, uint32_t cause)
 
     KASSERT(PAGE_ALIGN_DOWN(vaddr) == PN_TO_ADDR(pagenum));
     err = pt_map(pagedir, (uintptr_t)PN_TO_ADDR(pagenum), 
-            pt_virt_to_phys((uintptr_t)pf->pf_addr), pdflags, ptflags);
+            pf->pf_paddr, pdflags, ptflags);
     KASSERT(err == 0);
 
+    /*a read fault probably means more reads of the pages around it*/
+    if (area->vma_advice == MADV_SEQUENTIAL) {
+        fault_sequential(area, pagenum);
+    }
+    if (!forwrite && area->vma_advice != MADV_RANDOM) {
+        fault_around(area, pagenum, pdflags);
+    }
+
         /*NOT_YET_IMPLEMENTED("VM: handle_pagefault");*/
 }
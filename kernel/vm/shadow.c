@@ -12,6 +12,7 @@
 #include "mm/tlb.h"
 
 #include "vm/vmmap.h"
+#include "vm/ksm.h"
 #include "vm/shadow.h"
 #include "vm/shadowd.h"
 
@@ -26,7 +27,21 @@ int shadow_count = 0; /* for debugging/verification purposes */
 static int shadow_singleton_count = 0;
 #endif
 
+/*
+ * A shadow object, with the pages of it which ksmd has merged with
+ * others of the same contents (see vm/ksm.c), and its place on the list
+ * of them all, which ksmd scans.
+ */
+typedef struct shadow {
+        mmobj_t         sh_mmobj;
+        radix_tree_t    sh_merged;      /* ksm pages by page number */
+        list_link_t     sh_link;        /* on shadow_list */
+} shadow_t;
+
+#define MMOBJ_TO_SHADOW(o) CONTAINER_OF((o), shadow_t, sh_mmobj)
+
 static slab_allocator_t *shadow_allocator;
+static list_t shadow_list = { &shadow_list, &shadow_list };
 
 static void shadow_ref(mmobj_t *o);
 static void shadow_put(mmobj_t *o);
@@ -36,6 +51,7 @@ static int  shadow_dirtypage(mmobj_t *o, pframe_t *pf);
 static int  shadow_cleanpage(mmobj_t *o, pframe_t *pf);
 
 static mmobj_ops_t shadow_mmobj_ops = {
+        .type = MMOBJ_SHADOW,
         .ref = shadow_ref,
         .put = shadow_put,
         .lookuppage = shadow_lookuppage,
@@ -52,7 +68,7 @@ static mmobj_ops_t shadow_mmobj_ops = {
 void
 shadow_init()
 {
-    shadow_allocator = slab_allocator_create("shadow object", sizeof(mmobj_t));
+    shadow_allocator = slab_allocator_create("shadow object", sizeof(shadow_t));
         /*NOT_YET_IMPLEMENTED("VM: shadow_init");*/
 }
 
@@ -65,11 +81,15 @@ shadow_init()
 mmobj_t *
 shadow_create()
 {
-    mmobj_t *mmo = slab_obj_alloc(shadow_allocator);
-    if (mmo) {
-        mmobj_init(mmo, &shadow_mmobj_ops);
+    shadow_t *sh = slab_obj_alloc(shadow_allocator);
+    if (sh == NULL) {
+        return NULL;
     }
-    return mmo;
+    mmobj_init(&sh->sh_mmobj, &shadow_mmobj_ops);
+    radix_tree_init(&sh->sh_merged);
+    list_link_init(&sh->sh_link);
+    list_insert_tail(&shadow_list, &sh->sh_link);
+    return &sh->sh_mmobj;
         /*NOT_YET_IMPLEMENTED("VM: shadow_create");*/
         /*return NULL;*/
 }
@@ -121,13 +141,58 @@ shadow_put(mmobj_t *o)
         return;
     }
 
+    ksm_forget(o);
+    list_remove(&MMOBJ_TO_SHADOW(o)->sh_link);
     o->mmo_shadowed->mmo_ops->put(o->mmo_shadowed);
     o->mmo_un.mmo_bottom_obj->mmo_ops->put(o->mmo_un.mmo_bottom_obj);
 
-    slab_obj_free(shadow_allocator, o);
+    slab_obj_free(shadow_allocator, MMOBJ_TO_SHADOW(o));
         /*NOT_YET_IMPLEMENTED("VM: shadow_put");*/
 }
 
+/*
+ * If the object o shadows is itself a shadow object whose only parent
+ * is o, move its pages up into o and drop it from the chain, so later
+ * lookups through o do not walk it. Both objects are reffed while the
+ * pages move, since pframe_migrate can block, so that shadowd sees them
+ * as shared and leaves them alone. Returns 1 if the chain got shorter,
+ * 0 if there was nothing to collapse and -errno on failure; pages
+ * already moved are found first, so a failure leaves the chain usable.
+ */
+static int
+shadow_collapse_below(mmobj_t *o)
+{
+    mmobj_t *s = o->mmo_shadowed;
+    pframe_t *pf;
+    int err = 0;
+
+    if (s == NULL || s->mmo_shadowed == NULL) {
+        return 0;
+    }
+    if (s->mmo_refcount - s->mmo_nrespages != 1) {
+        return 0;
+    }
+
+    o->mmo_ops->ref(o);
+    s->mmo_ops->ref(s);
+    err = ksm_migrate(s, o);
+    list_iterate_begin(&s->mmo_respages, pf, pframe_t, pf_olink) {
+        if (0 == err) {
+            err = pframe_migrate(pf, o);
+        }
+    } list_iterate_end();
+
+    if (0 == err) {
+        o->mmo_shadowed = s->mmo_shadowed;
+        o->mmo_shadowed->mmo_ops->ref(o->mmo_shadowed);
+        KASSERT(s->mmo_refcount == 2 && s->mmo_nrespages == 0);
+        s->mmo_ops->put(s);
+    }
+    s->mmo_ops->put(s);
+    o->mmo_ops->put(o);
+    return (0 == err) ? 1 : err;
+}
+
 /* This function looks up the given page in this shadow object. The
  * forwrite argument is true if the page is being looked up for
  * writing, false if it is being looked up for reading. This function
@@ -149,6 +214,15 @@ shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
             if (*pf) {
                 return 0;
             }
+            /*or the page ksmd merged it into, which is only read*/
+            *pf = ksm_lookup(o, pagenum);
+            if (*pf) {
+                return 0;
+            }
+            /*shorten the chain as we go; the page may now be in o*/
+            if (shadow_collapse_below(o) > 0) {
+                continue;
+            }
             o = o->mmo_shadowed;
         }
         /*the bottom of the shadow chain whould not be a shadow object*/
@@ -161,6 +235,18 @@ shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
         /*return 0;*/
 }
 
+/* Copies the contents of src to dst, either of which may be in high
+ * memory */
+static void
+shadow_copy_page(pframe_t *dst, pframe_t *src)
+{
+    void *to = pframe_kmap_atomic(dst);
+    void *from = pframe_kmap_atomic(src);
+    page_copy(to, from);
+    pframe_kunmap_atomic(src, from);
+    pframe_kunmap_atomic(dst, to);
+}
+
 /* As per the specification in mmobj.h, fill the page frame starting
  * at address pf->pf_addr with the contents of the page identified by
  * pf->pf_obj and pf->pf_pagenum. This function handles all
@@ -176,14 +262,28 @@ static int
 shadow_fillpage(mmobj_t *o, pframe_t *pf)
 {
     mmobj_t *bottom_obj = mmobj_bottom_obj(o);
+    pframe_t *pf_merged = ksm_lookup(o, pf->pf_pagenum);
+
+    /*breaking o's own page away from the ones it was merged with, whose
+     *mappings (found through the same offset) go before it may be freed*/
+    if (pf_merged) {
+        shadow_copy_page(pf, pf_merged);
+        pframe_remove_from_pts(pf);
+        ksm_unmerge(o, pf->pf_pagenum, pf->pf_pagenum + 1);
+        pframe_pin(pf);
+        return 0;
+    }
 
     o = o->mmo_shadowed;
     while (o != bottom_obj) {
         pframe_t *pf_source = pframe_get_resident(o, pf->pf_pagenum);
+        if (pf_source == NULL) {
+            pf_source = ksm_lookup(o, pf->pf_pagenum);
+        }
         if (pf_source) {
             /*pf_source can be the same as pf*/
             KASSERT(pf_source != pf);
-            memcpy(pf->pf_addr, pf_source->pf_addr, PAGE_SIZE);
+            shadow_copy_page(pf, pf_source);
             pframe_pin(pf);
             return 0;
         }
@@ -192,19 +292,39 @@ shadow_fillpage(mmobj_t *o, pframe_t *pf)
 
     pframe_pin(pf);
 
+    /*we only read the bottom page, an untouched anon page need not exist*/
     pframe_t *pf_source = NULL;
-    int err = pframe_lookup(o, pf->pf_pagenum, 1, &pf_source);
+    int err = pframe_lookup(o, pf->pf_pagenum, 0, &pf_source);
     if (err < 0) {
         KASSERT(pf_source == NULL);
         return err;
     }
     
-    memcpy(pf->pf_addr, pf_source->pf_addr, PAGE_SIZE);
+    shadow_copy_page(pf, pf_source);
     return 0;
         /*NOT_YET_IMPLEMENTED("VM: shadow_fillpage");*/
         /*return 0;*/
 }
 
+radix_tree_t *
+shadow_merged(mmobj_t *o)
+{
+    KASSERT(o->mmo_ops == &shadow_mmobj_ops);
+    return &MMOBJ_TO_SHADOW(o)->sh_merged;
+}
+
+mmobj_t *
+shadow_next(mmobj_t *o)
+{
+    list_link_t *link = (o == NULL) ? shadow_list.l_next : MMOBJ_TO_SHADOW(o)->sh_link.l_next;
+    shadow_t *sh;
+    if (link == &shadow_list) {
+        return NULL;
+    }
+    sh = list_item(link, shadow_t, sh_link);
+    return &sh->sh_mmobj;
+}
+
 /* These next two functions are not difficult. */
 
 static int
@@ -4,12 +4,15 @@
 #include "mm/mmobj.h"
 #include "mm/pframe.h"
 
+#include "vm/ksm.h"
+
 #include "util/debug.h"
 #include "util/string.h"
 
 #include "proc/proc.h"
 #include "proc/sched.h"
 #include "proc/kthread.h"
+#include "proc/rcu.h"
 
 #ifdef __SHADOWD__
 static ktqueue_t shadowd_waitq, kmem_alloc_waitq;
@@ -22,7 +25,7 @@ shadowd_wakeup()
          * before it has been properly initialized then the system
          * does not have enough memory. */
         KASSERT(shadowd_initialized);
-        sched_broadcast_on(&shadowd_waitq);
+        sched_broadcast_urgent(&shadowd_waitq);
 }
 
 void
@@ -32,7 +35,11 @@ shadowd_alloc_sleep()
          * before it has been properly initialized then the system
          * does not have enough memory. */
         KASSERT(shadowd_initialized);
-        sched_sleep_on(&kmem_alloc_waitq);
+        sched_sleep_on_exclusive(&kmem_alloc_waitq);
+        /* shadowd only wakes the first waiter. Retrying the allocation
+         * does not block, so this one has had its go before the next
+         * runs */
+        sched_wakeup_n(&kmem_alloc_waitq, 1);
 }
 
 /*
@@ -56,8 +63,15 @@ shadowd(int arg1, void *arg2)
 {
         while (1) {
                 proc_t *p;
-                /* for each process, go through its vmareas */
-                list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+                uint32_t seq = 0;
+                /* for each process, go through its vmareas; this sleeps, so
+                 * the walk picks up where it left off each time round */
+                while (1) {
+                        rcu_read_lock();
+                        p = proc_list_next(&seq);
+                        rcu_read_unlock();
+                        if (NULL == p)
+                                break;
                         /* all of the dead process's shadow objects will be takenen care of by init */
                         if (PROC_RUNNING == p->p_state) {
                                 vmarea_t *vma;
@@ -74,26 +88,43 @@ shadowd(int arg1, void *arg2)
                                                 KASSERT(o != last);
                                                 if (o->mmo_refcount - o->mmo_nrespages == 1) {
                                                         dbg(DBG_FORK, "if.\n");
+                                                        /* ref o while its pages move, so a read fault
+                                                         * collapsing the same chain sees it as shared */
+                                                        o->mmo_ops->ref(o);
                                                         /* migrate all its pages to last, and remove it from the shadow tree */
                                                         pframe_t *pf;
+                                                        int err = ksm_migrate(o, last);
                                                         list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
                                                                 /* Because the operations that could be
                                                                  * performed with an intermediate shadow object
                                                                  * to make pages busy are non-blocking,
                                                                  * we always expect to see non-busy pages. */
                                                                 KASSERT(!pframe_is_busy(pf));
-                                                                /* o has refcount 1+nrespages, so this won't delete it yet */
-                                                                pframe_migrate(pf, last);
+                                                                /* o has refcount 2+nrespages, so this won't delete it yet */
+                                                                if (0 == err)
+                                                                        err = pframe_migrate(pf, last);
                                                         } list_iterate_end();
+                                                        if (0 > err) {
+                                                                /* out of memory; the pages which did
+                                                                 * move are still found first, so just
+                                                                 * leave o in the chain and try again
+                                                                 * next time */
+                                                                last->mmo_ops->put(last);
+                                                                last = o;
+                                                                o = shadow;
+                                                                continue;
+                                                        }
                                                         last->mmo_shadowed = o->mmo_shadowed;
                                                         /* Ref o's shadowed, so we don't accidentally delete it when we
                                                          * finally put o */
                                                         o->mmo_shadowed->mmo_ops->ref(o->mmo_shadowed);
-                                                        KASSERT(o->mmo_refcount == 1 && o->mmo_nrespages == 0);
+                                                        KASSERT(o->mmo_refcount == 2 && o->mmo_nrespages == 0);
+                                                        o->mmo_ops->put(o);
                                                         o->mmo_ops->put(o);
                                                 } else {
                                                         dbg(DBG_FORK, "else.\n");
-                                                        KASSERT(o->mmo_refcount - o->mmo_nrespages == 2);
+                                                        /* more if a read fault is collapsing below o */
+                                                        KASSERT(o->mmo_refcount - o->mmo_nrespages >= 2);
                                                         o->mmo_ops->ref(o);
                                                         last->mmo_ops->put(last);
                                                         last = o;
@@ -104,9 +135,12 @@ shadowd(int arg1, void *arg2)
                                         last->mmo_ops->put(last);
                                 } list_iterate_end();
                         }
-                } list_iterate_end();
+                        /* proc_list_next picks up from here regardless */
+                        cond_resched();
+                }
 
-                sched_broadcast_on(&kmem_alloc_waitq);
+                sched_wakeup_n(&kmem_alloc_waitq, 1);
+                sched_set_prio(curthr, SCHED_PRIO_DEFAULT);
                 if (sched_cancellable_sleep_on(&shadowd_waitq) < 0) {
                         return (void *)0;
                 }
@@ -121,12 +155,14 @@ shadowd_init()
 {
         sched_queue_init(&shadowd_waitq);
         sched_queue_init(&kmem_alloc_waitq);
+        sched_queue_class(&kmem_alloc_waitq, SCHED_WQ_ALLOC);
 
         KASSERT(NULL != curproc && (PID_IDLE == curproc->p_pid));
         shadowd_proc = proc_create("shadowd");
         KASSERT(NULL != shadowd_proc);
         shadowd_thr = kthread_create(shadowd_proc, shadowd, 0, NULL);
         KASSERT(NULL != shadowd_thr);
+        sched_set_affinity(shadowd_thr, SCHED_HOUSEKEEPING_CPUS);
 
         sched_make_runnable(shadowd_thr);
 
@@ -0,0 +1,274 @@
+/*
+ * Named shared memory objects, as made by shm_open(3): anonymous objects,
+ * each under a name such as "/ring" in a namespace of their own, apart
+ * from the filesystem. Every shm_open of the name gets a file on the same
+ * object, which mmap maps directly, so MAP_SHARED mappings of it in
+ * different processes share its pages, and those of a fork(2) share them
+ * too.
+ *
+ * An object is a vnode of shmfs, a filesystem which is never mounted,
+ * whose anonymous object is in vn_i. The name holds a reference to the
+ * vnode, and each file one; the mappings hold the anonymous object
+ * itself, which goes away once it is unlinked and the last of them goes.
+ *
+ * Objects have no length: there is no ftruncate(2), and a mapping of any
+ * length sees zeros where nothing has been stored. For the same reason
+ * they can only be mapped, not read or written.
+ */
+
+#include "kernel.h"
+#include "globals.h"
+#include "types.h"
+#include "errno.h"
+#include "config.h"
+
+#include "fs/fcntl.h"
+#include "fs/file.h"
+#include "fs/open.h"
+#include "fs/stat.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+#include "mm/kmalloc.h"
+#include "mm/mmobj.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/string.h"
+
+#include "vm/anon.h"
+#include "vm/shm.h"
+
+#define VNODE_TO_SHMOBJ(vn) ((mmobj_t *)((vn)->vn_i))
+
+/* A name in the namespace, and the object it names */
+typedef struct shm_name {
+        char            sn_name[NAME_LEN + 1];
+        vnode_t        *sn_vnode;
+        list_link_t     sn_link;        /* on shm_names */
+} shm_name_t;
+
+static void shm_read_vnode(vnode_t *vnode);
+static void shm_delete_vnode(vnode_t *vnode);
+static int  shm_query_vnode(vnode_t *vnode);
+
+static fs_ops_t shm_fsops = {
+        .read_vnode = shm_read_vnode,
+        .delete_vnode = shm_delete_vnode,
+        .query_vnode = shm_query_vnode,
+        .umount = NULL
+};
+
+static fs_t shm_fs = {
+        .fs_dev = "shm",
+        .fs_type = "shm",
+        .fs_op = &shm_fsops,
+        .fs_root = NULL,
+        .fs_i = NULL
+};
+
+static int shm_read(vnode_t *vnode, off_t offset, void *buf, size_t len);
+static int shm_write(vnode_t *vnode, off_t offset, const void *buf, size_t len);
+static int shm_mmap(vnode_t *vnode, vmarea_t *vma, mmobj_t **ret);
+static int shm_stat(vnode_t *vnode, struct stat *ss);
+
+static vnode_ops_t shm_vops = {
+        .read = shm_read,
+        .write = shm_write,
+        .read_user = NULL,
+        .write_user = NULL,
+        .mmap = shm_mmap,
+        .create = NULL,
+        .mknod = NULL,
+        .lookup = NULL,
+        .link = NULL,
+        .unlink = NULL,
+        .mkdir = NULL,
+        .rmdir = NULL,
+        .readdir = NULL,
+        .stat = shm_stat,
+        .acquire = NULL,
+        .release = NULL,
+        .fillpage = NULL,
+        .dirtypage = NULL,
+        .cleanpage = NULL
+};
+
+static list_t shm_names = { &shm_names, &shm_names };
+static int next_shmno = 0;
+
+static void
+shm_read_vnode(vnode_t *vnode)
+{
+        vnode->vn_ops = &shm_vops;
+        vnode->vn_mode = S_IFREG;
+        vnode->vn_len = 0;
+        vnode->vn_i = NULL;
+}
+
+static void
+shm_delete_vnode(vnode_t *vnode)
+{
+        mmobj_t *obj = VNODE_TO_SHMOBJ(vnode);
+        if (obj)
+                obj->mmo_ops->put(obj);
+}
+
+static int
+shm_query_vnode(vnode_t *vnode)
+{
+        return 0;
+}
+
+static int
+shm_read(vnode_t *vnode, off_t offset, void *buf, size_t len)
+{
+        return -EINVAL;
+}
+
+static int
+shm_write(vnode_t *vnode, off_t offset, const void *buf, size_t len)
+{
+        return -EINVAL;
+}
+
+static int
+shm_mmap(vnode_t *vnode, vmarea_t *vma, mmobj_t **ret)
+{
+        *ret = VNODE_TO_SHMOBJ(vnode);
+        return 0;
+}
+
+static int
+shm_stat(vnode_t *vnode, struct stat *ss)
+{
+        memset(ss, 0, sizeof(*ss));
+        ss->st_mode    = vnode->vn_mode;
+        ss->st_ino     = (int) vnode->vn_vno;
+        ss->st_nlink   = 1;
+        ss->st_blksize = (int) PAGE_SIZE;
+        ss->st_blocks  = (int) VNODE_TO_SHMOBJ(vnode)->mmo_nrespages;
+        return 0;
+}
+
+/* Gets the name out of a path such as "/ring", which is one slash and then
+ * the name, or NULL if it is not one */
+static const char *
+shm_path_name(const char *path)
+{
+        size_t len;
+
+        if ('/' != path[0])
+                return NULL;
+        path++;
+        len = strlen(path);
+        if (0 == len || len > NAME_LEN || NULL != strchr(path, '/'))
+                return NULL;
+        return path;
+}
+
+static shm_name_t *
+shm_lookup(const char *name)
+{
+        shm_name_t *sn;
+
+        list_iterate_begin(&shm_names, sn, shm_name_t, sn_link) {
+                if (0 == strcmp(sn->sn_name, name))
+                        return sn;
+        } list_iterate_end();
+        return NULL;
+}
+
+/* Makes a new object under name, with a reference to its vnode for the
+ * caller besides the name's */
+static int
+shm_create(const char *name, vnode_t **vnp)
+{
+        shm_name_t *sn;
+        vnode_t *vn;
+        mmobj_t *obj;
+
+        if (NULL == (sn = kmalloc(sizeof(*sn))))
+                return -ENOMEM;
+        if (NULL == (obj = anon_create())) {
+                kfree(sn);
+                return -ENOMEM;
+        }
+        obj->mmo_ops->ref(obj);
+        if (NULL == (vn = vget(&shm_fs, next_shmno++))) {
+                obj->mmo_ops->put(obj);
+                kfree(sn);
+                return -ENOMEM;
+        }
+        KASSERT(NULL == vn->vn_i);
+        vn->vn_i = obj;
+
+        strcpy(sn->sn_name, name);
+        sn->sn_vnode = vn;
+        list_link_init(&sn->sn_link);
+        list_insert_tail(&shm_names, &sn->sn_link);
+
+        vref(vn);
+        *vnp = vn;
+        return 0;
+}
+
+int
+do_shm_open(const char *path, int oflags)
+{
+        const char *name;
+        shm_name_t *sn;
+        vnode_t *vn;
+        file_t *f;
+        int fd, err;
+
+        if (NULL == (name = shm_path_name(path)))
+                return -EINVAL;
+        if ((O_RDONLY != (oflags & 3) && O_RDWR != (oflags & 3))
+            || (oflags & ~(3 | O_CREAT | O_EXCL | O_TRUNC)))
+                return -EINVAL;
+
+        /* get the file first, so that a failure leaves no new name */
+        if (0 > (fd = get_empty_fd(curproc)))
+                return fd;
+        if (NULL == (f = fget(-1)))
+                return -ENOMEM;
+
+        if (NULL != (sn = shm_lookup(name))) {
+                if ((oflags & O_CREAT) && (oflags & O_EXCL)) {
+                        fput(f);
+                        return -EEXIST;
+                }
+                vn = sn->sn_vnode;
+                vref(vn);
+        } else if (!(oflags & O_CREAT)) {
+                fput(f);
+                return -ENOENT;
+        } else if (0 > (err = shm_create(name, &vn))) {
+                fput(f);
+                return err;
+        }
+
+        fdtable_install(&curproc->p_fdtable, fd, f);
+        f->f_mode = (O_RDWR == (oflags & 3)) ? FMODE_READ | FMODE_WRITE : FMODE_READ;
+        f->f_pos = 0;
+        facq(f, vn);
+        return fd;
+}
+
+int
+do_shm_unlink(const char *path)
+{
+        const char *name;
+        shm_name_t *sn;
+
+        if (NULL == (name = shm_path_name(path)))
+                return -EINVAL;
+        if (NULL == (sn = shm_lookup(name)))
+                return -ENOENT;
+
+        list_remove(&sn->sn_link);
+        vput(sn->sn_vnode);
+        kfree(sn);
+        return 0;
+}
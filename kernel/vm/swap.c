@@ -0,0 +1,135 @@
+#include "kernel.h"
+#include "types.h"
+#include "config.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/string.h"
+
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+
+#include "mm/vmalloc.h"
+#include "mm/page.h"
+
+#include "vm/swap.h"
+#include "vm/zram.h"
+
+/*
+ * Slots are handed out from a bitmap, searching on from the one last
+ * handed out, so pages swapped out together tend to sit together on the
+ * disk. Nothing here is touched from interrupt context and nothing
+ * blocks in between looking at the bitmap and changing it, so it needs
+ * no lock. With no swap_dev, the slots are zram's.
+ */
+
+#define SWAP_WORD_BITS  32
+
+static blockdev_t *swap_dev;
+static uint32_t *swap_map;      /* a set bit is a slot in use */
+static uint32_t swap_nslots;
+static uint32_t swap_nfree;
+static uint32_t swap_hint;      /* where the next search starts */
+
+void
+swap_init(void)
+{
+        uint32_t nwords;
+
+        if (0 <= SWAP_DISK) {
+                KASSERT(BLOCK_SIZE == PAGE_SIZE);
+                if (NULL == (swap_dev = blockdev_lookup(MKDEVID(DISK_MAJOR, SWAP_DISK))))
+                        dbg(DBG_VM, "swap: no disk%d\n", SWAP_DISK);
+        }
+        if (NULL == swap_dev) {
+                if (0 == ZRAM_PAGES) {
+                        dbg(DBG_VM, "swap: running without swap\n");
+                        return;
+                }
+                if (0 > zram_init(SWAP_BLOCKS))
+                        panic("Not enough memory for the compressed swap!\n");
+        }
+
+        nwords = (SWAP_BLOCKS + SWAP_WORD_BITS - 1) / SWAP_WORD_BITS;
+        if (NULL == (swap_map = (uint32_t *)vmalloc(nwords * sizeof(uint32_t))))
+                panic("Not enough memory for the swap map!\n");
+        memset(swap_map, 0, nwords * sizeof(uint32_t));
+        swap_nslots = SWAP_BLOCKS;
+        swap_nfree = SWAP_BLOCKS;
+        swap_hint = 0;
+
+        if (NULL != swap_dev)
+                dbg(DBG_VM, "swap: %d pages on disk%d from block %d\n",
+                    SWAP_BLOCKS, SWAP_DISK, SWAP_FIRST_BLOCK);
+        else
+                dbg(DBG_VM, "swap: %d pages compressed into at most %d\n",
+                    SWAP_BLOCKS, ZRAM_PAGES);
+}
+
+int
+swap_enabled(void)
+{
+        return NULL != swap_map;
+}
+
+int
+swap_alloc(uint32_t *slot)
+{
+        uint32_t i, s;
+
+        if (0 == swap_nfree)
+                return -ENOSPC;
+
+        for (i = 0; i < swap_nslots; i++) {
+                s = (swap_hint + i) % swap_nslots;
+                if (!(swap_map[s / SWAP_WORD_BITS] & (1U << (s % SWAP_WORD_BITS)))) {
+                        swap_map[s / SWAP_WORD_BITS] |= 1U << (s % SWAP_WORD_BITS);
+                        swap_nfree--;
+                        swap_hint = s + 1;
+                        *slot = s;
+                        return 0;
+                }
+        }
+        panic("swap map disagrees with its free count\n");
+        return -ENOSPC;
+}
+
+void
+swap_free(uint32_t slot)
+{
+        KASSERT(slot < swap_nslots);
+        KASSERT(swap_map[slot / SWAP_WORD_BITS] & (1U << (slot % SWAP_WORD_BITS)));
+
+        swap_map[slot / SWAP_WORD_BITS] &= ~(1U << (slot % SWAP_WORD_BITS));
+        swap_nfree++;
+        swap_discard(slot);
+}
+
+void
+swap_discard(uint32_t slot)
+{
+        KASSERT(slot < swap_nslots);
+        if (NULL == swap_dev)
+                zram_discard(slot);
+}
+
+int
+swap_read(uint32_t slot, void *page)
+{
+        KASSERT(slot < swap_nslots);
+        if (NULL != curthr)
+                curthr->kt_nreadins++;
+        if (NULL == swap_dev)
+                return zram_read(slot, page);
+        return blockdev_read(swap_dev, (char *)page, SWAP_FIRST_BLOCK + slot);
+}
+
+int
+swap_write(uint32_t slot, const void *page)
+{
+        KASSERT(slot < swap_nslots);
+        if (NULL == swap_dev)
+                return zram_write(slot, page);
+        return blockdev_write(swap_dev, (const char *)page, SWAP_FIRST_BLOCK + slot);
+}
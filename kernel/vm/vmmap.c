@@ -5,6 +5,7 @@
 #include "vm/vmmap.h"
 #include "vm/shadow.h"
 #include "vm/anon.h"
+#include "vm/ksm.h"
 
 #include "proc/proc.h"
 
@@ -23,6 +24,10 @@
 #include "mm/mm.h"
 #include "mm/mman.h"
 #include "mm/mmobj.h"
+#include "mm/pframe.h"
+#include "mm/pagetable.h"
+#include "mm/tlb.h"
+#include "api/access.h"
 
 #define USER_PAGE_LOW  USER_MEM_LOW / PAGE_SIZE
 #define USER_PAGE_HIGH USER_MEM_HIGH / PAGE_SIZE
@@ -51,6 +56,9 @@ valid_pagenumber(uint32_t pagenum)
 static slab_allocator_t *vmmap_allocator;
 static slab_allocator_t *vmarea_allocator;
 
+/* most pages one address space may have locked */
+static uint32_t vmmap_mlock_limit;
+
 void
 vmmap_init(void)
 {
@@ -58,6 +66,7 @@ vmmap_init(void)
         KASSERT(NULL != vmmap_allocator && "failed to create vmmap allocator!");
         vmarea_allocator = slab_allocator_create("vmarea", sizeof(vmarea_t));
         KASSERT(NULL != vmarea_allocator && "failed to create vmarea allocator!");
+        vmmap_mlock_limit = page_free_count() >> PROC_MLOCK_LIMIT_SHIFT;
 }
 
 vmarea_t *
@@ -66,6 +75,10 @@ vmarea_alloc(void)
         vmarea_t *newvma = (vmarea_t *) slab_obj_alloc(vmarea_allocator);
         if (newvma) {
                 newvma->vma_vmmap = NULL;
+                newvma->vma_advice = MADV_NORMAL;
+                newvma->vma_otree = NULL;
+                memset(newvma->vma_faults, 0, sizeof(newvma->vma_faults));
+                memset(newvma->vma_fault_depths, 0, sizeof(newvma->vma_fault_depths));
         }
         return newvma;
 }
@@ -74,9 +87,423 @@ void
 vmarea_free(vmarea_t *vma)
 {
         KASSERT(NULL != vma);
+        KASSERT(NULL == vma->vma_otree);
         slab_obj_free(vmarea_allocator, vma);
 }
 
+/*
+ * The vmmap tree. Besides the usual AVL bookkeeping, every node knows the
+ * size of the gap in front of it and the largest such gap in its subtree,
+ * which lets vmmap_find_range go straight to the first gap that fits.
+ * Since vmareas never overlap, ordering them by start or by end is the
+ * same. Neighbours are found with vmm_list, which is kept in step.
+ */
+#define vma_tree_height(vma)    ((vma) ? (vma)->vma_height : 0)
+#define vma_tree_maxgap(vma)    ((vma) ? (vma)->vma_maxgap : 0)
+
+static vmarea_t *
+vma_prev(vmmap_t *map, vmarea_t *vma)
+{
+    if (vma->vma_plink.l_prev == &map->vmm_list) {
+        return NULL;
+    }
+    return list_item(vma->vma_plink.l_prev, vmarea_t, vma_plink);
+}
+
+static vmarea_t *
+vma_next(vmmap_t *map, vmarea_t *vma)
+{
+    if (vma->vma_plink.l_next == &map->vmm_list) {
+        return NULL;
+    }
+    return list_item(vma->vma_plink.l_next, vmarea_t, vma_plink);
+}
+
+/* recompute a node's height and maxgap from its children */
+static void
+vma_tree_update(vmarea_t *vma)
+{
+    vma->vma_height = 1 + MAX(vma_tree_height(vma->vma_left),
+                              vma_tree_height(vma->vma_right));
+    vma->vma_maxgap = MAX(vma->vma_gap, MAX(vma_tree_maxgap(vma->vma_left),
+                                            vma_tree_maxgap(vma->vma_right)));
+}
+
+/* make 'to' take the place of 'from' as a child of from's parent */
+static void
+vma_tree_replace(vmmap_t *map, vmarea_t *from, vmarea_t *to)
+{
+    vmarea_t *parent = from->vma_parent;
+
+    if (parent == NULL) {
+        map->vmm_root = to;
+    } else if (parent->vma_left == from) {
+        parent->vma_left = to;
+    } else {
+        parent->vma_right = to;
+    }
+    if (to != NULL) {
+        to->vma_parent = parent;
+    }
+}
+
+static vmarea_t *
+vma_tree_rotate_left(vmmap_t *map, vmarea_t *vma)
+{
+    vmarea_t *r = vma->vma_right;
+
+    vma_tree_replace(map, vma, r);
+    vma->vma_right = r->vma_left;
+    if (r->vma_left != NULL) {
+        r->vma_left->vma_parent = vma;
+    }
+    r->vma_left = vma;
+    vma->vma_parent = r;
+
+    vma_tree_update(vma);
+    vma_tree_update(r);
+    return r;
+}
+
+static vmarea_t *
+vma_tree_rotate_right(vmmap_t *map, vmarea_t *vma)
+{
+    vmarea_t *l = vma->vma_left;
+
+    vma_tree_replace(map, vma, l);
+    vma->vma_left = l->vma_right;
+    if (l->vma_right != NULL) {
+        l->vma_right->vma_parent = vma;
+    }
+    l->vma_right = vma;
+    vma->vma_parent = l;
+
+    vma_tree_update(vma);
+    vma_tree_update(l);
+    return l;
+}
+
+/* restore balance and maxgaps on the path from vma up to the root */
+static void
+vma_tree_rebalance(vmmap_t *map, vmarea_t *vma)
+{
+    while (vma != NULL) {
+        int balance = vma_tree_height(vma->vma_left) - vma_tree_height(vma->vma_right);
+
+        if (balance > 1) {
+            vmarea_t *l = vma->vma_left;
+            if (vma_tree_height(l->vma_left) < vma_tree_height(l->vma_right)) {
+                vma_tree_rotate_left(map, l);
+            }
+            vma = vma_tree_rotate_right(map, vma);
+        } else if (balance < -1) {
+            vmarea_t *r = vma->vma_right;
+            if (vma_tree_height(r->vma_right) < vma_tree_height(r->vma_left)) {
+                vma_tree_rotate_right(map, r);
+            }
+            vma = vma_tree_rotate_left(map, vma);
+        } else {
+            vma_tree_update(vma);
+        }
+        vma = vma->vma_parent;
+    }
+}
+
+/* recompute the gap in front of vma, after its start or the end of the
+ * area before it changed */
+static void
+vma_tree_fix_gap(vmmap_t *map, vmarea_t *vma)
+{
+    vmarea_t *prev = vma_prev(map, vma);
+
+    vma->vma_gap = vma->vma_start - (prev ? prev->vma_end : USER_PAGE_LOW);
+    for (; vma != NULL; vma = vma->vma_parent) {
+        vma_tree_update(vma);
+    }
+}
+
+/* Forget the areas remembered by vmmap_lookup */
+static void
+vmmap_cache_flush(vmmap_t *map)
+{
+    int i;
+    for (i = 0; i < VMMAP_CACHE_SIZE; i++) {
+        map->vmm_cache[i] = NULL;
+    }
+}
+
+/* Unlink a vmarea from the map's list and tree */
+static void
+vmmap_unlink(vmmap_t *map, vmarea_t *vma)
+{
+    vmarea_t *next = vma_next(map, vma);
+    vmarea_t *rebalance_from;
+
+    vmmap_cache_flush(map);
+    list_remove(&vma->vma_plink);
+
+    if (vma->vma_left != NULL && vma->vma_right != NULL) {
+        /* swap in the successor, which has no left child */
+        vmarea_t *succ = vma->vma_right;
+        while (succ->vma_left != NULL) {
+            succ = succ->vma_left;
+        }
+        if (succ->vma_parent == vma) {
+            rebalance_from = succ;
+        } else {
+            rebalance_from = succ->vma_parent;
+            vma_tree_replace(map, succ, succ->vma_right);
+            succ->vma_right = vma->vma_right;
+            succ->vma_right->vma_parent = succ;
+        }
+        vma_tree_replace(map, vma, succ);
+        succ->vma_left = vma->vma_left;
+        succ->vma_left->vma_parent = succ;
+    } else {
+        rebalance_from = vma->vma_parent;
+        vma_tree_replace(map, vma, vma->vma_left ? vma->vma_left : vma->vma_right);
+    }
+    vma_tree_rebalance(map, rebalance_from);
+
+    if (next != NULL) {
+        vma_tree_fix_gap(map, next);
+    }
+    vma->vma_left = vma->vma_right = vma->vma_parent = NULL;
+}
+
+/* Returns the first area of the map which ends after vfn, or NULL */
+static vmarea_t *
+vmmap_lower_bound(vmmap_t *map, uint32_t vfn)
+{
+    vmarea_t *vma = map->vmm_root, *found = NULL;
+
+    while (vma != NULL) {
+        if (vma->vma_end > vfn) {
+            found = vma;
+            vma = vma->vma_left;
+        } else {
+            vma = vma->vma_right;
+        }
+    }
+    return found;
+}
+
+/*
+ * The trees of areas by bottom object. They are ordered by vma_off, and
+ * by address among areas with the same vma_off, and every node knows
+ * the furthest page any area in its subtree reaches, so a search for
+ * the areas covering a page can skip subtrees which all end before it.
+ */
+#define vma_otree_height(vma)   ((vma) ? (vma)->vma_oheight : 0)
+#define vma_otree_end(vma)      ((vma)->vma_off + ((vma)->vma_end - (vma)->vma_start))
+
+static int
+vma_otree_before(vmarea_t *a, vmarea_t *b)
+{
+    return a->vma_off < b->vma_off
+           || (a->vma_off == b->vma_off && (uintptr_t)a < (uintptr_t)b);
+}
+
+/* recompute a node's height and maxend from its children */
+static void
+vma_otree_update(vmarea_t *vma)
+{
+    vma->vma_oheight = 1 + MAX(vma_otree_height(vma->vma_oleft),
+                               vma_otree_height(vma->vma_oright));
+    vma->vma_omaxend = vma_otree_end(vma);
+    if (vma->vma_oleft != NULL) {
+        vma->vma_omaxend = MAX(vma->vma_omaxend, vma->vma_oleft->vma_omaxend);
+    }
+    if (vma->vma_oright != NULL) {
+        vma->vma_omaxend = MAX(vma->vma_omaxend, vma->vma_oright->vma_omaxend);
+    }
+}
+
+/* make 'to' take the place of 'from' as a child of from's parent */
+static void
+vma_otree_replace(vmarea_t *from, vmarea_t *to)
+{
+    vmarea_t *parent = from->vma_oparent;
+
+    if (parent == NULL) {
+        from->vma_otree->mmo_un.mmo_vmas = to;
+    } else if (parent->vma_oleft == from) {
+        parent->vma_oleft = to;
+    } else {
+        parent->vma_oright = to;
+    }
+    if (to != NULL) {
+        to->vma_oparent = parent;
+    }
+}
+
+static vmarea_t *
+vma_otree_rotate_left(vmarea_t *vma)
+{
+    vmarea_t *r = vma->vma_oright;
+
+    vma_otree_replace(vma, r);
+    vma->vma_oright = r->vma_oleft;
+    if (r->vma_oleft != NULL) {
+        r->vma_oleft->vma_oparent = vma;
+    }
+    r->vma_oleft = vma;
+    vma->vma_oparent = r;
+
+    vma_otree_update(vma);
+    vma_otree_update(r);
+    return r;
+}
+
+static vmarea_t *
+vma_otree_rotate_right(vmarea_t *vma)
+{
+    vmarea_t *l = vma->vma_oleft;
+
+    vma_otree_replace(vma, l);
+    vma->vma_oleft = l->vma_oright;
+    if (l->vma_oright != NULL) {
+        l->vma_oright->vma_oparent = vma;
+    }
+    l->vma_oright = vma;
+    vma->vma_oparent = l;
+
+    vma_otree_update(vma);
+    vma_otree_update(l);
+    return l;
+}
+
+/* restore balance and maxends on the path from vma up to the root */
+static void
+vma_otree_rebalance(vmarea_t *vma)
+{
+    while (vma != NULL) {
+        int balance = vma_otree_height(vma->vma_oleft) - vma_otree_height(vma->vma_oright);
+
+        if (balance > 1) {
+            vmarea_t *l = vma->vma_oleft;
+            if (vma_otree_height(l->vma_oleft) < vma_otree_height(l->vma_oright)) {
+                vma_otree_rotate_left(l);
+            }
+            vma = vma_otree_rotate_right(vma);
+        } else if (balance < -1) {
+            vmarea_t *r = vma->vma_oright;
+            if (vma_otree_height(r->vma_oright) < vma_otree_height(r->vma_oleft)) {
+                vma_otree_rotate_right(r);
+            }
+            vma = vma_otree_rotate_left(vma);
+        } else {
+            vma_otree_update(vma);
+        }
+        vma = vma->vma_oparent;
+    }
+}
+
+/* Add vma to the tree of areas of bottom, which must not be a shadow
+ * object */
+void
+vmarea_obj_insert(mmobj_t *bottom, vmarea_t *vma)
+{
+    vmarea_t **link = &bottom->mmo_un.mmo_vmas, *parent = NULL;
+
+    KASSERT(bottom->mmo_shadowed == NULL);
+    KASSERT(vma->vma_otree == NULL);
+
+    while (*link != NULL) {
+        parent = *link;
+        if (vma_otree_before(vma, parent)) {
+            link = &parent->vma_oleft;
+        } else {
+            link = &parent->vma_oright;
+        }
+    }
+
+    vma->vma_oleft = vma->vma_oright = NULL;
+    vma->vma_oparent = parent;
+    vma->vma_otree = bottom;
+    *link = vma;
+    vma_otree_rebalance(vma);
+}
+
+/* Take vma out of the tree it is in, if any */
+void
+vmarea_obj_remove(vmarea_t *vma)
+{
+    vmarea_t *rebalance_from;
+
+    if (vma->vma_otree == NULL) {
+        return;
+    }
+
+    if (vma->vma_oleft != NULL && vma->vma_oright != NULL) {
+        /* swap in the successor, which has no left child */
+        vmarea_t *succ = vma->vma_oright;
+        while (succ->vma_oleft != NULL) {
+            succ = succ->vma_oleft;
+        }
+        if (succ->vma_oparent == vma) {
+            rebalance_from = succ;
+        } else {
+            rebalance_from = succ->vma_oparent;
+            vma_otree_replace(succ, succ->vma_oright);
+            succ->vma_oright = vma->vma_oright;
+            succ->vma_oright->vma_oparent = succ;
+        }
+        vma_otree_replace(vma, succ);
+        succ->vma_oleft = vma->vma_oleft;
+        succ->vma_oleft->vma_oparent = succ;
+    } else {
+        rebalance_from = vma->vma_oparent;
+        vma_otree_replace(vma, vma->vma_oleft ? vma->vma_oleft : vma->vma_oright);
+    }
+    vma_otree_rebalance(rebalance_from);
+
+    vma->vma_oleft = vma->vma_oright = vma->vma_oparent = NULL;
+    vma->vma_otree = NULL;
+}
+
+static void
+vma_otree_walk(vmarea_t *vma, uint32_t pagenum,
+               void (*func)(vmarea_t *vma, uintptr_t vaddr, void *arg), void *arg)
+{
+    while (vma != NULL && vma->vma_omaxend > pagenum) {
+        vma_otree_walk(vma->vma_oleft, pagenum, func, arg);
+        /* everything to the right starts later still */
+        if (vma->vma_off > pagenum) {
+            return;
+        }
+        if (vma_otree_end(vma) > pagenum) {
+            func(vma, (uintptr_t)PN_TO_ADDR(vma->vma_start + pagenum - vma->vma_off), arg);
+        }
+        vma = vma->vma_oright;
+    }
+}
+
+void
+vmarea_obj_walk(mmobj_t *o, uint32_t pagenum,
+                void (*func)(vmarea_t *vma, uintptr_t vaddr, void *arg), void *arg)
+{
+    vma_otree_walk(mmobj_bottom_obj(o)->mmo_un.mmo_vmas, pagenum, func, arg);
+}
+
+/* Change the pages vma covers, keeping it in order in its object's tree;
+ * the vmmap tree is the caller's business */
+static void
+vma_set_range(vmarea_t *vma, uint32_t start, uint32_t end, uint32_t off)
+{
+    mmobj_t *bottom = vma->vma_otree;
+
+    if (bottom != NULL) {
+        vmarea_obj_remove(vma);
+    }
+    vma->vma_start = start;
+    vma->vma_end = end;
+    vma->vma_off = off;
+    if (bottom != NULL) {
+        vmarea_obj_insert(bottom, vma);
+    }
+}
+
 /* Create a new vmmap, which has no vmareas and does
  * not refer to a process. */
 vmmap_t *
@@ -86,7 +513,11 @@ vmmap_create(void)
     vmmap_t *newvmm = (vmmap_t *)slab_obj_alloc(vmmap_allocator);
     if (newvmm) {
         list_init(&newvmm->vmm_list);
+        newvmm->vmm_root = NULL;
+        vmmap_cache_flush(newvmm);
         newvmm->vmm_proc = NULL;
+        radix_tree_init(&newvmm->vmm_locked);
+        newvmm->vmm_nlocked = 0;
         KASSERT(list_empty(&newvmm->vmm_list));
     }
     return newvmm;
@@ -105,22 +536,28 @@ vmmap_destroy(vmmap_t *map)
     /*vmarea_t pointer*/
     vmarea_t *vma;
 
-    /*traversal thru vmm_list and remove it*/
-    list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+    /*the page tables still map it if a process is exiting*/
+    vmmap_sync(map, USER_PAGE_LOW, USER_PAGE_HIGH - USER_PAGE_LOW, 0);
+    vmmap_unlock(map, USER_PAGE_LOW, USER_PAGE_HIGH - USER_PAGE_LOW);
+
+    /*take areas off the front one at a time, so that the teardown of a
+     *big address space can stop to let others run without losing its place*/
+    while (!list_empty(&map->vmm_list)) {
+        vma = list_head(&map->vmm_list, vmarea_t, vma_plink);
         /*remove it from the list*/
         list_remove(&vma->vma_plink);
 
-        /*it could be on no list*/
-        if (list_link_is_linked(&vma->vma_olink)) {
-            list_remove(&vma->vma_olink);
-        }
+        /*it could be in no tree*/
+        vmarea_obj_remove(vma);
 
         /*since there is 1 less pointer pointing to vma_obj, put it*/
         vma->vma_obj->mmo_ops->put(vma->vma_obj);
 
         /*reclaim the memory*/
         vmarea_free(vma);
-    } list_iterate_end();
+
+        cond_resched();
+    }
     
     /*Any other things than just remove the link?*/
 
@@ -135,38 +572,88 @@ vmmap_destroy(vmmap_t *map)
 void
 vmmap_insert(vmmap_t *map, vmarea_t *newvma)
 {
-    if list_empty(&map->vmm_list) {
-        list_insert_head(&map->vmm_list, &newvma->vma_plink);
-        newvma->vma_vmmap = map;
-        return;
-    }
+    vmarea_t **link = &map->vmm_root, *parent = NULL, *succ = NULL;
 
-    list_link_t *list = &map->vmm_list;
-    vmarea_t *vma_cur;
-    list_iterate_begin(list, vma_cur, vmarea_t, vma_plink) {
-        if (vma_cur->vma_plink.l_prev == list) {
-            /*no prev*/
-            if (newvma->vma_end <= vma_cur->vma_start) {
-                list_insert_head(list, &newvma->vma_plink);
-                newvma->vma_vmmap = map;
-                return;
-            }
+    KASSERT(newvma->vma_start < newvma->vma_end);
+
+    vmmap_cache_flush(map);
+
+    /*find the leaf to hang it from, and the area after it*/
+    while (*link != NULL) {
+        parent = *link;
+        if (newvma->vma_end <= parent->vma_start) {
+            succ = parent;
+            link = &parent->vma_left;
         } else {
-            /*prev is a vmarea*/
-            vmarea_t *vma_prev = list_item(vma_cur->vma_plink.l_prev, vmarea_t, vma_plink);
-            KASSERT(vma_prev);
-            if (newvma->vma_end <= vma_cur->vma_start && newvma->vma_start >= vma_prev->vma_end) {
-                list_insert_before(&vma_cur->vma_plink, &newvma->vma_plink);
-                newvma->vma_vmmap = map;
-                return;
-            }
+            KASSERT(newvma->vma_start >= parent->vma_end && "overlapping vmareas");
+            link = &parent->vma_right;
         }
-    } list_iterate_end();
+    }
 
-    list_insert_tail(list, &newvma->vma_plink);
+    newvma->vma_left = newvma->vma_right = NULL;
+    newvma->vma_parent = parent;
+    newvma->vma_height = 1;
+    *link = newvma;
+
+    if (succ != NULL) {
+        list_insert_before(&succ->vma_plink, &newvma->vma_plink);
+    } else {
+        list_insert_tail(&map->vmm_list, &newvma->vma_plink);
+    }
     newvma->vma_vmmap = map;
 
-        /*NOT_YET_IMPLEMENTED("VM: vmmap_insert");*/
+    vma_tree_fix_gap(map, newvma);
+    vma_tree_rebalance(map, newvma);
+    if (succ != NULL) {
+        vma_tree_fix_gap(map, succ);
+    }
+}
+
+/* Move the end of an area already in the map to end, which must not
+ * overlap the next area.  Callers must use this instead of writing
+ * vma_end so the free gap after the area stays current. */
+void
+vmmap_resize(vmmap_t *map, vmarea_t *vma, uint32_t end)
+{
+    vmarea_t *next = vma_next(map, vma);
+
+    KASSERT(vma->vma_vmmap == map);
+    KASSERT(vma->vma_start < end);
+    KASSERT(next == NULL || end <= next->vma_start);
+
+    vma_set_range(vma, vma->vma_start, end, vma->vma_off);
+    if (next != NULL) {
+        vma_tree_fix_gap(map, next);
+    }
+}
+
+/* For a fault or a user access at vfn, which no area maps: if the area
+ * above vfn grows down (MAP_GROWSDOWN, a stack), move its start down to
+ * vfn and return it. Such an area's vma_off is how many pages it may
+ * still grow by, which gives it a page numbering that never goes below
+ * 0, and it is kept STACK_GUARD_PAGES clear of the area below it, so
+ * that a stack overflowing into another mapping faults instead. Returns
+ * NULL if there is no such area or it cannot reach vfn. Nothing here
+ * blocks. */
+vmarea_t *
+vmmap_grow_down(vmmap_t *map, uint32_t vfn)
+{
+    vmarea_t *vma = vmmap_lower_bound(map, vfn);
+
+    if (vma == NULL || !(vma->vma_flags & MAP_GROWSDOWN) || vma->vma_start <= vfn) {
+        return NULL;
+    }
+    if (vma->vma_start - vfn > vma->vma_off || vfn < USER_PAGE_LOW) {
+        return NULL;
+    }
+    vmarea_t *prev = vma_prev(map, vma);
+    if (prev != NULL && vfn < prev->vma_end + STACK_GUARD_PAGES) {
+        return NULL;
+    }
+
+    vma_set_range(vma, vfn, vma->vma_end, vma->vma_off - (vma->vma_start - vfn));
+    vma_tree_fix_gap(map, vma);
+    return vma;
 }
 
 /* Find a contiguous range of free virtual pages of length npages in
@@ -181,92 +668,80 @@ vmmap_find_range(vmmap_t *map, uint32_t npages, int dir)
 {
     dbg(DBG_MM, "vmmap function hook\n");
 
-    /*low-high*/
+    /*the gap after the last area is not in the tree*/
+    uint32_t tail = USER_PAGE_LOW;
+    if (!list_empty(&map->vmm_list)) {
+        vmarea_t *last = list_tail(&map->vmm_list, vmarea_t, vma_plink);
+        tail = last->vma_end;
+    }
+
+    vmarea_t *vma = map->vmm_root;
+    if (vma_tree_maxgap(vma) < npages) {
+        vma = NULL;
+    }
+
     if (dir == VMMAP_DIR_LOHI || dir == 0) {
-        if list_empty(&map->vmm_list) {
-            return USER_PAGE_LOW;
-        }
-
-        list_link_t *list = &map->vmm_list;
-        vmarea_t *vma_cur;
-        list_iterate_begin(list, vma_cur, vmarea_t, vma_plink) {
-            if (vma_cur->vma_plink.l_prev == list) {
-                /*no prev*/
-                /*head of list*/
-                if (vma_cur->vma_start >= npages + USER_PAGE_LOW) {
-                    return USER_PAGE_LOW;
-                }
+        /*low-high: the leftmost gap that fits*/
+        while (vma != NULL) {
+            if (vma_tree_maxgap(vma->vma_left) >= npages) {
+                vma = vma->vma_left;
+            } else if (vma->vma_gap >= npages) {
+                return vma->vma_start - vma->vma_gap;
             } else {
-                /*prev is a vmarea*/
-                vmarea_t *vma_prev = list_item(vma_cur->vma_plink.l_prev, vmarea_t, vma_plink);
-                KASSERT(vma_prev);
-                KASSERT(vma_cur->vma_start >= vma_prev->vma_end);
-                if (vma_cur->vma_start - vma_prev->vma_end >= npages) {
-                    return vma_prev->vma_end;
-                }
+                vma = vma->vma_right;
             }
-        } list_iterate_end();
-
-        KASSERT(vma_cur->vma_plink.l_next == list);
-        if (USER_PAGE_HIGH - vma_cur->vma_end >= npages) {
-            return vma_cur->vma_end;
-        } else {
-            return -1;
+        }
+        if (USER_PAGE_HIGH - tail >= npages) {
+            return tail;
         }
     } else {
-        /*high-low*/
-        if list_empty(&map->vmm_list) {
+        /*high-low: the rightmost gap that fits*/
+        if (USER_PAGE_HIGH - tail >= npages) {
             return (USER_PAGE_HIGH - npages);
         }
-
-        list_link_t *list = &map->vmm_list;
-        vmarea_t *vma_cur;
-        list_iterate_reverse(list, vma_cur, vmarea_t, vma_plink) {
-            if (vma_cur->vma_plink.l_next == list) {
-                /*no prev*/
-                /*head of list*/
-                if (USER_PAGE_HIGH - vma_cur->vma_end >= npages) {
-                    return (USER_PAGE_HIGH - npages);
-                }
+        while (vma != NULL) {
+            if (vma_tree_maxgap(vma->vma_right) >= npages) {
+                vma = vma->vma_right;
+            } else if (vma->vma_gap >= npages) {
+                return vma->vma_start - npages;
             } else {
-                /*next is a vmarea*/
-                vmarea_t *vma_next = list_item(vma_cur->vma_plink.l_next, vmarea_t, vma_plink);
-                KASSERT(vma_next);
-                KASSERT(vma_next->vma_start >= vma_cur->vma_end);
-                if (vma_next->vma_start - vma_cur->vma_end >= npages) {
-                    return (vma_next->vma_start - npages);
-                }
+                vma = vma->vma_left;
             }
-        } list_iterate_end();
-
-        KASSERT(vma_cur->vma_plink.l_prev == list);
-        if (vma_cur->vma_start - USER_PAGE_LOW >= npages) {
-            return vma_cur->vma_start - npages;
-        } else {
-            return -1;
         }
     }
-        /*NOT_YET_IMPLEMENTED("VM: vmmap_find_range");*/
-        /*return -1;*/
+    return -1;
 }
 
-/* Find the vm_area that vfn lies in. Simply scan the address space
- * looking for a vma whose range covers vfn. If the page is unmapped,
- * return NULL. */
+/* Find the vm_area that vfn lies in. If the page is unmapped, return
+ * NULL. */
 vmarea_t *
 vmmap_lookup(vmmap_t *map, uint32_t vfn)
 {
     vmarea_t *vma;
+    int i;
 
-    list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
-        if (vfn >= vma->vma_start && vfn < vma->vma_end) {
-            return vma;
+    /*most faults land in an area looked up recently*/
+    for (i = 0; i < VMMAP_CACHE_SIZE && map->vmm_cache[i] != NULL; i++) {
+        vma = map->vmm_cache[i];
+        if (vma->vma_start <= vfn && vfn < vma->vma_end) {
+            goto hit;
         }
-    } list_iterate_end();
+    }
 
-    return NULL;
-        /*NOT_YET_IMPLEMENTED("VM: vmmap_lookup");*/
-        /*return NULL;*/
+    vma = vmmap_lower_bound(map, vfn);
+    if (vma == NULL || vma->vma_start > vfn) {
+        return NULL;
+    }
+    /*evict the least recent entry*/
+    i = VMMAP_CACHE_SIZE - 1;
+
+hit:
+    /*move it to the front*/
+    for (; i > 0; i--) {
+        map->vmm_cache[i] = map->vmm_cache[i - 1];
+    }
+    map->vmm_cache[0] = vma;
+    return vma;
 }
 
 /* Allocates a new vmmap containing a new vmarea for each area in the
@@ -299,6 +774,7 @@ vmmap_clone(vmmap_t *map)
 
         area_new->vma_prot = area_cur->vma_prot;
         area_new->vma_flags = area_cur->vma_flags;
+        area_new->vma_advice = area_cur->vma_advice;
 
         area_new->vma_vmmap = newmap;
 
@@ -306,8 +782,6 @@ vmmap_clone(vmmap_t *map)
         list_link_init(&area_new->vma_plink);
         vmmap_insert(newmap, area_new);
 
-        list_link_init(&area_new->vma_olink);
-        /*olink need future attention*/
         KASSERT(area_cur->vma_obj->mmo_shadowed != area_cur->vma_obj);
 
         mmobj_t *bottom = mmobj_bottom_obj(area_cur->vma_obj);
@@ -319,8 +793,18 @@ vmmap_clone(vmmap_t *map)
             KASSERT(area_cur->vma_obj != bottom);
         }
 
+        /*
+         * a shared area, MAP_ANON or a shm object as much as a file, keeps
+         * the very same object in the child; private ones start out on it
+         * too, and vmmap_shadow puts shadows in front of them
+         */
         area_new->vma_obj = area_cur->vma_obj;
         area_new->vma_obj->mmo_ops->ref(area_new->vma_obj);
+
+        /*vmmap_shadow links the private ones once it has shadowed them*/
+        if (area_new->vma_flags & MAP_SHARED) {
+            vmarea_obj_insert(bottom, area_new);
+        }
     } list_iterate_end();
 
     return newmap;
@@ -354,9 +838,10 @@ vmmap_clone(vmmap_t *map)
  *
  * If 'new' is non-NULL a pointer to the new vmarea_t should be stored in it.
  */
-int
-vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
-          int prot, int flags, off_t off, int dir, vmarea_t **new)
+static int
+vmmap_map_common(vmmap_t *map, vnode_t *file, mmobj_t *obj, uint32_t lopage,
+                 uint32_t npages, int prot, int flags, off_t off, int dir,
+                 vmarea_t **new)
 {
     dbg(DBG_MM, "vmmap function hook\n");
     KASSERT(map);
@@ -403,11 +888,12 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
     /*vma_obj will be set later*/
     vma_result->vma_obj = NULL;
 
-    /*vma_olink is initialized during alloc, still unclear, what to do?*/
-    list_link_init(&vma_result->vma_olink);
-    /*list_insert_head(&vma_result->vma_obj->mmo_un.mmo_vmas, &vma_result->vma_olink);*/
-
-    if ((flags & MAP_ANON) || (file == NULL)) {
+    if (obj != NULL) {
+        /*the caller's object stands in for the file*/
+        KASSERT(obj->mmo_shadowed == NULL);
+        obj->mmo_ops->ref(obj);
+        vma_result->vma_obj = obj;
+    } else if ((flags & MAP_ANON) || (file == NULL)) {
         mmobj_t *mmobj_anon = anon_create();
         if (mmobj_anon == NULL) {
             vmarea_free(vma_result);
@@ -441,6 +927,12 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
     }
     KASSERT(vma_result->vma_obj);
 
+    /*
+     * every area goes in its bottom object's tree, shared ones too, so
+     * that pframe_remove_from_pts and the dirty bit harvest find them
+     */
+    vmarea_obj_insert(vma_result->vma_obj, vma_result);
+
     if (flags & MAP_PRIVATE) {
         /*create a shadow object*/
         mmobj_t *mmobj_shadow = shadow_create();
@@ -458,8 +950,6 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
         /*ref it*/
         mmobj_shadow->mmo_un.mmo_bottom_obj->mmo_ops->ref(mmobj_shadow->mmo_un.mmo_bottom_obj);
 
-        list_insert_head(&vma_result->vma_obj->mmo_un.mmo_vmas, &vma_result->vma_olink);
-
         vma_result->vma_obj = mmobj_shadow;
         mmobj_shadow->mmo_ops->ref(mmobj_shadow);
     }
@@ -468,6 +958,7 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
     if (remove) {
         int err = vmmap_remove(map, lopage, npages);
         if (err < 0) {
+            vmarea_obj_remove(vma_result);
             vma_result->vma_obj->mmo_ops->put(vma_result->vma_obj);
             vmarea_free(vma_result);
             return err;
@@ -484,6 +975,29 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
         /*return -1;*/
 }
 
+int
+vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
+          int prot, int flags, off_t off, int dir, vmarea_t **new)
+{
+    return vmmap_map_common(map, file, NULL, lopage, npages, prot, flags,
+                            off, dir, new);
+}
+
+/*
+ * Like vmmap_map, but maps the pages of obj, which must not be a shadow
+ * object, instead of a file or new anonymous memory. This is how several
+ * processes map one object private copy-on-write without there being a
+ * file behind it.
+ */
+int
+vmmap_map_obj(vmmap_t *map, mmobj_t *obj, uint32_t lopage, uint32_t npages,
+              int prot, int flags, off_t off, int dir, vmarea_t **new)
+{
+    KASSERT(obj);
+    return vmmap_map_common(map, NULL, obj, lopage, npages, prot, flags,
+                            off, dir, new);
+}
+
 /*
  * We have no guarantee that the region of the address space being
  * unmapped will play nicely with our list of vmareas.
@@ -526,6 +1040,12 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
     vmarea_t *vma;
     uint32_t hipage = lopage + npages;
 
+    /*the page table entries for the range go once this returns*/
+    vmmap_sync(map, lopage, npages, 0);
+    vmmap_unlock(map, lopage, npages);
+
+    vmmap_cache_flush(map);
+
     list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
         /*no intersection*/
         if (vma->vma_start >= hipage || vma->vma_end <= lopage) {
@@ -548,42 +1068,40 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
 
             vma_new->vma_prot = vma->vma_prot;
             vma_new->vma_flags = vma->vma_flags;
+            vma_new->vma_advice = vma->vma_advice;
 
             vma_new->vma_vmmap = vma->vma_vmmap;
             vma_new->vma_obj = vma->vma_obj;
             vma_new->vma_obj->mmo_ops->ref(vma_new->vma_obj);
 
-            list_link_init(&vma_new->vma_plink);
-            list_insert_before(&vma->vma_plink, &vma_new->vma_plink);
+            vmarea_obj_insert(mmobj_bottom_obj(vma->vma_obj), vma_new);
 
-            list_link_init(&vma_new->vma_olink);
-            mmobj_t *bottom = mmobj_bottom_obj(vma->vma_obj);
-            KASSERT(bottom->mmo_shadowed == NULL);
+            vma_set_range(vma, hipage, vma->vma_end,
+                          hipage - vma->vma_start + vma->vma_off);
 
-            if (bottom != vma->vma_obj) {
-                /*only add it to the bottom's vmas when it's truly needed*/
-                KASSERT(vma->vma_obj->mmo_shadowed);
-                list_insert_head(&bottom->mmo_un.mmo_vmas, &vma_new->vma_olink);
-            }
-            /*not sure about what I could do here with olink*/
-
-            vma->vma_off = hipage - vma->vma_start + vma->vma_off;
-            vma->vma_start = hipage;
+            /*shrinking an area in place keeps the tree in order*/
+            vma_tree_fix_gap(map, vma);
+            list_link_init(&vma_new->vma_plink);
+            vmmap_insert(map, vma_new);
             continue;
         }
 
         /*case 2*/
         /*chop off the right part*/
         if (vma->vma_start < lopage && vma->vma_end <= hipage) {
-            vma->vma_end = lopage;
+            vma_set_range(vma, vma->vma_start, lopage, vma->vma_off);
+            if (vma_next(map, vma) != NULL) {
+                vma_tree_fix_gap(map, vma_next(map, vma));
+            }
             continue;
         }
 
         /*case 3*/
         /*chop off the left part*/
         if (vma->vma_start >= lopage && vma->vma_end > hipage) {
-            vma->vma_off = hipage - vma->vma_start + vma->vma_off;
-            vma->vma_start = hipage;
+            vma_set_range(vma, hipage, vma->vma_end,
+                          hipage - vma->vma_start + vma->vma_off);
+            vma_tree_fix_gap(map, vma);
             continue;
         }
 
@@ -591,14 +1109,8 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
         /*just remove it*/
         if (vma->vma_start >= lopage && vma->vma_end <= hipage) {
             vma->vma_obj->mmo_ops->put(vma->vma_obj);
-            list_remove(&vma->vma_plink);
-            /*for NOW omit vma_olink*/
-            /*not sure about removing it*/
-            if (list_link_is_linked(&vma->vma_olink)) {
-                list_remove(&vma->vma_olink);
-            } else {
-                /*panic("wohoo");*/
-            }
+            vmmap_unlink(map, vma);
+            vmarea_obj_remove(vma);
             vmarea_free(vma);
             continue;
         }
@@ -610,28 +1122,244 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
 }
 
 /*
- * Returns 1 if the given address space has no mappings for the
- * given range, 0 otherwise.
+ * Moves the dirty bits in the page tables for the shared areas of map in
+ * [lopage, lopage + npages) into their pages, before the page table
+ * entries go away or for msync(2). If sync is set the dirty pages of
+ * those areas are written back as well, and the first error in doing so
+ * is returned.
  */
 int
-vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages)
+vmmap_sync(vmmap_t *map, uint32_t lopage, uint32_t npages, int sync)
+{
+    uint32_t hipage = lopage + npages;
+    vmarea_t *vma;
+    int ret = 0;
+
+    if (map->vmm_proc == NULL) {
+        return 0;
+    }
+
+    list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+        if (!(vma->vma_flags & MAP_SHARED)
+            || vma->vma_start >= hipage || vma->vma_end <= lopage) {
+            continue;
+        }
+
+        uint32_t first = MAX(vma->vma_start, lopage) - vma->vma_start + vma->vma_off;
+        uint32_t end = MIN(vma->vma_end, hipage) - vma->vma_start + vma->vma_off;
+        uint32_t pn;
+        pframe_t *pf;
+
+        for (pn = first; NULL != (pf = pframe_next_resident(vma->vma_obj, &pn))
+             && pn < end; pn++) {
+            pframe_harvest_dirty(pf);
+            if (!sync || pframe_is_pinned(pf)) {
+                continue;
+            }
+            /*wait for a write or fill under way to finish*/
+            if (pframe_is_busy(pf)) {
+                int err = pframe_get(vma->vma_obj, pn, &pf);
+                if (err < 0) {
+                    ret = (ret < 0) ? ret : err;
+                    continue;
+                }
+            }
+            if (pframe_is_dirty(pf) && !pframe_is_pinned(pf)) {
+                int err = pframe_clean(pf);
+                ret = (ret < 0) ? ret : err;
+            }
+        }
+    } list_iterate_end();
+
+    return ret;
+}
+
+/*
+ * Splits vma in two at vfn, which must lie inside it. vma keeps the upper
+ * part, and the new area for the lower part is stored in *lower if lower
+ * is non-NULL. Returns 0 or -ENOSPC.
+ */
+static int
+vmmap_split(vmmap_t *map, vmarea_t *vma, uint32_t vfn, vmarea_t **lower)
+{
+    KASSERT(vma->vma_start < vfn && vfn < vma->vma_end);
+
+    vmarea_t *vma_new = vmarea_alloc();
+    if (vma_new == NULL) {
+        return -ENOSPC;
+    }
+
+    vma_new->vma_start = vma->vma_start;
+    vma_new->vma_end = vfn;
+    vma_new->vma_off = vma->vma_off;
+
+    vma_new->vma_prot = vma->vma_prot;
+    vma_new->vma_flags = vma->vma_flags;
+    vma_new->vma_advice = vma->vma_advice;
+
+    vma_new->vma_obj = vma->vma_obj;
+    vma_new->vma_obj->mmo_ops->ref(vma_new->vma_obj);
+
+    vmarea_obj_insert(mmobj_bottom_obj(vma->vma_obj), vma_new);
+
+    vma_set_range(vma, vfn, vma->vma_end, vfn - vma->vma_start + vma->vma_off);
+
+    /*shrinking an area in place keeps the tree in order*/
+    vma_tree_fix_gap(map, vma);
+    list_link_init(&vma_new->vma_plink);
+    vmmap_insert(map, vma_new);
+
+    if (lower) {
+        *lower = vma_new;
+    }
+    return 0;
+}
+
+/*
+ * Records advice (MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL) for
+ * [lopage, lopage + npages) of map, splitting the areas it starts or ends
+ * inside so that it applies to exactly that range. Returns 0 or -ENOSPC,
+ * in which case only part of the range may have taken the advice.
+ */
+int
+vmmap_advise(vmmap_t *map, uint32_t lopage, uint32_t npages, int advice)
 {
+    uint32_t hipage = lopage + npages;
+    vmarea_t *vma;
 
+    list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+        if (vma->vma_start >= hipage || vma->vma_end <= lopage
+            || vma->vma_advice == advice) {
+            continue;
+        }
+
+        vmarea_t *target = vma;
+        int err;
+        if (vma->vma_start < lopage
+            && 0 > (err = vmmap_split(map, vma, lopage, NULL))) {
+            return err;
+        }
+        if (vma->vma_end > hipage
+            && 0 > (err = vmmap_split(map, vma, hipage, &target))) {
+            return err;
+        }
+        target->vma_advice = advice;
+    } list_iterate_end();
+
+    return 0;
+}
+
+/*
+ * Starts bringing the file pages behind [lopage, lopage + npages) of map
+ * into memory without waiting for them, for MADV_WILLNEED and sequential
+ * faults. Anonymous memory has nothing to read; the prefetch stops early
+ * when memory is short.
+ */
+void
+vmmap_prefetch(vmmap_t *map, uint32_t lopage, uint32_t npages)
+{
+    uint32_t hipage = lopage + npages;
     vmarea_t *vma;
+
     list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
-        if ((vma->vma_start >= startvfn + npages) || (vma->vma_end <= startvfn)) {
-            /*nothing*/
-            /*no overlapping*/
-        } else {
-            dprintf("Hmm, not empty, found some overlapping\n");
-            return 0;
+        if (vma->vma_start >= hipage || vma->vma_end <= lopage) {
+            continue;
+        }
+
+        mmobj_t *bottom = mmobj_bottom_obj(vma->vma_obj);
+        uint32_t vfn;
+        for (vfn = MAX(vma->vma_start, lopage); vfn < MIN(vma->vma_end, hipage); vfn++) {
+            if (0 > pframe_prefetch(bottom, get_pagenum(vma, vfn))) {
+                break;
+            }
+        }
+    } list_iterate_end();
+}
+
+/*
+ * MADV_DONTNEED for [lopage, lopage + npages) of map, which must be
+ * mapped: the page table entries go, and private areas throw away the
+ * pages they have copied, so that they read as what they were copied
+ * from again (the file, zeros, or the memory shared with a fork parent).
+ * Shared areas keep what was written through them.
+ */
+void
+vmmap_dontneed(vmmap_t *map, uint32_t lopage, uint32_t npages)
+{
+    uint32_t hipage = lopage + npages;
+    vmarea_t *vma;
+
+    /*before the page table entries go*/
+    vmmap_sync(map, lopage, npages, 0);
+    if (map->vmm_proc) {
+        pt_unmap_range(map->vmm_proc->p_pagedir, (uintptr_t)PN_TO_ADDR(lopage),
+                       (uintptr_t)PN_TO_ADDR(hipage));
+        tlb_flush_range((uintptr_t)PN_TO_ADDR(lopage), npages);
+    }
+
+    list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+        if (!(vma->vma_flags & MAP_PRIVATE)
+            || vma->vma_start >= hipage || vma->vma_end <= lopage) {
+            continue;
+        }
+
+        /*only the top shadow object belongs to this area alone*/
+        uint32_t end = MIN(vma->vma_end, hipage) - vma->vma_start + vma->vma_off;
+        uint32_t pn;
+        pframe_t *pf;
+        for (pn = get_pagenum(vma, MAX(vma->vma_start, lopage));
+             NULL != (pf = pframe_next_resident(vma->vma_obj, &pn)) && pn < end; pn++) {
+            pframe_discard(pf);
+        }
+        /*and the pages ksmd merged, which read as what was copied too*/
+        ksm_unmerge(vma->vma_obj, get_pagenum(vma, MAX(vma->vma_start, lopage)), end);
+    } list_iterate_end();
+}
+
+/*
+ * Counts the pages mapped in pd from the top objects of the private
+ * areas of map, which no other address space can see; every other
+ * mapped page is shared, with other processes or with the page cache.
+ * Nothing here blocks.
+ */
+uint32_t
+vmmap_private_pages(vmmap_t *map, pagedir_t *pd)
+{
+    uint32_t count = 0;
+    vmarea_t *vma;
+
+    list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
+        if (!(vma->vma_flags & MAP_PRIVATE)) {
+            continue;
+        }
+        uint32_t end = vma->vma_end - vma->vma_start + vma->vma_off;
+        uint32_t pn;
+        for (pn = vma->vma_off;
+             NULL != pframe_next_resident(vma->vma_obj, &pn) && pn < end; pn++) {
+            if (pt_is_mapped(pd, (uintptr_t)PN_TO_ADDR(vma->vma_start + pn - vma->vma_off))) {
+                count++;
+            }
         }
     } list_iterate_end();
+    return count;
+}
+
+/*
+ * Returns 1 if the given address space has no mappings for the
+ * given range, 0 otherwise.
+ */
+int
+vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages)
+{
+    vmarea_t *vma = vmmap_lower_bound(map, startvfn);
+
+    if (vma != NULL && vma->vma_start < startvfn + npages) {
+        dprintf("Hmm, not empty, found some overlapping\n");
+        return 0;
+    }
 
     dprintf("turns out it's emtpy for that range\n");
     return 1;
-        /*NOT_YET_IMPLEMENTED("VM: vmmap_is_range_empty");*/
-        /*return 0;*/
 }
 
 /* Read into 'buf' from the virtual address space of 'map' starting at
@@ -669,8 +1397,9 @@ vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count)
         KASSERT(pf);
 
         size_t readlen = MIN((PAGE_SIZE - offset), count);
-        char *readptr = (char *)pf->pf_addr + offset;
-        memcpy(buff, readptr, readlen);
+        char *page = pframe_kmap_atomic(pf);
+        memcpy(buff, page + offset, readlen);
+        pframe_kunmap_atomic(pf, page);
 
         count -= readlen;
         buff += readlen;
@@ -699,8 +1428,8 @@ vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count)
     uint32_t addr = (uint32_t)vaddr;
     
     while (count > 0) {
-        uint32_t pagenum = ADDR_TO_PN(vaddr);
-        uint32_t offset = PAGE_OFFSET(vaddr);
+        uint32_t pagenum = ADDR_TO_PN(addr);
+        uint32_t offset = PAGE_OFFSET(addr);
 
         /*get the vmarea*/
         vmarea_t *vmarea = vmmap_lookup(map, pagenum);
@@ -718,8 +1447,9 @@ vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count)
         KASSERT(pf);
 
         size_t writelen = MIN((PAGE_SIZE - offset), count);
-        char *writeptr = (char *)pf->pf_addr + offset;
-        memcpy(writeptr, buff, writelen);
+        char *page = pframe_kmap_atomic(pf);
+        memcpy(page + offset, buff, writelen);
+        pframe_kunmap_atomic(pf, page);
         pframe_dirty(pf);
 
         count -= writelen;
@@ -733,6 +1463,195 @@ vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count)
         /*return 0;*/
 }
 
+int
+vmmap_write_user(vmmap_t *map, void *vaddr, const void *ubuf, size_t count)
+{
+    const char *buff = (const char *)ubuf;
+    uint32_t addr = (uint32_t)vaddr;
+
+    while (count > 0) {
+        uint32_t pagenum = ADDR_TO_PN(addr);
+        uint32_t offset = PAGE_OFFSET(addr);
+
+        vmarea_t *vmarea = vmmap_lookup(map, pagenum);
+        KASSERT(vmarea);
+
+        pframe_t *pf;
+        int err = pframe_lookup(vmarea->vma_obj, get_pagenum(vmarea, pagenum),
+                    1, &pf);
+        if (err < 0) {
+            return err;
+        }
+
+        /*copy_from_user may block, so keep the page from being paged out
+         *under us while it does*/
+        size_t writelen = MIN((PAGE_SIZE - offset), count);
+        pframe_pin(pf);
+        char *page = pframe_kmap(pf);
+        err = copy_from_user(page + offset, buff, writelen);
+        pframe_kunmap(pf, page);
+        if (err == 0) {
+            pframe_dirty(pf);
+        }
+        pframe_unpin(pf);
+        if (err < 0) {
+            return err;
+        }
+
+        count -= writelen;
+        buff += writelen;
+        addr += writelen;
+    }
+    return 0;
+}
+
+/*
+ * Pins the pframes behind npages pages of map from lopage, the ones a
+ * read of them would find, so that they can be lent out rather than
+ * copied, and puts them in pfs. Each one's object is reffed as well,
+ * which keeps shadowd and read faults from collapsing the page into
+ * another object, and munmap from freeing it, until vmmap_unpin_pages.
+ * The caller has checked that the pages are mapped readable, or, if
+ * forwrite is set, writable; then they are the ones a write would find,
+ * which the page table may not map yet. Returns 0, or -errno with none
+ * of them pinned.
+ */
+int
+vmmap_pin_pages(vmmap_t *map, uint32_t lopage, uint32_t npages, pframe_t **pfs,
+                int forwrite)
+{
+    uint32_t i;
+    int err = 0;
+
+    for (i = 0; i < npages; i++) {
+        vmarea_t *vmarea = vmmap_lookup(map, lopage + i);
+        if (NULL == vmarea) {
+            /* unmapped by another thread since it was checked */
+            err = -EFAULT;
+            break;
+        }
+        if (0 > (err = pframe_lookup(vmarea->vma_obj,
+                                     get_pagenum(vmarea, lopage + i), forwrite, &pfs[i]))) {
+            break;
+        }
+        pframe_pin(pfs[i]);
+        pfs[i]->pf_obj->mmo_ops->ref(pfs[i]->pf_obj);
+    }
+    if (0 > err) {
+        vmmap_unpin_pages(pfs, i);
+    }
+    return err;
+}
+
+void
+vmmap_unpin_pages(pframe_t **pfs, uint32_t npages)
+{
+    uint32_t i;
+
+    for (i = 0; i < npages; i++) {
+        mmobj_t *o = pfs[i]->pf_obj;
+        pframe_unpin(pfs[i]);
+        /* which may free the page along with the object */
+        o->mmo_ops->put(o);
+    }
+}
+
+/*
+ * Returns how many of the pages of map in [lopage, lopage + npages) are
+ * locked. Nothing here blocks.
+ */
+uint32_t
+vmmap_locked_pages(vmmap_t *map, uint32_t lopage, uint32_t npages)
+{
+    uint32_t vfn = lopage;
+    uint32_t count = 0;
+
+    while (NULL != radix_next(&map->vmm_locked, &vfn) && vfn - lopage < npages) {
+        count++;
+        vfn++;
+    }
+    return count;
+}
+
+/*
+ * Locks [lopage, lopage + npages) of map, which must all be mapped, for
+ * mlock(2). Each page is found as a fault on it would find it, and for
+ * writing in a writable private area, so that its copy is made now
+ * rather than at the first store; it is then pinned as vmmap_pin_pages
+ * does, so that pageoutd leaves it be, and kept in vmm_locked until
+ * vmmap_unlock. The file pages of the range are all started reading at
+ * once first. Pages which are locked already are left as they are.
+ *
+ * Locks are not inherited by fork, and a page of a private area written
+ * after a fork is copied then as any other.
+ *
+ * Returns 0, -ENOMEM if it would take map past the most pages an address
+ * space may lock, or -errno, in which case the pages locked before the
+ * error stay locked.
+ */
+int
+vmmap_lock(vmmap_t *map, uint32_t lopage, uint32_t npages)
+{
+    uint32_t hipage = lopage + npages;
+    uint32_t vfn;
+    int err;
+
+    if (map->vmm_nlocked + npages - vmmap_locked_pages(map, lopage, npages)
+        > vmmap_mlock_limit) {
+        return -ENOMEM;
+    }
+
+    vmmap_prefetch(map, lopage, npages);
+
+    for (vfn = lopage; vfn < hipage; vfn++) {
+        if (NULL != radix_lookup(&map->vmm_locked, vfn)) {
+            continue;
+        }
+        vmarea_t *vma = vmmap_lookup(map, vfn);
+        if (NULL == vma) {
+            /*unmapped by another thread since it was checked*/
+            return -ENOMEM;
+        }
+
+        pframe_t *pf;
+        int forwrite = (vma->vma_prot & PROT_WRITE) && (vma->vma_flags & MAP_PRIVATE);
+        if (0 > (err = vmmap_pin_pages(map, vfn, 1, &pf, forwrite))) {
+            return err;
+        }
+        /*finding it may have blocked, while another thread locked it*/
+        if (NULL != radix_lookup(&map->vmm_locked, vfn)) {
+            vmmap_unpin_pages(&pf, 1);
+            continue;
+        }
+        if (0 > (err = radix_insert(&map->vmm_locked, vfn, pf))) {
+            vmmap_unpin_pages(&pf, 1);
+            return err;
+        }
+        map->vmm_nlocked++;
+    }
+
+    return 0;
+}
+
+/*
+ * Unlocks the locked pages of map in [lopage, lopage + npages), for
+ * munlock(2), and before the range is unmapped.
+ */
+void
+vmmap_unlock(vmmap_t *map, uint32_t lopage, uint32_t npages)
+{
+    uint32_t vfn = lopage;
+    pframe_t *pf;
+
+    while (NULL != (pf = (pframe_t *)radix_next(&map->vmm_locked, &vfn))
+           && vfn - lopage < npages) {
+        radix_remove(&map->vmm_locked, vfn);
+        map->vmm_nlocked--;
+        vmmap_unpin_pages(&pf, 1);
+        vfn++;
+    }
+}
+
 /* a debugging routine: dumps the mappings of the given address space. */
 size_t
 vmmap_mapping_info(const void *vmmap, char *buf, size_t osize)
@@ -745,9 +1664,12 @@ vmmap_mapping_info(const void *vmmap, char *buf, size_t osize)
         vmarea_t *vma;
         ssize_t size = (ssize_t)osize;
 
-        int len = snprintf(buf, size, "%21s %5s %7s %8s %10s %12s\n",
+        /* then the area's faults by kind (see vm/pagefault.h), and by
+         * depth in the shadow chain */
+        int len = snprintf(buf, size, "%21s %5s %7s %8s %10s %12s %6s %6s %6s %6s %s\n",
                            "VADDR RANGE", "PROT", "FLAGS", "MMOBJ", "OFFSET",
-                           "VFN RANGE");
+                           "VFN RANGE", "ZERO", "MINOR", "MAJOR", "COW",
+                           "DEPTH 0/1/2/3+");
 
         list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink) {
                 size -= len;
@@ -757,14 +1679,19 @@ vmmap_mapping_info(const void *vmmap, char *buf, size_t osize)
                 }
 
                 len = snprintf(buf, size,
-                               "%#.8x-%#.8x  %c%c%c  %7s 0x%p %#.5x %#.5x-%#.5x\n",
+                               "%#.8x-%#.8x  %c%c%c  %7s 0x%p %#.5x %#.5x-%#.5x"
+                               " %6u %6u %6u %6u %u/%u/%u/%u\n",
                                vma->vma_start << PAGE_SHIFT,
                                vma->vma_end << PAGE_SHIFT,
                                (vma->vma_prot & PROT_READ ? 'r' : '-'),
                                (vma->vma_prot & PROT_WRITE ? 'w' : '-'),
                                (vma->vma_prot & PROT_EXEC ? 'x' : '-'),
                                (vma->vma_flags & MAP_SHARED ? " SHARED" : "PRIVATE"),
-                               vma->vma_obj, vma->vma_off, vma->vma_start, vma->vma_end);
+                               vma->vma_obj, vma->vma_off, vma->vma_start, vma->vma_end,
+                               vma->vma_faults[FAULT_ZERO], vma->vma_faults[FAULT_MINOR],
+                               vma->vma_faults[FAULT_MAJOR], vma->vma_faults[FAULT_COW],
+                               vma->vma_fault_depths[0], vma->vma_fault_depths[1],
+                               vma->vma_fault_depths[2], vma->vma_fault_depths[3]);
         } list_iterate_end();
 
 end:
@@ -0,0 +1,288 @@
+#include "kernel.h"
+#include "types.h"
+#include "config.h"
+#include "errno.h"
+
+#include "util/counter.h"
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/lz4.h"
+#include "util/string.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+
+#include "vm/zram.h"
+
+/*
+ * Compressed pages are kept in zspages: runs of up to ZSPAGE_MAX_PAGES
+ * pages, which need not be next to each other, cut into chunks all of one
+ * size class. Classes go up in steps of ZRAM_CLASS_STEP bytes, and each
+ * class takes as many pages to a zspage as wastes least at the end, so a
+ * chunk may straddle two of its pages. A page which does not compress to
+ * ZRAM_MAX_LEN is not worth keeping, since it would save little.
+ *
+ * The free chunks of a zspage are a list threaded through the chunks
+ * themselves, by number. Each class keeps a list of its zspages which
+ * have free chunks, and a zspage goes back to the page allocator as soon
+ * as it is empty.
+ */
+
+#define ZRAM_CLASS_SHIFT        5
+#define ZRAM_CLASS_STEP         (1 << ZRAM_CLASS_SHIFT)
+#define ZRAM_MAX_LEN            (PAGE_SIZE * 3 / 4)
+#define ZRAM_NCLASSES           (ZRAM_MAX_LEN >> ZRAM_CLASS_SHIFT)
+#define ZSPAGE_MAX_PAGES        4
+
+#define ZRAM_CLASS(len)         (((len) + ZRAM_CLASS_STEP - 1) >> ZRAM_CLASS_SHIFT)
+
+#define ZS_NONE                 0xffff  /* the end of a free list */
+
+typedef struct zspage {
+        char           *zs_pages[ZSPAGE_MAX_PAGES];
+        uint16_t        zs_class;
+        uint16_t        zs_inuse;       /* chunks in use */
+        uint16_t        zs_free;        /* first free chunk, or ZS_NONE */
+        list_link_t     zs_link;        /* on its class's zc_partial */
+} zspage_t;
+
+typedef struct zclass {
+        uint16_t        zc_size;        /* of each chunk */
+        uint16_t        zc_npages;      /* to a zspage */
+        uint16_t        zc_nchunks;     /* to a zspage */
+        list_t          zc_partial;     /* zspages with free chunks */
+} zclass_t;
+
+/* Where what is in a slot is; zt_zspage is NULL for an empty slot */
+typedef struct zslot {
+        zspage_t       *zt_zspage;
+        uint16_t        zt_chunk;
+        uint16_t        zt_len;         /* compressed */
+} zslot_t;
+
+/* Index 0 is unused, so a class is its size in steps */
+static zclass_t zram_classes[ZRAM_NCLASSES + 1];
+static zslot_t *zram_slots;
+static uint32_t zram_nslots;
+static uint32_t zram_npages;    /* taken up by zspages */
+
+/* Where pages are compressed to, and chunks which straddle pages are put
+ * together to be decompressed. Nothing here blocks, so one will do. */
+static char zram_buf[ZRAM_MAX_LEN];
+
+static counter_t zram_nstores;
+static counter_t zram_nloads;
+static counter_t zram_nrejected;        /* did not compress well enough */
+static counter_t zram_nfull;            /* no room for them */
+
+int
+zram_init(uint32_t nslots)
+{
+        uint32_t c, k, best, waste, bestwaste;
+        zclass_t *zc;
+
+        if (NULL == (zram_slots = (zslot_t *)kmalloc(nslots * sizeof(zslot_t))))
+                return -ENOMEM;
+        memset(zram_slots, 0, nslots * sizeof(zslot_t));
+        zram_nslots = nslots;
+        zram_npages = 0;
+
+        for (c = 1; c <= ZRAM_NCLASSES; c++) {
+                zc = &zram_classes[c];
+                zc->zc_size = c << ZRAM_CLASS_SHIFT;
+                best = 1;
+                bestwaste = PAGE_SIZE;
+                for (k = 1; k <= ZSPAGE_MAX_PAGES; k++) {
+                        /* as a share of the zspage, in 1024ths */
+                        waste = (k * PAGE_SIZE % zc->zc_size) * 1024 / (k * PAGE_SIZE);
+                        if (waste < bestwaste) {
+                                best = k;
+                                bestwaste = waste;
+                        }
+                }
+                zc->zc_npages = best;
+                zc->zc_nchunks = best * PAGE_SIZE / zc->zc_size;
+                list_init(&zc->zc_partial);
+        }
+
+        counter_register(&zram_nstores, "zram.stores");
+        counter_register(&zram_nloads, "zram.loads");
+        counter_register(&zram_nrejected, "zram.rejected");
+        counter_register(&zram_nfull, "zram.full");
+        return 0;
+}
+
+/* Copies len bytes between buf and the zspage, from off bytes into it */
+static void
+zspage_copy(zspage_t *zs, size_t off, char *buf, size_t len, int tozs)
+{
+        while (len > 0) {
+                char *p = zs->zs_pages[off / PAGE_SIZE] + off % PAGE_SIZE;
+                size_t n = MIN(len, PAGE_SIZE - off % PAGE_SIZE);
+
+                if (tozs)
+                        memcpy(p, buf, n);
+                else
+                        memcpy(buf, p, n);
+                off += n;
+                buf += n;
+                len -= n;
+        }
+}
+
+/* The next free chunk after chunk, which is free, is in its first bytes,
+ * which never straddle pages since chunks start at multiples of the step */
+static uint16_t *
+zspage_link(zspage_t *zs, uint16_t chunk)
+{
+        size_t off = (size_t)chunk * zram_classes[zs->zs_class].zc_size;
+        return (uint16_t *)(zs->zs_pages[off / PAGE_SIZE] + off % PAGE_SIZE);
+}
+
+/* Makes an empty zspage of class c, unless that would take more than
+ * ZRAM_PAGES pages, or there are none */
+static zspage_t *
+zspage_create(uint32_t c)
+{
+        zclass_t *zc = &zram_classes[c];
+        zspage_t *zs;
+        uint16_t i;
+
+        if (zram_npages + zc->zc_npages > ZRAM_PAGES)
+                return NULL;
+        if (NULL == (zs = (zspage_t *)kmalloc(sizeof(zspage_t))))
+                return NULL;
+        for (i = 0; i < zc->zc_npages; i++) {
+                if (NULL == (zs->zs_pages[i] = page_alloc())) {
+                        while (i-- > 0)
+                                page_free(zs->zs_pages[i]);
+                        kfree(zs);
+                        return NULL;
+                }
+        }
+        zram_npages += zc->zc_npages;
+
+        zs->zs_class = c;
+        zs->zs_inuse = 0;
+        zs->zs_free = 0;
+        for (i = 0; i < zc->zc_nchunks; i++)
+                *zspage_link(zs, i) = (i + 1 < zc->zc_nchunks) ? i + 1 : ZS_NONE;
+        list_link_init(&zs->zs_link);
+        list_insert_head(&zc->zc_partial, &zs->zs_link);
+        return zs;
+}
+
+static void
+zspage_destroy(zspage_t *zs)
+{
+        zclass_t *zc = &zram_classes[zs->zs_class];
+        uint16_t i;
+
+        KASSERT(0 == zs->zs_inuse);
+        list_remove(&zs->zs_link);
+        for (i = 0; i < zc->zc_npages; i++)
+                page_free(zs->zs_pages[i]);
+        zram_npages -= zc->zc_npages;
+        kfree(zs);
+}
+
+/* Takes a chunk big enough for len bytes, or returns -ENOSPC */
+static int
+zram_chunk_alloc(size_t len, zspage_t **zsp, uint16_t *chunk)
+{
+        uint32_t c = ZRAM_CLASS(len);
+        zclass_t *zc = &zram_classes[c];
+        zspage_t *zs;
+
+        KASSERT(0 < c && c <= ZRAM_NCLASSES);
+        if (list_empty(&zc->zc_partial)) {
+                if (NULL == (zs = zspage_create(c)))
+                        return -ENOSPC;
+        } else {
+                zs = list_head(&zc->zc_partial, zspage_t, zs_link);
+        }
+
+        KASSERT(ZS_NONE != zs->zs_free);
+        *chunk = zs->zs_free;
+        zs->zs_free = *zspage_link(zs, *chunk);
+        if (++zs->zs_inuse == zc->zc_nchunks)
+                list_remove(&zs->zs_link);
+        *zsp = zs;
+        return 0;
+}
+
+static void
+zram_chunk_free(zspage_t *zs, uint16_t chunk)
+{
+        zclass_t *zc = &zram_classes[zs->zs_class];
+
+        if (zs->zs_inuse == zc->zc_nchunks)
+                list_insert_head(&zc->zc_partial, &zs->zs_link);
+        *zspage_link(zs, chunk) = zs->zs_free;
+        zs->zs_free = chunk;
+        if (0 == --zs->zs_inuse)
+                zspage_destroy(zs);
+}
+
+void
+zram_discard(uint32_t slot)
+{
+        zslot_t *zt;
+
+        KASSERT(slot < zram_nslots);
+        zt = &zram_slots[slot];
+        if (NULL != zt->zt_zspage) {
+                zram_chunk_free(zt->zt_zspage, zt->zt_chunk);
+                zt->zt_zspage = NULL;
+        }
+}
+
+int
+zram_write(uint32_t slot, const void *page)
+{
+        zslot_t *zt;
+        size_t len, off;
+        int err;
+
+        zram_discard(slot);
+        zt = &zram_slots[slot];
+
+        if (0 == (len = lz4_compress(page, PAGE_SIZE, zram_buf, ZRAM_MAX_LEN))) {
+                counter_inc(&zram_nrejected);
+                return -ENOSPC;
+        }
+        if (0 > (err = zram_chunk_alloc(len, &zt->zt_zspage, &zt->zt_chunk))) {
+                counter_inc(&zram_nfull);
+                return err;
+        }
+        zt->zt_len = len;
+        off = (size_t)zt->zt_chunk * zram_classes[zt->zt_zspage->zs_class].zc_size;
+        zspage_copy(zt->zt_zspage, off, zram_buf, len, 1);
+        counter_inc(&zram_nstores);
+        return 0;
+}
+
+int
+zram_read(uint32_t slot, void *page)
+{
+        zslot_t *zt;
+        size_t off;
+        const char *src;
+
+        KASSERT(slot < zram_nslots);
+        zt = &zram_slots[slot];
+        if (NULL == zt->zt_zspage)
+                return -EIO;
+
+        off = (size_t)zt->zt_chunk * zram_classes[zt->zt_zspage->zs_class].zc_size;
+        if (off / PAGE_SIZE == (off + zt->zt_len - 1) / PAGE_SIZE) {
+                src = zt->zt_zspage->zs_pages[off / PAGE_SIZE] + off % PAGE_SIZE;
+        } else {
+                zspage_copy(zt->zt_zspage, off, zram_buf, zt->zt_len, 0);
+                src = zram_buf;
+        }
+        if (PAGE_SIZE != lz4_decompress(src, zt->zt_len, page, PAGE_SIZE))
+                panic("zram: slot %u does not decompress\n", slot);
+        counter_inc(&zram_nloads);
+        return 0;
+}
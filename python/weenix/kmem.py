@@ -21,11 +21,17 @@ class Slab:
 		else:
 			self._value = val.cast(_slab_type)
 
+	def bufctl(self, i, obj):
+		# large objects keep their bufctls apart, see mm/slab.c
+		if (self._value["s_bufctl"] != 0):
+			return self._value["s_bufctl"] + i
+		return (obj.cast(_uintptr_type)
+				+ self._alloc["sa_objsize"]).cast(_bufctl_type.pointer())
+
 	def objs(self, typ=None):
-		next = self._value["s_addr"]
+		next = self._value["s_objs"]
 		for i in xrange(self._alloc["sa_slab_nobjs"]):
-			bufctl = (next.cast(_uintptr_type)
-					  + self._alloc["sa_objsize"]).cast(_bufctl_type.pointer())
+			bufctl = self.bufctl(i, next)
 			if (bufctl.dereference()["u"]["sb_slab"] == self._value.address):
 				# if redzones are in effect we need to skip them
 				if (int(next.cast(_uint32_type.pointer()).dereference()) == 0xdeadbeef):
@@ -39,8 +45,7 @@ class Slab:
 					yield value
 					
 			next = (next.cast(_uintptr_type)
-					+ self._alloc["sa_objsize"]
-					+ _bufctl_type.sizeof).cast(_void_type.pointer())
+					+ self._alloc["sa_bufsize"]).cast(_void_type.pointer())
 
 class SlabAllocator:
 
@@ -57,10 +62,9 @@ class SlabAllocator:
 		return int(self._value["sa_objsize"])
 
 	def slabs(self):
-		next = self._value["sa_slabs"]
-		while (next != 0):
-			yield Slab(self._value, next.dereference())
-			next = next.dereference()["s_next"]
+		for name in ["sa_full", "sa_partial", "sa_empty"]:
+			for link in weenix.list.load(self._value[name], "struct slab", "s_link"):
+				yield Slab(self._value, link.item())
 
 	def objs(self, typ=None):
 		for slab in self.slabs():
@@ -92,12 +96,14 @@ def pagesize():
 def freepages():
 	freepages = dict()
 	for pagegroup in weenix.list.load("pagegroup_list", "struct pagegroup", "pg_link"):
-		freelist = pagegroup.item()["pg_freelist"]
-		for order in xrange(freelist.type.sizeof / freelist.type.target().sizeof):
-			psize = (1 << order) * PAGE_SIZE
-			count = len(weenix.list.load(freelist[order]))
-			if (order in freepages):
-				freepages[order] += count
-			else:
-				freepages[order] = count
+		freelists = pagegroup.item()["pg_freelist"]
+		for kind in xrange(freelists.type.sizeof / freelists.type.target().sizeof):
+			freelist = freelists[kind]
+			for order in xrange(freelist.type.sizeof / freelist.type.target().sizeof):
+				psize = (1 << order) * PAGE_SIZE
+				count = len(weenix.list.load(freelist[order]))
+				if (order in freepages):
+					freepages[order] += count
+				else:
+					freepages[order] = count
 	return freepages
@@ -0,0 +1,159 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+"""
+Runs /usr/bin/bench in a headless QEMU and compares the results with a
+baseline, for catching performance regressions from one commit to the
+next. Build first ("make"); this boots kernel/weenix.iso with a copy of
+user/disk0.img.
+
+The copy gets a /bench.auto listing the benchmarks to run, which makes
+init run bench with its output in /bench.out, and then exit instead of
+starting shells, so the kernel halts. Once "halted cleanly" comes out of
+the serial port, /bench.out is read back off the disk with fsmaker.
+
+Results are kept as JSON, {"name": [value, "unit"], ...}. A result in ns
+is worse when it is larger, one in KB/s when it is smaller; anything
+worse than the baseline by more than the threshold is a regression, and
+makes the exit status 1.
+
+    tools/benchrun.py --save baseline.json
+    tools/benchrun.py --baseline baseline.json --threshold 15
+"""
+
+from __future__ import print_function
+
+import argparse
+import json
+import os
+import os.path
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+ISO = os.path.join(ROOT, "kernel", "weenix.iso")
+DISK = os.path.join(ROOT, "user", "disk0.img")
+FSMAKER = os.path.join(ROOT, "tools", "fsmaker", "sh.py")
+HALTED = "halted cleanly"
+
+# how a larger value compares, by unit
+HIGHER_IS_WORSE = { "ns": True, "KB/s": False }
+
+
+def fsmaker(image, *commands):
+    args = [ os.environ.get("PYTHON", "python"), FSMAKER, image ]
+    for c in commands:
+        args += [ "-e", c ]
+    subprocess.check_call(args, stdout=open(os.devnull, "w"))
+
+
+def boot(image, timeout, memory, log):
+    qemu = os.environ.get("QEMU", "qemu-system-i386")
+    args = [ qemu, "-m", str(memory), "-display", "none", "-no-reboot",
+             "-boot", "order=dca", "-cdrom", ISO, "-hda", image,
+             "-serial", "file:" + log ]
+    proc = subprocess.Popen(args)
+    deadline = time.time() + timeout
+    try:
+        while time.time() < deadline:
+            if proc.poll() is not None:
+                break
+            with open(log, "r") as f:
+                if HALTED in f.read():
+                    return True
+            time.sleep(1)
+        return False
+    finally:
+        if proc.poll() is None:
+            proc.kill()
+            proc.wait()
+
+
+def parse(text):
+    results = dict()
+    for line in text.splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[2] in HIGHER_IS_WORSE:
+            try:
+                results[fields[0]] = [ int(fields[1]), fields[2] ]
+            except ValueError:
+                pass
+        elif len(fields) > 1 and fields[1] == "failed":
+            print("warning: {0}".format(line), file=sys.stderr)
+    return results
+
+
+def compare(results, baseline, threshold):
+    regressions = 0
+    for name in sorted(results):
+        value, unit = results[name]
+        if name not in baseline or baseline[name][1] != unit or baseline[name][0] <= 0:
+            print("{0:<16} {1:>12} {2:<5} (no baseline)".format(name, value, unit))
+            continue
+        base = baseline[name][0]
+        change = 100.0 * (value - base) / base
+        worse = change if HIGHER_IS_WORSE[unit] else -change
+        flag = ""
+        if worse > threshold:
+            flag = "REGRESSION"
+            regressions += 1
+        print("{0:<16} {1:>12} {2:<5} {3:>+7.1f}% {4}".format(name, value, unit, change, flag))
+    for name in sorted(set(baseline) - set(results)):
+        print("{0:<16} missing".format(name))
+        regressions += 1
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Run the in-guest benchmarks and check them against a baseline.")
+    parser.add_argument("names", nargs="*", help="benchmarks to run, all by default (see bench -l)")
+    parser.add_argument("--baseline", help="JSON results to compare with")
+    parser.add_argument("--threshold", type=float, default=10.0, help="percent worse that counts as a regression (default 10)")
+    parser.add_argument("--save", help="where to write these results as JSON")
+    parser.add_argument("--timeout", type=int, default=1800, help="seconds to wait for the run (default 1800)")
+    parser.add_argument("--memory", type=int, default=32, help="megabytes for the guest (default 32)")
+    args = parser.parse_args()
+
+    for f in [ ISO, DISK ]:
+        if not os.path.exists(f):
+            parser.error("{0} is missing, run make first".format(f))
+
+    tmp = tempfile.mkdtemp(prefix="benchrun")
+    try:
+        image = os.path.join(tmp, "disk0.img")
+        names = os.path.join(tmp, "bench.auto")
+        out = os.path.join(tmp, "bench.out")
+        log = os.path.join(tmp, "serial.log")
+
+        shutil.copyfile(DISK, image)
+        with open(names, "w") as f:
+            f.write(" ".join(args.names) + "\n")
+        fsmaker(image, "getfile {0} /bench.auto".format(names))
+
+        if not boot(image, args.timeout, args.memory, log):
+            sys.stderr.write(open(log).read())
+            print("error: the guest did not halt within {0}s".format(args.timeout), file=sys.stderr)
+            return 2
+        fsmaker(image, "putfile /bench.out {0}".format(out))
+        results = parse(open(out).read())
+    finally:
+        shutil.rmtree(tmp)
+
+    if len(results) == 0:
+        print("error: no results", file=sys.stderr)
+        return 2
+    if args.save:
+        with open(args.save, "w") as f:
+            json.dump(results, f, indent=1, sort_keys=True)
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        return 1 if compare(results, baseline, args.threshold) else 0
+    for name in sorted(results):
+        print("{0:<16} {1:>12} {2}".format(name, results[name][0], results[name][1]))
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,170 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+"""
+Decodes block I/O traces read from /dev/blktrace (see
+kernel/include/drivers/blktrace.h), and sums up what they show: how far
+the disk had to seek between transfers, how many requests the elevator
+merged into each, and how long requests waited to be dispatched and to
+complete.
+
+In weenix, turn tracing on, run whatever is of interest, and save the
+ring:
+
+    echo 1 > /dev/blktrace
+    ...
+    cat /dev/blktrace > /blktrace.out
+
+Then, once it has halted, read the file back off the disk and decode it:
+
+    python tools/fsmaker/sh.py user/disk0.img -e "putfile /blktrace.out blktrace.out"
+    tools/blkparse.py blktrace.out
+    tools/blkparse.py --summary blktrace.out
+
+The ring keeps only the newest records; if it wrapped before it was read
+the older ones show up as lost.
+"""
+
+from __future__ import print_function
+
+import argparse
+import collections
+import struct
+import sys
+
+# struct blktrace_rec
+REC = struct.Struct("<QIIHHhBBiI")
+
+# BLKTRACE_ actions
+LOST, QUEUE, DISPATCH, ISSUE, COMPLETE = range(5)
+ACTIONS = { LOST: "lost", QUEUE: "Q", DISPATCH: "D", ISSUE: "I", COMPLETE: "C" }
+
+# seek distances, in blocks, which the summary counts separately
+SEEK_BUCKETS = [ 0, 8, 64, 512, 4096 ]
+
+Rec = collections.namedtuple("Rec", "ns seq block count dev pid action write status depth")
+
+
+def records(f):
+    while True:
+        data = f.read(REC.size)
+        if len(data) < REC.size:
+            return
+        yield Rec(*REC.unpack(data))
+
+
+def devname(dev):
+    return "{0},{1}".format(dev >> 8, dev & 0xff)
+
+
+def show(rec, start):
+    if LOST == rec.action:
+        print("{0:>8} lost".format(rec.seq))
+        return
+    print("{0:>8} {1:>14.3f} {2:>5} {3:>6} {4} {5} {6:>9}+{7:<3} depth {8}{9}".format(
+        rec.seq, (rec.ns - start) / 1000.0, devname(rec.dev), rec.pid,
+        ACTIONS.get(rec.action, "?"), "W" if rec.write else "R",
+        rec.block, rec.count, rec.depth,
+        " status {0}".format(rec.status) if COMPLETE == rec.action and rec.status else ""))
+
+
+SEEK_NAMES = [ "<= {0}".format(limit) for limit in SEEK_BUCKETS ] \
+             + [ "> {0}".format(SEEK_BUCKETS[-1]) ]
+
+
+def bucket(distance):
+    for i, limit in enumerate(SEEK_BUCKETS):
+        if distance <= limit:
+            return SEEK_NAMES[i]
+    return SEEK_NAMES[-1]
+
+
+def summarize(recs):
+    actions = collections.Counter()
+    merges = collections.Counter()
+    seeks = collections.Counter()
+    backward = 0
+    head = dict()                       # the block after a device's last issue
+    queued = collections.defaultdict(collections.deque)
+    q2d, q2c = [], []
+    by_pid = collections.defaultdict(lambda: [ 0, 0 ])
+
+    for r in recs:
+        actions[r.action] += 1
+        key = (r.dev, r.block, r.write)
+        if QUEUE == r.action:
+            queued[key].append([ r.ns, None ])
+            by_pid[r.pid][r.write] += 1
+        elif DISPATCH == r.action:
+            merges[r.count] += 1
+            for b in range(r.block, r.block + r.count):
+                for q in queued.get((r.dev, b, r.write), ()):
+                    if q[1] is None:
+                        q[1] = r.ns
+                        q2d.append(r.ns - q[0])
+                        break
+        elif ISSUE == r.action:
+            if r.dev in head:
+                distance = r.block - head[r.dev]
+                if distance < 0:
+                    backward += 1
+                seeks[bucket(abs(distance))] += 1
+            head[r.dev] = r.block + r.count
+        elif COMPLETE == r.action:
+            if queued.get(key):
+                q2c.append(r.ns - queued[key].popleft()[0])
+
+    print("records: " + ", ".join("{0} {1}".format(actions[a], ACTIONS[a])
+                                  for a in sorted(ACTIONS)))
+
+    ndispatch = sum(merges.values())
+    if ndispatch:
+        nreqs = sum(n * c for n, c in merges.items())
+        print("dispatches: {0}, {1:.2f} requests each".format(ndispatch, float(nreqs) / ndispatch))
+        for n in sorted(merges):
+            print("  {0:>3} requests: {1}".format(n, merges[n]))
+
+    nseeks = sum(seeks.values())
+    if nseeks:
+        print("seeks between issues: {0}, {1} backwards".format(nseeks, backward))
+        for name in SEEK_NAMES:
+            if seeks[name]:
+                print("  {0:>8} blocks: {1} ({2:.1f}%)".format(
+                    name, seeks[name], 100.0 * seeks[name] / nseeks))
+
+    for name, waits in (("queue to dispatch", q2d), ("queue to complete", q2c)):
+        if waits:
+            waits.sort()
+            print("{0}: {1} requests, mean {2:.1f}us, median {3:.1f}us, max {4:.1f}us".format(
+                name, len(waits), sum(waits) / 1000.0 / len(waits),
+                waits[len(waits) // 2] / 1000.0, waits[-1] / 1000.0))
+
+    if by_pid:
+        print("requests by process:")
+        for pid in sorted(by_pid):
+            print("  {0:>6}: {1} reads, {2} writes".format(pid, by_pid[pid][0], by_pid[pid][1]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode a weenix block I/O trace.")
+    parser.add_argument("trace", help="a file of records read from /dev/blktrace")
+    parser.add_argument("--summary", action="store_true",
+                        help="only show the summary, not each record")
+    args = parser.parse_args()
+
+    with open(args.trace, "rb") as f:
+        recs = list(records(f))
+    if len(recs) == 0:
+        print("error: no records in {0}".format(args.trace), file=sys.stderr)
+        return 1
+
+    if not args.summary:
+        start = min([ r.ns for r in recs if LOST != r.action ] or [ 0 ])
+        for r in recs:
+            show(r, start)
+        print()
+    summarize(recs)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
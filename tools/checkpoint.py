@@ -0,0 +1,189 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+"""
+Saves a booted Weenix, with init and its shells already running, and
+starts later guests from it instead of booting, for running tests
+without waiting out the boot each time. Build first ("make").
+
+"save" boots kernel/weenix.iso in a headless QEMU with a qcow2 copy of
+user/disk0.img, waits until the shell on the serial terminal gives its
+prompt, and has QEMU save the whole machine (memory, devices and the
+disk) as a snapshot in that qcow2 file. "resume" starts QEMU from the
+snapshot in a copy of the file, so the checkpoint itself is never
+changed and any number of guests can run from it at once; the serial
+terminal is on stdio, at the prompt.
+
+The guest does nothing to help: the snapshot is QEMU's, and the kernel
+goes on from where it was stopped. So a resumed guest runs the kernel
+and disk which were saved, not what was built since; resume refuses a
+checkpoint made from a different weenix.iso.
+
+    tools/checkpoint.py save
+    tools/checkpoint.py resume < tests.sh
+"""
+
+from __future__ import print_function
+
+import argparse
+import hashlib
+import json
+import os
+import os.path
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+ISO = os.path.join(ROOT, "kernel", "weenix.iso")
+DISK = os.path.join(ROOT, "user", "disk0.img")
+CHECKPOINT = os.path.join(ROOT, "checkpoint.qcow2")
+SNAPSHOT = "ready"
+PROMPT = "weenix -> "
+
+
+def qemu():
+    return os.environ.get("QEMU", "qemu-system-i386")
+
+
+def qemu_img():
+    return os.environ.get("QEMU_IMG", "qemu-img")
+
+
+def machine(image, memory):
+    # resume has to give QEMU the same machine that was saved
+    return [ qemu(), "-m", str(memory), "-display", "none", "-no-reboot",
+             "-boot", "order=dca", "-cdrom", ISO,
+             "-drive", "file={0},format=qcow2,if=ide,index=0".format(image) ]
+
+
+def iso_digest():
+    h = hashlib.sha1()
+    with open(ISO, "rb") as f:
+        for block in iter(lambda: f.read(1 << 16), b""):
+            h.update(block)
+    return h.hexdigest()
+
+
+def monitor(path, *commands):
+    """Runs commands at the QEMU monitor, each once the one before is done"""
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.connect(path)
+    try:
+        out = b""
+        for c in (None,) + commands:
+            if c is not None:
+                s.sendall((c + "\n").encode())
+            # the banner, then each command, end with a prompt
+            while not out.endswith(b"(qemu) "):
+                got = s.recv(4096)
+                if not got:
+                    return out.decode("ascii", "replace")
+                out += got
+            if c is not None and b"Error" in out:
+                raise RuntimeError("{0}: {1}".format(c, out.decode("ascii", "replace")))
+            out = b""
+        return ""
+    finally:
+        s.close()
+
+
+def wait_ready(proc, log, timeout, settle):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if proc.poll() is not None:
+            return False
+        with open(log, "r") as f:
+            if PROMPT in f.read():
+                # give the other terminals' shells time to get there too
+                time.sleep(settle)
+                return proc.poll() is None
+        time.sleep(0.2)
+    return False
+
+
+def save(args):
+    for f in [ ISO, DISK ]:
+        if not os.path.exists(f):
+            print("error: {0} is missing, run make first".format(f), file=sys.stderr)
+            return 2
+
+    tmp = tempfile.mkdtemp(prefix="checkpoint")
+    try:
+        image = os.path.join(tmp, "disk0.qcow2")
+        log = os.path.join(tmp, "serial.log")
+        sock = os.path.join(tmp, "monitor.sock")
+
+        subprocess.check_call([ qemu_img(), "convert", "-O", "qcow2", DISK, image ])
+        proc = subprocess.Popen(machine(image, args.memory)
+                                + [ "-serial", "file:" + log,
+                                    "-monitor", "unix:{0},server,nowait".format(sock) ])
+        try:
+            if not wait_ready(proc, log, args.timeout, args.settle):
+                sys.stderr.write(open(log).read())
+                print("error: no shell prompt within {0}s".format(args.timeout), file=sys.stderr)
+                return 2
+            monitor(sock, "stop", "savevm " + SNAPSHOT, "quit")
+            proc.wait()
+        finally:
+            if proc.poll() is None:
+                proc.kill()
+                proc.wait()
+
+        shutil.move(image, args.checkpoint)
+        with open(args.checkpoint + ".json", "w") as f:
+            json.dump({ "iso": iso_digest(), "memory": args.memory }, f, indent=1, sort_keys=True)
+    finally:
+        shutil.rmtree(tmp)
+    print("saved {0}".format(args.checkpoint))
+    return 0
+
+
+def resume(args):
+    try:
+        with open(args.checkpoint + ".json") as f:
+            info = json.load(f)
+    except (IOError, ValueError):
+        print("error: no checkpoint at {0}, run save first".format(args.checkpoint), file=sys.stderr)
+        return 2
+    if info["iso"] != iso_digest():
+        print("error: {0} was saved from another weenix.iso, save it again".format(args.checkpoint),
+              file=sys.stderr)
+        return 2
+
+    tmp = tempfile.mkdtemp(prefix="checkpoint")
+    try:
+        image = os.path.join(tmp, "disk0.qcow2")
+        shutil.copyfile(args.checkpoint, image)
+        return subprocess.call(machine(image, info["memory"])
+                               + [ "-loadvm", SNAPSHOT, "-serial", "stdio" ] + args.qemu_args)
+    finally:
+        shutil.rmtree(tmp)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Save a booted guest, and start guests from it.")
+    parser.add_argument("--checkpoint", default=CHECKPOINT,
+                        help="the qcow2 file to save to or resume from (default checkpoint.qcow2)")
+    sub = parser.add_subparsers(dest="command")
+
+    p = sub.add_parser("save", help="boot, and save once the shells are up")
+    p.add_argument("--timeout", type=int, default=300, help="seconds to wait for the prompt (default 300)")
+    p.add_argument("--settle", type=float, default=1.0,
+                   help="seconds to wait after the prompt before saving (default 1)")
+    p.add_argument("--memory", type=int, default=32, help="megabytes for the guest (default 32)")
+    p.set_defaults(func=save)
+
+    p = sub.add_parser("resume", help="start a guest from the checkpoint")
+    p.add_argument("qemu_args", nargs=argparse.REMAINDER, help="more arguments for QEMU")
+    p.set_defaults(func=resume)
+
+    args = parser.parse_args()
+    if args.command is None:
+        parser.error("save or resume?")
+    return args.func(args)
+
+if __name__ == "__main__":
+    sys.exit(main())
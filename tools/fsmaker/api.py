@@ -3,26 +3,39 @@ import math
 import struct
 
 S5_MAGIC = 0x727f
-S5_CURRENT_VERSION = 3
+S5_CURRENT_VERSION = 9
 S5_BLOCK_SIZE = 4096
 
 S5_NBLKS_PER_FNODE = 30
-S5_NDIRECT_BLOCKS = 28
-S5_MAX_FILE_BLOCKS = S5_NDIRECT_BLOCKS + math.floor(S5_BLOCK_SIZE / 4)
+S5_NDIRECT_BLOCKS = 27
+S5_NIDIRECT_BLOCKS = S5_BLOCK_SIZE / 4
+# the kernel's file offsets are 32-bit signed
+S5_MAX_FILE_BLOCKS = 0x7fffffff / S5_BLOCK_SIZE
 S5_MAX_FILE_SIZE = S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE
 
+# blocks format() reserves for the kernel's metadata journal
+S5_JOURNAL_BLOCKS = 64
+
 S5_NAME_LEN = 28
 S5_DIRENT_SIZE = S5_NAME_LEN + 4
 
-S5_INODE_SIZE = 16 + S5_NDIRECT_BLOCKS * 4
+S5_INODE_SIZE = 20 + S5_NDIRECT_BLOCKS * 4
+# regular files this small are kept in the direct block numbers
+S5_INLINE_SIZE = S5_NDIRECT_BLOCKS * 4
 S5_INODES_PER_BLOCK = S5_BLOCK_SIZE / S5_INODE_SIZE
+# the inode bitmap after the inode blocks has a bit for each inode
+S5_IMAP_BITS = S5_BLOCK_SIZE * 8
+# and the block reference counts after it a byte for each block, the
+# number of files sharing it beyond the first
+S5_REFS_PER_BLOCK = S5_BLOCK_SIZE
 
 S5_TYPE_FREE = 0x0
 S5_TYPE_DATA = 0x1
 S5_TYPE_DIR = 0x2
 S5_TYPE_CHR = 0x4
 S5_TYPE_BLK = 0x8
-S5_TYPES = set([ S5_TYPE_FREE, S5_TYPE_DATA, S5_TYPE_DIR, S5_TYPE_CHR, S5_TYPE_BLK ])
+S5_TYPE_SOCK = 0x10
+S5_TYPES = set([ S5_TYPE_FREE, S5_TYPE_DATA, S5_TYPE_DIR, S5_TYPE_CHR, S5_TYPE_BLK, S5_TYPE_SOCK ])
 
 class S5fsException(Exception):
 
@@ -68,6 +81,12 @@ class Block:
             self._simdisk._simfile.write('\0')
 
     def free(self):
+        refs = self._simdisk.get_block_refs(self._blockno)
+        if (refs > 0):
+            # another file still has it
+            self._simdisk.set_block_refs(self._blockno, refs - 1)
+            return
+        self._simdisk.set_free_count(self._simdisk.get_free_count() + 1)
         if (self._simdisk.get_nfree() < S5_NBLKS_PER_FNODE - 1):
             self._simdisk.set_free_block(self._simdisk.get_nfree(), self._blockno)
             self._simdisk.set_nfree(self._simdisk.get_nfree() + 1)
@@ -97,12 +116,6 @@ class Inode:
         self._number = number
         self._offset = offset
 
-    def get_next_free(self):
-        return self.get_size()
-
-    def set_next_free(self, val):
-        return self.set_size(val)
-
     def get_size(self):
         self._simfile.seek(int(self._offset))
         return struct.unpack("I", self._simfile.read(4))[0]
@@ -157,6 +170,93 @@ class Inode:
         self._simfile.seek(int(self._offset + 12 + 4 * S5_NDIRECT_BLOCKS))
         self._simfile.write(struct.pack("I", val))
 
+    def get_dindirect_blockno(self):
+        self._simfile.seek(int(self._offset + 16 + 4 * S5_NDIRECT_BLOCKS))
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_dindirect_blockno(self, val):
+        self._simfile.seek(int(self._offset + 16 + 4 * S5_NDIRECT_BLOCKS))
+        self._simfile.write(struct.pack("I", val))
+
+    def is_inline(self):
+        return self.get_type() == S5_TYPE_DATA and self.get_size() <= S5_INLINE_SIZE
+
+    def _read_inline(self, offset, size):
+        self._simfile.seek(int(self._offset + 12 + offset))
+        return self._simfile.read(size)
+
+    def _write_inline(self, offset, data):
+        self._simfile.seek(int(self._offset + 12 + offset))
+        self._simfile.write(data)
+
+    def _uninline(self, size):
+        """Moves the data of an inline file, which is to grow to size bytes,
+        into a block."""
+        data = self.read()
+        self._write_inline(0, '\0' * S5_INLINE_SIZE)
+        self.set_size(size)
+        if (len(data) > 0):
+            self._write_blocks(0, data)
+
+    def _map_entry(self, blockno, alloc, clear, store, unshare=False):
+        if (clear and blockno != 0):
+            store(0)
+        elif (alloc and blockno == 0):
+            block = self._simdisk.alloc_block()
+            block.zero()
+            blockno = block.get_blockno()
+            store(blockno)
+        elif (unshare and blockno != 0 and self._simdisk.get_block_refs(blockno) > 0):
+            shared = self._simdisk.get_block(blockno)
+            block = self._simdisk.alloc_block()
+            block.write(0, shared.read())
+            shared.free()
+            blockno = block.get_blockno()
+            store(blockno)
+        return blockno
+
+    def _map_block(self, blockloc, alloc=False, clear=False):
+        """Returns the disk block holding block blockloc of the file, or 0 if
+        it is sparse. With alloc, sparse blocks, and the index blocks leading
+        to them, are allocated, and a block shared with another file is
+        replaced by a copy of its own. With clear, the block is unlinked from
+        the file (but not freed)."""
+        blockloc = int(blockloc)
+        if (blockloc < S5_NDIRECT_BLOCKS):
+            return self._map_entry(self.get_direct_blockno(blockloc), alloc, clear,
+                                   lambda b: self.set_direct_blockno(blockloc, b), alloc)
+        blockloc -= S5_NDIRECT_BLOCKS
+        if (blockloc < S5_NIDIRECT_BLOCKS):
+            blockno = self._map_entry(self.get_indirect_blockno(), alloc, False,
+                                      self.set_indirect_blockno)
+            path = [ blockloc ]
+        else:
+            blockloc -= S5_NIDIRECT_BLOCKS
+            blockno = self._map_entry(self.get_dindirect_blockno(), alloc, False,
+                                      self.set_dindirect_blockno)
+            path = [ blockloc / S5_NIDIRECT_BLOCKS, blockloc % S5_NIDIRECT_BLOCKS ]
+        for i, index in enumerate(path):
+            if (blockno == 0):
+                return 0
+            iblock = self._simdisk.get_block(blockno)
+            entry = struct.unpack("I", iblock.read(index * 4, 4))[0]
+            blockno = self._map_entry(entry, alloc, clear and i == len(path) - 1,
+                                      lambda b: iblock.write(index * 4, struct.pack("I", b)),
+                                      alloc and i == len(path) - 1)
+        return blockno
+
+    def _free_index(self, blockno, depth):
+        """Frees an index block, and for a double-indirect block (depth 2)
+        the indirect blocks it points to. The data blocks must already be
+        gone."""
+        iblock = self._simdisk.get_block(blockno)
+        if (depth > 1):
+            for i in xrange(S5_NIDIRECT_BLOCKS):
+                child = struct.unpack("I", iblock.read(i * 4, 4))[0]
+                if (child != 0):
+                    self._free_index(child, depth - 1)
+        iblock.free()
+
     def get_type_str(self, short=False):
         t = self.get_type()
         name = "INV" if short else "INVALID"
@@ -170,6 +270,8 @@ class Inode:
             name = "blk" if short else "S5_TYPE_BLK"
         elif (t == S5_TYPE_CHR):
             name = "chr" if short else "S5_TYPE_CHR"
+        elif (t == S5_TYPE_SOCK):
+            name = "sck" if short else "S5_TYPE_SOCK"
         return name if short else "{0} (0x{1:02x})".format(name, t)
 
     def get_summary(self):
@@ -187,6 +289,9 @@ class Inode:
             elif (self.get_type() == S5_TYPE_DIR):
                 res += " ({0} dirents)".format(self.get_size() / S5_DIRENT_SIZE)
             res += "\n"
+            if (self.is_inline()):
+                res += "inline data\n"
+                return res[:-1]
             res += "direct blocks ({0}):\n".format(S5_NDIRECT_BLOCKS)
             for i in xrange(S5_NDIRECT_BLOCKS):
                 res += " {0:5}".format(self.get_direct_blockno(i))
@@ -195,8 +300,7 @@ class Inode:
             if (res[-1] != "\n"):
                 res += "\n"
             res += "indirect block: {0}\n".format(self.get_indirect_blockno())
-        elif (self.get_type() == S5_TYPE_FREE):
-            res += "next free: {0}\n".format(self.get_next_free())
+            res += "double-indirect block: {0}\n".format(self.get_dindirect_blockno())
         res = res[:-1]
         return res
 
@@ -206,20 +310,14 @@ class Inode:
         if (self.get_type() not in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
             raise S5fsException("cannot read from inode of type " + self.get_type_str())
         size = min(size, min(S5_MAX_FILE_SIZE, self.get_size()) - offset)
+        if (self.is_inline()):
+            return self._read_inline(offset, max(size, 0))
         res = ""
         while (size > 0):
             blockno = math.floor(offset / S5_BLOCK_SIZE)
             blockoff = offset % S5_BLOCK_SIZE
             ammount = min(S5_BLOCK_SIZE - blockoff, size)
-            if (blockno < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockno)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno -= S5_NDIRECT_BLOCKS
-                    blockno = struct.unpack("I", indirect.read(blockno * 4, 4))[0]
+            blockno = self._map_block(blockno)
             if (blockno == 0):
                 for i in xrange(ammount):
                     res += '\0'
@@ -234,72 +332,70 @@ class Inode:
             raise S5fsException("cannot write to inode of type " + self.get_type_str())
         if (offset + len(data) > S5_MAX_FILE_SIZE):
             raise S5fsException("cannot write up to byte {0}, max file size is {1}".format(offset + len(data), S5_MAX_FILE_SIZE))
+        end = offset + len(data)
+        if (self.is_inline()):
+            if (end <= S5_INLINE_SIZE):
+                self._write_inline(offset, data)
+                if (end > self.get_size()):
+                    self.set_size(end)
+                return
+            self._uninline(end)
+        self._write_blocks(offset, data)
+        if (end > self.get_size()):
+            self.set_size(end)
+
+    def _write_blocks(self, offset, data):
         remaining = len(data)
         while (remaining > 0):
             blockloc = math.floor(offset / S5_BLOCK_SIZE)
             blockoff = offset % S5_BLOCK_SIZE
             ammount = min(S5_BLOCK_SIZE - blockoff, remaining)
-            if (blockloc < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockloc)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    indirect = self._simdisk.alloc_block()
-                    indirect.zero()
-                    self.set_indirect_blockno(indirect.get_blockno())
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno = struct.unpack("I", indirect.read((blockloc - S5_NDIRECT_BLOCKS) * 4, 4))[0]
-            if (blockno == 0):
-                block = self._simdisk.alloc_block()
-                block.zero()
-                if (blockloc < S5_NDIRECT_BLOCKS):
-                    self.set_direct_blockno(blockloc, block.get_blockno())
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((blockloc - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", block.get_blockno()))
-            else:
-                block = self._simdisk.get_block(blockno)
+            block = self._simdisk.get_block(self._map_block(blockloc, alloc=True))
             if (remaining == ammount):
                 block.write(blockoff, data[-remaining:])
             else:
                 block.write(blockoff, data[-remaining:-remaining+ammount])
             remaining -= ammount
             offset += ammount
-        if (offset > self.get_size()):
-            self.set_size(offset)
 
     def truncate(self, size=0):
-        target = math.floor((size - 1) / S5_BLOCK_SIZE)
-        curr = math.floor(self.get_size() / S5_BLOCK_SIZE)
-        while (curr > target):
-            if (curr < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(curr)
+        if (self.get_type() == S5_TYPE_DATA and size <= S5_INLINE_SIZE):
+            # the data that is left moves into the inode
+            data = self.read(0, size)
+            if (not self.is_inline()):
+                self._truncate_blocks(0)
+            self._write_inline(0, data + '\0' * (S5_INLINE_SIZE - len(data)))
+            self.set_size(size)
+            return
+        if (self.is_inline()):
+            self._uninline(size)
+            return
+        self._truncate_blocks(size)
+
+    def _truncate_blocks(self, size):
+        keep = int(math.ceil(float(size) / S5_BLOCK_SIZE))
+        curr = int(math.ceil(float(self.get_size()) / S5_BLOCK_SIZE))
+        for blockloc in xrange(curr - 1, keep - 1, -1):
+            blockno = self._map_block(blockloc, clear=True)
+            if (blockno != 0):
+                self._simdisk.get_block(blockno).free()
+        # then the index blocks which no longer map anything
+        if (keep <= S5_NDIRECT_BLOCKS and self.get_indirect_blockno() != 0):
+            self._free_index(self.get_indirect_blockno(), 1)
+            self.set_indirect_blockno(0)
+        dstart = S5_NDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS
+        if (self.get_dindirect_blockno() != 0):
+            if (keep <= dstart):
+                self._free_index(self.get_dindirect_blockno(), 2)
+                self.set_dindirect_blockno(0)
             else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno = struct.unpack("I", indirect.read((curr - S5_NDIRECT_BLOCKS) * 4, 4))[0]
-            if (blockno > 0):
-                block = self._simdisk.get_block(blockno)
-                block.free()
-                if (curr < S5_NDIRECT_BLOCKS):
-                    self.set_direct_blockno(curr, 0)
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((curr - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", 0))
-                    if (curr == S5_NDIRECT_BLOCKS):
-                        indirect.free()
-                        self.set_indirect_blockno(0)
-            curr -= 1
-        while (curr < target):
-            if (curr < S5_NDIRECT_BLOCKS):
-                self.set_direct_blockno(0)
-            else:
-                if (self.get_indirect_blockno() != 0):
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((curr - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", 0))
+                dindirect = self._simdisk.get_block(self.get_dindirect_blockno())
+                first = int(math.ceil(float(keep - dstart) / S5_NIDIRECT_BLOCKS))
+                for i in xrange(first, S5_NIDIRECT_BLOCKS):
+                    child = struct.unpack("I", dindirect.read(i * 4, 4))[0]
+                    if (child != 0):
+                        self._free_index(child, 1)
+                        dindirect.write(i * 4, struct.pack("I", 0))
         self.set_size(size)
 
     def _find_dirent(self, name, types=S5_TYPES):
@@ -382,6 +478,7 @@ class Inode:
             for i in xrange(S5_NDIRECT_BLOCKS):
                 inode.set_direct_blockno(i, 0)
             inode.set_indirect_blockno(0)
+            inode.set_dindirect_blockno(0)
             self._make_dirent(inode.get_number(), name)
             return inode
         except S5fsException as e:
@@ -397,6 +494,7 @@ class Inode:
             for i in xrange(S5_NDIRECT_BLOCKS):
                 inode.set_direct_blockno(i, 0)
             inode.set_indirect_blockno(0)
+            inode.set_dindirect_blockno(0)
             inode._make_dirent(inode.get_number(), ".")
             inode._make_dirent(self.get_number(), "..")
             self.set_link_count(self.get_link_count() + 1)
@@ -462,8 +560,8 @@ class Inode:
         if (self.get_size() != 0):
             self.truncate()
         self.set_type(S5_TYPE_FREE)
-        self.set_next_free(self._simdisk.get_free_inode())
-        self._simdisk.set_free_inode(self._number)
+        self._simdisk.set_inode_used(self._number, False)
+        self._simdisk.set_free_inodes(self._simdisk.get_free_inodes() + 1)
 
 class Simdisk:
 
@@ -478,11 +576,11 @@ class Simdisk:
         self._simfile.seek(0)
         self._simfile.write(struct.pack("I", val))
 
-    def get_free_inode(self):
+    def get_free_inodes(self):
         self._simfile.seek(4)
         return struct.unpack("I", self._simfile.read(4))[0]
 
-    def set_free_inode(self, val):
+    def set_free_inodes(self, val):
         self._simfile.seek(4)
         self._simfile.write(struct.pack("I", val))
 
@@ -536,13 +634,90 @@ class Simdisk:
         self._simfile.seek(20 + 4 * S5_NBLKS_PER_FNODE)
         self._simfile.write(struct.pack("I", val))
 
+    def get_journal_start(self):
+        self._simfile.seek(24 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_journal_start(self, val):
+        self._simfile.seek(24 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_journal_blocks(self):
+        self._simfile.seek(28 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_journal_blocks(self, val):
+        self._simfile.seek(28 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_free_count(self):
+        self._simfile.seek(32 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_free_count(self, val):
+        self._simfile.seek(32 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_imap_start(self):
+        self._simfile.seek(36 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_imap_start(self, val):
+        self._simfile.seek(36 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_num_blocks(self):
+        self._simfile.seek(40 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_num_blocks(self, val):
+        self._simfile.seek(40 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_refs_start(self):
+        self._simfile.seek(44 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_refs_start(self, val):
+        self._simfile.seek(44 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_block_refs(self, index):
+        self._simfile.seek(S5_BLOCK_SIZE * self.get_refs_start() + index)
+        return struct.unpack("B", self._simfile.read(1))[0]
+
+    def set_block_refs(self, index, val):
+        self._simfile.seek(S5_BLOCK_SIZE * self.get_refs_start() + index)
+        self._simfile.write(struct.pack("B", val))
+
+    def _imap_offset(self, index):
+        return S5_BLOCK_SIZE * self.get_imap_start() + int(index / 8)
+
+    def get_inode_used(self, index):
+        self._simfile.seek(self._imap_offset(index))
+        return 0 != (struct.unpack("B", self._simfile.read(1))[0] & (1 << (index % 8)))
+
+    def set_inode_used(self, index, used):
+        self._simfile.seek(self._imap_offset(index))
+        byte = struct.unpack("B", self._simfile.read(1))[0]
+        if (used):
+            byte |= 1 << (index % 8)
+        else:
+            byte &= ~(1 << (index % 8))
+        self._simfile.seek(self._imap_offset(index))
+        self._simfile.write(struct.pack("B", byte))
+
     def get_super_block_summary(self):
         res = ""
         res += "magic:      0x{0:04x} ({1})\n".format(self.get_magic(), "VALID" if self.get_magic() == S5_MAGIC else "INVALID")
         res += "version:    0x{0:04x}{1}\n".format(self.get_version(), "" if self.get_version() == S5_CURRENT_VERSION else " (INVALID)")
         res += "num inodes: {0}\n".format(self.get_num_inodes())
-        res += "free inode: {0}{1}\n".format(self.get_free_inode(), "" if self.get_free_inode() < self.get_num_inodes() else " (INVALID)")
+        res += "free inodes: {0}{1}\n".format(self.get_free_inodes(), "" if self.get_free_inodes() < self.get_num_inodes() else " (INVALID)")
+        res += "inode map:  block {0}\n".format(self.get_imap_start())
+        res += "num blocks: {0}, reference counts at {1}\n".format(self.get_num_blocks(), self.get_refs_start())
         res += "root inode: {0}{1}\n".format(self.get_root_inode(), "" if self.get_root_inode() < self.get_num_inodes() else " (INVALID)")
+        res += "journal:    {0} blocks at {1}\n".format(self.get_journal_blocks(), self.get_journal_start())
+        res += "free count: {0}\n".format(self.get_free_count())
         res += "free blocks ({0}{1}):\n".format(self.get_nfree(), "" if self.get_nfree() <= S5_NBLKS_PER_FNODE else (", too large shouldn't exceed " + str(S5_NBLKS_PER_FNODE)))
         for i in xrange(min(self.get_nfree(), S5_NBLKS_PER_FNODE - 1)):
             res += "  {0}".format(self.get_free_block(i))
@@ -553,15 +728,21 @@ class Simdisk:
         res += "  last free block: {0}\n".format(self.get_last_free_block())
         return res
 
-    def format(self, inodes, size):
+    def format(self, inodes, size, journal=S5_JOURNAL_BLOCKS):
         if (inodes < 1):
             raise S5fsException("cannot format disk with {0} inodes, must have at least one".format(inodes))
         if (size % S5_BLOCK_SIZE != 0):
             raise S5fsException("cannot format disk to size {0} which is not a multiple of the block size {1}".format(size, S5_BLOCK_SIZE))
         blocks = int(size / S5_BLOCK_SIZE)
         iblocks = int(math.floor((inodes - 1) / S5_INODES_PER_BLOCK) + 1)
+        imap = int(math.floor((inodes - 1) / S5_IMAP_BITS) + 1)
+        refs = int(math.floor((blocks - 1) / S5_REFS_PER_BLOCK) + 1)
         if (iblocks + 1 >= blocks):
             raise S5fsException("cannot format disk of size {0} with {1} inodes, the inodes require at least {2} bytes of space".format(size, inodes, (1 + iblocks) * S5_BLOCK_SIZE))
+        if (journal != 0 and journal < 3):
+            raise S5fsException("cannot give the journal {0} blocks, it needs at least 3".format(journal))
+        if (iblocks + imap + refs + journal + 1 >= blocks):
+            raise S5fsException("cannot format disk of size {0} with {1} inodes and a {2} block journal, they require at least {3} bytes of space".format(size, inodes, journal, (1 + iblocks + imap + refs + journal) * S5_BLOCK_SIZE))
         self._simfile.truncate()
         self._simfile.seek(size)
         self._simfile.write("")
@@ -569,17 +750,28 @@ class Simdisk:
         self.set_magic(S5_MAGIC)
         self.set_version(S5_CURRENT_VERSION)
         self.set_num_inodes(inodes)
+        # the inode bitmap follows the inodes, then the block reference
+        # counts, then the journal, a zeroed first block of which is an
+        # empty log
+        self.set_num_blocks(blocks)
+        self.set_imap_start(iblocks + 1)
+        self.set_refs_start(iblocks + imap + 1)
+        for i in xrange(imap + refs):
+            self.get_block(iblocks + 1 + i).zero()
+        self.set_journal_start(iblocks + imap + refs + 1 if journal else 0)
+        self.set_journal_blocks(journal)
+        if (journal):
+            self.get_block(iblocks + imap + refs + 1).zero()
         for i in xrange(inodes):
             inode = self.get_inode(i)
             inode.set_number(i)
             inode.set_type(S5_TYPE_FREE)
-            inode.set_next_free(i + 1)
-        inode.set_next_free(0xffffffff)
-        self.set_free_inode(0)
+            inode.set_size(0)
+        self.set_free_inodes(inodes)
 
         self.set_last_free_block(0xffffffff)
         i = 0
-        for num in xrange(iblocks+1, blocks):
+        for num in xrange(iblocks + imap + refs + journal + 1, blocks):
             if (i == S5_NBLKS_PER_FNODE - 1):
                 block = self.get_block(num)
                 for j in xrange(S5_NBLKS_PER_FNODE - 1):
@@ -591,11 +783,13 @@ class Simdisk:
                 self.set_free_block(i, num)
                 i += 1
         self.set_nfree(i)
+        self.set_free_count(blocks - iblocks - imap - refs - journal - 1)
 
         root = self.alloc_inode()
         for i in xrange(S5_NDIRECT_BLOCKS):
             root.set_direct_blockno(i, 0)
         root.set_indirect_blockno(0)
+        root.set_dindirect_blockno(0)
         root.set_type(S5_TYPE_DIR)
         root.set_size(0)
         root.set_link_count(1)
@@ -604,14 +798,9 @@ class Simdisk:
         root.set_link_count(1)
 
     def free_inodes(self):
-        inext = self.get_free_inode()
-        while (inext != 0xffffffff):
-            try:
-                curr = self.get_inode(inext)
-                yield inext
-                inext = curr.get_free_inode()
-            except S5fsException as e:
-                raise S5fsException("error encountered while iterating free inodes: {0}".format(str(e)))
+        for i in xrange(self.get_num_inodes()):
+            if (not self.get_inode_used(i)):
+                yield i
 
     def get_inode(self, index):
         offset = S5_BLOCK_SIZE * (1 + math.floor(index / S5_INODES_PER_BLOCK)) + S5_INODE_SIZE * (index % S5_INODES_PER_BLOCK)
@@ -620,11 +809,13 @@ class Simdisk:
         return Inode(self, index, offset)
 
     def alloc_inode(self):
-        if (self.get_free_inode() == 0xffffffff):
+        if (self.get_free_inodes() == 0):
             raise S5fsException("disk is out of inodes")
-        inode = self.get_inode(self.get_free_inode())
-        self.set_free_inode(inode.get_next_free())
-        return inode
+        for i in self.free_inodes():
+            self.set_inode_used(i, True)
+            self.set_free_inodes(self.get_free_inodes() - 1)
+            return self.get_inode(i)
+        raise S5fsException("free inode count {0} disagrees with the inode bitmap".format(self.get_free_inodes()))
 
     def get_block(self, index):
         offset = S5_BLOCK_SIZE * index
@@ -642,8 +833,10 @@ class Simdisk:
                     self.set_free_block(i, struct.unpack("I", block.read(i * 4, 4))[0])
                 self.set_last_free_block(struct.unpack("I", block.read((S5_NBLKS_PER_FNODE - 1) * 4, 4))[0])
                 self.set_nfree(S5_NBLKS_PER_FNODE - 1)
+            self.set_free_count(self.get_free_count() - 1)
             return block
         else:
+            self.set_free_count(self.get_free_count() - 1)
             self.set_nfree(self.get_nfree() - 1)
             return self.get_block(self.get_free_block(self.get_nfree()))
 
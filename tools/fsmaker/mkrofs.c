@@ -0,0 +1,377 @@
+/*
+ * Builds a rofs image (see kernel/include/fs/rofs/rofs.h) holding a copy
+ * of a directory tree.
+ *
+ * usage: mkrofs <image> <directory>
+ *
+ * As with mks5fs, inodes are numbered breadth first from the root and
+ * the bytes are laid out in the same order: each directory's entries,
+ * then each regular file in it, its table of pieces followed by the
+ * pieces. The pieces are compressed with a plain greedy LZ4 compressor,
+ * which makes them a little bigger than lz4 itself would, but is all the
+ * kernel's decompressor needs.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "fs/rofs/rofs.h"
+
+#define MIN(a, b)               ((a) < (b) ? (a) : (b))
+
+#define LZ4_MIN_MATCH           4
+#define LZ4_LAST_LITERALS       5       /* a block ends with at least these */
+#define LZ4_MATCH_LIMIT         12      /* and has no match starting here */
+#define LZ4_MAX_OFFSET          65535
+#define LZ4_HASH_BITS           12
+
+/* A file or directory to be copied in, in the order they are laid out */
+struct node {
+        char            *n_path;        /* on the host */
+        char             n_name[ROFS_NAME_LEN];
+        uint32_t         n_inode;
+        int              n_dir;
+        off_t            n_size;        /* for a regular file */
+
+        struct node     *n_parent;
+        struct node     *n_children;    /* first, in name order */
+        struct node     *n_sibling;
+        uint32_t         n_nchildren;
+        uint32_t         n_nsubdirs;
+        struct node     *n_next;        /* breadth first */
+};
+
+static const char *progname = "mkrofs";
+
+static uint8_t *image;
+static size_t image_len;
+static size_t image_cap;
+static rofs_inode_t *inodes;
+static uint32_t num_inodes = 1;
+
+static void
+fail(const char *fmt, ...)
+{
+        va_list args;
+
+        fprintf(stderr, "%s: ", progname);
+        va_start(args, fmt);
+        vfprintf(stderr, fmt, args);
+        va_end(args);
+        fprintf(stderr, "\n");
+        exit(1);
+}
+
+static void *
+xmalloc(size_t size)
+{
+        void *p = calloc(1, size);
+        if (NULL == p)
+                fail("out of memory");
+        return p;
+}
+
+/* Makes room for len more bytes, zeroed, at the end of the image */
+static uint32_t
+extend(size_t len)
+{
+        size_t off = image_len;
+
+        if (image_len + len > UINT32_MAX)
+                fail("the image would be more than 4GB");
+        if (image_len + len > image_cap) {
+                size_t cap = image_cap ? image_cap : ROFS_BLOCK_SIZE;
+                while (cap < image_len + len)
+                        cap *= 2;
+                if (NULL == (image = realloc(image, cap)))
+                        fail("out of memory");
+                memset(image + image_cap, 0, cap - image_cap);
+                image_cap = cap;
+        }
+        image_len += len;
+        return off;
+}
+
+static void
+align(size_t to)
+{
+        extend((to - image_len % to) % to);
+}
+
+static uint32_t
+append(const void *buf, size_t len)
+{
+        uint32_t off = extend(len);
+        memcpy(image + off, buf, len);
+        return off;
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+        return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Reads the tree into nodes, breadth first, and numbers them */
+static struct node *
+scan(const char *root)
+{
+        struct node *head, *tail, *n;
+
+        head = tail = xmalloc(sizeof(*head));
+        head->n_path = strdup(root);
+        head->n_dir = 1;
+        head->n_parent = head;
+
+        for (n = head; NULL != n; n = n->n_next) {
+                struct node **link = &n->n_children;
+                struct dirent *d;
+                char **names = NULL;
+                size_t nnames = 0, cap = 0, i;
+                DIR *dir;
+
+                if (!n->n_dir)
+                        continue;
+                if (NULL == (dir = opendir(n->n_path)))
+                        fail("%s: %s", n->n_path, strerror(errno));
+                while (NULL != (d = readdir(dir))) {
+                        if (0 == strcmp(d->d_name, ".") || 0 == strcmp(d->d_name, ".."))
+                                continue;
+                        if (nnames == cap) {
+                                cap = cap ? 2 * cap : 16;
+                                if (NULL == (names = realloc(names, cap * sizeof(*names))))
+                                        fail("out of memory");
+                        }
+                        names[nnames++] = strdup(d->d_name);
+                }
+                closedir(dir);
+                /* the kernel looks names up by binary search */
+                qsort(names, nnames, sizeof(*names), compare_names);
+
+                for (i = 0; i < nnames; i++) {
+                        struct node *c = xmalloc(sizeof(*c));
+                        struct stat st;
+
+                        if (strlen(names[i]) >= ROFS_NAME_LEN)
+                                fail("%s/%s: names can be at most %d characters",
+                                     n->n_path, names[i], ROFS_NAME_LEN - 1);
+                        c->n_path = xmalloc(strlen(n->n_path) + strlen(names[i]) + 2);
+                        sprintf(c->n_path, "%s/%s", n->n_path, names[i]);
+                        strcpy(c->n_name, names[i]);
+                        free(names[i]);
+
+                        if (0 > stat(c->n_path, &st))
+                                fail("%s: %s", c->n_path, strerror(errno));
+                        if (S_ISDIR(st.st_mode)) {
+                                c->n_dir = 1;
+                                n->n_nsubdirs++;
+                        } else if (S_ISREG(st.st_mode)) {
+                                if (st.st_size > (off_t)UINT32_MAX)
+                                        fail("%s: too big for rofs", c->n_path);
+                                c->n_size = st.st_size;
+                        } else {
+                                fail("%s: only files and directories can be copied", c->n_path);
+                        }
+
+                        c->n_inode = num_inodes++;
+                        c->n_parent = n;
+                        *link = c;
+                        link = &c->n_sibling;
+                        n->n_nchildren++;
+                        tail->n_next = c;
+                        tail = c;
+                }
+                free(names);
+        }
+        return head;
+}
+
+static uint32_t
+read32(const uint8_t *p)
+{
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+static uint8_t *
+put_length(uint8_t *op, size_t len)
+{
+        for (; len >= 255; len -= 255)
+                *op++ = 255;
+        *op++ = (uint8_t)len;
+        return op;
+}
+
+static uint8_t *
+put_sequence(uint8_t *op, const uint8_t *lit, size_t nlit, size_t offset, size_t mlen)
+{
+        uint8_t *token = op++;
+
+        *token = (uint8_t)(MIN(nlit, 15) << 4);
+        if (nlit >= 15)
+                op = put_length(op, nlit - 15);
+        memcpy(op, lit, nlit);
+        op += nlit;
+        if (0 == mlen)
+                return op;
+
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        mlen -= LZ4_MIN_MATCH;
+        *token |= (uint8_t)MIN(mlen, 15);
+        if (mlen >= 15)
+                op = put_length(op, mlen - 15);
+        return op;
+}
+
+/*
+ * Compresses src[0..n) into dest as one LZ4 block; dest must hold
+ * n + n / 255 + 16 bytes, the most it can come to. Returns its length.
+ */
+static size_t
+compress(const uint8_t *src, size_t n, uint8_t *dest)
+{
+        uint32_t table[1 << LZ4_HASH_BITS];
+        size_t ip = 0, anchor = 0;
+        uint8_t *op = dest;
+
+        memset(table, 0, sizeof(table));
+        if (n > LZ4_MATCH_LIMIT) {
+                while (ip < n - LZ4_MATCH_LIMIT) {
+                        uint32_t seq = read32(src + ip);
+                        uint32_t h = (seq * 2654435761U) >> (32 - LZ4_HASH_BITS);
+                        size_t ref = table[h], len;
+
+                        /* positions are kept one up, so that 0 is none */
+                        table[h] = ip + 1;
+                        if (0 == ref-- || ip - ref > LZ4_MAX_OFFSET || read32(src + ref) != seq) {
+                                ip++;
+                                continue;
+                        }
+                        for (len = LZ4_MIN_MATCH;
+                             ip + len < n - LZ4_LAST_LITERALS && src[ref + len] == src[ip + len];
+                             len++)
+                                ;
+                        op = put_sequence(op, src + anchor, ip - anchor, ip - ref, len);
+                        ip += len;
+                        anchor = ip;
+                }
+        }
+        op = put_sequence(op, src + anchor, n - anchor, 0, 0);
+        return op - dest;
+}
+
+static void
+write_dirent(uint32_t ino, const char *name)
+{
+        rofs_dirent_t d;
+
+        memset(&d, 0, sizeof(d));
+        d.rd_inode = ino;
+        strncpy(d.rd_name, name, sizeof(d.rd_name) - 1);
+        append(&d, sizeof(d));
+}
+
+static void
+write_dir(struct node *n)
+{
+        rofs_inode_t *ino = &inodes[n->n_inode];
+        struct node *c;
+
+        align(sizeof(rofs_dirent_t));
+        ino->ri_type = ROFS_TYPE_DIR;
+        ino->ri_size = (n->n_nchildren + 2) * sizeof(rofs_dirent_t);
+        ino->ri_linkcount = 2 + n->n_nsubdirs;
+        ino->ri_data = image_len;
+
+        write_dirent(n->n_inode, ".");
+        write_dirent(n->n_parent->n_inode, "..");
+        for (c = n->n_children; NULL != c; c = c->n_sibling)
+                write_dirent(c->n_inode, c->n_name);
+}
+
+static void
+write_file(struct node *n)
+{
+        rofs_inode_t *ino = &inodes[n->n_inode];
+        uint32_t npieces = (n->n_size + ROFS_BLOCK_SIZE - 1) / ROFS_BLOCK_SIZE, i, table;
+        uint8_t piece[ROFS_BLOCK_SIZE], packed[ROFS_BLOCK_SIZE + ROFS_BLOCK_SIZE / 255 + 16];
+        FILE *f;
+
+        align(sizeof(uint32_t));
+        ino->ri_type = ROFS_TYPE_DATA;
+        ino->ri_size = n->n_size;
+        ino->ri_linkcount = 1;
+        ino->ri_data = table = extend((npieces + 1) * sizeof(uint32_t));
+
+        if (NULL == (f = fopen(n->n_path, "rb")))
+                fail("%s: %s", n->n_path, strerror(errno));
+        for (i = 0; i < npieces; i++) {
+                size_t len = MIN(ROFS_BLOCK_SIZE, n->n_size - (off_t)i * ROFS_BLOCK_SIZE);
+                size_t clen;
+                uint32_t off;
+
+                if (len != fread(piece, 1, len, f))
+                        fail("%s: %s", n->n_path, ferror(f) ? strerror(errno) : "shorter than expected");
+                /* a piece which does not get smaller is kept as it is */
+                if ((clen = compress(piece, len, packed)) < len)
+                        off = append(packed, clen);
+                else
+                        off = append(piece, len);
+                memcpy(image + table + i * sizeof(uint32_t), &off, sizeof(off));
+        }
+        memcpy(image + table + npieces * sizeof(uint32_t), &image_len, sizeof(uint32_t));
+        fclose(f);
+}
+
+int
+main(int argc, char **argv)
+{
+        struct node *root, *n;
+        rofs_super_t *s;
+        size_t table;
+        FILE *f;
+
+        if (3 != argc) {
+                fprintf(stderr, "usage: %s <image> <directory>\n", progname);
+                return 2;
+        }
+
+        root = scan(argv[2]);
+        inodes = xmalloc(num_inodes * sizeof(*inodes));
+
+        /* the superblock, then the inodes, filled in as they are written */
+        extend(ROFS_BLOCK_SIZE);
+        table = extend((ROFS_INODE_BLOCK(num_inodes - 1) + 1) * ROFS_BLOCK_SIZE - image_len);
+        for (n = root; NULL != n; n = n->n_next) {
+                struct node *c;
+
+                if (!n->n_dir)
+                        continue;
+                write_dir(n);
+                for (c = n->n_children; NULL != c; c = c->n_sibling)
+                        if (!c->n_dir)
+                                write_file(c);
+        }
+        memcpy(image + table, inodes, num_inodes * sizeof(*inodes));
+
+        s = (rofs_super_t *)(image + ROFS_SUPER_BLOCK * ROFS_BLOCK_SIZE);
+        s->rs_magic = ROFS_MAGIC;
+        s->rs_version = ROFS_CURRENT_VERSION;
+        s->rs_num_inodes = num_inodes;
+        s->rs_root_inode = root->n_inode;
+        s->rs_size = image_len;
+        align(ROFS_BLOCK_SIZE);
+
+        if (NULL == (f = fopen(argv[1], "wb")))
+                fail("%s: %s", argv[1], strerror(errno));
+        if (image_len != fwrite(image, 1, image_len, f) || 0 != fclose(f))
+                fail("%s: %s", argv[1], strerror(errno));
+        return 0;
+}
@@ -0,0 +1,453 @@
+/*
+ * Builds an s5fs disk image holding a copy of a directory tree, all at
+ * once, instead of a block at a time as "format -d" in sh.py does.
+ *
+ * usage: mks5fs -b <blocks> -i <inodes> [-j <journal blocks>] <image> [<directory>]
+ *
+ * The image is put together in memory and written out once. Inodes are
+ * numbered breadth first from the root, as sh.py would number them, and
+ * the blocks are laid out in the same order, starting right after the
+ * journal: each directory's entries, then the contents of the regular
+ * files in it, each file's blocks one after another with its index
+ * blocks just ahead of the blocks they map. The free block list is built
+ * over what is left so that the kernel hands those out from low to high.
+ *
+ * The kernel keeps its directory name hashes in memory only (see
+ * s5fs_subr.c), so there is nothing of those to put on the disk.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fs/s5fs/s5fs.h"
+
+#define S5_JOURNAL_BLOCKS       64      /* as sh.py's format gives it */
+#define S5_NONE                 ((uint32_t) -1) /* ends the free list */
+
+/* A file or directory to be copied in, in the order they are laid out */
+struct node {
+        char            *n_path;        /* on the host */
+        char             n_name[S5_NAME_LEN];
+        uint32_t         n_inode;
+        int              n_dir;
+        off_t            n_size;        /* for a regular file */
+
+        struct node     *n_parent;
+        struct node     *n_children;    /* first, in name order */
+        struct node     *n_sibling;
+        uint32_t         n_nchildren;
+        struct node     *n_next;        /* breadth first */
+};
+
+static const char *progname = "mks5fs";
+
+static uint8_t *disk;
+static uint32_t disk_blocks;
+static uint32_t disk_inodes;
+static uint32_t next_block;             /* the next one to lay out */
+
+static void
+fail(const char *fmt, ...)
+{
+        va_list args;
+
+        fprintf(stderr, "%s: ", progname);
+        va_start(args, fmt);
+        vfprintf(stderr, fmt, args);
+        va_end(args);
+        fprintf(stderr, "\n");
+        exit(1);
+}
+
+static void *
+xmalloc(size_t size)
+{
+        void *p = calloc(1, size);
+        if (NULL == p)
+                fail("out of memory");
+        return p;
+}
+
+static uint8_t *
+block(uint32_t blockno)
+{
+        return disk + (size_t)blockno * S5_BLOCK_SIZE;
+}
+
+static uint32_t *
+block_words(uint32_t blockno)
+{
+        return (uint32_t *)block(blockno);
+}
+
+static s5_super_t *
+super(void)
+{
+        return (s5_super_t *)block(S5_SUPER_BLOCK);
+}
+
+static s5_inode_t *
+inode(uint32_t ino)
+{
+        return (s5_inode_t *)block(S5_INODE_BLOCK(ino)) + S5_INODE_OFFSET(ino);
+}
+
+static uint32_t
+alloc_block(void)
+{
+        if (next_block >= disk_blocks)
+                fail("out of disk space, more than %u blocks are needed", disk_blocks);
+        return next_block++;
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+        return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Reads the tree into nodes, breadth first, and numbers them */
+static struct node *
+scan(const char *root)
+{
+        struct node *head, *tail, *n;
+        uint32_t inodes = 1;
+
+        head = tail = xmalloc(sizeof(*head));
+        head->n_path = strdup(root);
+        head->n_dir = 1;
+        head->n_parent = head;
+
+        for (n = head; NULL != n; n = n->n_next) {
+                struct node **link = &n->n_children;
+                struct dirent *d;
+                char **names = NULL;
+                size_t nnames = 0, cap = 0, i;
+                DIR *dir;
+
+                if (!n->n_dir)
+                        continue;
+                if (NULL == (dir = opendir(n->n_path)))
+                        fail("%s: %s", n->n_path, strerror(errno));
+                while (NULL != (d = readdir(dir))) {
+                        if (0 == strcmp(d->d_name, ".") || 0 == strcmp(d->d_name, ".."))
+                                continue;
+                        if (nnames == cap) {
+                                cap = cap ? 2 * cap : 16;
+                                if (NULL == (names = realloc(names, cap * sizeof(*names))))
+                                        fail("out of memory");
+                        }
+                        names[nnames++] = strdup(d->d_name);
+                }
+                closedir(dir);
+                qsort(names, nnames, sizeof(*names), compare_names);
+
+                for (i = 0; i < nnames; i++) {
+                        struct node *c = xmalloc(sizeof(*c));
+                        struct stat st;
+
+                        if (strlen(names[i]) >= S5_NAME_LEN)
+                                fail("%s/%s: names can be at most %d characters",
+                                     n->n_path, names[i], S5_NAME_LEN - 1);
+                        c->n_path = xmalloc(strlen(n->n_path) + strlen(names[i]) + 2);
+                        sprintf(c->n_path, "%s/%s", n->n_path, names[i]);
+                        strcpy(c->n_name, names[i]);
+                        free(names[i]);
+
+                        /* like sh.py, this follows symbolic links */
+                        if (0 > stat(c->n_path, &st))
+                                fail("%s: %s", c->n_path, strerror(errno));
+                        if (S_ISDIR(st.st_mode)) {
+                                c->n_dir = 1;
+                        } else if (S_ISREG(st.st_mode)) {
+                                if (st.st_size > (off_t)S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE)
+                                        fail("%s: too big for s5fs", c->n_path);
+                                c->n_size = st.st_size;
+                        } else {
+                                fail("%s: only files and directories can be copied", c->n_path);
+                        }
+
+                        if (inodes >= disk_inodes)
+                                fail("out of inodes, more than %u are needed", disk_inodes);
+                        c->n_inode = inodes++;
+                        c->n_parent = n;
+                        *link = c;
+                        link = &c->n_sibling;
+                        n->n_nchildren++;
+                        tail->n_next = c;
+                        tail = c;
+                }
+                free(names);
+        }
+        return head;
+}
+
+/*
+ * Gives the inode nblocks blocks, one after another, along with the
+ * index blocks they need, and puts the numbers of the data blocks in
+ * blocknos. Each index block comes just before the first block it maps.
+ */
+static void
+alloc_file_blocks(s5_inode_t *ino, uint32_t nblocks, uint32_t *blocknos)
+{
+        uint32_t i, *ind = NULL, *dind = NULL;
+
+        for (i = 0; i < nblocks; i++) {
+                uint32_t loc = i;
+
+                if (loc < S5_NDIRECT_BLOCKS) {
+                        ino->s5_direct_blocks[loc] = blocknos[i] = alloc_block();
+                        continue;
+                }
+                loc -= S5_NDIRECT_BLOCKS;
+                if (loc < S5_NIDIRECT_BLOCKS) {
+                        if (0 == loc) {
+                                ino->s5_indirect_block = alloc_block();
+                                ind = block_words(ino->s5_indirect_block);
+                        }
+                        ind[loc] = blocknos[i] = alloc_block();
+                        continue;
+                }
+                loc -= S5_NIDIRECT_BLOCKS;
+                if (0 == loc) {
+                        ino->s5_dindirect_block = alloc_block();
+                        dind = block_words(ino->s5_dindirect_block);
+                }
+                if (0 == loc % S5_NIDIRECT_BLOCKS) {
+                        dind[loc / S5_NIDIRECT_BLOCKS] = alloc_block();
+                        ind = block_words(dind[loc / S5_NIDIRECT_BLOCKS]);
+                }
+                ind[loc % S5_NIDIRECT_BLOCKS] = blocknos[i] = alloc_block();
+        }
+}
+
+static void
+init_inode(s5_inode_t *ino, uint32_t number, uint16_t type, int16_t links)
+{
+        memset(ino, 0, sizeof(*ino));
+        ino->s5_number = number;
+        ino->s5_type = type;
+        ino->s5_linkcount = links;
+}
+
+static void
+write_dir(struct node *n)
+{
+        s5_inode_t *ino = inode(n->n_inode);
+        uint32_t ndirents = n->n_nchildren + 2, nblocks, i, *blocknos;
+        s5_dirent_t *d;
+        struct node *c;
+        int16_t links = 1;
+
+        for (c = n->n_children; NULL != c; c = c->n_sibling)
+                links += c->n_dir;
+        init_inode(ino, n->n_inode, S5_TYPE_DIR, links);
+        ino->s5_size = ndirents * sizeof(s5_dirent_t);
+        if ((uint64_t)ino->s5_size > (uint64_t)S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE)
+                fail("%s: too many entries", n->n_path);
+
+        nblocks = (ino->s5_size + S5_BLOCK_SIZE - 1) / S5_BLOCK_SIZE;
+        blocknos = xmalloc(nblocks * sizeof(*blocknos));
+        alloc_file_blocks(ino, nblocks, blocknos);
+
+        /* ".", "..", then the children in name order */
+        for (i = 0, c = NULL; i < ndirents; i++) {
+                d = (s5_dirent_t *)block(blocknos[i / S5_DIRENTS_PER_BLOCK])
+                    + i % S5_DIRENTS_PER_BLOCK;
+                if (0 == i) {
+                        d->s5d_inode = n->n_inode;
+                        strcpy(d->s5d_name, ".");
+                } else if (1 == i) {
+                        d->s5d_inode = n->n_parent->n_inode;
+                        strcpy(d->s5d_name, "..");
+                } else {
+                        c = (NULL == c) ? n->n_children : c->n_sibling;
+                        d->s5d_inode = c->n_inode;
+                        strcpy(d->s5d_name, c->n_name);
+                }
+        }
+        free(blocknos);
+}
+
+static void
+write_file(struct node *n)
+{
+        s5_inode_t *ino = inode(n->n_inode);
+        uint32_t nblocks, i, *blocknos;
+        FILE *f;
+
+        init_inode(ino, n->n_inode, S5_TYPE_DATA, 1);
+        ino->s5_size = n->n_size;
+        if (NULL == (f = fopen(n->n_path, "rb")))
+                fail("%s: %s", n->n_path, strerror(errno));
+
+        if (n->n_size <= (off_t)S5_INLINE_SIZE) {
+                if ((size_t)n->n_size != fread(ino->s5_direct_blocks, 1, n->n_size, f))
+                        fail("%s: short read", n->n_path);
+                fclose(f);
+                return;
+        }
+
+        nblocks = (n->n_size + S5_BLOCK_SIZE - 1) / S5_BLOCK_SIZE;
+        blocknos = xmalloc(nblocks * sizeof(*blocknos));
+        alloc_file_blocks(ino, nblocks, blocknos);
+        for (i = 0; i < nblocks; i++) {
+                size_t len = S5_BLOCK_SIZE;
+                if (i == nblocks - 1 && 0 != n->n_size % S5_BLOCK_SIZE)
+                        len = n->n_size % S5_BLOCK_SIZE;
+                if (len != fread(block(blocknos[i]), 1, len, f))
+                        fail("%s: short read", n->n_path);
+        }
+        free(blocknos);
+        fclose(f);
+}
+
+/* Lays out each directory followed by the regular files in it */
+static void
+write_tree(struct node *root)
+{
+        struct node *n, *c;
+
+        for (n = root; NULL != n; n = n->n_next) {
+                if (!n->n_dir)
+                        continue;
+                write_dir(n);
+                for (c = n->n_children; NULL != c; c = c->n_sibling) {
+                        if (!c->n_dir)
+                                write_file(c);
+                }
+        }
+}
+
+static void
+format(uint32_t journal)
+{
+        uint32_t iblocks = (disk_inodes - 1) / S5_INODES_PER_BLOCK + 1;
+        uint32_t imap = S5_IMAP_BLOCKS(disk_inodes);
+        uint32_t refs = S5_REFS_BLOCKS(disk_blocks);
+        s5_super_t *s = super();
+        uint32_t i;
+
+        if (iblocks + imap + refs + journal + 1 >= disk_blocks)
+                fail("%u blocks cannot hold %u inodes and a %u block journal",
+                     disk_blocks, disk_inodes, journal);
+        if (0 != journal && journal < 3)
+                fail("the journal needs at least 3 blocks");
+
+        s->s5s_magic = S5_MAGIC;
+        s->s5s_version = S5_CURRENT_VERSION;
+        s->s5s_num_inodes = disk_inodes;
+        s->s5s_root_inode = 0;
+        /* the inode bitmap follows the inodes, then the block reference
+         * counts, all 0 as nothing is shared yet, then the journal, a
+         * zeroed first block of which is an empty log */
+        s->s5s_num_blocks = disk_blocks;
+        s->s5s_imap_start = iblocks + 1;
+        s->s5s_refs_start = iblocks + imap + 1;
+        s->s5s_journal_start = journal ? iblocks + imap + refs + 1 : 0;
+        s->s5s_journal_blocks = journal;
+
+        for (i = 0; i < disk_inodes; i++) {
+                s5_inode_t *ino = inode(i);
+                ino->s5_number = i;
+                ino->s5_type = S5_TYPE_FREE;
+        }
+        next_block = iblocks + imap + refs + journal + 1;
+}
+
+/* Once the tree is in, everything from next_block on is free */
+static void
+finish(uint32_t inodes_used)
+{
+        s5_super_t *s = super();
+        uint32_t i, num;
+
+        /* the inodes in use are the lowest ones, see scan() */
+        for (i = 0; i < inodes_used; i++)
+                block(s->s5s_imap_start)[i / 8] |= 1 << (i % 8);
+        s->s5s_free_inodes = disk_inodes - inodes_used;
+
+        /*
+         * From the top down, so that the lowest blocks end up in the
+         * superblock with the lowest last: the kernel takes from the end
+         * of s5s_free_blocks, then the node block, then what it lists.
+         */
+        s->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1] = S5_NONE;
+        s->s5s_nfree = 0;
+        for (num = disk_blocks; num-- > next_block;) {
+                if (S5_NBLKS_PER_FNODE - 1 == s->s5s_nfree) {
+                        memcpy(block(num), s->s5s_free_blocks, sizeof(s->s5s_free_blocks));
+                        s->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1] = num;
+                        s->s5s_nfree = 0;
+                } else {
+                        s->s5s_free_blocks[s->s5s_nfree++] = num;
+                }
+        }
+        s->s5s_free_count = disk_blocks - next_block;
+}
+
+static void
+usage(void)
+{
+        fprintf(stderr, "usage: %s -b <blocks> -i <inodes> [-j <journal blocks>] <image> [<directory>]\n",
+                progname);
+        exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+        uint32_t journal = S5_JOURNAL_BLOCKS, inodes_used = 1;
+        struct node *root = NULL, *n;
+        const char *image;
+        FILE *f;
+        int c;
+
+        while (-1 != (c = getopt(argc, argv, "b:i:j:"))) {
+                switch (c) {
+                        case 'b':
+                                disk_blocks = strtoul(optarg, NULL, 0);
+                                break;
+                        case 'i':
+                                disk_inodes = strtoul(optarg, NULL, 0);
+                                break;
+                        case 'j':
+                                journal = strtoul(optarg, NULL, 0);
+                                break;
+                        default:
+                                usage();
+                }
+        }
+        if (optind + 1 != argc && optind + 2 != argc)
+                usage();
+        if (0 == disk_blocks || 0 == disk_inodes)
+                usage();
+        image = argv[optind];
+
+        disk = xmalloc((size_t)disk_blocks * S5_BLOCK_SIZE);
+        format(journal);
+
+        if (optind + 2 == argc) {
+                root = scan(argv[optind + 1]);
+        } else {
+                root = xmalloc(sizeof(*root));
+                root->n_dir = 1;
+                root->n_parent = root;
+        }
+        write_tree(root);
+        for (n = root->n_next; NULL != n; n = n->n_next)
+                inodes_used++;
+        finish(inodes_used);
+
+        if (NULL == (f = fopen(image, "wb")))
+                fail("%s: %s", image, strerror(errno));
+        if (disk_blocks != fwrite(disk, S5_BLOCK_SIZE, disk_blocks, f) || 0 != fclose(f))
+                fail("%s: %s", image, strerror(errno));
+        return 0;
+}
@@ -68,6 +68,8 @@ class FsmakerShell(cmd.Cmd):
                                       help="size for the new file system in blocks, must specify either this option or -s but not both")
         self._parse_format.add_option("-i", "--inodes", action="store", type="int", default=None,
                                       help="number of inodes to put on the disk, this must be specified and be compatible with the size of the disk (there must be enough space for the inodes)")
+        self._parse_format.add_option("-j", "--journal", action="store", type="int", default=api.S5_JOURNAL_BLOCKS,
+                                      help="number of blocks to reserve for the metadata journal, 0 for none (default %default)")
         self._parse_format.add_option("-d", "--directory", action="store", type="str", default=None,
                                       help="initializes the disk with the contents of the specified directory")
 
@@ -216,7 +218,7 @@ class FsmakerShell(cmd.Cmd):
                 else:
                     if (itype in set([ api.S5_TYPE_DATA, api.S5_TYPE_DIR ])):
                         msg = "{0} {1} bytes".format(itypestr, isize)
-                    elif (itype in set([ api.S5_TYPE_BLK, api.S5_TYPE_CHR ])):
+                    elif (itype in set([ api.S5_TYPE_BLK, api.S5_TYPE_CHR, api.S5_TYPE_SOCK ])):
                         msg = "{0}".format(itypestr)
                     else:
                         msg = "{0} (INVALID, free inode)".format(itypestr)
@@ -648,7 +650,7 @@ class FsmakerShell(cmd.Cmd):
                 size = options.size
             else:
                 size = options.blocks * api.S5_BLOCK_SIZE
-            self._simdisk.format(options.inodes, size)
+            self._simdisk.format(options.inodes, size, options.journal)
 
         if (options.directory):
             q = Queue.Queue()
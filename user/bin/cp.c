@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <errno.h>
+
+/* Bytes asked of each sendfile() when the copy cannot be a clone */
+#define CP_CHUNK        (1 << 20)
+
+/*
+ * Copies a file. If the file system can, the copy is a clone sharing
+ * the original's blocks, which makes it no more than an inode write;
+ * otherwise the bytes are copied in the kernel with sendfile().
+ */
+int main(int argc, char **argv)
+{
+        int             in, out, n;
+
+        if (argc != 3) {
+                fprintf(stderr, "usage: cp <source> <dest>\n");
+                return 1;
+        }
+
+        if ((in = open(argv[1], O_RDONLY, 0)) < 0) {
+                fprintf(stderr, "cp: unable to open \"%s\": %s\n",
+                        argv[1], strerror(errno));
+                return 1;
+        }
+        if ((out = open(argv[2], O_WRONLY | O_CREAT, 0666)) < 0) {
+                fprintf(stderr, "cp: unable to create \"%s\": %s\n",
+                        argv[2], strerror(errno));
+                close(in);
+                return 1;
+        }
+
+        if (0 == clone_file(in, out)) {
+                close(out);
+                close(in);
+                return 0;
+        }
+        if (EXDEV != errno && EOPNOTSUPP != errno && EINVAL != errno) {
+                fprintf(stderr, "cp: unable to clone \"%s\": %s\n",
+                        argv[1], strerror(errno));
+                close(out);
+                close(in);
+                return 1;
+        }
+
+        while ((n = sendfile(out, in, NULL, CP_CHUNK)) > 0)
+                ;
+        if (n < 0) {
+                fprintf(stderr, "cp: unable to copy \"%s\" to \"%s\": %s\n",
+                        argv[1], argv[2], strerror(errno));
+        }
+        close(out);
+        close(in);
+        return (n < 0) ? 1 : 0;
+}
@@ -114,6 +114,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 /*
  * Editor
@@ -127,6 +128,9 @@
 #define ESIZE   128
 #define GBSIZE  256
 #define NBRA    5
+#define IOBSIZE 8192            /* file reads and writes */
+#define TBSIZE  (32 * 1024 * 1024)      /* room for the text of the lines */
+#define CORESIZE 16384          /* the line table grows this much at a time */
 
 #define CBRA    1
 #define CCHR    2
@@ -171,18 +175,12 @@ int     vflag = 1;
 int     listf;
 int     col;
 char    *globp;
-int     tfile = -1;
+char    *tbuf;
 int     tline;
-char    tfname[] = "/tmp/exxxxx";
+char    iobuf[IOBSIZE];
 char    *loc1;
 char    *loc2;
 char    *locs;
-char    ibuff[512];
-int     iblock = -1;
-char    obuff[512];
-int     oblock = -1;
-int     ichanged;
-int     nleft;
 void    errfunc();
 /* int  *errlab=(int*)errfunc; */
 char    TMPERR[] = "TMP";
@@ -213,9 +211,7 @@ void    dounix();
 void    compile(int c);
 int     execute(int gf, int *addr);
 int     putline();
-char   *getblock(int atl, int iof);
 int     getchar();
-void    blkio(int b, char *buf, void *);
 int     compsub();
 void    dosub();
 char   *place(char *asp, char *al1, char *al2);
@@ -270,7 +266,6 @@ main(int argc, char **argv)
         init();
         /* setexit(); */
         commands();
-        unlink(tfname);
         return 0;
 }
 
@@ -387,7 +382,6 @@ print:
                         case 'q':
                                 setnoaddr();
                                 newline();
-                                unlink(tfname);
                                 exit(0);
 
                         case 'r':
@@ -719,9 +713,9 @@ getfile()
         fp = nextip;
         do {
                 if (--ninbuf < 0) {
-                        if ((ninbuf = read(io, genbuf, LBSIZE) - 1) < 0)
+                        if ((ninbuf = read(io, iobuf, IOBSIZE) - 1) < 0)
                                 return(EOF);
-                        fp = genbuf;
+                        fp = iobuf;
                 }
                 if (lp >= &linebuf[LBSIZE])
                         error;
@@ -744,16 +738,16 @@ putfile()
         register char *fp, *lp;
         register int nib;
 
-        nib = 512;
-        fp = genbuf;
+        nib = IOBSIZE;
+        fp = iobuf;
         a1 = addr1;
         do {
                 lp = getline(*a1++);
                 for (;;) {
                         if (--nib < 0) {
-                                write(io, genbuf, fp - genbuf);
-                                nib = 511;
-                                fp = genbuf;
+                                write(io, iobuf, fp - iobuf);
+                                nib = IOBSIZE - 1;
+                                fp = iobuf;
                         }
                         if (++count[1] == 0)
                                 ++count[0];
@@ -763,7 +757,7 @@ putfile()
                         }
                 }
         } while (a1 <= addr2);
-        write(io, genbuf, fp - genbuf);
+        write(io, iobuf, fp - iobuf);
 }
 
 int
@@ -773,18 +767,14 @@ int *a;
 {
         register int *a1, *a2, *rdot;
         int nline, tl;
-        int *corep = (int *)endcore;
-        struct core {
-                int integer;
-        };
 
         nline = 0;
         dot = a;
         while ((*f)() == 0) {
                 if (dol >= endcore) {
-                        if (sbrk(1024) == (char *) - 1)
+                        if (sbrk(CORESIZE) == (char *) - 1)
                                 error;
-                        *corep += 1024;
+                        endcore = (int *)((char *)endcore + CORESIZE);
                 }
                 tl = putline();
                 nline++;
@@ -841,21 +831,21 @@ delete()
         dot = a1;
 }
 
+/*
+ * The text of the lines is kept in tbuf, which is mapped once and only
+ * has pages behind it as far as it has been written; each entry in the
+ * line table is the offset of its line there. Offsets are even, as
+ * global() marks lines with the low bit.
+ */
 char *
 getline(int tl)
 {
         register char *bp, *lp;
-        register int nl;
 
         lp = linebuf;
-        bp = getblock(tl, READ);
-        nl = nleft;
-        tl &= ~0377;
+        bp = tbuf + (tl & ~01);
         while ((*lp++ = *bp++))
-                if (--nl == 0) {
-                        bp = getblock(tl += 0400, READ);
-                        nl = nleft;
-                }
+                ;
         return(linebuf);
 }
 
@@ -863,92 +853,42 @@ int
 putline()
 {
         register char *bp, *lp;
-        register int nl;
         int tl;
 
         lp = linebuf;
         tl = tline;
-        bp = getblock(tl, WRITE);
-        nl = nleft;
-        tl &= ~0377;
+        if (tl + LBSIZE + 2 > TBSIZE) {
+                puts(TMPERR);
+                error;
+        }
+        bp = tbuf + tl;
         while ((*bp = *lp++)) {
                 if (*bp++ == '\n') {
                         *--bp = 0;
                         linebp = lp;
                         break;
                 }
-                if (--nl == 0) {
-                        bp = getblock(tl += 0400, WRITE);
-                        nl = nleft;
-                }
-        }
-        nl = tline;
-        tline += (((lp - linebuf) + 03) >> 1) & 077776;
-        return(nl);
-}
-
-char *
-getblock(int atl, int iof)
-{
-        register int bno, off;
-
-        bno = (atl >> 8) & 0377;
-        off = (atl << 1) & 0774;
-        if (bno >= 255) {
-                puts(TMPERR);
-                error;
-        }
-        nleft = 512 - off;
-        if (bno == iblock) {
-                ichanged |= iof;
-                return(ibuff + off);
-        }
-        if (bno == oblock)
-                return(obuff + off);
-        if (iof == READ) {
-                if (ichanged)
-                        blkio(iblock, ibuff, (void *)write);
-                ichanged = 0;
-                iblock = bno;
-                blkio(bno, ibuff, (void *)read);
-                return(ibuff + off);
-        }
-        if (oblock >= 0)
-                blkio(oblock, obuff, (void *)write);
-        oblock = bno;
-        return(obuff + off);
-}
-
-void
-blkio(int b, char *buf, void *iofcn)
-{
-        int (*iof)(int f, char * b, int len) =
-                (int( *)(int f, char * b, int len)) iofcn;
-        lseek(tfile, b, SEEK_SET);
-        if ((*iof)(tfile, buf, 512) != 512) {
-                puts(TMPERR);
-                error;
         }
+        tline += ((lp - linebuf) + 1) & ~01;
+        return(tl);
 }
 
 void
 init()
 {
-        register char *p;
-        register int pid;
-
-        close(tfile);
-        tline = 0;
-        iblock = -1;
-        oblock = -1;
-        ichanged = 0;
-        pid = getpid();
-        for (p = &tfname[11]; p > &tfname[6];) {
-                *--p = (pid & 07) + '0';
-                pid >>= 3;
+        if (tbuf == NULL) {
+                tbuf = mmap(NULL, TBSIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANON, -1, 0);
+                if (tbuf == MAP_FAILED) {
+                        tbuf = NULL;
+                        puts(TMPERR);
+                        exit(1);
+                }
+        } else if (tline > 0) {
+                /* nothing refers to the old text any more */
+                madvise(tbuf, tline, MADV_DONTNEED);
         }
-        close(creat(tfname, 0600));
-        tfile = open(tfname, O_RDWR, 0);
+        tline = 0;
         brk(fendcore);
         dot = zero = dol = fendcore;
         endcore = fendcore - 2;
@@ -1458,6 +1398,7 @@ putd()
         putchar(r + '0');
 #else
         printf("%d", count[1]);
+        fflush(stdout);
 #endif
 }
 
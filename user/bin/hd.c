@@ -9,6 +9,91 @@
 
 #define LINE_LEN 16
 
+/* Input is read, and output written, this much at a time */
+#define IN_LEN (4096 * LINE_LEN)
+#define OUT_LEN 16384
+
+/* The longest a line can be: offset, bytes, gap, and the characters */
+#define OUT_LINE (10 + 3 * LINE_LEN + 1 + LINE_LEN + 3)
+
+static const char hexdigits[] = "0123456789abcdef";
+
+/* hex[2 * b] and hex[2 * b + 1] are the digits of b; printable[b] is b
+ * if it can be shown, otherwise '.' */
+static char hex[512];
+static char printable[256];
+
+static char inbuf[IN_LEN];
+static char outbuf[OUT_LEN];
+static int outlen;
+
+static void make_tables(void) {
+  int b;
+  for (b = 0; b < 256; ++b) {
+    hex[2 * b] = hexdigits[b >> 4];
+    hex[2 * b + 1] = hexdigits[b & 0xf];
+    printable[b] = (b < 32 || b > 126) ? '.' : b;
+  }
+}
+
+static void flush_out(void) {
+  int done = 0;
+  while (done < outlen) {
+    int n = write(1, outbuf + done, outlen - done);
+    if (n < 0) {
+      fprintf(stderr, "write: %s\n", strerror(errno));
+      exit(1);
+    }
+    done += n;
+  }
+  outlen = 0;
+}
+
+static void put_offset(char *p, unsigned int off) {
+  int i;
+  for (i = 7; i >= 0; --i) {
+    p[i] = hexdigits[off & 0xf];
+    off >>= 4;
+  }
+}
+
+/* Formats one line of up to LINE_LEN bytes, as it would be with
+ * "%08x  ", "%02x " for each byte and "|%c...|\n" */
+static void put_line(unsigned int off, const unsigned char *line, int bytes) {
+  char *p;
+  int i;
+
+  if (outlen + OUT_LINE > OUT_LEN) {
+    flush_out();
+  }
+  p = outbuf + outlen;
+
+  put_offset(p, off);
+  p += 8;
+  *p++ = ' ';
+  *p++ = ' ';
+  for (i = 0; i < LINE_LEN; ++i) {
+    if (i < bytes) {
+      p[0] = hex[2 * line[i]];
+      p[1] = hex[2 * line[i] + 1];
+    } else {
+      p[0] = p[1] = ' ';
+    }
+    p[2] = ' ';
+    p += 3;
+    if (i == 7) {
+      *p++ = ' ';
+    }
+  }
+  *p++ = '|';
+  for (i = 0; i < bytes; ++i) {
+    *p++ = printable[line[i]];
+  }
+  *p++ = '|';
+  *p++ = '\n';
+  outlen = p - outbuf;
+}
+
 int main(int argc, char **argv) {
   int readfd = 0;
   if (argc == 2) {
@@ -22,50 +107,57 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  make_tables();
+
   char lastbuf[LINE_LEN];
-  char curbuf[LINE_LEN];
-  int off = 0;
+  unsigned int off = 0;
   int lastrep = 0;
+  int have = 0;
+  int eof = 0;
   int bytes;
 
-  int i;
-  while ((bytes = read(readfd, curbuf, LINE_LEN)) > 0) {
-    if (off > 0 && !memcmp(lastbuf, curbuf, LINE_LEN)) {
-      if (!lastrep) {
-        printf("*\n");
-        lastrep = 1;
-      }
-      off += bytes;
-      continue;
-    }
-    lastrep = 0;
-    printf("%08x  ", off);
-    off += bytes;
-    /* print bytes */
-    for (i = 0; i < LINE_LEN; ++i) {
-      if (i < bytes) {
-        printf("%02x ", (unsigned char)curbuf[i]);
-      } else {
-        printf("   ");
-      }
-      if (i == 7) {
-        printf(" ");
+  while (!eof) {
+    /* fill the buffer, so that only the very last line is short */
+    while (have < IN_LEN) {
+      bytes = read(readfd, inbuf + have, IN_LEN - have);
+      if (bytes <= 0) {
+        eof = 1;
+        break;
       }
+      have += bytes;
     }
-    /* show printable characters */
-    printf("|");
-    for (i = 0; i < bytes; ++i) {
-      char c = curbuf[i];
-      if (c < 32 || c > 126) {
-        printf(".");
-      } else {
-        printf("%c",c);
+
+    int pos;
+    for (pos = 0; pos < have; pos += LINE_LEN) {
+      const unsigned char *line = (const unsigned char *)inbuf + pos;
+      int n = (have - pos < LINE_LEN) ? have - pos : LINE_LEN;
+      if (n == LINE_LEN && off > 0 && !memcmp(lastbuf, line, LINE_LEN)) {
+        if (!lastrep) {
+          if (outlen + 2 > OUT_LEN) {
+            flush_out();
+          }
+          outbuf[outlen++] = '*';
+          outbuf[outlen++] = '\n';
+          lastrep = 1;
+        }
+        off += n;
+        continue;
       }
+      lastrep = 0;
+      put_line(off, line, n);
+      off += n;
+      memcpy(lastbuf, line, n);
     }
-    printf("|\n");
-    memcpy(lastbuf, curbuf, LINE_LEN);
+    have = 0;
+  }
+
+  if (outlen + 9 > OUT_LEN) {
+    flush_out();
   }
-  printf("%08x\n", off);
+  put_offset(outbuf + outlen, off);
+  outbuf[outlen + 8] = '\n';
+  outlen += 9;
+  flush_out();
 
   if (readfd > 0) {
     close(readfd);
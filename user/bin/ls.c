@@ -7,18 +7,18 @@
 
 #include <errno.h>
 
+/* Each getdents_plus() fills as much of this as the directory has left,
+ * which is a few hundred entries */
+static union {
+        dirent_plus_t   dirent;
+        char            buf[16384];
+} lsb;
+
 static int do_ls(const char *dir)
 {
         int             fd;
-        struct dirent   *dirent;
+        dirent_plus_t   *dirent;
         int             nbytes;
-        char            tmpbuf[256];
-        struct stat     sbuf;
-
-        union {
-                struct dirent   dirent;
-                char            buf[4096];
-        } lsb;
 
         fd = open(dir, O_RDONLY, 0600);
         if (fd < 0) {
@@ -28,32 +28,22 @@ static int do_ls(const char *dir)
                 return 1;
         }
 
-        while ((nbytes = getdents(fd, &lsb.dirent, sizeof(lsb))) > 0) {
-                dirent = &lsb.dirent;
-
-                if (nbytes % sizeof(struct dirent)) {
+        /* the sizes come along with the names, so there is nothing to
+         * stat() */
+        while ((nbytes = getdents_plus(fd, &lsb.dirent, sizeof(lsb))) > 0) {
+                if (nbytes % sizeof(dirent_plus_t)) {
                         fprintf(stderr,
-                                "ls: incorrect return value from getdents (%d):"
-                                " not a multiple of sizeof(struct dirent) (%d)\n",
-                                nbytes, sizeof(struct dirent));
+                                "ls: incorrect return value from getdents_plus (%d):"
+                                " not a multiple of sizeof(dirent_plus_t) (%d)\n",
+                                nbytes, sizeof(dirent_plus_t));
                         return 1;
                 }
-                do {
-                        int reclen;
-                        int size;
-
-                        snprintf(tmpbuf, 256, "%s/%s", dir, dirent->d_name);
-                        if (0 == stat(tmpbuf, &sbuf))
-                                size = sbuf.st_size;
-                        else
-                                size = 0;
-
-                        reclen = sizeof(struct dirent);
+                for (dirent = &lsb.dirent; nbytes; dirent++) {
                         fprintf(stdout, "%7d  %-20s   %d\n",
-                                size, dirent->d_name, dirent->d_ino);
-                        dirent = (struct dirent *)(((char *)dirent) + reclen);
-                        nbytes -= reclen;
-                } while (nbytes);
+                                dirent->dp_size, dirent->dp_dirent.d_name,
+                                dirent->dp_dirent.d_ino);
+                        nbytes -= sizeof(dirent_plus_t);
+                }
         }
         if (nbytes < 0) {
                 if (errno == ENOTDIR)
@@ -14,6 +14,7 @@
 #include <sys/mman.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdarg.h>
 
 #define ROOT            "/"
 
@@ -21,7 +22,8 @@
 #define TMP             ROOT "tmp"
 
 #define ARGV_MAX        256
-#define REDIR_MAX       10
+#define REDIR_MAX       12      /* room for a pipeline's two as well */
+#define PIPE_MAX        16      /* commands in a pipeline */
 
 typedef struct redirect {
         int             r_sfd;
@@ -63,6 +65,14 @@ DECL_CMD(sync);
 DECL_CMD(check);
 DECL_CMD(repeat);
 DECL_CMD(parallel);
+DECL_CMD(hash);
+DECL_CMD(true);
+DECL_CMD(false);
+DECL_CMD(test);
+DECL_CMD(printf);
+DECL_CMD(pwd);
+DECL_CMD(read);
+DECL_CMD(set);
 
 typedef struct {
         const char      *cmd_name;
@@ -72,6 +82,7 @@ typedef struct {
 
 static cmd_t builtin_cmds[] = {
         { "?",        cmd_help,     "list shell commands" },
+        { "[",        cmd_test,     "evaluate an expression" },
         { "cat",      cmd_cat,      "display file" },
         { "env",      cmd_env,      "display environment"},
         { "cd",       cmd_cd,       "change directory" },
@@ -80,14 +91,22 @@ static cmd_t builtin_cmds[] = {
         { "cp",       cmd_cp,       "copy file" },
         { "echo",     cmd_echo,     "print arguments" },
         { "exit",     cmd_exit,     "exit shell" },
+        { "false",    cmd_false,    "do nothing, unsuccessfully" },
+        { "hash",     cmd_hash,     "remember or forget where commands are" },
         { "help",     cmd_help,     "list shell commands" },
         { "ln",       cmd_ln,       "link file" },
         { "mkdir",    cmd_mkdir,    "create a directory" },
         { "mv",       cmd_mv,       "move file" },
+        { "printf",   cmd_printf,   "print formatted arguments" },
+        { "pwd",      cmd_pwd,      "print working directory" },
         { "quit",     cmd_exit,     "exit shell" },
+        { "read",     cmd_read,     "read a line into variables" },
         { "rm",       cmd_rm,       "remove file(s)" },
         { "rmdir",    cmd_rmdir,    "remove a directory" },
+        { "set",      cmd_set,      "set shell options" },
         { "sync",     cmd_sync,     "sync filesystems" },
+        { "test",     cmd_test,     "evaluate an expression" },
+        { "true",     cmd_true,     "do nothing, successfully" },
         { "repeat",   cmd_repeat,   "repeat a command" },
         { "parallel", cmd_parallel, "run multiple commands in parallel" },
         { NULL,       NULL,         NULL }
@@ -99,6 +118,26 @@ static cmd_t builtin_cmds[] = {
 
 #define is_std_stream(fd) ((fd) >= 0 && (fd) <= 2)
 
+/* Writes to the builtin's standard stream fd, wherever it has been
+ * redirected to, which stdout and stderr know nothing about */
+static void io_printf(ioenv_t *io, int fd, const char *fmt, ...)
+        __attribute__((__format__(printf, 3, 4)));
+
+static void io_printf(ioenv_t *io, int fd, const char *fmt, ...)
+{
+        char            buf[1024];
+        va_list         args;
+        int             len;
+
+        va_start(args, fmt);
+        len = vsnprintf(buf, sizeof(buf), fmt, args);
+        va_end(args);
+        if (len > (int)sizeof(buf) - 1)
+                len = sizeof(buf) - 1;
+        if (len > 0)
+                write(io->io_map_fd[fd], buf, len);
+}
+
 DECL_CMD(chk_sparse);
 DECL_CMD(chk_unlink);
 DECL_CMD(chk_wrnoent);
@@ -784,6 +823,14 @@ static int do_cp(ioenv_t *io, const char *cmd,
         if (is_std_stream(out_fd))
                 out_fd = io->io_map_fd[out_fd];
 
+        /* Let the kernel copy without the data coming up here; whatever
+         * it cannot do is left to the loop below, which says what went
+         * wrong */
+        while ((nbytes_in = sendfile(out_fd, in_fd, NULL, 16 * buffer_sz)) > 0)
+                ;
+        if (0 == nbytes_in)
+                return 1;
+
         while ((nbytes_in = read(in_fd, buffer, buffer_sz)) > 0) {
                 if ((nbytes_out = write(out_fd, buffer, nbytes_in)) < 0) {
                         fprintf(stderr,
@@ -846,9 +893,9 @@ DECL_CMD(echo)
 {
         int                     argn;
 
-        for (argn = 2; argn < argc; argn++)
-                fprintf(stdout, "%s ", argv[argn - 1]);
-        fprintf(stdout, "%s\n", argv[argn - 1]);
+        for (argn = 1; argn < argc; argn++)
+                io_printf(io, 1, "%s%s", argv[argn], (argn < argc - 1) ? " " : "");
+        io_printf(io, 1, "\n");
         return 0;
 }
 
@@ -1015,6 +1062,39 @@ DECL_CMD(help)
         return 0;
 }
 
+/* The working directory, as cd has been told it; there are no symbolic
+ * links to make that differ from where it really is */
+static char sh_cwd[256] = "/";
+
+static void cwd_update(const char *dir)
+{
+        char            path[sizeof(sh_cwd)], out[sizeof(sh_cwd)];
+        char            *comp, *slash;
+        size_t          len;
+
+        out[0] = '\0';
+        if ('/' != dir[0] && strcmp(sh_cwd, "/"))
+                strcpy(out, sh_cwd);
+        strncpy(path, dir, sizeof(path) - 1);
+        path[sizeof(path) - 1] = '\0';
+
+        for (comp = strtok(path, "/"); NULL != comp; comp = strtok(NULL, "/")) {
+                if (!strcmp(comp, "."))
+                        continue;
+                if (!strcmp(comp, "..")) {
+                        if (NULL != (slash = strrchr(out, '/')))
+                                *slash = '\0';
+                        continue;
+                }
+                len = strlen(out);
+                if (len + 1 + strlen(comp) >= sizeof(out))
+                        break;
+                out[len] = '/';
+                strcpy(out + len + 1, comp);
+        }
+        strcpy(sh_cwd, ('\0' == out[0]) ? "/" : out);
+}
+
 DECL_CMD(cd)
 {
         const char      *dir;
@@ -1034,9 +1114,436 @@ DECL_CMD(cd)
                         dir, strerror(errno));
                 return 1;
         }
+        cwd_update(dir);
+        return 0;
+}
+
+DECL_CMD(pwd)
+{
+        io_printf(io, 1, "%s\n", sh_cwd);
+        return 0;
+}
+
+/*
+ * Where external commands were found along the PATH, so that running one
+ * again needs no search, and one which does not exist is caught before
+ * forking. Commands found through a relative directory of PATH (such as
+ * ".") are not remembered, since they would be somewhere else after a cd.
+ */
+#define DEFAULT_PATH    ".:/usr/bin:/bin"
+#define CMDHASH_BUCKETS 32
+#define CMDPATH_MAX     256
+
+typedef struct cmdhash_ent {
+        struct cmdhash_ent      *ch_next;
+        int                     ch_hits;
+        char                    *ch_name;
+        char                    ch_path[CMDPATH_MAX];
+} cmdhash_ent_t;
+
+static cmdhash_ent_t *cmdhash[CMDHASH_BUCKETS];
+
+static unsigned int cmdhash_bucket(const char *name)
+{
+        unsigned int            h = 0;
+
+        while (*name)
+                h = h * 31 + (unsigned char)*name++;
+        return h % CMDHASH_BUCKETS;
+}
+
+static const char *sh_path(void)
+{
+        char                    **ep;
+
+        for (ep = my_envp; NULL != ep && NULL != *ep; ep++) {
+                if (!strncmp(*ep, "PATH=", 5))
+                        return *ep + 5;
+        }
+        return DEFAULT_PATH;
+}
+
+static void cmdhash_forget(const char *name)
+{
+        cmdhash_ent_t           **pp, *ch;
+
+        for (pp = &cmdhash[cmdhash_bucket(name)]; NULL != (ch = *pp); pp = &ch->ch_next) {
+                if (!strcmp(ch->ch_name, name)) {
+                        *pp = ch->ch_next;
+                        free(ch);
+                        return;
+                }
+        }
+}
+
+static void cmdhash_clear(void)
+{
+        cmdhash_ent_t           *ch;
+        int                     i;
+
+        for (i = 0; i < CMDHASH_BUCKETS; i++) {
+                while (NULL != (ch = cmdhash[i])) {
+                        cmdhash[i] = ch->ch_next;
+                        free(ch);
+                }
+        }
+}
+
+/*
+ * Finds where to run name from, in a buffer of CMDPATH_MAX bytes: name
+ * itself if it has a slash in it, otherwise the first regular file called
+ * name in a directory of PATH. Returns 0, or -1 if there is none; *hashed
+ * is set if path came from the hash or has just been put in it.
+ */
+static int cmd_resolve(const char *name, char *path, int *hashed)
+{
+        cmdhash_ent_t           *ch;
+        const char              *dir, *end;
+        struct stat             st;
+        size_t                  len, namelen = strlen(name);
+        unsigned int            b;
+
+        *hashed = 0;
+        if (NULL != strchr(name, '/')) {
+                if (namelen >= CMDPATH_MAX)
+                        return -1;
+                strcpy(path, name);
+                return 0;
+        }
+
+        b = cmdhash_bucket(name);
+        for (ch = cmdhash[b]; NULL != ch; ch = ch->ch_next) {
+                if (!strcmp(ch->ch_name, name)) {
+                        ch->ch_hits++;
+                        strcpy(path, ch->ch_path);
+                        *hashed = 1;
+                        return 0;
+                }
+        }
+
+        for (dir = sh_path(); ; dir = end + 1) {
+                if (NULL == (end = strchr(dir, ':')))
+                        end = dir + strlen(dir);
+                len = end - dir;
+                /* an empty element is the current directory */
+                if (len + 1 + namelen < CMDPATH_MAX) {
+                        memcpy(path, dir, len);
+                        if (0 < len)
+                                path[len++] = '/';
+                        strcpy(path + len, name);
+                        if (0 == stat(path, &st) && S_ISREG(st.st_mode)) {
+                                if ('/' == dir[0]
+                                    && NULL != (ch = malloc(sizeof(*ch) + namelen + 1))) {
+                                        ch->ch_name = (char *)(ch + 1);
+                                        strcpy(ch->ch_name, name);
+                                        strcpy(ch->ch_path, path);
+                                        ch->ch_hits = 1;
+                                        ch->ch_next = cmdhash[b];
+                                        cmdhash[b] = ch;
+                                        *hashed = 1;
+                                }
+                                return 0;
+                        }
+                }
+                if ('\0' == *end)
+                        return -1;
+        }
+}
+
+DECL_CMD(hash)
+{
+        cmdhash_ent_t           *ch;
+        char                    path[CMDPATH_MAX];
+        int                     i, hashed, ret = 0;
+
+        if (argc == 2 && !strcmp(argv[1], "-r")) {
+                cmdhash_clear();
+                return 0;
+        }
+        if (argc == 1) {
+                fprintf(stdout, "hits    command\n");
+                for (i = 0; i < CMDHASH_BUCKETS; i++) {
+                        for (ch = cmdhash[i]; NULL != ch; ch = ch->ch_next)
+                                fprintf(stdout, "%4d    %s\n", ch->ch_hits, ch->ch_path);
+                }
+                return 0;
+        }
+        for (i = 1; i < argc; i++) {
+                if ('-' == argv[i][0]) {
+                        fprintf(stderr, "usage: hash [-r] [command ...]\n");
+                        return 1;
+                }
+                /* look again, in case it has moved */
+                cmdhash_forget(argv[i]);
+                if (0 > cmd_resolve(argv[i], path, &hashed)) {
+                        fprintf(stderr, "sh: hash: %s: not found\n", argv[i]);
+                        ret = 1;
+                }
+        }
+        return ret;
+}
+
+/* Whether the last command of a pipeline runs in the shell if it is a
+ * builtin, rather than in a process of its own; see set */
+static int sh_lastpipe = 1;
+
+/* The environment has to be copied before it can grow; the strings of
+ * the one we started with are not ours to free */
+static int sh_envp_owned;
+
+/* Sets name=value in the environment commands are run with */
+static int sh_setenv(const char *name, const char *value)
+{
+        size_t                  nlen = strlen(name);
+        char                    *ent, **nenv;
+        int                     i, n;
+
+        if (NULL == (ent = malloc(nlen + strlen(value) + 2)))
+                return -1;
+        strcpy(ent, name);
+        ent[nlen] = '=';
+        strcpy(ent + nlen + 1, value);
+
+        /* where commands are found may have changed */
+        if (!strcmp(name, "PATH"))
+                cmdhash_clear();
+
+        for (n = 0; NULL != my_envp && NULL != my_envp[n]; n++) {
+                if (!strncmp(my_envp[n], name, nlen) && '=' == my_envp[n][nlen]) {
+                        my_envp[n] = ent;
+                        return 0;
+                }
+        }
+        if (NULL == (nenv = malloc((n + 2) * sizeof(*nenv)))) {
+                free(ent);
+                return -1;
+        }
+        for (i = 0; i < n; i++)
+                nenv[i] = my_envp[i];
+        nenv[n] = ent;
+        nenv[n + 1] = NULL;
+        if (sh_envp_owned)
+                free(my_envp);
+        my_envp = nenv;
+        sh_envp_owned = 1;
+        return 0;
+}
+
+DECL_CMD(true)
+{
+        return 0;
+}
+
+DECL_CMD(false)
+{
+        return 1;
+}
+
+/* These return 0 if the test holds, 1 if it does not, 2 if it makes no sense */
+static int test_unary(const char *op, const char *arg)
+{
+        struct stat             st;
+
+        if (!strcmp(op, "-n"))
+                return '\0' == arg[0];
+        if (!strcmp(op, "-z"))
+                return '\0' != arg[0];
+        if (!strcmp(op, "-e"))
+                return 0 != stat(arg, &st);
+        if (!strcmp(op, "-f"))
+                return 0 != stat(arg, &st) || !S_ISREG(st.st_mode);
+        if (!strcmp(op, "-d"))
+                return 0 != stat(arg, &st) || !S_ISDIR(st.st_mode);
+        if (!strcmp(op, "-s"))
+                return 0 != stat(arg, &st) || 0 == st.st_size;
+        return 2;
+}
+
+static int test_binary(const char *a, const char *op, const char *b)
+{
+        long                    x, y;
+
+        if (!strcmp(op, "="))
+                return 0 != strcmp(a, b);
+        if (!strcmp(op, "!="))
+                return 0 == strcmp(a, b);
+        x = strtol(a, NULL, 10);
+        y = strtol(b, NULL, 10);
+        if (!strcmp(op, "-eq"))
+                return !(x == y);
+        if (!strcmp(op, "-ne"))
+                return !(x != y);
+        if (!strcmp(op, "-lt"))
+                return !(x < y);
+        if (!strcmp(op, "-le"))
+                return !(x <= y);
+        if (!strcmp(op, "-gt"))
+                return !(x > y);
+        if (!strcmp(op, "-ge"))
+                return !(x >= y);
+        return 2;
+}
+
+DECL_CMD(test)
+{
+        char                    **args = &argv[1];
+        int                     nargs = argc - 1, neg = 0, ret;
+
+        if (!strcmp(argv[0], "[")) {
+                if (argc < 2 || strcmp(argv[argc - 1], "]")) {
+                        fprintf(stderr, "[: missing ]\n");
+                        return 2;
+                }
+                nargs--;
+        }
+        if (0 < nargs && !strcmp(args[0], "!")) {
+                neg = 1;
+                args++;
+                nargs--;
+        }
+
+        switch (nargs) {
+                case 0:
+                        ret = 1;
+                        break;
+                case 1:
+                        ret = '\0' == args[0][0];
+                        break;
+                case 2:
+                        ret = test_unary(args[0], args[1]);
+                        break;
+                case 3:
+                        ret = test_binary(args[0], args[1], args[2]);
+                        break;
+                default:
+                        ret = 2;
+        }
+        if (2 == ret) {
+                fprintf(stderr, "%s: bad expression\n", argv[0]);
+                return 2;
+        }
+        return neg ? !ret : ret;
+}
+
+DECL_CMD(printf)
+{
+        char                    out[1024], spec[32];
+        const char              *f, *arg;
+        int                     len = 0, sl, argn = 2;
+
+        if (argc < 2) {
+                fprintf(stderr, "usage: printf <format> [args ...]\n");
+                return 1;
+        }
+
+        for (f = argv[1]; *f && len < (int)sizeof(out) - 1; f++) {
+                if ('\\' == *f && f[1]) {
+                        f++;
+                        out[len++] = ('n' == *f) ? '\n' : ('t' == *f) ? '\t' : *f;
+                        continue;
+                }
+                if ('%' != *f) {
+                        out[len++] = *f;
+                        continue;
+                }
+                if ('%' == f[1]) {
+                        out[len++] = *++f;
+                        continue;
+                }
+
+                /* the flags and width go to snprintf along with the
+                 * conversion */
+                sl = 0;
+                spec[sl++] = *f++;
+                while (*f && strchr("-+ #0123456789.", *f) && sl < (int)sizeof(spec) - 2)
+                        spec[sl++] = *f++;
+                if (!*f)
+                        break;
+                spec[sl++] = *f;
+                spec[sl] = '\0';
+                arg = (argn < argc) ? argv[argn++] : "";
+
+                switch (*f) {
+                        case 's':
+                                len += snprintf(out + len, sizeof(out) - len, spec, arg);
+                                break;
+                        case 'c':
+                                len += snprintf(out + len, sizeof(out) - len, spec, arg[0]);
+                                break;
+                        case 'd':
+                        case 'i':
+                        case 'u':
+                        case 'x':
+                        case 'X':
+                                len += snprintf(out + len, sizeof(out) - len, spec,
+                                                (int)strtol(arg, NULL, 0));
+                                break;
+                        default:
+                                fprintf(stderr, "printf: bad conversion %s\n", spec);
+                                return 1;
+                }
+                if (len > (int)sizeof(out) - 1)
+                        len = sizeof(out) - 1;
+        }
+        if (len > 0)
+                write(io->io_map_fd[1], out, len);
+        return 0;
+}
+
+DECL_CMD(read)
+{
+        char                    line[1024], *p, *val;
+        int                     len = 0, got = 0, argn;
+        char                    c;
+
+        /* a byte at a time, so that what follows the line is left for
+         * whoever reads next */
+        while (len < (int)sizeof(line) - 1 && 1 == read(io->io_map_fd[0], &c, 1)) {
+                got = 1;
+                if ('\n' == c)
+                        break;
+                line[len++] = c;
+        }
+        line[len] = '\0';
+        if (!got)
+                return 1;
+
+        if (1 == argc)
+                return 0 > sh_setenv("REPLY", line);
+
+        /* a word each, and the rest of the line to the last name */
+        p = line;
+        for (argn = 1; argn < argc; argn++) {
+                while (isspace(*p))
+                        p++;
+                val = p;
+                if (argn < argc - 1) {
+                        while (*p && !isspace(*p))
+                                p++;
+                        if (*p)
+                                *p++ = '\0';
+                }
+                if (0 > sh_setenv(argv[argn], val))
+                        return 1;
+        }
         return 0;
 }
 
+DECL_CMD(set)
+{
+        if (1 == argc) {
+                io_printf(io, 1, "lastpipe        %s\n", sh_lastpipe ? "on" : "off");
+                return 0;
+        }
+        if (3 == argc && !strcmp(argv[2], "lastpipe")
+            && (!strcmp(argv[1], "-o") || !strcmp(argv[1], "+o"))) {
+                sh_lastpipe = ('-' == argv[1][0]);
+                return 0;
+        }
+        fprintf(stderr, "usage: set [-o|+o lastpipe]\n");
+        return 1;
+}
+
 DECL_CMD(repeat)
 {
         long            ntimes;
@@ -1203,52 +1710,186 @@ static int builtin_exec(cmd_t *cmd, int argc, char *argv[], ioenv_t *io)
         return (*cmd->cmd_func)(argc, argv, io);
 }
 
-static int execute(int argc, char *argv[], redirect_map_t *map)
+static cmd_t *find_builtin(const char *name)
 {
-        int             status, pid;
         cmd_t           *cmd;
 
         for (cmd = builtin_cmds; cmd->cmd_name; cmd++) {
-                if (!strcmp(cmd->cmd_name, argv[0]))
-                        break;
+                if (!strcmp(cmd->cmd_name, name))
+                        return cmd;
         }
-        if (cmd->cmd_name) {
-                ioenv_t io;
+        return NULL;
+}
 
-                build_ioenv(map, &io);
-                status = builtin_exec(cmd, argc, argv, &io);
-                destroy_ioenv(&io);
-                cleanup_redirects(map);
-                return 0;
+static int sh_wait(int pid)
+{
+        int             status;
+
+        if (0 > waitpid(pid, 0, &status))
+                return -1;
+        if (status == EFAULT) {
+                fprintf(stderr, "sh: child process accessed invalid memory\n");
+        }
+        return status;
+}
+
+/* Set by a vforked child which could not exec, for the parent to see */
+static int sh_exec_errno;
+
+/*
+ * Starts a command in a process of its own with map applied, and returns
+ * its pid, or -1 if it could not be started; the caller waits for it and
+ * cleans up map. closefd, unless it is -1, is closed in the child: the
+ * read end of the pipe it writes to. Buffered output must have been
+ * flushed, or a forked builtin would write it again.
+ */
+static int spawn(int argc, char *argv[], redirect_map_t *map, int closefd)
+{
+        int             pid, hashed;
+        cmd_t           *cmd;
+        char            path[CMDPATH_MAX];
+
+        if (NULL != (cmd = find_builtin(argv[0]))) {
+                /* it has to run alongside the rest of the pipeline, but
+                 * needs no exec */
+                if (!(pid = fork())) {
+                        redirect_map_t  none;
+                        ioenv_t         io;
+
+                        if (do_redirect(map) < 0)
+                                exit(1);
+                        if (0 <= closefd)
+                                close(closefd);
+                        none.rm_nfds = 0;
+                        build_ioenv(&none, &io);
+                        exit(builtin_exec(cmd, argc, argv, &io));
+                }
+                if (0 > pid)
+                        fprintf(stderr, "sh: fork failed errno = %d\n", errno);
+                return pid;
+        }
+
+        if (0 > cmd_resolve(argv[0], path, &hashed)) {
+                fprintf(stderr, "sh: command not found: %s\n", argv[0]);
+                return -1;
         }
 
-        if (!(pid = fork())) {
+        /* The child only redirects and execs, so it can borrow our address
+         * space instead of copying it. Until it execs it must not return
+         * from here or run our atexit handlers, hence _exit(). We do not
+         * run again until it has done one or the other, so what it leaves
+         * in sh_exec_errno is there to be seen when vfork returns. */
+        sh_exec_errno = 0;
+        if (!(pid = vfork())) {
                 if (do_redirect(map) < 0)
-                        exit(1);
-
-                execve(argv[0], argv, my_envp);
-                if (errno == ENOENT) {
-                        char buf[256];
-                        snprintf(buf, 255, "/usr/bin/%s", argv[0]);
-                        execve(buf, argv, my_envp);
-                        fprintf(stderr, "sh: command not found: %s\n", argv[0]);
-                } else
-                        fprintf(stderr, "sh: exec failed for %s: %s\n",
-                                argv[0], strerror(errno));
-                exit(1);
+                        _exit(1);
+                if (0 <= closefd)
+                        close(closefd);
+
+                execve(path, argv, my_envp);
+                sh_exec_errno = errno;
+                _exit(1);
         } else {
                 if (0 > pid) {
                         fprintf(stderr, "sh: fork failed errno = %d\n", errno);
+                } else if (0 != sh_exec_errno) {
+                        fprintf(stderr, "sh: exec failed for %s: %s\n",
+                                path, strerror(sh_exec_errno));
+                        /* it was removed since it was found */
+                        if (hashed && ENOENT == sh_exec_errno)
+                                cmdhash_forget(argv[0]);
                 }
         }
+        return pid;
+}
+
+static int execute(int argc, char *argv[], redirect_map_t *map)
+{
+        int             status = -1, pid;
+        cmd_t           *cmd;
+
+        if (NULL != (cmd = find_builtin(argv[0]))) {
+                ioenv_t io;
+
+                build_ioenv(map, &io);
+                status = builtin_exec(cmd, argc, argv, &io);
+                destroy_ioenv(&io);
+                cleanup_redirects(map);
+                return status;
+        }
 
+        fflush(NULL);
+        pid = spawn(argc, argv, map, -1);
         cleanup_redirects(map);
-        int ret = wait(&status);
-        if (status == EFAULT) {
-                fprintf(stderr, "sh: child process accessed invalid memory\n");
+        if (0 < pid)
+                status = sh_wait(pid);
+        return status;
+}
+
+/*
+ * Runs cmd1 | cmd2 | ..., each command with its own redirects applied
+ * after the pipes, so that they win. With lastpipe set, a builtin at the
+ * end runs in the shell while the rest run in processes of their own, so
+ * that "ls | wc" forks once and "ls | read x" actually sets x. Returns
+ * the status of the last command.
+ */
+static int pipeline(int n, int argcs[], char **argvs[], redirect_map_t maps[])
+{
+        int             pids[PIPE_MAX], npids = 0, lastpid = -1;
+        int             i, ii, in = -1, pfd[2], status = -1;
+        cmd_t           *cmd;
+
+        fflush(NULL);
+        for (i = 0; i < n; i++) {
+                redirect_map_t  map;
+                int             last = (n - 1 == i);
+
+                pfd[0] = pfd[1] = -1;
+                if (!last && 0 > pipe(pfd)) {
+                        fprintf(stderr, "sh: pipe failed: %s\n", strerror(errno));
+                        for (; i < n; i++)
+                                cleanup_redirects(&maps[i]);
+                        if (0 <= in)
+                                close(in);
+                        break;
+                }
+
+                map.rm_nfds = 0;
+                if (0 <= in)
+                        add_redirect(&map, in, 0);
+                if (!last)
+                        add_redirect(&map, pfd[1], 1);
+                for (ii = 0; ii < maps[i].rm_nfds; ii++)
+                        add_redirect(&map, maps[i].rm_redir[ii].r_sfd,
+                                     maps[i].rm_redir[ii].r_dfd);
+                in = pfd[0];
+
+                if (last && sh_lastpipe && NULL != (cmd = find_builtin(argvs[i][0]))) {
+                        ioenv_t io;
+
+                        build_ioenv(&map, &io);
+                        status = builtin_exec(cmd, argcs[i], argvs[i], &io);
+                        destroy_ioenv(&io);
+                        /* whatever it did not read is the writer's problem */
+                        cleanup_redirects(&map);
+                        continue;
+                }
+
+                pids[npids] = spawn(argcs[i], argvs[i], &map, pfd[0]);
+                cleanup_redirects(&map);
+                if (0 < pids[npids]) {
+                        if (last)
+                                lastpid = pids[npids];
+                        npids++;
+                }
         }
 
-        return ret;
+        for (i = 0; i < npids; i++) {
+                ii = sh_wait(pids[i]);
+                if (pids[i] == lastpid)
+                        status = ii;
+        }
+        return status;
 }
 
 #define sh_isredirect(ch) ((ch) == '>' || (ch) == '<')
@@ -1475,52 +2116,90 @@ static int parse_redirects(char *line, redirect_map_t *map)
         return 0;
 }
 
-static void parse(char *line)
+/* Splits s into words in argv, at most max - 1 of them and then NULL,
+ * and returns how many there were */
+static int tokenize(char *s, char *argv[], int max)
 {
-        char            *argv[ARGV_MAX];
-        int             argc;
-        char            *tmp;
-        int             len;
-        redirect_map_t  map;
+        int             argc = 0;
 
-        argc = 0;
-        tmp = line;
-
-        len = strlen(line);
-        if (line[len - 1] == '\n')
-                line[len - 1] = 0;
-
-        if (parse_redirects(line, &map) < 0)
-                return;
-
-        for (;;) {
+        while (argc < max - 1) {
                 /* Ignore leading whitespace.
                 */
-                while (*tmp && isspace(*tmp))
-                        tmp++;
-                if (!*tmp)
+                while (*s && isspace(*s))
+                        s++;
+                if (!*s)
                         break;
 
-                argv[argc++] = tmp;
+                argv[argc++] = s;
 
                 /* Token is everything up to trailing whitespace.
                 */
-                while (*tmp && !isspace(*tmp))
-                        tmp++;
-                if (!*tmp)
+                while (*s && !isspace(*s))
+                        s++;
+                if (!*s)
                         break;
 
                 /* Null-terminate token.
                 */
-                *tmp++ = 0;
+                *s++ = 0;
         }
 
         argv[argc] = NULL;
+        return argc;
+}
+
+static void parse(char *line)
+{
+        char            *argv[ARGV_MAX];
+        char            **argvs[PIPE_MAX];
+        int             argcs[PIPE_MAX];
+        redirect_map_t  maps[PIPE_MAX];
+        char            *cmd, *bar;
+        int             argc, ncmds, i, len;
+
+        len = strlen(line);
+        if (line[len - 1] == '\n')
+                line[len - 1] = 0;
+
+        /* the commands of a pipeline, each with its own redirects */
+        argc = 0;
+        ncmds = 0;
+        for (cmd = line; ; cmd = bar + 1) {
+                if (NULL != (bar = strchr(cmd, '|')))
+                        *bar = 0;
+                if (PIPE_MAX == ncmds) {
+                        fprintf(stderr, "sh: too many commands in pipeline\n");
+                        goto fail;
+                }
+                if (parse_redirects(cmd, &maps[ncmds]) < 0)
+                        goto fail;
+                argvs[ncmds] = &argv[argc];
+                argcs[ncmds] = tokenize(cmd, &argv[argc], ARGV_MAX - argc);
+                argc += argcs[ncmds] + 1;
+                ncmds++;
+                if (NULL == bar)
+                        break;
+        }
 
-        if (!argc)
+        if (1 == ncmds) {
+                if (argcs[0])
+                        execute(argcs[0], argvs[0], &maps[0]);
+                else
+                        cleanup_redirects(&maps[0]);
                 return;
+        }
+        for (i = 0; i < ncmds; i++) {
+                if (!argcs[i]) {
+                        fprintf(stderr, "sh: empty command in pipeline\n");
+                        goto fail;
+                }
+        }
+        pipeline(ncmds, argcs, argvs, maps);
+        return;
 
-        execute(argc, argv, &map);
+fail:
+        for (i = 0; i < ncmds; i++)
+                cleanup_redirects(&maps[i]);
 }
 
 static char linebuf[1024];
@@ -19,6 +19,8 @@ const char *modestr(int mode) {
     return "Regular file";
   case S_IFLNK:
     return "Symbolic link";
+  case S_IFSOCK:
+    return "Socket";
   default:
     return "Unknown";
   }
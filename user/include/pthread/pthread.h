@@ -8,6 +8,9 @@ typedef struct pthread          *pthread_t;
 typedef struct pthread_mutex    *pthread_mutex_t;
 typedef struct pthread_cond     *pthread_cond_t;
 
+/* What a cancelled thread returns to pthread_join */
+#define PTHREAD_CANCELED        ((void *) -1)
+
 /* Attributes NYI */
 typedef int pthread_attr_t;
 typedef int pthread_mutexattr_t;
@@ -5,8 +5,13 @@
 #include "stdarg.h"
 #include "sys/types.h"
 
-/* Output not buffered */
-#define __IONBF 1
+/* Buffering modes for setvbuf() */
+#define _IOFBF  0               /* write when the buffer fills */
+#define _IOLBF  1               /* and at each newline */
+#define _IONBF  2               /* write each call at once */
+
+/* The size of stdout's buffer */
+#define BUFSIZ  4096
 
 #ifndef EOF
 #define EOF     (-1)
@@ -16,8 +21,21 @@
 #define NULL    0
 #endif
 
-/* For now, just store a file descriptor */
-typedef int FILE;
+/*
+ * Only the three standard streams exist; there is no fopen(). stdout is
+ * line buffered on a tty and fully buffered anywhere else, stderr is not
+ * buffered, and nothing reads through stdin. What is buffered is written
+ * out by fflush(), exit() and fork(), but not by vfork() or _exit(), so
+ * flush before those. Streams are not locked: threads which share one
+ * must keep out of each other's way.
+ */
+typedef struct __file {
+        int     f_fd;
+        int     f_mode;         /* _IO?BF, or -1 until the first write */
+        char   *f_buf;
+        size_t  f_size;
+        size_t  f_len;          /* bytes in f_buf not yet written */
+} FILE;
 typedef off_t fpos_t;
 extern FILE *stdin;
 extern FILE *stdout;
@@ -35,6 +53,12 @@ int sprintf(char *buf, const char *fmt, ...)
         __attribute__((__nonnull__(2)));
 
 int fflush(FILE *stream);
+int setvbuf(FILE *stream, char *buf, int mode, size_t size);
+void setbuf(FILE *stream, char *buf);
+
+int fputc(int c, FILE *stream);
+int fputs(const char *s, FILE *stream);
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream);
 
 int vprintf(const char *fmt, va_list args)
         __attribute__((__format__(printf, 1, 0)))
@@ -0,0 +1 @@
+../../../kernel/include/proc/affinity.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../kernel/include/proc/ioprio.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../kernel/include/proc/resource.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../kernel/include/net/socket.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../kernel/include/fs/uio.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../kernel/include/fs/uring.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../kernel/include/drivers/tty/termios.h
\ No newline at end of file
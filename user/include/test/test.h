@@ -37,3 +37,27 @@ typedef void (*test_pass_func_t)(int val, const char *file, int line, const char
 typedef void (*test_fail_func_t)(const char *file, int line, const char *name, const char *fmt, va_list args);
 
 int _test_assert(int val, const char *file, int line, const char *name, const char *fmt, ...);
+
+/*
+ * Latency histograms, for the benchmark modes of the tests. There are
+ * TEST_HIST_SUB buckets for each power of two of nanoseconds, so a
+ * percentile is good to within a quarter of itself however long the
+ * operations take, and the histograms of several workers can simply be
+ * added together.
+ */
+#define TEST_HIST_SUB           4
+#define TEST_HIST_BUCKETS       (64 * TEST_HIST_SUB)
+
+typedef struct test_hist {
+        uint32_t        th_count;
+        uint64_t        th_total_ns;
+        uint64_t        th_max_ns;
+        uint32_t        th_buckets[TEST_HIST_BUCKETS];
+} test_hist_t;
+
+uint64_t test_now_ns(void);
+void test_hist_add(test_hist_t *h, uint64_t ns);
+void test_hist_merge(test_hist_t *to, const test_hist_t *from);
+
+/* An upper bound on the pct'th percentile of what h has seen, 0 if nothing */
+uint64_t test_hist_percentile(const test_hist_t *h, int pct);
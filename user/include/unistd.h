@@ -14,9 +14,13 @@
 #endif
 
 struct dirent;
+struct dirent_plus;
+struct syscall_stat;
+struct proc_stat;
 
 /* User exec-related */
 int     fork(void);
+int     vfork(void);
 int     execl(const char *filename, const char *arg, ...); /* NYI */
 int     execle(const char *filename, const char *arg, ...); /* NYI */
 int     execv(const char *filename, char *const argv[]); /* NYI */
@@ -32,16 +36,30 @@ void    thr_set_errno(int n);
 void    yield(void);
 pid_t   getpid(void);
 int     halt(void);
+int     usleep(unsigned int usec);
+unsigned int sleep(unsigned int seconds);
 void    sync(void);
+int     fsync(int fd);
+int     fdatasync(int fd);
+int     fadvise(int fd, off_t offset, off_t len, int advice);
+int     fallocate(int fd, int mode, off_t offset, off_t len);
 
 size_t  get_free_mem(void);
+int     syscall_stats(struct syscall_stat *buf, int count);
+int     proc_stats(struct proc_stat *buf, int count);
+int     kmem_census(char *buf, size_t len);
 
 /* VFS-related */
 int     open(const char *filename, int flags, int mode);
 int     close(int fd);
 int     read(int fd, void *buf, size_t nbytes);
 int     write(int fd, const void *buf, size_t nbytes);
+int     pread(int fd, void *buf, size_t nbytes, off_t offset);
+int     pwrite(int fd, const void *buf, size_t nbytes, off_t offset);
+int     sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+int     clone_file(int src_fd, int dst_fd);
 off_t   lseek(int fd, off_t offset, int whence);
+int     ioctl(int fd, int request, void *arg);
 int     dup(int fd);
 int     dup2(int ofd, int nfd);
 int     mkdir(const char *path, int mode);
@@ -51,12 +69,20 @@ int     link(const char *to, const char *from);
 int     rename(const char *oldname, const char *newname);
 int     chdir(const char *path);
 int     getdents(int fd, struct dirent *dir, size_t size);
+int     getdents_plus(int fd, struct dirent_plus *dir, size_t size);
 int     stat(const char *path, struct stat *buf);
+int     fstatat(int dirfd, const char *path, struct stat *buf);
 int     pipe(int pipefd[2]);
 
 /* VM-related */
 void    *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off);
 int     munmap(void *addr, size_t len);
+int     msync(void *addr, size_t len, int flags);
+int     madvise(void *addr, size_t len, int advice);
+int     mlock(const void *addr, size_t len);
+int     munlock(const void *addr, size_t len);
+int     shm_open(const char *name, int oflag, int mode);
+int     shm_unlink(const char *name);
 int     brk(void *addr);
 void    *sbrk(int incr);
 
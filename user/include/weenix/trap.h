@@ -7,19 +7,47 @@
 
 #define TRAP_INTR_STRING QUOTE(INTR_SYSCALL)
 
-static inline int trap(uint32_t num, uint32_t arg)
+/* Whether system calls enter with sysenter rather than int $INTR_SYSCALL:
+ * 1 if so, 0 if not, and -1 until __trap_sysenter_detect() has asked the
+ * processor. */
+extern int __trap_sysenter;
+int __trap_sysenter_detect(void);
+
+static inline int __trap(uint32_t num, uint32_t arg)
 {
         int ret;
-        __asm__ volatile(
-                "int $" TRAP_INTR_STRING
-                : "=a"(ret)
-                : "a"(num), "d"(arg)
-        );
-        /* Copy in errno */
-        __asm__ volatile(
-                "int $" TRAP_INTR_STRING
-                : "=a"(errno)
-                : "a"(SYS_errno)
-        );
+        if (__trap_sysenter > 0 || (__trap_sysenter < 0 && __trap_sysenter_detect())) {
+                /* the kernel returns to the address in %esi with the stack
+                 * pointer in %ecx, and uses %edx for the return address */
+                __asm__ volatile(
+                        "call 1f\n"
+                        "1:\n\t"
+                        "popl %%esi\n\t"
+                        "addl $2f-1b, %%esi\n\t"
+                        "movl %%esp, %%ecx\n\t"
+                        "sysenter\n"
+                        "2:\n"
+                        : "=a"(ret), "+d"(arg)
+                        : "a"(num)
+                        : "ecx", "esi", "memory"
+                );
+        } else {
+                __asm__ volatile(
+                        "int $" TRAP_INTR_STRING
+                        : "=a"(ret)
+                        : "a"(num), "d"(arg)
+                        : "memory"
+                );
+        }
+        return ret;
+}
+
+static inline int trap(uint32_t num, uint32_t arg)
+{
+        int ret = __trap(num, arg);
+        /* Copy in errno; every system call returns -1 when it fails */
+        if (-1 == ret) {
+                errno = __trap(SYS_errno, 0);
+        }
         return ret;
 }
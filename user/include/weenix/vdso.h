@@ -0,0 +1 @@
+../../../kernel/include/api/vdso.h
\ No newline at end of file
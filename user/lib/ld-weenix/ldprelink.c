@@ -0,0 +1,361 @@
+/*
+ *  File: ldprelink.c
+ *  Desc: A persistent cache of symbol resolutions and relocated pages
+ *
+ * Looking up every relocation's symbol through the hash chains of each
+ * module is most of what the linker does at start-up, and it comes out
+ * the same every time the same libraries land at the same addresses.
+ * Run with LD_PRELINK_SAVE set (which is what /sbin/prelink does), the
+ * linker writes what each lookup returned to a file in PRELINK_DIR named
+ * by the executable's fingerprint, and exits without starting the program.
+ * Later runs which find that file, and whose modules are all where they
+ * were and unchanged, replay it instead of looking anything up.
+ *
+ * Where every relocation of a module lands in its writable segments, the
+ * file also holds those segments as they were once relocated. Such a
+ * module is not relocated at all: its segments are mapped privately from
+ * the file instead, so every process running the program shares the same
+ * relocated pages in the page cache until it writes to one of them.
+ *
+ * The file holds a fingerprint of each module's symbol, string and
+ * relocation tables rather than of the whole file, which is everything
+ * the lookups depend on; the addends of a module which is replayed
+ * rather than mapped are still read from the module itself.
+ */
+
+#include "sys/types.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "sys/mman.h"
+
+#include "ldtypes.h"
+#include "ldresolve.h"
+#include "ldutil.h"
+
+#ifndef PRELINK_DIR
+#define PRELINK_DIR "/lib/prelink"
+#endif
+
+#define PRELINK_MAGIC   0x4b4e4c50      /* "PLNK" */
+
+#define H_nchain        1
+
+typedef struct prelink_hdr_t {
+        uint32_t        ph_magic;
+        uint32_t        ph_bind_now;    /* PLT relocations were bound too */
+        uint32_t        ph_pagesize;
+        uint32_t        ph_nmod;        /* prelink_mod_t which follow */
+        uint32_t        ph_nsym;        /* then prelink_sym_t */
+} prelink_hdr_t;
+
+typedef struct prelink_mod_t {
+        uint32_t        pm_base;
+        uint32_t        pm_print;
+        uint32_t        pm_nsym;        /* this module's prelink_sym_t */
+        uint32_t        pm_pages;       /* offset of its segments, or 0 */
+} prelink_mod_t;
+
+/* One lookup */
+typedef struct prelink_sym_t {
+        uint32_t        ps_value;
+        uint32_t        ps_size;
+} prelink_sym_t;
+
+static const char *err_prelink =
+        "ld.so.1: panic - unable to write prelink cache \"%s\"\n";
+static const char *err_premap =
+        "ld.so.1: panic - failure to map prelinked section of length 0x%x at 0x%x\n";
+
+static int              saving;
+static char             cache_path[64];
+static int              pagesz;
+
+
+static uint32_t _ldprint_bytes(uint32_t h, const void *p, size_t len)
+{
+        const unsigned char *c = p;
+        while (len--) {
+                h ^= *c++;
+                h *= 16777619;
+        }
+        return h;
+}
+
+/* Fingerprints everything about a module that a symbol lookup, the list
+ * of lookups its relocations make, or where they write, depends on. */
+static uint32_t _ldprint(module_t *mod)
+{
+        uint32_t h = 2166136261u;
+
+        if (mod->hash && mod->dynsym) {
+                h = _ldprint_bytes(h, mod->dynsym,
+                                   mod->hash[H_nchain] * sizeof(Elf32_Sym));
+        }
+        if (mod->dynstr) {
+                h = _ldprint_bytes(h, mod->dynstr, mod->strsz);
+        }
+        if (mod->reloc) {
+                h = _ldprint_bytes(h, mod->reloc, mod->nreloc * sizeof(Elf32_Rel));
+        }
+        if (mod->pltreloc) {
+                h = _ldprint_bytes(h, mod->pltreloc,
+                                   mod->npltreloc * sizeof(Elf32_Rel));
+        }
+        if (mod->nwrseg > 0) {
+                h = _ldprint_bytes(h, mod->wrseg, mod->nwrseg * sizeof(ldseg_t));
+        }
+        return h;
+}
+
+static int _ldprelink_count(module_t *first)
+{
+        int n = 0;
+        for (; first; first = first->next)
+                n++;
+        return n;
+}
+
+static int _ldinwrseg(module_t *mod, Elf32_Addr addr)
+{
+        int i;
+        for (i = 0; i < mod->nwrseg; i++) {
+                if (addr >= mod->wrseg[i].addr &&
+                    addr + sizeof(Elf32_Addr) <= mod->wrseg[i].addr + mod->wrseg[i].len)
+                        return 1;
+        }
+        return 0;
+}
+
+/* Whether once relocated mod can be mapped from the cache as it is */
+static int _ldsnapshotable(module_t *mod)
+{
+        int i;
+
+        if (mod->nwrseg <= 0)
+                return 0;
+        for (i = 0; i < mod->nwrseg; i++) {
+                if (!(mod->wrseg[i].prot & PROT_READ))
+                        return 0;
+        }
+        for (i = 0; i < mod->nreloc; i++) {
+                if (!_ldinwrseg(mod, mod->base + mod->reloc[i].r_offset))
+                        return 0;
+        }
+        for (i = 0; i < mod->npltreloc; i++) {
+                if (!_ldinwrseg(mod, mod->base + mod->pltreloc[i].r_offset))
+                        return 0;
+        }
+        return 1;
+}
+
+/* Maps mod's relocated segments from offset off of the cache on fd. */
+static void _ldmapsnapshot(module_t *mod, int fd, uint32_t off)
+{
+        int i;
+
+        for (i = 0; i < mod->nwrseg; i++) {
+                ldseg_t *seg = &mod->wrseg[i];
+                if (mmap((void *)seg->addr, seg->len, seg->prot,
+                         MAP_PRIVATE | MAP_FIXED, fd, off) == MAP_FAILED) {
+                        printf(err_premap, seg->len, seg->addr);
+                        exit(1);
+                }
+                off += seg->len;
+        }
+
+        /* The GOT's own entries point into this run of the linker */
+        if (mod->pltgot)
+                _ldpltgot_init(mod);
+        mod->prelinked = 1;
+}
+
+/* Maps the cache at the named path and checks it was made for exactly
+ * this set of modules; sets up replay if so. */
+static void _ldprelink_load(module_t *first, const char *path)
+{
+        const prelink_hdr_t     *hdr;
+        const prelink_mod_t     *pm;
+        const prelink_sym_t     *ps;
+        module_t                *mod;
+        off_t                   len;
+        int                     fd;
+
+        if (0 > (fd = open(path, O_RDONLY, 0)))
+                return;
+        len = lseek(fd, 0, SEEK_END);
+        if (len < (off_t)sizeof(*hdr)) {
+                close(fd);
+                return;
+        }
+        hdr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (hdr == MAP_FAILED) {
+                close(fd);
+                return;
+        }
+
+        if (hdr->ph_magic != PRELINK_MAGIC
+            || hdr->ph_bind_now != (uint32_t)_ldenv.ld_bind_now
+            || hdr->ph_pagesize != (uint32_t)pagesz
+            || hdr->ph_nmod != (uint32_t)_ldprelink_count(first)
+            || (off_t)(sizeof(*hdr) + hdr->ph_nmod * sizeof(*pm)
+                       + hdr->ph_nsym * sizeof(*ps)) > len) {
+                goto stale;
+        }
+
+        pm = (const prelink_mod_t *)(hdr + 1);
+        for (mod = first; mod; mod = mod->next, pm++) {
+                if (pm->pm_base != mod->base || pm->pm_print != _ldprint(mod))
+                        goto stale;
+        }
+
+        pm = (const prelink_mod_t *)(hdr + 1);
+        ps = (const prelink_sym_t *)(pm + hdr->ph_nmod);
+        for (mod = first; mod; mod = mod->next, pm++) {
+                if (pm->pm_pages) {
+                        _ldmapsnapshot(mod, fd, pm->pm_pages);
+                } else {
+                        mod->plsyms = (void *)ps;
+                        mod->plnsym = pm->pm_nsym;
+                        mod->plpos = 0;
+                }
+                ps += pm->pm_nsym;
+        }
+        close(fd);
+        return;
+
+stale:
+        munmap((void *)hdr, len);
+        close(fd);
+}
+
+
+/* Called once every module is mapped and linked, before relocating any
+ * of them, to either replay or record the lookups that will follow. */
+void _ldprelink_open(module_t *first, int pagesize)
+{
+        pagesz = pagesize;
+        snprintf(cache_path, sizeof(cache_path), "%s/%08x", PRELINK_DIR,
+                 (unsigned int)_ldprint(first));
+
+        if (_ldenv.ld_prelink_save)
+                saving = 1;
+        else
+                _ldprelink_load(first, cache_path);
+}
+
+/* What the relocation code calls instead of _ldresolve. */
+ldsym_t _ldprelink_resolve(module_t *module, const char *name,
+                           Elf32_Word *size, int copy)
+{
+        prelink_sym_t   *ps;
+        ldsym_t         sym;
+
+        if (!saving && module->plpos < module->plnsym) {
+                ps = (prelink_sym_t *)module->plsyms + module->plpos++;
+                if (size)
+                        *size = ps->ps_size;
+                return (ldsym_t)ps->ps_value;
+        }
+
+        Elf32_Word symsize = 0;
+        sym = _ldresolve(module, name, -1, &symsize, copy);
+        if (size)
+                *size = symsize;
+
+        if (saving) {
+                /* The program is not run when saving, so the linker can
+                 * have the heap */
+                if (module->plnsym == module->plpos) {
+                        module->plpos = module->plpos ? 2 * module->plpos : 64;
+                        module->plsyms = realloc(module->plsyms,
+                                                 module->plpos * sizeof(*ps));
+                        if (!module->plsyms) {
+                                printf(err_prelink, cache_path);
+                                exit(1);
+                        }
+                }
+                ps = (prelink_sym_t *)module->plsyms + module->plnsym++;
+                ps->ps_value = (uint32_t)sym;
+                ps->ps_size = symsize;
+        }
+        return sym;
+}
+
+static void _ldprelink_write(int fd, const void *buf, size_t len)
+{
+        if ((int)len != write(fd, buf, len)) {
+                printf(err_prelink, cache_path);
+                exit(1);
+        }
+}
+
+/* Called after the relocations. When saving this writes out the cache
+ * and exits: prelinking does not run the program. */
+void _ldprelink_close(module_t *first)
+{
+        static const char zero[64];
+        prelink_hdr_t   hdr;
+        prelink_mod_t   pm;
+        module_t        *mod;
+        uint32_t        off, pad;
+        int             fd, i;
+
+        if (!saving)
+                return;
+
+        (void) mkdir(PRELINK_DIR, 0);
+        (void) unlink(cache_path);
+        if (0 > (fd = open(cache_path, O_WRONLY | O_CREAT, 0))) {
+                printf(err_prelink, cache_path);
+                exit(1);
+        }
+
+        hdr.ph_magic = PRELINK_MAGIC;
+        hdr.ph_bind_now = _ldenv.ld_bind_now;
+        hdr.ph_pagesize = pagesz;
+        hdr.ph_nmod = _ldprelink_count(first);
+        hdr.ph_nsym = 0;
+        for (mod = first; mod; mod = mod->next)
+                hdr.ph_nsym += mod->plnsym;
+        _ldprelink_write(fd, &hdr, sizeof(hdr));
+
+        /* The relocated segments follow the lookups, page aligned so that
+         * they can be mapped */
+        off = sizeof(hdr) + hdr.ph_nmod * sizeof(pm)
+              + hdr.ph_nsym * sizeof(prelink_sym_t);
+        pad = ((off + pagesz - 1) & ~(pagesz - 1)) - off;
+        off += pad;
+        for (mod = first; mod; mod = mod->next) {
+                pm.pm_base = mod->base;
+                pm.pm_print = _ldprint(mod);
+                pm.pm_nsym = mod->plnsym;
+                pm.pm_pages = 0;
+                if (_ldsnapshotable(mod)) {
+                        pm.pm_pages = off;
+                        for (i = 0; i < mod->nwrseg; i++)
+                                off += mod->wrseg[i].len;
+                }
+                _ldprelink_write(fd, &pm, sizeof(pm));
+        }
+        for (mod = first; mod; mod = mod->next) {
+                if (mod->plnsym)
+                        _ldprelink_write(fd, mod->plsyms,
+                                         mod->plnsym * sizeof(prelink_sym_t));
+        }
+
+        for (; pad > sizeof(zero); pad -= sizeof(zero))
+                _ldprelink_write(fd, zero, sizeof(zero));
+        _ldprelink_write(fd, zero, pad);
+        for (mod = first; mod; mod = mod->next) {
+                if (!_ldsnapshotable(mod))
+                        continue;
+                for (i = 0; i < mod->nwrseg; i++)
+                        _ldprelink_write(fd, (void *)mod->wrseg[i].addr,
+                                         mod->wrseg[i].len);
+        }
+        close(fd);
+        exit(0);
+}
@@ -123,7 +123,7 @@ void _ldrelocobj(module_t *module)
                                 *addr += base;
                                 break;
                         case R_386_COPY:
-                                symbol = _ldresolve(module, name, -1, &size, 1);
+                                symbol = _ldprelink_resolve(module, name, &size, 1);
                                 /* memcpy: symbol to addr */
                                 char *dest = (char *) addr;
                                 char *src = (char *) symbol;
@@ -134,7 +134,7 @@ void _ldrelocobj(module_t *module)
                                 /* TODO this never actually gets called; it's overwritten by the
                                  * calls to _ldrelocplt and _ldbindnow */
                         case R_386_JMP_SLOT:
-                                symbol = _ldresolve(module, name, -1, &size, 0);
+                                symbol = _ldprelink_resolve(module, name, &size, 0);
                                 if (symbol == 0) {
                                         /* HUH? */
                                         return;
@@ -143,7 +143,7 @@ void _ldrelocobj(module_t *module)
                                 *(uint32_t *) addr = (uint32_t) symbol;
                                 break;
                         case R_386_GLOB_DAT:
-                                symbol = _ldresolve(module, name, -1, 0, 0);
+                                symbol = _ldprelink_resolve(module, name, 0, 0);
                                 if (symbol == 0) {
                                         /* HUH? */
                                         return;
@@ -152,7 +152,7 @@ void _ldrelocobj(module_t *module)
                                 break;
                                 /* For non-PIC (requires modifying text) */
                         case R_386_32:
-                                symbol = _ldresolve(module, name, -1, 0, 0);
+                                symbol = _ldprelink_resolve(module, name, 0, 0);
                                 if (symbol == 0) {
                                         /* HUH? */
                                         return;
@@ -160,7 +160,7 @@ void _ldrelocobj(module_t *module)
                                 *addr += (Elf32_Addr) symbol;
                                 break;
                         case R_386_PC32:
-                                symbol = _ldresolve(module, name, -1, 0, 0);
+                                symbol = _ldprelink_resolve(module, name, 0, 0);
                                 if (symbol == 0) {
                                         /* HUH? */
                                         return;
@@ -216,7 +216,7 @@ _ldbindnow(module_t *mod)
                 addr = (Elf32_Addr *)(mod->base + rel[i].r_offset);
 
                 if (sym && type == R_386_JMP_SLOT) {
-                        symbol = _ldresolve(mod, name, -1, 0, 0);
+                        symbol = _ldprelink_resolve(mod, name, 0, 0);
                         *addr = (Elf32_Addr)symbol;
                 }
         }
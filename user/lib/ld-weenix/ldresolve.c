@@ -14,43 +14,105 @@
 #define H_nchain        1
 #define H_bucket        2
 
-/* This function looks up the specified symbol in the specified
- * module.  If the symbol is present, it returns the symbol's index in
- * the dynamic symbol table, otherwise STN_UNDEF is returned. */
+#define G_nbucket       0
+#define G_symoffset     1
+#define G_bloomsize     2
+#define G_bloomshift    3
+#define G_bloom         4
+
+/* Lazily bound PLT entries remembered, a power of two */
+#define LD_SYMCACHE     64
+
+/* A name being looked up, with its hashes worked out once for all the
+ * modules it is looked up in. */
+typedef struct ldname_t {
+        const char      *name;
+        unsigned long   gnuhash;
+        unsigned long   elfhash;
+        int             haselfhash;
+} ldname_t;
+
+typedef struct ldcache_t {
+        const char      *name;
+        unsigned long   hash;           /* gnu hash of name */
+        ldsym_t         sym;
+} ldcache_t;
 
-int _ldlookup(module_t *module, const char *name)
+static ldcache_t symcache[LD_SYMCACHE];
+
+static void _ldname_init(ldname_t *n, const char *name)
+{
+        n->name = name;
+        n->gnuhash = _ldgnuhash(name);
+        n->haselfhash = 0;
+}
+
+/* Looks name up through a DT_GNU_HASH table. The Bloom filter turns most
+ * modules which do not define the name away without touching a chain,
+ * and the chains hold the rest of each symbol's hash, so strcmp is only
+ * reached for a likely match. */
+
+static int _ldgnulookup(module_t *module, ldname_t *n)
+{
+        const Elf32_Word *gh = module->gnuhash;
+        const Elf32_Word *bloom = gh + G_bloom;
+        const Elf32_Word *bucket = bloom + gh[G_bloomsize];
+        const Elf32_Word *chain = bucket + gh[G_nbucket];
+        unsigned long   h = n->gnuhash;
+        Elf32_Word      word, mask;
+        unsigned long   y;
+
+        word = bloom[(h / 32) % gh[G_bloomsize]];
+        mask = (1u << (h % 32)) | (1u << ((h >> gh[G_bloomshift]) % 32));
+        if ((word & mask) != mask)
+                return STN_UNDEF;
+
+        y = bucket[h % gh[G_nbucket]];
+        if (y < gh[G_symoffset])
+                return STN_UNDEF;
+
+        for (;;) {
+                Elf32_Word ch = chain[y - gh[G_symoffset]];
+                if ((ch | 1) == (h | 1) &&
+                    !strcmp(module->dynstr + module->dynsym[y].st_name, n->name))
+                        return y;
+                if (ch & 1)
+                        return STN_UNDEF;
+                y++;
+        }
+}
+
+static int _ldlookup_name(module_t *module, ldname_t *n)
 {
         unsigned long   hashval;
         unsigned long   y;
 
-        hashval = _ldelfhash(name);
-        hashval %= module->hash[H_nbucket];
+        if (module->gnuhash)
+                return _ldgnulookup(module, n);
+
+        if (!n->haselfhash) {
+                n->elfhash = _ldelfhash(n->name);
+                n->haselfhash = 1;
+        }
+        hashval = n->elfhash % module->hash[H_nbucket];
 
         y = module->hash[H_bucket + hashval];
 
         while ((y != STN_UNDEF) &&
-               strcmp(module->dynstr + module->dynsym[y].st_name, name)) {
+               strcmp(module->dynstr + module->dynsym[y].st_name, n->name)) {
                 y = module->hash[H_bucket + module->hash[H_nbucket] + y];
         }
 
         return y;
 }
 
-
-/* This looks up the specified symbol in the given module, subject to
- * the provided binding and type restrictions (a value of -1 will
- * function as a wildcard for both the 'binding' and 'type'
- * parameters).  The symbol's size will be placed in the memory
- * location pointed to by 'size', if it is non-null.  0 is returned if
- * a symbol matching all the requirements is not found. */
-
-ldsym_t _ldsymbol(module_t *module, const char *name, int binding, int type,
-                  Elf32_Word *size)
+static ldsym_t _ldsymbol_name(module_t *module, ldname_t *n, int binding,
+                              int type, Elf32_Word *size)
 {
         int     result;
 
         /* LINTED */
-        if (((result = _ldlookup(module, name)) != STN_UNDEF) &&
+        if (((result = _ldlookup_name(module, n)) != STN_UNDEF) &&
             ((binding < 0) ||
              (ELF32_ST_BIND(module->dynsym[result].st_info) == binding)) &&
             ((type < 0) ||
@@ -65,17 +127,11 @@ ldsym_t _ldsymbol(module_t *module, const char *name, int binding, int type,
         return 0;
 }
 
+/* The global and then weak passes of _ldresolve, which do not depend on
+ * which module is asking unless it is excluded. */
 
-/* Given a module and a symbol name, this function attempts to find the
- * symbol through the process' link chain.  It first checks for its
- * presence as a global symbol, then as a weak symbol, and finally as a
- * local symbol in the specified module.  A type restriction can be
- * specified, and if 'size' is non-null, the memory location to which
- * it points will hold the size of the resolved symbol.  0 is returned
- * if the symbol cannot be found. */
-
-ldsym_t _ldresolve(module_t *module, const char *name, int type,
-                   Elf32_Word *size, int exclude)
+static ldsym_t _ldresolve_global(module_t *module, ldname_t *n, int type,
+                                 Elf32_Word *size, int exclude)
 {
         module_t        *curmod;
         ldsym_t         sym;
@@ -84,7 +140,7 @@ ldsym_t _ldresolve(module_t *module, const char *name, int type,
 
         while (curmod) {
                 if (!exclude || curmod != module) {
-                        if ((sym = _ldsymbol(curmod, name, STB_GLOBAL, type, size)))
+                        if ((sym = _ldsymbol_name(curmod, n, STB_GLOBAL, type, size)))
                                 return sym;
                 }
                 curmod = curmod->next;
@@ -92,20 +148,91 @@ ldsym_t _ldresolve(module_t *module, const char *name, int type,
 
         curmod = module->first;
         while (curmod) {
-                if ((sym = _ldsymbol(curmod, name, STB_WEAK, type, size)))
+                if ((sym = _ldsymbol_name(curmod, n, STB_WEAK, type, size)))
                         return sym;
                 curmod = curmod->next;
         }
 
-        return _ldsymbol(module, name, STB_LOCAL, type, size);
+        return 0;
+}
+
+
+/* This function looks up the specified symbol in the specified
+ * module.  If the symbol is present, it returns the symbol's index in
+ * the dynamic symbol table, otherwise STN_UNDEF is returned. */
+
+int _ldlookup(module_t *module, const char *name)
+{
+        ldname_t        n;
+
+        _ldname_init(&n, name);
+        return _ldlookup_name(module, &n);
 }
 
+
+/* This looks up the specified symbol in the given module, subject to
+ * the provided binding and type restrictions (a value of -1 will
+ * function as a wildcard for both the 'binding' and 'type'
+ * parameters).  The symbol's size will be placed in the memory
+ * location pointed to by 'size', if it is non-null.  0 is returned if
+ * a symbol matching all the requirements is not found. */
+
+ldsym_t _ldsymbol(module_t *module, const char *name, int binding, int type,
+                  Elf32_Word *size)
+{
+        ldname_t        n;
+
+        _ldname_init(&n, name);
+        return _ldsymbol_name(module, &n, binding, type, size);
+}
+
+
+/* Given a module and a symbol name, this function attempts to find the
+ * symbol through the process' link chain.  It first checks for its
+ * presence as a global symbol, then as a weak symbol, and finally as a
+ * local symbol in the specified module.  A type restriction can be
+ * specified, and if 'size' is non-null, the memory location to which
+ * it points will hold the size of the resolved symbol.  0 is returned
+ * if the symbol cannot be found. */
+
+ldsym_t _ldresolve(module_t *module, const char *name, int type,
+                   Elf32_Word *size, int exclude)
+{
+        ldname_t        n;
+        ldsym_t         sym;
+
+        _ldname_init(&n, name);
+        if ((sym = _ldresolve_global(module, &n, type, size, exclude)))
+                return sym;
+
+        return _ldsymbol_name(module, &n, STB_LOCAL, type, size);
+}
+
+/* Binds a PLT entry on its first call (from _ld_bind). Many modules call
+ * the same functions, so what the global passes find is remembered by
+ * name for the next module to bind it. */
+
 Elf32_Addr _rtresolve(module_t *mod, Elf32_Word reloff)
 {
         Elf32_Rel      *rel = (void *)((Elf32_Addr)mod->pltreloc + reloff);
         int             sym = ELF32_R_SYM(rel->r_info);
         const char     *name = mod->dynstr + mod->dynsym[sym].st_name;
-        ldsym_t         symbol = _ldresolve(mod, name, -1, 0, 0);
+        ldname_t        n;
+        ldcache_t      *c;
+        ldsym_t         symbol;
+
+        _ldname_init(&n, name);
+        c = &symcache[n.gnuhash & (LD_SYMCACHE - 1)];
+        if (c->name && c->hash == n.gnuhash &&
+            (c->name == name || !strcmp(c->name, name))) {
+                symbol = c->sym;
+        } else if ((symbol = _ldresolve_global(mod, &n, -1, 0, 0))) {
+                c->name = name;
+                c->hash = n.gnuhash;
+                c->sym = symbol;
+        } else {
+                symbol = _ldsymbol_name(mod, &n, STB_LOCAL, -1, 0);
+        }
         *(Elf32_Addr *)(mod->base + rel->r_offset) = (Elf32_Addr)symbol;
         return (Elf32_Addr)symbol;
 }
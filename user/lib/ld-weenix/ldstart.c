@@ -56,6 +56,47 @@ ldenv_t _ldenv;
 #define round_page(x) (((x) + pagesize - 1) & ~(pagesize - 1))
 
 
+static int _ldsegprot(Elf32_Phdr *phdr, int textrel)
+{
+        int perms = 0;
+
+        if (phdr->p_flags & PF_R)
+                perms |= PROT_READ;
+        if (phdr->p_flags & PF_W)
+                perms |= PROT_WRITE;
+        if (phdr->p_flags & PF_X)
+                perms |= PROT_EXEC;
+
+        /* Check if read-only sections will need relocation */
+        if (textrel)
+                perms |= PROT_WRITE;
+
+        return perms;
+}
+
+/* Notes a segment of module, loaded at baseaddr, which relocation can
+ * write to, for the prelink cache to keep a copy of. */
+
+static void _ldaddwrseg(module_t *module, unsigned long baseaddr,
+                        Elf32_Phdr *phdr, int textrel)
+{
+        int prot = _ldsegprot(phdr, textrel);
+        ldseg_t *seg;
+
+        if (!(prot & PROT_WRITE) || module->nwrseg < 0)
+                return;
+        if (module->nwrseg == LD_MAXWRSEG) {
+                module->nwrseg = -1;
+                return;
+        }
+
+        seg = &module->wrseg[module->nwrseg++];
+        seg->addr = trunc_page(baseaddr + phdr->p_vaddr);
+        seg->len = round_page(baseaddr + phdr->p_vaddr + phdr->p_memsz) - seg->addr;
+        seg->prot = prot;
+}
+
+
 static const char *_ldgetenv(const char *var)
 {
         char **e = env;
@@ -80,6 +121,9 @@ static void _ldenv_init(char **environ)
         if (_ldgetenv("LD_DEBUG")) {
                 _ldenv.ld_debug = 1;
         }
+        if (_ldgetenv("LD_PRELINK_SAVE")) {
+                _ldenv.ld_prelink_save = 1;
+        }
         _ldenv.ld_preload = _ldgetenv("LD_PRELOAD");
         _ldenv.ld_library_path = _ldgetenv("LD_LIBRARY_PATH");
 }
@@ -115,12 +159,18 @@ static module_t *_ldlinkobj(module_t *info, char *baseaddr, Elf32_Dyn *dyn)
                         case DT_HASH:
                                 info->hash = (void *)(info->base + curdyn->d_un.d_ptr);
                                 break;
+                        case DT_GNU_HASH:
+                                info->gnuhash = (void *)(info->base + curdyn->d_un.d_ptr);
+                                break;
                         case DT_SYMTAB:
                                 info->dynsym = (void *)(info->base + curdyn->d_un.d_ptr);
                                 break;
                         case DT_STRTAB:
                                 info->dynstr = (char *)(info->base + curdyn->d_un.d_ptr);
                                 break;
+                        case DT_STRSZ:
+                                info->strsz = curdyn->d_un.d_val;
+                                break;
                         case DT_JMPREL:
                                 info->pltreloc = (void *)(info->base + curdyn->d_un.d_ptr);
                                 break;
@@ -289,18 +339,7 @@ void _ldmapsect(int fd, unsigned long baseaddr, Elf32_Phdr *phdr, int textrel)
         uintptr_t file_addr = trunc_page(offset);
         uintptr_t map_len;
         uintptr_t copy_len;
-        int perms = 0;
-
-        if (phdr->p_flags & PF_R)
-                perms |= PROT_READ;
-        if (phdr->p_flags & PF_W)
-                perms |= PROT_WRITE;
-        if (phdr->p_flags & PF_X)
-                perms |= PROT_EXEC;
-
-        /* Check if read-only sections will need relocation */
-        if (textrel)
-                perms |= PROT_WRITE;
+        int perms = _ldsegprot(phdr, textrel);
 
         if (memsz > filsz) {
                 map_len = trunc_page(offset + filsz) - file_addr;
@@ -418,9 +457,10 @@ void _ldloadobj(module_t *module)
         } while (curdyn.d_tag != DT_NULL);
 
         for (i = 0; i < hdr->e_phnum; i++) {
-                if (phdr[i].p_type == PT_LOAD)
+                if (phdr[i].p_type == PT_LOAD) {
                         _ldmapsect(fd, (unsigned long)loc - bottom, phdr + i, textrel);
-                else if (phdr[i].p_type == PT_DYNAMIC)
+                        _ldaddwrseg(module, (unsigned long)loc - bottom, phdr + i, textrel);
+                } else if (phdr[i].p_type == PT_DYNAMIC)
                         dyn = (Elf32_Dyn *)(loc + phdr[i].p_vaddr);
         }
         munmap(hdr, pagesize);
@@ -486,6 +526,10 @@ ldinit_t _ldstart(char **environ, auxv_t *auxv)
                         break;
                 }
         }
+        for (i = 0; i < abuf[AT_PHNUM]; i++) {
+                if (phdr[i].p_type == PT_LOAD)
+                        _ldaddwrseg(_ldfirst, 0, phdr + i, 0);
+        }
 
         curmod = _ldfirst->next;
         while (curmod) {
@@ -493,6 +537,10 @@ ldinit_t _ldstart(char **environ, auxv_t *auxv)
                 curmod = curmod->next;
         }
 
+        /* Replay the symbol lookups below from a prelink cache, if there
+         * is one for this set of modules, or record them into one */
+        _ldprelink_open(_ldfirst, pagesize);
+
         /* Perform all necessary relocations */
         /* We relocate the current module (executable) last, as it is the only one that will
          * contain R_386_COPY entries, and we need to make sure the things being
@@ -500,25 +548,31 @@ ldinit_t _ldstart(char **environ, auxv_t *auxv)
          * to copying */
         curmod = _ldfirst->next; /* Assume at least one module... */
         while (curmod) {
-                _ldrelocobj(curmod);
+                if (!curmod->prelinked)
+                        _ldrelocobj(curmod);
                 curmod = curmod->next;
         }
-        _ldrelocobj(_ldfirst);
+        if (!_ldfirst->prelinked)
+                _ldrelocobj(_ldfirst);
 
         curmod = _ldfirst;
         while (curmod) {
-                _ldrelocplt(curmod);
+                if (!curmod->prelinked)
+                        _ldrelocplt(curmod);
                 curmod = curmod->next;
         }
 
         if (_ldenv.ld_bind_now) {
                 curmod = _ldfirst;
                 while (curmod) {
-                        _ldbindnow(curmod);
+                        if (!curmod->prelinked)
+                                _ldbindnow(curmod);
                         curmod = curmod->next;
                 }
         }
 
+        _ldprelink_close(_ldfirst);
+
         /* Call .init functions */  /* XXX: fix ordering */
         curmod = _ldfirst->next;
         while (curmod) {
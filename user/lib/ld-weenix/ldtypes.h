@@ -21,12 +21,22 @@ typedef void (*ldinit_t)(int argc, char **argv, char **environ, auxv_t *auxv);
 typedef struct ldenv_t {
         int ld_bind_now;
         int ld_debug;
+        int ld_prelink_save;
         const char *ld_preload;
         const char *ld_library_path;
 } ldenv_t;
 
 extern ldenv_t _ldenv;
 
+/* A segment of a module which relocation may write to */
+#define LD_MAXWRSEG     2
+
+typedef struct ldseg_t {
+        unsigned long   addr;           /* page aligned                 */
+        unsigned long   len;            /* page multiple, through bss   */
+        int             prot;
+} ldseg_t;
+
 typedef struct module_t module_t;
 struct module_t {
         char            *name;          /* the filename                 */
@@ -34,8 +44,10 @@ struct module_t {
 
         unsigned long   base;           /* base address of module       */
         Elf32_Word      *hash;          /* the module's hash table      */
+        Elf32_Word      *gnuhash;       /* its GNU hash table, if any   */
         Elf32_Sym       *dynsym;        /* the dynamic symbol table     */
         char            *dynstr;        /* the dynamic string table     */
+        Elf32_Word      strsz;          /* size of dynstr               */
 
         ldfunc_t        init;           /* module initialization fcn.   */
         ldfunc_t        fini;           /* module shutdown fcn.         */
@@ -53,6 +65,15 @@ struct module_t {
         module_t        *next;          /* the next module in the chain */
         module_t        *first;         /* the first module             */
         Elf32_Addr      *pltgot;        /* base of plt                  */
+
+        ldseg_t         wrseg[LD_MAXWRSEG];
+        int             nwrseg;         /* -1 if there were too many    */
+
+        /* prelink cache state, see ldprelink.c */
+        int             prelinked;      /* relocated from the cache     */
+        void            *plsyms;        /* this module's symbol lookups */
+        int             plnsym;
+        int             plpos;          /* next to replay, or capacity  */
 };
 
 #endif /* _ldtypes.h_ */
@@ -66,3 +66,16 @@ unsigned long _ldelfhash(const char *name)
         return h;
 }
 
+
+/* The hash function of DT_GNU_HASH tables (Bernstein's). */
+
+unsigned long _ldgnuhash(const char *name)
+{
+        unsigned long h = 5381;
+
+        while (*name)
+                h = (h << 5) + h + (unsigned char) *name++;
+
+        return h & 0xffffffff;
+}
+
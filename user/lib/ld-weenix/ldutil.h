@@ -16,6 +16,7 @@ extern "C" {
         int _ldzero();
 
         unsigned long _ldelfhash(const char *name);
+        unsigned long _ldgnuhash(const char *name);
         int _ldtryopen(const char *filename, const char *path);
         void _ldmapsect(int fd, unsigned long baseaddr, Elf32_Phdr *phdr, int textrel);
         void _ldloadobj(module_t *module);
@@ -26,6 +27,11 @@ extern "C" {
         void _ldrelocplt(module_t *module);
         void _ldpltgot_init(module_t *module);
 
+        void _ldprelink_open(module_t *first, int pagesize);
+        ldsym_t _ldprelink_resolve(module_t *module, const char *name,
+                                   Elf32_Word *size, int copy);
+        void _ldprelink_close(module_t *first);
+
 #ifdef  __cplusplus
 }
 #endif
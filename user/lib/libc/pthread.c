@@ -0,0 +1,246 @@
+/*
+ * POSIX threads on top of the MTP thread syscalls. Mutexes and condition
+ * variables spin on nothing: contended waiters sleep in the kernel with
+ * SYS_futex until the word they are waiting on changes.
+ *
+ * There is no thread local storage, so errno is shared by all threads of
+ * a process.
+ */
+
+#include "sys/types.h"
+#include "stdlib.h"
+#include "unistd.h"
+#include "limits.h"
+#include "errno.h"
+#include "sys/mman.h"
+#include "weenix/trap.h"
+#include "pthread/pthread.h"
+
+#define PTHREAD_STACK_SIZE      (64 * 1024)
+
+struct pthread {
+        int             pt_tid;
+        void         *(*pt_func)(void *);
+        void           *pt_arg;
+        void           *pt_stack;
+};
+
+struct pthread_mutex {
+        volatile uint32_t pm_state;     /* 0 unlocked, 1 locked, 2 locked
+                                         * and maybe waited on */
+};
+
+struct pthread_cond {
+        volatile uint32_t pc_seq;       /* bumped by every signal */
+};
+
+static inline uint32_t cmpxchg(volatile uint32_t *p, uint32_t old, uint32_t new)
+{
+        uint32_t prev;
+        __asm__ volatile("lock; cmpxchgl %2, %1"
+                         : "=a"(prev), "+m"(*p)
+                         : "r"(new), "0"(old)
+                         : "memory");
+        return prev;
+}
+
+static inline uint32_t xchg(volatile uint32_t *p, uint32_t val)
+{
+        __asm__ volatile("xchgl %0, %1"
+                         : "+r"(val), "+m"(*p)
+                         :
+                         : "memory");
+        return val;
+}
+
+static inline void atomic_inc(volatile uint32_t *p)
+{
+        __asm__ volatile("lock; incl %0" : "+m"(*p) : : "memory");
+}
+
+static int futex(volatile uint32_t *addr, int op, uint32_t val)
+{
+        futex_args_t args;
+
+        args.fa_addr = (uint32_t *) addr;
+        args.fa_op = op;
+        args.fa_val = val;
+
+        return trap(SYS_futex, (uint32_t) &args);
+}
+
+static void pthread_start(struct pthread *thr)
+{
+        pthread_exit(thr->pt_func(thr->pt_arg));
+}
+
+int pthread_create(pthread_t *thr, const pthread_attr_t *attr,
+                   void *(*func)(void *), void *arg)
+{
+        thr_create_args_t args;
+        struct pthread *t;
+        uint32_t *sp;
+        int tid;
+
+        if (NULL == (t = malloc(sizeof(*t)))) {
+                return ENOMEM;
+        }
+        t->pt_func = func;
+        t->pt_arg = arg;
+        t->pt_stack = mmap(NULL, PTHREAD_STACK_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (MAP_FAILED == t->pt_stack) {
+                free(t);
+                return ENOMEM;
+        }
+
+        /* pthread_start's argument and a return address it never uses */
+        sp = (uint32_t *)((char *) t->pt_stack + PTHREAD_STACK_SIZE);
+        *--sp = (uint32_t) t;
+        *--sp = 0;
+
+        args.tca_eip = (void *) pthread_start;
+        args.tca_esp = sp;
+        if (0 > (tid = trap(SYS_thr_create, (uint32_t) &args))) {
+                int err = errno;
+                munmap(t->pt_stack, PTHREAD_STACK_SIZE);
+                free(t);
+                return err;
+        }
+
+        t->pt_tid = tid;
+        *thr = t;
+        return 0;
+}
+
+void pthread_exit(void *retval)
+{
+        trap(SYS_thr_exit, (uint32_t) retval);
+}
+
+int pthread_join(pthread_t thr, void **retval)
+{
+        thr_join_args_t args;
+
+        args.tja_tid = thr->pt_tid;
+        args.tja_retval = retval;
+        if (0 > trap(SYS_thr_join, (uint32_t) &args)) {
+                return errno;
+        }
+
+        munmap(thr->pt_stack, PTHREAD_STACK_SIZE);
+        free(thr);
+        return 0;
+}
+
+/* The stack and struct of a detached thread are never freed: nothing is
+ * left running once the thread's last use of them is over. */
+int pthread_detach(pthread_t thr)
+{
+        if (0 > trap(SYS_thr_detach, (uint32_t) thr->pt_tid)) {
+                return errno;
+        }
+        return 0;
+}
+
+int pthread_cancel(pthread_t thr)
+{
+        if (0 > trap(SYS_thr_cancel, (uint32_t) thr->pt_tid)) {
+                return errno;
+        }
+        return 0;
+}
+
+int pthread_equal(pthread_t a, pthread_t b)
+{
+        return a == b;
+}
+
+void pthread_yield(void)
+{
+        trap(SYS_thr_yield, 0);
+}
+
+int pthread_mutex_init(pthread_mutex_t *mtx, const pthread_mutexattr_t *attr)
+{
+        if (NULL == (*mtx = malloc(sizeof(**mtx)))) {
+                return ENOMEM;
+        }
+        (*mtx)->pm_state = 0;
+        return 0;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mtx)
+{
+        volatile uint32_t *state = &(*mtx)->pm_state;
+        uint32_t c;
+
+        /* see Drepper, "Futexes Are Tricky", mutex #2 */
+        if (0 != (c = cmpxchg(state, 0, 1))) {
+                if (2 != c) {
+                        c = xchg(state, 2);
+                }
+                while (0 != c) {
+                        futex(state, FUTEX_WAIT, 2);
+                        c = xchg(state, 2);
+                }
+        }
+        return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mtx)
+{
+        return (0 == cmpxchg(&(*mtx)->pm_state, 0, 1)) ? 0 : EBUSY;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mtx)
+{
+        volatile uint32_t *state = &(*mtx)->pm_state;
+
+        if (2 == xchg(state, 0)) {
+                futex(state, FUTEX_WAKE, 1);
+        }
+        return 0;
+}
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+        if (NULL == (*cond = malloc(sizeof(**cond)))) {
+                return ENOMEM;
+        }
+        (*cond)->pc_seq = 0;
+        return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond)
+{
+        free(*cond);
+        *cond = NULL;
+        return 0;
+}
+
+/* A signal between unlocking and sleeping changes pc_seq, so the wait
+ * returns straight away instead of missing it. */
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mtx)
+{
+        uint32_t seq = (*cond)->pc_seq;
+
+        pthread_mutex_unlock(mtx);
+        futex(&(*cond)->pc_seq, FUTEX_WAIT, seq);
+        pthread_mutex_lock(mtx);
+        return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond)
+{
+        atomic_inc(&(*cond)->pc_seq);
+        futex(&(*cond)->pc_seq, FUTEX_WAKE, 1);
+        return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+        atomic_inc(&(*cond)->pc_seq);
+        futex(&(*cond)->pc_seq, FUTEX_WAKE, INT_MAX);
+        return 0;
+}
@@ -1,7 +1,159 @@
 #include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "unistd.h"
+#include "termios.h"
 
-static int stdstreams[3] = { 0, 1, 2 };
+static char stdout_buf[BUFSIZ];
+
+static FILE stdstreams[3] = {
+        { 0, _IONBF, NULL, 0, 0 },
+        { 1, -1, stdout_buf, BUFSIZ, 0 },
+        { 2, _IONBF, NULL, 0, 0 }
+};
 
 FILE *stdin = &stdstreams[0];
 FILE *stdout = &stdstreams[1];
 FILE *stderr = &stdstreams[2];
+
+/* Writes all of buf, returning 0, or -1 if the file descriptor would not
+ * take it. */
+static int write_all(int fd, const char *buf, size_t len)
+{
+        ssize_t ret;
+
+        while (len > 0) {
+                if (0 >= (ret = write(fd, buf, len))) {
+                        return -1;
+                }
+                buf += ret;
+                len -= ret;
+        }
+        return 0;
+}
+
+static int flush_one(FILE *stream)
+{
+        int ret = 0;
+
+        if (stream->f_len > 0) {
+                ret = write_all(stream->f_fd, stream->f_buf, stream->f_len);
+                /* what could not be written is dropped rather than tried
+                 * again at every later write */
+                stream->f_len = 0;
+        }
+        return ret ? EOF : 0;
+}
+
+int fflush(FILE *stream)
+{
+        int i, ret = 0;
+
+        if (NULL != stream) {
+                return flush_one(stream);
+        }
+        for (i = 0; i < 3; i++) {
+                if (0 > flush_one(&stdstreams[i])) {
+                        ret = EOF;
+                }
+        }
+        return ret;
+}
+
+int setvbuf(FILE *stream, char *buf, int mode, size_t size)
+{
+        if (mode != _IOFBF && mode != _IOLBF && mode != _IONBF) {
+                return EOF;
+        }
+        fflush(stream);
+
+        if (mode != _IONBF) {
+                if (NULL != buf && size > 0) {
+                        stream->f_buf = buf;
+                        stream->f_size = size;
+                } else if (NULL == stream->f_buf) {
+                        size = size ? size : BUFSIZ;
+                        if (NULL == (stream->f_buf = malloc(size))) {
+                                return EOF;
+                        }
+                        stream->f_size = size;
+                }
+        }
+        stream->f_mode = mode;
+        return 0;
+}
+
+void setbuf(FILE *stream, char *buf)
+{
+        if (NULL != buf) {
+                setvbuf(stream, buf, _IOFBF, BUFSIZ);
+        } else {
+                setvbuf(stream, NULL, _IONBF, 0);
+        }
+}
+
+static size_t write_stream(FILE *stream, const char *buf, size_t len)
+{
+        struct termios t;
+        size_t i;
+
+        if (stream->f_mode < 0) {
+                stream->f_mode = (0 == tcgetattr(stream->f_fd, &t))
+                                 ? _IOLBF : _IOFBF;
+        }
+
+        if (stream->f_mode == _IONBF) {
+                return write_all(stream->f_fd, buf, len) ? 0 : len;
+        }
+
+        if (stream->f_len + len > stream->f_size) {
+                if (0 > flush_one(stream)) {
+                        return 0;
+                }
+                if (len >= stream->f_size) {
+                        return write_all(stream->f_fd, buf, len) ? 0 : len;
+                }
+        }
+        memcpy(stream->f_buf + stream->f_len, buf, len);
+        stream->f_len += len;
+
+        if (stream->f_mode == _IOLBF) {
+                for (i = 0; i < len; i++) {
+                        if (buf[i] == '\n') {
+                                return flush_one(stream) ? 0 : len;
+                        }
+                }
+        }
+        return len;
+}
+
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+        if (0 == size || 0 == nmemb) {
+                return 0;
+        }
+        return write_stream(stream, ptr, size * nmemb) / size;
+}
+
+int fputc(int c, FILE *stream)
+{
+        char ch = (char) c;
+
+        return write_stream(stream, &ch, 1) ? (unsigned char) c : EOF;
+}
+
+int fputs(const char *s, FILE *stream)
+{
+        size_t len = strlen(s);
+
+        return (write_stream(stream, s, len) == len) ? 0 : EOF;
+}
+
+/* Returning from main() in a dynamically linked program exits through
+ * ld-weenix's own copy of exit(), which has its own streams, but before
+ * that it runs the DT_FINI function of each library, which ld takes to be
+ * _fini(). */
+void _fini(void)
+{
+        fflush(NULL);
+}
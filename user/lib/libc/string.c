@@ -3,25 +3,66 @@
 #include "string.h"
 #include "errno.h"
 
+/*
+ * The copies, fills and scans below go a dword at a time where they can.
+ * A string is only read a dword at a time from aligned addresses, so a
+ * read never runs onto a page past the one with the terminator in it.
+ * The kernel does not switch floating point state between threads, so
+ * there are no SSE versions.
+ */
+typedef uint32_t __attribute__((__may_alias__)) word_t;
+
+#define WORD_ONES       0x01010101U
+#define WORD_HIGHS      0x80808080U
+/* nonzero if one of the bytes of w is zero */
+#define WORD_HASZERO(w) (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+#define WORD_ALIGNED(p) (0 == ((uintptr_t)(p) & 3))
+
 int memcmp(const void *cs, const void *ct, size_t count)
 {
-        const unsigned char *su1, *su2;
-        signed char res = 0;
-
-        for (su1 = cs, su2 = ct; 0 < count; ++su1, ++su2, count--)
-                if ((res = *su1 - *su2) != 0)
-                        break;
-        return res;
+        const unsigned char *su1 = cs, *su2 = ct;
+        size_t words = count >> 2, left, i;
+
+        /* Skip the dwords which are the same; if one differs, back up to
+         * its start so the bytes below find which of its bytes it is.
+         * Setting zf first covers there being no dwords at all. */
+        __asm__ volatile(
+                "cld\n\t"
+                "xorl %%eax, %%eax\n\t"
+                "repe\n\t"
+                "cmpsl\n\t"
+                "je 1f\n\t"
+                "subl $4, %%esi\n\t"
+                "subl $4, %%edi\n\t"
+                "incl %%ecx\n"
+                "1:"
+                : "+S"(su1), "+D"(su2), "+c"(words)
+                :
+                : "eax", "cc", "memory"
+        );
+        left = (words << 2) + (count & 3);
+        for (i = 0; i < left; i++) {
+                if (su1[i] != su2[i])
+                        return (int)su1[i] - (int)su2[i];
+        }
+        return 0;
 }
 
 void *memcpy(void *dest, const void *src, size_t count)
 {
-        char *tmp = (char *) dest;
-        const char *s = src;
-
-        while (count--)
-                *tmp++ = *s++;
-
+        int d0, d1, d2;
+
+        __asm__ volatile(
+                "cld\n\t"
+                "rep\n\t"
+                "movsl\n\t"
+                "movl %4, %%ecx\n\t"
+                "rep\n\t"
+                "movsb"
+                : "=&c"(d0), "=&D"(d1), "=&S"(d2)
+                : "0"(count >> 2), "g"(count & 3), "1"(dest), "2"(src)
+                : "memory", "cc"
+        );
         return dest;
 }
 
@@ -40,23 +81,29 @@ int strncmp(const char *cs, const char *ct, size_t count)
 
 int strcmp(const char *cs, const char *ct)
 {
-        register signed char __res;
-
-        while (1) {
-                if ((__res = *cs - *ct++) != 0 || !*cs++)
-                        break;
+        const unsigned char *su1 = (const unsigned char *)cs;
+        const unsigned char *su2 = (const unsigned char *)ct;
+
+        /* dwords at a time once both are aligned, if they can both be */
+        if (((uintptr_t)su1 & 3) == ((uintptr_t)su2 & 3)) {
+                for (; !WORD_ALIGNED(su1); ++su1, ++su2) {
+                        if (*su1 != *su2 || '\0' == *su1)
+                                return (int)*su1 - (int)*su2;
+                }
+                while (*(const word_t *)su1 == *(const word_t *)su2
+                       && !WORD_HASZERO(*(const word_t *)su1)) {
+                        su1 += 4;
+                        su2 += 4;
+                }
         }
-
-        return __res;
+        for (; *su1 == *su2 && '\0' != *su1; ++su1, ++su2)
+                /* nothing */;
+        return (int)*su1 - (int)*su2;
 }
 
 char *strcpy(char *dest, const char *src)
 {
-        char *tmp = dest;
-
-        while ((*dest++ = *src++) != '\0')
-                /* nothing */;
-        return tmp;
+        return memcpy(dest, src, strlen(src) + 1);
 }
 
 char *strncpy(char *dest, const char *src, size_t count)
@@ -71,11 +118,19 @@ char *strncpy(char *dest, const char *src, size_t count)
 
 void *memset(void *s, int c, size_t count)
 {
-        char *xs = (char *) s;
-
-        while (count--)
-                *xs++ = c;
-
+        int d0, d1;
+
+        __asm__ volatile(
+                "cld\n\t"
+                "rep\n\t"
+                "stosl\n\t"
+                "movl %3, %%ecx\n\t"
+                "rep\n\t"
+                "stosb"
+                : "=&c"(d0), "=&D"(d1)
+                : "a"((c & 0xff) * WORD_ONES), "g"(count & 3), "0"(count >> 2), "1"(s)
+                : "memory", "cc"
+        );
         return s;
 }
 
@@ -91,28 +146,41 @@ size_t strnlen(const char *s, size_t count)
 
 char *strcat(char *dest, const char *src)
 {
-        char *tmp = dest;
-
-        while (*dest)
-                dest++;
-
-        while ((*dest++ = *src++) != '\0');
-
-        return tmp;
+        strcpy(dest + strlen(dest), src);
+        return dest;
 }
 
 size_t strlen(const char *s)
 {
         const char *sc;
+        const word_t *w;
 
-        for (sc = s; *sc != '\0'; ++sc)
+        for (sc = s; !WORD_ALIGNED(sc); ++sc) {
+                if ('\0' == *sc)
+                        return sc - s;
+        }
+        for (w = (const word_t *)sc; !WORD_HASZERO(*w); ++w)
+                /* nothing */;
+        for (sc = (const char *)w; *sc != '\0'; ++sc)
                 /* nothing */;
         return sc - s;
 }
 
 char *strchr(const char *s, int c)
 {
-        for (; *s != (char) c; ++s)
+        uint32_t mask = (c & 0xff) * WORD_ONES;
+        const word_t *w;
+
+        for (; !WORD_ALIGNED(s); ++s) {
+                if (*s == (char) c)
+                        return (char *)s;
+                if (*s == '\0')
+                        return NULL;
+        }
+        /* on to the dword with either c or the end in it */
+        for (w = (const word_t *)s; !WORD_HASZERO(*w) && !WORD_HASZERO(*w ^ mask); ++w)
+                /* nothing */;
+        for (s = (const char *)w; *s != (char) c; ++s)
                 if (*s == '\0')
                         return NULL;
         return (char *)s;
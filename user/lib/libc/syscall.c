@@ -1,14 +1,46 @@
 #include "sys/types.h"
 #include "stdarg.h"
 
+#include "stdio.h"
 #include "string.h"
 #include "stdlib.h"
 
 #include "unistd.h"
+#include "time.h"
+#include "sys/uio.h"
+#include "poll.h"
+#include "termios.h"
+#include "sys/epoll.h"
+#include "sys/uring.h"
+#include "sys/ioprio.h"
+#include "sys/affinity.h"
+#include "sys/resource.h"
+#include "sys/socket.h"
 #include "weenix/trap.h"
+#include "weenix/vdso.h"
 
 #include "dirent.h"
 
+int __trap_sysenter = -1;
+
+int __trap_sysenter_detect(void)
+{
+        uint32_t eax, edx;
+
+        /* cpuid leaf 1 reports sysenter support in bit 11 (SEP) of %edx;
+         * %ebx may hold the GOT pointer, so keep it safe */
+        __asm__ volatile(
+                "pushl %%ebx\n\t"
+                "cpuid\n\t"
+                "popl %%ebx"
+                : "=a"(eax), "=d"(edx)
+                : "0"(1)
+                : "ecx"
+        );
+        __trap_sysenter = !!(edx & (1 << 11));
+        return __trap_sysenter;
+}
+
 static void *__curbrk = NULL;
 #define MAX_EXIT_HANDLERS 32
 
@@ -58,6 +90,8 @@ int brk(void *addr)
 
 int fork(void)
 {
+        /* or the child would write out what is buffered a second time */
+        fflush(NULL);
         return trap(SYS_fork, 0);
 }
 
@@ -85,6 +119,7 @@ void exit(int status)
         while (atexit_handlers--) {
                 atexit_func[atexit_handlers]();
         }
+        fflush(NULL);
 
         _exit(status);
         exit(status); /* gcc doesn't realize that _exit() exits */
@@ -127,7 +162,47 @@ void thr_exit(int status)
 
 pid_t getpid(void)
 {
-        return trap(SYS_getpid, 0);
+        return VDSO_PROC->vp_pid;
+}
+
+int clock_gettime(clockid_t clk, struct timespec *tp)
+{
+        clock_gettime_args_t args;
+
+        args.clk = clk;
+        args.tp = tp;
+
+        return trap(SYS_clock_gettime, (uint32_t) &args);
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+        nanosleep_args_t args;
+
+        args.req = req;
+        args.rem = rem;
+
+        return trap(SYS_nanosleep, (uint32_t) &args);
+}
+
+int usleep(unsigned int usec)
+{
+        struct timespec req;
+
+        req.tv_sec = usec / 1000000;
+        req.tv_nsec = (usec % 1000000) * 1000;
+
+        return nanosleep(&req, NULL);
+}
+
+unsigned int sleep(unsigned int seconds)
+{
+        struct timespec req;
+
+        req.tv_sec = seconds;
+        req.tv_nsec = 0;
+
+        return (0 > nanosleep(&req, NULL)) ? seconds : 0;
 }
 
 int halt(void)
@@ -159,11 +234,107 @@ int munmap(void *addr, size_t len)
         return trap(SYS_munmap, (uint32_t) &args);
 }
 
+int msync(void *addr, size_t len, int flags)
+{
+        msync_args_t args;
+
+        args.addr = addr;
+        args.len = len;
+        args.flags = flags;
+
+        return trap(SYS_msync, (uint32_t) &args);
+}
+
+int madvise(void *addr, size_t len, int advice)
+{
+        madvise_args_t args;
+
+        args.addr = addr;
+        args.len = len;
+        args.advice = advice;
+
+        return trap(SYS_madvise, (uint32_t) &args);
+}
+
+int mlock(const void *addr, size_t len)
+{
+        munmap_args_t args;
+
+        args.addr = (void *)addr;
+        args.len = len;
+
+        return trap(SYS_mlock, (uint32_t) &args);
+}
+
+int munlock(const void *addr, size_t len)
+{
+        munmap_args_t args;
+
+        args.addr = (void *)addr;
+        args.len = len;
+
+        return trap(SYS_munlock, (uint32_t) &args);
+}
+
+int shm_open(const char *name, int oflag, int mode)
+{
+        shm_open_args_t args;
+
+        args.name.as_len = strlen(name);
+        args.name.as_str = name;
+        args.oflag = oflag;
+        args.mode = mode;
+
+        return trap(SYS_shm_open, (uint32_t) &args);
+}
+
+int shm_unlink(const char *name)
+{
+        argstr_t args;
+        args.as_len = strlen(name);
+        args.as_str = name;
+        return trap(SYS_shm_unlink, (uint32_t) &args);
+}
+
 void sync(void)
 {
         trap(SYS_sync, 0);
 }
 
+int fsync(int fd)
+{
+        return trap(SYS_fsync, (uint32_t) fd);
+}
+
+int fdatasync(int fd)
+{
+        return trap(SYS_fdatasync, (uint32_t) fd);
+}
+
+int fadvise(int fd, off_t offset, off_t len, int advice)
+{
+        fadvise_args_t args;
+
+        args.fd = fd;
+        args.offset = offset;
+        args.len = len;
+        args.advice = advice;
+
+        return trap(SYS_fadvise, (uint32_t) &args);
+}
+
+int fallocate(int fd, int mode, off_t offset, off_t len)
+{
+        fallocate_args_t args;
+
+        args.fd = fd;
+        args.mode = mode;
+        args.offset = offset;
+        args.len = len;
+
+        return trap(SYS_fallocate, (uint32_t) &args);
+}
+
 int open(const char *filename, int flags, int mode)
 {
         open_args_t args;
@@ -187,6 +358,40 @@ off_t lseek(int fd, off_t offset, int whence)
         return trap(SYS_lseek, (uint32_t) &args);
 }
 
+int ioctl(int fd, int request, void *arg)
+{
+        ioctl_args_t args;
+
+        args.fd = fd;
+        args.request = request;
+        args.arg = arg;
+
+        return trap(SYS_ioctl, (uint32_t) &args);
+}
+
+int tcgetattr(int fd, struct termios *t)
+{
+        return ioctl(fd, TCGETS, t);
+}
+
+/* Every action takes effect at once: output is never held back, and
+ * there is no typeahead worth flushing. */
+int tcsetattr(int fd, int action, const struct termios *t)
+{
+        if (TCSANOW != action && TCSADRAIN != action && TCSAFLUSH != action) {
+                errno = EINVAL;
+                return -1;
+        }
+        return ioctl(fd, TCSETS, (void *) t);
+}
+
+void cfmakeraw(struct termios *t)
+{
+        t->c_lflag &= ~(ICANON | ECHO);
+        t->c_cc[VMIN] = 1;
+        t->c_cc[VTIME] = 0;
+}
+
 
 int read(int fd, void *buf, size_t nbytes)
 {
@@ -211,6 +416,74 @@ int write(int fd, const void *buf, size_t nbytes)
         return trap(SYS_write, (uint32_t) &args);
 }
 
+int pread(int fd, void *buf, size_t nbytes, off_t offset)
+{
+        pread_args_t args;
+
+        args.fd = fd;
+        args.buf = buf;
+        args.nbytes = nbytes;
+        args.offset = offset;
+
+        return trap(SYS_pread, (uint32_t) &args);
+}
+
+int pwrite(int fd, const void *buf, size_t nbytes, off_t offset)
+{
+        pwrite_args_t args;
+
+        args.fd = fd;
+        args.buf = (void *) buf;
+        args.nbytes = nbytes;
+        args.offset = offset;
+
+        return trap(SYS_pwrite, (uint32_t) &args);
+}
+
+int sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+        sendfile_args_t args;
+
+        args.out_fd = out_fd;
+        args.in_fd = in_fd;
+        args.offset = offset;
+        args.count = count;
+
+        return trap(SYS_sendfile, (uint32_t) &args);
+}
+
+int clone_file(int src_fd, int dst_fd)
+{
+        clone_file_args_t args;
+
+        args.src_fd = src_fd;
+        args.dst_fd = dst_fd;
+
+        return trap(SYS_clone_file, (uint32_t) &args);
+}
+
+int readv(int fd, const struct iovec *iov, int iovcnt)
+{
+        rwv_args_t args;
+
+        args.fd = fd;
+        args.iov = iov;
+        args.iovcnt = iovcnt;
+
+        return trap(SYS_readv, (uint32_t) &args);
+}
+
+int writev(int fd, const struct iovec *iov, int iovcnt)
+{
+        rwv_args_t args;
+
+        args.fd = fd;
+        args.iov = iov;
+        args.iovcnt = iovcnt;
+
+        return trap(SYS_writev, (uint32_t) &args);
+}
+
 int close(int fd)
 {
         return trap(SYS_close, (uint32_t) fd);
@@ -295,6 +568,81 @@ size_t get_free_mem(void)
         return (size_t) trap(SYS_get_free_mem, 0);
 }
 
+int syscall_stats(struct syscall_stat *buf, int count)
+{
+        syscall_stats_args_t args;
+
+        args.buf = buf;
+        args.count = count;
+
+        return trap(SYS_syscall_stats, (uint32_t) &args);
+}
+
+int proc_stats(struct proc_stat *buf, int count)
+{
+        proc_stats_args_t args;
+
+        args.buf = buf;
+        args.count = count;
+
+        return trap(SYS_proc_stats, (uint32_t) &args);
+}
+
+int kmem_census(char *buf, size_t len)
+{
+        kmem_census_args_t args;
+
+        args.buf = buf;
+        args.len = len;
+
+        return trap(SYS_kmem_census, (uint32_t) &args);
+}
+
+int ioprio_set(int pid, int ioclass)
+{
+        ioprio_set_args_t args;
+
+        args.pid = pid;
+        args.ioclass = ioclass;
+
+        return trap(SYS_ioprio_set, (uint32_t) &args);
+}
+
+int ioprio_get(int pid)
+{
+        return trap(SYS_ioprio_get, (uint32_t) pid);
+}
+
+int sched_setaffinity(int pid, unsigned int mask)
+{
+        sched_setaffinity_args_t args;
+
+        args.pid = pid;
+        args.mask = mask;
+
+        return trap(SYS_sched_setaffinity, (uint32_t) &args);
+}
+
+int sched_getaffinity(int pid, unsigned int *mask)
+{
+        sched_getaffinity_args_t args;
+
+        args.pid = pid;
+        args.mask = mask;
+
+        return trap(SYS_sched_getaffinity, (uint32_t) &args);
+}
+
+int getrusage(int who, struct rusage *ru)
+{
+        getrusage_args_t args;
+
+        args.who = who;
+        args.ru = ru;
+
+        return trap(SYS_getrusage, (uint32_t) &args);
+}
+
 int execve(const char *filename, char *const argv[], char *const envp[])
 {
         execve_args_t           args;
@@ -355,6 +703,17 @@ int getdents(int fd, dirent_t *dir, size_t size)
         return trap(SYS_getdents, (uint32_t) &args);
 }
 
+int getdents_plus(int fd, dirent_plus_t *dir, size_t size)
+{
+        getdents_plus_args_t args;
+
+        args.fd = fd;
+        args.dirp = dir;
+        args.count = size;
+
+        return trap(SYS_getdents_plus, (uint32_t) &args);
+}
+
 #ifdef __MOUNTING__
 int
 mount(const char *spec, const char *dir, const char *fstype)
@@ -395,16 +754,202 @@ stat(const char *path, struct stat *buf)
         return trap(SYS_stat, (uint32_t) &args);
 }
 
+int
+fstatat(int dirfd, const char *path, struct stat *buf)
+{
+        fstatat_args_t args;
+
+        args.dirfd = dirfd;
+        args.path.as_len = strlen(path);
+        args.path.as_str = path;
+        args.buf = buf;
+
+        return trap(SYS_fstatat, (uint32_t) &args);
+}
+
 int
 pipe(int pipefd[2])
 {
         return trap(SYS_pipe, (uint32_t) pipefd);
 }
 
+int
+socket(int domain, int type, int protocol)
+{
+        socket_args_t args;
+
+        args.domain = domain;
+        args.type = type;
+        args.protocol = protocol;
+
+        return trap(SYS_socket, (uint32_t) &args);
+}
+
+int
+bind(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+        bind_args_t args;
+
+        args.fd = fd;
+        args.addr = addr;
+        args.addrlen = addrlen;
+
+        return trap(SYS_bind, (uint32_t) &args);
+}
+
+ssize_t
+sendto(int fd, const void *buf, size_t len, int flags,
+       const struct sockaddr *to, socklen_t tolen)
+{
+        sendto_args_t args;
+
+        args.fd = fd;
+        args.buf = buf;
+        args.len = len;
+        args.flags = flags;
+        args.to = to;
+        args.tolen = tolen;
+
+        return trap(SYS_sendto, (uint32_t) &args);
+}
+
+ssize_t
+recvfrom(int fd, void *buf, size_t len, int flags,
+         struct sockaddr *from, socklen_t *fromlen)
+{
+        recvfrom_args_t args;
+
+        args.fd = fd;
+        args.buf = buf;
+        args.len = len;
+        args.flags = flags;
+        args.from = from;
+        args.fromlen = fromlen;
+
+        return trap(SYS_recvfrom, (uint32_t) &args);
+}
+
+int
+socketpair(int domain, int type, int protocol, int sv[2])
+{
+        socketpair_args_t args;
+
+        args.domain = domain;
+        args.type = type;
+        args.protocol = protocol;
+        args.sv = sv;
+
+        return trap(SYS_socketpair, (uint32_t) &args);
+}
+
+int
+listen(int fd, int backlog)
+{
+        listen_args_t args;
+
+        args.fd = fd;
+        args.backlog = backlog;
+
+        return trap(SYS_listen, (uint32_t) &args);
+}
+
+int
+accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+        accept_args_t args;
+
+        args.fd = fd;
+        args.addr = addr;
+        args.addrlen = addrlen;
+
+        return trap(SYS_accept, (uint32_t) &args);
+}
+
+int
+connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+        connect_args_t args;
+
+        args.fd = fd;
+        args.addr = addr;
+        args.addrlen = addrlen;
+
+        return trap(SYS_connect, (uint32_t) &args);
+}
+
+int
+poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+        poll_args_t args;
+
+        args.fds = fds;
+        args.nfds = nfds;
+        args.timeout = timeout;
+
+        return trap(SYS_poll, (uint32_t) &args);
+}
+
+int
+epoll_create(int size)
+{
+        return trap(SYS_epoll_create, (uint32_t) size);
+}
+
+int
+epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+        epoll_ctl_args_t args;
+
+        args.epfd = epfd;
+        args.op = op;
+        args.fd = fd;
+        args.event = event;
+
+        return trap(SYS_epoll_ctl, (uint32_t) &args);
+}
+
+int
+epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+        epoll_wait_args_t args;
+
+        args.epfd = epfd;
+        args.events = events;
+        args.maxevents = maxevents;
+        args.timeout = timeout;
+
+        return trap(SYS_epoll_wait, (uint32_t) &args);
+}
+
+int
+uring_setup(uint32_t entries, uint32_t buflen, struct uring_params *params)
+{
+        uring_setup_args_t args;
+
+        args.entries = entries;
+        args.buflen = buflen;
+        args.params = params;
+
+        return trap(SYS_uring_setup, (uint32_t) &args);
+}
+
+int
+uring_enter(int fd, uint32_t to_submit, uint32_t min_complete)
+{
+        uring_enter_args_t args;
+
+        args.fd = fd;
+        args.to_submit = to_submit;
+        args.min_complete = min_complete;
+
+        return trap(SYS_uring_enter, (uint32_t) &args);
+}
+
 int
 uname(struct utsname *buf)
 {
-        return trap(SYS_uname, (uint32_t) buf);
+        memcpy(buf, &VDSO_DATA->vd_uts, sizeof(*buf));
+        return 0;
 }
 
 int
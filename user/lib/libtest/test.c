@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <time.h>
 
 typedef struct test_data {
         int td_passed;
@@ -185,3 +186,79 @@ _test_assert(int val, const char *file, int line, const char *name, const char *
         va_end(args);
         return val;
 }
+
+uint64_t
+test_now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+_test_hist_bucket(uint64_t ns)
+{
+        int log = 63;
+
+        if (ns < TEST_HIST_SUB)
+                return ns;
+        while (!(ns & (1ULL << log)))
+                log--;
+        /* the top two bits after the leading one pick the sub-bucket */
+        return log * TEST_HIST_SUB + ((ns >> (log - 2)) & (TEST_HIST_SUB - 1));
+}
+
+static uint64_t
+_test_hist_bound(int bucket)
+{
+        int log = bucket / TEST_HIST_SUB, sub = bucket % TEST_HIST_SUB;
+
+        if (bucket < TEST_HIST_SUB)
+                return bucket;
+        return ((uint64_t)(TEST_HIST_SUB + sub + 1) << (log - 2)) - 1;
+}
+
+void
+test_hist_add(test_hist_t *h, uint64_t ns)
+{
+        h->th_count++;
+        h->th_total_ns += ns;
+        if (ns > h->th_max_ns)
+                h->th_max_ns = ns;
+        h->th_buckets[_test_hist_bucket(ns)]++;
+}
+
+void
+test_hist_merge(test_hist_t *to, const test_hist_t *from)
+{
+        int i;
+
+        to->th_count += from->th_count;
+        to->th_total_ns += from->th_total_ns;
+        if (from->th_max_ns > to->th_max_ns)
+                to->th_max_ns = from->th_max_ns;
+        for (i = 0; i < TEST_HIST_BUCKETS; i++)
+                to->th_buckets[i] += from->th_buckets[i];
+}
+
+uint64_t
+test_hist_percentile(const test_hist_t *h, int pct)
+{
+        uint32_t want = (h->th_count * pct + 99) / 100, seen = 0;
+        int i;
+
+        if (0 == h->th_count)
+                return 0;
+        if (0 == want)
+                want = 1;
+        for (i = 0; i < TEST_HIST_BUCKETS; i++) {
+                seen += h->th_buckets[i];
+                if (seen >= want)
+                        break;
+        }
+        /* the last bucket's bound can be well past anything seen */
+        if (_test_hist_bound(i) > h->th_max_ns)
+                return h->th_max_ns;
+        return _test_hist_bound(i);
+}
@@ -1,5 +1,6 @@
 /*
- * Forks a shell for each terminal and waits for them.
+ * Starts the services listed in /init.tab and a shell for each terminal,
+ * and waits for them.
  * This is the final thing you should be executing
  * (with kernel_execve) in kernel-land once everything works.
  */
@@ -13,6 +14,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <time.h>
 
 char *empty[] = { NULL };
 
@@ -22,6 +24,47 @@ const char      *ttystr = "tty";
 const char      *home = "/";
 const char      *alldone = "init: no remaining processes\n";
 
+/* If benchauto exists, init runs bench with the names it lists and puts
+ * what it prints in benchout, instead of starting shells, then exits so
+ * that the kernel halts; see tools/benchrun */
+const char      *benchauto = "/bench.auto";
+const char      *benchout = "/bench.out";
+const char      *bench = "/usr/bin/bench";
+
+static int run_bench(void)
+{
+        char     names[512];
+        char    *args[64];
+        int      fd, len, nargs = 0, pid, status;
+        char    *p;
+
+        if (-1 == (fd = open(benchauto, O_RDONLY, 0))) {
+                return 0;
+        }
+        len = read(fd, names, sizeof(names) - 1);
+        close(fd);
+        names[(len > 0) ? len : 0] = '\0';
+
+        args[nargs++] = "bench";
+        for (p = strtok(names, " \t\n"); NULL != p && nargs < 63; p = strtok(NULL, " \t\n")) {
+                args[nargs++] = p;
+        }
+        args[nargs] = NULL;
+
+        if (!(pid = fork())) {
+                close(1);
+                if (1 != open(benchout, O_WRONLY | O_CREAT | O_TRUNC, 0)) {
+                        exit(1);
+                }
+                execve(bench, args, empty);
+                fprintf(stderr, "exec failed!\n");
+                exit(1);
+        }
+        waitpid(pid, 0, &status);
+        printf("init: %s exited with %d\n", bench, status);
+        return 1;
+}
+
 static int open_tty(char *tty)
 {
         if (-1 == open(tty, O_RDONLY, 0)) {
@@ -35,31 +78,310 @@ static int open_tty(char *tty)
         }
 }
 
-static void spawn_shell_on(char *tty)
+/*
+ * Each line of the manifest names a service, says whether it is run
+ * "once" or kept running ("respawn"), lists the services it must come
+ * after, separated by commas or "-" for none, and gives the command:
+ *
+ *      # name   kind     after   command
+ *      mkfiles  once     -       /bin/sh /etc/mkfiles
+ *      logger   respawn  mkfiles /usr/bin/logger
+ *
+ * A service may start once each of those it comes after has finished,
+ * if it runs once, or has been started, if it is kept running; all of
+ * the services which may start are started together. The shells on the
+ * terminals come after every "once" service, and are not restarted.
+ */
+const char      *manifest = "/init.tab";
+
+#define SVC_MAX         32
+#define SVC_DEPS        4
+#define SVC_ARGS        8
+#define SVC_NAME_LEN    16
+
+/* A service which dies within RESPAWN_FAST seconds of starting waits
+ * twice as long as it did the last time before it is started again, up
+ * to RESPAWN_MAX seconds, so that one which cannot run does not spin */
+#define RESPAWN_FAST    10
+#define RESPAWN_MAX     64
+
+#define SV_WAITING      0       /* has not started yet */
+#define SV_RUNNING      1
+#define SV_DONE         2       /* ran once and has exited */
+
+typedef struct service {
+        char     sv_name[SVC_NAME_LEN];
+        char    *sv_argv[SVC_ARGS + 1];         /* the command, argv[0] its path */
+        char     sv_tty[NAME_LEN + 1];          /* for a shell, its terminal */
+        int      sv_respawn;
+        int      sv_state;
+        int      sv_started;                    /* ever */
+        int      sv_ndeps;
+        char    *sv_after[SVC_DEPS];            /* from the manifest */
+        int      sv_deps[SVC_DEPS];             /* ...and what they are */
+        pid_t    sv_pid;
+        int      sv_backoff;                    /* seconds to wait first */
+        time_t   sv_start;                      /* when it last started */
+} service_t;
+
+static service_t services[SVC_MAX];
+static int nservices;
+static char manifest_text[2048];
+
+static time_t now(void)
 {
-        if (!fork()) {
-                close(0);
-                close(1);
-                close(2);
-                if (-1 == open_tty(tty)) {
-                        exit(1);
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec;
+}
+
+/* Returns the next word of *pp, up to the end of the line, and leaves
+ * *pp after it, or returns NULL if the line has none left */
+static char *next_word(char **pp, const char *seps)
+{
+        char    *p = *pp, *word;
+
+        while ('\0' != *p && NULL != strchr(seps, *p))
+                p++;
+        if ('\0' == *p)
+                return NULL;
+        word = p;
+        while ('\0' != *p && NULL == strchr(seps, *p))
+                p++;
+        if ('\0' != *p)
+                *p++ = '\0';
+        *pp = p;
+        return word;
+}
+
+static service_t *add_service(const char *name)
+{
+        service_t       *sv;
+
+        if (SVC_MAX == nservices) {
+                printf("init: too many services, ignoring %s\n", name);
+                return NULL;
+        }
+        sv = &services[nservices++];
+        memset(sv, 0, sizeof(*sv));
+        strncpy(sv->sv_name, name, SVC_NAME_LEN - 1);
+        return sv;
+}
+
+static void load_manifest(void)
+{
+        int      fd, len, i;
+        char    *line, *end, *word, *after;
+        service_t *sv;
+
+        if (-1 == (fd = open(manifest, O_RDONLY, 0))) {
+                return;
+        }
+        len = read(fd, manifest_text, sizeof(manifest_text) - 1);
+        close(fd);
+        manifest_text[(len > 0) ? len : 0] = '\0';
+
+        for (line = manifest_text; NULL != line; line = end) {
+                if (NULL != (end = strchr(line, '\n')))
+                        *end++ = '\0';
+                if (NULL == (word = next_word(&line, " \t")) || '#' == *word)
+                        continue;
+                if (NULL == (sv = add_service(word)))
+                        return;
+
+                word = next_word(&line, " \t");
+                after = next_word(&line, " \t");
+                if (NULL == after || (strcmp(word, "once") && strcmp(word, "respawn"))) {
+                        printf("init: %s: bad entry for %s\n", manifest, sv->sv_name);
+                        nservices--;
+                        continue;
+                }
+                sv->sv_respawn = !strcmp(word, "respawn");
+                if (strcmp(after, "-")) {
+                        while (sv->sv_ndeps < SVC_DEPS
+                               && NULL != (word = next_word(&after, ",")))
+                                sv->sv_after[sv->sv_ndeps++] = word;
+                }
+                for (i = 0; i < SVC_ARGS && NULL != (word = next_word(&line, " \t")); i++)
+                        sv->sv_argv[i] = word;
+                if (0 == i) {
+                        printf("init: %s: no command for %s\n", manifest, sv->sv_name);
+                        nservices--;
+                }
+        }
+}
+
+static char *shell_argv[] = { NULL, NULL };
+
+/* The shells, which come after every service that runs once */
+static void add_shells(void)
+{
+        int      devdir, i, nonce = nservices;
+        dirent_t d;
+        service_t *sv;
+
+        devdir = open("/dev", O_RDONLY, 0);
+        while (getdents(devdir, &d, sizeof(d)) > 0) {
+                if (0 != strncmp(d.d_name, ttystr, strlen(ttystr))) {
+                        continue;
+                }
+                if (NULL == (sv = add_service(d.d_name))) {
+                        break;
+                }
+                strcpy(sv->sv_tty, d.d_name);
+                shell_argv[0] = (char *)sh;
+                memcpy(sv->sv_argv, shell_argv, sizeof(shell_argv));
+                for (i = 0; i < nonce && sv->sv_ndeps < SVC_DEPS; i++) {
+                        if (!services[i].sv_respawn) {
+                                sv->sv_deps[sv->sv_ndeps++] = i;
+                        }
+                }
+        }
+        close(devdir);
+}
+
+static void resolve_deps(void)
+{
+        int      i, j, k;
+        service_t *sv;
+
+        for (i = 0; i < nservices; i++) {
+                sv = &services[i];
+                if ('\0' != sv->sv_tty[0]) {
+                        continue;
+                }
+                for (j = 0; j < sv->sv_ndeps; j++) {
+                        for (k = 0; k < nservices; k++) {
+                                if (!strcmp(sv->sv_after[j], services[k].sv_name))
+                                        break;
+                        }
+                        if (k == nservices || k == i) {
+                                printf("init: %s: %s comes after unknown service %s\n",
+                                       manifest, sv->sv_name, sv->sv_after[j]);
+                                sv->sv_after[j--] = sv->sv_after[--sv->sv_ndeps];
+                        } else {
+                                sv->sv_deps[j] = k;
+                        }
                 }
+        }
+}
 
+static int service_ready(service_t *sv)
+{
+        return sv->sv_respawn ? sv->sv_started : (SV_DONE == sv->sv_state);
+}
+
+static void start_service(service_t *sv)
+{
+        struct timespec ts;
+        pid_t    pid;
+
+        sv->sv_state = SV_RUNNING;
+        sv->sv_started = 1;
+        sv->sv_start = now();
+
+        /* the child waits out its backoff itself, so that we need no
+         * timers and can go on waiting for the others */
+        if (!(pid = fork())) {
+                if (0 < sv->sv_backoff) {
+                        ts.tv_sec = sv->sv_backoff;
+                        ts.tv_nsec = 0;
+                        nanosleep(&ts, NULL);
+                }
+                if ('\0' != sv->sv_tty[0]) {
+                        close(0);
+                        close(1);
+                        close(2);
+                        if (-1 == open_tty(sv->sv_tty)) {
+                                exit(1);
+                        }
+                        printf(hi);
+                        printf(sv->sv_tty);
+                        printf("\n");
+                }
                 chdir(home);
 
-                printf(hi);
-                printf(tty);
-                printf("\n");
+                execve(sv->sv_argv[0], sv->sv_argv, empty);
+                fprintf(stderr, "init: exec %s failed: %s\n",
+                        sv->sv_argv[0], strerror(errno));
+                exit(1);
+        }
+        if (0 > pid) {
+                printf("init: cannot start %s: %s\n", sv->sv_name, strerror(errno));
+                sv->sv_state = SV_DONE;
+        }
+        sv->sv_pid = pid;
+}
 
-                execve(sh, empty, empty);
-                fprintf(stderr, "exec failed!\n");
+/* Starts everything which is waiting and whose dependencies are ready;
+ * a service kept running is ready as soon as it has started, and then
+ * so may be what comes after it */
+static void start_ready(void)
+{
+        int      i, j, started;
+        service_t *sv;
+
+        do {
+                started = 0;
+                for (i = 0; i < nservices; i++) {
+                        sv = &services[i];
+                        if (SV_WAITING != sv->sv_state) {
+                                continue;
+                        }
+                        for (j = 0; j < sv->sv_ndeps; j++) {
+                                if (!service_ready(&services[sv->sv_deps[j]]))
+                                        break;
+                        }
+                        if (j == sv->sv_ndeps) {
+                                start_service(sv);
+                                started = 1;
+                        }
+                }
+        } while (started);
+}
+
+static void service_exited(pid_t pid, int status)
+{
+        int      i, up;
+        service_t *sv;
+
+        for (i = 0; i < nservices; i++) {
+                sv = &services[i];
+                if (SV_RUNNING == sv->sv_state && sv->sv_pid == pid) {
+                        break;
+                }
         }
+        if (i == nservices) {
+                return;
+        }
+
+        if (!sv->sv_respawn) {
+                if (0 != status && '\0' == sv->sv_tty[0]) {
+                        printf("init: %s exited with %d\n", sv->sv_name, status);
+                }
+                sv->sv_state = SV_DONE;
+                return;
+        }
+
+        /* the backoff counted against how long it ran */
+        up = now() - sv->sv_start - sv->sv_backoff;
+        if (up < RESPAWN_FAST) {
+                sv->sv_backoff = sv->sv_backoff ? 2 * sv->sv_backoff : 1;
+                if (sv->sv_backoff > RESPAWN_MAX) {
+                        sv->sv_backoff = RESPAWN_MAX;
+                }
+        } else {
+                sv->sv_backoff = 0;
+        }
+        printf("init: %s exited with %d, restarting in %ds\n",
+               sv->sv_name, status, sv->sv_backoff);
+        start_service(sv);
 }
 
 int main(int argc, char **argv, char **envp)
 {
-        int      devdir, ii;
-        dirent_t d;
+        int      ii;
         int      status;
 
         for (ii = 0; ii < NFILES; ii++)
@@ -70,21 +392,31 @@ int main(int argc, char **argv, char **envp)
                 exit(1);
         }
 
+        if (run_bench()) {
+                return 0;
+        }
+
+        /* relative to which the terminals are opened */
         chdir("/dev");
 
-        devdir = open("/dev", O_RDONLY, 0);
-        while (getdents(devdir, &d, sizeof(d)) > 0) {
-                if (0 == strncmp(d.d_name, ttystr, strlen(ttystr))) {
-                        spawn_shell_on(d.d_name);
-                }
-        }
-        close(devdir);
+        load_manifest();
+        add_shells();
+        resolve_deps();
+        start_ready();
 
         int pid;
         while (0 <= (pid = wait(&status))) {
                 if (EFAULT == status) {
                         printf("process %i faulted\n", pid);
                 }
+                service_exited(pid, status);
+                start_ready();
+        }
+
+        for (ii = 0; ii < nservices; ii++) {
+                if (SV_WAITING == services[ii].sv_state) {
+                        printf("init: %s never started\n", services[ii].sv_name);
+                }
         }
 
         if (ECHILD != errno) {
@@ -0,0 +1,75 @@
+/*
+ * Usage: prelink program...
+ *
+ * Runs each dynamically linked program just far enough for ld-weenix to
+ * record its symbol lookups and relocated pages in a prelink cache (see
+ * ldprelink.c), so that the program starts without redoing them from then
+ * on. Run it again after changing a program or a library it uses; until
+ * then the stale cache is simply ignored. Set LD_BIND_NOW first to prelink
+ * for that.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char *save_env = "LD_PRELINK_SAVE=1";
+
+static int prelink(char *prog, char **envp)
+{
+        char    *argv[] = { prog, NULL };
+        int     status;
+        pid_t   pid;
+
+        if (0 > (pid = fork())) {
+                fprintf(stderr, "prelink: fork: %s\n", strerror(errno));
+                return -1;
+        } else if (0 == pid) {
+                execve(prog, argv, envp);
+                fprintf(stderr, "prelink: %s: %s\n", prog, strerror(errno));
+                exit(1);
+        }
+
+        if (0 > waitpid(pid, 0, &status)) {
+                fprintf(stderr, "prelink: wait: %s\n", strerror(errno));
+                return -1;
+        } else if (0 != status) {
+                fprintf(stderr, "prelink: %s: failed (%d)\n", prog, status);
+                return -1;
+        }
+        return 0;
+}
+
+int main(int argc, char **argv, char **envp)
+{
+        char    **env;
+        int     envc, ii;
+        int     ret = 0;
+
+        if (argc < 2) {
+                fprintf(stderr, "usage: prelink program...\n");
+                return 1;
+        }
+
+        for (envc = 0; envp[envc]; envc++)
+                ;
+        if (NULL == (env = malloc((envc + 2) * sizeof(*env)))) {
+                fprintf(stderr, "prelink: out of memory\n");
+                return 1;
+        }
+        for (ii = 0; ii < envc; ii++)
+                env[ii] = envp[ii];
+        env[envc] = (char *)save_env;
+        env[envc + 1] = NULL;
+
+        for (ii = 1; ii < argc; ii++) {
+                if (0 > prelink(argv[ii], env))
+                        ret = 1;
+        }
+
+        free(env);
+        return ret;
+}
@@ -0,0 +1,349 @@
+/*
+ * Microbenchmarks, after lmbench. Each prints one line,
+ *
+ *     <name> <value> <unit>
+ *
+ * with latencies in nanoseconds per operation and bandwidths in KB/s,
+ * so that runs can be compared by script.
+ *
+ * usage: bench [<name>...]
+ *   with no names, runs all of them; "bench -l" lists them
+ *
+ * The file benchmarks work on BENCH_FILE in the working directory, and
+ * go through the page cache like anything else; the reads and the random
+ * writes use what file_write_seq wrote earlier in the same run.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <weenix/trap.h>
+
+#define BENCH_PATH      "/usr/bin/bench"        /* to exec ourselves */
+#define BENCH_FILE      "bench.tmp"
+#define BENCH_BUF       4096
+#define BENCH_FILE_SIZE (1024 * 1024)
+#define BENCH_PIPE_SIZE (4 * 1024 * 1024)
+
+static char buf[BENCH_BUF];
+
+static uint64_t now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report_latency(const char *name, uint64_t ns, uint32_t ops)
+{
+        printf("%s %llu ns\n", name, ns / ops);
+}
+
+static void report_bandwidth(const char *name, uint64_t ns, uint64_t bytes)
+{
+        if (0 == ns)
+                ns = 1;
+        printf("%s %llu KB/s\n", name, bytes * 1000000000 / ns / 1024);
+}
+
+static void fail(const char *name, const char *what)
+{
+        printf("%s failed %s: %s\n", name, what, strerror(errno));
+}
+
+static void bench_null_syscall(const char *name)
+{
+        int i, n = 10000;
+        uint64_t start = now_ns();
+
+        /* about the least a system call can do */
+        for (i = 0; i < n; i++)
+                thr_errno();
+        report_latency(name, now_ns() - start, n);
+}
+
+static void bench_fork_exit(const char *name)
+{
+        int i, n = 100;
+        uint64_t start = now_ns();
+
+        for (i = 0; i < n; i++) {
+                int pid = fork();
+                if (0 == pid)
+                        _exit(0);
+                if (0 > pid) {
+                        fail(name, "fork");
+                        return;
+                }
+                waitpid(pid, 0, NULL);
+        }
+        report_latency(name, now_ns() - start, n);
+}
+
+static void bench_fork_exec(const char *name)
+{
+        char *argv[] = { BENCH_PATH, "-exit", NULL };
+        char *envp[] = { NULL };
+        int i, n = 20;
+        uint64_t start = now_ns();
+
+        for (i = 0; i < n; i++) {
+                int pid = fork();
+                if (0 == pid) {
+                        execve(BENCH_PATH, argv, envp);
+                        _exit(1);
+                }
+                if (0 > pid) {
+                        fail(name, "fork");
+                        return;
+                }
+                waitpid(pid, 0, NULL);
+        }
+        report_latency(name, now_ns() - start, n);
+}
+
+/* A byte there and back through two pipes */
+static void bench_pipe_latency(const char *name)
+{
+        int to[2], from[2];
+        int i, n = 1000, pid;
+        uint64_t start;
+        char c = 0;
+
+        if (0 > pipe(to) || 0 > pipe(from)) {
+                fail(name, "pipe");
+                return;
+        }
+        if (0 == (pid = fork())) {
+                for (i = 0; i < n; i++) {
+                        read(to[0], &c, 1);
+                        write(from[1], &c, 1);
+                }
+                _exit(0);
+        }
+        start = now_ns();
+        for (i = 0; i < n; i++) {
+                write(to[1], &c, 1);
+                read(from[0], &c, 1);
+        }
+        report_latency(name, now_ns() - start, n);
+        waitpid(pid, 0, NULL);
+        close(to[0]);
+        close(to[1]);
+        close(from[0]);
+        close(from[1]);
+}
+
+static void bench_pipe_bandwidth(const char *name)
+{
+        int fds[2], pid, got;
+        uint64_t start, total = 0;
+
+        if (0 > pipe(fds)) {
+                fail(name, "pipe");
+                return;
+        }
+        start = now_ns();
+        if (0 == (pid = fork())) {
+                int left;
+                close(fds[0]);
+                for (left = BENCH_PIPE_SIZE; left > 0; left -= BENCH_BUF)
+                        write(fds[1], buf, BENCH_BUF);
+                _exit(0);
+        }
+        close(fds[1]);
+        while (0 < (got = read(fds[0], buf, BENCH_BUF)))
+                total += got;
+        report_bandwidth(name, now_ns() - start, total);
+        waitpid(pid, 0, NULL);
+        close(fds[0]);
+}
+
+static void bench_file_seq(const char *name, int writing)
+{
+        int fd, i, n = BENCH_FILE_SIZE / BENCH_BUF;
+        uint64_t start;
+
+        if (0 > (fd = open(BENCH_FILE, writing ? O_WRONLY | O_CREAT : O_RDONLY, 0))) {
+                fail(name, "open");
+                return;
+        }
+        start = now_ns();
+        for (i = 0; i < n; i++) {
+                if (BENCH_BUF != (writing ? write(fd, buf, BENCH_BUF)
+                                          : read(fd, buf, BENCH_BUF))) {
+                        fail(name, writing ? "write" : "read");
+                        close(fd);
+                        return;
+                }
+        }
+        report_bandwidth(name, now_ns() - start, (uint64_t)n * BENCH_BUF);
+        close(fd);
+}
+
+static void bench_file_write_seq(const char *name)
+{
+        bench_file_seq(name, 1);
+}
+
+static void bench_file_read_seq(const char *name)
+{
+        bench_file_seq(name, 0);
+}
+
+/* Whole blocks at random within what file_write_seq wrote */
+static void bench_file_rand(const char *name, int writing)
+{
+        int fd, i, n = 256, nblocks = BENCH_FILE_SIZE / BENCH_BUF;
+        uint64_t start;
+
+        if (0 > (fd = open(BENCH_FILE, writing ? O_RDWR | O_CREAT : O_RDONLY, 0))) {
+                fail(name, "open");
+                return;
+        }
+        srand(nblocks);
+        start = now_ns();
+        for (i = 0; i < n; i++) {
+                off_t off = (rand() % nblocks) * BENCH_BUF;
+                if (BENCH_BUF != (writing ? pwrite(fd, buf, BENCH_BUF, off)
+                                          : pread(fd, buf, BENCH_BUF, off))) {
+                        fail(name, writing ? "pwrite" : "pread");
+                        close(fd);
+                        return;
+                }
+        }
+        report_bandwidth(name, now_ns() - start, (uint64_t)n * BENCH_BUF);
+        close(fd);
+}
+
+static void bench_file_write_rand(const char *name)
+{
+        bench_file_rand(name, 1);
+}
+
+static void bench_file_read_rand(const char *name)
+{
+        bench_file_rand(name, 0);
+}
+
+/* An empty file made and removed, per operation */
+static void bench_create_unlink(const char *name)
+{
+        char path[32];
+        int i, fd, n = 100;
+        uint64_t start = now_ns();
+
+        for (i = 0; i < n; i++) {
+                snprintf(path, sizeof(path), "bench.%d", i);
+                if (0 > (fd = open(path, O_WRONLY | O_CREAT, 0))) {
+                        fail(name, "open");
+                        return;
+                }
+                close(fd);
+        }
+        for (i = 0; i < n; i++) {
+                snprintf(path, sizeof(path), "bench.%d", i);
+                unlink(path);
+        }
+        report_latency(name, now_ns() - start, n);
+}
+
+/* Per page, touching fresh anonymous memory */
+static void bench_mmap_fault(const char *name)
+{
+        int i, n = 256;
+        uint64_t start;
+        char *p;
+
+        p = mmap(NULL, n * BENCH_BUF, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (MAP_FAILED == p) {
+                fail(name, "mmap");
+                return;
+        }
+        start = now_ns();
+        for (i = 0; i < n; i++)
+                p[i * BENCH_BUF] = 1;
+        report_latency(name, now_ns() - start, n);
+        munmap(p, n * BENCH_BUF);
+}
+
+/* Two processes yielding to each other, two switches a round */
+static void bench_ctx_switch(const char *name)
+{
+        int i, n = 1000, pid;
+        uint64_t start;
+
+        if (0 == (pid = fork())) {
+                for (i = 0; i < n; i++)
+                        trap(SYS_thr_yield, 0);
+                _exit(0);
+        }
+        start = now_ns();
+        for (i = 0; i < n; i++)
+                trap(SYS_thr_yield, 0);
+        report_latency(name, now_ns() - start, 2 * n);
+        waitpid(pid, 0, NULL);
+}
+
+static const struct bench {
+        const char     *b_name;
+        void          (*b_func)(const char *name);
+} benches[] = {
+        { "null_syscall",       bench_null_syscall },
+        { "fork_exit",          bench_fork_exit },
+        { "fork_exec",          bench_fork_exec },
+        { "pipe_latency",       bench_pipe_latency },
+        { "pipe_bandwidth",     bench_pipe_bandwidth },
+        { "file_write_seq",     bench_file_write_seq },
+        { "file_read_seq",      bench_file_read_seq },
+        { "file_write_rand",    bench_file_write_rand },
+        { "file_read_rand",     bench_file_read_rand },
+        { "create_unlink",      bench_create_unlink },
+        { "mmap_fault",         bench_mmap_fault },
+        { "ctx_switch",         bench_ctx_switch },
+        { NULL,                 NULL }
+};
+
+int main(int argc, char **argv)
+{
+        const struct bench *b;
+        int i;
+
+        /* what fork_exec runs */
+        if (2 == argc && 0 == strcmp(argv[1], "-exit"))
+                return 0;
+
+        if (2 == argc && 0 == strcmp(argv[1], "-l")) {
+                for (b = benches; NULL != b->b_name; b++)
+                        printf("%s\n", b->b_name);
+                return 0;
+        }
+
+        for (i = 1; i < argc; i++) {
+                for (b = benches; NULL != b->b_name; b++) {
+                        if (0 == strcmp(argv[i], b->b_name))
+                                break;
+                }
+                if (NULL == b->b_name) {
+                        fprintf(stderr, "bench: no benchmark %s\n", argv[i]);
+                        return 1;
+                }
+        }
+
+        for (b = benches; NULL != b->b_name; b++) {
+                int want = (1 == argc);
+                for (i = 1; i < argc && !want; i++)
+                        want = (0 == strcmp(argv[i], b->b_name));
+                if (want)
+                        b->b_func(b->b_name);
+        }
+        unlink(BENCH_FILE);
+        return 0;
+}
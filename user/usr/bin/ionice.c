@@ -0,0 +1,67 @@
+/*
+ * Gets or sets the I/O priority class of a process (see sys/ioprio.h),
+ * or runs a command in a class. Classes are 1 (realtime), 2 (best-effort)
+ * and 3 (idle); 0 means none has been set, which is served as
+ * best-effort.
+ *
+ * usage: ionice -p pid
+ *        ionice -c class -p pid
+ *        ionice -c class command [arg ...]
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioprio.h>
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "usage: %s -p pid\n"
+                "       %s -c class -p pid\n"
+                "       %s -c class command [arg ...]\n", prog, prog, prog);
+        exit(1);
+}
+
+int main(int argc, char **argv, char **envp)
+{
+        int ioclass = -1, pid = -1, i = 1;
+
+        while (i + 1 < argc && '-' == argv[i][0]) {
+                if (!strcmp(argv[i], "-c"))
+                        ioclass = atoi(argv[i + 1]);
+                else if (!strcmp(argv[i], "-p"))
+                        pid = atoi(argv[i + 1]);
+                else
+                        usage(argv[0]);
+                i += 2;
+        }
+
+        if (0 <= pid) {
+                if (i != argc)
+                        usage(argv[0]);
+                if (0 > ioclass) {
+                        if (0 > (ioclass = ioprio_get(pid))) {
+                                fprintf(stderr, "ionice: %s\n", strerror(errno));
+                                return 1;
+                        }
+                        printf("%d\n", ioclass);
+                        return 0;
+                }
+        } else if (0 > ioclass || i == argc) {
+                usage(argv[0]);
+        }
+
+        if (0 > ioprio_set((0 <= pid) ? pid : 0, ioclass)) {
+                fprintf(stderr, "ionice: %s\n", strerror(errno));
+                return 1;
+        }
+        if (0 <= pid)
+                return 0;
+
+        /* the class is inherited across exec as well as fork */
+        execve(argv[i], argv + i, envp);
+        fprintf(stderr, "ionice: %s: %s\n", argv[i], strerror(errno));
+        return 1;
+}
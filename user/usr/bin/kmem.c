@@ -0,0 +1,31 @@
+/*
+ * Prints the kernel heap census: the live objects of every slab allocator
+ * and the call sites in the kernel holding the most memory, as return
+ * addresses (name them with addr2line on the kernel image).
+ *
+ * usage: kmem
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <weenix/syscall.h>
+
+static char buf[KMEM_CENSUS_MAX];
+
+int main(int argc, char **argv)
+{
+        int n;
+
+        if (argc != 1) {
+                fprintf(stderr, "usage: %s\n", argv[0]);
+                return 1;
+        }
+        if ((n = kmem_census(buf, sizeof(buf))) < 0) {
+                fprintf(stderr, "kmem: %s\n", strerror(errno));
+                return 1;
+        }
+        write(1, buf, n);
+        return 0;
+}
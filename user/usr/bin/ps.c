@@ -0,0 +1,44 @@
+/*
+ * Lists processes with the memory each uses, in KB: all the user pages
+ * mapped (RSS), those no other process maps (PRIV), those it shares
+ * with other processes or the page cache (SHR), and its page tables
+ * (PT).
+ *
+ * usage: ps
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <weenix/syscall.h>
+
+#define NPROCS  128
+#define KB(pages)       ((pages) * 4)
+
+static struct proc_stat procs[NPROCS];
+
+int main(int argc, char **argv)
+{
+        int n, i;
+
+        if (argc != 1) {
+                fprintf(stderr, "usage: %s\n", argv[0]);
+                return 1;
+        }
+        if ((n = proc_stats(procs, NPROCS)) < 0) {
+                fprintf(stderr, "ps: %s\n", strerror(errno));
+                return 1;
+        }
+
+        printf("%5s %5s %2s %7s %7s %7s %5s %s\n", "PID", "PPID", "S",
+               "RSS", "PRIV", "SHR", "PT", "NAME");
+        for (i = 0; i < n; i++) {
+                struct proc_stat *p = &procs[i];
+                printf("%5d %5d %2s %7u %7u %7u %5u %s\n", p->ps_pid, p->ps_ppid,
+                       (2 == p->ps_state) ? "Z" : "R", KB(p->ps_rss),
+                       KB(p->ps_private), KB(p->ps_rss - p->ps_private),
+                       KB(p->ps_ptpages), p->ps_comm);
+        }
+        return 0;
+}
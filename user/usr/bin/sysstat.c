@@ -0,0 +1,83 @@
+/*
+ * Prints how often each system call has been made and how long the
+ * calls took, as a histogram of log2 nanoseconds (see
+ * SYSCALL_STAT_BUCKETS in weenix/syscall.h).
+ *
+ * usage: sysstat [-h]
+ *   -h  show each call's histogram as well as its mean
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <weenix/syscall.h>
+
+#define NSTATS  128
+
+#define NAME(call) [SYS_ ## call] = #call
+
+static const char *names[NSTATS] = {
+        NAME(syscall), NAME(exit), NAME(fork), NAME(read), NAME(write),
+        NAME(open), NAME(close), NAME(waitpid), NAME(link), NAME(unlink),
+        NAME(execve), NAME(chdir), NAME(sleep), NAME(lseek), NAME(sync),
+        NAME(nuke), NAME(dup), NAME(pipe), NAME(ioctl), NAME(rmdir),
+        NAME(mkdir), NAME(getdents), NAME(mmap), NAME(mprotect),
+        NAME(munmap), NAME(rename), NAME(uname), NAME(thr_create),
+        NAME(thr_cancel), NAME(thr_exit), NAME(thr_yield), NAME(thr_join),
+        NAME(gettid), NAME(getpid), NAME(errno), NAME(halt),
+        NAME(get_free_mem), NAME(set_errno), NAME(dup2), NAME(brk),
+        NAME(mount), NAME(umount), NAME(stat), NAME(vfork),
+        NAME(nanosleep), NAME(thr_detach), NAME(futex), NAME(readv),
+        NAME(writev), NAME(pread), NAME(pwrite), NAME(sendfile),
+        NAME(msync), NAME(madvise), NAME(poll), NAME(epoll_create),
+        NAME(epoll_ctl), NAME(epoll_wait), NAME(clock_gettime),
+        NAME(syscall_stats), NAME(proc_stats), NAME(socket), NAME(bind),
+        NAME(sendto), NAME(recvfrom), NAME(listen), NAME(accept),
+        NAME(connect), NAME(socketpair), NAME(shm_open), NAME(shm_unlink),
+        NAME(fsync), NAME(fdatasync), NAME(uring_setup), NAME(uring_enter),
+        NAME(fadvise), NAME(ioprio_set), NAME(ioprio_get),
+        NAME(getdents_plus), NAME(fstatat), NAME(getrusage),
+        NAME(kmem_census), NAME(clone_file), NAME(fallocate),
+        NAME(mlock), NAME(munlock), NAME(sched_setaffinity),
+        NAME(sched_getaffinity)
+};
+
+static struct syscall_stat stats[NSTATS];
+
+int main(int argc, char **argv)
+{
+        int hist = 0, n, i, b;
+
+        if (argc == 2 && 0 == strcmp(argv[1], "-h")) {
+                hist = 1;
+        } else if (argc != 1) {
+                fprintf(stderr, "usage: %s [-h]\n", argv[0]);
+                return 1;
+        }
+
+        if ((n = syscall_stats(stats, NSTATS)) < 0) {
+                fprintf(stderr, "sysstat: %s\n", strerror(errno));
+                return 1;
+        }
+
+        printf("%-14s %10s %12s\n", "syscall", "calls", "mean ns");
+        for (i = 0; i < n; i++) {
+                if (0 == stats[i].ss_calls)
+                        continue;
+                if (NULL != names[i])
+                        printf("%-14s", names[i]);
+                else
+                        printf("%-14d", i);
+                printf(" %10llu %12llu\n", stats[i].ss_calls,
+                       stats[i].ss_ns / stats[i].ss_calls);
+                if (!hist)
+                        continue;
+                for (b = 0; b < SYSCALL_STAT_BUCKETS; b++) {
+                        if (0 != stats[i].ss_hist[b])
+                                printf("%16s2^%-2d ns %10u\n", "",
+                                       b, stats[i].ss_hist[b]);
+                }
+        }
+        return 0;
+}
@@ -145,7 +145,7 @@ int main(int argc, char **argv)
 
         if (*opts & OPT_INFINITE) {
                 while (1) {
-                        yield();
+                        sleep(1);
                 }
         } else if (*opts & OPT_ITER) {
                 while (--iter) {
@@ -14,6 +14,8 @@
 #include <stdio.h>
 #include <errno.h>
 
+#include <test/test.h>
+
 static void check_failed(const char *cmd)
 {
         (void) printf("stress: %s failed: errno %d\n", cmd, errno);
@@ -403,10 +405,170 @@ void brk_test()
         (void) printf("-- brk test passed\n");
 }
 
+/*
+ * The benchmark mode,
+ *
+ *     stress --bench [-p procs] [-n iters] [-s pages]
+ *
+ * Each of procs processes maps pages pages of anonymous memory and
+ * touches them, then iters times forks a child which waits on a pipe,
+ * writes to every page, each write a copy-on-write fault, and lets the
+ * child go and reaps it. The report gives how many forks, page touches
+ * and reaps were done per second over the whole run, and their latencies.
+ */
+#define BENCH_MAX_PROCS 32
+#define BENCH_PAGE      4096
+
+enum { BENCH_FORK, BENCH_COW, BENCH_REAP, BENCH_NOPS };
+
+typedef struct bench_stats {
+        test_hist_t     bs_ops[BENCH_NOPS];
+        int             bs_errors;
+} bench_stats_t;
+
+static void bench_worker(int iters, int pages, bench_stats_t *bs)
+{
+        char            *mem;
+        int             i, p, status, fds[2];
+        pid_t           pid;
+        uint64_t        start;
+
+        mem = mmap(0, pages * BENCH_PAGE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (mem == MAP_FAILED) {
+                bs->bs_errors++;
+                return;
+        }
+        for (p = 0; p < pages; p++)
+                mem[p * BENCH_PAGE] = 0;
+
+        for (i = 0; i < iters; i++) {
+                if (pipe(fds)) {
+                        bs->bs_errors++;
+                        continue;
+                }
+                start = test_now_ns();
+                if (!(pid = fork())) {
+                        char c;
+
+                        close(fds[1]);
+                        read(fds[0], &c, 1);
+                        exit(0);
+                }
+                if (pid < 0) {
+                        bs->bs_errors++;
+                        close(fds[0]);
+                        close(fds[1]);
+                        continue;
+                }
+                test_hist_add(&bs->bs_ops[BENCH_FORK], test_now_ns() - start);
+                close(fds[0]);
+
+                /* the child still shares every page, so each is copied */
+                for (p = 0; p < pages; p++) {
+                        start = test_now_ns();
+                        mem[p * BENCH_PAGE] = i;
+                        test_hist_add(&bs->bs_ops[BENCH_COW], test_now_ns() - start);
+                }
+
+                start = test_now_ns();
+                close(fds[1]);
+                if (waitpid(pid, 0, &status) < 0 || status)
+                        bs->bs_errors++;
+                test_hist_add(&bs->bs_ops[BENCH_REAP], test_now_ns() - start);
+        }
+        munmap(mem, pages * BENCH_PAGE);
+}
+
+static int bench(int argc, char **argv)
+{
+        static const char *names[BENCH_NOPS] = { "fork", "cow", "reap" };
+        bench_stats_t   *stats, total;
+        pid_t           pids[BENCH_MAX_PROCS];
+        int             procs = 1, iters = 100, pages = 16;
+        int             i, op, zfd, status;
+        size_t          len;
+        uint64_t        start, ns;
+
+        for (i = 1; i < argc; i += 2) {
+                if (i + 1 == argc || argv[i][0] != '-' || argv[i][2] != '\0')
+                        goto usage;
+                switch (argv[i][1]) {
+                        case 'p': procs = atoi(argv[i + 1]); break;
+                        case 'n': iters = atoi(argv[i + 1]); break;
+                        case 's': pages = atoi(argv[i + 1]); break;
+                        default: goto usage;
+                }
+        }
+        if (procs < 1 || procs > BENCH_MAX_PROCS || iters < 1 || pages < 1)
+                goto usage;
+
+        /* somewhere the workers can all leave their results */
+        len = procs * sizeof(*stats);
+        if ((zfd = open("/dev/zero", O_RDWR, 0)) < 0)
+                check_failed("open");
+        stats = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, zfd, 0);
+        if (stats == MAP_FAILED)
+                check_failed("mmap");
+        close(zfd);
+
+        start = test_now_ns();
+        for (i = 0; i < procs; i++) {
+                if (!(pids[i] = fork())) {
+                        bench_worker(iters, pages, &stats[i]);
+                        exit(0);
+                }
+                if (pids[i] < 0) {
+                        (void) printf("Fork failed (errno=%d)\n", errno);
+                        procs = i;
+                        break;
+                }
+        }
+        for (i = 0; i < procs; i++)
+                waitpid(pids[i], 0, &status);
+        ns = test_now_ns() - start;
+        if (!ns)
+                ns = 1;
+
+        memset(&total, 0, sizeof(total));
+        for (i = 0; i < procs; i++) {
+                for (op = 0; op < BENCH_NOPS; op++)
+                        test_hist_merge(&total.bs_ops[op], &stats[i].bs_ops[op]);
+                total.bs_errors += stats[i].bs_errors;
+        }
+
+        (void) printf("%d processes, %d forks each, %d pages each\n",
+                      procs, iters, pages);
+        (void) printf("%-8s %8s %9s %9s %9s %9s %9s\n",
+                      "op", "count", "ops/s", "p50 us", "p90 us", "p99 us", "max us");
+        for (op = 0; op < BENCH_NOPS; op++) {
+                test_hist_t *h = &total.bs_ops[op];
+
+                (void) printf("%-8s %8u %9llu %9llu %9llu %9llu %9llu\n", names[op],
+                              h->th_count, h->th_count * 1000000000ULL / ns,
+                              test_hist_percentile(h, 50) / 1000,
+                              test_hist_percentile(h, 90) / 1000,
+                              test_hist_percentile(h, 99) / 1000,
+                              h->th_max_ns / 1000);
+        }
+        if (total.bs_errors)
+                (void) printf("%d operations failed\n", total.bs_errors);
+
+        munmap(stats, len);
+        return total.bs_errors != 0;
+
+usage:
+        (void) printf("usage: stress --bench [-p procs] [-n iters] [-s pages]\n");
+        return 1;
+}
+
 int main(int argc, char **argv)
 {
     open("/dev/tty0", O_RDONLY, 0);
     open("/dev/tty0", O_WRONLY, 0);
+        if (argc > 1 && !strcmp(argv[1], "--bench"))
+                return bench(argc - 1, argv + 1);
+
         (void) printf("Congrats!  You're running this executable.\n");
         (void) printf("Now let's see how you handle the tests...\n");
 
@@ -12,6 +12,7 @@
 
 #include "proc/proc.h"
 #include "proc/kthread.h"
+#include "proc/sched.h"
 
 #include "fs/dirent.h"
 #include "fs/vfs_syscall.h"
@@ -38,6 +39,7 @@
 #include <weenix/syscall.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <stdio.h>
 
 #include <test/test.h>
@@ -713,6 +715,278 @@ vfstest_read(void)
         syscall_success(chdir(".."));
 }
 
+/*
+ * Tests pread(), pwrite(), readv() and writev()
+ *      - pread and pwrite go to the offset given and leave the file
+ *        position alone
+ *      - Neither works on a pipe
+ *      - readv and writev go through each segment in turn, and a read
+ *        which runs out of file part of the way through one stops there
+ */
+static void
+vfstest_rw(void)
+{
+#define RW_BUFSIZE 16
+
+        int fd, ret, pipefd[2];
+        char buf[RW_BUFSIZE], a[4], b[4], c[8];
+        struct iovec iov[3];
+
+        syscall_success(mkdir("rw", 0777));
+        syscall_success(chdir("rw"));
+
+        /* pread and pwrite leave the file position where it was */
+        syscall_success(fd = open("file01", O_RDWR | O_CREAT, 0));
+        syscall_success(write(fd, "helloworld", 10));
+        syscall_success(lseek(fd, 2, SEEK_SET));
+        syscall_success(ret = pwrite(fd, "WO", 2, 5));
+        test_assert(2 == ret, "pwrite returned %d", ret);
+        test_fpos(fd, 2);
+        syscall_success(ret = pread(fd, buf, 4, 4));
+        test_assert(4 == ret, "pread returned %d", ret);
+        test_assert(0 == memcmp(buf, "oWOr", 4), "pread data incorrect");
+        test_fpos(fd, 2);
+        read_fd(fd, 8, "lloWOrld");
+
+        /* past the end a pread reads nothing, and a pwrite leaves a hole */
+        syscall_success(ret = pread(fd, buf, RW_BUFSIZE, 20));
+        test_assert(0 == ret, "pread past the end returned %d", ret);
+        syscall_success(ret = pwrite(fd, "!", 1, 12));
+        test_assert(1 == ret, "pwrite past the end returned %d", ret);
+        test_fpos(fd, 10);
+        syscall_success(ret = pread(fd, buf, RW_BUFSIZE, 8));
+        test_assert(5 == ret, "pread returned %d", ret);
+        test_assert(0 == memcmp(buf, "ld\0\0!", 5), "pread data incorrect");
+
+        syscall_fail(pread(fd, buf, 1, -1), EINVAL);
+        syscall_fail(pwrite(fd, buf, 1, -1), EINVAL);
+        syscall_success(close(fd));
+
+        /* there is no offset into a pipe */
+        syscall_success(pipe(pipefd));
+        syscall_fail(pwrite(pipefd[1], "x", 1, 0), ESPIPE);
+        syscall_fail(pread(pipefd[0], buf, 1, 0), ESPIPE);
+        syscall_success(close(pipefd[0]));
+        syscall_success(close(pipefd[1]));
+
+        /* writev writes the segments in order, skipping empty ones */
+        syscall_success(fd = open("file02", O_RDWR | O_CREAT, 0));
+        iov[0].iov_base = "hello";
+        iov[0].iov_len = 5;
+        iov[1].iov_base = "";
+        iov[1].iov_len = 0;
+        iov[2].iov_base = "world";
+        iov[2].iov_len = 5;
+        syscall_success(ret = writev(fd, iov, 3));
+        test_assert(10 == ret, "writev returned %d", ret);
+        test_fpos(fd, 10);
+        syscall_success(lseek(fd, 0, SEEK_SET));
+        read_fd(fd, RW_BUFSIZE, "helloworld");
+
+        /* readv fills each segment before the next, and stops part of the
+         * way through the last one at the end of the file */
+        syscall_success(lseek(fd, 1, SEEK_SET));
+        memset(c, 0, sizeof(c));
+        iov[0].iov_base = a;
+        iov[0].iov_len = sizeof(a);
+        iov[1].iov_base = b;
+        iov[1].iov_len = sizeof(b);
+        iov[2].iov_base = c;
+        iov[2].iov_len = sizeof(c);
+        syscall_success(ret = readv(fd, iov, 3));
+        test_assert(9 == ret, "readv returned %d", ret);
+        test_assert(0 == memcmp(a, "ello", 4), "first segment incorrect");
+        test_assert(0 == memcmp(b, "worl", 4), "second segment incorrect");
+        test_assert(0 == memcmp(c, "d\0", 2), "third segment incorrect");
+        test_fpos(fd, 10);
+
+        /* and at the end of the file reads nothing */
+        syscall_success(ret = readv(fd, iov, 3));
+        test_assert(0 == ret, "readv at the end returned %d", ret);
+        syscall_success(close(fd));
+
+        syscall_success(chdir(".."));
+}
+
+/*
+ * Tests clone_file(), on file systems which can clone files
+ *      - The clone reads back as its source did
+ *      - Writing either one afterwards leaves the other as it was
+ *      - The destination must be empty
+ */
+static void
+vfstest_clone(void)
+{
+/* More than a couple of blocks, and more than fits in an inode */
+#define CLONE_SIZE 9000
+
+        int src, dst, ret, i;
+        char *buf, *got;
+        struct stat s;
+
+        syscall_success(mkdir("clone", 0777));
+        syscall_success(chdir("clone"));
+
+        buf = malloc(CLONE_SIZE);
+        got = malloc(CLONE_SIZE);
+        if (!test_assert(NULL != buf && NULL != got, "out of memory")) {
+                goto out;
+        }
+        for (i = 0; i < CLONE_SIZE; i++) {
+                buf[i] = 'a' + i % 26;
+        }
+
+        syscall_success(src = open("src", O_RDWR | O_CREAT, 0));
+        syscall_success(ret = write(src, buf, CLONE_SIZE));
+        test_assert(CLONE_SIZE == ret, "write returned %d", ret);
+        syscall_success(dst = open("dst", O_RDWR | O_CREAT, 0));
+
+        errno = 0;
+        if (0 > clone_file(src, dst) && EOPNOTSUPP == errno) {
+                printf("clone_file not supported here, skipping\n");
+                syscall_success(close(dst));
+                syscall_success(close(src));
+                goto out;
+        }
+        test_assert(0 == errno, "clone_file: %s (%d)", test_errstr(errno), errno);
+
+        /* the clone holds what its source does, and neither has moved */
+        test_fpos(src, CLONE_SIZE);
+        test_fpos(dst, 0);
+        syscall_success(stat("dst", &s));
+        test_assert(CLONE_SIZE == s.st_size, "clone size %d", s.st_size);
+        syscall_success(ret = read(dst, got, CLONE_SIZE));
+        test_assert(CLONE_SIZE == ret, "read returned %d", ret);
+        test_assert(0 == memcmp(buf, got, CLONE_SIZE), "clone data incorrect");
+
+        /* writing the clone leaves the source as it was */
+        syscall_success(pwrite(dst, "CLONE", 5, 0));
+        syscall_success(ret = pread(src, got, CLONE_SIZE, 0));
+        test_assert(CLONE_SIZE == ret, "pread returned %d", ret);
+        test_assert(0 == memcmp(buf, got, CLONE_SIZE), "source changed with the clone");
+
+        /* and writing the source leaves the clone as it was */
+        syscall_success(pwrite(src, "SOURCE", 6, CLONE_SIZE / 2));
+        syscall_success(ret = pread(dst, got, CLONE_SIZE, 0));
+        test_assert(CLONE_SIZE == ret, "pread returned %d", ret);
+        test_assert(0 == memcmp(got, "CLONE", 5), "clone lost its own write");
+        test_assert(0 == memcmp(buf + 5, got + 5, CLONE_SIZE - 5),
+                    "clone changed with the source");
+
+        /* the destination has to be empty, and another file */
+        syscall_fail(clone_file(src, dst), EINVAL);
+        syscall_fail(clone_file(src, src), EINVAL);
+
+        syscall_success(close(dst));
+        syscall_success(close(src));
+        syscall_success(unlink("dst"));
+        syscall_success(unlink("src"));
+
+out:
+        if (NULL != buf) {
+                free(buf);
+        }
+        if (NULL != got) {
+                free(got);
+        }
+        syscall_success(chdir(".."));
+}
+
+/* Whether all len bytes of buf are c */
+static int
+all_bytes(const char *buf, int len, char c)
+{
+        int i;
+
+        for (i = 0; i < len; i++) {
+                if (c != buf[i]) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+/*
+ * Tests fallocate(), on file systems which can preallocate
+ *      - Preallocating grows the file with blocks which read as zeros,
+ *        unless told to keep the size
+ *      - Punching a hole frees the blocks it covers, which then read as
+ *        zeros, and leaves the size and the rest of the file alone
+ *      - Bad ranges and modes are refused
+ */
+static void
+vfstest_fallocate(void)
+{
+        int fd, ret, bs;
+        char *buf = NULL;
+        struct stat s;
+
+        syscall_success(mkdir("fallocate", 0777));
+        syscall_success(chdir("fallocate"));
+
+        syscall_success(fd = open("file01", O_RDWR | O_CREAT, 0));
+        syscall_success(stat("file01", &s));
+        bs = s.st_blksize;
+        if (!test_assert(0 < bs && NULL != (buf = malloc(bs)), "blksize %d", bs)) {
+                syscall_success(close(fd));
+                goto out;
+        }
+
+        errno = 0;
+        if (0 > fallocate(fd, 0, 0, 3 * bs) && EOPNOTSUPP == errno) {
+                printf("fallocate not supported here, skipping\n");
+                syscall_success(close(fd));
+                goto out;
+        }
+        test_assert(0 == errno, "fallocate: %s (%d)", test_errstr(errno), errno);
+
+        /* three blocks of zeros, and the file position where it was */
+        test_fpos(fd, 0);
+        syscall_success(stat("file01", &s));
+        test_assert(3 * bs == s.st_size, "size %d", s.st_size);
+        test_assert(3 == s.st_blocks, "blocks %d", s.st_blocks);
+        syscall_success(ret = pread(fd, buf, bs, bs));
+        test_assert(bs == ret && all_bytes(buf, bs, '\0'), "preallocated block not zeros");
+
+        /* another block past the end, keeping the size */
+        syscall_success(fallocate(fd, FALLOC_FL_KEEP_SIZE, 3 * bs, bs));
+        syscall_success(stat("file01", &s));
+        test_assert(3 * bs == s.st_size, "size %d", s.st_size);
+        test_assert(4 == s.st_blocks, "blocks %d", s.st_blocks);
+
+        /* punching out the middle block frees it, and it reads as zeros */
+        memset(buf, 'x', bs);
+        syscall_success(pwrite(fd, buf, bs, 0));
+        syscall_success(pwrite(fd, buf, bs, bs));
+        syscall_success(pwrite(fd, buf, bs, 2 * bs));
+        syscall_success(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, bs, bs));
+        syscall_success(stat("file01", &s));
+        test_assert(3 * bs == s.st_size, "size %d", s.st_size);
+        test_assert(3 == s.st_blocks, "blocks %d", s.st_blocks);
+        syscall_success(ret = pread(fd, buf, bs, bs));
+        test_assert(bs == ret && all_bytes(buf, bs, '\0'), "hole not zeros");
+        syscall_success(ret = pread(fd, buf, bs, 0));
+        test_assert(bs == ret && all_bytes(buf, bs, 'x'), "block before the hole changed");
+        syscall_success(ret = pread(fd, buf, bs, 2 * bs));
+        test_assert(bs == ret && all_bytes(buf, bs, 'x'), "block after the hole changed");
+
+        /* error cases */
+        syscall_fail(fallocate(fd, 0, -1, bs), EINVAL);
+        syscall_fail(fallocate(fd, 0, 0, 0), EINVAL);
+        syscall_fail(fallocate(fd, FALLOC_FL_PUNCH_HOLE, 0, bs), EOPNOTSUPP);
+        syscall_success(close(fd));
+        syscall_success(fd = open("file01", O_RDONLY, 0));
+        syscall_fail(fallocate(fd, 0, 0, bs), EBADF);
+        syscall_success(close(fd));
+        syscall_success(unlink("file01"));
+
+out:
+        if (NULL != buf) {
+                free(buf);
+        }
+        syscall_success(chdir(".."));
+}
+
 static void
 vfstest_getdents(void)
 {
@@ -893,6 +1167,368 @@ vfstest_s5fs_vm(void)
 }
 #endif
 
+/*
+ * The benchmark mode, "vfstest --bench", which times the same calls the
+ * tests above check rather than checking them:
+ *
+ *     vfstest --bench [-p workers] [-n ops] [-s size] [-f files] [-m mix]
+ *
+ * Each of the workers (processes, which are kernel processes when this is
+ * run from the kshell) does ops operations on its own directory of files
+ * files, taking them in turn from mix, a string of
+ *
+ *     c  create a file, or truncate it if it is there already
+ *     w  write size bytes to a file, from the start
+ *     r  read a file to the end
+ *     u  unlink a file
+ *     n  rename a file, to and from a second name
+ *
+ * on a file chosen at random; a file an operation needs which is missing
+ * is first made, untimed. Each operation is timed from its open to its
+ * close, and the report gives, for each kind, how many were done per
+ * second over the whole run, and their latencies.
+ */
+#define BENCH_MAX_WORKERS       32
+#define BENCH_MAX_FILES         256
+#define BENCH_CHUNK             4096
+
+#define BENCH_OPS               "cwrun"
+#define BENCH_NOPS              5
+
+typedef struct bench_stats {
+        test_hist_t     bs_ops[BENCH_NOPS];
+        int             bs_errors;
+        int             bs_errno;       /* from the first error */
+} bench_stats_t;
+
+static int bench_nops = 1000;
+static int bench_size = 16384;
+static int bench_nfiles = 16;
+static const char *bench_mix = "cwrun";
+
+static char bench_buf[BENCH_CHUNK];
+
+static void
+bench_report(const char *fmt, ...)
+{
+        char line[128];
+        va_list args;
+        int len;
+
+        /* not printf, which goes to the debug log in the kernel */
+        va_start(args, fmt);
+        len = vsnprintf(line, sizeof(line), fmt, args);
+        va_end(args);
+        if (len > (int)sizeof(line) - 1)
+                len = sizeof(line) - 1;
+        write(1, line, len);
+}
+
+static int
+bench_num(const char *s, int *val)
+{
+        int n = 0;
+
+        if ('\0' == *s)
+                return -1;
+        for (; '0' <= *s && *s <= '9'; s++)
+                n = n * 10 + *s - '0';
+        if ('k' == *s || 'K' == *s) {
+                n *= 1024;
+                s++;
+        }
+        if ('\0' != *s)
+                return -1;
+        *val = n;
+        return 0;
+}
+
+static void
+bench_name(char *buf, int file, int renamed)
+{
+        snprintf(buf, NAME_LEN, "f%d%s", file, renamed ? ".r" : "");
+}
+
+static int
+bench_create(const char *name)
+{
+        int fd;
+
+        if (0 > (fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666)))
+                return -1;
+        return close(fd);
+}
+
+static int
+bench_write(const char *name, int flags)
+{
+        int fd, done, n;
+
+        if (0 > (fd = open(name, O_WRONLY | O_CREAT | flags, 0666)))
+                return -1;
+        for (done = 0; done < bench_size; done += n) {
+                n = bench_size - done;
+                if (n > BENCH_CHUNK)
+                        n = BENCH_CHUNK;
+                if (0 > (n = write(fd, bench_buf, n))) {
+                        close(fd);
+                        return -1;
+                }
+        }
+        return close(fd);
+}
+
+static int
+bench_read(const char *name)
+{
+        int fd, n;
+
+        if (0 > (fd = open(name, O_RDONLY, 0)))
+                return -1;
+        while (0 < (n = read(fd, bench_buf, BENCH_CHUNK)))
+                ;
+        if (0 > n) {
+                close(fd);
+                return -1;
+        }
+        return close(fd);
+}
+
+static void
+bench_worker(int id, bench_stats_t *bs)
+{
+        char dir[NAME_LEN], name[NAME_LEN], other[NAME_LEN];
+        char exists[BENCH_MAX_FILES], renamed[BENCH_MAX_FILES];
+        const char *mix = bench_mix;
+        int i, f, op, ret;
+        uint64_t start;
+
+        snprintf(dir, sizeof(dir), "w%d", id);
+        if (0 > mkdir(dir, 0777) || 0 > chdir(dir)) {
+                bs->bs_errors++;
+                bs->bs_errno = errno;
+                return;
+        }
+        srand(id + 1);
+        memset(exists, 0, sizeof(exists));
+        memset(renamed, 0, sizeof(renamed));
+
+        for (i = 0; i < bench_nops; i++) {
+                if ('\0' == *mix)
+                        mix = bench_mix;
+                op = strchr(BENCH_OPS, *mix++) - BENCH_OPS;
+                f = rand() % bench_nfiles;
+                bench_name(name, f, renamed[f]);
+
+                /* anything but create needs the file to be there */
+                if (0 != op && !exists[f]) {
+                        if (0 > bench_write(name, O_TRUNC))
+                                goto failed;
+                        exists[f] = 1;
+                }
+
+                start = test_now_ns();
+                switch (BENCH_OPS[op]) {
+                        case 'c':
+                                ret = bench_create(name);
+                                break;
+                        case 'w':
+                                ret = bench_write(name, 0);
+                                break;
+                        case 'r':
+                                ret = bench_read(name);
+                                break;
+                        case 'u':
+                                ret = unlink(name);
+                                break;
+                        default:
+                                bench_name(other, f, !renamed[f]);
+                                ret = rename(name, other);
+                                break;
+                }
+                if (0 > ret)
+                        goto failed;
+                test_hist_add(&bs->bs_ops[op], test_now_ns() - start);
+
+                if ('c' == BENCH_OPS[op])
+                        exists[f] = 1;
+                else if ('u' == BENCH_OPS[op])
+                        exists[f] = 0;
+                else if ('n' == BENCH_OPS[op])
+                        renamed[f] = !renamed[f];
+                continue;
+
+failed:
+                if (0 == bs->bs_errors++)
+                        bs->bs_errno = errno;
+        }
+
+        chdir("..");
+}
+
+#ifdef __KERNEL__
+static void *
+bench_kthread(int id, void *arg)
+{
+        bench_worker(id, arg);
+        return NULL;
+}
+#endif
+
+static int
+bench_spawn(int id, bench_stats_t *bs)
+{
+#ifdef __KERNEL__
+        proc_t *p = proc_create("vfstest bench");
+        kthread_t *thr;
+
+        KASSERT(NULL != p);
+        thr = kthread_create(p, bench_kthread, id, bs);
+        KASSERT(NULL != thr);
+        sched_make_runnable(thr);
+        return p->p_pid;
+#else
+        int pid;
+
+        if (0 == (pid = fork())) {
+                bench_worker(id, bs);
+                exit(0);
+        }
+        return pid;
+#endif
+}
+
+/* Somewhere the workers can all leave their results */
+static bench_stats_t *
+bench_alloc(size_t len)
+{
+        bench_stats_t *stats;
+#ifdef __KERNEL__
+        if (NULL != (stats = kmalloc(len)))
+                memset(stats, 0, len);
+#else
+        int zfd;
+
+        if (0 > (zfd = open("/dev/zero", O_RDWR, 0)))
+                return NULL;
+        stats = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, zfd, 0);
+        close(zfd);
+        if (MAP_FAILED == stats)
+                stats = NULL;
+#endif
+        return stats;
+}
+
+static int
+vfstest_bench(int argc, char **argv)
+{
+        static const char *names[BENCH_NOPS] = {
+                "create", "write", "read", "unlink", "rename"
+        };
+        bench_stats_t *stats, total;
+        pid_t pids[BENCH_MAX_WORKERS];
+        int nworkers = 1, i, op, status, *val;
+        size_t len;
+        uint64_t start, ns;
+
+        for (i = 1; i < argc; i++) {
+                if (i + 1 == argc || '-' != argv[i][0] || '\0' != argv[i][2])
+                        goto usage;
+                switch (argv[i][1]) {
+                        case 'p': val = &nworkers; break;
+                        case 'n': val = &bench_nops; break;
+                        case 's': val = &bench_size; break;
+                        case 'f': val = &bench_nfiles; break;
+                        case 'm': bench_mix = argv[++i]; continue;
+                        default: goto usage;
+                }
+                if (0 > bench_num(argv[++i], val))
+                        goto usage;
+        }
+        if (nworkers < 1 || nworkers > BENCH_MAX_WORKERS || bench_nops < 1
+            || bench_nfiles < 1 || bench_nfiles > BENCH_MAX_FILES
+            || '\0' == *bench_mix)
+                goto usage;
+        for (i = 0; '\0' != bench_mix[i]; i++) {
+                if (NULL == strchr(BENCH_OPS, bench_mix[i]))
+                        goto usage;
+        }
+
+        len = nworkers * sizeof(*stats);
+        if (NULL == (stats = bench_alloc(len))) {
+                bench_report("vfstest: no memory for the results\n");
+                return 1;
+        }
+        memset(bench_buf, 'x', sizeof(bench_buf));
+
+        vfstest_start();
+        if (0 > chdir(root_dir)) {
+                bench_report("vfstest: chdir: %s\n", test_errstr(errno));
+                return 1;
+        }
+        start = test_now_ns();
+        for (i = 0; i < nworkers; i++) {
+                if (0 > (pids[i] = bench_spawn(i, &stats[i]))) {
+                        bench_report("vfstest: fork: %s\n", test_errstr(errno));
+                        nworkers = i;
+                        break;
+                }
+        }
+        for (i = 0; i < nworkers; i++) {
+#ifdef __KERNEL__
+                do_waitpid(pids[i], 0, &status);
+#else
+                waitpid(pids[i], 0, &status);
+#endif
+        }
+        ns = test_now_ns() - start;
+        if (0 == ns)
+                ns = 1;
+        chdir("..");
+        vfstest_term();
+
+        memset(&total, 0, sizeof(total));
+        for (i = 0; i < nworkers; i++) {
+                for (op = 0; op < BENCH_NOPS; op++)
+                        test_hist_merge(&total.bs_ops[op], &stats[i].bs_ops[op]);
+                if (0 == total.bs_errors && 0 != stats[i].bs_errors)
+                        total.bs_errno = stats[i].bs_errno;
+                total.bs_errors += stats[i].bs_errors;
+        }
+
+        bench_report("%d workers, %d ops each, %d byte files, %d files each, mix %s\n",
+                     nworkers, bench_nops, bench_size, bench_nfiles, bench_mix);
+        bench_report("%-8s %8s %9s %9s %9s %9s %9s\n",
+                     "op", "count", "ops/s", "p50 us", "p90 us", "p99 us", "max us");
+        for (op = 0; op < BENCH_NOPS; op++) {
+                test_hist_t *h = &total.bs_ops[op];
+
+                if (0 == h->th_count)
+                        continue;
+                bench_report("%-8s %8u %9llu %9llu %9llu %9llu %9llu\n", names[op],
+                             h->th_count, h->th_count * 1000000000ULL / ns,
+                             test_hist_percentile(h, 50) / 1000,
+                             test_hist_percentile(h, 90) / 1000,
+                             test_hist_percentile(h, 99) / 1000,
+                             h->th_max_ns / 1000);
+        }
+        if (0 != total.bs_errors)
+                bench_report("%d operations failed, the first with %s\n",
+                             total.bs_errors, test_errstr(total.bs_errno));
+
+#ifdef __KERNEL__
+        kfree(stats);
+#else
+        munmap(stats, len);
+#endif
+        return 0 != total.bs_errors;
+
+usage:
+        bench_report("USAGE: vfstest --bench [-p workers] [-n ops] [-s size] [-f files] [-m mix]\n");
+        bench_report("  mix is a string of c (create), w (write), r (read), u (unlink), n (rename)\n");
+        return 1;
+}
+
 /*
  * Finally, the main function.
  */
@@ -902,8 +1538,11 @@ int main(int argc, char **argv)
 int vfstest_main(int argc, char **argv)
 #endif
 {
+        if (argc > 1 && 0 == strcmp(argv[1], "--bench")) {
+                return vfstest_bench(argc - 1, argv + 1);
+        }
         if (argc != 1) {
-                fprintf(stderr, "USAGE: vfstest\n");
+                fprintf(stderr, "USAGE: vfstest [--bench ...]\n");
                 return 1;
         }
 
@@ -919,6 +1558,9 @@ int vfstest_main(int argc, char **argv)
         vfstest_fd();
         vfstest_open();
         vfstest_read();
+        vfstest_rw();
+        vfstest_clone();
+        vfstest_fallocate();
         vfstest_getdents();
 
 #ifdef __VM__